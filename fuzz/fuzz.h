@@ -0,0 +1,81 @@
+/*
+ * fuzz.h : common definitions for the fuzzing entry points
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _NTFS_FUZZ_H_
+#define _NTFS_FUZZ_H_
+
+#include "types.h"
+#include "volume.h"
+
+/*
+ *	Each input begins with a header giving the geometry of the
+ *	volume it was taken from, the rest depends on the entry point :
+ *
+ *	mapping_pairs : header, an attribute record
+ *	mst           : header, an mft record or index block
+ *	attr          : header, an mft record
+ *	index         : header, le16 key length, key, an mft record of a
+ *			directory, then the contents of its $I30 index
+ *			allocation, located at cluster 1 of the volume
+ *
+ *	The records are taken before their fixups are applied.
+ */
+
+struct FUZZ_HEADER {
+	u8 cluster_size_bits;	/* 9 to 16 */
+	u8 record_size_bits;	/* 9 to 12, mft record or index block */
+} __attribute__((__packed__)) ;
+
+#define FUZZ_IMAGE_LCN 1	/* cluster where the image data begins */
+
+typedef int (*FUZZ_FUNCTION)(const u8 *data, size_t size);
+
+struct FUZZ_TARGET {
+	const char *name;
+	FUZZ_FUNCTION run;
+} ;
+
+ntfs_volume *fuzz_volume(const struct FUZZ_HEADER *header,
+			const u8 *image, size_t image_size);
+ntfs_inode *fuzz_inode(ntfs_volume *vol, MFT_RECORD *mrec);
+void fuzz_inode_free(ntfs_inode *ni);
+void *fuzz_record(const u8 *data, size_t size, u32 record_size);
+
+int fuzz_mapping_pairs(const u8 *data, size_t size);
+int fuzz_mst(const u8 *data, size_t size);
+int fuzz_attr(const u8 *data, size_t size);
+int fuzz_index(const u8 *data, size_t size);
+
+/*
+ *	Define the libFuzzer entry point when building a fuzzer
+ */
+
+#ifdef NTFS_FUZZER
+#define FUZZ_ENTRY(function) \
+	int LLVMFuzzerTestOneInput(const u8 *data, size_t size); \
+	int LLVMFuzzerTestOneInput(const u8 *data, size_t size) \
+	{ \
+		function(data, size); \
+		return (0); \
+	}
+#else
+#define FUZZ_ENTRY(function)
+#endif
+
+#endif /* _NTFS_FUZZ_H_ */
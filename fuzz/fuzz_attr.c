@@ -0,0 +1,127 @@
+/**
+ * fuzz_attr.c : fuzzing entry point for the search of attributes
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include "types.h"
+#include "layout.h"
+#include "mst.h"
+#include "mft.h"
+#include "inode.h"
+#include "attrib.h"
+#include "index.h"
+#include "dir.h"
+#include "misc.h"
+#include "fuzz.h"
+
+static ntfschar zone_identifier[] = {
+	const_cpu_to_le16('Z'), const_cpu_to_le16('o'),
+	const_cpu_to_le16('n'), const_cpu_to_le16('e'),
+	const_cpu_to_le16('.'), const_cpu_to_le16('I'),
+	const_cpu_to_le16('d'), const_cpu_to_le16('e'),
+	const_cpu_to_le16('n'), const_cpu_to_le16('t'),
+	const_cpu_to_le16('i'), const_cpu_to_le16('f'),
+	const_cpu_to_le16('i'), const_cpu_to_le16('e'),
+	const_cpu_to_le16('r')
+} ;
+
+/*
+ *	The searches done when opening files and directories
+ */
+
+static const struct {
+	ATTR_TYPES type;
+	ntfschar *name;
+	u32 name_len;
+	IGNORE_CASE_BOOL ic;
+} searches[] = {
+	{ AT_STANDARD_INFORMATION, AT_UNNAMED, 0, CASE_SENSITIVE },
+	{ AT_ATTRIBUTE_LIST, AT_UNNAMED, 0, CASE_SENSITIVE },
+	{ AT_FILE_NAME, (ntfschar*)NULL, 0, CASE_SENSITIVE },
+	{ AT_DATA, AT_UNNAMED, 0, CASE_SENSITIVE },
+	{ AT_DATA, zone_identifier, 15, IGNORE_CASE },
+	{ AT_INDEX_ROOT, NTFS_INDEX_I30, 4, CASE_SENSITIVE },
+	{ AT_INDEX_ALLOCATION, NTFS_INDEX_I30, 4, CASE_SENSITIVE },
+	{ AT_BITMAP, NTFS_INDEX_I30, 4, CASE_SENSITIVE },
+	{ AT_REPARSE_POINT, AT_UNNAMED, 0, CASE_SENSITIVE },
+	{ AT_END, (ntfschar*)NULL, 0, CASE_SENSITIVE }
+} ;
+
+/*
+ *		Search the attributes of an mft record
+ *
+ *	The record goes through the fixups and the checks done when it is
+ *	read, then all its attributes are enumerated, and the usual ones
+ *	are searched by type and name.
+ *
+ *	Returns 0 if the record was accepted, -1 if rejected
+ */
+
+int fuzz_attr(const u8 *data, size_t size)
+{
+	ntfs_volume *vol;
+	ntfs_inode *ni;
+	ntfs_attr_search_ctx *ctx;
+	MFT_RECORD *mrec;
+	int res;
+	int i;
+
+	if (size < sizeof(struct FUZZ_HEADER))
+		return (-1);
+	vol = fuzz_volume((const struct FUZZ_HEADER*)data, NULL, 0);
+	data += sizeof(struct FUZZ_HEADER);
+	size -= sizeof(struct FUZZ_HEADER);
+	if (!vol)
+		return (-1);
+	mrec = (MFT_RECORD*)fuzz_record(data, size, vol->mft_record_size);
+	if (!mrec)
+		return (-1);
+	res = -1;
+	if (!ntfs_mst_post_read_fixup_warn((NTFS_RECORD*)mrec,
+			vol->mft_record_size, FALSE)
+	    && !ntfs_mft_record_check(vol, 0, mrec)) {
+		ni = fuzz_inode(vol, mrec);
+		ctx = (ni ? ntfs_attr_get_search_ctx(ni, NULL)
+				: (ntfs_attr_search_ctx*)NULL);
+		if (ctx) {
+			while (!ntfs_attr_lookup(AT_UNUSED, NULL, 0,
+					CASE_SENSITIVE, 0, NULL, 0, ctx)) { }
+			for (i=0; searches[i].type != AT_END; i++) {
+				ntfs_attr_reinit_search_ctx(ctx);
+				ntfs_attr_lookup(searches[i].type,
+					searches[i].name, searches[i].name_len,
+					searches[i].ic, 0, NULL, 0, ctx);
+			}
+			ntfs_attr_put_search_ctx(ctx);
+			res = 0;
+		}
+		if (ni)
+			fuzz_inode_free(ni);
+	}
+	free(mrec);
+	return (res);
+}
+
+FUZZ_ENTRY(fuzz_attr)
@@ -0,0 +1,107 @@
+/**
+ * fuzz_index.c : fuzzing entry point for the lookups in directories
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include "types.h"
+#include "layout.h"
+#include "mst.h"
+#include "mft.h"
+#include "inode.h"
+#include "index.h"
+#include "dir.h"
+#include "misc.h"
+#include "fuzz.h"
+
+#define KEY_SIZE (sizeof(FILE_NAME_ATTR) + 2*NTFS_MAX_NAME_LEN)
+
+/*
+ *		Look up a key in the $I30 index of a directory
+ *
+ *	The mft record goes through the fixups and the checks done when
+ *	it is read, then the key is searched from the index root, down
+ *	through the index blocks read from the image which follows it.
+ *
+ *	Returns 0 if the key was found, -1 otherwise
+ */
+
+int fuzz_index(const u8 *data, size_t size)
+{
+	const struct FUZZ_HEADER *header;
+	ntfs_volume *vol;
+	ntfs_inode *ni;
+	ntfs_index_context *icx;
+	MFT_RECORD *mrec;
+	u8 *key;
+	u32 record_size;
+	int key_len;
+	int res;
+
+	if (size < sizeof(struct FUZZ_HEADER) + 2)
+		return (-1);
+	header = (const struct FUZZ_HEADER*)data;
+	key_len = le16_to_cpup((const le16*)&data[sizeof(*header)]);
+	data += sizeof(*header) + 2;
+	size -= sizeof(*header) + 2;
+	if (!key_len || ((size_t)key_len > size))
+		return (-1);
+		/*
+		 * A copy of the key, large enough for the longest file
+		 * name, as the keys are built by the callers and trusted.
+		 */
+	key = (u8*)fuzz_record(data, key_len, ((size_t)key_len > KEY_SIZE
+					? key_len : KEY_SIZE));
+	data += key_len;
+	size -= key_len;
+	record_size = 1 << (9 + (header->record_size_bits & 3));
+	vol = (size < record_size ? (ntfs_volume*)NULL
+			: fuzz_volume(header, &data[record_size],
+					size - record_size));
+	mrec = (vol ? (MFT_RECORD*)fuzz_record(data, size, record_size)
+			: (MFT_RECORD*)NULL);
+	res = -1;
+	if (key && mrec
+	    && !ntfs_mst_post_read_fixup_warn((NTFS_RECORD*)mrec,
+			record_size, FALSE)
+	    && !ntfs_mft_record_check(vol, 0, mrec)) {
+		ni = fuzz_inode(vol, mrec);
+		if (ni) {
+			icx = ntfs_index_ctx_get(ni, NTFS_INDEX_I30, 4);
+			if (icx) {
+				res = ntfs_index_lookup(key, key_len, icx);
+				ntfs_index_ctx_put(icx);
+			}
+			fuzz_inode_free(ni);
+		}
+	}
+	free(mrec);
+	free(key);
+	return (res);
+}
+
+FUZZ_ENTRY(fuzz_index)
@@ -0,0 +1,135 @@
+/**
+ * fuzz_mapping_pairs.c : fuzzing entry point for the runlist decoding
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_LIMITS_H
+#include <limits.h>
+#endif
+
+#include "types.h"
+#include "layout.h"
+#include "runlist.h"
+#include "misc.h"
+#include "fuzz.h"
+
+/*
+ *		Check that two runlists are the same
+ */
+
+static BOOL same_runlists(const runlist_element *rl1,
+			const runlist_element *rl2)
+{
+	while (rl1->length && (rl1->vcn == rl2->vcn)
+			&& (rl1->lcn == rl2->lcn)
+			&& (rl1->length == rl2->length)) {
+		rl1++;
+		rl2++;
+	}
+	return ((rl1->vcn == rl2->vcn) && (rl1->lcn == rl2->lcn)
+			&& (rl1->length == rl2->length));
+}
+
+/*
+ *		Encode a decoded runlist again and check it decodes the same
+ *
+ *	Only done for the first extent, with a regular mapping pairs
+ *	offset, so that the header is not overwritten.
+ */
+
+static void check_round_trip(ntfs_volume *vol, const ATTR_RECORD *a,
+			const runlist_element *rl)
+{
+	ATTR_RECORD *b;
+	runlist_element *rl2;
+	int mp_offset;
+	int mp_size;
+
+	mp_offset = le16_to_cpu(a->mapping_pairs_offset);
+	if (a->lowest_vcn
+	    || (mp_offset < (int)offsetof(ATTR_RECORD, compressed_size)))
+		return;
+	mp_size = ntfs_get_size_for_mapping_pairs(vol, rl, 0, INT_MAX);
+	if (mp_size <= 0)
+		return;
+	b = (ATTR_RECORD*)ntfs_calloc(mp_offset + mp_size);
+	if (!b)
+		return;
+	memcpy(b, a, mp_offset);
+	b->length = cpu_to_le32(mp_offset + mp_size);
+	if (!ntfs_mapping_pairs_build(vol, (u8*)b + mp_offset, mp_size,
+			rl, 0, NULL)) {
+		rl2 = ntfs_mapping_pairs_decompress(vol, b, NULL);
+		if (!rl2 || !same_runlists(rl, rl2))
+			abort();
+		free(rl2);
+	}
+	free(b);
+}
+
+/*
+ *		Decode the mapping pairs of an attribute record
+ *
+ *	The length of the attribute is limited to the input, as the
+ *	checks of mft records would do.
+ *
+ *	Returns 0 if the mapping pairs were decoded, -1 if rejected
+ */
+
+int fuzz_mapping_pairs(const u8 *data, size_t size)
+{
+	ntfs_volume *vol;
+	ATTR_RECORD *a;
+	runlist_element *rl;
+	u32 length;
+	int res;
+
+	if (size < sizeof(struct FUZZ_HEADER))
+		return (-1);
+	vol = fuzz_volume((const struct FUZZ_HEADER*)data, NULL, 0);
+	data += sizeof(struct FUZZ_HEADER);
+	size -= sizeof(struct FUZZ_HEADER);
+	if (!vol || (size > 65536))
+		return (-1);
+	length = (size < sizeof(ATTR_RECORD) ? sizeof(ATTR_RECORD) : size);
+	a = (ATTR_RECORD*)fuzz_record(data, size, length);
+	if (!a)
+		return (-1);
+	if (le32_to_cpu(a->length) > length)
+		a->length = cpu_to_le32(length);
+	res = -1;
+	rl = ntfs_mapping_pairs_decompress(vol, a, NULL);
+	if (rl) {
+		check_round_trip(vol, a, rl);
+		free(rl);
+		res = 0;
+	}
+	free(a);
+	return (res);
+}
+
+FUZZ_ENTRY(fuzz_mapping_pairs)
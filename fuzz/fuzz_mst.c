@@ -0,0 +1,91 @@
+/**
+ * fuzz_mst.c : fuzzing entry point for the multi sector transfer fixups
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include "types.h"
+#include "layout.h"
+#include "mst.h"
+#include "misc.h"
+#include "fuzz.h"
+
+/*
+ *		Apply the fixups of a record read from disk
+ *
+ *	When accepted, the record is protected again as for writing it,
+ *	and its fixups applied again, which must restore the same data
+ *	outside the update sequence array.
+ *
+ *	Returns 0 if the fixups were applied, -1 if rejected
+ */
+
+int fuzz_mst(const u8 *data, size_t size)
+{
+	const struct FUZZ_HEADER *header;
+	NTFS_RECORD *record;
+	u8 *copy;
+	u32 record_size;
+	u32 usa_start;
+	u32 usa_end;
+	int res;
+
+	if (size < sizeof(struct FUZZ_HEADER))
+		return (-1);
+	header = (const struct FUZZ_HEADER*)data;
+	record_size = 1 << (9 + (header->record_size_bits & 3));
+	data += sizeof(struct FUZZ_HEADER);
+	size -= sizeof(struct FUZZ_HEADER);
+	record = (NTFS_RECORD*)fuzz_record(data, size, record_size);
+	if (!record)
+		return (-1);
+	res = ntfs_mst_post_read_fixup_warn(record, record_size, FALSE);
+	if (!res) {
+		copy = (u8*)ntfs_malloc(record_size);
+		if (copy) {
+			memcpy(copy, record, record_size);
+			if (ntfs_mst_pre_write_fixup(record, record_size)
+			    || ntfs_mst_post_read_fixup_warn(record,
+					record_size, FALSE))
+				abort();
+			usa_start = le16_to_cpu(record->usa_ofs);
+			usa_end = usa_start
+				+ 2*le16_to_cpu(record->usa_count);
+			if (usa_end > record_size)
+				usa_end = record_size;
+			if (memcmp(copy, record, usa_start)
+			    || memcmp(&copy[usa_end], (u8*)record + usa_end,
+					record_size - usa_end))
+				abort();
+			free(copy);
+		}
+	}
+	free(record);
+	return (res);
+}
+
+FUZZ_ENTRY(fuzz_mst)
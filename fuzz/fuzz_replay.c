@@ -0,0 +1,219 @@
+/**
+ * fuzz_replay - Replay a corpus through the fuzzing entry points
+ *
+ * This program runs the inputs of a corpus through an entry point,
+ * without libFuzzer, and reports the throughput for each input, so
+ * that a new implementation of a parser can be checked for both
+ * correctness (when built with the sanitizers) and speed.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#include <dirent.h>
+
+#include "types.h"
+#include "misc.h"
+#include "fuzz.h"
+
+#define MIN_TIME 0.05		/* seconds spent on each input */
+#define MIN_RUNS 10		/* runs of each input */
+
+static const char *EXEC_NAME = "fuzz_replay";
+
+static const struct FUZZ_TARGET targets[] = {
+	{ "mapping_pairs", fuzz_mapping_pairs },
+	{ "mst", fuzz_mst },
+	{ "attr", fuzz_attr },
+	{ "index", fuzz_index },
+	{ (const char*)NULL, (FUZZ_FUNCTION)NULL }
+} ;
+
+static struct {
+	unsigned long inputs;
+	unsigned long accepted;
+	unsigned long long bytes;
+	double elapsed;
+} total;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec/1000000000.0);
+}
+
+/*
+ *		Replay an input until enough time has been spent on it
+ *
+ *	Prints the name of the input, its size, whether it was accepted,
+ *	the runs per second and the MB parsed per second.
+ */
+
+static int replay_file(const struct FUZZ_TARGET *target, const char *path)
+{
+	struct stat st;
+	FILE *f;
+	u8 *data;
+	double start;
+	double elapsed;
+	unsigned long runs;
+	int res;
+
+	f = fopen(path, "rb");
+	if (!f || fstat(fileno(f), &st)) {
+		fprintf(stderr, "Could not open %s : %s\n", path,
+				strerror(errno));
+		if (f)
+			fclose(f);
+		return (-1);
+	}
+		/* an exact allocation, so that overflows are detected */
+	data = (u8*)ntfs_malloc(st.st_size ? st.st_size : 1);
+	if (!data
+	    || (st.st_size && (fread(data, st.st_size, 1, f) != 1))) {
+		fprintf(stderr, "Could not read %s\n", path);
+		fclose(f);
+		free(data);
+		return (-1);
+	}
+	fclose(f);
+	res = target->run(data, st.st_size);
+	runs = 0;
+	start = now();
+	do {
+		target->run(data, st.st_size);
+		runs++;
+		elapsed = now() - start;
+	} while ((runs < MIN_RUNS) || (elapsed < MIN_TIME));
+	printf("%s\t%s\t%lld\t%s\t%.0f\t%.1f\n", target->name, path,
+		(long long)st.st_size, (res ? "rejected" : "accepted"),
+		runs/elapsed, runs*(double)st.st_size/elapsed/1048576.0);
+	total.inputs++;
+	if (!res)
+		total.accepted++;
+	total.bytes += (unsigned long long)st.st_size*runs;
+	total.elapsed += elapsed;
+	free(data);
+	return (0);
+}
+
+/*
+ *		Replay a file or all the files in a directory
+ */
+
+static int replay(const struct FUZZ_TARGET *target, const char *path)
+{
+	struct stat st;
+	struct dirent *entry;
+	char *name;
+	DIR *dir;
+	int err;
+
+	if (stat(path, &st)) {
+		fprintf(stderr, "Could not access %s : %s\n", path,
+				strerror(errno));
+		return (-1);
+	}
+	if (!S_ISDIR(st.st_mode))
+		return (replay_file(target, path));
+	dir = opendir(path);
+	if (!dir) {
+		fprintf(stderr, "Could not open %s : %s\n", path,
+				strerror(errno));
+		return (-1);
+	}
+	err = 0;
+	while ((entry = readdir(dir))) {
+		if (entry->d_name[0] == '.')
+			continue;
+		name = (char*)ntfs_malloc(strlen(path)
+				+ strlen(entry->d_name) + 2);
+		if (!name) {
+			err = -1;
+			break;
+		}
+		sprintf(name, "%s/%s", path, entry->d_name);
+		if (!stat(name, &st) && S_ISREG(st.st_mode)
+		    && replay_file(target, name))
+			err = -1;
+		free(name);
+	}
+	closedir(dir);
+	return (err);
+}
+
+static void usage(void)
+{
+	int i;
+
+	fprintf(stderr, "\n%s %s - Replay a corpus through a fuzzing"
+			" entry point\n\n"
+			"Usage:    %s target file|directory...\n\n"
+			"Targets :",
+			EXEC_NAME, VERSION, EXEC_NAME);
+	for (i=0; targets[i].name; i++)
+		fprintf(stderr, " %s", targets[i].name);
+	fprintf(stderr, "\n\nFor each input, prints the target, the input,"
+			" its size, whether it was\naccepted, the runs per"
+			" second and the MB per second.\n\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const struct FUZZ_TARGET *target;
+	int err;
+	int i;
+
+	target = (const struct FUZZ_TARGET*)NULL;
+	if (argc > 2)
+		for (i=0; targets[i].name; i++)
+			if (!strcmp(argv[1], targets[i].name))
+				target = &targets[i];
+	if (!target) {
+		usage();
+		return (1);
+	}
+	err = 0;
+	for (i=2; i<argc; i++)
+		if (replay(target, argv[i]))
+			err = 1;
+	if (total.inputs)
+		printf("# %s\t%lu inputs\t%lu accepted\t%.1f MB/s\n",
+			target->name, total.inputs, total.accepted,
+			total.bytes/total.elapsed/1048576.0);
+	return (err);
+}
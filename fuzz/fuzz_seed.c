@@ -0,0 +1,413 @@
+/**
+ * fuzz_seed - Extract a corpus for the fuzzing entry points from a volume
+ *
+ * This program reads the mft records, attributes and directory indexes
+ * of a real volume, and writes them in the input format of each entry
+ * point, so that fuzzing starts from realistic data.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_STRINGS_H
+#include <strings.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+
+#include "types.h"
+#include "layout.h"
+#include "volume.h"
+#include "inode.h"
+#include "attrib.h"
+#include "runlist.h"
+#include "mst.h"
+#include "index.h"
+#include "dir.h"
+#include "misc.h"
+#include "fuzz.h"
+
+#define MAX_INDEX_SIZE 1048576	/* index allocation kept for a directory */
+
+static const char *EXEC_NAME = "fuzz_seed";
+
+static const char *target_dirs[] = {
+	"mapping_pairs", "mst", "attr", "index"
+} ;
+
+static struct {
+	unsigned long records;
+	unsigned long attributes;
+	unsigned long indexes;
+} count;
+
+/*
+ *		Write an input, made of a header and up to three parts
+ */
+
+static int write_input(const char *dir, const char *target,
+			const char *name, const struct FUZZ_HEADER *header,
+			const void *p1, size_t s1, const void *p2, size_t s2,
+			const void *p3, size_t s3)
+{
+	char path[PATH_MAX];
+	FILE *f;
+	int err;
+
+	snprintf(path, sizeof(path), "%s/%s/%s", dir, target, name);
+	f = fopen(path, "wb");
+	if (!f) {
+		fprintf(stderr, "Could not create %s : %s\n", path,
+				strerror(errno));
+		return (-1);
+	}
+	err = ((fwrite(header, sizeof(*header), 1, f) != 1)
+		|| (s1 && (fwrite(p1, s1, 1, f) != 1))
+		|| (s2 && (fwrite(p2, s2, 1, f) != 1))
+		|| (s3 && (fwrite(p3, s3, 1, f) != 1)));
+	if (fclose(f) || err) {
+		fprintf(stderr, "Could not write %s\n", path);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ *		Get the next attribute of a record, checking its bounds
+ */
+
+static ATTR_RECORD *next_attribute(MFT_RECORD *m, u32 size, ATTR_RECORD *a)
+{
+	u8 *end;
+
+	end = (u8*)m + size;
+	if (!a)
+		a = (ATTR_RECORD*)((u8*)m + le16_to_cpu(m->attrs_offset));
+	else
+		a = (ATTR_RECORD*)((u8*)a + le32_to_cpu(a->length));
+	if (((u8*)a + 8 > end) || (a->type == AT_END) || !a->length
+	    || ((u8*)a + le32_to_cpu(a->length) > end))
+		return ((ATTR_RECORD*)NULL);
+	return (a);
+}
+
+static BOOL is_i30(ATTR_RECORD *a)
+{
+	return ((a->name_length == 4)
+		&& !memcmp((u8*)a + le16_to_cpu(a->name_offset),
+				NTFS_INDEX_I30, 8));
+}
+
+/*
+ *		Get the first key of an index block or index root
+ */
+
+static INDEX_ENTRY *first_entry(INDEX_HEADER *ih, u32 size)
+{
+	INDEX_ENTRY *ie;
+
+	if (le32_to_cpu(ih->entries_offset) + sizeof(INDEX_ENTRY_HEADER)
+			> size)
+		return ((INDEX_ENTRY*)NULL);
+	ie = (INDEX_ENTRY*)((u8*)ih + le32_to_cpu(ih->entries_offset));
+	if ((ie->ie_flags & INDEX_ENTRY_END)
+	    || ((u8*)&ie->key + le16_to_cpu(ie->key_length)
+			> (u8*)ih + size))
+		return ((INDEX_ENTRY*)NULL);
+	return (ie);
+}
+
+static INDEX_ENTRY *dup_entry(const INDEX_ENTRY *ie)
+{
+	INDEX_ENTRY *copy;
+	u32 size;
+
+	copy = (INDEX_ENTRY*)NULL;
+	if (ie) {
+		size = offsetof(INDEX_ENTRY, key)
+				+ le16_to_cpu(ie->key_length);
+		copy = (INDEX_ENTRY*)ntfs_malloc(size);
+		if (copy)
+			memcpy(copy, ie, size);
+	}
+	return (copy);
+}
+
+/*
+ *		Write the input for a lookup in a directory
+ *
+ *	The $I30 index allocation is moved to a single run located at
+ *	cluster FUZZ_IMAGE_LCN, so that it can follow the record in the
+ *	input. The key is the first one in the first index block, or in
+ *	the index root if there is no index block.
+ */
+
+static int seed_index(ntfs_volume *vol, const char *dir, u64 mft_no,
+			const struct FUZZ_HEADER *header, MFT_RECORD *m)
+{
+	ntfs_inode *ni;
+	ntfs_attr *na;
+	ATTR_RECORD *a;
+	ATTR_RECORD *ia;
+	INDEX_ROOT *ir;
+	INDEX_BLOCK *ib;
+	INDEX_ENTRY *ie;
+	runlist_element rl[2];
+	struct FUZZ_HEADER ib_header;
+	char name[40];
+	u8 *tail;
+	u8 *key;
+	u32 key_len;
+	s64 tail_size;
+	u32 block_size;
+	int err;
+
+	ir = (INDEX_ROOT*)NULL;
+	ia = (ATTR_RECORD*)NULL;
+	for (a=next_attribute(m, vol->mft_record_size, NULL); a;
+			a=next_attribute(m, vol->mft_record_size, a)) {
+		if ((a->type == AT_INDEX_ROOT) && !a->non_resident
+		    && is_i30(a))
+			ir = (INDEX_ROOT*)((u8*)a
+				+ le16_to_cpu(a->value_offset));
+		if ((a->type == AT_INDEX_ALLOCATION) && a->non_resident
+		    && is_i30(a))
+			ia = a;
+	}
+	if (!ir)
+		return (0);
+	block_size = le32_to_cpu(ir->index_block_size);
+	tail = (u8*)NULL;
+	tail_size = 0;
+	ie = (INDEX_ENTRY*)NULL;
+	err = 0;
+	if (ia) {
+		ni = ntfs_inode_open(vol, mft_no);
+		na = (ni ? ntfs_attr_open(ni, AT_INDEX_ALLOCATION,
+					NTFS_INDEX_I30, 4)
+			: (ntfs_attr*)NULL);
+		if (na) {
+			tail_size = na->initialized_size;
+			if (tail_size > MAX_INDEX_SIZE)
+				tail_size = MAX_INDEX_SIZE;
+			tail_size &= -(s64)vol->cluster_size;
+			tail = (u8*)ntfs_malloc(tail_size ? tail_size : 1);
+			if (tail && (ntfs_attr_pread(na, 0, tail_size, tail)
+					!= tail_size))
+				tail_size = 0;
+			ntfs_attr_close(na);
+		}
+		if (ni)
+			ntfs_inode_close(ni);
+		if (!tail || (tail_size < block_size)) {
+			free(tail);
+			return (0);
+		}
+			/* an index block for the mst target */
+		ib_header.cluster_size_bits = vol->cluster_size_bits - 9;
+		ib_header.record_size_bits = ffs(block_size) - 10;
+		snprintf(name, sizeof(name), "%llu-indx",
+				(unsigned long long)mft_no);
+		err = write_input(dir, "mst", name, &ib_header,
+				tail, block_size, NULL, 0, NULL, 0);
+		ib = (INDEX_BLOCK*)ntfs_malloc(block_size);
+		if (ib) {
+			memcpy(ib, tail, block_size);
+			if (!ntfs_mst_post_read_fixup_warn((NTFS_RECORD*)ib,
+					block_size, FALSE)) {
+				ie = first_entry(&ib->index, block_size
+					- offsetof(INDEX_BLOCK, index));
+				ie = dup_entry(ie);
+			}
+			free(ib);
+		}
+			/* relocate the index allocation to the image */
+		rl[0].vcn = 0;
+		rl[0].lcn = FUZZ_IMAGE_LCN;
+		rl[0].length = tail_size >> vol->cluster_size_bits;
+		rl[1].vcn = rl[0].length;
+		rl[1].lcn = LCN_ENOENT;
+		rl[1].length = 0;
+		if (ntfs_mapping_pairs_build(vol, (u8*)ia
+				+ le16_to_cpu(ia->mapping_pairs_offset),
+				le32_to_cpu(ia->length)
+				- le16_to_cpu(ia->mapping_pairs_offset),
+				rl, 0, NULL)) {
+			free(ie);
+			free(tail);
+			return (err);
+		}
+		ia->lowest_vcn = const_cpu_to_sle64(0);
+		ia->highest_vcn = cpu_to_sle64(rl[0].length - 1);
+		ia->allocated_size = cpu_to_sle64(tail_size);
+		ia->data_size = cpu_to_sle64(tail_size);
+		ia->initialized_size = cpu_to_sle64(tail_size);
+	}
+	if (!ie) {
+		ie = first_entry(&ir->index, (u8*)m + vol->mft_record_size
+					- (u8*)&ir->index);
+		ie = dup_entry(ie);
+	}
+	key = (ie ? (u8*)ntfs_malloc(2 + le16_to_cpu(ie->key_length))
+			: (u8*)NULL);
+	if (key && !ntfs_mst_pre_write_fixup((NTFS_RECORD*)m,
+			vol->mft_record_size)) {
+		key_len = le16_to_cpu(ie->key_length);
+		*(le16*)key = ie->key_length;
+		memcpy(&key[2], &ie->key, key_len);
+		snprintf(name, sizeof(name), "%llu",
+				(unsigned long long)mft_no);
+		if (write_input(dir, "index", name, header, key, 2 + key_len,
+				m, vol->mft_record_size, tail, tail_size))
+			err = -1;
+		count.indexes++;
+	}
+	free(key);
+	free(ie);
+	free(tail);
+	return (err);
+}
+
+/*
+ *		Write the inputs for an mft record
+ *
+ *	The raw record goes to the mst and attr targets, each non-resident
+ *	attribute to the mapping_pairs target, and a directory with an
+ *	index root to the index target.
+ */
+
+static int seed_record(ntfs_volume *vol, const char *dir, u64 mft_no,
+			const u8 *raw)
+{
+	struct FUZZ_HEADER header;
+	MFT_RECORD *m;
+	ATTR_RECORD *a;
+	char name[40];
+	int err;
+	int k;
+
+	m = (MFT_RECORD*)ntfs_malloc(vol->mft_record_size);
+	if (!m)
+		return (-1);
+	memcpy(m, raw, vol->mft_record_size);
+	if (ntfs_mst_post_read_fixup_warn((NTFS_RECORD*)m,
+			vol->mft_record_size, FALSE)
+	    || !ntfs_is_file_record(m->magic)
+	    || !(m->flags & MFT_RECORD_IN_USE)) {
+		free(m);
+		return (0);
+	}
+	header.cluster_size_bits = vol->cluster_size_bits - 9;
+	header.record_size_bits = vol->mft_record_size_bits - 9;
+	snprintf(name, sizeof(name), "%llu", (unsigned long long)mft_no);
+	err = write_input(dir, "mst", name, &header,
+			raw, vol->mft_record_size, NULL, 0, NULL, 0)
+		|| write_input(dir, "attr", name, &header,
+			raw, vol->mft_record_size, NULL, 0, NULL, 0);
+	count.records++;
+	k = 0;
+	for (a=next_attribute(m, vol->mft_record_size, NULL); a && !err;
+			a=next_attribute(m, vol->mft_record_size, a)) {
+		if (a->non_resident) {
+			snprintf(name, sizeof(name), "%llu-%d",
+					(unsigned long long)mft_no, k++);
+			err = write_input(dir, "mapping_pairs", name, &header,
+					a, le32_to_cpu(a->length),
+					NULL, 0, NULL, 0);
+			count.attributes++;
+		}
+	}
+	if (!err && (m->flags & MFT_RECORD_IS_DIRECTORY))
+		err = seed_index(vol, dir, mft_no, &header, m);
+	free(m);
+	return (err ? -1 : 0);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "\n%s %s - Extract a fuzzing corpus from a volume"
+			"\n\nUsage:    %s device directory [max-records]\n\n"
+			"Writes the inputs for each target to a subdirectory"
+			" of the directory :\n",
+			EXEC_NAME, VERSION, EXEC_NAME);
+	fprintf(stderr, "%s, %s, %s and %s.\n\n", target_dirs[0],
+			target_dirs[1], target_dirs[2], target_dirs[3]);
+}
+
+int main(int argc, char *argv[])
+{
+	ntfs_volume *vol;
+	char path[PATH_MAX];
+	unsigned long max_records;
+	u64 nr_records;
+	u64 mft_no;
+	u8 *raw;
+	int err;
+	unsigned int i;
+
+	if ((argc < 3) || (argc > 4)) {
+		usage();
+		return (1);
+	}
+	max_records = (argc > 3 ? strtoul(argv[3], NULL, 0) : 10000);
+	for (i=0; i<sizeof(target_dirs)/sizeof(target_dirs[0]); i++) {
+		snprintf(path, sizeof(path), "%s/%s", argv[2], target_dirs[i]);
+		if (mkdir(path, 0777) && (errno != EEXIST)) {
+			fprintf(stderr, "Could not create %s : %s\n", path,
+					strerror(errno));
+			return (1);
+		}
+	}
+	vol = ntfs_mount(argv[1], NTFS_MNT_RDONLY);
+	if (!vol) {
+		fprintf(stderr, "Could not mount %s : %s\n", argv[1],
+				strerror(errno));
+		return (1);
+	}
+	raw = (u8*)ntfs_malloc(vol->mft_record_size);
+	err = !raw;
+	nr_records = vol->mft_na->initialized_size
+				>> vol->mft_record_size_bits;
+	for (mft_no=0; !err && (mft_no < nr_records)
+			&& (count.records < max_records); mft_no++) {
+		if (ntfs_attr_pread(vol->mft_na,
+				mft_no << vol->mft_record_size_bits,
+				vol->mft_record_size, raw)
+					!= vol->mft_record_size)
+			err = 1;
+		else
+			err = (seed_record(vol, argv[2], mft_no, raw) != 0);
+	}
+	free(raw);
+	ntfs_umount(vol, FALSE);
+	printf("%lu records, %lu non-resident attributes, %lu indexes\n",
+			count.records, count.attributes, count.indexes);
+	return (err);
+}
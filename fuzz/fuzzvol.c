@@ -0,0 +1,264 @@
+/**
+ * fuzzvol.c : an in-memory volume for the fuzzing entry points
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include "types.h"
+#include "device.h"
+#include "volume.h"
+#include "inode.h"
+#include "attrib.h"
+#include "unistr.h"
+#include "logging.h"
+#include "misc.h"
+#include "fuzz.h"
+
+/*
+ *		The volume which the entry points parse
+ *
+ *	It is built once, with a default upcase table, and its geometry
+ *	and device contents are replaced for each input. The device only
+ *	holds the image data given by the input, from cluster
+ *	FUZZ_IMAGE_LCN, and reads zeroes elsewhere. It cannot be written.
+ */
+
+struct FUZZ_DEVICE {
+	const u8 *image;
+	size_t image_size;
+	s64 image_pos;
+} ;
+
+static ntfs_volume *fuzz_vol;
+static struct FUZZ_DEVICE fuzz_device;
+
+static int fuzz_dev_open(struct ntfs_device *dev __attribute__((unused)),
+			int flags __attribute__((unused)))
+{
+	return (0);
+}
+
+static int fuzz_dev_close(struct ntfs_device *dev __attribute__((unused)))
+{
+	return (0);
+}
+
+static s64 fuzz_dev_seek(struct ntfs_device *dev __attribute__((unused)),
+			s64 offset __attribute__((unused)),
+			int whence __attribute__((unused)))
+{
+	errno = EOPNOTSUPP;
+	return (-1);
+}
+
+static s64 fuzz_dev_pread(struct ntfs_device *dev, void *buf, s64 count,
+			s64 offset)
+{
+	struct FUZZ_DEVICE *fdev;
+	s64 start;
+	s64 end;
+
+	fdev = (struct FUZZ_DEVICE*)dev->d_private;
+	memset(buf, 0, count);
+	start = offset - fdev->image_pos;
+	end = start + count;
+	if (start < 0)
+		start = 0;
+	if (end > (s64)fdev->image_size)
+		end = fdev->image_size;
+	if (start < end)
+		memcpy((u8*)buf + start + fdev->image_pos - offset,
+			&fdev->image[start], end - start);
+	return (count);
+}
+
+static s64 fuzz_dev_read(struct ntfs_device *dev __attribute__((unused)),
+			void *buf __attribute__((unused)),
+			s64 count __attribute__((unused)))
+{
+	errno = EOPNOTSUPP;
+	return (-1);
+}
+
+static s64 fuzz_dev_write(struct ntfs_device *dev __attribute__((unused)),
+			const void *buf __attribute__((unused)),
+			s64 count __attribute__((unused)))
+{
+	errno = EROFS;
+	return (-1);
+}
+
+static s64 fuzz_dev_pwrite(struct ntfs_device *dev __attribute__((unused)),
+			const void *buf __attribute__((unused)),
+			s64 count __attribute__((unused)),
+			s64 offset __attribute__((unused)))
+{
+	errno = EROFS;
+	return (-1);
+}
+
+static int fuzz_dev_sync(struct ntfs_device *dev __attribute__((unused)))
+{
+	return (0);
+}
+
+static int fuzz_dev_stat(struct ntfs_device *dev __attribute__((unused)),
+			struct stat *buf __attribute__((unused)))
+{
+	errno = EOPNOTSUPP;
+	return (-1);
+}
+
+static int fuzz_dev_ioctl(struct ntfs_device *dev __attribute__((unused)),
+			int request __attribute__((unused)),
+			void *argp __attribute__((unused)))
+{
+	errno = EOPNOTSUPP;
+	return (-1);
+}
+
+static struct ntfs_device_operations fuzz_device_ops = {
+	.open		= fuzz_dev_open,
+	.close		= fuzz_dev_close,
+	.seek		= fuzz_dev_seek,
+	.read		= fuzz_dev_read,
+	.write		= fuzz_dev_write,
+	.pread		= fuzz_dev_pread,
+	.pwrite		= fuzz_dev_pwrite,
+	.sync		= fuzz_dev_sync,
+	.stat		= fuzz_dev_stat,
+	.ioctl		= fuzz_dev_ioctl,
+} ;
+
+/*
+ *		Build the volume on first use
+ *
+ *	The logging is silenced, the inputs are expected to be rejected
+ *	most of the time.
+ */
+
+static ntfs_volume *fuzz_volume_init(void)
+{
+	ntfs_volume *vol;
+
+	ntfs_log_set_handler(ntfs_log_handler_null);
+	vol = ntfs_volume_alloc();
+	if (!vol)
+		return ((ntfs_volume*)NULL);
+	vol->dev = ntfs_device_alloc("fuzz", 0, &fuzz_device_ops,
+				&fuzz_device);
+	vol->upcase_len = ntfs_upcase_build_default(&vol->upcase);
+	if (!vol->dev || !vol->upcase_len) {
+		if (vol->dev)
+			ntfs_device_free(vol->dev);
+		free(vol->upcase);
+		free(vol);
+		return ((ntfs_volume*)NULL);
+	}
+	NVolSetReadOnly(vol);
+	NVolSetNoFixupWarn(vol);
+	vol->sector_size = NTFS_BLOCK_SIZE;
+	return (vol);
+}
+
+/*
+ *		Get the volume, with the geometry from the header of
+ *	an input, and an image located at cluster FUZZ_IMAGE_LCN
+ *
+ *	The geometry is forced into the valid ranges.
+ */
+
+ntfs_volume *fuzz_volume(const struct FUZZ_HEADER *header,
+			const u8 *image, size_t image_size)
+{
+	ntfs_volume *vol;
+	int cluster_bits;
+	int record_bits;
+
+	if (!fuzz_vol)
+		fuzz_vol = fuzz_volume_init();
+	vol = fuzz_vol;
+	if (vol) {
+		cluster_bits = 9 + (header->cluster_size_bits & 7);
+		record_bits = 9 + (header->record_size_bits & 3);
+		vol->cluster_size_bits = cluster_bits;
+		vol->cluster_size = 1 << cluster_bits;
+		vol->mft_record_size_bits = record_bits;
+		vol->mft_record_size = 1 << record_bits;
+		vol->indx_record_size = 1 << record_bits;
+		vol->nr_clusters = FUZZ_IMAGE_LCN + 1
+				+ (image_size >> cluster_bits);
+		fuzz_device.image = image;
+		fuzz_device.image_size = image_size;
+		fuzz_device.image_pos = (s64)FUZZ_IMAGE_LCN << cluster_bits;
+	}
+	return (vol);
+}
+
+/*
+ *		Copy a record from an input, padded with zeroes
+ *
+ *	Returns the allocated copy, to be freed by the caller
+ */
+
+void *fuzz_record(const u8 *data, size_t size, u32 record_size)
+{
+	u8 *record;
+
+	record = (u8*)ntfs_calloc(record_size);
+	if (record)
+		memcpy(record, data, (size < record_size ? size : record_size));
+	return (record);
+}
+
+/*
+ *		Make an inode for an mft record, as if it was opened
+ */
+
+ntfs_inode *fuzz_inode(ntfs_volume *vol, MFT_RECORD *mrec)
+{
+	ntfs_inode *ni;
+
+	ni = (ntfs_inode*)ntfs_calloc(sizeof(ntfs_inode));
+	if (ni) {
+		ni->vol = vol;
+		ni->mft_no = FILE_first_user;
+		ni->mrec = mrec;
+	}
+	return (ni);
+}
+
+void fuzz_inode_free(ntfs_inode *ni)
+{
+	if (ni->index_na)
+		ntfs_attr_close(ni->index_na);
+	free(ni->attr_list);
+	free(ni);
+}
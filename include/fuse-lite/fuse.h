@@ -436,6 +436,26 @@ struct fuse_operations {
 	int (*ioctl) (const char *, int cmd, void *arg,
 		      struct fuse_file_info *, unsigned int flags, void *data); 
 
+	/**
+	 * Allocate space to an open file
+	 *
+	 * mode is a combination of FALLOC_FL_KEEP_SIZE and
+	 * FALLOC_FL_PUNCH_HOLE, as for fallocate(2).
+	 *
+	 * Introduced in version 2.9.1
+	 */
+	int (*fallocate) (const char *, int mode, off_t offset, off_t length,
+			  struct fuse_file_info *);
+
+	/**
+	 * Find the next data or hole after the specified offset
+	 *
+	 * Only called for SEEK_DATA and SEEK_HOLE, returns the
+	 * offset found or -errno.
+	 */
+	off_t (*lseek) (const char *, off_t off, int whence,
+			struct fuse_file_info *);
+
 	/*
 	 * The flags below have been discarded, they should not be used
 	 */
@@ -619,6 +639,10 @@ int fuse_fs_bmap(struct fuse_fs *fs, const char *path, size_t blocksize,
 		 uint64_t *idx);
 int fuse_fs_ioctl(struct fuse_fs *fs, const char *path, int cmd, void *arg,
 		  struct fuse_file_info *fi, unsigned int flags, void *data);
+int fuse_fs_fallocate(struct fuse_fs *fs, const char *path, int mode,
+		      off_t offset, off_t length, struct fuse_file_info *fi);
+off_t fuse_fs_lseek(struct fuse_fs *fs, const char *path, off_t off,
+		    int whence, struct fuse_file_info *fi);
 void fuse_fs_init(struct fuse_fs *fs, struct fuse_conn_info *conn);
 void fuse_fs_destroy(struct fuse_fs *fs);
 
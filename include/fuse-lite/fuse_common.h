@@ -50,6 +50,10 @@ extern "C" {
 
 #define FUSE_CAP_BIG_WRITES	(1 << 5)
 #define FUSE_CAP_IOCTL_DIR	(1 << 11)
+#define FUSE_CAP_READDIRPLUS	(1 << 13)
+#define FUSE_CAP_READDIRPLUS_AUTO	(1 << 14)
+#define FUSE_CAP_WRITEBACK_CACHE	(1 << 16)
+#define FUSE_CAP_MAX_PAGES	(1 << 22)
 
 /**
  * Ioctl flags
@@ -237,6 +241,25 @@ int fuse_set_signal_handlers(struct fuse_session *se);
  */
 void fuse_remove_signal_handlers(struct fuse_session *se);
 
+/**
+ * Exit several sessions on HUP, TERM and INT signals and ignore PIPE signal
+ *
+ * Stores the array of sessions in a global variable, the array must
+ * be kept until fuse_remove_signal_handlers_multi() is called.
+ *
+ * @param se the sessions to exit
+ * @param count the number of sessions
+ * @return 0 on success, -1 on failure
+ */
+int fuse_set_signal_handlers_multi(struct fuse_session **se, int count);
+
+/**
+ * Restore default signal handlers after fuse_set_signal_handlers_multi()
+ *
+ * @param se the same sessions as given in fuse_set_signal_handlers_multi()
+ */
+void fuse_remove_signal_handlers_multi(struct fuse_session **se);
+
 #ifdef __cplusplus
 }
 #endif
@@ -39,7 +39,9 @@
 #include <sys/types.h>
 #define __u64 uint64_t
 #define __u32 uint32_t
+#define __u16 uint16_t
 #define __s32 int32_t
+#define __s64 int64_t
 #else
 #include <asm/types.h>
 #include <linux/major.h>
@@ -138,12 +140,20 @@ struct fuse_file_lock {
  * FUSE_BIG_WRITES: allow big writes to be issued to the file system
  * FUSE_DONT_MASK: don't apply umask to file mode on create operations
  * FUSE_HAS_IOCTL_DIR: kernel supports ioctl on directories
+ * FUSE_DO_READDIRPLUS: do READDIRPLUS (READDIR+LOOKUP in one)
+ * FUSE_READDIRPLUS_AUTO: adaptive readdirplus
+ * FUSE_WRITEBACK_CACHE: use writeback cache for buffered writes
+ * FUSE_MAX_PAGES: init_out.max_pages contains the max number of req pages
  */
 #define FUSE_ASYNC_READ		(1 << 0)
 #define FUSE_POSIX_LOCKS	(1 << 1)
 #define FUSE_BIG_WRITES		(1 << 5)
 #define FUSE_DONT_MASK		(1 << 6)
 #define FUSE_HAS_IOCTL_DIR	(1 << 11)
+#define FUSE_DO_READDIRPLUS	(1 << 13)
+#define FUSE_READDIRPLUS_AUTO	(1 << 14)
+#define FUSE_WRITEBACK_CACHE	(1 << 16)
+#define FUSE_MAX_PAGES		(1 << 22)
 
 /**
  * Release flags
@@ -188,10 +198,26 @@ enum fuse_opcode {
 	FUSE_BMAP          = 37,
 	FUSE_DESTROY       = 38,
 	FUSE_IOCTL         = 39,
+	FUSE_BATCH_FORGET  = 42,
+	FUSE_FALLOCATE     = 43,
+	FUSE_READDIRPLUS   = 44,
+	FUSE_LSEEK         = 46,
+	FUSE_COPY_FILE_RANGE = 47,
+};
+
+enum fuse_notify_code {
+	FUSE_NOTIFY_POLL   = 1,
+	FUSE_NOTIFY_INVAL_INODE = 2,
+	FUSE_NOTIFY_INVAL_ENTRY = 3,
+	FUSE_NOTIFY_CODE_MAX,
 };
 
 /* The read buffer is required to be at least 8k, but may be much larger */
 #define FUSE_MIN_READ_BUFFER 8192
+
+/* Largest number of pages the kernel accepts in a request */
+#define FUSE_MAX_MAX_PAGES 256
+
 #define FUSE_COMPAT_ENTRY_OUT_SIZE 120 /* JPA */
 
 struct fuse_entry_out {
@@ -209,6 +235,16 @@ struct fuse_forget_in {
 	__u64	nlookup;
 };
 
+struct fuse_forget_one {
+	__u64	nodeid;
+	__u64	nlookup;
+};
+
+struct fuse_batch_forget_in {
+	__u32	count;
+	__u32	dummy;
+};
+
 #define FUSE_COMPAT_FUSE_ATTR_OUT_SIZE 96  /* JPA */
 
 struct fuse_attr_out {
@@ -371,8 +407,18 @@ struct fuse_init_out {
 	__u32	flags;
 	__u32	unused;
 	__u32	max_write;
+	__u32	time_gran;
+	__u16	max_pages;
+	__u16	padding;
+	__u32	unused2[8];
 };
 
+/*
+ * Kernels older than protocol 7.23 do not accept the extended reply,
+ * and max_pages is only defined since 7.28, as signalled by FUSE_MAX_PAGES
+ */
+#define FUSE_COMPAT_22_INIT_OUT_SIZE 24
+
 struct fuse_interrupt_in {
 	__u64	unique;
 };
@@ -408,6 +454,35 @@ struct fuse_ioctl_out {
 	__u32	out_iovs;
 };
 
+struct fuse_fallocate_in {
+	__u64	fh;
+	__u64	offset;
+	__u64	length;
+	__u32	mode;
+	__u32	padding;
+};
+
+struct fuse_lseek_in {
+	__u64	fh;
+	__u64	offset;
+	__u32	whence;
+	__u32	padding;
+};
+
+struct fuse_lseek_out {
+	__u64	offset;
+};
+
+struct fuse_copy_file_range_in {
+	__u64	fh_in;
+	__u64	off_in;
+	__u64	nodeid_out;
+	__u64	fh_out;
+	__u64	off_out;
+	__u64	len;
+	__u64	flags;
+};
+
 struct fuse_in_header {
 	__u32	len;
 	__u32	opcode;
@@ -437,3 +512,25 @@ struct fuse_dirent {
 #define FUSE_DIRENT_ALIGN(x) (((x) + sizeof(__u64) - 1) & ~(sizeof(__u64) - 1))
 #define FUSE_DIRENT_SIZE(d) \
 	FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + (d)->namelen)
+
+struct fuse_direntplus {
+	struct fuse_entry_out entry_out;
+	struct fuse_dirent dirent;
+};
+
+#define FUSE_NAME_OFFSET_DIRENTPLUS \
+	offsetof(struct fuse_direntplus, dirent.name)
+#define FUSE_DIRENTPLUS_SIZE(d) \
+	FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET_DIRENTPLUS + (d)->dirent.namelen)
+
+struct fuse_notify_inval_inode_out {
+	__u64	ino;
+	__s64	off;
+	__s64	len;
+};
+
+struct fuse_notify_inval_entry_out {
+	__u64	parent;
+	__u32	namelen;
+	__u32	padding;
+};
@@ -55,6 +55,12 @@ struct fuse_session;
  */
 struct fuse_chan;
 
+/** Inode and count of lookups supplied to forget_multi() */
+struct fuse_forget_data {
+	fuse_ino_t ino;
+	uint64_t nlookup;
+};
+
 /** Directory entry parameters supplied to fuse_reply_entry() */
 struct fuse_entry_param {
 	/** Unique inode number
@@ -105,6 +111,40 @@ struct fuse_ctx {
 	mode_t umask;
 };
 
+/** Number of latency buckets in struct fuse_op_stats */
+#define FUSE_STATS_BUCKETS 32
+
+/** Counters accumulated for each request opcode */
+struct fuse_op_stats {
+	/** Name of the operation */
+	const char *name;
+
+	/** Number of requests processed */
+	unsigned long long count;
+
+	/** Total time spent in the handlers, in microseconds */
+	unsigned long long total_us;
+
+	/** Latency histogram, bucket n counts requests which took
+	    less than 2^(n+1) microseconds (and at least 2^n if n > 0) */
+	unsigned long long buckets[FUSE_STATS_BUCKETS];
+};
+
+/** Data buffer supplied to fuse_reply_data() */
+struct fuse_buf {
+	/** Size of data in bytes */
+	size_t size;
+
+	/** Data in memory, or NULL if the data has to be read from fd */
+	const void *mem;
+
+	/** File descriptor to read the data from, when mem is NULL */
+	int fd;
+
+	/** Position of the data in the file */
+	off_t pos;
+};
+
 /* 'to_set' flags in setattr */
 #define FUSE_SET_ATTR_MODE	(1 << 0)
 #define FUSE_SET_ATTR_UID	(1 << 1)
@@ -834,6 +874,122 @@ struct fuse_lowlevel_ops {
 		       struct fuse_file_info *fi, unsigned flags,
 		       const void *in_buf, size_t in_bufsz, size_t out_bufsz);
 
+	/**
+	 * Read directory with attributes
+	 *
+	 * Send a buffer filled using fuse_add_direntry_plus(), with size
+	 * not exceeding the requested size.  Send an empty buffer on end
+	 * of stream.
+	 *
+	 * Only used when the file system has requested it in init, by
+	 * setting FUSE_CAP_READDIRPLUS in fuse_conn_info.want.
+	 *
+	 * In contrast to readdir(), the lookup count of every entry
+	 * returned with a non-zero inode is increased by one, except
+	 * for "." and "..".
+	 *
+	 * Valid replies:
+	 *   fuse_reply_buf
+	 *   fuse_reply_err
+	 *
+	 * @param req request handle
+	 * @param ino the inode number
+	 * @param size maximum number of bytes to send
+	 * @param off offset to continue reading the directory stream
+	 * @param fi file information
+	 */
+	void (*readdirplus) (fuse_req_t req, fuse_ino_t ino, size_t size,
+			 off_t off, struct fuse_file_info *fi);
+
+	/**
+	 * Forget about multiple inodes
+	 *
+	 * When the kernel forgets many inodes at once, it sends them
+	 * in a single message. See the description of the forget
+	 * method for more information.
+	 *
+	 * If this method is not defined, forget() is called for each
+	 * inode in the list.
+	 *
+	 * Valid replies:
+	 *   fuse_reply_none
+	 *
+	 * @param req request handle
+	 * @param count the number of inodes to forget
+	 * @param forgets the list of inodes and lookup counts
+	 */
+	void (*forget_multi) (fuse_req_t req, size_t count,
+			      struct fuse_forget_data *forgets);
+
+	/**
+	 * Allocate requested space
+	 *
+	 * The space is allocated as with fallocate(2), @mode being
+	 * a combination of FALLOC_FL_KEEP_SIZE and FALLOC_FL_PUNCH_HOLE.
+	 *
+	 * If this method is not implemented, fallocate(2) fails
+	 * with EOPNOTSUPP.
+	 *
+	 * Valid replies:
+	 *   fuse_reply_err
+	 *
+	 * @param req request handle
+	 * @param ino the inode number
+	 * @param mode the allocation mode
+	 * @param offset the start of the allocated region
+	 * @param length the size of the allocated region
+	 * @param fi file information
+	 */
+	void (*fallocate) (fuse_req_t req, fuse_ino_t ino, int mode,
+			   off_t offset, off_t length,
+			   struct fuse_file_info *fi);
+
+	/**
+	 * Find the next data or hole
+	 *
+	 * The kernel only forwards lseek(2) with SEEK_DATA or SEEK_HOLE.
+	 * If this method is not implemented, the kernel considers the
+	 * whole file as data.
+	 *
+	 * Valid replies:
+	 *   fuse_reply_lseek
+	 *   fuse_reply_err
+	 *
+	 * @param req request handle
+	 * @param ino the inode number
+	 * @param off offset to start the search from
+	 * @param whence SEEK_DATA or SEEK_HOLE
+	 * @param fi file information
+	 */
+	void (*lseek) (fuse_req_t req, fuse_ino_t ino, off_t off, int whence,
+		       struct fuse_file_info *fi);
+
+	/**
+	 * Copy a range of data from a file to another one
+	 *
+	 * Both files are on this filesystem. If this method is not
+	 * implemented, the kernel copies the data through read and
+	 * write requests.
+	 *
+	 * Valid replies:
+	 *   fuse_reply_write
+	 *   fuse_reply_err
+	 *
+	 * @param req request handle
+	 * @param ino_in the inode number of the source file
+	 * @param off_in offset to copy from
+	 * @param fi_in file information of the source file
+	 * @param ino_out the inode number of the target file
+	 * @param off_out offset to copy to
+	 * @param fi_out file information of the target file
+	 * @param len count of bytes to copy
+	 * @param flags flags of copy_file_range(2), currently zero
+	 */
+	void (*copy_file_range) (fuse_req_t req, fuse_ino_t ino_in,
+				 off_t off_in, struct fuse_file_info *fi_in,
+				 fuse_ino_t ino_out, off_t off_out,
+				 struct fuse_file_info *fi_out,
+				 size_t len, int flags);
 };
 
 /**
@@ -956,6 +1112,23 @@ int fuse_reply_write(fuse_req_t req, size_t count);
  */
 int fuse_reply_buf(fuse_req_t req, const char *buf, size_t size);
 
+/**
+ * Reply with data from memory and files
+ *
+ * When the channel supports it, the data held in files is spliced
+ * to the kernel without being copied through user space, otherwise
+ * it is read into a temporary buffer.
+ *
+ * Possible requests:
+ *   read
+ *
+ * @param req request handle
+ * @param bufv the data buffers
+ * @param count the number of buffers
+ * @return zero for success, -errno for failure to send reply
+ */
+int fuse_reply_data(fuse_req_t req, const struct fuse_buf *bufv, int count);
+
 #ifdef POSIXACLS
 /**
  * Reply with data vector
@@ -1019,6 +1192,18 @@ int fuse_reply_lock(fuse_req_t req, struct flock *lock);
  */
 int fuse_reply_bmap(fuse_req_t req, uint64_t idx);
 
+/**
+ * Reply with the offset found by lseek
+ *
+ * Possible requests:
+ *   lseek
+ *
+ * @param req request handle
+ * @param off offset of the data or hole found
+ * @return zero for success, -errno for failure to send reply
+ */
+int fuse_reply_lseek(fuse_req_t req, off_t off);
+
 /* ----------------------------------------------------------- *
  * Filling a buffer in readdir				       *
  * ----------------------------------------------------------- */
@@ -1051,6 +1236,26 @@ size_t fuse_add_direntry(fuse_req_t req, char *buf, size_t bufsize,
 			 const char *name, const struct stat *stbuf,
 			 off_t off);
 
+/**
+ * Add a directory entry with attributes to the buffer
+ *
+ * Same as fuse_add_direntry(), except that the whole entry parameter
+ * is sent, so that the kernel does not have to look the name up.
+ * An entry with a zero e->ino only defines the name, and its inode
+ * number and type are taken from e->attr.
+ *
+ * @param req request handle
+ * @param buf the point where the new entry will be added to the buffer
+ * @param bufsize remaining size of the buffer
+ * @param the name of the entry
+ * @param e the entry parameter
+ * @param off the offset of the next entry
+ * @return the space needed for the entry
+ */
+size_t fuse_add_direntry_plus(fuse_req_t req, char *buf, size_t bufsize,
+			      const char *name,
+			      const struct fuse_entry_param *e, off_t off);
+
 /**
  * Reply to finish ioctl
  *
@@ -1064,6 +1269,47 @@ size_t fuse_add_direntry(fuse_req_t req, char *buf, size_t bufsize,
  */
 int fuse_reply_ioctl(fuse_req_t req, int result, const void *buf, size_t size);
 
+/* ----------------------------------------------------------- *
+ * Notification						       *
+ * ----------------------------------------------------------- */
+
+/**
+ * Notify to invalidate cache for an inode
+ *
+ * The attributes of the inode are invalidated, and so are the
+ * cached data in the given range, if len is not negative.
+ * An offset of zero and a length of zero invalidate all the data.
+ *
+ * To avoid a deadlock, this must not be called while processing
+ * a request which may hold a lock needed for the notification.
+ *
+ * @param ch the channel through which to send the notification
+ * @param ino the inode number
+ * @param off the offset in the inode where to start invalidating
+ *            or negative to invalidate attributes only
+ * @param len the amount of cache to invalidate or 0 for all
+ * @return zero for success, -errno for failure
+ */
+int fuse_lowlevel_notify_inval_inode(struct fuse_chan *ch, fuse_ino_t ino,
+                                     off_t off, off_t len);
+
+/**
+ * Notify to invalidate parent attributes and the dentry matching
+ * parent/name
+ *
+ * The same restriction as for fuse_lowlevel_notify_inval_inode()
+ * about deadlocks applies. The kernel replies -ENOENT when the
+ * entry was not cached.
+ *
+ * @param ch the channel through which to send the notification
+ * @param parent inode number
+ * @param name file name
+ * @param namelen strlen() of file name
+ * @return zero for success, -errno for failure
+ */
+int fuse_lowlevel_notify_inval_entry(struct fuse_chan *ch, fuse_ino_t parent,
+                                     const char *name, size_t namelen);
+
 
 /* ----------------------------------------------------------- *
  * Utility functions					       *
@@ -1118,6 +1364,20 @@ void fuse_req_interrupt_func(fuse_req_t req, fuse_interrupt_func_t func,
  */
 int fuse_req_interrupted(fuse_req_t req);
 
+/**
+ * Get the counters accumulated for each operation of the session
+ *
+ * Only the operations known to the library are reported, the
+ * counters are updated concurrently, so they are only approximately
+ * consistent with each other.
+ *
+ * @param req request handle
+ * @param stats array to fill
+ * @param max number of entries in the array
+ * @return the number of entries filled
+ */
+int fuse_req_stats(fuse_req_t req, struct fuse_op_stats *stats, int max);
+
 /* ----------------------------------------------------------- *
  * Filesystem setup					       *
  * ----------------------------------------------------------- */
@@ -1272,6 +1532,14 @@ void fuse_session_reset(struct fuse_session *se);
  */
 int fuse_session_exited(struct fuse_session *se);
 
+/**
+ * Get the user data provided to the session
+ *
+ * @param se the session
+ * @return the user data
+ */
+void *fuse_session_data(struct fuse_session *se);
+
 /**
  * Enter a single threaded event loop
  *
@@ -1288,6 +1556,39 @@ int fuse_session_loop(struct fuse_session *se);
  */
 int fuse_session_loop_mt(struct fuse_session *se);
 
+/**
+ * Enter a multi-threaded event loop with a limited number of workers
+ *
+ * Worker threads are started on demand when all existing ones are
+ * busy, up to max_threads of them (a default is used if zero).
+ * The file system operations must be thread safe.
+ *
+ * @param se the session
+ * @param max_threads the maximum number of worker threads
+ * @return 0 on success, -1 on error
+ */
+int fuse_session_loop_mt_max(struct fuse_session *se, int max_threads);
+
+/**
+ * Enter a multi-threaded event loop serving several sessions
+ *
+ * The sessions share a pool of workers, each of them processing
+ * the requests of any session. The file system operations must be
+ * thread safe.
+ *
+ * @param se the sessions
+ * @param data the data passed to the callbacks for each session
+ * @param count the number of sessions
+ * @param max_threads the maximum number of worker threads
+ * @param enter called in the worker before processing each request
+ * @param leave called in the calling thread when a session has exited
+ *        and none of its requests is being processed any more
+ * @return 0 on success, -1 on error
+ */
+int fuse_sessions_loop_mt_max(struct fuse_session **se, void **data, int count,
+			      int max_threads, void (*enter)(void *data),
+			      void (*leave)(void *data));
+
 /* ----------------------------------------------------------- *
  * Channel interface					       *
  * ----------------------------------------------------------- */
@@ -1322,6 +1623,22 @@ struct fuse_chan_ops {
 	int (*send)(struct fuse_chan *ch, const struct iovec iov[],
 		    size_t count);
 
+	/**
+	 * Hook for sending a raw reply with data read from files
+	 * (optional)
+	 *
+	 * @param ch the channel
+	 * @param iov vector of blocks to send first
+	 * @param count the number of blocks in vector
+	 * @param bufv the data buffers
+	 * @param bufcount the number of data buffers
+	 * @return zero on success, -ENOSYS if nothing was sent because
+	 * this is not supported, -errno on other failures
+	 */
+	int (*send_data)(struct fuse_chan *ch, const struct iovec iov[],
+			 size_t count, const struct fuse_buf *bufv,
+			 int bufcount);
+
 	/**
 	 * Destroy the channel
 	 *
@@ -1400,6 +1717,21 @@ int fuse_chan_recv(struct fuse_chan **ch, char *buf, size_t size);
 int fuse_chan_send(struct fuse_chan *ch, const struct iovec iov[],
 		   size_t count);
 
+/**
+ * Send a raw reply with data read from files
+ *
+ * @param ch the channel
+ * @param iov vector of blocks to send first
+ * @param count the number of blocks in vector
+ * @param bufv the data buffers
+ * @param bufcount the number of data buffers
+ * @return zero on success, -ENOSYS if nothing was sent because the
+ * channel does not support it, -errno on other failures
+ */
+int fuse_chan_send_data(struct fuse_chan *ch, const struct iovec iov[],
+			size_t count, const struct fuse_buf *bufv,
+			int bufcount);
+
 /**
  * Destroy a channel
  *
@@ -28,6 +28,7 @@
 /* Forward declarations */
 typedef struct _ntfs_attr ntfs_attr;
 typedef struct _ntfs_attr_search_ctx ntfs_attr_search_ctx;
+typedef struct _ntfs_attr_stream ntfs_attr_stream;
 
 #include "types.h"
 #include "inode.h"
@@ -92,12 +93,14 @@ struct _ntfs_attr_search_ctx {
 	ntfs_inode *base_ntfs_ino;
 	MFT_RECORD *base_mrec;
 	ATTR_RECORD *base_attr;
+	ntfs_volume *vol;	/* volume of the pool, NULL if not pooled */
 };
 
 extern void ntfs_attr_reinit_search_ctx(ntfs_attr_search_ctx *ctx);
 extern ntfs_attr_search_ctx *ntfs_attr_get_search_ctx(ntfs_inode *ni,
 		MFT_RECORD *mrec);
 extern void ntfs_attr_put_search_ctx(ntfs_attr_search_ctx *ctx);
+extern void ntfs_attr_search_pool_release(ntfs_volume *vol);
 
 extern int ntfs_attr_lookup(const ATTR_TYPES type, const ntfschar *name,
 		const u32 name_len, const IGNORE_CASE_BOOL ic,
@@ -198,8 +201,19 @@ struct _ntfs_attr {
 	u8 compression_block_size_bits;
 	u8 compression_block_clusters;
 	s8 unused_runs; /* pre-reserved entries available */
+	struct ATTR_READAHEAD *readahead; /* NULL until read sequentially */
+	struct ATTR_WRITEBUF *writebuf; /* NULL unless appends are buffered */
+	runlist_element *rl_base; /* rl when its runs were last counted */
+	s32 rl_runs; /* count of runs in rl_base, 0 if unknown */
+	s32 rl_hint; /* index of the run last searched for */
 };
 
+/*
+ * The count of runs must be forgotten when the runlist of an
+ * attribute may have been shortened in place.
+ */
+#define ntfs_attr_forget_runs(na) ((na)->rl_runs = 0)
+
 /**
  * enum ntfs_attr_state_bits - bits for the state field in the ntfs_attr
  * structure
@@ -296,14 +310,29 @@ extern ntfs_attr *ntfs_attr_open(ntfs_inode *ni, const ATTR_TYPES type,
 		ntfschar *name, u32 name_len);
 extern void ntfs_attr_close(ntfs_attr *na);
 
+extern ntfs_attr *ntfs_stream_open(ntfs_inode *ni, ntfschar *name,
+		u32 name_len);
+extern void ntfs_stream_close(ntfs_attr *na);
+extern void ntfs_stream_forget_all(ntfs_inode *ni);
+
 extern s64 ntfs_attr_pread(ntfs_attr *na, const s64 pos, s64 count,
 		void *b);
 extern s64 ntfs_attr_pwrite(ntfs_attr *na, const s64 pos, s64 count,
 		const void *b);
 extern int ntfs_attr_pclose(ntfs_attr *na);
 
+extern int ntfs_attr_buffer_writes(ntfs_attr *na);
+extern int ntfs_attr_flush(ntfs_attr *na);
+extern s64 ntfs_attr_pending_writes(ntfs_attr *na);
+
 extern void *ntfs_attr_readall(ntfs_inode *ni, const ATTR_TYPES type,
 			       ntfschar *name, u32 name_len, s64 *data_size);
+extern const void *ntfs_attr_peek(ntfs_inode *ni, const ATTR_TYPES type,
+			const ntfschar *name, u32 name_len, u32 *size);
+
+extern ntfs_attr_stream *ntfs_attr_stream_open(ntfs_attr *na);
+extern s64 ntfs_attr_stream_read(ntfs_attr_stream *stream, const void **buf);
+extern void ntfs_attr_stream_close(ntfs_attr_stream *stream);
 
 extern s64 ntfs_attr_mst_pread(ntfs_attr *na, const s64 pos,
 		const s64 bk_cnt, const u32 bk_size, void *dst);
@@ -312,6 +341,7 @@ extern s64 ntfs_attr_mst_pwrite(ntfs_attr *na, const s64 pos,
 
 extern int ntfs_attr_map_runlist(ntfs_attr *na, VCN vcn);
 extern int ntfs_attr_map_whole_runlist(ntfs_attr *na);
+extern BOOL ntfs_attr_release_runlist(ntfs_attr *na, s32 max_runs);
 
 extern LCN ntfs_attr_vcn_to_lcn(ntfs_attr *na, const VCN vcn);
 extern runlist_element *ntfs_attr_find_vcn(ntfs_attr *na, const VCN vcn);
@@ -352,6 +382,13 @@ extern int ntfs_attr_update_mapping_pairs(ntfs_attr *na, VCN from_vcn);
 
 extern int ntfs_attr_truncate(ntfs_attr *na, const s64 newsize);
 extern int ntfs_attr_truncate_solid(ntfs_attr *na, const s64 newsize);
+extern int ntfs_attr_fallocate(ntfs_attr *na, s64 offset, s64 length,
+			BOOL keep_size);
+extern int ntfs_attr_punch_hole(ntfs_attr *na, s64 offset, s64 length);
+extern s64 ntfs_attr_seek_hole_data(ntfs_attr *na, s64 pos, BOOL hole);
+extern s64 ntfs_attr_copy_range(ntfs_attr *src, s64 src_pos,
+			ntfs_attr *dst, s64 dst_pos, s64 count);
+extern s64 ntfs_attr_defragment(ntfs_attr *na);
 
 /**
  * get_attribute_value_length - return the length of the value of an attribute
@@ -39,6 +39,11 @@
 extern void ntfs_bit_set(u8 *bitmap, const u64 bit, const u8 new_value);
 extern char ntfs_bit_get(const u8 *bitmap, const u64 bit);
 extern char ntfs_bit_get_and_set(u8 *bitmap, const u64 bit, const u8 new_value);
+/* The scans below assemble 64-bit words in little endian order */
+extern s64 ntfs_bitmap_find_set(const u8 *bitmap, s64 start, s64 end);
+extern s64 ntfs_bitmap_find_zero(const u8 *bitmap, s64 start, s64 end);
+extern s64 ntfs_bitmap_count_set(const u8 *bitmap, s64 start, s64 end);
+extern void ntfs_bitmap_fill(u8 *bitmap, s64 start, s64 end);
 extern int  ntfs_bitmap_set_run(ntfs_attr *na, s64 start_bit, s64 count);
 extern int  ntfs_bitmap_clear_run(ntfs_attr *na, s64 start_bit, s64 count);
 
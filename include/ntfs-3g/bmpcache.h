@@ -0,0 +1,37 @@
+/*
+ * bmpcache.h : write-back cache of bitmap pages
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _NTFS_BMPCACHE_H_
+#define _NTFS_BMPCACHE_H_
+
+#include "types.h"
+#include "attrib.h"
+#include "volume.h"
+
+int ntfs_bmpcache_attach(ntfs_volume *vol, int count, BOOL resident);
+int ntfs_bmpcache_flush(const ntfs_volume *vol, BOOL clears);
+int ntfs_bmpcache_detach(ntfs_volume *vol);
+void ntfs_bmpcache_log(const ntfs_volume *vol);
+
+BOOL ntfs_bmpcache_covers(const ntfs_attr *na);
+void ntfs_bmpcache_get(ntfs_attr *na, s64 pos, s64 count, void *b);
+BOOL ntfs_bmpcache_read(ntfs_attr *na, s64 pos, s64 count, void *b);
+int ntfs_bmpcache_defer(ntfs_attr *na, s64 pos, s64 count, const void *b);
+
+#endif /* _NTFS_BMPCACHE_H_ */
@@ -29,6 +29,7 @@ struct CACHED_GENERIC {
 	struct CACHED_GENERIC *previous;
 	void *variable;
 	size_t varsize;
+	int state;		/* reserved to the cache management */
 	union ALIGNMENT payload[0];
 } ;
 
@@ -37,6 +38,7 @@ struct CACHED_INODE {
 	struct CACHED_INODE *previous;
 	const char *pathname;
 	size_t varsize;
+	int state;
 	union ALIGNMENT payload[0];
 		/* above fields must match "struct CACHED_GENERIC" */
 	u64 inum;
@@ -47,6 +49,7 @@ struct CACHED_NIDATA {
 	struct CACHED_NIDATA *previous;
 	const char *pathname;	/* not used */
 	size_t varsize;		/* not used */
+	int state;
 	union ALIGNMENT payload[0];
 		/* above fields must match "struct CACHED_GENERIC" */
 	u64 inum;
@@ -58,15 +61,45 @@ struct CACHED_LOOKUP {
 	struct CACHED_LOOKUP *previous;
 	const char *name;
 	size_t namesize;
+	int state;
 	union ALIGNMENT payload[0];
 		/* above fields must match "struct CACHED_GENERIC" */
 	u64 parent;
 	u64 inum;
 } ;
 
+struct CACHED_CHUNK {
+	struct CACHED_CHUNK *next;
+	struct CACHED_CHUNK *previous;
+	void *data;		/* the decompressed chunk */
+	size_t datasize;
+	int state;
+	union ALIGNMENT payload[0];
+		/* above fields must match "struct CACHED_GENERIC" */
+	u64 inum;
+	u64 chunk;
+	u64 compressed_size;
+	le16 sequence_number;
+} ;
+
+struct CACHED_SYMLINK {
+	struct CACHED_SYMLINK *next;
+	struct CACHED_SYMLINK *previous;
+	char *data;		/* reparse data, then the target */
+	size_t datasize;
+	int state;
+	union ALIGNMENT payload[0];
+		/* above fields must match "struct CACHED_GENERIC" */
+	u64 inum;
+	u32 generation;
+	int reparse_size;
+	le16 sequence_number;
+} ;
+
 enum {
 	CACHE_FREE = 1,
-	CACHE_NOHASH = 2
+	CACHE_NOHASH = 2,
+	CACHE_SECONDARY = 4
 } ;
 
 typedef int (*cache_compare)(const struct CACHED_GENERIC *cached,
@@ -81,16 +114,28 @@ struct HASH_ENTRY {
 
 struct CACHE_HEADER {
 	const char *name;
+	ntfs_volume *vol;
 	struct CACHED_GENERIC *most_recent_entry;
 	struct CACHED_GENERIC *oldest_entry;
+	struct CACHED_GENERIC *probation_entry;
 	struct CACHED_GENERIC *free_entry;
 	struct HASH_ENTRY *free_hash;
 	struct HASH_ENTRY **first_hash;
+	struct HASH_ENTRY *free_hash2;
+	struct HASH_ENTRY **first_hash2;
 	cache_free dofree;
 	cache_hash dohash;
+	cache_hash dohash2;
 	unsigned long reads;
 	unsigned long writes;
 	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;	/* entries dropped to meet the budget */
+	size_t fixed_mem;	/* memory allocated when creating */
+	size_t mem_used;	/* memory currently used */
+	size_t entry_extra;	/* memory held by an entry, out of variable */
+	int item_count;
+	int protected_count;
 	int fixed_size;
 	int max_hash;
 	struct CACHED_GENERIC entry[0];
@@ -111,7 +156,19 @@ int ntfs_invalidate_cache(struct CACHE_HEADER *cache,
 int ntfs_remove_cache(struct CACHE_HEADER *cache,
 			struct CACHED_GENERIC *item, int flags);
 
+void ntfs_cache_mem_update(ntfs_volume *vol, s64 delta);
+BOOL ntfs_cache_mem_allowed(ntfs_volume *vol, size_t size);
+
+struct CACHE_POOL *ntfs_cache_pool_create(u64 budget);
+void ntfs_cache_pool_join(struct CACHE_POOL *pool, ntfs_volume *vol);
+void ntfs_cache_pool_leave(ntfs_volume *vol);
+s64 ntfs_cache_pool_trim(ntfs_volume *vol);
+u64 ntfs_cache_pool_used(const struct CACHE_POOL *pool);
+void ntfs_cache_pool_free(struct CACHE_POOL *pool);
+
 void ntfs_create_lru_caches(ntfs_volume *vol);
+int ntfs_resize_lru_caches(ntfs_volume *vol, int inode_size,
+			int nidata_size, int lookup_size);
 void ntfs_free_lru_caches(ntfs_volume *vol);
 
 #endif /* _NTFS_CACHE_H_ */
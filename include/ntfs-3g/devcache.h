@@ -0,0 +1,33 @@
+/*
+ * devcache.h : block cache in front of a device
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _NTFS_DEVCACHE_H_
+#define _NTFS_DEVCACHE_H_
+
+#include "types.h"
+#include "device.h"
+
+int ntfs_devcache_attach(struct ntfs_device *dev, s64 size, BOOL writeback);
+int ntfs_devcache_flush(struct ntfs_device *dev);
+int ntfs_devcache_flush_range(struct ntfs_device *dev, s64 pos, s64 count);
+int ntfs_devcache_sync_lower(struct ntfs_device *dev);
+struct ntfs_device_operations *ntfs_devcache_lower_ops(
+			struct ntfs_device *dev);
+
+#endif /* _NTFS_DEVCACHE_H_ */
@@ -43,6 +43,7 @@ typedef enum {
 	ND_Dirty,	/* 1: Device is dirty, needs sync. */
 	ND_Block,	/* 1: Device is a block device. */
 	ND_Sync,	/* 1: Device is mounted with "-o sync" */
+	ND_Direct,	/* 1: Device is opened with O_DIRECT */
 } ntfs_device_state_bits;
 
 #define  test_ndev_flag(nd, flag)	   test_bit(ND_##flag, (nd)->d_state)
@@ -69,6 +70,10 @@ typedef enum {
 #define NDevSetSync(nd)		  set_ndev_flag(nd, Sync)
 #define NDevClearSync(nd)	clear_ndev_flag(nd, Sync)
 
+#define NDevDirect(nd)		 test_ndev_flag(nd, Direct)
+#define NDevSetDirect(nd)	  set_ndev_flag(nd, Direct)
+#define NDevClearDirect(nd)	clear_ndev_flag(nd, Direct)
+
 /**
  * struct ntfs_device -
  *
@@ -90,10 +95,35 @@ struct ntfs_device {
 						   heads or -1. */
 	int d_sectors_per_track;		/* Disk geometry: number of
 						   sectors per track or -1. */
+	struct DEVICE_CACHE *d_cache;		/* Block cache inserted in
+						   front of the operations
+						   or NULL. */
+	struct DEVICE_TRACE *d_trace;		/* Trace of the transfers
+						   or NULL. */
+	u64 d_reads;				/* Statistics: number of
+						   positioned reads. */
+	u64 d_read_bytes;			/* Statistics: bytes read. */
+	u64 d_writes;				/* Statistics: number of
+						   positioned writes. */
+	u64 d_written_bytes;			/* Statistics: bytes
+						   written. */
 };
 
 struct stat;
 
+/**
+ * struct ntfs_device_io - a transfer within a batch
+ *
+ * The result of the transfer is set in @res : the number of bytes
+ * transferred, or a negated error code.
+ */
+struct ntfs_device_io {
+	void *buf;
+	s64 count;
+	s64 pos;
+	s64 res;
+} ;
+
 /**
  * struct ntfs_device_operations -
  *
@@ -112,6 +142,11 @@ struct ntfs_device_operations {
 	int (*sync)(struct ntfs_device *dev);
 	int (*stat)(struct ntfs_device *dev, struct stat *buf);
 	int (*ioctl)(struct ntfs_device *dev, int request, void *argp);
+		/* optional, issue all the transfers before waiting */
+	int (*pread_batch)(struct ntfs_device *dev,
+			struct ntfs_device_io *ios, int count);
+	int (*pwrite_batch)(struct ntfs_device *dev,
+			struct ntfs_device_io *ios, int count);
 };
 
 extern struct ntfs_device *ntfs_device_alloc(const char *name, const long state,
@@ -124,6 +159,11 @@ extern s64 ntfs_pread(struct ntfs_device *dev, const s64 pos, s64 count,
 extern s64 ntfs_pwrite(struct ntfs_device *dev, const s64 pos, s64 count,
 		const void *b);
 
+extern int ntfs_pread_batch(struct ntfs_device *dev,
+		struct ntfs_device_io *ios, int count);
+extern int ntfs_pwrite_batch(struct ntfs_device *dev,
+		struct ntfs_device_io *ios, int count);
+
 extern s64 ntfs_mst_pread(struct ntfs_device *dev, const s64 pos, s64 count,
 		const u32 bksize, void *b);
 extern s64 ntfs_mst_pwrite(struct ntfs_device *dev, const s64 pos, s64 count,
@@ -140,5 +180,7 @@ extern int ntfs_device_heads_get(struct ntfs_device *dev);
 extern int ntfs_device_sectors_per_track_get(struct ntfs_device *dev);
 extern int ntfs_device_sector_size_get(struct ntfs_device *dev);
 extern int ntfs_device_block_size_set(struct ntfs_device *dev, int block_size);
+extern int ntfs_device_io_size_get(struct ntfs_device *dev);
+extern int ntfs_device_fd_get(struct ntfs_device *dev);
 
 #endif /* defined _NTFS_DEVICE_H */
@@ -39,6 +39,13 @@
 /* Not for Windows use standard Unix style low level device operations. */
 #define ntfs_device_default_io_ops ntfs_device_unix_io_ops
 
+/* Read-only devices and images may be mapped in memory. */
+#ifdef HAVE_SYS_MMAN_H
+#define ntfs_device_mmap_io_ops ntfs_device_unix_mmap_io_ops
+#else
+#define ntfs_device_mmap_io_ops ntfs_device_unix_io_ops
+#endif
+
 #else /* HAVE_WINDOWS_H */
 
 #ifndef HDIO_GETGEO
@@ -68,6 +75,7 @@ struct hd_geometry {
 
 /* On Windows (and Cygwin) : use Win32 low level device operations. */
 #define ntfs_device_default_io_ops ntfs_device_win32_io_ops
+#define ntfs_device_mmap_io_ops ntfs_device_win32_io_ops
 
 /* A few useful functions */
 int ntfs_win32_set_sparse(int);
@@ -81,6 +89,7 @@ int ntfs_device_win32_ftruncate(struct ntfs_device*, s64);
 struct ntfs_device_operations;
 
 extern struct ntfs_device_operations ntfs_device_default_io_ops;
+extern struct ntfs_device_operations ntfs_device_mmap_io_ops;
 
 #endif /* NO_NTFS_DEVICE_DEFAULT_IO_OPS */
 
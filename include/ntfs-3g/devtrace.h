@@ -0,0 +1,77 @@
+/*
+ * devtrace.h : tracing of the transfers on a device
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _NTFS_DEVTRACE_H_
+#define _NTFS_DEVTRACE_H_
+
+#include "types.h"
+#include "device.h"
+
+/*
+ *	Categories of the callers, recorded with each transfer
+ */
+
+enum {
+	NTFS_IO_OTHER,		/* boot sector, direct accesses... */
+	NTFS_IO_MFT,		/* MFT records and their mirror */
+	NTFS_IO_BITMAP,		/* cluster and MFT record bitmaps */
+	NTFS_IO_INDEX,		/* directory and view indexes */
+	NTFS_IO_LOG,		/* Windows journal */
+	NTFS_IO_DATA,		/* file data and other attributes */
+	NTFS_IO_CATEGORIES
+} ;
+
+enum {
+	NTFS_IOTRACE_READ = 'R',
+	NTFS_IOTRACE_WRITE = 'W'
+} ;
+
+#define NTFS_IOTRACE_MAGIC "NTFSIOT1"
+
+/*
+ *	A trace file is made of a header followed by records, all
+ *	numbers are little endian.
+ */
+
+struct NTFS_IOTRACE_HEADER {
+	char magic[8];		/* NTFS_IOTRACE_MAGIC */
+	le32 record_size;	/* size of the records which follow */
+	le32 reserved;
+	le64 start;		/* start of trace, seconds since 1970 */
+} __attribute__((__packed__)) ;
+
+struct NTFS_IOTRACE_RECORD {
+	le64 time;		/* microseconds from the start of trace */
+	le64 pos;		/* byte position on the device */
+	le32 count;		/* bytes requested */
+	le32 duration;		/* microseconds */
+	u8 op;			/* NTFS_IOTRACE_READ or _WRITE */
+	u8 category;		/* NTFS_IO_* */
+	u8 failed;		/* nonzero if not fully transferred */
+	u8 reserved[5];
+} __attribute__((__packed__)) ;
+
+int ntfs_devtrace_attach(struct ntfs_device *dev, const char *path);
+int ntfs_devtrace_detach(struct ntfs_device *dev);
+int ntfs_devtrace_category(int category);
+s64 ntfs_devtrace_time(void);
+void ntfs_devtrace_record(struct ntfs_device *dev, int op, s64 pos,
+			s64 count, s64 start, BOOL failed);
+
+#endif /* _NTFS_DEVTRACE_H_ */
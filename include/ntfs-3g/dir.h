@@ -78,9 +78,15 @@ extern int ntfs_check_empty_dir(ntfs_inode *ni);
 extern int ntfs_delete(ntfs_volume *vol, const char *path,
 		ntfs_inode *ni, ntfs_inode *dir_ni, const ntfschar *name,
 		u8 name_len);
+extern int ntfs_delete_tree(ntfs_inode *ni, ntfs_inode *dir_ni,
+		BOOL (*busy)(void *data, u64 mft_no), void *data, u64 *count);
 
 extern int ntfs_link(ntfs_inode *ni, ntfs_inode *dir_ni, const ntfschar *name,
 		u8 name_len);
+extern int ntfs_rename(ntfs_volume *vol, const char *path, ntfs_inode *ni,
+		ntfs_inode *old_dir_ni, const ntfschar *old_name,
+		u8 old_name_len, ntfs_inode *new_dir_ni,
+		const ntfschar *new_name, u8 new_name_len);
 
 /*
  * File types (adapted from include <linux/fs.h>)
@@ -122,6 +128,8 @@ struct CACHED_GENERIC;
 
 extern int ntfs_dir_inode_hash(const struct CACHED_GENERIC *cached);
 extern int ntfs_dir_lookup_hash(const struct CACHED_GENERIC *cached);
+extern int ntfs_dir_inode_num_hash(const struct CACHED_GENERIC *cached);
+extern int ntfs_dir_lookup_parent_hash(const struct CACHED_GENERIC *cached);
 
 #endif
 
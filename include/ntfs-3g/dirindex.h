@@ -0,0 +1,39 @@
+/*
+ * dirindex.h : in-memory indexes of hot directories
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _NTFS_DIRINDEX_H_
+#define _NTFS_DIRINDEX_H_
+
+#include "types.h"
+#include "layout.h"
+#include "volume.h"
+#include "inode.h"
+
+int ntfs_dirindex_attach(ntfs_volume *vol, s64 budget);
+int ntfs_dirindex_detach(ntfs_volume *vol);
+void ntfs_dirindex_log(const ntfs_volume *vol);
+
+BOOL ntfs_dirindex_lookup(ntfs_inode *dir_ni, const ntfschar *uname,
+			int uname_len, u64 *pmref);
+void ntfs_dirindex_add(ntfs_inode *dir_ni, const FILE_NAME_ATTR *fn,
+			u64 mref);
+void ntfs_dirindex_remove(ntfs_inode *dir_ni, const FILE_NAME_ATTR *fn);
+void ntfs_dirindex_invalidate(ntfs_inode *dir_ni);
+
+#endif /* _NTFS_DIRINDEX_H_ */
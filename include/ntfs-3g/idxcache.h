@@ -0,0 +1,39 @@
+/*
+ * idxcache.h : write-back cache of index blocks
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _NTFS_IDXCACHE_H_
+#define _NTFS_IDXCACHE_H_
+
+#include "types.h"
+#include "attrib.h"
+#include "volume.h"
+
+int ntfs_idxcache_attach(ntfs_volume *vol, int count);
+int ntfs_idxcache_flush(const ntfs_volume *vol);
+int ntfs_idxcache_flush_inode(const ntfs_volume *vol, u64 mft_no);
+int ntfs_idxcache_detach(ntfs_volume *vol);
+void ntfs_idxcache_log(const ntfs_volume *vol);
+
+BOOL ntfs_idxcache_get(ntfs_attr *na, s64 pos, s64 count,
+			u32 bk_size, void *b);
+int ntfs_idxcache_defer(ntfs_attr *na, s64 pos, s64 count,
+			u32 bk_size, const void *b);
+void ntfs_idxcache_forget(const ntfs_volume *vol, LCN lcn, s64 count);
+
+#endif /* _NTFS_IDXCACHE_H_ */
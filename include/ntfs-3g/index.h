@@ -86,6 +86,10 @@ typedef int (*COLLATE)(ntfs_volume *vol, const void *data1, int len1,
  * @ib_dirty:		TRUE if index block was changed
  * @block_size:		index block size
  * @vcn_size_bits:	VCN size bits for this index block
+ * @collation_rule:	collation rule of the index, set with @collate
+ * @entries:		locations of the entries of the node being searched
+ * @max_entries:	count of locations @entries can hold
+ * @deferred:		index blocks whose writing is deferred, or NULL
  *
  * @ni is the inode this context belongs to.
  *
@@ -111,6 +115,9 @@ typedef int (*COLLATE)(ntfs_volume *vol, const void *data1, int len1,
  * If the index entry was modified, call ntfs_index_entry_mark_dirty() before
  * the call to ntfs_index_ctx_put() to ensure that the changes are written
  * to disk.
+ *
+ * When @deferred is set, the index blocks written are kept in memory and
+ * read back from there, until they are flushed by the owner of @deferred.
  */
 typedef struct {
 	ntfs_inode *ni;
@@ -120,6 +127,7 @@ typedef struct {
 	void *data;
 	u16 data_len;
 	COLLATE collate;
+	COLLATION_RULES collation_rule;
 	BOOL is_in_root;
 	INDEX_ROOT *ir;
 	ntfs_attr_search_ctx *actx;
@@ -131,12 +139,25 @@ typedef struct {
 	BOOL ib_dirty;
 	u32 block_size;
 	u8 vcn_size_bits;
+	INDEX_ENTRY **entries;
+	int max_entries;
+	struct DEFERRED_BLOCKS *deferred;
 } ntfs_index_context;
 
+typedef struct _ntfs_index_batch ntfs_index_batch;
+
 extern ntfs_index_context *ntfs_index_ctx_get(ntfs_inode *ni,
 						ntfschar *name, u32 name_len);
 extern void ntfs_index_ctx_put(ntfs_index_context *ictx);
 extern void ntfs_index_ctx_reinit(ntfs_index_context *ictx);
+extern void ntfs_index_pool_release(ntfs_volume *vol);
+
+extern ntfs_attr *ntfs_index_ia_open(ntfs_inode *ni,
+						ntfschar *name, u32 name_len);
+extern void ntfs_index_ia_close(ntfs_attr *na);
+extern INDEX_BLOCK *ntfs_index_buffer_get(ntfs_volume *vol, u32 size);
+extern void ntfs_index_buffer_put(ntfs_volume *vol, INDEX_BLOCK *ib,
+						u32 size);
 
 extern int ntfs_index_lookup(const void *key, const int key_len,
 		ntfs_index_context *ictx) __attribute_warn_unused_result__;
@@ -144,14 +165,30 @@ extern int ntfs_index_lookup(const void *key, const int key_len,
 extern INDEX_ENTRY *ntfs_index_next(INDEX_ENTRY *ie,
 		ntfs_index_context *ictx);
 
+struct INDEX_SCAN;
+
+extern struct INDEX_SCAN *ntfs_index_scan_start(ntfs_inode *ni,
+		ntfschar *name, u32 name_len);
+extern BOOL ntfs_index_scan_next(struct INDEX_SCAN *scan, INDEX_ENTRY **pie);
+extern int ntfs_index_scan_end(struct INDEX_SCAN *scan);
+extern s64 ntfs_index_rebuild(ntfs_inode *ni, ntfschar *name, u32 name_len,
+		s64 *before, BOOL count_only);
+
 extern int ntfs_index_add_filename(ntfs_inode *ni, FILE_NAME_ATTR *fn,
 		MFT_REF mref);
+extern ntfs_index_batch *ntfs_index_batch_get(ntfs_inode *dir_ni);
+extern int ntfs_index_batch_add(ntfs_index_batch *batch,
+		const FILE_NAME_ATTR *fn, MFT_REF mref);
+extern int ntfs_index_batch_commit(ntfs_index_batch *batch);
 extern int ntfs_index_remove(ntfs_inode *dir_ni, ntfs_inode *ni,
 		const void *key, const int keylen);
 
 extern INDEX_ROOT *ntfs_index_root_get(ntfs_inode *ni, ATTR_RECORD *attr);
 
 extern VCN ntfs_ie_get_vcn(INDEX_ENTRY *ie);
+extern int ntfs_ie_table_size(INDEX_HEADER *ih, const u8 *index_end);
+extern int ntfs_ie_table(INDEX_HEADER *ih, const u8 *index_end,
+			INDEX_ENTRY **table, int max);
 
 extern void ntfs_index_entry_mark_dirty(ntfs_index_context *ictx);
 
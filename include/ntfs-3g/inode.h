@@ -27,6 +27,7 @@
 
 /* Forward declaration */
 typedef struct _ntfs_inode ntfs_inode;
+struct ATTRLIST_INDEX;
 
 #include "types.h"
 #include "layout.h"
@@ -52,6 +53,10 @@ typedef enum {
 	NI_v3_Extensions,	/* 1: JPA v3.x extensions present. */
 	NI_TimesSet,		/* 1: Use times which were set */
 	NI_KnownSize,		/* 1: Set if sizes are meaningful */
+	NI_EmbeddedRecord,	/* 1: Allocated with room for the mft record,
+				      see inode.c */
+	NI_TimesOnlyDirty,	/* 1: Mft record only dirty for its times,
+				      meaningful when NI_Dirty is set */
 } ntfs_inode_state_bits;
 
 #define  test_nino_flag(ni, flag)	   test_bit(NI_##flag, (ni)->state)
@@ -64,7 +69,8 @@ typedef enum {
 				 test_and_clear_bit(NI_##flag, (ni)->state)
 
 #define NInoDirty(ni)				  test_nino_flag(ni, Dirty)
-#define NInoSetDirty(ni)			   set_nino_flag(ni, Dirty)
+#define NInoSetDirty(ni)	(clear_nino_flag(ni, TimesOnlyDirty), \
+					set_nino_flag(ni, Dirty))
 #define NInoClearDirty(ni)			 clear_nino_flag(ni, Dirty)
 #define NInoTestAndSetDirty(ni)		  test_and_set_nino_flag(ni, Dirty)
 #define NInoTestAndClearDirty(ni)	test_and_clear_nino_flag(ni, Dirty)
@@ -73,6 +79,12 @@ typedef enum {
 #define NInoSetAttrList(ni)			   set_nino_flag(ni, AttrList)
 #define NInoClearAttrList(ni)			 clear_nino_flag(ni, AttrList)
 
+#define NInoTimesOnlyDirty(ni)		  test_nino_flag(ni, TimesOnlyDirty)
+#define NInoSetTimesOnlyDirty(ni)	   set_nino_flag(ni, TimesOnlyDirty)
+
+#define NInoEmbeddedRecord(ni)		  test_nino_flag(ni, EmbeddedRecord)
+#define NInoSetEmbeddedRecord(ni)	   set_nino_flag(ni, EmbeddedRecord)
+
 
 #define  test_nino_al_flag(ni, flag)	 test_nino_flag(ni, AttrList##flag)
 #define   set_nino_al_flag(ni, flag)	  set_nino_flag(ni, AttrList##flag)
@@ -103,6 +115,8 @@ typedef enum {
  * It is just used as an extension to the fields already provided in the VFS
  * inode.
  */
+#define NTFS_KEPT_STREAMS 4	/* named data streams kept open per inode */
+
 struct _ntfs_inode {
 	u64 mft_no;		/* Inode / mft record number. */
 	MFT_RECORD *mrec;	/* The actual mft record of the inode. */
@@ -118,6 +132,9 @@ struct _ntfs_inode {
 	 */
 	u32 attr_list_size;	/* Length of attribute list value in bytes. */
 	u8 *attr_list;		/* Attribute list value itself. */
+	struct ATTRLIST_INDEX *attr_list_index; /* Index over a long
+				   attribute list, NULL until needed
+				   (see attrlist.c). */
 	/* Below fields are always valid. */
 	s32 nr_extents;		/* For a base mft record, the number of
 				   attached extent inodes (0 if none), for
@@ -164,6 +181,25 @@ struct _ntfs_inode {
 	le32 security_id;
 	le64 quota_charged;
 	le64 usn;
+				/* For a held base inode only */
+	s32 open_count;		/* Count of openings not closed yet, 0 when
+				   the inode is not held. */
+	ntfs_inode *next_held;	/* Next inode in the list of held inodes. */
+				/* For a directory only */
+	struct _ntfs_attr *index_na; /* Open $I30 index allocation, kept for
+				   the next index context (see index.c). */
+	s32 index_users;	/* Count of $I30 index allocations in use. */
+	BOOL index_overlap;	/* Several of them were in use at once. */
+				/* For a base inode only */
+	char *stream_names;	/* Names of the named data streams, kept
+				   until one is added or removed, NULL
+				   if not known (see xattrs.c). */
+	s32 stream_names_size;	/* Size of the list of names. */
+	struct _ntfs_attr *kept_streams[NTFS_KEPT_STREAMS]; /* Named data
+				   streams kept open for the next access
+				   (see ntfs_stream_open()). */
+	le32 usn_reasons;	/* USN_REASON_* of the changes since the
+				   file was opened (see usnjrnl.c). */
 };
 
 typedef enum {
@@ -178,12 +214,19 @@ typedef enum {
 extern ntfs_inode *ntfs_inode_base(ntfs_inode *ni);
 
 extern ntfs_inode *ntfs_inode_allocate(ntfs_volume *vol);
+extern void ntfs_inode_pool_release(ntfs_volume *vol);
 
 extern ntfs_inode *ntfs_inode_open(ntfs_volume *vol, const MFT_REF mref);
 
+extern void ntfs_inode_hold(ntfs_inode *ni);
+
 extern int ntfs_inode_close(ntfs_inode *ni);
 extern int ntfs_inode_close_in_dir(ntfs_inode *ni, ntfs_inode *dir_ni);
 
+extern int ntfs_inode_defer_file_names(ntfs_volume *vol, int delay);
+extern int ntfs_inode_flush_file_names(ntfs_volume *vol, BOOL force);
+extern BOOL ntfs_inode_file_names_pending(const ntfs_volume *vol);
+
 #if CACHE_NIDATA_SIZE
 
 struct CACHED_GENERIC;
@@ -196,6 +239,7 @@ extern int ntfs_inode_nidata_hash(const struct CACHED_GENERIC *item);
 #endif
 
 
+extern int ntfs_inode_attach_extent(ntfs_inode *base_ni, ntfs_inode *ni);
 extern ntfs_inode *ntfs_extent_inode_open(ntfs_inode *base_ni,
 		const leMFT_REF mref);
 
@@ -206,6 +250,7 @@ extern void ntfs_inode_mark_dirty(ntfs_inode *ni);
 extern void ntfs_inode_update_times(ntfs_inode *ni, ntfs_time_update_flags mask);
 
 extern int ntfs_inode_sync(ntfs_inode *ni);
+extern int ntfs_inode_fsync(ntfs_inode *ni, BOOL datasync);
 
 extern int ntfs_inode_add_attrlist(ntfs_inode *ni);
 
@@ -26,5 +26,59 @@
 
 int ntfs_ioctl(ntfs_inode *ni, int cmd, void *arg,
                         unsigned int flags, void *data);
+int ntfs_fstrim(ntfs_volume *vol, void *data);
+
+void ntfs_discard_queue(ntfs_volume *vol, LCN lcn, s64 count);
+int ntfs_discard_start(ntfs_volume *vol);
+void ntfs_discard_stop(ntfs_volume *vol);
+
+/*
+ *	Deletion of a directory tree, issued on its parent directory
+ *	(see ntfs_delete_tree()). The count of deleted inodes is returned.
+ *	Defined when the includer has the ioctl encoding macros.
+ */
+
+#define NTFS_RMTREE_NAME_MAX 1024
+
+struct NTFS_RMTREE {
+	u64 count;			/* inodes deleted, returned */
+	char name[NTFS_RMTREE_NAME_MAX]; /* name in the parent directory */
+} ;
+
+/*
+ *	Defragmentation of the data of a file, or of the index of a
+ *	directory (see ntfs_attr_defragment()). The counts of fragments
+ *	before and after are returned, and with NTFS_DEFRAG_COUNT the
+ *	fragments are only counted.
+ */
+
+#define NTFS_DEFRAG_COUNT 1
+
+struct NTFS_DEFRAG {
+	u64 flags;			/* NTFS_DEFRAG_COUNT or zero */
+	u64 before;			/* fragments before, returned */
+	u64 after;			/* fragments after, returned */
+} ;
+
+/*
+ *	Rebuilding of the index of a directory into fully filled blocks
+ *	(see ntfs_index_rebuild()). The counts of index blocks before and
+ *	after are returned, and with NTFS_REINDEX_COUNT the index is not
+ *	modified, and the count it would be rebuilt into is returned.
+ */
+
+#define NTFS_REINDEX_COUNT 1
+
+struct NTFS_REINDEX {
+	u64 flags;			/* NTFS_REINDEX_COUNT or zero */
+	u64 before;			/* index blocks before, returned */
+	u64 after;			/* index blocks after, returned */
+} ;
+
+#ifdef _IOWR
+#define NTFS_IOC_RMTREE _IOWR('n', 0x80, struct NTFS_RMTREE)
+#define NTFS_IOC_DEFRAG _IOWR('n', 0x81, struct NTFS_DEFRAG)
+#define NTFS_IOC_REINDEX _IOWR('n', 0x82, struct NTFS_REINDEX)
+#endif
 
 #endif /* IOCTL_H */
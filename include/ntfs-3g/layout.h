@@ -2663,4 +2663,85 @@ typedef struct {
 	} __attribute__((__packed__));
 } __attribute__((__packed__)) INTX_FILE;
 
+/*
+ * The change journal FILE_Extend/$UsnJrnl. Its named data stream $J is a
+ * sparse log of USN_RECORD, each identified by its offset in the stream,
+ * its update sequence number (usn). The oldest records are discarded by
+ * deallocating the beginning of the stream. Its named data stream $Max
+ * describes the journal.
+ */
+
+/**
+ * enum USN_REASONS - Reasons for a change, as recorded in a USN_RECORD.
+ *
+ * The reasons accumulate in the records of a file until it is closed, the
+ * last record for a set of changes having USN_REASON_CLOSE.
+ */
+typedef enum {
+	USN_REASON_DATA_OVERWRITE	= const_cpu_to_le32(0x00000001),
+	USN_REASON_DATA_EXTEND		= const_cpu_to_le32(0x00000002),
+	USN_REASON_DATA_TRUNCATION	= const_cpu_to_le32(0x00000004),
+	USN_REASON_NAMED_DATA_OVERWRITE	= const_cpu_to_le32(0x00000010),
+	USN_REASON_NAMED_DATA_EXTEND	= const_cpu_to_le32(0x00000020),
+	USN_REASON_NAMED_DATA_TRUNCATION = const_cpu_to_le32(0x00000040),
+	USN_REASON_FILE_CREATE		= const_cpu_to_le32(0x00000100),
+	USN_REASON_FILE_DELETE		= const_cpu_to_le32(0x00000200),
+	USN_REASON_EA_CHANGE		= const_cpu_to_le32(0x00000400),
+	USN_REASON_SECURITY_CHANGE	= const_cpu_to_le32(0x00000800),
+	USN_REASON_RENAME_OLD_NAME	= const_cpu_to_le32(0x00001000),
+	USN_REASON_RENAME_NEW_NAME	= const_cpu_to_le32(0x00002000),
+	USN_REASON_INDEXABLE_CHANGE	= const_cpu_to_le32(0x00004000),
+	USN_REASON_BASIC_INFO_CHANGE	= const_cpu_to_le32(0x00008000),
+	USN_REASON_HARD_LINK_CHANGE	= const_cpu_to_le32(0x00010000),
+	USN_REASON_COMPRESSION_CHANGE	= const_cpu_to_le32(0x00020000),
+	USN_REASON_ENCRYPTION_CHANGE	= const_cpu_to_le32(0x00040000),
+	USN_REASON_OBJECT_ID_CHANGE	= const_cpu_to_le32(0x00080000),
+	USN_REASON_REPARSE_POINT_CHANGE	= const_cpu_to_le32(0x00100000),
+	USN_REASON_STREAM_CHANGE	= const_cpu_to_le32(0x00200000),
+	USN_REASON_TRANSACTED_CHANGE	= const_cpu_to_le32(0x00400000),
+	USN_REASON_INTEGRITY_CHANGE	= const_cpu_to_le32(0x00800000),
+	USN_REASON_CLOSE		= const_cpu_to_le32(0x80000000),
+} __attribute__((__packed__)) USN_REASONS;
+
+/**
+ * struct USN_RECORD - Record of the change journal, version 2.0.
+ *
+ * Records are aligned to 8 bytes, and the space left at the end of a
+ * journal page (USN_PAGE_SIZE bytes) is filled with zeroes. Versions 3.0 (128-bit file
+ * references) and 4.0 (ranges of changes) are not described here.
+ */
+typedef struct {
+/*  0*/	le32 record_length;		/* Byte size of this record, a
+					   multiple of 8. */
+/*  4*/	le16 major_version;		/* 2 for this layout. */
+/*  6*/	le16 minor_version;		/* 0 for this layout. */
+/*  8*/	leMFT_REF file_reference;	/* The file changed. */
+/* 16*/	leMFT_REF parent_reference;	/* Its parent directory. */
+/* 24*/	sle64 usn;			/* Offset of this record in $J. */
+/* 32*/	sle64 timestamp;		/* Time of the change, NTFS time. */
+/* 40*/	USN_REASONS reason;		/* Reasons accumulated so far. */
+/* 44*/	le32 source_info;		/* Flags describing the origin of
+					   the change. */
+/* 48*/	le32 security_id;		/* Security id of the file. */
+/* 52*/	FILE_ATTR_FLAGS file_attributes; /* Attributes of the file. */
+/* 56*/	le16 file_name_length;		/* Byte size of the name. */
+/* 58*/	le16 file_name_offset;		/* Offset of the name from the
+					   start of this record. */
+/* 60*/	ntfschar file_name[0];		/* Name within the parent. */
+} __attribute__((__packed__)) USN_RECORD;
+
+#define USN_PAGE_SIZE 4096	/* Records do not cross such boundaries. */
+
+/**
+ * struct USN_JOURNAL_MAX - Contents of $UsnJrnl:$Max.
+ */
+typedef struct {
+/*  0*/	sle64 maximum_size;		/* Size of $J before its oldest
+					   records are discarded. */
+/*  8*/	sle64 allocation_delta;		/* Size discarded at once. */
+/* 16*/	le64 journal_id;		/* Identifier of this journal, its
+					   creation time. */
+/* 24*/	sle64 lowest_valid_usn;		/* Oldest record still present. */
+} __attribute__((__packed__)) USN_JOURNAL_MAX;
+
 #endif /* defined _NTFS_LAYOUT_H */
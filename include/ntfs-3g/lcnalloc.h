@@ -40,6 +40,9 @@ typedef enum {
 
 extern runlist *ntfs_cluster_alloc(ntfs_volume *vol, VCN start_vcn, s64 count,
 		LCN start_lcn, const NTFS_CLUSTER_ALLOCATION_ZONES zone);
+extern int ntfs_cluster_stripe_set(ntfs_volume *vol, s64 size);
+extern LCN ntfs_cluster_find_free(ntfs_volume *vol, s64 count,
+		s64 *length);
 
 extern int ntfs_cluster_free_from_rl(ntfs_volume *vol, runlist *rl);
 extern int ntfs_cluster_free_basic(ntfs_volume *vol, s64 lcn, s64 count);
@@ -47,5 +50,15 @@ extern int ntfs_cluster_free_basic(ntfs_volume *vol, s64 lcn, s64 count);
 extern int ntfs_cluster_free(ntfs_volume *vol, ntfs_attr *na, VCN start_vcn,
 		s64 count);
 
+extern void ntfs_cluster_summary_update(ntfs_volume *vol, LCN lcn, s64 count,
+		BOOL used);
+extern void ntfs_cluster_summary_release(ntfs_volume *vol);
+extern void ntfs_cluster_windows_release(ntfs_volume *vol);
+
+extern int ntfs_cluster_count_free(ntfs_volume *vol);
+extern void ntfs_cluster_count_start(ntfs_volume *vol);
+extern BOOL ntfs_cluster_count_done(const ntfs_volume *vol);
+extern void ntfs_cluster_count_stop(ntfs_volume *vol);
+
 #endif /* defined _NTFS_LCNALLOC_H */
 
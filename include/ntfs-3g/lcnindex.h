@@ -0,0 +1,58 @@
+/*
+ * lcnindex.h : index of the owners of the clusters of a volume
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _NTFS_LCNINDEX_H_
+#define _NTFS_LCNINDEX_H_
+
+#include "types.h"
+#include "layout.h"
+#include "volume.h"
+
+/*
+ *		A run of clusters and the attribute it belongs to
+ */
+
+struct LCN_INDEX_ENTRY {
+	LCN lcn;		/* first cluster of the run */
+	s64 length;		/* count of clusters */
+	VCN vcn;		/* of the first cluster in the attribute */
+	MFT_REF mref;		/* base inode of the attribute */
+	ATTR_TYPES type;
+	u32 name;		/* offset of the attribute name in the pool */
+	u32 name_len;
+} ;
+
+struct LCN_INDEX;
+
+typedef int (*ntfs_lcnindex_func)(const struct LCN_INDEX *index,
+		const struct LCN_INDEX_ENTRY *entry, LCN begin, LCN end,
+		void *arg);
+
+struct LCN_INDEX *ntfs_lcnindex_build(ntfs_volume *vol, int threads);
+struct LCN_INDEX *ntfs_lcnindex_load(ntfs_volume *vol, const char *path);
+int ntfs_lcnindex_save(const struct LCN_INDEX *index, const char *path);
+void ntfs_lcnindex_free(struct LCN_INDEX *index);
+
+s64 ntfs_lcnindex_count(const struct LCN_INDEX *index);
+const ntfschar *ntfs_lcnindex_name(const struct LCN_INDEX *index,
+		const struct LCN_INDEX_ENTRY *entry);
+int ntfs_lcnindex_query(const struct LCN_INDEX *index, LCN begin, LCN end,
+		ntfs_lcnindex_func func, void *arg);
+
+#endif /* _NTFS_LCNINDEX_H_ */
@@ -0,0 +1,47 @@
+/*
+ * lock.h : locks for concurrent access to a volume
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _NTFS_LOCK_H_
+#define _NTFS_LOCK_H_
+
+#include "volume.h"
+#include "inode.h"
+
+int ntfs_create_locks(ntfs_volume *vol);
+void ntfs_free_locks(ntfs_volume *vol);
+
+void ntfs_volume_lock_shared(ntfs_volume *vol);
+void ntfs_volume_lock_exclusive(ntfs_volume *vol);
+void ntfs_volume_unlock(ntfs_volume *vol);
+
+void ntfs_cache_lock(ntfs_volume *vol);
+void ntfs_cache_unlock(ntfs_volume *vol);
+
+void ntfs_security_lock(ntfs_volume *vol);
+void ntfs_security_unlock(ntfs_volume *vol);
+
+void ntfs_cluster_alloc_lock(ntfs_volume *vol);
+void ntfs_cluster_alloc_unlock(ntfs_volume *vol);
+void ntfs_mft_alloc_lock(ntfs_volume *vol);
+void ntfs_mft_alloc_unlock(ntfs_volume *vol);
+
+void ntfs_inode_lock(ntfs_inode *ni);
+void ntfs_inode_unlock(ntfs_inode *ni);
+
+#endif /* _NTFS_LOCK_H_ */
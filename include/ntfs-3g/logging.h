@@ -50,6 +50,7 @@ ntfs_log_handler ntfs_log_handler_outerr  __attribute__((format(printf, 6, 0)));
 ntfs_log_handler ntfs_log_handler_stderr  __attribute__((format(printf, 6, 0)));
 
 /* Enable/disable certain log levels */
+extern u32 ntfs_log_levels;
 u32 ntfs_log_set_levels(u32 levels);
 u32 ntfs_log_clear_levels(u32 levels);
 u32 ntfs_log_get_levels(void);
@@ -99,14 +100,17 @@ int ntfs_log_redirect(const char *function, const char *file, int line,
 #define ntfs_log_verbose(FORMAT, ARGS...) ntfs_log_redirect(__FUNCTION__,__FILE__,__LINE__,NTFS_LOG_LEVEL_VERBOSE,NULL,FORMAT,##ARGS)
 #define ntfs_log_warning(FORMAT, ARGS...) ntfs_log_redirect(__FUNCTION__,__FILE__,__LINE__,NTFS_LOG_LEVEL_WARNING,NULL,FORMAT,##ARGS)
 
-/* By default debug and trace messages are compiled into the program,
- * but not displayed.
+/* With DEBUG defined, debug and trace messages are compiled into the
+ * program, and the level is checked inline, so that the hot paths do
+ * not pay for a call when the level is not enabled. Otherwise they
+ * are compiled out.
  */
 #ifdef DEBUG
-#define ntfs_log_debug(FORMAT, ARGS...) ntfs_log_redirect(__FUNCTION__,__FILE__,__LINE__,NTFS_LOG_LEVEL_DEBUG,NULL,FORMAT,##ARGS)
-#define ntfs_log_trace(FORMAT, ARGS...) ntfs_log_redirect(__FUNCTION__,__FILE__,__LINE__,NTFS_LOG_LEVEL_TRACE,NULL,FORMAT,##ARGS)
-#define ntfs_log_enter(FORMAT, ARGS...) ntfs_log_redirect(__FUNCTION__,__FILE__,__LINE__,NTFS_LOG_LEVEL_ENTER,NULL,FORMAT,##ARGS)
-#define ntfs_log_leave(FORMAT, ARGS...) ntfs_log_redirect(__FUNCTION__,__FILE__,__LINE__,NTFS_LOG_LEVEL_LEAVE,NULL,FORMAT,##ARGS)
+#define ntfs_log_filtered(LEVEL, FORMAT, ARGS...) do { if (__builtin_expect(ntfs_log_levels & (LEVEL), 0)) ntfs_log_redirect(__FUNCTION__,__FILE__,__LINE__,LEVEL,NULL,FORMAT,##ARGS); } while (0)
+#define ntfs_log_debug(FORMAT, ARGS...) ntfs_log_filtered(NTFS_LOG_LEVEL_DEBUG,FORMAT,##ARGS)
+#define ntfs_log_trace(FORMAT, ARGS...) ntfs_log_filtered(NTFS_LOG_LEVEL_TRACE,FORMAT,##ARGS)
+#define ntfs_log_enter(FORMAT, ARGS...) ntfs_log_filtered(NTFS_LOG_LEVEL_ENTER,FORMAT,##ARGS)
+#define ntfs_log_leave(FORMAT, ARGS...) ntfs_log_filtered(NTFS_LOG_LEVEL_LEAVE,FORMAT,##ARGS)
 #else
 #define ntfs_log_debug(FORMAT, ARGS...)do {} while (0)
 #define ntfs_log_trace(FORMAT, ARGS...)do {} while (0)
@@ -130,5 +130,20 @@ extern int ntfs_mft_record_free(ntfs_volume *vol, ntfs_inode *ni);
 
 extern int ntfs_mft_usn_dec(MFT_RECORD *mrec);
 
+extern void ntfs_mft_bitmap_release(ntfs_volume *vol);
+extern int ntfs_mft_bitmap_load(ntfs_volume *vol);
+
+extern struct MFT_SCAN *ntfs_mft_scan_start(ntfs_volume *vol,
+		s64 first, s64 end);
+extern BOOL ntfs_mft_scan_next(struct MFT_SCAN *scan, s64 *mft_no,
+		MFT_RECORD **mrec);
+extern void ntfs_mft_scan_end(struct MFT_SCAN *scan);
+
+typedef int (*ntfs_mft_scan_func)(ntfs_volume *vol, s64 mft_no,
+		MFT_RECORD *mrec, void *arg);
+
+extern int ntfs_mft_scan_parallel(ntfs_volume *vol, s64 first, s64 end,
+		int threads, ntfs_mft_scan_func func, void *arg);
+
 #endif /* defined _NTFS_MFT_H */
 
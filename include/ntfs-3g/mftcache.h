@@ -0,0 +1,47 @@
+/*
+ * mftcache.h : cache of MFT records
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _NTFS_MFTCACHE_H_
+#define _NTFS_MFTCACHE_H_
+
+#include "types.h"
+#include "layout.h"
+#include "volume.h"
+
+int ntfs_mftcache_attach(ntfs_volume *vol, int count, BOOL writeback);
+int ntfs_mftcache_flush(const ntfs_volume *vol);
+int ntfs_mftcache_flush_record(const ntfs_volume *vol, VCN mft_no);
+int ntfs_mftcache_detach(ntfs_volume *vol);
+void ntfs_mftcache_log(const ntfs_volume *vol);
+
+BOOL ntfs_mftcache_get(const ntfs_volume *vol, VCN mft_no, MFT_RECORD *b);
+void ntfs_mftcache_overlay(const ntfs_volume *vol, VCN mft_no,
+			s64 count, MFT_RECORD *b);
+void ntfs_mftcache_put(const ntfs_volume *vol, VCN mft_no,
+			s64 count, const MFT_RECORD *b, BOOL written);
+void ntfs_mftcache_prefetch(const ntfs_volume *vol, VCN mft_no,
+			s64 count, const MFT_RECORD *b, const BOOL *valid);
+int ntfs_mftcache_window(const ntfs_volume *vol);
+void ntfs_mftcache_readahead(const ntfs_volume *vol, const s64 *list,
+			int count);
+int ntfs_mftcache_readahead_start(ntfs_volume *vol);
+int ntfs_mftcache_defer(const ntfs_volume *vol, VCN mft_no,
+			s64 count, const MFT_RECORD *b);
+
+#endif /* _NTFS_MFTCACHE_H_ */
@@ -32,4 +32,11 @@ int ntfs_remove_ntfs_object_id(ntfs_inode *ni);
 
 int ntfs_delete_object_id_index(ntfs_inode *ni);
 
+struct OBJECT_ID_SCAN;
+
+struct OBJECT_ID_SCAN *ntfs_object_id_scan_start(ntfs_volume *vol);
+BOOL ntfs_object_id_scan_next(struct OBJECT_ID_SCAN *os, u64 *mref,
+			GUID *object_id);
+int ntfs_object_id_scan_end(struct OBJECT_ID_SCAN *os);
+
 #endif /* OBJECT_ID_H */
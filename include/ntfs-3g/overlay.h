@@ -0,0 +1,64 @@
+/*
+ * overlay.h : copy-on-write overlay over a read-only device
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _NTFS_OVERLAY_H_
+#define _NTFS_OVERLAY_H_
+
+#include "types.h"
+#include "device.h"
+
+#define NTFS_OVERLAY_MAGIC "NTFSOVL1"
+#define NTFS_OVERLAY_HEADER_SIZE 4096
+
+/*
+ *	An overlay file is made of a header, the bitmap of the blocks
+ *	present in the overlay, and the data area, in which a block is
+ *	stored at the same offset as on the base device. The data area
+ *	is sparse, only the blocks written are allocated. All numbers
+ *	are little endian.
+ */
+
+struct NTFS_OVERLAY_HEADER {
+	char magic[8];		/* NTFS_OVERLAY_MAGIC */
+	le32 block_size;	/* granularity of the copies */
+	le32 name_length;	/* length of base_name, without the null */
+	le64 base_size;		/* bytes on the base device */
+	le64 base_mtime;	/* seconds since 1970, zero if a device */
+	le64 bitmap_offset;	/* position of the bitmap of blocks */
+	le64 data_offset;	/* position of the first block */
+	char base_name[0];	/* absolute path, null terminated */
+} __attribute__((__packed__)) ;
+
+struct NTFS_OVERLAY_INFO {
+	char *base_name;	/* to be freed by the caller */
+	s64 base_size;
+	u32 block_size;
+	s64 changed_blocks;	/* count of blocks in the overlay */
+} ;
+
+extern struct ntfs_device_operations ntfs_device_overlay_io_ops;
+
+int ntfs_overlay_create(const char *base_name, const char *overlay_name,
+			u32 block_size);
+int ntfs_overlay_info(const char *overlay_name,
+			struct NTFS_OVERLAY_INFO *info);
+s64 ntfs_overlay_merge(const char *overlay_name);
+int ntfs_overlay_discard(const char *overlay_name);
+
+#endif /* _NTFS_OVERLAY_H_ */
@@ -27,6 +27,13 @@
 #define CACHE_LOOKUP_SIZE 64	/* lookup cache, zero or >= 3 and not too big */
 #define CACHE_SECURID_SIZE 16    /* securid cache, zero or >= 3 and not too big */
 #define CACHE_LEGACY_SIZE 8    /* legacy cache size, zero or >= 3 and not too big */
+#define CACHE_CHUNK_SIZE 32	/* system-compressed chunks, zero or >= 3 */
+#define CACHE_SYMLINK_SIZE 32	/* resolved symlinks, zero or >= 3 */
+#define CACHE_GROUPS_SIZE 32	/* groups of requesters, zero or >= 3 */
+#define CACHE_GROUPS_TTL 1	/* seconds a list of groups is trusted */
+#define CACHE_INHERIT_SIZE 32	/* inherited security ids, zero or >= 3 */
+#define CACHE_PATH_SIZE 1024	/* inode cache of the path based driver */
+#define CACHE_MAX_SIZE 1048576	/* max count of entries set by mount options */
 
 #define FORCE_FORMAT_v1x 0	/* Insert security data as in NTFS v1.x */
 #define OWNERFROMACL 1		/* Get the owner from ACL (not Windows owner) */
@@ -75,6 +82,191 @@ enum {
 
 	/* only update the final extent of a runlist when appending data */
 #define PARTIAL_RUNLIST_UPDATING 1
+	/* max count of runs read or written in a single batch */
+#define RUNLIST_BATCH_SIZE 16
+	/* max count of runs kept mapped for an attribute kept open */
+#define RUNLIST_KEEP_MAX 16384
+
+/*
+ *		Parameters for reading files sequentially
+ */
+
+	/* initial and max bytes read ahead of sequential reads */
+#define READAHEAD_MIN 131072
+#define READAHEAD_MAX 2097152
+	/* max bytes of appended data kept in the write buffer of a file */
+#define WRITE_BUFFER_SIZE 1048576
+	/* max bytes allocated ahead of the buffered data appended to a file */
+#define ALLOCATE_AHEAD_MAX 67108864
+	/* size of the buffer for copying data inside a volume */
+#define COPY_BUFFER_SIZE 4194304
+
+/*
+ *		Parameters for the device block cache
+ */
+
+	/* size of the cached blocks, a power of 2 */
+#define DEVCACHE_BLOCK_SIZE 4096
+	/* count of parts of the cache locked independently */
+#define DEVCACHE_SHARDS 16
+	/* max size of the transfers the blocks are kept in cache for */
+#define DEVCACHE_MAX_TRANSFER 16384
+
+/*
+ *		Parameters for extending the MFT
+ */
+
+	/* min count of records added when extending the MFT */
+#define MFT_GROWTH_MIN 16
+	/* default max count of records added, growing by one eighth */
+#define MFT_GROWTH_MAX 8192
+	/* count of records formatted ahead when one is first allocated */
+#define MFT_FORMAT_AHEAD 64
+
+/*
+ *		Parameters for the security descriptors kept in memory
+ */
+
+	/* max bytes of descriptors interned from $Secure */
+#define SECURE_INTERN_MAX_SIZE 16777216
+	/* count of hash chains of interned descriptors (power of 2) */
+#define SECURE_INTERN_HASH 1024
+
+/*
+ *		Parameters for counting the free clusters
+ */
+
+	/* bytes of $Bitmap counted when mounting, the rest in background */
+#define FREE_COUNT_SYNC_SIZE 1048576
+
+/*
+ *		Parameters for reserving clusters to files being extended
+ */
+
+	/* bytes reserved after the last cluster allocated to a file */
+#define ALLOC_WINDOW_SIZE 67108864
+	/* count of allocations after which an unused reservation is dropped */
+#define ALLOC_WINDOW_AGE 64
+	/* max stripe width big allocations are aligned to */
+#define ALLOC_STRIPE_MAX 16777216
+
+/*
+ *		Parameters for discarding the clusters freed
+ */
+
+	/* seconds between the checks for ranges of clusters to discard */
+#define DISCARD_DELAY 30
+	/* max count of ranges of clusters queued for being discarded */
+#define DISCARD_QUEUE_SIZE 4096
+	/* count of threads issuing the discards when trimming */
+#define FSTRIM_THREADS 4
+	/* max count of discards queued for the threads when trimming */
+#define FSTRIM_QUEUE_SIZE 64
+	/* max bytes of bitmap examined under one lock when trimming */
+#define FSTRIM_PART_MAX 131072
+
+/*
+ *		Parameters for the sequential scans of MFT records and indexes
+ */
+
+	/* size of the batches of records read together */
+#define MFT_SCAN_SIZE 4194304
+	/* size of the ranges of records handed to each thread */
+#define MFT_SCAN_PARALLEL_SIZE 1048576
+	/* max count of threads scanning in parallel */
+#define MFT_SCAN_MAX_THREADS 16
+	/* size of the batches of index blocks read together */
+#define INDEX_SCAN_SIZE 1048576
+	/* size of the beginning of $LogFile read at once to check it */
+#define LOGFILE_HEAD_SIZE 65536
+	/* size of the writes filling $LogFile when it is reset */
+#define LOGFILE_RESET_SIZE 1048576
+	/* size of the reads of the change journal $UsnJrnl:$J */
+#define USN_READ_SIZE 1048576
+	/* size of the writes of records appended to $UsnJrnl:$J */
+#define USN_WRITE_SIZE 65536
+
+/*
+ *		Parameters for compressed files
+ */
+
+	/* compression levels, from the fastest to the best ratio */
+#define COMPRESSION_LEVEL_MAX 2
+#define COMPRESSION_LEVEL_DEFAULT 2
+
+	/* min count of compression blocks read for decompressing in parallel */
+#define DECOMPRESS_PARALLEL_MIN 4
+	/* max count of threads decompressing a read */
+#define DECOMPRESS_MAX_THREADS 4
+	/* max count of compression blocks read ahead of their decompression */
+#define DECOMPRESS_MAX_SLOTS 16
+	/* min count of 4K sub-blocks written for compressing in parallel */
+#define COMPRESS_PARALLEL_MIN 4
+	/* max count of threads compressing a compression block */
+#define COMPRESS_MAX_THREADS 4
+	/* max bytes of system-compressed chunks read at once */
+#define SYSCOMP_BATCH_SIZE 1048576
+	/* min count of system-compressed chunks for decompressing in parallel */
+#define SYSCOMP_PARALLEL_MIN 4
+	/* max count of threads decompressing system-compressed chunks */
+#define SYSCOMP_MAX_THREADS 4
+	/* bytes read at once by sequential readers of an attribute */
+#define ATTR_STREAM_SIZE 1048576
+
+/*
+ *		Parameters for the in-memory indexes of hot directories
+ */
+
+	/* min size of the index allocation of a directory indexed in memory */
+#define DIRINDEX_MIN_SIZE 262144
+	/* count of lookups which makes a directory hot */
+#define DIRINDEX_HOT_LOOKUPS 64
+	/* count of directories for which lookups are counted */
+#define DIRINDEX_CANDIDATES 16
+	/* max count of index blocks read at once when indexing in memory */
+#define DIRINDEX_READ_BLOCKS 64
+	/* max age (seconds) of modifications in the index block cache */
+#define INDEX_CACHE_DELAY 30
+	/* max count of files whose directory entries are updated later */
+#define DEFERRED_FILE_NAMES 64
+	/* default cache sizes when modifications are committed periodically */
+#define COMMIT_MFT_RECORDS 1024
+#define COMMIT_INDEX_BLOCKS 256
+#define COMMIT_BITMAP_PAGES 256
+	/* max count of consecutive cached MFT records written at once */
+#define MFTCACHE_WRITE_RECORDS 16
+	/* bounds of the window of MFT records prefetched on a cache miss */
+#define MFTCACHE_PREFETCH_MIN 4
+#define MFTCACHE_PREFETCH_START 16
+#define MFTCACHE_PREFETCH_BYTES 65536
+	/* max count of scattered MFT records queued for reading */
+#define MFTCACHE_READAHEAD_RECORDS 4096
+	/* max count of unneeded records read between queued ones */
+#define MFTCACHE_READAHEAD_GAP 8
+	/* size of the pages of $Bitmap and $MFT:$BITMAP kept in cache */
+#define BMPCACHE_PAGE_BITS 12
+#define BMPCACHE_PAGE_SIZE (1 << BMPCACHE_PAGE_BITS)
+	/* max size of a bitmap update kept in cache */
+#define BMPCACHE_MAX_WRITE 16384
+	/* spare pages of a resident bitmap cache, for the MFT growth */
+#define BMPCACHE_RESIDENT_SPARE 64
+	/* size of the reads for loading a resident bitmap cache */
+#define BMPCACHE_LOAD_SIZE 1048576
+	/* huge page size, the smallest bitmap cache mapped into them */
+#define BMPCACHE_HUGE_PAGE 2097152
+
+/*
+ *		Parameters for directories
+ */
+
+	/* max bytes of consecutive index blocks read at once by readdir */
+#define INDEX_READAHEAD_SIZE 65536
+	/* max count of free index contexts and index blocks kept for reuse */
+#define INDEX_POOL_SIZE 16
+	/* max count of free inodes with an embedded record kept for reuse */
+#define INODE_POOL_SIZE 64
+	/* max count of free attribute search contexts kept for reuse */
+#define SEARCH_POOL_SIZE 16
 
 /*
  *		Parameters for upper-case table
@@ -0,0 +1,70 @@
+/*
+ * probe.h : static tracepoints
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _NTFS_PROBE_H_
+#define _NTFS_PROBE_H_
+
+/*
+ *	When configured with --enable-usdt, the probes are USDT (systemtap
+ *	style) tracepoints of provider "ntfs3g", which cost a single nop
+ *	when no tracer is attached, for instance :
+ *
+ *	bpftrace -e 'usdt:/lib/libntfs-3g.so:ntfs3g:inode__open
+ *		{ @[arg1 ? "hit" : "miss"] = count(); }'
+ *
+ *	inode__open (inum, hit)
+ *		ntfs_inode_open(), hit is 1 when found in the nidata cache
+ *	cluster__alloc (count, start_lcn, zone)
+ *		ntfs_cluster_alloc() entered
+ *	cluster__alloc__done (count, error, bytes_scanned, bytes_skipped)
+ *		ntfs_cluster_alloc() done, with the bytes of $Bitmap read
+ *		and skipped as known to be full
+ *	index__read (inum, vcn, block_size, deferred)
+ *		ntfs_ib_read(), deferred is 1 when the block was found in
+ *		the write-back cache of index blocks
+ *	decompress (cb_size, dest_size)
+ *	decompress__done (cb_size, bytes_decompressed, error)
+ *		decoding of a compression block by ntfs_decompress()
+ *
+ *	The probes are removed otherwise, and their arguments not evaluated.
+ */
+
+#ifdef ENABLE_USDT
+
+#include <sys/sdt.h>
+
+#define NTFS_PROBE2(name, a1, a2) \
+	DTRACE_PROBE2(ntfs3g, name, a1, a2)
+#define NTFS_PROBE3(name, a1, a2, a3) \
+	DTRACE_PROBE3(ntfs3g, name, a1, a2, a3)
+#define NTFS_PROBE4(name, a1, a2, a3, a4) \
+	DTRACE_PROBE4(ntfs3g, name, a1, a2, a3, a4)
+
+#else /* ENABLE_USDT */
+
+#define NTFS_PROBE2(name, a1, a2) \
+	((void)(sizeof(a1) + sizeof(a2)))
+#define NTFS_PROBE3(name, a1, a2, a3) \
+	((void)(sizeof(a1) + sizeof(a2) + sizeof(a3)))
+#define NTFS_PROBE4(name, a1, a2, a3, a4) \
+	((void)(sizeof(a1) + sizeof(a2) + sizeof(a3) + sizeof(a4)))
+
+#endif /* ENABLE_USDT */
+
+#endif /* _NTFS_PROBE_H_ */
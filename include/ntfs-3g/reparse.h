@@ -36,4 +36,18 @@ int ntfs_remove_ntfs_reparse_data(ntfs_inode *ni);
 
 int ntfs_delete_reparse_index(ntfs_inode *ni);
 
+struct REPARSE_SCAN;
+
+struct REPARSE_SCAN *ntfs_reparse_scan_start(ntfs_volume *vol);
+BOOL ntfs_reparse_scan_next(struct REPARSE_SCAN *rs, u64 *mref, le32 *tag);
+int ntfs_reparse_scan_end(struct REPARSE_SCAN *rs);
+
+#if CACHE_SYMLINK_SIZE
+
+struct CACHED_GENERIC;
+
+int ntfs_symlink_hash(const struct CACHED_GENERIC *item);
+
+#endif
+
 #endif /* REPARSE_H */
@@ -70,6 +70,10 @@ extern int ntfs_get_nr_significant_bytes(const s64 n);
 extern int ntfs_get_size_for_mapping_pairs(const ntfs_volume *vol,
 		const runlist_element *rl, const VCN start_vcn, int max_size);
 
+extern int ntfs_get_size_for_mapping_pairs_from(const ntfs_volume *vol,
+		const runlist_element *rl, const VCN start_vcn, LCN prev_lcn,
+		int max_size);
+
 extern int ntfs_write_significant_bytes(u8 *dst, const u8 *dst_max,
 		const s64 n);
 
@@ -77,10 +81,20 @@ extern int ntfs_mapping_pairs_build(const ntfs_volume *vol, u8 *dst,
 		const int dst_len, const runlist_element *rl,
 		const VCN start_vcn, runlist_element const **stop_rl);
 
+extern int ntfs_mapping_pairs_build_from(const ntfs_volume *vol, u8 *dst,
+		const int dst_len, const runlist_element *rl,
+		const VCN start_vcn, LCN prev_lcn,
+		runlist_element const **stop_rl);
+
+extern int ntfs_mapping_pairs_resume(const ntfs_volume *vol, const u8 *mp,
+		const u8 *mp_end, const runlist_element *rl,
+		const VCN lowest_vcn, VCN *resume_vcn, LCN *prev_lcn);
+
 extern int ntfs_rl_truncate(runlist **arl, const VCN start_vcn);
 
 extern int ntfs_rl_sparse(runlist *rl);
 extern s64 ntfs_rl_get_compressed_size(ntfs_volume *vol, runlist *rl);
+extern s64 ntfs_rl_fragments(const runlist_element *rl);
 
 #ifdef NTFS_TEST
 int test_rl_main(int argc, char *argv[]);
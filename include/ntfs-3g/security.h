@@ -59,10 +59,11 @@ struct CACHED_PERMISSIONS {
 	le32 inh_dirid;
 #if POSIXACLS
 	struct POSIX_SECURITY *pxdesc;
+	const struct POSIX_COMPILED *pxcomp; /* see security.c */
 	unsigned int pxdescsize:16;
 #endif
 	unsigned int mode:12;
-	unsigned int valid:1;
+	unsigned char valid;	/* set last, see peek_cache() */
 } ;
 
 /*
@@ -74,6 +75,7 @@ struct CACHED_PERMISSIONS_LEGACY {
 	struct CACHED_PERMISSIONS_LEGACY *previous;
 	void *variable;
 	size_t varsize;
+	int state;
 	union ALIGNMENT payload[0];
 		/* above fields must match "struct CACHED_GENERIC" */
 	u64 mft_no;
@@ -89,6 +91,7 @@ struct CACHED_SECURID {
 	struct CACHED_SECURID *previous;
 	void *variable;
 	size_t varsize;
+	int state;
 	union ALIGNMENT payload[0];
 		/* above fields must match "struct CACHED_GENERIC" */
 	uid_t uid;
@@ -97,6 +100,44 @@ struct CACHED_SECURID {
 	le32 securid;
 } ;
 
+/*
+ *	Entry in the cache of supplementary groups of requesters
+ */
+
+struct CACHED_GROUPS {
+	struct CACHED_GROUPS *next;
+	struct CACHED_GROUPS *previous;
+	gid_t *groups;
+	size_t groupsize;
+	int state;
+	union ALIGNMENT payload[0];
+		/* above fields must match "struct CACHED_GENERIC" */
+	pid_t tid;
+	uid_t uid;
+	gid_t gid;
+	time_t stamp;
+} ;
+
+/*
+ *	Entry in the cache of security ids inherited from a parent
+ *	directory by a file or directory created by some user
+ */
+
+struct CACHED_INHERIT {
+	struct CACHED_INHERIT *next;
+	struct CACHED_INHERIT *previous;
+	void *variable;
+	size_t varsize;
+	int state;
+	union ALIGNMENT payload[0];
+		/* above fields must match "struct CACHED_GENERIC" */
+	le32 parent_id;
+	uid_t uid;
+	gid_t gid;
+	BOOL fordir;
+	le32 securid;
+} ;
+
 /*
  *	Header of the security cache
  *	(has no cache structure by itself)
@@ -108,6 +149,7 @@ struct CACHED_PERMISSIONS_HEADER {
 	unsigned long p_writes;
 	unsigned long p_reads;
 	unsigned long p_hits;
+	struct PERMISSIONS_CACHE *retired; /* replaced tables */
 } ;
 
 /*
@@ -215,6 +257,7 @@ extern int ntfs_sid_to_mbs_size(const SID *sid);
 extern char *ntfs_sid_to_mbs(const SID *sid, char *sid_str,
 		size_t sid_str_size);
 extern void ntfs_generate_guid(GUID *guid);
+extern SECURITY_DESCRIPTOR_RELATIVE *ntfs_sd_everyone(int *psd_len);
 extern int ntfs_sd_add_everyone(ntfs_inode *ni);
 
 extern le32 ntfs_security_hash(const SECURITY_DESCRIPTOR_RELATIVE *sd, 
@@ -256,6 +299,7 @@ int ntfs_set_owner_mode(struct SECURITY_CONTEXT *scx,
 le32 ntfs_inherited_id(struct SECURITY_CONTEXT *scx,
 		ntfs_inode *dir_ni, BOOL fordir);
 int ntfs_open_secure(ntfs_volume *vol);
+void ntfs_secure_preload(ntfs_volume *vol, BOOL background);
 void ntfs_close_secure(struct SECURITY_CONTEXT *scx);
 
 #if POSIXACLS
@@ -324,6 +368,18 @@ INDEX_ENTRY *ntfs_read_sii(struct SECURITY_API *scapi,
 		INDEX_ENTRY *entry);
 INDEX_ENTRY *ntfs_read_sdh(struct SECURITY_API *scapi,
 		INDEX_ENTRY *entry);
+
+typedef int (*ntfs_secure_entry_callback)(void *context,
+		const INDEX_ENTRY *entry);
+typedef int (*ntfs_secure_file_callback)(void *context,
+		u64 inum, u32 securid);
+
+int ntfs_scan_sii(struct SECURITY_API *scapi,
+		ntfs_secure_entry_callback callback, void *context);
+int ntfs_scan_sdh(struct SECURITY_API *scapi,
+		ntfs_secure_entry_callback callback, void *context);
+int ntfs_scan_security_ids(struct SECURITY_API *scapi, int threads,
+		ntfs_secure_file_callback callback, void *context);
 struct SECURITY_API *ntfs_initialize_file_security(const char *device,
                                 unsigned long flags);
 BOOL ntfs_leave_file_security(struct SECURITY_API *scx);
@@ -47,6 +47,24 @@ ntfs_read_system_compressed_data(struct ntfs_system_decompression_ctx *ctx,
 extern void
 ntfs_close_system_decompression_ctx(struct ntfs_system_decompression_ctx *ctx);
 
+/* System compressed file creation  */
+
+/* Compression formats, with the values stored in the reparse point  */
+#define SYSTEM_COMPRESSION_XPRESS4K	0
+#define SYSTEM_COMPRESSION_LZX		1
+#define SYSTEM_COMPRESSION_XPRESS8K	2
+#define SYSTEM_COMPRESSION_XPRESS16K	3
+
+extern int ntfs_compress_system_file(ntfs_inode *ni, int format);
+
+#if CACHE_CHUNK_SIZE
+
+struct CACHED_GENERIC;
+
+extern int ntfs_system_chunk_hash(const struct CACHED_GENERIC *item);
+
+#endif
+
 /* XPRESS decompression  */
 
 struct xpress_decompressor;
@@ -59,6 +77,18 @@ extern int xpress_decompress(struct xpress_decompressor *decompressor,
 
 extern void xpress_free_decompressor(struct xpress_decompressor *decompressor);
 
+/* XPRESS compression  */
+
+struct xpress_compressor;
+
+extern struct xpress_compressor *xpress_allocate_compressor(size_t max_bufsize);
+
+extern size_t xpress_compress(struct xpress_compressor *compressor,
+		       const void *uncompressed_data, size_t uncompressed_size,
+		       void *compressed_data, size_t max_compressed_size);
+
+extern void xpress_free_compressor(struct xpress_compressor *compressor);
+
 /* LZX decompression  */
 
 struct lzx_decompressor;
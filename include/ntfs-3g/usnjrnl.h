@@ -0,0 +1,63 @@
+/*
+ * usnjrnl.h : reading and recording the change journal
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _NTFS_USNJRNL_H_
+#define _NTFS_USNJRNL_H_
+
+#include "types.h"
+#include "layout.h"
+#include "volume.h"
+
+struct USN_JOURNAL_INFO {
+	u64 journal_id;		/* changed when the journal is recreated */
+	s64 lowest_usn;		/* oldest record still present */
+	s64 next_usn;		/* next record to be written */
+	s64 maximum_size;
+	s64 allocation_delta;
+} ;
+
+struct USN_CHANGE {
+	s64 usn;
+	u64 mref;		/* the file changed */
+	u64 parent_mref;	/* its parent directory */
+	s64 timestamp;		/* NTFS time */
+	u32 reason;		/* USN_REASON_* in cpu order */
+	u32 source_info;
+	u32 security_id;
+	u32 file_attributes;
+	const ntfschar *name;	/* little endian, not terminated */
+	int name_len;		/* in characters */
+} ;
+
+struct USN_READER;
+
+struct USN_READER *ntfs_usn_open(ntfs_volume *vol, s64 start,
+			struct USN_JOURNAL_INFO *info);
+int ntfs_usn_read(struct USN_READER *reader, struct USN_CHANGE *changes,
+			int count);
+s64 ntfs_usn_position(const struct USN_READER *reader);
+int ntfs_usn_close(struct USN_READER *reader);
+
+int ntfs_usn_start(ntfs_volume *vol);
+int ntfs_usn_flush(ntfs_volume *vol);
+int ntfs_usn_stop(ntfs_volume *vol);
+void ntfs_usn_record(ntfs_inode *ni, ntfs_inode *dir_ni,
+			const ntfschar *name, int name_len, le32 reason);
+
+#endif /* _NTFS_USNJRNL_H_ */
@@ -60,11 +60,22 @@ typedef struct _ntfs_volume ntfs_volume;
 enum {
 	NTFS_MNT_NONE                   = 0x00000000,
 	NTFS_MNT_RDONLY                 = 0x00000001,
+	NTFS_MNT_IMMUTABLE              = 0x00400000, /* Read-only, and the
+	                                               * device never changes
+	                                               * while mounted. */
+	NTFS_MNT_OVERLAY                = 0x00800000, /* The device is an
+	                                               * overlay file. */
+	NTFS_MNT_MMAP                   = 0x01000000, /* Map a read-only
+	                                               * device in memory. */
+	NTFS_MNT_FAST                   = 0x02000000, /* Defer loading what
+	                                               * is not needed yet. */
 	NTFS_MNT_FORENSIC               = 0x04000000, /* No modification during
 	                                               * mount. */
 	NTFS_MNT_EXCLUSIVE              = 0x08000000,
 	NTFS_MNT_RECOVER                = 0x10000000,
 	NTFS_MNT_IGNORE_HIBERFILE       = 0x20000000,
+	NTFS_MNT_DIRECT_IO              = 0x40000000, /* Bypass the cache of
+	                                               * the device. */
 };
 typedef unsigned long ntfs_mount_flags;
 
@@ -111,6 +122,7 @@ typedef enum {
 	NV_HideDotFiles,	/* 1: Set hidden flag on dot files */
 	NV_Compression,		/* 1: allow compression */
 	NV_NoFixupWarn,		/* 1: Do not log fixup errors */
+	NV_SparseZeroDetect,	/* 1: Do not allocate zeroes written */
 } ntfs_volume_state_bits;
 
 #define  test_nvol_flag(nv, flag)	 test_bit(NV_##flag, (nv)->state)
@@ -149,6 +161,10 @@ typedef enum {
 #define NVolSetNoFixupWarn(nv)		  set_nvol_flag(nv, NoFixupWarn)
 #define NVolClearNoFixupWarn(nv)	clear_nvol_flag(nv, NoFixupWarn)
 
+#define NVolSparseZeroDetect(nv)	 test_nvol_flag(nv, SparseZeroDetect)
+#define NVolSetSparseZeroDetect(nv)	  set_nvol_flag(nv, SparseZeroDetect)
+#define NVolClearSparseZeroDetect(nv)	clear_nvol_flag(nv, SparseZeroDetect)
+
 /*
  * NTFS version 1.1 and 1.2 are used by Windows NT4.
  * NTFS version 2.x is used by Windows 2000 Beta
@@ -196,14 +212,24 @@ struct _ntfs_volume {
 	u8 full_zones;		/* cluster zones which are full */
 	s64 mft_data_pos;	/* Mft record number at which to allocate the
 				   next mft record. */
+	s64 mft_growth;		/* Max count of mft records to add when
+				   extending the mft data. */
+	u8 compression_level;	/* Effort for compressing file data, from 0
+				   (fastest) to COMPRESSION_LEVEL_MAX. */
 	LCN mft_zone_start;	/* First cluster of the mft zone. */
 	LCN mft_zone_end;	/* First cluster beyond the mft zone. */
 	LCN mft_zone_pos;	/* Current position in the mft zone. */
 	LCN data1_zone_pos;	/* Current position in the first data zone. */
 	LCN data2_zone_pos;	/* Current position in the second data zone. */
+	u64 alloc_calls;	/* Statistics: cluster allocation requests. */
+	u64 alloc_clusters;	/* Statistics: clusters allocated. */
+	u64 alloc_bmp_read;	/* Statistics: bytes of $Bitmap scanned. */
+	u64 alloc_bmp_skipped;	/* Statistics: bytes of $Bitmap skipped as
+				   known to be full. */
 
 	s64 nr_clusters;	/* Volume size in clusters, hence also the
 				   number of bits in lcn_bitmap. */
+	u64 serial_no;		/* Serial number from the boot sector. */
 	ntfs_inode *lcnbmp_ni;	/* ntfs_inode structure for FILE_Bitmap. */
 	ntfs_attr *lcnbmp_na;	/* ntfs_attr structure for the data attribute
 				   of FILE_Bitmap. Each bit represents a
@@ -226,6 +252,7 @@ struct _ntfs_volume {
 	ntfs_inode *secure_ni;	/* ntfs_inode structure for FILE $Secure */
 	ntfs_index_context *secure_xsii; /* index for using $Secure:$SII */
 	ntfs_index_context *secure_xsdh; /* index for using $Secure:$SDH */
+	struct SECURE_INTERN *secure_intern; /* descriptors, see security.c */
 	int secure_reentry;  /* check for non-rentries */
 	unsigned int secure_flags;  /* flags, see security.h for values */
 
@@ -273,7 +300,49 @@ struct _ntfs_volume {
 #if CACHE_LEGACY_SIZE
 	struct CACHE_HEADER *legacy_cache;
 #endif
-
+#if CACHE_GROUPS_SIZE
+	struct CACHE_HEADER *groups_cache;
+#endif
+#if CACHE_INHERIT_SIZE
+	struct CACHE_HEADER *inherit_cache;
+#endif
+#if CACHE_CHUNK_SIZE
+	struct CACHE_HEADER *chunk_cache;
+#endif
+#if CACHE_SYMLINK_SIZE
+	struct CACHE_HEADER *symlink_cache;
+#endif
+	u64 cache_mem;		/* memory budget of the caches, 0 if none */
+	u64 cache_mem_used;	/* memory used by the caches, see cache.c */
+	u64 permissions_mem;	/* part used by the permissions cache */
+	int cache_count;	/* count of LRU caches sharing the budget */
+	struct CACHE_POOL *cache_pool; /* budget shared with other volumes,
+				   see cache.c */
+	u32 dir_generation; /* bumped on every change to a directory */
+	struct MFT_CACHE *mft_cache; /* fixed-up records, see mftcache.c */
+	struct DIRINDEX_CACHE *dir_index; /* hot directories, see dirindex.c */
+	struct INDEX_CACHE *index_cache; /* index blocks, see idxcache.c */
+	struct BITMAP_CACHE *bitmap_cache; /* see bmpcache.c */
+	struct INDEX_POOL *index_pool; /* free index contexts, see index.c */
+	struct INODE_POOL *inode_pool; /* free inodes, see inode.c */
+	struct SEARCH_POOL *search_pool; /* free search contexts, see attrib.c */
+	struct MFT_SCAN *mft_scan; /* sequential scan of records, see mft.c */
+	struct MFT_BITMAP *mft_bitmap; /* copy of $MFT/$BITMAP, see mft.c */
+	struct CLUSTER_SUMMARY *cluster_summary; /* see lcnalloc.c */
+	struct FREE_COUNT *free_count; /* background count, see lcnalloc.c */
+	struct ALLOC_WINDOWS *alloc_windows; /* see lcnalloc.c */
+	s64 alloc_stripe;	/* clusters big allocations are aligned to */
+	s64 alloc_stripe_offset; /* lcn misalignment of the device stripes */
+	struct DISCARD_QUEUE *discard_queue; /* see ioctl.c */
+	u64 fstrim_rate;	/* max bytes discarded per second when trimming,
+				   zero for no limit */
+	struct USN_WRITER *usn_writer; /* changes recorded, see usnjrnl.c */
+	struct NTFS_LOCKS *locks; /* for concurrent requests, see lock.c */
+	ntfs_inode *held_inodes;  /* inodes kept open, see ntfs_inode_hold() */
+	struct DEFERRED_NAMES *deferred_names; /* see inode.c */
+	int commit_interval;	/* seconds, see ntfs_volume_commit() */
+	time_t committed;	/* time of the last commit */
+	u32 data_generation;	/* count of data updates, see readahead */
 };
 
 extern const char *ntfs_home;
@@ -299,6 +368,9 @@ extern int ntfs_volume_error(int err);
 extern void ntfs_mount_error(const char *vol, const char *mntpoint, int err);
 
 extern int ntfs_volume_get_free_space(ntfs_volume *vol);
+extern int ntfs_volume_commit(ntfs_volume *vol, BOOL force);
+extern int ntfs_volume_load_attrdef(ntfs_volume *vol);
+extern int ntfs_volume_get_lsn(ntfs_volume *vol, s64 *lsn);
 extern int ntfs_volume_rename(ntfs_volume *vol, const ntfschar *label,
 		int label_len);
 
@@ -72,5 +72,6 @@ int ntfs_xattr_system_setxattr(struct SECURITY_CONTEXT *scx,
 int ntfs_xattr_system_removexattr(struct SECURITY_CONTEXT *scx,
 			enum SYSTEMXATTRS attr,
 			ntfs_inode *ni, ntfs_inode *dir_ni);
+int ntfs_xattr_stream_names(ntfs_inode *ni, const char **plist);
 
 #endif /* _NTFS_XATTR_H_ */
@@ -88,12 +88,15 @@ struct fuse {
     struct fuse_session *se;
     struct node **name_table;
     size_t name_table_size;
+    size_t name_table_use;
     struct node **id_table;
     size_t id_table_size;
+    size_t id_table_use;
     fuse_ino_t ctr;
     unsigned int generation;
     unsigned int hidectr;
     pthread_mutex_t lock;
+    pthread_rwlock_t node_lock;
     pthread_rwlock_t tree_lock;
     struct fuse_config conf;
     int intr_installed;
@@ -117,6 +120,7 @@ struct node {
     int refctr;
     struct node *parent;
     char *name;
+    char *path; /* cached path, without the leading '/' */
     uint64_t nlookup;
     int open_count;
     int is_hidden;
@@ -279,10 +283,43 @@ static struct node *get_node(struct fuse *f, fuse_ino_t nodeid)
 
 static void free_node(struct node *node)
 {
+    free(node->path);
     free(node->name);
     free(node);
 }
 
+/*
+ * The hash tables are grown when they hold more nodes than slots,
+ * keeping the chains short. The old table is kept when a bigger one
+ * cannot be allocated.
+ */
+static void rehash_id(struct fuse *f)
+{
+    size_t oldsize = f->id_table_size;
+    struct node **oldtable = f->id_table;
+    struct node **newtable;
+    struct node *node;
+    struct node *next;
+    size_t hash;
+    size_t i;
+
+    newtable = (struct node **)
+        calloc(1, sizeof(struct node *) * oldsize * 2);
+    if (newtable == NULL)
+        return;
+
+    f->id_table = newtable;
+    f->id_table_size = oldsize * 2;
+    for (i = 0; i < oldsize; i++)
+        for (node = oldtable[i]; node != NULL; node = next) {
+            next = node->id_next;
+            hash = node->nodeid % f->id_table_size;
+            node->id_next = newtable[hash];
+            newtable[hash] = node;
+        }
+    free(oldtable);
+}
+
 static void unhash_id(struct fuse *f, struct node *node)
 {
     size_t hash = node->nodeid % f->id_table_size;
@@ -291,6 +328,7 @@ static void unhash_id(struct fuse *f, struct node *node)
     for (; *nodep != NULL; nodep = &(*nodep)->id_next)
         if (*nodep == node) {
             *nodep = node->id_next;
+            f->id_table_use--;
             return;
         }
 }
@@ -300,6 +338,8 @@ static void hash_id(struct fuse *f, struct node *node)
     size_t hash = node->nodeid % f->id_table_size;
     node->id_next = f->id_table[hash];
     f->id_table[hash] = node;
+    if (++f->id_table_use > f->id_table_size)
+        rehash_id(f);
 }
 
 static unsigned int name_hash(struct fuse *f, fuse_ino_t parent,
@@ -314,6 +354,50 @@ static unsigned int name_hash(struct fuse *f, fuse_ino_t parent,
     return (hash + parent) % f->name_table_size;
 }
 
+static void rehash_name(struct fuse *f)
+{
+    size_t oldsize = f->name_table_size;
+    struct node **oldtable = f->name_table;
+    struct node **newtable;
+    struct node *node;
+    struct node *next;
+    size_t hash;
+    size_t i;
+
+    newtable = (struct node **)
+        calloc(1, sizeof(struct node *) * oldsize * 2);
+    if (newtable == NULL)
+        return;
+
+    f->name_table = newtable;
+    f->name_table_size = oldsize * 2;
+    for (i = 0; i < oldsize; i++)
+        for (node = oldtable[i]; node != NULL; node = next) {
+            next = node->name_next;
+            hash = name_hash(f, node->parent->nodeid, node->name);
+            node->name_next = newtable[hash];
+            newtable[hash] = node;
+        }
+    free(oldtable);
+}
+
+/*
+ * Forget all the cached paths, when the path of a directory changes.
+ * This is rare enough to not justify locating its descendants.
+ * Must be called with node_lock held for writing.
+ */
+static void uncache_paths(struct fuse *f)
+{
+    struct node *node;
+    size_t i;
+
+    for (i = 0; i < f->id_table_size; i++)
+        for (node = f->id_table[i]; node != NULL; node = node->id_next) {
+            free(node->path);
+            node->path = NULL;
+        }
+}
+
 static void unref_node(struct fuse *f, struct node *node);
 
 static void unhash_name(struct fuse *f, struct node *node)
@@ -326,6 +410,12 @@ static void unhash_name(struct fuse *f, struct node *node)
             if (*nodep == node) {
                 *nodep = node->name_next;
                 node->name_next = NULL;
+                f->name_table_use--;
+                /* the paths cached below a directory become stale */
+                if (node->refctr > 1)
+                    uncache_paths(f);
+                free(node->path);
+                node->path = NULL;
                 unref_node(f, node->parent);
                 free(node->name);
                 node->name = NULL;
@@ -351,6 +441,8 @@ static int hash_name(struct fuse *f, struct node *node, fuse_ino_t parentid,
     node->parent = parent;
     node->name_next = f->name_table[hash];
     f->name_table[hash] = node;
+    if (++f->name_table_use > f->name_table_size)
+        rehash_name(f);
     return 0;
 }
 
@@ -401,7 +493,16 @@ static struct node *find_node(struct fuse *f, fuse_ino_t parent,
 {
     struct node *node;
 
-    pthread_mutex_lock(&f->lock);
+    /* Looking up a known node only needs reading the tables */
+    pthread_rwlock_rdlock(&f->node_lock);
+    node = lookup_node(f, parent, name);
+    if (node != NULL)
+        __atomic_add_fetch(&node->nlookup, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&f->node_lock);
+    if (node != NULL)
+        return node;
+
+    pthread_rwlock_wrlock(&f->node_lock);
     node = lookup_node(f, parent, name);
     if (node == NULL) {
         node = (struct node *) calloc(1, sizeof(struct node));
@@ -422,7 +523,7 @@ static struct node *find_node(struct fuse *f, fuse_ino_t parent,
     }
     node->nlookup ++;
  out_err:
-    pthread_mutex_unlock(&f->lock);
+    pthread_rwlock_unlock(&f->node_lock);
     return node;
 }
 
@@ -471,8 +572,41 @@ static char *add_name(char *buf, char *s, const char *name)
     return s;
 }
 
+/*
+ * The path of a node is cached when it has been built, and used for
+ * building the paths of the node and its descendants until a name
+ * above it changes.
+ *
+ * The paths are built with node_lock held for reading, so the cached
+ * path is only published when there is none, and it is only freed
+ * with node_lock held for writing. A cached path is thus always valid.
+ */
+static const char *cached_path(struct node *node)
+{
+    return __atomic_load_n(&node->path, __ATOMIC_ACQUIRE);
+}
+
+static void cache_path(struct node *node, const char *path, size_t len)
+{
+    char *none = NULL;
+    char *copy;
+
+    if (node->nodeid == FUSE_ROOT_ID || cached_path(node) != NULL)
+        return;
+
+    copy = malloc(len + 1);
+    if (copy != NULL) {
+        memcpy(copy, path, len);
+        copy[len] = '\0';
+        if (!__atomic_compare_exchange_n(&node->path, &none, copy, 0,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            free(copy);
+    }
+}
+
 static char *get_path_name(struct fuse *f, fuse_ino_t nodeid, const char *name)
 {
+    size_t suffix = (name != NULL ? strlen(name) + 1 : 0);
 #ifdef __SOLARIS__
     char buf[FUSE_MAX_PATH];
     char *s = buf + FUSE_MAX_PATH - 1;
@@ -486,9 +620,16 @@ static char *get_path_name(struct fuse *f, fuse_ino_t nodeid, const char *name)
             return NULL;
     }
 
-    pthread_mutex_lock(&f->lock);
+    pthread_rwlock_rdlock(&f->node_lock);
     for (node = get_node(f, nodeid); node && node->nodeid != FUSE_ROOT_ID;
          node = node->parent) {
+        const char *path = cached_path(node);
+
+        if (path != NULL) {
+            s = add_name(buf, s, path);
+            break;
+        }
+
         if (node->name == NULL) {
             s = NULL;
             break;
@@ -498,7 +639,9 @@ static char *get_path_name(struct fuse *f, fuse_ino_t nodeid, const char *name)
         if (s == NULL)
             break;
     }
-    pthread_mutex_unlock(&f->lock);
+    if (node != NULL && s != NULL && *s != '\0')
+        cache_path(get_node(f, nodeid), s + 1, strlen(s) - suffix - 1);
+    pthread_rwlock_unlock(&f->node_lock);
 
     if (node == NULL || s == NULL)
         return NULL;
@@ -527,9 +670,16 @@ static char *get_path_name(struct fuse *f, fuse_ino_t nodeid, const char *name)
             goto out_free;
     }
 
-    pthread_mutex_lock(&f->lock);
+    pthread_rwlock_rdlock(&f->node_lock);
     for (node = get_node(f, nodeid); node && node->nodeid != FUSE_ROOT_ID;
          node = node->parent) {
+        const char *path = cached_path(node);
+
+        if (path != NULL) {
+            s = add_name(&buf, &bufsize, s, path);
+            break;
+        }
+
         if (node->name == NULL) {
             s = NULL;
             break;
@@ -539,7 +689,9 @@ static char *get_path_name(struct fuse *f, fuse_ino_t nodeid, const char *name)
         if (s == NULL)
             break;
     }
-    pthread_mutex_unlock(&f->lock);
+    if (node != NULL && s != NULL && *s != '\0')
+        cache_path(get_node(f, nodeid), s + 1, strlen(s) - suffix - 1);
+    pthread_rwlock_unlock(&f->node_lock);
 
     if (node == NULL || s == NULL)
         goto out_free;
@@ -561,12 +713,31 @@ static char *get_path(struct fuse *f, fuse_ino_t nodeid)
     return get_path_name(f, nodeid, NULL);
 }
 
+/*
+ * The tables of nodes, their names and parents are protected by
+ * node_lock, so that concurrent requests can look up nodes and build
+ * paths together. The other state of nodes is protected by lock,
+ * which is taken after node_lock, so that nodes cannot be unhashed
+ * while being used.
+ */
+static void lock_node_state(struct fuse *f)
+{
+    pthread_rwlock_rdlock(&f->node_lock);
+    pthread_mutex_lock(&f->lock);
+}
+
+static void unlock_node_state(struct fuse *f)
+{
+    pthread_mutex_unlock(&f->lock);
+    pthread_rwlock_unlock(&f->node_lock);
+}
+
 static void forget_node(struct fuse *f, fuse_ino_t nodeid, uint64_t nlookup)
 {
     struct node *node;
     if (nodeid == FUSE_ROOT_ID)
         return;
-    pthread_mutex_lock(&f->lock);
+    pthread_rwlock_wrlock(&f->node_lock);
     node = get_node(f, nodeid);
     assert(node->nlookup >= nlookup);
     node->nlookup -= nlookup;
@@ -574,18 +745,18 @@ static void forget_node(struct fuse *f, fuse_ino_t nodeid, uint64_t nlookup)
         unhash_name(f, node);
         unref_node(f, node);
     }
-    pthread_mutex_unlock(&f->lock);
+    pthread_rwlock_unlock(&f->node_lock);
 }
 
 static void remove_node(struct fuse *f, fuse_ino_t dir, const char *name)
 {
     struct node *node;
 
-    pthread_mutex_lock(&f->lock);
+    pthread_rwlock_wrlock(&f->node_lock);
     node = lookup_node(f, dir, name);
     if (node != NULL)
         unhash_name(f, node);
-    pthread_mutex_unlock(&f->lock);
+    pthread_rwlock_unlock(&f->node_lock);
 }
 
 static int rename_node(struct fuse *f, fuse_ino_t olddir, const char *oldname,
@@ -595,7 +766,7 @@ static int rename_node(struct fuse *f, fuse_ino_t olddir, const char *oldname,
     struct node *newnode;
     int err = 0;
 
-    pthread_mutex_lock(&f->lock);
+    pthread_rwlock_wrlock(&f->node_lock);
     node  = lookup_node(f, olddir, oldname);
     newnode  = lookup_node(f, newdir, newname);
     if (node == NULL)
@@ -620,7 +791,7 @@ static int rename_node(struct fuse *f, fuse_ino_t olddir, const char *oldname,
         node->is_hidden = 1;
 
  out:
-    pthread_mutex_unlock(&f->lock);
+    pthread_rwlock_unlock(&f->node_lock);
     return err;
 }
 
@@ -1055,15 +1226,35 @@ int fuse_fs_ioctl(struct fuse_fs *fs, const char *path, int cmd, void *arg,
 	return -ENOSYS;
 }
 
+int fuse_fs_fallocate(struct fuse_fs *fs, const char *path, int mode,
+		      off_t offset, off_t length, struct fuse_file_info *fi)
+{
+    fuse_get_context()->private_data = fs->user_data;
+    if (fs->op.fallocate)
+        return fs->op.fallocate(path, mode, offset, length, fi);
+    else
+        return -EOPNOTSUPP;
+}
+
+off_t fuse_fs_lseek(struct fuse_fs *fs, const char *path, off_t off,
+		    int whence, struct fuse_file_info *fi)
+{
+    fuse_get_context()->private_data = fs->user_data;
+    if (fs->op.lseek)
+        return fs->op.lseek(path, off, whence, fi);
+    else
+        return -ENOSYS;
+}
+
 static int is_open(struct fuse *f, fuse_ino_t dir, const char *name)
 {
     struct node *node;
     int isopen = 0;
-    pthread_mutex_lock(&f->lock);
+    lock_node_state(f);
     node = lookup_node(f, dir, name);
     if (node && node->open_count > 0)
         isopen = 1;
-    pthread_mutex_unlock(&f->lock);
+    unlock_node_state(f);
     return isopen;
 }
 
@@ -1078,10 +1269,10 @@ static char *hidden_name(struct fuse *f, fuse_ino_t dir, const char *oldname,
     int failctr = 10;
 
     do {
-        pthread_mutex_lock(&f->lock);
+        lock_node_state(f);
         node = lookup_node(f, dir, oldname);
         if (node == NULL) {
-            pthread_mutex_unlock(&f->lock);
+            unlock_node_state(f);
             return NULL;
         }
         do {
@@ -1090,7 +1281,7 @@ static char *hidden_name(struct fuse *f, fuse_ino_t dir, const char *oldname,
                      (unsigned int) node->nodeid, f->hidectr);
             newnode = lookup_node(f, dir, newname);
         } while(newnode);
-        pthread_mutex_unlock(&f->lock);
+        unlock_node_state(f);
 
         newpath = get_path_name(f, dir, newname);
         if (!newpath)
@@ -1185,9 +1376,9 @@ static int lookup_path(struct fuse *f, fuse_ino_t nodeid,
             e->attr_timeout = f->conf.attr_timeout;
 #ifdef __SOLARIS__
             if (f->conf.auto_cache) {
-                pthread_mutex_lock(&f->lock);
+                lock_node_state(f);
                 update_stat(node, &e->attr);
-                pthread_mutex_unlock(&f->lock);
+                unlock_node_state(f);
             }
 #endif /* __SOLARIS__ */
             set_stat(f, e->ino, &e->attr);
@@ -1391,9 +1582,9 @@ static void fuse_lib_getattr(fuse_req_t req, fuse_ino_t ino,
     if (!err) {
 #ifdef __SOLARIS__
         if (f->conf.auto_cache) {
-            pthread_mutex_lock(&f->lock);
+            lock_node_state(f);
             update_stat(get_node(f, ino), &buf);
-            pthread_mutex_unlock(&f->lock);
+            unlock_node_state(f);
         }
 #endif /* __SOLARIS__ */
         set_stat(f, ino, &buf);
@@ -1482,9 +1673,9 @@ static void fuse_lib_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
     if (!err) {
 #ifdef __SOLARIS__
         if (f->conf.auto_cache) {
-            pthread_mutex_lock(&f->lock);
+            lock_node_state(f);
             update_stat(get_node(f, ino), &buf);
-            pthread_mutex_unlock(&f->lock);
+            unlock_node_state(f);
         }
 #endif /* __SOLARIS__ */
         set_stat(f, ino, &buf);
@@ -1760,7 +1951,7 @@ static void fuse_do_release(struct fuse *f, fuse_ino_t ino, const char *path,
 
     fuse_fs_release(f->fs, path ? path : "-", fi);
 
-    pthread_mutex_lock(&f->lock);
+    lock_node_state(f);
     node = get_node(f, ino);
     assert(node->open_count > 0);
     --node->open_count;
@@ -1768,7 +1959,7 @@ static void fuse_do_release(struct fuse *f, fuse_ino_t ino, const char *path,
         unlink_hidden = 1;
         node->is_hidden = 0;
     }
-    pthread_mutex_unlock(&f->lock);
+    unlock_node_state(f);
 
     if(unlink_hidden && path)
         fuse_fs_unlink(f->fs, path);
@@ -1809,9 +2000,9 @@ static void fuse_lib_create(fuse_req_t req, fuse_ino_t parent,
         fuse_finish_interrupt(f, req, &d);
     }
     if (!err) {
-        pthread_mutex_lock(&f->lock);
+        lock_node_state(f);
         get_node(f, e.ino)->open_count++;
-        pthread_mutex_unlock(&f->lock);
+        unlock_node_state(f);
         if (fuse_reply_create(req, &e, fi) == -ENOENT) {
             /* The open syscall was interrupted, so it must be cancelled */
             fuse_prepare_interrupt(f, req, &d);
@@ -1845,7 +2036,7 @@ static void open_auto_cache(struct fuse *f, fuse_ino_t ino, const char *path,
 {
     struct node *node;
 
-    pthread_mutex_lock(&f->lock);
+    lock_node_state(f);
     node = get_node(f, ino);
     if (node->cache_valid) {
         struct timespec now;
@@ -1854,9 +2045,9 @@ static void open_auto_cache(struct fuse *f, fuse_ino_t ino, const char *path,
         if (diff_timespec(&now, &node->stat_updated) > f->conf.ac_attr_timeout) {
             struct stat stbuf;
             int err;
-            pthread_mutex_unlock(&f->lock);
+            unlock_node_state(f);
             err = fuse_fs_fgetattr(f->fs, path, &stbuf, fi);
-            pthread_mutex_lock(&f->lock);
+            lock_node_state(f);
             if (!err)
                 update_stat(node, &stbuf);
             else
@@ -1867,7 +2058,7 @@ static void open_auto_cache(struct fuse *f, fuse_ino_t ino, const char *path,
         fi->keep_cache = 1;
 
     node->cache_valid = 1;
-    pthread_mutex_unlock(&f->lock);
+    unlock_node_state(f);
 }
 
 #endif /* __SOLARIS__ */
@@ -1900,9 +2091,9 @@ static void fuse_lib_open(fuse_req_t req, fuse_ino_t ino,
         fuse_finish_interrupt(f, req, &d);
     }
     if (!err) {
-        pthread_mutex_lock(&f->lock);
+        lock_node_state(f);
         get_node(f, ino)->open_count++;
-        pthread_mutex_unlock(&f->lock);
+        unlock_node_state(f);
         if (fuse_reply_open(req, fi) == -ENOENT) {
             /* The open syscall was interrupted, so it must be cancelled */
             fuse_prepare_interrupt(f, req, &d);
@@ -2138,11 +2329,11 @@ static int fill_dir(void *dh_, const char *name, const struct stat *statp,
         stbuf.st_ino = FUSE_UNKNOWN_INO;
         if (dh->fuse->conf.readdir_ino) {
             struct node *node;
-            pthread_mutex_lock(&dh->fuse->lock);
+            pthread_rwlock_rdlock(&dh->fuse->node_lock);
             node = lookup_node(dh->fuse, dh->nodeid, name);
             if (node)
                 stbuf.st_ino  = (ino_t) node->nodeid;
-            pthread_mutex_unlock(&dh->fuse->lock);
+            pthread_rwlock_unlock(&dh->fuse->node_lock);
         }
     }
 
@@ -2584,9 +2775,9 @@ static int fuse_flush_common(struct fuse *f, fuse_req_t req, fuse_ino_t ino,
     if (errlock != -ENOSYS) {
         flock_to_lock(&lock, &l);
         l.owner = fi->lock_owner;
-        pthread_mutex_lock(&f->lock);
+        lock_node_state(f);
         locks_insert(get_node(f, ino), &l);
-        pthread_mutex_unlock(&f->lock);
+        unlock_node_state(f);
 
         /* if op.lock() is defined FLUSH is needed regardless of op.flush() */
         if (err == -ENOSYS)
@@ -2674,11 +2865,11 @@ static void fuse_lib_getlk(fuse_req_t req, fuse_ino_t ino,
 
     flock_to_lock(lock, &l);
     l.owner = fi->lock_owner;
-    pthread_mutex_lock(&f->lock);
+    lock_node_state(f);
     conflict = locks_conflict(get_node(f, ino), &l);
     if (conflict)
         lock_to_flock(conflict, lock);
-    pthread_mutex_unlock(&f->lock);
+    unlock_node_state(f);
     if (!conflict)
         err = fuse_lock_common(req, ino, fi, lock, F_GETLK);
     else
@@ -2700,9 +2891,9 @@ static void fuse_lib_setlk(fuse_req_t req, fuse_ino_t ino,
         struct lock l;
         flock_to_lock(lock, &l);
         l.owner = fi->lock_owner;
-        pthread_mutex_lock(&f->lock);
+        lock_node_state(f);
         locks_insert(get_node(f, ino), &l);
-        pthread_mutex_unlock(&f->lock);
+        unlock_node_state(f);
     }
     reply_err(req, err);
 }
@@ -2785,6 +2976,57 @@ out:
     free(out_buf);
 }
 
+static void fuse_lib_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+                               off_t offset, off_t length,
+                               struct fuse_file_info *fi)
+{
+    struct fuse *f = req_fuse_prepare(req);
+    char *path;
+    int err;
+
+    err = -ENOENT;
+    pthread_rwlock_rdlock(&f->tree_lock);
+    path = get_path(f, ino);
+    if (path != NULL) {
+        struct fuse_intr_data d;
+        if (f->conf.debug)
+            fprintf(stderr, "FALLOCATE[%llu] mode 0x%x %llu+%llu\n",
+                    (unsigned long long) fi->fh, mode,
+                    (unsigned long long) offset,
+                    (unsigned long long) length);
+        fuse_prepare_interrupt(f, req, &d);
+        err = fuse_fs_fallocate(f->fs, path, mode, offset, length, fi);
+        fuse_finish_interrupt(f, req, &d);
+        free(path);
+    }
+    pthread_rwlock_unlock(&f->tree_lock);
+    reply_err(req, err);
+}
+
+static void fuse_lib_lseek(fuse_req_t req, fuse_ino_t ino, off_t off,
+                           int whence, struct fuse_file_info *fi)
+{
+    struct fuse *f = req_fuse_prepare(req);
+    char *path;
+    off_t res;
+
+    res = -ENOENT;
+    pthread_rwlock_rdlock(&f->tree_lock);
+    path = get_path(f, ino);
+    if (path != NULL) {
+        struct fuse_intr_data d;
+        fuse_prepare_interrupt(f, req, &d);
+        res = fuse_fs_lseek(f->fs, path, off, whence, fi);
+        fuse_finish_interrupt(f, req, &d);
+        free(path);
+    }
+    pthread_rwlock_unlock(&f->tree_lock);
+    if (res >= 0)
+        fuse_reply_lseek(req, res);
+    else
+        reply_err(req, (int)res);
+}
+
 static struct fuse_lowlevel_ops fuse_path_ops = {
     .init = fuse_lib_init,
     .destroy = fuse_lib_destroy,
@@ -2821,6 +3063,8 @@ static struct fuse_lowlevel_ops fuse_path_ops = {
     .setlk = fuse_lib_setlk,
     .bmap = fuse_lib_bmap,
     .ioctl = fuse_lib_ioctl,
+    .fallocate = fuse_lib_fallocate,
+    .lseek = fuse_lib_lseek,
 };
 
 struct fuse_session *fuse_get_session(struct fuse *f)
@@ -3123,7 +3367,6 @@ struct fuse *fuse_new(struct fuse_chan *ch, struct fuse_args *args,
 
     f->ctr = 0;
     f->generation = 0;
-    /* FIXME: Dynamic hash table */
     f->name_table_size = 14057;
     f->name_table = (struct node **)
         calloc(1, sizeof(struct node *) * f->name_table_size);
@@ -3141,6 +3384,7 @@ struct fuse *fuse_new(struct fuse_chan *ch, struct fuse_args *args,
     }
 
     fuse_mutex_init(&f->lock);
+    pthread_rwlock_init(&f->node_lock, NULL);
     pthread_rwlock_init(&f->tree_lock, NULL);
 
     root = (struct node *) calloc(1, sizeof(struct node));
@@ -3233,6 +3477,7 @@ void fuse_destroy(struct fuse *f)
     free(f->id_table);
     free(f->name_table);
     pthread_mutex_destroy(&f->lock);
+    pthread_rwlock_destroy(&f->node_lock);
     pthread_rwlock_destroy(&f->tree_lock);
     fuse_session_destroy(f->se);
 #ifdef __SOLARIS__
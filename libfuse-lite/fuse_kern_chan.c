@@ -6,16 +6,28 @@
     See the file COPYING.LIB
 */
 
+/* For splice() and vmsplice() */
+#define _GNU_SOURCE
+
 #include "config.h"
 #include "fuse_lowlevel.h"
 #include "fuse_kernel.h"
 #include "fuse_i.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <assert.h>
 
+#if defined(HAVE_SPLICE) && defined(HAVE_VMSPLICE)
+#define USE_SPLICE 1
+#include <sys/uio.h>
+#endif
+
 static int fuse_kern_chan_receive(struct fuse_chan **chp, char *buf,
                                   size_t size)
 {
@@ -76,6 +88,169 @@ static int fuse_kern_chan_send(struct fuse_chan *ch, const struct iovec iov[],
     return 0;
 }
 
+#ifdef USE_SPLICE
+
+/*
+ * Replies are spliced to the device through a pipe, each thread
+ * has its own one, sized for the replies it has to send.
+ */
+struct fuse_pipe {
+    int fd[2];
+    size_t size;
+};
+
+static pthread_key_t fuse_pipe_key;
+static pthread_once_t fuse_pipe_once = PTHREAD_ONCE_INIT;
+static int fuse_pipe_key_ok;
+
+static void fuse_pipe_free(void *data)
+{
+    struct fuse_pipe *p = (struct fuse_pipe *) data;
+
+    close(p->fd[0]);
+    close(p->fd[1]);
+    free(p);
+}
+
+static void fuse_pipe_init(void)
+{
+    fuse_pipe_key_ok = !pthread_key_create(&fuse_pipe_key, fuse_pipe_free);
+}
+
+static struct fuse_pipe *fuse_pipe_get(size_t size)
+{
+    struct fuse_pipe *p;
+
+    pthread_once(&fuse_pipe_once, fuse_pipe_init);
+    if (!fuse_pipe_key_ok)
+        return NULL;
+    p = (struct fuse_pipe *) pthread_getspecific(fuse_pipe_key);
+    if (!p) {
+        p = (struct fuse_pipe *) malloc(sizeof(struct fuse_pipe));
+        if (!p)
+            return NULL;
+        if (pipe(p->fd)) {
+            free(p);
+            return NULL;
+        }
+        p->size = 16 * getpagesize();
+        pthread_setspecific(fuse_pipe_key, p);
+    }
+    if (p->size < size) {
+#ifdef F_SETPIPE_SZ
+        int res = fcntl(p->fd[1], F_SETPIPE_SZ, size);
+        if (res < 0)
+            return NULL;
+        p->size = res;
+#else
+        return NULL;
+#endif
+    }
+    return p;
+}
+
+/*
+ * The pipe may hold the beginning of a reply which could not be
+ * completed, so it cannot be used any more.
+ */
+static void fuse_pipe_drop(struct fuse_pipe *p)
+{
+    pthread_setspecific(fuse_pipe_key, NULL);
+    fuse_pipe_free(p);
+}
+
+static int fuse_pipe_fill_mem(struct fuse_pipe *p, const void *mem, size_t size)
+{
+    struct iovec iov;
+    ssize_t res;
+
+    iov.iov_base = (void *)(uintptr_t) mem;
+    iov.iov_len = size;
+    while (iov.iov_len) {
+        res = vmsplice(p->fd[1], &iov, 1, 0);
+        if (res <= 0)
+            return -1;
+        iov.iov_base = (char *) iov.iov_base + res;
+        iov.iov_len -= res;
+    }
+    return 0;
+}
+
+static int fuse_pipe_fill_fd(struct fuse_pipe *p, int fd, off_t pos,
+                             size_t size)
+{
+    loff_t off = pos;
+    ssize_t res;
+
+    while (size) {
+        res = splice(fd, &off, p->fd[1], NULL, size, 0);
+        if (res <= 0)
+            return -1;
+        size -= res;
+    }
+    return 0;
+}
+
+static int fuse_kern_chan_send_data(struct fuse_chan *ch,
+                                    const struct iovec iov[], size_t count,
+                                    const struct fuse_buf *bufv, int bufcount)
+{
+    struct fuse_pipe *p;
+    size_t total = 0;
+    ssize_t res;
+    size_t i;
+    int err;
+
+    for (i = 0; i < count; i++)
+        total += iov[i].iov_len;
+    for (i = 0; i < (size_t) bufcount; i++)
+        total += bufv[i].size;
+    /*
+     * The pipe must be able to hold the whole reply, so that filling
+     * it never blocks, and each block may leave a partially filled
+     * page in the pipe. It cannot be made non blocking, as reading
+     * from files would then fail on data not in the page cache.
+     */
+    p = fuse_pipe_get(total + (count + 2 * bufcount) * getpagesize());
+    if (!p)
+        return -ENOSYS;
+
+    for (i = 0; i < count; i++)
+        if (fuse_pipe_fill_mem(p, iov[i].iov_base, iov[i].iov_len))
+            goto fallback;
+    for (i = 0; i < (size_t) bufcount; i++) {
+        if (bufv[i].mem)
+            err = fuse_pipe_fill_mem(p, bufv[i].mem, bufv[i].size);
+        else
+            err = fuse_pipe_fill_fd(p, bufv[i].fd, bufv[i].pos,
+                                    bufv[i].size);
+        if (err)
+            goto fallback;
+    }
+
+    /* The whole reply must be transferred at once */
+    res = splice(p->fd[0], NULL, fuse_chan_fd(ch), NULL, total, 0);
+    if (res == (ssize_t) total)
+        return 0;
+    err = (res == -1 ? errno : EIO);
+    fuse_pipe_drop(p);
+    if (err != ENOENT) {
+        struct fuse_session *se = fuse_chan_session(ch);
+
+        assert(se != NULL);
+        if (!fuse_session_exited(se))
+            perror("fuse: splicing to device");
+    }
+    return -err;
+
+fallback:
+    /* nothing was sent, the caller may send the reply otherwise */
+    fuse_pipe_drop(p);
+    return -ENOSYS;
+}
+
+#endif /* USE_SPLICE */
+
 static void fuse_kern_chan_destroy(struct fuse_chan *ch)
 {
     close(fuse_chan_fd(ch));
@@ -83,14 +258,23 @@ static void fuse_kern_chan_destroy(struct fuse_chan *ch)
 
 #define MIN_BUFSIZE 0x21000
 
+/*
+ * The receive buffer has to hold the largest write request the kernel
+ * may send, that is the data which can be negotiated through
+ * FUSE_MAX_PAGES and one page for the headers. Kernels which cannot
+ * issue requests this big only make use of the beginning of the buffer.
+ */
 struct fuse_chan *fuse_kern_chan_new(int fd)
 {
     struct fuse_chan_ops op = {
         .receive = fuse_kern_chan_receive,
         .send = fuse_kern_chan_send,
+#ifdef USE_SPLICE
+        .send_data = fuse_kern_chan_send_data,
+#endif
         .destroy = fuse_kern_chan_destroy,
     };
-    size_t bufsize = getpagesize() + 0x1000;
+    size_t bufsize = (FUSE_MAX_MAX_PAGES + 1) * getpagesize();
     bufsize = bufsize < MIN_BUFSIZE ? MIN_BUFSIZE : bufsize;
     return fuse_chan_new(&op, fd, bufsize, NULL);
 }
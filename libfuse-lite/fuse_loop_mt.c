@@ -0,0 +1,504 @@
+/*
+    FUSE: Filesystem in Userspace
+    Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+
+    This program can be distributed under the terms of the GNU LGPLv2.
+    See the file COPYING.LIB
+*/
+
+#include "config.h"
+#include "fuse_lowlevel.h"
+#include "fuse_kernel.h"
+#include "fuse_misc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/time.h>
+
+/*
+ * Workers which have found nothing to do for a while are
+ * terminated, but a few of them are always kept available.
+ */
+#define FUSE_MAX_IDLE_WORKERS 10
+
+/* Upper limit on workers when the caller does not set one */
+#define FUSE_DEFAULT_MAX_THREADS 16
+
+struct fuse_worker {
+    struct fuse_worker *prev;
+    struct fuse_worker *next;
+    pthread_t thread_id;
+    size_t bufsize;
+    char *buf;
+    struct fuse_mt *mt;
+};
+
+/*
+ * A session served by a shared pool of workers
+ */
+struct fuse_mt_session {
+    struct fuse_session *se;
+    struct fuse_chan *ch;
+    void *data;
+    int busy;           /* requests being processed */
+    int done;           /* exit reported to the caller */
+};
+
+struct fuse_mt {
+    pthread_mutex_t lock;
+    int numworker;
+    int numavail;
+    int maxworker;
+    struct fuse_session *se;
+    struct fuse_chan *prevch;
+    struct fuse_worker main;
+    sem_t finish;
+    int exit;
+    int error;
+    /* for a pool shared by several sessions */
+    struct fuse_mt_session *sessions;
+    int count;
+    void (*enter)(void *data);
+};
+
+static void list_add_worker(struct fuse_worker *w, struct fuse_worker *next)
+{
+    struct fuse_worker *prev = next->prev;
+    w->next = next;
+    w->prev = prev;
+    prev->next = w;
+    next->prev = w;
+}
+
+static void list_del_worker(struct fuse_worker *w)
+{
+    struct fuse_worker *prev = w->prev;
+    struct fuse_worker *next = w->next;
+    prev->next = next;
+    next->prev = prev;
+}
+
+static int fuse_start_thread(struct fuse_mt *mt);
+static void *fuse_do_work_shared(void *data);
+
+static void *fuse_do_work(void *data)
+{
+    struct fuse_worker *w = (struct fuse_worker *) data;
+    struct fuse_mt *mt = w->mt;
+
+    while (!fuse_session_exited(mt->se)) {
+        int isforget = 0;
+        struct fuse_chan *ch = mt->prevch;
+        int res;
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        res = fuse_chan_recv(&ch, w->buf, w->bufsize);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if (res == -EINTR)
+            continue;
+        if (res <= 0) {
+            if (res < 0) {
+                fuse_session_exit(mt->se);
+                mt->error = -1;
+            }
+            break;
+        }
+
+        pthread_mutex_lock(&mt->lock);
+        if (mt->exit) {
+            pthread_mutex_unlock(&mt->lock);
+            return NULL;
+        }
+
+        /*
+         * Do not create new threads on a burst of FORGET messages,
+         * they are processed quickly and never block.
+         */
+        if ((((struct fuse_in_header *) w->buf)->opcode == FUSE_FORGET)
+            || (((struct fuse_in_header *) w->buf)->opcode
+                == FUSE_BATCH_FORGET))
+            isforget = 1;
+
+        if (!isforget)
+            mt->numavail--;
+        if (!mt->numavail && (mt->numworker < mt->maxworker))
+            fuse_start_thread(mt);
+        pthread_mutex_unlock(&mt->lock);
+
+        fuse_session_process(mt->se, w->buf, res, ch);
+
+        pthread_mutex_lock(&mt->lock);
+        if (!isforget)
+            mt->numavail++;
+        if (mt->numavail > FUSE_MAX_IDLE_WORKERS) {
+            if (mt->exit) {
+                pthread_mutex_unlock(&mt->lock);
+                return NULL;
+            }
+            list_del_worker(w);
+            mt->numavail--;
+            mt->numworker--;
+            pthread_mutex_unlock(&mt->lock);
+
+            pthread_detach(w->thread_id);
+            free(w->buf);
+            free(w);
+            return NULL;
+        }
+        pthread_mutex_unlock(&mt->lock);
+    }
+
+    sem_post(&mt->finish);
+    return NULL;
+}
+
+/*
+ * Wait for a request on any session which has not exited
+ *
+ * Returns the size of the request, 0 if there is nothing to process
+ * (the request was taken by another worker or a session has exited)
+ * and -1 when all the sessions have exited.
+ */
+static int fuse_shared_recv(struct fuse_mt *mt, struct fuse_worker *w,
+                            struct fuse_mt_session **psession)
+{
+    struct pollfd fds[mt->count];
+    struct fuse_mt_session *index[mt->count];
+    struct fuse_mt_session *s;
+    struct fuse_chan *ch;
+    int len;
+    int n;
+    int i;
+    int res;
+
+    len = 0;
+    n = 0;
+    pthread_mutex_lock(&mt->lock);
+    for (i = 0; i < mt->count; i++) {
+        s = &mt->sessions[i];
+        if (!fuse_session_exited(s->se)) {
+            fds[n].fd = fuse_chan_fd(s->ch);
+            fds[n].events = POLLIN;
+            fds[n].revents = 0;
+            index[n++] = s;
+        }
+    }
+    pthread_mutex_unlock(&mt->lock);
+    if (!n)
+        return -1;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    if (mt->count > 1)
+        res = poll(fds, n, -1);
+    else {
+        /* a single session is read in blocking mode, as usual */
+        fds[0].revents = POLLIN;
+        res = 1;
+    }
+    for (i = 0; (res > 0) && (i < n); i++) {
+        if (!fds[i].revents)
+            continue;
+        s = index[i];
+        ch = s->ch;
+        res = fuse_chan_recv(&ch, w->buf, w->bufsize);
+        if (res > 0) {
+            *psession = s;
+            len = res;
+            break;
+        }
+        /* -EAGAIN when another worker got the request first */
+        if (!res || ((res != -EAGAIN) && (res != -EINTR))) {
+            if (res < 0) {
+                fuse_session_exit(s->se);
+                mt->error = -1;
+            }
+            sem_post(&mt->finish);
+        }
+        res = 1;
+    }
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    return len;
+}
+
+/*
+ * Worker of a pool shared by several sessions
+ *
+ * The caller is called back before each request is processed, so that
+ * it can find the state of the session.
+ */
+static void *fuse_do_work_shared(void *data)
+{
+    struct fuse_worker *w = (struct fuse_worker *) data;
+    struct fuse_mt *mt = w->mt;
+    struct fuse_mt_session *s;
+    int isforget;
+    int res;
+
+    while (1) {
+        res = fuse_shared_recv(mt, w, &s);
+        if (res < 0)
+            break;
+        if (!res)
+            continue;
+
+        pthread_mutex_lock(&mt->lock);
+        if (mt->exit) {
+            pthread_mutex_unlock(&mt->lock);
+            return NULL;
+        }
+        /* too late, the session has been released */
+        if (s->done) {
+            pthread_mutex_unlock(&mt->lock);
+            continue;
+        }
+        isforget = ((((struct fuse_in_header *) w->buf)->opcode
+                        == FUSE_FORGET)
+                    || (((struct fuse_in_header *) w->buf)->opcode
+                        == FUSE_BATCH_FORGET));
+        if (!isforget)
+            mt->numavail--;
+        if (!mt->numavail && (mt->numworker < mt->maxworker))
+            fuse_start_thread(mt);
+        s->busy++;
+        pthread_mutex_unlock(&mt->lock);
+
+        if (mt->enter)
+            mt->enter(s->data);
+        fuse_session_process(s->se, w->buf, res, s->ch);
+
+        pthread_mutex_lock(&mt->lock);
+        s->busy--;
+        if (!isforget)
+            mt->numavail++;
+        if (!s->busy && fuse_session_exited(s->se))
+            sem_post(&mt->finish);
+        if (mt->numavail > FUSE_MAX_IDLE_WORKERS) {
+            if (mt->exit) {
+                pthread_mutex_unlock(&mt->lock);
+                return NULL;
+            }
+            list_del_worker(w);
+            mt->numavail--;
+            mt->numworker--;
+            pthread_mutex_unlock(&mt->lock);
+
+            pthread_detach(w->thread_id);
+            free(w->buf);
+            free(w);
+            return NULL;
+        }
+        pthread_mutex_unlock(&mt->lock);
+    }
+
+    sem_post(&mt->finish);
+    return NULL;
+}
+
+/*
+ * Must be called with mt->lock held
+ */
+static int fuse_start_thread(struct fuse_mt *mt)
+{
+    sigset_t oldset;
+    sigset_t newset;
+    int res;
+    struct fuse_worker *w = malloc(sizeof(struct fuse_worker));
+    if (!w) {
+        fprintf(stderr, "fuse: failed to allocate worker structure\n");
+        return -1;
+    }
+    memset(w, 0, sizeof(struct fuse_worker));
+    w->bufsize = fuse_chan_bufsize(mt->prevch);
+    w->buf = malloc(w->bufsize);
+    w->mt = mt;
+    if (!w->buf) {
+        fprintf(stderr, "fuse: failed to allocate read buffer\n");
+        free(w);
+        return -1;
+    }
+
+    /* Disallow signal reception in worker threads */
+    sigemptyset(&newset);
+    sigaddset(&newset, SIGTERM);
+    sigaddset(&newset, SIGINT);
+    sigaddset(&newset, SIGHUP);
+    sigaddset(&newset, SIGQUIT);
+    pthread_sigmask(SIG_BLOCK, &newset, &oldset);
+    res = pthread_create(&w->thread_id, NULL,
+                         (mt->sessions ? fuse_do_work_shared : fuse_do_work),
+                         w);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    if (res != 0) {
+        fprintf(stderr, "fuse: error creating thread: %s\n", strerror(res));
+        free(w->buf);
+        free(w);
+        return -1;
+    }
+    list_add_worker(w, &mt->main);
+    mt->numavail++;
+    mt->numworker++;
+
+    return 0;
+}
+
+static void fuse_join_worker(struct fuse_mt *mt, struct fuse_worker *w)
+{
+    pthread_join(w->thread_id, NULL);
+    pthread_mutex_lock(&mt->lock);
+    list_del_worker(w);
+    pthread_mutex_unlock(&mt->lock);
+    free(w->buf);
+    free(w);
+}
+
+int fuse_session_loop_mt_max(struct fuse_session *se, int max_threads)
+{
+    int err;
+    struct fuse_mt mt;
+    struct fuse_worker *w;
+
+    memset(&mt, 0, sizeof(struct fuse_mt));
+    mt.se = se;
+    mt.prevch = fuse_session_next_chan(se, NULL);
+    mt.error = 0;
+    mt.numworker = 0;
+    mt.numavail = 0;
+    mt.maxworker = (max_threads > 0 ? max_threads : FUSE_DEFAULT_MAX_THREADS);
+    mt.main.thread_id = pthread_self();
+    mt.main.prev = mt.main.next = &mt.main;
+    sem_init(&mt.finish, 0, 0);
+    fuse_mutex_init(&mt.lock);
+
+    pthread_mutex_lock(&mt.lock);
+    err = fuse_start_thread(&mt);
+    pthread_mutex_unlock(&mt.lock);
+    if (!err) {
+        /* sem_wait() is interruptible */
+        while (!fuse_session_exited(se))
+            sem_wait(&mt.finish);
+
+        pthread_mutex_lock(&mt.lock);
+        for (w = mt.main.next; w != &mt.main; w = w->next)
+            pthread_cancel(w->thread_id);
+        mt.exit = 1;
+        pthread_mutex_unlock(&mt.lock);
+
+        while (mt.main.next != &mt.main)
+            fuse_join_worker(&mt, mt.main.next);
+
+        err = mt.error;
+    }
+
+    pthread_mutex_destroy(&mt.lock);
+    sem_destroy(&mt.finish);
+    fuse_session_reset(se);
+    return err;
+}
+
+int fuse_session_loop_mt(struct fuse_session *se)
+{
+    return fuse_session_loop_mt_max(se, FUSE_DEFAULT_MAX_THREADS);
+}
+
+/*
+ * Serve several sessions with a shared pool of workers
+ *
+ * Each worker waits for a request on any session. The function enter()
+ * is called with the data of the session before each request, and
+ * leave() is called from the calling thread when a session has exited
+ * and none of its requests is being processed any more, so that the
+ * caller can release its resources while the others are still served.
+ * The function returns when all the sessions have exited.
+ */
+int fuse_sessions_loop_mt_max(struct fuse_session **se, void **data, int count,
+                              int max_threads, void (*enter)(void *data),
+                              void (*leave)(void *data))
+{
+    int err;
+    int alive;
+    int flags;
+    int i;
+    size_t bufsize;
+    struct fuse_mt mt;
+    struct fuse_mt_session *s;
+    struct fuse_worker *w;
+
+    memset(&mt, 0, sizeof(struct fuse_mt));
+    mt.sessions = calloc(count, sizeof(struct fuse_mt_session));
+    if (!count || !mt.sessions) {
+        free(mt.sessions);
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        s = &mt.sessions[i];
+        s->se = se[i];
+        s->ch = fuse_session_next_chan(se[i], NULL);
+        s->data = data[i];
+        /* a request may be taken by another worker after poll() */
+        flags = fcntl(fuse_chan_fd(s->ch), F_GETFL);
+        if ((count > 1) && (flags != -1))
+            fcntl(fuse_chan_fd(s->ch), F_SETFL, flags | O_NONBLOCK);
+    }
+    mt.count = count;
+    mt.enter = enter;
+    mt.prevch = mt.sessions[0].ch;
+    bufsize = fuse_chan_bufsize(mt.prevch);
+    for (i = 1; i < count; i++)
+        if (fuse_chan_bufsize(mt.sessions[i].ch) > bufsize)
+            mt.prevch = mt.sessions[i].ch;
+    mt.maxworker = (max_threads > 0 ? max_threads : FUSE_DEFAULT_MAX_THREADS);
+    mt.main.thread_id = pthread_self();
+    mt.main.prev = mt.main.next = &mt.main;
+    sem_init(&mt.finish, 0, 0);
+    fuse_mutex_init(&mt.lock);
+
+    pthread_mutex_lock(&mt.lock);
+    err = fuse_start_thread(&mt);
+    pthread_mutex_unlock(&mt.lock);
+    if (!err) {
+        alive = count;
+        while (alive) {
+            /* sem_wait() is interruptible, by the signal handlers */
+            sem_wait(&mt.finish);
+            pthread_mutex_lock(&mt.lock);
+            for (i = 0; i < count; i++) {
+                s = &mt.sessions[i];
+                if (!s->done && !s->busy && fuse_session_exited(s->se)) {
+                    s->done = 1;
+                    alive--;
+                    if (leave) {
+                        pthread_mutex_unlock(&mt.lock);
+                        leave(s->data);
+                        pthread_mutex_lock(&mt.lock);
+                    }
+                }
+            }
+            pthread_mutex_unlock(&mt.lock);
+        }
+
+        pthread_mutex_lock(&mt.lock);
+        for (w = mt.main.next; w != &mt.main; w = w->next)
+            pthread_cancel(w->thread_id);
+        mt.exit = 1;
+        pthread_mutex_unlock(&mt.lock);
+
+        while (mt.main.next != &mt.main)
+            fuse_join_worker(&mt, mt.main.next);
+
+        err = mt.error;
+    }
+
+    pthread_mutex_destroy(&mt.lock);
+    sem_destroy(&mt.finish);
+    for (i = 0; i < count; i++)
+        fuse_session_reset(se[i]);
+    free(mt.sessions);
+    return err;
+}
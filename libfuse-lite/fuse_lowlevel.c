@@ -21,6 +21,10 @@
 #include <unistd.h>
 #include <limits.h>
 #include <errno.h>
+#include <time.h>
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+#endif
 
 #define PARAM(inarg) (((const char *)(inarg)) + sizeof(*(inarg)))
 #define OFFSET_MAX 0x7fffffffffffffffLL
@@ -60,6 +64,7 @@ struct fuse_ll {
     struct fuse_req interrupts;
     pthread_mutex_t lock;
     int got_destroy;
+    struct fuse_op_stats *stats;
 };
 
 static void convert_stat(const struct stat *stbuf, struct fuse_attr *attr)
@@ -319,6 +324,34 @@ static void fill_entry(struct fuse_entry_out *arg,
     convert_stat(&e->attr, &arg->attr);
 }
 
+size_t fuse_add_direntry_plus(fuse_req_t req, char *buf, size_t bufsize,
+                              const char *name,
+                              const struct fuse_entry_param *e, off_t off)
+{
+    struct fuse_direntplus *dp;
+    size_t namelen;
+    size_t entlen;
+    size_t entsize;
+
+    (void) req;
+    namelen = strlen(name);
+    entlen = FUSE_NAME_OFFSET_DIRENTPLUS + namelen;
+    entsize = FUSE_DIRENT_ALIGN(entlen);
+    if (entsize <= bufsize && buf) {
+        dp = (struct fuse_direntplus *) buf;
+        memset(&dp->entry_out, 0, sizeof(dp->entry_out));
+        if (e->ino)
+            fill_entry(&dp->entry_out, e);
+        dp->dirent.ino = e->attr.st_ino;
+        dp->dirent.off = off;
+        dp->dirent.namelen = namelen;
+        dp->dirent.type = (e->attr.st_mode & 0170000) >> 12;
+        memcpy(dp->dirent.name, name, namelen);
+        memset(buf + entlen, 0, entsize - entlen);
+    }
+    return entsize;
+}
+
 static void fill_open(struct fuse_open_out *arg,
                       const struct fuse_file_info *f)
 {
@@ -408,6 +441,66 @@ int fuse_reply_buf(fuse_req_t req, const char *buf, size_t size)
     return send_reply_ok(req, buf, size);
 }
 
+static int read_buf(const struct fuse_buf *buf, char *dst)
+{
+    size_t done = 0;
+    ssize_t res;
+
+    while (done < buf->size) {
+        res = pread(buf->fd, dst + done, buf->size - done, buf->pos + done);
+        if (res <= 0)
+            return (res < 0 ? -errno : -EIO);
+        done += res;
+    }
+    return 0;
+}
+
+int fuse_reply_data(fuse_req_t req, const struct fuse_buf *bufv, int count)
+{
+    struct fuse_out_header out;
+    struct iovec iov[1];
+    char *buf;
+    size_t size = 0;
+    int res = 0;
+    int i;
+
+    for (i = 0; i < count; i++)
+        size += bufv[i].size;
+    out.unique = req->unique;
+    out.error = 0;
+    out.len = sizeof(struct fuse_out_header) + size;
+    iov[0].iov_base = &out;
+    iov[0].iov_len = sizeof(struct fuse_out_header);
+    res = fuse_chan_send_data(req->ch, iov, 1, bufv, count);
+    if (res != -ENOSYS) {
+        if (req->f->debug)
+            fprintf(stderr, "   unique: %llu, error: 0 (spliced), outsize: %i\n",
+                    (unsigned long long) out.unique, out.len);
+        free_req(req);
+        return res;
+    }
+
+    /* Cannot splice, gather the data into a buffer */
+    buf = (char *) malloc(size ? size : 1);
+    if (buf == NULL)
+        return fuse_reply_err(req, ENOMEM);
+    size = 0;
+    res = 0;
+    for (i = 0; (i < count) && !res; i++) {
+        if (bufv[i].mem)
+            memcpy(buf + size, bufv[i].mem, bufv[i].size);
+        else
+            res = read_buf(&bufv[i], buf + size);
+        size += bufv[i].size;
+    }
+    if (res)
+        res = fuse_reply_err(req, -res);
+    else
+        res = send_reply_ok(req, buf, size);
+    free(buf);
+    return res;
+}
+
 int fuse_reply_statfs(fuse_req_t req, const struct statvfs *stbuf)
 {
     struct fuse_statfs_out arg;
@@ -456,6 +549,16 @@ int fuse_reply_bmap(fuse_req_t req, uint64_t idx)
     return send_reply_ok(req, &arg, sizeof(arg));
 }
 
+int fuse_reply_lseek(fuse_req_t req, off_t off)
+{
+    struct fuse_lseek_out arg;
+
+    memset(&arg, 0, sizeof(arg));
+    arg.offset = off;
+
+    return send_reply_ok(req, &arg, sizeof(arg));
+}
+
 int fuse_reply_ioctl(fuse_req_t req, int result, const void *buf, size_t size)
 {
     struct fuse_ioctl_out arg;
@@ -478,6 +581,79 @@ int fuse_reply_ioctl(fuse_req_t req, int result, const void *buf, size_t size)
     return send_reply_iov(req, 0, iov, count);
 }
 
+static int send_notify_iov(struct fuse_ll *f, struct fuse_chan *ch,
+                           int notify_code, struct iovec *iov, int count)
+{
+    struct fuse_out_header out;
+
+    /* notifications were introduced in protocol 7.12 */
+    if (!f->got_init || (f->conn.proto_minor < 12))
+        return -ENOSYS;
+
+    out.unique = 0;
+    out.error = notify_code;
+    iov[0].iov_base = &out;
+    iov[0].iov_len = sizeof(struct fuse_out_header);
+    out.len = iov_length(iov, count);
+
+    if (f->debug)
+        fprintf(stderr, "NOTIFY: code=%d length=%u\n",
+                notify_code, out.len);
+
+    return fuse_chan_send(ch, iov, count);
+}
+
+int fuse_lowlevel_notify_inval_inode(struct fuse_chan *ch, fuse_ino_t ino,
+                                     off_t off, off_t len)
+{
+    struct fuse_notify_inval_inode_out outarg;
+    struct fuse_ll *f;
+    struct iovec iov[2];
+
+    if (!ch)
+        return -EINVAL;
+
+    f = (struct fuse_ll *) fuse_session_data(fuse_chan_session(ch));
+    if (!f)
+        return -ENODEV;
+
+    outarg.ino = ino;
+    outarg.off = off;
+    outarg.len = len;
+
+    iov[1].iov_base = &outarg;
+    iov[1].iov_len = sizeof(outarg);
+
+    return send_notify_iov(f, ch, FUSE_NOTIFY_INVAL_INODE, iov, 2);
+}
+
+int fuse_lowlevel_notify_inval_entry(struct fuse_chan *ch, fuse_ino_t parent,
+                                     const char *name, size_t namelen)
+{
+    struct fuse_notify_inval_entry_out outarg;
+    struct fuse_ll *f;
+    struct iovec iov[3];
+
+    if (!ch)
+        return -EINVAL;
+
+    f = (struct fuse_ll *) fuse_session_data(fuse_chan_session(ch));
+    if (!f)
+        return -ENODEV;
+
+    outarg.parent = parent;
+    outarg.namelen = namelen;
+    outarg.padding = 0;
+
+    iov[1].iov_base = &outarg;
+    iov[1].iov_len = sizeof(outarg);
+		/* Note : const qualifier dropped */
+    iov[2].iov_base = (char *)(uintptr_t) name;
+    iov[2].iov_len = namelen + 1;
+
+    return send_notify_iov(f, ch, FUSE_NOTIFY_INVAL_ENTRY, iov, 3);
+}
+
 static void do_lookup(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 {
     const char *name = (const char *) inarg;
@@ -498,6 +674,55 @@ static void do_forget(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
         fuse_reply_none(req);
 }
 
+static void do_batch_forget(fuse_req_t req, fuse_ino_t nodeid,
+                            const void *inarg)
+{
+    const struct fuse_batch_forget_in *arg =
+        (const struct fuse_batch_forget_in *) inarg;
+    struct fuse_forget_one *param = (struct fuse_forget_one *) &arg[1];
+    struct fuse_req dummy_req;
+    unsigned int i;
+
+    (void) nodeid;
+    if (req->f->op.forget_multi) {
+        /* same layout, when fuse_ino_t has 64 bits */
+        if (sizeof(struct fuse_forget_data)
+                == sizeof(struct fuse_forget_one))
+            req->f->op.forget_multi(req, arg->count,
+                                    (struct fuse_forget_data *) param);
+        else {
+            struct fuse_forget_data *forgets;
+
+            forgets = (struct fuse_forget_data *)
+                malloc(arg->count * sizeof(struct fuse_forget_data));
+            if (forgets) {
+                for (i = 0; i < arg->count; i++) {
+                    forgets[i].ino = param[i].nodeid;
+                    forgets[i].nlookup = param[i].nlookup;
+                }
+                req->f->op.forget_multi(req, arg->count, forgets);
+                free(forgets);
+            } else
+                fuse_reply_none(req);
+        }
+    } else if (req->f->op.forget) {
+        /*
+         * forget() has to reply to each request, use a copy of
+         * the request which is not registered anywhere, so that
+         * replying to it does nothing.
+         */
+        for (i = 0; i < arg->count; i++) {
+            dummy_req = *req;
+            dummy_req.ctr = 2;
+            list_init_req(&dummy_req);
+            req->f->op.forget(&dummy_req, param[i].nodeid,
+                              param[i].nlookup);
+        }
+        fuse_reply_none(req);
+    } else
+        fuse_reply_none(req);
+}
+
 static void do_getattr(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 {
     (void) inarg;
@@ -792,6 +1017,22 @@ static void do_readdir(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
         fuse_reply_err(req, ENOSYS);
 }
 
+static void do_readdirplus(fuse_req_t req, fuse_ino_t nodeid,
+                           const void *inarg)
+{
+    const struct fuse_read_in *arg = (const struct fuse_read_in *) inarg;
+    struct fuse_file_info fi;
+
+    memset(&fi, 0, sizeof(fi));
+    fi.fh = arg->fh;
+    fi.fh_old = fi.fh;
+
+    if (req->f->op.readdirplus)
+        req->f->op.readdirplus(req, nodeid, arg->size, arg->offset, &fi);
+    else
+        fuse_reply_err(req, ENOSYS);
+}
+
 static void do_releasedir(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 {
     const struct fuse_release_in *arg = (const struct fuse_release_in *) inarg;
@@ -1057,12 +1298,67 @@ static void do_ioctl(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
     	fuse_reply_err(req, ENOSYS);
 }
 
+static void do_fallocate(fuse_req_t req, fuse_ino_t nodeid,
+			 const void *inarg)
+{
+    const struct fuse_fallocate_in *arg =
+		(const struct fuse_fallocate_in *) inarg;
+    struct fuse_file_info fi;
+
+    memset(&fi, 0, sizeof(fi));
+    fi.fh = arg->fh;
+
+    if (req->f->op.fallocate)
+        req->f->op.fallocate(req, nodeid, arg->mode, arg->offset,
+                             arg->length, &fi);
+    else
+        fuse_reply_err(req, EOPNOTSUPP);
+}
+
+static void do_lseek(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
+{
+    const struct fuse_lseek_in *arg = (const struct fuse_lseek_in *) inarg;
+    struct fuse_file_info fi;
+
+    memset(&fi, 0, sizeof(fi));
+    fi.fh = arg->fh;
+
+    if (req->f->op.lseek)
+        req->f->op.lseek(req, nodeid, arg->offset, arg->whence, &fi);
+    else
+        fuse_reply_err(req, ENOSYS);
+}
+
+static void do_copy_file_range(fuse_req_t req, fuse_ino_t nodeid,
+                               const void *inarg)
+{
+    const struct fuse_copy_file_range_in *arg =
+        (const struct fuse_copy_file_range_in *) inarg;
+    struct fuse_file_info fi_in;
+    struct fuse_file_info fi_out;
+
+    memset(&fi_in, 0, sizeof(fi_in));
+    fi_in.fh = arg->fh_in;
+    memset(&fi_out, 0, sizeof(fi_out));
+    fi_out.fh = arg->fh_out;
+
+    if (req->f->op.copy_file_range)
+        req->f->op.copy_file_range(req, nodeid, arg->off_in, &fi_in,
+                                   arg->nodeid_out, arg->off_out, &fi_out,
+                                   arg->len, arg->flags);
+    else
+        fuse_reply_err(req, ENOSYS);
+}
+
 static void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 {
     const struct fuse_init_in *arg = (const struct fuse_init_in *) inarg;
     struct fuse_init_out outarg;
     struct fuse_ll *f = req->f;
     size_t bufsize = fuse_chan_bufsize(req->ch);
+    size_t outsize;
+    unsigned int pagesize;
+    unsigned int maxpages;
 
     (void) nodeid;
     if (f->debug) {
@@ -1095,6 +1391,14 @@ static void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 	    f->conn.capable |= FUSE_CAP_BIG_WRITES;
 	if (arg->flags & FUSE_HAS_IOCTL_DIR)
 	    f->conn.capable |= FUSE_CAP_IOCTL_DIR;
+	if (arg->flags & FUSE_DO_READDIRPLUS)
+	    f->conn.capable |= FUSE_CAP_READDIRPLUS;
+	if (arg->flags & FUSE_READDIRPLUS_AUTO)
+	    f->conn.capable |= FUSE_CAP_READDIRPLUS_AUTO;
+	if (arg->flags & FUSE_WRITEBACK_CACHE)
+	    f->conn.capable |= FUSE_CAP_WRITEBACK_CACHE;
+	if (arg->flags & FUSE_MAX_PAGES)
+	    f->conn.capable |= FUSE_CAP_MAX_PAGES;
     } else {
         f->conn.async_read = 0;
         f->conn.max_readahead = 0;
@@ -1153,17 +1457,48 @@ static void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
         outarg.flags |= FUSE_POSIX_LOCKS;
     if (f->conn.want & FUSE_CAP_BIG_WRITES)
 	outarg.flags |= FUSE_BIG_WRITES;
+    if ((f->conn.capable & FUSE_CAP_READDIRPLUS)
+	    && (f->conn.want & FUSE_CAP_READDIRPLUS) && f->op.readdirplus) {
+	outarg.flags |= FUSE_DO_READDIRPLUS;
+	if ((f->conn.capable & FUSE_CAP_READDIRPLUS_AUTO)
+		&& (f->conn.want & FUSE_CAP_READDIRPLUS_AUTO))
+	    outarg.flags |= FUSE_READDIRPLUS_AUTO;
+    }
+    if ((f->conn.capable & FUSE_CAP_WRITEBACK_CACHE)
+	    && (f->conn.want & FUSE_CAP_WRITEBACK_CACHE))
+	outarg.flags |= FUSE_WRITEBACK_CACHE;
     outarg.max_readahead = f->conn.max_readahead;
     outarg.max_write = f->conn.max_write;
+	/*
+	 * Without FUSE_MAX_PAGES the kernel limits requests to 32 pages,
+	 * ask for as many pages as needed to fill the receive buffer.
+	 */
+    if ((f->conn.capable & FUSE_CAP_MAX_PAGES)
+	    && (f->conn.want & FUSE_CAP_MAX_PAGES)) {
+	pagesize = getpagesize();
+	maxpages = (f->conn.max_write + pagesize - 1) / pagesize;
+	if (maxpages > FUSE_MAX_MAX_PAGES)
+	    maxpages = FUSE_MAX_MAX_PAGES;
+	outarg.flags |= FUSE_MAX_PAGES;
+	outarg.max_pages = maxpages;
+    }
 
     if (f->debug) {
         fprintf(stderr, "   INIT: %u.%u\n", outarg.major, outarg.minor);
         fprintf(stderr, "   flags=0x%08x\n", outarg.flags);
         fprintf(stderr, "   max_readahead=0x%08x\n", outarg.max_readahead);
         fprintf(stderr, "   max_write=0x%08x\n", outarg.max_write);
+        if (outarg.flags & FUSE_MAX_PAGES)
+            fprintf(stderr, "   max_pages=%u\n", outarg.max_pages);
     }
 
-    send_reply_ok(req, &outarg, arg->minor < 5 ? 8 : sizeof(outarg));
+    if (arg->minor < 5)
+	outsize = 8;
+    else if (arg->minor < 23)
+	outsize = FUSE_COMPAT_22_INIT_OUT_SIZE;
+    else
+	outsize = sizeof(outarg);
+    send_reply_ok(req, &outarg, outsize);
 }
 
 static void do_destroy(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
@@ -1252,7 +1587,12 @@ static struct {
     [FUSE_INTERRUPT]   = { do_interrupt,   "INTERRUPT"   },
     [FUSE_BMAP]        = { do_bmap,        "BMAP"        },
     [FUSE_IOCTL]       = { do_ioctl,       "IOCTL"       },
+    [FUSE_BATCH_FORGET] = { do_batch_forget, "BATCH_FORGET" },
+    [FUSE_FALLOCATE]   = { do_fallocate,   "FALLOCATE"   },
     [FUSE_DESTROY]     = { do_destroy,     "DESTROY"     },
+    [FUSE_READDIRPLUS] = { do_readdirplus, "READDIRPLUS" },
+    [FUSE_LSEEK]       = { do_lseek,       "LSEEK"       },
+    [FUSE_COPY_FILE_RANGE] = { do_copy_file_range, "COPY_FILE_RANGE" },
 };
 
 #define FUSE_MAXOP (sizeof(fuse_ll_ops) / sizeof(fuse_ll_ops[0]))
@@ -1265,6 +1605,70 @@ static const char *opname(enum fuse_opcode opcode)
         return fuse_ll_ops[opcode].name;
 }
 
+static unsigned long long fuse_ll_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Call the handler for an opcode and account for the time spent in it.
+ * The request may be freed by the handler, so only use f afterwards.
+ *
+ * With --enable-usdt, the tracepoints fuse:op__start (opcode, nodeid,
+ * unique) and fuse:op__done (opcode, nodeid, microseconds) surround
+ * the handler.
+ */
+static void fuse_ll_dispatch(struct fuse_ll *f, fuse_req_t req,
+                             const struct fuse_in_header *in,
+                             const void *inarg)
+{
+    struct fuse_op_stats *st = &f->stats[in->opcode];
+    unsigned long long start;
+    unsigned long long us;
+    int n;
+
+    start = fuse_ll_now_us();
+#ifdef ENABLE_USDT
+    DTRACE_PROBE3(fuse, op__start, in->opcode, in->nodeid, in->unique);
+#endif
+    fuse_ll_ops[in->opcode].func(req, in->nodeid, inarg);
+    us = fuse_ll_now_us() - start;
+#ifdef ENABLE_USDT
+    DTRACE_PROBE3(fuse, op__done, in->opcode, in->nodeid, us);
+#endif
+    for (n = 0; (n < FUSE_STATS_BUCKETS - 1) && (us >> (n + 1)); n++) ;
+    __atomic_fetch_add(&st->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->total_us, us, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->buckets[n], 1, __ATOMIC_RELAXED);
+}
+
+int fuse_req_stats(fuse_req_t req, struct fuse_op_stats *stats, int max)
+{
+    struct fuse_ll *f = req->f;
+    int count;
+    int op;
+    int n;
+
+    count = 0;
+    for (op = 0; (op < (int) FUSE_MAXOP) && (count < max); op++) {
+        if (!fuse_ll_ops[op].name)
+            continue;
+        stats[count].name = fuse_ll_ops[op].name;
+        stats[count].count = __atomic_load_n(&f->stats[op].count,
+                                             __ATOMIC_RELAXED);
+        stats[count].total_us = __atomic_load_n(&f->stats[op].total_us,
+                                                __ATOMIC_RELAXED);
+        for (n = 0; n < FUSE_STATS_BUCKETS; n++)
+            stats[count].buckets[n] = __atomic_load_n(&f->stats[op].buckets[n],
+                                                      __ATOMIC_RELAXED);
+        count++;
+    }
+    return count;
+}
+
 static void fuse_ll_process(void *data, const char *buf, size_t len,
                      struct fuse_chan *ch)
 {
@@ -1301,11 +1705,16 @@ static void fuse_ll_process(void *data, const char *buf, size_t len,
              in->opcode != FUSE_INIT && in->opcode != FUSE_READ &&
              in->opcode != FUSE_WRITE && in->opcode != FUSE_FSYNC &&
              in->opcode != FUSE_RELEASE && in->opcode != FUSE_READDIR &&
+             in->opcode != FUSE_READDIRPLUS &&
              in->opcode != FUSE_FSYNCDIR && in->opcode != FUSE_RELEASEDIR) {
         fuse_reply_err(req, EACCES);
     } else if (in->opcode >= FUSE_MAXOP || !fuse_ll_ops[in->opcode].func)
         fuse_reply_err(req, ENOSYS);
-    else {
+    else if ((in->opcode == FUSE_FORGET)
+	    || (in->opcode == FUSE_BATCH_FORGET)) {
+	/* never interrupted, so not registered */
+        fuse_ll_dispatch(f, req, in, inarg);
+    } else {
         if (in->opcode != FUSE_INTERRUPT) {
             struct fuse_req *intr;
             pthread_mutex_lock(&f->lock);
@@ -1315,7 +1724,7 @@ static void fuse_ll_process(void *data, const char *buf, size_t len,
             if (intr)
                 fuse_reply_err(intr, EAGAIN);
         }
-        fuse_ll_ops[in->opcode].func(req, in->nodeid, inarg);
+        fuse_ll_dispatch(f, req, in, inarg);
     }
 }
 
@@ -1395,6 +1804,7 @@ static void fuse_ll_destroy(void *data)
     }
 
     pthread_mutex_destroy(&f->lock);
+    free(f->stats);
     free(f);
 }
 
@@ -1419,6 +1829,13 @@ struct fuse_session *fuse_lowlevel_new(struct fuse_args *args,
         fprintf(stderr, "fuse: failed to allocate fuse object\n");
         goto out;
     }
+    f->stats = (struct fuse_op_stats *) calloc(FUSE_MAXOP,
+                                               sizeof(struct fuse_op_stats));
+    if (f->stats == NULL) {
+        fprintf(stderr, "fuse: failed to allocate fuse object\n");
+        free(f);
+        goto out;
+    }
 
     f->conn.async_read = 1;
     f->conn.max_write = UINT_MAX;
@@ -1441,6 +1858,7 @@ struct fuse_session *fuse_lowlevel_new(struct fuse_args *args,
     return se;
 
  out_free:
+    free(f->stats);
     free(f);
  out:
     return NULL;
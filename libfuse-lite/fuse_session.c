@@ -118,6 +118,11 @@ int fuse_session_exited(struct fuse_session *se)
         return se->exited;
 }
 
+void *fuse_session_data(struct fuse_session *se)
+{
+    return se->data;
+}
+
 static struct fuse_chan *fuse_chan_new_common(struct fuse_chan_ops *op, int fd,
                                 size_t bufsize, void *data)
 {
@@ -184,6 +189,15 @@ int fuse_chan_send(struct fuse_chan *ch, const struct iovec iov[], size_t count)
     return ch->op.send(ch, iov, count);
 }
 
+int fuse_chan_send_data(struct fuse_chan *ch, const struct iovec iov[],
+                        size_t count, const struct fuse_buf *bufv,
+                        int bufcount)
+{
+    if (!ch->op.send_data)
+        return -ENOSYS;
+    return ch->op.send_data(ch, iov, count, bufv, bufcount);
+}
+
 void fuse_chan_destroy(struct fuse_chan *ch)
 {
     fuse_session_remove_chan(ch);
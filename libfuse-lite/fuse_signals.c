@@ -14,12 +14,18 @@
 #include <signal.h>
 
 static struct fuse_session *fuse_instance;
+static struct fuse_session **fuse_instances;
+static int fuse_instance_count;
 
 static void exit_handler(int sig)
 {
+    int i;
+
     (void) sig;
     if (fuse_instance)
         fuse_session_exit(fuse_instance);
+    for (i = 0; i < fuse_instance_count; i++)
+        fuse_session_exit(fuse_instances[i]);
 }
 
 static int set_one_signal_handler(int sig, void (*handler)(int), int remove)
@@ -71,3 +77,25 @@ void fuse_remove_signal_handlers(struct fuse_session *se)
     set_one_signal_handler(SIGPIPE, SIG_IGN, 1);
 }
 
+
+int fuse_set_signal_handlers_multi(struct fuse_session **se, int count)
+{
+    if (fuse_set_signal_handlers(NULL))
+        return -1;
+
+    fuse_instances = se;
+    fuse_instance_count = count;
+    return 0;
+}
+
+void fuse_remove_signal_handlers_multi(struct fuse_session **se)
+{
+    if (fuse_instances != se)
+        fprintf(stderr,
+                "fuse: fuse_remove_signal_handlers: unknown sessions\n");
+    else {
+        fuse_instance_count = 0;
+        fuse_instances = NULL;
+    }
+    fuse_remove_signal_handlers(NULL);
+}
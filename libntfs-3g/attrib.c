@@ -64,6 +64,11 @@
 #include "logging.h"
 #include "misc.h"
 #include "efs.h"
+#include "idxcache.h"
+#include "bmpcache.h"
+#include "usnjrnl.h"
+#include "lock.h"
+#include "devtrace.h"
 
 ntfschar AT_UNNAMED[] = { const_cpu_to_le16('\0') };
 ntfschar STREAM_SDS[] = { const_cpu_to_le16('$'),
@@ -83,6 +88,32 @@ ntfschar TXF_DATA[] = { const_cpu_to_le16('$'),
 			const_cpu_to_le16('A'),
 			const_cpu_to_le16('\0') };
 
+		/* state of sequential reads, see ntfs_attr_pread_ahead() */
+struct ATTR_READAHEAD {
+	s64 next;		/* position expected for a sequential read */
+	s64 window;		/* bytes to read ahead, zero if not sequential */
+	s64 pos;		/* position of the buffered data */
+	s64 count;		/* count of buffered bytes */
+	s64 size;		/* allocated size of the buffer */
+	char *buf;
+	u32 generation;		/* volume data generation when buffered */
+} ;
+
+		/* appended data not written yet, see ntfs_attr_buffer_writes() */
+struct ATTR_WRITEBUF {
+	s64 disk_size;		/* data size recorded in the attribute */
+	s64 count;		/* count of buffered bytes */
+	char *buf;
+	BOOL allocated_ahead;	/* clusters allocated beyond data */
+} ;
+
+	/*
+	 * Size beyond which a data attribute being appended to is made
+	 * non-resident at once, and which it must not have exceeded for
+	 * being made resident again when truncated to zero.
+	 */
+#define RESIDENT_GROWTH_LIMIT(vol) ((vol)->mft_record_size >> 1)
+
 static int NAttrFlag(ntfs_attr *na, FILE_ATTR_FLAGS flag)
 {
 	if (na->type == AT_DATA && na->name == AT_UNNAMED)
@@ -322,6 +353,7 @@ static void __ntfs_attr_init(ntfs_attr *na, ntfs_inode *ni,
 		const ATTR_TYPES type, ntfschar *name, const u32 name_len)
 {
 	na->rl = NULL;
+	ntfs_attr_forget_runs(na);
 	na->ni = ni;
 	na->type = type;
 	na->name = name;
@@ -380,6 +412,38 @@ void ntfs_attr_init(ntfs_attr *na, const BOOL non_resident,
 	}
 }
 
+/*
+ *		Close a named data stream kept open in the base inode
+ *
+ *	This is needed when the stream is opened through another handle,
+ *	which may change its size, its runlist or its residency.
+ */
+
+static void forget_kept_stream(ntfs_inode *ni, const ntfschar *name,
+			u32 name_len)
+{
+	ntfs_inode *base_ni;
+	ntfs_attr *na;
+	int i;
+
+	base_ni = (ni->nr_extents == -1 ? ni->base_ni : ni);
+	na = (ntfs_attr*)NULL;
+	ntfs_cache_lock(base_ni->vol);
+	for (i=0; (i<NTFS_KEPT_STREAMS) && !na; i++) {
+		if (base_ni->kept_streams[i]
+		    && ntfs_names_are_equal(name, name_len,
+				base_ni->kept_streams[i]->name,
+				base_ni->kept_streams[i]->name_len,
+				CASE_SENSITIVE, (ntfschar*)NULL, 0)) {
+			na = base_ni->kept_streams[i];
+			base_ni->kept_streams[i] = (ntfs_attr*)NULL;
+		}
+	}
+	ntfs_cache_unlock(base_ni->vol);
+	if (na)
+		ntfs_attr_close(na);
+}
+
 /**
  * ntfs_attr_open - open an ntfs attribute for access
  * @ni:		open ntfs inode in which the ntfs attribute resides
@@ -411,6 +475,9 @@ ntfs_attr *ntfs_attr_open(ntfs_inode *ni, const ATTR_TYPES type,
 		errno = EINVAL;
 		goto out;
 	}
+		/* a kept handle would not see the changes through this one */
+	if ((type == AT_DATA) && name && (name != AT_UNNAMED) && name_len)
+		forget_kept_stream(ni, name, name_len);
 	na = ntfs_calloc(sizeof(ntfs_attr));
 	if (!na)
 		goto out;
@@ -543,9 +610,119 @@ void ntfs_attr_close(ntfs_attr *na)
 	if (na->name != AT_UNNAMED && na->name != NTFS_INDEX_I30
 				&& na->name != STREAM_SDS)
 		free(na->name);
+	if (na->readahead) {
+		free(na->readahead->buf);
+		free(na->readahead);
+	}
+	if (na->writebuf) {
+		if (ntfs_attr_flush(na))
+			ntfs_log_perror("Failed to write buffered data of "
+				"inode %lld",(long long)na->ni->mft_no);
+		free(na->writebuf->buf);
+		free(na->writebuf);
+	}
 	free(na);
 }
 
+/**
+ * ntfs_stream_open - open a data stream, reusing a kept handle
+ * @ni:		open ntfs base inode in which the stream resides
+ * @name:	stream name in little endian Unicode, or AT_UNNAMED
+ * @name_len:	length of stream @name in Unicode characters
+ *
+ * Named data streams are used by clients storing metadata (such as
+ * resource forks) for every file, mostly through extended attributes,
+ * and opening them requires a search of the attribute records. When
+ * a named stream is closed by ntfs_stream_close(), its handle is kept
+ * in the inode, with its sizes and runlist, so that the next access
+ * while the inode is held or cached does not search the records.
+ * A kept handle is taken out of the inode while it is used, and it is
+ * closed if the stream is opened by ntfs_attr_open() meanwhile.
+ *
+ * The unnamed data stream is simply opened by ntfs_attr_open().
+ *
+ * Return the attribute, or NULL on error with errno set.
+ */
+ntfs_attr *ntfs_stream_open(ntfs_inode *ni, ntfschar *name, u32 name_len)
+{
+	ntfs_attr *na;
+	ntfs_attr *kept;
+	int i;
+
+	na = (ntfs_attr*)NULL;
+	if (ni && (ni->nr_extents != -1) && name && (name != AT_UNNAMED)
+	    && name_len) {
+		ntfs_cache_lock(ni->vol);
+		for (i=0; (i<NTFS_KEPT_STREAMS) && !na; i++) {
+			kept = ni->kept_streams[i];
+			if (kept
+			    && ntfs_names_are_equal(name, name_len,
+					kept->name, kept->name_len,
+					CASE_SENSITIVE, (ntfschar*)NULL, 0)) {
+				na = kept;
+				ni->kept_streams[i] = (ntfs_attr*)NULL;
+			}
+		}
+		ntfs_cache_unlock(ni->vol);
+	}
+	if (!na)
+		na = ntfs_attr_open(ni, AT_DATA, name, name_len);
+	return (na);
+}
+
+/**
+ * ntfs_stream_close - close a data stream opened by ntfs_stream_open()
+ * @na:		the data stream
+ *
+ * A named stream is kept open in its inode for the next access, its
+ * buffered data being written first. When all the places are used,
+ * the oldest kept stream is closed.
+ */
+void ntfs_stream_close(ntfs_attr *na)
+{
+	ntfs_inode *ni;
+	ntfs_attr *old;
+	int i;
+
+	ni = (na ? na->ni : (ntfs_inode*)NULL);
+	if (!ni || (ni->nr_extents == -1) || (na->type != AT_DATA)
+	    || !na->name_len || (na->writebuf && ntfs_attr_flush(na))) {
+		ntfs_attr_close(na);
+		return;
+	}
+	ntfs_cache_lock(ni->vol);
+		/* another thread may have kept the same stream */
+	for (i=0; (i<(NTFS_KEPT_STREAMS - 1))
+			&& ni->kept_streams[i]
+			&& !ntfs_names_are_equal(na->name, na->name_len,
+				ni->kept_streams[i]->name,
+				ni->kept_streams[i]->name_len,
+				CASE_SENSITIVE, (ntfschar*)NULL, 0); i++) { }
+	old = ni->kept_streams[i];
+	for ( ; i>0; i--)
+		ni->kept_streams[i] = ni->kept_streams[i - 1];
+	ni->kept_streams[0] = na;
+	ntfs_cache_unlock(ni->vol);
+	if (old)
+		ntfs_attr_close(old);
+}
+
+/**
+ * ntfs_stream_forget_all - close the named data streams kept in an inode
+ * @ni:		the base inode, before it is closed
+ */
+void ntfs_stream_forget_all(ntfs_inode *ni)
+{
+	int i;
+
+	for (i=0; i<NTFS_KEPT_STREAMS; i++) {
+		if (ni->kept_streams[i]) {
+			ntfs_attr_close(ni->kept_streams[i]);
+			ni->kept_streams[i] = (ntfs_attr*)NULL;
+		}
+	}
+}
+
 /**
  * ntfs_attr_map_runlist - map (a part of) a runlist of an ntfs attribute
  * @na:		ntfs attribute for which to map (part of) a runlist
@@ -581,6 +758,7 @@ int ntfs_attr_map_runlist(ntfs_attr *na, VCN vcn)
 				na->rl);
 		if (rl) {
 			na->rl = rl;
+			ntfs_attr_forget_runs(na);
 			ntfs_attr_put_search_ctx(ctx);
 			return 0;
 		}
@@ -643,6 +821,7 @@ static int ntfs_attr_map_partial_runlist(ntfs_attr *na, VCN vcn)
 				rl = na->rl;
 			if (rl) {
 				na->rl = rl;
+				ntfs_attr_forget_runs(na);
 				highest_vcn = sle64_to_cpu(a->highest_vcn);
 				if (highest_vcn < needed) {
 				/* corruption detection on unchanged runlists */
@@ -738,6 +917,7 @@ int ntfs_attr_map_whole_runlist(ntfs_attr *na)
 			if (!rl)
 				goto err_out;
 			na->rl = rl;
+			ntfs_attr_forget_runs(na);
 		}
 
 		/* Are we in the first extent? */
@@ -801,6 +981,97 @@ out:
 	return ret;
 }
 
+/*
+ *		Release the runlist of an attribute if it has grown too big
+ *
+ *	The runlist is mapped again on demand, one attribute extent at
+ *	a time, so that an attribute kept open on a huge fragmented
+ *	file does not hold its full runlist. The runlist is only
+ *	released when it has no pending changes, and not for compressed
+ *	attributes, which have to keep runs reserved in advance.
+ *
+ *	Returns TRUE if the runlist was released
+ */
+
+BOOL ntfs_attr_release_runlist(ntfs_attr *na, s32 max_runs)
+{
+	runlist_element *rl;
+	s32 runs;
+	BOOL released;
+
+	released = FALSE;
+	rl = na->rl;
+	if (NAttrNonResident(na)
+	    && rl
+	    && !NAttrRunlistDirty(na)
+	    && !(na->data_flags & ATTR_COMPRESSION_MASK)) {
+		if (na->rl_runs && (na->rl_base == rl)
+		    && !rl[na->rl_runs].length)
+			runs = na->rl_runs;
+		else
+			for (runs=0; rl[runs].length; runs++) { }
+		if (runs > max_runs) {
+			free(rl);
+			na->rl = (runlist_element*)NULL;
+			ntfs_attr_forget_runs(na);
+			NAttrClearFullyMapped(na);
+			na->unused_runs = 0;
+			released = TRUE;
+		}
+	}
+	return (released);
+}
+
+/*
+ *		Search the run containing a vcn in the runlist of an attribute
+ *
+ *	The run found by the previous search and the next one are
+ *	checked first, as most accesses are sequential, then the runlist
+ *	is searched by dichotomy, so that random accesses to heavily
+ *	fragmented attributes are fast. The runs are counted again when
+ *	the runlist has been replaced or extended.
+ *
+ *	The vcn must not be lower than the first one in the runlist.
+ *
+ *	Returns the run containing the vcn, or the terminator
+ */
+
+static runlist_element *ntfs_attr_search_run(ntfs_attr *na, const VCN vcn)
+{
+	runlist_element *rl;
+	s32 low, high, mid;
+
+	rl = na->rl;
+	if (!na->rl_runs || (na->rl_base != rl) || rl[na->rl_runs].length) {
+		for (high=0; rl[high].length; high++) { }
+		na->rl_base = rl;
+		na->rl_runs = high;
+		na->rl_hint = 0;
+	}
+	high = na->rl_runs;
+	mid = na->rl_hint;
+	if ((mid < high) && (rl[mid].vcn <= vcn)) {
+		if (vcn < rl[mid + 1].vcn)
+			return (&rl[mid]);
+		if (((mid + 1) < high) && (vcn < rl[mid + 2].vcn)) {
+			na->rl_hint = mid + 1;
+			return (&rl[mid + 1]);
+		}
+	}
+		/* find the last run starting not beyond vcn */
+	low = 0;
+	while (low < high) {
+		mid = (low + high + 1) >> 1;
+		if (rl[mid].vcn <= vcn)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+	if (low < na->rl_runs)
+		na->rl_hint = low;
+	return (&rl[low]);
+}
+
 /**
  * ntfs_attr_vcn_to_lcn - convert a vcn into a lcn given an ntfs attribute
  * @na:		ntfs attribute whose runlist to use for conversion
@@ -824,6 +1095,7 @@ out:
  */
 LCN ntfs_attr_vcn_to_lcn(ntfs_attr *na, const VCN vcn)
 {
+	runlist_element *rl;
 	LCN lcn;
 	BOOL is_retry = FALSE;
 
@@ -834,7 +1106,19 @@ LCN ntfs_attr_vcn_to_lcn(ntfs_attr *na, const VCN vcn)
 			long)na->ni->mft_no, le32_to_cpu(na->type));
 retry:
 	/* Convert vcn to lcn. If that fails map the runlist and retry once. */
-	lcn = ntfs_rl_vcn_to_lcn(na->rl, vcn);
+	if (!na->rl)
+		lcn = (LCN)LCN_RL_NOT_MAPPED;
+	else if (vcn < na->rl[0].vcn)
+		lcn = (LCN)LCN_ENOENT;
+	else {
+		rl = ntfs_attr_search_run(na, vcn);
+		if (rl->length && (rl->lcn >= (LCN)0))
+			lcn = rl->lcn + (vcn - rl->vcn);
+		else if (rl->lcn < (LCN)0)
+			lcn = rl->lcn;
+		else
+			lcn = (LCN)LCN_ENOENT;
+	}
 	if (lcn >= 0)
 		return lcn;
 	if (!is_retry && !ntfs_attr_map_runlist(na, vcn)) {
@@ -891,14 +1175,9 @@ retry:
 		goto map_rl;
 	if (vcn < rl[0].vcn)
 		goto map_rl;
-	while (rl->length) {
-		if (vcn < rl[1].vcn) {
-			if (rl->lcn >= (LCN)LCN_HOLE)
-				return rl;
-			break;
-		}
-		rl++;
-	}
+	rl = ntfs_attr_search_run(na, vcn);
+	if (rl->length && (rl->lcn >= (LCN)LCN_HOLE))
+		return rl;
 	switch (rl->lcn) {
 	case (LCN)LCN_RL_NOT_MAPPED:
 		goto map_rl;
@@ -935,10 +1214,13 @@ map_rl:
  */ 
 static s64 ntfs_attr_pread_i(ntfs_attr *na, const s64 pos, s64 count, void *b)
 {
-	s64 br, to_read, ofs, total, total2, max_read, max_init;
+	struct ntfs_device_io ios[RUNLIST_BATCH_SIZE];
+	s64 to_read, ofs, total, total2, max_read, max_init, gathered;
 	ntfs_volume *vol;
 	runlist_element *rl;
 	u16 efs_padding_length;
+	BOOL bad;
+	int n, i;
 
 	/* Sanity checking arguments is done in ntfs_attr_pread(). */
 	
@@ -1068,72 +1350,84 @@ res_err_out:
 	/*
 	 * Gather the requested data into the linear destination buffer. Note,
 	 * a partial final vcn is taken care of by the @count capping of read
-	 * length.
+	 * length. The reads from several fragments are issued together.
 	 */
 	ofs = pos - (rl->vcn << vol->cluster_size_bits);
-	for (; count; rl++, ofs = 0) {
-		if (rl->lcn == LCN_RL_NOT_MAPPED) {
-			rl = ntfs_attr_find_vcn(na, rl->vcn);
-			if (!rl) {
-				if (errno == ENOENT) {
-					errno = EIO;
-					ntfs_log_perror("%s: Failed to find VCN #2",
-							__FUNCTION__);
+	bad = FALSE;
+	while (count && !bad) {
+		n = 0;
+		for (gathered = 0; (gathered < count)
+				&& (n < RUNLIST_BATCH_SIZE); rl++, ofs = 0) {
+			if (rl->lcn == LCN_RL_NOT_MAPPED) {
+				rl = ntfs_attr_find_vcn(na, rl->vcn);
+				if (!rl) {
+					if (errno == ENOENT) {
+						errno = EIO;
+						ntfs_log_perror("%s: Failed to find VCN #2",
+								__FUNCTION__);
+					}
+					bad = TRUE;
+					break;
 				}
-				goto rl_err_out;
+				/* Needed for case when runs merged. */
+				ofs = pos + total + gathered
+					- (rl->vcn << vol->cluster_size_bits);
 			}
-			/* Needed for case when runs merged. */
-			ofs = pos + total - (rl->vcn << vol->cluster_size_bits);
-		}
-		if (!rl->length) {
-			errno = EIO;
-			ntfs_log_perror("%s: Zero run length", __FUNCTION__);
-			goto rl_err_out;
-		}
-		if (rl->lcn < (LCN)0) {
-			if (rl->lcn != (LCN)LCN_HOLE) {
-				ntfs_log_perror("%s: Bad run (%lld)", 
-						__FUNCTION__,
-						(long long)rl->lcn);
-				goto rl_err_out;
+			if (!rl->length) {
+				errno = EIO;
+				ntfs_log_perror("%s: Zero run length", __FUNCTION__);
+				bad = TRUE;
+				break;
 			}
-			/* It is a hole, just zero the matching @b range. */
-			to_read = min(count, (rl->length <<
+			to_read = min(count - gathered, (rl->length <<
 					vol->cluster_size_bits) - ofs);
-			memset(b, 0, to_read);
-			/* Update progress counters. */
-			total += to_read;
-			count -= to_read;
-			b = (u8*)b + to_read;
-			continue;
+			if (rl->lcn < (LCN)0) {
+				if (rl->lcn != (LCN)LCN_HOLE) {
+					ntfs_log_perror("%s: Bad run (%lld)", 
+							__FUNCTION__,
+							(long long)rl->lcn);
+					bad = TRUE;
+					break;
+				}
+				/* It is a hole, just zero the matching @b range. */
+				memset((u8*)b + gathered, 0, to_read);
+			} else {
+				/* It is a real lcn, read it into @dst. */
+				ntfs_log_trace("Reading %lld bytes from vcn %lld, lcn %lld, ofs"
+						" %lld.\n", (long long)to_read, (long long)rl->vcn,
+					       (long long )rl->lcn, (long long)ofs);
+				ios[n].buf = (u8*)b + gathered;
+				ios[n].count = to_read;
+				ios[n].pos = (rl->lcn << vol->cluster_size_bits)
+						+ ofs;
+				n++;
+			}
+			gathered += to_read;
 		}
-		/* It is a real lcn, read it into @dst. */
-		to_read = min(count, (rl->length << vol->cluster_size_bits) -
-				ofs);
-retry:
-		ntfs_log_trace("Reading %lld bytes from vcn %lld, lcn %lld, ofs"
-				" %lld.\n", (long long)to_read, (long long)rl->vcn,
-			       (long long )rl->lcn, (long long)ofs);
-		br = ntfs_pread(vol->dev, (rl->lcn << vol->cluster_size_bits) +
-				ofs, to_read, b);
-		/* If everything ok, update progress counters and continue. */
-		if (br > 0) {
-			total += br;
-			count -= br;
-			b = (u8*)b + br;
+		if (n && ntfs_pread_batch(vol->dev, ios, n))
+			goto rl_err_out;
+		/* Stop at the first fragment not fully read */
+		for (i = 0; (i < n) && (ios[i].res == ios[i].count); i++) { }
+		if (i < n) {
+			total += (u8*)ios[i].buf - (u8*)b;
+			if (ios[i].res > 0)
+				total += ios[i].res;
+			if (total)
+				return total;
+			if (ios[i].res < 0)
+				errno = -ios[i].res;
+			else
+				errno = EIO;
+			ntfs_log_perror("%s: ntfs_pread failed", __FUNCTION__);
+			return -1;
 		}
-		if (br == to_read)
-			continue;
-		/* If the syscall was interrupted, try again. */
-		if (br == (s64)-1 && errno == EINTR)
-			goto retry;
-		if (total)
-			return total;
-		if (!br)
-			errno = EIO;
-		ntfs_log_perror("%s: ntfs_pread failed", __FUNCTION__);
-		return -1;
+		/* Update progress counters. */
+		total += gathered;
+		count -= gathered;
+		b = (u8*)b + gathered;
 	}
+	if (bad)
+		goto rl_err_out;
 	/* Finally, return the number of bytes read. */
 	return total + total2;
 rl_err_out:
@@ -1143,6 +1437,219 @@ rl_err_out:
 	return -1;
 }
 
+/*
+ *		Read ahead of sequential reads
+ *
+ *	When an attribute is read sequentially, the reads are enlarged to
+ *	a window which doubles on each sequential read, and the surplus is
+ *	kept in a buffer attached to the attribute, so that the device
+ *	gets big reads even when the application issues small ones. The
+ *	enlarged read stops at the end of the current extent, so that no
+ *	further seek is added for data which may never be used.
+ *
+ *	Only the data of user files is read ahead : the attributes of
+ *	system files may be shared by concurrent readers, and they are
+ *	not read sequentially anyway. As the same data may be updated
+ *	through another ntfs_attr, the buffer is dropped when any data
+ *	has been updated on the volume since it was filled. The raw data
+ *	of encrypted files, as read with the efs_raw option, is read
+ *	ahead in the same way.
+ */
+
+static BOOL ntfs_attr_is_plain_data(ntfs_attr *na)
+{
+	return ((na->type == AT_DATA)
+		&& (na->ni->mft_no >= FILE_first_user)
+		&& !(na->data_flags & ATTR_COMPRESSION_MASK)
+		&& !NAttrEncrypted(na));
+}
+
+/*
+ *		Check whether an attribute holds the raw data of an
+ *	encrypted user file, as read with the efs_raw mount option
+ */
+
+static BOOL ntfs_attr_is_raw_encrypted(ntfs_attr *na)
+{
+	return ((na->type == AT_DATA)
+		&& (na->ni->mft_no >= FILE_first_user)
+		&& !(na->data_flags & ATTR_COMPRESSION_MASK)
+		&& NAttrEncrypted(na)
+		&& na->ni->vol->efs_raw);
+}
+
+static BOOL ntfs_attr_can_read_ahead(ntfs_attr *na)
+{
+	return (NAttrNonResident(na)
+		&& (ntfs_attr_is_plain_data(na)
+			|| ntfs_attr_is_raw_encrypted(na)));
+}
+
+/*
+ *		Get the end of a read enlarged up to a limit
+ *
+ *	The read is only enlarged up to the end of the extent holding
+ *	its last byte, unless it already ends on an extent boundary.
+ */
+
+static s64 ntfs_attr_readahead_end(ntfs_attr *na, s64 end, s64 limit)
+{
+	runlist_element *rl;
+	ntfs_volume *vol;
+	s64 extent_end;
+
+	vol = na->ni->vol;
+	rl = ntfs_attr_find_vcn(na, (end - 1) >> vol->cluster_size_bits);
+	if (rl) {
+		extent_end = (rl->vcn + rl->length) << vol->cluster_size_bits;
+		if ((extent_end > end) && (extent_end < limit))
+			limit = extent_end;
+	}
+		/* align to clusters */
+	if ((limit & ~(s64)(vol->cluster_size - 1)) > end)
+		limit &= ~(s64)(vol->cluster_size - 1);
+	if (limit > na->initialized_size)
+		limit = na->initialized_size;
+	return (limit > end ? limit : end);
+}
+
+static s64 ntfs_attr_pread_ahead(ntfs_attr *na, const s64 pos, s64 count,
+			void *b)
+{
+	struct ATTR_READAHEAD *ra;
+	ntfs_volume *vol;
+	char *newbuf;
+	s64 done;
+	s64 end;
+	s64 br;
+	BOOL sequential;
+
+	vol = na->ni->vol;
+	ra = na->readahead;
+	if (!ra) {
+		ra = (struct ATTR_READAHEAD*)ntfs_calloc(
+				sizeof(struct ATTR_READAHEAD));
+		if (!ra)
+			return (ntfs_attr_pread_i(na, pos, count, b));
+		na->readahead = ra;
+	}
+	if (ra->count && (ra->generation != vol->data_generation))
+		ra->count = 0;
+	sequential = (pos == ra->next)
+		|| ((pos >= ra->pos) && (pos < (ra->pos + ra->count)));
+	done = 0;
+	if ((pos >= ra->pos) && (pos < (ra->pos + ra->count))) {
+		done = ra->pos + ra->count - pos;
+		if (done > count)
+			done = count;
+		memcpy(b, &ra->buf[pos - ra->pos], done);
+	}
+	ra->next = pos + count;
+	if (sequential) {
+		ra->window = (ra->window ? 2*ra->window : READAHEAD_MIN);
+		if (ra->window > READAHEAD_MAX)
+			ra->window = READAHEAD_MAX;
+	} else {
+			/* random reads, no need to keep a buffer */
+		ra->window = 0;
+		ra->count = 0;
+		ra->size = 0;
+		free(ra->buf);
+		ra->buf = (char*)NULL;
+	}
+	if (done == count)
+		return (count);
+	if ((count - done) >= ra->window) {
+		br = ntfs_attr_pread_i(na, pos + done, count - done,
+				(char*)b + done);
+		if (br < 0)
+			return (done ? done : br);
+		return (done + br);
+	}
+	if (ra->size < ra->window) {
+		newbuf = (char*)realloc(ra->buf, ra->window);
+		if (!newbuf) {
+			ra->count = 0;
+			br = ntfs_attr_pread_i(na, pos + done, count - done,
+					(char*)b + done);
+			if (br < 0)
+				return (done ? done : br);
+			return (done + br);
+		}
+		ra->buf = newbuf;
+		ra->size = ra->window;
+	}
+	end = ntfs_attr_readahead_end(na, pos + count,
+				pos + done + ra->window);
+	ra->count = 0;
+	br = ntfs_attr_pread_i(na, pos + done, end - pos - done, ra->buf);
+	if (br < 0)
+		return (done ? done : br);
+	ra->pos = pos + done;
+	ra->count = br;
+	ra->generation = vol->data_generation;
+	if (br > (count - done))
+		br = count - done;
+	memcpy((char*)b + done, ra->buf, br);
+	return (done + br);
+}
+
+/*
+ *		Insert the appended data not written yet into a read
+ *
+ *	The buffered data is beyond the initialized size, so it has
+ *	been read as zeroes.
+ */
+
+static void ntfs_attr_overlay_writes(ntfs_attr *na, s64 pos, s64 count,
+			void *b)
+{
+	struct ATTR_WRITEBUF *wb;
+	s64 start;
+	s64 end;
+
+	wb = na->writebuf;
+	start = (pos > wb->disk_size ? pos : wb->disk_size);
+	end = wb->disk_size + wb->count;
+	if (end > (pos + count))
+		end = pos + count;
+	if (end > start)
+		memcpy((char*)b + start - pos,
+			&wb->buf[start - wb->disk_size], end - start);
+}
+
+/*
+ *		Get the category of the transfers for an attribute,
+ *	to be recorded in a device trace
+ */
+
+static int attr_io_category(ntfs_attr *na)
+{
+	int category;
+
+	switch (na->ni->mft_no) {
+	case FILE_MFT :
+	case FILE_MFTMirr :
+		category = (na->type == AT_BITMAP
+				? NTFS_IO_BITMAP : NTFS_IO_MFT);
+		break;
+	case FILE_Bitmap :
+		category = NTFS_IO_BITMAP;
+		break;
+	case FILE_LogFile :
+		category = NTFS_IO_LOG;
+		break;
+	default :
+		if ((na->type == AT_INDEX_ALLOCATION)
+		    || (na->type == AT_BITMAP))
+			category = NTFS_IO_INDEX;
+		else
+			category = NTFS_IO_DATA;
+		break;
+	}
+	return (category);
+}
+
 /**
  * ntfs_attr_pread - read from an attribute specified by an ntfs_attr structure
  * @na:		ntfs attribute to read from
@@ -1165,6 +1672,8 @@ rl_err_out:
 s64 ntfs_attr_pread(ntfs_attr *na, const s64 pos, s64 count, void *b)
 {
 	s64 ret;
+	BOOL traced;
+	int category = NTFS_IO_OTHER;
 	
 	if (!na || !na->ni || !na->ni->vol || !b || pos < 0 || count < 0) {
 		errno = EINVAL;
@@ -1178,7 +1687,27 @@ s64 ntfs_attr_pread(ntfs_attr *na, const s64 pos, s64 count, void *b)
 		       "%lld\n", (unsigned long long)na->ni->mft_no,
 		       le32_to_cpu(na->type), (long long)pos, (long long)count);
 
-	ret = ntfs_attr_pread_i(na, pos, count, b);
+		/* a resident bitmap cache may hold all the pages */
+	if (na->ni->vol->bitmap_cache && ntfs_bmpcache_covers(na)
+	    && ntfs_bmpcache_read(na, pos, count, b)) {
+		ntfs_log_leave("\n");
+		return (count);
+	}
+	traced = na->ni->vol->dev->d_trace != (struct DEVICE_TRACE*)NULL;
+	if (traced)
+		category = ntfs_devtrace_category(attr_io_category(na));
+	if (count && ntfs_attr_can_read_ahead(na))
+		ret = ntfs_attr_pread_ahead(na, pos, count, b);
+	else
+		ret = ntfs_attr_pread_i(na, pos, count, b);
+	if ((ret > 0) && na->writebuf && na->writebuf->count)
+		ntfs_attr_overlay_writes(na, pos, ret, b);
+		/* the cached bitmap pages may be more recent */
+	if ((ret > 0) && na->ni->vol->bitmap_cache
+	    && ntfs_bmpcache_covers(na))
+		ntfs_bmpcache_get(na, pos, ret, b);
+	if (traced)
+		ntfs_devtrace_category(category);
 	
 	ntfs_log_leave("\n");
 	return ret;
@@ -1385,6 +1914,7 @@ static int ntfs_attr_fill_hole(ntfs_attr *na, s64 count, s64 *ofs,
 	}
 	na->unused_runs = 2;
 	na->rl = *rl;
+	ntfs_attr_forget_runs(na);
 	if ((*update_from == -1) || (from_vcn < *update_from))
 		*update_from = from_vcn;
 	*rl = ntfs_attr_find_vcn(na, cur_vcn);
@@ -1760,6 +2290,8 @@ static int borrow_from_hole(ntfs_attr *na, runlist_element **prl,
 
 static int ntfs_attr_truncate_i(ntfs_attr *na, const s64 newsize,
 				hole_type holes);
+static int ntfs_attr_allocate_ahead(ntfs_attr *na, const s64 newsize);
+static int ntfs_non_resident_attr_shrink(ntfs_attr *na, const s64 newsize);
 
 /**
  * ntfs_attr_pwrite - positioned write to an ntfs attribute
@@ -1839,6 +2371,24 @@ static s64 ntfs_attr_pwrite_i(ntfs_attr *na, const s64 pos, s64 count,
 	
 	if (!count)
 		goto out;
+		/*
+		 * A resident data attribute which is appended to by chunks
+		 * and is getting beyond half the mft record is most likely
+		 * to get even bigger, so make it non-resident at once
+		 * instead of resizing the record for each chunk until it
+		 * does not fit any more. This is only a hint, so just go
+		 * on if it fails.
+		 */
+	if (!NAttrNonResident(na)
+	    && (na->type == AT_DATA)
+	    && !compressed
+	    && !(na->data_flags & ATTR_IS_ENCRYPTED)
+	    && pos
+	    && (pos >= na->data_size)
+	    && ((pos + count) > RESIDENT_GROWTH_LIMIT(vol))
+	    && ntfs_attr_force_non_resident(na))
+		ntfs_log_debug("Could not make inode %lld non-resident early\n",
+				(long long)na->ni->mft_no);
 	/* for a compressed file, get prepared to reserve a full block */
 	fullcount = count;
 	/* If the write reaches beyond the end, extend the attribute. */
@@ -2326,53 +2876,479 @@ errno_set:
 	goto out;
 }
 
-s64 ntfs_attr_pwrite(ntfs_attr *na, const s64 pos, s64 count, const void *b)
+/*
+ *		Write out the appended data which was buffered
+ *
+ *	When @all is not set, only the part ending on the last cluster
+ *	boundary is written, the rest is kept for further appends, and
+ *	as the file is expected to grow further, clusters are allocated
+ *	as a single extent for the data to come. When @all is set, the
+ *	clusters allocated ahead and not used are freed.
+ *	The data sizes are set back to their on-disk values while
+ *	writing, so that the usual extension of the attribute occurs,
+ *	with a single allocation for all the data.
+ *
+ *	On error, the buffered data is dropped.
+ *
+ *	Returns 0 if successful
+ *		-1 if failed, with errno set
+ */
+
+static int ntfs_attr_write_buffer(ntfs_attr *na, BOOL all)
 {
+	struct ATTR_WRITEBUF *wb;
+	ntfs_volume *vol;
 	s64 total;
 	s64 written;
+	s64 size;
+	s64 end;
+	s64 ahead;
+	BOOL unnamed;
+	int res;
 
-	ntfs_log_enter("Entering for inode %lld, attr 0x%x, pos 0x%llx, count "
-		       "0x%llx.\n", (long long)na->ni->mft_no, le32_to_cpu(na->type),
-		       (long long)pos, (long long)count);
-	
-	total = 0;
-	if (!na || !na->ni || !na->ni->vol || !b || pos < 0 || count < 0) {
-		errno = EINVAL;
-		written = -1;
-		ntfs_log_perror("%s", __FUNCTION__);
-		goto out;
+	res = 0;
+	wb = na->writebuf;
+	vol = na->ni->vol;
+	unnamed = (na->type == AT_DATA) && (na->name == AT_UNNAMED);
+	size = wb->count;
+	if (!all) {
+		end = (wb->disk_size + wb->count)
+				& ~(s64)(vol->cluster_size - 1);
+		if (end > wb->disk_size)
+			size = end - wb->disk_size;
+	}
+	na->data_size = wb->disk_size;
+	if (unnamed)
+		na->ni->data_size = wb->disk_size;
+	end = wb->disk_size + size;
+	if (!all && ((end + WRITE_BUFFER_SIZE) > na->allocated_size)) {
+			/* allocate as much as already written, within limits */
+		ahead = end;
+		if (ahead < WRITE_BUFFER_SIZE)
+			ahead = WRITE_BUFFER_SIZE;
+		if (ahead > ALLOCATE_AHEAD_MAX)
+			ahead = ALLOCATE_AHEAD_MAX;
+			/* not allocating ahead is not an error */
+		if (!ntfs_attr_allocate_ahead(na, end + ahead))
+			wb->allocated_ahead = TRUE;
 	}
-
-		/*
-		 * Compressed attributes may be written partially, so
-		 * we may have to iterate.
-		 */
+	total = 0;
 	do {
-		written = ntfs_attr_pwrite_i(na, pos + total,
-				count - total, (const u8*)b + total);
+		written = ntfs_attr_pwrite_i(na, wb->disk_size + total,
+				size - total, (const u8*)wb->buf + total);
 		if (written > 0)
 			total += written;
-	} while ((written > 0) && (total < count));
-out :
-	ntfs_log_leave("\n");
-	return (total > 0 ? total : written);
+	} while ((written > 0) && (total < size));
+	vol->data_generation++;
+	if (total < size) {
+		if (written >= 0)
+			errno = EIO;
+		ntfs_log_perror("Failed to write %lld buffered bytes to "
+			"inode %lld", (long long)(wb->count - total),
+			(long long)na->ni->mft_no);
+		wb->count = 0;
+		res = -1;
+	} else {
+		wb->disk_size += size;
+		if (all && wb->allocated_ahead) {
+			wb->allocated_ahead = FALSE;
+			if (ntfs_non_resident_attr_shrink(na, na->data_size)) {
+				ntfs_log_perror("Failed to free the clusters "
+					"allocated ahead of inode %lld",
+					(long long)na->ni->mft_no);
+				res = -1;
+			}
+		}
+		wb->count -= size;
+		if (wb->count) {
+			memmove(wb->buf, &wb->buf[size], wb->count);
+			na->data_size = wb->disk_size + wb->count;
+			if (unnamed)
+				na->ni->data_size = na->data_size;
+		}
+	}
+	return (res);
 }
 
+/*
+ *		Buffer a write appended to an attribute
+ *
+ *	The write is buffered if it is a small one at the end of a
+ *	plain non-resident data attribute, and there is room to store
+ *	it on the device. Otherwise the data already buffered is
+ *	written out, and the write has to be done directly.
+ *
+ *	Returns the count of bytes buffered
+ *		0 if the write was not buffered
+ *		-1 if failed, with errno set
+ */
 
-int ntfs_attr_pclose(ntfs_attr *na)
+static s64 ntfs_attr_buffer_write(ntfs_attr *na, const s64 pos, s64 count,
+			const void *b)
 {
-	s64 ofs;
-	int failed;
-	BOOL ok = TRUE;
-	VCN update_from = -1;
+	struct ATTR_WRITEBUF *wb;
 	ntfs_volume *vol;
-	ntfs_attr_search_ctx *ctx = NULL;
-	runlist_element *rl;
-	int eo;
-	int compressed_part;
-	BOOL compressed;
+	s64 needed;
 
-	ntfs_log_enter("Entering for inode 0x%llx, attr 0x%x.\n",
+	wb = na->writebuf;
+	vol = na->ni->vol;
+	if (count
+	    && (count < WRITE_BUFFER_SIZE)
+	    && (pos == na->data_size)
+	    && NAttrNonResident(na)
+	    && ntfs_attr_is_plain_data(na)) {
+			/* keep some margin for metadata, and report ENOSPC */
+		needed = ((pos + count - na->allocated_size
+				+ vol->cluster_size - 1)
+				>> vol->cluster_size_bits);
+		if ((needed > 0) && (vol->free_clusters < 2*needed))
+			return (ntfs_attr_flush(na));
+		if (!wb->count)
+			wb->disk_size = na->data_size;
+		if (((wb->count + count) > WRITE_BUFFER_SIZE)
+		    && ntfs_attr_write_buffer(na, FALSE))
+			return (-1);
+		if ((wb->count + count) <= WRITE_BUFFER_SIZE) {
+			memcpy(&wb->buf[wb->count], b, count);
+			wb->count += count;
+			na->data_size = wb->disk_size + wb->count;
+			if ((na->type == AT_DATA) && (na->name == AT_UNNAMED))
+				na->ni->data_size = na->data_size;
+			return (count);
+		}
+	}
+	return (ntfs_attr_flush(na));
+}
+
+/*
+ *		Buffer the writes appended to an attribute
+ *
+ *	Small writes appended to a plain data attribute are kept in
+ *	memory and written out together when they fill the buffer, so
+ *	that the clusters are allocated and the runlist is updated once
+ *	for many writes. The buffer is also written out on other writes,
+ *	truncations or closings through the same ntfs_attr, and when
+ *	calling ntfs_attr_flush(). Errors, such as ENOSPC, are therefore
+ *	only reported on these later calls.
+ *
+ *	The data size of the attribute (and of the inode for the unnamed
+ *	data stream) includes the buffered data, and it can be read
+ *	through the same ntfs_attr, but not through another one until
+ *	it has been flushed.
+ *
+ *	Returns 0 if successful
+ *		-1 if failed, with errno set
+ *			(EOPNOTSUPP if the attribute does not qualify)
+ */
+
+int ntfs_attr_buffer_writes(ntfs_attr *na)
+{
+	struct ATTR_WRITEBUF *wb;
+
+	if (!ntfs_attr_is_plain_data(na)) {
+		errno = EOPNOTSUPP;
+		return (-1);
+	}
+	if (!na->writebuf) {
+		wb = (struct ATTR_WRITEBUF*)ntfs_calloc(
+				sizeof(struct ATTR_WRITEBUF));
+		if (!wb)
+			return (-1);
+		wb->buf = (char*)ntfs_malloc(WRITE_BUFFER_SIZE);
+		if (!wb->buf) {
+			free(wb);
+			return (-1);
+		}
+		na->writebuf = wb;
+	}
+	return (0);
+}
+
+/*
+ *		Write out the appended data which was buffered
+ *
+ *	Returns 0 if successful (or nothing was buffered)
+ *		-1 if failed, with errno set, the buffered data is lost
+ */
+
+int ntfs_attr_flush(ntfs_attr *na)
+{
+	int res;
+
+	res = 0;
+	if (na->writebuf
+	    && (na->writebuf->count || na->writebuf->allocated_ahead))
+		res = ntfs_attr_write_buffer(na, TRUE);
+	return (res);
+}
+
+/*
+ *		Get the count of appended bytes not written yet
+ */
+
+s64 ntfs_attr_pending_writes(ntfs_attr *na)
+{
+	return (na->writebuf ? na->writebuf->count : 0);
+}
+
+/*
+ *		Check whether a buffer only contains zeroes
+ *
+ *	Once the first bytes are checked, the buffer is compared to
+ *	itself shifted, which the C library does a vector at a time.
+ */
+
+static BOOL ntfs_is_zeroed(const char *buf, s64 size)
+{
+	s64 i;
+
+	for (i=0; (i<16) && (i<size); i++)
+		if (buf[i])
+			return (FALSE);
+	return ((size <= 16) || !memcmp(buf, buf + 16, size - 16));
+}
+
+/*
+ *		Check whether zeroes written to an attribute may be
+ *	left as holes
+ *
+ *	Compressed attributes are not concerned, as compressing
+ *	zeroes already leads to holes.
+ */
+
+static BOOL ntfs_attr_keeps_holes(ntfs_attr *na)
+{
+	return ((na->type == AT_DATA)
+		&& (na->ni->vol->major_ver >= 3)
+		&& NAttrNonResident(na)
+		&& !(na->data_flags
+			& (ATTR_COMPRESSION_MASK | ATTR_IS_ENCRYPTED)));
+}
+
+/*
+ *		Write zeroes to a range of an attribute
+ *
+ *	Nothing is written where there is a hole, and the attribute is
+ *	extended with a hole when the zeroes are appended.
+ *
+ *	Returns 0 if successful
+ *		-1 if failed, with errno set
+ */
+
+static int ntfs_attr_write_zeroes(ntfs_attr *na, s64 pos, s64 end,
+			const char *zeroes)
+{
+	ntfs_volume *vol;
+	runlist_element *rl;
+	s64 written;
+	s64 size;
+
+	vol = na->ni->vol;
+	while (pos < end) {
+		if (pos >= na->data_size) {
+			if (ntfs_attr_truncate(na, end))
+				return (-1);
+			pos = end;
+		} else {
+			rl = ntfs_attr_find_vcn(na, pos >> vol->cluster_size_bits);
+			if (!rl)
+				return (-1);
+			size = min(end, na->data_size);
+			size = min(size, (rl->vcn + rl->length)
+					<< vol->cluster_size_bits) - pos;
+			if (rl->lcn == LCN_HOLE)
+				written = size;
+			else
+				written = ntfs_attr_pwrite_i(na, pos, size, zeroes);
+			if (written <= 0) {
+				if (!written)
+					errno = EIO;
+				return (-1);
+			}
+			pos += written;
+			zeroes += written;
+		}
+	}
+	return (0);
+}
+
+/*
+ *		Write to a sparse capable attribute, skipping zeroes
+ *
+ *	The clusters fully zeroed in the buffer are not allocated if
+ *	they are in a hole or beyond the end of the attribute, so that
+ *	the attribute is kept sparse.
+ *
+ *	Returns the count of bytes written
+ *		0 if there was no zeroed cluster, and nothing was done
+ *		-1 if failed, with errno set
+ */
+
+static s64 ntfs_attr_pwrite_sparse(ntfs_attr *na, const s64 pos, s64 count,
+			const void *b)
+{
+	ntfs_volume *vol;
+	const char *buf;
+	s64 cur;
+	s64 end;
+	s64 zstart;
+	s64 zend;
+	s64 written;
+
+	vol = na->ni->vol;
+	buf = (const char*)b;
+	end = pos + count;
+	zstart = (pos + vol->cluster_size - 1)
+			& ~((s64)vol->cluster_size - 1);
+	while (((zstart + vol->cluster_size) <= end)
+	    && !ntfs_is_zeroed(&buf[zstart - pos], vol->cluster_size))
+		zstart += vol->cluster_size;
+	if ((zstart + vol->cluster_size) > end)
+		return (0);
+	if (ntfs_attr_flush(na))
+		return (-1);
+	cur = pos;
+	do {
+		zend = zstart;
+		while (((zend + vol->cluster_size) <= end)
+		    && ntfs_is_zeroed(&buf[zend - pos], vol->cluster_size))
+			zend += vol->cluster_size;
+			/* write the data before the zeroes */
+		while (cur < zstart) {
+			written = ntfs_attr_pwrite_i(na, cur, zstart - cur,
+					&buf[cur - pos]);
+			if (written <= 0)
+				return (cur > pos ? cur - pos : -1);
+			cur += written;
+		}
+		if ((zend > zstart)
+		    && ntfs_attr_write_zeroes(na, zstart, zend,
+						&buf[zstart - pos]))
+			return (cur > pos ? cur - pos : -1);
+		cur = zend;
+			/* locate the next zeroed cluster */
+		zstart = zend;
+		while (((zstart + vol->cluster_size) <= end)
+		    && !ntfs_is_zeroed(&buf[zstart - pos], vol->cluster_size))
+			zstart += vol->cluster_size;
+		if ((zstart + vol->cluster_size) > end)
+			zstart = end;
+	} while (cur < end);
+	return (cur - pos);
+}
+
+/*
+ *		Record a change to the data of a file into the change journal
+ *
+ *	@end is the end of the data written, or the new size when
+ *	@truncation is set.
+ */
+
+static void attr_usn_record(ntfs_attr *na, s64 end, BOOL truncation)
+{
+	le32 reason;
+
+	if (na->ni->vol->usn_writer && (na->type == AT_DATA)) {
+		if (truncation)
+			reason = (na->name_len
+				? USN_REASON_NAMED_DATA_TRUNCATION
+				: USN_REASON_DATA_TRUNCATION);
+		else
+			if (end > na->data_size)
+				reason = (na->name_len
+					? USN_REASON_NAMED_DATA_EXTEND
+					: USN_REASON_DATA_EXTEND);
+			else
+				reason = (na->name_len
+					? USN_REASON_NAMED_DATA_OVERWRITE
+					: USN_REASON_DATA_OVERWRITE);
+		ntfs_usn_record(na->ni, NULL, NULL, 0, reason);
+	}
+}
+
+s64 ntfs_attr_pwrite(ntfs_attr *na, const s64 pos, s64 count, const void *b)
+{
+	s64 total;
+	s64 written;
+	BOOL traced;
+	int category = NTFS_IO_OTHER;
+
+	ntfs_log_enter("Entering for inode %lld, attr 0x%x, pos 0x%llx, count "
+		       "0x%llx.\n", (long long)na->ni->mft_no, le32_to_cpu(na->type),
+		       (long long)pos, (long long)count);
+	
+	total = 0;
+	traced = FALSE;
+	if (!na || !na->ni || !na->ni->vol || !b || pos < 0 || count < 0) {
+		errno = EINVAL;
+		written = -1;
+		ntfs_log_perror("%s", __FUNCTION__);
+		goto out;
+	}
+	if (count)
+		attr_usn_record(na, pos + count, FALSE);
+		/* bitmap updates may only be written into the cache */
+	if (na->ni->vol->bitmap_cache && ntfs_bmpcache_covers(na)
+	    && !ntfs_bmpcache_defer(na, pos, count, b)) {
+		total = count;
+		written = count;
+		goto out;
+	}
+	traced = na->ni->vol->dev->d_trace != (struct DEVICE_TRACE*)NULL;
+	if (traced)
+		category = ntfs_devtrace_category(attr_io_category(na));
+		/* data read ahead may become stale */
+	na->ni->vol->data_generation++;
+		/* zeroes may be skipped where holes can be created */
+	if (NVolSparseZeroDetect(na->ni->vol)
+	    && (count >= na->ni->vol->cluster_size)
+	    && ntfs_attr_keeps_holes(na)) {
+		written = ntfs_attr_pwrite_sparse(na, pos, count, b);
+		if (written) {
+			total = written;
+			goto out;
+		}
+	}
+	if (na->writebuf) {
+		written = ntfs_attr_buffer_write(na, pos, count, b);
+		if (written) {
+			total = written;
+			goto out;
+		}
+	}
+
+		/*
+		 * Compressed attributes may be written partially, so
+		 * we may have to iterate.
+		 */
+	do {
+		written = ntfs_attr_pwrite_i(na, pos + total,
+				count - total, (const u8*)b + total);
+		if (written > 0)
+			total += written;
+	} while ((written > 0) && (total < count));
+out :
+	if (traced)
+		ntfs_devtrace_category(category);
+	ntfs_log_leave("\n");
+	return (total > 0 ? total : written);
+}
+
+
+int ntfs_attr_pclose(ntfs_attr *na)
+{
+	s64 ofs;
+	int failed;
+	BOOL ok = TRUE;
+	VCN update_from = -1;
+	ntfs_volume *vol;
+	ntfs_attr_search_ctx *ctx = NULL;
+	runlist_element *rl;
+	int eo;
+	int compressed_part;
+	BOOL compressed;
+
+	ntfs_log_enter("Entering for inode 0x%llx, attr 0x%x.\n",
 			(unsigned long long)na->ni->mft_no,
 			le32_to_cpu(na->type));
 	
@@ -2383,6 +3359,8 @@ int ntfs_attr_pclose(ntfs_attr *na)
 	}
 	vol = na->ni->vol;
 	na->unused_runs = 0;
+	if (ntfs_attr_flush(na))
+		goto errno_set;
 	compressed = (na->data_flags & ATTR_COMPRESSION_MASK)
 			 != const_cpu_to_le16(0);
 	/*
@@ -2590,7 +3568,9 @@ s64 ntfs_attr_mst_pread(ntfs_attr *na, const s64 pos, const s64 bk_cnt,
 {
 	s64 br;
 	u8 *end;
+	u8 *p;
 	BOOL warn;
+	BOOL cached;
 
 	ntfs_log_trace("Entering for inode 0x%llx, attr type 0x%x, pos 0x%llx.\n",
 			(unsigned long long)na->ni->mft_no, le32_to_cpu(na->type),
@@ -2600,15 +3580,22 @@ s64 ntfs_attr_mst_pread(ntfs_attr *na, const s64 pos, const s64 bk_cnt,
 		ntfs_log_perror("%s", __FUNCTION__);
 		return -1;
 	}
+	cached = (na->type == AT_INDEX_ALLOCATION)
+			&& na->ni->vol->index_cache;
+	if (cached && ntfs_idxcache_get(na, pos, bk_cnt, bk_size, dst))
+		return bk_cnt;
 	br = ntfs_attr_pread(na, pos, bk_cnt * bk_size, dst);
 	if (br <= 0)
 		return br;
 	br /= bk_size;
 		/* log errors unless silenced */
 	warn = !na->ni || !na->ni->vol || !NVolNoFixupWarn(na->ni->vol);
-	for (end = (u8*)dst + br * bk_size; (u8*)dst < end; dst = (u8*)dst +
-			bk_size)
-		ntfs_mst_post_read_fixup_warn((NTFS_RECORD*)dst, bk_size, warn);
+	for (end = (u8*)dst + br * bk_size, p = (u8*)dst; p < end;
+			p += bk_size)
+		ntfs_mst_post_read_fixup_warn((NTFS_RECORD*)p, bk_size, warn);
+		/* the cached blocks may be more recent */
+	if (cached)
+		ntfs_idxcache_get(na, pos, br, bk_size, dst);
 	/* Finally, return the number of blocks read. */
 	return br;
 }
@@ -2657,6 +3644,21 @@ s64 ntfs_attr_mst_pwrite(ntfs_attr *na, const s64 pos, s64 bk_cnt,
 	}
 	if (!bk_cnt)
 		return 0;
+	/* Index blocks may only be written into the cache. */
+	if ((na->type == AT_INDEX_ALLOCATION) && na->ni->vol->index_cache) {
+		switch (ntfs_idxcache_defer(na, pos, bk_cnt, bk_size, src)) {
+		case 0 :
+			return bk_cnt;
+		case 1 :
+			break;
+		default :
+			return -1;
+		}
+	}
+	/* The bits allocating the records must be on the device first. */
+	if ((na == na->ni->vol->mft_na)
+	    && ntfs_bmpcache_flush(na->ni->vol, FALSE))
+		return -1;
 	/* Prepare data for writing. */
 	for (i = 0; i < bk_cnt; ++i) {
 		int err;
@@ -2766,6 +3768,7 @@ static int ntfs_attr_find(const ATTR_TYPES type, const ntfschar *name,
 	ntfs_volume *vol;
 	ntfschar *upcase;
 	u32 upcase_len;
+	char *mrec_end;
 
 	ntfs_log_trace("attribute type 0x%x.\n", le32_to_cpu(type));
 
@@ -2793,9 +3796,10 @@ static int ntfs_attr_find(const ATTR_TYPES type, const ntfschar *name,
 	} else
 		a = (ATTR_RECORD*)((char*)ctx->attr +
 				le32_to_cpu(ctx->attr->length));
+	mrec_end = (char*)ctx->mrec + le32_to_cpu(ctx->mrec->bytes_allocated);
 	for (;;	a = (ATTR_RECORD*)((char*)a + le32_to_cpu(a->length))) {
-		if (p2n(a) < p2n(ctx->mrec) || (char*)a > (char*)ctx->mrec +
-				le32_to_cpu(ctx->mrec->bytes_allocated))
+		if (p2n(a) < p2n(ctx->mrec)
+		    || (char*)a + offsetof(ATTR_RECORD, non_resident) > mrec_end)
 			break;
 		ctx->attr = a;
 		if (((type != AT_UNUSED) && (le32_to_cpu(a->type) >
@@ -2806,6 +3810,11 @@ static int ntfs_attr_find(const ATTR_TYPES type, const ntfschar *name,
 		}
 		if (!a->length)
 			break;
+		/* The attribute and its name must be within the record */
+		if (((char*)a + le32_to_cpu(a->length) > mrec_end)
+		    || (le16_to_cpu(a->name_offset) + 2*a->name_length
+				> le32_to_cpu(a->length)))
+			break;
 		/* If this is an enumeration return this attribute. */
 		if (type == AT_UNUSED)
 			return 0;
@@ -2852,6 +3861,11 @@ static int ntfs_attr_find(const ATTR_TYPES type, const ntfschar *name,
 		else {
 			register int rc;
 
+			if (a->non_resident
+			    || (le16_to_cpu(a->value_offset)
+				+ (u64)le32_to_cpu(a->value_length)
+					> le32_to_cpu(a->length)))
+				break;
 			rc = memcmp(val, (char*)a +le16_to_cpu(a->value_offset),
 					min(val_len,
 					le32_to_cpu(a->value_length)));
@@ -3008,6 +4022,13 @@ static int ntfs_external_attr_find(ATTR_TYPES type, const ntfschar *name,
 	if (!ctx->al_entry) {
 		ctx->al_entry = (ATTR_LIST_ENTRY*)al_start;
 		is_first_search = TRUE;
+			/* skip the entries before the attribute, if indexed */
+		if ((type != AT_UNUSED) && ctx->is_first) {
+			al_entry = ntfs_attrlist_lookup(base_ni, type, name,
+					name_len, ic, lowest_vcn);
+			if (al_entry)
+				ctx->al_entry = al_entry;
+		}
 	}
 	/*
 	 * Iterate over entries in attribute list starting at @ctx->al_entry,
@@ -3481,6 +4502,41 @@ void ntfs_attr_reinit_search_ctx(ntfs_attr_search_ctx *ctx)
 	return;
 }
 
+/*
+ *		Pool of search contexts
+ *
+ *	Search contexts are kept for reuse when they are released, so
+ *	that looking up an attribute does not allocate memory in the
+ *	common case. Only the contexts associated to an inode are kept,
+ *	and the volume is recorded when getting them, as the inode may
+ *	have been closed when the context is released.
+ *
+ *	The pool is protected by the cache lock.
+ */
+
+struct SEARCH_POOL {
+	int count;
+	ntfs_attr_search_ctx *contexts[SEARCH_POOL_SIZE];
+} ;
+
+/*
+ *		Free the pool of a volume, when unmounting
+ */
+
+void ntfs_attr_search_pool_release(ntfs_volume *vol)
+{
+	struct SEARCH_POOL *pool;
+	int i;
+
+	pool = vol->search_pool;
+	if (pool) {
+		vol->search_pool = (struct SEARCH_POOL*)NULL;
+		for (i=0; i<pool->count; i++)
+			free(pool->contexts[i]);
+		free(pool);
+	}
+}
+
 /**
  * ntfs_attr_get_search_ctx - allocate/initialize a new attribute search context
  * @ni:		ntfs inode with which to initialize the search context
@@ -3497,16 +4553,30 @@ void ntfs_attr_reinit_search_ctx(ntfs_attr_search_ctx *ctx)
  */
 ntfs_attr_search_ctx *ntfs_attr_get_search_ctx(ntfs_inode *ni, MFT_RECORD *mrec)
 {
+	struct SEARCH_POOL *pool;
 	ntfs_attr_search_ctx *ctx;
+	ntfs_volume *vol;
 
 	if (!ni && !mrec) {
 		errno = EINVAL;
 		ntfs_log_perror("NULL arguments");
 		return NULL;
 	}
-	ctx = ntfs_malloc(sizeof(ntfs_attr_search_ctx));
-	if (ctx)
+	ctx = (ntfs_attr_search_ctx*)NULL;
+	if (ni) {
+		vol = ni->vol;
+		ntfs_cache_lock(vol);
+		pool = vol->search_pool;
+		if (pool && pool->count)
+			ctx = pool->contexts[--pool->count];
+		ntfs_cache_unlock(vol);
+	}
+	if (!ctx)
+		ctx = ntfs_malloc(sizeof(ntfs_attr_search_ctx));
+	if (ctx) {
 		ntfs_attr_init_search_ctx(ctx, ni, mrec);
+		ctx->vol = (ni ? ni->vol : (ntfs_volume*)NULL);
+	}
 	return ctx;
 }
 
@@ -3518,8 +4588,26 @@ ntfs_attr_search_ctx *ntfs_attr_get_search_ctx(ntfs_inode *ni, MFT_RECORD *mrec)
  */
 void ntfs_attr_put_search_ctx(ntfs_attr_search_ctx *ctx)
 {
+	struct SEARCH_POOL *pool;
+	ntfs_volume *vol;
+
 	// NOTE: save errno if it could change and function stays void!
-	free(ctx);
+	if (ctx) {
+		vol = ctx->vol;
+		if (vol) {
+			ntfs_cache_lock(vol);
+			if (!vol->search_pool)
+				vol->search_pool = (struct SEARCH_POOL*)
+					ntfs_calloc(sizeof(struct SEARCH_POOL));
+			pool = vol->search_pool;
+			if (pool && (pool->count < SEARCH_POOL_SIZE)) {
+				pool->contexts[pool->count++] = ctx;
+				ctx = (ntfs_attr_search_ctx*)NULL;
+			}
+			ntfs_cache_unlock(vol);
+		}
+		free(ctx);
+	}
 }
 
 /**
@@ -3541,11 +4629,15 @@ ATTR_DEF *ntfs_attr_find_in_attrdef(const ntfs_volume *vol,
 {
 	ATTR_DEF *ad;
 
-	if (!vol || !vol->attrdef || !type) {
+	if (!vol || !type) {
 		errno = EINVAL;
 		ntfs_log_perror("%s: type=%d", __FUNCTION__, le32_to_cpu(type));
 		return NULL;
 	}
+		/* not loaded yet when mounted with NTFS_MNT_FAST */
+	if (!vol->attrdef
+	    && ntfs_volume_load_attrdef((ntfs_volume*)vol))
+		return NULL;
 	for (ad = vol->attrdef; (u8*)ad - (u8*)vol->attrdef <
 			vol->attrdef_len && ad->type; ++ad) {
 		/* We haven't found it yet, carry on searching. */
@@ -3704,7 +4796,8 @@ static int ntfs_attr_can_be_non_resident(const ntfs_volume *vol, const ATTR_TYPE
  */
 int ntfs_attr_can_be_resident(const ntfs_volume *vol, const ATTR_TYPES type)
 {
-	if (!vol || !vol->attrdef || !type) {
+		/* $AttrDef is not used, it may not be loaded yet */
+	if (!vol || !type) {
 		errno = EINVAL;
 		return -1;
 	}
@@ -3770,6 +4863,18 @@ int ntfs_make_room_for_attr(MFT_RECORD *m, u8 *pos, u32 size)
 	return 0;
 }
 
+/*
+ *		Drop the list of named data streams kept in a base inode
+ *	when one of them is added or removed (see xattrs.c)
+ */
+
+static void forget_stream_names(ntfs_inode *base_ni)
+{
+	free(base_ni->stream_names);
+	base_ni->stream_names = (char*)NULL;
+	base_ni->stream_names_size = 0;
+}
+
 /**
  * ntfs_resident_attr_record_add - add resident attribute to inode
  * @ni:		opened ntfs inode to which MFT record add attribute
@@ -3876,6 +4981,8 @@ int ntfs_resident_attr_record_add(ntfs_inode *ni, ATTR_TYPES type,
 		base_ni = ni->base_ni;
 	else
 		base_ni = ni;
+	if ((type == AT_DATA) && name_len)
+		forget_stream_names(base_ni);
 	if (type != AT_ATTRIBUTE_LIST && NInoAttrList(base_ni)) {
 		if (ntfs_attrlist_entry_add(ni, a)) {
 			err = errno;
@@ -4015,6 +5122,8 @@ int ntfs_non_resident_attr_record_add(ntfs_inode *ni, ATTR_TYPES type,
 		base_ni = ni->base_ni;
 	else
 		base_ni = ni;
+	if ((type == AT_DATA) && name_len)
+		forget_stream_names(base_ni);
 	if (type != AT_ATTRIBUTE_LIST && NInoAttrList(base_ni)) {
 		if (ntfs_attrlist_entry_add(ni, a)) {
 			err = errno;
@@ -4077,6 +5186,8 @@ int ntfs_attr_record_rm(ntfs_attr_search_ctx *ctx)
 		base_ni = ctx->base_ntfs_ino;
 	else
 		base_ni = ctx->ntfs_ino;
+	if ((type == AT_DATA) && ctx->attr->name_length)
+		forget_stream_names(base_ni);
 
 	/* Remove attribute itself. */
 	if (ntfs_attr_record_resize(ctx->mrec, ctx->attr, 0)) {
@@ -4107,6 +5218,7 @@ int ntfs_attr_record_rm(ntfs_attr_search_ctx *ctx)
 	if (type == AT_ATTRIBUTE_LIST) {
 		if (NInoAttrList(base_ni) && base_ni->attr_list)
 			free(base_ni->attr_list);
+		ntfs_attrlist_index_free(base_ni);
 		base_ni->attr_list = NULL;
 		NInoClearAttrList(base_ni);
 		NInoAttrListClearDirty(base_ni);
@@ -4445,6 +5557,25 @@ int ntfs_attr_rm(ntfs_attr *na)
 	ntfs_log_trace("Entering for inode 0x%llx, attr 0x%x.\n",
 		(long long) na->ni->mft_no, le32_to_cpu(na->type));
 
+	/* Appended data not written yet is dropped. */
+	if (na->writebuf) {
+		if (na->writebuf->count) {
+			na->data_size = na->writebuf->disk_size;
+			if ((na->type == AT_DATA) && (na->name == AT_UNNAMED)) {
+				na->ni->data_size = na->data_size;
+				if (NAttrNonResident(na)
+				    && (NAttrCompressed(na) || NAttrSparse(na)))
+					na->ni->allocated_size
+						= na->compressed_size;
+				else
+					na->ni->allocated_size
+						= na->allocated_size;
+			}
+		}
+		na->writebuf->count = 0;
+		na->writebuf->allocated_ahead = FALSE;
+	}
+
 	/* Free cluster allocation. */
 	if (NAttrNonResident(na)) {
 		if (ntfs_attr_map_whole_runlist(na))
@@ -4830,6 +5961,7 @@ int ntfs_attr_make_non_resident(ntfs_attr *na,
 	NAttrSetNonResident(na);
 	NAttrSetBeingNonResident(na);
 	na->rl = rl;
+	ntfs_attr_forget_runs(na);
 	na->allocated_size = new_allocated_size;
 	na->data_size = na->initialized_size = le32_to_cpu(a->value_length);
 	/*
@@ -5568,6 +6700,101 @@ retry:	ret = -2; goto out;
 error:  ret = -3; goto out;
 }
 
+/*
+ *		Append the new runs to the mapping pairs of the last extent
+ *
+ *	When a runlist was extended or changed near its end, as when
+ *	appending to a file, the mapping pairs of the last extent which
+ *	still describe the runlist are kept, and only the runs which
+ *	follow are encoded after them, instead of encoding again the
+ *	whole extent. The new runs which do not fit in the mft record
+ *	are left to be stored into new extents.
+ *
+ *	Returns 1 if all the runs have been stored
+ *		0 if the runs from *stop_rl have still to be stored
+ *		-1 if this cannot be done, and the extent was not changed
+ */
+
+static int ntfs_attr_append_mapping_pairs(ntfs_attr *na,
+			ntfs_attr_search_ctx *ctx,
+			const runlist_element **stop_rl)
+{
+	ntfs_volume *vol;
+	ntfs_inode *base_ni;
+	ATTR_LIST_ENTRY *next;
+	const runlist_element *rl;
+	MFT_RECORD *m;
+	ATTR_RECORD *a;
+	u8 *mp;
+	VCN lowest_vcn;
+	VCN resume_vcn;
+	LCN prev_lcn;
+	int offset;
+	int mp_size;
+	int cur_max_mp_size;
+	int exp_max_mp_size;
+	int err;
+
+	vol = na->ni->vol;
+	a = ctx->attr;
+	m = ctx->mrec;
+	base_ni = ctx->base_ntfs_ino;
+	if (!base_ni)
+		base_ni = ctx->ntfs_ino;
+		/* the extent must be the last one of the attribute */
+	if (NInoAttrList(base_ni) && ctx->al_entry) {
+		next = (ATTR_LIST_ENTRY*)((u8*)ctx->al_entry
+				+ le16_to_cpu(ctx->al_entry->length));
+		if (((u8*)next < (base_ni->attr_list
+					+ base_ni->attr_list_size))
+		    && (next->type == ctx->al_entry->type)
+		    && (next->name_length == ctx->al_entry->name_length)
+		    && !memcmp((u8*)next + next->name_offset,
+				(u8*)ctx->al_entry
+					+ ctx->al_entry->name_offset,
+				next->name_length*sizeof(ntfschar)))
+			return (-1);
+	}
+	lowest_vcn = sle64_to_cpu(a->lowest_vcn);
+	if (lowest_vcn < na->rl->vcn)
+		return (-1);
+	rl = ntfs_attr_search_run(na, lowest_vcn);
+	mp = (u8*)a + le16_to_cpu(a->mapping_pairs_offset);
+	cur_max_mp_size = le32_to_cpu(a->length)
+				- le16_to_cpu(a->mapping_pairs_offset);
+	offset = ntfs_mapping_pairs_resume(vol, mp, mp + cur_max_mp_size,
+				rl, lowest_vcn, &resume_vcn, &prev_lcn);
+		/* nothing to keep, let the extent be rebuilt */
+	if ((offset <= 0) || (resume_vcn <= lowest_vcn))
+		return (-1);
+	rl = ntfs_attr_search_run(na, resume_vcn);
+	mp_size = ntfs_get_size_for_mapping_pairs_from(vol, rl, resume_vcn,
+				prev_lcn, INT_MAX);
+	if (mp_size <= 0)
+		return (-1);
+	exp_max_mp_size = le32_to_cpu(m->bytes_allocated)
+			- le32_to_cpu(m->bytes_in_use) + cur_max_mp_size;
+	if ((offset + mp_size) > exp_max_mp_size) {
+		if (!NInoAttrList(base_ni)
+		    || ((offset + 1) >= exp_max_mp_size))
+			return (-1);
+		mp_size = exp_max_mp_size - offset;
+	}
+	if (((offset + mp_size + 7) & ~7) != cur_max_mp_size) {
+		if (ntfs_attr_record_resize(m, a,
+				le16_to_cpu(a->mapping_pairs_offset)
+					+ offset + mp_size))
+			return (-1);
+	}
+	err = ntfs_mapping_pairs_build_from(vol, mp + offset, mp_size,
+				rl, resume_vcn, prev_lcn, stop_rl);
+	if (err && (errno != ENOSPC))
+		return (-1);
+	a->highest_vcn = cpu_to_sle64((*stop_rl ? (*stop_rl)->vcn : 0) - 1);
+	ntfs_inode_mark_dirty(ctx->ntfs_ino);
+	return (err ? 0 : 1);
+}
+
 #define NTFS_VCN_DELETE_MARK -2
 /**
  * ntfs_attr_update_mapping_pairs_i - see ntfs_attr_update_mapping_pairs
@@ -5584,6 +6811,8 @@ static int ntfs_attr_update_mapping_pairs_i(ntfs_attr *na, VCN from_vcn,
 	int err, mp_size, cur_max_mp_size, exp_max_mp_size, ret = -1;
 	BOOL finished_build;
 	BOOL first_updated = FALSE;
+	BOOL try_append;
+	BOOL appended;
 
 retry:
 	if (!na || !na->rl) {
@@ -5675,6 +6904,8 @@ retry:
 	stop_vcn = 0;
 	stop_rl = na->rl;
 	finished_build = FALSE;
+	try_append = FALSE;
+	appended = FALSE;
 	while (!ntfs_attr_lookup(na->type, na->name, na->name_len,
 				CASE_SENSITIVE, from_vcn, NULL, 0, ctx)) {
 		a = ctx->attr;
@@ -5697,15 +6928,24 @@ retry:
 			 * the last run in runlist, if so, then deallocate
 			 * all attrubute extents starting this one.
 			 */
-			first_lcn = ntfs_rl_vcn_to_lcn(na->rl, stop_vcn);
-			if (first_lcn == LCN_EINVAL) {
-				errno = EIO;
-				ntfs_log_perror("Bad runlist");
-				goto put_err_out;
+			if (stop_vcn < na->rl->vcn)
+				first_lcn = LCN_ENOENT;
+			else {
+				stop_rl = ntfs_attr_search_run(na, stop_vcn);
+				if (stop_rl->lcn < 0)
+					first_lcn = stop_rl->lcn;
+				else
+					first_lcn = (stop_rl->length
+						? stop_rl->lcn + stop_vcn
+							- stop_rl->vcn
+						: LCN_ENOENT);
 			}
 			if (first_lcn == LCN_ENOENT ||
 					first_lcn == LCN_RL_NOT_MAPPED)
 				finished_build = TRUE;
+			else
+				try_append = stop_rl->length
+					&& (na->type != AT_ATTRIBUTE_LIST);
 		}
 
 		/*
@@ -5729,6 +6969,27 @@ retry:
 			case -3: goto put_err_out;
 		}
 
+		/*
+		 * When updating from within the last extent, only
+		 * encode the runs which changed.
+		 */
+		if (try_append) {
+			try_append = FALSE;
+			switch (ntfs_attr_append_mapping_pairs(na, ctx,
+						&stop_rl)) {
+			case 1 :
+				finished_build = TRUE;
+				appended = TRUE;
+				continue;
+			case 0 :
+				stop_vcn = stop_rl->vcn;
+				appended = TRUE;
+				continue;
+			default :
+				break;
+			}
+		}
+
 		/*
 		 * Determine maximum possible length of mapping pairs,
 		 * if we shall *not* expand space for mapping pairs.
@@ -5812,7 +7073,7 @@ retry:
 		 * correct destination, i.e. the attribute record itself.
 		 */
 		if (!ntfs_mapping_pairs_build(na->ni->vol, (u8*)a + le16_to_cpu(
-				a->mapping_pairs_offset), mp_size, na->rl,
+				a->mapping_pairs_offset), mp_size, stop_rl,
 				stop_vcn, &stop_rl))
 			finished_build = TRUE;
 		if (stop_rl)
@@ -5859,6 +7120,11 @@ retry:
 		}
 	}
 
+	/* No extent follows the one appended to */
+	if (finished_build && appended) {
+		ntfs_attr_put_search_ctx(ctx);
+		goto ok;
+	}
 	/* Deallocate not used attribute extents and return with success. */
 	if (finished_build) {
 		ntfs_attr_reinit_search_ctx(ctx);
@@ -5890,7 +7156,7 @@ retry:
 	while (1) {
 		/* Calculate size of rest mapping pairs. */
 		mp_size = ntfs_get_size_for_mapping_pairs(na->ni->vol,
-						na->rl, stop_vcn, INT_MAX);
+						stop_rl, stop_vcn, INT_MAX);
 		if (mp_size <= 0) {
 			ntfs_log_perror("%s: get mp size failed", __FUNCTION__);
 			goto put_err_out;
@@ -5934,7 +7200,7 @@ retry:
 		a = (ATTR_RECORD*)((u8*)m + err);
 
 		err = ntfs_mapping_pairs_build(na->ni->vol, (u8*)a +
-			le16_to_cpu(a->mapping_pairs_offset), mp_size, na->rl,
+			le16_to_cpu(a->mapping_pairs_offset), mp_size, stop_rl,
 			stop_vcn, &stop_rl);
 		if (stop_rl)
 			stop_vcn = stop_rl->vcn;
@@ -6019,12 +7285,14 @@ static int ntfs_non_resident_attr_shrink(ntfs_attr *na, const s64 newsize)
 	ntfs_attr_search_ctx *ctx;
 	VCN first_free_vcn;
 	s64 nr_freed_clusters;
+	s64 old_size;
 	int err;
 
 	ntfs_log_trace("Inode 0x%llx attr 0x%x new size %lld\n", (unsigned long long)
 		       na->ni->mft_no, le32_to_cpu(na->type), (long long)newsize);
 
 	vol = na->ni->vol;
+	old_size = na->data_size;
 
 	/*
 	 * Check the attribute type and the corresponding minimum size
@@ -6073,6 +7341,7 @@ static int ntfs_non_resident_attr_shrink(ntfs_attr *na, const s64 newsize)
 		}
 
 		/* Truncate the runlist itself. */
+		ntfs_attr_forget_runs(na);
 		if (ntfs_rl_truncate(&na->rl, first_free_vcn)) {
 			/*
 			 * Failed to truncate the runlist, so just throw it
@@ -6132,8 +7401,13 @@ static int ntfs_non_resident_attr_shrink(ntfs_attr *na, const s64 newsize)
 		}
 	}
 
-	/* If the attribute now has zero size, make it resident. */
-	if (!newsize) {
+	/*
+	 * If the attribute now has zero size, make it resident, unless
+	 * it is data which was big, and is probably being rewritten.
+	 */
+	if (!newsize
+	    && ((na->type != AT_DATA)
+		|| (old_size <= RESIDENT_GROWTH_LIMIT(vol)))) {
 		if (!(na->data_flags & ATTR_IS_ENCRYPTED)
 		    && ntfs_attr_make_resident(na, ctx)) {
 			/* If couldn't make resident, just continue. */
@@ -6154,8 +7428,102 @@ put_err_out:
 	return -1;
 }
 
-/**
- * ntfs_non_resident_attr_expand - expand a non-resident, open ntfs attribute
+/*
+ *		Determine first after last LCN of attribute
+ *
+ *	We will start seek clusters from this LCN to avoid fragmentation.
+ *	If there are no valid LCNs in the attribute let the cluster
+ *	allocator choose the starting LCN (-1 is returned).
+ */
+
+static LCN ntfs_attr_next_lcn(ntfs_attr *na)
+{
+	runlist_element *rl;
+	LCN lcn_seek_from;
+
+	lcn_seek_from = -1;
+	if (na->rl->length) {
+		/* Seek to the last run list element. */
+		for (rl = na->rl; (rl + 1)->length; rl++)
+			;
+		/*
+		 * If the last LCN is a hole or similar seek
+		 * back to last valid LCN.
+		 */
+		while (rl->lcn < 0 && rl != na->rl)
+			rl--;
+		/*
+		 * Only set lcn_seek_from it the LCN is valid.
+		 */
+		if (rl->lcn >= 0)
+			lcn_seek_from = rl->lcn + rl->length;
+	}
+	return (lcn_seek_from);
+}
+
+/*
+ *		Allocate clusters ahead of the data of an attribute
+ *
+ *	The allocation is extended up to @newsize, without changing the
+ *	data size, so that data appended later in several steps, while
+ *	other files are being written, is stored contiguously. This is
+ *	only done when there is plenty of free space, and the clusters
+ *	not used are expected to be freed when the appending is over.
+ *
+ *	Returns 0 if clusters were allocated
+ *		-1 otherwise, with errno set
+ */
+
+static int ntfs_attr_allocate_ahead(ntfs_attr *na, const s64 newsize)
+{
+	ntfs_volume *vol;
+	runlist *rl, *rln;
+	s64 org_alloc_size;
+	VCN first_free_vcn;
+	s64 count;
+	int err;
+
+	vol = na->ni->vol;
+	org_alloc_size = na->allocated_size;
+	first_free_vcn = (newsize + vol->cluster_size - 1)
+			>> vol->cluster_size_bits;
+	count = first_free_vcn - (org_alloc_size >> vol->cluster_size_bits);
+	if ((count <= 0) || (vol->free_clusters < 4*count)) {
+		errno = ENOSPC;
+		return (-1);
+	}
+	if (ntfs_attr_map_whole_runlist(na))
+		return (-1);
+	rl = ntfs_cluster_alloc(vol, org_alloc_size >> vol->cluster_size_bits,
+			count, ntfs_attr_next_lcn(na), DATA_ZONE);
+	if (!rl)
+		return (-1);
+	rln = ntfs_runlists_merge(na->rl, rl);
+	if (!rln) {
+		err = errno;
+		ntfs_cluster_free_from_rl(vol, rl);
+		free(rl);
+		errno = err;
+		return (-1);
+	}
+	na->rl = rln;
+	ntfs_attr_forget_runs(na);
+	NAttrSetRunlistDirty(na);
+	na->allocated_size = first_free_vcn << vol->cluster_size_bits;
+	if (ntfs_attr_update_mapping_pairs(na, 0)) {
+		err = errno;
+		ntfs_log_perror("Mapping pairs update failed");
+		if (ntfs_non_resident_attr_shrink(na, na->data_size))
+			ntfs_log_perror("Failed to free the clusters "
+					"allocated ahead");
+		errno = err;
+		return (-1);
+	}
+	return (0);
+}
+
+/**
+ * ntfs_non_resident_attr_expand - expand a non-resident, open ntfs attribute
  * @na:		non-resident ntfs attribute to expand
  * @newsize:	new size (in bytes) to which to expand the attribute
  *
@@ -6248,31 +7616,7 @@ static int ntfs_non_resident_attr_expand_i(ntfs_attr *na, const s64 newsize,
 			rl[1].lcn = LCN_ENOENT;
 			rl[1].length = 0;
 		} else {
-			/*
-			 * Determine first after last LCN of attribute.
-			 * We will start seek clusters from this LCN to avoid
-			 * fragmentation.  If there are no valid LCNs in the
-			 * attribute let the cluster allocator choose the
-			 * starting LCN.
-			 */
-			lcn_seek_from = -1;
-			if (na->rl->length) {
-				/* Seek to the last run list element. */
-				for (rl = na->rl; (rl + 1)->length; rl++)
-					;
-				/*
-				 * If the last LCN is a hole or similar seek
-				 * back to last valid LCN.
-				 */
-				while (rl->lcn < 0 && rl != na->rl)
-					rl--;
-				/*
-				 * Only set lcn_seek_from it the LCN is valid.
-				 */
-				if (rl->lcn >= 0)
-					lcn_seek_from = rl->lcn + rl->length;
-			}
-
+			lcn_seek_from = ntfs_attr_next_lcn(na);
 			rl = ntfs_cluster_alloc(vol, na->allocated_size >>
 					vol->cluster_size_bits, first_free_vcn -
 					(na->allocated_size >>
@@ -6300,6 +7644,7 @@ static int ntfs_non_resident_attr_expand_i(ntfs_attr *na, const s64 newsize,
 			return -1;
 		}
 		na->rl = rln;
+		ntfs_attr_forget_runs(na);
 		NAttrSetRunlistDirty(na);
 
 		/* Prepare to mapping pairs update. */
@@ -6376,6 +7721,7 @@ rollback:
 		ntfs_log_perror("Leaking clusters");
 	}
 	/* Now, truncate the runlist itself. */
+	ntfs_attr_forget_runs(na);
 	if (ntfs_rl_truncate(&na->rl, org_alloc_size >>
 			vol->cluster_size_bits)) {
 		/*
@@ -6453,12 +7799,14 @@ static int ntfs_attr_truncate_i(ntfs_attr *na, const s64 newsize,
 	ntfs_log_enter("Entering for inode %lld, attr 0x%x, size %lld\n",
 		       (unsigned long long)na->ni->mft_no, le32_to_cpu(na->type),
 		       (long long)newsize);
+	na->ni->vol->data_generation++;
 
 	if (na->data_size == newsize) {
 		ntfs_log_trace("Size is already ok\n");
 		ret = STATUS_OK;
 		goto out;
 	}
+	attr_usn_record(na, newsize, newsize < na->data_size);
 	/*
 	 * Encrypted attributes are not supported. We return access denied,
 	 * which is what Windows NT4 does, too.
@@ -6521,6 +7869,8 @@ int ntfs_attr_truncate(ntfs_attr *na, const s64 newsize)
 {
 	int r;
 
+	if (ntfs_attr_flush(na))
+		return (-1);
 	r = ntfs_attr_truncate_i(na, newsize, HOLES_OK);
 	NAttrClearDataAppending(na);
 	NAttrClearBeingNonResident(na);
@@ -6533,9 +7883,1093 @@ int ntfs_attr_truncate(ntfs_attr *na, const s64 newsize)
 
 int ntfs_attr_truncate_solid(ntfs_attr *na, const s64 newsize)
 {
+	if (ntfs_attr_flush(na))
+		return (-1);
 	return (ntfs_attr_truncate_i(na, newsize, HOLES_NO));
 }
 
+/*
+ *		Save the initial runlist, to be restored on error
+ */
+
+static runlist_element *ntfs_fallocate_save_rl(runlist_element *rl)
+{
+	runlist_element *save;
+	int n;
+
+	n = 0;
+	save = (runlist_element*)NULL;
+	if (rl) {
+		while (rl[n].length)
+			n++;
+		save = (runlist_element*)ntfs_malloc(
+					(n + 1)*sizeof(runlist_element));
+		if (save) {
+			memcpy(save, rl, (n + 1)*sizeof(runlist_element));
+		}
+	}
+	return (save);
+}
+
+/*
+ *		Free the common part of two runs
+ */
+
+static void ntfs_fallocate_free_common(ntfs_volume *vol,
+			runlist_element *brl, s64 blth,
+			runlist_element *grl, s64 glth)
+{
+	VCN begin_common;
+	VCN end_common;
+
+	begin_common = max(grl->vcn, brl->vcn);
+	end_common = min(grl->vcn + glth, brl->vcn + blth);
+	if (end_common > begin_common) {
+		if (ntfs_bitmap_clear_run(vol->lcnbmp_na,
+			brl->lcn + begin_common - brl->vcn,
+					end_common - begin_common))
+			ntfs_log_error("Failed to free %lld clusters "
+				"from 0x%llx\n",
+				(long long)end_common - begin_common,
+				(long long)(brl->lcn + begin_common
+							- brl->vcn));
+	}
+}
+
+/*
+ *		Restore the cluster allocations to initial state
+ *
+ *	If a new error occurs, only output a message
+ */
+
+static void ntfs_fallocate_restore_rl(ntfs_attr *na, runlist_element *oldrl)
+{
+	runlist_element *brl; /* Pointer to bad runlist */
+	runlist_element *grl; /* Pointer to good runlist */
+	ntfs_volume *vol;
+
+	vol = na->ni->vol;
+		/* Examine allocated entries from the bad runlist */
+	for (brl=na->rl; brl->length; brl++) {
+		if (brl->lcn != LCN_HOLE) {
+// TODO improve by examining both list in parallel
+		/* Find the holes in the good runlist which overlap */
+			for (grl=oldrl; grl->length
+			   && (grl->vcn<=(brl->vcn+brl->length)); grl++) {
+				if (grl->lcn == LCN_HOLE) {
+					ntfs_fallocate_free_common(vol,
+						brl, brl->length,
+						grl, grl->length);
+				}
+			}
+			/* Free allocations beyond the end of good runlist */
+			if (grl && !grl->length
+			    && ((brl->vcn + brl->length) > grl->vcn)) {
+				ntfs_fallocate_free_common(vol,
+					brl, brl->length, grl,
+					brl->vcn + brl->length - grl->vcn);
+			}
+		}
+	}
+	free(na->rl);
+	na->rl = oldrl;
+	ntfs_attr_forget_runs(na);
+	if (ntfs_attr_update_mapping_pairs(na, 0)) {
+		ntfs_log_error("Failed to restore the original runlist\n");
+	}
+}
+
+/*
+ *		Zero newly allocated runs up to initialized_size
+ */
+
+static int ntfs_fallocate_zero(ntfs_attr *na, runlist_element *rl)
+{
+	ntfs_volume *vol;
+	char *buf;
+	runlist_element *zrl;
+	s64 cofs;
+	s64 pos;
+	s64 zeroed;
+	int err;
+
+	err = 0;
+	vol = na->ni->vol;
+	buf = (char*)ntfs_malloc(vol->cluster_size);
+	if (buf) {
+		memset(buf, 0, vol->cluster_size);
+		zrl = rl;
+		pos = zrl->vcn << vol->cluster_size_bits;
+		while (zrl->length
+	 	    && !err
+	    	    && (pos < na->initialized_size)) {
+			for (cofs=0; cofs<zrl->length && !err; cofs++) {
+				zeroed = ntfs_pwrite(vol->dev,
+					(zrl->lcn + cofs)
+						<< vol->cluster_size_bits,
+					vol->cluster_size, buf);
+				if (zeroed != vol->cluster_size) {
+					ntfs_log_error("Failed to zero at "
+						"offset %lld\n",
+						(long long)pos);
+					errno = EIO;
+					err = -1;
+				}
+				pos += vol->cluster_size;
+			}
+			zrl++;
+			pos = zrl->vcn << vol->cluster_size_bits;
+		}
+		free(buf);
+	} else
+		err = -1;
+	return (err);
+}
+
+/*
+ *		Merge newly allocated runs into runlist
+ */
+
+static int ntfs_fallocate_merge(ntfs_attr *na, runlist_element *rl,
+				s64 size)
+{
+	ntfs_volume *vol;
+	int err;
+
+	err = 0;
+	vol = na->ni->vol;
+	/* Newly allocated clusters before initialized size need be zeroed */
+	if ((rl->vcn << vol->cluster_size_bits) < na->initialized_size) {
+		err = ntfs_fallocate_zero(na, rl);
+	}
+	if (!err) {
+		if (na->data_flags & ATTR_IS_SPARSE) {
+			na->compressed_size += size;
+			if (na->compressed_size >= na->allocated_size) {
+				na->data_flags &= ~ATTR_IS_SPARSE;
+				if (na->compressed_size > na->allocated_size) {
+					ntfs_log_error("File size error : "
+						"apparent %lld, "
+						"compressed %lld > "
+						"allocated %lld",
+						(long long)na->data_size,
+						(long long)na->compressed_size,
+						(long long)na->allocated_size);
+					errno = EIO;
+					err = -1;
+				}
+			}
+		}
+	}
+	if (!err) {
+		rl = ntfs_runlists_merge(na->rl, rl);
+		if (!rl) {
+			ntfs_log_error("Failed to merge the new allocation\n");
+			err = -1;
+		} else {
+			na->rl = rl;
+			ntfs_attr_forget_runs(na);
+				/* Update the runlist */
+			if (ntfs_attr_update_mapping_pairs(na, 0)) {
+				ntfs_log_error(
+					"Failed to update the runlist\n");
+				err = -1;
+			}
+		}
+	}
+	return (err);
+}
+
+/*
+ *		Allocate the holes which overlap the requested range
+ */
+
+static int ntfs_fallocate_holes(ntfs_attr *na, s64 alloc_offs, s64 alloc_len)
+{
+	ntfs_volume *vol;
+	runlist_element *rl;
+	runlist_element *prl;
+	runlist_element *rlc;
+	VCN from_vcn;
+	VCN end_vcn;
+	LCN lcn_seek_from;
+	VCN from_hole;
+	VCN end_hole;
+	s64 need;
+	int err;
+	BOOL done;
+
+	err = 0;
+	vol = na->ni->vol;
+		/* Find holes which overlap the requested allocation */
+	from_vcn = alloc_offs >> vol->cluster_size_bits;
+	end_vcn = (alloc_offs + alloc_len + vol->cluster_size - 1)
+			>> vol->cluster_size_bits;
+	do {
+		done = FALSE;
+		rl = na->rl;
+		while (rl->length
+		    && ((rl->lcn >= 0)
+		    	|| ((rl->vcn + rl->length) <= from_vcn)
+			|| (rl->vcn >= end_vcn)))
+				rl++;
+		if (!rl->length)
+			done = TRUE;
+		else {
+			from_hole = max(from_vcn, rl->vcn);
+			end_hole = min(end_vcn, rl->vcn + rl->length);
+			need = end_hole - from_hole;
+			lcn_seek_from = -1;
+			if (rl->vcn) {
+					/* Avoid fragmentation when possible */
+				prl = rl;
+				if ((--prl)->lcn >= 0) {
+					lcn_seek_from = prl->lcn
+						+ from_hole - prl->vcn;
+				}
+			}
+			if (need <= 0) {
+				ntfs_log_error("Wrong hole size %lld\n",
+							(long long)need);
+				errno = EIO;
+				err = -1;
+			} else {
+				rlc = ntfs_cluster_alloc(vol, from_hole, need,
+					 lcn_seek_from, DATA_ZONE);
+				if (!rlc)
+					err = -1;
+				else
+					err = ntfs_fallocate_merge(na, rlc,
+						need << vol->cluster_size_bits);
+			}
+		}
+	} while (!err && !done);
+	return (err);
+}
+
+static int ntfs_fallocate_full(ntfs_attr *na, ntfs_attr_search_ctx *ctx,
+			s64 alloc_offs, s64 alloc_len, BOOL keep_size)
+{
+	ATTR_RECORD *attr;
+	ntfs_inode *ni;
+	s64 initialized_size;
+	s64 data_size;
+	int err;
+
+	err = 0;
+	initialized_size = na->initialized_size;
+	data_size = na->data_size;
+
+	if (na->allocated_size <= alloc_offs) {
+		/*
+		 * Request is fully beyond what was already allocated :
+		 * only need to expand the attribute
+		 */
+		err = ntfs_attr_truncate(na, alloc_offs);
+		if (!err)
+			err = ntfs_attr_truncate_solid(na,
+						alloc_offs + alloc_len);
+	} else {
+		/*
+		 * Request overlaps what was already allocated :
+		 * We may have to fill existing holes, and force zeroes
+		 * into clusters which are visible.
+		 */
+		if ((alloc_offs + alloc_len) > na->allocated_size)
+			err = ntfs_attr_truncate(na, alloc_offs + alloc_len);
+		if (!err)
+			err = ntfs_fallocate_holes(na, alloc_offs, alloc_len);
+	}
+		/*
+		 * Set the sizes, even after an error, to keep consistency.
+		 * Keeping the initialized size means the new clusters are
+		 * never zeroed : they are read as zeroes until written to.
+		 */
+	na->initialized_size = initialized_size;
+		/* Restore the original apparent size if requested or error */
+	if (err || keep_size
+	    || ((alloc_offs + alloc_len) < data_size))
+		na->data_size = data_size;
+	else {
+		/*
+		 * As with no FALLOC_FL_KEEP_SIZE in fallocate(2) :
+		 * "the file size will be changed if offset + len is greater
+		 * than the  file  size"
+		 */
+		na->data_size = alloc_offs + alloc_len;
+	}
+
+	if (!err) {
+	/* Find the attribute, which may have been relocated for allocations */
+		if (ntfs_attr_lookup(na->type, na->name, na->name_len,
+					CASE_SENSITIVE, 0, NULL, 0, ctx)) {
+			err = -1;
+			ntfs_log_error("Failed to locate the attribute\n");
+		} else {
+				/* Feed the sizes into the attribute */
+			attr = ctx->attr;
+			attr->data_size = cpu_to_sle64(na->data_size);
+			attr->initialized_size
+				= cpu_to_sle64(na->initialized_size);
+			attr->allocated_size
+				= cpu_to_sle64(na->allocated_size);
+			if (na->data_flags & ATTR_IS_SPARSE)
+				attr->compressed_size
+					= cpu_to_sle64(na->compressed_size);
+			ntfs_inode_mark_dirty(ctx->ntfs_ino);
+			/* Copy the unnamed data attribute sizes to inode */
+			if ((na->type == AT_DATA) && (na->name == AT_UNNAMED)) {
+				ni = na->ni;
+				ni->data_size = na->data_size;
+				if (na->data_flags & ATTR_IS_SPARSE) {
+					ni->allocated_size
+						= na->compressed_size;
+					ni->flags |= FILE_ATTR_SPARSE_FILE;
+				} else
+					ni->allocated_size
+						= na->allocated_size;
+			}
+		}
+	}
+	return (err);
+}
+
+/*
+ *		Allocate clusters to an attribute, as fallocate(2) does
+ *
+ *	The holes in the requested range are filled with new clusters,
+ *	and the attribute is extended as needed. The initialized size
+ *	is kept, so that the new clusters do not have to be zeroed
+ *	unless they are inside the initialized part. The apparent size
+ *	is only extended when @keep_size is not set.
+ *
+ *	Returns 0 if succeeded,
+ *		-1 if it failed (as explained in errno)
+ */
+
+int ntfs_attr_fallocate(ntfs_attr *na, s64 offset, s64 length, BOOL keep_size)
+{
+	ntfs_inode *ni;
+	ntfs_attr_search_ctx *ctx;
+	runlist_element *oldrl;
+	s64 allocated_size;
+	s64 data_size;
+	int save_errno;
+	int err;
+
+	if (!na || (offset < 0) || (length <= 0)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (na->data_flags & (ATTR_COMPRESSION_MASK | ATTR_IS_ENCRYPTED)) {
+		errno = EOPNOTSUPP;
+		return (-1);
+	}
+	if (ntfs_attr_flush(na))
+		return (-1);
+	ni = na->ni;
+	if (!NAttrNonResident(na)) {
+		/*
+		 * Resident data is always allocated : only extend the
+		 * attribute (and possibly make it non-resident) when the
+		 * size has to be changed.
+		 */
+		if (keep_size || ((offset + length) <= na->data_size))
+			return (0);
+		if (ntfs_attr_truncate_solid(na, offset + length))
+			return (-1);
+		NInoFileNameSetDirty(ni);
+		NInoSetDirty(ni);
+		return (0);
+	}
+	err = -1;
+	/* Locate the attribute record, needed for updating sizes */
+	ctx = ntfs_attr_get_search_ctx(ni, NULL);
+	if (ctx) {
+		/* Get and save the initial allocations */
+		allocated_size = ni->allocated_size;
+		data_size = ni->data_size;
+		if (!ntfs_attr_map_whole_runlist(na)) {
+			oldrl = ntfs_fallocate_save_rl(na->rl);
+			if (oldrl) {
+				err = ntfs_fallocate_full(na, ctx,
+						offset, length, keep_size);
+				if (err) {
+					save_errno = errno;
+					ni->allocated_size = allocated_size;
+					ni->data_size = data_size;
+					ntfs_fallocate_restore_rl(na, oldrl);
+					errno = save_errno;
+				} else {
+					free(oldrl);
+	/* Mark file name dirty, to update the sizes in directories */
+					NInoFileNameSetDirty(ni);
+					NInoSetDirty(ni);
+				}
+			}
+		}
+		ntfs_attr_put_search_ctx(ctx);
+	}
+	return (err);
+}
+
+/*
+ *		Zero a part of an attribute which is not deallocated
+ *
+ *	Only the initialized and allocated part is written to, the rest
+ *	is read as zeroes anyway.
+ */
+
+static int ntfs_punch_zero(ntfs_attr *na, s64 pos, s64 end)
+{
+	ntfs_volume *vol;
+	runlist_element *rl;
+	char *buf;
+	s64 size;
+	int err;
+
+	err = 0;
+	vol = na->ni->vol;
+	if (end > na->initialized_size)
+		end = na->initialized_size;
+	if (pos < end) {
+		buf = (char*)ntfs_malloc(vol->cluster_size);
+		if (!buf)
+			return (-1);
+		memset(buf, 0, vol->cluster_size);
+		while (!err && (pos < end)) {
+			size = min(end - pos, vol->cluster_size
+				- (pos & (vol->cluster_size - 1)));
+			rl = (NAttrNonResident(na)
+				? ntfs_attr_find_vcn(na,
+					pos >> vol->cluster_size_bits)
+				: (runlist_element*)NULL);
+			/* Do not allocate clusters to write zeroes to holes */
+			if ((!rl || (rl->lcn != LCN_HOLE))
+			    && (ntfs_attr_pwrite(na, pos, size, buf) != size))
+				err = -1;
+			pos += size;
+		}
+		free(buf);
+	}
+	return (err);
+}
+
+/*
+ *		Replace a range of vcns in a runlist by a hole
+ *
+ *	Returns the new runlist, or NULL if there was no memory.
+ */
+
+static runlist_element *ntfs_rl_punch(const runlist_element *rl,
+			VCN start_vcn, VCN end_vcn)
+{
+	runlist_element *nrl;
+	VCN run_end;
+	VCN from;
+	VCN to;
+	int n;
+	int i;
+
+	for (n=0; rl[n].length; n++) { }
+		/* at most two runs are split, adding two runs */
+	nrl = (runlist_element*)ntfs_malloc((n + 3)*sizeof(runlist_element));
+	if (nrl) {
+		i = 0;
+		for ( ; rl->length; rl++) {
+			run_end = rl->vcn + rl->length;
+			if ((run_end <= start_vcn) || (rl->vcn >= end_vcn)) {
+				nrl[i++] = *rl;
+			} else {
+				from = max(rl->vcn, start_vcn);
+				to = min(run_end, end_vcn);
+				if (rl->vcn < start_vcn) {
+					nrl[i] = *rl;
+					nrl[i++].length = start_vcn - rl->vcn;
+				}
+				if (i && (nrl[i - 1].lcn == LCN_HOLE))
+					nrl[i - 1].length += to - from;
+				else {
+					nrl[i].vcn = from;
+					nrl[i].lcn = LCN_HOLE;
+					nrl[i++].length = to - from;
+				}
+				if (run_end > end_vcn) {
+					nrl[i].vcn = end_vcn;
+					nrl[i].lcn = (rl->lcn >= 0
+						? rl->lcn + end_vcn - rl->vcn
+						: rl->lcn);
+					nrl[i++].length = run_end - end_vcn;
+				}
+			}
+				/* merge with a following hole */
+			if ((i > 1) && (nrl[i - 1].lcn == LCN_HOLE)
+			    && (nrl[i - 2].lcn == LCN_HOLE)) {
+				nrl[i - 2].length += nrl[i - 1].length;
+				i--;
+			}
+		}
+		nrl[i] = *rl;
+	}
+	return (nrl);
+}
+
+/*
+ *		Deallocate a range of an attribute, as fallocate(2) does
+ *		with FALLOC_FL_PUNCH_HOLE
+ *
+ *	The clusters fully inside the range are freed and replaced by
+ *	a hole, the partial clusters at both ends are zeroed. The size
+ *	of the attribute is not changed.
+ *
+ *	Returns 0 if succeeded,
+ *		-1 if it failed (as explained in errno)
+ */
+
+int ntfs_attr_punch_hole(ntfs_attr *na, s64 offset, s64 length)
+{
+	ntfs_volume *vol;
+	runlist_element *rl;
+	VCN start_vcn;
+	VCN end_vcn;
+	s64 end;
+	int err;
+
+	if (!na || (offset < 0) || (length <= 0)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (na->data_flags & (ATTR_COMPRESSION_MASK | ATTR_IS_ENCRYPTED)) {
+		errno = EOPNOTSUPP;
+		return (-1);
+	}
+	if (ntfs_attr_flush(na))
+		return (-1);
+	vol = na->ni->vol;
+	end = offset + length;
+	if (offset < na->data_size)
+		attr_usn_record(na, offset, FALSE);
+	if (!NAttrNonResident(na))
+		return (ntfs_punch_zero(na, offset, min(end, na->data_size)));
+	/* Holes can only be created where extending creates them */
+	if ((na->type != AT_DATA) || (vol->major_ver < 3)) {
+		errno = EOPNOTSUPP;
+		return (-1);
+	}
+	if (end > na->allocated_size)
+		end = na->allocated_size;
+	if (offset >= end)
+		return (0);
+	start_vcn = (offset + vol->cluster_size - 1) >> vol->cluster_size_bits;
+		/* a partial cluster beyond the apparent size can be freed */
+	if (end >= na->data_size)
+		end_vcn = (end + vol->cluster_size - 1)
+				>> vol->cluster_size_bits;
+	else
+		end_vcn = end >> vol->cluster_size_bits;
+	if (start_vcn >= end_vcn)
+		return (ntfs_punch_zero(na, offset, end));
+	err = ntfs_punch_zero(na, offset, start_vcn << vol->cluster_size_bits);
+	if (!err)
+		err = ntfs_punch_zero(na, end_vcn << vol->cluster_size_bits,
+					end);
+	if (!err)
+		err = ntfs_attr_map_whole_runlist(na);
+	if (!err && (ntfs_cluster_free(vol, na, start_vcn,
+				end_vcn - start_vcn) < 0)) {
+		ntfs_log_perror("Failed to free the punched clusters");
+		err = -1;
+	}
+	if (!err) {
+		rl = ntfs_rl_punch(na->rl, start_vcn, end_vcn);
+		if (!rl)
+			err = -1;
+		else {
+			free(na->rl);
+			na->rl = rl;
+			ntfs_attr_forget_runs(na);
+			/* The sparse flag and sizes are updated from the runlist */
+			if (ntfs_attr_update_mapping_pairs(na, 0)) {
+				ntfs_log_perror("Failed to update the runlist "
+					"of punched attribute");
+				err = -1;
+			} else {
+				NInoFileNameSetDirty(na->ni);
+				NInoSetDirty(na->ni);
+			}
+		}
+	}
+	return (err);
+}
+
+/*
+ *		Find the next data or hole in an attribute, for lseek(2)
+ *		with SEEK_DATA or SEEK_HOLE
+ *
+ *	Data is located from the runlist. In a compressed attribute,
+ *	a compression block is a hole only if it is fully unallocated,
+ *	and the part beyond the initialized size is reported as a hole
+ *	as it is read as zeroes. The end of the attribute is a hole.
+ *
+ *	Returns the offset of the data or hole found,
+ *		-1 if it failed (as explained in errno, ENXIO if
+ *		there is no more data or the start is beyond the end)
+ */
+
+s64 ntfs_attr_seek_hole_data(ntfs_attr *na, s64 pos, BOOL hole)
+{
+	ntfs_volume *vol;
+	runlist_element *rl;
+	VCN vcn;
+	VCN hole_vcn;
+	s64 limit;
+	s64 found;
+	u32 block_clusters;
+
+	if (!na || (pos < 0)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (pos >= na->data_size) {
+		errno = ENXIO;
+		return (-1);
+	}
+	if (!NAttrNonResident(na)
+	    || (na->data_flags & ATTR_IS_ENCRYPTED))
+		return (hole ? na->data_size : pos);
+	limit = min(na->initialized_size, na->data_size);
+	if (pos >= limit) {
+		if (hole)
+			return (pos);
+		errno = ENXIO;
+		return (-1);
+	}
+	if (ntfs_attr_map_whole_runlist(na))
+		return (-1);
+	vol = na->ni->vol;
+	block_clusters = ((na->data_flags & ATTR_COMPRESSION_MASK)
+				? na->compression_block_clusters : 1);
+	vcn = pos >> vol->cluster_size_bits;
+	found = -1;
+	for (rl=na->rl; (found < 0) && rl->length; rl++) {
+		if ((rl->vcn + rl->length) <= vcn)
+			continue;
+		if (rl->lcn >= 0)
+			hole_vcn = rl->vcn + rl->length;
+		else {
+			/* the compressed tail of a block is not a hole */
+			hole_vcn = ((rl->vcn + block_clusters - 1)
+					/ block_clusters) * block_clusters;
+			if (hole_vcn > (rl->vcn + rl->length))
+				hole_vcn = rl->vcn + rl->length;
+		}
+		if (!hole && (hole_vcn > max(rl->vcn, vcn)))
+			found = max(rl->vcn, vcn) << vol->cluster_size_bits;
+		if (hole && (hole_vcn < (rl->vcn + rl->length)))
+			found = max(hole_vcn, vcn) << vol->cluster_size_bits;
+	}
+	if (hole) {
+		if ((found < 0) || (found > limit))
+			found = limit;
+	} else
+		if ((found < 0) || (found >= limit)) {
+			errno = ENXIO;
+			return (-1);
+		}
+	return (max(found, pos));
+}
+
+/*
+ *		Copy a range of an attribute to another one, or to another
+ *	place in the same one, on the same volume
+ *
+ *	The data is transferred through a large buffer without being
+ *	seen by the caller, and the holes of the source are not copied :
+ *	they are kept as holes in the target when it is sparse capable,
+ *	or written as zeroes otherwise. The reads of fragmented data are
+ *	issued together through the device batches.
+ *
+ *	The ranges must not overlap when copying inside an attribute.
+ *	The target must not be compressed or encrypted, nor the source
+ *	encrypted, as their data is not transferred as is.
+ *
+ *	Returns the count of bytes copied, which is short only if
+ *		the end of the source is met
+ *		-1 if it failed, with errno set (EOPNOTSUPP if
+ *		the attributes cannot be copied this way)
+ */
+
+s64 ntfs_attr_copy_range(ntfs_attr *src, s64 src_pos,
+			ntfs_attr *dst, s64 dst_pos, s64 count)
+{
+	char *buf;
+	s64 bufsize;
+	s64 end;
+	s64 pos;
+	s64 next;
+	s64 size;
+	s64 done;
+	s64 written;
+	BOOL holes;
+	int err;
+
+	if (!src || !dst || (src_pos < 0) || (dst_pos < 0) || (count < 0)
+	    || (src->ni->vol != dst->ni->vol)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if ((src->data_flags & ATTR_IS_ENCRYPTED)
+	    || (dst->data_flags & (ATTR_COMPRESSION_MASK | ATTR_IS_ENCRYPTED))) {
+		errno = EOPNOTSUPP;
+		return (-1);
+	}
+	if (ntfs_attr_flush(src) || ((dst != src) && ntfs_attr_flush(dst)))
+		return (-1);
+	if ((src_pos >= src->data_size) || !count)
+		return (0);
+	if (count > (src->data_size - src_pos))
+		count = src->data_size - src_pos;
+	bufsize = min(count, COPY_BUFFER_SIZE);
+	buf = (char*)ntfs_malloc(bufsize);
+	if (!buf)
+		return (-1);
+	err = 0;
+	end = src_pos + count;
+	pos = src_pos;
+	while (!err && (pos < end)) {
+		next = ntfs_attr_seek_hole_data(src, pos, FALSE);
+		if ((next < 0) && (errno != ENXIO)) {
+			err = -1;
+			break;
+		}
+		if ((next < 0) || (next > end))
+			next = end;
+		if (next > pos) {
+				/* a hole, the target gets zeroes */
+			size = min(next - pos, bufsize);
+			memset(buf, 0, size);
+			holes = ntfs_attr_keeps_holes(dst);
+			if (holes)
+				size = next - pos;
+		} else {
+				/* data, up to the next hole */
+			holes = FALSE;
+			next = ntfs_attr_seek_hole_data(src, pos, TRUE);
+			if (next < 0) {
+				err = -1;
+				break;
+			}
+			size = min(min(next, end) - pos, bufsize);
+			for (done=0; !err && (done<size); done+=written) {
+				written = ntfs_attr_pread(src, pos + done,
+						size - done, &buf[done]);
+				if (written <= 0) {
+					if (!written)
+						errno = EIO;
+					err = -1;
+				}
+			}
+		}
+		if (!err && holes) {
+			if (ntfs_attr_write_zeroes(dst, dst_pos + pos - src_pos,
+					dst_pos + pos - src_pos + size, buf))
+				err = -1;
+		} else {
+			for (done=0; !err && (done<size); done+=written) {
+				written = ntfs_attr_pwrite(dst,
+						dst_pos + pos - src_pos + done,
+						size - done, &buf[done]);
+				if (written <= 0) {
+					if (!written)
+						errno = EIO;
+					err = -1;
+				}
+			}
+		}
+		if (!err)
+			pos += size;
+	}
+	free(buf);
+	return (pos > src_pos ? pos - src_pos : err);
+}
+
+/*
+ *		Build the runlist of a relocated attribute
+ *
+ *	The allocated runs of @rl are given the clusters of @newrl in
+ *	the order of their vcns, and the holes are kept in place.
+ *
+ *	Returns the new runlist, or NULL if there was an error
+ */
+
+static runlist_element *defrag_runlist(const runlist_element *rl,
+			const runlist_element *newrl)
+{
+	runlist_element *xrl;
+	const runlist_element *prl;
+	VCN vcn;
+	s64 taken;
+	s64 n;
+	int count;
+	int size;
+
+	count = 1;
+	for (prl=rl; prl->length; prl++)
+		count++;
+	for (prl=newrl; prl->length; prl++)
+		count++;
+	size = (count*sizeof(runlist_element) + 0xfff) & ~0xfff;
+	xrl = (runlist_element*)ntfs_malloc(size);
+	if (!xrl)
+		return ((runlist_element*)NULL);
+	count = 0;
+	taken = 0;
+	for (; rl->length; rl++) {
+		for (vcn=rl->vcn; vcn<(rl->vcn + rl->length); vcn+=n) {
+			n = rl->vcn + rl->length - vcn;
+			if (rl->lcn >= 0) {
+				if ((newrl->length - taken) < n)
+					n = newrl->length - taken;
+				if (count
+				    && (xrl[count - 1].lcn >= 0)
+				    && ((xrl[count - 1].lcn
+					+ xrl[count - 1].length)
+						== (newrl->lcn + taken)))
+					xrl[count - 1].length += n;
+				else {
+					xrl[count].vcn = vcn;
+					xrl[count].lcn = newrl->lcn + taken;
+					xrl[count].length = n;
+					count++;
+				}
+				taken += n;
+				if (taken >= newrl->length) {
+					newrl++;
+					taken = 0;
+				}
+			} else {
+				xrl[count].vcn = vcn;
+				xrl[count].lcn = rl->lcn;
+				xrl[count].length = n;
+				count++;
+			}
+		}
+	}
+	xrl[count] = *rl;
+	return (xrl);
+}
+
+/*
+ *		Copy the allocated clusters of an attribute to their new place
+ *
+ *	The copy is done directly on the device through a large buffer,
+ *	the data beyond the initialized size is not copied.
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+static int defrag_copy(ntfs_attr *na, const runlist_element *rl,
+			const runlist_element *newrl)
+{
+	ntfs_volume *vol;
+	char *buf;
+	VCN init_vcn;
+	VCN vcn;
+	VCN end;
+	LCN lcn;
+	LCN newlcn;
+	s64 n;
+	s64 bufclusters;
+	int bits;
+	int err;
+
+	vol = na->ni->vol;
+	bits = vol->cluster_size_bits;
+	bufclusters = COPY_BUFFER_SIZE >> bits;
+	if (bufclusters < 1)
+		bufclusters = 1;
+	buf = (char*)ntfs_malloc(bufclusters << bits);
+	if (!buf)
+		return (-1);
+	init_vcn = (na->initialized_size + vol->cluster_size - 1) >> bits;
+	err = 0;
+	for (; !err && rl->length && (rl->vcn < init_vcn); rl++) {
+		if (rl->lcn < 0)
+			continue;
+		end = min(rl->vcn + rl->length, init_vcn);
+		for (vcn=rl->vcn; !err && (vcn<end); vcn+=n) {
+			while ((newrl->vcn + newrl->length) <= vcn)
+				newrl++;
+			lcn = rl->lcn + vcn - rl->vcn;
+			newlcn = newrl->lcn + vcn - newrl->vcn;
+			n = min(end, newrl->vcn + newrl->length) - vcn;
+			if (n > bufclusters)
+				n = bufclusters;
+			if ((ntfs_pread(vol->dev, lcn << bits, n << bits, buf)
+					!= (n << bits))
+			    || (ntfs_pwrite(vol->dev, newlcn << bits,
+					n << bits, buf) != (n << bits))) {
+				if (!errno)
+					errno = EIO;
+				err = -1;
+			}
+		}
+	}
+	free(buf);
+	return (err);
+}
+
+/*
+ *		Allocate the clusters for relocating an attribute
+ *
+ *	The clusters are allocated from the longest free extents, and
+ *	the allocation is abandoned when it would not get fewer than
+ *	@fragments extents.
+ *
+ *	Returns the runlist of the clusters allocated, or NULL with
+ *		errno set (ENOSPC if there are not enough long extents)
+ */
+
+static runlist_element *defrag_alloc(ntfs_volume *vol, s64 clusters,
+			s64 fragments)
+{
+	runlist_element *rl;
+	runlist_element *piece;
+	runlist_element *prl;
+	s64 allocated;
+	s64 length;
+	LCN lcn;
+	int count;
+	int err;
+
+	rl = (runlist_element*)ntfs_malloc((fragments + 1)
+				*sizeof(runlist_element));
+	if (!rl)
+		return ((runlist_element*)NULL);
+	err = 0;
+	count = 0;
+	allocated = 0;
+	while (!err && (allocated < clusters)) {
+		lcn = ntfs_cluster_find_free(vol, clusters - allocated,
+					&length);
+		if (lcn < 0) {
+			err = errno;
+			break;
+		}
+		piece = ntfs_cluster_alloc(vol, allocated, length, lcn,
+					DATA_ZONE);
+		if (!piece) {
+			err = errno;
+			break;
+		}
+		for (prl=piece; prl->length && (count < (fragments - 1));
+				prl++) {
+			rl[count++] = *prl;
+			allocated += prl->length;
+		}
+		if (prl->length) {
+			ntfs_cluster_free_from_rl(vol, prl);
+			err = ENOSPC;
+		}
+		free(piece);
+		rl[count].vcn = allocated;
+		rl[count].lcn = LCN_RL_NOT_MAPPED;
+		rl[count].length = 0;
+	}
+	if (err) {
+		ntfs_cluster_free_from_rl(vol, rl);
+		free(rl);
+		errno = err;
+		rl = (runlist_element*)NULL;
+	}
+	return (rl);
+}
+
+/*
+ *		Defragment a non-resident attribute
+ *
+ *	The allocated clusters of the attribute are moved to a single
+ *	free extent, or to the longest free extents when there is no
+ *	extent big enough, and the former clusters are freed. The holes
+ *	of sparse and compressed attributes are kept.
+ *	The new clusters are allocated and filled before the mapping
+ *	pairs designate them, and the former ones are only freed after,
+ *	so that the record always designates clusters holding the data.
+ *
+ *	The caller has to make sure the attribute is not being used
+ *	through another ntfs_attr, and the attribute is left unchanged
+ *	if the new place would not be better.
+ *
+ *	Returns the count of fragments after defragmenting
+ *		-1 if it failed, with errno set
+ */
+
+s64 ntfs_attr_defragment(ntfs_attr *na)
+{
+	ntfs_volume *vol;
+	runlist_element *newrl;
+	runlist_element *rl;
+	runlist_element *oldrl;
+	s64 fragments;
+	s64 clusters;
+	int err;
+
+	if (!na || !NAttrNonResident(na)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	vol = na->ni->vol;
+	if (ntfs_attr_flush(na) || ntfs_attr_map_whole_runlist(na))
+		return (-1);
+	fragments = ntfs_rl_fragments(na->rl);
+	if (fragments <= 1)
+		return (fragments);
+	clusters = ntfs_rl_get_compressed_size(vol, na->rl)
+				>> vol->cluster_size_bits;
+	if (clusters <= 0)
+		return (clusters < 0 ? -1 : 0);
+	rl = defrag_alloc(vol, clusters, fragments);
+	if (!rl)
+		return (errno == ENOSPC ? fragments : -1);
+	newrl = defrag_runlist(na->rl, rl);
+	if (!newrl)
+		goto err_free;
+	if ((na->type == AT_INDEX_ALLOCATION)
+	    && ntfs_idxcache_flush_inode(vol, na->ni->mft_no))
+		goto err_free;
+	if (defrag_copy(na, na->rl, newrl))
+		goto err_free;
+	oldrl = na->rl;
+	na->rl = newrl;
+	if (ntfs_attr_update_mapping_pairs(na, 0)) {
+		err = errno;
+		free(na->rl);
+		na->rl = oldrl;
+			/* the new clusters may be designated, keep them */
+		if (ntfs_attr_update_mapping_pairs(na, 0))
+			ntfs_log_perror("Failed to restore the runlist of"
+				" inode %lld", (long long)na->ni->mft_no);
+		else
+			ntfs_cluster_free_from_rl(vol, rl);
+		free(rl);
+		errno = err;
+		return (-1);
+	}
+	free(rl);
+	if (ntfs_cluster_free_from_rl(vol, oldrl))
+		ntfs_log_perror("Failed to free the former clusters of"
+				" inode %lld", (long long)na->ni->mft_no);
+	free(oldrl);
+	return (ntfs_rl_fragments(na->rl));
+err_free:
+	err = errno;
+	ntfs_cluster_free_from_rl(vol, rl);
+	free(rl);
+	free(newrl);
+	errno = err;
+	return (-1);
+}
+
 /*
  *		Stuff a hole in a compressed file
  *
@@ -6677,6 +9111,151 @@ err_exit:
 	return ret;
 }
 
+/**
+ * ntfs_attr_peek - get a read-only view of a resident attribute value
+ * @ni:		open ntfs inode in which the ntfs attribute resides
+ * @type:	attribute type
+ * @name:	attribute name in little endian Unicode or AT_UNNAMED or NULL
+ * @name_len:	length of attribute @name in Unicode characters (if @name given)
+ * @size:	where to store the size of the value
+ *
+ * This is ntfs_attr_readall() for the values which are resident, without
+ * an ntfs_attr being opened and without copying : the value is accessed
+ * directly in the MFT record of the inode (or of its extent) held in
+ * memory. The pointer is only valid until the inode is modified or
+ * closed, and the value must not be changed through it.
+ *
+ * On success the location of the value is returned, and its size is
+ * stored in @size.
+ *
+ * On error NULL is returned with errno set to the error code. It is
+ * EOVERFLOW when the value cannot be accessed this way (not resident,
+ * compressed or encrypted), ntfs_attr_readall() has to be used then.
+ */
+const void *ntfs_attr_peek(ntfs_inode *ni, const ATTR_TYPES type,
+			const ntfschar *name, u32 name_len, u32 *size)
+{
+	ntfs_attr_search_ctx *ctx;
+	ATTR_RECORD *a;
+	const void *value;
+
+	value = (const void*)NULL;
+	ctx = ntfs_attr_get_search_ctx(ni, NULL);
+	if (!ctx)
+		return (value);
+	if (!ntfs_attr_lookup(type, name, name_len, CASE_SENSITIVE,
+				0, NULL, 0, ctx)) {
+		a = ctx->attr;
+		if (a->non_resident
+		    || (a->flags & (ATTR_COMPRESSION_MASK
+					| ATTR_IS_ENCRYPTED)))
+			errno = EOVERFLOW;
+		else {
+			value = (const u8*)a + le16_to_cpu(a->value_offset);
+			*size = le32_to_cpu(a->value_length);
+		}
+	}
+	ntfs_attr_put_search_ctx(ctx);
+	return (value);
+}
+
+/*
+ *		Sequential reading of an attribute
+ *
+ *	Reading a whole attribute by small buffers locates the runs
+ *	again on each read, and decompresses again the compression
+ *	block being read from.  A stream reads ATTR_STREAM_SIZE bytes at
+ *	once into its own buffer, starting from aligned compression
+ *	blocks, so that they are decompressed once (and in parallel) and
+ *	holes are filled at memory speed.
+ */
+
+struct _ntfs_attr_stream {
+	ntfs_attr *na;
+	s64 pos;
+	u32 bufsize;
+	char *buf;
+} ;
+
+/*
+ *		Open a stream for reading an attribute from its beginning
+ *
+ *	Returns the stream, or NULL if there was an error (errno set)
+ */
+
+ntfs_attr_stream *ntfs_attr_stream_open(ntfs_attr *na)
+{
+	ntfs_attr_stream *stream;
+	s64 size;
+
+	if (!na) {
+		errno = EINVAL;
+		return ((ntfs_attr_stream*)NULL);
+	}
+	stream = (ntfs_attr_stream*)ntfs_malloc(sizeof(ntfs_attr_stream));
+	if (stream) {
+		stream->na = na;
+		stream->pos = 0;
+			/* do not allocate much more than needed */
+		size = (na->data_size | (NTFS_BLOCK_SIZE - 1)) + 1;
+		if ((na->data_flags & ATTR_COMPRESSION_MASK)
+		    && NAttrNonResident(na)
+		    && (size > na->compression_block_size))
+			size = ((size - 1) | (na->compression_block_size - 1))
+					+ 1;
+		if (size > ATTR_STREAM_SIZE)
+			size = ATTR_STREAM_SIZE;
+		stream->bufsize = size;
+		stream->buf = (char*)ntfs_malloc(size);
+		if (!stream->buf) {
+			free(stream);
+			stream = (ntfs_attr_stream*)NULL;
+		}
+	}
+	return (stream);
+}
+
+/*
+ *		Read the next data from a stream into the stream buffer
+ *
+ *	Returns the count of bytes read, set in @buf, zero at the end
+ *		of the attribute, or -1 if there was an error (errno set)
+ */
+
+s64 ntfs_attr_stream_read(ntfs_attr_stream *stream, const void **buf)
+{
+	s64 count;
+	s64 br;
+
+	count = stream->na->data_size - stream->pos;
+	if (count <= 0)
+		return (0);
+	if (count > stream->bufsize)
+		count = stream->bufsize;
+	br = ntfs_attr_pread(stream->na, stream->pos, count, stream->buf);
+	if (br > 0) {
+		stream->pos += br;
+		*buf = stream->buf;
+	} else
+		if (!br) {
+			errno = EIO;
+			br = -1;
+		}
+	return (br);
+}
+
+/*
+ *		Close a stream, the attribute being left open
+ */
+
+void ntfs_attr_stream_close(ntfs_attr_stream *stream)
+{
+	if (stream) {
+		free(stream->buf);
+		free(stream);
+	}
+}
+
 /*
  *		Read some data from a data attribute
  *
@@ -6850,61 +9429,25 @@ int ntfs_attr_remove(ntfs_inode *ni, const ATTR_TYPES type, ntfschar *name,
 	return ret;
 }
 
-/* Below macros are 32-bit ready. */
-#define BCX(x) ((x) - (((x) >> 1) & 0x77777777) - \
-		      (((x) >> 2) & 0x33333333) - \
-		      (((x) >> 3) & 0x11111111))
-#define BITCOUNT(x) (((BCX(x) + (BCX(x) >> 4)) & 0x0F0F0F0F) % 255)
-
-static u8 *ntfs_init_lut256(void)
-{
-	int i;
-	u8 *lut;
-	
-	lut = ntfs_malloc(256);
-	if (lut)
-		for(i = 0; i < 256; i++)
-			*(lut + i) = 8 - BITCOUNT(i);
-	return lut;
-}
-
 s64 ntfs_attr_get_free_bits(ntfs_attr *na)
 {
-	u8 *buf, *lut;
+	u8 *buf;
 	s64 br      = 0;
 	s64 total   = 0;
 	s64 nr_free = 0;
 
-	lut = ntfs_init_lut256();
-	if (!lut)
-		return -1;
-	
 	buf = ntfs_malloc(65536);
 	if (!buf)
-		goto out;
+		return -1;
 
 	while (1) {
-		u32 *p;
 		br = ntfs_attr_pread(na, total, 65536, buf);
 		if (br <= 0)
 			break;
 		total += br;
-		p = (u32 *)buf + br / 4 - 1;
-		for (; (u8 *)p >= buf; p--) {
-			nr_free += lut[ *p        & 255] + 
-			           lut[(*p >>  8) & 255] + 
-			           lut[(*p >> 16) & 255] + 
-			           lut[(*p >> 24)      ];
-		}
-		switch (br % 4) {
-			case 3:  nr_free += lut[*(buf + br - 3)];
-			case 2:  nr_free += lut[*(buf + br - 2)];
-			case 1:  nr_free += lut[*(buf + br - 1)];
-		}
+		nr_free += (br << 3) - ntfs_bitmap_count_set(buf, 0, br << 3);
 	}
 	free(buf);
-out:
-	free(lut);
 	if (!total || br < 0)
 		return -1;
 	return nr_free;
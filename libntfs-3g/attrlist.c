@@ -43,6 +43,7 @@
 #include "debug.h"
 #include "unistr.h"
 #include "logging.h"
+#include "lock.h"
 #include "misc.h"
 
 /**
@@ -218,6 +219,7 @@ int ntfs_attrlist_entry_add(ntfs_inode *ni, ATTR_RECORD *attr)
 			entry_offset, ni->attr_list_size - entry_offset);
 
 	/* Set new runlist. */
+	ntfs_attrlist_index_free(ni);
 	free(ni->attr_list);
 	ni->attr_list = new_al;
 	ni->attr_list_size = ni->attr_list_size + entry_len;
@@ -298,6 +300,7 @@ int ntfs_attrlist_entry_rm(ntfs_attr_search_ctx *ctx)
 		ale->length), new_al_len - ((u8*)ale - base_ni->attr_list));
 
 	/* Set new runlist. */
+	ntfs_attrlist_index_free(base_ni);
 	free(base_ni->attr_list);
 	base_ni->attr_list = new_al;
 	base_ni->attr_list_size = new_al_len;
@@ -312,3 +315,228 @@ err_out:
 	errno = err;
 	return -1;
 }
+
+/*
+ *		Index over a long attribute list
+ *
+ *	The entries of an attribute list are ordered by type, name and
+ *	lowest vcn, so that the entries of the same attribute (same type
+ *	and name) make a group. The index records the offsets of the
+ *	entries, and the first entry of each group, so that the start
+ *	of an attribute, then its extent holding a vcn, can be found by
+ *	binary searches instead of walking the list.
+ *
+ *	Only offsets are recorded, the values (such as the lowest vcn,
+ *	which may be updated in place) are read from the list itself.
+ *	The index has to be freed whenever entries are inserted or
+ *	removed, it is rebuilt when needed.
+ */
+
+struct ATTRLIST_INDEX {
+	const u8 *attr_list;	/* the list indexed, for checking */
+	u32 attr_list_size;
+	u32 entry_count;
+	u32 group_count;
+	u32 *groups;		/* first entry of each group, then the count */
+	u32 entries[1];		/* offsets of the entries */
+} ;
+
+/*
+ *		Check whether two entries belong to the same attribute
+ */
+
+static BOOL same_attribute(const ATTR_LIST_ENTRY *ale1,
+			const ATTR_LIST_ENTRY *ale2)
+{
+	return ((ale1->type == ale2->type)
+		&& (ale1->name_length == ale2->name_length)
+		&& !memcmp((const u8*)ale1 + ale1->name_offset,
+			(const u8*)ale2 + ale2->name_offset,
+			ale1->name_length*sizeof(ntfschar)));
+}
+
+/*
+ *		Build the index of the attribute list of a base inode
+ *
+ *	Returns the index, or NULL if the list is malformed (the linear
+ *	search then reports the error) or memory is short.
+ */
+
+static struct ATTRLIST_INDEX *build_index(ntfs_inode *ni)
+{
+	struct ATTRLIST_INDEX *index;
+	const ATTR_LIST_ENTRY *ale;
+	const ATTR_LIST_ENTRY *prev;
+	u32 entry_count;
+	u32 group_count;
+	u32 offset;
+	u32 length;
+
+	entry_count = 0;
+	group_count = 0;
+	prev = (const ATTR_LIST_ENTRY*)NULL;
+	for (offset=0; offset<ni->attr_list_size; offset+=length) {
+		ale = (const ATTR_LIST_ENTRY*)&ni->attr_list[offset];
+		if ((offset + offsetof(ATTR_LIST_ENTRY, name))
+				> ni->attr_list_size)
+			return ((struct ATTRLIST_INDEX*)NULL);
+		length = le16_to_cpu(ale->length);
+		if ((length < offsetof(ATTR_LIST_ENTRY, name))
+		    || ((offset + length) > ni->attr_list_size)
+		    || ((ale->name_offset
+			+ ale->name_length*sizeof(ntfschar)) > length))
+			return ((struct ATTRLIST_INDEX*)NULL);
+		if (!prev || !same_attribute(prev, ale))
+			group_count++;
+		entry_count++;
+		prev = ale;
+	}
+	index = (struct ATTRLIST_INDEX*)ntfs_malloc(
+			sizeof(struct ATTRLIST_INDEX)
+			+ (entry_count + group_count)*sizeof(u32));
+	if (index) {
+		index->attr_list = ni->attr_list;
+		index->attr_list_size = ni->attr_list_size;
+		index->entry_count = entry_count;
+		index->group_count = group_count;
+		index->groups = &index->entries[entry_count];
+		entry_count = 0;
+		group_count = 0;
+		prev = (const ATTR_LIST_ENTRY*)NULL;
+		for (offset=0; offset<ni->attr_list_size; offset+=length) {
+			ale = (const ATTR_LIST_ENTRY*)&ni->attr_list[offset];
+			length = le16_to_cpu(ale->length);
+			if (!prev || !same_attribute(prev, ale))
+				index->groups[group_count++] = entry_count;
+			index->entries[entry_count++] = offset;
+			prev = ale;
+		}
+		index->groups[group_count] = entry_count;
+	}
+	return (index);
+}
+
+/**
+ * ntfs_attrlist_index_free - free the index of an attribute list
+ * @ni:		base inode owning the attribute list
+ *
+ * To be called before the in-memory attribute list is replaced or freed.
+ */
+void ntfs_attrlist_index_free(ntfs_inode *ni)
+{
+	free(ni->attr_list_index);
+	ni->attr_list_index = (struct ATTRLIST_INDEX*)NULL;
+}
+
+/**
+ * ntfs_attrlist_lookup - find where to start searching an attribute list
+ * @ni:		base inode owning the attribute list
+ * @type:	attribute type to find
+ * @name:	attribute name to find (NULL means don't care)
+ * @name_len:	attribute name length
+ * @ic:		IGNORE_CASE or CASE_SENSITIVE
+ * @lowest_vcn:	lowest vcn to find
+ *
+ * Locate the entry from which walking the attribute list leads to the
+ * same result as walking it from its start, with the same comparisons
+ * as ntfs_external_attr_find() : the first entry of the attribute
+ * for the type and name, and within it the last entry starting at or
+ * before @lowest_vcn. When there is no such attribute, this is the
+ * entry where the walk stops.
+ *
+ * Short lists are not indexed, as walking them is faster.
+ *
+ * Returns the entry, or NULL if the list has to be walked from its start.
+ */
+ATTR_LIST_ENTRY *ntfs_attrlist_lookup(ntfs_inode *ni, ATTR_TYPES type,
+		const ntfschar *name, u32 name_len, IGNORE_CASE_BOOL ic,
+		VCN lowest_vcn)
+{
+	struct ATTRLIST_INDEX *index;
+	const ATTR_LIST_ENTRY *ale;
+	ntfs_volume *vol;
+	u32 low, high, mid;
+	u32 group;
+	u32 entry;
+	u32 wanted;
+	BOOL matched;
+	int rc;
+
+	if (!ni->attr_list || (ni->attr_list_size < ATTRLIST_INDEX_MIN_SIZE))
+		return ((ATTR_LIST_ENTRY*)NULL);
+	index = ni->attr_list_index;
+	if (!index
+	    || (index->attr_list != ni->attr_list)
+	    || (index->attr_list_size != ni->attr_list_size)) {
+			/* the lists of system files are shared by readers */
+		ntfs_inode_lock(ni);
+		index = ni->attr_list_index;
+		if (!index
+		    || (index->attr_list != ni->attr_list)
+		    || (index->attr_list_size != ni->attr_list_size)) {
+			free(index);
+			index = build_index(ni);
+			ni->attr_list_index = index;
+		}
+		ntfs_inode_unlock(ni);
+		if (!index)
+			return ((ATTR_LIST_ENTRY*)NULL);
+	}
+	vol = ni->vol;
+	wanted = le32_to_cpu(type);
+		/* first group of a type not lower than the wanted one */
+	low = 0;
+	high = index->group_count;
+	while (low < high) {
+		mid = (low + high)/2;
+		ale = (const ATTR_LIST_ENTRY*)&ni->attr_list[
+				index->entries[index->groups[mid]]];
+		if (le32_to_cpu(ale->type) < wanted)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	group = low;
+	if (group >= index->group_count)
+		return ((ATTR_LIST_ENTRY*)&ni->attr_list[ni->attr_list_size]);
+	ale = (const ATTR_LIST_ENTRY*)&ni->attr_list[
+				index->entries[index->groups[group]]];
+	matched = (ale->type == type);
+	if (matched && (name == AT_UNNAMED))
+		matched = !ale->name_length;
+	if (matched && name && (name != AT_UNNAMED)) {
+			/* skip the groups whose name collates before */
+		do {
+			rc = ntfs_names_full_collate(name, name_len,
+				(const ntfschar*)((const u8*)ale
+						+ ale->name_offset),
+				ale->name_length, ic,
+				vol->upcase, vol->upcase_len);
+			if (rc > 0) {
+				if (++group >= index->group_count)
+					return ((ATTR_LIST_ENTRY*)
+					    &ni->attr_list[ni->attr_list_size]);
+				ale = (const ATTR_LIST_ENTRY*)&ni->attr_list[
+					index->entries[index->groups[group]]];
+			}
+		} while ((rc > 0) && (ale->type == type));
+		matched = !rc;
+	}
+	entry = index->groups[group];
+	if (matched && lowest_vcn) {
+			/* last entry of the group starting before lowest_vcn */
+		low = entry;
+		high = index->groups[group + 1];
+		while ((high - low) > 1) {
+			mid = (low + high)/2;
+			ale = (const ATTR_LIST_ENTRY*)&ni->attr_list[
+					index->entries[mid]];
+			if (sle64_to_cpu(ale->lowest_vcn) <= lowest_vcn)
+				low = mid;
+			else
+				high = mid;
+		}
+		entry = low;
+	}
+	return ((ATTR_LIST_ENTRY*)&ni->attr_list[index->entries[entry]]);
+}
@@ -41,6 +41,8 @@
 #include "types.h"
 #include "attrib.h"
 #include "bitmap.h"
+#include "lcnalloc.h"
+#include "idxcache.h"
 #include "debug.h"
 #include "logging.h"
 #include "misc.h"
@@ -100,6 +102,171 @@ char ntfs_bit_get_and_set(u8 *bitmap, const u64 bit, const u8 new_value)
 	return old_bit;
 }
 
+/*
+ *		Word at a time scanning of bitmaps in memory
+ *
+ *	The bitmaps are processed 64 bits at a time, the words being
+ *	assembled in little endian order so that bit n of a word is bit
+ *	n of the bitmap whatever the endianness of the machine. No byte
+ *	is accessed beyond the one holding the last bit of the range, so
+ *	the bitmap need not be padded.
+ */
+
+static u64 bitmap_word(const u8 *bitmap, s64 w, s64 end)
+{
+	s64 limit;
+	s64 i;
+	le64 lew;
+	u64 word;
+
+	limit = (end + 7) >> 3;
+	if (((w + 1) << 3) <= limit) {
+		memcpy(&lew, &bitmap[w << 3], sizeof(lew));
+		word = le64_to_cpu(lew);
+	} else {
+		word = 0;
+		for (i=w << 3; i<limit; i++)
+			word |= (u64)bitmap[i] << ((i & 7) << 3);
+	}
+	return (word);
+}
+
+static int bitmap_lowest_set(u64 word)
+{
+	int bit;
+
+	bit = 0;
+	if (!(word & 0xffffffffULL)) {
+		word >>= 32;
+		bit += 32;
+	}
+	if (!(word & 0xffff)) {
+		word >>= 16;
+		bit += 16;
+	}
+	if (!(word & 0xff)) {
+		word >>= 8;
+		bit += 8;
+	}
+	if (!(word & 0xf)) {
+		word >>= 4;
+		bit += 4;
+	}
+	if (!(word & 0x3)) {
+		word >>= 2;
+		bit += 2;
+	}
+	if (!(word & 0x1))
+		bit += 1;
+	return (bit);
+}
+
+static s64 bitmap_find(const u8 *bitmap, s64 start, s64 end, u64 invert)
+{
+	s64 w;
+	u64 word;
+
+	if (!bitmap || (start < 0) || (start >= end))
+		return (-1);
+	w = start >> 6;
+	word = (bitmap_word(bitmap, w, end) ^ invert)
+			& ~(((u64)1 << (start & 63)) - 1);
+	while (!word) {
+		w++;
+		if ((w << 6) >= end)
+			return (-1);
+		word = bitmap_word(bitmap, w, end) ^ invert;
+	}
+	start = (w << 6) + bitmap_lowest_set(word);
+	return (start < end ? start : -1);
+}
+
+/**
+ * ntfs_bitmap_find_set - find the first set bit in a field of bits
+ * @bitmap:	field of bits
+ * @start:	first bit to examine
+ * @end:	bit after the last one to examine
+ *
+ * Return the first bit set from @start up to @end excluded, or -1 if there
+ * is none. The length of the run of zeroes at @start is the returned value
+ * minus @start, or @end minus @start if -1 is returned.
+ */
+s64 ntfs_bitmap_find_set(const u8 *bitmap, s64 start, s64 end)
+{
+	return (bitmap_find(bitmap, start, end, 0));
+}
+
+/**
+ * ntfs_bitmap_find_zero - find the first zero bit in a field of bits
+ * @bitmap:	field of bits
+ * @start:	first bit to examine
+ * @end:	bit after the last one to examine
+ *
+ * Return the first bit clear from @start up to @end excluded, or -1 if there
+ * is none.
+ */
+s64 ntfs_bitmap_find_zero(const u8 *bitmap, s64 start, s64 end)
+{
+	return (bitmap_find(bitmap, start, end, ~(u64)0));
+}
+
+/**
+ * ntfs_bitmap_count_set - count the set bits in a field of bits
+ * @bitmap:	field of bits
+ * @start:	first bit to count
+ * @end:	bit after the last one to count
+ *
+ * Return the count of bits set from @start up to @end excluded.
+ */
+s64 ntfs_bitmap_count_set(const u8 *bitmap, s64 start, s64 end)
+{
+	s64 count;
+	s64 w;
+	u64 word;
+
+	count = 0;
+	if (!bitmap || (start < 0))
+		return (0);
+	for (w=start >> 6; (w << 6)<end; w++) {
+		word = bitmap_word(bitmap, w, end);
+		if ((w << 6) < start)
+			word &= ~(((u64)1 << (start & 63)) - 1);
+		if (((w + 1) << 6) > end)
+			word &= ((u64)1 << (end & 63)) - 1;
+			/* population count, adding bits in parallel */
+		word -= (word >> 1) & 0x5555555555555555ULL;
+		word = (word & 0x3333333333333333ULL)
+			+ ((word >> 2) & 0x3333333333333333ULL);
+		word = (word + (word >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+		count += (word * 0x0101010101010101ULL) >> 56;
+	}
+	return (count);
+}
+
+/**
+ * ntfs_bitmap_fill - set a run of bits in a field of bits
+ * @bitmap:	field of bits
+ * @start:	first bit to set
+ * @end:	bit after the last one to set
+ */
+void ntfs_bitmap_fill(u8 *bitmap, s64 start, s64 end)
+{
+	if (!bitmap || (start < 0))
+		return;
+	while ((start < end) && (start & 7)) {
+		bitmap[start >> 3] |= 1 << (start & 7);
+		start++;
+	}
+	if ((end - start) >= 8) {
+		memset(&bitmap[start >> 3], 0xff, (end - start) >> 3);
+		start += (end - start) & ~7LL;
+	}
+	while (start < end) {
+		bitmap[start >> 3] |= 1 << (start & 7);
+		start++;
+	}
+}
+
 /**
  * ntfs_bitmap_set_bits_in_run - set a run of bits in a bitmap to a value
  * @na:		attribute containing the bitmap
@@ -272,6 +439,9 @@ int ntfs_bitmap_set_run(ntfs_attr *na, s64 start_bit, s64 count)
 	ntfs_log_enter("Set from bit %lld, count %lld\n",
 		       (long long)start_bit, (long long)count);
 	ret = ntfs_bitmap_set_bits_in_run(na, start_bit, count, 1);
+	if (!ret && (na == na->ni->vol->lcnbmp_na))
+		ntfs_cluster_summary_update(na->ni->vol, start_bit, count,
+				TRUE);
 	ntfs_log_leave("\n");
 	return ret;
 }
@@ -294,6 +464,12 @@ int ntfs_bitmap_clear_run(ntfs_attr *na, s64 start_bit, s64 count)
 	ntfs_log_enter("Clear from bit %lld, count %lld\n",
 		       (long long)start_bit, (long long)count);
 	ret = ntfs_bitmap_set_bits_in_run(na, start_bit, count, 0);
+	if (!ret && (na == na->ni->vol->lcnbmp_na)) {
+		ntfs_cluster_summary_update(na->ni->vol, start_bit, count,
+				FALSE);
+		if (na->ni->vol->index_cache)
+			ntfs_idxcache_forget(na->ni->vol, start_bit, count);
+	}
 	ntfs_log_leave("\n");
 	return ret;
 }
@@ -0,0 +1,865 @@
+/**
+ * bmpcache.c : write-back cache of bitmap pages
+ *
+ *      This module is part of ntfs-3g library
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
+
+#include "param.h"
+#include "types.h"
+#include "layout.h"
+#include "attrib.h"
+#include "device.h"
+#include "volume.h"
+#include "bmpcache.h"
+#include "misc.h"
+#include "logging.h"
+
+/*
+ *		Write-back cache of bitmap pages
+ *
+ *	Allocating or freeing clusters or MFT records implies writing
+ *	the page of $Bitmap or $MFT:$BITMAP which contains their bits,
+ *	and creating and deleting many small files rewrites the same
+ *	pages again and again. The cache keeps the modified pages, and
+ *	they are only written to the device when they are evicted, when
+ *	the volume is committed or synced (by fsync(2)) and when it
+ *	is unmounted. The cached pages are inserted into the bitmaps
+ *	read.
+ *
+ *	A record on the device must never designate clusters or records
+ *	whose bits are not set on the device, and a bit must not be
+ *	cleared on the device while a record still designates them. So
+ *	the state of each page on the device is kept too, and the pages
+ *	are written in two steps :
+ *	- before MFT records are written, the bits which were set are
+ *	  written, keeping the bits cleared meanwhile set,
+ *	- after the MFT records have been written on a commit, the
+ *	  cleared bits are written.
+ *	As a consequence, a page with bits cleared and not written is
+ *	never evicted, and when no page can be evicted, the writes are
+ *	done to the device as usual.
+ *
+ *	The location of the pages on the device is determined when they
+ *	enter the cache, the bitmaps being never moved while mounted.
+ *	Only the pages fully inside the initialized part of the bitmaps,
+ *	and stored in consecutive clusters, are kept.
+ *
+ *	The pages to evict are selected by a clock algorithm, and the
+ *	cache is protected by a single lock.
+ *
+ *	In resident mode, the cache is sized for the full bitmaps, which
+ *	are loaded when attaching, and the reads of the bitmaps are then
+ *	served from memory when all the pages they need are cached. Such
+ *	a cache is allocated by mmap(), preferably in huge pages.
+ */
+
+struct BMPCACHE_ENTRY {
+	struct BMPCACHE_ENTRY *next;	/* next entry in hash chain */
+	s64 pos;			/* -1 if the entry is unused */
+	s64 devpos;			/* position on device */
+	char *data;			/* current state of the page */
+	char *ondisk;			/* state of the page on device */
+	u32 size;			/* may be less than a page */
+	BOOL mft;			/* $MFT:$BITMAP, not $Bitmap */
+	BOOL dirty;			/* data differs from ondisk */
+	BOOL sets;			/* bits set in data, not in ondisk */
+	BOOL referenced;
+} ;
+
+struct BITMAP_CACHE {
+#ifdef ENABLE_THREADS
+	pthread_mutex_t lock;
+#endif
+	struct BMPCACHE_ENTRY *entries;
+	struct BMPCACHE_ENTRY **hash;
+	char *buffers;			/* pages of all the entries */
+	int count;			/* count of entries */
+	int hashmask;
+	int hand;			/* position of the clock hand */
+	int pending_sets;		/* count of entries with sets */
+	size_t mapsize;			/* size mapped, 0 if malloc'ed */
+	BOOL resident;			/* serve the reads */
+	unsigned long writes;
+	unsigned long reads;		/* reads served from memory */
+	unsigned long flushed;		/* pages written to device */
+} ;
+
+static void bmpcache_lock(struct BITMAP_CACHE *cache
+#ifndef ENABLE_THREADS
+			__attribute__((unused))
+#endif
+			)
+{
+#ifdef ENABLE_THREADS
+	pthread_mutex_lock(&cache->lock);
+#endif
+}
+
+static void bmpcache_unlock(struct BITMAP_CACHE *cache
+#ifndef ENABLE_THREADS
+			__attribute__((unused))
+#endif
+			)
+{
+#ifdef ENABLE_THREADS
+	pthread_mutex_unlock(&cache->lock);
+#endif
+}
+
+static struct BMPCACHE_ENTRY **hash_head(struct BITMAP_CACHE *cache,
+		BOOL mft, s64 pos)
+{
+	return (&cache->hash[((pos >> BMPCACHE_PAGE_BITS)*2 + (mft ? 1 : 0))
+				& cache->hashmask]);
+}
+
+static struct BMPCACHE_ENTRY *find_entry(struct BITMAP_CACHE *cache,
+		BOOL mft, s64 pos)
+{
+	struct BMPCACHE_ENTRY *entry;
+
+	entry = *hash_head(cache, mft, pos);
+	while (entry && ((entry->pos != pos) || (entry->mft != mft)))
+		entry = entry->next;
+	return (entry);
+}
+
+static void unhash_entry(struct BITMAP_CACHE *cache,
+		struct BMPCACHE_ENTRY *entry)
+{
+	struct BMPCACHE_ENTRY **pprev;
+
+	pprev = hash_head(cache, entry->mft, entry->pos);
+	while (*pprev && (*pprev != entry))
+		pprev = &(*pprev)->next;
+	if (*pprev)
+		*pprev = entry->next;
+	entry->next = (struct BMPCACHE_ENTRY*)NULL;
+	entry->pos = -1;
+	entry->dirty = FALSE;
+	if (entry->sets) {
+		entry->sets = FALSE;
+		cache->pending_sets--;
+	}
+}
+
+/*
+ *		Check whether an attribute is one of the cached bitmaps
+ */
+
+BOOL ntfs_bmpcache_covers(const ntfs_attr *na)
+{
+	return (((na->ni->mft_no == FILE_Bitmap)
+			&& (na->type == AT_DATA) && !na->name_len)
+		|| ((na->ni->mft_no == FILE_MFT)
+			&& (na->type == AT_BITMAP)));
+}
+
+/*
+ *		Write a page to the device
+ *
+ *	When @clears is not set, the bits cleared since the previous
+ *	write are kept set on the device.
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+static int write_entry(const ntfs_volume *vol, struct BITMAP_CACHE *cache,
+		struct BMPCACHE_ENTRY *entry, BOOL clears)
+{
+	char page[BMPCACHE_PAGE_SIZE];
+	const char *src;
+	s64 bw;
+	u32 i;
+
+	if (clears)
+		src = entry->data;
+	else {
+		for (i=0; i<entry->size; i++)
+			page[i] = entry->data[i] | entry->ondisk[i];
+		src = page;
+	}
+	if (!memcmp(src, entry->ondisk, entry->size))
+		bw = entry->size;
+	else {
+		bw = ntfs_pwrite(vol->dev, entry->devpos, entry->size, src);
+		cache->flushed++;
+	}
+	if (bw != entry->size) {
+		if (bw >= 0)
+			errno = EIO;
+		ntfs_log_perror("Failed to write the cached page %lld"
+			" of %s", (long long)entry->pos,
+			(entry->mft ? "$MFT:$BITMAP" : "$Bitmap"));
+		return (-1);
+	}
+	memcpy(entry->ondisk, src, entry->size);
+	if (entry->sets) {
+		entry->sets = FALSE;
+		cache->pending_sets--;
+	}
+	entry->dirty = clears ? FALSE
+			: (memcmp(entry->data, entry->ondisk, entry->size) != 0);
+	return (0);
+}
+
+/*
+ *		Get a free entry for a page, evicting another one
+ *
+ *	The pages with cleared bits not written yet are not evicted.
+ *
+ *	Returns the entry, or NULL if none could be freed (errno is set)
+ *	The cache must be locked by the caller.
+ */
+
+static struct BMPCACHE_ENTRY *new_entry(const ntfs_volume *vol,
+		struct BITMAP_CACHE *cache, BOOL mft, s64 pos)
+{
+	struct BMPCACHE_ENTRY *entry;
+	struct BMPCACHE_ENTRY **head;
+	int i;
+
+		/* a second round finds the entries no more referenced */
+	entry = (struct BMPCACHE_ENTRY*)NULL;
+	for (i=0; !entry && (i<=2*cache->count); i++) {
+		entry = &cache->entries[cache->hand];
+		if (++cache->hand >= cache->count)
+			cache->hand = 0;
+		if (entry->pos >= 0) {
+			if (entry->referenced) {
+				entry->referenced = FALSE;
+				entry = (struct BMPCACHE_ENTRY*)NULL;
+			} else
+				if (entry->dirty && !entry->sets)
+					entry = (struct BMPCACHE_ENTRY*)NULL;
+		}
+	}
+	if (!entry) {
+		errno = EBUSY;
+		return ((struct BMPCACHE_ENTRY*)NULL);
+	}
+	if (entry->pos >= 0) {
+		if (entry->dirty && write_entry(vol, cache, entry, FALSE))
+			return ((struct BMPCACHE_ENTRY*)NULL);
+		if (entry->dirty) {
+				/* bits were also cleared, keep it */
+			entry->referenced = TRUE;
+			errno = EBUSY;
+			return ((struct BMPCACHE_ENTRY*)NULL);
+		}
+		unhash_entry(cache, entry);
+	}
+	entry->pos = pos;
+	entry->mft = mft;
+	entry->dirty = FALSE;
+	entry->sets = FALSE;
+	entry->referenced = TRUE;
+	head = hash_head(cache, mft, pos);
+	entry->next = *head;
+	*head = entry;
+	return (entry);
+}
+
+/*
+ *		Get the location of a page on the device
+ *
+ *	Returns the location, or -1 if the page is not stored in
+ *	consecutive clusters.
+ */
+
+static s64 page_location(ntfs_attr *na, s64 pos, u32 size)
+{
+	const ntfs_volume *vol;
+	runlist_element *rl;
+	VCN vcn;
+	s64 devpos;
+
+	vol = na->ni->vol;
+	devpos = -1;
+	vcn = pos >> vol->cluster_size_bits;
+	rl = ntfs_attr_find_vcn(na, vcn);
+	if (rl && (rl->lcn >= 0)
+	    && (((pos + size - 1) >> vol->cluster_size_bits)
+			< (rl->vcn + rl->length)))
+		devpos = ((rl->lcn + vcn - rl->vcn) << vol->cluster_size_bits)
+				+ (pos & (vol->cluster_size - 1));
+	return (devpos);
+}
+
+/*
+ *		Get the entry of a page, loading it if not cached
+ *
+ *	The last page of a bitmap is extended when the initialized
+ *	size of the bitmap has grown since it was loaded.
+ *
+ *	Returns the entry, or NULL if the page cannot be cached.
+ *	The cache must be locked by the caller.
+ */
+
+static struct BMPCACHE_ENTRY *load_entry(ntfs_attr *na,
+		struct BITMAP_CACHE *cache, BOOL mft, s64 pos)
+{
+	struct BMPCACHE_ENTRY *entry;
+	const ntfs_volume *vol;
+	s64 devpos;
+	u32 size;
+
+	vol = na->ni->vol;
+	size = BMPCACHE_PAGE_SIZE;
+	if ((pos + size) > na->initialized_size)
+		size = na->initialized_size - pos;
+	entry = find_entry(cache, mft, pos);
+	if (!entry) {
+		devpos = page_location(na, pos, size);
+		if (devpos >= 0)
+			entry = new_entry(vol, cache, mft, pos);
+		if (entry) {
+			entry->devpos = devpos;
+			entry->size = size;
+			if (ntfs_pread(vol->dev, devpos, size, entry->ondisk)
+					!= size) {
+				unhash_entry(cache, entry);
+				entry = (struct BMPCACHE_ENTRY*)NULL;
+			} else
+				memcpy(entry->data, entry->ondisk, size);
+		}
+	} else
+		if (entry->size < size) {
+			if ((page_location(na, pos, size) == entry->devpos)
+			    && (ntfs_pread(vol->dev,
+					entry->devpos + entry->size,
+					size - entry->size,
+					&entry->ondisk[entry->size])
+				== (size - entry->size))) {
+				memcpy(&entry->data[entry->size],
+					&entry->ondisk[entry->size],
+					size - entry->size);
+				entry->size = size;
+			} else
+				entry = (struct BMPCACHE_ENTRY*)NULL;
+		}
+	return (entry);
+}
+
+/*
+ *		Copy a part of a bitmap into a page
+ *
+ *	The cache must be locked by the caller.
+ */
+
+static void update_entry(struct BITMAP_CACHE *cache,
+		struct BMPCACHE_ENTRY *entry, u32 ofs, u32 n, const char *b)
+{
+	u32 i;
+
+	memcpy(&entry->data[ofs], b, n);
+	for (i=ofs; (i<(ofs + n)) && !entry->sets; i++)
+		if (entry->data[i] & ~entry->ondisk[i]) {
+			entry->sets = TRUE;
+			cache->pending_sets++;
+		}
+	entry->dirty = TRUE;
+	entry->referenced = TRUE;
+}
+
+/*
+ *		Insert the cached pages into a part of a bitmap just read
+ */
+
+void ntfs_bmpcache_get(ntfs_attr *na, s64 pos, s64 count, void *b)
+{
+	struct BITMAP_CACHE *cache;
+	struct BMPCACHE_ENTRY *entry;
+	s64 page;
+	s64 start, end;
+	BOOL mft;
+
+	cache = na->ni->vol->bitmap_cache;
+	mft = (na->ni->mft_no == FILE_MFT);
+	bmpcache_lock(cache);
+	for (page=pos & ~(s64)(BMPCACHE_PAGE_SIZE - 1); page<(pos + count);
+			page+=BMPCACHE_PAGE_SIZE) {
+		entry = find_entry(cache, mft, page);
+		if (entry) {
+			start = (page > pos ? page : pos);
+			end = page + entry->size;
+			if (end > (pos + count))
+				end = pos + count;
+			if (end > start)
+				memcpy((char*)b + start - pos,
+					&entry->data[start - page],
+					end - start);
+		}
+	}
+	bmpcache_unlock(cache);
+}
+
+/*
+ *		Read a part of a bitmap from a resident cache
+ *
+ *	Returns TRUE if all the pages were cached and have been copied,
+ *		FALSE if the part has to be read from the device
+ */
+
+BOOL ntfs_bmpcache_read(ntfs_attr *na, s64 pos, s64 count, void *b)
+{
+	struct BITMAP_CACHE *cache;
+	struct BMPCACHE_ENTRY *entry;
+	s64 page;
+	s64 start, end;
+	BOOL mft;
+	BOOL done;
+
+	cache = na->ni->vol->bitmap_cache;
+	if (!cache->resident || !count
+	    || ((pos + count) > na->initialized_size))
+		return (FALSE);
+	mft = (na->ni->mft_no == FILE_MFT);
+	done = TRUE;
+	bmpcache_lock(cache);
+	for (page=pos & ~(s64)(BMPCACHE_PAGE_SIZE - 1);
+			done && (page<(pos + count));
+			page+=BMPCACHE_PAGE_SIZE) {
+		entry = find_entry(cache, mft, page);
+		start = (page > pos ? page : pos);
+		end = page + BMPCACHE_PAGE_SIZE;
+		if (end > (pos + count))
+			end = pos + count;
+		if (entry && ((page + entry->size) >= end)) {
+			memcpy((char*)b + start - pos,
+				&entry->data[start - page], end - start);
+			entry->referenced = TRUE;
+		} else
+			done = FALSE;
+	}
+	if (done)
+		cache->reads++;
+	bmpcache_unlock(cache);
+	return (done);
+}
+
+/*
+ *		Write a part of a bitmap into the cache only
+ *
+ *	When the write cannot be kept in the cache, the cached pages
+ *	are updated, so that they are not rewritten with stale data.
+ *
+ *	Returns 0 if the part has been kept in the cache,
+ *		1 if it has to be written to the device
+ */
+
+int ntfs_bmpcache_defer(ntfs_attr *na, s64 pos, s64 count, const void *b)
+{
+	struct BITMAP_CACHE *cache;
+	struct BMPCACHE_ENTRY *entry;
+	const ntfs_volume *vol;
+	s64 page;
+	s64 start, end;
+	BOOL mft;
+	int res;
+
+	vol = na->ni->vol;
+	cache = vol->bitmap_cache;
+	mft = (na->ni->mft_no == FILE_MFT);
+	res = 0;
+	if (!count || NDevSync(vol->dev) || NDevReadOnly(vol->dev)
+	    || !NAttrNonResident(na)
+	    || (na->data_flags & (ATTR_COMPRESSION_MASK
+				| ATTR_IS_ENCRYPTED | ATTR_IS_SPARSE))
+	    || (count > BMPCACHE_MAX_WRITE)
+	    || ((pos + count) > na->initialized_size))
+		res = 1;
+	bmpcache_lock(cache);
+		/* make sure all the pages can be kept */
+	for (page=pos & ~(s64)(BMPCACHE_PAGE_SIZE - 1); !res && (page<(pos + count));
+			page+=BMPCACHE_PAGE_SIZE)
+		if (!load_entry(na, cache, mft, page))
+			res = 1;
+	if (!res)
+		NDevSetDirty(vol->dev);
+	for (page=pos & ~(s64)(BMPCACHE_PAGE_SIZE - 1); page<(pos + count);
+			page+=BMPCACHE_PAGE_SIZE) {
+		entry = find_entry(cache, mft, page);
+		if (entry) {
+			start = (page > pos ? page : pos);
+			end = page + entry->size;
+			if (end > (pos + count))
+				end = pos + count;
+			if (end > start)
+				update_entry(cache, entry, start - page,
+					end - start,
+					(const char*)b + start - pos);
+		}
+	}
+	if (!res)
+		cache->writes++;
+	bmpcache_unlock(cache);
+	return (res);
+}
+
+/*
+ *		Write the modified pages to the device
+ *
+ *	The pages are written in the order of their locations.
+ *	When @clears is not set, only the bits set are written, which
+ *	is to be done before MFT records are written. When it is set,
+ *	the pages are written fully, and this must only be done after
+ *	the MFT records have been written.
+ *	The cache must be locked by the caller.
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+static int entry_compare(const void *p1, const void *p2)
+{
+	s64 devpos1 = (*(const struct BMPCACHE_ENTRY* const*)p1)->devpos;
+	s64 devpos2 = (*(const struct BMPCACHE_ENTRY* const*)p2)->devpos;
+
+	return (devpos1 < devpos2 ? -1 : (devpos1 > devpos2 ? 1 : 0));
+}
+
+static int flush_entries(const ntfs_volume *vol, struct BITMAP_CACHE *cache,
+		BOOL clears)
+{
+	struct BMPCACHE_ENTRY **dirty;
+	struct BMPCACHE_ENTRY *entry;
+	int count;
+	int err;
+	int i;
+
+	err = 0;
+	count = 0;
+	dirty = (struct BMPCACHE_ENTRY**)ntfs_malloc(
+			cache->count*sizeof(struct BMPCACHE_ENTRY*));
+	for (i=0; i<cache->count; i++) {
+		entry = &cache->entries[i];
+		if ((entry->pos >= 0) && entry->dirty
+		    && (clears || entry->sets)) {
+			if (dirty)
+				dirty[count++] = entry;
+			else
+				if (write_entry(vol, cache, entry, clears))
+					err = errno;
+		}
+	}
+	if (dirty) {
+		qsort(dirty, count, sizeof(struct BMPCACHE_ENTRY*),
+				entry_compare);
+		for (i=0; i<count; i++)
+			if (write_entry(vol, cache, dirty[i], clears))
+				err = errno;
+		free(dirty);
+	}
+	if (err) {
+		errno = err;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ *		Write the modified pages to the device
+ *
+ *	See flush_entries() about @clears. Nothing is done when @clears
+ *	is not set and no bit was set, so that this can be checked
+ *	before writing every MFT record.
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+int ntfs_bmpcache_flush(const ntfs_volume *vol, BOOL clears)
+{
+	struct BITMAP_CACHE *cache;
+	int res;
+
+	cache = vol->bitmap_cache;
+	if (!cache)
+		return (0);
+	res = 0;
+	bmpcache_lock(cache);
+	if (clears || cache->pending_sets)
+		res = flush_entries(vol, cache, clears);
+	bmpcache_unlock(cache);
+	return (res);
+}
+
+/*
+ *		Log the statistics of the cache
+ */
+
+void ntfs_bmpcache_log(const ntfs_volume *vol)
+{
+	struct BITMAP_CACHE *cache;
+
+	cache = vol->bitmap_cache;
+	if (cache && (cache->writes || cache->reads)) {
+		ntfs_log_info("Bitmap cache : %d entries, %lu writes,"
+			" %lu reads, %lu pages written to device\n",
+			cache->count, cache->writes, cache->reads,
+			cache->flushed);
+	}
+}
+
+/*
+ *		Allocate the pages of the cache
+ *
+ *	A resident cache is mapped, in huge pages if some are reserved,
+ *	otherwise asking for transparent huge pages, so that scanning
+ *	the bitmaps does not thrash the TLB.
+ */
+
+static char *alloc_buffers(struct BITMAP_CACHE *cache, size_t size)
+{
+	char *buffers;
+#ifdef HAVE_SYS_MMAN_H
+	size_t mapsize;
+
+	if (cache->resident && (size >= BMPCACHE_HUGE_PAGE)) {
+		buffers = (char*)MAP_FAILED;
+		mapsize = (size + BMPCACHE_HUGE_PAGE - 1)
+				& ~(size_t)(BMPCACHE_HUGE_PAGE - 1);
+#ifdef MAP_HUGETLB
+		buffers = (char*)mmap((void*)NULL, mapsize,
+				PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+				-1, 0);
+#endif
+		if (buffers == (char*)MAP_FAILED) {
+			buffers = (char*)mmap((void*)NULL, mapsize,
+				PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+			if (buffers != (char*)MAP_FAILED)
+				madvise(buffers, mapsize, MADV_HUGEPAGE);
+#endif
+		}
+		if (buffers != (char*)MAP_FAILED) {
+			cache->mapsize = mapsize;
+			return (buffers);
+		}
+	}
+#endif
+	buffers = (char*)ntfs_malloc(size);
+	return (buffers);
+}
+
+static void free_cache(struct BITMAP_CACHE *cache)
+{
+	free(cache->entries);
+	free(cache->hash);
+#ifdef HAVE_SYS_MMAN_H
+	if (cache->mapsize) {
+		if (cache->buffers)
+			munmap(cache->buffers, cache->mapsize);
+	} else
+#endif
+		free(cache->buffers);
+	free(cache);
+}
+
+/*
+ *		Load a full bitmap into a resident cache
+ *
+ *	The bitmap is read by big chunks, and its pages are inserted,
+ *	except those which are not stored in consecutive clusters.
+ *	This is done when attaching, so no lock is needed.
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+static int load_bitmap(ntfs_attr *na, struct BITMAP_CACHE *cache)
+{
+	struct BMPCACHE_ENTRY *entry;
+	char *buf;
+	s64 pos, page;
+	s64 br;
+	s64 devpos;
+	u32 size;
+	BOOL mft;
+	int res;
+
+	res = 0;
+	mft = (na->ni->mft_no == FILE_MFT);
+	buf = (char*)ntfs_malloc(BMPCACHE_LOAD_SIZE);
+	if (!buf)
+		return (-1);
+	for (pos=0; !res && (pos<na->initialized_size);
+			pos+=BMPCACHE_LOAD_SIZE) {
+		br = ntfs_attr_pread(na, pos, BMPCACHE_LOAD_SIZE, buf);
+		if ((br <= 0)
+		    || ((br < BMPCACHE_LOAD_SIZE)
+			&& ((pos + br) < na->initialized_size))) {
+			if (br >= 0)
+				errno = EIO;
+			res = -1;
+		}
+		for (page=0; !res && (page<br); page+=BMPCACHE_PAGE_SIZE) {
+			size = BMPCACHE_PAGE_SIZE;
+			if ((pos + page + size) > na->initialized_size)
+				size = na->initialized_size - pos - page;
+			devpos = page_location(na, pos + page, size);
+			if (devpos >= 0) {
+				entry = new_entry(na->ni->vol, cache, mft,
+						pos + page);
+				if (entry) {
+					entry->devpos = devpos;
+					entry->size = size;
+					memcpy(entry->data, &buf[page], size);
+					memcpy(entry->ondisk, &buf[page],
+							size);
+					entry->referenced = FALSE;
+				} else
+					res = -1;
+			}
+		}
+	}
+	free(buf);
+	return (res);
+}
+
+/*
+ *		Count the pages needed for holding a bitmap
+ */
+
+static int bitmap_pages(const ntfs_attr *na)
+{
+	return ((na->allocated_size + BMPCACHE_PAGE_SIZE - 1)
+			>> BMPCACHE_PAGE_BITS);
+}
+
+/*
+ *		Create a cache of bitmap pages for a mounted volume
+ *
+ *	When @resident is set, the cache is made big enough for holding
+ *	both bitmaps, with some spare pages for the growth of the MFT
+ *	bitmap, and the bitmaps are loaded.
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+int ntfs_bmpcache_attach(ntfs_volume *vol, int count, BOOL resident)
+{
+	struct BITMAP_CACHE *cache;
+	int hashsize;
+	int needed;
+	int i;
+
+	if (!vol || !vol->dev || vol->bitmap_cache
+	    || ((count <= 0) && !resident)
+	    || (resident && (!vol->lcnbmp_na || !vol->mftbmp_na))) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (resident) {
+		needed = bitmap_pages(vol->lcnbmp_na)
+				+ bitmap_pages(vol->mftbmp_na)
+				+ BMPCACHE_RESIDENT_SPARE;
+		if (count < needed)
+			count = needed;
+	}
+	hashsize = 1;
+	while (hashsize < count)
+		hashsize <<= 1;
+	cache = (struct BITMAP_CACHE*)ntfs_calloc(sizeof(struct BITMAP_CACHE));
+	if (!cache)
+		return (-1);
+	cache->resident = resident;
+	cache->entries = (struct BMPCACHE_ENTRY*)ntfs_calloc(
+			count*sizeof(struct BMPCACHE_ENTRY));
+	cache->hash = (struct BMPCACHE_ENTRY**)ntfs_calloc(
+			hashsize*sizeof(struct BMPCACHE_ENTRY*));
+	cache->buffers = alloc_buffers(cache,
+			(size_t)count*2*BMPCACHE_PAGE_SIZE);
+	if (!cache->entries || !cache->hash || !cache->buffers) {
+		free_cache(cache);
+		errno = ENOMEM;
+		return (-1);
+	}
+	for (i=0; i<count; i++) {
+		cache->entries[i].pos = -1;
+		cache->entries[i].data = &cache->buffers[
+				(size_t)i*2*BMPCACHE_PAGE_SIZE];
+		cache->entries[i].ondisk = cache->entries[i].data
+				+ BMPCACHE_PAGE_SIZE;
+	}
+#ifdef ENABLE_THREADS
+	pthread_mutex_init(&cache->lock, NULL);
+#endif
+	cache->count = count;
+	cache->hashmask = hashsize - 1;
+	if (resident
+	    && (load_bitmap(vol->lcnbmp_na, cache)
+		|| load_bitmap(vol->mftbmp_na, cache))) {
+		ntfs_log_perror("Failed to load the bitmaps");
+#ifdef ENABLE_THREADS
+		pthread_mutex_destroy(&cache->lock);
+#endif
+		free_cache(cache);
+		return (-1);
+	}
+	vol->bitmap_cache = cache;
+	ntfs_log_debug("Bitmap cache of %d pages%s\n", count,
+			(resident ? ", resident" : ""));
+	return (0);
+}
+
+/*
+ *		Write the modified pages and free the cache
+ *
+ *	This has to be done after the MFT records have been written,
+ *	while the device is still open.
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+int ntfs_bmpcache_detach(ntfs_volume *vol)
+{
+	struct BITMAP_CACHE *cache;
+	int res;
+
+	cache = vol->bitmap_cache;
+	if (!cache)
+		return (0);
+	res = ntfs_bmpcache_flush(vol, TRUE);
+	vol->bitmap_cache = (struct BITMAP_CACHE*)NULL;
+#ifdef ENABLE_THREADS
+	pthread_mutex_destroy(&cache->lock);
+#endif
+	free_cache(cache);
+	return (res);
+}
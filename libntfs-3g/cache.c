@@ -33,6 +33,8 @@
 #include "types.h"
 #include "security.h"
 #include "cache.h"
+#include "system_compression.h"
+#include "reparse.h"
 #include "misc.h"
 #include "logging.h"
 
@@ -52,8 +54,286 @@
  *	shortage of memory, data is simply not cached.
  *	When there is a hashing bug, hashing is dropped, and sequential
  *	searches are used.
+ *
+ *	The hash functions return any non-negative value, which is
+ *	reduced to the size of the hash index of the cache, so that
+ *	the index can be sized along with the cache. A secondary hash
+ *	function may be provided to find the entries to invalidate
+ *	with a compare function which does not match the main hash
+ *	(such as all the entries related to some directory).
+ *
+ *	The LRU list is split in two segments, so that a scan through
+ *	many items used once does not evict the useful ones. A new entry
+ *	is put on probation at the head of the older segment, and it is
+ *	only moved to the head of the list, into the protected segment,
+ *	if it is fetched again. When the protected segment is full, its
+ *	oldest entry is put back on probation. The entries to reuse are
+ *	taken from the oldest ones.
+ *
+ *	The memory used by the caches of a volume is accounted for in
+ *	vol->cache_mem_used : the fixed part allocated when creating a
+ *	cache, the variable part of each entry and the memory an entry
+ *	keeps allocated out of it (the inode of a nidata entry). The
+ *	permissions cache in security.c adds its own allocations.
+ *	When a budget is set in vol->cache_mem (mount option cache_mem)
+ *	and is exceeded, entering a new entry evicts the oldest entries
+ *	of the same cache, as long as that cache uses more than its share
+ *	of the budget, so that a cache with big entries (such as the
+ *	decompressed chunks) cannot starve the others. The eviction is
+ *	limited to the cache being entered into, as the caches are
+ *	protected by different locks. The fixed part of a cache cannot
+ *	be evicted, so a budget lower than the fixed parts only bounds
+ *	the variable parts.
+ *
+ *	Several volumes mounted by the same process may share a budget
+ *	through a cache pool, which accounts for the memory of all their
+ *	caches. The share of a cache is then the budget of the pool
+ *	divided by the count of caches of all the volumes, and it is
+ *	only enforced when the pool is over budget, so that a busy volume
+ *	may use the memory the others do not use. As the caches of an
+ *	idle volume are never entered into, they are only trimmed to
+ *	their shares when the owner of the pool requests it, so that
+ *	their memory can go to the busy volumes.
+ */
+
+#define CACHE_PROTECTED 1	/* entry in protected segment */
+
+	/* trimming is useless when less than 3/4 of the pool is used */
+#define POOL_PRESSURE(pool) ((pool)->budget - ((pool)->budget >> 2))
+
+struct CACHE_POOL {
+	u64 budget;		/* memory budget of all the volumes */
+	u64 mem_used;		/* memory used by all the caches */
+	int cache_count;	/* count of LRU caches sharing the budget */
+	int volume_count;
+} ;
+
+	/* memory kept by a nidata entry : the inode and its mft record */
+#define NIDATA_EXTRA(vol) (sizeof(ntfs_inode) + (vol)->mft_record_size)
+
+/*
+ *		Update the memory used by the caches of a volume
+ *
+ *	The caches of a volume may be updated concurrently, under
+ *	different locks.
+ */
+
+void ntfs_cache_mem_update(ntfs_volume *vol, s64 delta)
+{
+	if (vol && delta) {
+		__atomic_add_fetch(&vol->cache_mem_used, (u64)delta,
+				__ATOMIC_RELAXED);
+		if (vol->cache_pool)
+			__atomic_add_fetch(&vol->cache_pool->mem_used,
+				(u64)delta, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ *		Update the count of caches sharing the budget
+ */
+
+static void cache_count_update(ntfs_volume *vol, int delta)
+{
+	if (vol) {
+		vol->cache_count += delta;
+		if (vol->cache_pool)
+			__atomic_add_fetch(&vol->cache_pool->cache_count,
+				delta, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ *		Check whether some more memory may be used by caches
+ *
+ *	This is for the caches which cannot evict their entries.
+ */
+
+BOOL ntfs_cache_mem_allowed(ntfs_volume *vol, size_t size)
+{
+	struct CACHE_POOL *pool;
+
+	if (!vol)
+		return (TRUE);
+	pool = vol->cache_pool;
+	return ((!vol->cache_mem
+		|| ((__atomic_load_n(&vol->cache_mem_used, __ATOMIC_RELAXED)
+				+ size) <= vol->cache_mem))
+	    && (!pool
+		|| ((__atomic_load_n(&pool->mem_used, __ATOMIC_RELAXED)
+				+ size) <= pool->budget)));
+}
+
+/*
+ *		Account for memory used by a cache
+ */
+
+static void account(struct CACHE_HEADER *cache, s64 delta)
+{
+	cache->mem_used += delta;
+	ntfs_cache_mem_update(cache->vol, delta);
+}
+
+/*
+ *		Get the count of entries which can be protected
+ *
+ *	At least a quarter of the cache is kept for probation
+ */
+
+static int maxprotected(const struct CACHE_HEADER *cache)
+{
+	return (cache->item_count - (cache->item_count + 3)/4);
+}
+
+/*
+ *		Unlink an entry from the LRU list
+ */
+
+static void unlinkentry(struct CACHE_HEADER *cache,
+			struct CACHED_GENERIC *current)
+{
+	if (current == cache->probation_entry)
+		cache->probation_entry = current->next;
+	if (current->state & CACHE_PROTECTED)
+		cache->protected_count--;
+	if (current->previous)
+		current->previous->next = current->next;
+	else
+		cache->most_recent_entry = current->next;
+	if (current->next)
+		current->next->previous = current->previous;
+	else
+		cache->oldest_entry = current->previous;
+}
+
+/*
+ *		Link an entry at the head of the LRU list, as protected
+ *
+ *	If there are too many protected entries, the oldest one is
+ *	put on probation.
+ */
+
+static void linkprotected(struct CACHE_HEADER *cache,
+			struct CACHED_GENERIC *current)
+{
+	struct CACHED_GENERIC *last;
+
+	current->state |= CACHE_PROTECTED;
+	current->previous = (struct CACHED_GENERIC*)NULL;
+	current->next = cache->most_recent_entry;
+	if (cache->most_recent_entry)
+		cache->most_recent_entry->previous = current;
+	else
+		cache->oldest_entry = current;
+	cache->most_recent_entry = current;
+	if (++cache->protected_count > maxprotected(cache)) {
+		if (cache->probation_entry)
+			last = cache->probation_entry->previous;
+		else
+			last = cache->oldest_entry;
+		last->state &= ~CACHE_PROTECTED;
+		cache->probation_entry = last;
+		cache->protected_count--;
+	}
+}
+
+/*
+ *		Link a new entry at the head of the probation segment
  */
 
+static void linkprobation(struct CACHE_HEADER *cache,
+			struct CACHED_GENERIC *current)
+{
+	struct CACHED_GENERIC *next;
+
+	current->state &= ~CACHE_PROTECTED;
+	next = cache->probation_entry;
+	current->next = next;
+	if (next) {
+		current->previous = next->previous;
+		next->previous = current;
+	} else {
+		current->previous = cache->oldest_entry;
+		cache->oldest_entry = current;
+	}
+	if (current->previous)
+		current->previous->next = current;
+	else
+		cache->most_recent_entry = current;
+	cache->probation_entry = current;
+}
+
+/*
+ *		Get the hash index of a record
+ *
+ *	Returns -1 if the record cannot be hashed
+ */
+
+static int gethashindex(const struct CACHE_HEADER *cache,
+			cache_hash dohash, const struct CACHED_GENERIC *item)
+{
+	int h;
+
+	h = dohash(item);
+	if (h >= 0)
+		h %= cache->max_hash;
+	return (h);
+}
+
+/*
+ *		Insert a record into a hash list
+ *
+ *	Returns FALSE if there is no free link
+ */
+
+static BOOL hashinsert(struct HASH_ENTRY **pfree,
+			struct HASH_ENTRY **first_hash, int h,
+			struct CACHED_GENERIC *current)
+{
+	struct HASH_ENTRY *link;
+
+	/* get a free link and insert at top of hash list */
+	link = *pfree;
+	if (link) {
+		*pfree = link->next;
+		link->next = first_hash[h];
+		link->entry = current;
+		first_hash[h] = link;
+	}
+	return (link != (struct HASH_ENTRY*)NULL);
+}
+
+/*
+ *		Drop a record from a hash list
+ *
+ *	Returns FALSE if the record was not found
+ */
+
+static BOOL hashdrop(struct HASH_ENTRY **pfree,
+			struct HASH_ENTRY **first_hash, int h,
+			const struct CACHED_GENERIC *current)
+{
+	struct HASH_ENTRY *link;
+	struct HASH_ENTRY *previous;
+
+	/* find the link and unlink */
+	link = first_hash[h];
+	previous = (struct HASH_ENTRY*)NULL;
+	while (link && (link->entry != current)) {
+		previous = link;
+		link = link->next;
+	}
+	if (link) {
+		if (previous)
+			previous->next = link->next;
+		else
+			first_hash[h] = link->next;
+		link->next = *pfree;
+		*pfree = link;
+	}
+	return (link != (struct HASH_ENTRY*)NULL);
+}
+
 /*
  *		Enter a new hash index, after a new record has been inserted
  *
@@ -64,79 +344,151 @@ static void inserthashindex(struct CACHE_HEADER *cache,
 			struct CACHED_GENERIC *current)
 {
 	int h;
-	struct HASH_ENTRY *link;
-	struct HASH_ENTRY *first;
 
 	if (cache->dohash) {
-		h = cache->dohash(current);
-		if ((h >= 0) && (h < cache->max_hash)) {
-			/* get a free link and insert at top of hash list */
-			link = cache->free_hash;
-			if (link) {
-				cache->free_hash = link->next;
-				first = cache->first_hash[h];
-				if (first)
-					link->next = first;
-				else
-					link->next = NULL;
-				link->entry = current;
-				cache->first_hash[h] = link;
-			} else {
+		h = gethashindex(cache, cache->dohash, current);
+		if (h < 0) {
+			ntfs_log_error("Illegal hash value,"
+						" cache %s hashing dropped\n",
+						cache->name);
+			cache->dohash = (cache_hash)NULL;
+		} else
+			if (!hashinsert(&cache->free_hash,
+					cache->first_hash, h, current)) {
 				ntfs_log_error("No more hash entries,"
 						" cache %s hashing dropped\n",
 						cache->name);
 				cache->dohash = (cache_hash)NULL;
 			}
-		} else {
-			ntfs_log_error("Illegal hash value,"
+	}
+	if (cache->dohash2) {
+		h = gethashindex(cache, cache->dohash2, current);
+		if ((h < 0)
+		    || !hashinsert(&cache->free_hash2,
+				cache->first_hash2, h, current)) {
+			ntfs_log_error("Bad secondary hash,"
 						" cache %s hashing dropped\n",
 						cache->name);
-			cache->dohash = (cache_hash)NULL;
+			cache->dohash2 = (cache_hash)NULL;
 		}
 	}
 }
 
 /*
- *		Drop a hash index when a record is about to be deleted
+ *		Drop the hash indexes when a record is about to be deleted
  */
 
 static void drophashindex(struct CACHE_HEADER *cache,
-			const struct CACHED_GENERIC *current, int hash)
+			const struct CACHED_GENERIC *current)
 {
-	struct HASH_ENTRY *link;
-	struct HASH_ENTRY *previous;
+	int h;
 
 	if (cache->dohash) {
-		if ((hash >= 0) && (hash < cache->max_hash)) {
-			/* find the link and unlink */
-			link = cache->first_hash[hash];
-			previous = (struct HASH_ENTRY*)NULL;
-			while (link && (link->entry != current)) {
-				previous = link;
-				link = link->next;
-			}
-			if (link) {
-				if (previous)
-					previous->next = link->next;
-				else
-					cache->first_hash[hash] = link->next;
-				link->next = cache->free_hash;
-				cache->free_hash = link;
-			} else {
+		h = gethashindex(cache, cache->dohash, current);
+		if (h < 0) {
+			ntfs_log_error("Illegal hash value,"
+					" cache %s hashing dropped\n",
+					cache->name);
+			cache->dohash = (cache_hash)NULL;
+		} else
+			if (!hashdrop(&cache->free_hash,
+					cache->first_hash, h, current)) {
 				ntfs_log_error("Bad hash list,"
 						" cache %s hashing dropped\n",
 						cache->name);
 				cache->dohash = (cache_hash)NULL;
 			}
-		} else {
-			ntfs_log_error("Illegal hash value,"
-					" cache %s hashing dropped\n",
-					cache->name);
-			cache->dohash = (cache_hash)NULL;
+	}
+	if (cache->dohash2) {
+		h = gethashindex(cache, cache->dohash2, current);
+		if ((h < 0)
+		    || !hashdrop(&cache->free_hash2,
+				cache->first_hash2, h, current)) {
+			ntfs_log_error("Bad secondary hash,"
+						" cache %s hashing dropped\n",
+						cache->name);
+			cache->dohash2 = (cache_hash)NULL;
 		}
 	}
 }
 
+/*
+ *		Invalidate a cache entry
+ *	The entry is moved to the free entry list
+ *	A specific function may be called for entry deletion
+ */
+
+static void do_invalidate(struct CACHE_HEADER *cache,
+		struct CACHED_GENERIC *current, int flags)
+{
+	if ((flags & CACHE_FREE) && cache->dofree)
+		cache->dofree(current);
+	/*
+	 * Relink into free list
+	 */
+	unlinkentry(cache, current);
+	current->next = cache->free_entry;
+	cache->free_entry = current;
+	if (current->variable)
+		free(current->variable);
+	account(cache, -(s64)(current->varsize + cache->entry_extra));
+	current->varsize = 0;
+   }
+
+
+/*
+ *		Evict old entries when the memory budget is exceeded
+ *
+ *	Only the entries of this cache are evicted, and only while it
+ *	uses more than its share of the budget. The new entry is kept.
+ */
+
+static BOOL over_budget(const struct CACHE_HEADER *cache)
+{
+	const struct CACHE_POOL *pool;
+	ntfs_volume *vol;
+	u64 variable;
+	int count;
+
+	vol = cache->vol;
+	variable = cache->mem_used - cache->fixed_mem;
+	if (vol->cache_mem && vol->cache_count
+	    && (variable > vol->cache_mem/vol->cache_count)
+	    && (__atomic_load_n(&vol->cache_mem_used, __ATOMIC_RELAXED)
+			> vol->cache_mem))
+		return (TRUE);
+	pool = vol->cache_pool;
+	if (pool) {
+		count = __atomic_load_n(&pool->cache_count, __ATOMIC_RELAXED);
+		if (count && (variable > pool->budget/count)
+		    && (__atomic_load_n(&pool->mem_used, __ATOMIC_RELAXED)
+				> pool->budget))
+			return (TRUE);
+	}
+	return (FALSE);
+}
+
+static void evict_oldest(struct CACHE_HEADER *cache)
+{
+	struct CACHED_GENERIC *oldest;
+
+	oldest = cache->oldest_entry;
+	if (cache->dohash || cache->dohash2)
+		drophashindex(cache, oldest);
+	do_invalidate(cache, oldest, CACHE_FREE);
+	cache->evictions++;
+}
+
+static void enforce_budget(struct CACHE_HEADER *cache,
+			const struct CACHED_GENERIC *current)
+{
+	if (cache->vol && (cache->vol->cache_mem || cache->vol->cache_pool)) {
+		while (cache->oldest_entry && (cache->oldest_entry != current)
+		    && over_budget(cache))
+			evict_oldest(cache);
+	}
+}
+
 /*
  *		Fetch an entry from cache
  *
@@ -148,7 +500,6 @@ struct CACHED_GENERIC *ntfs_fetch_cache(struct CACHE_HEADER *cache,
 		const struct CACHED_GENERIC *wanted, cache_compare compare)
 {
 	struct CACHED_GENERIC *current;
-	struct CACHED_GENERIC *previous;
 	struct HASH_ENTRY *link;
 	int h;
 
@@ -159,8 +510,9 @@ struct CACHED_GENERIC *ntfs_fetch_cache(struct CACHE_HEADER *cache,
 			 * When possible, use the hash table to
 			 * locate the entry if present
 			 */
-			h = cache->dohash(wanted);
-		        link = cache->first_hash[h];
+			h = gethashindex(cache, cache->dohash, wanted);
+			link = (h >= 0 ? cache->first_hash[h]
+					: (struct HASH_ENTRY*)NULL);
 			while (link && compare(link->entry, wanted))
 				link = link->next;
 			if (link)
@@ -177,26 +529,19 @@ struct CACHED_GENERIC *ntfs_fetch_cache(struct CACHE_HEADER *cache,
 				current = current->next;
 				}
 		}
+		if (!current)
+			cache->misses++;
 		if (current) {
-			previous = current->previous;
 			cache->hits++;
-			if (previous) {
 			/*
-			 * found and not at head of list, unlink from current
-			 * position and relink as head of list
+			 * found and not at head of list, or found
+			 * on probation, unlink from current position
+			 * and relink as head of list
 			 */
-				previous->next = current->next;
-				if (current->next)
-					current->next->previous
-						= current->previous;
-				else
-					cache->oldest_entry
-						= current->previous;
-				current->next = cache->most_recent_entry;
-				current->previous
-						= (struct CACHED_GENERIC*)NULL;
-				cache->most_recent_entry->previous = current;
-				cache->most_recent_entry = current;
+			if (current->previous
+			    || !(current->state & CACHE_PROTECTED)) {
+				unlinkentry(cache, current);
+				linkprotected(cache, current);
 			}
 		}
 		cache->reads++;
@@ -214,7 +559,6 @@ struct CACHED_GENERIC *ntfs_enter_cache(struct CACHE_HEADER *cache,
 			cache_compare compare)
 {
 	struct CACHED_GENERIC *current;
-	struct CACHED_GENERIC *before;
 	struct HASH_ENTRY *link;
 	int h;
 
@@ -225,8 +569,9 @@ struct CACHED_GENERIC *ntfs_enter_cache(struct CACHE_HEADER *cache,
 			 * When possible, use the hash table to
 			 * find out whether the entry if present
 			 */
-			h = cache->dohash(item);
-		        link = cache->first_hash[h];
+			h = gethashindex(cache, cache->dohash, item);
+			link = (h >= 0 ? cache->first_hash[h]
+					: (struct HASH_ENTRY*)NULL);
 			while (link && compare(link->entry, item))
 				link = link->next;
 			if (link) {
@@ -250,10 +595,8 @@ struct CACHED_GENERIC *ntfs_enter_cache(struct CACHE_HEADER *cache,
 		if (!current) {
 			/*
 			 * Not in list, get a free entry or reuse the
-			 * last entry, and relink as head of list
-			 * Note : we assume at least three entries, so
-			 * before, previous and first are different when
-			 * an entry is reused.
+			 * last entry, and relink as head of the
+			 * probation segment
 			 */
 
 			if (cache->free_entry) {
@@ -265,19 +608,16 @@ struct CACHED_GENERIC *ntfs_enter_cache(struct CACHE_HEADER *cache,
 				} else
 					current->variable = (void*)NULL;
 				current->varsize = item->varsize;
-				if (!cache->oldest_entry)
-					cache->oldest_entry = current;
 			} else {
 				/* reusing the oldest entry */
 				current = cache->oldest_entry;
-				before = current->previous;
-				before->next = (struct CACHED_GENERIC*)NULL;
-				if (cache->dohash)
-					drophashindex(cache,current,
-						cache->dohash(current));
+				if (cache->dohash || cache->dohash2)
+					drophashindex(cache,current);
 				if (cache->dofree)
 					cache->dofree(current);
-				cache->oldest_entry = current->previous;
+				unlinkentry(cache, current);
+				account(cache, -(s64)(current->varsize
+						+ cache->entry_extra));
 				if (item->varsize) {
 					if (current->varsize)
 						current->variable = realloc(
@@ -293,11 +633,7 @@ struct CACHED_GENERIC *ntfs_enter_cache(struct CACHE_HEADER *cache,
 				}
 				current->varsize = item->varsize;
 			}
-			current->next = cache->most_recent_entry;
-			current->previous = (struct CACHED_GENERIC*)NULL;
-			if (cache->most_recent_entry)
-				cache->most_recent_entry->previous = current;
-			cache->most_recent_entry = current;
+			linkprobation(cache, current);
 			memcpy(current->payload, item->payload, cache->fixed_size);
 			if (item->varsize) {
 				if (current->variable) {
@@ -309,7 +645,7 @@ struct CACHED_GENERIC *ntfs_enter_cache(struct CACHE_HEADER *cache,
 					 * recycle entry in free list
 					 * not an error, just uncacheable
 					 */
-					cache->most_recent_entry = current->next;
+					unlinkentry(cache, current);
 					current->next = cache->free_entry;
 					cache->free_entry = current;
 					current = (struct CACHED_GENERIC*)NULL;
@@ -318,47 +654,19 @@ struct CACHED_GENERIC *ntfs_enter_cache(struct CACHE_HEADER *cache,
 				current->variable = (void*)NULL;
 				current->varsize = 0;
 			}
-			if (cache->dohash && current)
+			if ((cache->dohash || cache->dohash2) && current)
 				inserthashindex(cache,current);
+			if (current) {
+				account(cache, current->varsize
+						+ cache->entry_extra);
+				enforce_budget(cache, current);
+			}
 		}
 		cache->writes++;
 	}
 	return (current);
 }
 
-/*
- *		Invalidate a cache entry
- *	The entry is moved to the free entry list
- *	A specific function may be called for entry deletion
- */
-
-static void do_invalidate(struct CACHE_HEADER *cache,
-		struct CACHED_GENERIC *current, int flags)
-{
-	struct CACHED_GENERIC *previous;
-
-	previous = current->previous;
-	if ((flags & CACHE_FREE) && cache->dofree)
-		cache->dofree(current);
-	/*
-	 * Relink into free list
-	 */
-	if (current->next)
-		current->next->previous = current->previous;
-	else
-		cache->oldest_entry = current->previous;
-	if (previous)
-		previous->next = current->next;
-	else
-		cache->most_recent_entry = current->next;
-	current->next = cache->free_entry;
-	cache->free_entry = current;
-	if (current->variable)
-		free(current->variable);
-	current->varsize = 0;
-   }
-
-
 /*
  *		Invalidate entries in cache
  *
@@ -366,6 +674,10 @@ static void do_invalidate(struct CACHE_HEADER *cache,
  *	associated to directories which have been renamed), a different
  *	compare function may be provided to select entries to invalidate
  *
+ *	With flag CACHE_SECONDARY, the entries to compare are only the
+ *	ones with the same secondary hash as the item, otherwise with
+ *	flag CACHE_NOHASH they are all the entries in the LRU list.
+ *
  *	Returns the number of deleted entries, this can be used by
  *	the caller to signal a cache corruption if the entry was
  *	supposed to be found.
@@ -378,19 +690,30 @@ int ntfs_invalidate_cache(struct CACHE_HEADER *cache,
 	struct CACHED_GENERIC *current;
 	struct CACHED_GENERIC *next;
 	struct HASH_ENTRY *link;
+	struct HASH_ENTRY **first_hash;
+	cache_hash dohash;
 	int count;
 	int h;
 
 	current = (struct CACHED_GENERIC*)NULL;
 	count = 0;
 	if (cache) {
-		if (!(flags & CACHE_NOHASH) && cache->dohash) {
+		if (flags & CACHE_SECONDARY) {
+			dohash = cache->dohash2;
+			first_hash = cache->first_hash2;
+		} else {
+			dohash = (flags & CACHE_NOHASH ?
+					(cache_hash)NULL : cache->dohash);
+			first_hash = cache->first_hash;
+		}
+		if (dohash) {
 			/*
 			 * When possible, use the hash table to
 			 * find out whether the entry if present
 			 */
-			h = cache->dohash(item);
-		        link = cache->first_hash[h];
+			h = gethashindex(cache, dohash, item);
+			link = (h >= 0 ? first_hash[h]
+					: (struct HASH_ENTRY*)NULL);
 			while (link) {
 				if (compare(link->entry, item))
 					link = link->next;
@@ -398,7 +721,7 @@ int ntfs_invalidate_cache(struct CACHE_HEADER *cache,
 					current = link->entry;
 					link = link->next;
 					if (current) {
-						drophashindex(cache,current,h);
+						drophashindex(cache,current);
 						do_invalidate(cache,
 							current,flags);
 						count++;
@@ -406,7 +729,7 @@ int ntfs_invalidate_cache(struct CACHE_HEADER *cache,
 				}
 			}
 		}
-		if ((flags & CACHE_NOHASH) || !cache->dohash) {
+		if (!dohash) {
 				/*
 				 * Search sequentially in LRU list
 				 */
@@ -414,9 +737,8 @@ int ntfs_invalidate_cache(struct CACHE_HEADER *cache,
 			while (current) {
 				if (!compare(current, item)) {
 					next = current->next;
-					if (cache->dohash)
-						drophashindex(cache,current,
-						    cache->dohash(current));
+					if (cache->dohash || cache->dohash2)
+						drophashindex(cache,current);
 					do_invalidate(cache,current,flags);
 					current = next;
 					count++;
@@ -436,8 +758,8 @@ int ntfs_remove_cache(struct CACHE_HEADER *cache,
 
 	count = 0;
 	if (cache) {
-		if (cache->dohash)
-			drophashindex(cache,item,cache->dohash(item));
+		if (cache->dohash || cache->dohash2)
+			drophashindex(cache,item);
 		do_invalidate(cache,item,flags);
 		count++;
 	}
@@ -459,34 +781,66 @@ static void ntfs_free_cache(struct CACHE_HEADER *cache)
 			if (entry->variable)
 				free(entry->variable);
 		}
+		ntfs_cache_mem_update(cache->vol, -(s64)cache->mem_used);
+		cache_count_update(cache->vol, -1);
 		free(cache);
 	}
 }
 
+/*
+ *		Chain the links of a hash index and clear its heads
+ *
+ *	Returns the location following the heads
+ */
+
+static char *inithashindex(struct HASH_ENTRY **pfree,
+			struct HASH_ENTRY ***pfirst, char *area,
+			int item_count, int max_hash)
+{
+	struct HASH_ENTRY *ph;
+	struct HASH_ENTRY **px;
+	int i;
+
+	ph = (struct HASH_ENTRY*)area;
+	*pfree = ph;
+	for (i=0; i<(item_count - 1); i++)
+		ph[i].next = &ph[i + 1];
+		/* special for the last entry */
+	if (item_count)
+		ph[item_count - 1].next =  (struct HASH_ENTRY*)NULL;
+		/* create and initialize the hash indexes */
+	px = (struct HASH_ENTRY**)&ph[item_count];
+	*pfirst = px;
+	for (i=0; i<max_hash; i++)
+		px[i] = (struct HASH_ENTRY*)NULL;
+	return ((char*)&px[max_hash]);
+}
+
 /*
  *		Create a cache
  *
  *	Returns the cache header, or NULL if the cache could not be created
  */
 
-static struct CACHE_HEADER *ntfs_create_cache(const char *name,
-			cache_free dofree, cache_hash dohash,
-			int full_item_size,
-			int item_count, int max_hash)
+static struct CACHE_HEADER *ntfs_create_cache(ntfs_volume *vol,
+			const char *name, cache_free dofree, cache_hash dohash,
+			cache_hash dohash2, int full_item_size,
+			size_t entry_extra, int item_count, int max_hash)
 {
 	struct CACHE_HEADER *cache;
 	struct CACHED_GENERIC *pc;
 	struct CACHED_GENERIC *qc;
-	struct HASH_ENTRY *ph;
-	struct HASH_ENTRY *qh;
-	struct HASH_ENTRY **px;
+	char *area;
 	size_t size;
 	int i;
 
+	if (!dohash)
+		dohash2 = (cache_hash)NULL;
 	size = sizeof(struct CACHE_HEADER) + item_count*full_item_size;
 	if (max_hash)
-		size += item_count*sizeof(struct HASH_ENTRY)
-			 + max_hash*sizeof(struct HASH_ENTRY*);
+		size += (dohash2 ? 2 : 1)
+			* (item_count*sizeof(struct HASH_ENTRY)
+				 + max_hash*sizeof(struct HASH_ENTRY*));
 	cache = (struct CACHE_HEADER*)ntfs_malloc(size);
 	if (cache) {
 				/* header */
@@ -494,18 +848,31 @@ static struct CACHE_HEADER *ntfs_create_cache(const char *name,
 		cache->dofree = dofree;
 		if (dohash && max_hash) {
 			cache->dohash = dohash;
+			cache->dohash2 = dohash2;
 			cache->max_hash = max_hash;
 		} else {
 			cache->dohash = (cache_hash)NULL;
+			cache->dohash2 = (cache_hash)NULL;
 			cache->max_hash = 0;
 		}
 		cache->fixed_size = full_item_size - sizeof(struct CACHED_GENERIC);
 		cache->reads = 0;
 		cache->writes = 0;
 		cache->hits = 0;
+		cache->misses = 0;
+		cache->evictions = 0;
+		cache->vol = vol;
+		cache->entry_extra = entry_extra;
+		cache->fixed_mem = size;
+		cache->mem_used = 0;
+		account(cache, size);
+		cache_count_update(vol, 1);
+		cache->item_count = item_count;
+		cache->protected_count = 0;
 		/* chain the data entries, and mark an invalid entry */
 		cache->most_recent_entry = (struct CACHED_GENERIC*)NULL;
 		cache->oldest_entry = (struct CACHED_GENERIC*)NULL;
+		cache->probation_entry = (struct CACHED_GENERIC*)NULL;
 		cache->free_entry = &cache->entry[0];
 		pc = &cache->entry[0];
 		for (i=0; i<(item_count - 1); i++) {
@@ -521,27 +888,20 @@ static struct CACHE_HEADER *ntfs_create_cache(const char *name,
 		pc->variable = (void*)NULL;
 		pc->varsize = 0;
 
+		cache->free_hash = (struct HASH_ENTRY*)NULL;
+		cache->first_hash = (struct HASH_ENTRY**)NULL;
+		cache->free_hash2 = (struct HASH_ENTRY*)NULL;
+		cache->first_hash2 = (struct HASH_ENTRY**)NULL;
 		if (max_hash) {
 				/* chain the hash entries */
-			ph = (struct HASH_ENTRY*)(((char*)pc) + full_item_size);
-			cache->free_hash = ph;
-			for (i=0; i<(item_count - 1); i++) {
-				qh = &ph[1];
-				ph->next = qh;
-				ph = qh;
-			}
-				/* special for the last entry */
-			if (item_count) {
-				ph->next =  (struct HASH_ENTRY*)NULL;
-			}
-				/* create and initialize the hash indexes */
-			px = (struct HASH_ENTRY**)&ph[1];
-			cache->first_hash = px;
-			for (i=0; i<max_hash; i++)
-				px[i] = (struct HASH_ENTRY*)NULL;
-		} else {
-			cache->free_hash = (struct HASH_ENTRY*)NULL;
-			cache->first_hash = (struct HASH_ENTRY**)NULL;
+			area = ((char*)pc) + full_item_size;
+			area = inithashindex(&cache->free_hash,
+					&cache->first_hash, area,
+					item_count, max_hash);
+			if (cache->dohash2)
+				inithashindex(&cache->free_hash2,
+					&cache->first_hash2, area,
+					item_count, max_hash);
 		}
 	}
 	return (cache);
@@ -558,32 +918,142 @@ void ntfs_create_lru_caches(ntfs_volume *vol)
 {
 #if CACHE_INODE_SIZE
 		 /* inode cache */
-	vol->xinode_cache = ntfs_create_cache("inode",(cache_free)NULL,
-		ntfs_dir_inode_hash, sizeof(struct CACHED_INODE),
+	vol->xinode_cache = ntfs_create_cache(vol, "inode",(cache_free)NULL,
+		ntfs_dir_inode_hash, ntfs_dir_inode_num_hash,
+		sizeof(struct CACHED_INODE), 0,
 		CACHE_INODE_SIZE, 2*CACHE_INODE_SIZE);
 #endif
 #if CACHE_NIDATA_SIZE
 		 /* idata cache */
-	vol->nidata_cache = ntfs_create_cache("nidata",
+	vol->nidata_cache = ntfs_create_cache(vol, "nidata",
 		ntfs_inode_nidata_free, ntfs_inode_nidata_hash,
-		sizeof(struct CACHED_NIDATA),
-		CACHE_NIDATA_SIZE, 2*CACHE_NIDATA_SIZE);
+		(cache_hash)NULL, sizeof(struct CACHED_NIDATA),
+		NIDATA_EXTRA(vol), CACHE_NIDATA_SIZE, 2*CACHE_NIDATA_SIZE);
 #endif
 #if CACHE_LOOKUP_SIZE
 		 /* lookup cache */
-	vol->lookup_cache = ntfs_create_cache("lookup",
+	vol->lookup_cache = ntfs_create_cache(vol, "lookup",
 		(cache_free)NULL, ntfs_dir_lookup_hash,
-		sizeof(struct CACHED_LOOKUP),
+		ntfs_dir_lookup_parent_hash, sizeof(struct CACHED_LOOKUP), 0,
 		CACHE_LOOKUP_SIZE, 2*CACHE_LOOKUP_SIZE);
 #endif
-	vol->securid_cache = ntfs_create_cache("securid",(cache_free)NULL,
-		(cache_hash)NULL,sizeof(struct CACHED_SECURID), CACHE_SECURID_SIZE, 0);
+	vol->securid_cache = ntfs_create_cache(vol, "securid",(cache_free)NULL,
+		(cache_hash)NULL, (cache_hash)NULL,
+		sizeof(struct CACHED_SECURID), 0, CACHE_SECURID_SIZE, 0);
 #if CACHE_LEGACY_SIZE
-	vol->legacy_cache = ntfs_create_cache("legacy",(cache_free)NULL,
-		(cache_hash)NULL, sizeof(struct CACHED_PERMISSIONS_LEGACY), CACHE_LEGACY_SIZE, 0);
+	vol->legacy_cache = ntfs_create_cache(vol, "legacy",(cache_free)NULL,
+		(cache_hash)NULL, (cache_hash)NULL,
+		sizeof(struct CACHED_PERMISSIONS_LEGACY), 0,
+		CACHE_LEGACY_SIZE, 0);
+#endif
+#if CACHE_GROUPS_SIZE
+	vol->groups_cache = ntfs_create_cache(vol, "groups",(cache_free)NULL,
+		(cache_hash)NULL, (cache_hash)NULL,
+		sizeof(struct CACHED_GROUPS), 0, CACHE_GROUPS_SIZE, 0);
+#endif
+#if CACHE_INHERIT_SIZE
+	vol->inherit_cache = ntfs_create_cache(vol, "inherit",(cache_free)NULL,
+		(cache_hash)NULL, (cache_hash)NULL,
+		sizeof(struct CACHED_INHERIT), 0, CACHE_INHERIT_SIZE, 0);
+#endif
+#if CACHE_CHUNK_SIZE
+		 /* decompressed chunks of system-compressed files */
+	vol->chunk_cache = ntfs_create_cache(vol, "chunk",(cache_free)NULL,
+		ntfs_system_chunk_hash, (cache_hash)NULL,
+		sizeof(struct CACHED_CHUNK), 0,
+		CACHE_CHUNK_SIZE, 2*CACHE_CHUNK_SIZE);
+#endif
+#if CACHE_SYMLINK_SIZE
+		 /* targets of symlinks and junctions */
+	vol->symlink_cache = ntfs_create_cache(vol, "symlink",(cache_free)NULL,
+		ntfs_symlink_hash, (cache_hash)NULL,
+		sizeof(struct CACHED_SYMLINK), 0,
+		CACHE_SYMLINK_SIZE, 2*CACHE_SYMLINK_SIZE);
 #endif
 }
 
+/*
+ *		Replace a cache by a new one with another size
+ *
+ *	The entries of the old cache are dropped. A zero size means
+ *	no cache, other sizes are raised to the minimum of three entries.
+ *	If the new cache cannot be created, the old one is kept.
+ *
+ *	Returns 0 if successful, or -1 if there was not enough memory
+ */
+
+static int ntfs_replace_cache(ntfs_volume *vol, struct CACHE_HEADER **pcache,
+			const char *name, cache_free dofree, cache_hash dohash,
+			cache_hash dohash2, int full_item_size,
+			size_t entry_extra, int item_count)
+{
+	struct CACHE_HEADER *cache;
+	int res;
+
+	res = 0;
+	if (item_count < 0)
+		item_count = 0;
+	if (item_count && (item_count < 3))
+		item_count = 3;
+	if (item_count > CACHE_MAX_SIZE)
+		item_count = CACHE_MAX_SIZE;
+	if (!*pcache || ((*pcache)->item_count != item_count)) {
+		cache = (struct CACHE_HEADER*)NULL;
+		if (item_count) {
+			cache = ntfs_create_cache(vol, name, dofree, dohash,
+				dohash2, full_item_size, entry_extra,
+				item_count, 2*item_count);
+			if (!cache)
+				res = -1;
+		}
+		if (!res) {
+			ntfs_free_cache(*pcache);
+			*pcache = cache;
+		}
+	}
+	return (res);
+}
+
+/*
+ *		Change the sizes of the inode, nidata and lookup caches
+ *
+ *	This is meant to be called just after the volume has been
+ *	mounted. The caches disabled at build time cannot be resized.
+ *
+ *	Returns 0 if successful, or -1 if some cache could not be
+ *	created (the previous one is then kept and errno is set)
+ */
+
+int ntfs_resize_lru_caches(ntfs_volume *vol, int inode_size,
+			int nidata_size, int lookup_size)
+{
+	int res;
+
+	res = 0;
+#if CACHE_INODE_SIZE
+	if (ntfs_replace_cache(vol, &vol->xinode_cache, "inode",
+			(cache_free)NULL, ntfs_dir_inode_hash,
+			ntfs_dir_inode_num_hash,
+			sizeof(struct CACHED_INODE), 0, inode_size))
+		res = -1;
+#endif
+#if CACHE_NIDATA_SIZE
+	if (ntfs_replace_cache(vol, &vol->nidata_cache, "nidata",
+			ntfs_inode_nidata_free, ntfs_inode_nidata_hash,
+			(cache_hash)NULL, sizeof(struct CACHED_NIDATA),
+			NIDATA_EXTRA(vol), nidata_size))
+		res = -1;
+#endif
+#if CACHE_LOOKUP_SIZE
+	if (ntfs_replace_cache(vol, &vol->lookup_cache, "lookup",
+			(cache_free)NULL, ntfs_dir_lookup_hash,
+			ntfs_dir_lookup_parent_hash,
+			sizeof(struct CACHED_LOOKUP), 0, lookup_size))
+		res = -1;
+#endif
+	return (res);
+}
+
 /*
  *		Free all LRU caches
  */
@@ -603,4 +1073,177 @@ void ntfs_free_lru_caches(ntfs_volume *vol)
 #if CACHE_LEGACY_SIZE
 	ntfs_free_cache(vol->legacy_cache);
 #endif
+#if CACHE_GROUPS_SIZE
+	ntfs_free_cache(vol->groups_cache);
+#endif
+#if CACHE_INHERIT_SIZE
+	ntfs_free_cache(vol->inherit_cache);
+#endif
+#if CACHE_CHUNK_SIZE
+	ntfs_free_cache(vol->chunk_cache);
+#endif
+#if CACHE_SYMLINK_SIZE
+	ntfs_free_cache(vol->symlink_cache);
+#endif
+}
+
+/*
+ *		Get the LRU caches of a volume
+ *
+ *	Returns the count of caches stored into the array, which must
+ *	have room for CACHE_TYPES entries.
+ */
+
+#define CACHE_TYPES 10
+
+static int volume_caches(ntfs_volume *vol, struct CACHE_HEADER **caches)
+{
+	int n;
+
+	n = 0;
+#if CACHE_INODE_SIZE
+	caches[n++] = vol->xinode_cache;
+#endif
+#if CACHE_NIDATA_SIZE
+	caches[n++] = vol->nidata_cache;
+#endif
+#if CACHE_LOOKUP_SIZE
+	caches[n++] = vol->lookup_cache;
+#endif
+	caches[n++] = vol->securid_cache;
+#if CACHE_LEGACY_SIZE
+	caches[n++] = vol->legacy_cache;
+#endif
+#if CACHE_GROUPS_SIZE
+	caches[n++] = vol->groups_cache;
+#endif
+#if CACHE_INHERIT_SIZE
+	caches[n++] = vol->inherit_cache;
+#endif
+#if CACHE_CHUNK_SIZE
+	caches[n++] = vol->chunk_cache;
+#endif
+#if CACHE_SYMLINK_SIZE
+	caches[n++] = vol->symlink_cache;
+#endif
+	return (n);
+}
+
+/**
+ * ntfs_cache_pool_create - create a budget to be shared by volumes
+ * @budget:	bytes the caches of all the volumes may use
+ *
+ * Return the pool, or NULL if there is not enough memory.
+ */
+struct CACHE_POOL *ntfs_cache_pool_create(u64 budget)
+{
+	struct CACHE_POOL *pool;
+
+	pool = (struct CACHE_POOL*)ntfs_calloc(sizeof(struct CACHE_POOL));
+	if (pool)
+		pool->budget = budget;
+	return (pool);
+}
+
+/**
+ * ntfs_cache_pool_join - make a volume share the budget of a pool
+ * @pool:	the cache pool
+ * @vol:	a mounted volume, not in use yet
+ *
+ * The memory already used by the caches of the volume is accounted
+ * for in the pool.
+ */
+void ntfs_cache_pool_join(struct CACHE_POOL *pool, ntfs_volume *vol)
+{
+	if (pool && vol && !vol->cache_pool) {
+		__atomic_add_fetch(&pool->mem_used, vol->cache_mem_used,
+				__ATOMIC_RELAXED);
+		__atomic_add_fetch(&pool->cache_count, vol->cache_count,
+				__ATOMIC_RELAXED);
+		__atomic_add_fetch(&pool->volume_count, 1, __ATOMIC_RELAXED);
+		vol->cache_pool = pool;
+	}
+}
+
+/**
+ * ntfs_cache_pool_leave - stop sharing the budget of a pool
+ * @vol:	the volume, not in use any more
+ *
+ * This is meant to be called just before unmounting.
+ */
+void ntfs_cache_pool_leave(ntfs_volume *vol)
+{
+	struct CACHE_POOL *pool;
+
+	pool = (vol ? vol->cache_pool : (struct CACHE_POOL*)NULL);
+	if (pool) {
+		__atomic_sub_fetch(&pool->mem_used, vol->cache_mem_used,
+				__ATOMIC_RELAXED);
+		__atomic_sub_fetch(&pool->cache_count, vol->cache_count,
+				__ATOMIC_RELAXED);
+		__atomic_sub_fetch(&pool->volume_count, 1, __ATOMIC_RELAXED);
+		vol->cache_pool = (struct CACHE_POOL*)NULL;
+	}
+}
+
+/**
+ * ntfs_cache_pool_trim - give the memory of an idle volume to the pool
+ * @vol:	the volume, locked in exclusive mode if used by several
+ *		threads
+ *
+ * When the memory used by all the volumes of the pool nears the budget,
+ * the oldest entries of each cache of the volume are evicted until the
+ * cache is within its share of the pool. The fixed parts of the caches
+ * are kept.
+ *
+ * Return the count of bytes released.
+ */
+s64 ntfs_cache_pool_trim(ntfs_volume *vol)
+{
+	struct CACHE_HEADER *caches[CACHE_TYPES];
+	struct CACHE_HEADER *cache;
+	struct CACHE_POOL *pool;
+	u64 used;
+	u64 share;
+	int count;
+	int n;
+	int i;
+
+	used = 0;
+	pool = (vol ? vol->cache_pool : (struct CACHE_POOL*)NULL);
+	count = (pool ? __atomic_load_n(&pool->cache_count,
+					__ATOMIC_RELAXED) : 0);
+	if (count && (__atomic_load_n(&pool->mem_used, __ATOMIC_RELAXED)
+			> POOL_PRESSURE(pool))) {
+		used = vol->cache_mem_used;
+		share = pool->budget/count;
+		n = volume_caches(vol, caches);
+		for (i=0; i<n; i++) {
+			cache = caches[i];
+			while (cache && cache->oldest_entry
+			    && ((cache->mem_used - cache->fixed_mem) > share))
+				evict_oldest(cache);
+		}
+		used -= vol->cache_mem_used;
+	}
+	return (used);
+}
+
+/**
+ * ntfs_cache_pool_used - get the memory used by the volumes of a pool
+ * @pool:	the cache pool
+ */
+u64 ntfs_cache_pool_used(const struct CACHE_POOL *pool)
+{
+	return (pool ? __atomic_load_n(&pool->mem_used, __ATOMIC_RELAXED)
+			: 0);
+}
+
+/**
+ * ntfs_cache_pool_free - free a cache pool
+ * @pool:	the cache pool, no volume may share it any more
+ */
+void ntfs_cache_pool_free(struct CACHE_POOL *pool)
+{
+	free(pool);
 }
@@ -40,6 +40,12 @@
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
 
 #include "attrib.h"
 #include "debug.h"
@@ -51,6 +57,7 @@
 #include "lcnalloc.h"
 #include "logging.h"
 #include "misc.h"
+#include "probe.h"
 
 #undef le16_to_cpup 
 /* the standard le16_to_cpup() crashes for unaligned data on some processors */ 
@@ -76,8 +83,19 @@ typedef enum {
 #define NICE_MATCH_LEN 18
 
 /* Maximum number of potential matches that ntfs_best_match() will consider at
- * each position.  */
-#define MAX_SEARCH_DEPTH 24
+ * each position, and parsing, for each compression level from the fastest
+ * (a single probe, and the first match found is chosen) to the best ratio
+ * (the longest match is chosen, unless the match at next position is
+ * longer).  */
+static const struct {
+	int max_search_depth;
+	BOOL lazy;
+	BOOL skip_matches;
+} compression_levels[COMPRESSION_LEVEL_MAX + 1] = {
+	{ 1, FALSE, TRUE },
+	{ 8, FALSE, FALSE },
+	{ 24, TRUE, FALSE },
+} ;
 
 /* log base 2 of the number of entries in the hash table for match-finding.  */
 #define HASH_SHIFT 14
@@ -91,6 +109,7 @@ struct COMPRESS_CONTEXT {
 	int size;
 	int rel;
 	int mxsz;
+	int max_search_depth;
 	s16 head[1 << HASH_SHIFT];
 	s16 prev[NTFS_SB_SIZE];
 } ;
@@ -142,9 +161,9 @@ static inline unsigned int ntfs_hash(const u8 *p)
  *	    it ends early because a match this long is good enough and it's not
  *	    worth spending more time searching.
  *
- *	(2) If this function considers MAX_SEARCH_DEPTH matches with a single
- *	    position, it ends early and returns the longest match found so far.
- *	    This saves a lot of time on degenerate inputs.
+ *	(2) If this function considers pctx->max_search_depth matches with a
+ *	    single position, it ends early and returns the longest match found
+ *	    so far.  This saves a lot of time on degenerate inputs.
  */
 static void ntfs_best_match(struct COMPRESS_CONTEXT *pctx, const int i,
 			    int best_len)
@@ -154,7 +173,7 @@ static void ntfs_best_match(struct COMPRESS_CONTEXT *pctx, const int i,
 	s16 * const prev = pctx->prev;
 	const int max_len = min(pctx->bufsize - i, pctx->mxsz);
 	const int nice_len = min(NICE_MATCH_LEN, max_len);
-	int depth_remaining = MAX_SEARCH_DEPTH;
+	int depth_remaining = pctx->max_search_depth;
 	const u8 *best_matchptr = strptr;
 	unsigned int hash;
 	s16 cur_match;
@@ -268,13 +287,16 @@ static void ntfs_skip_position(struct COMPRESS_CONTEXT *pctx, const int i)
  *	Note : two bytes may be output before output buffer overflow
  *	is detected, so a 4100-bytes output buffer must be reserved.
  *
+ *	The compression level (from 0 to COMPRESSION_LEVEL_MAX) selects
+ *	the effort spent on searching matches.
+ *
  *	Returns the size of the compressed block, including the
  *			header (minimal size is 2, maximum size is 4098)
  *		0 if an error has been met. 
  */
 
 static unsigned int ntfs_compress_block(const char *inbuf, const int bufsize,
-				char *outbuf)
+				char *outbuf, int level)
 {
 	struct COMPRESS_CONTEXT *pctx;
 	int i; /* current position */
@@ -290,6 +312,8 @@ static unsigned int ntfs_compress_block(const char *inbuf, const int bufsize,
 	char *ptag; /* location reserved for a tag */
 	int tag;    /* current value of tag */
 	int ntag;   /* count of bits still undefined in tag */
+	BOOL lazy;  /* whether to check for a longer match next position */
+	BOOL skip_matches; /* whether to not hash the positions in matches */
 
 	pctx = ntfs_malloc(sizeof(struct COMPRESS_CONTEXT));
 	if (!pctx) {
@@ -303,6 +327,11 @@ static unsigned int ntfs_compress_block(const char *inbuf, const int bufsize,
 
 	pctx->inbuf = (const unsigned char*)inbuf;
 	pctx->bufsize = bufsize;
+	if ((level < 0) || (level > COMPRESSION_LEVEL_MAX))
+		level = COMPRESSION_LEVEL_MAX;
+	pctx->max_search_depth = compression_levels[level].max_search_depth;
+	lazy = compression_levels[level].lazy;
+	skip_matches = compression_levels[level].skip_matches;
 	xout = 2;
 	i = 0;
 	bp = 4;
@@ -318,7 +347,8 @@ static unsigned int ntfs_compress_block(const char *inbuf, const int bufsize,
 		/* This implementation uses "lazy" parsing: it always chooses
 		 * the longest match, unless the match at the next position is
 		 * longer.  This is the same strategy used by the high
-		 * compression modes of zlib.  */
+		 * compression modes of zlib.  The fast levels choose the
+		 * match immediately.  */
 
 		if (!have_match) {
 			/* Find the longest match at the current position.  But
@@ -341,7 +371,7 @@ static unsigned int ntfs_compress_block(const char *inbuf, const int bufsize,
 			bp_cur = bp;
 			offs = pctx->rel;
 
-			if (pctx->size >= NICE_MATCH_LEN) {
+			if ((pctx->size >= NICE_MATCH_LEN) || !lazy) {
 
 				/* Choose long matches immediately.  */
 
@@ -358,9 +388,12 @@ static unsigned int ntfs_compress_block(const char *inbuf, const int bufsize,
 					break;
 				}
 				i += 1;
-				do {
-					ntfs_skip_position(pctx, i);
-				} while (++i != j);
+				if (skip_matches)
+					i = j;
+				else
+					do {
+						ntfs_skip_position(pctx, i);
+					} while (++i != j);
 				have_match = 0;
 			} else {
 				/* Check for a longer match at the next
@@ -446,6 +479,77 @@ static unsigned int ntfs_compress_block(const char *inbuf, const int bufsize,
 	return (xout);
 }
 
+/*
+ *		Copy a byte sequence designated by a phrase token
+ *
+ *	The sequence is copied from the data already decompressed in
+ *	the current sub-block. Short sequences are copied with a single
+ *	16-byte move when they are at least 16 bytes back, and the rest
+ *	is copied by doubling chunks when the sequence overlaps itself.
+ *	Bytes beyond the sequence may be overwritten up to the end of
+ *	the sub-block, they are decompressed later.
+ *
+ *	Returns the new destination position,
+ *		or NULL if the phrase is not valid
+ */
+
+static inline u8 *ntfs_copy_phrase(u8 *dest, const u8 *dest_sb_start,
+			const u8 *dest_sb_end, u16 pt)
+{
+	const u8 *dest_back_addr;
+	unsigned int pos, lg, length, chunk;
+
+	/* A phrase cannot be the first token in the sb. */
+	if (dest == dest_sb_start)
+		return ((u8*)NULL);
+	/*
+	 * Determine the number of bytes to go back (p) and the number
+	 * of bytes to copy (l), from log2(current destination position
+	 * in sb).
+	 */
+	pos = dest - dest_sb_start - 1;
+	lg = 0;
+#ifdef __GNUC__
+	if (pos >= 0x10)
+		lg = 28 - __builtin_clz(pos);
+#else
+	for (; pos >= 0x10; pos >>= 1)
+		lg++;
+#endif
+	/*
+	 * Calculate starting position of the byte sequence in
+	 * the destination using the fact that p = (pt >> (12 - lg)) + 1
+	 * and make sure we don't go too far back.
+	 */
+	dest_back_addr = dest - (pt >> (12 - lg)) - 1;
+	if (dest_back_addr < dest_sb_start)
+		return ((u8*)NULL);
+	/* Now calculate the length of the byte sequence. */
+	length = (pt & (0xfff >> lg)) + 3;
+	/* Verify destination is in range. */
+	if (dest + length > dest_sb_end)
+		return ((u8*)NULL);
+	if ((length <= 16)
+	    && ((dest - dest_back_addr) >= 16)
+	    && ((dest_sb_end - dest) >= 16)) {
+		memcpy(dest, dest_back_addr, 16);
+		return (dest + length);
+	}
+	/*
+	 * The copied part repeats the sequence, so it can be copied
+	 * again from the same place without overlapping.
+	 */
+	do {
+		chunk = dest - dest_back_addr;
+		if (chunk > length)
+			chunk = length;
+		memcpy(dest, dest_back_addr, chunk);
+		dest += chunk;
+		length -= chunk;
+	} while (length);
+	return (dest);
+}
+
 /**
  * ntfs_decompress - decompress a compression block into an array of pages
  * @dest:	buffer to which to write the decompressed data
@@ -481,6 +585,7 @@ static int ntfs_decompress(u8 *dest, const u32 dest_size,
 	int token;		/* Loop counter for the eight tokens in tag. */
 
 	ntfs_log_trace("Entering, cb_size = 0x%x.\n", (unsigned)cb_size);
+	NTFS_PROBE2(decompress, cb_size, dest_size);
 do_next_sb:
 	ntfs_log_debug("Beginning sub-block at offset = %d in the cb.\n",
 			(int)(cb - cb_start));
@@ -492,6 +597,8 @@ do_next_sb:
 	 */
 	if (cb == cb_end || !le16_to_cpup((le16*)cb) || dest == dest_end) {
 		ntfs_log_debug("Completed. Returning success (0).\n");
+		NTFS_PROBE3(decompress__done, cb_size,
+				dest_size - (dest_end - dest), 0);
 		return 0;
 	}
 	/* Setup offset for the current sub-block destination. */
@@ -530,6 +637,33 @@ do_next_sb:
 	/* Forward to the first tag in the sub-block. */
 	cb += 2;
 do_next_tag:
+	/*
+	 * While a full tag group (a tag and eight tokens of at most two
+	 * bytes) is in the sub-block, the source needs no checking, and
+	 * a group of eight symbols is copied at once.
+	 */
+	while ((cb_sb_end - cb) >= 17) {
+		tag = *cb++;
+		if (!tag && ((dest_sb_end - dest) >= 8)) {
+			memcpy(dest, cb, 8);
+			dest += 8;
+			cb += 8;
+			continue;
+		}
+		for (token = 0; token < 8; token++, tag >>= 1) {
+			if ((tag & NTFS_TOKEN_MASK) == NTFS_SYMBOL_TOKEN) {
+				if (dest >= dest_sb_end)
+					goto return_overflow;
+				*dest++ = *cb++;
+			} else {
+				dest = ntfs_copy_phrase(dest, dest_sb_start,
+					dest_sb_end, le16_to_cpup((le16*)cb));
+				if (!dest)
+					goto return_overflow;
+				cb += 2;
+			}
+		}
+	}
 	if (cb == cb_sb_end) {
 		/* Check if the decompressed sub-block was not full-length. */
 		if (dest < dest_sb_end) {
@@ -550,12 +684,8 @@ do_next_tag:
 	tag = *cb++;
 	/* Parse the eight tokens described by the tag. */
 	for (token = 0; token < 8; token++, tag >>= 1) {
-		u16 lg, pt, length, max_non_overlap;
-		register u16 i;
-		u8 *dest_back_addr;
-
-		/* Check if we are done / still in range. */
-		if (cb >= cb_sb_end || dest > dest_sb_end)
+		/* Check if we are done. */
+		if (cb >= cb_sb_end)
 			break;
 		/* Determine token type and parse appropriately.*/
 		if ((tag & NTFS_TOKEN_MASK) == NTFS_SYMBOL_TOKEN) {
@@ -563,68 +693,26 @@ do_next_tag:
 			 * We have a symbol token, copy the symbol across, and
 			 * advance the source and destination positions.
 			 */
+			if (dest >= dest_sb_end)
+				goto return_overflow;
 			*dest++ = *cb++;
 			/* Continue with the next token. */
 			continue;
 		}
-		/*
-		 * We have a phrase token. Make sure it is not the first tag in
-		 * the sb as this is illegal and would confuse the code below.
-		 */
-		if (dest == dest_sb_start)
-			goto return_overflow;
-		/*
-		 * Determine the number of bytes to go back (p) and the number
-		 * of bytes to copy (l). We use an optimized algorithm in which
-		 * we first calculate log2(current destination position in sb),
-		 * which allows determination of l and p in O(1) rather than
-		 * O(n). We just need an arch-optimized log2() function now.
-		 */
-		lg = 0;
-		for (i = dest - dest_sb_start - 1; i >= 0x10; i >>= 1)
-			lg++;
-		/* Get the phrase token into i. */
-		pt = le16_to_cpup((le16*)cb);
-		/*
-		 * Calculate starting position of the byte sequence in
-		 * the destination using the fact that p = (pt >> (12 - lg)) + 1
-		 * and make sure we don't go too far back.
-		 */
-		dest_back_addr = dest - (pt >> (12 - lg)) - 1;
-		if (dest_back_addr < dest_sb_start)
+		/* We have a phrase token, copy the byte sequence. */
+		if (cb + 2 > cb_sb_end)
 			goto return_overflow;
-		/* Now calculate the length of the byte sequence. */
-		length = (pt & (0xfff >> lg)) + 3;
-		/* Verify destination is in range. */
-		if (dest + length > dest_sb_end)
+		dest = ntfs_copy_phrase(dest, dest_sb_start, dest_sb_end,
+				le16_to_cpup((le16*)cb));
+		if (!dest)
 			goto return_overflow;
-		/* The number of non-overlapping bytes. */
-		max_non_overlap = dest - dest_back_addr;
-		if (length <= max_non_overlap) {
-			/* The byte sequence doesn't overlap, just copy it. */
-			memcpy(dest, dest_back_addr, length);
-			/* Advance destination pointer. */
-			dest += length;
-		} else {
-			/*
-			 * The byte sequence does overlap, copy non-overlapping
-			 * part and then do a slow byte by byte copy for the
-			 * overlapping part. Also, advance the destination
-			 * pointer.
-			 */
-			memcpy(dest, dest_back_addr, max_non_overlap);
-			dest += max_non_overlap;
-			dest_back_addr += max_non_overlap;
-			length -= max_non_overlap;
-			while (length--)
-				*dest++ = *dest_back_addr++;
-		}
 		/* Advance source position and continue with the next token. */
 		cb += 2;
 	}
 	/* No tokens left in the current tag. Continue with the next tag. */
 	goto do_next_tag;
 return_overflow:
+	NTFS_PROBE3(decompress__done, cb_size, 0, EOVERFLOW);
 	errno = EOVERFLOW;
 	ntfs_log_perror("Failed to decompress file");
 	return -1;
@@ -683,6 +771,345 @@ restart:
 	return FALSE;
 }
 
+#ifdef ENABLE_THREADS
+
+/*
+ *		Decompressing compression blocks in parallel
+ *
+ *	The calling thread reads the compressed blocks in order into a
+ *	ring of slots, and helper threads decompress the slots filled
+ *	into the output buffer, so that the device reads of the next
+ *	blocks are in flight while the previous ones are decompressed.
+ *	The calling thread decompresses too when no slot is free.
+ *
+ *	Only the calling thread uses the attribute, the helpers only see
+ *	the slots.
+ */
+
+enum { SLOT_FREE, SLOT_FILLING, SLOT_READY, SLOT_BUSY } ;
+
+struct DECOMPRESS_SLOT {
+	u8 *cb;		/* the compressed block */
+	u8 *dest;	/* temporary buffer, for a partial block */
+	u8 *out;	/* where the requested part goes */
+	u32 ofs;	/* offset of the requested part in the block */
+	u32 to_read;	/* size of the requested part */
+	unsigned int index;
+	int state;
+} ;
+
+struct DECOMPRESS_RING {
+	pthread_mutex_t lock;
+	pthread_cond_t ready;	/* a slot was filled, or the end */
+	pthread_cond_t freed;	/* a slot was decompressed */
+	struct DECOMPRESS_SLOT *slots;
+	unsigned int nr_slots;
+	u32 cb_size;
+	unsigned int failed;	/* index of the first block failed */
+	int err;
+	BOOL done;		/* no more slots will be filled */
+} ;
+
+/*
+ *		Record the failure of a block
+ *
+ *	Only the data before the first failed block is returned.
+ *	Must be called with the ring locked.
+ */
+
+static void decompress_fail(struct DECOMPRESS_RING *ring,
+			unsigned int index, int err)
+{
+	if (index < ring->failed) {
+		ring->failed = index;
+		ring->err = err;
+	}
+}
+
+/*
+ *		Decompress a slot, with the ring unlocked
+ *
+ *	Returns 0 if successful, or the error code
+ */
+
+static int decompress_slot(struct DECOMPRESS_RING *ring,
+			struct DECOMPRESS_SLOT *slot)
+{
+	u32 decompsz;
+	int err;
+
+	err = 0;
+	/* Just a precaution. */
+	*(u16*)(slot->cb + ring->cb_size - 2) = 0;
+	/* Do not decompress beyond the requested block */
+	decompsz = ((slot->ofs + slot->to_read - 1) | (NTFS_SB_SIZE - 1)) + 1;
+	if (!slot->ofs && (decompsz == slot->to_read)) {
+		if (ntfs_decompress(slot->out, decompsz,
+				slot->cb, ring->cb_size) < 0)
+			err = errno;
+	} else {
+		if (!slot->dest)
+			slot->dest = (u8*)ntfs_malloc(ring->cb_size);
+		if (!slot->dest)
+			err = errno;
+		else if (ntfs_decompress(slot->dest, decompsz,
+				slot->cb, ring->cb_size) < 0)
+			err = errno;
+		else
+			memcpy(slot->out, slot->dest + slot->ofs,
+					slot->to_read);
+	}
+	return (err);
+}
+
+/*
+ *		Decompress a ready slot, if any
+ *
+ *	Must be called with the ring locked, which is unlocked
+ *	while decompressing.
+ *
+ *	Returns TRUE if a slot was decompressed
+ */
+
+static BOOL decompress_one(struct DECOMPRESS_RING *ring)
+{
+	struct DECOMPRESS_SLOT *slot;
+	unsigned int i;
+	int err;
+
+	slot = (struct DECOMPRESS_SLOT*)NULL;
+	for (i=0; !slot && (i<ring->nr_slots); i++)
+		if (ring->slots[i].state == SLOT_READY)
+			slot = &ring->slots[i];
+	if (slot) {
+		slot->state = SLOT_BUSY;
+		pthread_mutex_unlock(&ring->lock);
+		err = decompress_slot(ring, slot);
+		pthread_mutex_lock(&ring->lock);
+		if (err)
+			decompress_fail(ring, slot->index, err);
+		slot->state = SLOT_FREE;
+		pthread_cond_signal(&ring->freed);
+	}
+	return (slot != (struct DECOMPRESS_SLOT*)NULL);
+}
+
+static void *decompress_worker(void *arg)
+{
+	struct DECOMPRESS_RING *ring;
+
+	ring = (struct DECOMPRESS_RING*)arg;
+	pthread_mutex_lock(&ring->lock);
+	do {
+		while (decompress_one(ring)) { }
+		if (!ring->done)
+			pthread_cond_wait(&ring->ready, &ring->lock);
+	} while (!ring->done || decompress_one(ring));
+	pthread_mutex_unlock(&ring->lock);
+	return ((void*)NULL);
+}
+
+/*
+ *		Get a free slot for a new block, decompressing ready
+ *	slots while there is none
+ */
+
+static struct DECOMPRESS_SLOT *decompress_get_slot(
+			struct DECOMPRESS_RING *ring)
+{
+	struct DECOMPRESS_SLOT *slot;
+	unsigned int i;
+
+	slot = (struct DECOMPRESS_SLOT*)NULL;
+	pthread_mutex_lock(&ring->lock);
+	do {
+		for (i=0; !slot && (i<ring->nr_slots); i++)
+			if (ring->slots[i].state == SLOT_FREE)
+				slot = &ring->slots[i];
+		if (!slot && !decompress_one(ring))
+			pthread_cond_wait(&ring->freed, &ring->lock);
+	} while (!slot);
+	slot->state = SLOT_FILLING;
+	pthread_mutex_unlock(&ring->lock);
+	return (slot);
+}
+
+/*
+ *		Read the raw clusters of a compression block
+ *
+ *	The attribute is temporarily marked as not compressed, as
+ *	for reading blocks in ntfs_compressed_attr_pread()
+ *
+ *	Returns 0 if successful, or the error code
+ */
+
+static int decompress_read(ntfs_attr *na, s64 pos, u32 to_read, u8 *buf)
+{
+	s64 tdata_size, tinitialized_size;
+	ATTR_FLAGS data_flags;
+	FILE_ATTR_FLAGS compression;
+	s64 br;
+	int err;
+
+	err = 0;
+	data_flags = na->data_flags;
+	compression = na->ni->flags & FILE_ATTR_COMPRESSED;
+	NAttrClearCompressed(na);
+	na->data_flags &= ~ATTR_COMPRESSION_MASK;
+	tdata_size = na->data_size;
+	tinitialized_size = na->initialized_size;
+	na->data_size = na->initialized_size = na->allocated_size;
+	do {
+		br = ntfs_attr_pread(na, pos, to_read, buf);
+		if (br <= 0) {
+			if (!br) {
+				ntfs_log_error("Failed to read a compression"
+					" block, inode %lld offs 0x%llx\n",
+					(long long)na->ni->mft_no,
+					(long long)pos);
+				errno = EIO;
+			}
+			err = errno;
+		} else {
+			pos += br;
+			buf += br;
+			to_read -= br;
+		}
+	} while (!err && (to_read > 0));
+	na->data_size = tdata_size;
+	na->initialized_size = tinitialized_size;
+	na->ni->flags |= compression;
+	na->data_flags = data_flags;
+	return (err);
+}
+
+/*
+ *		Read a range of compression blocks, with the compressed
+ *	ones decompressed in parallel
+ *
+ *	Returns the count of bytes read, short if an error occurred,
+ *		-1 if nothing could be read, with errno set
+ */
+
+static s64 ntfs_compressed_pread_parallel(ntfs_attr *na, VCN start_vcn,
+			s64 ofs, unsigned int nr_cbs, s64 count, u8 *b,
+			int threads)
+{
+	struct DECOMPRESS_RING ring;
+	struct DECOMPRESS_SLOT *slot;
+	ntfs_volume *vol;
+	runlist_element *rl;
+	pthread_t tids[DECOMPRESS_MAX_THREADS];
+	unsigned int index;
+	unsigned int i;
+	int started;
+	BOOL stop;
+	s64 first_ofs;
+	s64 total;
+	s64 done;
+	s64 to_read;
+	VCN vcn;
+	int err;
+
+	vol = na->ni->vol;
+	ring.cb_size = na->compression_block_size;
+	ring.nr_slots = min(nr_cbs, DECOMPRESS_MAX_SLOTS);
+	ring.slots = (struct DECOMPRESS_SLOT*)ntfs_malloc(ring.nr_slots
+				*sizeof(struct DECOMPRESS_SLOT));
+	if (!ring.slots)
+		return (-1);
+	for (i=0; i<ring.nr_slots; i++) {
+		ring.slots[i].cb = (u8*)ntfs_malloc(ring.cb_size);
+		ring.slots[i].dest = (u8*)NULL;
+		ring.slots[i].state = SLOT_FREE;
+		if (!ring.slots[i].cb) {
+			while (i-- > 0)
+				free(ring.slots[i].cb);
+			free(ring.slots);
+			return (-1);
+		}
+	}
+	ring.failed = nr_cbs;
+	ring.err = 0;
+	ring.done = FALSE;
+	pthread_mutex_init(&ring.lock, NULL);
+	pthread_cond_init(&ring.ready, NULL);
+	pthread_cond_init(&ring.freed, NULL);
+	started = 0;
+	while ((started < (threads - 1))
+	    && !pthread_create(&tids[started], NULL,
+				decompress_worker, &ring))
+		started++;
+	done = 0;
+	first_ofs = ofs;
+	stop = FALSE;
+	for (index=0; (index<nr_cbs) && !stop; index++) {
+		vcn = start_vcn + index*na->compression_block_clusters;
+		to_read = min(count - done, ring.cb_size - ofs);
+		err = 0;
+		rl = ntfs_attr_find_vcn(na, vcn);
+		if (!rl || (rl->lcn < LCN_HOLE))
+			err = EIO;
+		else if (rl->lcn == LCN_HOLE)
+			memset(&b[done], 0, to_read);
+		else if (!ntfs_is_cb_compressed(na, rl, vcn,
+				na->compression_block_clusters))
+			err = decompress_read(na,
+				(vcn << vol->cluster_size_bits) + ofs,
+				to_read, &b[done]);
+		else {
+			slot = decompress_get_slot(&ring);
+			err = decompress_read(na, vcn << vol->cluster_size_bits,
+					ring.cb_size, slot->cb);
+			slot->out = &b[done];
+			slot->ofs = ofs;
+			slot->to_read = to_read;
+			slot->index = index;
+			pthread_mutex_lock(&ring.lock);
+			slot->state = (err ? SLOT_FREE : SLOT_READY);
+			pthread_cond_signal(&ring.ready);
+			stop = ring.failed < nr_cbs;
+			pthread_mutex_unlock(&ring.lock);
+		}
+		if (err) {
+			pthread_mutex_lock(&ring.lock);
+			decompress_fail(&ring, index, err);
+			pthread_mutex_unlock(&ring.lock);
+			stop = TRUE;
+		}
+		done += to_read;
+		ofs = 0;
+	}
+		/* let the helpers go when the ring is empty, and help them */
+	pthread_mutex_lock(&ring.lock);
+	ring.done = TRUE;
+	pthread_cond_broadcast(&ring.ready);
+	while (decompress_one(&ring)) { }
+	pthread_mutex_unlock(&ring.lock);
+	for (i=0; i<(unsigned int)started; i++)
+		pthread_join(tids[i], NULL);
+	pthread_cond_destroy(&ring.freed);
+	pthread_cond_destroy(&ring.ready);
+	pthread_mutex_destroy(&ring.lock);
+	for (i=0; i<ring.nr_slots; i++) {
+		free(ring.slots[i].cb);
+		free(ring.slots[i].dest);
+	}
+	free(ring.slots);
+		/* only return the data before the first failed block */
+	total = count;
+	if (ring.failed < nr_cbs) {
+		total = (s64)ring.cb_size*ring.failed - first_ofs;
+		if (total <= 0) {
+			total = -1;
+			errno = ring.err;
+		}
+	}
+	return (total);
+}
+
+#endif /* ENABLE_THREADS */
+
 /**
  * ntfs_compressed_attr_pread - read from a compressed attribute
  * @na:		ntfs attribute to read from
@@ -765,18 +1192,6 @@ s64 ntfs_compressed_attr_pread(ntfs_attr *na, s64 pos, s64 count, void *b)
 	cb_size = na->compression_block_size;
 	cb_size_mask = cb_size - 1UL;
 	cb_clusters = na->compression_block_clusters;
-	
-	/* Need a temporary buffer for each loaded compression block. */
-	cb = (u8*)ntfs_malloc(cb_size);
-	if (!cb)
-		return -1;
-	
-	/* Need a temporary buffer for each uncompressed block. */
-	dest = (u8*)ntfs_malloc(cb_size);
-	if (!dest) {
-		free(cb);
-		return -1;
-	}
 	/*
 	 * The first vcn in the first compression block (cb) which we need to
 	 * decompress.
@@ -793,6 +1208,38 @@ s64 ntfs_compressed_attr_pread(ntfs_attr *na, s64 pos, s64 count, void *b)
 	/* Number of compression blocks (cbs) in the wanted vcn range. */
 	nr_cbs = (end_vcn - start_vcn) << vol->cluster_size_bits >>
 			na->compression_block_size_bits;
+#ifdef ENABLE_THREADS
+	/* Decompress in parallel when there are several blocks */
+	if (nr_cbs >= DECOMPRESS_PARALLEL_MIN) {
+		int threads;
+
+		threads = 1;
+#if defined(HAVE_UNISTD_H) && defined(_SC_NPROCESSORS_ONLN)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+		if (threads > DECOMPRESS_MAX_THREADS)
+			threads = DECOMPRESS_MAX_THREADS;
+		if (threads > 1) {
+			br = ntfs_compressed_pread_parallel(na, start_vcn,
+					ofs, nr_cbs, count, (u8*)b, threads);
+			if (br == count)
+				br += total2;
+			return (br);
+		}
+	}
+#endif
+	
+	/* Need a temporary buffer for each loaded compression block. */
+	cb = (u8*)ntfs_malloc(cb_size);
+	if (!cb)
+		return -1;
+	
+	/* Need a temporary buffer for each uncompressed block. */
+	dest = (u8*)ntfs_malloc(cb_size);
+	if (!dest) {
+		free(cb);
+		return -1;
+	}
 	cb_end = cb + cb_size;
 do_next_cb:
 	nr_cbs--;
@@ -1048,9 +1495,176 @@ static s32 write_clusters(ntfs_volume *vol, const runlist_element *rl,
 }
 
 
+#ifdef ENABLE_THREADS
+
+/*
+ *		Compressing the sub-blocks of a compression block in parallel
+ *
+ *	Each sub-block is compressed independently into its own slot of
+ *	a scratch buffer, and the caller assembles the slots in order.
+ */
+
+	/* size of a slot, see ntfs_compress_block() */
+#define COMPRESS_SLOT_SIZE (NTFS_SB_SIZE + 4)
+
+struct COMPRESS_JOBS {
+	pthread_mutex_t lock;
+	const char *inbuf;
+	u32 insz;
+	char *scratch;
+	unsigned int *sizes;
+	unsigned int next;	/* next sub-block to compress */
+	unsigned int count;	/* count of sub-blocks */
+	int level;
+} ;
+
+static void *compress_worker(void *arg)
+{
+	struct COMPRESS_JOBS *jobs;
+	unsigned int index;
+	u32 p;
+	u32 bsz;
+
+	jobs = (struct COMPRESS_JOBS*)arg;
+	do {
+		pthread_mutex_lock(&jobs->lock);
+		index = jobs->next;
+		if (index < jobs->count)
+			jobs->next++;
+		pthread_mutex_unlock(&jobs->lock);
+		if (index < jobs->count) {
+			p = index*NTFS_SB_SIZE;
+			if ((p + NTFS_SB_SIZE) < jobs->insz)
+				bsz = NTFS_SB_SIZE;
+			else
+				bsz = jobs->insz - p;
+			jobs->sizes[index] = ntfs_compress_block(
+					&jobs->inbuf[p], bsz,
+					&jobs->scratch[index*COMPRESS_SLOT_SIZE],
+					jobs->level);
+		}
+	} while (index < jobs->count);
+	return ((void*)NULL);
+}
+
+/*
+ *		Compress all the sub-blocks of a set, using several threads
+ *
+ *	Returns the scratch buffer, with the size of each compressed
+ *		sub-block in @sizes (zero if it failed),
+ *		or NULL if not worth or not possible (nothing is done)
+ */
+
+static char *ntfs_compress_parallel(ntfs_volume *vol, const char *inbuf,
+			u32 insz, unsigned int *sizes)
+{
+	struct COMPRESS_JOBS jobs;
+	pthread_t tids[COMPRESS_MAX_THREADS];
+	int threads;
+	int started;
+	int i;
+
+	jobs.count = (insz + NTFS_SB_SIZE - 1)/NTFS_SB_SIZE;
+	if (jobs.count < COMPRESS_PARALLEL_MIN)
+		return ((char*)NULL);
+	threads = 1;
+#if defined(HAVE_UNISTD_H) && defined(_SC_NPROCESSORS_ONLN)
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (threads > COMPRESS_MAX_THREADS)
+		threads = COMPRESS_MAX_THREADS;
+	if (threads < 2)
+		return ((char*)NULL);
+	jobs.scratch = (char*)ntfs_malloc(jobs.count*COMPRESS_SLOT_SIZE);
+	if (!jobs.scratch)
+		return ((char*)NULL);
+	jobs.inbuf = inbuf;
+	jobs.insz = insz;
+	jobs.sizes = sizes;
+	jobs.next = 0;
+	jobs.level = vol->compression_level;
+	pthread_mutex_init(&jobs.lock, NULL);
+	started = 0;
+	while ((started < (threads - 1))
+	    && !pthread_create(&tids[started], NULL,
+				compress_worker, &jobs))
+		started++;
+	compress_worker(&jobs);
+	for (i=0; i<started; i++)
+		pthread_join(tids[i], NULL);
+	pthread_mutex_destroy(&jobs.lock);
+	return (jobs.scratch);
+}
+
+#endif /* ENABLE_THREADS */
+
+/*
+ *		Guess whether a set of blocks is not worth compressing
+ *
+ *	A slice is sampled at the beginning of each quarter of the
+ *	set, up to 1024 bytes each.  The set is deemed not
+ *	worth compressing when the sampled bytes are almost evenly
+ *	distributed, their collision entropy being above about 7.7 bits
+ *	per byte, and they show almost no repeated 3-byte sequences, which
+ *	is what JPEG pictures, archives and encrypted data look like.
+ *	This costs about the compression of a hundred bytes.
+ */
+
+#define COMPRESS_SAMPLE_SLICES 4
+#define COMPRESS_SAMPLE_SIZE 1024
+#define COMPRESS_PROBE_SHIFT 10
+
+static BOOL ntfs_incompressible(const char *inbuf, u32 insz)
+{
+	const u8 *slice;
+	u32 counts[256];
+	u16 last[1 << COMPRESS_PROBE_SHIFT];
+	u32 slicesz;
+	u32 sampled;
+	u32 hits;
+	u32 i, j;
+	u64 sumsq;
+	unsigned int h;
+
+	slicesz = insz/COMPRESS_SAMPLE_SLICES;
+	if (slicesz > COMPRESS_SAMPLE_SIZE)
+		slicesz = COMPRESS_SAMPLE_SIZE;
+	if (slicesz < 32)
+		return (FALSE);
+	memset(counts, 0, sizeof(counts));
+	sampled = 0;
+	hits = 0;
+	for (i=0; i<COMPRESS_SAMPLE_SLICES; i++) {
+		slice = (const u8*)&inbuf[i*(insz/COMPRESS_SAMPLE_SLICES)];
+		memset(last, 0, sizeof(last));
+		for (j=0; j<slicesz; j++)
+			counts[slice[j]]++;
+		for (j=0; (j + 3)<=slicesz; j++) {
+			h = ((slice[j] | (slice[j+1] << 8)
+				| ((u32)slice[j+2] << 16)) * HASH_MULTIPLIER)
+					>> (32 - COMPRESS_PROBE_SHIFT);
+			if (last[h] && !memcmp(&slice[last[h] - 1],
+						&slice[j], 3))
+				hits++;
+			last[h] = j + 1;
+		}
+		sampled += slicesz;
+	}
+	sumsq = 0;
+	for (i=0; i<256; i++)
+		sumsq += (u64)counts[i]*counts[i];
+	/* an even distribution gives sumsq = sampled*(1 + sampled/256) */
+	return ((sumsq*256 < (u64)sampled*(sampled + 256)*5/4)
+		&& (hits*32 < sampled));
+}
+
 /*
  *		Compress and write a set of blocks
  *
+ *	The sub-blocks are compressed in parallel when there are
+ *	several processors.  Sets which obviously do not compress are
+ *	not tried.
+ *
  *	returns the size actually written (rounded to a full cluster)
  *		or 0 if all zeroes (nothing is written)
  *		or -1 if could not compress (nothing is written)
@@ -1072,6 +1686,8 @@ static s32 ntfs_comp_set(ntfs_attr *na, runlist_element *rl,
 	unsigned int bsz;
 	BOOL fail;
 	BOOL allzeroes;
+	char *scratch;
+	unsigned int *sizes;
 		/* a single compressed zero */
 	static char onezero[] = { 0x01, 0xb0, 0x00, 0x00 } ;
 		/* a couple of compressed zeroes */
@@ -1081,6 +1697,8 @@ static s32 ntfs_comp_set(ntfs_attr *na, runlist_element *rl,
 
 	vol = na->ni->vol;
 	written = -1; /* default return */
+	if (ntfs_incompressible(inbuf, insz))
+		return (written);
 	clsz = 1 << vol->cluster_size_bits;
 		/* may need 2 extra bytes per block and 2 more bytes */
 	outbuf = (char*)ntfs_malloc(na->compression_block_size
@@ -1090,13 +1708,31 @@ static s32 ntfs_comp_set(ntfs_attr *na, runlist_element *rl,
 		fail = FALSE;
 		compsz = 0;
 		allzeroes = TRUE;
+		scratch = (char*)NULL;
+#ifdef ENABLE_THREADS
+		sizes = (unsigned int*)ntfs_malloc(sizeof(unsigned int)
+				*((insz + NTFS_SB_SIZE - 1)/NTFS_SB_SIZE));
+		if (sizes)
+			scratch = ntfs_compress_parallel(vol, inbuf,
+					insz, sizes);
+#else
+		sizes = (unsigned int*)NULL;
+#endif
 		for (p=0; (p<insz) && !fail; p+=NTFS_SB_SIZE) {
 			if ((p + NTFS_SB_SIZE) < insz)
 				bsz = NTFS_SB_SIZE;
 			else
 				bsz = insz - p;
 			pbuf = &outbuf[compsz];
-			sz = ntfs_compress_block(&inbuf[p],bsz,pbuf);
+#ifdef ENABLE_THREADS
+			if (scratch) {
+				sz = sizes[p/NTFS_SB_SIZE];
+				memcpy(pbuf, &scratch[(p/NTFS_SB_SIZE)
+						*COMPRESS_SLOT_SIZE], sz);
+			} else
+#endif
+				sz = ntfs_compress_block(&inbuf[p],bsz,pbuf,
+					vol->compression_level);
 			/* fail if all the clusters (or more) are needed */
 			if (!sz || ((compsz + sz + clsz + 2)
 					 > na->compression_block_size))
@@ -1125,6 +1761,8 @@ static s32 ntfs_comp_set(ntfs_attr *na, runlist_element *rl,
 			compsz += sz;
 			}
 		}
+		free(scratch);
+		free(sizes);
 		if (!fail && !allzeroes) {
 			/* add a couple of null bytes, space has been checked */
 			outbuf[compsz++] = 0;
@@ -1418,6 +2056,8 @@ static int ntfs_compress_overwr_free(ntfs_attr *na, runlist_element *rl,
 		*++xrl = *frl; /* terminator */
 	na->compressed_size -= freed << vol->cluster_size_bits;
 	}
+		/* the runlist may have been shortened */
+	ntfs_attr_forget_runs(na);
 	return (res);
 }
 
@@ -1563,6 +2203,8 @@ static int ntfs_compress_free(ntfs_attr *na, runlist_element *rl,
 		errno = EIO;
 	}
 	NAttrSetRunlistDirty(na);
+		/* the runlist may have been shortened */
+	ntfs_attr_forget_runs(na);
 	return (res);
 }
 
@@ -59,6 +59,11 @@ static FORCEINLINE u32 get_unaligned_le32(const u8 *p)
 	return le32_to_cpu(((const struct u32_unaligned *)p)->v);
 }
 
+static FORCEINLINE void put_unaligned_le16(u16 v, u8 *p)
+{
+	((struct u16_unaligned *)p)->v = cpu_to_le16(v);
+}
+
 static FORCEINLINE void put_unaligned_le32(u32 v, u8 *p)
 {
 	((struct u32_unaligned *)p)->v = cpu_to_le32(v);
@@ -121,6 +126,12 @@ static FORCEINLINE u32 get_unaligned_le32(const u8 *p)
 	return p[0] | ((u32)p[1] << 8) | ((u32)p[2] << 16) | ((u32)p[3] << 24);
 }
 
+static FORCEINLINE void put_unaligned_le16(u16 v, u8 *p)
+{
+	p[0] = v >> 0;
+	p[1] = v >> 8;
+}
+
 static FORCEINLINE void put_unaligned_le32(u32 v, u8 *p)
 {
 	p[0] = v >> 0;
@@ -138,8 +149,8 @@ static FORCEINLINE void put_unaligned_le32(u32 v, u8 *p)
 struct input_bitstream {
 
 	/* Bits that have been read from the input buffer.  The bits are
-	 * left-justified; the next bit is always bit 31.  */
-	u32 bitbuf;
+	 * left-justified; the next bit is always bit 63.  */
+	u64 bitbuf;
 
 	/* Number of bits currently held in @bitbuf.  */
 	unsigned bitsleft;
@@ -164,16 +175,21 @@ static FORCEINLINE void init_input_bitstream(struct input_bitstream *is,
 /* Ensure the bit buffer variable for the bitstream contains at least @num_bits
  * bits.  Following this, bitstream_peek_bits() and/or bitstream_remove_bits()
  * may be called on the bitstream to peek or remove up to @num_bits bits.  Note
- * that @num_bits must be <= 16.  */
+ * that @num_bits must be <= 16.
+ *
+ * The next coding unit is fetched without branching on the end of the input,
+ * past which the missing bits are zeroes.  */
 static FORCEINLINE void bitstream_ensure_bits(struct input_bitstream *is,
 					      unsigned num_bits)
 {
+	unsigned avail;
+	u16 unit;
+
 	if (is->bitsleft < num_bits) {
-		if (is->end - is->next >= 2) {
-			is->bitbuf |= (u32)get_unaligned_le16(is->next)
-					<< (16 - is->bitsleft);
-			is->next += 2;
-		}
+		avail = (is->end - is->next >= 2) << 1;
+		unit = avail ? get_unaligned_le16(is->next) : 0;
+		is->bitbuf |= (u64)unit << (48 - is->bitsleft);
+		is->next += avail;
 		is->bitsleft += 16;
 	}
 }
@@ -186,7 +202,7 @@ static FORCEINLINE u32 bitstream_peek_bits(const struct input_bitstream *is,
 {
 	if (num_bits == 0)
 		return 0;
-	return is->bitbuf >> (32 - num_bits);
+	return is->bitbuf >> (64 - num_bits);
 }
 
 /* Remove @num_bits from the bitstream.  There must be at least @num_bits
@@ -0,0 +1,828 @@
+/**
+ * devcache.c : block cache in front of a device
+ *
+ *      This module is part of ntfs-3g library
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
+
+#include "types.h"
+#include "param.h"
+#include "device.h"
+#include "devcache.h"
+#include "misc.h"
+#include "logging.h"
+
+/*
+ *		Block cache in front of a device
+ *
+ *	The same metadata (MFT records, index blocks, bitmap pages...)
+ *	is read again and again, and when the device is opened with
+ *	O_DIRECT, there is nothing else to keep it in memory. The cache
+ *	is inserted in front of the device operations, and it keeps the
+ *	blocks involved in the small transfers. The big transfers, which
+ *	are expected to be for file data, go directly to the device, and
+ *	they only update the blocks already present in the cache.
+ *
+ *	When the cache is write-through, the device is always up to date,
+ *	so that it can still be accessed directly. When it is write-back,
+ *	the small writes are only done in the cache, and the modified
+ *	blocks are written to the device when they are evicted and when
+ *	the device is synced or closed.
+ *
+ *	The cache is split into shards, selected by the block number,
+ *	which are locked independently. The blocks to evict are selected
+ *	by a clock algorithm within each shard.
+ */
+
+struct DEVCACHE_BLOCK {
+	struct DEVCACHE_BLOCK *next;	/* next block in hash chain */
+	s64 blkno;			/* -1 if the block is unused */
+	char *data;
+	int valid;			/* count of bytes present */
+	BOOL dirty;
+	BOOL referenced;
+} ;
+
+struct DEVCACHE_SHARD {
+#ifdef ENABLE_THREADS
+	pthread_mutex_t lock;
+#endif
+	struct DEVCACHE_BLOCK *blocks;
+	struct DEVCACHE_BLOCK **hash;
+	int count;			/* count of blocks */
+	int hashmask;
+	int hand;			/* position of the clock hand */
+} ;
+
+struct DEVICE_CACHE {
+	struct ntfs_device_operations *lower;
+	BOOL writeback;
+	char *buffers;			/* data of all the blocks */
+	struct DEVCACHE_SHARD shards[DEVCACHE_SHARDS];
+} ;
+
+static struct ntfs_device_operations ntfs_devcache_ops;
+
+static void shard_lock(struct DEVCACHE_SHARD *shard
+#ifndef ENABLE_THREADS
+			__attribute__((unused))
+#endif
+			)
+{
+#ifdef ENABLE_THREADS
+	pthread_mutex_lock(&shard->lock);
+#endif
+}
+
+static void shard_unlock(struct DEVCACHE_SHARD *shard
+#ifndef ENABLE_THREADS
+			__attribute__((unused))
+#endif
+			)
+{
+#ifdef ENABLE_THREADS
+	pthread_mutex_unlock(&shard->lock);
+#endif
+}
+
+/*
+ *		Transfers on the device, as ntfs_pread() and ntfs_pwrite()
+ */
+
+static s64 lower_pread(struct ntfs_device *dev, void *buf,
+		s64 count, s64 pos)
+{
+	struct ntfs_device_operations *dops;
+	s64 br, total;
+
+	dops = dev->d_cache->lower;
+	for (total=0; count; count-=br, total+=br) {
+		br = dops->pread(dev, (char*)buf + total, count, pos + total);
+		if (br <= 0)
+			return (total ? total : br);
+	}
+	return (total);
+}
+
+static s64 lower_pwrite(struct ntfs_device *dev, const void *buf,
+		s64 count, s64 pos)
+{
+	struct ntfs_device_operations *dops;
+	s64 bw, total;
+
+	dops = dev->d_cache->lower;
+	for (total=0; count; count-=bw, total+=bw) {
+		bw = dops->pwrite(dev, (const char*)buf + total,
+				count, pos + total);
+		if (bw <= 0)
+			return (total ? total : bw);
+	}
+	return (total);
+}
+
+static struct DEVCACHE_SHARD *get_shard(struct DEVICE_CACHE *cache,
+		s64 blkno)
+{
+	return (&cache->shards[blkno % DEVCACHE_SHARDS]);
+}
+
+static struct DEVCACHE_BLOCK **hash_head(struct DEVCACHE_SHARD *shard,
+		s64 blkno)
+{
+	return (&shard->hash[(blkno / DEVCACHE_SHARDS) & shard->hashmask]);
+}
+
+static struct DEVCACHE_BLOCK *find_block(struct DEVCACHE_SHARD *shard,
+		s64 blkno)
+{
+	struct DEVCACHE_BLOCK *block;
+
+	block = *hash_head(shard, blkno);
+	while (block && (block->blkno != blkno))
+		block = block->next;
+	return (block);
+}
+
+static void unhash_block(struct DEVCACHE_SHARD *shard,
+		struct DEVCACHE_BLOCK *block)
+{
+	struct DEVCACHE_BLOCK **pprev;
+
+	pprev = hash_head(shard, block->blkno);
+	while (*pprev && (*pprev != block))
+		pprev = &(*pprev)->next;
+	if (*pprev)
+		*pprev = block->next;
+	block->next = (struct DEVCACHE_BLOCK*)NULL;
+	block->blkno = -1;
+}
+
+/*
+ *		Write a modified block to the device
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+static int write_block(struct ntfs_device *dev, struct DEVCACHE_BLOCK *block)
+{
+	s64 bw;
+
+	bw = lower_pwrite(dev, block->data, block->valid,
+			block->blkno*DEVCACHE_BLOCK_SIZE);
+	if (bw != block->valid) {
+		if (bw >= 0)
+			errno = EIO;
+		ntfs_log_perror("Failed to write a cached block at %lld",
+			(long long)block->blkno*DEVCACHE_BLOCK_SIZE);
+		return (-1);
+	}
+	block->dirty = FALSE;
+	return (0);
+}
+
+/*
+ *		Get a block into a shard, evicting another one
+ *
+ *	If the block has to be read, its data may be short at the end
+ *	of the device.
+ *
+ *	Returns the block, or NULL if there was an error (errno is set)
+ *	The shard must be locked by the caller.
+ */
+
+static struct DEVCACHE_BLOCK *load_block(struct ntfs_device *dev,
+		struct DEVCACHE_SHARD *shard, s64 blkno, BOOL fill)
+{
+	struct DEVCACHE_BLOCK *block;
+	struct DEVCACHE_BLOCK **head;
+	s64 br;
+	int i;
+
+		/* a second round finds the blocks no more referenced */
+	block = (struct DEVCACHE_BLOCK*)NULL;
+	for (i=0; !block && (i<=2*shard->count); i++) {
+		block = &shard->blocks[shard->hand];
+		if (++shard->hand >= shard->count)
+			shard->hand = 0;
+		if ((block->blkno >= 0) && block->referenced) {
+			block->referenced = FALSE;
+			block = (struct DEVCACHE_BLOCK*)NULL;
+		}
+	}
+	if (!block) {
+		errno = EIO;
+		return ((struct DEVCACHE_BLOCK*)NULL);
+	}
+	if (block->blkno >= 0) {
+		if (block->dirty && write_block(dev, block))
+			return ((struct DEVCACHE_BLOCK*)NULL);
+		unhash_block(shard, block);
+	}
+	block->valid = 0;
+	if (fill) {
+		br = lower_pread(dev, block->data, DEVCACHE_BLOCK_SIZE,
+				blkno*DEVCACHE_BLOCK_SIZE);
+		if (br < 0)
+			return ((struct DEVCACHE_BLOCK*)NULL);
+		block->valid = br;
+	}
+	block->blkno = blkno;
+	block->dirty = FALSE;
+	block->referenced = TRUE;
+	head = hash_head(shard, blkno);
+	block->next = *head;
+	*head = block;
+	return (block);
+}
+
+/*
+ *		Copy new data into a cached block
+ *
+ *	The data may begin beyond the end of the device, which implies
+ *	the device is a file, and the gap will read as zeroes.
+ */
+
+static void update_block(struct DEVCACHE_BLOCK *block, const char *buf,
+		int ofs, int n)
+{
+	if (ofs > block->valid)
+		memset(&block->data[block->valid], 0, ofs - block->valid);
+	memcpy(&block->data[ofs], buf, n);
+	if ((ofs + n) > block->valid)
+		block->valid = ofs + n;
+}
+
+/*
+ *		Update the cached blocks after a direct write
+ */
+
+static void patch_blocks(struct DEVICE_CACHE *cache, const void *buf,
+		s64 count, s64 pos)
+{
+	struct DEVCACHE_SHARD *shard;
+	struct DEVCACHE_BLOCK *block;
+	s64 blkno;
+	s64 done;
+	int ofs, n;
+
+	for (done=0; done<count; done+=n) {
+		blkno = (pos + done)/DEVCACHE_BLOCK_SIZE;
+		ofs = (pos + done) & (DEVCACHE_BLOCK_SIZE - 1);
+		n = DEVCACHE_BLOCK_SIZE - ofs;
+		if (n > (count - done))
+			n = count - done;
+		shard = get_shard(cache, blkno);
+		shard_lock(shard);
+		block = find_block(shard, blkno);
+		if (block)
+			update_block(block, (const char*)buf + done, ofs, n);
+		shard_unlock(shard);
+	}
+}
+
+/*
+ *		Insert the modified cached blocks into data read directly
+ */
+
+static void overlay_blocks(struct DEVICE_CACHE *cache, void *buf,
+		s64 count, s64 pos)
+{
+	struct DEVCACHE_SHARD *shard;
+	struct DEVCACHE_BLOCK *block;
+	s64 blkno;
+	s64 done;
+	int ofs, n, m;
+
+	for (done=0; done<count; done+=n) {
+		blkno = (pos + done)/DEVCACHE_BLOCK_SIZE;
+		ofs = (pos + done) & (DEVCACHE_BLOCK_SIZE - 1);
+		n = DEVCACHE_BLOCK_SIZE - ofs;
+		if (n > (count - done))
+			n = count - done;
+		shard = get_shard(cache, blkno);
+		shard_lock(shard);
+		block = find_block(shard, blkno);
+		if (block && block->dirty && (ofs < block->valid)) {
+			m = block->valid - ofs;
+			if (m > n)
+				m = n;
+			memcpy((char*)buf + done, &block->data[ofs], m);
+		}
+		shard_unlock(shard);
+	}
+}
+
+static s64 cached_pread(struct ntfs_device *dev, void *buf,
+		s64 count, s64 pos)
+{
+	struct DEVICE_CACHE *cache;
+	struct DEVCACHE_SHARD *shard;
+	struct DEVCACHE_BLOCK *block;
+	s64 blkno;
+	s64 total;
+	s64 br;
+	int ofs, n, got;
+
+	cache = dev->d_cache;
+	if (count > DEVCACHE_MAX_TRANSFER) {
+		br = lower_pread(dev, buf, count, pos);
+		if ((br > 0) && cache->writeback)
+			overlay_blocks(cache, buf, br, pos);
+		return (br);
+	}
+	for (total=0; total<count; total+=got) {
+		blkno = (pos + total)/DEVCACHE_BLOCK_SIZE;
+		ofs = (pos + total) & (DEVCACHE_BLOCK_SIZE - 1);
+		n = DEVCACHE_BLOCK_SIZE - ofs;
+		if (n > (count - total))
+			n = count - total;
+		shard = get_shard(cache, blkno);
+		shard_lock(shard);
+		block = find_block(shard, blkno);
+		if (!block)
+			block = load_block(dev, shard, blkno, TRUE);
+		if (!block) {
+			shard_unlock(shard);
+			return (total ? total : -1);
+		}
+		block->referenced = TRUE;
+		got = block->valid - ofs;
+		if (got > n)
+			got = n;
+		if (got > 0)
+			memcpy((char*)buf + total, &block->data[ofs], got);
+		shard_unlock(shard);
+			/* end of device */
+		if (got < n) {
+			if (got > 0)
+				total += got;
+			break;
+		}
+	}
+	return (total);
+}
+
+static s64 cached_pwrite(struct ntfs_device *dev, const void *buf,
+		s64 count, s64 pos)
+{
+	struct DEVICE_CACHE *cache;
+	struct DEVCACHE_SHARD *shard;
+	struct DEVCACHE_BLOCK *block;
+	s64 blkno;
+	s64 total;
+	s64 bw;
+	int ofs, n;
+
+	cache = dev->d_cache;
+	if (!cache->writeback || NDevSync(dev)
+	    || (count > DEVCACHE_MAX_TRANSFER)) {
+		bw = lower_pwrite(dev, buf, count, pos);
+		if (bw > 0)
+			patch_blocks(cache, buf, bw, pos);
+		return (bw);
+	}
+	if (NDevReadOnly(dev)) {
+		errno = EROFS;
+		return (-1);
+	}
+	NDevSetDirty(dev);
+	for (total=0; total<count; total+=n) {
+		blkno = (pos + total)/DEVCACHE_BLOCK_SIZE;
+		ofs = (pos + total) & (DEVCACHE_BLOCK_SIZE - 1);
+		n = DEVCACHE_BLOCK_SIZE - ofs;
+		if (n > (count - total))
+			n = count - total;
+		shard = get_shard(cache, blkno);
+		shard_lock(shard);
+		block = find_block(shard, blkno);
+			/* no need to read a block which is fully rewritten */
+		if (!block)
+			block = load_block(dev, shard, blkno,
+					n < DEVCACHE_BLOCK_SIZE);
+		if (!block) {
+			shard_unlock(shard);
+			return (total ? total : -1);
+		}
+		update_block(block, (const char*)buf + total, ofs, n);
+		block->dirty = TRUE;
+		block->referenced = TRUE;
+		shard_unlock(shard);
+	}
+	return (total);
+}
+
+/*
+ *		Write all the modified blocks to the device
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+int ntfs_devcache_flush(struct ntfs_device *dev)
+{
+	struct DEVICE_CACHE *cache;
+	struct DEVCACHE_SHARD *shard;
+	struct DEVCACHE_BLOCK *block;
+	int err;
+	int i, j;
+
+	cache = dev->d_cache;
+	if (!cache || !cache->writeback)
+		return (0);
+	err = 0;
+	for (i=0; i<DEVCACHE_SHARDS; i++) {
+		shard = &cache->shards[i];
+		shard_lock(shard);
+		for (j=0; j<shard->count; j++) {
+			block = &shard->blocks[j];
+			if ((block->blkno >= 0) && block->dirty
+			    && write_block(dev, block))
+				err = errno;
+		}
+		shard_unlock(shard);
+	}
+	if (err) {
+		errno = err;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ *		Write the modified blocks within a range of the device
+ *
+ *	This is for syncing a single file. When the range has more
+ *	blocks than the cache, the cache is scanned instead of looking
+ *	up every block of the range.
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+int ntfs_devcache_flush_range(struct ntfs_device *dev, s64 pos, s64 count)
+{
+	struct DEVICE_CACHE *cache;
+	struct DEVCACHE_SHARD *shard;
+	struct DEVCACHE_BLOCK *block;
+	s64 first, last;
+	s64 blkno;
+	s64 total;
+	int err;
+	int i, j;
+
+	cache = dev->d_cache;
+	if (!cache || !cache->writeback || (count <= 0))
+		return (0);
+	err = 0;
+	first = pos/DEVCACHE_BLOCK_SIZE;
+	last = (pos + count - 1)/DEVCACHE_BLOCK_SIZE;
+	total = 0;
+	for (i=0; i<DEVCACHE_SHARDS; i++)
+		total += cache->shards[i].count;
+	if ((last - first) >= total) {
+		for (i=0; i<DEVCACHE_SHARDS; i++) {
+			shard = &cache->shards[i];
+			shard_lock(shard);
+			for (j=0; j<shard->count; j++) {
+				block = &shard->blocks[j];
+				if ((block->blkno >= first)
+				    && (block->blkno <= last)
+				    && block->dirty
+				    && write_block(dev, block))
+					err = errno;
+			}
+			shard_unlock(shard);
+		}
+	} else {
+		for (blkno=first; blkno<=last; blkno++) {
+			shard = get_shard(cache, blkno);
+			shard_lock(shard);
+			block = find_block(shard, blkno);
+			if (block && block->dirty && write_block(dev, block))
+				err = errno;
+			shard_unlock(shard);
+		}
+	}
+	if (err) {
+		errno = err;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ *		Sync the device behind the cache
+ *
+ *	The modified blocks are left in the cache, the ones needed
+ *	having been written by ntfs_devcache_flush_range().
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+int ntfs_devcache_sync_lower(struct ntfs_device *dev)
+{
+	struct DEVICE_CACHE *cache;
+
+	cache = dev->d_cache;
+	if (!cache)
+		return (ntfs_device_sync(dev));
+	if (!NDevDirty(dev))
+		return (0);
+	return (cache->lower->sync(dev));
+}
+
+/*
+ *		Get the device operations behind the cache
+ *
+ *	Returns NULL if the cache may hold data not yet written to the
+ *	device, which therefore cannot be accessed directly.
+ */
+
+struct ntfs_device_operations *ntfs_devcache_lower_ops(
+			struct ntfs_device *dev)
+{
+	struct DEVICE_CACHE *cache;
+
+	cache = dev->d_cache;
+	if (!cache)
+		return (dev->d_ops);
+	return (cache->writeback
+			? (struct ntfs_device_operations*)NULL
+			: cache->lower);
+}
+
+static void free_cache(struct DEVICE_CACHE *cache)
+{
+	int i;
+
+	for (i=0; i<DEVCACHE_SHARDS; i++) {
+#ifdef ENABLE_THREADS
+		if (cache->shards[i].blocks)
+			pthread_mutex_destroy(&cache->shards[i].lock);
+#endif
+		free(cache->shards[i].blocks);
+		free(cache->shards[i].hash);
+	}
+	free(cache->buffers);
+	free(cache);
+}
+
+/*
+ *		Insert a cache in front of the operations of an open device
+ *
+ *	The size is the total size of the cached blocks, in bytes.
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+int ntfs_devcache_attach(struct ntfs_device *dev, s64 size, BOOL writeback)
+{
+	struct DEVICE_CACHE *cache;
+	struct DEVCACHE_SHARD *shard;
+	s64 per_shard;
+	int hashsize;
+	int err;
+	int i, j;
+
+	if (!dev || !NDevOpen(dev) || dev->d_cache || (size <= 0)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	per_shard = size/(DEVCACHE_BLOCK_SIZE*DEVCACHE_SHARDS);
+	if (per_shard < 4)
+		per_shard = 4;
+	if (per_shard > 0x1000000) {
+		errno = EINVAL;
+		return (-1);
+	}
+	hashsize = 1;
+	while (hashsize < per_shard)
+		hashsize <<= 1;
+	cache = (struct DEVICE_CACHE*)ntfs_calloc(sizeof(struct DEVICE_CACHE));
+	if (!cache)
+		return (-1);
+	err = posix_memalign((void**)&cache->buffers, DEVCACHE_BLOCK_SIZE,
+			per_shard*DEVCACHE_SHARDS*DEVCACHE_BLOCK_SIZE);
+	if (err) {
+		cache->buffers = (char*)NULL;
+		free_cache(cache);
+		ntfs_log_error("Failed to allocate %lld bytes for"
+				" the device cache\n",
+				(long long)per_shard*DEVCACHE_SHARDS
+					*DEVCACHE_BLOCK_SIZE);
+		errno = err;
+		return (-1);
+	}
+	for (i=0; i<DEVCACHE_SHARDS; i++) {
+		shard = &cache->shards[i];
+		shard->hash = (struct DEVCACHE_BLOCK**)ntfs_calloc(
+				hashsize*sizeof(struct DEVCACHE_BLOCK*));
+		shard->blocks = (struct DEVCACHE_BLOCK*)ntfs_calloc(
+				per_shard*sizeof(struct DEVCACHE_BLOCK));
+		if (!shard->hash || !shard->blocks) {
+			err = errno;
+			free(shard->blocks);
+			shard->blocks = (struct DEVCACHE_BLOCK*)NULL;
+			free_cache(cache);
+			errno = err;
+			return (-1);
+		}
+#ifdef ENABLE_THREADS
+		pthread_mutex_init(&shard->lock, NULL);
+#endif
+		shard->count = per_shard;
+		shard->hashmask = hashsize - 1;
+		for (j=0; j<per_shard; j++) {
+			shard->blocks[j].blkno = -1;
+			shard->blocks[j].data = &cache->buffers[
+				(i*per_shard + j)*DEVCACHE_BLOCK_SIZE];
+		}
+	}
+	cache->lower = dev->d_ops;
+	cache->writeback = writeback;
+	dev->d_cache = cache;
+	dev->d_ops = &ntfs_devcache_ops;
+	ntfs_log_debug("Device cache of %lld bytes, %s\n",
+		(long long)per_shard*DEVCACHE_SHARDS*DEVCACHE_BLOCK_SIZE,
+		(writeback ? "write-back" : "write-through"));
+	return (0);
+}
+
+/*
+ *		The device operations, as seen through the cache
+ */
+
+static int devcache_open(struct ntfs_device *dev __attribute__((unused)),
+		int flags __attribute__((unused)))
+{
+		/* the cache is only inserted on an open device */
+	errno = EBUSY;
+	return (-1);
+}
+
+static int devcache_close(struct ntfs_device *dev)
+{
+	struct DEVICE_CACHE *cache;
+	int flushed;
+	int res;
+
+	cache = dev->d_cache;
+	flushed = ntfs_devcache_flush(dev);
+	res = cache->lower->close(dev);
+	if (!res) {
+		dev->d_ops = cache->lower;
+		dev->d_cache = (struct DEVICE_CACHE*)NULL;
+		free_cache(cache);
+		if (flushed) {
+			errno = EIO;
+			res = -1;
+		}
+	}
+	return (res);
+}
+
+static s64 devcache_seek(struct ntfs_device *dev, s64 offset, int whence)
+{
+	return (dev->d_cache->lower->seek(dev, offset, whence));
+}
+
+static s64 devcache_read(struct ntfs_device *dev, void *buf, s64 count)
+{
+	s64 pos;
+	s64 br;
+
+	pos = devcache_seek(dev, 0, SEEK_CUR);
+	if (pos < 0)
+		return (-1);
+	br = cached_pread(dev, buf, count, pos);
+	if ((br > 0) && (devcache_seek(dev, pos + br, SEEK_SET) < 0))
+		br = -1;
+	return (br);
+}
+
+static s64 devcache_write(struct ntfs_device *dev, const void *buf,
+		s64 count)
+{
+	s64 pos;
+	s64 bw;
+
+	pos = devcache_seek(dev, 0, SEEK_CUR);
+	if (pos < 0)
+		return (-1);
+	bw = cached_pwrite(dev, buf, count, pos);
+	if ((bw > 0) && (devcache_seek(dev, pos + bw, SEEK_SET) < 0))
+		bw = -1;
+	return (bw);
+}
+
+static int devcache_sync(struct ntfs_device *dev)
+{
+	if (ntfs_devcache_flush(dev))
+		return (-1);
+	return (dev->d_cache->lower->sync(dev));
+}
+
+static int devcache_stat(struct ntfs_device *dev, struct stat *buf)
+{
+	return (dev->d_cache->lower->stat(dev, buf));
+}
+
+static int devcache_ioctl(struct ntfs_device *dev, int request, void *argp)
+{
+	return (dev->d_cache->lower->ioctl(dev, request, argp));
+}
+
+/*
+ *		Batches of transfers
+ *
+ *	These are for file data, so they go directly to the device as
+ *	the big transfers do.
+ */
+
+static int devcache_pread_batch(struct ntfs_device *dev,
+		struct ntfs_device_io *ios, int count)
+{
+	struct DEVICE_CACHE *cache;
+	int i;
+
+	cache = dev->d_cache;
+	if (!cache->lower->pread_batch) {
+		errno = EOPNOTSUPP;
+		return (-1);
+	}
+	if (cache->lower->pread_batch(dev, ios, count))
+		return (-1);
+	if (cache->writeback)
+		for (i=0; i<count; i++)
+			if (ios[i].res > 0)
+				overlay_blocks(cache, ios[i].buf,
+					ios[i].res, ios[i].pos);
+	return (0);
+}
+
+static int devcache_pwrite_batch(struct ntfs_device *dev,
+		struct ntfs_device_io *ios, int count)
+{
+	struct DEVICE_CACHE *cache;
+	int i;
+
+	cache = dev->d_cache;
+	if (!cache->lower->pwrite_batch) {
+		errno = EOPNOTSUPP;
+		return (-1);
+	}
+	if (cache->lower->pwrite_batch(dev, ios, count))
+		return (-1);
+	for (i=0; i<count; i++)
+		if (ios[i].res > 0)
+			patch_blocks(cache, ios[i].buf,
+				ios[i].res, ios[i].pos);
+	return (0);
+}
+
+static struct ntfs_device_operations ntfs_devcache_ops = {
+	.open		= devcache_open,
+	.close		= devcache_close,
+	.seek		= devcache_seek,
+	.read		= devcache_read,
+	.write		= devcache_write,
+	.pread		= cached_pread,
+	.pwrite		= cached_pwrite,
+	.sync		= devcache_sync,
+	.stat		= devcache_stat,
+	.ioctl		= devcache_ioctl,
+	.pread_batch	= devcache_pread_batch,
+	.pwrite_batch	= devcache_pwrite_batch,
+};
@@ -76,6 +76,8 @@
 #include "mst.h"
 #include "debug.h"
 #include "device.h"
+#include "devcache.h"
+#include "devtrace.h"
 #include "logging.h"
 #include "misc.h"
 
@@ -94,6 +96,12 @@
 #if defined(linux) && defined(_IO) && !defined(BLKBSZSET)
 #	define BLKBSZSET _IOW(0x12,113,size_t) /* Set device block size in bytes. */
 #endif
+#if defined(linux) && defined(_IO) && !defined(BLKIOOPT)
+#	define BLKIOOPT _IO(0x12,121) /* Get optimal I/O size in bytes. */
+#endif
+#if defined(linux) && defined(_IO) && !defined(BLKPBSZGET)
+#	define BLKPBSZGET _IO(0x12,123) /* Get physical sector size in bytes. */
+#endif
 
 /**
  * ntfs_device_alloc - allocate an ntfs device structure and pre-initialize it
@@ -134,6 +142,12 @@ struct ntfs_device *ntfs_device_alloc(const char *name, const long state,
 		dev->d_private = priv_data;
 		dev->d_heads = -1;
 		dev->d_sectors_per_track = -1;
+		dev->d_cache = (struct DEVICE_CACHE*)NULL;
+		dev->d_trace = (struct DEVICE_TRACE*)NULL;
+		dev->d_reads = 0;
+		dev->d_read_bytes = 0;
+		dev->d_writes = 0;
+		dev->d_written_bytes = 0;
 	}
 	return dev;
 }
@@ -159,6 +173,8 @@ int ntfs_device_free(struct ntfs_device *dev)
 		errno = EBUSY;
 		return -1;
 	}
+	if (dev->d_trace && ntfs_devtrace_detach(dev))
+		ntfs_log_perror("Failed to write the trace of %s", dev->d_name);
 	free(dev->d_name);
 	free(dev);
 	return 0;
@@ -205,6 +221,7 @@ int ntfs_device_sync(struct ntfs_device *dev)
 s64 ntfs_pread(struct ntfs_device *dev, const s64 pos, s64 count, void *b)
 {
 	s64 br, total;
+	s64 start;
 	struct ntfs_device_operations *dops;
 
 	ntfs_log_trace("pos %lld, count %lld\n",(long long)pos,(long long)count);
@@ -218,6 +235,8 @@ s64 ntfs_pread(struct ntfs_device *dev, const s64 pos, s64 count, void *b)
 	
 	dops = dev->d_ops;
 
+	start = (dev->d_trace ? ntfs_devtrace_time() : 0);
+	__atomic_fetch_add(&dev->d_reads, 1, __ATOMIC_RELAXED);
 	for (total = 0; count; count -= br, total += br) {
 		br = dops->pread(dev, (char*)b + total, count, pos + total);
 		/* If everything ok, continue. */
@@ -225,10 +244,18 @@ s64 ntfs_pread(struct ntfs_device *dev, const s64 pos, s64 count, void *b)
 			continue;
 		/* If EOF or error return number of bytes read. */
 		if (!br || total)
-			return total;
+			break;
 		/* Nothing read and error, return error status. */
-		return br;
+		total = br;
+		break;
 	}
+	if (dev->d_trace)
+		ntfs_devtrace_record(dev, NTFS_IOTRACE_READ, pos,
+				(total > 0 ? total : 0) + count, start,
+				count != 0);
+	if (total > 0)
+		__atomic_fetch_add(&dev->d_read_bytes, total,
+				__ATOMIC_RELAXED);
 	/* Finally, return the number of bytes read. */
 	return total;
 }
@@ -256,6 +283,7 @@ s64 ntfs_pwrite(struct ntfs_device *dev, const s64 pos, s64 count,
 		const void *b)
 {
 	s64 written, total, ret = -1;
+	s64 start;
 	struct ntfs_device_operations *dops;
 
 	ntfs_log_trace("pos %lld, count %lld\n",(long long)pos,(long long)count);
@@ -274,6 +302,7 @@ s64 ntfs_pwrite(struct ntfs_device *dev, const s64 pos, s64 count,
 	dops = dev->d_ops;
 
 	NDevSetDirty(dev);
+	start = (dev->d_trace ? ntfs_devtrace_time() : 0);
 	for (total = 0; count; count -= written, total += written) {
 		written = dops->pwrite(dev, (const char*)b + total, count,
 				       pos + total);
@@ -289,6 +318,14 @@ s64 ntfs_pwrite(struct ntfs_device *dev, const s64 pos, s64 count,
 		total = written;
 		break;
 	}
+	if (dev->d_trace)
+		ntfs_devtrace_record(dev, NTFS_IOTRACE_WRITE, pos,
+				(total > 0 ? total : 0) + count, start,
+				count != 0);
+	__atomic_fetch_add(&dev->d_writes, 1, __ATOMIC_RELAXED);
+	if (total > 0)
+		__atomic_fetch_add(&dev->d_written_bytes, total,
+				__ATOMIC_RELAXED);
 	if (NDevSync(dev) && total && dops->sync(dev)) {
 		total--; /* on sync error, return partially written */
 	}
@@ -297,6 +334,162 @@ out:
 	return ret;
 }
 
+/**
+ * ntfs_pread_batch - positioned reads of several extents from disk
+ * @dev:	device to read from
+ * @ios:	the extents to read
+ * @count:	number of extents
+ *
+ * This function reads all the extents described in @ios, as ntfs_pread()
+ * would do for each of them, but if the device supports it, the reads
+ * are all issued before waiting for any of them, so that the device
+ * can process them concurrently.
+ *
+ * The result of each read is set in its @res field : the number of
+ * bytes read (lower than requested in case of error or end of file),
+ * or a negated error code if nothing has been read.
+ *
+ * Return 0 when all the reads have been processed, or -1 with errno
+ * set to EINVAL in case of invalid arguments.
+ */
+int ntfs_pread_batch(struct ntfs_device *dev, struct ntfs_device_io *ios,
+		int count)
+{
+	struct ntfs_device_io *io;
+	s64 br;
+	s64 start;
+	int i;
+
+	if (!ios || (count < 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (i=0; i<count; i++)
+		if (!ios[i].buf || (ios[i].count < 0) || (ios[i].pos < 0)) {
+			errno = EINVAL;
+			return -1;
+		}
+	start = (dev->d_trace ? ntfs_devtrace_time() : 0);
+		/* a single read would not gain anything */
+	if ((count < 2)
+	    || !dev->d_ops->pread_batch
+	    || dev->d_ops->pread_batch(dev, ios, count)) {
+		for (i=0; i<count; i++)
+			ios[i].res = 0;
+	}
+		/* account for what the batch has transferred */
+	for (i=0; i<count; i++)
+		if (ios[i].res > 0) {
+			if (dev->d_trace)
+				ntfs_devtrace_record(dev, NTFS_IOTRACE_READ,
+					ios[i].pos, ios[i].count, start,
+					ios[i].res < ios[i].count);
+			__atomic_fetch_add(&dev->d_reads, 1,
+					__ATOMIC_RELAXED);
+			__atomic_fetch_add(&dev->d_read_bytes, ios[i].res,
+					__ATOMIC_RELAXED);
+		}
+		/* complete the partial reads, as ntfs_pread() does */
+	for (i=0; i<count; i++) {
+		io = &ios[i];
+			/* let errors be reported by a plain transfer */
+		if (io->res < 0)
+			io->res = 0;
+		if ((io->res >= 0) && (io->res < io->count)) {
+			br = ntfs_pread(dev, io->pos + io->res,
+					io->count - io->res,
+					(char*)io->buf + io->res);
+			if (br > 0)
+				io->res += br;
+			else
+				if ((br < 0) && !io->res)
+					io->res = -errno;
+		}
+	}
+	return (0);
+}
+
+/**
+ * ntfs_pwrite_batch - positioned writes of several extents to disk
+ * @dev:	device to write to
+ * @ios:	the extents to write
+ * @count:	number of extents
+ *
+ * This function writes all the extents described in @ios, as
+ * ntfs_pwrite() would do for each of them, but if the device supports
+ * it, the writes are all issued before waiting for any of them.
+ *
+ * The result of each write is set in its @res field : the number of
+ * bytes written (lower than requested in case of error), or a negated
+ * error code if nothing has been written.
+ *
+ * Return 0 when all the writes have been processed, or -1 with errno
+ * set to EINVAL in case of invalid arguments, or to EROFS if the device
+ * is read-only.
+ */
+int ntfs_pwrite_batch(struct ntfs_device *dev, struct ntfs_device_io *ios,
+		int count)
+{
+	struct ntfs_device_io *io;
+	s64 written;
+	s64 start;
+	int i;
+
+	if (!ios || (count < 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (i=0; i<count; i++)
+		if (!ios[i].buf || (ios[i].count < 0) || (ios[i].pos < 0)) {
+			errno = EINVAL;
+			return -1;
+		}
+	if (NDevReadOnly(dev)) {
+		errno = EROFS;
+		return -1;
+	}
+	NDevSetDirty(dev);
+	start = (dev->d_trace ? ntfs_devtrace_time() : 0);
+		/* a single write would not gain anything */
+	if ((count < 2)
+	    || NDevSync(dev)
+	    || !dev->d_ops->pwrite_batch
+	    || dev->d_ops->pwrite_batch(dev, ios, count)) {
+		for (i=0; i<count; i++)
+			ios[i].res = 0;
+	}
+		/* account for what the batch has transferred */
+	for (i=0; i<count; i++)
+		if (ios[i].res > 0) {
+			if (dev->d_trace)
+				ntfs_devtrace_record(dev, NTFS_IOTRACE_WRITE,
+					ios[i].pos, ios[i].count, start,
+					ios[i].res < ios[i].count);
+			__atomic_fetch_add(&dev->d_writes, 1,
+					__ATOMIC_RELAXED);
+			__atomic_fetch_add(&dev->d_written_bytes, ios[i].res,
+					__ATOMIC_RELAXED);
+		}
+		/* complete the partial writes, as ntfs_pwrite() does */
+	for (i=0; i<count; i++) {
+		io = &ios[i];
+			/* let errors be reported by a plain transfer */
+		if (io->res < 0)
+			io->res = 0;
+		if ((io->res >= 0) && (io->res < io->count)) {
+			written = ntfs_pwrite(dev, io->pos + io->res,
+					io->count - io->res,
+					(char*)io->buf + io->res);
+			if (written > 0)
+				io->res += written;
+			else
+				if ((written < 0) && !io->res)
+					io->res = -errno;
+		}
+	}
+	return (0);
+}
+
 /**
  * ntfs_mst_pread - multi sector transfer (mst) positioned read
  * @dev:	device to read from
@@ -930,3 +1123,79 @@ int ntfs_device_block_size_set(struct ntfs_device *dev,
 #endif
 	return -1;
 }
+
+/**
+ * ntfs_device_io_size_get - get the preferred size of transfers to a device
+ * @dev:	open device
+ *
+ * On success, return the size in bytes of the transfers which the device
+ * @dev processes without reading and rewriting part of its storage : the
+ * optimal I/O size, such as the stripe width of a RAID array, or otherwise
+ * the physical sector size. Zero is returned when it is not known.
+ * On error return -1 with errno set to the error code.
+ *
+ * The following error codes are defined:
+ *	EINVAL		Input parameter error
+ *	EOPNOTSUPP	System does not support BLKIOOPT and BLKPBSZGET ioctls
+ *	ENOTTY		@dev is a file or a device not supporting them
+ */
+int ntfs_device_io_size_get(struct ntfs_device *dev)
+{
+	if (!dev) {
+		errno = EINVAL;
+		return -1;
+	}
+#if defined(BLKIOOPT) && defined(BLKPBSZGET)
+	{
+		unsigned int io_opt = 0;
+		unsigned int phys_size = 0;
+
+		if (!dev->d_ops->ioctl(dev, BLKIOOPT, &io_opt)
+		    && !dev->d_ops->ioctl(dev, BLKPBSZGET, &phys_size)) {
+			ntfs_log_debug("BLKIOOPT optimal I/O size = %u bytes,"
+				" BLKPBSZGET physical sector size = %u bytes\n",
+				io_opt, phys_size);
+			return (io_opt > phys_size ? io_opt : phys_size);
+		}
+	}
+#else
+	errno = EOPNOTSUPP;
+#endif
+	return -1;
+}
+
+/**
+ * ntfs_device_fd_get - get the file descriptor of a device
+ * @dev:	open device
+ *
+ * This enables a program to transfer data directly from the device,
+ * bypassing the library buffers, which is only possible when the
+ * device is accessed through the standard Unix style operations.
+ *
+ * On success, return the file descriptor.
+ * On error return -1 with errno set to the error code.
+ *
+ * The following error codes are defined:
+ *	EINVAL		Input parameter error
+ *	EOPNOTSUPP	The device is not accessed through a file descriptor,
+ *			or its transfers have alignment constraints
+ */
+int ntfs_device_fd_get(struct ntfs_device *dev)
+{
+#if !defined(NO_NTFS_DEVICE_DEFAULT_IO_OPS) && !defined(HAVE_WINDOWS_H)
+	struct ntfs_device_operations *dops;
+
+#endif
+	if (!dev || !NDevOpen(dev)) {
+		errno = EINVAL;
+		return -1;
+	}
+#if !defined(NO_NTFS_DEVICE_DEFAULT_IO_OPS) && !defined(HAVE_WINDOWS_H)
+		/* a cache holding unwritten data must not be bypassed */
+	dops = (dev->d_cache ? ntfs_devcache_lower_ops(dev) : dev->d_ops);
+	if ((dops == &ntfs_device_unix_io_ops) && !NDevDirect(dev))
+		return (*(int*)dev->d_private);
+#endif
+	errno = EOPNOTSUPP;
+	return -1;
+}
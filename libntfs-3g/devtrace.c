@@ -0,0 +1,252 @@
+/**
+ * devtrace.c : tracing of the transfers on a device
+ *
+ *      This module is part of ntfs-3g library
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
+
+#include "types.h"
+#include "device.h"
+#include "devtrace.h"
+#include "misc.h"
+#include "logging.h"
+
+/*
+ *		Tracing of the transfers on a device
+ *
+ *	When a trace is attached to a device, ntfs_pread(), ntfs_pwrite()
+ *	and their batch variants record each transfer, with its position,
+ *	size, duration and the category of the caller, so that the access
+ *	pattern generated by the library can be analyzed (see ntfsiotrace).
+ *
+ *	The category is set per thread by the attribute level, and it
+ *	is kept across the nested transfers. The records are accumulated
+ *	in a buffer which is appended to the trace file when it is full
+ *	and when the trace is detached.
+ */
+
+#define DEVTRACE_RECORDS 4096	/* records buffered before writing */
+
+struct DEVICE_TRACE {
+#ifdef ENABLE_THREADS
+	pthread_mutex_t lock;
+#endif
+	int fd;
+	int count;		/* records in buffer */
+	BOOL failed;		/* the trace file could not be written */
+	s64 start;		/* microseconds, see ntfs_devtrace_time() */
+	struct NTFS_IOTRACE_RECORD records[DEVTRACE_RECORDS];
+} ;
+
+static __thread int current_category = NTFS_IO_OTHER;
+
+/*
+ *		Set the category of the transfers from the current thread
+ *
+ *	Returns the previous category, to be restored when done
+ */
+
+int ntfs_devtrace_category(int category)
+{
+	int previous;
+
+	previous = current_category;
+	current_category = category;
+	return (previous);
+}
+
+/*
+ *		Get a monotonic time in microseconds
+ */
+
+s64 ntfs_devtrace_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((s64)ts.tv_sec*1000000 + ts.tv_nsec/1000);
+}
+
+/*
+ *		Append the buffered records to the trace file
+ *
+ *	Must be called with the trace locked
+ */
+
+static void flush_records(struct DEVICE_TRACE *trace)
+{
+	size_t size;
+	size_t done;
+	ssize_t written;
+
+	size = trace->count*sizeof(struct NTFS_IOTRACE_RECORD);
+	done = 0;
+	while (!trace->failed && (done < size)) {
+		written = write(trace->fd, (char*)trace->records + done,
+					size - done);
+		if (written > 0)
+			done += written;
+		else
+			if ((written < 0) && (errno == EINTR))
+				continue;
+			else {
+				ntfs_log_perror("Could not write the I/O trace");
+				trace->failed = TRUE;
+			}
+	}
+	trace->count = 0;
+}
+
+/*
+ *		Record a transfer
+ *
+ *	The start time is the one got by ntfs_devtrace_time() when the
+ *	transfer was submitted.
+ */
+
+void ntfs_devtrace_record(struct ntfs_device *dev, int op, s64 pos,
+			s64 count, s64 start, BOOL failed)
+{
+	struct DEVICE_TRACE *trace;
+	struct NTFS_IOTRACE_RECORD *rec;
+	s64 now;
+
+	trace = dev->d_trace;
+	now = ntfs_devtrace_time();
+#ifdef ENABLE_THREADS
+	pthread_mutex_lock(&trace->lock);
+#endif
+	rec = &trace->records[trace->count];
+	rec->time = cpu_to_le64(start - trace->start);
+	rec->pos = cpu_to_le64(pos);
+	rec->count = cpu_to_le32(count);
+	rec->duration = cpu_to_le32(now - start);
+	rec->op = op;
+	rec->category = current_category;
+	rec->failed = failed;
+	memset(rec->reserved, 0, sizeof(rec->reserved));
+	if (++trace->count >= DEVTRACE_RECORDS)
+		flush_records(trace);
+#ifdef ENABLE_THREADS
+	pthread_mutex_unlock(&trace->lock);
+#endif
+}
+
+/*
+ *		Start tracing the transfers on a device into a file
+ *
+ *	The file is truncated if it already exists.
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+int ntfs_devtrace_attach(struct ntfs_device *dev, const char *path)
+{
+	struct DEVICE_TRACE *trace;
+	struct NTFS_IOTRACE_HEADER header;
+	int err;
+
+	if (!dev || dev->d_trace || !path) {
+		errno = EINVAL;
+		return (-1);
+	}
+	trace = (struct DEVICE_TRACE*)ntfs_calloc(sizeof(struct DEVICE_TRACE));
+	if (!trace)
+		return (-1);
+	trace->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (trace->fd < 0) {
+		err = errno;
+		free(trace);
+		errno = err;
+		return (-1);
+	}
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, NTFS_IOTRACE_MAGIC, sizeof(header.magic));
+	header.record_size = const_cpu_to_le32(
+				sizeof(struct NTFS_IOTRACE_RECORD));
+	header.start = cpu_to_le64(time((time_t*)NULL));
+	if (write(trace->fd, &header, sizeof(header)) != sizeof(header)) {
+		err = (errno ? errno : EIO);
+		close(trace->fd);
+		free(trace);
+		errno = err;
+		return (-1);
+	}
+#ifdef ENABLE_THREADS
+	pthread_mutex_init(&trace->lock, NULL);
+#endif
+	trace->start = ntfs_devtrace_time();
+	dev->d_trace = trace;
+	return (0);
+}
+
+/*
+ *		Stop tracing the transfers on a device
+ *
+ *	Returns 0 if successful, -1 if the trace file could not be
+ *	fully written (with errno set)
+ */
+
+int ntfs_devtrace_detach(struct ntfs_device *dev)
+{
+	struct DEVICE_TRACE *trace;
+	int res;
+
+	trace = dev->d_trace;
+	if (!trace) {
+		errno = EINVAL;
+		return (-1);
+	}
+	dev->d_trace = (struct DEVICE_TRACE*)NULL;
+	flush_records(trace);
+	res = 0;
+	if (close(trace->fd) || trace->failed) {
+		errno = EIO;
+		res = -1;
+	}
+#ifdef ENABLE_THREADS
+	pthread_mutex_destroy(&trace->lock);
+#endif
+	free(trace);
+	return (res);
+}
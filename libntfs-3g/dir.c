@@ -53,10 +53,14 @@
 #include "volume.h"
 #include "mft.h"
 #include "index.h"
+#include "dirindex.h"
+#include "idxcache.h"
+#include "usnjrnl.h"
 #include "ntfstime.h"
 #include "lcnalloc.h"
 #include "logging.h"
 #include "cache.h"
+#include "lock.h"
 #include "misc.h"
 #include "security.h"
 #include "reparse.h"
@@ -91,13 +95,15 @@ ntfschar NTFS_INDEX_R[3] = { const_cpu_to_le16('$'), const_cpu_to_le16('R'),
 /*
  *		Pathname hashing
  *
- *	Based on first char and second char (which may be '\0')
+ *	Based on all the chars of the last component, the result
+ *	is reduced by the cache to the size of its hash index.
  */
 
 int ntfs_dir_inode_hash(const struct CACHED_GENERIC *cached)
 {
 	const char *path;
 	const unsigned char *name;
+	unsigned int val;
 
 	path = (const char*)cached->variable;
 	if (!path) {
@@ -107,8 +113,22 @@ int ntfs_dir_inode_hash(const struct CACHED_GENERIC *cached)
 	name = (const unsigned char*)strrchr(path,'/');
 	if (!name)
 		name = (const unsigned char*)path;
-	return (((name[0] << 1) + name[1] + strlen((const char*)name))
-				% (2*CACHE_INODE_SIZE));
+	for (val=0; *name; name++)
+		val = val*31 + *name;
+	return (val & 0x7fffffff);
+}
+
+/*
+ *		Inode number hashing
+ *
+ *	Secondary hash, to invalidate all the paths to an inode
+ *	without scanning the whole cache
+ */
+
+int ntfs_dir_inode_num_hash(const struct CACHED_GENERIC *cached)
+{
+	return (MREF(((const struct CACHED_INODE*)cached)->inum)
+			& 0x7fffffff);
 }
 
 /*
@@ -130,7 +150,9 @@ static int inode_cache_compare(const struct CACHED_GENERIC *cached,
  *	inode numbers are also checked, as deleting a long name may
  *	imply deleting a short name and conversely
  *
- *	Only use associated with a CACHE_NOHASH flag
+ *	Only use associated with a CACHE_NOHASH flag, or with a
+ *	CACHE_SECONDARY flag when no other inode can be designated
+ *	by a path beginning with the one compared
  */
 
 static int inode_cache_inv_compare(const struct CACHED_GENERIC *cached,
@@ -180,7 +202,7 @@ static int lookup_cache_compare(const struct CACHED_GENERIC *cached,
  *
  *	All entries with designated inode number are invalidated
  *
- *	Only use associated with a CACHE_NOHASH flag
+ *	Only use associated with a CACHE_NOHASH or CACHE_SECONDARY flag
  */
 
 static int lookup_cache_inv_compare(const struct CACHED_GENERIC *cached,
@@ -196,7 +218,8 @@ static int lookup_cache_inv_compare(const struct CACHED_GENERIC *cached,
 /*
  *		Lookup hashing
  *
- *	Based on first, second and and last char
+ *	Based on the parent directory and all the chars of the name,
+ *	the result is reduced by the cache to the size of its hash index.
  */
 
 int ntfs_dir_lookup_hash(const struct CACHED_GENERIC *cached)
@@ -211,12 +234,75 @@ int ntfs_dir_lookup_hash(const struct CACHED_GENERIC *cached)
 		ntfs_log_error("Bad lookup cache entry\n");
 		return (-1);
 	}
-	val = (name[0] << 2) + (name[1] << 1) + name[count - 1] + count;
-	return (val % (2*CACHE_LOOKUP_SIZE));
+	val = ((const struct CACHED_LOOKUP*)cached)->parent;
+	while (count--)
+		val = val*31 + *name++;
+	return (val & 0x7fffffff);
+}
+
+/*
+ *		Parent directory hashing
+ *
+ *	Secondary hash, to invalidate the entries of a directory
+ *	without scanning the whole cache
+ */
+
+int ntfs_dir_lookup_parent_hash(const struct CACHED_GENERIC *cached)
+{
+	return (((const struct CACHED_LOOKUP*)cached)->parent & 0x7fffffff);
 }
 
 #endif
 
+/*
+ *		Search a name in an index node of a directory
+ *
+ *	The entries are located once, then binary searched for the first
+ *	one which does not collate before the name, so that only a few
+ *	full collations are needed.  The name has been upcased once
+ *	for all the collations.
+ *
+ *	Returns the matching entry (*found set to TRUE),
+ *		or the entry which may lead to a child node (*found FALSE),
+ *		or NULL if the node is corrupted
+ */
+
+static INDEX_ENTRY *ntfs_dir_node_lookup(ntfs_volume *vol,
+		INDEX_HEADER *ih, u8 *index_end,
+		INDEX_ENTRY **table, int max,
+		const ntfschar *uname, const ntfschar *upuname,
+		const int uname_len,
+		IGNORE_CASE_BOOL case_sensitivity, BOOL *found)
+{
+	INDEX_ENTRY *ie;
+	int count, lo, hi, mid;
+	int rc, last;
+
+	count = ntfs_ie_table(ih, index_end, table, max);
+	if (count < 0)
+		return ((INDEX_ENTRY*)NULL);
+	lo = 0;
+	hi = count;
+	last = -1;
+	while (lo < hi) {
+		mid = (lo + hi) >> 1;
+		ie = table[mid];
+		rc = ntfs_names_full_collate_upcased(uname, upuname,
+				uname_len,
+				(ntfschar*)&ie->key.file_name.file_name,
+				ie->key.file_name.file_name_length,
+				case_sensitivity, vol->upcase, vol->upcase_len);
+		if (rc > 0)
+			lo = mid + 1;
+		else {
+			hi = mid;
+			last = rc;
+		}
+	}
+	*found = !last;
+	return (table[lo]);
+}
+
 /**
  * ntfs_inode_lookup_by_name - find an inode in a directory given its name
  * @dir_ni:	ntfs inode of the directory in which to search for the name
@@ -256,7 +342,11 @@ u64 ntfs_inode_lookup_by_name(ntfs_inode *dir_ni,
 	IGNORE_CASE_BOOL case_sensitivity;
 	u8 *index_end;
 	ntfs_attr *ia_na;
-	int eo, rc;
+	INDEX_ENTRY **table;
+	ntfschar upuname[NTFS_MAX_NAME_LEN];
+	BOOL found;
+	int eo;
+	int max;
 	u32 index_block_size;
 	u8 index_vcn_size_bits;
 
@@ -267,6 +357,23 @@ u64 ntfs_inode_lookup_by_name(ntfs_inode *dir_ni,
 		return -1;
 	}
 
+	/* No longer name can be indexed */
+	if (uname_len > NTFS_MAX_NAME_LEN) {
+		errno = ENOENT;
+		return -1;
+	}
+	/* A hot directory may have all its names in memory */
+	if (vol->dir_index
+	    && ntfs_dirindex_lookup(dir_ni, uname, uname_len, &mref)) {
+		if (mref == (u64)-1)
+			errno = ENOENT;
+		return mref;
+	}
+	mref = 0;
+	memcpy(upuname, uname, uname_len*sizeof(ntfschar));
+	ntfs_name_upcase(upuname, uname_len, vol->upcase, vol->upcase_len);
+
+	table = (INDEX_ENTRY**)NULL;
 	ctx = ntfs_attr_get_search_ctx(dir_ni, NULL);
 	if (!ctx)
 		return -1;
@@ -289,60 +396,31 @@ u64 ntfs_inode_lookup_by_name(ntfs_inode *dir_ni,
 				(unsigned)index_block_size);
 		goto put_err_out;
 	}
+	/* A table for the entries of the index root or of any index block */
+	max = (index_block_size > vol->mft_record_size
+			? index_block_size : vol->mft_record_size)
+				/ sizeof(INDEX_ENTRY_HEADER) + 1;
+	table = (INDEX_ENTRY**)ntfs_malloc(max*sizeof(INDEX_ENTRY*));
+	if (!table) {
+		eo = ENOMEM;
+		goto eo_put_err_out;
+	}
 	index_end = (u8*)&ir->index + le32_to_cpu(ir->index.index_length);
-	/* The first index entry. */
-	ie = (INDEX_ENTRY*)((u8*)&ir->index +
-			le32_to_cpu(ir->index.entries_offset));
-	/*
-	 * Loop until we exceed valid memory (corruption case) or until we
-	 * reach the last entry.
-	 */
-	for (;; ie = (INDEX_ENTRY*)((u8*)ie + le16_to_cpu(ie->length))) {
-		/* Bounds checks. */
-		if ((u8*)ie < (u8*)ctx->mrec || (u8*)ie +
-				sizeof(INDEX_ENTRY_HEADER) > index_end ||
-				(u8*)ie + le16_to_cpu(ie->key_length) >
-				index_end) {
-			ntfs_log_error("Index entry out of bounds in inode %lld"
-				       "\n", (unsigned long long)dir_ni->mft_no);
-			goto put_err_out;
-		}
-		/*
-		 * The last entry cannot contain a name. It can however contain
-		 * a pointer to a child node in the B+tree so we just break out.
-		 */
-		if (ie->ie_flags & INDEX_ENTRY_END)
-			break;
-		
-		if (!le16_to_cpu(ie->length)) {
-			ntfs_log_error("Zero length index entry in inode %lld"
-				       "\n", (unsigned long long)dir_ni->mft_no);
-			goto put_err_out;
-		}
-		/*
-		 * Not a perfect match, need to do full blown collation so we
-		 * know which way in the B+tree we have to go.
-		 */
-		rc = ntfs_names_full_collate(uname, uname_len,
-				(ntfschar*)&ie->key.file_name.file_name,
-				ie->key.file_name.file_name_length,
-				case_sensitivity, vol->upcase, vol->upcase_len);
-		/*
-		 * If uname collates before the name of the current entry, there
-		 * is definitely no such name in this index but we might need to
-		 * descend into the B+tree so we just break out of the loop.
-		 */
-		if (rc == -1)
-			break;
-		/* The names are not equal, continue the search. */
-		if (rc)
-			continue;
-		/*
-		 * Perfect match, this will never happen as the
-		 * ntfs_are_names_equal() call will have gotten a match but we
-		 * still treat it correctly.
-		 */
+	if (index_end > (u8*)ctx->mrec + vol->mft_record_size) {
+		ntfs_log_error("Index root out of bounds in inode %lld\n",
+			       (unsigned long long)dir_ni->mft_no);
+		goto put_err_out;
+	}
+	ie = ntfs_dir_node_lookup(vol, &ir->index, index_end, table, max,
+			uname, upuname, uname_len, case_sensitivity, &found);
+	if (!ie) {
+		ntfs_log_error("Index entry out of bounds in inode %lld"
+			       "\n", (unsigned long long)dir_ni->mft_no);
+		goto put_err_out;
+	}
+	if (found) {
 		mref = le64_to_cpu(ie->indexed_file);
+		free(table);
 		ntfs_attr_put_search_ctx(ctx);
 		return mref;
 	}
@@ -353,6 +431,7 @@ u64 ntfs_inode_lookup_by_name(ntfs_inode *dir_ni,
 	 * cached in mref in which case return mref.
 	 */
 	if (!(ie->ie_flags & INDEX_ENTRY_NODE)) {
+		free(table);
 		ntfs_attr_put_search_ctx(ctx);
 		if (mref)
 			return mref;
@@ -362,7 +441,7 @@ u64 ntfs_inode_lookup_by_name(ntfs_inode *dir_ni,
 	} /* Child node present, descend into it. */
 
 	/* Open the index allocation attribute. */
-	ia_na = ntfs_attr_open(dir_ni, AT_INDEX_ALLOCATION, NTFS_INDEX_I30, 4);
+	ia_na = ntfs_index_ia_open(dir_ni, NTFS_INDEX_I30, 4);
 	if (!ia_na) {
 		ntfs_log_perror("Failed to open index allocation (inode %lld)",
 				(unsigned long long)dir_ni->mft_no);
@@ -370,9 +449,9 @@ u64 ntfs_inode_lookup_by_name(ntfs_inode *dir_ni,
 	}
 
 	/* Allocate a buffer for the current index block. */
-	ia = ntfs_malloc(index_block_size);
+	ia = ntfs_index_buffer_get(vol, index_block_size);
 	if (!ia) {
-		ntfs_attr_close(ia_na);
+		ntfs_index_ia_close(ia_na);
 		goto put_err_out;
 	}
 
@@ -426,60 +505,20 @@ descend_into_child_node:
 		goto close_err_out;
 	}
 
-	/* The first index entry. */
-	ie = (INDEX_ENTRY*)((u8*)&ia->index +
-			le32_to_cpu(ia->index.entries_offset));
-	/*
-	 * Iterate similar to above big loop but applied to index buffer, thus
-	 * loop until we exceed valid memory (corruption case) or until we
-	 * reach the last entry.
-	 */
-	for (;; ie = (INDEX_ENTRY*)((u8*)ie + le16_to_cpu(ie->length))) {
-		/* Bounds check. */
-		if ((u8*)ie < (u8*)ia || (u8*)ie +
-				sizeof(INDEX_ENTRY_HEADER) > index_end ||
-				(u8*)ie + le16_to_cpu(ie->key_length) >
-				index_end) {
-			ntfs_log_error("Index entry out of bounds in directory "
-				       "inode %lld.\n", 
-				       (unsigned long long)dir_ni->mft_no);
-			errno = EIO;
-			goto close_err_out;
-		}
-		/*
-		 * The last entry cannot contain a name. It can however contain
-		 * a pointer to a child node in the B+tree so we just break out.
-		 */
-		if (ie->ie_flags & INDEX_ENTRY_END)
-			break;
-		
-		if (!le16_to_cpu(ie->length)) {
-			errno = EIO;
-			ntfs_log_error("Zero length index entry in inode %lld"
-				       "\n", (unsigned long long)dir_ni->mft_no);
-			goto close_err_out;
-		}
-		/*
-		 * Not a perfect match, need to do full blown collation so we
-		 * know which way in the B+tree we have to go.
-		 */
-		rc = ntfs_names_full_collate(uname, uname_len,
-				(ntfschar*)&ie->key.file_name.file_name,
-				ie->key.file_name.file_name_length,
-				case_sensitivity, vol->upcase, vol->upcase_len);
-		/*
-		 * If uname collates before the name of the current entry, there
-		 * is definitely no such name in this index but we might need to
-		 * descend into the B+tree so we just break out of the loop.
-		 */
-		if (rc == -1)
-			break;
-		/* The names are not equal, continue the search. */
-		if (rc)
-			continue;
+	ie = ntfs_dir_node_lookup(vol, &ia->index, index_end, table, max,
+			uname, upuname, uname_len, case_sensitivity, &found);
+	if (!ie) {
+		ntfs_log_error("Index entry out of bounds in directory "
+			       "inode %lld.\n",
+			       (unsigned long long)dir_ni->mft_no);
+		errno = EIO;
+		goto close_err_out;
+	}
+	if (found) {
 		mref = le64_to_cpu(ie->indexed_file);
-		free(ia);
-		ntfs_attr_close(ia_na);
+		ntfs_index_buffer_put(vol, ia, index_block_size);
+		free(table);
+		ntfs_index_ia_close(ia_na);
 		ntfs_attr_put_search_ctx(ctx);
 		return mref;
 	}
@@ -504,8 +543,9 @@ descend_into_child_node:
 		errno = EIO;
 		goto close_err_out;
 	}
-	free(ia);
-	ntfs_attr_close(ia_na);
+	ntfs_index_buffer_put(vol, ia, index_block_size);
+	free(table);
+	ntfs_index_ia_close(ia_na);
 	ntfs_attr_put_search_ctx(ctx);
 	/*
 	 * No child node present, return error code ENOENT, unless we have got
@@ -521,29 +561,54 @@ put_err_out:
 	eo = EIO;
 	ntfs_log_debug("Corrupt directory. Aborting lookup.\n");
 eo_put_err_out:
+	free(table);
 	ntfs_attr_put_search_ctx(ctx);
 	errno = eo;
 	return -1;
 close_err_out:
 	eo = errno;
-	free(ia);
-	ntfs_attr_close(ia_na);
+	ntfs_index_buffer_put(vol, ia, index_block_size);
+	ntfs_index_ia_close(ia_na);
 	goto eo_put_err_out;
 }
 
+/*
+ *		Translate a name to look up into a buffer able to hold
+ *	the longest name which can be indexed
+ *
+ *	A longer name is truncated to a name which cannot be found,
+ *	so that looking it up fails with ENOENT as for any name not
+ *	in the directory.
+ *
+ *	Returns the length of the translated name,
+ *		or -1 if it cannot be translated (errno set)
+ */
+
+static int ntfs_lookup_ucsname(const char *name, ntfschar *uname)
+{
+	int uname_len;
+
+	uname_len = ntfs_mbstoucs_buf(name, uname, NTFS_MAX_NAME_LEN + 1);
+	if ((uname_len < 0) && (errno == ENAMETOOLONG))
+		uname_len = NTFS_MAX_NAME_LEN + 1;
+	return (uname_len);
+}
+
 /*
  *		Lookup a file in a directory from its UTF-8 name
  *
- *	The name is first fetched from cache if one is defined
+ *	The name is first fetched from cache if one is defined.
+ *	When @uname_len is negative, the name is only translated into
+ *	@uname if it has to be searched for in the directory, otherwise
+ *	@uname already holds its translation.
  *
  *	Returns the inode number
  *		or -1 if not possible (errno tells why)
  */
 
-u64 ntfs_inode_lookup_by_mbsname(ntfs_inode *dir_ni, const char *name)
+static u64 lookup_by_mbsname(ntfs_inode *dir_ni, const char *name,
+			ntfschar *uname, int uname_len)
 {
-	int uname_len;
-	ntfschar *uname = (ntfschar*)NULL;
 	u64 inum;
 	char *cached_name;
 	const char *const_name;
@@ -570,25 +635,40 @@ u64 ntfs_inode_lookup_by_mbsname(ntfs_inode *dir_ni, const char *name)
 			item.name = const_name;
 			item.namesize = strlen(const_name) + 1;
 			item.parent = dir_ni->mft_no;
+			ntfs_cache_lock(dir_ni->vol);
 			cached = (struct CACHED_LOOKUP*)ntfs_fetch_cache(
 					dir_ni->vol->lookup_cache,
 					GENERIC(&item), lookup_cache_compare);
 			if (cached) {
 				inum = cached->inum;
+				ntfs_cache_unlock(dir_ni->vol);
 				if (inum == (u64)-1)
 					errno = ENOENT;
 			} else {
+				ntfs_cache_unlock(dir_ni->vol);
 				/* Generate unicode name. */
-				uname_len = ntfs_mbstoucs(name, &uname);
+				if (uname_len < 0)
+					uname_len = ntfs_lookup_ucsname(name,
+								uname);
 				if (uname_len >= 0) {
 					inum = ntfs_inode_lookup_by_name(dir_ni,
 							uname, uname_len);
 					item.inum = inum;
-				/* enter into cache, even if not found */
-					ntfs_enter_cache(dir_ni->vol->lookup_cache,
+				/*
+				 * enter into cache, even if not found, so
+				 * that repeated misses are not searched for
+				 */
+					if ((inum != (u64)-1)
+					    || (errno == ENOENT)) {
+						ntfs_cache_lock(dir_ni->vol);
+						ntfs_enter_cache(
+							dir_ni->vol->lookup_cache,
 							GENERIC(&item),
 							lookup_cache_compare);
-					free(uname);
+						ntfs_cache_unlock(dir_ni->vol);
+						if (inum == (u64)-1)
+							errno = ENOENT;
+					}
 				} else
 					inum = (s64)-1;
 			}
@@ -596,11 +676,12 @@ u64 ntfs_inode_lookup_by_mbsname(ntfs_inode *dir_ni, const char *name)
 #endif
 			{
 				/* Generate unicode name. */
-			uname_len = ntfs_mbstoucs(cached_name, &uname);
-			if (uname_len >= 0)
+			if (uname_len < 0)
+				uname_len = ntfs_lookup_ucsname(name, uname);
+			if (uname_len >= 0) {
 				inum = ntfs_inode_lookup_by_name(dir_ni,
 						uname, uname_len);
-			else
+			} else
 				inum = (s64)-1;
 		}
 		if (cached_name)
@@ -610,6 +691,20 @@ u64 ntfs_inode_lookup_by_mbsname(ntfs_inode *dir_ni, const char *name)
 	return (inum);
 }
 
+/*
+ *		Lookup a file in a directory from its UTF-8 name
+ *
+ *	Returns the inode number
+ *		or -1 if not possible (errno tells why)
+ */
+
+u64 ntfs_inode_lookup_by_mbsname(ntfs_inode *dir_ni, const char *name)
+{
+	ntfschar uname[NTFS_MAX_NAME_LEN + 1];
+
+	return (lookup_by_mbsname(dir_ni, name, uname, -1));
+}
+
 /*
  *		Update a cache lookup record when a name has been defined
  *
@@ -636,11 +731,13 @@ void ntfs_inode_update_mbsname(ntfs_inode *dir_ni, const char *name, u64 inum)
 			item.namesize = strlen(item.name) + 1;
 			item.parent = dir_ni->mft_no;
 			item.inum = inum;
+			ntfs_cache_lock(dir_ni->vol);
 			cached = (struct CACHED_LOOKUP*)ntfs_enter_cache(
 					dir_ni->vol->lookup_cache,
 					GENERIC(&item), lookup_cache_compare);
 			if (cached)
 				cached->inum = inum;
+			ntfs_cache_unlock(dir_ni->vol);
 			if (cached_name)
 				free(cached_name);
 		}
@@ -648,6 +745,45 @@ void ntfs_inode_update_mbsname(ntfs_inode *dir_ni, const char *name, u64 inum)
 #endif
 }
 
+/*
+ *		Forget a name in the lookup cache when it has been created
+ *
+ *	The name may have been recorded as not existing in the directory
+ */
+
+static void forget_mbsname(ntfs_inode *dir_ni, const ntfschar *name,
+			int name_len)
+{
+#if CACHE_LOOKUP_SIZE
+	struct CACHED_LOOKUP item;
+	char *mbsname;
+	char *cached_name;
+
+	mbsname = (char*)NULL;
+	if (dir_ni->vol->lookup_cache
+	    && (ntfs_ucstombs(name, name_len, &mbsname, 0) > 0)) {
+		if (!NVolCaseSensitive(dir_ni->vol)) {
+			cached_name = ntfs_uppercase_mbs(mbsname,
+				dir_ni->vol->upcase, dir_ni->vol->upcase_len);
+			item.name = cached_name;
+		} else {
+			cached_name = (char*)NULL;
+			item.name = mbsname;
+		}
+		if (item.name) {
+			item.namesize = strlen(item.name) + 1;
+			item.parent = dir_ni->mft_no;
+			ntfs_cache_lock(dir_ni->vol);
+			ntfs_invalidate_cache(dir_ni->vol->lookup_cache,
+					GENERIC(&item), lookup_cache_compare, 0);
+			ntfs_cache_unlock(dir_ni->vol);
+		}
+		free(cached_name);
+		free(mbsname);
+	}
+#endif
+}
+
 /**
  * ntfs_pathname_to_inode - Find the inode which represents the given pathname
  * @vol:       An ntfs volume obtained from ntfs_mount
@@ -669,7 +805,7 @@ ntfs_inode *ntfs_pathname_to_inode(ntfs_volume *vol, ntfs_inode *parent,
 	char *p, *q;
 	ntfs_inode *ni;
 	ntfs_inode *result = NULL;
-	ntfschar *unicode = NULL;
+	ntfschar unicode[NTFS_MAX_NAME_LEN + 1];
 	char *ascii = NULL;
 #if CACHE_INODE_SIZE
 	struct CACHED_INODE item;
@@ -710,16 +846,19 @@ ntfs_inode *ntfs_pathname_to_inode(ntfs_volume *vol, ntfs_inode *parent,
 		if (*fullname) {
 			item.pathname = fullname;
 			item.varsize = strlen(fullname) + 1;
+			ntfs_cache_lock(vol);
 			cached = (struct CACHED_INODE*)ntfs_fetch_cache(
 				vol->xinode_cache, GENERIC(&item),
 				inode_cache_compare);
+			if (cached)
+				inum = MREF(cached->inum);
+			ntfs_cache_unlock(vol);
 		} else
 			cached = (struct CACHED_INODE*)NULL;
 		if (cached) {
 			/*
 			 * return opened inode if found in cache
 			 */
-			inum = MREF(cached->inum);
 			ni = ntfs_inode_open(vol, inum);
 			if (!ni) {
 				ntfs_log_debug("Cannot open inode %llu: %s.\n",
@@ -729,6 +868,44 @@ ntfs_inode *ntfs_pathname_to_inode(ntfs_volume *vol, ntfs_inode *parent,
 			result = ni;
 			goto out;
 		}
+			/*
+			 * fetch the inode of the longest partial path
+			 * from cache, so that only the names beyond it
+			 * have to be searched in their directories
+			 */
+		ni = (ntfs_inode*)NULL;
+		q = fullname + strlen(fullname);
+		while (!ni && (q > fullname)) {
+			do {
+				q--;
+			} while ((q > fullname) && (*q != PATH_SEP));
+			if (q == fullname)
+				break;
+			*q = '\0';
+			item.pathname = fullname;
+			item.varsize = strlen(fullname) + 1;
+			ntfs_cache_lock(vol);
+			cached = (struct CACHED_INODE*)ntfs_fetch_cache(
+				vol->xinode_cache, GENERIC(&item),
+				inode_cache_compare);
+			if (cached)
+				inum = MREF(cached->inum);
+			ntfs_cache_unlock(vol);
+			*q = PATH_SEP;
+			if (cached) {
+				ni = ntfs_inode_open(vol, inum);
+				if (!ni) {
+					ntfs_log_debug("Cannot open inode %llu: %s.\n",
+						(unsigned long long)inum, p);
+					err = EIO;
+					goto out;
+				}
+				p = q;
+				while (*p == PATH_SEP)
+					p++;
+			}
+		}
+		if (!ni)
 #endif
 		ni = ntfs_inode_open(vol, FILE_root);
 		if (!ni) {
@@ -748,51 +925,41 @@ ntfs_inode *ntfs_pathname_to_inode(ntfs_volume *vol, ntfs_inode *parent,
 		}
 #if CACHE_INODE_SIZE
 			/*
-			 * fetch inode for partial path from cache
+			 * the longer partial paths are known not to be
+			 * in cache : translate, search, then
+			 * insert into cache if found
 			 */
-		cached = (struct CACHED_INODE*)NULL;
-		if (!parent) {
-			item.pathname = fullname;
-			item.varsize = strlen(fullname) + 1;
-			cached = (struct CACHED_INODE*)ntfs_fetch_cache(
-					vol->xinode_cache, GENERIC(&item),
-					inode_cache_compare);
-			if (cached) {
-				inum = cached->inum;
-			}
+		len = ntfs_mbstoucs_buf(p, unicode, NTFS_MAX_NAME_LEN + 1);
+		if (len < 0) {
+			err = errno;
+			if (err != ENAMETOOLONG)
+				ntfs_log_perror("Could not convert filename"
+					" to Unicode: '%s'", p);
+			goto close;
 		}
 			/*
-			 * if not in cache, translate, search, then
-			 * insert into cache if found
+			 * also gets the names known not to exist, the
+			 * translation is only used if the name has to
+			 * be searched for
 			 */
-		if (!cached) {
-			len = ntfs_mbstoucs(p, &unicode);
-			if (len < 0) {
-				ntfs_log_perror("Could not convert filename to Unicode:"
-					" '%s'", p);
-				err = errno;
-				goto close;
-			} else if (len > NTFS_MAX_NAME_LEN) {
-				err = ENAMETOOLONG;
-				goto close;
-			}
-			inum = ntfs_inode_lookup_by_name(ni, unicode, len);
-			if (!parent && (inum != (u64) -1)) {
-				item.inum = inum;
-				ntfs_enter_cache(vol->xinode_cache,
-						GENERIC(&item),
-						inode_cache_compare);
-			}
+		inum = lookup_by_mbsname(ni, p, unicode, len);
+		if (!parent && (inum != (u64) -1)) {
+			item.pathname = fullname;
+			item.varsize = strlen(fullname) + 1;
+			item.inum = inum;
+			ntfs_cache_lock(vol);
+			ntfs_enter_cache(vol->xinode_cache,
+					GENERIC(&item),
+					inode_cache_compare);
+			ntfs_cache_unlock(vol);
 		}
 #else
-		len = ntfs_mbstoucs(p, &unicode);
+		len = ntfs_mbstoucs_buf(p, unicode, NTFS_MAX_NAME_LEN + 1);
 		if (len < 0) {
-			ntfs_log_perror("Could not convert filename to Unicode:"
-					" '%s'", p);
 			err = errno;
-			goto close;
-		} else if (len > NTFS_MAX_NAME_LEN) {
-			err = ENAMETOOLONG;
+			if (err != ENAMETOOLONG)
+				ntfs_log_perror("Could not convert filename"
+					" to Unicode: '%s'", p);
 			goto close;
 		}
 		inum = ntfs_inode_lookup_by_name(ni, unicode, len);
@@ -818,9 +985,6 @@ ntfs_inode *ntfs_pathname_to_inode(ntfs_volume *vol, ntfs_inode *parent,
 			err = EIO;
 			goto close;
 		}
-	
-		free(unicode);
-		unicode = NULL;
 
 		if (q) *q++ = PATH_SEP; /* JPA */
 		p = q;
@@ -836,7 +1000,6 @@ close:
 			err = errno;
 out:
 	free(ascii);
-	free(unicode);
 	if (err)
 		errno = err;
 	return result;
@@ -867,6 +1030,10 @@ typedef enum {
 	INDEX_TYPE_ALLOCATION,	/* index allocation */
 } INDEX_TYPE;
 
+	/* max size of an Interix file, as symlink targets are limited */
+#define INTX_MAX_SIZE ((s64)(sizeof(INTX_FILE_TYPES) \
+				+ 32767*sizeof(ntfschar)))
+
 /*
  *		Decode Interix file types
  *
@@ -907,22 +1074,75 @@ static u32 ntfs_interix_types(ntfs_inode *ni)
 	return (dt_type);
 }
 
+/*
+ *		Guess the type of a file from its directory entry
+ *
+ *	The reparse tag is copied into the entries of reparse points,
+ *	unless there are extended attributes, whose size is then found
+ *	instead, and the size of Interix files tells most of them from
+ *	the plain files.
+ *
+ *	Returns NTFS_DT_UNKNOWN if the inode has to be examined.
+ */
+
+static u32 ntfs_dir_entry_guess_type(const FILE_NAME_ATTR *fn)
+{
+	FILE_ATTR_FLAGS attributes;
+	s64 size;
+	u32 dt_type;
+
+	attributes = fn->file_attributes;
+	if (attributes & FILE_ATTR_REPARSE_POINT) {
+		if ((fn->reparse_point_tag == IO_REPARSE_TAG_MOUNT_POINT)
+		    || (fn->reparse_point_tag == IO_REPARSE_TAG_SYMLINK))
+			return (NTFS_DT_LNK);
+			/* a small value may be the size of the EAs */
+		if (!(le32_to_cpu(fn->reparse_point_tag) & 0xffff0000))
+			return (NTFS_DT_UNKNOWN);
+	}
+	if ((attributes & FILE_ATTR_SYSTEM)
+	    && !(attributes & FILE_ATTR_I30_INDEX_PRESENT)) {
+		size = sle64_to_cpu(fn->data_size);
+		if (size <= 1) {
+			dt_type = NTFS_DT_REG;
+			if (!(attributes & FILE_ATTR_HIDDEN))
+				dt_type = (size ? NTFS_DT_SOCK : NTFS_DT_FIFO);
+		} else
+			if ((size < (s64)sizeof(INTX_FILE_TYPES))
+			    || (size > INTX_MAX_SIZE))
+				dt_type = NTFS_DT_REG;
+			else
+				dt_type = NTFS_DT_UNKNOWN;
+	} else
+		dt_type = (attributes & FILE_ATTR_I30_INDEX_PRESENT
+				? NTFS_DT_DIR : NTFS_DT_REG);
+	return (dt_type);
+}
+
 /*
  *		Decode file types
  *
  *	Better only use for Interix types and junctions,
  *	unneeded complexity when used for plain files or directories
  *
+ *	The type is guessed from the directory entry when possible, so
+ *	that listing a directory does not mean reading the records of
+ *	all the system files and reparse points it contains.
+ *
  *	Error cases are logged and returned as unknown.
  */
 
 static u32 ntfs_dir_entry_type(ntfs_inode *dir_ni, MFT_REF mref,
-					FILE_ATTR_FLAGS attributes)
+					const FILE_NAME_ATTR *fn)
 {
 	ntfs_inode *ni;
+	FILE_ATTR_FLAGS attributes;
 	u32 dt_type;
 
-	dt_type = NTFS_DT_UNKNOWN;
+	dt_type = ntfs_dir_entry_guess_type(fn);
+	if (dt_type != NTFS_DT_UNKNOWN)
+		return (dt_type);
+	attributes = fn->file_attributes;
 	ni = ntfs_inode_open(dir_ni->vol, mref);
 	if (ni) {
 		if ((attributes & FILE_ATTR_REPARSE_POINT)
@@ -991,7 +1211,7 @@ static int ntfs_filldir(ntfs_inode *dir_ni, s64 *pos, u8 ivcn_bits,
 		     & (FILE_ATTR_REPARSE_POINT | FILE_ATTR_SYSTEM))
 	    && !metadata)
 		dt_type = ntfs_dir_entry_type(dir_ni, mref,
-					ie->key.file_name.file_attributes);
+					&ie->key.file_name);
 	else if (ie->key.file_name.file_attributes
 		     & FILE_ATTR_I30_INDEX_PRESENT)
 		dt_type = NTFS_DT_DIR;
@@ -1108,7 +1328,9 @@ err_out:
  * Return 0 on success or -1 on error with errno set to the error code.
  *
  * Note: Index blocks are parsed in ascending vcn order, from which follows
- * that the directory entries are not returned sorted.
+ * that the directory entries are not returned sorted. Consecutive index
+ * blocks in use are read together (up to INDEX_READAHEAD_SIZE bytes), so
+ * that big directories do not need a device request per index block.
  */
 int ntfs_readdir(ntfs_inode *dir_ni, s64 *pos,
 		void *dirent, ntfs_filldir_t filldir)
@@ -1121,6 +1343,8 @@ int ntfs_readdir(ntfs_inode *dir_ni, s64 *pos,
 	INDEX_ROOT *ir;
 	INDEX_ENTRY *ie;
 	INDEX_ALLOCATION *ia = NULL;
+	u8 *ia_buf = NULL;
+	s64 ia_first, ia_count, ia_max;
 	int rc, ir_pos, bmp_buf_size, bmp_buf_pos, eo;
 	u32 index_block_size;
 	u8 index_block_size_bits, index_vcn_size_bits;
@@ -1143,7 +1367,7 @@ int ntfs_readdir(ntfs_inode *dir_ni, s64 *pos,
 			(unsigned long long)dir_ni->mft_no, (long long)*pos);
 
 	/* Open the index allocation attribute. */
-	ia_na = ntfs_attr_open(dir_ni, AT_INDEX_ALLOCATION, NTFS_INDEX_I30, 4);
+	ia_na = ntfs_index_ia_open(dir_ni, NTFS_INDEX_I30, 4);
 	if (!ia_na) {
 		if (errno != ENOENT) {
 			ntfs_log_perror("Failed to open index allocation attribute. "
@@ -1280,10 +1504,15 @@ skip_index_root:
 	if (!ia_na)
 		goto done;
 
-	/* Allocate a buffer for the current index block. */
-	ia = ntfs_malloc(index_block_size);
-	if (!ia)
+	/* Allocate a buffer for the index blocks read ahead. */
+	ia_max = INDEX_READAHEAD_SIZE >> index_block_size_bits;
+	if (ia_max < 1)
+		ia_max = 1;
+	ia_buf = ntfs_malloc(ia_max << index_block_size_bits);
+	if (!ia_buf)
 		goto err_out;
+	ia_first = 0;
+	ia_count = 0;
 
 	bmp_na = ntfs_attr_open(dir_ni, AT_BITMAP, NTFS_INDEX_I30, 4);
 	if (!bmp_na) {
@@ -1341,15 +1570,36 @@ find_next_index_buffer:
 
 	ntfs_log_debug("Handling index block 0x%llx.\n", (long long)bmp_pos);
 
-	/* Read the index block starting at bmp_pos. */
-	br = ntfs_attr_mst_pread(ia_na, bmp_pos << index_block_size_bits, 1,
-			index_block_size, ia);
-	if (br != 1) {
-		if (br != -1)
-			errno = EIO;
-		ntfs_log_perror("Failed to read index block");
-		goto err_out;
+	/*
+	 * Read the index block starting at bmp_pos, together with the
+	 * next ones in use as long as they are marked in the current
+	 * bitmap chunk, unless it has already been read.
+	 */
+	if ((bmp_pos < ia_first) || (bmp_pos >= ia_first + ia_count)) {
+		s64 cnt;
+
+		cnt = 1;
+		while ((cnt < ia_max)
+		    && (((bmp_buf_pos + cnt) >> 3) < bmp_buf_size)
+		    && (bmp[(bmp_buf_pos + cnt) >> 3]
+				& (1 << ((bmp_buf_pos + cnt) & 7)))
+		    && (((bmp_pos + cnt + 1) << index_block_size_bits)
+				<= ia_na->data_size))
+			cnt++;
+		br = ntfs_attr_mst_pread(ia_na,
+				bmp_pos << index_block_size_bits, cnt,
+				index_block_size, ia_buf);
+		if (br < 1) {
+			if (br != -1)
+				errno = EIO;
+			ntfs_log_perror("Failed to read index block");
+			goto err_out;
+		}
+		ia_first = bmp_pos;
+		ia_count = br;
 	}
+	ia = (INDEX_ALLOCATION*)(ia_buf
+		+ ((bmp_pos - ia_first) << index_block_size_bits));
 
 	ia_start = ia_pos & ~(s64)(index_block_size - 1);
 	if (sle64_to_cpu(ia->index_block_vcn) != ia_start >>
@@ -1423,12 +1673,11 @@ EOD:
 	/* We are finished, set *pos to EOD. */
 	*pos = i_size + vol->mft_record_size;
 done:
-	free(ia);
+	free(ia_buf);
 	free(bmp);
 	if (bmp_na)
 		ntfs_attr_close(bmp_na);
-	if (ia_na)
-		ntfs_attr_close(ia_na);
+	ntfs_index_ia_close(ia_na);
 	ntfs_log_debug("EOD, *pos 0x%llx, returning 0.\n", (long long)*pos);
 	return 0;
 dir_err_out:
@@ -1438,17 +1687,110 @@ err_out:
 	ntfs_log_trace("failed.\n");
 	if (ctx)
 		ntfs_attr_put_search_ctx(ctx);
-	free(ia);
+	free(ia_buf);
 	free(bmp);
 	if (bmp_na)
 		ntfs_attr_close(bmp_na);
-	if (ia_na)
-		ntfs_attr_close(ia_na);
+	ntfs_index_ia_close(ia_na);
 	errno = eo;
 	return -1;
 }
 
 
+/*
+ *		Description of an attribute to insert into a new inode
+ */
+
+struct NEW_ATTR {
+	ATTR_TYPES type;
+	const ntfschar *name;
+	u8 name_len;
+	const u8 *val;
+	u32 size;
+	ATTR_FLAGS flags;
+} ;
+
+/*
+ *		Insert the resident attributes of a new inode in one pass
+ *
+ *	The attributes have to be sorted by type, and the mft record has
+ *	to be empty, as left by ntfs_mft_record_alloc(). The records
+ *	are set up as ntfs_resident_attr_record_add() would do.
+ *
+ *	Nothing is inserted when the attributes do not all fit, so that
+ *	the caller can insert them one at a time, possibly non-resident.
+ *
+ *	Returns 0 if successful
+ *		-1 with errno ENOSPC if the attributes cannot be inserted
+ */
+
+static int new_attrs_insert(ntfs_inode *ni, const struct NEW_ATTR *attrs,
+			int count)
+{
+	MFT_RECORD *m;
+	ATTR_RECORD *a;
+	const struct NEW_ATTR *pa;
+	u32 total;
+	u32 length;
+	u16 instance;
+	int i;
+
+	m = ni->mrec;
+	a = (ATTR_RECORD*)((u8*)m + le16_to_cpu(m->attrs_offset));
+	total = le16_to_cpu(m->attrs_offset) + 8;
+	for (i=0; i<count; i++)
+		total += offsetof(ATTR_RECORD, resident_end)
+			+ ((attrs[i].name_len * sizeof(ntfschar) + 7) & ~7)
+			+ ((attrs[i].size + 7) & ~7);
+	if ((a->type != AT_END)
+	    || (total > le32_to_cpu(m->bytes_allocated))) {
+		errno = ENOSPC;
+		return (-1);
+	}
+	instance = le16_to_cpu(m->next_attr_instance);
+	for (i=0; i<count; i++) {
+		pa = &attrs[i];
+		length = offsetof(ATTR_RECORD, resident_end)
+			+ ((pa->name_len * sizeof(ntfschar) + 7) & ~7)
+			+ ((pa->size + 7) & ~7);
+		memset(a, 0, length);
+		a->type = pa->type;
+		a->length = cpu_to_le32(length);
+		a->non_resident = 0;
+		a->name_length = pa->name_len;
+		a->name_offset = (pa->name_len
+			? const_cpu_to_le16(offsetof(ATTR_RECORD, resident_end))
+			: const_cpu_to_le16(0));
+		a->flags = pa->flags;
+		a->instance = cpu_to_le16(instance);
+		instance = (instance + 1) & 0xffff;
+		a->value_length = cpu_to_le32(pa->size);
+		a->value_offset = cpu_to_le16(length - ((pa->size + 7) & ~7));
+		if (pa->val)
+			memcpy((u8*)a + le16_to_cpu(a->value_offset),
+				pa->val, pa->size);
+		if (pa->type == AT_FILE_NAME)
+			a->resident_flags = RESIDENT_ATTR_IS_INDEXED;
+		if (pa->name_len)
+			memcpy((u8*)a + le16_to_cpu(a->name_offset),
+				pa->name, sizeof(ntfschar) * pa->name_len);
+		if ((m->flags & MFT_RECORD_IS_DIRECTORY)
+		    ? pa->type == AT_INDEX_ROOT && pa->name == NTFS_INDEX_I30
+		    : pa->type == AT_DATA && pa->name == AT_UNNAMED) {
+			ni->data_size = pa->size;
+			ni->allocated_size = (pa->size + 7) & ~7;
+			set_nino_flag(ni,KnownSize);
+		}
+		a = (ATTR_RECORD*)((u8*)a + length);
+	}
+	a->type = AT_END;
+	a->length = const_cpu_to_le32(0);
+	m->bytes_in_use = cpu_to_le32(total);
+	m->next_attr_instance = cpu_to_le16(instance);
+	ntfs_inode_mark_dirty(ni);
+	return (0);
+}
+
 /**
  * __ntfs_create - create object on ntfs volume
  * @dir_ni:	ntfs inode for directory in which create new object
@@ -1489,7 +1831,14 @@ static ntfs_inode *__ntfs_create(ntfs_inode *dir_ni, le32 securid,
 	int rollback_data = 0, rollback_sd = 0;
 	FILE_NAME_ATTR *fn = NULL;
 	STANDARD_INFORMATION *si = NULL;
+	SECURITY_DESCRIPTOR_RELATIVE *sd = NULL;
+	INDEX_ROOT *ir = NULL;
+	INTX_FILE *data = NULL;
+	struct NEW_ATTR attrs[4];
+	ATTR_FLAGS data_flags;
 	int err, fn_len, si_len;
+	int sd_len = 0, ir_len = 0, data_len = 0;
+	int count;
 
 	ntfs_log_trace("Entering.\n");
 	
@@ -1558,27 +1907,18 @@ static ntfs_inode *__ntfs_create(ntfs_inode *dir_ni, le32 securid,
 	   && (dir_ni->vol->cluster_size <= MAX_COMPRESSION_CLUSTER_SIZE)
 	   && (S_ISREG(type) || S_ISDIR(type)))
 		ni->flags |= FILE_ATTR_COMPRESSED;
-	/* Add STANDARD_INFORMATION to inode. */
-	if (ntfs_attr_add(ni, AT_STANDARD_INFORMATION, AT_UNNAMED, 0,
-			(u8*)si, si_len)) {
-		err = errno;
-		ntfs_log_error("Failed to add STANDARD_INFORMATION "
-				"attribute.\n");
-		goto err_out;
-	}
-
+	/* Create the default SECURITY_DESCRIPTOR when none is inherited. */
 	if (!securid) {
-		if (ntfs_sd_add_everyone(ni)) {
+		sd = ntfs_sd_everyone(&sd_len);
+		if (!sd) {
 			err = errno;
 			goto err_out;
 		}
 	}
-	rollback_sd = 1;
 
 	if (S_ISDIR(type)) {
-		INDEX_ROOT *ir = NULL;
 		INDEX_ENTRY *ie;
-		int ir_len, index_len;
+		int index_len;
 
 		/* Create INDEX_ROOT attribute. */
 		index_len = sizeof(INDEX_HEADER) + sizeof(INDEX_ENTRY_HEADER);
@@ -1606,19 +1946,7 @@ static ntfs_inode *__ntfs_create(ntfs_inode *dir_ni, le32 securid,
 		ie->length = const_cpu_to_le16(sizeof(INDEX_ENTRY_HEADER));
 		ie->key_length = const_cpu_to_le16(0);
 		ie->ie_flags = INDEX_ENTRY_END;
-		/* Add INDEX_ROOT attribute to inode. */
-		if (ntfs_attr_add(ni, AT_INDEX_ROOT, NTFS_INDEX_I30, 4,
-				(u8*)ir, ir_len)) {
-			err = errno;
-			free(ir);
-			ntfs_log_error("Failed to add INDEX_ROOT attribute.\n");
-			goto err_out;
-		}
-		free(ir);
 	} else {
-		INTX_FILE *data;
-		int data_len;
-
 		switch (type) {
 			case S_IFBLK:
 			case S_IFCHR:
@@ -1656,16 +1984,6 @@ static ntfs_inode *__ntfs_create(ntfs_inode *dir_ni, le32 securid,
 				data_len = 0;
 				break;
 		}
-		/* Add DATA attribute to inode. */
-		if (ntfs_attr_add(ni, AT_DATA, AT_UNNAMED, 0, (u8*)data,
-				data_len)) {
-			err = errno;
-			ntfs_log_error("Failed to add DATA attribute.\n");
-			free(data);
-			goto err_out;
-		}
-		rollback_data = 1;
-		free(data);
 	}
 	/* Create FILE_NAME attribute. */
 	fn_len = sizeof(FILE_NAME_ATTR) + name_len * sizeof(ntfschar);
@@ -1690,18 +2008,113 @@ static ntfs_inode *__ntfs_create(ntfs_inode *dir_ni, le32 securid,
 	fn->last_data_change_time = ni->last_data_change_time;
 	fn->last_mft_change_time = ni->last_mft_change_time;
 	fn->last_access_time = ni->last_access_time;
-	if (ni->mrec->flags & MFT_RECORD_IS_DIRECTORY)
+	memcpy(fn->file_name, name, name_len * sizeof(ntfschar));
+
+	/*
+	 * Insert all the attributes into the new record in one pass,
+	 * they are expected to fit in the common case. The compression
+	 * flag is only set on the inode when the volume allows it.
+	 */
+	if (ni->flags & FILE_ATTR_COMPRESSED)
+		data_flags = ATTR_IS_COMPRESSED;
+	else
+		data_flags = const_cpu_to_le16(0);
+	if (S_ISDIR(type))
 		fn->data_size = fn->allocated_size = const_cpu_to_sle64(0);
 	else {
-		fn->data_size = cpu_to_sle64(ni->data_size);
-		fn->allocated_size = cpu_to_sle64(ni->allocated_size);
+		fn->data_size = cpu_to_sle64(data_len);
+		fn->allocated_size = cpu_to_sle64((data_len + 7) & ~7);
 	}
-	memcpy(fn->file_name, name, name_len * sizeof(ntfschar));
-	/* Add FILE_NAME attribute to inode. */
-	if (ntfs_attr_add(ni, AT_FILE_NAME, AT_UNNAMED, 0, (u8*)fn, fn_len)) {
-		err = errno;
-		ntfs_log_error("Failed to add FILE_NAME attribute.\n");
-		goto err_out;
+	count = 0;
+	attrs[count].type = AT_STANDARD_INFORMATION;
+	attrs[count].name = AT_UNNAMED;
+	attrs[count].name_len = 0;
+	attrs[count].val = (u8*)si;
+	attrs[count].size = si_len;
+	attrs[count++].flags = const_cpu_to_le16(0);
+	attrs[count].type = AT_FILE_NAME;
+	attrs[count].name = AT_UNNAMED;
+	attrs[count].name_len = 0;
+	attrs[count].val = (u8*)fn;
+	attrs[count].size = fn_len;
+	attrs[count++].flags = const_cpu_to_le16(0);
+	if (sd) {
+		attrs[count].type = AT_SECURITY_DESCRIPTOR;
+		attrs[count].name = AT_UNNAMED;
+		attrs[count].name_len = 0;
+		attrs[count].val = (u8*)sd;
+		attrs[count].size = sd_len;
+		attrs[count++].flags = const_cpu_to_le16(0);
+	}
+	if (S_ISDIR(type)) {
+		attrs[count].type = AT_INDEX_ROOT;
+		attrs[count].name = NTFS_INDEX_I30;
+		attrs[count].name_len = 4;
+		attrs[count].val = (u8*)ir;
+		attrs[count].size = ir_len;
+	} else {
+		attrs[count].type = AT_DATA;
+		attrs[count].name = AT_UNNAMED;
+		attrs[count].name_len = 0;
+		attrs[count].val = (u8*)data;
+		attrs[count].size = data_len;
+	}
+	attrs[count++].flags = data_flags;
+	if (!new_attrs_insert(ni, attrs, count)) {
+		rollback_sd = 1;
+		if (!S_ISDIR(type))
+			rollback_data = 1;
+	} else {
+		/*
+		 * Some attribute is too big for the record (a long symlink
+		 * target) : insert them one by one, so that the big one can
+		 * be made non-resident.
+		 */
+		if (ntfs_attr_add(ni, AT_STANDARD_INFORMATION, AT_UNNAMED, 0,
+				(u8*)si, si_len)) {
+			err = errno;
+			ntfs_log_error("Failed to add STANDARD_INFORMATION "
+					"attribute.\n");
+			goto err_out;
+		}
+		if (sd && ntfs_attr_add(ni, AT_SECURITY_DESCRIPTOR,
+				AT_UNNAMED, 0, (u8*)sd, sd_len)) {
+			err = errno;
+			ntfs_log_perror("Failed to add initial "
+					"SECURITY_DESCRIPTOR");
+			goto err_out;
+		}
+		rollback_sd = 1;
+		if (S_ISDIR(type)) {
+			/* Add INDEX_ROOT attribute to inode. */
+			if (ntfs_attr_add(ni, AT_INDEX_ROOT, NTFS_INDEX_I30, 4,
+					(u8*)ir, ir_len)) {
+				err = errno;
+				ntfs_log_error("Failed to add INDEX_ROOT "
+						"attribute.\n");
+				goto err_out;
+			}
+		} else {
+			/* Add DATA attribute to inode. */
+			if (ntfs_attr_add(ni, AT_DATA, AT_UNNAMED, 0,
+					(u8*)data, data_len)) {
+				err = errno;
+				ntfs_log_error("Failed to add DATA "
+						"attribute.\n");
+				goto err_out;
+			}
+			rollback_data = 1;
+			fn->data_size = cpu_to_sle64(ni->data_size);
+			fn->allocated_size = cpu_to_sle64(ni->allocated_size);
+		}
+		/* Add FILE_NAME attribute to inode. */
+		if (ntfs_attr_add(ni, AT_FILE_NAME, AT_UNNAMED, 0,
+				(u8*)fn, fn_len)) {
+			err = errno;
+			ntfs_log_error("Failed to add FILE_NAME "
+					"attribute.\n");
+			goto err_out;
+		}
 	}
 	/* Add FILE_NAME attribute to index. */
 	if (ntfs_index_add_filename(dir_ni, fn, MK_MREF(ni->mft_no,
@@ -1715,7 +2128,12 @@ static ntfs_inode *__ntfs_create(ntfs_inode *dir_ni, le32 securid,
 	if (S_ISDIR(type))
 		ni->mrec->flags |= MFT_RECORD_IS_DIRECTORY;
 	ntfs_inode_mark_dirty(ni);
+	forget_mbsname(dir_ni, name, name_len);
+	ntfs_usn_record(ni, dir_ni, name, name_len, USN_REASON_FILE_CREATE);
 	/* Done! */
+	free(data);
+	free(ir);
+	free(sd);
 	free(fn);
 	free(si);
 	ntfs_log_trace("Done.\n");
@@ -1742,6 +2160,9 @@ err_out:
 	if (ntfs_mft_record_free(ni->vol, ni))
 		ntfs_log_error("Failed to free MFT record.  "
 				"Leaving inconsistent metadata. Run chkdsk.\n");
+	free(data);
+	free(ir);
+	free(sd);
 	free(fn);
 	free(si);
 	errno = err;
@@ -1837,6 +2258,133 @@ no_hardlink:
 	return ret;
 }
 
+/*
+ *		Forget the cached lookups of a name being removed
+ *
+ *	The entries of the lookup cache designating the inode in the
+ *	directory and those of the inode cache designating the inode
+ *	(or the descendants of a directory being renamed) are invalidated.
+ */
+
+static void forget_names(ntfs_volume *vol, const char *pathname,
+			ntfs_inode *ni, ntfs_inode *dir_ni)
+{
+#if CACHE_INODE_SIZE
+	struct CACHED_INODE item;
+	const char *p;
+	int count;
+	int flags;
+#endif
+#if CACHE_LOOKUP_SIZE
+	struct CACHED_LOOKUP lkitem;
+#endif
+
+#if CACHE_LOOKUP_SIZE
+			/* invalidate entry in lookup cache */
+	lkitem.name = (const char*)NULL;
+	lkitem.namesize = 0;
+	lkitem.inum = ni->mft_no;
+	lkitem.parent = dir_ni->mft_no;
+	ntfs_cache_lock(vol);
+	ntfs_invalidate_cache(vol->lookup_cache, GENERIC(&lkitem),
+			lookup_cache_inv_compare, CACHE_SECONDARY);
+	ntfs_cache_unlock(vol);
+#endif
+#if CACHE_INODE_SIZE
+	if (pathname) {
+			/* invalide cache entry, even if there was an error */
+		/* Remove leading /'s. */
+		p = pathname;
+		while (*p == PATH_SEP)
+			p++;
+		if (p[0] && (p[strlen(p)-1] == PATH_SEP))
+			ntfs_log_error("Unnormalized path %s\n",pathname);
+		item.pathname = p;
+		item.varsize = strlen(p);
+	} else {
+		item.pathname = (const char*)NULL;
+		item.varsize = 0;
+	}
+	item.inum = ni->mft_no;
+		/*
+		 * Only a directory which keeps a name (being renamed)
+		 * may have descendants in cache, which have to be
+		 * found by scanning the whole cache. Otherwise all the
+		 * entries to invalidate designate the deleted inode.
+		 */
+	if (pathname
+	    && (ni->mrec->flags & MFT_RECORD_IS_DIRECTORY)
+	    && ni->mrec->link_count)
+		flags = CACHE_NOHASH;
+	else
+		flags = CACHE_SECONDARY;
+	ntfs_cache_lock(vol);
+	count = ntfs_invalidate_cache(vol->xinode_cache, GENERIC(&item),
+				inode_cache_inv_compare, flags);
+	ntfs_cache_unlock(vol);
+	if (pathname && !count)
+		ntfs_log_error("Could not delete inode cache entry for %s\n",
+			pathname);
+#endif
+}
+
+/*
+ *		Free the mft records of an inode and of its extents
+ *
+ *	The clusters of the attributes must have been freed, and the
+ *	extents attached by a walk of the attributes.
+ *	The inode is freed, even if there was an error.
+ *
+ *	Returns 0 if successful, -1 if there was an error (described
+ *		by errno)
+ */
+
+static int free_inode_records(ntfs_inode *ni)
+{
+	int err;
+#if CACHE_NIDATA_SIZE
+	int i;
+#endif
+
+	err = 0;
+#if CACHE_NIDATA_SIZE
+		/*
+		 * Disconnect extents before deleting them, so they are
+		 * not wrongly moved to cache through the chainings
+		 */
+	for (i=ni->nr_extents-1; i>=0; i--) {
+		ni->extent_nis[i]->base_ni = (ntfs_inode*)NULL;
+		ni->extent_nis[i]->nr_extents = 0;
+		if (ntfs_mft_record_free(ni->vol, ni->extent_nis[i])) {
+			err = errno;
+			ntfs_log_error("Failed to free extent MFT record.  "
+					"Leaving inconsistent metadata.\n");
+		}
+	}
+	free(ni->extent_nis);
+	ni->nr_extents = 0;
+	ni->extent_nis = (ntfs_inode**)NULL;
+#else
+	while (ni->nr_extents)
+		if (ntfs_mft_record_free(ni->vol, *(ni->extent_nis))) {
+			err = errno;
+			ntfs_log_error("Failed to free extent MFT record.  "
+					"Leaving inconsistent metadata.\n");
+		}
+#endif
+	debug_double_inode(ni->mft_no,0);
+	if (ntfs_mft_record_free(ni->vol, ni)) {
+		err = errno;
+		ntfs_log_error("Failed to free base MFT record.  "
+				"Leaving inconsistent metadata.\n");
+	}
+	if (err) {
+		errno = err;
+		return (-1);
+	}
+	return (0);
+}
+
 /**
  * ntfs_delete - delete file or directory from ntfs volume
  * @ni:		ntfs inode for object to delte
@@ -1858,18 +2406,6 @@ int ntfs_delete(ntfs_volume *vol, const char *pathname,
 	BOOL looking_for_dos_name = FALSE, looking_for_win32_name = FALSE;
 	BOOL case_sensitive_match = TRUE;
 	int err = 0;
-#if CACHE_NIDATA_SIZE
-	int i;
-#endif
-#if CACHE_INODE_SIZE
-	struct CACHED_INODE item;
-	const char *p;
-	u64 inum = (u64)-1;
-	int count;
-#endif
-#if CACHE_LOOKUP_SIZE
-	struct CACHED_LOOKUP lkitem;
-#endif
 
 	ntfs_log_trace("Entering.\n");
 	
@@ -1994,42 +2530,16 @@ search:
 	 * case there are no reference to this inode left, so we should free all
 	 * non-resident attributes and mark all MFT record as not in use.
 	 */
-#if CACHE_LOOKUP_SIZE
-			/* invalidate entry in lookup cache */
-	lkitem.name = (const char*)NULL;
-	lkitem.namesize = 0;
-	lkitem.inum = ni->mft_no;
-	lkitem.parent = dir_ni->mft_no;
-	ntfs_invalidate_cache(vol->lookup_cache, GENERIC(&lkitem),
-			lookup_cache_inv_compare, CACHE_NOHASH);
-#endif
-#if CACHE_INODE_SIZE
-	inum = ni->mft_no;
-	if (pathname) {
-			/* invalide cache entry, even if there was an error */
-		/* Remove leading /'s. */
-		p = pathname;
-		while (*p == PATH_SEP)
-			p++;
-		if (p[0] && (p[strlen(p)-1] == PATH_SEP))
-			ntfs_log_error("Unnormalized path %s\n",pathname);
-		item.pathname = p;
-		item.varsize = strlen(p);
-	} else {
-		item.pathname = (const char*)NULL;
-		item.varsize = 0;
-	}
-	item.inum = inum;
-	count = ntfs_invalidate_cache(vol->xinode_cache, GENERIC(&item),
-				inode_cache_inv_compare, CACHE_NOHASH);
-	if (pathname && !count)
-		ntfs_log_error("Could not delete inode cache entry for %s\n",
-			pathname);
-#endif
+	forget_names(vol, pathname, ni, dir_ni);
 	if (ni->mrec->link_count) {
+		ntfs_usn_record(ni, dir_ni, name, name_len,
+				USN_REASON_HARD_LINK_CHANGE);
 		ntfs_inode_update_times(ni, NTFS_UPDATE_CTIME);
 		goto ok;
 	}
+		/* the last record, the inode is not closed */
+	ntfs_usn_record(ni, dir_ni, name, name_len,
+			USN_REASON_FILE_DELETE | USN_REASON_CLOSE);
 	if (ntfs_delete_reparse_index(ni)) {
 		/*
 		 * Failed to remove the reparse index : proceed anyway
@@ -2074,37 +2584,8 @@ search:
 				"Probably leaving inconsistent metadata.\n");
 	}
 	/* All extents should be attached after attribute walk. */
-#if CACHE_NIDATA_SIZE
-		/*
-		 * Disconnect extents before deleting them, so they are
-		 * not wrongly moved to cache through the chainings
-		 */
-	for (i=ni->nr_extents-1; i>=0; i--) {
-		ni->extent_nis[i]->base_ni = (ntfs_inode*)NULL;
-		ni->extent_nis[i]->nr_extents = 0;
-		if (ntfs_mft_record_free(ni->vol, ni->extent_nis[i])) {
-			err = errno;
-			ntfs_log_error("Failed to free extent MFT record.  "
-					"Leaving inconsistent metadata.\n");
-		}
-	}
-	free(ni->extent_nis);
-	ni->nr_extents = 0;
-	ni->extent_nis = (ntfs_inode**)NULL;
-#else
-	while (ni->nr_extents)
-		if (ntfs_mft_record_free(ni->vol, *(ni->extent_nis))) {
-			err = errno;
-			ntfs_log_error("Failed to free extent MFT record.  "
-					"Leaving inconsistent metadata.\n");
-		}
-#endif
-	debug_double_inode(ni->mft_no,0);
-	if (ntfs_mft_record_free(ni->vol, ni)) {
+	if (free_inode_records(ni))
 		err = errno;
-		ntfs_log_error("Failed to free base MFT record.  "
-				"Leaving inconsistent metadata.\n");
-	}
 	ni = NULL;
 ok:	
 	ntfs_inode_update_times(dir_ni, NTFS_UPDATE_MCTIME);
@@ -2127,51 +2608,638 @@ err_out:
 	goto out;
 }
 
-/**
- * ntfs_link - create hard link for file or directory
- * @ni:		ntfs inode for object to create hard link
- * @dir_ni:	ntfs inode for directory in which new link should be placed
- * @name:	unicode name of the new link
- * @name_len:	length of the name in unicode characters
- *
- * NOTE: At present we allow creating hardlinks to directories, we use them
- * in a temporary state during rename. But it's defenitely bad idea to have
- * hard links to directories as a result of operation.
- * FIXME: Create internal  __ntfs_link that allows hard links to a directories
- * and external ntfs_link that do not. Write ntfs_rename that uses __ntfs_link.
+/*
+ *		The inodes of a tree being deleted
  *
- * Return 0 on success or -1 on error with errno set to the error code.
+ *	Each name found in a directory of the tree is recorded as the
+ *	inode number it designates, so that an inode is freed only when
+ *	all its names are within the tree.
  */
-static int ntfs_link_i(ntfs_inode *ni, ntfs_inode *dir_ni, const ntfschar *name,
-			 u8 name_len, FILE_NAME_TYPE_FLAGS nametype)
+
+struct DELETE_TREE {
+	u64 *names;		/* inode of each name, then unique inodes */
+	int *counts;		/* count of names of each unique inode */
+	s64 name_count;
+	s64 name_room;
+	u64 *dirs;		/* directories of the tree */
+	s64 dir_count;
+	s64 dir_room;
+	runlist_element *runs;	/* clusters to free */
+	s64 run_count;
+	s64 run_room;
+} ;
+
+#if CACHE_INODE_SIZE | CACHE_LOOKUP_SIZE
+
+struct CACHED_TREE {
+	struct CACHED_TREE *next;
+	struct CACHED_TREE *previous;
+	const char *variable;
+	size_t varsize;
+	int state;
+	union ALIGNMENT payload[0];
+		/* above fields must match "struct CACHED_GENERIC" */
+	const struct DELETE_TREE *tree;
+} ;
+
+#endif
+
+static int tree_inum_compare(const void *p1, const void *p2)
 {
-	FILE_NAME_ATTR *fn = NULL;
-	int fn_len, err;
+	u64 n1 = *(const u64*)p1;
+	u64 n2 = *(const u64*)p2;
 
-	ntfs_log_trace("Entering.\n");
-	
-	if (!ni || !dir_ni || !name || !name_len || 
-			ni->mft_no == dir_ni->mft_no) {
-		err = EINVAL;
-		ntfs_log_perror("ntfs_link wrong arguments");
-		goto err_out;
-	}
-	
-	if (NVolHideDotFiles(dir_ni->vol)) {
-		/* Set hidden flag according to the latest name */
-		if ((name_len > 1)
-		    && (name[0] == const_cpu_to_le16('.'))
-		    && (name[1] != const_cpu_to_le16('.')))
-			ni->flags |= FILE_ATTR_HIDDEN;
-		else
-			ni->flags &= ~FILE_ATTR_HIDDEN;
+	return (n1 < n2 ? -1 : (n1 > n2 ? 1 : 0));
+}
+
+static int tree_run_compare(const void *p1, const void *p2)
+{
+	LCN lcn1 = ((const runlist_element*)p1)->lcn;
+	LCN lcn2 = ((const runlist_element*)p2)->lcn;
+
+	return (lcn1 < lcn2 ? -1 : (lcn1 > lcn2 ? 1 : 0));
+}
+
+static BOOL tree_has(const u64 *set, s64 count, u64 inum)
+{
+	return (bsearch(&inum, set, count, sizeof(u64), tree_inum_compare)
+			!= (void*)NULL);
+}
+
+/*
+ *		Append an item to a growing array of a tree
+ */
+
+static void *tree_append(void *array, s64 *count, s64 *room, size_t size)
+{
+	void *grown;
+	s64 newroom;
+
+	if (*count >= *room) {
+		newroom = (*room ? 2*(*room) : 256);
+		grown = realloc(array, newroom*size);
+		if (!grown)
+			return ((void*)NULL);
+		array = grown;
+		*room = newroom;
 	}
-	
-	/* Create FILE_NAME attribute. */
-	fn_len = sizeof(FILE_NAME_ATTR) + name_len * sizeof(ntfschar);
-	fn = ntfs_calloc(fn_len);
-	if (!fn) {
-		err = errno;
+	(*count)++;
+	return (array);
+}
+
+/*
+ *		Record the names found in a directory of the tree
+ *
+ *	The index is scanned in the order of its blocks, and all the
+ *	names are recorded, including the hidden and system ones. The
+ *	directories are queued for being listed once, by their WIN32 or
+ *	POSIX name, the DOS names are only counted.
+ */
+
+static int tree_list_dir(struct DELETE_TREE *tree, ntfs_inode *dir_ni)
+{
+	struct INDEX_SCAN *scan;
+	INDEX_ENTRY *ie;
+	FILE_NAME_ATTR *fn;
+	u64 *names;
+	u64 *dirs;
+	int err;
+
+		/* the scan reads the index blocks from the device */
+	if (ntfs_idxcache_flush_inode(dir_ni->vol, dir_ni->mft_no))
+		return (-1);
+	scan = ntfs_index_scan_start(dir_ni, NTFS_INDEX_I30, 4);
+	if (!scan)
+		return (-1);
+	err = 0;
+	while (!err && ntfs_index_scan_next(scan, &ie)) {
+		fn = &ie->key.file_name;
+		names = (u64*)tree_append(tree->names, &tree->name_count,
+				&tree->name_room, sizeof(u64));
+		if (!names) {
+			err = errno;
+			break;
+		}
+		tree->names = names;
+		names[tree->name_count - 1] = MREF_LE(ie->indexed_file);
+		if ((fn->file_attributes & FILE_ATTR_I30_INDEX_PRESENT)
+		    && (fn->file_name_type != FILE_NAME_DOS)) {
+			dirs = (u64*)tree_append(tree->dirs, &tree->dir_count,
+				&tree->dir_room, sizeof(u64));
+			if (!dirs) {
+				err = errno;
+				break;
+			}
+			tree->dirs = dirs;
+			dirs[tree->dir_count - 1] = MREF_LE(ie->indexed_file);
+		}
+	}
+	if (ntfs_index_scan_end(scan) && !err)
+		err = errno;
+	if (err) {
+		errno = err;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ *		Record the clusters of the non-resident attributes of
+ *	an inode, and attach its extents
+ */
+
+static int tree_collect_runs(struct DELETE_TREE *tree, ntfs_inode *ni)
+{
+	ntfs_attr_search_ctx *actx;
+	runlist_element *rl;
+	runlist_element *rlhead;
+	runlist_element *runs;
+	int err;
+
+	err = 0;
+	actx = ntfs_attr_get_search_ctx(ni, NULL);
+	if (!actx)
+		return (-1);
+	while (!ntfs_attrs_walk(actx)) {
+		if (!actx->attr->non_resident)
+			continue;
+		rlhead = ntfs_mapping_pairs_decompress(ni->vol, actx->attr,
+				NULL);
+		if (!rlhead) {
+			err = errno;
+			ntfs_log_error("Failed to decompress runlist.  "
+					"Leaving inconsistent metadata.\n");
+			continue;
+		}
+		for (rl=rlhead; rl->length && !err; rl++) {
+			if (rl->lcn < 0)
+				continue;
+			runs = (runlist_element*)tree_append(tree->runs,
+					&tree->run_count, &tree->run_room,
+					sizeof(runlist_element));
+			if (runs) {
+				tree->runs = runs;
+				runs[tree->run_count - 1] = *rl;
+			} else
+				err = errno;
+		}
+		free(rlhead);
+	}
+	if (errno != ENOENT) {
+		err = errno;
+		ntfs_log_error("Attribute enumeration failed.  "
+				"Probably leaving inconsistent metadata.\n");
+	}
+	ntfs_attr_put_search_ctx(actx);
+	if (err) {
+		errno = err;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ *		Free all the clusters recorded, merging the adjacent runs
+ */
+
+static int tree_free_runs(ntfs_volume *vol, struct DELETE_TREE *tree)
+{
+	runlist_element *runs;
+	s64 i, j;
+
+	runs = (runlist_element*)tree_append(tree->runs, &tree->run_count,
+				&tree->run_room, sizeof(runlist_element));
+	if (!runs)
+		return (-1);
+	tree->runs = runs;
+	tree->run_count--;
+	qsort(runs, tree->run_count, sizeof(runlist_element),
+				tree_run_compare);
+	j = 0;
+	for (i=0; i<tree->run_count; i++) {
+		if (j && ((runs[j - 1].lcn + runs[j - 1].length)
+				== runs[i].lcn))
+			runs[j - 1].length += runs[i].length;
+		else
+			runs[j++] = runs[i];
+	}
+	runs[j].vcn = 0;
+	runs[j].lcn = LCN_ENOENT;
+	runs[j].length = 0;
+	return (ntfs_cluster_free_from_rl(vol, runs));
+}
+
+/*
+ *		Remove the names an inode has in the tree, when it has
+ *	other ones outside
+ */
+
+static int tree_unlink_names(struct DELETE_TREE *tree, ntfs_inode *ni)
+{
+	ntfs_attr_search_ctx *actx;
+	FILE_NAME_ATTR *fn;
+	int err;
+
+	err = 0;
+	actx = ntfs_attr_get_search_ctx(ni, NULL);
+	if (!actx)
+		return (-1);
+	while (!err && !ntfs_attr_lookup(AT_FILE_NAME, AT_UNNAMED, 0,
+				CASE_SENSITIVE, 0, NULL, 0, actx)) {
+		fn = (FILE_NAME_ATTR*)((u8*)actx->attr +
+				le16_to_cpu(actx->attr->value_offset));
+		if (tree_has(tree->dirs, tree->dir_count,
+				MREF_LE(fn->parent_directory))) {
+			if (ntfs_attr_record_rm(actx))
+				err = errno;
+			else {
+				ni->mrec->link_count = cpu_to_le16(
+					le16_to_cpu(ni->mrec->link_count) - 1);
+				ntfs_attr_reinit_search_ctx(actx);
+			}
+		}
+	}
+	ntfs_attr_put_search_ctx(actx);
+	ntfs_inode_mark_dirty(ni);
+	ntfs_inode_update_times(ni, NTFS_UPDATE_CTIME);
+	if (err) {
+		errno = err;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ *		Delete an inode of the tree, or only its names within the
+ *	tree if it has other ones
+ *
+ *	The clusters are only recorded, to be freed with the other ones.
+ *	The inode is always closed (or freed).
+ *
+ *	Returns 0 if the inode was freed, 1 if it was kept,
+ *		-1 if there was an error (described by errno)
+ */
+
+static int tree_delete_inode(struct DELETE_TREE *tree, ntfs_inode *ni,
+			int names)
+{
+	int err;
+
+	err = 0;
+	if (le16_to_cpu(ni->mrec->link_count) > names) {
+		ntfs_usn_record(ni, NULL, NULL, 0,
+				USN_REASON_HARD_LINK_CHANGE);
+		if (tree_unlink_names(tree, ni))
+			err = errno;
+		if (ntfs_inode_close(ni) && !err)
+			err = errno;
+		if (err) {
+			errno = err;
+			return (-1);
+		}
+		return (1);
+	}
+		/* as in ntfs_delete(), errors on indexes do not stop */
+	ntfs_usn_record(ni, NULL, NULL, 0,
+			USN_REASON_FILE_DELETE | USN_REASON_CLOSE);
+	if (ntfs_delete_reparse_index(ni))
+		err = errno;
+	if (ntfs_delete_object_id_index(ni))
+		err = errno;
+	if (ni->mrec->flags & MFT_RECORD_IS_DIRECTORY)
+		ntfs_dirindex_invalidate(ni);
+	if (tree_collect_runs(tree, ni))
+		err = errno;
+	if (free_inode_records(ni))
+		err = errno;
+	if (err) {
+		errno = err;
+		return (-1);
+	}
+	return (0);
+}
+
+#if CACHE_LOOKUP_SIZE
+
+/*
+ *		Select the lookups in directories of a deleted tree, or
+ *	which designate an inode of the tree
+ */
+
+static int lookup_cache_tree_compare(const struct CACHED_GENERIC *cached,
+			const struct CACHED_GENERIC *wanted)
+{
+	const struct CACHED_LOOKUP *c = (const struct CACHED_LOOKUP*) cached;
+	const struct DELETE_TREE *tree =
+			((const struct CACHED_TREE*)wanted)->tree;
+
+	return (!c->name
+		    || (!tree_has(tree->dirs, tree->dir_count, c->parent)
+			&& !tree_has(tree->dirs, tree->dir_count,
+					MREF(c->inum))
+			&& !tree_has(tree->names, tree->name_count,
+					MREF(c->inum))));
+}
+
+#endif
+
+#if CACHE_INODE_SIZE
+
+/*
+ *		Select the cached paths which designate an inode of a
+ *	deleted tree (the paths of the descendants designate one too)
+ */
+
+static int inode_cache_tree_compare(const struct CACHED_GENERIC *cached,
+			const struct CACHED_GENERIC *wanted)
+{
+	const struct CACHED_INODE *c = (const struct CACHED_INODE*) cached;
+	const struct DELETE_TREE *tree =
+			((const struct CACHED_TREE*)wanted)->tree;
+
+	return (!c->pathname
+		    || (!tree_has(tree->dirs, tree->dir_count, MREF(c->inum))
+			&& !tree_has(tree->names, tree->name_count,
+					MREF(c->inum))));
+}
+
+#endif
+
+/*
+ *		Forget the cached lookups related to a deleted tree
+ */
+
+static void forget_tree(ntfs_volume *vol, const struct DELETE_TREE *tree)
+{
+#if CACHE_INODE_SIZE | CACHE_LOOKUP_SIZE
+	struct CACHED_TREE item;
+
+	item.variable = (const char*)NULL;
+	item.varsize = 0;
+	item.tree = tree;
+	ntfs_cache_lock(vol);
+#if CACHE_LOOKUP_SIZE
+	ntfs_invalidate_cache(vol->lookup_cache, GENERIC(&item),
+			lookup_cache_tree_compare, CACHE_NOHASH);
+#endif
+#if CACHE_INODE_SIZE
+	ntfs_invalidate_cache(vol->xinode_cache, GENERIC(&item),
+			inode_cache_tree_compare, CACHE_NOHASH);
+#endif
+	ntfs_cache_unlock(vol);
+#endif
+		/* outdate the cached targets of symlinks */
+	vol->dir_generation++;
+}
+
+/**
+ * ntfs_delete_tree - delete a directory and all its descendants
+ * @ni:		ntfs inode of the directory to delete
+ * @dir_ni:	ntfs inode of the directory in which @ni is named
+ * @busy:	function telling whether an inode may not be deleted,
+ *		or NULL
+ * @data:	argument for @busy
+ * @count:	where to return the count of inodes freed, or NULL
+ *
+ * Unlike deleting the entries one by one, the directories are not
+ * updated : the tree is listed, its names are removed from @dir_ni,
+ * then its inodes are freed in the order of their mft records, and
+ * the clusters of all the inodes are freed together, ordered and
+ * merged, when all the records have been freed.
+ * An inode which also has names outside of the tree only loses its
+ * names within the tree.
+ *
+ * Nothing is changed if a metadata file or an inode for which @busy
+ * returns TRUE is found in the tree.
+ *
+ * @ni and @dir_ni are always closed after the call to this function
+ * (even if it failed).
+ *
+ * Return 0 on success or -1 on error with errno set to the error code.
+ */
+int ntfs_delete_tree(ntfs_inode *ni, ntfs_inode *dir_ni,
+		BOOL (*busy)(void *data, u64 mft_no), void *data, u64 *count)
+{
+	struct DELETE_TREE tree;
+	ntfs_attr_search_ctx *actx;
+	ntfs_volume *vol;
+	ntfs_inode *xni;
+	FILE_NAME_ATTR *fn;
+	u64 *counted;
+	u64 *dirs;
+	u64 inum;
+	u64 freed;
+	s64 i, j;
+	int top_names;
+	int names;
+	int res;
+	int err;
+
+	ntfs_log_trace("Entering.\n");
+
+	memset(&tree, 0, sizeof(tree));
+	freed = 0;
+	err = 0;
+	if (!ni || !dir_ni) {
+		err = EINVAL;
+		goto out;
+	}
+	if (ni->nr_extents == -1)
+		ni = ni->base_ni;
+	if (dir_ni->nr_extents == -1)
+		dir_ni = dir_ni->base_ni;
+	vol = ni->vol;
+	if (!(ni->mrec->flags & MFT_RECORD_IS_DIRECTORY)) {
+		err = ENOTDIR;
+		goto out;
+	}
+	if ((ni->mft_no < FILE_first_user)
+	    || (busy && busy(data, ni->mft_no))) {
+		err = (ni->mft_no < FILE_first_user ? EPERM : EBUSY);
+		goto out;
+	}
+		/* list the tree, breadth first */
+	dirs = (u64*)tree_append(tree.dirs, &tree.dir_count, &tree.dir_room,
+				sizeof(u64));
+	if (!dirs) {
+		err = errno;
+		goto out;
+	}
+	tree.dirs = dirs;
+	tree.dirs[0] = ni->mft_no;
+	for (i=0; (i<tree.dir_count) && !err; i++) {
+		xni = (tree.dirs[i] == ni->mft_no ? ni
+				: ntfs_inode_open(vol, tree.dirs[i]));
+		if (!xni || tree_list_dir(&tree, xni))
+			err = errno;
+		if ((xni != ni) && ntfs_inode_close(xni) && !err)
+			err = errno;
+	}
+	if (err)
+		goto out;
+		/* count the names of each inode */
+	qsort(tree.names, tree.name_count, sizeof(u64), tree_inum_compare);
+	qsort(tree.dirs, tree.dir_count, sizeof(u64), tree_inum_compare);
+	tree.counts = (int*)ntfs_malloc((tree.name_count + 1)*sizeof(int));
+	if (!tree.counts) {
+		err = errno;
+		goto out;
+	}
+	j = 0;
+	for (i=0; i<tree.name_count; i++) {
+		inum = tree.names[i];
+		if ((inum < FILE_first_user) || (busy && busy(data, inum))) {
+			err = (inum < FILE_first_user ? EPERM : EBUSY);
+			goto out;
+		}
+		if (j && (tree.names[j - 1] == inum))
+			tree.counts[j - 1]++;
+		else {
+			tree.names[j] = inum;
+			tree.counts[j++] = 1;
+		}
+	}
+	tree.name_count = j;
+		/* directories linked from outside could not be deleted */
+	for (i=0; (i<tree.dir_count) && !err; i++) {
+		if (tree.dirs[i] == ni->mft_no)
+			continue;
+		counted = (u64*)bsearch(&tree.dirs[i], tree.names,
+				tree.name_count, sizeof(u64),
+				tree_inum_compare);
+		xni = ntfs_inode_open(vol, tree.dirs[i]);
+		if (!xni)
+			err = errno;
+		else {
+			if (!counted || (le16_to_cpu(xni->mrec->link_count)
+					> tree.counts[counted - tree.names]))
+				err = EMLINK;
+			if (ntfs_inode_close(xni) && !err)
+				err = errno;
+		}
+	}
+	if (err)
+		goto out;
+		/* remove the names of the tree from its parent */
+	actx = ntfs_attr_get_search_ctx(ni, NULL);
+	if (!actx) {
+		err = errno;
+		goto out;
+	}
+	top_names = 0;
+	while (!err && !ntfs_attr_lookup(AT_FILE_NAME, AT_UNNAMED, 0,
+				CASE_SENSITIVE, 0, NULL, 0, actx)) {
+		fn = (FILE_NAME_ATTR*)((u8*)actx->attr +
+				le16_to_cpu(actx->attr->value_offset));
+		if (MREF_LE(fn->parent_directory) != dir_ni->mft_no)
+			err = EMLINK;
+		top_names++;
+	}
+	ntfs_attr_reinit_search_ctx(actx);
+	while (!err && !ntfs_attr_lookup(AT_FILE_NAME, AT_UNNAMED, 0,
+				CASE_SENSITIVE, 0, NULL, 0, actx)) {
+		fn = (FILE_NAME_ATTR*)((u8*)actx->attr +
+				le16_to_cpu(actx->attr->value_offset));
+		if (ntfs_index_remove(dir_ni, ni, fn,
+				le32_to_cpu(actx->attr->value_length)))
+			err = errno;
+	}
+	ntfs_attr_put_search_ctx(actx);
+	if (err)
+		goto out;
+	ntfs_inode_update_times(dir_ni, NTFS_UPDATE_MCTIME);
+	forget_tree(vol, &tree);
+		/*
+		 * The tree is now unreachable : free the inodes in the
+		 * order of their records, the top directory last, then
+		 * the clusters of all of them.
+		 */
+	for (i=0; i<=tree.name_count; i++) {
+		if (i < tree.name_count) {
+			xni = ntfs_inode_open(vol, tree.names[i]);
+			names = tree.counts[i];
+		} else {
+			xni = ni;
+			names = top_names;
+			ni = (ntfs_inode*)NULL;
+		}
+		if (!xni)
+			res = -1;
+		else
+			res = tree_delete_inode(&tree, xni, names);
+		if (res < 0) {
+			if (!err)
+				err = errno;
+		} else
+			if (!res)
+				freed++;
+	}
+	if (tree_free_runs(vol, &tree) && !err)
+		err = errno;
+out:
+	free(tree.names);
+	free(tree.counts);
+	free(tree.dirs);
+	free(tree.runs);
+	if (ntfs_inode_close(dir_ni) && !err)
+		err = errno;
+	if (ntfs_inode_close(ni) && !err)
+		err = errno;
+	if (count)
+		*count = freed;
+	if (err) {
+		errno = err;
+		ntfs_log_debug("Could not delete tree: %s\n",
+				strerror(errno));
+		return -1;
+	}
+	ntfs_log_trace("Done.\n");
+	return 0;
+}
+
+/**
+ * ntfs_link - create hard link for file or directory
+ * @ni:		ntfs inode for object to create hard link
+ * @dir_ni:	ntfs inode for directory in which new link should be placed
+ * @name:	unicode name of the new link
+ * @name_len:	length of the name in unicode characters
+ *
+ * NOTE: At present we allow creating hardlinks to directories, though
+ * ntfs_rename() does not need them any more. But it's defenitely bad idea
+ * to have hard links to directories as a result of operation.
+ *
+ * Return 0 on success or -1 on error with errno set to the error code.
+ */
+static int ntfs_link_i(ntfs_inode *ni, ntfs_inode *dir_ni, const ntfschar *name,
+			 u8 name_len, FILE_NAME_TYPE_FLAGS nametype)
+{
+	FILE_NAME_ATTR *fn = NULL;
+	int fn_len, err;
+
+	ntfs_log_trace("Entering.\n");
+	
+	if (!ni || !dir_ni || !name || !name_len || 
+			ni->mft_no == dir_ni->mft_no) {
+		err = EINVAL;
+		ntfs_log_perror("ntfs_link wrong arguments");
+		goto err_out;
+	}
+	
+	if (NVolHideDotFiles(dir_ni->vol)) {
+		/* Set hidden flag according to the latest name */
+		if ((name_len > 1)
+		    && (name[0] == const_cpu_to_le16('.'))
+		    && (name[1] != const_cpu_to_le16('.')))
+			ni->flags |= FILE_ATTR_HIDDEN;
+		else
+			ni->flags &= ~FILE_ATTR_HIDDEN;
+	}
+	
+	/* Create FILE_NAME attribute. */
+	fn_len = sizeof(FILE_NAME_ATTR) + name_len * sizeof(ntfschar);
+	fn = ntfs_calloc(fn_len);
+	if (!fn) {
+		err = errno;
 		goto err_out;
 	}
 	fn->parent_directory = MK_LE_MREF(dir_ni->mft_no,
@@ -2212,6 +3280,7 @@ static int ntfs_link_i(ntfs_inode *ni, ntfs_inode *dir_ni, const ntfschar *name,
 			ni->mrec->link_count) + 1);
 	/* Done! */
 	ntfs_inode_mark_dirty(ni);
+	forget_mbsname(dir_ni, name, name_len);
 	free(fn);
 	ntfs_log_trace("Done.\n");
 	return 0;
@@ -2226,7 +3295,291 @@ err_out:
 int ntfs_link(ntfs_inode *ni, ntfs_inode *dir_ni, const ntfschar *name,
 		u8 name_len)
 {
-	return (ntfs_link_i(ni, dir_ni, name, name_len, FILE_NAME_POSIX));
+	int res;
+
+	res = ntfs_link_i(ni, dir_ni, name, name_len, FILE_NAME_POSIX);
+	if (!res)
+		ntfs_usn_record(ni, dir_ni, name, name_len,
+				USN_REASON_HARD_LINK_CHANGE);
+	return (res);
+}
+
+/*
+ *		Find the FILE_NAME attribute of a name in a directory
+ *
+ *	The name is first searched case sensitively, then ignoring case
+ *	(as ntfs_delete() does). When the name found has an associated
+ *	DOS name, the DOS name is removed from the index and the inode,
+ *	and the WIN32 name is returned.
+ *
+ *	Returns the FILE_NAME attribute found, with the search context
+ *		positioned on it
+ *		or NULL if there was an error (described by errno)
+ */
+
+static FILE_NAME_ATTR *find_rename_name(ntfs_inode *ni, ntfs_inode *dir_ni,
+			ntfs_attr_search_ctx *actx,
+			const ntfschar *name, u8 name_len)
+{
+	FILE_NAME_ATTR *fn;
+	IGNORE_CASE_BOOL case_sensitive;
+	BOOL case_sensitive_match;
+	BOOL found;
+	FILE_NAME_TYPE_FLAGS wanted;
+
+	found = FALSE;
+	fn = (FILE_NAME_ATTR*)NULL;
+	case_sensitive_match = TRUE;
+	do {
+		ntfs_attr_reinit_search_ctx(actx);
+		while (!found
+		    && !ntfs_attr_lookup(AT_FILE_NAME, AT_UNNAMED, 0,
+				CASE_SENSITIVE, 0, NULL, 0, actx)) {
+			fn = (FILE_NAME_ATTR*)((u8*)actx->attr +
+				le16_to_cpu(actx->attr->value_offset));
+			if (dir_ni->mft_no != MREF_LE(fn->parent_directory))
+				continue;
+			if (case_sensitive_match
+			    || ((fn->file_name_type == FILE_NAME_POSIX)
+				&& NVolCaseSensitive(ni->vol)))
+				case_sensitive = CASE_SENSITIVE;
+			else
+				case_sensitive = IGNORE_CASE;
+			found = ntfs_names_are_equal(fn->file_name,
+					fn->file_name_length, name, name_len,
+					case_sensitive, ni->vol->upcase,
+					ni->vol->upcase_len);
+		}
+		if (!found && (errno != ENOENT))
+			return ((FILE_NAME_ATTR*)NULL);
+		case_sensitive_match = !case_sensitive_match;
+	} while (!found && !case_sensitive_match);
+	if (!found) {
+		errno = ENOENT;
+		return ((FILE_NAME_ATTR*)NULL);
+	}
+	if ((fn->file_name_type == FILE_NAME_WIN32)
+	    || (fn->file_name_type == FILE_NAME_DOS)) {
+			/* drop the DOS name, then locate the WIN32 one */
+		for (wanted=FILE_NAME_DOS; ; wanted=FILE_NAME_WIN32) {
+			ntfs_attr_reinit_search_ctx(actx);
+			do {
+				if (ntfs_attr_lookup(AT_FILE_NAME, AT_UNNAMED,
+					    0, CASE_SENSITIVE, 0, NULL, 0,
+					    actx))
+					return ((FILE_NAME_ATTR*)NULL);
+				fn = (FILE_NAME_ATTR*)((u8*)actx->attr +
+					le16_to_cpu(actx->attr->value_offset));
+			} while ((fn->file_name_type != wanted)
+			    || (dir_ni->mft_no
+					!= MREF_LE(fn->parent_directory)));
+			if (wanted == FILE_NAME_WIN32)
+				break;
+			if (ntfs_index_remove(dir_ni, ni, fn,
+				    le32_to_cpu(actx->attr->value_length))
+			    || ntfs_attr_record_rm(actx))
+				return ((FILE_NAME_ATTR*)NULL);
+			ni->mrec->link_count = cpu_to_le16(le16_to_cpu(
+					ni->mrec->link_count) - 1);
+			ntfs_inode_mark_dirty(ni);
+		}
+	}
+	return (fn);
+}
+
+/*
+ *		Replace the value of the FILE_NAME attribute a search
+ *	context is positioned on
+ *
+ *	When the inode has a single name, the value is resized within
+ *	its mft record if possible. Otherwise the attribute is removed
+ *	and added again, so that the names are kept ordered.
+ *	The search context must not be used afterwards.
+ *
+ *	Returns 0 if successful, -1 if there was an error (the old
+ *		value being restored if possible)
+ */
+
+static int replace_file_name(ntfs_inode *ni, ntfs_attr_search_ctx *actx,
+			const FILE_NAME_ATTR *old_fn, u32 old_fn_len,
+			const FILE_NAME_ATTR *new_fn, u32 new_fn_len)
+{
+	int err;
+
+	if ((ni->mrec->link_count == const_cpu_to_le16(1))
+	    && !ntfs_resident_attr_value_resize(actx->mrec, actx->attr,
+							new_fn_len)) {
+		memcpy((u8*)actx->attr + le16_to_cpu(actx->attr->value_offset),
+				new_fn, new_fn_len);
+		ntfs_inode_mark_dirty(actx->ntfs_ino);
+		return (0);
+	}
+	if (ntfs_attr_record_rm(actx))
+		return (-1);
+	if (ntfs_attr_add(ni, AT_FILE_NAME, AT_UNNAMED, 0,
+				(const u8*)new_fn, new_fn_len)) {
+		err = errno;
+		if (ntfs_attr_add(ni, AT_FILE_NAME, AT_UNNAMED, 0,
+				(const u8*)old_fn, old_fn_len))
+			ntfs_log_error("Failed to restore FILE_NAME.\n");
+		errno = err;
+		return (-1);
+	}
+	return (0);
+}
+
+/**
+ * ntfs_rename - rename a file or directory, possibly to another directory
+ * @vol:	ntfs volume
+ * @pathname:	former path of the object, to update the inode cache
+ *		(may be NULL)
+ * @ni:		ntfs inode of the object to rename
+ * @old_dir_ni:	ntfs inode of the directory where the object is named
+ * @old_name:	unicode name of the object
+ * @old_name_len: length of the name in unicode characters
+ * @new_dir_ni:	ntfs inode of the directory where the object is to be
+ *		named, may be @old_dir_ni for a rename within a directory
+ * @new_name:	new unicode name of the object
+ * @new_name_len: length of the new name in unicode characters
+ *
+ * The FILE_NAME attribute is rewritten in place and the entry is moved
+ * from an index to the other, so that, unlike a link followed by an
+ * unlink, the link count never changes and no temporary hard link to a
+ * directory is created. A DOS name associated to the old name is
+ * removed, the new name is in the POSIX namespace.
+ *
+ * The new name must not exist, and the inodes are not closed.
+ *
+ * Return 0 on success or -1 on error with errno set to the error code.
+ */
+int ntfs_rename(ntfs_volume *vol, const char *pathname, ntfs_inode *ni,
+		ntfs_inode *old_dir_ni, const ntfschar *old_name,
+		u8 old_name_len, ntfs_inode *new_dir_ni,
+		const ntfschar *new_name, u8 new_name_len)
+{
+	ntfs_attr_search_ctx *actx;
+	FILE_NAME_ATTR *fn;
+	FILE_NAME_ATTR *old_fn = NULL;
+	FILE_NAME_ATTR *new_fn = NULL;
+	u32 old_fn_len;
+	u32 new_fn_len;
+	u64 mref;
+	int err;
+
+	ntfs_log_trace("Entering.\n");
+
+	if (!ni || !old_dir_ni || !new_dir_ni || !old_name || !old_name_len
+	    || !new_name || !new_name_len
+	    || (ni->mft_no == new_dir_ni->mft_no)) {
+		errno = EINVAL;
+		ntfs_log_perror("ntfs_rename wrong arguments");
+		return (-1);
+	}
+	if (ni->nr_extents == -1)
+		ni = ni->base_ni;
+	if (old_dir_ni->nr_extents == -1)
+		old_dir_ni = old_dir_ni->base_ni;
+	if (new_dir_ni->nr_extents == -1)
+		new_dir_ni = new_dir_ni->base_ni;
+	actx = ntfs_attr_get_search_ctx(ni, NULL);
+	if (!actx)
+		return (-1);
+	fn = find_rename_name(ni, old_dir_ni, actx, old_name, old_name_len);
+	if (!fn)
+		goto err_out;
+	old_fn_len = le32_to_cpu(actx->attr->value_length);
+	new_fn_len = sizeof(FILE_NAME_ATTR) + new_name_len*sizeof(ntfschar);
+	old_fn = (FILE_NAME_ATTR*)ntfs_malloc(old_fn_len);
+	new_fn = (FILE_NAME_ATTR*)ntfs_calloc(new_fn_len);
+	if (!old_fn || !new_fn)
+		goto err_out;
+	memcpy(old_fn, fn, old_fn_len);
+
+	if (NVolHideDotFiles(vol)) {
+		/* Set hidden flag according to the latest name */
+		if ((new_name_len > 1)
+		    && (new_name[0] == const_cpu_to_le16('.'))
+		    && (new_name[1] != const_cpu_to_le16('.')))
+			ni->flags |= FILE_ATTR_HIDDEN;
+		else
+			ni->flags &= ~FILE_ATTR_HIDDEN;
+	}
+	new_fn->parent_directory = MK_LE_MREF(new_dir_ni->mft_no,
+			le16_to_cpu(new_dir_ni->mrec->sequence_number));
+	new_fn->file_name_length = new_name_len;
+	new_fn->file_name_type = FILE_NAME_POSIX;
+	new_fn->file_attributes = ni->flags;
+	if (ni->mrec->flags & MFT_RECORD_IS_DIRECTORY) {
+		new_fn->file_attributes |= FILE_ATTR_I30_INDEX_PRESENT;
+		new_fn->data_size = new_fn->allocated_size
+				= const_cpu_to_sle64(0);
+	} else {
+		new_fn->allocated_size = cpu_to_sle64(ni->allocated_size);
+		new_fn->data_size = cpu_to_sle64(ni->data_size);
+	}
+	new_fn->creation_time = ni->creation_time;
+	new_fn->last_data_change_time = ni->last_data_change_time;
+	new_fn->last_mft_change_time = ni->last_mft_change_time;
+	new_fn->last_access_time = ni->last_access_time;
+	memcpy(new_fn->file_name, new_name, new_name_len*sizeof(ntfschar));
+
+		/*
+		 * Insert the new entry first, so that the object always
+		 * has a name in an index, and roll back in reverse order.
+		 */
+	mref = MK_MREF(ni->mft_no, le16_to_cpu(ni->mrec->sequence_number));
+	if (ntfs_index_add_filename(new_dir_ni, new_fn, mref)) {
+		ntfs_log_perror("Failed to add filename to the index");
+		goto err_out;
+	}
+	if (replace_file_name(ni, actx, old_fn, old_fn_len,
+				new_fn, new_fn_len)) {
+		ntfs_log_error("Failed to replace FILE_NAME attribute.\n");
+		goto rollback_index;
+	}
+	if (ntfs_index_remove(old_dir_ni, ni, old_fn, old_fn_len)) {
+		err = errno;
+		ntfs_attr_reinit_search_ctx(actx);
+		fn = find_rename_name(ni, new_dir_ni, actx,
+					new_name, new_name_len);
+		errno = err;
+		if (!fn || replace_file_name(ni, actx, new_fn, new_fn_len,
+						old_fn, old_fn_len))
+			goto rollback_failed;
+		goto rollback_index;
+	}
+	ntfs_inode_mark_dirty(ni);
+	forget_names(vol, pathname, ni, old_dir_ni);
+	forget_mbsname(new_dir_ni, new_name, new_name_len);
+	ntfs_usn_record(ni, old_dir_ni, old_name, old_name_len,
+			USN_REASON_RENAME_OLD_NAME);
+	ntfs_usn_record(ni, new_dir_ni, new_name, new_name_len,
+			USN_REASON_RENAME_NEW_NAME);
+	ntfs_inode_update_times(ni, NTFS_UPDATE_CTIME);
+	ntfs_inode_update_times(old_dir_ni, NTFS_UPDATE_MCTIME);
+	if (new_dir_ni != old_dir_ni)
+		ntfs_inode_update_times(new_dir_ni, NTFS_UPDATE_MCTIME);
+	ntfs_attr_put_search_ctx(actx);
+	free(old_fn);
+	free(new_fn);
+	ntfs_log_trace("Done.\n");
+	return (0);
+rollback_index:
+	err = errno;
+	if (ntfs_index_remove(new_dir_ni, ni, new_fn, new_fn_len)) {
+rollback_failed:
+		err = errno;
+		ntfs_log_error("Rollback failed. "
+				"Leaving inconsistent metadata.\n");
+	}
+	errno = err;
+err_out:
+	err = errno;
+	ntfs_attr_put_search_ctx(actx);
+	free(old_fn);
+	free(new_fn);
+	errno = err;
+	return (-1);
 }
 
 /*
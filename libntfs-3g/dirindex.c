@@ -0,0 +1,807 @@
+/**
+ * dirindex.c : in-memory indexes of hot directories
+ *
+ *      This module is part of ntfs-3g library
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
+
+#include "param.h"
+#include "types.h"
+#include "layout.h"
+#include "attrib.h"
+#include "inode.h"
+#include "dir.h"
+#include "volume.h"
+#include "unistr.h"
+#include "dirindex.h"
+#include "misc.h"
+#include "logging.h"
+
+/*
+ *		In-memory indexes of hot directories
+ *
+ *	Looking up a name in a huge directory implies reading several
+ *	index blocks, and the lookup cache does not help when the names
+ *	are only looked up once, or when they are not present. For the
+ *	few directories in which many names are looked up, all the names
+ *	are loaded into a hash table, so that a lookup is a single probe.
+ *
+ *	The directories are selected by counting the lookups in the
+ *	directories which need a tree walk. The count is approximate and
+ *	only kept for a few directories at a time: when a directory is
+ *	not counted and there is no free slot, all the counts are
+ *	decremented, so only the directories getting a significant share
+ *	of the lookups can reach DIRINDEX_HOT_LOOKUPS. A hot directory is
+ *	then only indexed if its index allocation is big enough.
+ *
+ *	The indexed directories stay in memory, updated by
+ *	ntfs_index_add_filename() and ntfs_index_remove(), until the
+ *	memory used exceeds the budget defined when attaching the cache,
+ *	the least recently used directories being then dropped.
+ *	The MFT record sequence number of each directory is checked, so
+ *	that a deleted directory whose record is reused is not mistaken
+ *	for the new one.
+ *
+ *	Lookups may be done concurrently while holding the volume lock in
+ *	shared mode, so the cache has its own lock, which is released
+ *	while the index of a directory is being loaded. Changes to the
+ *	directories are done with the volume lock held in exclusive mode.
+ */
+
+struct DIRINDEX_ENTRY {
+	struct DIRINDEX_ENTRY *next;	/* next entry in hash chain */
+	u64 mref;			/* as recorded in the index */
+	u32 hash;			/* hash of the upcased name */
+	u8 name_len;
+	ntfschar name[0];
+} ;
+
+struct DIRINDEX {
+	struct DIRINDEX *next;		/* next directory in cache */
+	u64 mft_no;
+	le16 sequence_number;		/* to detect a reused record */
+	u32 count;			/* count of names */
+	u32 hashmask;
+	struct DIRINDEX_ENTRY **hash;
+	s64 size;			/* memory used */
+	unsigned long used;		/* time of last use */
+} ;
+
+struct DIRINDEX_CANDIDATE {
+	u64 mft_no;
+	int lookups;			/* zero if the slot is free */
+	BOOL loading;
+} ;
+
+struct DIRINDEX_CACHE {
+#ifdef ENABLE_THREADS
+	pthread_mutex_t lock;
+#endif
+	struct DIRINDEX *dirs;
+	struct DIRINDEX_CANDIDATE candidates[DIRINDEX_CANDIDATES];
+	s64 budget;
+	s64 size;			/* memory used by all directories */
+	unsigned long clock;
+	unsigned long lookups;
+	unsigned long hits;
+	unsigned long loads;
+	unsigned long drops;
+} ;
+
+static void dirindex_lock(struct DIRINDEX_CACHE *cache
+#ifndef ENABLE_THREADS
+			__attribute__((unused))
+#endif
+			)
+{
+#ifdef ENABLE_THREADS
+	pthread_mutex_lock(&cache->lock);
+#endif
+}
+
+static void dirindex_unlock(struct DIRINDEX_CACHE *cache
+#ifndef ENABLE_THREADS
+			__attribute__((unused))
+#endif
+			)
+{
+#ifdef ENABLE_THREADS
+	pthread_mutex_unlock(&cache->lock);
+#endif
+}
+
+/*
+ *		Hash a name, ignoring the case
+ */
+
+static u32 name_hash(const ntfs_volume *vol, const ntfschar *name,
+			int name_len)
+{
+	u32 h;
+	u16 c;
+	int i;
+
+	h = 2166136261U;
+	for (i=0; i<name_len; i++) {
+		c = le16_to_cpu(name[i]);
+		if (c < vol->upcase_len)
+			c = le16_to_cpu(vol->upcase[c]);
+		h = (h ^ c)*16777619U;
+	}
+	return (h);
+}
+
+static void free_dir(struct DIRINDEX *dir)
+{
+	struct DIRINDEX_ENTRY *entry;
+	u32 i;
+
+	if (dir->hash) {
+		for (i=0; i<=dir->hashmask; i++) {
+			while ((entry = dir->hash[i])) {
+				dir->hash[i] = entry->next;
+				free(entry);
+			}
+		}
+		free(dir->hash);
+	}
+	free(dir);
+}
+
+/*
+ *		Double the size of the hash table of a directory
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+static int grow_hash(struct DIRINDEX *dir)
+{
+	struct DIRINDEX_ENTRY **hash;
+	struct DIRINDEX_ENTRY *entry;
+	u32 hashmask;
+	u32 i;
+
+	hashmask = 2*dir->hashmask + 1;
+	hash = (struct DIRINDEX_ENTRY**)ntfs_calloc((hashmask + 1)
+				*sizeof(struct DIRINDEX_ENTRY*));
+	if (!hash)
+		return (-1);
+	for (i=0; i<=dir->hashmask; i++) {
+		while ((entry = dir->hash[i])) {
+			dir->hash[i] = entry->next;
+			entry->next = hash[entry->hash & hashmask];
+			hash[entry->hash & hashmask] = entry;
+		}
+	}
+	free(dir->hash);
+	dir->size += (s64)(hashmask - dir->hashmask)
+				*sizeof(struct DIRINDEX_ENTRY*);
+	dir->hash = hash;
+	dir->hashmask = hashmask;
+	return (0);
+}
+
+/*
+ *		Insert a name into the index of a directory
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+static int insert_name(const ntfs_volume *vol, struct DIRINDEX *dir,
+			const ntfschar *name, int name_len, u64 mref)
+{
+	struct DIRINDEX_ENTRY *entry;
+	size_t size;
+
+	if ((dir->count > dir->hashmask) && grow_hash(dir))
+		return (-1);
+	size = sizeof(struct DIRINDEX_ENTRY) + name_len*sizeof(ntfschar);
+	entry = (struct DIRINDEX_ENTRY*)ntfs_malloc(size);
+	if (!entry)
+		return (-1);
+	entry->mref = mref;
+	entry->hash = name_hash(vol, name, name_len);
+	entry->name_len = name_len;
+	memcpy(entry->name, name, name_len*sizeof(ntfschar));
+	entry->next = dir->hash[entry->hash & dir->hashmask];
+	dir->hash[entry->hash & dir->hashmask] = entry;
+	dir->count++;
+	dir->size += size;
+	return (0);
+}
+
+/*
+ *		Find a name in the index of a directory
+ *
+ *	When ignoring the case, several names may match, and the one
+ *	which would be met first in the directory index is selected.
+ *
+ *	Returns the matching entry, or NULL if there is none
+ */
+
+static struct DIRINDEX_ENTRY *find_name(const ntfs_volume *vol,
+			struct DIRINDEX *dir, const ntfschar *uname,
+			int uname_len, IGNORE_CASE_BOOL ic)
+{
+	struct DIRINDEX_ENTRY *entry;
+	struct DIRINDEX_ENTRY *found;
+	u32 hash;
+
+	found = (struct DIRINDEX_ENTRY*)NULL;
+	hash = name_hash(vol, uname, uname_len);
+	for (entry=dir->hash[hash & dir->hashmask]; entry;
+						entry=entry->next) {
+		if ((entry->hash != hash) || (entry->name_len != uname_len))
+			continue;
+		if (ic == CASE_SENSITIVE) {
+			if (!memcmp(entry->name, uname,
+					uname_len*sizeof(ntfschar)))
+				return (entry);
+		} else
+			if (!ntfs_names_full_collate(entry->name, uname_len,
+					uname, uname_len, IGNORE_CASE,
+					vol->upcase, vol->upcase_len)
+			    && (!found
+				|| (ntfs_names_full_collate(entry->name,
+					uname_len, found->name, uname_len,
+					CASE_SENSITIVE, vol->upcase,
+					vol->upcase_len) < 0)))
+				found = entry;
+	}
+	return (found);
+}
+
+/*
+ *		Remove a directory from the cache and free it
+ */
+
+static void drop_dir(struct DIRINDEX_CACHE *cache, struct DIRINDEX *dir)
+{
+	struct DIRINDEX **pprev;
+
+	pprev = &cache->dirs;
+	while (*pprev && (*pprev != dir))
+		pprev = &(*pprev)->next;
+	if (*pprev) {
+		*pprev = dir->next;
+		cache->size -= dir->size;
+		cache->drops++;
+		free_dir(dir);
+	}
+}
+
+/*
+ *		Find a directory in the cache
+ *
+ *	A directory whose record was reused is dropped.
+ *
+ *	Returns the directory, or NULL if it is not in the cache
+ */
+
+static struct DIRINDEX *find_dir(struct DIRINDEX_CACHE *cache,
+			const ntfs_inode *dir_ni)
+{
+	struct DIRINDEX *dir;
+
+	dir = cache->dirs;
+	while (dir && (dir->mft_no != dir_ni->mft_no))
+		dir = dir->next;
+	if (dir && (dir->sequence_number != dir_ni->mrec->sequence_number)) {
+		drop_dir(cache, dir);
+		dir = (struct DIRINDEX*)NULL;
+	}
+	return (dir);
+}
+
+/*
+ *		Count a lookup in a directory which is not in the cache
+ *
+ *	Returns TRUE if the directory has become hot, in which case
+ *	the caller has to load it.
+ */
+
+static BOOL count_lookup(struct DIRINDEX_CACHE *cache, u64 mft_no)
+{
+	struct DIRINDEX_CANDIDATE *cand;
+	int i;
+
+	for (i=0; i<DIRINDEX_CANDIDATES; i++) {
+		cand = &cache->candidates[i];
+		if (cand->lookups && (cand->mft_no == mft_no)) {
+			if (cand->loading
+			    || (++cand->lookups < DIRINDEX_HOT_LOOKUPS))
+				return (FALSE);
+			cand->loading = TRUE;
+			return (TRUE);
+		}
+	}
+	for (i=0; i<DIRINDEX_CANDIDATES; i++) {
+		cand = &cache->candidates[i];
+		if (!cand->lookups) {
+			cand->mft_no = mft_no;
+			cand->lookups = 1;
+			cand->loading = FALSE;
+			return (FALSE);
+		}
+	}
+	for (i=0; i<DIRINDEX_CANDIDATES; i++) {
+		cand = &cache->candidates[i];
+		if (!cand->loading)
+			cand->lookups--;
+	}
+	return (FALSE);
+}
+
+/*
+ *		Forget about the lookups counted in a directory
+ */
+
+static void uncount_lookups(struct DIRINDEX_CACHE *cache, u64 mft_no)
+{
+	struct DIRINDEX_CANDIDATE *cand;
+	int i;
+
+	for (i=0; i<DIRINDEX_CANDIDATES; i++) {
+		cand = &cache->candidates[i];
+		if (cand->lookups && (cand->mft_no == mft_no)) {
+			cand->lookups = 0;
+			cand->loading = FALSE;
+		}
+	}
+}
+
+/*
+ *		Insert the names of an index node
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+static int load_node(const ntfs_volume *vol, struct DIRINDEX *dir,
+			INDEX_HEADER *ih, const u8 *index_end)
+{
+	INDEX_ENTRY *ie;
+	const FILE_NAME_ATTR *fn;
+	const ntfschar *name;
+
+	ie = (INDEX_ENTRY*)((u8*)ih + le32_to_cpu(ih->entries_offset));
+	while (((u8*)ie + sizeof(INDEX_ENTRY_HEADER) <= index_end)
+	    && ((u8*)ie + le16_to_cpu(ie->length) <= index_end)
+	    && (le16_to_cpu(ie->length) >= sizeof(INDEX_ENTRY_HEADER))) {
+		if (ie->ie_flags & INDEX_ENTRY_END)
+			return (0);
+		fn = &ie->key.file_name;
+		name = (const ntfschar*)((const u8*)fn + offsetof(FILE_NAME_ATTR, file_name));
+		if (((const u8*)name + fn->file_name_length*sizeof(ntfschar))
+				> ((u8*)ie + le16_to_cpu(ie->length)))
+			break;
+		if (insert_name(vol, dir, name, fn->file_name_length,
+				le64_to_cpu(ie->indexed_file)))
+			return (-1);
+		ie = (INDEX_ENTRY*)((u8*)ie + le16_to_cpu(ie->length));
+	}
+	errno = EIO;
+	return (-1);
+}
+
+/*
+ *		Insert the names of the in-use index blocks of a directory
+ *
+ *	Consecutive blocks are read together.
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+static int load_blocks(ntfs_inode *dir_ni, struct DIRINDEX *dir,
+			ntfs_attr *ia_na, u32 block_size, s64 budget)
+{
+	ntfs_volume *vol;
+	INDEX_BLOCK *ib;
+	u8 *bitmap;
+	char *buf;
+	u8 *index_end;
+	s64 bmsize;
+	s64 blocks;
+	s64 block;
+	s64 count;
+	s64 i;
+	u8 vcn_size_bits;
+	int res;
+
+	vol = dir_ni->vol;
+	if (vol->cluster_size <= block_size)
+		vcn_size_bits = vol->cluster_size_bits;
+	else
+		vcn_size_bits = NTFS_BLOCK_SIZE_BITS;
+	bitmap = (u8*)ntfs_attr_readall(dir_ni, AT_BITMAP, NTFS_INDEX_I30,
+				4, &bmsize);
+	buf = (char*)ntfs_malloc(DIRINDEX_READ_BLOCKS*block_size);
+	res = (bitmap && buf ? 0 : -1);
+	blocks = ia_na->data_size/block_size;
+	if (blocks > (bmsize << 3))
+		blocks = bmsize << 3;
+	block = 0;
+	while (!res && (block < blocks)) {
+		if (!(bitmap[block >> 3] & (1 << (block & 7)))) {
+			block++;
+			continue;
+		}
+		count = 1;
+		while (((block + count) < blocks)
+		    && (count < DIRINDEX_READ_BLOCKS)
+		    && (bitmap[(block + count) >> 3]
+				& (1 << ((block + count) & 7))))
+			count++;
+		if (ntfs_attr_mst_pread(ia_na, block*block_size, count,
+				block_size, buf) != count) {
+			errno = EIO;
+			res = -1;
+		}
+		for (i=0; !res && (i<count); i++) {
+			ib = (INDEX_BLOCK*)&buf[i*block_size];
+			index_end = (u8*)&ib->index
+					+ le32_to_cpu(ib->index.index_length);
+			if ((sle64_to_cpu(ib->index_block_vcn)
+				    != (((block + i)*block_size)
+						>> vcn_size_bits))
+			    || ((le32_to_cpu(ib->index.allocated_size) + 0x18)
+					!= block_size)
+			    || (index_end > (u8*)ib + block_size)) {
+				errno = EIO;
+				res = -1;
+			} else
+				res = load_node(vol, dir, &ib->index,
+						index_end);
+		}
+		if (!res && (dir->size > budget)) {
+			errno = EFBIG;
+			res = -1;
+		}
+		block += count;
+	}
+	free(buf);
+	free(bitmap);
+	return (res);
+}
+
+/*
+ *		Load all the names of a hot directory
+ *
+ *	Returns the loaded directory,
+ *		or NULL if it is too small, too big or unreadable
+ */
+
+static struct DIRINDEX *load_dir(ntfs_inode *dir_ni, s64 budget)
+{
+	struct DIRINDEX *dir;
+	ntfs_attr_search_ctx *ctx;
+	ntfs_attr *ia_na;
+	INDEX_ROOT *ir;
+	u8 *index_end;
+	u32 block_size;
+	int res;
+
+	dir = (struct DIRINDEX*)NULL;
+	ia_na = ntfs_attr_open(dir_ni, AT_INDEX_ALLOCATION,
+				NTFS_INDEX_I30, 4);
+	if (!ia_na)
+		return (dir);
+	ctx = (ntfs_attr_search_ctx*)NULL;
+	if (ia_na->data_size >= DIRINDEX_MIN_SIZE) {
+		ctx = ntfs_attr_get_search_ctx(dir_ni, NULL);
+		dir = (struct DIRINDEX*)ntfs_calloc(sizeof(struct DIRINDEX));
+	}
+	if (ctx && dir
+	    && !ntfs_attr_lookup(AT_INDEX_ROOT, NTFS_INDEX_I30, 4,
+				CASE_SENSITIVE, 0, NULL, 0, ctx)) {
+		dir->mft_no = dir_ni->mft_no;
+		dir->sequence_number = dir_ni->mrec->sequence_number;
+		dir->hashmask = 255;
+		dir->size = sizeof(struct DIRINDEX)
+				+ (dir->hashmask + 1)
+					*sizeof(struct DIRINDEX_ENTRY*);
+		dir->hash = (struct DIRINDEX_ENTRY**)ntfs_calloc(
+				(dir->hashmask + 1)
+					*sizeof(struct DIRINDEX_ENTRY*));
+		ir = (INDEX_ROOT*)((u8*)ctx->attr
+				+ le16_to_cpu(ctx->attr->value_offset));
+		index_end = (u8*)&ir->index
+				+ le32_to_cpu(ir->index.index_length);
+		block_size = le32_to_cpu(ir->index_block_size);
+		res = !dir->hash
+			|| (block_size < NTFS_BLOCK_SIZE)
+			|| (block_size & (block_size - 1))
+			|| (index_end > ((u8*)ctx->mrec
+					+ dir_ni->vol->mft_record_size))
+			|| load_node(dir_ni->vol, dir, &ir->index, index_end)
+			|| load_blocks(dir_ni, dir, ia_na, block_size,
+					budget);
+	} else
+		res = -1;
+	if (res && dir) {
+		free_dir(dir);
+		dir = (struct DIRINDEX*)NULL;
+	}
+	if (ctx)
+		ntfs_attr_put_search_ctx(ctx);
+	ntfs_attr_close(ia_na);
+	return (dir);
+}
+
+/*
+ *		Insert a loaded directory into the cache
+ *
+ *	The least recently used directories are dropped to stay within
+ *	the memory budget.
+ */
+
+static void insert_dir(struct DIRINDEX_CACHE *cache, struct DIRINDEX *dir)
+{
+	struct DIRINDEX *oldest;
+	struct DIRINDEX *p;
+
+	while (cache->dirs && ((cache->size + dir->size) > cache->budget)) {
+		oldest = cache->dirs;
+		for (p=oldest->next; p; p=p->next)
+			if (p->used < oldest->used)
+				oldest = p;
+		drop_dir(cache, oldest);
+	}
+	dir->used = ++cache->clock;
+	dir->next = cache->dirs;
+	cache->dirs = dir;
+	cache->size += dir->size;
+	cache->loads++;
+}
+
+/*
+ *		Look up a name in the cache
+ *
+ *	*pmref is set to the reference recorded in the index for the
+ *	name, or to (u64)-1 if the directory does not contain it.
+ *
+ *	Returns TRUE if the directory is in the cache,
+ *		FALSE if the index of the directory has to be searched
+ */
+
+BOOL ntfs_dirindex_lookup(ntfs_inode *dir_ni, const ntfschar *uname,
+			int uname_len, u64 *pmref)
+{
+	struct DIRINDEX_CACHE *cache;
+	struct DIRINDEX_ENTRY *entry;
+	struct DIRINDEX *dir;
+	IGNORE_CASE_BOOL ic;
+	BOOL found;
+
+	found = FALSE;
+	cache = dir_ni->vol->dir_index;
+	if (cache) {
+		ic = (NVolCaseSensitive(dir_ni->vol)
+				? CASE_SENSITIVE : IGNORE_CASE);
+		dirindex_lock(cache);
+		cache->lookups++;
+		dir = find_dir(cache, dir_ni);
+		if (!dir && count_lookup(cache, dir_ni->mft_no)) {
+				/* load without blocking the other lookups */
+			dirindex_unlock(cache);
+			dir = load_dir(dir_ni, cache->budget);
+			dirindex_lock(cache);
+			uncount_lookups(cache, dir_ni->mft_no);
+			if (dir)
+				insert_dir(cache, dir);
+		}
+		if (dir) {
+			entry = find_name(dir_ni->vol, dir, uname,
+						uname_len, ic);
+			*pmref = (entry ? entry->mref : (u64)-1);
+			dir->used = ++cache->clock;
+			cache->hits++;
+			found = TRUE;
+		}
+		dirindex_unlock(cache);
+	}
+	return (found);
+}
+
+/*
+ *		Record a name inserted into a directory
+ */
+
+void ntfs_dirindex_add(ntfs_inode *dir_ni, const FILE_NAME_ATTR *fn,
+			u64 mref)
+{
+	struct DIRINDEX_CACHE *cache;
+	struct DIRINDEX *dir;
+	const ntfschar *name;
+	s64 oldsize;
+
+	cache = dir_ni->vol->dir_index;
+	if (cache) {
+		dirindex_lock(cache);
+		dir = find_dir(cache, dir_ni);
+		if (dir) {
+			oldsize = dir->size;
+			name = (const ntfschar*)((const u8*)fn + offsetof(FILE_NAME_ATTR, file_name));
+			if (insert_name(dir_ni->vol, dir, name,
+					fn->file_name_length, mref))
+				drop_dir(cache, dir);
+			else
+				cache->size += dir->size - oldsize;
+		}
+		dirindex_unlock(cache);
+	}
+}
+
+/*
+ *		Record a name removed from a directory
+ */
+
+void ntfs_dirindex_remove(ntfs_inode *dir_ni, const FILE_NAME_ATTR *fn)
+{
+	struct DIRINDEX_CACHE *cache;
+	struct DIRINDEX_ENTRY **pprev;
+	struct DIRINDEX_ENTRY *entry;
+	struct DIRINDEX *dir;
+	const ntfschar *name;
+	size_t size;
+	u32 hash;
+
+	cache = dir_ni->vol->dir_index;
+	if (cache) {
+		dirindex_lock(cache);
+		dir = find_dir(cache, dir_ni);
+		if (dir) {
+			name = (const ntfschar*)((const u8*)fn + offsetof(FILE_NAME_ATTR, file_name));
+			hash = name_hash(dir_ni->vol, name,
+					fn->file_name_length);
+			pprev = &dir->hash[hash & dir->hashmask];
+			while ((entry = *pprev)
+			    && ((entry->hash != hash)
+				|| (entry->name_len != fn->file_name_length)
+				|| memcmp(entry->name, name,
+					entry->name_len*sizeof(ntfschar))))
+				pprev = &entry->next;
+			if (entry) {
+				*pprev = entry->next;
+				size = sizeof(struct DIRINDEX_ENTRY)
+					+ entry->name_len*sizeof(ntfschar);
+				dir->size -= size;
+				cache->size -= size;
+				dir->count--;
+				free(entry);
+			} else
+				/* not coherent, reload when needed */
+				drop_dir(cache, dir);
+		}
+		dirindex_unlock(cache);
+	}
+}
+
+/*
+ *		Forget about a directory whose index may have changed
+ *	without being recorded
+ */
+
+void ntfs_dirindex_invalidate(ntfs_inode *dir_ni)
+{
+	struct DIRINDEX_CACHE *cache;
+	struct DIRINDEX *dir;
+
+	cache = dir_ni->vol->dir_index;
+	if (cache) {
+		dirindex_lock(cache);
+		dir = find_dir(cache, dir_ni);
+		if (dir)
+			drop_dir(cache, dir);
+		dirindex_unlock(cache);
+	}
+}
+
+/*
+ *		Log the cache statistics
+ */
+
+void ntfs_dirindex_log(const ntfs_volume *vol)
+{
+	struct DIRINDEX_CACHE *cache;
+	struct DIRINDEX *dir;
+	int count;
+
+	cache = vol->dir_index;
+	if (cache && cache->lookups) {
+		count = 0;
+		for (dir=cache->dirs; dir; dir=dir->next)
+			count++;
+		ntfs_log_info("Directory index cache : %d directories,"
+			" %lld bytes, %lu lookups, %lu hits, %lu loads,"
+			" %lu drops\n",
+			count, (long long)cache->size, cache->lookups,
+			cache->hits, cache->loads, cache->drops);
+	}
+}
+
+/*
+ *		Create a cache of hot directories for a mounted volume
+ *
+ *	@budget is the max count of bytes used by the directories
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+int ntfs_dirindex_attach(ntfs_volume *vol, s64 budget)
+{
+	struct DIRINDEX_CACHE *cache;
+
+	if (!vol || vol->dir_index || (budget <= 0)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	cache = (struct DIRINDEX_CACHE*)ntfs_calloc(
+				sizeof(struct DIRINDEX_CACHE));
+	if (!cache)
+		return (-1);
+#ifdef ENABLE_THREADS
+	pthread_mutex_init(&cache->lock, NULL);
+#endif
+	cache->budget = budget;
+	vol->dir_index = cache;
+	ntfs_log_debug("Directory index cache of %lld bytes\n",
+			(long long)budget);
+	return (0);
+}
+
+/*
+ *		Free the cache of hot directories
+ *
+ *	Returns 0 (always successful)
+ */
+
+int ntfs_dirindex_detach(ntfs_volume *vol)
+{
+	struct DIRINDEX_CACHE *cache;
+	struct DIRINDEX *dir;
+
+	cache = vol->dir_index;
+	if (cache) {
+		vol->dir_index = (struct DIRINDEX_CACHE*)NULL;
+		while ((dir = cache->dirs)) {
+			cache->dirs = dir->next;
+			free_dir(dir);
+		}
+#ifdef ENABLE_THREADS
+		pthread_mutex_destroy(&cache->lock);
+#endif
+		free(cache);
+	}
+	return (0);
+}
@@ -0,0 +1,628 @@
+/**
+ * idxcache.c : write-back cache of index blocks
+ *
+ *      This module is part of ntfs-3g library
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
+
+#include "param.h"
+#include "types.h"
+#include "layout.h"
+#include "attrib.h"
+#include "device.h"
+#include "mst.h"
+#include "volume.h"
+#include "idxcache.h"
+#include "misc.h"
+#include "logging.h"
+
+/*
+ *		Write-back cache of index blocks
+ *
+ *	Inserting or deleting an index entry implies writing the index
+ *	block which contains it, and modifying neighbouring entries
+ *	rewrites the same block many times, each write implying applying
+ *	and removing the update sequence fixups. The cache keeps the
+ *	modified blocks in their fixed-up state, and they are only
+ *	written to the device when they are evicted, when a block is
+ *	modified while the oldest modification is older than
+ *	INDEX_CACHE_DELAY seconds (or the commit interval of the volume,
+ *	if defined), when the volume is synced (by fsync(2)) or committed
+ *	and when it is unmounted.
+ *
+ *	The blocks are identified by their inode, index name and position,
+ *	and they are read back from the cache. The location on the device
+ *	is determined when a block enters the cache, so that it can be
+ *	written without the inode being open. The blocks whose clusters
+ *	are freed are thus dropped from the cache, so that they are not
+ *	written over clusters reallocated to another file.
+ *
+ *	Only single blocks fully inside the initialized part of plain
+ *	non-resident index allocations, and stored in consecutive
+ *	clusters, are kept. The others are written as usual and the
+ *	cached copies of them are dropped.
+ *
+ *	The blocks to evict are selected by a clock algorithm, and the
+ *	cache is protected by a single lock.
+ */
+
+#define IDXCACHE_NAME_LEN 4	/* max name length of cached indexes */
+
+struct IDXCACHE_ENTRY {
+	struct IDXCACHE_ENTRY *next;	/* next entry in hash chain */
+	s64 mft_no;			/* -1 if the entry is unused */
+	s64 pos;			/* position in index allocation */
+	s64 devpos;			/* position on device */
+	char *buf;			/* block in fixed-up state */
+	u32 bk_size;
+	u32 buf_size;			/* allocated size of buf */
+	ntfschar name[IDXCACHE_NAME_LEN];
+	u8 name_len;
+	BOOL dirty;
+	BOOL referenced;
+} ;
+
+struct INDEX_CACHE {
+#ifdef ENABLE_THREADS
+	pthread_mutex_t lock;
+#endif
+	struct IDXCACHE_ENTRY *entries;
+	struct IDXCACHE_ENTRY **hash;
+	int count;			/* count of entries */
+	int hashmask;
+	int hand;			/* position of the clock hand */
+	time_t dirtied;			/* oldest modification, 0 if none */
+	unsigned long writes;
+	unsigned long flushed;		/* blocks written to device */
+} ;
+
+static void idxcache_lock(struct INDEX_CACHE *cache
+#ifndef ENABLE_THREADS
+			__attribute__((unused))
+#endif
+			)
+{
+#ifdef ENABLE_THREADS
+	pthread_mutex_lock(&cache->lock);
+#endif
+}
+
+static void idxcache_unlock(struct INDEX_CACHE *cache
+#ifndef ENABLE_THREADS
+			__attribute__((unused))
+#endif
+			)
+{
+#ifdef ENABLE_THREADS
+	pthread_mutex_unlock(&cache->lock);
+#endif
+}
+
+static struct IDXCACHE_ENTRY **hash_head(struct INDEX_CACHE *cache,
+		s64 mft_no, s64 pos)
+{
+	return (&cache->hash[(mft_no*31 + (pos >> NTFS_BLOCK_SIZE_BITS))
+				& cache->hashmask]);
+}
+
+static struct IDXCACHE_ENTRY *find_entry(struct INDEX_CACHE *cache,
+		const ntfs_attr *na, s64 pos)
+{
+	struct IDXCACHE_ENTRY *entry;
+
+	entry = *hash_head(cache, na->ni->mft_no, pos);
+	while (entry && ((entry->mft_no != (s64)na->ni->mft_no)
+			|| (entry->pos != pos)
+			|| (entry->name_len != na->name_len)
+			|| memcmp(entry->name, na->name,
+				na->name_len*sizeof(ntfschar))))
+		entry = entry->next;
+	return (entry);
+}
+
+static void unhash_entry(struct INDEX_CACHE *cache,
+		struct IDXCACHE_ENTRY *entry)
+{
+	struct IDXCACHE_ENTRY **pprev;
+
+	pprev = hash_head(cache, entry->mft_no, entry->pos);
+	while (*pprev && (*pprev != entry))
+		pprev = &(*pprev)->next;
+	if (*pprev)
+		*pprev = entry->next;
+	entry->next = (struct IDXCACHE_ENTRY*)NULL;
+	entry->mft_no = -1;
+	entry->dirty = FALSE;
+}
+
+/*
+ *		Write a modified block to the device
+ *
+ *	The fixups are applied just for the write, which changes the
+ *	update sequence number of the cached block, as when a block is
+ *	written through ntfs_attr_mst_pwrite().
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+static int write_entry(const ntfs_volume *vol, struct INDEX_CACHE *cache,
+		struct IDXCACHE_ENTRY *entry)
+{
+	s64 bw;
+
+	if (ntfs_mst_pre_write_fixup((NTFS_RECORD*)entry->buf,
+				entry->bk_size))
+		return (-1);
+	bw = ntfs_pwrite(vol->dev, entry->devpos, entry->bk_size,
+				entry->buf);
+	ntfs_mst_post_write_fixup((NTFS_RECORD*)entry->buf);
+	if (bw != entry->bk_size) {
+		if (bw >= 0)
+			errno = EIO;
+		ntfs_log_perror("Failed to write the cached index block"
+			" %lld of inode %lld", (long long)entry->pos,
+			(long long)entry->mft_no);
+		return (-1);
+	}
+	entry->dirty = FALSE;
+	cache->flushed++;
+	return (0);
+}
+
+/*
+ *		Get a free entry for a block, evicting another one
+ *
+ *	Returns the entry, or NULL if there was an error (errno is set)
+ *	The cache must be locked by the caller.
+ */
+
+static struct IDXCACHE_ENTRY *new_entry(const ntfs_volume *vol,
+		struct INDEX_CACHE *cache, const ntfs_attr *na, s64 pos,
+		u32 bk_size)
+{
+	struct IDXCACHE_ENTRY *entry;
+	struct IDXCACHE_ENTRY **head;
+	char *buf;
+	int i;
+
+		/* a second round finds the entries no more referenced */
+	entry = (struct IDXCACHE_ENTRY*)NULL;
+	for (i=0; !entry && (i<=2*cache->count); i++) {
+		entry = &cache->entries[cache->hand];
+		if (++cache->hand >= cache->count)
+			cache->hand = 0;
+		if ((entry->mft_no >= 0) && entry->referenced) {
+			entry->referenced = FALSE;
+			entry = (struct IDXCACHE_ENTRY*)NULL;
+		}
+	}
+	if (!entry) {
+		errno = EIO;
+		return ((struct IDXCACHE_ENTRY*)NULL);
+	}
+	if (entry->mft_no >= 0) {
+		if (entry->dirty && write_entry(vol, cache, entry))
+			return ((struct IDXCACHE_ENTRY*)NULL);
+		unhash_entry(cache, entry);
+	}
+	if (entry->buf_size < bk_size) {
+		buf = (char*)ntfs_malloc(bk_size);
+		if (!buf)
+			return ((struct IDXCACHE_ENTRY*)NULL);
+		free(entry->buf);
+		entry->buf = buf;
+		entry->buf_size = bk_size;
+	}
+	entry->mft_no = na->ni->mft_no;
+	entry->pos = pos;
+	entry->bk_size = bk_size;
+	entry->name_len = na->name_len;
+	memcpy(entry->name, na->name, na->name_len*sizeof(ntfschar));
+	entry->dirty = FALSE;
+	entry->referenced = TRUE;
+	head = hash_head(cache, entry->mft_no, pos);
+	entry->next = *head;
+	*head = entry;
+	return (entry);
+}
+
+/*
+ *		Get the location of a block on the device
+ *
+ *	Returns the location, or -1 if the block is not stored in
+ *	consecutive clusters.
+ */
+
+static s64 block_location(ntfs_attr *na, s64 pos, u32 bk_size)
+{
+	const ntfs_volume *vol;
+	runlist_element *rl;
+	VCN vcn;
+	s64 devpos;
+
+	vol = na->ni->vol;
+	devpos = -1;
+	vcn = pos >> vol->cluster_size_bits;
+	rl = ntfs_attr_find_vcn(na, vcn);
+	if (rl && (rl->lcn >= 0)
+	    && (((pos + bk_size - 1) >> vol->cluster_size_bits)
+			< (rl->vcn + rl->length)))
+		devpos = ((rl->lcn + vcn - rl->vcn) << vol->cluster_size_bits)
+				+ (pos & (vol->cluster_size - 1));
+	return (devpos);
+}
+
+/*
+ *		Copy the cached blocks into a buffer
+ *
+ *	Returns TRUE if all the blocks were cached
+ *	The cache must be locked by the caller.
+ */
+
+static BOOL copy_blocks(struct INDEX_CACHE *cache, const ntfs_attr *na,
+		s64 pos, s64 count, u32 bk_size, void *b)
+{
+	struct IDXCACHE_ENTRY *entry;
+	BOOL all;
+	s64 i;
+
+	all = TRUE;
+	for (i=0; i<count; i++) {
+		entry = find_entry(cache, na, pos + i*bk_size);
+		if (entry && (entry->bk_size == bk_size)) {
+			memcpy((char*)b + i*bk_size, entry->buf, bk_size);
+			entry->referenced = TRUE;
+		} else
+			all = FALSE;
+	}
+	return (all);
+}
+
+/*
+ *		Get index blocks from the cache
+ *
+ *	This is to be called before reading blocks from the device,
+ *	and again afterwards, to insert the cached blocks among the
+ *	ones read.
+ *
+ *	Returns TRUE if all the blocks were found and copied
+ */
+
+BOOL ntfs_idxcache_get(ntfs_attr *na, s64 pos, s64 count,
+			u32 bk_size, void *b)
+{
+	struct INDEX_CACHE *cache;
+	BOOL all;
+
+	cache = na->ni->vol->index_cache;
+	idxcache_lock(cache);
+	all = copy_blocks(cache, na, pos, count, bk_size, b);
+	idxcache_unlock(cache);
+	return (all);
+}
+
+/*
+ *		Write the modified blocks to the device
+ *
+ *	The blocks of the index of inode @mft_no are written, or all
+ *	the blocks if @mft_no is negative, in the order of their
+ *	locations. The cache must be locked by the caller.
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+static int entry_compare(const void *p1, const void *p2)
+{
+	s64 devpos1 = (*(const struct IDXCACHE_ENTRY* const*)p1)->devpos;
+	s64 devpos2 = (*(const struct IDXCACHE_ENTRY* const*)p2)->devpos;
+
+	return (devpos1 < devpos2 ? -1 : (devpos1 > devpos2 ? 1 : 0));
+}
+
+static int flush_entries(const ntfs_volume *vol, struct INDEX_CACHE *cache,
+			s64 mft_no)
+{
+	struct IDXCACHE_ENTRY **dirty;
+	struct IDXCACHE_ENTRY *entry;
+	int count;
+	int err;
+	int i;
+
+	err = 0;
+	count = 0;
+	dirty = (struct IDXCACHE_ENTRY**)ntfs_malloc(
+			cache->count*sizeof(struct IDXCACHE_ENTRY*));
+	for (i=0; i<cache->count; i++) {
+		entry = &cache->entries[i];
+		if ((entry->mft_no >= 0) && entry->dirty
+		    && ((mft_no < 0) || (entry->mft_no == mft_no))) {
+			if (dirty)
+				dirty[count++] = entry;
+			else
+				if (write_entry(vol, cache, entry))
+					err = errno;
+		}
+	}
+	if (dirty) {
+		qsort(dirty, count, sizeof(struct IDXCACHE_ENTRY*),
+				entry_compare);
+		for (i=0; i<count; i++)
+			if (write_entry(vol, cache, dirty[i]))
+				err = errno;
+		free(dirty);
+	}
+	if (err) {
+		errno = err;
+		return (-1);
+	}
+	if (mft_no < 0)
+		cache->dirtied = 0;
+	return (0);
+}
+
+/*
+ *		Write index blocks into the cache only
+ *
+ *	Returns 0 if the blocks have been kept in the cache,
+ *		1 if they have to be written to the device,
+ *		-1 if there was an error (with errno set)
+ */
+
+int ntfs_idxcache_defer(ntfs_attr *na, s64 pos, s64 count,
+			u32 bk_size, const void *b)
+{
+	struct INDEX_CACHE *cache;
+	struct IDXCACHE_ENTRY *entry;
+	const ntfs_volume *vol;
+	s64 devpos;
+	time_t now;
+	int delay;
+	s64 i;
+	int res;
+
+	vol = na->ni->vol;
+	cache = vol->index_cache;
+	devpos = -1;
+	if ((count == 1)
+	    && !NDevSync(vol->dev) && !NDevReadOnly(vol->dev)
+	    && NAttrNonResident(na)
+	    && !(na->data_flags & (ATTR_COMPRESSION_MASK
+				| ATTR_IS_ENCRYPTED | ATTR_IS_SPARSE))
+	    && (na->name_len <= IDXCACHE_NAME_LEN)
+	    && ((pos + bk_size) <= na->initialized_size))
+		devpos = block_location(na, pos, bk_size);
+	idxcache_lock(cache);
+	if (devpos < 0) {
+			/* drop the copies which would become stale */
+		for (i=0; i<count; i++) {
+			entry = find_entry(cache, na, pos + i*bk_size);
+			if (entry)
+				unhash_entry(cache, entry);
+		}
+		res = 1;
+	} else {
+		res = 0;
+		NDevSetDirty(vol->dev);
+		entry = find_entry(cache, na, pos);
+		if (entry && (entry->bk_size != bk_size)) {
+			unhash_entry(cache, entry);
+			entry = (struct IDXCACHE_ENTRY*)NULL;
+		}
+		if (!entry)
+			entry = new_entry(vol, cache, na, pos, bk_size);
+		if (entry) {
+			memcpy(entry->buf, b, bk_size);
+			entry->devpos = devpos;
+			entry->dirty = TRUE;
+			entry->referenced = TRUE;
+			cache->writes++;
+			now = time((time_t*)NULL);
+			delay = (vol->commit_interval
+					? vol->commit_interval
+					: INDEX_CACHE_DELAY);
+			if (!cache->dirtied)
+				cache->dirtied = now;
+			else
+				if ((now - cache->dirtied) >= delay)
+					res = flush_entries(vol, cache, -1);
+		} else
+			res = -1;
+	}
+	idxcache_unlock(cache);
+	return (res);
+}
+
+/*
+ *		Drop the cached blocks stored in clusters being freed
+ */
+
+void ntfs_idxcache_forget(const ntfs_volume *vol, LCN lcn, s64 count)
+{
+	struct INDEX_CACHE *cache;
+	struct IDXCACHE_ENTRY *entry;
+	s64 start, end;
+	int i;
+
+	cache = vol->index_cache;
+	start = lcn << vol->cluster_size_bits;
+	end = (lcn + count) << vol->cluster_size_bits;
+	idxcache_lock(cache);
+	for (i=0; i<cache->count; i++) {
+		entry = &cache->entries[i];
+		if ((entry->mft_no >= 0)
+		    && (entry->devpos < end)
+		    && ((entry->devpos + entry->bk_size) > start))
+			unhash_entry(cache, entry);
+	}
+	idxcache_unlock(cache);
+}
+
+/*
+ *		Write all the modified blocks to the device
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+int ntfs_idxcache_flush(const ntfs_volume *vol)
+{
+	struct INDEX_CACHE *cache;
+	int res;
+
+	cache = vol->index_cache;
+	if (!cache)
+		return (0);
+	idxcache_lock(cache);
+	res = flush_entries(vol, cache, -1);
+	idxcache_unlock(cache);
+	return (res);
+}
+
+/*
+ *		Write the modified blocks of the indexes of an inode
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+int ntfs_idxcache_flush_inode(const ntfs_volume *vol, u64 mft_no)
+{
+	struct INDEX_CACHE *cache;
+	int res;
+
+	cache = vol->index_cache;
+	if (!cache)
+		return (0);
+	idxcache_lock(cache);
+	res = flush_entries(vol, cache, (s64)mft_no);
+	idxcache_unlock(cache);
+	return (res);
+}
+
+/*
+ *		Log the statistics of the cache
+ */
+
+void ntfs_idxcache_log(const ntfs_volume *vol)
+{
+	struct INDEX_CACHE *cache;
+
+	cache = vol->index_cache;
+	if (cache && cache->writes) {
+		ntfs_log_info("Index block cache : %d entries, %lu writes,"
+			" %lu blocks written to device\n",
+			cache->count, cache->writes, cache->flushed);
+	}
+}
+
+static void free_cache(struct INDEX_CACHE *cache)
+{
+	int i;
+
+	if (cache->entries)
+		for (i=0; i<cache->count; i++)
+			free(cache->entries[i].buf);
+	free(cache->entries);
+	free(cache->hash);
+	free(cache);
+}
+
+/*
+ *		Create a cache of index blocks for a mounted volume
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+int ntfs_idxcache_attach(ntfs_volume *vol, int count)
+{
+	struct INDEX_CACHE *cache;
+	int hashsize;
+	int i;
+
+	if (!vol || !vol->dev || vol->index_cache || (count <= 0)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	hashsize = 1;
+	while (hashsize < count)
+		hashsize <<= 1;
+	cache = (struct INDEX_CACHE*)ntfs_calloc(sizeof(struct INDEX_CACHE));
+	if (!cache)
+		return (-1);
+	cache->count = count;
+	cache->entries = (struct IDXCACHE_ENTRY*)ntfs_calloc(
+			count*sizeof(struct IDXCACHE_ENTRY));
+	cache->hash = (struct IDXCACHE_ENTRY**)ntfs_calloc(
+			hashsize*sizeof(struct IDXCACHE_ENTRY*));
+	if (!cache->entries || !cache->hash) {
+		free_cache(cache);
+		errno = ENOMEM;
+		return (-1);
+	}
+	for (i=0; i<count; i++)
+		cache->entries[i].mft_no = -1;
+#ifdef ENABLE_THREADS
+	pthread_mutex_init(&cache->lock, NULL);
+#endif
+	cache->hashmask = hashsize - 1;
+	vol->index_cache = cache;
+	ntfs_log_debug("Index block cache of %d blocks\n", count);
+	return (0);
+}
+
+/*
+ *		Write the modified blocks and free the cache
+ *
+ *	This has to be done while the device is still open.
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+int ntfs_idxcache_detach(ntfs_volume *vol)
+{
+	struct INDEX_CACHE *cache;
+	int res;
+
+	cache = vol->index_cache;
+	if (!cache)
+		return (0);
+	res = ntfs_idxcache_flush(vol);
+	vol->index_cache = (struct INDEX_CACHE*)NULL;
+#ifdef ENABLE_THREADS
+	pthread_mutex_destroy(&cache->lock);
+#endif
+	free_cache(cache);
+	return (res);
+}
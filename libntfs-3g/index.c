@@ -47,6 +47,11 @@
 #include "bitmap.h"
 #include "reparse.h"
 #include "misc.h"
+#include "param.h"
+#include "lock.h"
+#include "dirindex.h"
+#include "idxcache.h"
+#include "probe.h"
 
 /**
  * ntfs_index_entry_mark_dirty - mark an index entry dirty
@@ -80,12 +85,136 @@ static VCN ntfs_ib_pos_to_vcn(ntfs_index_context *icx, s64 pos)
 	return pos >> icx->vcn_size_bits;
 }
 
+/*
+ *		Index blocks whose writing is deferred while inserting
+ *	a batch of entries, so that a block is only written once.
+ */
+
+#define DEFERRED_HASH_SIZE 64
+
+struct DEFERRED_BLOCK {
+	struct DEFERRED_BLOCK *next;
+	VCN vcn;
+	INDEX_BLOCK ib[0];
+} ;
+
+struct DEFERRED_BLOCKS {
+	struct DEFERRED_BLOCK *hash[DEFERRED_HASH_SIZE];
+	int count;
+} ;
+
+static struct DEFERRED_BLOCK *ntfs_deferred_find(struct DEFERRED_BLOCKS *db,
+			VCN vcn)
+{
+	struct DEFERRED_BLOCK *block;
+
+	block = db->hash[vcn & (DEFERRED_HASH_SIZE - 1)];
+	while (block && (block->vcn != vcn))
+		block = block->next;
+	return block;
+}
+
+static int ntfs_deferred_store(ntfs_index_context *icx, INDEX_BLOCK *ib,
+			VCN vcn)
+{
+	struct DEFERRED_BLOCKS *db = icx->deferred;
+	struct DEFERRED_BLOCK *block;
+
+	block = ntfs_deferred_find(db, vcn);
+	if (!block) {
+		block = ntfs_malloc(sizeof(struct DEFERRED_BLOCK)
+				+ icx->block_size);
+		if (!block)
+			return STATUS_ERROR;
+		block->vcn = vcn;
+		block->next = db->hash[vcn & (DEFERRED_HASH_SIZE - 1)];
+		db->hash[vcn & (DEFERRED_HASH_SIZE - 1)] = block;
+		db->count++;
+	}
+	memcpy(block->ib, ib, icx->block_size);
+	return STATUS_OK;
+}
+
+static int ntfs_deferred_cmp(const void *p1, const void *p2)
+{
+	VCN vcn1 = (*(const struct DEFERRED_BLOCK* const*)p1)->vcn;
+	VCN vcn2 = (*(const struct DEFERRED_BLOCK* const*)p2)->vcn;
+
+	return (vcn1 < vcn2 ? -1 : (vcn1 > vcn2 ? 1 : 0));
+}
+
+/*
+ *		Write the deferred index blocks in ascending order and free them
+ *
+ *	All the blocks are freed, even if some of them could not be written.
+ *	Returns STATUS_OK or STATUS_ERROR
+ */
+
+static int ntfs_deferred_flush(ntfs_inode *ni, ntfschar *name, u32 name_len,
+			struct DEFERRED_BLOCKS *db, u32 block_size,
+			u8 vcn_size_bits)
+{
+	struct DEFERRED_BLOCK **blocks;
+	struct DEFERRED_BLOCK *block;
+	ntfs_attr *na;
+	int ret = STATUS_OK;
+	int err = 0;
+	int i, n;
+
+	blocks = (struct DEFERRED_BLOCK**)NULL;
+	na = (ntfs_attr*)NULL;
+	if (db->count) {
+		blocks = ntfs_malloc(db->count*sizeof(struct DEFERRED_BLOCK*));
+		na = ntfs_index_ia_open(ni, name, name_len);
+		if (!blocks || !na) {
+			err = errno;
+			ret = STATUS_ERROR;
+		}
+	}
+	n = 0;
+	for (i=0; i<DEFERRED_HASH_SIZE; i++)
+		for (block=db->hash[i]; block; block=block->next)
+			if (blocks)
+				blocks[n++] = block;
+	if (!ret) {
+		qsort(blocks, n, sizeof(struct DEFERRED_BLOCK*),
+				ntfs_deferred_cmp);
+		for (i=0; i<n; i++) {
+			if (ntfs_attr_mst_pwrite(na,
+				    blocks[i]->vcn << vcn_size_bits, 1,
+				    block_size, blocks[i]->ib) != 1) {
+				ntfs_log_perror("Failed to write index block"
+					" %lld, inode %llu",
+					(long long)blocks[i]->vcn,
+					(unsigned long long)ni->mft_no);
+				if (!err)
+					err = (errno ? errno : EIO);
+				ret = STATUS_ERROR;
+			}
+		}
+	}
+	for (i=0; i<DEFERRED_HASH_SIZE; i++)
+		while ((block = db->hash[i])) {
+			db->hash[i] = block->next;
+			free(block);
+		}
+	db->count = 0;
+	free(blocks);
+	ntfs_index_ia_close(na);
+	if (ret)
+		errno = err;
+	return ret;
+}
+
 static int ntfs_ib_write(ntfs_index_context *icx, INDEX_BLOCK *ib)
 {
 	s64 ret, vcn = sle64_to_cpu(ib->index_block_vcn);
 	
 	ntfs_log_trace("vcn: %lld\n", (long long)vcn);
 	
+	if (icx->deferred)
+		return ntfs_deferred_store(icx, ib, vcn);
+
 	ret = ntfs_attr_mst_pwrite(icx->ia_na, ntfs_ib_vcn_to_pos(icx, vcn),
 				   1, icx->block_size, ib);
 	if (ret != 1) {
@@ -107,6 +236,177 @@ static int ntfs_icx_ib_write(ntfs_index_context *icx)
 		return STATUS_OK;
 }
 
+/*
+ *		Pools of index contexts and index blocks
+ *
+ *	Index contexts and index block buffers are kept for reuse when
+ *	they are released, so that looking up, inserting or removing an
+ *	entry does not allocate memory in the common case. A context is
+ *	kept with its table of entries, and only buffers of the usual size
+ *	of index blocks on the volume are kept.
+ *
+ *	The open index allocation of a directory is kept in its inode,
+ *	and it is lent to one context at a time. When several contexts
+ *	have used it at once, one of them may have extended it, so the
+ *	copies are not kept until they are all released.
+ *
+ *	The pools and the open index allocations are protected by the
+ *	cache lock.
+ */
+
+struct INDEX_POOL {
+	int context_count;
+	int block_count;
+	ntfs_index_context *contexts[INDEX_POOL_SIZE];
+	INDEX_BLOCK *blocks[INDEX_POOL_SIZE];
+} ;
+
+static struct INDEX_POOL *ntfs_index_pool(ntfs_volume *vol)
+{
+	if (!vol->index_pool)
+		vol->index_pool = (struct INDEX_POOL*)
+				ntfs_calloc(sizeof(struct INDEX_POOL));
+	return (vol->index_pool);
+}
+
+/*
+ *		Free the pools of a volume, when unmounting
+ */
+
+void ntfs_index_pool_release(ntfs_volume *vol)
+{
+	struct INDEX_POOL *pool;
+	int i;
+
+	pool = vol->index_pool;
+	if (pool) {
+		vol->index_pool = (struct INDEX_POOL*)NULL;
+		for (i=0; i<pool->context_count; i++) {
+			free(pool->contexts[i]->entries);
+			free(pool->contexts[i]);
+		}
+		for (i=0; i<pool->block_count; i++)
+			free(pool->blocks[i]);
+		free(pool);
+	}
+}
+
+/*
+ *		Get a buffer for an index block, its contents is undefined
+ *
+ *	Returns the buffer, or NULL with errno set
+ */
+
+INDEX_BLOCK *ntfs_index_buffer_get(ntfs_volume *vol, u32 size)
+{
+	struct INDEX_POOL *pool;
+	INDEX_BLOCK *ib;
+
+	ib = (INDEX_BLOCK*)NULL;
+	if (size == vol->indx_record_size) {
+		ntfs_cache_lock(vol);
+		pool = vol->index_pool;
+		if (pool && pool->block_count)
+			ib = pool->blocks[--pool->block_count];
+		ntfs_cache_unlock(vol);
+	}
+	if (!ib)
+		ib = (INDEX_BLOCK*)ntfs_malloc(size);
+	return (ib);
+}
+
+/*
+ *		Release a buffer got from ntfs_index_buffer_get()
+ */
+
+void ntfs_index_buffer_put(ntfs_volume *vol, INDEX_BLOCK *ib, u32 size)
+{
+	struct INDEX_POOL *pool;
+
+	if (ib && (size == vol->indx_record_size)) {
+		ntfs_cache_lock(vol);
+		pool = ntfs_index_pool(vol);
+		if (pool && (pool->block_count < INDEX_POOL_SIZE)) {
+			pool->blocks[pool->block_count++] = ib;
+			ib = (INDEX_BLOCK*)NULL;
+		}
+		ntfs_cache_unlock(vol);
+	}
+	free(ib);
+}
+
+static BOOL ntfs_is_i30(const ntfschar *name, u32 name_len)
+{
+	return ((name_len == 4)
+		&& ((name == NTFS_INDEX_I30)
+		    || !memcmp(name, NTFS_INDEX_I30, 4*sizeof(ntfschar))));
+}
+
+/**
+ * ntfs_index_ia_open - open the index allocation of an index
+ * @ni:		base inode of the index
+ * @name:	name of the index
+ * @name_len:	length of the index name
+ *
+ * For a directory index, the allocation opened by a previous user
+ * is reused if it is available. The attribute must be released by
+ * ntfs_index_ia_close(), and it must not be used for anything else
+ * than the index blocks.
+ *
+ * Return the opened attribute, or NULL with errno set.
+ */
+ntfs_attr *ntfs_index_ia_open(ntfs_inode *ni, ntfschar *name, u32 name_len)
+{
+	ntfs_attr *na;
+	int err;
+
+	if (!ntfs_is_i30(name, name_len))
+		return (ntfs_attr_open(ni, AT_INDEX_ALLOCATION,
+					name, name_len));
+	if (ni->nr_extents == -1)
+		ni = ni->base_ni;
+	ntfs_cache_lock(ni->vol);
+	na = ni->index_na;
+	ni->index_na = (ntfs_attr*)NULL;
+	if (ni->index_users++)
+		ni->index_overlap = TRUE;
+	ntfs_cache_unlock(ni->vol);
+	if (!na) {
+		na = ntfs_attr_open(ni, AT_INDEX_ALLOCATION, name, name_len);
+		if (!na) {
+			err = errno;
+			ntfs_cache_lock(ni->vol);
+			if (!--ni->index_users)
+				ni->index_overlap = FALSE;
+			ntfs_cache_unlock(ni->vol);
+			errno = err;
+		}
+	}
+	return (na);
+}
+
+/**
+ * ntfs_index_ia_close - release an index allocation
+ * @na:		attribute opened by ntfs_index_ia_open()
+ */
+void ntfs_index_ia_close(ntfs_attr *na)
+{
+	ntfs_inode *ni;
+
+	if (na && ntfs_is_i30(na->name, na->name_len)) {
+		ni = na->ni;
+		ntfs_cache_lock(ni->vol);
+		if (!ni->index_na && !ni->index_overlap) {
+			ni->index_na = na;
+			na = (ntfs_attr*)NULL;
+		}
+		if (!--ni->index_users)
+			ni->index_overlap = FALSE;
+		ntfs_cache_unlock(ni->vol);
+	}
+	ntfs_attr_close(na);
+}
+
 /**
  * ntfs_index_ctx_get - allocate and initialize a new index context
  * @ni:		ntfs inode with which to initialize the context
@@ -119,7 +419,10 @@ static int ntfs_icx_ib_write(ntfs_index_context *icx)
 ntfs_index_context *ntfs_index_ctx_get(ntfs_inode *ni,
 				       ntfschar *name, u32 name_len)
 {
+	struct INDEX_POOL *pool;
 	ntfs_index_context *icx;
+	INDEX_ENTRY **entries;
+	int max_entries;
 
 	ntfs_log_trace("Entering\n");
 	
@@ -129,12 +432,26 @@ ntfs_index_context *ntfs_index_ctx_get(ntfs_inode *ni,
 	}
 	if (ni->nr_extents == -1)
 		ni = ni->base_ni;
-	icx = ntfs_calloc(sizeof(ntfs_index_context));
+	icx = (ntfs_index_context*)NULL;
+	entries = (INDEX_ENTRY**)NULL;
+	max_entries = 0;
+	ntfs_cache_lock(ni->vol);
+	pool = ni->vol->index_pool;
+	if (pool && pool->context_count) {
+		icx = pool->contexts[--pool->context_count];
+		entries = icx->entries;
+		max_entries = icx->max_entries;
+	}
+	ntfs_cache_unlock(ni->vol);
+	if (!icx)
+		icx = ntfs_malloc(sizeof(ntfs_index_context));
 	if (icx)
 		*icx = (ntfs_index_context) {
 			.ni = ni,
 			.name = name,
 			.name_len = name_len,
+			.entries = entries,
+			.max_entries = max_entries,
 		};
 	return icx;
 }
@@ -143,21 +460,20 @@ static void ntfs_index_ctx_free(ntfs_index_context *icx)
 {
 	ntfs_log_trace("Entering\n");
 	
-	if (!icx->entry)
-		return;
-
-	if (icx->actx)
-		ntfs_attr_put_search_ctx(icx->actx);
+	if (icx->entry) {
+		if (icx->actx)
+			ntfs_attr_put_search_ctx(icx->actx);
 
-	if (!icx->is_in_root) {
-		if (icx->ib_dirty) {
-			/* FIXME: Error handling!!! */
-			ntfs_ib_write(icx, icx->ib);
+		if (!icx->is_in_root) {
+			if (icx->ib_dirty) {
+				/* FIXME: Error handling!!! */
+				ntfs_ib_write(icx, icx->ib);
+			}
+			ntfs_index_buffer_put(icx->ni->vol, icx->ib,
+					icx->block_size);
 		}
-		free(icx->ib);
 	}
-	
-	ntfs_attr_close(icx->ia_na);
+	ntfs_index_ia_close(icx->ia_na);
 }
 
 /**
@@ -165,11 +481,26 @@ static void ntfs_index_ctx_free(ntfs_index_context *icx)
  * @icx:	index context to free
  *
  * Release the index context @icx, releasing all associated resources.
+ * The context is kept for reuse if there is room for it.
  */
 void ntfs_index_ctx_put(ntfs_index_context *icx)
 {
+	struct INDEX_POOL *pool;
+	ntfs_volume *vol;
+
 	ntfs_index_ctx_free(icx);
-	free(icx);
+	vol = icx->ni->vol;
+	ntfs_cache_lock(vol);
+	pool = ntfs_index_pool(vol);
+	if (pool && (pool->context_count < INDEX_POOL_SIZE)) {
+		pool->contexts[pool->context_count++] = icx;
+		icx = (ntfs_index_context*)NULL;
+	}
+	ntfs_cache_unlock(vol);
+	if (icx) {
+		free(icx->entries);
+		free(icx);
+	}
 }
 
 /**
@@ -188,6 +519,9 @@ void ntfs_index_ctx_reinit(ntfs_index_context *icx)
 		.ni = icx->ni,
 		.name = icx->name,
 		.name_len = icx->name_len,
+		.entries = icx->entries,
+		.max_entries = icx->max_entries,
+		.deferred = icx->deferred,
 	};
 }
 
@@ -225,6 +559,57 @@ static int ntfs_ie_end(INDEX_ENTRY *ie)
 	return ie->ie_flags & INDEX_ENTRY_END || !ie->length;
 }
 
+/*
+ *		Get the size of a table able to hold the locations of
+ *	all the entries in an index node, including its end entry
+ */
+
+int ntfs_ie_table_size(INDEX_HEADER *ih, const u8 *index_end)
+{
+	const u8 *first;
+	int size;
+
+	first = (const u8*)ntfs_ie_get_first(ih);
+	size = 1;
+	if (index_end > first)
+		size += (index_end - first)/sizeof(INDEX_ENTRY_HEADER);
+	return (size);
+}
+
+/*
+ *		Locate the entries of an index node
+ *
+ *	The entries have variable sizes, so they have to be walked
+ *	through from the first one to locate them.  Doing it once
+ *	without collating makes a binary search possible.
+ *
+ *	Returns the count of entries before the end entry, which is
+ *		located just after them in @table,
+ *		or -1 if the node is corrupted
+ */
+
+int ntfs_ie_table(INDEX_HEADER *ih, const u8 *index_end,
+			INDEX_ENTRY **table, int max)
+{
+	INDEX_ENTRY *ie;
+	int count;
+
+	count = 0;
+	ie = ntfs_ie_get_first(ih);
+	while (((u8*)ie + sizeof(INDEX_ENTRY_HEADER) <= index_end)
+	    && ((u8*)ie + le16_to_cpu(ie->length) <= index_end)
+	    && (count < max)) {
+		table[count] = ie;
+		if (ie->ie_flags & INDEX_ENTRY_END)
+			return (count);
+		if (le16_to_cpu(ie->length) < sizeof(INDEX_ENTRY_HEADER))
+			break;
+		count++;
+		ie = ntfs_ie_get_next(ie);
+	}
+	return (-1);
+}
+
 /** 
  *  Find the last entry in the index block
  */
@@ -274,7 +659,8 @@ char *ntfs_ie_filename_get(INDEX_ENTRY *ie)
 	FILE_NAME_ATTR *fn;
 
 	fn = (FILE_NAME_ATTR *)&ie->key;
-	return ntfs_attr_name_get(fn->file_name, fn->file_name_length);
+	return ntfs_attr_name_get((const ntfschar*)((const u8*)fn
+				+ offsetof(FILE_NAME_ATTR, file_name)), fn->file_name_length);
 }
 
 void ntfs_ie_filename_dump(INDEX_ENTRY *ie)
@@ -421,6 +807,14 @@ static int ntfs_ia_check(ntfs_index_context *icx, INDEX_BLOCK *ib, VCN vcn)
 			       icx->block_size);
 		return -1;
 	}
+
+	if ((u64)le32_to_cpu(ib->index.index_length) + 0x18 > ib_size) {
+
+		ntfs_log_error("Corrupt index block : VCN (%lld) of inode %llu "
+			       "has entries beyond its end\n", (long long)vcn,
+			       (unsigned long long)icx->ni->mft_no);
+		return -1;
+	}
 	return 0;
 }
 
@@ -450,6 +844,18 @@ static INDEX_ROOT *ntfs_ir_lookup(ntfs_inode *ni, ntfschar *name,
 	}
 	
 	ir = (INDEX_ROOT *)((char *)a + le16_to_cpu(a->value_offset));
+		/* the entries must be within the value, within the attribute */
+	if ((le16_to_cpu(a->value_offset) + (u64)le32_to_cpu(a->value_length)
+			> le32_to_cpu(a->length))
+	    || (le32_to_cpu(a->value_length) < sizeof(INDEX_ROOT))
+	    || ((u64)le32_to_cpu(ir->index.index_length)
+			+ offsetof(INDEX_ROOT, index)
+			> le32_to_cpu(a->value_length))) {
+		ir = (INDEX_ROOT*)NULL;
+		errno = EIO;
+		ntfs_log_perror("Corrupt $INDEX_ROOT in inode %llu",
+				(unsigned long long)ni->mft_no);
+	}
 err_out:
 	if (!ir) {
 		ntfs_attr_put_search_ctx(*ctx);
@@ -469,6 +875,69 @@ static INDEX_ROOT *ntfs_ir_lookup2(ntfs_inode *ni, ntfschar *name, u32 len)
 	return ir;
 }
 
+/*
+ *		Collate a key with the key of an index entry
+ *
+ *	The usual collation rules are done inline, so that the binary
+ *	search in an index block makes no indirect call : the keys of
+ *	$SII and $SDH are compared as integers, and for file names the
+ *	key looked for has been upcased beforehand into @upkey, so that
+ *	only the characters which differ in the entry have to be upcased.
+ *	The other rules, and unexpected key sizes, are left to the
+ *	collation function.
+ */
+
+static __inline__ int ntfs_ie_collate(ntfs_index_context *icx,
+			const void *key, int key_len, const ntfschar *upkey,
+			const INDEX_ENTRY *ie)
+{
+	const FILE_NAME_ATTR *fn1;
+	const FILE_NAME_ATTR *fn2;
+	const le32 *p1;
+	const le32 *p2;
+	ntfs_volume *vol;
+	int ie_key_len;
+	u32 d1, d2;
+
+	ie_key_len = le16_to_cpu(ie->key_length);
+	p1 = (const le32*)key;
+	p2 = (const le32*)((const u8*)ie + offsetof(INDEX_ENTRY, key));
+	switch (icx->collation_rule) {
+	case COLLATION_NTOFS_ULONG :
+		if ((key_len != 4) || (ie_key_len != 4))
+			break;
+		d1 = le32_to_cpup(p1);
+		d2 = le32_to_cpup(p2);
+		return (d1 < d2 ? -1 : (d1 > d2 ? 1 : 0));
+	case COLLATION_NTOFS_SECURITY_HASH :
+		if ((key_len != 8) || (ie_key_len != 8))
+			break;
+		d1 = le32_to_cpup(p1);
+		d2 = le32_to_cpup(p2);
+		if (d1 == d2) {
+			d1 = le32_to_cpup(&p1[1]);
+			d2 = le32_to_cpup(&p2[1]);
+		}
+		return (d1 < d2 ? -1 : (d1 > d2 ? 1 : 0));
+	case COLLATION_FILE_NAME :
+		if (!upkey)
+			break;
+		vol = icx->ni->vol;
+		fn1 = (const FILE_NAME_ATTR*)key;
+		fn2 = (const FILE_NAME_ATTR*)p2;
+		return (ntfs_names_full_collate_upcased(
+				(const ntfschar*)((const u8*)fn1 + offsetof(FILE_NAME_ATTR, file_name)),
+				upkey, fn1->file_name_length,
+				(const ntfschar*)((const u8*)fn2 + offsetof(FILE_NAME_ATTR, file_name)),
+				fn2->file_name_length,
+				CASE_SENSITIVE, vol->upcase, vol->upcase_len));
+	default :
+		break;
+	}
+	return (icx->collate(icx->ni->vol, key, key_len,
+				&ie->key, ie_key_len));
+}
+
 /** 
  * Find a key in the index block.
  * 
@@ -482,70 +951,77 @@ static INDEX_ROOT *ntfs_ir_lookup2(ntfs_inode *ni, ntfschar *name, u32 len)
  *   STATUS_ERROR with errno set if on unexpected error during lookup.
  */
 static int ntfs_ie_lookup(const void *key, const int key_len,
+			  const ntfschar *upkey,
 			  ntfs_index_context *icx, INDEX_HEADER *ih,
 			  VCN *vcn, INDEX_ENTRY **ie_out)
 {
 	INDEX_ENTRY *ie;
+	INDEX_ENTRY **table;
 	u8 *index_end;
-	int rc, item = 0;
+	int rc, last, item;
+	int count, lo, hi, mid, max;
 	 
 	ntfs_log_trace("Entering\n");
 	
+	if (!icx->collate) {
+		ntfs_log_error("Collation function not defined\n");
+		errno = EOPNOTSUPP;
+		return STATUS_ERROR;
+	}
 	index_end = ntfs_ie_get_end(ih);
-	
-	/*
-	 * Loop until we exceed valid memory (corruption case) or until we
-	 * reach the last entry.
-	 */
-	for (ie = ntfs_ie_get_first(ih); ; ie = ntfs_ie_get_next(ie)) {
-		/* Bounds checks. */
-		if ((u8 *)ie + sizeof(INDEX_ENTRY_HEADER) > index_end ||
-		    (u8 *)ie + le16_to_cpu(ie->length) > index_end) {
-			errno = ERANGE;
-			ntfs_log_error("Index entry out of bounds in inode "
-				       "%llu.\n",
-				       (unsigned long long)icx->ni->mft_no);
-			return STATUS_ERROR;
-		}
-		/*
-		 * The last entry cannot contain a key.  It can however contain
-		 * a pointer to a child node in the B+tree so we just break out.
-		 */
-		if (ntfs_ie_end(ie))
-			break;
-		/*
-		 * Not a perfect match, need to do full blown collation so we
-		 * know which way in the B+tree we have to go.
-		 */
-		if (!icx->collate) {
-			ntfs_log_error("Collation function not defined\n");
-			errno = EOPNOTSUPP;
+	max = ntfs_ie_table_size(ih, index_end);
+	if (max > icx->max_entries) {
+		table = (INDEX_ENTRY**)realloc(icx->entries,
+					max*sizeof(INDEX_ENTRY*));
+		if (!table) {
+			errno = ENOMEM;
 			return STATUS_ERROR;
 		}
-		rc = icx->collate(icx->ni->vol, key, key_len,
-					&ie->key, le16_to_cpu(ie->key_length));
+		icx->entries = table;
+		icx->max_entries = max;
+	}
+	table = icx->entries;
+	count = ntfs_ie_table(ih, index_end, table, max);
+	if (count < 0) {
+		errno = ERANGE;
+		ntfs_log_error("Index entry out of bounds in inode "
+			       "%llu.\n",
+			       (unsigned long long)icx->ni->mft_no);
+		return STATUS_ERROR;
+	}
+	/*
+	 * Binary search for the first entry which does not collate
+	 * before @key. The last entry cannot contain a key, but it
+	 * can contain a pointer to a child node in the B+tree, so it
+	 * stands for an entry collating after any key.
+	 */
+	lo = 0;
+	hi = count;
+	last = -1;
+	while (lo < hi) {
+		mid = (lo + hi) >> 1;
+		ie = table[mid];
+		rc = ntfs_ie_collate(icx, key, key_len, upkey, ie);
 		if (rc == NTFS_COLLATION_ERROR) {
 			ntfs_log_error("Collation error. Perhaps a filename "
 				       "contains invalid characters?\n");
 			errno = ERANGE;
 			return STATUS_ERROR;
 		}
-		/*
-		 * If @key collates before the key of the current entry, there
-		 * is definitely no such key in this index but we might need to
-		 * descend into the B+tree so we just break out of the loop.
-		 */
-		if (rc == -1)
-			break;
-		
-		if (!rc) {
-			*ie_out = ie;
-			errno = 0;
-			icx->parent_pos[icx->pindex] = item;
-			return STATUS_OK;
+		if (rc > 0)
+			lo = mid + 1;
+		else {
+			hi = mid;
+			last = rc;
 		}
-		
-		item++;
+	}
+	item = lo;
+	ie = table[item];
+	if (!last) {
+		*ie_out = ie;
+		errno = 0;
+		icx->parent_pos[icx->pindex] = item;
+		return STATUS_OK;
 	}
 	/*
 	 * We have finished with this index block without success. Check for the
@@ -578,7 +1054,7 @@ static ntfs_attr *ntfs_ia_open(ntfs_index_context *icx, ntfs_inode *ni)
 {
 	ntfs_attr *na;
 	
-	na = ntfs_attr_open(ni, AT_INDEX_ALLOCATION, icx->name, icx->name_len);
+	na = ntfs_index_ia_open(ni, icx->name, icx->name_len);
 	if (!na) {
 		ntfs_log_perror("Failed to open index allocation of inode "
 				"%llu", (unsigned long long)ni->mft_no);
@@ -590,10 +1066,22 @@ static ntfs_attr *ntfs_ia_open(ntfs_index_context *icx, ntfs_inode *ni)
 
 static int ntfs_ib_read(ntfs_index_context *icx, VCN vcn, INDEX_BLOCK *dst)
 {
+	struct DEFERRED_BLOCK *block;
 	s64 pos, ret;
 
 	ntfs_log_trace("vcn: %lld\n", (long long)vcn);
 	
+	if (icx->deferred) {
+		block = ntfs_deferred_find(icx->deferred, vcn);
+		if (block) {
+			NTFS_PROBE4(index__read, icx->ni->mft_no, vcn,
+					icx->block_size, 1);
+			memcpy(dst, block->ib, icx->block_size);
+			return 0;
+		}
+	}
+
+	NTFS_PROBE4(index__read, icx->ni->mft_no, vcn, icx->block_size, 0);
 	pos = ntfs_ib_vcn_to_pos(icx, vcn);
 
 	ret = ntfs_attr_mst_pread(icx->ia_na, pos, 1, icx->block_size, (u8 *)dst);
@@ -673,6 +1161,9 @@ int ntfs_index_lookup(const void *key, const int key_len, ntfs_index_context *ic
 	INDEX_ROOT *ir;
 	INDEX_ENTRY *ie;
 	INDEX_BLOCK *ib = NULL;
+	const FILE_NAME_ATTR *fn;
+	const ntfschar *upkey;
+	ntfschar upname[NTFS_MAX_NAME_LEN];
 	int ret, err = 0;
 
 	ntfs_log_trace("Entering\n");
@@ -710,13 +1201,28 @@ int ntfs_index_lookup(const void *key, const int key_len, ntfs_index_context *ic
 				(unsigned)le32_to_cpu(ir->collation_rule));
 		goto err_out;
 	}
+	icx->collation_rule = ir->collation_rule;
+		/* upcase the name looked for once for all */
+	upkey = (const ntfschar*)NULL;
+	fn = (const FILE_NAME_ATTR*)key;
+	if ((ir->collation_rule == COLLATION_FILE_NAME)
+	    && (key_len >= (int)offsetof(FILE_NAME_ATTR, file_name))
+	    && (key_len >= (int)(offsetof(FILE_NAME_ATTR, file_name)
+				+ fn->file_name_length*sizeof(ntfschar)))) {
+		memcpy(upname, fn->file_name,
+				fn->file_name_length*sizeof(ntfschar));
+		ntfs_name_upcase(upname, fn->file_name_length,
+				ni->vol->upcase, ni->vol->upcase_len);
+		upkey = upname;
+	}
 	
 	old_vcn = VCN_INDEX_ROOT_PARENT;
 	/* 
 	 * FIXME: check for both ir and ib that the first index entry is
 	 * within the index block.
 	 */
-	ret = ntfs_ie_lookup(key, key_len, icx, &ir->index, &vcn, &ie);
+	ret = ntfs_ie_lookup(key, key_len, upkey, icx, &ir->index,
+				&vcn, &ie);
 	if (ret == STATUS_ERROR) {
 		err = errno;
 		goto err_out;
@@ -738,7 +1244,7 @@ int ntfs_index_lookup(const void *key, const int key_len, ntfs_index_context *ic
 	if (!icx->ia_na)
 		goto err_out;
 	
-	ib = ntfs_malloc(icx->block_size);
+	ib = ntfs_index_buffer_get(ni->vol, icx->block_size);
 	if (!ib) {
 		err = errno;
 		goto err_out;
@@ -758,7 +1264,8 @@ descend_into_child_node:
 	if (ntfs_ib_read(icx, vcn, ib))
 		goto err_out;
 	
-	ret = ntfs_ie_lookup(key, key_len, icx, &ib->index, &vcn, &ie);
+	ret = ntfs_ie_lookup(key, key_len, upkey, icx, &ib->index,
+				&vcn, &ie);
 	if (ret != STATUS_KEEP_SEARCHING) {
 		err = errno;
 		if (ret == STATUS_ERROR)
@@ -780,7 +1287,10 @@ descend_into_child_node:
 	
 	goto descend_into_child_node;
 err_out:
-	free(ib);
+	ntfs_index_buffer_put(ni->vol, ib, icx->block_size);
+		/* the search context is only released with an entry */
+	ntfs_attr_put_search_ctx(icx->actx);
+	icx->actx = (ntfs_attr_search_ctx*)NULL;
 	if (!err)
 		err = EIO;
 	errno = err;
@@ -798,7 +1308,7 @@ done:
 
 }
 
-static INDEX_BLOCK *ntfs_ib_alloc(VCN ib_vcn, u32 ib_size, 
+static INDEX_BLOCK *ntfs_ib_alloc(ntfs_volume *vol, VCN ib_vcn, u32 ib_size,
 				  INDEX_HEADER_FLAGS node_type)
 {
 	INDEX_BLOCK *ib;
@@ -806,9 +1316,10 @@ static INDEX_BLOCK *ntfs_ib_alloc(VCN ib_vcn, u32 ib_size,
 	
 	ntfs_log_trace("ib_vcn: %lld ib_size: %u\n", (long long)ib_vcn, ib_size);
 	
-	ib = ntfs_calloc(ib_size);
+	ib = ntfs_index_buffer_get(vol, ib_size);
 	if (!ib)
 		return NULL;
+	memset(ib, 0, ib_size);
 	
 	ib->magic = magic_INDX;
 	ib->usa_ofs = const_cpu_to_le16(sizeof(INDEX_BLOCK));
@@ -986,7 +1497,8 @@ out:
 	return vcn;
 }
 
-static INDEX_BLOCK *ntfs_ir_to_ib(INDEX_ROOT *ir, VCN ib_vcn)
+static INDEX_BLOCK *ntfs_ir_to_ib(ntfs_volume *vol, INDEX_ROOT *ir,
+				  VCN ib_vcn)
 {
 	INDEX_BLOCK *ib;
 	INDEX_ENTRY *ie_last;
@@ -995,7 +1507,8 @@ static INDEX_BLOCK *ntfs_ir_to_ib(INDEX_ROOT *ir, VCN ib_vcn)
 	
 	ntfs_log_trace("Entering\n");
 	
-	ib = ntfs_ib_alloc(ib_vcn, le32_to_cpu(ir->index_block_size), LEAF_NODE);
+	ib = ntfs_ib_alloc(vol, ib_vcn, le32_to_cpu(ir->index_block_size),
+			   LEAF_NODE);
 	if (!ib)
 		return NULL;
 	
@@ -1046,7 +1559,7 @@ static int ntfs_ib_copy_tail(ntfs_index_context *icx, INDEX_BLOCK *src,
 	
 	ntfs_log_trace("Entering\n");
 	
-	dst = ntfs_ib_alloc(new_vcn, icx->block_size, 
+	dst = ntfs_ib_alloc(icx->ni->vol, new_vcn, icx->block_size,
 			    src->index.ih_flags & NODE_MASK);
 	if (!dst)
 		return STATUS_ERROR;
@@ -1061,7 +1574,7 @@ static int ntfs_ib_copy_tail(ntfs_index_context *icx, INDEX_BLOCK *src,
 					      le32_to_cpu(dst->index.entries_offset));
 	ret = ntfs_ib_write(icx, dst);
 
-	free(dst);
+	ntfs_index_buffer_put(icx->ni->vol, dst, icx->block_size);
 	return ret;
 }
 
@@ -1107,7 +1620,8 @@ static int ntfs_ia_add(ntfs_index_context *icx)
 		}
 	}
 	
-	icx->ia_na = ntfs_ia_open(icx, icx->ni);
+	if (!icx->ia_na)
+		icx->ia_na = ntfs_ia_open(icx, icx->ni);
 	if (!icx->ia_na)
 		return -1;
 
@@ -1142,7 +1656,7 @@ static int ntfs_ir_reparent(ntfs_index_context *icx)
 	if (!ir)
 		goto clear_bmp;
 	
-	ib = ntfs_ir_to_ib(ir, new_ib_vcn);
+	ib = ntfs_ir_to_ib(icx->ni->vol, ir, new_ib_vcn);
 	if (ib == NULL) {
 		ntfs_log_perror("Failed to move index root to index block");
 		goto clear_bmp;
@@ -1199,7 +1713,7 @@ retry :
 	
 	ret = STATUS_OK;
 err_out:
-	free(ib);
+	ntfs_index_buffer_put(icx->ni->vol, ib, icx->block_size);
 	ntfs_attr_put_search_ctx(ctx);
 out:
 	return ret;
@@ -1373,7 +1887,7 @@ static int ntfs_ib_insert(ntfs_index_context *icx, INDEX_ENTRY *ie, VCN new_vcn)
 
 	ntfs_log_trace("Entering\n");
 	
-	ib = ntfs_malloc(icx->block_size);
+	ib = ntfs_index_buffer_get(icx->ni->vol, icx->block_size);
 	if (!ib)
 		return -1;
 	
@@ -1400,7 +1914,7 @@ static int ntfs_ib_insert(ntfs_index_context *icx, INDEX_ENTRY *ie, VCN new_vcn)
 	
 	err = STATUS_OK;
 err_out:	
-	free(ib);
+	ntfs_index_buffer_put(icx->ni->vol, ib, icx->block_size);
 	return err;
 }
 
@@ -1551,12 +2065,202 @@ int ntfs_index_add_filename(ntfs_inode *ni, FILE_NAME_ATTR *fn, MFT_REF mref)
 	ret = ntfs_ie_add(icx, ie);
 	err = errno;
 	ntfs_index_ctx_put(icx);
+	ni->vol->dir_generation++;
+	if (!ret)
+		ntfs_dirindex_add(ni, fn, mref);
+	else
+		if (err != EEXIST)
+			ntfs_dirindex_invalidate(ni);
 	errno = err;
 out:
 	free(ie);
 	return ret;
 }
 
+/*
+ *		Batches of filenames to insert into a directory index
+ */
+
+struct BATCH_ENTRY {
+	ntfs_volume *vol;
+	INDEX_ENTRY *ie;
+} ;
+
+struct _ntfs_index_batch {
+	ntfs_inode *ni;
+	struct BATCH_ENTRY *entries;
+	int count;
+	int allocated;
+} ;
+
+/**
+ * ntfs_index_batch_get - prepare a batch of filenames to insert
+ * @dir_ni:	ntfs inode of the directory to insert the filenames into
+ *
+ * The filenames are then queued by ntfs_index_batch_add() and they are
+ * only inserted into the index by ntfs_index_batch_commit(), so they
+ * cannot be looked up in the meantime.
+ *
+ * Return the batch, or NULL on error with errno set to the error code.
+ */
+ntfs_index_batch *ntfs_index_batch_get(ntfs_inode *dir_ni)
+{
+	ntfs_index_batch *batch;
+
+	if (!dir_ni) {
+		errno = EINVAL;
+		return NULL;
+	}
+	batch = ntfs_calloc(sizeof(ntfs_index_batch));
+	if (batch)
+		batch->ni = dir_ni;
+	return batch;
+}
+
+/**
+ * ntfs_index_batch_add - queue a filename for insertion
+ * @batch:	batch got from ntfs_index_batch_get()
+ * @fn:		FILE_NAME attribute to add
+ * @mref:	reference of the inode which @fn describes
+ *
+ * Return 0 on success or -1 on error with errno set to the error code.
+ */
+int ntfs_index_batch_add(ntfs_index_batch *batch, const FILE_NAME_ATTR *fn,
+		MFT_REF mref)
+{
+	struct BATCH_ENTRY *entries;
+	INDEX_ENTRY *ie;
+	int fn_size, ie_size;
+
+	if (!batch || !fn) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (batch->count >= batch->allocated) {
+		entries = realloc(batch->entries, (batch->allocated + 64)
+					*sizeof(struct BATCH_ENTRY));
+		if (!entries) {
+			errno = ENOMEM;
+			return -1;
+		}
+		batch->entries = entries;
+		batch->allocated += 64;
+	}
+	fn_size = (fn->file_name_length * sizeof(ntfschar)) +
+			sizeof(FILE_NAME_ATTR);
+	ie_size = (sizeof(INDEX_ENTRY_HEADER) + fn_size + 7) & ~7;
+	ie = ntfs_calloc(ie_size);
+	if (!ie)
+		return -1;
+	ie->indexed_file = cpu_to_le64(mref);
+	ie->length 	 = cpu_to_le16(ie_size);
+	ie->key_length 	 = cpu_to_le16(fn_size);
+	memcpy(&ie->key, fn, fn_size);
+	batch->entries[batch->count].vol = batch->ni->vol;
+	batch->entries[batch->count].ie = ie;
+	batch->count++;
+	return 0;
+}
+
+static int ntfs_batch_cmp(const void *p1, const void *p2)
+{
+	const struct BATCH_ENTRY *e1 = (const struct BATCH_ENTRY*)p1;
+	const struct BATCH_ENTRY *e2 = (const struct BATCH_ENTRY*)p2;
+	const FILE_NAME_ATTR *fn1 = &e1->ie->key.file_name;
+	const FILE_NAME_ATTR *fn2 = &e2->ie->key.file_name;
+
+	return ntfs_names_full_collate(
+			(const ntfschar*)((const u8*)fn1 + offsetof(FILE_NAME_ATTR, file_name)),
+			fn1->file_name_length,
+			(const ntfschar*)((const u8*)fn2 + offsetof(FILE_NAME_ATTR, file_name)),
+			fn2->file_name_length,
+			CASE_SENSITIVE, e1->vol->upcase, e1->vol->upcase_len);
+}
+
+/**
+ * ntfs_index_batch_commit - insert a batch of filenames and free the batch
+ * @batch:	batch got from ntfs_index_batch_get()
+ *
+ * The filenames are inserted in collation order, so that consecutive
+ * insertions mostly apply to the same index blocks, and the index blocks
+ * are kept in memory and only written once when all the filenames have
+ * been inserted, whatever the count of insertions or splits they got.
+ *
+ * The insertion stops on the first error, the filenames collating
+ * before the failing one being inserted. The batch is freed in all
+ * situations.
+ *
+ * Return 0 on success or -1 on error with errno set to the error code.
+ */
+int ntfs_index_batch_commit(ntfs_index_batch *batch)
+{
+	struct DEFERRED_BLOCKS *db;
+	ntfs_index_context *icx;
+	INDEX_ENTRY *ie;
+	u32 block_size;
+	u8 vcn_size_bits;
+	int ret, err, i;
+
+	if (!batch) {
+		errno = EINVAL;
+		return -1;
+	}
+	ret = STATUS_OK;
+	err = 0;
+	block_size = 0;
+	vcn_size_bits = 0;
+	icx = (ntfs_index_context*)NULL;
+	db = (struct DEFERRED_BLOCKS*)NULL;
+	if (batch->count) {
+		qsort(batch->entries, batch->count,
+				sizeof(struct BATCH_ENTRY), ntfs_batch_cmp);
+		icx = ntfs_index_ctx_get(batch->ni, NTFS_INDEX_I30, 4);
+		db = ntfs_calloc(sizeof(struct DEFERRED_BLOCKS));
+		if (!icx || !db) {
+			err = errno;
+			ret = STATUS_ERROR;
+		} else
+			icx->deferred = db;
+	}
+	for (i=0; !ret && (i<batch->count); i++) {
+		ie = batch->entries[i].ie;
+		ret = ntfs_ie_add(icx, ie);
+		if (ret) {
+			err = errno;
+			if (err != EEXIST)
+				ntfs_dirindex_invalidate(batch->ni);
+		} else
+			ntfs_dirindex_add(batch->ni, &ie->key.file_name,
+					le64_to_cpu(ie->indexed_file));
+		if (icx->block_size) {
+			block_size = icx->block_size;
+			vcn_size_bits = icx->vcn_size_bits;
+		}
+		ntfs_index_ctx_reinit(icx);
+	}
+	if (icx)
+		ntfs_index_ctx_put(icx);
+	batch->ni->vol->dir_generation++;
+	if (db) {
+		if (ntfs_deferred_flush(batch->ni, NTFS_INDEX_I30, 4, db,
+				block_size, vcn_size_bits)) {
+			if (!ret) {
+				err = errno;
+				ret = STATUS_ERROR;
+			}
+			ntfs_dirindex_invalidate(batch->ni);
+		}
+		free(db);
+	}
+	for (i=0; i<batch->count; i++)
+		free(batch->entries[i].ie);
+	free(batch->entries);
+	free(batch);
+	if (ret)
+		errno = err;
+	return ret;
+}
+
 static int ntfs_ih_takeout(ntfs_index_context *icx, INDEX_HEADER *ih,
 			   INDEX_ENTRY *ie, INDEX_BLOCK *ib)
 {
@@ -1643,7 +2347,7 @@ static int ntfs_index_rm_leaf(ntfs_index_context *icx)
 	if (ntfs_icx_parent_vcn(icx) == VCN_INDEX_ROOT_PARENT)
 		parent_ih = &icx->ir->index;
 	else {
-		ib = ntfs_malloc(icx->block_size);
+		ib = ntfs_index_buffer_get(icx->ni->vol, icx->block_size);
 		if (!ib)
 			return STATUS_ERROR;
 		
@@ -1675,7 +2379,7 @@ static int ntfs_index_rm_leaf(ntfs_index_context *icx)
 ok:	
 	ret = STATUS_OK;
 out:
-	free(ib);
+	ntfs_index_buffer_put(icx->ni->vol, ib, icx->block_size);
 	return ret;
 }
 
@@ -1697,7 +2401,7 @@ static int ntfs_index_rm_node(ntfs_index_context *icx)
 			return STATUS_ERROR;
 	}
 
-	ib = ntfs_malloc(icx->block_size);
+	ib = ntfs_index_buffer_get(icx->ni->vol, icx->block_size);
 	if (!ib)
 		return STATUS_ERROR;
 	
@@ -1783,7 +2487,7 @@ descend:
 out2:
 	free(ie);
 out:
-	free(ib);
+	ntfs_index_buffer_put(icx->ni->vol, ib, icx->block_size);
 	return ret;
 }
 
@@ -1852,6 +2556,7 @@ int ntfs_index_remove(ntfs_inode *dir_ni,
 	if (!icx)
 		return -1;
 
+	dir_ni->vol->dir_generation++;
 	while (1) {
 				
 		if (ntfs_index_lookup(key, keylen, icx))
@@ -1868,12 +2573,14 @@ int ntfs_index_remove(ntfs_inode *dir_ni,
 	}
 
 	ntfs_inode_mark_dirty(icx->actx->ntfs_ino);
+	ntfs_dirindex_remove(dir_ni, (const FILE_NAME_ATTR*)key);
 out:	
 	ntfs_index_ctx_put(icx);
 	return ret;
 err_out:
 	ret = STATUS_ERROR;
 	ntfs_log_perror("Delete failed");
+	ntfs_dirindex_invalidate(dir_ni);
 	goto out;
 }
 
@@ -1932,7 +2639,8 @@ static INDEX_ENTRY *ntfs_index_walk_down(INDEX_ENTRY *ie,
 			/* down from level zero */
 
 			ictx->ir = (INDEX_ROOT*)NULL;
-			ictx->ib = (INDEX_BLOCK*)ntfs_malloc(ictx->block_size);
+			ictx->ib = ntfs_index_buffer_get(ictx->ni->vol,
+					ictx->block_size);
 			ictx->pindex = 1;
 			ictx->is_in_root = FALSE;
 		} else {
@@ -1972,7 +2680,8 @@ static INDEX_ENTRY *ntfs_index_walk_up(INDEX_ENTRY *ie,
 
 					/* we have reached the root */
 
-				free(ictx->ib);
+				ntfs_index_buffer_put(ictx->ni->vol, ictx->ib,
+					ictx->block_size);
 				ictx->ib = (INDEX_BLOCK*)NULL;
 				ictx->is_in_root = TRUE;
 				/* a new search context is to be allocated */
@@ -2076,3 +2785,685 @@ INDEX_ENTRY *ntfs_index_next(INDEX_ENTRY *ie, ntfs_index_context *ictx)
 }
 
 
+
+/*
+ *		Sequential scans of indexes
+ *
+ *	When all the entries of an index are wanted in no particular
+ *	order, walking the tree reads the blocks in the collating order
+ *	of their entries, and each block is read one at a time. A scan
+ *	rather reads the index root, then the index blocks in use in the
+ *	order of their positions, in batches of INDEX_SCAN_SIZE bytes.
+ *	The entries of non-leaf nodes also have data, so all the nodes
+ *	are examined in the same way.
+ */
+
+struct INDEX_SCAN {
+	ntfs_inode *ni;
+	ntfs_attr *ia_na;	/* NULL if there is no index allocation */
+	INDEX_ROOT *ir;		/* copy of the index root */
+	u8 *bitmap;		/* index blocks in use */
+	char *batch;		/* index blocks read together */
+	s64 next;		/* next block to examine */
+	s64 end;		/* block after the last one to examine */
+	s64 first;		/* first block in the batch */
+	s64 count;		/* count of blocks in the batch */
+	s64 capacity;		/* max count of blocks in a batch */
+	INDEX_ENTRY *entry;	/* next entry to examine in the node */
+	u8 *index_end;		/* end of the entries of the node */
+	u32 block_size;
+	u8 vcn_size_bits;
+	int errors;		/* count of nodes which could not be used */
+} ;
+
+/*
+ *		Read a batch of index blocks, beginning with @block
+ *
+ *	The blocks which cannot be read are left out of the batch, and
+ *	the ones after them will be read in a later batch.
+ */
+
+static void scan_load_blocks(struct INDEX_SCAN *scan, s64 block)
+{
+	s64 count;
+	s64 br;
+
+	count = scan->end - block;
+	if (count > scan->capacity)
+		count = scan->capacity;
+	br = ntfs_attr_mst_pread(scan->ia_na, block*scan->block_size,
+			count, scan->block_size, scan->batch);
+	scan->first = block;
+	scan->count = (br > 0 ? br : 0);
+}
+
+/*
+ *		Locate the entries of the next index block in use
+ *
+ *	Returns TRUE if one was found, FALSE at the end of the index
+ */
+
+static BOOL scan_next_block(struct INDEX_SCAN *scan)
+{
+	INDEX_BLOCK *ib;
+	s64 block;
+	VCN vcn;
+	BOOL found;
+
+	found = FALSE;
+	scan->entry = (INDEX_ENTRY*)NULL;
+	while (!found && (scan->next < scan->end)) {
+		block = scan->next++;
+		if (scan->bitmap[block >> 3] & (1 << (block & 7))) {
+			if ((block < scan->first)
+			    || (block >= (scan->first + scan->count)))
+				scan_load_blocks(scan, block);
+			ib = (INDEX_BLOCK*)&scan->batch[(block - scan->first)
+						* scan->block_size];
+			vcn = (block * scan->block_size)
+					>> scan->vcn_size_bits;
+			if ((block < (scan->first + scan->count))
+			    && ntfs_is_indx_record(ib->magic)
+			    && (sle64_to_cpu(ib->index_block_vcn) == vcn)
+			    && ((le32_to_cpu(ib->index.allocated_size) + 0x18)
+					== scan->block_size)
+			    && ((le32_to_cpu(ib->index.index_length) + 0x18)
+					<= scan->block_size)) {
+				scan->entry = ntfs_ie_get_first(&ib->index);
+				scan->index_end = ntfs_ie_get_end(&ib->index);
+				found = TRUE;
+			} else {
+				ntfs_log_error("Bad index block: VCN %lld of "
+					"inode %llu\n",(long long)vcn,
+					(unsigned long long)scan->ni->mft_no);
+				scan->errors++;
+			}
+		}
+	}
+	return (found);
+}
+
+/**
+ * ntfs_index_scan_start - start a sequential scan of an index
+ * @ni:		inode of the index
+ * @name:	name of the index
+ * @name_len:	length of the index name
+ *
+ * Prepare for returning all the entries of the index, in no defined
+ * order. The index must not be modified until the scan is ended, and
+ * the inode must be kept open.
+ *
+ * Return the scan state on success or NULL on error, with errno set to
+ * the error code.
+ */
+struct INDEX_SCAN *ntfs_index_scan_start(ntfs_inode *ni, ntfschar *name,
+			u32 name_len)
+{
+	struct INDEX_SCAN *scan;
+	s64 root_size;
+	s64 bitmap_size;
+	int err;
+
+	scan = (struct INDEX_SCAN*)ntfs_calloc(sizeof(struct INDEX_SCAN));
+	if (!scan)
+		return (struct INDEX_SCAN*)NULL;
+	scan->ni = ni;
+	scan->ir = (INDEX_ROOT*)ntfs_attr_readall(ni, AT_INDEX_ROOT,
+				name, name_len, &root_size);
+	if (!scan->ir)
+		goto err_out;
+	scan->block_size = le32_to_cpu(scan->ir->index_block_size);
+	if ((root_size < (s64)sizeof(INDEX_ROOT))
+	    || ((s64)(offsetof(INDEX_ROOT, index)
+			+ le32_to_cpu(scan->ir->index.index_length))
+				> root_size)
+	    || (scan->block_size < NTFS_BLOCK_SIZE)) {
+		errno = EIO;
+		ntfs_log_perror("Bad index root in inode %llu",
+				(unsigned long long)ni->mft_no);
+		goto err_out;
+	}
+	if (ni->vol->cluster_size <= scan->block_size)
+		scan->vcn_size_bits = ni->vol->cluster_size_bits;
+	else
+		scan->vcn_size_bits = NTFS_BLOCK_SIZE_BITS;
+	scan->entry = ntfs_ie_get_first(&scan->ir->index);
+	scan->index_end = ntfs_ie_get_end(&scan->ir->index);
+	if (ntfs_attr_exist(ni, AT_INDEX_ALLOCATION, name, name_len)) {
+		scan->ia_na = ntfs_index_ia_open(ni, name, name_len);
+		if (!scan->ia_na)
+			goto err_out;
+		scan->bitmap = (u8*)ntfs_attr_readall(ni, AT_BITMAP,
+				name, name_len, &bitmap_size);
+		if (!scan->bitmap)
+			goto err_out;
+		scan->end = scan->ia_na->initialized_size / scan->block_size;
+		if (scan->end > (bitmap_size << 3))
+			scan->end = bitmap_size << 3;
+		scan->capacity = INDEX_SCAN_SIZE / scan->block_size;
+		if (scan->capacity < 1)
+			scan->capacity = 1;
+		scan->batch = (char*)ntfs_malloc(scan->capacity
+					* scan->block_size);
+		if (!scan->batch)
+			goto err_out;
+	}
+	return (scan);
+err_out:
+	err = errno;
+	if (scan->ia_na)
+		ntfs_index_ia_close(scan->ia_na);
+	free(scan->bitmap);
+	free(scan->ir);
+	free(scan);
+	errno = err;
+	return (struct INDEX_SCAN*)NULL;
+}
+
+/**
+ * ntfs_index_scan_next - get the next entry of a scan
+ * @scan:	scan state, as returned by ntfs_index_scan_start()
+ * @pie:	where to store the address of the entry
+ *
+ * Only the entries with a key are returned. The entry remains at the
+ * returned address until the next call.
+ *
+ * Return TRUE if an entry is returned, or FALSE after the last one
+ */
+BOOL ntfs_index_scan_next(struct INDEX_SCAN *scan, INDEX_ENTRY **pie)
+{
+	INDEX_ENTRY *ie;
+	BOOL found;
+
+	found = FALSE;
+	do {
+		ie = scan->entry;
+		if (ie
+		    && ((u8*)ie + sizeof(INDEX_ENTRY_HEADER)
+				<= scan->index_end)
+		    && (le16_to_cpu(ie->length) >= sizeof(INDEX_ENTRY_HEADER))
+		    && ((u8*)ie + le16_to_cpu(ie->length) <= scan->index_end)
+		    && !(ie->ie_flags & INDEX_ENTRY_END)) {
+			scan->entry = ntfs_ie_get_next(ie);
+			*pie = ie;
+			found = TRUE;
+		} else {
+				/* a node must be terminated by an end entry */
+			if (ie
+			    && (((u8*)ie + sizeof(INDEX_ENTRY_HEADER)
+					> scan->index_end)
+				|| !(ie->ie_flags & INDEX_ENTRY_END)))
+				scan->errors++;
+			scan->entry = (INDEX_ENTRY*)NULL;
+			if (!scan->ia_na || !scan_next_block(scan))
+				break;
+		}
+	} while (!found);
+	return (found);
+}
+
+/**
+ * ntfs_index_scan_end - end a sequential scan of an index
+ * @scan:	scan state, as returned by ntfs_index_scan_start()
+ *
+ * Return 0 if all the nodes could be examined, or -1 with errno set
+ * to EIO if some of them were skipped as unreadable or corrupted.
+ */
+int ntfs_index_scan_end(struct INDEX_SCAN *scan)
+{
+	int res;
+
+	res = 0;
+	if (scan->errors) {
+		errno = EIO;
+		res = -1;
+	}
+	if (scan->ia_na)
+		ntfs_index_ia_close(scan->ia_na);
+	free(scan->bitmap);
+	free(scan->batch);
+	free(scan->ir);
+	free(scan);
+	return (res);
+}
+
+/*
+ *		Rebuilding of indexes
+ *
+ *	Removing entries only frees the index blocks which become empty,
+ *	so after most of the entries of a big index have been removed,
+ *	the remaining ones may be spread over many nearly empty blocks
+ *	in a tree deeper than needed, and looking up or listing the index
+ *	still reads all of them. A rebuild collects the live entries,
+ *	sorts them in collating order, and loads them into a new tree,
+ *	each block being filled before the next one is begun. The new
+ *	blocks are written from the beginning of the index allocation,
+ *	which is then truncated to them, and the index root is left with
+ *	a single entry pointing to the top block.
+ *
+ *	The new tree overwrites the old one, so all the entries are kept
+ *	in memory until it is complete, and an interrupted rebuild leaves
+ *	the index to be repaired by chkdsk.
+ */
+
+struct REBUILD_ENTRY {
+	INDEX_ENTRY *ie;	/* copy of the entry, without a subnode */
+	const struct INDEX_REBUILD *rb;
+} ;
+
+struct INDEX_REBUILD {
+	ntfs_inode *ni;
+	ntfs_attr *ia_na;	/* NULL when only counting the blocks */
+	COLLATE collate;
+	s64 blocks;		/* count of blocks of the new tree */
+	u32 block_size;
+	u32 space;		/* room for the entries of a block */
+	u8 vcn_size_bits;
+} ;
+
+static int rebuild_cmp(const void *p1, const void *p2)
+{
+	const struct REBUILD_ENTRY *e1 = (const struct REBUILD_ENTRY*)p1;
+	const struct REBUILD_ENTRY *e2 = (const struct REBUILD_ENTRY*)p2;
+
+	return (e1->rb->collate(e1->rb->ni->vol,
+			&e1->ie->key, le16_to_cpu(e1->ie->key_length),
+			&e2->ie->key, le16_to_cpu(e2->ie->key_length)));
+}
+
+/*
+ *		Build a node of the new tree from @count keys
+ *
+ *	The keys get the subnodes @vcns[0] to @vcns[count - 1], and the
+ *	end entry gets @vcns[count], unless @vcns is NULL for a leaf.
+ *	The node is only written when the index allocation is open.
+ *
+ *	Returns 0 with the VCN of the node in @vcn, or -1 on error
+ */
+
+static int rebuild_node(struct INDEX_REBUILD *rb, INDEX_ENTRY **keys,
+			const VCN *vcns, s64 count, VCN *vcn)
+{
+	INDEX_BLOCK *ib;
+	INDEX_ENTRY *ie;
+	s64 pos;
+	u16 len;
+	s64 i;
+	int res;
+
+	res = 0;
+	pos = rb->blocks * rb->block_size;
+	*vcn = pos >> rb->vcn_size_bits;
+	if (rb->ia_na) {
+		ib = ntfs_ib_alloc(rb->ni->vol, *vcn, rb->block_size,
+				(vcns ? INDEX_NODE : LEAF_NODE));
+		if (!ib)
+			return (-1);
+		ie = ntfs_ie_get_first(&ib->index);
+		for (i=0; i<count; i++) {
+			len = le16_to_cpu(keys[i]->length);
+			memcpy(ie, keys[i], len);
+			if (vcns) {
+				ie->length = cpu_to_le16(len + sizeof(VCN));
+				ie->ie_flags |= INDEX_ENTRY_NODE;
+				ntfs_ie_set_vcn(ie, vcns[i]);
+			}
+			ie = ntfs_ie_get_next(ie);
+		}
+		memset(ie, 0, sizeof(INDEX_ENTRY_HEADER));
+		ie->length = const_cpu_to_le16(sizeof(INDEX_ENTRY_HEADER));
+		ie->ie_flags = INDEX_ENTRY_END;
+		if (vcns) {
+			ie->length = const_cpu_to_le16(
+				sizeof(INDEX_ENTRY_HEADER) + sizeof(VCN));
+			ie->ie_flags |= INDEX_ENTRY_NODE;
+			ntfs_ie_set_vcn(ie, vcns[count]);
+		}
+		ie = ntfs_ie_get_next(ie);
+		ib->index.index_length = cpu_to_le32((u8*)ie
+						- (u8*)&ib->index);
+		if (ntfs_attr_mst_pwrite(rb->ia_na, pos, 1,
+					rb->block_size, ib) != 1) {
+			ntfs_log_perror("Failed to write index block %lld, "
+					"inode %llu", (long long)*vcn,
+					(unsigned long long)rb->ni->mft_no);
+			res = -1;
+		}
+		ntfs_index_buffer_put(rb->ni->vol, ib, rb->block_size);
+	}
+	rb->blocks++;
+	return (res);
+}
+
+/*
+ *		Pack a level of the new tree into nodes
+ *
+ *	Each node is filled with as many of the @count keys as it can
+ *	hold, and the key after it is moved up to the upper level, with
+ *	the node as its subnode. The last node keeps at least two keys
+ *	when possible, so that it is not left empty. The keys and the
+ *	subnodes moved up replace the ones of the level in @keys and
+ *	@vcns, which only holds subnodes on input if @leaf is FALSE.
+ *
+ *	Returns the count of keys moved up, or -1 on error
+ */
+
+static s64 rebuild_level(struct INDEX_REBUILD *rb, INDEX_ENTRY **keys,
+			VCN *vcns, s64 count, BOOL leaf)
+{
+	u32 extra;
+	u32 size;
+	s64 nodes;
+	s64 i, k;
+	VCN vcn;
+
+	extra = (leaf ? 0 : sizeof(VCN));
+	nodes = 0;
+	i = 0;
+	do {
+		size = sizeof(INDEX_ENTRY_HEADER) + extra;
+		for (k=0; ((i + k) < count)
+		    && ((size + le16_to_cpu(keys[i + k]->length) + extra)
+				<= rb->space); k++)
+			size += le16_to_cpu(keys[i + k]->length) + extra;
+		if ((i + k) < count) {
+			if (!k) {
+				errno = EIO;
+				ntfs_log_perror("Index entry too long in "
+					"inode %llu",
+					(unsigned long long)rb->ni->mft_no);
+				return (-1);
+			}
+			if (((i + k + 1) == count) && (k > 1))
+				k--;
+		}
+		if (rebuild_node(rb, &keys[i], (leaf ? (VCN*)NULL : &vcns[i]),
+				k, &vcn))
+			return (-1);
+		vcns[nodes] = vcn;
+		if ((i + k) < count)
+			keys[nodes] = keys[i + k];
+		nodes++;
+		i += k + 1;
+	} while (i <= count);
+	return (nodes - 1);
+}
+
+/*
+ *		Build the new tree over the sorted entries
+ *
+ *	Returns 0 with the VCN of the top node in @top, or -1 on error
+ */
+
+static int rebuild_tree(struct INDEX_REBUILD *rb,
+			const struct REBUILD_ENTRY *entries,
+			INDEX_ENTRY **keys, VCN *vcns, s64 count, VCN *top)
+{
+	BOOL leaf;
+	s64 i;
+
+	for (i=0; i<count; i++)
+		keys[i] = entries[i].ie;
+	rb->blocks = 0;
+	leaf = TRUE;
+	do {
+		count = rebuild_level(rb, keys, vcns, count, leaf);
+		leaf = FALSE;
+	} while (count > 0);
+	*top = vcns[0];
+	return (count ? -1 : 0);
+}
+
+/*
+ *		Set the index root to point to the top node of the new tree,
+ *	or to be an empty leaf when the index has no entries.
+ */
+
+static int rebuild_root(ntfs_inode *ni, ntfschar *name, u32 name_len,
+			BOOL empty, VCN top)
+{
+	ntfs_attr_search_ctx *ctx;
+	INDEX_ROOT *ir;
+	INDEX_ENTRY *ie;
+	int res;
+
+	res = -1;
+	ctx = (ntfs_attr_search_ctx*)NULL;
+	ir = ntfs_ir_lookup(ni, name, name_len, &ctx);
+	if (ir) {
+		ie = ntfs_ie_get_first(&ir->index);
+		memset(ie, 0, sizeof(INDEX_ENTRY_HEADER));
+		if (empty) {
+			ie->length = const_cpu_to_le16(
+					sizeof(INDEX_ENTRY_HEADER));
+			ie->ie_flags = INDEX_ENTRY_END;
+			ir->index.ih_flags = SMALL_INDEX;
+		} else {
+			ie->length = const_cpu_to_le16(
+				sizeof(INDEX_ENTRY_HEADER) + sizeof(VCN));
+			ie->ie_flags = INDEX_ENTRY_END | INDEX_ENTRY_NODE;
+			ntfs_ie_set_vcn(ie, top);
+			ir->index.ih_flags = LARGE_INDEX;
+		}
+		ir->index.index_length = cpu_to_le32(
+				le32_to_cpu(ir->index.entries_offset)
+				+ le16_to_cpu(ie->length));
+		ir->index.allocated_size = ir->index.index_length;
+		if (!ntfs_resident_attr_value_resize(ctx->mrec, ctx->attr,
+				offsetof(INDEX_ROOT, index)
+				+ le32_to_cpu(ir->index.allocated_size))) {
+			ntfs_inode_mark_dirty(ctx->ntfs_ino);
+			res = 0;
+		}
+		ntfs_attr_put_search_ctx(ctx);
+	}
+	return (res);
+}
+
+/*
+ *		Mark the first @blocks index blocks as the ones in use,
+ *	and shrink the bitmap to them.
+ */
+
+static int rebuild_bitmap(ntfs_inode *ni, ntfschar *name, u32 name_len,
+			s64 blocks)
+{
+	ntfs_attr *na;
+	u8 *bm;
+	s64 size;
+	int res;
+
+	res = -1;
+		/* at least 8 bytes, in multiples of 8 bytes */
+	size = ((blocks + 63) >> 6) << 3;
+	if (size < 8)
+		size = 8;
+	bm = (u8*)ntfs_calloc(size);
+	if (!bm)
+		return (-1);
+	memset(bm, 255, blocks >> 3);
+	if (blocks & 7)
+		bm[blocks >> 3] = (1 << (blocks & 7)) - 1;
+	na = ntfs_attr_open(ni, AT_BITMAP, name, name_len);
+	if (!na)
+		ntfs_log_perror("Failed to open $BITMAP attribute");
+	else {
+		if (!ntfs_attr_truncate(na, size)
+		    && (ntfs_attr_pwrite(na, 0, size, bm) == size))
+			res = 0;
+		else
+			ntfs_log_perror("Failed to update $BITMAP");
+		ntfs_attr_close(na);
+	}
+	free(bm);
+	return (res);
+}
+
+/*
+ *		Count the index blocks in use
+ */
+
+static s64 rebuild_used(const struct INDEX_SCAN *scan)
+{
+	s64 used;
+	s64 block;
+
+	used = 0;
+	for (block=0; block<scan->end; block++)
+		if (scan->bitmap[block >> 3] & (1 << (block & 7)))
+			used++;
+	return (used);
+}
+
+/**
+ * ntfs_index_rebuild - pack the entries of an index into a new tree
+ * @ni:		inode of the index
+ * @name:	name of the index
+ * @name_len:	length of the index name
+ * @before:	where to store the count of index blocks used before
+ * @count_only:	TRUE if the index is only to be examined
+ *
+ * Rebuild the index as a tree of fully filled blocks, and free the
+ * index blocks which are not needed any more. Nothing is done when
+ * this would not free any block, when the index has no index
+ * allocation, or when @count_only is set. The index must not be in
+ * use by another context.
+ *
+ * Return the count of index blocks used after the rebuild, or which
+ * would be used with @count_only, or -1 on error with errno set to
+ * the error code. When the error occurs while writing the new tree,
+ * the index is left damaged.
+ */
+s64 ntfs_index_rebuild(ntfs_inode *ni, ntfschar *name, u32 name_len,
+			s64 *before, BOOL count_only)
+{
+	struct INDEX_REBUILD rb;
+	struct INDEX_SCAN *scan;
+	struct REBUILD_ENTRY *entries;
+	struct REBUILD_ENTRY *p;
+	INDEX_ENTRY **keys;
+	INDEX_ENTRY *ie;
+	INDEX_BLOCK *ib;
+	VCN *vcns;
+	VCN top;
+	s64 allocated;
+	s64 count;
+	s64 used;
+	s64 i;
+	int err;
+
+	if (!ni || !before) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (ni->nr_extents == -1)
+		ni = ni->base_ni;
+	*before = 0;
+	top = 0;
+	if (ntfs_idxcache_flush_inode(ni->vol, ni->mft_no))
+		return (-1);
+	scan = ntfs_index_scan_start(ni, name, name_len);
+	if (!scan)
+		return (-1);
+	if (!scan->ia_na) {
+		ntfs_index_scan_end(scan);
+		return (0);
+	}
+	used = rebuild_used(scan);
+	*before = used;
+	memset(&rb, 0, sizeof(rb));
+	rb.ni = ni;
+	rb.block_size = scan->block_size;
+	rb.vcn_size_bits = scan->vcn_size_bits;
+	rb.collate = ntfs_get_collate_function(scan->ir->collation_rule);
+	err = (rb.collate ? 0 : EOPNOTSUPP);
+	if (!(scan->ir->index.ih_flags & LARGE_INDEX))
+		err = EIO;
+		/* collect the entries */
+	entries = (struct REBUILD_ENTRY*)NULL;
+	allocated = 0;
+	count = 0;
+	while (!err && ntfs_index_scan_next(scan, &ie)) {
+		if (count >= allocated) {
+			allocated += (allocated ? allocated : 256);
+			p = (struct REBUILD_ENTRY*)realloc(entries,
+				allocated*sizeof(struct REBUILD_ENTRY));
+			if (!p) {
+				err = ENOMEM;
+				break;
+			}
+			entries = p;
+		}
+		entries[count].rb = &rb;
+		entries[count].ie = ntfs_ie_dup_novcn(ie);
+		if (!entries[count].ie)
+			err = ENOMEM;
+		else
+			count++;
+	}
+	if (ntfs_index_scan_end(scan) && !err) {
+		ntfs_log_error("Not rebuilding the damaged index of "
+			"inode %llu\n", (unsigned long long)ni->mft_no);
+		err = EIO;
+	}
+	keys = (INDEX_ENTRY**)NULL;
+	vcns = (VCN*)NULL;
+	if (!err) {
+		qsort(entries, count, sizeof(struct REBUILD_ENTRY),
+				rebuild_cmp);
+		for (i=1; (i<count) && !err; i++)
+			if (!rebuild_cmp(&entries[i - 1], &entries[i])) {
+				ntfs_log_error("Duplicated entry in the index "
+					"of inode %llu\n",
+					(unsigned long long)ni->mft_no);
+				err = EIO;
+			}
+	}
+	if (!err) {
+		keys = (INDEX_ENTRY**)ntfs_malloc((count + 1)
+					*sizeof(INDEX_ENTRY*));
+		vcns = (VCN*)ntfs_malloc((count + 1)*sizeof(VCN));
+		ib = ntfs_ib_alloc(ni->vol, 0, rb.block_size, LEAF_NODE);
+		if (!keys || !vcns || !ib)
+			err = ENOMEM;
+		if (ib) {
+			rb.space = le32_to_cpu(ib->index.allocated_size)
+				- le32_to_cpu(ib->index.entries_offset);
+			ntfs_index_buffer_put(ni->vol, ib, rb.block_size);
+		}
+	}
+		/* count the blocks needed, then build the tree if worth */
+	if (!err && count
+	    && rebuild_tree(&rb, entries, keys, vcns, count, &top))
+		err = errno;
+	if (!err && count_only)
+		used = rb.blocks;
+	else if (!err && (rb.blocks < used)) {
+		rb.ia_na = ntfs_index_ia_open(ni, name, name_len);
+		if (!rb.ia_na
+		    || (count
+			&& rebuild_tree(&rb, entries, keys, vcns, count, &top))
+		    || rebuild_root(ni, name, name_len, !count, top)
+		    || rebuild_bitmap(ni, name, name_len, rb.blocks)
+		    || ntfs_attr_truncate(rb.ia_na,
+				rb.blocks*rb.block_size)) {
+			err = (errno ? errno : EIO);
+			ntfs_log_perror("Failed to rebuild the index of "
+				"inode %llu",
+				(unsigned long long)ni->mft_no);
+		}
+		ntfs_index_ia_close(rb.ia_na);
+		ni->vol->dir_generation++;
+		used = rb.blocks;
+	}
+	for (i=0; i<count; i++)
+		free(entries[i].ie);
+	free(entries);
+	free(keys);
+	free(vcns);
+	if (err) {
+		errno = err;
+		used = -1;
+	}
+	return (used);
+}
@@ -45,6 +45,7 @@
 #include "types.h"
 #include "volume.h"
 #include "cache.h"
+#include "lock.h"
 #include "inode.h"
 #include "attrib.h"
 #include "debug.h"
@@ -55,8 +56,15 @@
 #include "index.h"
 #include "dir.h"
 #include "ntfstime.h"
+#include "device.h"
+#include "devcache.h"
+#include "mftcache.h"
+#include "idxcache.h"
+#include "bmpcache.h"
+#include "usnjrnl.h"
 #include "logging.h"
 #include "misc.h"
+#include "probe.h"
 
 ntfs_inode *ntfs_inode_base(ntfs_inode *ni)
 {
@@ -82,24 +90,132 @@ void ntfs_inode_mark_dirty(ntfs_inode *ni)
 		NInoSetDirty(ni->base_ni);
 }
 
+/*
+ *		Pool of inodes with an embedded record
+ *
+ *	The inodes opened from the volume are allocated in a single block
+ *	with room for their mft record, so that opening an inode only
+ *	needs one allocation, and the blocks are kept for reuse when
+ *	the inodes are released. The inodes allocated by
+ *	ntfs_inode_allocate() are not concerned, as their callers
+ *	manage the mft record.
+ *
+ *	The pool is protected by the cache lock.
+ */
+
+#define INODE_ALLOC_SIZE ((sizeof(ntfs_inode) + 15) & ~15)
+
+struct INODE_POOL {
+	int count;
+	ntfs_inode *inodes[INODE_POOL_SIZE];
+} ;
+
+/*
+ *		Free the pool of a volume, when unmounting
+ */
+
+void ntfs_inode_pool_release(ntfs_volume *vol)
+{
+	struct INODE_POOL *pool;
+	int i;
+
+	pool = vol->inode_pool;
+	if (pool) {
+		vol->inode_pool = (struct INODE_POOL*)NULL;
+		for (i=0; i<pool->count; i++)
+			free(pool->inodes[i]);
+		free(pool);
+	}
+}
+
 /**
  * __ntfs_inode_allocate - Create and initialise an NTFS inode object
- * @vol:
+ * @vol:	volume of the inode
+ * @embed:	TRUE if room for the mft record is to be allocated along
+ *		with the inode
  *
- * Description...
+ * When @embed is set, ni->mrec points to the room for the record,
+ * and the inode is taken from the pool of the volume if possible.
  *
- * Returns:
+ * Returns the inode, or NULL with errno set
  */
-static ntfs_inode *__ntfs_inode_allocate(ntfs_volume *vol)
+static ntfs_inode *__ntfs_inode_allocate(ntfs_volume *vol, BOOL embed)
 {
+	struct INODE_POOL *pool;
 	ntfs_inode *ni;
 
-	ni = (ntfs_inode*)ntfs_calloc(sizeof(ntfs_inode));
+	if (embed) {
+		ni = (ntfs_inode*)NULL;
+		ntfs_cache_lock(vol);
+		pool = vol->inode_pool;
+		if (pool && pool->count)
+			ni = pool->inodes[--pool->count];
+		ntfs_cache_unlock(vol);
+		if (ni)
+			memset(ni, 0, sizeof(ntfs_inode));
+		else
+			ni = (ntfs_inode*)ntfs_calloc(INODE_ALLOC_SIZE
+					+ vol->mft_record_size);
+		if (ni) {
+			ni->mrec = (MFT_RECORD*)((char*)ni + INODE_ALLOC_SIZE);
+			NInoSetEmbeddedRecord(ni);
+		}
+	} else
+		ni = (ntfs_inode*)ntfs_calloc(sizeof(ntfs_inode));
 	if (ni)
 		ni->vol = vol;
 	return ni;
 }
 
+/*
+ *		Get a held inode and count a new opening
+ *
+ *	Returns NULL if the inode is not held
+ */
+
+static ntfs_inode *get_held_inode(ntfs_volume *vol, u64 inum)
+{
+	ntfs_inode *ni;
+
+	ni = (ntfs_inode*)NULL;
+	if (vol && vol->held_inodes) {
+		ntfs_cache_lock(vol);
+		for (ni=vol->held_inodes; ni && (ni->mft_no != inum);
+				ni=ni->next_held) { }
+		if (ni)
+			ni->open_count++;
+		ntfs_cache_unlock(vol);
+	}
+	return (ni);
+}
+
+/*
+ *		Count the closing of a held inode
+ *
+ *	When this is the last opening, the inode is removed from the
+ *	list of held inodes, and it has to be closed by the caller.
+ *
+ *	Returns TRUE if the inode is still in use
+ */
+
+static BOOL unhold_inode(ntfs_inode *ni)
+{
+	ntfs_inode **pni;
+	BOOL inuse;
+
+	ntfs_cache_lock(ni->vol);
+	inuse = (--ni->open_count > 0);
+	if (!inuse) {
+		for (pni=&ni->vol->held_inodes; *pni && (*pni != ni);
+				pni=&(*pni)->next_held) { }
+		if (*pni)
+			*pni = ni->next_held;
+		ni->next_held = (ntfs_inode*)NULL;
+	}
+	ntfs_cache_unlock(ni->vol);
+	return (inuse);
+}
+
 /**
  * ntfs_inode_allocate - Create an NTFS inode object
  * @vol:
@@ -110,7 +226,7 @@ static ntfs_inode *__ntfs_inode_allocate(ntfs_volume *vol)
  */
 ntfs_inode *ntfs_inode_allocate(ntfs_volume *vol)
 {
-	return __ntfs_inode_allocate(vol);
+	return __ntfs_inode_allocate(vol, FALSE);
 }
 
 /**
@@ -123,12 +239,36 @@ ntfs_inode *ntfs_inode_allocate(ntfs_volume *vol)
  */
 static void __ntfs_inode_release(ntfs_inode *ni)
 {
+	struct INODE_POOL *pool;
+	ntfs_volume *vol;
+
 	if (NInoDirty(ni))
 		ntfs_log_error("Releasing dirty inode %lld!\n", 
 			       (long long)ni->mft_no);
 	if (NInoAttrList(ni) && ni->attr_list)
 		free(ni->attr_list);
-	free(ni->mrec);
+	ntfs_attrlist_index_free(ni);
+	if (ni->index_na)
+		ntfs_attr_close(ni->index_na);
+	ntfs_stream_forget_all(ni);
+	free(ni->stream_names);
+	if (NInoEmbeddedRecord(ni)) {
+		vol = ni->vol;
+		if (ni->mrec
+		    != (MFT_RECORD*)((char*)ni + INODE_ALLOC_SIZE))
+			free(ni->mrec);
+		ntfs_cache_lock(vol);
+		if (!vol->inode_pool)
+			vol->inode_pool = (struct INODE_POOL*)
+				ntfs_calloc(sizeof(struct INODE_POOL));
+		pool = vol->inode_pool;
+		if (pool && (pool->count < INODE_POOL_SIZE)) {
+			pool->inodes[pool->count++] = ni;
+			ni = (ntfs_inode*)NULL;
+		}
+		ntfs_cache_unlock(vol);
+	} else
+		free(ni->mrec);
 	free(ni);
 	return;
 }
@@ -170,7 +310,7 @@ static ntfs_inode *ntfs_inode_real_open(ntfs_volume *vol, const MFT_REF mref)
 		errno = EINVAL;
 		goto out;
 	}
-	ni = __ntfs_inode_allocate(vol);
+	ni = __ntfs_inode_allocate(vol, TRUE);
 	if (!ni)
 		goto out;
 	if (ntfs_file_record_read(vol, mref, &ni->mrec, NULL))
@@ -387,6 +527,11 @@ int ntfs_inode_real_close(ntfs_inode *ni)
 			ntfs_log_error("Extent inode %lld was not found\n",
 				       (long long)ni->mft_no);
 	}
+	/* A held inode is only freed when deleted, forget it */
+	if (ni->open_count) {
+		ni->open_count = 1;
+		unhold_inode(ni);
+	}
 	
 	__ntfs_inode_release(ni);
 	ret = 0;
@@ -413,8 +558,7 @@ void ntfs_inode_nidata_free(const struct CACHED_GENERIC *cached)
 
 int ntfs_inode_nidata_hash(const struct CACHED_GENERIC *item)
 {
-	return (((const struct CACHED_NIDATA*)item)->inum
-			% (2*CACHE_NIDATA_SIZE));
+	return (((const struct CACHED_NIDATA*)item)->inum & 0x7fffffff);
 }
 
 /*
@@ -442,8 +586,10 @@ void ntfs_inode_invalidate(ntfs_volume *vol, const MFT_REF mref)
 	item.ni = (ntfs_inode*)NULL;
 	item.pathname = (const char*)NULL;
 	item.varsize = 0;
+	ntfs_cache_lock(vol);
 	ntfs_invalidate_cache(vol->nidata_cache,
 				GENERIC(&item),idata_cache_compare,CACHE_FREE);
+	ntfs_cache_unlock(vol);
 }
 
 #endif
@@ -465,11 +611,15 @@ ntfs_inode *ntfs_inode_open(ntfs_volume *vol, const MFT_REF mref)
 	struct CACHED_NIDATA item;
 	struct CACHED_NIDATA *cached;
 
+	ni = get_held_inode(vol, MREF(mref));
+	if (ni)
+		return (ni);
 		/* fetch idata from cache */
 	item.inum = MREF(mref);
 	debug_double_inode(item.inum,1);
 	item.pathname = (const char*)NULL;
 	item.varsize = 0;
+	ntfs_cache_lock(vol);
 	cached = (struct CACHED_NIDATA*)ntfs_fetch_cache(vol->nidata_cache,
 				GENERIC(&item),idata_cache_compare);
 	if (cached) {
@@ -477,18 +627,49 @@ ntfs_inode *ntfs_inode_open(ntfs_volume *vol, const MFT_REF mref)
 		/* do not keep open entries in cache */
 		ntfs_remove_cache(vol->nidata_cache,
 				(struct CACHED_GENERIC*)cached,0);
+		ntfs_cache_unlock(vol);
 	} else {
+		ntfs_cache_unlock(vol);
 		ni = ntfs_inode_real_open(vol, mref);
 	}
+	NTFS_PROBE2(inode__open, item.inum, (cached != NULL));
 	if (!ni) {
 		debug_double_inode(item.inum, 0);
 	}
 #else
-	ni = ntfs_inode_real_open(vol, mref);
+	ni = get_held_inode(vol, MREF(mref));
+	if (!ni) {
+		ni = ntfs_inode_real_open(vol, mref);
+		NTFS_PROBE2(inode__open, MREF(mref), 0);
+	}
 #endif
 	return (ni);
 }
 
+/*
+ *		Keep an open inode available to further openings
+ *
+ *	A program which keeps an inode open across several operations
+ *	(such as a file open by some descriptor) declares it as held,
+ *	so that further openings of the same inode get the same
+ *	ntfs_inode instead of an independent copy. Each opening still
+ *	has to be matched by a close, and the inode is only synced
+ *	when the last one is closed.
+ *
+ *	The opening by the caller is counted as the first one.
+ */
+
+void ntfs_inode_hold(ntfs_inode *ni)
+{
+	ntfs_cache_lock(ni->vol);
+	if (!ni->open_count) {
+		ni->open_count = 1;
+		ni->next_held = ni->vol->held_inodes;
+		ni->vol->held_inodes = ni;
+	}
+	ntfs_cache_unlock(ni->vol);
+}
+
 /*
  *		Close an inode entry
  *
@@ -505,7 +686,14 @@ int ntfs_inode_close(ntfs_inode *ni)
 #if CACHE_NIDATA_SIZE
 	BOOL dirty;
 	struct CACHED_NIDATA item;
+	struct CACHED_NIDATA *cached;
+	ntfs_inode *old_ni;
 
+		/* a held inode is only closed by its last user */
+	if (ni && ni->open_count && unhold_inode(ni))
+		return (0);
+	if (ni && ni->usn_reasons)
+		ntfs_usn_record(ni, NULL, NULL, 0, USN_REASON_CLOSE);
 	if (ni) {
 		debug_double_inode(ni->mft_no,0);
 		/* do not cache system files : could lead to double entries */
@@ -530,8 +718,23 @@ int ntfs_inode_close(ntfs_inode *ni)
 				item.pathname = (const char*)NULL;
 				item.varsize = 0;
 				debug_cached_inode(ni);
-				ntfs_enter_cache(ni->vol->nidata_cache,
+				old_ni = (ntfs_inode*)NULL;
+				ntfs_cache_lock(ni->vol);
+				cached = (struct CACHED_NIDATA*)ntfs_enter_cache(
+					ni->vol->nidata_cache,
 					GENERIC(&item), idata_cache_compare);
+					/*
+					 * The inode was opened twice (possibly
+					 * by concurrent readers) : keep the
+					 * latest synced copy, drop the other.
+					 */
+				if (cached && (cached->ni != ni)) {
+					old_ni = cached->ni;
+					cached->ni = ni;
+				}
+				ntfs_cache_unlock(ni->vol);
+				if (old_ni)
+					ntfs_inode_real_close(old_ni);
 			}
 		} else {
 			/* cache not ready or system file, really close */
@@ -540,11 +743,77 @@ int ntfs_inode_close(ntfs_inode *ni)
 	} else
 		res = 0;
 #else
-	res = ntfs_inode_real_close(ni);
+	if (ni && ni->open_count && unhold_inode(ni))
+		res = 0;
+	else {
+		if (ni && ni->usn_reasons)
+			ntfs_usn_record(ni, NULL, NULL, 0, USN_REASON_CLOSE);
+		res = ntfs_inode_real_close(ni);
+	}
 #endif
 	return (res);
 }
 
+/*
+ *		Get the position of an extent in the table of its base inode
+ *
+ *	The extents are ordered by mft number, so this is the position
+ *	of the extent if it is attached, or where it has to be inserted.
+ */
+
+static s32 extent_position(ntfs_inode *base_ni, u64 mft_no)
+{
+	s32 low, high, mid;
+
+	low = 0;
+	high = (base_ni->nr_extents > 0 ? base_ni->nr_extents : 0);
+	while (low < high) {
+		mid = (low + high)/2;
+		if (base_ni->extent_nis[mid]->mft_no < mft_no)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return (low);
+}
+
+/**
+ * ntfs_inode_attach_extent - attach an extent inode to its base inode
+ * @base_ni:	base ntfs inode
+ * @ni:		extent inode, with its mft number set
+ *
+ * The table of extents grows by four entries at a time, and is kept
+ * ordered by mft number, so that ntfs_extent_inode_open() can find
+ * an extent by a binary search in inodes with many extents.
+ *
+ * Return 0 on success or -1 on error with errno set to the error code.
+ */
+int ntfs_inode_attach_extent(ntfs_inode *base_ni, ntfs_inode *ni)
+{
+	ntfs_inode **extent_nis;
+	s32 i;
+
+	if (!(base_ni->nr_extents & 3)) {
+		i = (base_ni->nr_extents + 4) * sizeof(ntfs_inode *);
+
+		extent_nis = ntfs_malloc(i);
+		if (!extent_nis)
+			return (-1);
+		if (base_ni->nr_extents) {
+			memcpy(extent_nis, base_ni->extent_nis,
+					i - 4 * sizeof(ntfs_inode *));
+			free(base_ni->extent_nis);
+		}
+		base_ni->extent_nis = extent_nis;
+	}
+	i = extent_position(base_ni, ni->mft_no);
+	memmove(&base_ni->extent_nis[i + 1], &base_ni->extent_nis[i],
+			(base_ni->nr_extents - i) * sizeof(ntfs_inode *));
+	base_ni->extent_nis[i] = ni;
+	base_ni->nr_extents++;
+	return (0);
+}
+
 /**
  * ntfs_extent_inode_open - load an extent inode and attach it to its base
  * @base_ni:	base ntfs inode
@@ -577,8 +846,7 @@ ntfs_inode *ntfs_extent_inode_open(ntfs_inode *base_ni, const leMFT_REF mref)
 	runlist_element *rl;
 	ntfs_volume *vol;
 	ntfs_inode *ni = NULL;
-	ntfs_inode **extent_nis;
-	int i;
+	s32 i;
 
 	if (!base_ni) {
 		errno = EINVAL;
@@ -590,6 +858,8 @@ ntfs_inode *ntfs_extent_inode_open(ntfs_inode *base_ni, const leMFT_REF mref)
 			(unsigned long long)mft_no,
 			(unsigned long long)base_ni->mft_no);
 	
+		/* the extents of system inodes are shared by readers */
+	ntfs_inode_lock(base_ni);
 	if (!base_ni->mft_no) {
 			/*
 			 * When getting extents of MFT, we must be sure
@@ -622,29 +892,25 @@ ntfs_inode *ntfs_extent_inode_open(ntfs_inode *base_ni, const leMFT_REF mref)
 	}
 
 	/* Is the extent inode already open and attached to the base inode? */
-	if (base_ni->nr_extents > 0) {
-		extent_nis = base_ni->extent_nis;
-		for (i = 0; i < base_ni->nr_extents; i++) {
-			u16 seq_no;
-
-			ni = extent_nis[i];
-			if (mft_no != ni->mft_no)
-				continue;
-			/* Verify the sequence number if given. */
-			seq_no = MSEQNO_LE(mref);
-			if (seq_no && seq_no != le16_to_cpu(
-					ni->mrec->sequence_number)) {
-				errno = EIO;
-				ntfs_log_perror("Found stale extent mft "
-					"reference mft=%lld",
-					(long long)ni->mft_no);
-				goto out;
-			}
-			goto out;
+	i = extent_position(base_ni, mft_no);
+	if ((i < base_ni->nr_extents)
+	    && (base_ni->extent_nis[i]->mft_no == mft_no)) {
+		u16 seq_no;
+
+		ni = base_ni->extent_nis[i];
+		/* Verify the sequence number if given. */
+		seq_no = MSEQNO_LE(mref);
+		if (seq_no && seq_no != le16_to_cpu(
+				ni->mrec->sequence_number)) {
+			errno = EIO;
+			ntfs_log_perror("Found stale extent mft "
+				"reference mft=%lld",
+				(long long)ni->mft_no);
 		}
+		goto out;
 	}
 	/* Wasn't there, we need to load the extent inode. */
-	ni = __ntfs_inode_allocate(base_ni->vol);
+	ni = __ntfs_inode_allocate(base_ni->vol, TRUE);
 	if (!ni)
 		goto out;
 	if (ntfs_file_record_read(base_ni->vol, le64_to_cpu(mref), &ni->mrec, NULL))
@@ -653,21 +919,10 @@ ntfs_inode *ntfs_extent_inode_open(ntfs_inode *base_ni, const leMFT_REF mref)
 	ni->nr_extents = -1;
 	ni->base_ni = base_ni;
 	/* Attach extent inode to base inode, reallocating memory if needed. */
-	if (!(base_ni->nr_extents & 3)) {
-		i = (base_ni->nr_extents + 4) * sizeof(ntfs_inode *);
-
-		extent_nis = ntfs_malloc(i);
-		if (!extent_nis)
-			goto err_out;
-		if (base_ni->nr_extents) {
-			memcpy(extent_nis, base_ni->extent_nis,
-					i - 4 * sizeof(ntfs_inode *));
-			free(base_ni->extent_nis);
-		}
-		base_ni->extent_nis = extent_nis;
-	}
-	base_ni->extent_nis[base_ni->nr_extents++] = ni;
+	if (ntfs_inode_attach_extent(base_ni, ni))
+		goto err_out;
 out:
+	ntfs_inode_unlock(base_ni);
 	ntfs_log_leave("\n");
 	return ni;
 err_out:
@@ -883,7 +1138,10 @@ static int ntfs_inode_sync_file_name(ntfs_inode *ni, ntfs_inode *dir_ni)
 			 * attribute update implied the unnamed data to be
 			 * made non-resident
 			 */
-			fn->allocated_size = fnx->allocated_size;
+			if (fn->allocated_size != fnx->allocated_size) {
+				fn->allocated_size = fnx->allocated_size;
+				ntfs_inode_mark_dirty(ctx->ntfs_ino);
+			}
 		}
 			/* update or clear the reparse tag in the index */
 		fnx->reparse_point_tag = reparse_tag;
@@ -924,6 +1182,61 @@ err_out:
 	return -1;
 }
 
+/*
+ *		Deferred updates of the FILE_NAME index entries
+ *
+ *	The sizes and times of a file are duplicated in the directory
+ *	entries of all its links, and updating them when the file is
+ *	closed implies an index lookup and an index block rewrite per
+ *	link. When enabled, only the inode number is recorded on close,
+ *	so that the repeated closings of a file being appended to are
+ *	coalesced into a single update.
+ *
+ *	The recorded updates are applied by ntfs_inode_flush_file_names(),
+ *	which the caller must invoke while it has no inode open (apart
+ *	from held ones), when a directory is read, on fsync and regularly,
+ *	and on unmount. Nothing in the library reads the duplicated data
+ *	from the index, so they are only late for outsiders.
+ */
+
+struct DEFERRED_NAMES {
+	int delay;		/* max age of the updates, seconds */
+	int count;
+	time_t oldest;		/* time of the first update recorded */
+	u64 list[DEFERRED_FILE_NAMES];
+} ;
+
+/*
+ *		Record a deferred update of the FILE_NAME index entries
+ *
+ *	Returns TRUE if the update was recorded, FALSE if it has to be
+ *	done immediately (not enabled, system file or list full)
+ */
+
+static BOOL defer_file_names(ntfs_inode *ni)
+{
+	struct DEFERRED_NAMES *dn;
+	BOOL deferred;
+	int i;
+
+	deferred = FALSE;
+	dn = ni->vol->deferred_names;
+	if (dn && (ni->mft_no >= FILE_first_user)) {
+		ntfs_cache_lock(ni->vol);
+		for (i=0; (i<dn->count) && (dn->list[i] != ni->mft_no); i++) { }
+		if (i < DEFERRED_FILE_NAMES) {
+			if (i == dn->count) {
+				if (!i)
+					dn->oldest = time((time_t*)NULL);
+				dn->list[dn->count++] = ni->mft_no;
+			}
+			deferred = TRUE;
+		}
+		ntfs_cache_unlock(ni->vol);
+	}
+	return (deferred);
+}
+
 /**
  * ntfs_inode_sync - write the inode (and its dirty extents) to disk
  * @ni:		ntfs inode to write
@@ -968,6 +1281,7 @@ static int ntfs_inode_sync_in_dir(ntfs_inode *ni, ntfs_inode *dir_ni)
 	/* Update FILE_NAME's in the index. */
 	if ((ni->mrec->flags & MFT_RECORD_IN_USE) && ni->nr_extents != -1 &&
 			NInoFileNameTestAndClearDirty(ni) &&
+			!defer_file_names(ni) &&
 			ntfs_inode_sync_file_name(ni, dir_ni)) {
 		if (!err || errno == EIO) {
 			err = errno;
@@ -1076,6 +1390,182 @@ int ntfs_inode_sync(ntfs_inode *ni)
 	return (ntfs_inode_sync_in_dir(ni, (ntfs_inode*)NULL));
 }
 
+/*
+ *		Write the cached device blocks of a part of an attribute
+ *
+ *	The attribute is a system one, such as $MFT or $Bitmap, whose
+ *	runlist is mapped. A resident attribute is in the record of its
+ *	inode.
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+static int flush_attr_blocks(ntfs_attr *na, s64 pos, s64 count)
+{
+	ntfs_volume *vol;
+	runlist_element *rl;
+	s64 start, end;
+	int err;
+
+	vol = na->ni->vol;
+	if (!NAttrNonResident(na))
+		return (flush_attr_blocks(vol->mft_na,
+				na->ni->mft_no << vol->mft_record_size_bits,
+				vol->mft_record_size));
+	if (ntfs_attr_map_whole_runlist(na))
+		return (-1);
+	err = 0;
+	for (rl=na->rl; rl && rl->length; rl++) {
+		start = rl->vcn << vol->cluster_size_bits;
+		end = (rl->vcn + rl->length) << vol->cluster_size_bits;
+		if (start < pos)
+			start = pos;
+		if (end > (pos + count))
+			end = pos + count;
+		if ((rl->lcn >= 0) && (start < end)
+		    && ntfs_devcache_flush_range(vol->dev,
+				(rl->lcn << vol->cluster_size_bits) + start
+					- (rl->vcn << vol->cluster_size_bits),
+				end - start))
+			err = errno;
+	}
+	if (err) {
+		errno = err;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ *		Write the cached device blocks of the clusters of an
+ *	attribute of an inode, and of the bits of $Bitmap for them
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+static int flush_clusters(ntfs_inode *ni, ATTR_TYPES type,
+			ntfschar *name, u32 name_len)
+{
+	ntfs_volume *vol;
+	ntfs_attr *na;
+	runlist_element *rl;
+	int err;
+
+	vol = ni->vol;
+	na = ntfs_attr_open(ni, type, name, name_len);
+	if (!na)
+		return (errno == ENOENT ? 0 : -1);
+	err = 0;
+	if (NAttrNonResident(na)) {
+		if (ntfs_attr_map_whole_runlist(na))
+			err = errno;
+		for (rl=na->rl; !err && rl && rl->length; rl++) {
+			if ((rl->lcn >= 0)
+			    && (ntfs_devcache_flush_range(vol->dev,
+					rl->lcn << vol->cluster_size_bits,
+					rl->length << vol->cluster_size_bits)
+				|| flush_attr_blocks(vol->lcnbmp_na,
+					rl->lcn >> 3,
+					((rl->lcn + rl->length + 7) >> 3)
+						- (rl->lcn >> 3))))
+				err = errno;
+		}
+	}
+	ntfs_attr_close(na);
+	if (err) {
+		errno = err;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ *		Write the cached device blocks of an mft record and of its
+ *	bit in $MFT:$BITMAP
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+static int flush_record(ntfs_volume *vol, s64 mft_no)
+{
+	if (ntfs_mftcache_flush_record(vol, mft_no))
+		return (-1);
+	if (!ntfs_devcache_lower_ops(vol->dev)
+	    && (flush_attr_blocks(vol->mft_na,
+			mft_no << vol->mft_record_size_bits,
+			vol->mft_record_size)
+		|| flush_attr_blocks(vol->mftbmp_na, mft_no >> 3, 1)))
+		return (-1);
+	return (0);
+}
+
+/**
+ * ntfs_inode_fsync - write the modifications of an inode to the device
+ * @ni:		inode to sync
+ * @datasync:	only what is needed to read the data back
+ *
+ * Unlike syncing the volume, only the state which belongs to the inode
+ * is written from the write-back caches : its mft records and their
+ * bits in $MFT:$BITMAP, its index blocks when it is a directory, the
+ * bits set in the bitmaps, and the cached device blocks holding them
+ * or its data. The device is then synced. With @datasync, an mft record
+ * only modified for its times is not written.
+ *
+ * The index entries of the inode in its parent directories are not
+ * written, as with other filesystems, this needs syncing the directory.
+ *
+ * Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+int ntfs_inode_fsync(ntfs_inode *ni, BOOL datasync)
+{
+	ntfs_volume *vol;
+	BOOL isdir;
+	int err;
+	int i;
+
+	vol = ni->vol;
+	err = 0;
+	isdir = (ni->mrec->flags & MFT_RECORD_IS_DIRECTORY) != 0;
+	if (isdir && ntfs_inode_flush_file_names(vol, TRUE))
+		err = errno;
+	if ((NInoAttrListDirty(ni)
+	    || (NInoDirty(ni) && !(datasync && NInoTimesOnlyDirty(ni))))
+	    && ntfs_inode_sync(ni) && !err)
+		err = errno;
+		/* bits set, before the records which use them */
+	if (ntfs_bmpcache_flush(vol, FALSE) && !err)
+		err = errno;
+	if (isdir && ntfs_idxcache_flush_inode(vol, ni->mft_no) && !err)
+		err = errno;
+	if (flush_record(vol, ni->mft_no) && !err)
+		err = errno;
+	for (i=0; i<ni->nr_extents; i++)
+		if (flush_record(vol, ni->extent_nis[i]->mft_no) && !err)
+			err = errno;
+	if (!ntfs_devcache_lower_ops(vol->dev)) {
+		if (NInoAttrList(ni)
+		    && flush_clusters(ni, AT_ATTRIBUTE_LIST, AT_UNNAMED, 0)
+		    && !err)
+			err = errno;
+		if (isdir) {
+			if (flush_clusters(ni, AT_INDEX_ALLOCATION,
+					NTFS_INDEX_I30, 4) && !err)
+				err = errno;
+		} else
+			if (flush_clusters(ni, AT_DATA, AT_UNNAMED, 0)
+			    && !err)
+				err = errno;
+	}
+	if (!err && ntfs_devcache_sync_lower(vol->dev))
+		err = errno;
+	if (err) {
+		errno = err;
+		return (-1);
+	}
+	return (0);
+}
+
 /*
  *		Close an inode with an open parent inode
  */
@@ -1093,6 +1583,112 @@ int ntfs_inode_close_in_dir(ntfs_inode *ni, ntfs_inode *dir_ni)
 	return (res);
 }
 
+/*
+ *		Apply the recorded updates of FILE_NAME index entries
+ *
+ *	The list is emptied first, so that updates recorded meanwhile
+ *	are kept for the next flush.
+ */
+
+static int apply_file_names(ntfs_volume *vol, struct DEFERRED_NAMES *dn)
+{
+	u64 list[DEFERRED_FILE_NAMES];
+	ntfs_inode *ni;
+	int count;
+	int err;
+	int i;
+
+	err = 0;
+	ntfs_cache_lock(vol);
+	count = dn->count;
+	memcpy(list, dn->list, count*sizeof(u64));
+	dn->count = 0;
+	ntfs_cache_unlock(vol);
+	for (i=0; i<count; i++) {
+			/* the file may have been deleted meanwhile */
+		ni = ntfs_inode_open(vol, list[i]);
+		if (ni) {
+			if (ntfs_inode_sync_file_name(ni, (ntfs_inode*)NULL)
+			    && !err)
+				err = errno;
+			if (ntfs_inode_close(ni) && !err)
+				err = errno;
+		}
+	}
+	if (err) {
+		errno = err;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ *		Apply the deferred updates of FILE_NAME index entries
+ *
+ *	When @force is not set, they are only applied if the oldest one
+ *	is older than the delay, or if the list is getting full.
+ *	The caller must not have any inode open, apart from held ones.
+ *
+ *	Returns 0 if successful, or -1 if some update failed (errno set)
+ */
+
+int ntfs_inode_flush_file_names(ntfs_volume *vol, BOOL force)
+{
+	struct DEFERRED_NAMES *dn;
+	int res;
+
+	res = 0;
+	dn = vol->deferred_names;
+	if (dn && dn->count
+	    && (force
+		|| (dn->count >= DEFERRED_FILE_NAMES/2)
+		|| ((time((time_t*)NULL) - dn->oldest) >= dn->delay)))
+		res = apply_file_names(vol, dn);
+	return (res);
+}
+
+BOOL ntfs_inode_file_names_pending(const ntfs_volume *vol)
+{
+	return (vol->deferred_names && vol->deferred_names->count);
+}
+
+/*
+ *		Enable or disable the deferred updates of FILE_NAME entries
+ *
+ *	When @delay is positive, the updates are deferred for at most
+ *	@delay seconds, otherwise the pending ones are applied and no
+ *	more updates are deferred.
+ *
+ *	Returns 0 if successful, or -1 if there was an error (errno set)
+ */
+
+int ntfs_inode_defer_file_names(ntfs_volume *vol, int delay)
+{
+	struct DEFERRED_NAMES *dn;
+	int res;
+
+	res = 0;
+	dn = vol->deferred_names;
+	if (delay > 0) {
+		if (!dn) {
+			dn = (struct DEFERRED_NAMES*)
+				ntfs_malloc(sizeof(struct DEFERRED_NAMES));
+			if (!dn)
+				return (-1);
+			dn->count = 0;
+			vol->deferred_names = dn;
+		}
+		dn->delay = delay;
+	} else
+		if (dn) {
+				/* no more deferring while flushing */
+			vol->deferred_names = (struct DEFERRED_NAMES*)NULL;
+			res = apply_file_names(vol, dn);
+			free(dn);
+		}
+	return (res);
+}
+
 /**
  * ntfs_inode_add_attrlist - add attribute list to inode and fill it
  * @ni: opened ntfs inode to which add attribute list
@@ -1270,6 +1866,7 @@ rollback:
 		ale = (ATTR_LIST_ENTRY*)((u8*)ale + le16_to_cpu(ale->length));
 	}
 	/* Remove in-memory attribute list. */
+	ntfs_attrlist_index_free(ni);
 	ni->attr_list = NULL;
 	ni->attr_list_size = 0;
 	NInoClearAttrList(ni);
@@ -1399,7 +1996,10 @@ void ntfs_inode_update_times(ntfs_inode *ni, ntfs_time_update_flags mask)
 		ni->last_mft_change_time = now;
 	
 	NInoFileNameSetDirty(ni);
-	NInoSetDirty(ni);
+	if (!NInoDirty(ni)) {
+		NInoSetDirty(ni);
+		NInoSetTimesOnlyDirty(ni);
+	}
 }
 
 /**
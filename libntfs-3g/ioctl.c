@@ -49,6 +49,12 @@
 #include <limits.h>
 #endif
 #include <syslog.h>
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
 
 #ifdef HAVE_SETXATTR
 #include <sys/xattr.h>
@@ -66,6 +72,10 @@
 #include <linux/fs.h>
 #endif
 
+#ifdef HAVE_LINUX_FIEMAP_H
+#include <linux/fiemap.h>
+#endif
+
 #include "compat.h"
 #include "debug.h"
 #include "bitmap.h"
@@ -80,7 +90,9 @@
 #include "dir.h"
 #include "security.h"
 #include "ioctl.h"
+#include "lock.h"
 #include "misc.h"
+#include "param.h"
 
 #if defined(FITRIM) && defined(BLKDISCARD)
 
@@ -226,6 +238,266 @@ not_found:
 
 #define FSTRIM_BUFSIZ 4096
 
+struct DISCARD_RANGE {
+	LCN lcn;
+	s64 length;
+} ;
+
+/*
+ *		Trimming the volume
+ *
+ *	The bitmap is examined by parts, each under the cluster allocation
+ *	lock, so that clusters can be allocated between parts, and the
+ *	free ranges found in a part are discarded before the lock is
+ *	released, so that no cluster allocated meanwhile gets discarded.
+ *	When threads are enabled, the discards of a part are issued in
+ *	parallel from a bounded queue.
+ */
+
+struct FSTRIM_CONTEXT {
+	ntfs_volume *vol;
+	u64 trimmed;			/* bytes discarded */
+	int err;			/* first error, as -errno */
+	struct timespec begin;		/* for the rate limit */
+#ifdef ENABLE_THREADS
+	struct DISCARD_RANGE range[FSTRIM_QUEUE_SIZE];
+	int first;			/* first range queued */
+	int count;			/* ranges queued */
+	int busy;			/* ranges being discarded */
+	int threads;			/* threads started */
+	BOOL stop;
+	pthread_t thread[FSTRIM_THREADS];
+	pthread_mutex_t lock;
+	pthread_cond_t queued;		/* a range was queued, or stop */
+	pthread_cond_t done;		/* a range was taken or discarded */
+#endif
+} ;
+
+#ifdef ENABLE_THREADS
+
+static void *fstrim_thread(void *arg)
+{
+	struct FSTRIM_CONTEXT *fc;
+	struct DISCARD_RANGE range;
+	int ret;
+
+	fc = (struct FSTRIM_CONTEXT*)arg;
+	pthread_mutex_lock(&fc->lock);
+	while (fc->count || !fc->stop) {
+		if (!fc->count)
+			pthread_cond_wait(&fc->queued, &fc->lock);
+		else {
+			range = fc->range[fc->first];
+			fc->first = (fc->first + 1) % FSTRIM_QUEUE_SIZE;
+			fc->count--;
+			fc->busy++;
+			pthread_mutex_unlock(&fc->lock);
+			ret = fstrim_clusters(fc->vol, range.lcn, range.length);
+			pthread_mutex_lock(&fc->lock);
+			if (ret) {
+				if (!fc->err)
+					fc->err = ret;
+			} else
+				fc->trimmed += range.length
+					<< fc->vol->cluster_size_bits;
+			fc->busy--;
+			pthread_cond_broadcast(&fc->done);
+		}
+	}
+	pthread_mutex_unlock(&fc->lock);
+	return ((void*)NULL);
+}
+
+/*
+ *		Start the threads discarding the queued ranges
+ *
+ *	When no thread can be started, the ranges are discarded by the
+ *	caller.
+ */
+
+static void fstrim_start(struct FSTRIM_CONTEXT *fc)
+{
+	fc->first = 0;
+	fc->count = 0;
+	fc->busy = 0;
+	fc->threads = 0;
+	fc->stop = FALSE;
+	pthread_mutex_init(&fc->lock, NULL);
+	pthread_cond_init(&fc->queued, NULL);
+	pthread_cond_init(&fc->done, NULL);
+	while ((fc->threads < FSTRIM_THREADS)
+	    && !pthread_create(&fc->thread[fc->threads], NULL,
+				fstrim_thread, fc))
+		fc->threads++;
+}
+
+static void fstrim_stop(struct FSTRIM_CONTEXT *fc)
+{
+	int i;
+
+	pthread_mutex_lock(&fc->lock);
+	fc->stop = TRUE;
+	pthread_cond_broadcast(&fc->queued);
+	pthread_mutex_unlock(&fc->lock);
+	for (i=0; i<fc->threads; i++)
+		pthread_join(fc->thread[i], (void**)NULL);
+	pthread_cond_destroy(&fc->done);
+	pthread_cond_destroy(&fc->queued);
+	pthread_mutex_destroy(&fc->lock);
+}
+
+/*
+ *		Wait until all the ranges queued have been discarded
+ *
+ *	Returns 0 if successful, or the first error met, as -errno
+ */
+
+static int fstrim_drain(struct FSTRIM_CONTEXT *fc)
+{
+	int ret;
+
+	if (!fc->threads)
+		return (fc->err);
+	pthread_mutex_lock(&fc->lock);
+	while (fc->count || fc->busy)
+		pthread_cond_wait(&fc->done, &fc->lock);
+	ret = fc->err;
+	pthread_mutex_unlock(&fc->lock);
+	return (ret);
+}
+
+#endif /* ENABLE_THREADS */
+
+/*
+ *		Discard a range of clusters, splitting it to the max size
+ *	of a discard
+ *
+ *	Returns 0 if successful, or the first error met, as -errno
+ */
+
+static int fstrim_issue(struct FSTRIM_CONTEXT *fc, LCN lcn, s64 length,
+			s64 max_clusters)
+{
+	s64 n;
+	int ret;
+
+	ret = 0;
+	while ((length > 0) && !ret) {
+		n = (length > max_clusters ? max_clusters : length);
+#ifdef ENABLE_THREADS
+		if (fc->threads) {
+			pthread_mutex_lock(&fc->lock);
+			while ((fc->count >= FSTRIM_QUEUE_SIZE) && !fc->err)
+				pthread_cond_wait(&fc->done, &fc->lock);
+			ret = fc->err;
+			if (!ret) {
+				fc->range[(fc->first + fc->count)
+					% FSTRIM_QUEUE_SIZE].lcn = lcn;
+				fc->range[(fc->first + fc->count)
+					% FSTRIM_QUEUE_SIZE].length = n;
+				fc->count++;
+				pthread_cond_signal(&fc->queued);
+			}
+			pthread_mutex_unlock(&fc->lock);
+		} else
+#endif
+		{
+			ret = fstrim_clusters(fc->vol, lcn, n);
+			if (ret)
+				fc->err = ret;
+			else
+				fc->trimmed += n << fc->vol->cluster_size_bits;
+		}
+		lcn += n;
+		length -= n;
+	}
+	return (ret);
+}
+
+/*
+ *		Wait until the bytes discarded so far fit in the rate limit
+ *
+ *	The wait is done between parts, with no lock held.
+ */
+
+static void fstrim_throttle(struct FSTRIM_CONTEXT *fc)
+{
+	struct timespec now;
+	struct timespec delay;
+	u64 elapsed;
+	u64 due;
+
+	if (fc->vol->fstrim_rate) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (u64)(now.tv_sec - fc->begin.tv_sec)*1000000000
+				+ now.tv_nsec - fc->begin.tv_nsec;
+			/* nanoseconds the bytes discarded are due for */
+		due = (u64)((double)fc->trimmed*1000000000.0
+				/ (double)fc->vol->fstrim_rate);
+		if (due > elapsed) {
+			delay.tv_sec = (due - elapsed)/1000000000;
+			delay.tv_nsec = (due - elapsed)%1000000000;
+			while (nanosleep(&delay, &delay) && (errno == EINTR)) { }
+		}
+	}
+}
+
+/*
+ *		Discard the free clusters of a part of the bitmap
+ *
+ *	A free run reaching the end of the part is not discarded, unless
+ *	it is the only one, and the next part starts from it, so that it
+ *	can be merged with the free clusters which follow.
+ *
+ *	Returns the first cluster of the next part, or -1 with fc->err set
+ */
+
+static LCN fstrim_part(struct FSTRIM_CONTEXT *fc, u8 *buf, LCN lcn, LCN end,
+			s64 part, s64 min_clusters, s64 max_clusters)
+{
+	ntfs_volume *vol;
+	LCN first, stop, next;
+	s64 bit, last, zero;
+	s64 pos, count, br;
+
+	vol = fc->vol;
+	pos = lcn >> 3;
+	last = end - (pos << 3);
+	if (last > part)
+		last = part;
+	count = (last + 7) >> 3;
+	next = (pos << 3) + last;
+	ntfs_cluster_alloc_lock(vol);
+	br = ntfs_attr_pread(vol->lcnbmp_na, pos, count, buf);
+	if (br != count)
+		fc->err = (br < 0 ? -errno : -EIO);
+	else {
+		bit = lcn & 7;
+		while ((bit < last)
+		    && ((zero = ntfs_bitmap_find_zero(buf, bit, last)) >= 0)) {
+			bit = ntfs_bitmap_find_set(buf, zero, last);
+			if (bit < 0)
+				bit = last;
+			first = (pos << 3) + zero;
+			stop = (pos << 3) + bit;
+			if ((stop < end) && (bit == last) && (first > lcn)
+			    && ((stop - first) < max_clusters)) {
+				next = first;
+				break;
+			}
+			if (((stop - first) >= min_clusters)
+			    && fstrim_issue(fc, first, stop - first,
+						max_clusters))
+				break;
+		}
+#ifdef ENABLE_THREADS
+		fstrim_drain(fc);
+#endif
+	}
+	ntfs_cluster_alloc_unlock(vol);
+	return (fc->err ? -1 : next);
+}
+
 /* Trim the filesystem.
  *
  * Free blocks between 'start' and 'start+len-1' (both byte offsets)
@@ -239,8 +511,12 @@ static int fstrim(ntfs_volume *vol, void *data, u64 *trimmed)
 	u64 len = range->len;
 	u64 minlen = range->minlen;
 	u64 discard_alignment, discard_granularity, discard_max_bytes;
-	u8 *buf = NULL;
-	LCN start_buf;
+	struct FSTRIM_CONTEXT *fc;
+	u64 size;
+	u8 *buf;
+	LCN lcn, end;
+	s64 part;
+	s64 min_clusters, max_clusters;
 	int ret;
 
 	ntfs_log_debug("fstrim: start=%llu len=%llu minlen=%llu\n",
@@ -250,15 +526,10 @@ static int fstrim(ntfs_volume *vol, void *data, u64 *trimmed)
 
 	*trimmed = 0;
 
-	/* Fail if user tries to use the fstrim -o/-l/-m options.
-	 * XXX We could fix these limitations in future.
-	 */
-	if (start != 0 || len != (uint64_t)-1) {
-		ntfs_log_debug("fstrim: setting start or length is not supported\n");
-		return -EINVAL;
-	}
-	if (minlen > vol->cluster_size) {
-		ntfs_log_debug("fstrim: minlen > cluster size is not supported\n");
+	size = (u64)vol->nr_clusters << vol->cluster_size_bits;
+	if ((start >= size) || (len < vol->cluster_size)
+	    || (minlen > size)) {
+		ntfs_log_debug("fstrim: range out of the volume\n");
 		return -EINVAL;
 	}
 
@@ -284,79 +555,663 @@ static int fstrim(ntfs_volume *vol, void *data, u64 *trimmed)
 		ntfs_log_debug("fstrim: discard granularity of backing device is larger than cluster size\n");
 		return -EOPNOTSUPP;
 	}
-	if (discard_max_bytes == 0) {
-		ntfs_log_debug("fstrim: backing device does not support discard (discard_max_bytes == 0)\n");
+	if (discard_max_bytes < vol->cluster_size) {
+		ntfs_log_debug("fstrim: backing device does not support discard (discard_max_bytes < cluster size)\n");
 		return -EOPNOTSUPP;
 	}
 
+	/* Only the clusters fully within the range are discarded. */
+	lcn = (start + vol->cluster_size - 1) >> vol->cluster_size_bits;
+	if (len > size - start)
+		end = vol->nr_clusters;
+	else
+		end = (start + len) >> vol->cluster_size_bits;
+	min_clusters = (minlen + vol->cluster_size - 1)
+			>> vol->cluster_size_bits;
+	if (!min_clusters)
+		min_clusters = 1;
+	max_clusters = discard_max_bytes >> vol->cluster_size_bits;
+
+	/* A part covers at least one max size discard, unless the
+	 * rate limit allows less than a part per second, the rate
+	 * being only checked between parts.
+	 */
+	part = FSTRIM_BUFSIZ*8;
+	if ((max_clusters > part) && (max_clusters < FSTRIM_PART_MAX*8))
+		part = (max_clusters + 7) & -8;
+	if (max_clusters >= FSTRIM_PART_MAX*8)
+		part = FSTRIM_PART_MAX*8;
+	if (vol->fstrim_rate
+	    && ((u64)part << vol->cluster_size_bits > vol->fstrim_rate)) {
+		part = (vol->fstrim_rate >> vol->cluster_size_bits) & -8;
+		if (part < 8)
+			part = 8;
+	}
+
 	/* Sync the device before doing anything. */
 	ret = ntfs_device_sync(vol->dev);
 	if (ret)
 		return ret;
 
-	/* Read through the bitmap. */
-	buf = ntfs_malloc(FSTRIM_BUFSIZ);
-	if (buf == NULL)
-		return -errno;
-	for (start_buf = 0; start_buf < vol->nr_clusters;
-	     start_buf += FSTRIM_BUFSIZ * 8) {
-		s64 count;
-		s64 br;
-		LCN end_buf, start_lcn;
-
-		/* start_buf is LCN of first cluster in the current buffer.
-		 * end_buf is LCN of last cluster + 1 in the current buffer.
-		 */
-		end_buf = start_buf + FSTRIM_BUFSIZ*8;
-		if (end_buf > vol->nr_clusters)
-			end_buf = vol->nr_clusters;
-		count = (end_buf - start_buf) / 8;
-
-		br = ntfs_attr_pread(vol->lcnbmp_na, start_buf/8, count, buf);
-		if (br != count) {
-			if (br >= 0)
-				ret = -EIO;
-			else
-				ret = -errno;
-			goto free_out;
+	buf = (u8*)ntfs_malloc(part >> 3);
+	fc = (struct FSTRIM_CONTEXT*)ntfs_malloc(
+				sizeof(struct FSTRIM_CONTEXT));
+	if (!buf || !fc) {
+		ret = -errno;
+		free(buf);
+		free(fc);
+		return ret;
+	}
+	fc->vol = vol;
+	fc->trimmed = 0;
+	fc->err = 0;
+	clock_gettime(CLOCK_MONOTONIC, &fc->begin);
+#ifdef ENABLE_THREADS
+	fstrim_start(fc);
+#endif
+	while ((lcn >= 0) && (lcn < end)) {
+		fstrim_throttle(fc);
+		lcn = fstrim_part(fc, buf, lcn, end, part,
+				min_clusters, max_clusters);
+	}
+#ifdef ENABLE_THREADS
+	fstrim_stop(fc);
+#endif
+	ret = fc->err;
+	*trimmed = fc->trimmed;
+	free(fc);
+	free(buf);
+	return ret;
+}
+
+/*
+ *		Trim the volume, as requested by a FITRIM ioctl
+ *
+ *	This does not need the volume lock: the bitmap is examined under
+ *	the cluster allocation lock, by parts, so that files can be
+ *	written while the volume is being trimmed.
+ *	On return, range->len is the count of bytes discarded.
+ *
+ *	Returns 0 if successful, or -errno
+ */
+
+int ntfs_fstrim(ntfs_volume *vol, void *data)
+{
+	struct fstrim_range *range = (struct fstrim_range*)data;
+	u64 trimmed;
+	int ret;
+
+	if (!vol || !range)
+		return (-EINVAL);
+	ret = fstrim(vol, range, &trimmed);
+	range->len = trimmed;
+	return (ret);
+}
+
+#else /* FITRIM && BLKDISCARD */
+
+int ntfs_fstrim(ntfs_volume *vol __attribute__((unused)),
+			void *data __attribute__((unused)))
+{
+	return (-EOPNOTSUPP);
+}
+
+#endif /* FITRIM && BLKDISCARD */
+
+#if defined(FITRIM) && defined(BLKDISCARD) && defined(ENABLE_THREADS)
+
+/*
+ *		Asynchronous discard of the clusters freed
+ *
+ *	The ranges of clusters freed are queued, and a thread wakes up
+ *	every DISCARD_DELAY seconds to discard the ranges which were
+ *	queued before its previous wakeup, so that the clusters freed
+ *	and immediately allocated again are not discarded uselessly, and
+ *	so that the ranges freed by deleting files have been merged.
+ *	As the clusters may have been allocated again since, the bitmap
+ *	is checked under the cluster allocation lock when discarding.
+ *
+ *	The queue is only used when the volume has locks.
+ */
+
+struct DISCARD_LIST {
+	struct DISCARD_RANGE *range;
+	int count;
+} ;
+
+struct DISCARD_QUEUE {
+	struct DISCARD_LIST pending;	/* queued since the last wakeup */
+	struct DISCARD_LIST ready;	/* queued before the last wakeup */
+	struct DISCARD_LIST batch;	/* being discarded */
+	u64 max_bytes;			/* max size of a discard */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	BOOL stop;
+} ;
+
+static int discard_range_compare(const void *p1, const void *p2)
+{
+	const struct DISCARD_RANGE *r1 = (const struct DISCARD_RANGE*)p1;
+	const struct DISCARD_RANGE *r2 = (const struct DISCARD_RANGE*)p2;
+
+	return (r1->lcn < r2->lcn ? -1 : (r1->lcn > r2->lcn ? 1 : 0));
+}
+
+/*
+ *		Sort a list and merge the ranges which overlap or touch
+ */
+
+static void discard_list_merge(struct DISCARD_LIST *list)
+{
+	struct DISCARD_RANGE *range;
+	int i, k;
+
+	range = list->range;
+	if (list->count > 1) {
+		qsort(range, list->count, sizeof(struct DISCARD_RANGE),
+			discard_range_compare);
+		for (i=0, k=1; k<list->count; k++) {
+			if (range[k].lcn <= (range[i].lcn + range[i].length)) {
+				if ((range[k].lcn + range[k].length)
+				    > (range[i].lcn + range[i].length))
+					range[i].length = range[k].lcn
+						+ range[k].length
+						- range[i].lcn;
+			} else
+				range[++i] = range[k];
 		}
+		list->count = i + 1;
+	}
+}
 
-		/* Trim the clusters in large as possible blocks, but
-		 * not larger than discard_max_bytes.
-		 */
-		for (start_lcn = start_buf; start_lcn < end_buf; ++start_lcn) {
-			if (!ntfs_bit_get(buf, start_lcn-start_buf)) {
-				LCN end_lcn;
-
-				/* Cluster 'start_lcn' is not in use,
-				 * find end of this run.
-				 */
-				end_lcn = start_lcn+1;
-				while (end_lcn < end_buf &&
-					(u64) (end_lcn-start_lcn) << vol->cluster_size_bits
-					  < discard_max_bytes &&
-					!ntfs_bit_get(buf, end_lcn-start_buf))
-					end_lcn++;
-
-				ret = fstrim_clusters(vol,
-						start_lcn, end_lcn-start_lcn);
-				if (ret)
-					goto free_out;
-
-				*trimmed += (end_lcn - start_lcn)
-						<< vol->cluster_size_bits;
-				start_lcn = end_lcn-1;
+/*
+ *		Discard the free clusters of a range
+ *
+ *	The range is examined by parts of FSTRIM_BUFSIZ bytes of the
+ *	bitmap, under the cluster allocation lock, so that no cluster
+ *	allocated meanwhile gets discarded.
+ */
+
+static void discard_range(ntfs_volume *vol, u8 *buf, u64 max_bytes,
+			LCN lcn, s64 length)
+{
+	LCN end, first, stop;
+	s64 bit, last, zero;
+	s64 pos, br;
+	s64 n;
+
+	end = lcn + length;
+	if (end > vol->nr_clusters)
+		end = vol->nr_clusters;
+	while (lcn < end) {
+		pos = lcn >> 3;
+		last = end - (pos << 3);
+		if (last > FSTRIM_BUFSIZ*8)
+			last = FSTRIM_BUFSIZ*8;
+		ntfs_cluster_alloc_lock(vol);
+		br = ntfs_attr_pread(vol->lcnbmp_na, pos, (last + 7) >> 3, buf);
+		if (br == ((last + 7) >> 3)) {
+			bit = lcn & 7;
+			while ((bit < last)
+			    && ((zero = ntfs_bitmap_find_zero(buf,
+						bit, last)) >= 0)) {
+				bit = ntfs_bitmap_find_set(buf, zero, last);
+				if (bit < 0)
+					bit = last;
+				first = (pos << 3) + zero;
+				stop = (pos << 3) + bit;
+				while (first < stop) {
+					n = stop - first;
+					if ((u64)n << vol->cluster_size_bits
+					    > max_bytes)
+						n = max_bytes
+						    >> vol->cluster_size_bits;
+					if (fstrim_clusters(vol, first, n))
+						break;
+					first += n;
+				}
 			}
 		}
+		ntfs_cluster_alloc_unlock(vol);
+		if (br != ((last + 7) >> 3))
+			break;
+		lcn = (pos << 3) + last;
+	}
+}
+
+static void discard_list(ntfs_volume *vol, struct DISCARD_LIST *list,
+			u64 max_bytes)
+{
+	u8 *buf;
+	int i;
+
+	buf = (u8*)ntfs_malloc(FSTRIM_BUFSIZ);
+	if (buf) {
+		for (i=0; i<list->count; i++)
+			discard_range(vol, buf, max_bytes,
+				list->range[i].lcn, list->range[i].length);
+		free(buf);
+	}
+	list->count = 0;
+}
+
+static void *discard_thread(void *arg)
+{
+	ntfs_volume *vol;
+	struct DISCARD_QUEUE *dq;
+	struct DISCARD_LIST empty;
+	struct timespec deadline;
+
+	vol = (ntfs_volume*)arg;
+	dq = vol->discard_queue;
+	pthread_mutex_lock(&dq->lock);
+	while (!dq->stop) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += DISCARD_DELAY;
+		while (!dq->stop
+		    && (pthread_cond_timedwait(&dq->cond, &dq->lock,
+					&deadline) != ETIMEDOUT)) { }
+		if (!dq->stop) {
+				/* the pending ranges wait for the next turn */
+			empty = dq->batch;
+			dq->batch = dq->ready;
+			discard_list_merge(&dq->pending);
+			dq->ready = dq->pending;
+			dq->pending = empty;
+			if (dq->batch.count) {
+				pthread_mutex_unlock(&dq->lock);
+				discard_list(vol, &dq->batch, dq->max_bytes);
+				pthread_mutex_lock(&dq->lock);
+			}
+		}
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return ((void*)NULL);
+}
+
+/*
+ *		Queue clusters freed for being discarded
+ *
+ *	Called with the cluster allocation lock held. When the queue is
+ *	full, the ranges are merged, and if it is still full, the clusters
+ *	are not discarded, they can still be with fstrim.
+ */
+
+void ntfs_discard_queue(ntfs_volume *vol, LCN lcn, s64 count)
+{
+	struct DISCARD_QUEUE *dq;
+	struct DISCARD_LIST *list;
+
+	dq = vol->discard_queue;
+	if (dq && (count > 0)) {
+		pthread_mutex_lock(&dq->lock);
+		list = &dq->pending;
+		if (list->count
+		    && (list->range[list->count - 1].lcn
+				+ list->range[list->count - 1].length == lcn))
+			list->range[list->count - 1].length += count;
+		else {
+			if (list->count >= DISCARD_QUEUE_SIZE)
+				discard_list_merge(list);
+			if (list->count < DISCARD_QUEUE_SIZE) {
+				list->range[list->count].lcn = lcn;
+				list->range[list->count].length = count;
+				list->count++;
+			}
+		}
+		pthread_mutex_unlock(&dq->lock);
+	}
+}
+
+/*
+ *		Start discarding the clusters freed
+ *
+ *	To be called once the program has detached from the terminal, as
+ *	a fork would not retain the thread.
+ *
+ *	Returns 0 if successful
+ *		-1 if failed, with errno set
+ */
+
+int ntfs_discard_start(ntfs_volume *vol)
+{
+	struct DISCARD_QUEUE *dq;
+	u64 discard_alignment, discard_granularity, discard_max_bytes;
+	int ret;
+
+	if (!vol->locks || !NDevBlock(vol->dev)) {
+		errno = EOPNOTSUPP;
+		return (-1);
+	}
+	ret = fstrim_limits(vol, &discard_alignment,
+			&discard_granularity, &discard_max_bytes);
+	if (ret) {
+		errno = -ret;
+		return (-1);
+	}
+	if (discard_alignment
+	    || (discard_granularity > vol->cluster_size)
+	    || (discard_max_bytes < vol->cluster_size)) {
+		errno = EOPNOTSUPP;
+		return (-1);
+	}
+	dq = (struct DISCARD_QUEUE*)ntfs_malloc(sizeof(struct DISCARD_QUEUE));
+	if (!dq)
+		return (-1);
+	dq->pending.range = (struct DISCARD_RANGE*)ntfs_malloc(
+			DISCARD_QUEUE_SIZE*sizeof(struct DISCARD_RANGE));
+	dq->ready.range = (struct DISCARD_RANGE*)ntfs_malloc(
+			DISCARD_QUEUE_SIZE*sizeof(struct DISCARD_RANGE));
+	dq->batch.range = (struct DISCARD_RANGE*)ntfs_malloc(
+			DISCARD_QUEUE_SIZE*sizeof(struct DISCARD_RANGE));
+	if (!dq->pending.range || !dq->ready.range || !dq->batch.range)
+		goto err_free;
+	dq->pending.count = 0;
+	dq->ready.count = 0;
+	dq->batch.count = 0;
+	dq->max_bytes = discard_max_bytes;
+	dq->stop = FALSE;
+	pthread_mutex_init(&dq->lock, NULL);
+	pthread_cond_init(&dq->cond, NULL);
+	vol->discard_queue = dq;
+	ret = pthread_create(&dq->thread, NULL, discard_thread, vol);
+	if (!ret)
+		return (0);
+	vol->discard_queue = (struct DISCARD_QUEUE*)NULL;
+	pthread_cond_destroy(&dq->cond);
+	pthread_mutex_destroy(&dq->lock);
+	errno = ret;
+err_free:
+	free(dq->pending.range);
+	free(dq->ready.range);
+	free(dq->batch.range);
+	free(dq);
+	return (-1);
+}
+
+/*
+ *		Stop discarding, after discarding all the clusters queued
+ */
+
+void ntfs_discard_stop(ntfs_volume *vol)
+{
+	struct DISCARD_QUEUE *dq;
+
+	dq = vol->discard_queue;
+	if (dq) {
+		pthread_mutex_lock(&dq->lock);
+		dq->stop = TRUE;
+		pthread_cond_signal(&dq->cond);
+		pthread_mutex_unlock(&dq->lock);
+		pthread_join(dq->thread, (void**)NULL);
+		vol->discard_queue = (struct DISCARD_QUEUE*)NULL;
+		discard_list(vol, &dq->ready, dq->max_bytes);
+		discard_list_merge(&dq->pending);
+		discard_list(vol, &dq->pending, dq->max_bytes);
+		pthread_cond_destroy(&dq->cond);
+		pthread_mutex_destroy(&dq->lock);
+		free(dq->pending.range);
+		free(dq->ready.range);
+		free(dq->batch.range);
+		free(dq);
+	}
+}
+
+#else /* FITRIM && BLKDISCARD && ENABLE_THREADS */
+
+void ntfs_discard_queue(ntfs_volume *vol __attribute__((unused)),
+			LCN lcn __attribute__((unused)),
+			s64 count __attribute__((unused)))
+{
+}
+
+int ntfs_discard_start(ntfs_volume *vol __attribute__((unused)))
+{
+	errno = EOPNOTSUPP;
+	return (-1);
+}
+
+void ntfs_discard_stop(ntfs_volume *vol __attribute__((unused)))
+{
+}
+
+#endif /* FITRIM && BLKDISCARD && ENABLE_THREADS */
+
+#if defined(FS_IOC_FIEMAP) && defined(HAVE_LINUX_FIEMAP_H)
+
+/*
+ *		Record an extent into a fiemap
+ *
+ *	Only the part of the extent inside the requested range is
+ *	considered, and only counted when no extent array is provided.
+ *
+ *	Returns TRUE if the extent could not be recorded, because it
+ *	is beyond the requested range or the extent array is full.
+ */
+
+static BOOL fiemap_add(struct fiemap *fm, u64 end, u64 logical,
+			u64 physical, u64 length, u32 flags)
+{
+	struct fiemap_extent *fe;
+
+	if ((logical + length) <= fm->fm_start)
+		return (FALSE);
+	if (logical >= end)
+		return (TRUE);
+	if (fm->fm_extent_count) {
+		if (fm->fm_mapped_extents >= fm->fm_extent_count)
+			return (TRUE);
+		fe = &fm->fm_extents[fm->fm_mapped_extents];
+		memset(fe, 0, sizeof(struct fiemap_extent));
+		fe->fe_logical = logical;
+		fe->fe_physical = physical;
+		fe->fe_length = length;
+		fe->fe_flags = flags;
 	}
+	fm->fm_mapped_extents++;
+	return (FALSE);
+}
 
+/*
+ *		Map the allocated extents of the unnamed data of a file
+ *
+ *	The extents are the allocated runs of the runlist. Clusters
+ *	beyond the initialized size are reported as unwritten, and a
+ *	run followed by the unallocated tail of its compression block
+ *	is reported as encoded, with the logical size of the block.
+ *
+ *	The room for extents after the fiemap header is defined by
+ *	fm_extent_count, no extent is recorded if it is zero.
+ */
+
+static int fiemap(ntfs_inode *ni, struct fiemap *fm)
+{
+	ntfs_volume *vol;
+	ntfs_attr *na;
+	runlist_element *rl;
+	VCN init_vcn;
+	VCN run_end;
+	VCN block_end;
+	u64 end;
+	u64 length;
+	u32 block_clusters;
+	u32 flags;
+	BOOL compressed;
+	BOOL more;
+	int ret;
+
+	if (fm->fm_flags & ~FIEMAP_FLAG_SYNC) {
+		fm->fm_flags &= ~FIEMAP_FLAG_SYNC;
+		return (-EBADR);
+	}
+	fm->fm_mapped_extents = 0;
+	if (fm->fm_length > (u64)LLONG_MAX - fm->fm_start)
+		end = LLONG_MAX;
+	else
+		end = fm->fm_start + fm->fm_length;
+	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+	if (!na)
+		return (-errno);
 	ret = 0;
-free_out:
-	free(buf);
-	return ret;
+	more = FALSE;
+	vol = ni->vol;
+	if (!NAttrNonResident(na)) {
+		if (na->data_size)
+			more = fiemap_add(fm, end, 0, 0, na->data_size,
+					FIEMAP_EXTENT_DATA_INLINE
+					| FIEMAP_EXTENT_NOT_ALIGNED);
+	} else
+		if (ntfs_attr_map_whole_runlist(na))
+			ret = -errno;
+		else {
+			compressed = (na->data_flags & ATTR_COMPRESSION_MASK)
+					!= const_cpu_to_le16(0);
+			block_clusters = (compressed
+					? na->compression_block_clusters : 1);
+			init_vcn = (na->initialized_size + vol->cluster_size - 1)
+					>> vol->cluster_size_bits;
+			for (rl=na->rl; rl->length && !more; rl++) {
+				if (rl->lcn < 0)
+					continue;
+				run_end = rl->vcn + rl->length;
+				flags = 0;
+				if (na->data_flags & ATTR_IS_ENCRYPTED)
+					flags |= FIEMAP_EXTENT_DATA_ENCRYPTED;
+				length = rl->length << vol->cluster_size_bits;
+				block_end = ((run_end + block_clusters - 1)
+					/ block_clusters) * block_clusters;
+				if (compressed
+				    && (block_end > run_end)
+				    && (rl[1].lcn == LCN_HOLE)) {
+					flags |= FIEMAP_EXTENT_ENCODED;
+					length = (block_end - rl->vcn)
+						<< vol->cluster_size_bits;
+				}
+				if (compressed || (run_end <= init_vcn)) {
+					more = fiemap_add(fm, end,
+						rl->vcn << vol->cluster_size_bits,
+						rl->lcn << vol->cluster_size_bits,
+						length, flags);
+				} else if (rl->vcn >= init_vcn) {
+					more = fiemap_add(fm, end,
+						rl->vcn << vol->cluster_size_bits,
+						rl->lcn << vol->cluster_size_bits,
+						length,
+						flags | FIEMAP_EXTENT_UNWRITTEN);
+				} else {
+					/* split at the initialized size */
+					more = fiemap_add(fm, end,
+						rl->vcn << vol->cluster_size_bits,
+						rl->lcn << vol->cluster_size_bits,
+						(init_vcn - rl->vcn)
+							<< vol->cluster_size_bits,
+						flags);
+					if (!more)
+						more = fiemap_add(fm, end,
+						init_vcn << vol->cluster_size_bits,
+						(rl->lcn + init_vcn - rl->vcn)
+							<< vol->cluster_size_bits,
+						(run_end - init_vcn)
+							<< vol->cluster_size_bits,
+						flags | FIEMAP_EXTENT_UNWRITTEN);
+				}
+			}
+		}
+		/* flag the last extent if no further one was found */
+	if (!ret && !more && fm->fm_extent_count && fm->fm_mapped_extents)
+		fm->fm_extents[fm->fm_mapped_extents - 1].fe_flags
+				|= FIEMAP_EXTENT_LAST;
+	ntfs_attr_close(na);
+	return (ret);
 }
 
-#endif /* FITRIM && BLKDISCARD */
+#endif /* FS_IOC_FIEMAP && HAVE_LINUX_FIEMAP_H */
+
+#ifdef NTFS_IOC_DEFRAG
+
+/*
+ *		Defragment the data of a file or the index of a directory
+ *
+ *	The system files are not moved, nor the files in $Extend.
+ *	The caller has to make sure the attribute is not open elsewhere.
+ */
+
+static int defrag(ntfs_inode *ni, struct NTFS_DEFRAG *dfg)
+{
+	const FILE_NAME_ATTR *fn;
+	ntfs_attr *na;
+	s64 fragments;
+	u32 size;
+	int ret;
+
+	fn = (const FILE_NAME_ATTR*)ntfs_attr_peek(ni, AT_FILE_NAME,
+				AT_UNNAMED, 0, &size);
+	if (((ni->mft_no < FILE_first_user) && (ni->mft_no != FILE_root))
+	    || !fn || (size < sizeof(FILE_NAME_ATTR))
+	    || (MREF_LE(fn->parent_directory) == FILE_Extend))
+		return (-EPERM);
+	if (ni->mrec->flags & MFT_RECORD_IS_DIRECTORY)
+		na = ntfs_attr_open(ni, AT_INDEX_ALLOCATION, NTFS_INDEX_I30, 4);
+	else
+		na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+	if (!na)
+		return (errno == ENOENT ? 0 : -errno);
+	ret = 0;
+	if (NAttrNonResident(na)) {
+		if (ntfs_attr_map_whole_runlist(na))
+			ret = -errno;
+		else {
+			fragments = ntfs_rl_fragments(na->rl);
+			dfg->before = fragments;
+			if (!(dfg->flags & NTFS_DEFRAG_COUNT))
+				fragments = ntfs_attr_defragment(na);
+			if (fragments < 0)
+				ret = -errno;
+			else
+				dfg->after = fragments;
+		}
+	}
+	ntfs_attr_close(na);
+	return (ret);
+}
+
+#endif /* NTFS_IOC_DEFRAG */
+
+#ifdef NTFS_IOC_REINDEX
+
+/*
+ *		Rebuild the index of a directory
+ *
+ *	The system directories are not rebuilt, except the root, nor the
+ *	directories in $Extend.
+ */
+
+static int reindex(ntfs_inode *ni, struct NTFS_REINDEX *rdx)
+{
+	const FILE_NAME_ATTR *fn;
+	s64 before;
+	s64 after;
+	u32 size;
+
+	if (!(ni->mrec->flags & MFT_RECORD_IS_DIRECTORY))
+		return (-ENOTDIR);
+	fn = (const FILE_NAME_ATTR*)ntfs_attr_peek(ni, AT_FILE_NAME,
+				AT_UNNAMED, 0, &size);
+	if (((ni->mft_no < FILE_first_user) && (ni->mft_no != FILE_root))
+	    || !fn || (size < sizeof(FILE_NAME_ATTR))
+	    || (MREF_LE(fn->parent_directory) == FILE_Extend))
+		return (-EPERM);
+	after = ntfs_index_rebuild(ni, NTFS_INDEX_I30, 4, &before,
+				(rdx->flags & NTFS_REINDEX_COUNT) != 0);
+	rdx->before = before;
+	if (after < 0)
+		return (-errno);
+	rdx->after = after;
+	return (0);
+}
+
+#endif /* NTFS_IOC_REINDEX */
 
 int ntfs_ioctl(ntfs_inode *ni, int cmd, void *arg __attribute__((unused)),
 			unsigned int flags __attribute__((unused)), void *data)
@@ -368,16 +1223,41 @@ int ntfs_ioctl(ntfs_inode *ni, int cmd, void *arg __attribute__((unused)),
 	case FITRIM:
 		if (!ni || !data)
 			ret = -EINVAL;
-		else {
-			u64 trimmed;
-			struct fstrim_range *range = (struct fstrim_range*)data;
-
-			ret = fstrim(ni->vol, data, &trimmed);
-			range->len = trimmed;
-		}
+		else
+			ret = ntfs_fstrim(ni->vol, data);
 		break;
 #else
 #warning Trimming not supported : FITRIM or BLKDISCARD not defined
+#endif
+#if defined(FS_IOC_FIEMAP) && defined(HAVE_LINUX_FIEMAP_H)
+	case FS_IOC_FIEMAP:
+		if (!ni || !data)
+			ret = -EINVAL;
+		else
+			ret = fiemap(ni, (struct fiemap*)data);
+		break;
+#endif
+#ifdef NTFS_IOC_DEFRAG
+	case NTFS_IOC_DEFRAG:
+		if (!ni || !data)
+			ret = -EINVAL;
+		else {
+			((struct NTFS_DEFRAG*)data)->before = 0;
+			((struct NTFS_DEFRAG*)data)->after = 0;
+			ret = defrag(ni, (struct NTFS_DEFRAG*)data);
+		}
+		break;
+#endif
+#ifdef NTFS_IOC_REINDEX
+	case NTFS_IOC_REINDEX:
+		if (!ni || !data)
+			ret = -EINVAL;
+		else {
+			((struct NTFS_REINDEX*)data)->before = 0;
+			((struct NTFS_REINDEX*)data)->after = 0;
+			ret = reindex(ni, (struct NTFS_REINDEX*)data);
+		}
+		break;
 #endif
 	default :
 		ret = -EINVAL;
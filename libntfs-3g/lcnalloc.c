@@ -35,6 +35,9 @@
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
 
 #include "types.h"
 #include "attrib.h"
@@ -43,8 +46,12 @@
 #include "runlist.h"
 #include "volume.h"
 #include "lcnalloc.h"
+#include "ioctl.h"
 #include "logging.h"
+#include "lock.h"
 #include "misc.h"
+#include "param.h"
+#include "probe.h"
 
 /*
  * Plenty possibilities for big optimizations all over in the cluster
@@ -54,6 +61,8 @@
  */
 #define NTFS_LCNALLOC_BSIZE 4096
 #define NTFS_LCNALLOC_SKIP  NTFS_LCNALLOC_BSIZE
+#define NTFS_LCNALLOC_CHUNK_BITS 12 /* clusters summarized together */
+#define NTFS_ALLOC_WINDOWS 8 /* files with clusters reserved ahead */
 
 enum {
 	ZONE_MFT = 1,
@@ -113,58 +122,699 @@ static void update_full_status(ntfs_volume *vol, LCN lcn)
 		}
 }
  
+/*
+ *		Summary of the free clusters
+ *
+ *	The count of free clusters is kept for each chunk of 4096 clusters,
+ *	so that the allocator can skip the parts of $Bitmap which have no
+ *	free cluster without reading them. The summary is built on the
+ *	first allocation, it is updated for each cluster allocated and by
+ *	ntfs_bitmap_set_run() and ntfs_bitmap_clear_run() on $Bitmap, the
+ *	same way as the count of free clusters of the volume. It is only
+ *	used under the cluster allocation lock.
+ */
+
+struct CLUSTER_SUMMARY {
+	ntfs_attr *na;		/* $Bitmap the summary was built from */
+	u16 *free;		/* count of free clusters in each chunk */
+	s64 count;		/* count of chunks */
+} ;
+
+void ntfs_cluster_summary_release(ntfs_volume *vol)
+{
+	if (vol->cluster_summary) {
+		free(vol->cluster_summary->free);
+		free(vol->cluster_summary);
+		vol->cluster_summary = (struct CLUSTER_SUMMARY*)NULL;
+	}
+}
+
+static struct CLUSTER_SUMMARY *cluster_summary_alloc(ntfs_volume *vol)
+{
+	struct CLUSTER_SUMMARY *cs;
+	ntfs_attr *na;
+
+	na = vol->lcnbmp_na;
+	cs = (struct CLUSTER_SUMMARY*)ntfs_malloc(sizeof(struct CLUSTER_SUMMARY));
+	if (cs) {
+		cs->na = na;
+		cs->count = ((na->data_size << 3)
+				+ (1 << NTFS_LCNALLOC_CHUNK_BITS) - 1)
+					>> NTFS_LCNALLOC_CHUNK_BITS;
+		cs->free = (u16*)ntfs_calloc(cs->count*sizeof(u16));
+		if (!cs->free) {
+			free(cs);
+			cs = (struct CLUSTER_SUMMARY*)NULL;
+		}
+	}
+	return (cs);
+}
+
+/*
+ *		Count the free clusters in a buffer read from $Bitmap
+ *
+ *	The buffer is at byte position @pos and holds a whole count of
+ *	chunks, unless it is the last one. The free clusters are added
+ *	to the summary when there is one.
+ *
+ *	Returns the count of free clusters in the buffer
+ */
+
+static s64 cluster_summary_count(struct CLUSTER_SUMMARY *cs, const u8 *buf,
+			s64 pos, s64 br)
+{
+	s64 bit;
+	s64 end;
+	s64 n;
+	s64 total;
+
+	total = 0;
+	for (bit=0; bit<(br << 3); bit=end) {
+		end = bit + (1 << NTFS_LCNALLOC_CHUNK_BITS);
+		if (end > (br << 3))
+			end = br << 3;
+		n = (end - bit) - ntfs_bitmap_count_set(buf, bit, end);
+		if (cs)
+			cs->free[((pos << 3) + bit)
+				>> NTFS_LCNALLOC_CHUNK_BITS] += n;
+		total += n;
+	}
+	return (total);
+}
+
+static struct CLUSTER_SUMMARY *cluster_summary_build(ntfs_volume *vol)
+{
+	struct CLUSTER_SUMMARY *cs;
+	u8 *buf;
+	s64 pos;
+	s64 br;
+
+	cs = cluster_summary_alloc(vol);
+	buf = (u8*)ntfs_malloc(65536);
+	if (!cs || !buf)
+		goto err_free;
+	pos = 0;
+	while ((br = ntfs_attr_pread(vol->lcnbmp_na, pos, 65536, buf)) > 0) {
+		cluster_summary_count(cs, buf, pos, br);
+		pos += br;
+	}
+	if (br < 0)
+		goto err_free;
+	free(buf);
+	vol->cluster_summary = cs;
+	return (cs);
+err_free:
+	free(buf);
+	if (cs) {
+		free(cs->free);
+		free(cs);
+	}
+	return ((struct CLUSTER_SUMMARY*)NULL);
+}
+
+/*
+ *		Adjust a summary for clusters allocated or freed
+ */
+
+static void cluster_summary_adjust(struct CLUSTER_SUMMARY *cs, LCN lcn,
+			s64 count, BOOL used)
+{
+	s64 chunk;
+	s64 n;
+
+	while (cs && (count > 0) && (lcn >= 0)) {
+		chunk = lcn >> NTFS_LCNALLOC_CHUNK_BITS;
+		if (chunk >= cs->count)
+			break;
+		n = ((chunk + 1) << NTFS_LCNALLOC_CHUNK_BITS) - lcn;
+		if (n > count)
+			n = count;
+		if (used)
+			cs->free[chunk] -= (cs->free[chunk] > n
+						? n : cs->free[chunk]);
+		else
+			cs->free[chunk] += n;
+		if (cs->free[chunk] > (1 << NTFS_LCNALLOC_CHUNK_BITS))
+			cs->free[chunk] = 1 << NTFS_LCNALLOC_CHUNK_BITS;
+		lcn += n;
+		count -= n;
+	}
+}
+
+/*
+ *		Background count of free clusters
+ *
+ *	Reading the whole $Bitmap of a big volume delays the mount, so
+ *	only its first part is counted when mounting, and the free clusters
+ *	in the rest are extrapolated. A thread then completes the count
+ *	under the cluster allocation lock, building the summary of free
+ *	clusters on the way. The clusters allocated or freed in the part
+ *	already counted are accounted for in the partial count, the others
+ *	are only accounted for in the estimation, which is replaced by the
+ *	exact count when the thread completes. The summary is not used
+ *	until then.
+ */
+
+struct FREE_COUNT {
+	struct CLUSTER_SUMMARY *cs; /* summary being built, or NULL */
+	s64 pos;		/* bytes of $Bitmap counted */
+	s64 free;		/* free clusters in the part counted */
+	BOOL done;		/* the count is complete */
+	BOOL stop;		/* the volume is being unmounted */
+	BOOL started;		/* the thread has been created */
+#ifdef ENABLE_THREADS
+	pthread_t thread;
+#endif
+} ;
+
+static BOOL free_count_pending(const ntfs_volume *vol)
+{
+	return (vol->free_count && !vol->free_count->done);
+}
+
+/*
+ *		Account for clusters allocated or freed while counting
+ */
+
+static void free_count_update(ntfs_volume *vol, LCN lcn, s64 count,
+			BOOL used)
+{
+	struct FREE_COUNT *fc;
+	s64 n;
+
+	fc = vol->free_count;
+	if (fc && !fc->done && (lcn >= 0) && (lcn < (fc->pos << 3))) {
+		n = (fc->pos << 3) - lcn;
+		if (n > count)
+			n = count;
+		if (used)
+			fc->free -= n;
+		else
+			fc->free += n;
+		cluster_summary_adjust(fc->cs, lcn, n, used);
+	}
+}
+
+/*
+ *		Complete the count of free clusters
+ *
+ *	Run by the background thread, or directly when it cannot be created
+ */
+
+static void *free_count_thread(void *arg)
+{
+	ntfs_volume *vol;
+	struct FREE_COUNT *fc;
+	u8 *buf;
+	s64 br;
+
+	vol = (ntfs_volume*)arg;
+	fc = vol->free_count;
+	buf = (u8*)ntfs_malloc(65536);
+	br = -1;
+	ntfs_cluster_alloc_lock(vol);
+	while (buf && !fc->stop) {
+		br = ntfs_attr_pread(vol->lcnbmp_na, fc->pos, 65536, buf);
+		if (br <= 0)
+			break;
+		fc->free += cluster_summary_count(fc->cs, buf, fc->pos, br);
+		fc->pos += br;
+			/* let the allocations proceed */
+		ntfs_cluster_alloc_unlock(vol);
+		ntfs_cluster_alloc_lock(vol);
+	}
+	if (!br) {
+		vol->free_clusters = fc->free;
+		if (fc->cs && !vol->cluster_summary) {
+			vol->cluster_summary = fc->cs;
+			fc->cs = (struct CLUSTER_SUMMARY*)NULL;
+		}
+		ntfs_log_debug("Counted %lld free clusters\n",
+				(long long)fc->free);
+	} else
+		if (!fc->stop)
+			ntfs_log_error("Failed to count the free clusters,"
+				" the count is an estimation\n");
+	fc->done = TRUE;
+	ntfs_cluster_alloc_unlock(vol);
+	free(buf);
+	return ((void*)NULL);
+}
+
+/*
+ *		Count the free clusters of a volume
+ *
+ *	When the volume is mounted with locks and its $Bitmap is big, only
+ *	the first part of it is counted, vol->free_clusters being an
+ *	estimation until the count is completed by ntfs_cluster_count_start().
+ *
+ *	Returns 0 if successful
+ *		-1 if failed, with errno set
+ */
+
+int ntfs_cluster_count_free(ntfs_volume *vol)
+{
+	struct FREE_COUNT *fc;
+	ntfs_attr *na;
+	u8 *buf;
+	s64 br;
+	s64 bits;
+	int res;
+
+	na = vol->lcnbmp_na;
+	if (!vol->locks || (na->data_size <= FREE_COUNT_SYNC_SIZE)) {
+		vol->free_clusters = ntfs_attr_get_free_bits(na);
+		return (vol->free_clusters < 0 ? -1 : 0);
+	}
+	res = -1;
+	fc = (struct FREE_COUNT*)ntfs_malloc(sizeof(struct FREE_COUNT));
+	buf = (u8*)ntfs_malloc(65536);
+	if (fc && buf) {
+		fc->cs = cluster_summary_alloc(vol);
+		fc->pos = 0;
+		fc->free = 0;
+		fc->done = FALSE;
+		fc->stop = FALSE;
+		fc->started = FALSE;
+		br = 1;
+		while ((fc->pos < FREE_COUNT_SYNC_SIZE)
+		    && ((br = ntfs_attr_pread(na, fc->pos, 65536, buf)) > 0)) {
+			fc->free += cluster_summary_count(fc->cs, buf,
+						fc->pos, br);
+			fc->pos += br;
+		}
+		if (br > 0) {
+				/* extrapolate to the clusters not counted */
+			bits = vol->nr_clusters - (fc->pos << 3);
+			if (bits < 0)
+				bits = 0;
+			vol->free_clusters = fc->free
+				+ bits*((double)fc->free/(fc->pos << 3));
+			vol->free_count = fc;
+			fc = (struct FREE_COUNT*)NULL;
+			res = 0;
+		} else
+			if (!br)
+				errno = EIO;
+	}
+	if (fc) {
+		if (fc->cs) {
+			free(fc->cs->free);
+			free(fc->cs);
+		}
+		free(fc);
+	}
+	free(buf);
+	return (res);
+}
+
+/*
+ *		Complete the count of free clusters in background
+ *
+ *	To be called after ntfs_cluster_count_free() once the program
+ *	has detached from the terminal, as a fork would not retain the
+ *	thread. The count is completed synchronously if the thread cannot
+ *	be created.
+ */
+
+void ntfs_cluster_count_start(ntfs_volume *vol)
+{
+	struct FREE_COUNT *fc;
+
+	fc = vol->free_count;
+	if (fc && !fc->started && !fc->done) {
+#ifdef ENABLE_THREADS
+		if (!pthread_create(&fc->thread, NULL, free_count_thread, vol))
+			fc->started = TRUE;
+		else
+#endif
+			free_count_thread(vol);
+	}
+}
+
+/*
+ *		Check whether the count of free clusters is complete
+ *
+ *	When it is not, vol->free_clusters is an estimation.
+ */
+
+BOOL ntfs_cluster_count_done(const ntfs_volume *vol)
+{
+	return (!free_count_pending(vol));
+}
+
+/*
+ *		Stop the count of free clusters
+ *
+ *	Called when releasing the volume, the count being then useless
+ */
+
+void ntfs_cluster_count_stop(ntfs_volume *vol)
+{
+	struct FREE_COUNT *fc;
+
+	fc = vol->free_count;
+	if (fc) {
+#ifdef ENABLE_THREADS
+		if (fc->started) {
+			ntfs_cluster_alloc_lock(vol);
+			fc->stop = TRUE;
+			ntfs_cluster_alloc_unlock(vol);
+			pthread_join(fc->thread, (void**)NULL);
+		}
+#endif
+		if (fc->cs) {
+			free(fc->cs->free);
+			free(fc->cs);
+		}
+		free(fc);
+		vol->free_count = (struct FREE_COUNT*)NULL;
+	}
+}
+
+static struct CLUSTER_SUMMARY *cluster_summary_get(ntfs_volume *vol)
+{
+	struct CLUSTER_SUMMARY *cs;
+
+	cs = vol->cluster_summary;
+	if (cs && (cs->na != vol->lcnbmp_na)) {
+		ntfs_cluster_summary_release(vol);
+		cs = (struct CLUSTER_SUMMARY*)NULL;
+	}
+	if (!cs && !free_count_pending(vol))
+		cs = cluster_summary_build(vol);
+	return (cs);
+}
+
+/*
+ *		Account for clusters being allocated or freed
+ *
+ *	Called on each change of $Bitmap other than by ntfs_cluster_alloc(),
+ *	the clusters being assumed to be in the opposite state before.
+ */
+
+void ntfs_cluster_summary_update(ntfs_volume *vol, LCN lcn, s64 count,
+			BOOL used)
+{
+	cluster_summary_adjust(vol->cluster_summary, lcn, count, used);
+	free_count_update(vol, lcn, count, used);
+	if (!used && vol->discard_queue)
+		ntfs_discard_queue(vol, lcn, count);
+}
+
+/*
+ *		Check whether the summary shows no free cluster in a range
+ */
+
+static BOOL cluster_summary_full(const struct CLUSTER_SUMMARY *cs,
+			LCN lcn, s64 count)
+{
+	s64 chunk, last;
+
+	chunk = lcn >> NTFS_LCNALLOC_CHUNK_BITS;
+	last = (lcn + count - 1) >> NTFS_LCNALLOC_CHUNK_BITS;
+	if (last >= cs->count)
+		return (FALSE);
+	while ((chunk <= last) && !cs->free[chunk])
+		chunk++;
+	return (chunk > last);
+}
+
+/*
+ *		Reservation windows for the files being written
+ *
+ *	Files grow from the cluster next to their last one, but when
+ *	several files are written concurrently, each one takes the
+ *	clusters the others would have needed to be contiguous, and their
+ *	extents end up interleaved. So, when the cluster requested for
+ *	extending a file is found already allocated, the search starts
+ *	from the zone position, and the clusters which follow the
+ *	allocation are reserved to the file for a while, in a window which
+ *	is identified by its first cluster, as this is the lcn the file
+ *	will request next time. The window is renewed by each allocation
+ *	starting from it, the allocations for other files are started
+ *	beyond the windows, and the windows not renewed during the last
+ *	allocations are dropped.
+ *
+ *	The windows are only kept in memory, and they are only advisory :
+ *	clusters in a window may still be allocated to another file,
+ *	notably when the volume gets full. They are used under the cluster
+ *	allocation lock.
+ */
+
+struct ALLOC_WINDOWS {
+	struct {
+		LCN start;	/* lcn the owner is expected to request */
+		LCN end;	/* first lcn after the window */
+		u32 stamp;	/* tick of the last allocation in window */
+	} window[NTFS_ALLOC_WINDOWS];
+	u32 tick;		/* count of allocations in windows */
+	int count;		/* count of windows in use */
+} ;
+
+void ntfs_cluster_windows_release(ntfs_volume *vol)
+{
+	free(vol->alloc_windows);
+	vol->alloc_windows = (struct ALLOC_WINDOWS*)NULL;
+}
+
+/*
+ *		Drop the windows not renewed recently
+ */
+
+static void alloc_windows_expire(struct ALLOC_WINDOWS *aw)
+{
+	int i;
+
+	i = 0;
+	while (i < aw->count) {
+		if ((aw->tick - aw->window[i].stamp) > ALLOC_WINDOW_AGE)
+			aw->window[i] = aw->window[--aw->count];
+		else
+			i++;
+	}
+}
+
+/*
+ *		Check the lcn requested for extending a file
+ *
+ *	Returns the lcn to start the search from, or -1 if the search
+ *	should be made from the zone position, because the lcn is
+ *	already allocated.
+ */
+
+static LCN alloc_window_goal(ntfs_volume *vol, LCN goal)
+{
+	u8 byte;
+
+	if (vol->alloc_windows)
+		alloc_windows_expire(vol->alloc_windows);
+	if ((goal >= 0) && (goal < vol->nr_clusters)
+	    && ((ntfs_attr_pread(vol->lcnbmp_na, goal >> 3, 1, &byte) != 1)
+		|| (byte & (1 << (goal & 7)))))
+		goal = -1;
+	return (goal);
+}
+
+/*
+ *		Skip the windows from the zone position
+ *
+ *	The search is not moved out of its zone, nor beyond the end of
+ *	the volume.
+ */
+
+static LCN alloc_windows_skip(ntfs_volume *vol, LCN lcn)
+{
+	struct ALLOC_WINDOWS *aw;
+	LCN limit;
+	LCN pos;
+	BOOL moved;
+	int i;
+
+	aw = vol->alloc_windows;
+	pos = lcn;
+	if (aw) {
+		limit = (lcn < vol->mft_zone_start
+				? vol->mft_zone_start : vol->nr_clusters);
+		do {
+			moved = FALSE;
+			for (i=0; i<aw->count; i++)
+				if ((pos >= aw->window[i].start)
+				    && (pos < aw->window[i].end)) {
+					pos = aw->window[i].end;
+					moved = TRUE;
+				}
+		} while (moved);
+		if (pos >= limit)
+			pos = lcn;
+	}
+	return (pos);
+}
+
+/*
+ *		Record the window following an allocation extending a file
+ *
+ *	@goal is the lcn which was requested, and @next is the lcn next
+ *	to the last one allocated. The window starting at @goal is renewed,
+ *	and when there is none, a window is only created if the goal
+ *	could not be used, the oldest window being reused when all of
+ *	them are in use.
+ */
+
+static void alloc_window_note(ntfs_volume *vol, LCN goal, LCN next,
+			BOOL create)
+{
+	struct ALLOC_WINDOWS *aw;
+	s64 size;
+	int i;
+	int k;
+
+	aw = vol->alloc_windows;
+	if (!aw) {
+		if (!create)
+			return;
+		aw = (struct ALLOC_WINDOWS*)ntfs_malloc(
+				sizeof(struct ALLOC_WINDOWS));
+		if (!aw)
+			return;
+		aw->tick = 0;
+		aw->count = 0;
+		vol->alloc_windows = aw;
+	}
+	for (i=0; (i<aw->count) && (aw->window[i].start != goal); i++) { }
+	if (i >= aw->count) {
+		if (!create)
+			return;
+		if (aw->count < NTFS_ALLOC_WINDOWS)
+			i = aw->count++;
+		else
+			for (i=0, k=1; k<aw->count; k++)
+				if ((aw->tick - aw->window[k].stamp)
+				    > (aw->tick - aw->window[i].stamp))
+					i = k;
+	}
+	aw->tick++;
+	size = ALLOC_WINDOW_SIZE >> vol->cluster_size_bits;
+	if (size > vol->nr_clusters - next)
+		size = vol->nr_clusters - next;
+	aw->window[i].start = next;
+	aw->window[i].end = next + size;
+	aw->window[i].stamp = aw->tick;
+}
+
+/*
+ *		Alignment of big allocations on the stripes of the device
+ *
+ *	On a RAID array, or a device whose physical sectors are bigger
+ *	than clusters, a write which does not cover whole stripes implies
+ *	reading and rewriting the rest of them. So an allocation of at
+ *	least a stripe which does not extend a file starts on a stripe
+ *	boundary when the free range found allows it, leaving the clusters
+ *	skipped to smaller allocations. Extending a file still goes on
+ *	from its last cluster, so that the files being written keep
+ *	covering whole stripes.
+ */
+
+/*
+ *		Set the stripe width big allocations are aligned to
+ *
+ *	@size is the width in bytes, zero to get it from the device
+ *	(when it is a block device), or negative for no alignment.
+ *	A width not bigger than a cluster means no alignment.
+ *
+ *	Returns 0 if successful
+ *		-1 if the requested width cannot be used (errno set)
+ */
+
+int ntfs_cluster_stripe_set(ntfs_volume *vol, s64 size)
+{
+	s64 start;
+	s64 offset;
+	BOOL requested;
+
+	vol->alloc_stripe = 0;
+	vol->alloc_stripe_offset = 0;
+	requested = (size != 0);
+	if (!requested)
+		size = ntfs_device_io_size_get(vol->dev);
+	if (size <= vol->cluster_size)
+		return (0);
+		/* the stripe boundaries are related to the whole device */
+	start = ntfs_device_partition_start_sector_get(vol->dev);
+	offset = (start > 0 ? (start << 9) % size : 0);
+	if ((size > ALLOC_STRIPE_MAX)
+	    || (size & (vol->cluster_size - 1))
+	    || (offset & (vol->cluster_size - 1))) {
+		if (!requested)
+			return (0);
+		errno = EINVAL;
+		return (-1);
+	}
+	vol->alloc_stripe = size >> vol->cluster_size_bits;
+	vol->alloc_stripe_offset = offset >> vol->cluster_size_bits;
+	ntfs_log_debug("Aligning big allocations to %lld clusters,"
+			" offset %lld\n", (long long)vol->alloc_stripe,
+			(long long)vol->alloc_stripe_offset);
+	return (0);
+}
+
+/*
+ *		Move the start of a big allocation to a stripe boundary
+ *
+ *	@lcn is the first free cluster found in the buffer, the boundary
+ *	is only used when a whole stripe (or the whole allocation) is free
+ *	from it within the buffer.
+ *
+ *	Returns the position in the buffer to start from
+ */
+
+static s64 alloc_stripe_start(ntfs_volume *vol, const u8 *buf, s64 buf_size,
+			LCN bmp_pos, s64 lcn, s64 count)
+{
+	s64 aligned;
+	s64 end;
+	s64 pos;
+	s64 rem;
+
+	rem = (bmp_pos + lcn + vol->alloc_stripe_offset) % vol->alloc_stripe;
+	if (!rem)
+		return (lcn);
+	aligned = lcn + vol->alloc_stripe - rem;
+	end = aligned + (count < vol->alloc_stripe ? count : vol->alloc_stripe);
+	if (end > buf_size)
+		return (lcn);
+	for (pos=aligned; (pos<end) && !(buf[pos >> 3] & (1 << (pos & 7)));
+			pos++) { }
+	return (pos < end ? lcn : aligned);
+}
+
+/*
+ *		Locate the longest run of free clusters in a buffer
+ *
+ *	Returns the position of the first one found, or -1 if there is
+ *	no free cluster
+ */
+
 static s64 max_empty_bit_range(unsigned char *buf, int size)
 {
-	int i, j, run = 0;
-	int max_range = 0;
+	s64 pos, start, end;
+	s64 max_range = 0;
 	s64 start_pos = -1;
 	
 	ntfs_log_trace("Entering\n");
 	
-	i = 0;
-	while (i < size) {
-		switch (*buf) {
-		case 0 :
-			do {
-				buf++;
-				run += 8;
-				i++;
-			} while ((i < size) && !*buf);
-			break;
-		case 255 :
-			if (run > max_range) {
-				max_range = run;
-				start_pos = (s64)i * 8 - run;
-			}
-			run = 0;
-			do {
-				buf++;
-				i++;
-			} while ((i < size) && (*buf == 255));
-			break;
-		default :
-			for (j = 0; j < 8; j++) {
-			
-				int bit = *buf & (1 << j);
-		
-				if (bit) {
-					if (run > max_range) {
-						max_range = run;
-						start_pos = (s64)i * 8 + (j - run);
-					}
-					run = 0;
-				} else 
-					run++;
-			}
-			i++;
-			buf++;
-		
+	pos = 0;
+	while ((start = ntfs_bitmap_find_zero(buf, pos, (s64)size << 3)) >= 0) {
+		end = ntfs_bitmap_find_set(buf, start, (s64)size << 3);
+		if (end < 0)
+			end = (s64)size << 3;
+		if ((end - start) > max_range) {
+			max_range = end - start;
+			start_pos = start;
 		}
+		pos = end;
 	}
 	
-	if (run > max_range)
-		start_pos = (s64)i * 8 - run;
-	
 	return start_pos;
 }
 
@@ -230,23 +880,32 @@ static int bitmap_writeback(ntfs_volume *vol, s64 pos, s64 size, void *b,
  * function. But it should all be worthwhile, because this allocator: 
  *   1) implements MFT zone reservation
  *   2) causes reduction in fragmentation. 
- * The code is not optimized for speed.
+ * The code is not optimized for speed, however the parts of the bitmap which
+ * the summary of free clusters shows as full are skipped without being read,
+ * which makes no difference to the clusters allocated. Should the summary
+ * be wrong and the search fail while the volume has enough free clusters,
+ * the summary is dropped and the search is made again on the bitmap.
  */
 runlist *ntfs_cluster_alloc(ntfs_volume *vol, VCN start_vcn, s64 count,
 		LCN start_lcn, const NTFS_CLUSTER_ALLOCATION_ZONES zone)
 {
 	LCN zone_start, zone_end;  /* current search range */
+	LCN goal;		/* lcn requested for extending a file */
 	LCN last_read_pos, lcn;
 	LCN bmp_pos;		/* current bit position inside the bitmap */
 	LCN prev_lcn = 0, prev_run_len = 0;
 	s64 clusters, br;
 	runlist *rl = NULL, *trl;
+	struct CLUSTER_SUMMARY *cs;
 	u8 *buf, *byte, bit, writeback;
 	u8 pass = 1; 	/* 1: inside zone;  2: start of zone */
 	u8 search_zone; /* 4: data2 (start) 1: mft (middle) 2: data1 (end) */
 	u8 done_zones = 0;
+	u8 full_zones;
 	u8 has_guess, used_zone_pos;
+	BOOL align;
 	int err = 0, rlpos, rlsize, buf_size;
+	u64 bmp_read, bmp_skipped;
 
 	ntfs_log_enter("Entering with count = 0x%llx, start_lcn = 0x%llx, "
 		       "zone = %s_ZONE.\n", (long long)count, (long long)
@@ -275,6 +934,21 @@ runlist *ntfs_cluster_alloc(ntfs_volume *vol, VCN start_vcn, s64 count,
 	buf = ntfs_malloc(NTFS_LCNALLOC_BSIZE);
 	if (!buf)
 		goto out;
+	ntfs_cluster_alloc_lock(vol);
+	vol->alloc_calls++;
+	NTFS_PROBE3(cluster__alloc, count, start_lcn, zone);
+	bmp_read = vol->alloc_bmp_read;
+	bmp_skipped = vol->alloc_bmp_skipped;
+	cs = cluster_summary_get(vol);
+	goal = start_lcn;
+	if (zone == DATA_ZONE)
+		start_lcn = alloc_window_goal(vol, start_lcn);
+	align = (zone == DATA_ZONE) && (vol->alloc_stripe > 1)
+			&& (count >= vol->alloc_stripe);
+	full_zones = vol->full_zones;
+	clusters = count;
+	rlpos = rlsize = 0;
+restart:
 	/*
 	 * If no @start_lcn was requested, use the current zone
 	 * position otherwise use the requested @start_lcn.
@@ -284,7 +958,8 @@ runlist *ntfs_cluster_alloc(ntfs_volume *vol, VCN start_vcn, s64 count,
 	
 	if (zone_start < 0) {
 		if (zone == DATA_ZONE)
-			zone_start = vol->data1_zone_pos;
+			zone_start = alloc_windows_skip(vol,
+						vol->data1_zone_pos);
 		else
 			zone_start = vol->mft_zone_pos;
 		has_guess = 0;
@@ -310,13 +985,30 @@ runlist *ntfs_cluster_alloc(ntfs_volume *vol, VCN start_vcn, s64 count,
 	bmp_pos = zone_start;
 
 	/* Loop until all clusters are allocated. */
-	clusters = count;
-	rlpos = rlsize = 0;
 	while (1) {
 			/* check whether we have exhausted the current zone */
 		if (search_zone & vol->full_zones)
 			goto zone_pass_done;
 		last_read_pos = bmp_pos >> 3;
+		if (cs) {
+			/*
+			 * Skip the part of the bitmap which would be read
+			 * if it has no free cluster, as if it had been read.
+			 */
+			br = vol->lcnbmp_na->data_size - last_read_pos;
+			if (br > NTFS_LCNALLOC_BSIZE)
+				br = NTFS_LCNALLOC_BSIZE;
+			if ((br > 0)
+			    && cluster_summary_full(cs, bmp_pos & ~7,
+						br << 3)) {
+				buf_size = (int)br << 3;
+				bmp_pos &= ~7;
+				has_guess = 0;
+				writeback = 0;
+				vol->alloc_bmp_skipped += br;
+				goto next_buffer;
+			}
+		}
 		br = ntfs_attr_pread(vol->lcnbmp_na, last_read_pos, 
 				     NTFS_LCNALLOC_BSIZE, buf);
 		if (br <= 0) {
@@ -326,6 +1018,7 @@ runlist *ntfs_cluster_alloc(ntfs_volume *vol, VCN start_vcn, s64 count,
 			ntfs_log_perror("Reading $BITMAP failed");
 			goto err_ret;
 		}
+		vol->alloc_bmp_read += br;
 		/*
 		 * We might have read less than NTFS_LCNALLOC_BSIZE bytes
 		 * if we are close to the end of the attribute.
@@ -347,6 +1040,9 @@ runlist *ntfs_cluster_alloc(ntfs_volume *vol, VCN start_vcn, s64 count,
 				lcn = max_empty_bit_range(buf, br);
 				if (lcn < 0)
 					break;
+				if (align && !rlpos)
+					lcn = alloc_stripe_start(vol, buf, buf_size,
+						bmp_pos, lcn, clusters);
 				has_guess = 1;
 				continue;
 			}
@@ -368,6 +1064,12 @@ runlist *ntfs_cluster_alloc(ntfs_volume *vol, VCN start_vcn, s64 count,
 			/* Allocate the bitmap bit. */
 			*byte |= bit;
 			writeback = 1;
+			if (cs && cs->free[(lcn + bmp_pos)
+					>> NTFS_LCNALLOC_CHUNK_BITS])
+				cs->free[(lcn + bmp_pos)
+					>> NTFS_LCNALLOC_CHUNK_BITS]--;
+			if (vol->free_count)
+				free_count_update(vol, lcn + bmp_pos, 1, TRUE);
 			if (vol->free_clusters <= 0) 
 				ntfs_log_error("Non-positive free clusters "
 					       "(%lld)!\n",
@@ -422,7 +1124,7 @@ runlist *ntfs_cluster_alloc(ntfs_volume *vol, VCN start_vcn, s64 count,
 			err = errno;
 			goto err_ret;
 		}
-		
+next_buffer:
 		if (!used_zone_pos) {
 			
 			used_zone_pos = 1;
@@ -522,6 +1224,16 @@ switch_to_data1_zone:		search_zone = ZONE_DATA1;
 			continue;
 		}
 		
+		if (cs && (vol->free_clusters >= clusters)) {
+			ntfs_log_debug("Inconsistent summary of free clusters,"
+					" searching again\n");
+			ntfs_cluster_summary_release(vol);
+			cs = (struct CLUSTER_SUMMARY*)NULL;
+			vol->full_zones = full_zones;
+			done_zones = 0;
+			pass = 1;
+			goto restart;
+		}
 		ntfs_log_trace("All zones are finished, no space on device.\n");
 		err = ENOSPC;
 		goto err_ret;
@@ -536,7 +1248,16 @@ done_ret:
 		err = errno;
 		goto err_ret;
 	}
+	vol->alloc_clusters += count;
+	if ((zone == DATA_ZONE) && (goal >= 0))
+		alloc_window_note(vol, goal,
+				rl[rlpos - 1].lcn + rl[rlpos - 1].length,
+				start_lcn != goal);
 done_err_ret:
+	NTFS_PROBE4(cluster__alloc__done, count, err,
+			vol->alloc_bmp_read - bmp_read,
+			vol->alloc_bmp_skipped - bmp_skipped);
+	ntfs_cluster_alloc_unlock(vol);
 	free(buf);
 	if (err) {
 		errno = err;
@@ -579,6 +1300,7 @@ int ntfs_cluster_free_from_rl(ntfs_volume *vol, runlist *rl)
 	int ret = -1;
 
 	ntfs_log_trace("Entering.\n");
+	ntfs_cluster_alloc_lock(vol);
 
 	for (; rl->length; rl++) {
 
@@ -606,6 +1328,7 @@ out:
 		ntfs_log_error("Too many free clusters (%lld > %lld)!",
 			       (long long)vol->free_clusters, 
 			       (long long)vol->nr_clusters);
+	ntfs_cluster_alloc_unlock(vol);
 	return ret;
 }
 
@@ -623,6 +1346,7 @@ int ntfs_cluster_free_basic(ntfs_volume *vol, s64 lcn, s64 count)
 	ntfs_log_trace("Dealloc lcn 0x%llx, len 0x%llx.\n",
 			       (long long)lcn, (long long)count);
 
+	ntfs_cluster_alloc_lock(vol);
 	if (lcn >= 0) { 
 		update_full_status(vol,lcn);
 		if (ntfs_bitmap_clear_run(vol->lcnbmp_na, lcn, 
@@ -642,6 +1366,7 @@ out:
 		ntfs_log_error("Too many free clusters (%lld > %lld)!",
 			       (long long)vol->free_clusters, 
 			       (long long)vol->nr_clusters);
+	ntfs_cluster_alloc_unlock(vol);
 	return ret;
 }
 
@@ -685,11 +1410,12 @@ int ntfs_cluster_free(ntfs_volume *vol, ntfs_attr *na, VCN start_vcn, s64 count)
 		goto leave;
 	}
 
+	ntfs_cluster_alloc_lock(vol);
 	if (rl->lcn < 0 && rl->lcn != LCN_HOLE) {
 		errno = EIO;
 		ntfs_log_perror("%s: Unexpected lcn (%lld)", __FUNCTION__, 
 				(long long)rl->lcn);
-		goto leave;
+		goto out;
 	}
 
 	/* Find the starting cluster inside the run that needs freeing. */
@@ -705,7 +1431,7 @@ int ntfs_cluster_free(ntfs_volume *vol, ntfs_attr *na, VCN start_vcn, s64 count)
 		update_full_status(vol,rl->lcn + delta);
 		if (ntfs_bitmap_clear_run(vol->lcnbmp_na, rl->lcn + delta,
 					  to_free))
-			goto leave;
+			goto out;
 		nr_freed = to_free;
 	} 
 
@@ -765,7 +1491,126 @@ out:
 		ntfs_log_error("Too many free clusters (%lld > %lld)!",
 			       (long long)vol->free_clusters, 
 			       (long long)vol->nr_clusters);
+	ntfs_cluster_alloc_unlock(vol);
 leave:	
 	ntfs_log_leave("\n");
 	return ret;
 }
+
+/*
+ *		Record the end of a free extent, if it is the longest one
+ */
+
+static void free_extent_end(LCN *start, LCN end, LCN *best, s64 *best_length)
+{
+	if ((*start >= 0) && ((end - *start) > *best_length)) {
+		*best = *start;
+		*best_length = end - *start;
+	}
+	*start = -1;
+}
+
+/**
+ * ntfs_cluster_find_free - locate a free extent
+ * @vol:	mounted ntfs volume on which to search
+ * @count:	wanted count of consecutive free clusters
+ * @length:	where to return the count of free clusters found
+ *
+ * Search the first extent of at least @count free clusters out of the
+ * mft zone, or the longest one if there is no such extent, for
+ * relocating a fragmented attribute. The clusters are not allocated.
+ * The summary of free clusters is used as an index of the free
+ * extents : the chunks it shows full are skipped, the chunks it shows
+ * free are extending the extent without being read, and only the
+ * chunks partially free are looked at in $Bitmap.
+ *
+ * Return the first cluster of the extent, with the count of clusters
+ * found (at most @count) in @length, or -1 on error with errno set to
+ * the error code (ENOSPC if there is no free cluster).
+ */
+LCN ntfs_cluster_find_free(ntfs_volume *vol, s64 count, s64 *length)
+{
+	struct CLUSTER_SUMMARY *cs;
+	const s64 chunk_size = 1 << NTFS_LCNALLOC_CHUNK_BITS;
+	u8 *buf;
+	LCN start;
+	LCN best;
+	LCN lcn;
+	LCN end;
+	s64 best_length;
+	s64 chunk;
+	s64 size;
+	s64 bit;
+	BOOL inzone;
+	int err;
+
+	if (!vol || (count <= 0) || !length) {
+		errno = EINVAL;
+		return (-1);
+	}
+	buf = (u8*)ntfs_malloc(chunk_size >> 3);
+	if (!buf)
+		return (-1);
+	ntfs_cluster_alloc_lock(vol);
+	cs = cluster_summary_get(vol);
+	err = 0;
+	best = -1;
+	best_length = 0;
+	start = -1;
+	for (lcn=0; (best_length < count) && (lcn < vol->nr_clusters);
+			lcn=end) {
+		chunk = lcn >> NTFS_LCNALLOC_CHUNK_BITS;
+		end = lcn + chunk_size;
+		if (end > vol->nr_clusters)
+			end = vol->nr_clusters;
+		inzone = (lcn < vol->mft_zone_end)
+				&& (end > vol->mft_zone_start);
+		if (cs && (chunk < cs->count) && !cs->free[chunk]) {
+			free_extent_end(&start, lcn, &best, &best_length);
+			continue;
+		}
+		if (cs && (chunk < cs->count) && !inzone
+		    && (end == (lcn + chunk_size))
+		    && (cs->free[chunk] == chunk_size)) {
+			if (start < 0)
+				start = lcn;
+			if ((end - start) >= count)
+				free_extent_end(&start, end, &best,
+						&best_length);
+			continue;
+		}
+		size = (end - lcn + 7) >> 3;
+		if (ntfs_attr_pread(vol->lcnbmp_na, lcn >> 3, size, buf)
+				!= size) {
+			err = EIO;
+			break;
+		}
+		for (bit=0; (best_length < count) && ((lcn + bit) < end);
+				bit++) {
+			if ((buf[bit >> 3] & (1 << (bit & 7)))
+			    || (inzone
+				&& ((lcn + bit) >= vol->mft_zone_start)
+				&& ((lcn + bit) < vol->mft_zone_end)))
+				free_extent_end(&start, lcn + bit, &best,
+						&best_length);
+			else {
+				if (start < 0)
+					start = lcn + bit;
+				if ((lcn + bit + 1 - start) >= count)
+					free_extent_end(&start, lcn + bit + 1,
+						&best, &best_length);
+			}
+		}
+	}
+	free_extent_end(&start, lcn, &best, &best_length);
+	ntfs_cluster_alloc_unlock(vol);
+	free(buf);
+	if (!err && (best < 0))
+		err = ENOSPC;
+	if (err) {
+		errno = err;
+		return (-1);
+	}
+	*length = (best_length < count ? best_length : count);
+	return (best);
+}
@@ -0,0 +1,557 @@
+/**
+ * lcnindex.c : index of the owners of the clusters of a volume
+ *
+ *      This module is part of ntfs-3g library
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
+
+#include "types.h"
+#include "layout.h"
+#include "attrib.h"
+#include "runlist.h"
+#include "mft.h"
+#include "volume.h"
+#include "lcnindex.h"
+#include "misc.h"
+#include "logging.h"
+
+/*
+ *		Index of the owners of the clusters
+ *
+ *	Finding the attribute which owns a cluster normally implies
+ *	decoding the runlists of all the attributes on the volume, which
+ *	is too long to be done for each of many clusters, for instance
+ *	when checking which files are hit by a list of bad sectors.
+ *
+ *	The index is built by a single parallel scan of the MFT, and all
+ *	the runs of allocated clusters, in the base records and in the
+ *	extents, are gathered into a table sorted by first cluster, so
+ *	that a query is a binary search. The volume is supposed to not
+ *	be modified while the index is used.
+ *
+ *	On a damaged volume, some clusters may be claimed by several
+ *	attributes, so the runs may overlap. The highest cluster reached
+ *	by the runs up to each entry is therefore kept in a separate
+ *	table, which is monotonic and used for the binary search.
+ *
+ *	The index can be saved to a file and loaded again, provided the
+ *	volume has not been changed meanwhile, which is only checked
+ *	through its serial number and size.
+ */
+
+#define LCNINDEX_MAGIC "NTFSLCNX"
+#define LCNINDEX_VERSION 1
+#define LCNINDEX_ENTRIES_STEP 4096
+
+struct LCN_INDEX {
+	struct LCN_INDEX_ENTRY *entries;
+	LCN *reach;			/* highest end of runs up to entry */
+	s64 count;
+	s64 size;			/* allocated entries */
+	ntfschar *names;		/* pool of attribute names */
+	u32 names_len;
+	u32 names_size;
+	u64 serial_no;
+	s64 nr_clusters;
+#ifdef ENABLE_THREADS
+	pthread_mutex_t lock;
+#endif
+} ;
+
+/* All values are in little endian. */
+struct LCN_INDEX_HEADER {
+	char magic[8];
+	le32 version;
+	le32 names_len;
+	le64 serial_no;
+	le64 nr_clusters;
+	le64 count;
+} __attribute__((__packed__));
+
+struct LCN_INDEX_RECORD {
+	le64 lcn;
+	le64 length;
+	le64 vcn;
+	le64 mref;
+	le32 type;
+	le32 name;
+	le32 name_len;
+} __attribute__((__packed__));
+
+static void lcnindex_lock(struct LCN_INDEX *index
+#ifndef ENABLE_THREADS
+			__attribute__((unused))
+#endif
+			)
+{
+#ifdef ENABLE_THREADS
+	pthread_mutex_lock(&index->lock);
+#endif
+}
+
+static void lcnindex_unlock(struct LCN_INDEX *index
+#ifndef ENABLE_THREADS
+			__attribute__((unused))
+#endif
+			)
+{
+#ifdef ENABLE_THREADS
+	pthread_mutex_unlock(&index->lock);
+#endif
+}
+
+static struct LCN_INDEX *lcnindex_alloc(ntfs_volume *vol)
+{
+	struct LCN_INDEX *index;
+
+	index = (struct LCN_INDEX*)ntfs_calloc(sizeof(struct LCN_INDEX));
+	if (index) {
+		index->serial_no = vol->serial_no;
+		index->nr_clusters = vol->nr_clusters;
+#ifdef ENABLE_THREADS
+		pthread_mutex_init(&index->lock, NULL);
+#endif
+	}
+	return (index);
+}
+
+void ntfs_lcnindex_free(struct LCN_INDEX *index)
+{
+	if (index) {
+#ifdef ENABLE_THREADS
+		pthread_mutex_destroy(&index->lock);
+#endif
+		free(index->entries);
+		free(index->reach);
+		free(index->names);
+		free(index);
+	}
+}
+
+/*
+ *		Append the runs of an attribute, the index being locked
+ *
+ *	Returns 0 if successful, -1 if there was not enough memory
+ */
+
+static int append_runs(struct LCN_INDEX *index, const runlist_element *rl,
+			MFT_REF mref, const ATTR_RECORD *a)
+{
+	struct LCN_INDEX_ENTRY *entry;
+	struct LCN_INDEX_ENTRY *newentries;
+	ntfschar *newnames;
+	u32 name;
+	u32 newsize;
+	s64 size;
+	int i;
+
+	name = 0;
+	if (a->name_length) {
+		if ((index->names_len + a->name_length) > index->names_size) {
+			newsize = index->names_size + 1024;
+			newnames = (ntfschar*)realloc(index->names,
+					newsize*sizeof(ntfschar));
+			if (!newnames)
+				return (-1);
+			index->names = newnames;
+			index->names_size = newsize;
+		}
+		name = index->names_len;
+		memcpy(&index->names[name],
+			(const char*)a + le16_to_cpu(a->name_offset),
+			a->name_length*sizeof(ntfschar));
+		index->names_len += a->name_length;
+	}
+	for (i=0; rl[i].length; i++) {
+		if (rl[i].lcn < 0)
+			continue;
+		if (index->count >= index->size) {
+			size = index->size + LCNINDEX_ENTRIES_STEP;
+			newentries = (struct LCN_INDEX_ENTRY*)realloc(
+				index->entries,
+				size*sizeof(struct LCN_INDEX_ENTRY));
+			if (!newentries)
+				return (-1);
+			index->entries = newentries;
+			index->size = size;
+		}
+		entry = &index->entries[index->count++];
+		entry->lcn = rl[i].lcn;
+		entry->length = rl[i].length;
+		entry->vcn = rl[i].vcn;
+		entry->mref = mref;
+		entry->type = a->type;
+		entry->name = name;
+		entry->name_len = a->name_length;
+	}
+	return (0);
+}
+
+/*
+ *		Collect the runs of an MFT record, base or extent
+ *
+ *	Called concurrently by the threads scanning the MFT. The runlists
+ *	are decoded without the lock, and merged into the index under it.
+ */
+
+static int index_record(ntfs_volume *vol, s64 mft_no, MFT_RECORD *mrec,
+			void *arg)
+{
+	struct LCN_INDEX *index = (struct LCN_INDEX*)arg;
+	ntfs_attr_search_ctx *ctx;
+	runlist_element *rl;
+	MFT_REF mref;
+	int ret;
+
+	if (!mrec) {
+		ntfs_log_error("Could not read MFT record %lld\n",
+				(long long)mft_no);
+		return (0);
+	}
+	if (!ntfs_is_file_record(mrec->magic)
+	    || !(mrec->flags & MFT_RECORD_IN_USE))
+		return (0);
+	if (mrec->base_mft_record)
+		mref = le64_to_cpu(mrec->base_mft_record);
+	else
+		mref = MK_MREF(mft_no, le16_to_cpu(mrec->sequence_number));
+	ctx = ntfs_attr_get_search_ctx(NULL, mrec);
+	if (!ctx)
+		return (-1);
+	ret = 0;
+	while (!ret && !ntfs_attrs_walk(ctx)) {
+		if (ctx->attr->type == AT_END)
+			break;
+		if (!ctx->attr->non_resident)
+			continue;
+		rl = ntfs_mapping_pairs_decompress(vol, ctx->attr, NULL);
+		if (!rl) {
+			ntfs_log_error("Bad runlist in MFT record %lld\n",
+					(long long)mft_no);
+			continue;
+		}
+		lcnindex_lock(index);
+		ret = append_runs(index, rl, mref, ctx->attr);
+		lcnindex_unlock(index);
+		free(rl);
+	}
+	ntfs_attr_put_search_ctx(ctx);
+	return (ret);
+}
+
+static int compare_entries(const void *p1, const void *p2)
+{
+	const struct LCN_INDEX_ENTRY *e1 = (const struct LCN_INDEX_ENTRY*)p1;
+	const struct LCN_INDEX_ENTRY *e2 = (const struct LCN_INDEX_ENTRY*)p2;
+
+	if (e1->lcn != e2->lcn)
+		return (e1->lcn < e2->lcn ? -1 : 1);
+	if (e1->mref != e2->mref)
+		return (e1->mref < e2->mref ? -1 : 1);
+	return (0);
+}
+
+/*
+ *		Sort the entries and compute the reach of each of them
+ *
+ *	Returns 0 if successful, -1 if there was not enough memory
+ */
+
+static int lcnindex_finish(struct LCN_INDEX *index)
+{
+	LCN reach;
+	LCN end;
+	s64 i;
+
+	qsort(index->entries, index->count, sizeof(struct LCN_INDEX_ENTRY),
+			compare_entries);
+	index->reach = (LCN*)ntfs_malloc((index->count + 1)*sizeof(LCN));
+	if (!index->reach)
+		return (-1);
+	reach = 0;
+	for (i=0; i<index->count; i++) {
+		end = index->entries[i].lcn + index->entries[i].length;
+		if (end > reach)
+			reach = end;
+		index->reach[i] = reach;
+	}
+	return (0);
+}
+
+/**
+ * ntfs_lcnindex_build - build the index of the owners of the clusters
+ * @vol:	volume to index
+ * @threads:	count of threads for scanning the MFT, zero for one
+ *		per processor
+ *
+ * Return the index, or NULL on error with errno set.
+ */
+
+struct LCN_INDEX *ntfs_lcnindex_build(ntfs_volume *vol, int threads)
+{
+	struct LCN_INDEX *index;
+	int err;
+
+	if (!vol || !vol->mft_na) {
+		errno = EINVAL;
+		return ((struct LCN_INDEX*)NULL);
+	}
+	index = lcnindex_alloc(vol);
+	if (index) {
+		if (ntfs_mft_scan_parallel(vol, 0,
+				vol->mft_na->initialized_size
+					>> vol->mft_record_size_bits,
+				threads, index_record, index)
+		    || lcnindex_finish(index)) {
+			err = errno;
+			ntfs_lcnindex_free(index);
+			index = (struct LCN_INDEX*)NULL;
+			errno = err;
+		}
+	}
+	if (!index)
+		ntfs_log_perror("Could not build the index of clusters");
+	return (index);
+}
+
+/**
+ * ntfs_lcnindex_save - save an index of the clusters to a file
+ * @index:	index to save
+ * @path:	file to create or overwrite
+ *
+ * Return 0 if successful, or -1 on error with errno set.
+ */
+
+int ntfs_lcnindex_save(const struct LCN_INDEX *index, const char *path)
+{
+	struct LCN_INDEX_HEADER header;
+	struct LCN_INDEX_RECORD record;
+	const struct LCN_INDEX_ENTRY *entry;
+	FILE *f;
+	BOOL ok;
+	s64 i;
+
+	if (!index || !path) {
+		errno = EINVAL;
+		return (-1);
+	}
+	f = fopen(path, "wb");
+	if (!f) {
+		ntfs_log_perror("Could not create %s", path);
+		return (-1);
+	}
+	memcpy(header.magic, LCNINDEX_MAGIC, sizeof(header.magic));
+	header.version = const_cpu_to_le32(LCNINDEX_VERSION);
+	header.names_len = cpu_to_le32(index->names_len);
+	header.serial_no = cpu_to_le64(index->serial_no);
+	header.nr_clusters = cpu_to_le64(index->nr_clusters);
+	header.count = cpu_to_le64(index->count);
+	ok = fwrite(&header, sizeof(header), 1, f) == 1;
+	for (i=0; ok && (i<index->count); i++) {
+		entry = &index->entries[i];
+		record.lcn = cpu_to_le64(entry->lcn);
+		record.length = cpu_to_le64(entry->length);
+		record.vcn = cpu_to_le64(entry->vcn);
+		record.mref = cpu_to_le64(entry->mref);
+		record.type = entry->type;
+		record.name = cpu_to_le32(entry->name);
+		record.name_len = cpu_to_le32(entry->name_len);
+		ok = fwrite(&record, sizeof(record), 1, f) == 1;
+	}
+		/* the names are already little endian */
+	if (ok && index->names_len)
+		ok = fwrite(index->names, sizeof(ntfschar), index->names_len,
+				f) == index->names_len;
+	if (fclose(f))
+		ok = FALSE;
+	if (!ok) {
+		ntfs_log_perror("Could not write %s", path);
+		return (-1);
+	}
+	return (0);
+}
+
+/**
+ * ntfs_lcnindex_load - load an index of the clusters from a file
+ * @vol:	volume the index was built for
+ * @path:	file saved by ntfs_lcnindex_save()
+ *
+ * The index is rejected if it was saved for another volume, or if
+ * it is inconsistent.
+ *
+ * Return the index, or NULL on error with errno set, to ENOENT if
+ * the file does not exist.
+ */
+
+struct LCN_INDEX *ntfs_lcnindex_load(ntfs_volume *vol, const char *path)
+{
+	struct LCN_INDEX_HEADER header;
+	struct LCN_INDEX_RECORD record;
+	struct LCN_INDEX_ENTRY *entry;
+	struct LCN_INDEX *index;
+	FILE *f;
+	BOOL ok;
+	s64 i;
+
+	if (!vol || !path) {
+		errno = EINVAL;
+		return ((struct LCN_INDEX*)NULL);
+	}
+	f = fopen(path, "rb");
+	if (!f)
+		return ((struct LCN_INDEX*)NULL);
+	index = (struct LCN_INDEX*)NULL;
+	ok = (fread(&header, sizeof(header), 1, f) == 1)
+		&& !memcmp(header.magic, LCNINDEX_MAGIC, sizeof(header.magic))
+		&& (header.version == const_cpu_to_le32(LCNINDEX_VERSION))
+		&& (le64_to_cpu(header.serial_no) == vol->serial_no)
+		&& (sle64_to_cpu(header.nr_clusters) == vol->nr_clusters)
+		&& (sle64_to_cpu(header.count) >= 0)
+		&& (sle64_to_cpu(header.count)
+			<= vol->nr_clusters);
+	if (ok) {
+		index = lcnindex_alloc(vol);
+		ok = (index != (struct LCN_INDEX*)NULL);
+	}
+	if (ok) {
+		index->size = sle64_to_cpu(header.count);
+		index->names_size = le32_to_cpu(header.names_len);
+		index->entries = (struct LCN_INDEX_ENTRY*)ntfs_malloc(
+			(index->size + 1)*sizeof(struct LCN_INDEX_ENTRY));
+		index->names = (ntfschar*)ntfs_malloc(
+			(index->names_size + 1)*sizeof(ntfschar));
+		ok = index->entries && index->names;
+	}
+	for (i=0; ok && (i<index->size); i++) {
+		entry = &index->entries[i];
+		ok = fread(&record, sizeof(record), 1, f) == 1;
+		entry->lcn = sle64_to_cpu(record.lcn);
+		entry->length = sle64_to_cpu(record.length);
+		entry->vcn = sle64_to_cpu(record.vcn);
+		entry->mref = le64_to_cpu(record.mref);
+		entry->type = record.type;
+		entry->name = le32_to_cpu(record.name);
+		entry->name_len = le32_to_cpu(record.name_len);
+		if (ok && ((entry->lcn < 0) || (entry->length <= 0)
+		    || (entry->vcn < 0)
+		    || (entry->lcn > vol->nr_clusters - entry->length)
+		    || (entry->name > index->names_size)
+		    || (entry->name_len > index->names_size - entry->name)))
+			ok = FALSE;
+		else
+			index->count++;
+	}
+	if (ok && index->names_size) {
+		ok = fread(index->names, sizeof(ntfschar), index->names_size,
+				f) == index->names_size;
+		index->names_len = index->names_size;
+	}
+	if (ok)
+		ok = !lcnindex_finish(index);
+	fclose(f);
+	if (!ok) {
+		ntfs_log_error("The index of clusters in %s is not usable\n",
+				path);
+		ntfs_lcnindex_free(index);
+		index = (struct LCN_INDEX*)NULL;
+		errno = EINVAL;
+	}
+	return (index);
+}
+
+s64 ntfs_lcnindex_count(const struct LCN_INDEX *index)
+{
+	return (index ? index->count : 0);
+}
+
+const ntfschar *ntfs_lcnindex_name(const struct LCN_INDEX *index,
+			const struct LCN_INDEX_ENTRY *entry)
+{
+	return (entry->name_len ? &index->names[entry->name] : AT_UNNAMED);
+}
+
+/**
+ * ntfs_lcnindex_query - find the attributes owning a range of clusters
+ * @index:	index of the clusters
+ * @begin:	first cluster of the range
+ * @end:	last cluster of the range (included)
+ * @func:	function to call for each run overlapping the range
+ * @arg:	argument passed to @func
+ *
+ * @func is called in the order of the clusters, with the part of the
+ * range which is overlapped by the run. It returns zero to go on, or
+ * another value to stop the query.
+ *
+ * Return zero, or the value returned by @func which stopped the query.
+ */
+
+int ntfs_lcnindex_query(const struct LCN_INDEX *index, LCN begin, LCN end,
+			ntfs_lcnindex_func func, void *arg)
+{
+	const struct LCN_INDEX_ENTRY *entry;
+	s64 low, high, mid;
+	LCN first, last;
+	int ret;
+
+	if (!index || !func || (begin > end)) {
+		errno = EINVAL;
+		return (-1);
+	}
+		/* locate the first entry which reaches beyond begin */
+	low = 0;
+	high = index->count;
+	while (low < high) {
+		mid = (low + high) >> 1;
+		if (index->reach[mid] > begin)
+			high = mid;
+		else
+			low = mid + 1;
+	}
+	ret = 0;
+	for (mid=low; !ret && (mid<index->count)
+			&& (index->entries[mid].lcn <= end); mid++) {
+		entry = &index->entries[mid];
+		if ((entry->lcn + entry->length) > begin) {
+			first = (entry->lcn > begin ? entry->lcn : begin);
+			last = entry->lcn + entry->length - 1;
+			if (last > end)
+				last = end;
+			ret = func(index, entry, first, last, arg);
+		}
+	}
+	return (ret);
+}
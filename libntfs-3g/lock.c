@@ -0,0 +1,321 @@
+/**
+ * lock.c : locks for concurrent access to a volume
+ *
+ *      This module is part of ntfs-3g library
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
+
+#include "types.h"
+#include "volume.h"
+#include "inode.h"
+#include "lock.h"
+#include "misc.h"
+#include "logging.h"
+
+/*
+ *		Locking model for concurrent requests
+ *
+ *	A program which issues requests on the same volume from several
+ *	threads must hold the volume lock while a request is being
+ *	processed :
+ *	- in shared mode for requests which only read data or metadata,
+ *	- in exclusive mode for requests which may modify anything.
+ *
+ *	Shared holders may run concurrently. An inode fetched from the
+ *	inode cache is removed from the cache while being used, so it
+ *	is private to its opener, but a held inode (see ntfs_inode_hold())
+ *	is the same ntfs_inode for all the readers which open it, and
+ *	the readers open their own attributes on it. This is safe as
+ *	long as the readers do not modify the held inode :
+ *	- the requests which modify an inode hold the volume lock in
+ *	  exclusive mode, so no reader is using it meanwhile,
+ *	- the access times are not updated by readers, the driver
+ *	  defers them and applies them later under the exclusive lock,
+ *	- the extents of a held inode which a reader may attach while
+ *	  opening an attribute are protected by the inode locks.
+ *	The state which is otherwise shared between readers is
+ *	protected by internal locks :
+ *	- the cache lock protects the LRU caches, it is only held
+ *	  while looking up an entry and copying the data out of it,
+ *	  it also protects the pools of index contexts and the index
+ *	  allocations kept open in directory inodes,
+ *	- the security lock protects the $Secure indexes and the
+ *	  updates of the permissions cache (the entries indexed by
+ *	  security id are read without locking),
+ *	- the inode locks protect the list of extents attached to
+ *	  a base inode (they are shared by several inodes, selected
+ *	  through the inode number),
+ *	- the allocation locks serialize the updates of $Bitmap and
+ *	  of the MFT bitmap.
+ *
+ *	The locks are recursive, and when several of them have to be
+ *	held, they are acquired in the order security, inode, mft
+ *	allocation, cluster allocation, cache.
+ *
+ *	Programs which do not create the locks, or which are built
+ *	without thread support, get no-ops.
+ */
+
+#ifdef ENABLE_THREADS
+
+#define INODE_LOCKS_BITS 6	/* log2 of the count of inode locks */
+
+struct NTFS_LOCKS {
+	pthread_rwlock_t volume;
+	pthread_mutex_t cache;
+	pthread_mutex_t security;
+	pthread_mutex_t cluster_alloc;
+	pthread_mutex_t mft_alloc;
+	pthread_mutex_t inode[1 << INODE_LOCKS_BITS];
+} ;
+
+static int init_recursive(pthread_mutex_t *mutex)
+{
+	pthread_mutexattr_t attr;
+	int res;
+
+	res = pthread_mutexattr_init(&attr);
+	if (!res) {
+		res = pthread_mutexattr_settype(&attr,
+				PTHREAD_MUTEX_RECURSIVE);
+		if (!res)
+			res = pthread_mutex_init(mutex, &attr);
+		pthread_mutexattr_destroy(&attr);
+	}
+	return (res);
+}
+
+/*
+ *		Create the locks of a volume
+ *
+ *	Returns 0 if successful,
+ *		-1 otherwise, with errno set, and the volume is left
+ *		without locks.
+ */
+
+int ntfs_create_locks(ntfs_volume *vol)
+{
+	struct NTFS_LOCKS *locks;
+	int err;
+	int i;
+
+	locks = (struct NTFS_LOCKS*)ntfs_malloc(sizeof(struct NTFS_LOCKS));
+	if (!locks)
+		return (-1);
+	err = pthread_rwlock_init(&locks->volume, NULL);
+	if (!err)
+		err = init_recursive(&locks->cache);
+	if (!err)
+		err = init_recursive(&locks->security);
+	if (!err)
+		err = init_recursive(&locks->cluster_alloc);
+	if (!err)
+		err = init_recursive(&locks->mft_alloc);
+	for (i=0; !err && (i<(1 << INODE_LOCKS_BITS)); i++)
+		err = init_recursive(&locks->inode[i]);
+	if (err) {
+		/* only happens on resource exhaustion, nothing to undo */
+		ntfs_log_error("Could not create the volume locks\n");
+		free(locks);
+		errno = err;
+		return (-1);
+	}
+	vol->locks = locks;
+	return (0);
+}
+
+void ntfs_free_locks(ntfs_volume *vol)
+{
+	struct NTFS_LOCKS *locks;
+	int i;
+
+	locks = vol->locks;
+	if (locks) {
+		vol->locks = (struct NTFS_LOCKS*)NULL;
+		pthread_rwlock_destroy(&locks->volume);
+		pthread_mutex_destroy(&locks->cache);
+		pthread_mutex_destroy(&locks->security);
+		pthread_mutex_destroy(&locks->cluster_alloc);
+		pthread_mutex_destroy(&locks->mft_alloc);
+		for (i=0; i<(1 << INODE_LOCKS_BITS); i++)
+			pthread_mutex_destroy(&locks->inode[i]);
+		free(locks);
+	}
+}
+
+void ntfs_volume_lock_shared(ntfs_volume *vol)
+{
+	if (vol->locks)
+		pthread_rwlock_rdlock(&vol->locks->volume);
+}
+
+void ntfs_volume_lock_exclusive(ntfs_volume *vol)
+{
+	if (vol->locks)
+		pthread_rwlock_wrlock(&vol->locks->volume);
+}
+
+void ntfs_volume_unlock(ntfs_volume *vol)
+{
+	if (vol->locks)
+		pthread_rwlock_unlock(&vol->locks->volume);
+}
+
+void ntfs_cache_lock(ntfs_volume *vol)
+{
+	if (vol->locks)
+		pthread_mutex_lock(&vol->locks->cache);
+}
+
+void ntfs_cache_unlock(ntfs_volume *vol)
+{
+	if (vol->locks)
+		pthread_mutex_unlock(&vol->locks->cache);
+}
+
+void ntfs_security_lock(ntfs_volume *vol)
+{
+	if (vol->locks)
+		pthread_mutex_lock(&vol->locks->security);
+}
+
+void ntfs_security_unlock(ntfs_volume *vol)
+{
+	if (vol->locks)
+		pthread_mutex_unlock(&vol->locks->security);
+}
+
+void ntfs_cluster_alloc_lock(ntfs_volume *vol)
+{
+	if (vol->locks)
+		pthread_mutex_lock(&vol->locks->cluster_alloc);
+}
+
+void ntfs_cluster_alloc_unlock(ntfs_volume *vol)
+{
+	if (vol->locks)
+		pthread_mutex_unlock(&vol->locks->cluster_alloc);
+}
+
+void ntfs_mft_alloc_lock(ntfs_volume *vol)
+{
+	if (vol->locks)
+		pthread_mutex_lock(&vol->locks->mft_alloc);
+}
+
+void ntfs_mft_alloc_unlock(ntfs_volume *vol)
+{
+	if (vol->locks)
+		pthread_mutex_unlock(&vol->locks->mft_alloc);
+}
+
+void ntfs_inode_lock(ntfs_inode *ni)
+{
+	if (ni->vol->locks)
+		pthread_mutex_lock(&ni->vol->locks->inode[ni->mft_no
+				& ((1 << INODE_LOCKS_BITS) - 1)]);
+}
+
+void ntfs_inode_unlock(ntfs_inode *ni)
+{
+	if (ni->vol->locks)
+		pthread_mutex_unlock(&ni->vol->locks->inode[ni->mft_no
+				& ((1 << INODE_LOCKS_BITS) - 1)]);
+}
+
+#else /* ENABLE_THREADS */
+
+/*
+ *		Stubs for builds without thread support
+ */
+
+int ntfs_create_locks(ntfs_volume *vol __attribute__((unused)))
+{
+	return (0);
+}
+
+void ntfs_free_locks(ntfs_volume *vol __attribute__((unused)))
+{
+}
+
+void ntfs_volume_lock_shared(ntfs_volume *vol __attribute__((unused)))
+{
+}
+
+void ntfs_volume_lock_exclusive(ntfs_volume *vol __attribute__((unused)))
+{
+}
+
+void ntfs_volume_unlock(ntfs_volume *vol __attribute__((unused)))
+{
+}
+
+void ntfs_cache_lock(ntfs_volume *vol __attribute__((unused)))
+{
+}
+
+void ntfs_cache_unlock(ntfs_volume *vol __attribute__((unused)))
+{
+}
+
+void ntfs_security_lock(ntfs_volume *vol __attribute__((unused)))
+{
+}
+
+void ntfs_security_unlock(ntfs_volume *vol __attribute__((unused)))
+{
+}
+
+void ntfs_cluster_alloc_lock(ntfs_volume *vol __attribute__((unused)))
+{
+}
+
+void ntfs_cluster_alloc_unlock(ntfs_volume *vol __attribute__((unused)))
+{
+}
+
+void ntfs_mft_alloc_lock(ntfs_volume *vol __attribute__((unused)))
+{
+}
+
+void ntfs_mft_alloc_unlock(ntfs_volume *vol __attribute__((unused)))
+{
+}
+
+void ntfs_inode_lock(ntfs_inode *ni __attribute__((unused)))
+{
+}
+
+void ntfs_inode_unlock(ntfs_inode *ni __attribute__((unused)))
+{
+}
+
+#endif /* ENABLE_THREADS */
@@ -35,6 +35,7 @@
 #include <errno.h>
 #endif
 
+#include "param.h"
 #include "attrib.h"
 #include "debug.h"
 #include "logfile.h"
@@ -43,6 +44,34 @@
 #include "logging.h"
 #include "misc.h"
 
+/*
+ *		Beginning of $LogFile, read once
+ *
+ *	Looking for the restart pages implies reading small blocks at
+ *	increasing positions, and then the full restart pages. They are
+ *	generally all within the beginning of the log, so the beginning
+ *	is read in a single request, the reads being served from it.
+ */
+
+struct LOGFILE_HEAD {
+	ntfs_attr *log_na;
+	u8 *data;
+	s64 size;		/* bytes in data, may be zero */
+} ;
+
+static s64 read_logfile(struct LOGFILE_HEAD *head, s64 pos, s64 count,
+			void *b)
+{
+	s64 res;
+
+	if ((pos + count) <= head->size) {
+		memcpy(b, &head->data[pos], count);
+		res = count;
+	} else
+		res = ntfs_attr_pread(head->log_na, pos, count, b);
+	return (res);
+}
+
 /**
  * ntfs_check_restart_page_header - check the page header for consistency
  * @rp:		restart page header to check
@@ -332,9 +361,9 @@ err_out:
 
 /**
  * ntfs_check_and_load_restart_page - check the restart page for consistency
- * @log_na:	opened ntfs attribute for journal $LogFile
+ * @head:	beginning of the journal $LogFile, already read
  * @rp:		restart page to check
- * @pos:	position in @log_na at which the restart page resides
+ * @pos:	position in $LogFile at which the restart page resides
  * @wrp:       [OUT] copy of the multi sector transfer deprotected restart page
  * @lsn:       [OUT] set to the current logfile lsn on success
  *
@@ -357,7 +386,7 @@ err_out:
  *     ENOMEM - Not enough memory to load the restart page.
  *     EIO    - Failed to reading from $LogFile.
  */
-static int ntfs_check_and_load_restart_page(ntfs_attr *log_na,
+static int ntfs_check_and_load_restart_page(struct LOGFILE_HEAD *head,
 		RESTART_PAGE_HEADER *rp, s64 pos, RESTART_PAGE_HEADER **wrp,
 		LSN *lsn)
 {
@@ -391,7 +420,7 @@ static int ntfs_check_and_load_restart_page(ntfs_attr *log_na,
 	 */
 	if (le32_to_cpu(rp->system_page_size) <= NTFS_BLOCK_SIZE)
 		memcpy(trp, rp, le32_to_cpu(rp->system_page_size));
-	else if (ntfs_attr_pread(log_na, pos,
+	else if (read_logfile(head, pos,
 			le32_to_cpu(rp->system_page_size), trp) !=
 			le32_to_cpu(rp->system_page_size)) {
 		err = errno;
@@ -476,6 +505,7 @@ BOOL ntfs_check_logfile(ntfs_attr *log_na, RESTART_PAGE_HEADER **rp)
 	u8 *kaddr = NULL;
 	RESTART_PAGE_HEADER *rstr1_ph = NULL;
 	RESTART_PAGE_HEADER *rstr2_ph = NULL;
+	struct LOGFILE_HEAD head;
 	int log_page_size, err;
 	BOOL logfile_is_empty = TRUE;
 	u8 log_page_bits;
@@ -509,6 +539,18 @@ BOOL ntfs_check_logfile(ntfs_attr *log_na, RESTART_PAGE_HEADER **rp)
 	kaddr = ntfs_malloc(NTFS_BLOCK_SIZE);
 	if (!kaddr)
 		return FALSE;
+	/*
+	 * Read the beginning of the log at once, the restart pages are
+	 * then generally read from it. If this fails, the blocks are
+	 * read one by one, and the error is reported then.
+	 */
+	head.log_na = log_na;
+	head.size = (size < LOGFILE_HEAD_SIZE ? size : LOGFILE_HEAD_SIZE);
+	head.data = (u8*)ntfs_malloc(head.size);
+	if (!head.data
+	    || (ntfs_attr_pread(log_na, 0, head.size, head.data)
+			!= head.size))
+		head.size = 0;
 	/*
 	 * Read through the file looking for a restart page.  Since the restart
 	 * page header is at the beginning of a page we only need to search at
@@ -521,7 +563,7 @@ BOOL ntfs_check_logfile(ntfs_attr *log_na, RESTART_PAGE_HEADER **rp)
 		/*
 		 * Read first NTFS_BLOCK_SIZE bytes of potential restart page.
 		 */
-		if (ntfs_attr_pread(log_na, pos, NTFS_BLOCK_SIZE, kaddr) !=
+		if (read_logfile(&head, pos, NTFS_BLOCK_SIZE, kaddr) !=
 				NTFS_BLOCK_SIZE) {
 			ntfs_log_error("Failed to read first NTFS_BLOCK_SIZE "
 					"bytes of potential restart page.\n");
@@ -555,7 +597,7 @@ BOOL ntfs_check_logfile(ntfs_attr *log_na, RESTART_PAGE_HEADER **rp)
 		 * and get a copy of the complete multi sector transfer
 		 * deprotected restart page.
 		 */
-		err = ntfs_check_and_load_restart_page(log_na,
+		err = ntfs_check_and_load_restart_page(&head,
 				(RESTART_PAGE_HEADER*)kaddr, pos,
 				!rstr1_ph ? &rstr1_ph : &rstr2_ph,
 				!rstr1_ph ? &rstr1_lsn : &rstr2_lsn);
@@ -589,6 +631,7 @@ BOOL ntfs_check_logfile(ntfs_attr *log_na, RESTART_PAGE_HEADER **rp)
 		free(kaddr);
 		kaddr = NULL;
 	}
+	free(head.data);
 	if (logfile_is_empty) {
 		NVolSetLogFileEmpty(vol);
 is_empty:
@@ -630,6 +673,7 @@ is_empty:
 	return TRUE;
 err_out:
 	free(kaddr);
+	free(head.data);
 	free(rstr1_ph);
 	free(rstr2_ph);
 	return FALSE;
@@ -700,18 +744,25 @@ BOOL ntfs_is_logfile_clean(ntfs_attr *log_na, RESTART_PAGE_HEADER *rp)
  * Empty the contents of the $LogFile journal @na and return 0 on success and
  * -1 on error.
  *
+ * The runs of $LogFile are filled directly on the device by big writes,
+ * as going through ntfs_attr_pwrite() with a small buffer made the mount
+ * of a volume with a big $LogFile noticeably slow.
+ *
  * This function assumes that the $LogFile journal has already been consistency
  * checked by a call to ntfs_check_logfile() and that ntfs_is_logfile_clean()
  * has been used to ensure that the $LogFile is clean.
  */
 int ntfs_empty_logfile(ntfs_attr *na)
 {
-	s64 pos, count;
-	char buf[NTFS_BUF_SIZE];
+	ntfs_volume *vol;
+	runlist_element *rl;
+	s64 pos, end, count, written;
+	char *buf;
 
 	ntfs_log_trace("Entering.\n");
 	
-	if (NVolLogFileEmpty(na->ni->vol))
+	vol = na->ni->vol;
+	if (NVolLogFileEmpty(vol))
 		return 0;
 
 	if (!NAttrNonResident(na)) {
@@ -720,25 +771,48 @@ int ntfs_empty_logfile(ntfs_attr *na)
 		return -1;
 	}
 
-	memset(buf, -1, NTFS_BUF_SIZE);
-
-	pos = 0;
-	while ((count = na->data_size - pos) > 0) {
-		
-		if (count > NTFS_BUF_SIZE)
-			count = NTFS_BUF_SIZE;
+	if (ntfs_attr_map_whole_runlist(na)) {
+		ntfs_log_perror("Failed to map the runlist of $LogFile");
+		return -1;
+	}
+	buf = (char*)ntfs_malloc(LOGFILE_RESET_SIZE);
+	if (!buf)
+		return -1;
+	memset(buf, -1, LOGFILE_RESET_SIZE);
 
-		count = ntfs_attr_pwrite(na, pos, count, buf);
-		if (count <= 0) {
-			ntfs_log_perror("Failed to reset $LogFile");
-			if (count != -1)
-				errno = EIO;
-			return -1;
+	for (rl=na->rl; rl->length
+		&& ((rl->vcn << vol->cluster_size_bits) < na->data_size); rl++) {
+		if (rl->lcn < 0) {
+			errno = EIO;
+			ntfs_log_perror("Unallocated run in $LogFile");
+			goto err_out;
+		}
+			/* only the data size is reset, as done formerly */
+		end = (rl->vcn + rl->length) << vol->cluster_size_bits;
+		if (end > na->data_size)
+			end = na->data_size;
+		for (pos=rl->vcn << vol->cluster_size_bits; pos<end;
+							pos+=written) {
+			count = end - pos;
+			if (count > LOGFILE_RESET_SIZE)
+				count = LOGFILE_RESET_SIZE;
+			written = ntfs_pwrite(vol->dev, pos
+				+ ((rl->lcn - rl->vcn) << vol->cluster_size_bits),
+				count, buf);
+			if (written <= 0) {
+				if (!written)
+					errno = EIO;
+				ntfs_log_perror("Failed to reset $LogFile");
+				goto err_out;
+			}
 		}
-		pos += count;
 	}
+	free(buf);
 
-	NVolSetLogFileEmpty(na->ni->vol);
+	NVolSetLogFileEmpty(vol);
 	
 	return 0;
+err_out:
+	free(buf);
+	return -1;
 }
@@ -62,14 +62,26 @@ static int tab;
 # define  BROKEN_GCC_FORMAT_ATTRIBUTE __attribute__((format(printf, 6, 0)))
 #endif
 
+/**
+ * ntfs_log_levels
+ * Bitfield of logging levels, kept apart so that the debug and trace
+ * macros can check it inline, before calling ntfs_log_redirect().
+ */
+u32 ntfs_log_levels =
+#ifdef DEBUG
+	NTFS_LOG_LEVEL_DEBUG | NTFS_LOG_LEVEL_TRACE | NTFS_LOG_LEVEL_ENTER |
+	NTFS_LOG_LEVEL_LEAVE |
+#endif
+	NTFS_LOG_LEVEL_INFO | NTFS_LOG_LEVEL_QUIET | NTFS_LOG_LEVEL_WARNING |
+	NTFS_LOG_LEVEL_ERROR | NTFS_LOG_LEVEL_PERROR | NTFS_LOG_LEVEL_CRITICAL |
+	NTFS_LOG_LEVEL_PROGRESS;
+
 /**
  * struct ntfs_logging - Control info for the logging system
- * @levels:	Bitfield of logging levels
  * @flags:	Flags which affect the output style
  * @handler:	Function to perform the actual logging
  */
 struct ntfs_logging {
-	u32 levels;
 	u32 flags;
 	ntfs_log_handler *handler BROKEN_GCC_FORMAT_ATTRIBUTE;
 };
@@ -79,13 +91,6 @@ struct ntfs_logging {
  * This struct controls all the logging within the library and tools.
  */
 static struct ntfs_logging ntfs_log = {
-#ifdef DEBUG
-	NTFS_LOG_LEVEL_DEBUG | NTFS_LOG_LEVEL_TRACE | NTFS_LOG_LEVEL_ENTER |
-	NTFS_LOG_LEVEL_LEAVE |
-#endif
-	NTFS_LOG_LEVEL_INFO | NTFS_LOG_LEVEL_QUIET | NTFS_LOG_LEVEL_WARNING |
-	NTFS_LOG_LEVEL_ERROR | NTFS_LOG_LEVEL_PERROR | NTFS_LOG_LEVEL_CRITICAL |
-	NTFS_LOG_LEVEL_PROGRESS,
 	NTFS_LOG_FLAG_ONLYNAME,
 #ifdef DEBUG
 	ntfs_log_handler_outerr
@@ -104,7 +109,7 @@ static struct ntfs_logging ntfs_log = {
  */
 u32 ntfs_log_get_levels(void)
 {
-	return ntfs_log.levels;
+	return ntfs_log_levels;
 }
 
 /**
@@ -119,8 +124,8 @@ u32 ntfs_log_get_levels(void)
 u32 ntfs_log_set_levels(u32 levels)
 {
 	u32 old;
-	old = ntfs_log.levels;
-	ntfs_log.levels |= levels;
+	old = ntfs_log_levels;
+	ntfs_log_levels |= levels;
 	return old;
 }
 
@@ -136,8 +141,8 @@ u32 ntfs_log_set_levels(u32 levels)
 u32 ntfs_log_clear_levels(u32 levels)
 {
 	u32 old;
-	old = ntfs_log.levels;
-	ntfs_log.levels &= (~levels);
+	old = ntfs_log_levels;
+	ntfs_log_levels &= (~levels);
 	return old;
 }
 
@@ -321,7 +326,7 @@ int ntfs_log_redirect(const char *function, const char *file,
 	int ret;
 	va_list args;
 
-	if (!(ntfs_log.levels & level))		/* Don't log this message */
+	if (!(ntfs_log_levels & level))		/* Don't log this message */
 		return 0;
 
 	va_start(args, format);
@@ -203,7 +203,8 @@ static void lzx_postprocess(u8 *data, u32 size)
 	 * that no translation can begin following an E8 byte in the last 10
 	 * bytes because a 4-byte offset containing E8 as its high byte is a
 	 * large negative number that is not valid for translation.  That is
-	 * exactly what we need.
+	 * exactly what we need.  The E8 bytes are searched with memchr(), which
+	 * the C library implements with vector instructions.
 	 */
 	u8 *tail;
 	u8 saved_bytes[6];
@@ -217,8 +218,7 @@ static void lzx_postprocess(u8 *data, u32 size)
 	memset(tail, 0xE8, 6);
 	p = data;
 	for (;;) {
-		while (*p != 0xE8)
-			p++;
+		p = memchr(p, 0xE8, tail + 6 - p);
 		if (p >= tail)
 			break;
 		undo_e8_translation(p + 1, p - data);
@@ -486,13 +486,17 @@ static int lzx_read_block_header(struct lzx_decompressor *d,
 
 /* Decompress a block of LZX-compressed data.  */
 static int lzx_decompress_block(const struct lzx_decompressor *d,
-				struct input_bitstream *is,
+				struct input_bitstream *isp,
 				int block_type, u32 block_size,
 				u8 * const out_begin, u8 *out_next,
 				u32 recent_offsets[])
 {
 	u8 * const block_end = out_next + block_size;
 	unsigned ones_if_aligned = 0U - (block_type == LZX_BLOCKTYPE_ALIGNED);
+	/* Decode from a local copy of the bitstream, which the stores to the
+	 * output buffer cannot alias, so it can be kept in registers.  */
+	struct input_bitstream bitstream = *isp;
+	struct input_bitstream *is = &bitstream;
 
 	do {
 		unsigned mainsym;
@@ -576,6 +580,7 @@ static int lzx_decompress_block(const struct lzx_decompressor *d,
 
 	} while (out_next != block_end);
 
+	*isp = bitstream;
 	return 0;
 }
 
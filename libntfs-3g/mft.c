@@ -42,6 +42,12 @@
 #ifdef HAVE_LIMITS_H
 #include <limits.h>
 #endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
 #include <time.h>
 
 #include "compat.h"
@@ -55,9 +61,149 @@
 #include "layout.h"
 #include "lcnalloc.h"
 #include "mft.h"
+#include "mftcache.h"
+#include "mst.h"
 #include "logging.h"
+#include "lock.h"
 #include "misc.h"
 
+/*
+ *		Sequential scan of the MFT records
+ *
+ *	The records are read in batches, which stop at the end of the
+ *	runs of $MFT/$DATA so that each batch is a single read from the
+ *	device. While a scan is active on the volume, the single record
+ *	reads (such as done by ntfs_inode_open()) of the records in the
+ *	current batch are served from it, and the records written are
+ *	updated in it.
+ */
+
+struct MFT_SCAN {
+	ntfs_volume *vol;
+	s64 next;		/* next record to return */
+	s64 end;		/* record after the last one to return */
+	s64 first;		/* first record in the batch */
+	s64 count;		/* count of records in the batch */
+	s64 capacity;		/* max count of records in a batch */
+	BOOL *valid;		/* whether each record could be read */
+	char *batch;
+} ;
+
+/*
+ *		Get a record from the batch of the current scan
+ *
+ *	Returns TRUE if the record was found and copied
+ */
+
+static BOOL scan_get(const struct MFT_SCAN *scan, s64 mft_no, MFT_RECORD *b)
+{
+	s64 i;
+	BOOL found;
+
+	i = mft_no - scan->first;
+	found = (i >= 0) && (i < scan->count) && scan->valid[i];
+	if (found)
+		memcpy(b, &scan->batch[i << scan->vol->mft_record_size_bits],
+				scan->vol->mft_record_size);
+	return (found);
+}
+
+/*
+ *		Update the batch of the current scan after records are written
+ */
+
+static void scan_update(const struct MFT_SCAN *scan, s64 mft_no,
+			s64 count, const MFT_RECORD *b)
+{
+	s64 i, j;
+	u32 bits;
+
+	bits = scan->vol->mft_record_size_bits;
+	for (j=0; j<count; j++) {
+		i = mft_no + j - scan->first;
+		if ((i >= 0) && (i < scan->count)) {
+			memcpy(&scan->batch[i << bits],
+				(const char*)b + (j << bits),
+				scan->vol->mft_record_size);
+			scan->valid[i] = TRUE;
+		}
+	}
+}
+
+static int mft_bitmap_in_use(const ntfs_volume *vol, s64 mft_no);
+
+/*
+ *		Read a missing record together with its neighbours
+ *
+ *	The aligned window of records around @mft_no is read in a single
+ *	request, and the neighbours which the mft bitmap marks in use
+ *	are fixed up and entered into the cache. When the bitmap is not
+ *	available, the in-use flag of the records is checked instead.
+ *
+ *	Returns 0 if the record has been read into @b,
+ *		-1 if it has to be read alone
+ */
+
+static int mft_prefetch(const ntfs_volume *vol, s64 mft_no, MFT_RECORD *b)
+{
+	BOOL valid[MFTCACHE_PREFETCH_BYTES/NTFS_BLOCK_SIZE];
+	MFT_RECORD *rec;
+	char *buf;
+	s64 first;
+	s64 count;
+	s64 allocated;
+	s64 i;
+	u32 bits;
+	int window;
+	int in_use;
+	int res;
+
+	res = -1;
+	bits = vol->mft_record_size_bits;
+	window = ntfs_mftcache_window(vol);
+	if ((window > 1)
+	    && (((s64)window << bits) <= MFTCACHE_PREFETCH_BYTES)) {
+		first = mft_no & -(s64)window;
+		allocated = vol->mft_na->initialized_size >> bits;
+		count = window;
+		if ((first + count) > allocated)
+			count = allocated - first;
+		buf = (char*)ntfs_malloc(count << bits);
+		if (buf
+		    && (ntfs_attr_pread(vol->mft_na, first << bits,
+				count << bits, buf) == (count << bits))) {
+			for (i=0; i<count; i++) {
+				rec = (MFT_RECORD*)&buf[i << bits];
+				if ((first + i) == mft_no) {
+					ntfs_mst_post_read_fixup_warn(
+						(NTFS_RECORD*)rec,
+						vol->mft_record_size,
+						!NVolNoFixupWarn(vol));
+					memcpy(b, rec, vol->mft_record_size);
+					valid[i] = FALSE;
+				} else {
+					in_use = mft_bitmap_in_use(vol,
+							first + i);
+					if (in_use < 0)
+						in_use = rec->flags
+							& MFT_RECORD_IN_USE;
+					valid[i] = in_use
+					    && (rec->magic == magic_FILE)
+					    && !ntfs_mst_post_read_fixup_warn(
+						(NTFS_RECORD*)rec,
+						vol->mft_record_size, FALSE);
+				}
+			}
+			ntfs_mftcache_put(vol, mft_no, 1, b, FALSE);
+			ntfs_mftcache_prefetch(vol, first, count,
+					(MFT_RECORD*)buf, valid);
+			res = 0;
+		}
+		free(buf);
+	}
+	return (res);
+}
+
 /**
  * ntfs_mft_records_read - read records from the mft from disk
  * @vol:	volume to read from
@@ -104,6 +250,12 @@ int ntfs_mft_records_read(const ntfs_volume *vol, const MFT_REF mref,
 				vol->mft_record_size_bits);
 		return -1;
 	}
+	if ((count == 1)
+	    && ((vol->mft_scan && scan_get(vol->mft_scan, m, b))
+		|| (vol->mft_cache && ntfs_mftcache_get(vol, m, b))))
+		return 0;
+	if ((count == 1) && vol->mft_cache && !mft_prefetch(vol, m, b))
+		return 0;
 	br = ntfs_attr_mst_pread(vol->mft_na, m << vol->mft_record_size_bits,
 			count, vol->mft_record_size, b);
 	if (br != count) {
@@ -114,6 +266,13 @@ int ntfs_mft_records_read(const ntfs_volume *vol, const MFT_REF mref,
 				(long long)br);
 		return -1;
 	}
+	if (vol->mft_cache) {
+			/* only keep single records, not scans */
+		if (count == 1)
+			ntfs_mftcache_put(vol, m, 1, b, FALSE);
+		else
+			ntfs_mftcache_overlay(vol, m, count, b);
+	}
 	return 0;
 }
 
@@ -164,6 +323,15 @@ int ntfs_mft_records_write(const ntfs_volume *vol, const MFT_REF mref,
 				vol->mft_record_size_bits);
 		return -1;
 	}
+	if (vol->mft_cache) {
+		res = ntfs_mftcache_defer(vol, m, count, b);
+		if (res <= 0) {
+			if (!res && vol->mft_scan)
+				scan_update(vol->mft_scan, m, count, b);
+			return res;
+		}
+		res = 0;
+	}
 	if (m < vol->mftmirr_size) {
 		if (!vol->mftmirr_na) {
 			errno = EINVAL;
@@ -189,6 +357,10 @@ int ntfs_mft_records_write(const ntfs_volume *vol, const MFT_REF mref,
 			ntfs_log_perror("Error writing $Mft record(s)");
 		res = errno;
 	}
+	if (vol->mft_cache && (bw > 0))
+		ntfs_mftcache_put(vol, m, bw, b, TRUE);
+	if (vol->mft_scan && (bw > 0))
+		scan_update(vol->mft_scan, m, bw, b);
 	if (bmirr && bw > 0) {
 		if (bw < cnt)
 			cnt = bw;
@@ -460,6 +632,260 @@ static int ntfs_is_mft(ntfs_inode *ni)
 
 #define RESERVED_MFT_RECORDS   64
 
+/*
+ *		In-memory copy of $MFT/$BITMAP
+ *
+ *	The initialized part of the mft bitmap is kept in memory as 64-bit
+ *	words, along with a summary holding one bit per word which is set
+ *	when the word has no free record, so that a free record is found
+ *	without reading the bitmap again and skipping the full parts 4096
+ *	records at a time. The copy is loaded on the first search and
+ *	extended when the bitmap is extended, and the allocations and
+ *	deallocations of records are made on disk first and then reflected
+ *	in the copy. It is only used under the mft allocation lock.
+ */
+
+struct MFT_BITMAP {
+	ntfs_attr *na;		/* attribute the copy was loaded from */
+	u64 *words;		/* the bitmap, in cpu order */
+	u64 *full;		/* summary, one bit per full word */
+	s64 size;		/* count of bytes copied */
+	s64 capacity;		/* count of words allocated */
+} ;
+
+/*
+ *		Find the first zero bit in a bitmap word
+ */
+
+static int mft_bitmap_ffz(u64 word)
+{
+	if ((u32)word != 0xffffffff)
+		return (ntfs_ffz((u32)word));
+	return (32 + ntfs_ffz((u32)(word >> 32)));
+}
+
+static void mft_bitmap_summarize(struct MFT_BITMAP *mb, s64 w)
+{
+	if (mb->words[w] == ~(u64)0)
+		mb->full[w >> 6] |= (u64)1 << (w & 63);
+	else
+		mb->full[w >> 6] &= ~((u64)1 << (w & 63));
+}
+
+/**
+ * ntfs_mft_bitmap_release - free the in-memory copy of the mft bitmap
+ * @vol:	volume whose copy is to be freed
+ */
+void ntfs_mft_bitmap_release(ntfs_volume *vol)
+{
+	struct MFT_BITMAP *mb;
+
+	mb = vol->mft_bitmap;
+	if (mb) {
+		free(mb->words);
+		free(mb->full);
+		free(mb);
+		vol->mft_bitmap = (struct MFT_BITMAP*)NULL;
+	}
+}
+
+/*
+ *		Copy the bytes of the mft bitmap up to a new size
+ *
+ *	Returns 0 if successful, -1 if failed
+ */
+
+static int mft_bitmap_extend(struct MFT_BITMAP *mb, s64 size)
+{
+	u64 *words;
+	u64 *full;
+	u8 *buf;
+	s64 capacity;
+	s64 pos;
+	s64 w;
+	s64 i;
+
+	capacity = (size + 7) >> 3;
+	if (capacity > mb->capacity) {
+		if (capacity < 2*mb->capacity)
+			capacity = 2*mb->capacity;
+		words = (u64*)realloc(mb->words, capacity*sizeof(u64));
+		if (!words)
+			return (-1);
+		mb->words = words;
+		full = (u64*)realloc(mb->full,
+				((capacity + 63) >> 6)*sizeof(u64));
+		if (!full)
+			return (-1);
+		mb->full = full;
+		memset(&mb->words[mb->capacity], 0,
+				(capacity - mb->capacity)*sizeof(u64));
+		memset(&mb->full[(mb->capacity + 63) >> 6], 0,
+				(((capacity + 63) >> 6)
+				- ((mb->capacity + 63) >> 6))*sizeof(u64));
+		mb->capacity = capacity;
+	}
+	buf = (u8*)ntfs_malloc(size - mb->size);
+	if (!buf)
+		return (-1);
+	if (ntfs_attr_pread(mb->na, mb->size, size - mb->size, buf)
+			!= (size - mb->size)) {
+		ntfs_log_perror("Failed to read $MFT bitmap");
+		free(buf);
+		return (-1);
+	}
+	for (i=0, pos=mb->size; pos<size; i++, pos++)
+		mb->words[pos >> 3] |= (u64)buf[i] << ((pos & 7) << 3);
+	for (w=mb->size >> 3; w<((size + 7) >> 3); w++)
+		mft_bitmap_summarize(mb, w);
+	mb->size = size;
+	free(buf);
+	return (0);
+}
+
+/*
+ *		Get the in-memory copy of the mft bitmap up to date
+ *
+ *	The copy is reloaded if the bitmap attribute was reopened or
+ *	shrunk by an aborted extension.
+ *
+ *	Returns the copy or NULL if it could not be built
+ */
+
+static struct MFT_BITMAP *mft_bitmap_get(ntfs_volume *vol)
+{
+	struct MFT_BITMAP *mb;
+	ntfs_attr *na;
+
+	na = vol->mftbmp_na;
+	mb = vol->mft_bitmap;
+	if (mb && ((mb->na != na) || (mb->size > na->initialized_size))) {
+		ntfs_mft_bitmap_release(vol);
+		mb = (struct MFT_BITMAP*)NULL;
+	}
+	if (!mb) {
+		mb = (struct MFT_BITMAP*)ntfs_calloc(sizeof(struct MFT_BITMAP));
+		if (!mb)
+			return ((struct MFT_BITMAP*)NULL);
+		mb->na = na;
+		vol->mft_bitmap = mb;
+	}
+	if ((mb->size < na->initialized_size)
+	    && mft_bitmap_extend(mb, na->initialized_size)) {
+		ntfs_mft_bitmap_release(vol);
+		mb = (struct MFT_BITMAP*)NULL;
+	}
+	return (mb);
+}
+
+/*
+ *		Reflect the allocation or deallocation of a record
+ */
+
+static void mft_bitmap_update(ntfs_volume *vol, s64 bit, BOOL used)
+{
+	struct MFT_BITMAP *mb;
+
+	mb = vol->mft_bitmap;
+	if (mb && (mb->na == vol->mftbmp_na) && (bit < (mb->size << 3))) {
+		if (used)
+			mb->words[bit >> 6] |= (u64)1 << (bit & 63);
+		else
+			mb->words[bit >> 6] &= ~((u64)1 << (bit & 63));
+		mft_bitmap_summarize(mb, bit >> 6);
+	}
+}
+
+/*
+ *		Search the in-memory copy for a free record
+ *
+ *	Returns the first free record from @pos up to @end excluded,
+ *		or -1 if there is none
+ */
+
+static s64 mft_bitmap_search(const struct MFT_BITMAP *mb, s64 pos, s64 end)
+{
+	s64 limit;
+	s64 bit;
+	s64 w;
+	s64 sw;
+	u64 word;
+	u64 summary;
+
+	limit = mb->size << 3;
+	if (end > limit)
+		end = limit;
+	while (pos < end) {
+		w = pos >> 6;
+		word = mb->words[w] | (((u64)1 << (pos & 63)) - 1);
+		if (word != ~(u64)0) {
+			bit = (w << 6) + mft_bitmap_ffz(word);
+			return (bit < end ? bit : -1);
+		}
+			/* skip the next full words through the summary */
+		w++;
+		sw = w >> 6;
+		if ((sw << 12) >= end)
+			break;
+		summary = mb->full[sw] | (((u64)1 << (w & 63)) - 1);
+		while (summary == ~(u64)0) {
+			sw++;
+			if ((sw << 12) >= end)
+				return (-1);
+			summary = mb->full[sw];
+		}
+		pos = ((sw << 6) + mft_bitmap_ffz(summary)) << 6;
+	}
+	return (-1);
+}
+
+/**
+ * ntfs_mft_bitmap_load - load the in-memory copy of the mft bitmap
+ * @vol:	volume whose mft bitmap is to be copied
+ *
+ * The copy is normally loaded on the first allocation. Loading it
+ * beforehand lets the readers of records check which ones are in use,
+ * this has to be done while no record can be allocated.
+ *
+ * Return 0 on success or -1 on error, with errno set to the error code.
+ */
+int ntfs_mft_bitmap_load(ntfs_volume *vol)
+{
+	int res;
+
+	if (!vol->mftbmp_na) {
+		errno = EINVAL;
+		return (-1);
+	}
+	ntfs_mft_alloc_lock(vol);
+	res = (mft_bitmap_get(vol) ? 0 : -1);
+	ntfs_mft_alloc_unlock(vol);
+	return (res);
+}
+
+/*
+ *		Check whether a record is marked in use in the copy
+ *	of the mft bitmap
+ *
+ *	The copy is only updated by requests which hold the volume lock
+ *	exclusively, so that it can be read by the other ones.
+ *
+ *	Returns 1 if the record is in use, 0 if it is free,
+ *		-1 if the copy is not available
+ */
+
+static int mft_bitmap_in_use(const ntfs_volume *vol, s64 mft_no)
+{
+	const struct MFT_BITMAP *mb;
+	int res;
+
+	res = -1;
+	mb = vol->mft_bitmap;
+	if (mb && (mb->na == vol->mftbmp_na) && (mft_no < (mb->size << 3)))
+		res = (mb->words[mft_no >> 6] >> (mft_no & 63)) & 1;
+	return (res);
+}
+
 /**
  * ntfs_mft_bitmap_find_free_rec - find a free mft record in the mft bitmap
  * @vol:	volume on which to search for a free mft record
@@ -479,7 +905,8 @@ static int ntfs_is_mft(ntfs_inode *ni)
  */
 static int ntfs_mft_bitmap_find_free_rec(ntfs_volume *vol, ntfs_inode *base_ni)
 {
-	s64 pass_end, ll, data_pos, pass_start, ofs, bit;
+	s64 pass_end, ll, data_pos, pass_start, ofs, bit, end, found;
+	struct MFT_BITMAP *mb;
 	ntfs_attr *mftbmp_na;
 	u8 *buf, *byte;
 	unsigned int size;
@@ -519,6 +946,22 @@ static int ntfs_mft_bitmap_find_free_rec(ntfs_volume *vol, ntfs_inode *base_ni)
 		pass = 2;
 	}
 	pass_start = data_pos;
+	mb = mft_bitmap_get(vol);
+	if (mb) {
+		/* Same limit as in the scan below when extending $MFT. */
+		end = pass_end;
+		if (ntfs_is_mft(base_ni) && (end > 408))
+			end = 408;
+		found = mft_bitmap_search(mb, data_pos, end);
+		if ((found < 0) && (pass == 1))
+			found = mft_bitmap_search(mb, RESERVED_MFT_RECORDS,
+						pass_start);
+		if (found >= 0)
+			ret = found;
+		else
+			errno = ENOSPC;
+		goto leave;
+	}
 	buf = ntfs_malloc(PAGE_SIZE);
 	if (!buf)
 		goto leave;
@@ -694,6 +1137,7 @@ static int ntfs_mft_bitmap_extend_allocation_i(ntfs_volume *vol)
 		return STATUS_ERROR;
 	}
 	mftbmp_na->rl = rl;
+	ntfs_attr_forget_runs(mftbmp_na);
 	ntfs_log_debug("Adding one run to mft bitmap.\n");
 	/* Find the last run in the new runlist. */
 	for (; rl[1].length; rl++)
@@ -778,6 +1222,8 @@ static int ntfs_mft_bitmap_extend_allocation_i(ntfs_volume *vol)
 ok:
 	mftbmp_na->allocated_size += vol->cluster_size;
 	a->allocated_size = cpu_to_sle64(mftbmp_na->allocated_size);
+		/* the bits beyond the data size are counted as free */
+	vol->free_mft_records += vol->cluster_size << 3;
 	/* Ensure the changes make it to disk. */
 	ntfs_inode_mark_dirty(ctx->ntfs_ino);
 	ntfs_attr_put_search_ctx(ctx);
@@ -910,7 +1356,6 @@ static int ntfs_mft_bitmap_extend_initialized(ntfs_volume *vol)
 	ll = ntfs_attr_pwrite(mftbmp_na, old_initialized_size, 8, &ll);
 	if (ll == 8) {
 		ntfs_log_debug("Wrote eight initialized bytes to mft bitmap.\n");
-		vol->free_mft_records += (8 * 8); 
 		ret = 0;
 		goto out;
 	}
@@ -956,9 +1401,12 @@ out:
  * ntfs_mft_data_extend_allocation - extend mft data attribute
  * @vol:	volume on which to extend the mft data attribute
  *
- * Extend the mft data attribute on the ntfs volume @vol by 16 mft records
- * worth of clusters or if not enough space for this by one mft record worth
- * of clusters.
+ * Extend the mft data attribute on the ntfs volume @vol by one eighth of its
+ * current size, with at least MFT_GROWTH_MIN and at most @vol->mft_growth mft
+ * records worth of clusters, so that the extensions get rarer and the $MFT
+ * less fragmented as it grows. If there is not enough space for this, the
+ * amount is halved down to one mft record worth of clusters. The records
+ * added are only formatted when they are allocated.
  *
  * Note:  Only changes allocated_size, i.e. does not touch initialized_size or
  * data_size.
@@ -1006,9 +1454,14 @@ static int ntfs_mft_data_extend_allocation(ntfs_volume *vol)
 	min_nr = vol->mft_record_size >> vol->cluster_size_bits;
 	if (!min_nr)
 		min_nr = 1;
-	/* Want to allocate 16 mft records worth of clusters. */
-	nr = vol->mft_record_size << 4 >> vol->cluster_size_bits;
-	if (!nr)
+	/* Want to allocate one eighth of the mft records worth of clusters. */
+	nr = mft_na->allocated_size >> vol->mft_record_size_bits >> 3;
+	if (nr > vol->mft_growth)
+		nr = vol->mft_growth;
+	if (nr < MFT_GROWTH_MIN)
+		nr = MFT_GROWTH_MIN;
+	nr = nr << vol->mft_record_size_bits >> vol->cluster_size_bits;
+	if (nr < min_nr)
 		nr = min_nr;
 	
 	old_last_vcn = rl[1].vcn;
@@ -1023,11 +1476,13 @@ static int ntfs_mft_data_extend_allocation(ntfs_volume *vol)
 		}
 		/*
 		 * There is not enough space to do the allocation, but there
-		 * might be enough space to do a minimal allocation so try that
+		 * might be enough space to do a smaller allocation so try that
 		 * before failing.
 		 */
-		nr = min_nr;
-		ntfs_log_debug("Retrying mft data allocation with minimal cluster "
+		nr >>= 1;
+		if (nr < min_nr)
+			nr = min_nr;
+		ntfs_log_debug("Retrying mft data allocation with smaller cluster "
 				"count %lli.\n", (long long)nr);
 	} while (1);
 	
@@ -1046,6 +1501,7 @@ static int ntfs_mft_data_extend_allocation(ntfs_volume *vol)
 		goto out;
 	}
 	mft_na->rl = rl;
+	ntfs_attr_forget_runs(mft_na);
 	
 	/* Find the last run in the new runlist. */
 	for (; rl[1].length; rl++)
@@ -1164,6 +1620,7 @@ undo_alloc:
 	if (ntfs_cluster_free(vol, mft_na, old_last_vcn, -1) < 0)
 		ntfs_log_error("Failed to free clusters from mft data "
 				"attribute.%s\n", es);
+	ntfs_attr_forget_runs(mft_na);
 	if (ntfs_rl_truncate(&mft_na->rl, old_last_vcn))
 		ntfs_log_error("Failed to truncate mft data attribute "
 				"runlist.%s\n", es);
@@ -1190,6 +1647,74 @@ undo_alloc:
 }
 
 
+/*
+ *		Format the mft records up to the allocated one, and a few more
+ *
+ *	The records following the allocated one are formatted along, so
+ *	that the next allocations find them initialized and do not have
+ *	to format them and to sync $MFT again. The records formatted
+ *	ahead are kept within the allocated size of $MFT and within the
+ *	records described by the initialized part of the mft bitmap.
+ *
+ *	Only the ntfs_attr sizes are updated, the caller has to update
+ *	the attribute record and to restore the sizes on failure.
+ */
+
+static int ntfs_mft_records_format_ahead(ntfs_volume *vol, s64 size)
+{
+	ntfs_attr *mft_na;
+	MFT_RECORD *b;
+	s64 first, last, limit;
+	s64 count, i;
+	int ret;
+
+	mft_na = vol->mft_na;
+	first = mft_na->initialized_size >> vol->mft_record_size_bits;
+	last = (size >> vol->mft_record_size_bits) + MFT_FORMAT_AHEAD - 1;
+	limit = mft_na->allocated_size >> vol->mft_record_size_bits;
+	if (last > limit)
+		last = limit;
+	limit = vol->mftbmp_na->initialized_size << 3;
+	if (last > limit)
+		last = limit;
+	if ((last << vol->mft_record_size_bits) < size)
+		last = size >> vol->mft_record_size_bits;
+	count = last - first;
+	if (count <= 0)
+		return (0);
+	b = (MFT_RECORD*)ntfs_calloc(count << vol->mft_record_size_bits);
+	if (!b) {
+		/* fall back to formatting the records one at a time */
+		ret = 0;
+		while (!ret && (first < last)) {
+			mft_na->initialized_size += vol->mft_record_size;
+			if (mft_na->initialized_size > mft_na->data_size)
+				mft_na->data_size = mft_na->initialized_size;
+			ret = ntfs_mft_record_format(vol, first++);
+		}
+	} else {
+		ret = 0;
+		for (i=0; !ret && (i<count); i++)
+			ret = ntfs_mft_record_layout(vol, first + i,
+				(MFT_RECORD*)((u8*)b
+					+ (i << vol->mft_record_size_bits)));
+		if (!ret) {
+			mft_na->initialized_size = last
+					<< vol->mft_record_size_bits;
+			if (mft_na->initialized_size > mft_na->data_size)
+				mft_na->data_size = mft_na->initialized_size;
+			ntfs_log_debug("Initializing mft records 0x%llx to "
+					"0x%llx.\n", (long long)first,
+					(long long)last - 1);
+			ret = ntfs_mft_records_write(vol, first, count, b);
+		}
+		free(b);
+	}
+	if (ret)
+		ntfs_log_perror("Failed to format mft record");
+	return (ret);
+}
+
 static int ntfs_mft_record_init(ntfs_volume *vol, s64 size)
 {
 	int ret = -1;
@@ -1236,17 +1761,8 @@ static int ntfs_mft_record_init(ntfs_volume *vol, s64 size)
 	 * needed by ntfs_mft_record_format().  We will update the attribute
 	 * record itself in one fell swoop later on.
 	 */
-	while (size > mft_na->initialized_size) {
-		s64 ll2 = mft_na->initialized_size >> vol->mft_record_size_bits;
-		mft_na->initialized_size += vol->mft_record_size;
-		if (mft_na->initialized_size > mft_na->data_size)
-			mft_na->data_size = mft_na->initialized_size;
-		ntfs_log_debug("Initializing mft record 0x%llx.\n", (long long)ll2);
-		if (ntfs_mft_record_format(vol, ll2) < 0) {
-			ntfs_log_perror("Failed to format mft record");
-			goto undo_data_init;
-		}
-	}
+	if (ntfs_mft_records_format_ahead(vol, size))
+		goto undo_data_init;
 	
 	/* Update the mft data attribute record to reflect the new sizes. */
 	ctx = ntfs_attr_get_search_ctx(mft_na->ni, NULL);
@@ -1421,6 +1937,7 @@ found_free_rec:
 		ntfs_log_error("Failed to allocate bit in mft bitmap #2\n");
 		goto err_out;
 	}
+	mft_bitmap_update(vol, bit, TRUE);
 	
 	ll = (bit + 1) << vol->mft_record_size_bits;
 	if (ll > mft_na->initialized_size)
@@ -1486,25 +2003,11 @@ found_free_rec:
 	 * Attach the extent inode to the base inode, reallocating
 	 * memory if needed.
 	 */
-	if (!(base_ni->nr_extents & 3)) {
-		ntfs_inode **extent_nis;
-		int i;
-
-		i = (base_ni->nr_extents + 4) * sizeof(ntfs_inode *);
-		extent_nis = ntfs_malloc(i);
-		if (!extent_nis) {
-			free(m);
-			free(ni);
-			goto undo_mftbmp_alloc;
-		}
-		if (base_ni->nr_extents) {
-			memcpy(extent_nis, base_ni->extent_nis,
-					i - 4 * sizeof(ntfs_inode *));
-			free(base_ni->extent_nis);
-		}
-		base_ni->extent_nis = extent_nis;
+	if (ntfs_inode_attach_extent(base_ni, ni)) {
+		free(m);
+		free(ni);
+		goto undo_mftbmp_alloc;
 	}
-	base_ni->extent_nis[base_ni->nr_extents++] = ni;
 	
 	/* Make sure the allocated inode is written out to disk later. */
 	ntfs_inode_mark_dirty(ni);
@@ -1520,6 +2023,7 @@ found_free_rec:
 	/* Return the opened, allocated inode of the allocated mft record. */
 	ntfs_log_error("allocated %sinode %lld\n",
 			base_ni ? "extent " : "", (long long)bit);
+	vol->free_mft_records--;
 out:
 	ntfs_log_leave("\n");	
 	return ni;
@@ -1528,6 +2032,8 @@ undo_mftbmp_alloc:
 	err = errno;
 	if (ntfs_bitmap_clear_bit(mftbmp_na, bit))
 		ntfs_log_error("Failed to clear bit in mft bitmap.%s\n", es);
+	else
+		mft_bitmap_update(vol, bit, FALSE);
 	errno = err;
 err_out:
 	if (!errno)
@@ -1638,9 +2144,10 @@ ntfs_inode *ntfs_mft_record_alloc(ntfs_volume *vol, ntfs_inode *base_ni)
 		ntfs_log_enter("Entering (allocating a base mft record)\n");
 	if (!vol || !vol->mft_na || !vol->mftbmp_na) {
 		errno = EINVAL;
-		goto out;
+		goto leave;
 	}
 	
+	ntfs_mft_alloc_lock(vol);
 	if (ntfs_is_mft(base_ni)) {
 		ni = ntfs_mft_rec_alloc(vol, FALSE);
 		goto out;
@@ -1725,6 +2232,7 @@ found_free_rec:
 		ntfs_log_error("Failed to allocate bit in mft bitmap.\n");
 		goto err_out;
 	}
+	mft_bitmap_update(vol, bit, TRUE);
 	
 	/* The mft bitmap is now uptodate.  Deal with mft data attribute now. */
 	ll = (bit + 1) << vol->mft_record_size_bits;
@@ -1799,25 +2307,11 @@ found_free_rec:
 		 * Attach the extent inode to the base inode, reallocating
 		 * memory if needed.
 		 */
-		if (!(base_ni->nr_extents & 3)) {
-			ntfs_inode **extent_nis;
-			int i;
-
-			i = (base_ni->nr_extents + 4) * sizeof(ntfs_inode *);
-			extent_nis = ntfs_malloc(i);
-			if (!extent_nis) {
-				free(m);
-				free(ni);
-				goto undo_mftbmp_alloc;
-			}
-			if (base_ni->nr_extents) {
-				memcpy(extent_nis, base_ni->extent_nis,
-						i - 4 * sizeof(ntfs_inode *));
-				free(base_ni->extent_nis);
-			}
-			base_ni->extent_nis = extent_nis;
+		if (ntfs_inode_attach_extent(base_ni, ni)) {
+			free(m);
+			free(ni);
+			goto undo_mftbmp_alloc;
 		}
-		base_ni->extent_nis[base_ni->nr_extents++] = ni;
 	}
 	/* Make sure the allocated inode is written out to disk later. */
 	ntfs_inode_mark_dirty(ni);
@@ -1835,6 +2329,8 @@ found_free_rec:
 			base_ni ? "extent " : "", (long long)bit);
 	vol->free_mft_records--; 
 out:
+	ntfs_mft_alloc_unlock(vol);
+leave:
 	ntfs_log_leave("\n");	
 	return ni;
 
@@ -1842,6 +2338,8 @@ undo_mftbmp_alloc:
 	err = errno;
 	if (ntfs_bitmap_clear_bit(mftbmp_na, bit))
 		ntfs_log_error("Failed to clear bit in mft bitmap.%s\n", es);
+	else
+		mft_bitmap_update(vol, bit, FALSE);
 	errno = err;
 err_out:
 	if (!errno)
@@ -1877,6 +2375,7 @@ int ntfs_mft_record_free(ntfs_volume *vol, ntfs_inode *ni)
 
 	/* Cache the mft reference for later. */
 	mft_no = ni->mft_no;
+	ntfs_mft_alloc_lock(vol);
 
 	/* Mark the mft record as not in use. */
 	ni->mrec->flags &= ~MFT_RECORD_IN_USE;
@@ -1904,6 +2403,7 @@ int ntfs_mft_record_free(ntfs_volume *vol, ntfs_inode *ni)
 		//	  error, this could be changed to goto sync_rollback;
 		goto bitmap_rollback;
 	}
+	mft_bitmap_update(vol, mft_no, FALSE);
 
 	/* Throw away the now freed inode. */
 #if CACHE_NIDATA_SIZE
@@ -1912,6 +2412,7 @@ int ntfs_mft_record_free(ntfs_volume *vol, ntfs_inode *ni)
 	if (!ntfs_inode_close(ni)) {
 #endif
 		vol->free_mft_records++; 
+		ntfs_mft_alloc_unlock(vol);
 		return 0;
 	}
 	err = errno;
@@ -1921,10 +2422,13 @@ bitmap_rollback:
 	if (ntfs_bitmap_set_bit(vol->mftbmp_na, mft_no))
 		ntfs_log_debug("Eeek! Rollback failed in ntfs_mft_record_free().  "
 				"Leaving inconsistent metadata!\n");
+	else
+		mft_bitmap_update(vol, mft_no, TRUE);
 sync_rollback:
 	ni->mrec->flags |= MFT_RECORD_IN_USE;
 	ni->mrec->sequence_number = old_seq_no;
 	ntfs_inode_mark_dirty(ni);
+	ntfs_mft_alloc_unlock(vol);
 	errno = err;
 	return -1;
 }
@@ -1953,3 +2457,443 @@ int ntfs_mft_usn_dec(MFT_RECORD *mrec)
 	return 0;
 }
 
+/*
+ *		Read the next batch of a scan
+ *
+ *	The records which cannot be read along with the others are read
+ *	one at a time, and those which still cannot be read are marked
+ *	as such, so that their errors are reported by the reads which
+ *	the caller will try.
+ */
+
+static void scan_load(struct MFT_SCAN *scan)
+{
+	ntfs_volume *vol;
+	runlist_element *rl;
+	s64 count;
+	s64 run_end;
+	s64 br;
+	s64 i;
+	u32 bits;
+
+	vol = scan->vol;
+	bits = vol->mft_record_size_bits;
+	count = scan->end - scan->next;
+	if (count > scan->capacity)
+		count = scan->capacity;
+		/* stop at the end of the run */
+	rl = ntfs_attr_find_vcn(vol->mft_na,
+			(scan->next << bits) >> vol->cluster_size_bits);
+	if (rl) {
+		run_end = ((rl->vcn + rl->length)
+				<< vol->cluster_size_bits) >> bits;
+		if ((run_end > scan->next) && (count > (run_end - scan->next)))
+			count = run_end - scan->next;
+	}
+	br = ntfs_attr_mst_pread(vol->mft_na, scan->next << bits,
+			count, vol->mft_record_size, scan->batch);
+	if (br < 0)
+		br = 0;
+	for (i=0; i<count; i++)
+		scan->valid[i] = (i < br)
+			|| (ntfs_attr_mst_pread(vol->mft_na,
+				(scan->next + i) << bits, 1,
+				vol->mft_record_size,
+				&scan->batch[i << bits]) == 1);
+	scan->first = scan->next;
+	scan->count = count;
+	if (vol->mft_cache)
+		ntfs_mftcache_overlay(vol, scan->first, count,
+				(MFT_RECORD*)scan->batch);
+}
+
+/**
+ * ntfs_mft_scan_start - start a sequential scan of the mft records
+ * @vol:	volume to scan
+ * @first:	first mft record number to return
+ * @end:	mft record number after the last one to return
+ *
+ * Prepare for returning all the mft records from @first up to @end
+ * excluded, or up to the last allocated record, whichever comes
+ * first, in the order of their numbers.
+ *
+ * Only one scan may be active on a volume at a time.
+ *
+ * Return the scan state on success or NULL on error, with errno set to
+ * the error code.
+ */
+struct MFT_SCAN *ntfs_mft_scan_start(ntfs_volume *vol, s64 first, s64 end)
+{
+	struct MFT_SCAN *scan;
+	s64 nr_mft_records;
+
+	if (!vol || !vol->mft_na || (first < 0)) {
+		errno = EINVAL;
+		return (struct MFT_SCAN*)NULL;
+	}
+	if (vol->mft_scan) {
+		errno = EBUSY;
+		return (struct MFT_SCAN*)NULL;
+	}
+	nr_mft_records = vol->mft_na->initialized_size
+				>> vol->mft_record_size_bits;
+	if (end > nr_mft_records)
+		end = nr_mft_records;
+	scan = (struct MFT_SCAN*)ntfs_calloc(sizeof(struct MFT_SCAN));
+	if (!scan)
+		return (struct MFT_SCAN*)NULL;
+	scan->capacity = MFT_SCAN_SIZE >> vol->mft_record_size_bits;
+	if (scan->capacity < 1)
+		scan->capacity = 1;
+	scan->batch = (char*)ntfs_malloc(scan->capacity
+				<< vol->mft_record_size_bits);
+	scan->valid = (BOOL*)ntfs_malloc(scan->capacity*sizeof(BOOL));
+	if (!scan->batch || !scan->valid) {
+		free(scan->batch);
+		free(scan->valid);
+		free(scan);
+		return (struct MFT_SCAN*)NULL;
+	}
+	scan->vol = vol;
+	scan->next = first;
+	scan->end = end;
+	scan->first = first;
+	scan->count = 0;
+	vol->mft_scan = scan;
+	return (scan);
+}
+
+/**
+ * ntfs_mft_scan_next - get the next mft record of a scan
+ * @scan:	scan state, as returned by ntfs_mft_scan_start()
+ * @mft_no:	where to store the number of the record
+ * @mrec:	where to store the address of the record, may be NULL
+ *
+ * All the record numbers are returned, even when the record could not
+ * be read, in which case the address is NULL, and reading the record
+ * again shows the error. The record is mst deprotected, and it remains
+ * at the returned address until the next call.
+ *
+ * Return TRUE if a record number is returned, or FALSE after the last
+ * one.
+ */
+BOOL ntfs_mft_scan_next(struct MFT_SCAN *scan, s64 *mft_no, MFT_RECORD **mrec)
+{
+	s64 i;
+
+	if (scan->next >= scan->end)
+		return (FALSE);
+	if (scan->next >= (scan->first + scan->count))
+		scan_load(scan);
+	i = scan->next - scan->first;
+	*mft_no = scan->next++;
+	if (mrec)
+		*mrec = (scan->valid[i]
+			? (MFT_RECORD*)&scan->batch[i
+				<< scan->vol->mft_record_size_bits]
+			: (MFT_RECORD*)NULL);
+	return (TRUE);
+}
+
+/**
+ * ntfs_mft_scan_end - end a sequential scan of the mft records
+ * @scan:	scan state, as returned by ntfs_mft_scan_start()
+ */
+void ntfs_mft_scan_end(struct MFT_SCAN *scan)
+{
+	if (scan) {
+		if (scan->vol->mft_scan == scan)
+			scan->vol->mft_scan = (struct MFT_SCAN*)NULL;
+		free(scan->batch);
+		free(scan->valid);
+		free(scan);
+	}
+}
+
+/*
+ *		Parallel scan of the MFT records
+ *
+ *	The records are split into ranges which do not cross the end of
+ *	a run of $MFT/$DATA, and the ranges are handed out to worker
+ *	threads in the order of the record numbers. Each worker reads
+ *	its ranges directly from the device, removes the fixups and
+ *	calls the function of the caller for each record, so that this
+ *	function is called concurrently and it has to protect the state
+ *	it shares. The runlist of $MFT/$DATA, fully mapped when mounting,
+ *	is only read by the workers.
+ */
+
+struct MFT_PSCAN {
+#ifdef ENABLE_THREADS
+	pthread_mutex_t lock;
+#endif
+	ntfs_volume *vol;
+	ntfs_mft_scan_func func;
+	void *arg;
+	s64 next;		/* next record to hand out */
+	s64 end;		/* record after the last one to hand out */
+	s64 capacity;		/* max count of records in a range */
+	int err;		/* first error met, stops the scan */
+} ;
+
+static void pscan_lock(struct MFT_PSCAN *pscan
+#ifndef ENABLE_THREADS
+			__attribute__((unused))
+#endif
+			)
+{
+#ifdef ENABLE_THREADS
+	pthread_mutex_lock(&pscan->lock);
+#endif
+}
+
+static void pscan_unlock(struct MFT_PSCAN *pscan
+#ifndef ENABLE_THREADS
+			__attribute__((unused))
+#endif
+			)
+{
+#ifdef ENABLE_THREADS
+	pthread_mutex_unlock(&pscan->lock);
+#endif
+}
+
+/*
+ *		Find the run of $MFT/$DATA containing a vcn
+ *
+ *	Returns NULL if there is none.
+ */
+
+static const runlist_element *mft_run(const ntfs_volume *vol, VCN vcn)
+{
+	const runlist_element *rl;
+
+	rl = vol->mft_na->rl;
+	while (rl && rl->length && ((rl->vcn + rl->length) <= vcn))
+		rl++;
+	if (!rl || !rl->length || (rl->vcn > vcn))
+		rl = (const runlist_element*)NULL;
+	return (rl);
+}
+
+/*
+ *		Read a part of $MFT/$DATA directly from the device
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+static int read_mft_range(const ntfs_volume *vol, s64 pos, s64 count,
+			char *buf)
+{
+	const runlist_element *rl;
+	s64 run_end;
+	s64 n;
+
+	while (count > 0) {
+		rl = mft_run(vol, pos >> vol->cluster_size_bits);
+		if (!rl || (rl->lcn < 0)) {
+			errno = EIO;
+			return (-1);
+		}
+		run_end = (rl->vcn + rl->length) << vol->cluster_size_bits;
+		n = run_end - pos;
+		if (n > count)
+			n = count;
+		if (ntfs_pread(vol->dev, (rl->lcn << vol->cluster_size_bits)
+				+ pos - (rl->vcn << vol->cluster_size_bits),
+				n, buf) != n) {
+			errno = EIO;
+			return (-1);
+		}
+		pos += n;
+		buf += n;
+		count -= n;
+	}
+	return (0);
+}
+
+/*
+ *		Get the next range of records to process
+ *
+ *	Returns the count of records in the range, zero when there are
+ *	no more records or after an error.
+ */
+
+static s64 pscan_range(struct MFT_PSCAN *pscan, s64 *first)
+{
+	const ntfs_volume *vol;
+	const runlist_element *rl;
+	s64 run_end;
+	s64 count;
+	u32 bits;
+
+	vol = pscan->vol;
+	bits = vol->mft_record_size_bits;
+	pscan_lock(pscan);
+	count = 0;
+	if (!pscan->err && (pscan->next < pscan->end)) {
+		count = pscan->end - pscan->next;
+		if (count > pscan->capacity)
+			count = pscan->capacity;
+		rl = mft_run(vol, (pscan->next << bits)
+				>> vol->cluster_size_bits);
+		if (rl) {
+			run_end = ((rl->vcn + rl->length)
+					<< vol->cluster_size_bits) >> bits;
+			if ((run_end > pscan->next)
+			    && (count > (run_end - pscan->next)))
+				count = run_end - pscan->next;
+		}
+		*first = pscan->next;
+		pscan->next += count;
+	}
+	pscan_unlock(pscan);
+	return (count);
+}
+
+static void pscan_error(struct MFT_PSCAN *pscan, int err)
+{
+	pscan_lock(pscan);
+	if (!pscan->err)
+		pscan->err = err;
+	pscan_unlock(pscan);
+}
+
+static void *pscan_worker(void *data)
+{
+	struct MFT_PSCAN *pscan;
+	ntfs_volume *vol;
+	MFT_RECORD *mrec;
+	char *buf;
+	s64 first;
+	s64 count;
+	s64 i;
+	u32 bits;
+	BOOL all_read;
+	BOOL warn;
+
+	pscan = (struct MFT_PSCAN*)data;
+	vol = pscan->vol;
+	bits = vol->mft_record_size_bits;
+	warn = !NVolNoFixupWarn(vol);
+	buf = (char*)ntfs_malloc(pscan->capacity << bits);
+	if (!buf) {
+		pscan_error(pscan, ENOMEM);
+		return ((void*)NULL);
+	}
+	while ((count = pscan_range(pscan, &first)) > 0) {
+		all_read = !read_mft_range(vol, first << bits,
+					count << bits, buf);
+		for (i=0; i<count; i++) {
+			mrec = (MFT_RECORD*)&buf[i << bits];
+				/* read again alone if the range failed */
+			if (!all_read
+			    && read_mft_range(vol, (first + i) << bits,
+					vol->mft_record_size, (char*)mrec))
+				mrec = (MFT_RECORD*)NULL;
+			if (mrec) {
+				ntfs_mst_post_read_fixup_warn(
+					(NTFS_RECORD*)mrec,
+					vol->mft_record_size, warn);
+				if (vol->mft_cache)
+					ntfs_mftcache_overlay(vol, first + i,
+							1, mrec);
+			}
+			if (pscan->func(vol, first + i, mrec, pscan->arg)) {
+				pscan_error(pscan, (errno ? errno : EIO));
+				break;
+			}
+		}
+	}
+	free(buf);
+	return ((void*)NULL);
+}
+
+/**
+ * ntfs_mft_scan_parallel - scan the mft records in several threads
+ * @vol:	volume to scan
+ * @first:	first mft record number to process
+ * @end:	mft record number after the last one to process
+ * @threads:	count of threads, zero to use one per processor
+ * @func:	function to call for each record
+ * @arg:	argument passed to @func
+ *
+ * Call @func for all the mft records from @first up to @end excluded,
+ * or up to the last allocated record, whichever comes first. The
+ * calls are made concurrently from @threads threads (including the
+ * calling one) in no defined order. The record is mst deprotected, and
+ * it is NULL if it could not be read. The record buffer may be
+ * modified by @func, but it is not written back.
+ *
+ * @func returns zero to go on, or -1 with errno set to stop the scan.
+ *
+ * Without thread support, all the calls are made from the calling
+ * thread.
+ *
+ * Return 0 on success or -1 on error, with errno set to the error code
+ * (possibly the one set by @func).
+ */
+int ntfs_mft_scan_parallel(ntfs_volume *vol, s64 first, s64 end,
+		int threads, ntfs_mft_scan_func func, void *arg)
+{
+	struct MFT_PSCAN pscan;
+	s64 nr_mft_records;
+#ifdef ENABLE_THREADS
+	pthread_t *tids;
+	int started;
+	int i;
+#endif
+
+	if (!vol || !vol->mft_na || !vol->mft_na->rl || !func
+	    || (first < 0)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	nr_mft_records = vol->mft_na->initialized_size
+				>> vol->mft_record_size_bits;
+	if (end > nr_mft_records)
+		end = nr_mft_records;
+#if defined(HAVE_UNISTD_H) && defined(_SC_NPROCESSORS_ONLN)
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (threads <= 0)
+		threads = 1;
+	if (threads > MFT_SCAN_MAX_THREADS)
+		threads = MFT_SCAN_MAX_THREADS;
+	pscan.vol = vol;
+	pscan.func = func;
+	pscan.arg = arg;
+	pscan.next = first;
+	pscan.end = end;
+	pscan.capacity = MFT_SCAN_PARALLEL_SIZE >> vol->mft_record_size_bits;
+	if (pscan.capacity < 1)
+		pscan.capacity = 1;
+	pscan.err = 0;
+#ifdef ENABLE_THREADS
+	pthread_mutex_init(&pscan.lock, NULL);
+	started = 0;
+	tids = (pthread_t*)NULL;
+	if (threads > 1)
+		tids = (pthread_t*)ntfs_malloc((threads - 1)
+					*sizeof(pthread_t));
+	if (tids) {
+		while ((started < (threads - 1))
+		    && !pthread_create(&tids[started], NULL,
+					pscan_worker, &pscan))
+			started++;
+	}
+	pscan_worker(&pscan);
+	for (i=0; i<started; i++)
+		pthread_join(tids[i], NULL);
+	free(tids);
+	pthread_mutex_destroy(&pscan.lock);
+#else
+	pscan_worker(&pscan);
+#endif
+	if (pscan.err) {
+		errno = pscan.err;
+		return (-1);
+	}
+	return (0);
+}
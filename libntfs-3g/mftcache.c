@@ -0,0 +1,983 @@
+/**
+ * mftcache.c : cache of MFT records
+ *
+ *      This module is part of ntfs-3g library
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
+
+#include "param.h"
+#include "types.h"
+#include "layout.h"
+#include "attrib.h"
+#include "device.h"
+#include "volume.h"
+#include "mft.h"
+#include "mftcache.h"
+#include "mst.h"
+#include "lock.h"
+#include "misc.h"
+#include "logging.h"
+
+/*
+ *		Cache of MFT records
+ *
+ *	Opening an inode which is not in the nidata cache implies reading
+ *	its MFT record and removing the update sequence fixups. The cache
+ *	keeps the records in their fixed-up state, so that reopening an
+ *	inode only implies copying its record.
+ *
+ *	When the cache is write-through, the records are written to the
+ *	device as usual and the cache is updated afterwards. When it is
+ *	write-back, the records beyond the ones mirrored in $MFTMirr are
+ *	only written into the cache, and they are written to the device
+ *	when they are evicted, when the volume is synced (by fsync(2))
+ *	or committed and when it is unmounted. The records are then
+ *	written in the order of their numbers, merging the consecutive
+ *	ones.
+ *
+ *	The records to evict are selected by a clock algorithm, and the
+ *	cache is protected by a single lock, as the records are only
+ *	copied while it is held.
+ *
+ *	When a record is missing, the aligned window of records around
+ *	it is read in a single request, and the neighbours in use are
+ *	entered as prefetched, without being referenced, so that they
+ *	are the first ones to be evicted if they are never requested.
+ *	The window is doubled when most of the prefetched records are
+ *	requested before being evicted, and halved when few of them are.
+ *
+ *	Lists of scattered records, such as the entries of a directory
+ *	just listed, may also be queued for a background thread, which
+ *	sorts them and reads them in the order of their numbers, merging
+ *	the close ones into single requests. The thread reads $MFT/$DATA
+ *	while holding the mft allocation lock, so that the runlist does
+ *	not change, and drops the records it has read if any record was
+ *	written meanwhile, as they might be older than the written one.
+ */
+
+struct MFTCACHE_ENTRY {
+	struct MFTCACHE_ENTRY *next;	/* next entry in hash chain */
+	s64 mft_no;			/* -1 if the entry is unused */
+	MFT_RECORD *rec;
+	BOOL dirty;
+	BOOL referenced;
+	BOOL prefetched;		/* not requested since prefetched */
+} ;
+
+struct MFT_CACHE {
+#ifdef ENABLE_THREADS
+	pthread_mutex_t lock;
+#endif
+	struct MFTCACHE_ENTRY *entries;
+	struct MFTCACHE_ENTRY **hash;
+	char *buffers;			/* records of all the entries */
+	int count;			/* count of entries */
+	int hashmask;
+	int hand;			/* position of the clock hand */
+	BOOL writeback;
+	unsigned long writes;
+	unsigned long reads;
+	unsigned long hits;
+	unsigned long prefetched;
+	unsigned long useful;		/* prefetched, then requested */
+	unsigned long wasted;		/* prefetched, evicted unrequested */
+	unsigned long sample_useful;	/* since the window was adjusted */
+	unsigned long sample_wasted;
+	int window;			/* records prefetched, 0 if none */
+	int max_window;
+	unsigned long generation;	/* count of records written */
+#ifdef ENABLE_THREADS
+	pthread_t thread;		/* reading the queued records */
+	pthread_cond_t cond;
+	s64 *queue;			/* records queued, NULL if no thread */
+	int queued;
+	BOOL stop;
+#endif
+} ;
+
+static void mftcache_lock(struct MFT_CACHE *cache
+#ifndef ENABLE_THREADS
+			__attribute__((unused))
+#endif
+			)
+{
+#ifdef ENABLE_THREADS
+	pthread_mutex_lock(&cache->lock);
+#endif
+}
+
+static void mftcache_unlock(struct MFT_CACHE *cache
+#ifndef ENABLE_THREADS
+			__attribute__((unused))
+#endif
+			)
+{
+#ifdef ENABLE_THREADS
+	pthread_mutex_unlock(&cache->lock);
+#endif
+}
+
+static struct MFTCACHE_ENTRY **hash_head(struct MFT_CACHE *cache,
+		s64 mft_no)
+{
+	return (&cache->hash[mft_no & cache->hashmask]);
+}
+
+static struct MFTCACHE_ENTRY *find_entry(struct MFT_CACHE *cache,
+		s64 mft_no)
+{
+	struct MFTCACHE_ENTRY *entry;
+
+	entry = *hash_head(cache, mft_no);
+	while (entry && (entry->mft_no != mft_no))
+		entry = entry->next;
+	return (entry);
+}
+
+static void unhash_entry(struct MFT_CACHE *cache,
+		struct MFTCACHE_ENTRY *entry)
+{
+	struct MFTCACHE_ENTRY **pprev;
+
+	pprev = hash_head(cache, entry->mft_no);
+	while (*pprev && (*pprev != entry))
+		pprev = &(*pprev)->next;
+	if (*pprev)
+		*pprev = entry->next;
+	entry->next = (struct MFTCACHE_ENTRY*)NULL;
+	entry->mft_no = -1;
+}
+
+/*
+ *		Write a modified record to the device
+ *
+ *	The update sequence number of the cached record is changed,
+ *	as when a record is written from an inode.
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+static int write_entry(const ntfs_volume *vol, struct MFTCACHE_ENTRY *entry)
+{
+	s64 bw;
+
+	bw = ntfs_attr_mst_pwrite(vol->mft_na,
+			entry->mft_no << vol->mft_record_size_bits,
+			1, vol->mft_record_size, entry->rec);
+	if (bw != 1) {
+		if (bw >= 0)
+			errno = EIO;
+		ntfs_log_perror("Failed to write the cached MFT record %lld",
+			(long long)entry->mft_no);
+		return (-1);
+	}
+	entry->dirty = FALSE;
+	return (0);
+}
+
+/*
+ *		Get a free entry for a record, evicting another one
+ *
+ *	Returns the entry, or NULL if there was an error (errno is set)
+ *	The cache must be locked by the caller.
+ */
+
+static struct MFTCACHE_ENTRY *new_entry(const ntfs_volume *vol,
+		struct MFT_CACHE *cache, s64 mft_no)
+{
+	struct MFTCACHE_ENTRY *entry;
+	struct MFTCACHE_ENTRY **head;
+	int i;
+
+		/* a second round finds the entries no more referenced */
+	entry = (struct MFTCACHE_ENTRY*)NULL;
+	for (i=0; !entry && (i<=2*cache->count); i++) {
+		entry = &cache->entries[cache->hand];
+		if (++cache->hand >= cache->count)
+			cache->hand = 0;
+		if ((entry->mft_no >= 0) && entry->referenced) {
+			entry->referenced = FALSE;
+			entry = (struct MFTCACHE_ENTRY*)NULL;
+		}
+	}
+	if (!entry) {
+		errno = EIO;
+		return ((struct MFTCACHE_ENTRY*)NULL);
+	}
+	if (entry->mft_no >= 0) {
+		if (entry->dirty) {
+			if (write_entry(vol, entry))
+				return ((struct MFTCACHE_ENTRY*)NULL);
+			cache->generation++;
+		}
+		if (entry->prefetched) {
+			cache->wasted++;
+			cache->sample_wasted++;
+		}
+		unhash_entry(cache, entry);
+	}
+	entry->mft_no = mft_no;
+	entry->dirty = FALSE;
+	entry->referenced = TRUE;
+	entry->prefetched = FALSE;
+	head = hash_head(cache, mft_no);
+	entry->next = *head;
+	*head = entry;
+	return (entry);
+}
+
+/*
+ *		Get a record from the cache
+ *
+ *	Returns TRUE if the record was found and copied
+ */
+
+BOOL ntfs_mftcache_get(const ntfs_volume *vol, VCN mft_no, MFT_RECORD *b)
+{
+	struct MFT_CACHE *cache;
+	struct MFTCACHE_ENTRY *entry;
+
+	cache = vol->mft_cache;
+	mftcache_lock(cache);
+	cache->reads++;
+	entry = find_entry(cache, mft_no);
+	if (entry) {
+		cache->hits++;
+		if (entry->prefetched) {
+			cache->useful++;
+			cache->sample_useful++;
+			entry->prefetched = FALSE;
+		}
+		entry->referenced = TRUE;
+		memcpy(b, entry->rec, vol->mft_record_size);
+	}
+	mftcache_unlock(cache);
+	return (entry != (struct MFTCACHE_ENTRY*)NULL);
+}
+
+/*
+ *		Insert the modified cached records into records read
+ *	directly from the device
+ */
+
+void ntfs_mftcache_overlay(const ntfs_volume *vol, VCN mft_no,
+			s64 count, MFT_RECORD *b)
+{
+	struct MFT_CACHE *cache;
+	struct MFTCACHE_ENTRY *entry;
+	s64 i;
+
+	cache = vol->mft_cache;
+	if (cache->writeback) {
+		mftcache_lock(cache);
+		for (i=0; i<count; i++) {
+			entry = find_entry(cache, mft_no + i);
+			if (entry && entry->dirty)
+				memcpy((char*)b
+					+ (i << vol->mft_record_size_bits),
+					entry->rec, vol->mft_record_size);
+		}
+		mftcache_unlock(cache);
+	}
+}
+
+/*
+ *		Enter records into the cache
+ *
+ *	When the records have just been read, the cached ones are kept,
+ *	as they cannot be older. When they have just been written, they
+ *	replace the cached ones.
+ *
+ *	Failing to enter a record is not an error, it is only forgotten.
+ */
+
+void ntfs_mftcache_put(const ntfs_volume *vol, VCN mft_no,
+			s64 count, const MFT_RECORD *b, BOOL written)
+{
+	struct MFT_CACHE *cache;
+	struct MFTCACHE_ENTRY *entry;
+	s64 i;
+
+	cache = vol->mft_cache;
+	mftcache_lock(cache);
+	for (i=0; i<count; i++) {
+		entry = find_entry(cache, mft_no + i);
+		if (!entry || written) {
+			if (!entry)
+				entry = new_entry(vol, cache, mft_no + i);
+			if (entry) {
+				memcpy(entry->rec, (const char*)b
+					+ (i << vol->mft_record_size_bits),
+					vol->mft_record_size);
+				entry->dirty = FALSE;
+				entry->referenced = TRUE;
+			}
+		}
+	}
+	if (written)
+		cache->generation++;
+	mftcache_unlock(cache);
+}
+
+/*
+ *		Adjust the window of prefetched records to the ratio of
+ *	prefetched records which were requested
+ *
+ *	The cache must be locked by the caller.
+ */
+
+static void adjust_window(struct MFT_CACHE *cache)
+{
+	unsigned long total;
+
+	total = cache->sample_useful + cache->sample_wasted;
+	if (total >= 2*(unsigned long)cache->window) {
+		if ((cache->sample_useful*2 >= total)
+		    && (cache->window < cache->max_window))
+			cache->window <<= 1;
+		else
+			if ((cache->sample_useful*4 < total)
+			    && (cache->window > MFTCACHE_PREFETCH_MIN))
+				cache->window >>= 1;
+		cache->sample_useful = 0;
+		cache->sample_wasted = 0;
+	}
+}
+
+/*
+ *		Enter prefetched records into the cache
+ *
+ *	The cache must be locked by the caller.
+ */
+
+static void enter_prefetched(const ntfs_volume *vol, struct MFT_CACHE *cache,
+			VCN mft_no, s64 count, const MFT_RECORD *b,
+			const BOOL *valid)
+{
+	struct MFTCACHE_ENTRY *entry;
+	s64 i;
+
+	for (i=0; i<count; i++) {
+		if (valid[i] && !find_entry(cache, mft_no + i)) {
+			entry = new_entry(vol, cache, mft_no + i);
+			if (entry) {
+				memcpy(entry->rec, (const char*)b
+					+ (i << vol->mft_record_size_bits),
+					vol->mft_record_size);
+				entry->referenced = FALSE;
+				entry->prefetched = TRUE;
+				cache->prefetched++;
+			}
+		}
+	}
+}
+
+/*
+ *		Enter prefetched records into the cache
+ *
+ *	Only the records flagged in @valid are entered, and the records
+ *	already cached are kept, as they cannot be older.
+ */
+
+void ntfs_mftcache_prefetch(const ntfs_volume *vol, VCN mft_no,
+			s64 count, const MFT_RECORD *b, const BOOL *valid)
+{
+	struct MFT_CACHE *cache;
+
+	cache = vol->mft_cache;
+	mftcache_lock(cache);
+	enter_prefetched(vol, cache, mft_no, count, b, valid);
+	adjust_window(cache);
+	mftcache_unlock(cache);
+}
+
+/*
+ *		Get the count of records to read around a missing record
+ *
+ *	Returns a power of two, or zero if records are not to be prefetched
+ */
+
+int ntfs_mftcache_window(const ntfs_volume *vol)
+{
+	struct MFT_CACHE *cache;
+	int window;
+
+	cache = vol->mft_cache;
+	mftcache_lock(cache);
+	window = cache->window;
+	mftcache_unlock(cache);
+	return (window);
+}
+
+#ifdef ENABLE_THREADS
+
+static int mft_no_compare(const void *p1, const void *p2)
+{
+	s64 mft_no1 = *(const s64*)p1;
+	s64 mft_no2 = *(const s64*)p2;
+
+	return (mft_no1 < mft_no2 ? -1 : (mft_no1 > mft_no2 ? 1 : 0));
+}
+
+/*
+ *		Read a run of queued records and enter them into the cache
+ *
+ *	The records from list[0] to list[count - 1] are read in a single
+ *	request, including the ones in the gaps, which are not entered.
+ */
+
+static void readahead_run(ntfs_volume *vol, struct MFT_CACHE *cache,
+			const s64 *list, int count, char *buf, BOOL *valid)
+{
+	MFT_RECORD *rec;
+	unsigned long generation;
+	s64 first;
+	s64 span;
+	s64 i;
+	u32 bits;
+	int k;
+
+	bits = vol->mft_record_size_bits;
+	first = list[0];
+	span = list[count - 1] - first + 1;
+	ntfs_mft_alloc_lock(vol);
+	mftcache_lock(cache);
+	generation = cache->generation;
+	mftcache_unlock(cache);
+	if (((first + span) <= (vol->mft_na->initialized_size >> bits))
+	    && (ntfs_attr_pread(vol->mft_na, first << bits, span << bits,
+				buf) == (span << bits))) {
+		for (i=0; i<span; i++)
+			valid[i] = FALSE;
+		for (k=0; k<count; k++) {
+			i = list[k] - first;
+			rec = (MFT_RECORD*)&buf[i << bits];
+			valid[i] = (rec->magic == magic_FILE)
+			    && (rec->flags & MFT_RECORD_IN_USE)
+			    && !ntfs_mst_post_read_fixup_warn(
+					(NTFS_RECORD*)rec,
+					vol->mft_record_size, FALSE);
+		}
+		mftcache_lock(cache);
+		if (cache->generation == generation)
+			enter_prefetched(vol, cache, first, span,
+					(MFT_RECORD*)buf, valid);
+		mftcache_unlock(cache);
+	}
+	ntfs_mft_alloc_unlock(vol);
+}
+
+/*
+ *		Read the records queued, in the order of their numbers
+ */
+
+static void readahead_list(ntfs_volume *vol, struct MFT_CACHE *cache,
+			s64 *list, int count, char *buf, BOOL *valid)
+{
+	s64 max_span;
+	int i, j, n;
+
+	qsort(list, count, sizeof(s64), mft_no_compare);
+		/* drop the duplicates and the records already cached */
+	n = 0;
+	mftcache_lock(cache);
+	for (i=0; i<count; i++) {
+		if ((!n || (list[i] != list[n - 1]))
+		    && !find_entry(cache, list[i]))
+			list[n++] = list[i];
+	}
+	mftcache_unlock(cache);
+	max_span = MFTCACHE_PREFETCH_BYTES >> vol->mft_record_size_bits;
+	for (i=0; (i<n) && !cache->stop; i=j) {
+		j = i + 1;
+		while ((j < n)
+		    && ((list[j] - list[j - 1]) <= MFTCACHE_READAHEAD_GAP)
+		    && ((list[j] - list[i]) < max_span))
+			j++;
+		readahead_run(vol, cache, &list[i], j - i, buf, valid);
+	}
+}
+
+static void *readahead_thread(void *arg)
+{
+	ntfs_volume *vol;
+	struct MFT_CACHE *cache;
+	s64 *list;
+	char *buf;
+	BOOL *valid;
+	int count;
+
+	vol = (ntfs_volume*)arg;
+	cache = vol->mft_cache;
+	list = (s64*)ntfs_malloc(MFTCACHE_READAHEAD_RECORDS*sizeof(s64));
+	buf = (char*)ntfs_malloc(MFTCACHE_PREFETCH_BYTES);
+	valid = (BOOL*)ntfs_malloc((MFTCACHE_PREFETCH_BYTES
+			>> vol->mft_record_size_bits)*sizeof(BOOL));
+	mftcache_lock(cache);
+	while (!cache->stop) {
+		if (cache->queued) {
+			count = cache->queued;
+			if (list)
+				memcpy(list, cache->queue, count*sizeof(s64));
+			cache->queued = 0;
+			mftcache_unlock(cache);
+			if (list && buf && valid)
+				readahead_list(vol, cache, list, count,
+						buf, valid);
+			mftcache_lock(cache);
+		} else
+			pthread_cond_wait(&cache->cond, &cache->lock);
+	}
+	mftcache_unlock(cache);
+	free(list);
+	free(buf);
+	free(valid);
+	return ((void*)NULL);
+}
+
+#endif /* ENABLE_THREADS */
+
+/*
+ *		Queue scattered records to be read into the cache
+ *
+ *	The records are read in background, in the order of their
+ *	numbers, when the thread has been started. The records which
+ *	do not fit into the queue are ignored.
+ */
+
+void ntfs_mftcache_readahead(const ntfs_volume *vol, const s64 *list,
+			int count)
+{
+#ifdef ENABLE_THREADS
+	struct MFT_CACHE *cache;
+
+	cache = vol->mft_cache;
+	if (cache && cache->queue && (count > 0)) {
+		mftcache_lock(cache);
+		if (count > (MFTCACHE_READAHEAD_RECORDS - cache->queued))
+			count = MFTCACHE_READAHEAD_RECORDS - cache->queued;
+		memcpy(&cache->queue[cache->queued], list,
+				count*sizeof(s64));
+		cache->queued += count;
+		pthread_cond_signal(&cache->cond);
+		mftcache_unlock(cache);
+	}
+#endif
+}
+
+/*
+ *		Start the thread reading the queued records
+ *
+ *	To be called once the program has detached from the terminal, as
+ *	a fork would not retain the thread.
+ *
+ *	Returns 0 if successful
+ *		-1 if failed, with errno set
+ */
+
+int ntfs_mftcache_readahead_start(ntfs_volume *vol)
+{
+#ifdef ENABLE_THREADS
+	struct MFT_CACHE *cache;
+	int ret;
+
+	cache = vol->mft_cache;
+	if (!cache || cache->queue || !vol->locks) {
+		errno = EINVAL;
+		return (-1);
+	}
+	cache->queue = (s64*)ntfs_malloc(
+			MFTCACHE_READAHEAD_RECORDS*sizeof(s64));
+	if (!cache->queue)
+		return (-1);
+	cache->queued = 0;
+	cache->stop = FALSE;
+	pthread_cond_init(&cache->cond, NULL);
+	ret = pthread_create(&cache->thread, NULL, readahead_thread, vol);
+	if (!ret)
+		return (0);
+	pthread_cond_destroy(&cache->cond);
+	free(cache->queue);
+	cache->queue = (s64*)NULL;
+	errno = ret;
+	return (-1);
+#else
+	errno = EOPNOTSUPP;
+	return (-1);
+#endif
+}
+
+/*
+ *		Stop the thread reading the queued records
+ */
+
+static void readahead_stop(struct MFT_CACHE *cache
+#ifndef ENABLE_THREADS
+			__attribute__((unused))
+#endif
+			)
+{
+#ifdef ENABLE_THREADS
+	if (cache->queue) {
+		mftcache_lock(cache);
+		cache->stop = TRUE;
+		pthread_cond_signal(&cache->cond);
+		mftcache_unlock(cache);
+		pthread_join(cache->thread, (void**)NULL);
+		pthread_cond_destroy(&cache->cond);
+		free(cache->queue);
+		cache->queue = (s64*)NULL;
+	}
+#endif
+}
+
+/*
+ *		Write records into the cache only
+ *
+ *	This is only done when the cache is write-back, and the records
+ *	mirrored into $MFTMirr are always written to the device.
+ *
+ *	Returns 0 if the records have been kept in the cache,
+ *		1 if they have to be written to the device,
+ *		-1 if there was an error (with errno set)
+ */
+
+int ntfs_mftcache_defer(const ntfs_volume *vol, VCN mft_no,
+			s64 count, const MFT_RECORD *b)
+{
+	struct MFT_CACHE *cache;
+	struct MFTCACHE_ENTRY *entry;
+	s64 i;
+	int res;
+
+	cache = vol->mft_cache;
+	if (!cache->writeback || NDevSync(vol->dev)
+	    || NDevReadOnly(vol->dev)
+	    || (mft_no < vol->mftmirr_size))
+		return (1);
+	res = 0;
+	NDevSetDirty(vol->dev);
+	mftcache_lock(cache);
+	for (i=0; (i<count) && !res; i++) {
+		entry = find_entry(cache, mft_no + i);
+		if (!entry)
+			entry = new_entry(vol, cache, mft_no + i);
+		if (entry) {
+			memcpy(entry->rec, (const char*)b
+				+ (i << vol->mft_record_size_bits),
+				vol->mft_record_size);
+			entry->dirty = TRUE;
+			entry->referenced = TRUE;
+			cache->writes++;
+		} else
+			res = -1;
+	}
+	cache->generation++;
+	mftcache_unlock(cache);
+	return (res);
+}
+
+/*
+ *		Write a run of consecutive modified records to the device
+ *
+ *	The records are gathered into @buf, so that they are written
+ *	in a single request, and copied back with their new update
+ *	sequence number.
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+static int write_run(const ntfs_volume *vol, struct MFTCACHE_ENTRY **run,
+			int count, char *buf)
+{
+	s64 bw;
+	int i;
+
+	for (i=0; i<count; i++)
+		memcpy(buf + ((size_t)i << vol->mft_record_size_bits),
+			run[i]->rec, vol->mft_record_size);
+	bw = ntfs_attr_mst_pwrite(vol->mft_na,
+			run[0]->mft_no << vol->mft_record_size_bits,
+			count, vol->mft_record_size, buf);
+	for (i=0; i<count; i++) {
+		memcpy(run[i]->rec,
+			buf + ((size_t)i << vol->mft_record_size_bits),
+			vol->mft_record_size);
+		if (i < bw)
+			run[i]->dirty = FALSE;
+	}
+	if (bw != count) {
+		if (bw >= 0)
+			errno = EIO;
+		ntfs_log_perror("Failed to write the cached MFT records"
+			" %lld-%lld", (long long)run[0]->mft_no,
+			(long long)run[count - 1]->mft_no);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ *		Write all the modified records to the device
+ *
+ *	The records are written in the order of their numbers, and the
+ *	consecutive ones are merged into single requests of at most
+ *	MFTCACHE_WRITE_RECORDS records.
+ *	The cache must be locked by the caller.
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+static int entry_compare(const void *p1, const void *p2)
+{
+	s64 mft_no1 = (*(const struct MFTCACHE_ENTRY* const*)p1)->mft_no;
+	s64 mft_no2 = (*(const struct MFTCACHE_ENTRY* const*)p2)->mft_no;
+
+	return (mft_no1 < mft_no2 ? -1 : (mft_no1 > mft_no2 ? 1 : 0));
+}
+
+static int flush_entries(const ntfs_volume *vol, struct MFT_CACHE *cache)
+{
+	struct MFTCACHE_ENTRY **dirty;
+	struct MFTCACHE_ENTRY *entry;
+	char *buf;
+	int count;
+	int err;
+	int i, n;
+
+	err = 0;
+	count = 0;
+	dirty = (struct MFTCACHE_ENTRY**)ntfs_malloc(
+			cache->count*sizeof(struct MFTCACHE_ENTRY*));
+	buf = (char*)ntfs_malloc((size_t)MFTCACHE_WRITE_RECORDS
+			<< vol->mft_record_size_bits);
+	for (i=0; i<cache->count; i++) {
+		entry = &cache->entries[i];
+		if ((entry->mft_no >= 0) && entry->dirty) {
+			if (dirty && buf)
+				dirty[count++] = entry;
+			else
+				if (write_entry(vol, entry))
+					err = errno;
+		}
+	}
+	if (count) {
+		qsort(dirty, count, sizeof(struct MFTCACHE_ENTRY*),
+				entry_compare);
+		for (i=0; i<count; i+=n) {
+			n = 1;
+			while (((i + n) < count)
+			    && (n < MFTCACHE_WRITE_RECORDS)
+			    && (dirty[i + n]->mft_no == (dirty[i]->mft_no + n)))
+				n++;
+			if (write_run(vol, &dirty[i], n, buf))
+				err = errno;
+		}
+	}
+	free(dirty);
+	free(buf);
+	if (err) {
+		errno = err;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ *		Write all the modified records to the device
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+int ntfs_mftcache_flush(const ntfs_volume *vol)
+{
+	struct MFT_CACHE *cache;
+	int res;
+
+	cache = vol->mft_cache;
+	if (!cache || !cache->writeback)
+		return (0);
+	mftcache_lock(cache);
+	res = flush_entries(vol, cache);
+	mftcache_unlock(cache);
+	return (res);
+}
+
+/*
+ *		Write a modified record to the device
+ *
+ *	This is for syncing a single file, the record is written alone.
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+int ntfs_mftcache_flush_record(const ntfs_volume *vol, VCN mft_no)
+{
+	struct MFT_CACHE *cache;
+	struct MFTCACHE_ENTRY *entry;
+	int res;
+
+	cache = vol->mft_cache;
+	if (!cache || !cache->writeback)
+		return (0);
+	res = 0;
+	mftcache_lock(cache);
+	entry = find_entry(cache, mft_no);
+	if (entry && entry->dirty)
+		res = write_entry(vol, entry);
+	mftcache_unlock(cache);
+	return (res);
+}
+
+/*
+ *		Log the statistics of the cache
+ */
+
+void ntfs_mftcache_log(const ntfs_volume *vol)
+{
+	struct MFT_CACHE *cache;
+
+	cache = vol->mft_cache;
+	if (cache && cache->reads) {
+		ntfs_log_info("MFT cache : %d entries, %lu writes, %lu reads,"
+			" %lu hits, %lu misses\n",
+			cache->count, cache->writes, cache->reads,
+			cache->hits, cache->reads - cache->hits);
+		if (cache->prefetched)
+			ntfs_log_info("MFT cache : %lu records prefetched,"
+				" %lu requested, %lu evicted unrequested,"
+				" window of %d records\n",
+				cache->prefetched, cache->useful,
+				cache->wasted, cache->window);
+	}
+}
+
+static void free_cache(struct MFT_CACHE *cache)
+{
+	free(cache->entries);
+	free(cache->hash);
+	free(cache->buffers);
+	free(cache);
+}
+
+/*
+ *		Create a cache of MFT records for a mounted volume
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+int ntfs_mftcache_attach(ntfs_volume *vol, int count, BOOL writeback)
+{
+	struct MFT_CACHE *cache;
+	int hashsize;
+	int i;
+
+	if (!vol || !vol->mft_na || vol->mft_cache || (count <= 0)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	hashsize = 1;
+	while (hashsize < count)
+		hashsize <<= 1;
+	cache = (struct MFT_CACHE*)ntfs_calloc(sizeof(struct MFT_CACHE));
+	if (!cache)
+		return (-1);
+	cache->entries = (struct MFTCACHE_ENTRY*)ntfs_calloc(
+			count*sizeof(struct MFTCACHE_ENTRY));
+	cache->hash = (struct MFTCACHE_ENTRY**)ntfs_calloc(
+			hashsize*sizeof(struct MFTCACHE_ENTRY*));
+	cache->buffers = (char*)ntfs_malloc(
+			(size_t)count*vol->mft_record_size);
+	if (!cache->entries || !cache->hash || !cache->buffers) {
+		free_cache(cache);
+		errno = ENOMEM;
+		return (-1);
+	}
+	for (i=0; i<count; i++) {
+		cache->entries[i].mft_no = -1;
+		cache->entries[i].rec = (MFT_RECORD*)&cache->buffers[
+				(size_t)i*vol->mft_record_size];
+	}
+#ifdef ENABLE_THREADS
+	pthread_mutex_init(&cache->lock, NULL);
+#endif
+	cache->count = count;
+	cache->hashmask = hashsize - 1;
+	cache->writeback = writeback;
+		/* prefetch at most 64K, and at most a quarter of the cache */
+	cache->max_window = MFTCACHE_PREFETCH_BYTES
+				>> vol->mft_record_size_bits;
+	while ((cache->max_window > MFTCACHE_PREFETCH_MIN)
+	    && (cache->max_window > count/4))
+		cache->max_window >>= 1;
+	if ((cache->max_window >= MFTCACHE_PREFETCH_MIN)
+	    && (cache->max_window <= count/4)) {
+		cache->window = MFTCACHE_PREFETCH_START;
+		if (cache->window > cache->max_window)
+			cache->window = cache->max_window;
+			/* the in-use records are found in the mft bitmap */
+		if (ntfs_mft_bitmap_load(vol))
+			ntfs_log_debug("Could not load the MFT bitmap\n");
+	}
+	vol->mft_cache = cache;
+	ntfs_log_debug("MFT cache of %d records, %s\n", count,
+		(writeback ? "write-back" : "write-through"));
+	return (0);
+}
+
+/*
+ *		Write the modified records and free the cache
+ *
+ *	This has to be done while $MFT is still open.
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+int ntfs_mftcache_detach(ntfs_volume *vol)
+{
+	struct MFT_CACHE *cache;
+	int res;
+
+	cache = vol->mft_cache;
+	if (!cache)
+		return (0);
+	readahead_stop(cache);
+	res = ntfs_mftcache_flush(vol);
+	vol->mft_cache = (struct MFT_CACHE*)NULL;
+#ifdef ENABLE_THREADS
+	pthread_mutex_destroy(&cache->lock);
+#endif
+	free_cache(cache);
+	return (res);
+}
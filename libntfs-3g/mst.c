@@ -31,6 +31,46 @@
 #include "mst.h"
 #include "logging.h"
 
+/*
+ *		Helpers for the fixups of the usual record sizes
+ *
+ *	The last u16 of each sector is checked against the usn without
+ *	branching, and the callers pass a constant count of sectors for
+ *	the records of 1024 and 4096 bytes (MFT records and index
+ *	blocks), so that the compiler can fully unroll the loops.
+ */
+
+static __inline__ u16 mst_check(const u16 *data_pos, u16 usn, u16 usa_count)
+{
+	u16 diff;
+
+	diff = 0;
+	while (usa_count--) {
+		diff |= *data_pos ^ usn;
+		data_pos += NTFS_BLOCK_SIZE/sizeof(u16);
+	}
+	return (diff);
+}
+
+static __inline__ void mst_restore(u16 *data_pos, const u16 *usa_pos,
+			u16 usa_count)
+{
+	while (usa_count--) {
+		*data_pos = *(++usa_pos);
+		data_pos += NTFS_BLOCK_SIZE/sizeof(u16);
+	}
+}
+
+static __inline__ void mst_protect(le16 *data_pos, le16 *usa_pos,
+			le16 le_usn, u16 usa_count)
+{
+	while (usa_count--) {
+		*(++usa_pos) = *data_pos;
+		*data_pos = le_usn;
+		data_pos += NTFS_BLOCK_SIZE/sizeof(le16);
+	}
+}
+
 /**
  * ntfs_mst_post_read_fixup - deprotect multi sector transfer protected data
  * @b:		pointer to the data to deprotect
@@ -50,7 +90,7 @@
 int ntfs_mst_post_read_fixup_warn(NTFS_RECORD *b, const u32 size,
 					BOOL warn)
 {
-	u16 usa_ofs, usa_count, usn;
+	u16 usa_ofs, usa_count, usn, diff;
 	u16 *usa_pos, *data_pos;
 
 	ntfs_log_trace("Entering\n");
@@ -89,9 +129,21 @@ int ntfs_mst_post_read_fixup_warn(NTFS_RECORD *b, const u32 size,
 	 */
 	data_pos = (u16*)b + NTFS_BLOCK_SIZE/sizeof(u16) - 1;
 	/*
-	 * Check for incomplete multi sector transfer(s).
+	 * Check for incomplete multi sector transfer(s), locating the
+	 * first one only when there is one.
 	 */
-	while (usa_count--) {
+	switch (usa_count) {
+	case 2 :
+		diff = mst_check(data_pos, usn, 2);
+		break;
+	case 8 :
+		diff = mst_check(data_pos, usn, 8);
+		break;
+	default :
+		diff = mst_check(data_pos, usn, usa_count);
+		break;
+	}
+	while (diff && usa_count--) {
 		if (*data_pos != usn) {
 			/*
 			 * Incomplete multi sector transfer detected! )-:
@@ -108,18 +160,20 @@ int ntfs_mst_post_read_fixup_warn(NTFS_RECORD *b, const u32 size,
 		}
 		data_pos += NTFS_BLOCK_SIZE/sizeof(u16);
 	}
-	/* Re-setup the variables. */
-	usa_count = le16_to_cpu(b->usa_count) - 1;
-	data_pos = (u16*)b + NTFS_BLOCK_SIZE/sizeof(u16) - 1;
-	/* Fixup all sectors. */
-	while (usa_count--) {
-		/*
-		 * Increment position in usa and restore original data from
-		 * the usa into the data buffer.
-		 */
-		*data_pos = *(++usa_pos);
-		/* Increment position in data as well. */
-		data_pos += NTFS_BLOCK_SIZE/sizeof(u16);
+	/*
+	 * Fixup all sectors, restoring the original data from the usa
+	 * into the data buffer.
+	 */
+	switch (usa_count) {
+	case 2 :
+		mst_restore(data_pos, usa_pos, 2);
+		break;
+	case 8 :
+		mst_restore(data_pos, usa_pos, 8);
+		break;
+	default :
+		mst_restore(data_pos, usa_pos, usa_count);
+		break;
 	}
 	return 0;
 }
@@ -194,17 +248,20 @@ int ntfs_mst_pre_write_fixup(NTFS_RECORD *b, const u32 size)
 	*usa_pos = le_usn;
 	/* Position in data of first le16 that needs fixing up. */
 	data_pos = (le16*)b + NTFS_BLOCK_SIZE/sizeof(le16) - 1;
-	/* Fixup all sectors. */
-	while (usa_count--) {
-		/*
-		 * Increment the position in the usa and save the
-		 * original data from the data buffer into the usa.
-		 */
-		*(++usa_pos) = *data_pos;
-		/* Apply fixup to data. */
-		*data_pos = le_usn;
-		/* Increment position in data as well. */
-		data_pos += NTFS_BLOCK_SIZE/sizeof(le16);
+	/*
+	 * Fixup all sectors, saving the original data from the data
+	 * buffer into the usa and applying the fixup to data.
+	 */
+	switch (usa_count) {
+	case 2 :
+		mst_protect(data_pos, usa_pos, le_usn, 2);
+		break;
+	case 8 :
+		mst_protect(data_pos, usa_pos, le_usn, 8);
+		break;
+	default :
+		mst_protect(data_pos, usa_pos, le_usn, usa_count);
+		break;
 	}
 	return 0;
 }
@@ -233,16 +290,20 @@ void ntfs_mst_post_write_fixup(NTFS_RECORD *b)
 	/* Position in protected data of first u16 that needs fixing up. */
 	data_pos = (u16*)b + NTFS_BLOCK_SIZE/sizeof(u16) - 1;
 
-	/* Fixup all sectors. */
-	while (usa_count--) {
-		/*
-		 * Increment position in usa and restore original data from
-		 * the usa into the data buffer.
-		 */
-		*data_pos = *(++usa_pos);
-
-		/* Increment position in data as well. */
-		data_pos += NTFS_BLOCK_SIZE/sizeof(u16);
+	/*
+	 * Fixup all sectors, restoring the original data from the usa
+	 * into the data buffer.
+	 */
+	switch (usa_count) {
+	case 2 :
+		mst_restore(data_pos, usa_pos, 2);
+		break;
+	case 8 :
+		mst_restore(data_pos, usa_pos, 8);
+		break;
+	default :
+		mst_restore(data_pos, usa_pos, usa_count);
+		break;
 	}
 }
 
@@ -179,20 +179,17 @@ static int set_object_id_index(ntfs_inode *ni, ntfs_index_context *xo,
 #endif /* HAVE_SETXATTR */
 
 /*
- *		Open the $Extend/$ObjId file and its index
+ *		Open the $Extend/$ObjId file
  *
- *	Return the index context if opened
+ *	Return the inode if opened
  *		or NULL if an error occurred (errno tells why)
- *
- *	The index has to be freed and inode closed when not needed any more.
  */
 
-static ntfs_index_context *open_object_id_index(ntfs_volume *vol)
+static ntfs_inode *open_object_id_inode(ntfs_volume *vol)
 {
 	u64 inum;
 	ntfs_inode *ni;
 	ntfs_inode *dir_ni;
-	ntfs_index_context *xo;
 
 		/* do not use path_name_to inode - could reopen root */
 	dir_ni = ntfs_inode_open(vol, FILE_Extend);
@@ -203,6 +200,24 @@ static ntfs_index_context *open_object_id_index(ntfs_volume *vol)
 			ni = ntfs_inode_open(vol, inum);
 		ntfs_inode_close(dir_ni);
 	}
+	return (ni);
+}
+
+/*
+ *		Open the $Extend/$ObjId file and its index
+ *
+ *	Return the index context if opened
+ *		or NULL if an error occurred (errno tells why)
+ *
+ *	The index has to be freed and inode closed when not needed any more.
+ */
+
+static ntfs_index_context *open_object_id_index(ntfs_volume *vol)
+{
+	ntfs_inode *ni;
+	ntfs_index_context *xo;
+
+	ni = open_object_id_inode(vol);
 	if (ni) {
 		xo = ntfs_index_ctx_get(ni, objid_index_name, 2);
 		if (!xo) {
@@ -213,6 +228,101 @@ static ntfs_index_context *open_object_id_index(ntfs_volume *vol)
 	return (xo);
 }
 
+struct OBJECT_ID_SCAN {
+	ntfs_inode *ni;
+	struct INDEX_SCAN *scan;
+} ;
+
+/*
+ *		Start listing the object ids of a volume
+ *
+ *	The entries of the $Extend/$ObjId index are read sequentially,
+ *	so that the object ids can be listed without examining every
+ *	file. The volume must not be modified until the scan is ended.
+ *
+ *	Returns the scan state,
+ *		or NULL if an error occurred (errno tells why)
+ */
+
+struct OBJECT_ID_SCAN *ntfs_object_id_scan_start(ntfs_volume *vol)
+{
+	struct OBJECT_ID_SCAN *os;
+	int err;
+
+	os = (struct OBJECT_ID_SCAN*)ntfs_malloc(
+				sizeof(struct OBJECT_ID_SCAN));
+	if (os) {
+		os->ni = open_object_id_inode(vol);
+		if (os->ni)
+			os->scan = ntfs_index_scan_start(os->ni,
+					objid_index_name, 2);
+		if (!os->ni || !os->scan) {
+			err = errno;
+			if (os->ni)
+				ntfs_inode_close(os->ni);
+			free(os);
+			os = (struct OBJECT_ID_SCAN*)NULL;
+			errno = err;
+		}
+	}
+	return (os);
+}
+
+/*
+ *		Get the next object id of a scan
+ *
+ *	Returns TRUE if an object id is returned,
+ *		FALSE after the last one
+ */
+
+BOOL ntfs_object_id_scan_next(struct OBJECT_ID_SCAN *os, u64 *mref,
+			GUID *object_id)
+{
+	INDEX_ENTRY *ie;
+	const OBJECT_ID_INDEX_DATA *data;
+	BOOL found;
+
+	found = FALSE;
+	while (!found && ntfs_index_scan_next(os->scan, &ie)) {
+		if ((le16_to_cpu(ie->key_length) >= sizeof(GUID))
+		    && (le16_to_cpu(ie->data_length)
+				>= sizeof(OBJECT_ID_INDEX_DATA))
+		    && ((u32)(le16_to_cpu(ie->data_offset)
+				+ le16_to_cpu(ie->data_length))
+				<= le16_to_cpu(ie->length))) {
+			data = (const OBJECT_ID_INDEX_DATA*)((const char*)ie
+					+ le16_to_cpu(ie->data_offset));
+			*mref = le64_to_cpu(data->file_id);
+			memcpy(object_id, &ie->key.object_id, sizeof(GUID));
+			found = TRUE;
+		}
+	}
+	return (found);
+}
+
+/*
+ *		End listing the object ids
+ *
+ *	Returns 0 if all the object ids could be listed,
+ *		or -1 if some could not (errno tells why)
+ */
+
+int ntfs_object_id_scan_end(struct OBJECT_ID_SCAN *os)
+{
+	int res;
+	int err;
+
+	res = ntfs_index_scan_end(os->scan);
+	err = errno;
+	if (ntfs_inode_close(os->ni) && !res) {
+		err = errno;
+		res = -1;
+	}
+	free(os);
+	errno = err;
+	return (res);
+}
+
 #ifdef HAVE_SETXATTR	/* extended attributes interface required */
 
 /*
@@ -471,13 +581,14 @@ int ntfs_delete_object_id_index(ntfs_inode *ni)
 int ntfs_get_ntfs_object_id(ntfs_inode *ni, char *value, size_t size)
 {
 	OBJECT_ID_ATTR full_objectid;
-	OBJECT_ID_ATTR *objectid_attr;
-	s64 attr_size;
+	const OBJECT_ID_ATTR *objectid_attr;
+	u32 attr_size;
 	int full_size;
 
 	full_size = 0;	/* default to no data and some error to be defined */
 	if (ni) {
-		objectid_attr = (OBJECT_ID_ATTR*)ntfs_attr_readall(ni,
+			/* the object id is always resident */
+		objectid_attr = (const OBJECT_ID_ATTR*)ntfs_attr_peek(ni,
 			AT_OBJECT_ID,(ntfschar*)NULL, 0, &attr_size);
 		if (objectid_attr) {
 				/* restrict to only GUID present in attr */
@@ -502,7 +613,6 @@ int ntfs_get_ntfs_object_id(ntfs_inode *ni, char *value, size_t size)
 				errno = EOPNOTSUPP;
 				full_size = 0;
 			}
-			free(objectid_attr);
 		} else
 			errno = ENODATA;
 	}
@@ -0,0 +1,1054 @@
+/**
+ * overlay.c : copy-on-write overlay over a read-only device
+ *
+ *      This module is part of ntfs-3g library
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef HAVE_WINDOWS_H
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_LIMITS_H
+#include <limits.h>
+#endif
+#ifdef HAVE_STDDEF_H
+#include <stddef.h>
+#endif
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_SYS_IOCTL_H
+#include <sys/ioctl.h>
+#endif
+#ifdef HAVE_SYS_MOUNT_H
+#include <sys/mount.h>
+#endif
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
+
+#include "types.h"
+#include "endians.h"
+#include "layout.h"
+#include "bitmap.h"
+#include "device.h"
+#include "overlay.h"
+#include "realpath.h"
+#include "misc.h"
+#include "logging.h"
+
+/*
+ *		Copy-on-write overlay over a read-only device
+ *
+ *	A device opened through the overlay operations is an overlay file
+ *	which designates a base device or image, which is never written
+ *	to. The blocks written are stored into the overlay, and the bitmap
+ *	of the blocks present in the overlay is updated after the data.
+ *	The reads are split into runs of blocks present or absent from
+ *	the overlay, the former being read from the overlay and the latter
+ *	from the base. A block partially written is first copied from the
+ *	base.
+ *
+ *	The overlay is created empty, so that a read-write mount of a big
+ *	image is immediate. Afterwards the blocks changed can be merged
+ *	into the base, or discarded.
+ */
+
+#define OVERLAY_DEFAULT_BLOCK 4096	/* when no cluster size is found */
+#define OVERLAY_MAX_BLOCK 65536		/* max NTFS cluster size */
+#define OVERLAY_MERGE_SIZE 1048576	/* max transfer when merging */
+
+#if defined(linux) && defined(_IOR) && !defined(BLKGETSIZE64)
+#define BLKGETSIZE64	_IOR(0x12,114,size_t)	/* Get device size in bytes. */
+#endif
+#if defined(linux) && defined(_IO) && !defined(BLKGETSIZE)
+#define BLKGETSIZE	_IO(0x12,96)  /* Get device size in 512-byte blocks. */
+#endif
+#if defined(linux) && defined(_IO) && !defined(BLKSSZGET)
+#define BLKSSZGET	_IO(0x12,104) /* Get device sector size in bytes. */
+#endif
+
+struct OVERLAY {
+	int fd;			/* the overlay file */
+	int base_fd;		/* the base device or image */
+	BOOL writable;
+	BOOL base_writable;
+	BOOL base_is_file;
+	BOOL dirty;		/* the overlay has to be synced */
+	u32 block_size;
+	u32 block_bits;
+	s64 base_size;
+	s64 base_mtime;
+	s64 blocks;		/* blocks on the base */
+	s64 bitmap_offset;
+	s64 bitmap_size;	/* bytes */
+	s64 data_offset;
+	s64 changed;		/* count of blocks in the overlay */
+	s64 pos;		/* position for seek, read and write */
+	u8 *bitmap;
+	char *base_name;
+#ifdef ENABLE_THREADS
+	pthread_mutex_t lock;	/* protects the bitmap and the copies */
+#endif
+} ;
+
+#define DEV_OVERLAY(dev) ((struct OVERLAY*)(dev)->d_private)
+
+static void overlay_lock(struct OVERLAY *ovl
+#ifndef ENABLE_THREADS
+			__attribute__((unused))
+#endif
+			)
+{
+#ifdef ENABLE_THREADS
+	pthread_mutex_lock(&ovl->lock);
+#endif
+}
+
+static void overlay_unlock(struct OVERLAY *ovl
+#ifndef ENABLE_THREADS
+			__attribute__((unused))
+#endif
+			)
+{
+#ifdef ENABLE_THREADS
+	pthread_mutex_unlock(&ovl->lock);
+#endif
+}
+
+/*
+ *		Read or write a full buffer
+ *
+ *	Returns 0 if successful, and -1 otherwise, with errno set
+ *	(EIO when the end of the file is met on a read).
+ */
+
+static int read_full(int fd, void *buf, s64 count, s64 pos)
+{
+	ssize_t n;
+
+	while (count > 0) {
+		n = pread(fd, buf, count, pos);
+		if (n <= 0) {
+			if (!n)
+				errno = EIO;
+			if (n && (errno == EINTR))
+				continue;
+			return (-1);
+		}
+		buf = (char*)buf + n;
+		pos += n;
+		count -= n;
+	}
+	return (0);
+}
+
+static int write_full(int fd, const void *buf, s64 count, s64 pos)
+{
+	ssize_t n;
+
+	while (count > 0) {
+		n = pwrite(fd, buf, count, pos);
+		if (n <= 0) {
+			if (!n)
+				errno = EIO;
+			if (n && (errno == EINTR))
+				continue;
+			return (-1);
+		}
+		buf = (const char*)buf + n;
+		pos += n;
+		count -= n;
+	}
+	return (0);
+}
+
+/*
+ *		Lock or unlock a whole file
+ */
+
+static int lock_file(int fd, short type, const char *name)
+{
+	struct flock flk;
+
+	memset(&flk, 0, sizeof(flk));
+	flk.l_type = type;
+	flk.l_whence = SEEK_SET;
+	flk.l_start = flk.l_len = 0LL;
+	if (fcntl(fd, F_SETLK, &flk)) {
+		if (type != F_UNLCK)
+			ntfs_log_perror("Failed to %s lock '%s'",
+				(type == F_WRLCK ? "write" : "read"), name);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ *		Get the size of a device or image
+ */
+
+static s64 base_size_get(int fd)
+{
+#ifdef BLKGETSIZE64
+	u64 size;
+
+	if (ioctl(fd, BLKGETSIZE64, &size) >= 0)
+		return (size);
+#endif
+	return (lseek(fd, 0, SEEK_END));
+}
+
+static void overlay_free(struct OVERLAY *ovl)
+{
+	if (ovl->base_fd >= 0) {
+		lock_file(ovl->base_fd, F_UNLCK, ovl->base_name);
+		close(ovl->base_fd);
+	}
+	if (ovl->fd >= 0) {
+		lock_file(ovl->fd, F_UNLCK, ovl->base_name);
+		close(ovl->fd);
+	}
+#ifdef ENABLE_THREADS
+	pthread_mutex_destroy(&ovl->lock);
+#endif
+	free(ovl->bitmap);
+	free(ovl->base_name);
+	free(ovl);
+}
+
+/*
+ *		Check the header of an overlay file
+ *
+ *	Returns the number of bits of the block size, or -1 if the header
+ *	is not sane.
+ */
+
+static int check_header(const struct NTFS_OVERLAY_HEADER *header)
+{
+	u32 block_size;
+	u32 name_length;
+	s64 base_size;
+	s64 bitmap_offset;
+	s64 data_offset;
+	int bits;
+
+	block_size = le32_to_cpu(header->block_size);
+	name_length = le32_to_cpu(header->name_length);
+	base_size = sle64_to_cpu(header->base_size);
+	bitmap_offset = sle64_to_cpu(header->bitmap_offset);
+	data_offset = sle64_to_cpu(header->data_offset);
+	if (memcmp(header->magic, NTFS_OVERLAY_MAGIC, 8)
+	    || (block_size < NTFS_BLOCK_SIZE)
+	    || (block_size > OVERLAY_MAX_BLOCK)
+	    || (block_size & (block_size - 1))
+	    || !name_length
+	    || (name_length >= (NTFS_OVERLAY_HEADER_SIZE
+			- sizeof(struct NTFS_OVERLAY_HEADER)))
+	    || header->base_name[name_length]
+	    || (base_size <= 0)
+	    || (bitmap_offset < NTFS_OVERLAY_HEADER_SIZE)
+	    || (data_offset < (bitmap_offset
+			+ (((base_size + block_size - 1)/block_size + 7) >> 3)))
+	    || (data_offset & (block_size - 1)))
+		return (-1);
+	for (bits=0; (1U << bits) < block_size; bits++) { }
+	return (bits);
+}
+
+/*
+ *		Open an overlay file and its base, and load the bitmap
+ *
+ *	The base is opened read-write only for merging the overlay.
+ *	Returns the overlay state, or NULL if it could not be opened
+ *	(errno is set).
+ */
+
+static struct OVERLAY *overlay_load(const char *name, BOOL writable,
+			BOOL base_writable)
+{
+	struct NTFS_OVERLAY_HEADER *header;
+	struct OVERLAY *ovl;
+	struct stat st;
+	char *buf;
+	le64 mtime;
+	int bits;
+	int err;
+
+	ovl = (struct OVERLAY*)ntfs_calloc(sizeof(struct OVERLAY));
+	buf = (char*)ntfs_malloc(NTFS_OVERLAY_HEADER_SIZE);
+	if (!ovl || !buf) {
+		free(ovl);
+		free(buf);
+		return ((struct OVERLAY*)NULL);
+	}
+	ovl->fd = -1;
+	ovl->base_fd = -1;
+#ifdef ENABLE_THREADS
+	pthread_mutex_init(&ovl->lock, NULL);
+#endif
+	ovl->writable = writable;
+	ovl->base_writable = base_writable;
+	header = (struct NTFS_OVERLAY_HEADER*)buf;
+	ovl->fd = open(name, (writable ? O_RDWR : O_RDONLY));
+	if (ovl->fd < 0) {
+		err = errno;
+		ntfs_log_perror("Failed to open overlay '%s'", name);
+		goto out;
+	}
+	if (lock_file(ovl->fd, (writable ? F_WRLCK : F_RDLCK), name)) {
+		err = errno;
+		goto out;
+	}
+	if (read_full(ovl->fd, buf, NTFS_OVERLAY_HEADER_SIZE, 0)
+	    || ((bits = check_header(header)) < 0)) {
+		err = EINVAL;
+		ntfs_log_error("'%s' is not an overlay file\n", name);
+		goto out;
+	}
+	ovl->block_size = le32_to_cpu(header->block_size);
+	ovl->block_bits = bits;
+	ovl->base_size = sle64_to_cpu(header->base_size);
+	ovl->base_mtime = sle64_to_cpu(header->base_mtime);
+	ovl->bitmap_offset = sle64_to_cpu(header->bitmap_offset);
+	ovl->data_offset = sle64_to_cpu(header->data_offset);
+	ovl->blocks = (ovl->base_size + ovl->block_size - 1) >> bits;
+	ovl->bitmap_size = (ovl->blocks + 7) >> 3;
+	ovl->base_name = strdup(header->base_name);
+		/* the bitmap is allocated in full words */
+	ovl->bitmap = (u8*)ntfs_calloc((ovl->bitmap_size + 7) & -8);
+	if (!ovl->base_name || !ovl->bitmap) {
+		err = ENOMEM;
+		goto out;
+	}
+	if (read_full(ovl->fd, ovl->bitmap, ovl->bitmap_size,
+			ovl->bitmap_offset)) {
+		err = errno;
+		ntfs_log_perror("Failed to read the bitmap of '%s'", name);
+		goto out;
+	}
+	ovl->changed = ntfs_bitmap_count_set(ovl->bitmap, 0, ovl->blocks);
+
+	ovl->base_fd = open(ovl->base_name,
+			(base_writable ? O_RDWR : O_RDONLY));
+	if ((ovl->base_fd < 0) || fstat(ovl->base_fd, &st)) {
+		err = errno;
+		ntfs_log_perror("Failed to open the base '%s'",
+				ovl->base_name);
+		goto out;
+	}
+	if (lock_file(ovl->base_fd, (base_writable ? F_WRLCK : F_RDLCK),
+			ovl->base_name)) {
+		err = errno;
+		goto out;
+	}
+	if (base_size_get(ovl->base_fd) != ovl->base_size) {
+		err = EINVAL;
+		ntfs_log_error("The size of '%s' has changed since the "
+				"overlay '%s' was created\n",
+				ovl->base_name, name);
+		goto out;
+	}
+		/* an image modified since is only accepted if unused */
+	ovl->base_is_file = S_ISREG(st.st_mode);
+	if (ovl->base_is_file && ((s64)st.st_mtime != ovl->base_mtime)) {
+		if (ovl->changed) {
+			err = EINVAL;
+			ntfs_log_error("'%s' has been modified since the "
+					"overlay '%s' was created\n",
+					ovl->base_name, name);
+			goto out;
+		}
+		if (writable) {
+			ovl->base_mtime = st.st_mtime;
+			mtime = cpu_to_sle64(ovl->base_mtime);
+			if (write_full(ovl->fd, &mtime, sizeof(mtime),
+				offsetof(struct NTFS_OVERLAY_HEADER,
+					base_mtime))) {
+				err = errno;
+				goto out;
+			}
+		}
+	}
+	free(buf);
+	return (ovl);
+out :
+	free(buf);
+	overlay_free(ovl);
+	errno = err;
+	return ((struct OVERLAY*)NULL);
+}
+
+/*
+ *		Write the bitmap bytes covering a range of blocks
+ *
+ *	Must be called with the overlay locked
+ */
+
+static int write_bitmap(struct OVERLAY *ovl, s64 first, s64 last)
+{
+	s64 start;
+	s64 end;
+
+	start = first >> 3;
+	end = (last >> 3) + 1;
+	return (write_full(ovl->fd, &ovl->bitmap[start], end - start,
+				ovl->bitmap_offset + start));
+}
+
+/*
+ *		Copy a block from the base into the overlay
+ *
+ *	Must be called with the overlay locked
+ */
+
+static int copy_block(struct OVERLAY *ovl, s64 block, char *buf)
+{
+	s64 pos;
+	s64 count;
+
+	pos = block << ovl->block_bits;
+	count = ovl->block_size;
+	if (count > (ovl->base_size - pos))
+		count = ovl->base_size - pos;
+	if (read_full(ovl->base_fd, buf, count, pos)
+	    || write_full(ovl->fd, buf, count, ovl->data_offset + pos))
+		return (-1);
+	return (0);
+}
+
+static s64 overlay_pread(struct OVERLAY *ovl, void *buf, s64 count, s64 pos)
+{
+	s64 block;
+	s64 end_block;
+	s64 next;
+	s64 done;
+	s64 n;
+	ssize_t br;
+	BOOL present;
+
+	if ((count < 0) || (pos < 0)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (pos >= ovl->base_size)
+		return (0);
+	if (count > (ovl->base_size - pos))
+		count = ovl->base_size - pos;
+	done = 0;
+	while (done < count) {
+			/* get the run of blocks in the same state */
+		block = (pos + done) >> ovl->block_bits;
+		end_block = ((pos + count - 1) >> ovl->block_bits) + 1;
+		overlay_lock(ovl);
+		present = ntfs_bit_get(ovl->bitmap, block);
+		if (present)
+			next = ntfs_bitmap_find_zero(ovl->bitmap,
+					block, end_block);
+		else
+			next = ntfs_bitmap_find_set(ovl->bitmap,
+					block, end_block);
+		overlay_unlock(ovl);
+		if (next < 0)
+			n = count - done;
+		else
+			n = (next << ovl->block_bits) - pos - done;
+		if (present)
+			br = pread(ovl->fd, (char*)buf + done, n,
+					ovl->data_offset + pos + done);
+		else
+			br = pread(ovl->base_fd, (char*)buf + done, n,
+					pos + done);
+		if (br <= 0) {
+			if (br && (errno == EINTR))
+				continue;
+			return (done ? done : br);
+		}
+		done += br;
+	}
+	return (done);
+}
+
+static s64 overlay_pwrite(struct OVERLAY *ovl, const void *buf, s64 count,
+			s64 pos)
+{
+	s64 first;
+	s64 last;
+	s64 end;
+	char *copy;
+	int res;
+
+	if ((count < 0) || (pos < 0)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (!count)
+		return (0);
+	if (pos >= ovl->base_size) {
+		errno = ENOSPC;
+		return (-1);
+	}
+	if (count > (ovl->base_size - pos))
+		count = ovl->base_size - pos;
+	end = pos + count;
+	first = pos >> ovl->block_bits;
+	last = (end - 1) >> ovl->block_bits;
+	copy = (char*)NULL;
+	res = 0;
+	overlay_lock(ovl);
+		/* first copy the blocks partially written */
+	if (((pos & (ovl->block_size - 1))
+		|| ((first == last) && (end < ovl->base_size)
+			&& (end & (ovl->block_size - 1))))
+	    && !ntfs_bit_get(ovl->bitmap, first)) {
+		copy = (char*)ntfs_malloc(ovl->block_size);
+		res = (copy ? copy_block(ovl, first, copy) : -1);
+	}
+	if (!res && (last != first)
+	    && (end < ovl->base_size) && (end & (ovl->block_size - 1))
+	    && !ntfs_bit_get(ovl->bitmap, last)) {
+		if (!copy)
+			copy = (char*)ntfs_malloc(ovl->block_size);
+		res = (copy ? copy_block(ovl, last, copy) : -1);
+	}
+		/* the data has to be present before being declared */
+	if (!res)
+		res = write_full(ovl->fd, buf, count, ovl->data_offset + pos);
+	if (!res && (ntfs_bitmap_find_zero(ovl->bitmap, first, last + 1) >= 0)) {
+		ovl->changed += (last + 1 - first)
+			- ntfs_bitmap_count_set(ovl->bitmap, first, last + 1);
+		ntfs_bitmap_fill(ovl->bitmap, first, last + 1);
+		res = write_bitmap(ovl, first, last);
+	}
+	if (!res)
+		ovl->dirty = TRUE;
+	overlay_unlock(ovl);
+	free(copy);
+	return (res ? -1 : count);
+}
+
+/**
+ * ntfs_device_overlay_io_open - Open an overlay file and its base
+ * @dev:
+ * @flags:
+ *
+ * The name of the device is the name of the overlay file, the base is
+ * always opened read-only.
+ *
+ * Returns:
+ */
+static int ntfs_device_overlay_io_open(struct ntfs_device *dev, int flags)
+{
+	struct OVERLAY *ovl;
+
+	if (NDevOpen(dev)) {
+		errno = EBUSY;
+		return -1;
+	}
+	ovl = overlay_load(dev->d_name, (flags & O_RDWR) == O_RDWR, FALSE);
+	if (!ovl)
+		return -1;
+	dev->d_private = ovl;
+	if (!ovl->writable)
+		NDevSetReadOnly(dev);
+	NDevSetOpen(dev);
+	return 0;
+}
+
+/**
+ * ntfs_device_overlay_io_close - Close an overlay file and its base
+ * @dev:
+ *
+ * Returns:
+ */
+static int ntfs_device_overlay_io_close(struct ntfs_device *dev)
+{
+	struct OVERLAY *ovl;
+	int res;
+
+	if (!NDevOpen(dev)) {
+		errno = EBADF;
+		ntfs_log_perror("Device %s is not open", dev->d_name);
+		return -1;
+	}
+	ovl = DEV_OVERLAY(dev);
+	res = 0;
+	if (ovl->dirty && fsync(ovl->fd)) {
+		ntfs_log_perror("Failed to fsync overlay %s", dev->d_name);
+		res = -1;
+	}
+	overlay_free(ovl);
+	dev->d_private = NULL;
+	NDevClearOpen(dev);
+	NDevClearDirty(dev);
+	return res;
+}
+
+static s64 ntfs_device_overlay_io_seek(struct ntfs_device *dev, s64 offset,
+		int whence)
+{
+	struct OVERLAY *ovl = DEV_OVERLAY(dev);
+
+	switch (whence) {
+	case SEEK_SET :
+		break;
+	case SEEK_CUR :
+		offset += ovl->pos;
+		break;
+	case SEEK_END :
+		offset += ovl->base_size;
+		break;
+	default :
+		offset = -1;
+		break;
+	}
+	if (offset < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	ovl->pos = offset;
+	return offset;
+}
+
+static s64 ntfs_device_overlay_io_read(struct ntfs_device *dev, void *buf,
+		s64 count)
+{
+	struct OVERLAY *ovl = DEV_OVERLAY(dev);
+	s64 br;
+
+	br = overlay_pread(ovl, buf, count, ovl->pos);
+	if (br > 0)
+		ovl->pos += br;
+	return br;
+}
+
+static s64 ntfs_device_overlay_io_write(struct ntfs_device *dev,
+		const void *buf, s64 count)
+{
+	struct OVERLAY *ovl = DEV_OVERLAY(dev);
+	s64 bw;
+
+	if (NDevReadOnly(dev)) {
+		errno = EROFS;
+		return -1;
+	}
+	NDevSetDirty(dev);
+	bw = overlay_pwrite(ovl, buf, count, ovl->pos);
+	if (bw > 0)
+		ovl->pos += bw;
+	return bw;
+}
+
+static s64 ntfs_device_overlay_io_pread(struct ntfs_device *dev, void *buf,
+		s64 count, s64 offset)
+{
+	return overlay_pread(DEV_OVERLAY(dev), buf, count, offset);
+}
+
+static s64 ntfs_device_overlay_io_pwrite(struct ntfs_device *dev,
+		const void *buf, s64 count, s64 offset)
+{
+	if (NDevReadOnly(dev)) {
+		errno = EROFS;
+		return -1;
+	}
+	NDevSetDirty(dev);
+	return overlay_pwrite(DEV_OVERLAY(dev), buf, count, offset);
+}
+
+static int ntfs_device_overlay_io_sync(struct ntfs_device *dev)
+{
+	struct OVERLAY *ovl = DEV_OVERLAY(dev);
+	int res = 0;
+
+	if (!NDevReadOnly(dev) && ovl->dirty) {
+		res = fsync(ovl->fd);
+		if (res)
+			ntfs_log_perror("Failed to sync overlay %s",
+					dev->d_name);
+		else {
+			ovl->dirty = FALSE;
+			NDevClearDirty(dev);
+		}
+	}
+	return res;
+}
+
+/*
+ *		Get information about the device
+ *
+ *	This is the information about the overlay file, with the size
+ *	of the base.
+ */
+
+static int ntfs_device_overlay_io_stat(struct ntfs_device *dev,
+		struct stat *buf)
+{
+	struct OVERLAY *ovl = DEV_OVERLAY(dev);
+
+	if (fstat(ovl->fd, buf))
+		return -1;
+	buf->st_size = ovl->base_size;
+	return 0;
+}
+
+/*
+ *		Perform an ioctl on the device
+ *
+ *	Only the requests getting the size are supported, the others
+ *	could bypass the overlay.
+ */
+
+static int ntfs_device_overlay_io_ioctl(struct ntfs_device *dev,
+		int request, void *argp)
+{
+	struct OVERLAY *ovl = DEV_OVERLAY(dev);
+
+	switch (request) {
+#ifdef BLKGETSIZE64
+	case BLKGETSIZE64 :
+		*(u64*)argp = ovl->base_size;
+		return 0;
+#endif
+#ifdef BLKGETSIZE
+	case BLKGETSIZE :
+		*(unsigned long*)argp = ovl->base_size >> 9;
+		return 0;
+#endif
+#ifdef BLKSSZGET
+	case BLKSSZGET :
+		if (ovl->base_is_file)
+			break;
+		return ioctl(ovl->base_fd, request, argp);
+#endif
+	default :
+		break;
+	}
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+/**
+ * Device operations for a copy-on-write overlay over a read-only device
+ */
+struct ntfs_device_operations ntfs_device_overlay_io_ops = {
+	.open		= ntfs_device_overlay_io_open,
+	.close		= ntfs_device_overlay_io_close,
+	.seek		= ntfs_device_overlay_io_seek,
+	.read		= ntfs_device_overlay_io_read,
+	.write		= ntfs_device_overlay_io_write,
+	.pread		= ntfs_device_overlay_io_pread,
+	.pwrite		= ntfs_device_overlay_io_pwrite,
+	.sync		= ntfs_device_overlay_io_sync,
+	.stat		= ntfs_device_overlay_io_stat,
+	.ioctl		= ntfs_device_overlay_io_ioctl,
+};
+
+/*
+ *		Get the cluster size of the NTFS volume on a base
+ *
+ *	Returns the default block size if there is no NTFS boot sector.
+ */
+
+static u32 base_cluster_size(int fd)
+{
+	NTFS_BOOT_SECTOR bs;
+	u32 sector_size;
+	u32 cluster_size;
+	u8 spc;
+
+	cluster_size = OVERLAY_DEFAULT_BLOCK;
+	if (!read_full(fd, &bs, sizeof(bs), 0)
+	    && (bs.oem_id == magicNTFS)) {
+		sector_size = le16_to_cpu(bs.bpb.bytes_per_sector);
+		spc = bs.bpb.sectors_per_cluster;
+		if (spc > 0x80)
+			cluster_size = sector_size << (256 - spc);
+		else
+			cluster_size = sector_size * spc;
+		if ((cluster_size < NTFS_BLOCK_SIZE)
+		    || (cluster_size > OVERLAY_MAX_BLOCK)
+		    || (cluster_size & (cluster_size - 1)))
+			cluster_size = OVERLAY_DEFAULT_BLOCK;
+	}
+	return (cluster_size);
+}
+
+/**
+ * ntfs_overlay_create - create an empty overlay over a device or image
+ * @base_name:		the device or image to protect
+ * @overlay_name:	the overlay file to create, it must not exist
+ * @block_size:		granularity of the copies, zero for the cluster
+ *			size of the NTFS volume on the base
+ *
+ * Only the header and the empty bitmap are written, the data area is
+ * sparse. The absolute path of the base is recorded in the overlay.
+ *
+ * Return 0 if successful, or -1 with errno set.
+ */
+int ntfs_overlay_create(const char *base_name, const char *overlay_name,
+			u32 block_size)
+{
+	struct NTFS_OVERLAY_HEADER *header;
+	char path[PATH_MAX];
+	struct stat st;
+	s64 base_size;
+	s64 bitmap_size;
+	s64 data_offset;
+	char *buf;
+	int base_fd;
+	int fd;
+	int err;
+
+	if (block_size && ((block_size < NTFS_BLOCK_SIZE)
+			|| (block_size > OVERLAY_MAX_BLOCK)
+			|| (block_size & (block_size - 1)))) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (!ntfs_realpath_canonicalize(base_name, path)) {
+		ntfs_log_perror("Failed to resolve '%s'", base_name);
+		return (-1);
+	}
+	if ((strlen(path) + sizeof(struct NTFS_OVERLAY_HEADER))
+			>= NTFS_OVERLAY_HEADER_SIZE) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+	base_fd = open(path, O_RDONLY);
+	if ((base_fd < 0) || fstat(base_fd, &st)) {
+		ntfs_log_perror("Failed to open '%s'", path);
+		if (base_fd >= 0)
+			close(base_fd);
+		return (-1);
+	}
+	base_size = base_size_get(base_fd);
+	if (!block_size)
+		block_size = base_cluster_size(base_fd);
+	close(base_fd);
+	if (base_size <= 0) {
+		errno = EINVAL;
+		ntfs_log_error("'%s' is empty\n", path);
+		return (-1);
+	}
+	bitmap_size = ((base_size + block_size - 1)/block_size + 7) >> 3;
+	data_offset = (NTFS_OVERLAY_HEADER_SIZE + bitmap_size
+			+ block_size - 1) & -(s64)block_size;
+	buf = (char*)ntfs_calloc(NTFS_OVERLAY_HEADER_SIZE);
+	if (!buf)
+		return (-1);
+	header = (struct NTFS_OVERLAY_HEADER*)buf;
+	memcpy(header->magic, NTFS_OVERLAY_MAGIC, 8);
+	header->block_size = cpu_to_le32(block_size);
+	header->name_length = cpu_to_le32(strlen(path));
+	header->base_size = cpu_to_sle64(base_size);
+	header->base_mtime = cpu_to_sle64(S_ISREG(st.st_mode)
+				? (s64)st.st_mtime : 0);
+	header->bitmap_offset = cpu_to_sle64(NTFS_OVERLAY_HEADER_SIZE);
+	header->data_offset = cpu_to_sle64(data_offset);
+	strcpy(header->base_name, path);
+	fd = open(overlay_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		err = errno;
+		ntfs_log_perror("Failed to create '%s'", overlay_name);
+		free(buf);
+		errno = err;
+		return (-1);
+	}
+		/* the bitmap and the data area are left sparse */
+	if (write_full(fd, buf, NTFS_OVERLAY_HEADER_SIZE, 0)
+	    || ftruncate(fd, data_offset)
+	    || fsync(fd)) {
+		err = errno;
+		ntfs_log_perror("Failed to write '%s'", overlay_name);
+		close(fd);
+		unlink(overlay_name);
+		free(buf);
+		errno = err;
+		return (-1);
+	}
+	free(buf);
+	return (close(fd));
+}
+
+/**
+ * ntfs_overlay_info - get information about an overlay
+ * @overlay_name:	the overlay file
+ * @info:		where to store the information
+ *
+ * The name of the base has to be freed by the caller.
+ *
+ * Return 0 if successful, or -1 with errno set.
+ */
+int ntfs_overlay_info(const char *overlay_name,
+			struct NTFS_OVERLAY_INFO *info)
+{
+	struct OVERLAY *ovl;
+
+	ovl = overlay_load(overlay_name, FALSE, FALSE);
+	if (!ovl)
+		return (-1);
+	info->base_name = ovl->base_name;
+	ovl->base_name = (char*)NULL;
+	info->base_size = ovl->base_size;
+	info->block_size = ovl->block_size;
+	info->changed_blocks = ovl->changed;
+	overlay_free(ovl);
+	return (0);
+}
+
+/*
+ *		Empty an overlay
+ *
+ *	The bitmap is cleared, the data area is deallocated, and the
+ *	current time of modification of the base is recorded.
+ */
+
+static int overlay_reset(struct OVERLAY *ovl)
+{
+	struct stat st;
+	le64 mtime;
+
+	memset(ovl->bitmap, 0, ovl->bitmap_size);
+	if (write_full(ovl->fd, ovl->bitmap, ovl->bitmap_size,
+			ovl->bitmap_offset)
+	    || ftruncate(ovl->fd, ovl->data_offset))
+		return (-1);
+	ovl->changed = 0;
+	if (ovl->base_is_file && !fstat(ovl->base_fd, &st)) {
+		mtime = cpu_to_sle64((s64)st.st_mtime);
+		if (write_full(ovl->fd, &mtime, sizeof(mtime),
+			offsetof(struct NTFS_OVERLAY_HEADER, base_mtime)))
+			return (-1);
+	}
+	return (fsync(ovl->fd));
+}
+
+/**
+ * ntfs_overlay_merge - write the blocks of an overlay into its base
+ * @overlay_name:	the overlay file
+ *
+ * The runs of blocks present in the overlay are copied to the base,
+ * which is then synced, and the overlay is emptied, so that it can be
+ * used again.
+ *
+ * Return the count of blocks merged, or -1 with errno set.
+ */
+s64 ntfs_overlay_merge(const char *overlay_name)
+{
+	struct OVERLAY *ovl;
+	char *buf;
+	s64 block;
+	s64 next;
+	s64 pos;
+	s64 end;
+	s64 n;
+	s64 merged;
+	int err;
+
+	ovl = overlay_load(overlay_name, TRUE, TRUE);
+	if (!ovl)
+		return (-1);
+	buf = (char*)ntfs_malloc(OVERLAY_MERGE_SIZE);
+	if (!buf) {
+		overlay_free(ovl);
+		return (-1);
+	}
+	merged = ovl->changed;
+	err = 0;
+	block = 0;
+	while (!err && (block < ovl->blocks)
+	    && ((block = ntfs_bitmap_find_set(ovl->bitmap, block,
+				ovl->blocks)) >= 0)) {
+		next = ntfs_bitmap_find_zero(ovl->bitmap, block, ovl->blocks);
+		if (next < 0)
+			next = ovl->blocks;
+		pos = block << ovl->block_bits;
+		end = next << ovl->block_bits;
+		if (end > ovl->base_size)
+			end = ovl->base_size;
+		while (!err && (pos < end)) {
+			n = end - pos;
+			if (n > OVERLAY_MERGE_SIZE)
+				n = OVERLAY_MERGE_SIZE;
+			if (read_full(ovl->fd, buf, n, ovl->data_offset + pos)
+			    || write_full(ovl->base_fd, buf, n, pos))
+				err = errno;
+			pos += n;
+		}
+		block = next;
+	}
+	if (!err && fsync(ovl->base_fd))
+		err = errno;
+	if (err)
+		ntfs_log_error("Failed to merge '%s' into '%s' : %s\n",
+				overlay_name, ovl->base_name, strerror(err));
+	else
+		if (overlay_reset(ovl))
+			err = errno;
+	free(buf);
+	overlay_free(ovl);
+	if (err) {
+		errno = err;
+		return (-1);
+	}
+	return (merged);
+}
+
+/**
+ * ntfs_overlay_discard - discard the blocks of an overlay
+ * @overlay_name:	the overlay file
+ *
+ * The overlay is emptied, so that it can be used again.
+ *
+ * Return 0 if successful, or -1 with errno set.
+ */
+int ntfs_overlay_discard(const char *overlay_name)
+{
+	struct OVERLAY *ovl;
+	int res;
+
+	ovl = overlay_load(overlay_name, TRUE, FALSE);
+	if (!ovl)
+		return (-1);
+	res = overlay_reset(ovl);
+	overlay_free(ovl);
+	return (res);
+}
+
+#endif /* HAVE_WINDOWS_H */
@@ -59,6 +59,8 @@
 #include "lcnalloc.h"
 #include "logging.h"
 #include "misc.h"
+#include "cache.h"
+#include "lock.h"
 #include "reparse.h"
 
 struct MOUNT_POINT_REPARSE_DATA {      /* reparse data for junctions */
@@ -708,6 +710,104 @@ static char *ntfs_get_rellink(ntfs_inode *ni, ntfschar *junction, int count)
 	return (target);
 }
 
+#if CACHE_SYMLINK_SIZE
+
+/*
+ *		The resolved targets of symbolic links and junctions are kept
+ *	in a volume-wide LRU cache, so that a repeated readlink() or stat()
+ *	does not have to walk the target path again. The entries are keyed
+ *	by inode number and sequence number, and hold a copy of the reparse
+ *	data, so that changing the reparse data misses the stale entry.
+ *	As the resolution depends on the names found along the target path,
+ *	each entry also records the directory generation of the volume, which
+ *	is bumped on every change to a directory.
+ */
+
+int ntfs_symlink_hash(const struct CACHED_GENERIC *item)
+{
+	return (((const struct CACHED_SYMLINK*)item)->inum & 0x7fffffff);
+}
+
+static int symlink_cache_compare(const struct CACHED_GENERIC *cached,
+			const struct CACHED_GENERIC *wanted)
+{
+	const struct CACHED_SYMLINK *c = (const struct CACHED_SYMLINK*)cached;
+	const struct CACHED_SYMLINK *w = (const struct CACHED_SYMLINK*)wanted;
+
+	return (c->inum != w->inum
+		|| c->generation != w->generation
+		|| c->sequence_number != w->sequence_number
+		|| c->reparse_size != w->reparse_size
+		|| memcmp(c->data, w->data, w->reparse_size));
+}
+
+/*
+ *		Get the cached target of a symlink
+ *
+ *	Returns the target (to be freed by caller), or NULL if not cached
+ */
+
+static char *fetch_symlink(ntfs_inode *ni, const REPARSE_POINT *reparse_attr,
+			int reparse_size)
+{
+	ntfs_volume *vol;
+	struct CACHED_SYMLINK item;
+	struct CACHED_SYMLINK *cached;
+	char *target;
+
+	target = (char*)NULL;
+	vol = ni->vol;
+	if (vol->symlink_cache) {
+		item.inum = ni->mft_no;
+		item.generation = vol->dir_generation;
+		item.sequence_number = ni->mrec->sequence_number;
+		item.reparse_size = reparse_size;
+		item.data = (char*)reparse_attr;
+		ntfs_cache_lock(vol);
+		cached = (struct CACHED_SYMLINK*)ntfs_fetch_cache(
+				vol->symlink_cache, GENERIC(&item),
+				symlink_cache_compare);
+		if (cached)
+			target = strdup(&cached->data[reparse_size]);
+		ntfs_cache_unlock(vol);
+	}
+	return (target);
+}
+
+/*
+ *		Cache the target of a symlink
+ */
+
+static void enter_symlink(ntfs_inode *ni, const REPARSE_POINT *reparse_attr,
+			int reparse_size, const char *target)
+{
+	ntfs_volume *vol;
+	struct CACHED_SYMLINK item;
+	int size;
+
+	vol = ni->vol;
+	if (vol->symlink_cache) {
+		size = reparse_size + strlen(target) + 1;
+		item.data = (char*)ntfs_malloc(size);
+		if (item.data) {
+			memcpy(item.data, reparse_attr, reparse_size);
+			strcpy(&item.data[reparse_size], target);
+			item.datasize = size;
+			item.inum = ni->mft_no;
+			item.generation = vol->dir_generation;
+			item.sequence_number = ni->mrec->sequence_number;
+			item.reparse_size = reparse_size;
+			ntfs_cache_lock(vol);
+			ntfs_enter_cache(vol->symlink_cache, GENERIC(&item),
+					symlink_cache_compare);
+			ntfs_cache_unlock(vol);
+			free(item.data);
+		}
+	}
+}
+
+#endif /* CACHE_SYMLINK_SIZE */
+
 /*
  *		Get the target for a junction point or symbolic link
  *	Should only be called for files or directories with reparse data
@@ -729,6 +829,9 @@ char *ntfs_make_symlink(ntfs_inode *ni, const char *mnt_point,
 	REPARSE_POINT *reparse_attr;
 	struct MOUNT_POINT_REPARSE_DATA *mount_point_data;
 	struct SYMLINK_REPARSE_DATA *symlink_data;
+#if CACHE_SYMLINK_SIZE
+	REPARSE_POINT *saved_attr;
+#endif
 	enum { FULL_TARGET, ABS_TARGET, REL_TARGET } kind;
 	ntfschar *p;
 	BOOL bad;
@@ -741,6 +844,25 @@ char *ntfs_make_symlink(ntfs_inode *ni, const char *mnt_point,
 	vol = ni->vol;
 	reparse_attr = (REPARSE_POINT*)ntfs_attr_readall(ni,
 			AT_REPARSE_POINT,(ntfschar*)NULL, 0, &attr_size);
+#if CACHE_SYMLINK_SIZE
+	saved_attr = (REPARSE_POINT*)NULL;
+	if (reparse_attr && attr_size) {
+		target = fetch_symlink(ni, reparse_attr, attr_size);
+		if (target) {
+			free(reparse_attr);
+			reparse_attr = (REPARSE_POINT*)NULL;
+			bad = FALSE;
+		} else
+			if (vol->symlink_cache) {
+				/* the resolution alters the path buffer */
+				saved_attr = (REPARSE_POINT*)
+						ntfs_malloc(attr_size);
+				if (saved_attr)
+					memcpy(saved_attr, reparse_attr,
+							attr_size);
+			}
+	}
+#endif
 	if (reparse_attr && attr_size
 			&& valid_reparse_data(ni, reparse_attr, attr_size)) {
 		switch (reparse_attr->reparse_tag) {
@@ -814,6 +936,13 @@ char *ntfs_make_symlink(ntfs_inode *ni, const char *mnt_point,
 		}
 		free(reparse_attr);
 	}
+#if CACHE_SYMLINK_SIZE
+	if (saved_attr) {
+		if (target)
+			enter_symlink(ni, saved_attr, attr_size, target);
+		free(saved_attr);
+	}
+#endif
 	*pattr_size = attr_size;
 	if (bad)
 		errno = EOPNOTSUPP;
@@ -831,21 +960,34 @@ char *ntfs_make_symlink(ntfs_inode *ni, const char *mnt_point,
 BOOL ntfs_possible_symlink(ntfs_inode *ni)
 {
 	s64 attr_size = 0;
-	REPARSE_POINT *reparse_attr;
+	const REPARSE_POINT *reparse_attr;
+	REPARSE_POINT *buf;
+	u32 peek_size;
 	BOOL possible;
 
 	possible = FALSE;
-	reparse_attr = (REPARSE_POINT*)ntfs_attr_readall(ni,
-			AT_REPARSE_POINT,(ntfschar*)NULL, 0, &attr_size);
-	if (reparse_attr && attr_size) {
+	buf = (REPARSE_POINT*)NULL;
+		/* the reparse data is normally resident, just look at it */
+	reparse_attr = (const REPARSE_POINT*)ntfs_attr_peek(ni,
+			AT_REPARSE_POINT, (ntfschar*)NULL, 0, &peek_size);
+	if (reparse_attr)
+		attr_size = peek_size;
+	else
+		if (errno == EOVERFLOW) {
+			buf = (REPARSE_POINT*)ntfs_attr_readall(ni,
+				AT_REPARSE_POINT,(ntfschar*)NULL, 0,
+				&attr_size);
+			reparse_attr = buf;
+		}
+	if (reparse_attr && (attr_size >= (s64)sizeof(le32))) {
 		switch (reparse_attr->reparse_tag) {
 		case IO_REPARSE_TAG_MOUNT_POINT :
 		case IO_REPARSE_TAG_SYMLINK :
 			possible = TRUE;
 		default : ;
 		}
-		free(reparse_attr);
 	}
+	free(buf);
 	return (possible);
 }
 
@@ -931,20 +1073,17 @@ static int remove_reparse_index(ntfs_attr *na, ntfs_index_context *xr,
 }
 
 /*
- *		Open the $Extend/$Reparse file and its index
+ *		Open the $Extend/$Reparse file
  *
- *	Return the index context if opened
+ *	Return the inode if opened
  *		or NULL if an error occurred (errno tells why)
- *
- *	The index has to be freed and inode closed when not needed any more.
  */
 
-static ntfs_index_context *open_reparse_index(ntfs_volume *vol)
+static ntfs_inode *open_reparse_inode(ntfs_volume *vol)
 {
 	u64 inum;
 	ntfs_inode *ni;
 	ntfs_inode *dir_ni;
-	ntfs_index_context *xr;
 
 		/* do not use path_name_to inode - could reopen root */
 	dir_ni = ntfs_inode_open(vol, FILE_Extend);
@@ -955,6 +1094,24 @@ static ntfs_index_context *open_reparse_index(ntfs_volume *vol)
 			ni = ntfs_inode_open(vol, inum);
 		ntfs_inode_close(dir_ni);
 	}
+	return (ni);
+}
+
+/*
+ *		Open the $Extend/$Reparse file and its index
+ *
+ *	Return the index context if opened
+ *		or NULL if an error occurred (errno tells why)
+ *
+ *	The index has to be freed and inode closed when not needed any more.
+ */
+
+static ntfs_index_context *open_reparse_index(ntfs_volume *vol)
+{
+	ntfs_inode *ni;
+	ntfs_index_context *xr;
+
+	ni = open_reparse_inode(vol);
 	if (ni) {
 		xr = ntfs_index_ctx_get(ni, reparse_index_name, 2);
 		if (!xr) {
@@ -965,6 +1122,92 @@ static ntfs_index_context *open_reparse_index(ntfs_volume *vol)
 	return (xr);
 }
 
+struct REPARSE_SCAN {
+	ntfs_inode *ni;
+	struct INDEX_SCAN *scan;
+} ;
+
+/*
+ *		Start listing the reparse points of a volume
+ *
+ *	The entries of the $Extend/$Reparse index are read sequentially,
+ *	so that the reparse points can be listed without examining every
+ *	file. The volume must not be modified until the scan is ended.
+ *
+ *	Returns the scan state,
+ *		or NULL if an error occurred (errno tells why)
+ */
+
+struct REPARSE_SCAN *ntfs_reparse_scan_start(ntfs_volume *vol)
+{
+	struct REPARSE_SCAN *rs;
+	int err;
+
+	rs = (struct REPARSE_SCAN*)ntfs_malloc(sizeof(struct REPARSE_SCAN));
+	if (rs) {
+		rs->ni = open_reparse_inode(vol);
+		if (rs->ni)
+			rs->scan = ntfs_index_scan_start(rs->ni,
+					reparse_index_name, 2);
+		if (!rs->ni || !rs->scan) {
+			err = errno;
+			if (rs->ni)
+				ntfs_inode_close(rs->ni);
+			free(rs);
+			rs = (struct REPARSE_SCAN*)NULL;
+			errno = err;
+		}
+	}
+	return (rs);
+}
+
+/*
+ *		Get the next reparse point of a scan
+ *
+ *	Returns TRUE if a reparse point is returned,
+ *		FALSE after the last one
+ */
+
+BOOL ntfs_reparse_scan_next(struct REPARSE_SCAN *rs, u64 *mref, le32 *tag)
+{
+	INDEX_ENTRY *ie;
+	BOOL found;
+
+	found = FALSE;
+	while (!found && ntfs_index_scan_next(rs->scan, &ie)) {
+		if (le16_to_cpu(ie->key_length)
+				>= sizeof(REPARSE_INDEX_KEY)) {
+			*mref = le64_to_cpu(ie->key.reparse.file_id);
+			*tag = ie->key.reparse.reparse_tag;
+			found = TRUE;
+		}
+	}
+	return (found);
+}
+
+/*
+ *		End listing the reparse points
+ *
+ *	Returns 0 if all the reparse points could be listed,
+ *		or -1 if some could not (errno tells why)
+ */
+
+int ntfs_reparse_scan_end(struct REPARSE_SCAN *rs)
+{
+	int res;
+	int err;
+
+	res = ntfs_index_scan_end(rs->scan);
+	err = errno;
+	if (ntfs_inode_close(rs->ni) && !res) {
+		err = errno;
+		res = -1;
+	}
+	free(rs);
+	errno = err;
+	return (res);
+}
+
 #ifdef HAVE_SETXATTR	/* extended attributes interface required */
 
 /*
@@ -48,6 +48,7 @@
 #include "device.h"
 #include "logging.h"
 #include "misc.h"
+#include "param.h"
 
 /**
  * ntfs_rl_mm - runlist memmove
@@ -138,6 +139,7 @@ runlist_element *ntfs_rl_extend(ntfs_attr *na, runlist_element *rl,
 			rl = (runlist_element*)NULL;
 		} else {
 			na->rl = newrl;
+			ntfs_attr_forget_runs(na);
 			rl = &newrl[irl];
 		}
 	} else {
@@ -753,6 +755,33 @@ runlist_element *ntfs_runlists_merge(runlist_element *drl,
 	return rl;
 }
 
+/*
+ *		Get a signed little-endian number of @n bytes (1 to 8) from
+ *	a mapping pairs array
+ *
+ *	When a whole word fits before @end, it is fetched in a single
+ *	load and sign extended by shifting, otherwise it is assembled
+ *	byte by byte. The shifts to the left are done on unsigned values,
+ *	as shifting a negative value is undefined.
+ */
+static __inline__ s64 ntfs_mapping_pairs_get_delta(const u8 *p, int n,
+			const u8 *end)
+{
+	le64 w;
+	s64 v;
+	int shift;
+
+	if ((p + sizeof(w)) <= end) {
+		memcpy(&w, p, sizeof(w));
+		shift = 64 - (n << 3);
+		v = (s64)(le64_to_cpu(w) << shift) >> shift;
+	} else {
+		for (v = (s8)p[--n]; n; )
+			v = (s64)(((u64)v << 8) + p[--n]);
+	}
+	return (v);
+}
+
 /**
  * ntfs_mapping_pairs_decompress - convert mapping pairs array to runlist
  * @vol:	ntfs volume on which the attribute resides
@@ -856,10 +885,10 @@ static runlist_element *ntfs_mapping_pairs_decompress_i(const ntfs_volume *vol,
 		 */
 		b = *buf & 0xf;
 		if (b) {
-			if (buf + b > attr_end)
+			if ((buf + b >= attr_end) || (b > 8))
 				goto io_error;
-			for (deltaxcn = (s8)buf[b--]; b; b--)
-				deltaxcn = (deltaxcn << 8) + buf[b];
+			deltaxcn = ntfs_mapping_pairs_get_delta(buf + 1, b,
+						attr_end);
 		} else { /* The length entry is compulsory. */
 			ntfs_log_debug("Missing length entry in mapping pairs "
 					"array.\n");
@@ -890,11 +919,11 @@ static runlist_element *ntfs_mapping_pairs_decompress_i(const ntfs_volume *vol,
 		else {
 			/* Get the lcn change which really can be negative. */
 			u8 b2 = *buf & 0xf;
-			b = b2 + ((*buf >> 4) & 0xf);
-			if (buf + b > attr_end)
+			b = (*buf >> 4) & 0xf;
+			if ((buf + b2 + b >= attr_end) || (b > 8))
 				goto io_error;
-			for (deltaxcn = (s8)buf[b--]; b > b2; b--)
-				deltaxcn = (deltaxcn << 8) + buf[b];
+			deltaxcn = ntfs_mapping_pairs_get_delta(buf + b2 + 1,
+						b, attr_end);
 			/* Change the current lcn to it's new value. */
 			lcn += deltaxcn;
 #ifdef DEBUG
@@ -1101,8 +1130,11 @@ LCN ntfs_rl_vcn_to_lcn(const runlist_element *rl, const VCN vcn)
 s64 ntfs_rl_pread(const ntfs_volume *vol, const runlist_element *rl,
 		const s64 pos, s64 count, void *b)
 {
-	s64 bytes_read, to_read, ofs, total;
+	struct ntfs_device_io ios[RUNLIST_BATCH_SIZE];
+	s64 to_read, ofs, total, gathered;
+	BOOL bad;
 	int err = EIO;
+	int n, i;
 
 	if (!vol || !rl || pos < 0 || count < 0) {
 		errno = EINVAL;
@@ -1119,42 +1151,56 @@ s64 ntfs_rl_pread(const ntfs_volume *vol, const runlist_element *rl,
 		ofs += (rl->length << vol->cluster_size_bits);
 	/* Offset in the run at which to begin reading. */
 	ofs = pos - ofs;
-	for (total = 0LL; count; rl++, ofs = 0) {
-		if (!rl->length)
-			goto rl_err_out;
-		if (rl->lcn < (LCN)0) {
-			if (rl->lcn != (LCN)LCN_HOLE)
-				goto rl_err_out;
-			/* It is a hole. Just fill buffer @b with zeroes. */
-			to_read = min(count, (rl->length <<
+	bad = FALSE;
+	for (total = 0LL; count && !bad; ) {
+		/*
+		 * Gather the next runs, so that the reads from the
+		 * fragments are all issued together.
+		 */
+		n = 0;
+		for (gathered = 0; (gathered < count)
+				&& (n < RUNLIST_BATCH_SIZE); rl++, ofs = 0) {
+			if (!rl->length
+			    || ((rl->lcn < (LCN)0)
+				&& (rl->lcn != (LCN)LCN_HOLE))) {
+				bad = TRUE;
+				break;
+			}
+			to_read = min(count - gathered, (rl->length <<
 					vol->cluster_size_bits) - ofs);
-			memset(b, 0, to_read);
-			/* Update counters and proceed with next run. */
-			total += to_read;
-			count -= to_read;
-			b = (u8*)b + to_read;
-			continue;
-		}
-		/* It is a real lcn, read it from the volume. */
-		to_read = min(count, (rl->length << vol->cluster_size_bits) -
-				ofs);
-retry:
-		bytes_read = ntfs_pread(vol->dev, (rl->lcn <<
-				vol->cluster_size_bits) + ofs, to_read, b);
-		/* If everything ok, update progress counters and continue. */
-		if (bytes_read > 0) {
-			total += bytes_read;
-			count -= bytes_read;
-			b = (u8*)b + bytes_read;
-			continue;
+			if (rl->lcn == (LCN)LCN_HOLE)
+				/* It is a hole, just fill with zeroes. */
+				memset((u8*)b + gathered, 0, to_read);
+			else {
+				ios[n].buf = (u8*)b + gathered;
+				ios[n].count = to_read;
+				ios[n].pos = (rl->lcn << vol->cluster_size_bits)
+						+ ofs;
+				n++;
+			}
+			gathered += to_read;
 		}
-		/* If the syscall was interrupted, try again. */
-		if (bytes_read == (s64)-1 && errno == EINTR)
-			goto retry;
-		if (bytes_read == (s64)-1)
+		if (n && ntfs_pread_batch(vol->dev, ios, n)) {
 			err = errno;
-		goto rl_err_out;
+			goto rl_err_out;
+		}
+		/* Stop at the first fragment not fully read */
+		for (i = 0; (i < n) && (ios[i].res == ios[i].count); i++) { }
+		if (i < n) {
+			total += (u8*)ios[i].buf - (u8*)b;
+			if (ios[i].res > 0)
+				total += ios[i].res;
+			else
+				if (ios[i].res < 0)
+					err = -ios[i].res;
+			goto rl_err_out;
+		}
+		total += gathered;
+		count -= gathered;
+		b = (u8*)b + gathered;
 	}
+	if (bad)
+		goto rl_err_out;
 	/* Finally, return the number of bytes read. */
 	return total;
 rl_err_out:
@@ -1190,8 +1236,11 @@ rl_err_out:
 s64 ntfs_rl_pwrite(const ntfs_volume *vol, const runlist_element *rl,
 		s64 ofs, const s64 pos, s64 count, void *b)
 {
-	s64 written, to_write, total = 0;
+	struct ntfs_device_io ios[RUNLIST_BATCH_SIZE];
+	s64 to_write, total = 0, gathered;
+	BOOL bad;
 	int err = EIO;
+	int n, i;
 
 	if (!vol || !rl || pos < 0 || count < 0) {
 		errno = EINVAL;
@@ -1210,46 +1259,54 @@ s64 ntfs_rl_pwrite(const ntfs_volume *vol, const runlist_element *rl,
 	}
 	/* Offset in the run at which to begin writing. */
 	ofs = pos - ofs;
-	for (total = 0LL; count; rl++, ofs = 0) {
-		if (!rl->length)
+	bad = FALSE;
+	for (total = 0LL; count && !bad; ) {
+		/*
+		 * Gather the next runs, so that the writes to the
+		 * fragments are all issued together. The data for
+		 * holes is ignored.
+		 */
+		n = 0;
+		for (gathered = 0; (gathered < count)
+				&& (n < RUNLIST_BATCH_SIZE); rl++, ofs = 0) {
+			if (!rl->length
+			    || ((rl->lcn < (LCN)0)
+				&& (rl->lcn != (LCN)LCN_HOLE))) {
+				bad = TRUE;
+				break;
+			}
+			to_write = min(count - gathered, (rl->length <<
+					vol->cluster_size_bits) - ofs);
+			if ((rl->lcn != (LCN)LCN_HOLE) && !NVolReadOnly(vol)) {
+				ios[n].buf = (u8*)b + gathered;
+				ios[n].count = to_write;
+				ios[n].pos = (rl->lcn << vol->cluster_size_bits)
+						+ ofs;
+				n++;
+			}
+			gathered += to_write;
+		}
+		if (n && ntfs_pwrite_batch(vol->dev, ios, n)) {
+			err = errno;
 			goto rl_err_out;
-		if (rl->lcn < (LCN)0) {
-
-			if (rl->lcn != (LCN)LCN_HOLE)
-				goto rl_err_out;
-			
-			to_write = min(count, (rl->length <<
-					       vol->cluster_size_bits) - ofs);
-			
-			total += to_write;
-			count -= to_write;
-			b = (u8*)b + to_write;
-			continue;
 		}
-		/* It is a real lcn, write it to the volume. */
-		to_write = min(count, (rl->length << vol->cluster_size_bits) -
-				ofs);
-retry:
-		if (!NVolReadOnly(vol))
-			written = ntfs_pwrite(vol->dev, (rl->lcn <<
-					vol->cluster_size_bits) + ofs,
-					to_write, b);
-		else
-			written = to_write;
-		/* If everything ok, update progress counters and continue. */
-		if (written > 0) {
-			total += written;
-			count -= written;
-			b = (u8*)b + written;
-			continue;
+		/* Stop at the first fragment not fully written */
+		for (i = 0; (i < n) && (ios[i].res == ios[i].count); i++) { }
+		if (i < n) {
+			total += (u8*)ios[i].buf - (u8*)b;
+			if (ios[i].res > 0)
+				total += ios[i].res;
+			else
+				if (ios[i].res < 0)
+					err = -ios[i].res;
+			goto rl_err_out;
 		}
-		/* If the syscall was interrupted, try again. */
-		if (written == (s64)-1 && errno == EINTR)
-			goto retry;
-		if (written == (s64)-1)
-			err = errno;
-		goto rl_err_out;
+		total += gathered;
+		count -= gathered;
+		b = (u8*)b + gathered;
 	}
+	if (bad)
+		goto rl_err_out;
 out:
 	return total;
 rl_err_out:
@@ -1280,6 +1337,10 @@ int ntfs_get_nr_significant_bytes(const s64 n)
 	int i;
 
 	l = (n < 0 ? ~n : n);
+#if defined(__GNUC__)
+		/* one byte per started group of 8 bits, plus a sign bit */
+	i = ((64 - __builtin_clzll(l | 1)) >> 3) + 1;
+#else
 	i = 1;
 	if (l >= 128) {
 		l >>= 7;
@@ -1288,6 +1349,7 @@ int ntfs_get_nr_significant_bytes(const s64 n)
 			l >>= 8;
 		} while (l);
 	}
+#endif
 	return i;
 }
 
@@ -1314,7 +1376,24 @@ int ntfs_get_nr_significant_bytes(const s64 n)
 int ntfs_get_size_for_mapping_pairs(const ntfs_volume *vol,
 		const runlist_element *rl, const VCN start_vcn, int max_size)
 {
-	LCN prev_lcn;
+	return (ntfs_get_size_for_mapping_pairs_from(vol, rl, start_vcn,
+			0, max_size));
+}
+
+/**
+ * ntfs_get_size_for_mapping_pairs_from - get bytes needed for the end
+ *		of a mapping pairs array
+ * @prev_lcn:	lcn of the last run already encoded, 0 if none
+ *
+ * Same as ntfs_get_size_for_mapping_pairs(), for mapping pairs to be
+ * appended to existing ones, so that the first lcn is encoded relative
+ * to @prev_lcn.
+ */
+int ntfs_get_size_for_mapping_pairs_from(const ntfs_volume *vol,
+		const runlist_element *rl, const VCN start_vcn, LCN prev_lcn,
+		int max_size)
+{
+	LCN lcn;
 	int rls;
 
 	if (start_vcn < 0) {
@@ -1340,7 +1419,6 @@ int ntfs_get_size_for_mapping_pairs(const ntfs_volume *vol,
 		errno = EINVAL;
 		goto errno_set;
 	}
-	prev_lcn = 0;
 	/* Always need the terminating zero byte. */
 	rls = 1;
 	/* Do the first partial run if present. */
@@ -1361,11 +1439,12 @@ int ntfs_get_size_for_mapping_pairs(const ntfs_volume *vol,
 		 * an lcn of -1 and not a delta_lcn of -1 (unless both are -1).
 		 */
 		if (rl->lcn >= 0 || vol->major_ver < 3) {
-			prev_lcn = rl->lcn;
+			lcn = rl->lcn;
 			if (rl->lcn >= 0)
-				prev_lcn += delta;
+				lcn += delta;
 			/* Change in lcn. */
-			rls += ntfs_get_nr_significant_bytes(prev_lcn);
+			rls += ntfs_get_nr_significant_bytes(lcn - prev_lcn);
+			prev_lcn = lcn;
 		}
 		/* Go to next runlist element. */
 		rl++;
@@ -1422,20 +1501,27 @@ errno_set:
  */
 int ntfs_write_significant_bytes(u8 *dst, const u8 *dst_max, const s64 n)
 {
-	s64 l = n;
+	le64 w;
+	u64 l = n;
 	int i;
+	int j;
 
-	i = 0;
-	if (dst > dst_max)
+		/* size first, so that the bound is only checked once */
+	i = ntfs_get_nr_significant_bytes(n);
+	if ((dst + i - 1) > dst_max)
 		goto err_out;
-	*dst++ = l;
-	i++;
-	while ((l > 0x7f) || (l < -0x80)) {
-		if (dst > dst_max)
-			goto err_out;
-		l >>= 8;
-		*dst++ = l;
-		i++;
+	if ((dst + sizeof(w) - 1) <= dst_max) {
+		/*
+		 * Store a full word when there is room, the extra bytes
+		 * are overwritten by the next value or the terminator
+		 */
+		w = cpu_to_le64(l);
+		memcpy(dst, &w, sizeof(w));
+	} else {
+		for (j=0; j<i; j++) {
+			dst[j] = l;
+			l >>= 8;
+		}
 	}
 	return i;
 err_out:
@@ -1443,6 +1529,20 @@ err_out:
 	return -1;
 }
 
+/*
+ *		Write the terminator of a mapping pairs array
+ *
+ *	The sign extension bytes left beyond the last value by a full word
+ *	store are cleared too, so that they do not pollute the attribute.
+ */
+static void ntfs_mapping_pairs_terminate(u8 *dst, const u8 *dst_max)
+{
+	int n;
+
+	n = dst_max - dst + 1;
+	memset(dst, 0, (n < (int)sizeof(le64) ? n : (int)sizeof(le64)));
+}
+
 /**
  * ntfs_mapping_pairs_build - build the mapping pairs array from a runlist
  * @vol:	ntfs volume (needed for the ntfs version)
@@ -1478,11 +1578,33 @@ int ntfs_mapping_pairs_build(const ntfs_volume *vol, u8 *dst,
 		const int dst_len, const runlist_element *rl,
 		const VCN start_vcn, runlist_element const **stop_rl)
 {
-	LCN prev_lcn;
+	return (ntfs_mapping_pairs_build_from(vol, dst, dst_len, rl,
+			start_vcn, 0, stop_rl));
+}
+
+/**
+ * ntfs_mapping_pairs_build_from - build the end of a mapping pairs array
+ * @prev_lcn:	lcn of the last run already encoded, 0 if none
+ *
+ * Same as ntfs_mapping_pairs_build(), for mapping pairs appended to
+ * existing ones in @dst - 1 and before, so that the first lcn is encoded
+ * relative to @prev_lcn.
+ */
+int ntfs_mapping_pairs_build_from(const ntfs_volume *vol, u8 *dst,
+		const int dst_len, const runlist_element *rl,
+		const VCN start_vcn, LCN prev_lcn,
+		runlist_element const **stop_rl)
+{
+	LCN lcn;
 	u8 *dst_max, *dst_next;
 	s8 len_len, lcn_len;
 	int ret = 0;
 
+	/*
+	 * @dst_max is used for bounds checking in
+	 * ntfs_write_significant_bytes().
+	 */
+	dst_max = dst + dst_len - 1;
 	if (start_vcn < 0)
 		goto val_err;
 	if (!rl) {
@@ -1499,12 +1621,6 @@ int ntfs_mapping_pairs_build(const ntfs_volume *vol, u8 *dst,
 		rl++;
 	if ((!rl->length && start_vcn > rl->vcn) || start_vcn < rl->vcn)
 		goto val_err;
-	/*
-	 * @dst_max is used for bounds checking in
-	 * ntfs_write_significant_bytes().
-	 */
-	dst_max = dst + dst_len - 1;
-	prev_lcn = 0;
 	/* Do the first partial run if present. */
 	if (start_vcn > rl->vcn) {
 		s64 delta;
@@ -1528,14 +1644,15 @@ int ntfs_mapping_pairs_build(const ntfs_volume *vol, u8 *dst,
 		 * change until someone tells us otherwise... (AIA)
 		 */
 		if (rl->lcn >= 0 || vol->major_ver < 3) {
-			prev_lcn = rl->lcn;
+			lcn = rl->lcn;
 			if (rl->lcn >= 0)
-				prev_lcn += delta;
+				lcn += delta;
 			/* Write change in lcn. */
 			lcn_len = ntfs_write_significant_bytes(dst + 1 +
-					len_len, dst_max, prev_lcn);
+					len_len, dst_max, lcn - prev_lcn);
 			if (lcn_len < 0)
 				goto size_err;
+			prev_lcn = lcn;
 		} else
 			lcn_len = 0;
 		dst_next = dst + len_len + lcn_len + 1;
@@ -1588,7 +1705,7 @@ int ntfs_mapping_pairs_build(const ntfs_volume *vol, u8 *dst,
 		*stop_rl = rl;
 ok:	
 	/* Add terminator byte. */
-	*dst = 0;
+	ntfs_mapping_pairs_terminate(dst, dst_max);
 out:
 	return ret;
 size_err:
@@ -1596,7 +1713,7 @@ size_err:
 	if (stop_rl)
 		*stop_rl = rl;
 	/* Add terminator byte. */
-	*dst = 0;
+	ntfs_mapping_pairs_terminate(dst, dst_max);
 nospc_err:
 	errno = ENOSPC;
 	goto errno_set;
@@ -1613,6 +1730,82 @@ errno_set:
 	goto out;
 }
 
+/**
+ * ntfs_mapping_pairs_resume - find where mapping pairs stop matching a runlist
+ * @vol:	ntfs volume (needed for the ntfs version)
+ * @mp:		mapping pairs array of an attribute extent
+ * @mp_end:	end of the space available for @mp
+ * @rl:		runlist element containing @lowest_vcn
+ * @lowest_vcn:	lowest vcn of the attribute extent
+ * @resume_vcn:	returns the vcn of the first pair which does not match
+ * @prev_lcn:	returns the lcn of the last pair which matches, 0 if none
+ *
+ * Decode the mapping pairs of an attribute extent as long as they
+ * describe the same runs as the runlist, so that only the end of the
+ * mapping pairs has to be encoded again, starting at @resume_vcn, after
+ * the runlist was extended or changed near its end.
+ *
+ * Return the offset in @mp of the first pair which does not match (or
+ * of the terminator), or -1 with errno set to EIO if the mapping pairs
+ * are corrupt.
+ */
+int ntfs_mapping_pairs_resume(const ntfs_volume *vol, const u8 *mp,
+		const u8 *mp_end, const runlist_element *rl,
+		const VCN lowest_vcn, VCN *resume_vcn, LCN *prev_lcn)
+{
+	const u8 *p;
+	VCN vcn;
+	LCN lcn;
+	LCN run_lcn;
+	s64 length;
+	int len_len;
+	int lcn_len;
+
+	vcn = lowest_vcn;
+	lcn = 0;
+	p = mp;
+	while ((p < mp_end) && *p) {
+		len_len = *p & 0xf;
+		lcn_len = (*p >> 4) & 0xf;
+		if (!len_len || (len_len > 8) || (lcn_len > 8)
+		    || ((p + 1 + len_len + lcn_len) > mp_end))
+			goto corrupt;
+		length = ntfs_mapping_pairs_get_delta(p + 1, len_len, mp_end);
+		if (length <= 0)
+			goto corrupt;
+		run_lcn = LCN_HOLE;
+		if (lcn_len)
+			run_lcn = lcn + ntfs_mapping_pairs_get_delta(
+					p + 1 + len_len, lcn_len, mp_end);
+		while (rl->length && (vcn >= (rl->vcn + rl->length)))
+			rl++;
+			/* the run has to end where the pair ends */
+		if (!rl->length || (vcn < rl->vcn)
+		    || ((vcn + length) != (rl->vcn + rl->length)))
+			break;
+		if (rl->lcn >= 0) {
+			if (!lcn_len
+			    || (run_lcn != (rl->lcn + vcn - rl->vcn)))
+				break;
+		} else
+			if ((rl->lcn != LCN_HOLE)
+			    || lcn_len || (vol->major_ver < 3))
+				break;
+		if (lcn_len)
+			lcn = run_lcn;
+		vcn += length;
+		p += 1 + len_len + lcn_len;
+	}
+	if (p >= mp_end)
+		goto corrupt;
+	*resume_vcn = vcn;
+	*prev_lcn = lcn;
+	return (p - mp);
+corrupt:
+	errno = EIO;
+	return (-1);
+}
+
 /**
  * ntfs_rl_truncate - truncate a runlist starting at a specified vcn
  * @arl:	address of runlist to truncate
@@ -1755,8 +1948,46 @@ s64 ntfs_rl_get_compressed_size(ntfs_volume *vol, runlist *rl)
 	return ret << vol->cluster_size_bits;
 }
 
+/**
+ * ntfs_rl_fragments - count the fragments of a runlist
+ * @rl:		runlist to count for, fully mapped
+ *
+ * A fragment is a set of allocated runs which are contiguous on the
+ * device, the holes in between (such as the ones in compression
+ * blocks) are not breaking a fragment.
+ *
+ * Return the count of fragments or -1 on error with errno set.
+ */
+s64 ntfs_rl_fragments(const runlist_element *rl)
+{
+	LCN next_lcn;
+	s64 count;
+
+	if (!rl) {
+		errno = EINVAL;
+		return -1;
+	}
+	count = 0;
+	next_lcn = LCN_HOLE;
+	for (; rl->length; rl++) {
+		if (rl->lcn >= 0) {
+			if (rl->lcn != next_lcn)
+				count++;
+			next_lcn = rl->lcn + rl->length;
+		} else
+			if (rl->lcn != LCN_HOLE) {
+				errno = EINVAL;
+				return -1;
+			}
+	}
+	return (count);
+}
+
 
 #ifdef NTFS_TEST
+#include <time.h>
+#include <limits.h>
+
 /**
  * test_rl_helper
  */
@@ -2155,6 +2386,196 @@ out:
 	free(attr3);
 }
 
+/**
+ * test_rl_random - Runlist test: Make a random runlist
+ * @runs:	number of runs
+ * @vol:	volume, for the cluster size
+ *
+ * Run lengths and lcn deltas are spread over all the byte counts which
+ * can be encoded, and some runs are holes.
+ *
+ * Returns a runlist terminated by LCN_ENOENT, or NULL if out of memory.
+ */
+static runlist_element *test_rl_random(int runs, const ntfs_volume *vol)
+{
+	runlist_element *rl;
+	VCN vcn;
+	LCN lcn;
+	s64 length;
+	int i;
+
+	rl = ntfs_malloc((runs + 1)*sizeof(runlist_element));
+	if (!rl)
+		return (NULL);
+	vcn = 0;
+	for (i=0; i<runs; i++) {
+			/* lengths up to 2^40, so that the vcn cannot overflow */
+		length = ((s64)random() << 31 | random())
+				>> (22 + random() % 40);
+		if (!length)
+			length = 1;
+		rl[i].vcn = vcn;
+		rl[i].length = length;
+		if (!(random() % 8) && (vol->major_ver >= 3))
+			rl[i].lcn = LCN_HOLE;
+		else {
+			lcn = ((s64)random() << 31 | random())
+					>> (random() % 62);
+			rl[i].lcn = lcn;
+		}
+		vcn += length;
+	}
+	MKRL(rl + runs, vcn, LCN_ENOENT, 0)
+	return (rl);
+}
+
+/**
+ * test_rl_encode - Runlist test: Make a single extent attribute from a runlist
+ * @vol:
+ * @rl:
+ *
+ * Returns the attribute, or NULL if out of memory
+ */
+static ATTR_RECORD *test_rl_encode(const ntfs_volume *vol,
+			const runlist_element *rl)
+{
+	ATTR_RECORD *attr;
+	VCN vcn;
+	int size;
+	int i;
+
+	size = ntfs_get_size_for_mapping_pairs(vol, rl, 0, INT_MAX);
+	if (size <= 0)
+		return (NULL);
+	attr = ntfs_calloc(0x40 + ((size + 7) & -8));
+	if (!attr)
+		return (NULL);
+	for (i=0; rl[i].length; i++) ;
+	vcn = rl[i].vcn;
+	attr->type = AT_DATA;
+	attr->length = cpu_to_le32(0x40 + ((size + 7) & -8));
+	attr->non_resident = 1;
+	attr->mapping_pairs_offset = const_cpu_to_le16(0x40);
+	attr->lowest_vcn = const_cpu_to_sle64(0);
+	attr->highest_vcn = cpu_to_sle64(vcn - 1);
+	attr->allocated_size = cpu_to_sle64(vcn << vol->cluster_size_bits);
+	if (ntfs_mapping_pairs_build(vol, (u8*)attr + 0x40, size,
+				rl, 0, NULL)) {
+		printf("    Failed to build the mapping pairs : %s\n",
+				strerror(errno));
+		free(attr);
+		attr = (ATTR_RECORD*)NULL;
+	}
+	return (attr);
+}
+
+/**
+ * test_rl_roundtrip - Runlist test: Encode and decode random runlists
+ * @count:	number of runlists to check
+ *
+ * Each runlist is converted to a mapping pairs array and back, and the
+ * result must be identical to the original.
+ *
+ * Returns:
+ */
+static void test_rl_roundtrip(const char *count)
+{
+	ntfs_volume vol;
+	runlist_element *rl;
+	runlist_element *rl2;
+	ATTR_RECORD *attr;
+	int n;
+	int i;
+	int j;
+	int bad;
+
+	vol.sb = NULL;
+	vol.sector_size_bits = 9;
+	vol.cluster_size = 4096;
+	vol.cluster_size_bits = 12;
+	vol.major_ver = 3;
+
+	n = atoi(count);
+	bad = 0;
+	srandom(n);
+	for (i=0; i<n; i++) {
+		rl = test_rl_random(1 + random() % 1000, &vol);
+		attr = (rl ? test_rl_encode(&vol, rl) : (ATTR_RECORD*)NULL);
+		rl2 = (attr ? ntfs_mapping_pairs_decompress(&vol, attr, NULL)
+				: (runlist_element*)NULL);
+		if (!rl2)
+			bad++;
+		else {
+			for (j=0; rl[j].length
+				&& (rl[j].vcn == rl2[j].vcn)
+				&& (rl[j].lcn == rl2[j].lcn)
+				&& (rl[j].length == rl2[j].length); j++) ;
+			if (rl[j].length || rl2[j].length
+			    || (rl[j].vcn != rl2[j].vcn)) {
+				printf("Runlist %d differs at run %d\n", i, j);
+				test_rl_dump_runlist(rl);
+				test_rl_dump_runlist(rl2);
+				bad++;
+			}
+		}
+		free(rl);
+		free(rl2);
+		free(attr);
+	}
+	printf("Roundtrip: %d runlists, %d failed\n", n, bad);
+}
+
+/**
+ * test_rl_bench - Runlist test: Time the mapping pairs encoding and decoding
+ * @runs:	number of runs in the runlist
+ * @count:	number of loops
+ *
+ * Returns:
+ */
+static void test_rl_bench(const char *runs, const char *count)
+{
+	ntfs_volume vol;
+	runlist_element *rl;
+	runlist_element *rl2;
+	ATTR_RECORD *attr;
+	clock_t start;
+	clock_t encode;
+	clock_t decode;
+	int n;
+	int i;
+
+	vol.sb = NULL;
+	vol.sector_size_bits = 9;
+	vol.cluster_size = 4096;
+	vol.cluster_size_bits = 12;
+	vol.major_ver = 3;
+
+	n = atoi(count);
+	srandom(1);
+	rl = test_rl_random(atoi(runs), &vol);
+	attr = (rl ? test_rl_encode(&vol, rl) : (ATTR_RECORD*)NULL);
+	if (!attr) {
+		free(rl);
+		return;
+	}
+	start = clock();
+	for (i=0; i<n; i++)
+		ntfs_mapping_pairs_build(&vol, (u8*)attr + 0x40,
+			le32_to_cpu(attr->length) - 0x40, rl, 0, NULL);
+	encode = clock() - start;
+	start = clock();
+	for (i=0; i<n; i++) {
+		rl2 = ntfs_mapping_pairs_decompress(&vol, attr, NULL);
+		free(rl2);
+	}
+	decode = clock() - start;
+	printf("Bench: %d x %s runs, encode %.3fs, decode %.3fs\n",
+			n, runs, (double)encode/CLOCKS_PER_SEC,
+			(double)decode/CLOCKS_PER_SEC);
+	free(rl);
+	free(attr);
+}
+
 /**
  * test_rl_main - Runlist test: Program start (main)
  * @argc:
@@ -2169,8 +2590,10 @@ int test_rl_main(int argc, char *argv[])
 	if      ((argc == 2) && (strcmp(argv[1], "zero") == 0)) test_rl_zero();
 	else if ((argc == 3) && (strcmp(argv[1], "frag") == 0)) test_rl_frag(argv[2]);
 	else if ((argc == 4) && (strcmp(argv[1], "pure") == 0)) test_rl_pure(argv[2], argv[3]);
+	else if ((argc == 3) && (strcmp(argv[1], "roundtrip") == 0)) test_rl_roundtrip(argv[2]);
+	else if ((argc == 4) && (strcmp(argv[1], "bench") == 0)) test_rl_bench(argv[2], argv[3]);
 	else
-		printf("rl [zero|frag|pure] {args}\n");
+		printf("rl [zero|frag|pure|roundtrip|bench] {args}\n");
 
 	return 0;
 }
@@ -47,10 +47,14 @@
 #ifdef HAVE_SYS_STAT_H
 #include <sys/stat.h>
 #endif
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
 
 #include <unistd.h>
 #include <pwd.h>
 #include <grp.h>
+#include <time.h>
 
 #include "compat.h"
 #include "param.h"
@@ -58,11 +62,13 @@
 #include "layout.h"
 #include "attrib.h"
 #include "index.h"
+#include "mft.h"
 #include "dir.h"
 #include "bitmap.h"
 #include "security.h"
 #include "acls.h"
 #include "cache.h"
+#include "lock.h"
 #include "misc.h"
 
 /*
@@ -417,6 +423,135 @@ static INDEX_ENTRY *ntfs_ie_get_first(INDEX_HEADER *ih)
 	return (INDEX_ENTRY*)((u8*)ih + le32_to_cpu(ih->entries_offset));
 }
 
+/*
+ *		Security descriptors interned from $Secure
+ *
+ *	Volumes generally have few distinct security descriptors shared
+ *	by many files. The descriptors retrieved from $SDS are kept in
+ *	memory, indexed by security id, so that each of them is read
+ *	once. A descriptor never changes while the volume is mounted, a
+ *	new descriptor being given a new security id.
+ *
+ *	The table may also be filled by a sequential scan of $SDS, so
+ *	that the first accesses to many files after mounting do not
+ *	read $Secure randomly. The scan is done by a background thread
+ *	when the program locks the volume in every request, otherwise
+ *	at the first retrieval.
+ *
+ *	The descriptors are also chained by hash, so that a descriptor
+ *	already present in $Secure is found without searching $SDH and
+ *	reading $SDS when it is reused for a new file.
+ *
+ *	The table is protected by the security lock. The scanning thread
+ *	also holds the volume lock in shared mode while reading $SDS,
+ *	to exclude the requests which update $Secure.
+ */
+
+struct INTERNED_DESCR {
+	struct INTERNED_DESCR *next;	/* same security id chain */
+	struct INTERNED_DESCR *hnext;	/* same hash chain */
+	le32 securid;
+	le32 hash;
+	u32 size;
+	char descr[0];
+} ;
+
+struct SECURE_INTERN {
+	struct INTERNED_DESCR *hash[SECURE_INTERN_HASH];
+	struct INTERNED_DESCR *byhash[SECURE_INTERN_HASH];
+	size_t size;		/* memory used by the descriptors */
+	s64 scanned;		/* next $SDS block to scan */
+	BOOL scan;		/* a scan is pending */
+	BOOL started;		/* a thread is scanning */
+	BOOL stop;		/* the thread has to stop */
+#ifdef ENABLE_THREADS
+	pthread_t thread;
+#endif
+} ;
+
+static unsigned int intern_hash(le32 securid)
+{
+	return (le32_to_cpu(securid) & (SECURE_INTERN_HASH - 1));
+}
+
+/*
+ *		Get a copy of an interned descriptor
+ *
+ *	Returns the copy, to be freed by caller, or NULL if not interned
+ */
+
+static char *intern_fetch(struct SECURE_INTERN *intern, le32 securid)
+{
+	struct INTERNED_DESCR *item;
+	char *securattr;
+
+	securattr = (char*)NULL;
+	item = intern->hash[intern_hash(securid)];
+	while (item && (item->securid != securid))
+		item = item->next;
+	if (item) {
+		securattr = (char*)ntfs_malloc(item->size);
+		if (securattr)
+			memcpy(securattr, item->descr, item->size);
+	}
+	return (securattr);
+}
+
+/*
+ *		Find the security id of an interned descriptor
+ *
+ *	Returns the security id, or zero if not interned
+ */
+
+static le32 intern_find(struct SECURE_INTERN *intern, const char *securattr,
+			u32 size, le32 hash)
+{
+	struct INTERNED_DESCR *item;
+
+	item = intern->byhash[le32_to_cpu(hash) & (SECURE_INTERN_HASH - 1)];
+	while (item && ((item->hash != hash) || (item->size != size)
+			|| memcmp(item->descr, securattr, size)))
+		item = item->hnext;
+	return (item ? item->securid : const_cpu_to_le32(0));
+}
+
+/*
+ *		Intern a descriptor, unless already interned
+ *
+ *	Lack of memory is not an error, the descriptor is just not
+ *	interned.
+ */
+
+static void intern_enter(struct SECURE_INTERN *intern, le32 securid,
+			const char *securattr, u32 size, le32 hash)
+{
+	struct INTERNED_DESCR *item;
+	unsigned int h;
+	unsigned int hh;
+
+	h = intern_hash(securid);
+	item = intern->hash[h];
+	while (item && (item->securid != securid))
+		item = item->next;
+	if (!item
+	    && ((intern->size + size) <= SECURE_INTERN_MAX_SIZE)) {
+		item = (struct INTERNED_DESCR*)ntfs_malloc(
+				sizeof(struct INTERNED_DESCR) + size);
+		if (item) {
+			item->securid = securid;
+			item->hash = hash;
+			item->size = size;
+			memcpy(item->descr, securattr, size);
+			item->next = intern->hash[h];
+			intern->hash[h] = item;
+			hh = le32_to_cpu(hash) & (SECURE_INTERN_HASH - 1);
+			item->hnext = intern->byhash[hh];
+			intern->byhash[hh] = item;
+			intern->size += size;
+		}
+	}
+}
+
 /*
  *		Stuff a 256KB block into $SDS before writing descriptors
  *	into the block.
@@ -798,6 +933,10 @@ static le32 entersecurityattr(ntfs_volume *vol,
 		if (entersecurity_data(vol, attr, attrsz, hash, securid, offs, gap)
 		    || entersecurity_indexes(vol, attrsz, hash, securid, offs))
 			securid = const_cpu_to_le32(0);
+		else
+			if (vol->secure_intern)
+				intern_enter(vol->secure_intern, securid,
+					(const char*)attr, attrsz, hash);
 	}
 		/* inode now is dirty, synchronize it all */
 	ntfs_index_entry_mark_dirty(vol->secure_xsii);
@@ -849,87 +988,99 @@ static le32 setsecurityattr(ntfs_volume *vol,
 	securid = const_cpu_to_le32(0);
 	res = 0;
 	xsdh = vol->secure_xsdh;
+	ntfs_security_lock(vol);
 	if (vol->secure_ni && xsdh && !vol->secure_reentry++) {
-		ntfs_index_ctx_reinit(xsdh);
-		/*
-		 * find the nearest key as (hash,0)
-		 * (do not search for partial key : in case of collision,
-		 * it could return a key which is not the first one which
-		 * collides)
-		 */
-		key.hash = hash;
-		key.security_id = const_cpu_to_le32(0);
-		olderrno = errno;
-		found = !ntfs_index_lookup((char*)&key,
-				 sizeof(SDH_INDEX_KEY), xsdh);
-		if (!found && (errno != ENOENT))
-			ntfs_log_perror("Inconsistency in index $SDH");
-		else {
-				/* restore errno to avoid misinterpretation */
-			errno = olderrno;
-			entry = xsdh->entry;
-			found = FALSE;
+		if (vol->secure_intern)
+			securid = intern_find(vol->secure_intern,
+					(const char*)attr, attrsz, hash);
+		if (!securid) {
+			ntfs_index_ctx_reinit(xsdh);
 			/*
-			 * lookup() may return a node with no data,
-			 * if so get next
+			 * find the nearest key as (hash,0)
+			 * (do not search for partial key : in case of collision,
+			 * it could return a key which is not the first one which
+			 * collides)
 			 */
-			if (entry->ie_flags & INDEX_ENTRY_END)
-				entry = ntfs_index_next(entry,xsdh);
-			do {
-				collision = FALSE;
-				psdh = (struct SDH*)entry;
-				if (psdh)
-					size = (size_t) le32_to_cpu(psdh->datasize)
-						 - sizeof(SECURITY_DESCRIPTOR_HEADER);
-				else size = 0;
-			   /* if hash is not the same, the key is not present */
-				if (psdh && (size > 0)
-				   && (psdh->keyhash == hash)) {
-					   /* if hash is the same */
-					   /* check the whole record */
-					realign.parts.dataoffsh = psdh->dataoffsh;
-					realign.parts.dataoffsl = psdh->dataoffsl;
-					offs = le64_to_cpu(realign.all)
-						+ sizeof(SECURITY_DESCRIPTOR_HEADER);
-					oldattr = (char*)ntfs_malloc(size);
-					if (oldattr) {
-						rdsize = ntfs_attr_data_read(
-							vol->secure_ni,
-							STREAM_SDS, 4,
-							oldattr, size, offs);
-						found = (rdsize == size)
-							&& !memcmp(oldattr,attr,size);
-						free(oldattr);
-					  /* if the records do not compare */
-					  /* (hash collision), try next one */
-						if (!found) {
-							entry = ntfs_index_next(
-								entry,xsdh);
-							collision = TRUE;
-						}
-					} else
-						res = ENOMEM;
-				}
-			} while (collision && entry);
-			if (found)
-				securid = psdh->keysecurid;
+			key.hash = hash;
+			key.security_id = const_cpu_to_le32(0);
+			olderrno = errno;
+			found = !ntfs_index_lookup((char*)&key,
+					 sizeof(SDH_INDEX_KEY), xsdh);
+			if (!found && (errno != ENOENT))
+				ntfs_log_perror("Inconsistency in index $SDH");
 			else {
-				if (res) {
-					errno = res;
-					securid = const_cpu_to_le32(0);
-				} else {
-					/*
-					 * no matching key :
-					 * have to build a new one
-					 */
-					securid = entersecurityattr(vol,
-						attr, attrsz, hash);
+					/* restore errno to avoid misinterpretation */
+				errno = olderrno;
+				entry = xsdh->entry;
+				found = FALSE;
+				/*
+				 * lookup() may return a node with no data,
+				 * if so get next
+				 */
+				if (entry->ie_flags & INDEX_ENTRY_END)
+					entry = ntfs_index_next(entry,xsdh);
+				do {
+					collision = FALSE;
+					psdh = (struct SDH*)entry;
+					if (psdh)
+						size = (size_t) le32_to_cpu(psdh->datasize)
+							 - sizeof(SECURITY_DESCRIPTOR_HEADER);
+					else size = 0;
+				   /* if hash is not the same, the key is not present */
+					if (psdh && (size > 0)
+					   && (psdh->keyhash == hash)) {
+						   /* if hash is the same */
+						   /* check the whole record */
+						realign.parts.dataoffsh = psdh->dataoffsh;
+						realign.parts.dataoffsl = psdh->dataoffsl;
+						offs = le64_to_cpu(realign.all)
+							+ sizeof(SECURITY_DESCRIPTOR_HEADER);
+						oldattr = (char*)ntfs_malloc(size);
+						if (oldattr) {
+							rdsize = ntfs_attr_data_read(
+								vol->secure_ni,
+								STREAM_SDS, 4,
+								oldattr, size, offs);
+							found = (rdsize == size)
+								&& !memcmp(oldattr,attr,size);
+							if (found && vol->secure_intern)
+								intern_enter(
+								    vol->secure_intern,
+								    psdh->keysecurid,
+								    oldattr, size, hash);
+							free(oldattr);
+						  /* if the records do not compare */
+						  /* (hash collision), try next one */
+							if (!found) {
+								entry = ntfs_index_next(
+									entry,xsdh);
+								collision = TRUE;
+							}
+						} else
+							res = ENOMEM;
+					}
+				} while (collision && entry);
+				if (found)
+					securid = psdh->keysecurid;
+				else {
+					if (res) {
+						errno = res;
+						securid = const_cpu_to_le32(0);
+					} else {
+						/*
+						 * no matching key :
+						 * have to build a new one
+						 */
+						securid = entersecurityattr(vol,
+							attr, attrsz, hash);
+					}
 				}
 			}
 		}
 	}
 	if (--vol->secure_reentry)
 		ntfs_log_perror("Reentry error, check no multithreading\n");
+	ntfs_security_unlock(vol);
 	return (securid);
 }
 
@@ -1233,6 +1384,82 @@ static BOOL groupmember(struct SECURITY_CONTEXT *scx, uid_t uid, gid_t gid)
 
 #else /* defined(__sun) && defined (__SVR4) */
 
+#if CACHE_GROUPS_SIZE
+
+/*
+ *		Cacheing of the supplementary groups of requesters
+ *
+ *	The groups of a thread are only read from /proc once in a while,
+ *	a thread changing its uid or gid gets a new entry, and changes
+ *	by setgroups() are taken into account after CACHE_GROUPS_TTL
+ *	seconds at most.
+ */
+
+static int groups_compare(const struct CACHED_GROUPS *cached,
+			const struct CACHED_GROUPS *item)
+{
+	return ((cached->tid != item->tid)
+		|| (cached->uid != item->uid)
+		|| (cached->gid != item->gid));
+}
+
+/*
+ *		Check group membership from the cache
+ *
+ *	Returns 1 if member, 0 if not, -1 if the groups are not cached
+ */
+
+static int cached_groupmember(struct SECURITY_CONTEXT *scx, gid_t gid)
+{
+	struct CACHED_GROUPS wanted;
+	struct CACHED_GROUPS *cached;
+	int grcnt;
+	int res;
+
+	res = -1;
+	wanted.tid = scx->tid;
+	wanted.uid = scx->uid;
+	wanted.gid = scx->gid;
+	wanted.groups = (gid_t*)NULL;
+	wanted.groupsize = 0;
+	ntfs_cache_lock(scx->vol);
+	cached = (struct CACHED_GROUPS*)ntfs_fetch_cache(
+			scx->vol->groups_cache, GENERIC(&wanted),
+			(cache_compare)groups_compare);
+	if (cached) {
+		if ((time((time_t*)NULL) - cached->stamp) < CACHE_GROUPS_TTL) {
+			grcnt = cached->groupsize/sizeof(gid_t);
+			res = 0;
+			while (!res && (--grcnt >= 0))
+				if (cached->groups[grcnt] == gid)
+					res = 1;
+		} else
+			ntfs_remove_cache(scx->vol->groups_cache,
+				(struct CACHED_GENERIC*)cached, 0);
+	}
+	ntfs_cache_unlock(scx->vol);
+	return (res);
+}
+
+static void enter_groups(struct SECURITY_CONTEXT *scx,
+			gid_t *groups, int grcnt)
+{
+	struct CACHED_GROUPS wanted;
+
+	wanted.tid = scx->tid;
+	wanted.uid = scx->uid;
+	wanted.gid = scx->gid;
+	wanted.stamp = time((time_t*)NULL);
+	wanted.groups = groups;
+	wanted.groupsize = grcnt*sizeof(gid_t);
+	ntfs_cache_lock(scx->vol);
+	ntfs_enter_cache(scx->vol->groups_cache, GENERIC(&wanted),
+			(cache_compare)groups_compare);
+	ntfs_cache_unlock(scx->vol);
+}
+
+#endif /* CACHE_GROUPS_SIZE */
+
 /*
  *		Check whether current thread owner is member of file group
  *				Linux version
@@ -1251,14 +1478,19 @@ static BOOL groupmember(struct SECURITY_CONTEXT *scx, uid_t uid, gid_t gid)
  *
  * The following implementation gets the group list from
  *   /proc/$TID/task/$TID/status which apparently exists and
- * contains the same data.
+ * contains the same data. The whole list is read, so that it can
+ * be cached for the next checks.
  */
 
 static BOOL groupmember(struct SECURITY_CONTEXT *scx, uid_t uid, gid_t gid)
 {
+	enum { readset = 64 };
 	static char key[] = "\nGroups:";
 	char buf[BUFSZ+1];
 	char filename[64];
+	gid_t groups[readset];
+	int grcnt;
+	BOOL full;
 	enum { INKEY, INSEP, INNUM, INEND } state;
 	int fd;
 	char c;
@@ -1273,6 +1505,16 @@ static BOOL groupmember(struct SECURITY_CONTEXT *scx, uid_t uid, gid_t gid)
 		ismember = staticgroupmember(scx, uid, gid);
 	else {
 		ismember = FALSE; /* default return */
+#if CACHE_GROUPS_SIZE
+		switch (cached_groupmember(scx, gid)) {
+		case 1 :
+			return (TRUE);
+		case 0 :
+			return (FALSE);
+		default :
+			break;
+		}
+#endif
 		tid = scx->tid;
 		sprintf(filename,"/proc/%u/task/%u/status",tid,tid);
 		fd = open(filename,O_RDONLY);
@@ -1283,6 +1525,8 @@ static BOOL groupmember(struct SECURITY_CONTEXT *scx, uid_t uid, gid_t gid)
 			matched = 0;
 			p = buf;
 			grp = 0;
+			grcnt = 0;
+			full = FALSE;
 				/*
 				 *  A simple automaton to process lines like
 				 *  Groups: 14 500 513
@@ -1319,7 +1563,12 @@ static BOOL groupmember(struct SECURITY_CONTEXT *scx, uid_t uid, gid_t gid)
 					if ((c >= '0') && (c <= '9'))
 						grp = grp*10 + c - '0';
 					else {
-						ismember = (grp == gid);
+						if (grp == gid)
+							ismember = TRUE;
+						if (grcnt < readset)
+							groups[grcnt++] = grp;
+						else
+							full = TRUE;
 						if ((c != ' ') && (c != '\t'))
 							state = INEND;
 						else
@@ -1328,10 +1577,15 @@ static BOOL groupmember(struct SECURITY_CONTEXT *scx, uid_t uid, gid_t gid)
 				default :
 					break;
 				}
-			} while (!ismember && c && (state != INEND));
+			} while ((!ismember || !full) && c && (state != INEND));
 		close(fd);
 		if (!c)
 			ntfs_log_error("No group record found in %s\n",filename);
+#if CACHE_GROUPS_SIZE
+		else
+			if (!full)
+				enter_groups(scx, groups, grcnt);
+#endif
 		} else
 			ntfs_log_error("Could not open %s\n",filename);
 	}
@@ -1403,11 +1657,15 @@ static int ntfs_basic_perms(const struct SECURITY_CONTEXT *scx,
  *
  *	In main caches, data is never invalidated, as the meaning of
  *	a security_id only changes when user mapping is changed, which
- *	current implies remounting. However returned entries may be
- *	overwritten at next update, so data has to be copied elsewhere
- *	before another cache update is made.
+ *	current implies remounting. So an entry is never updated once
+ *	it is valid, and the tables and blocks of entries are only
+ *	freed when unmounting : peek_cache() can read the main caches
+ *	without locking, while other threads enter new entries holding
+ *	the security lock. A table, a block or an entry is made visible
+ *	to readers only after it has been fully initialized.
  *	In legacy cache, data has to be invalidated when protection is
- *	changed.
+ *	changed, and returned entries may be overwritten at next update,
+ *	so they have to be used while holding the security lock.
  *
  *	Though the same data may be found in both list, they
  *	must be kept separately : the interpretation of ACL
@@ -1419,6 +1677,21 @@ static int ntfs_basic_perms(const struct SECURITY_CONTEXT *scx,
  *	and 30% if the cache is disabled.
  */
 
+/*
+ *		Account for memory used by the permissions cache
+ *
+ *	The entries of the permissions cache are read by threads which
+ *	do not hold the security lock, so they are never evicted to meet
+ *	the memory budget of the caches (see cache.c). Instead, new
+ *	blocks of entries and ACLs are not cached when over budget.
+ */
+
+static void account_permissions(struct SECURITY_CONTEXT *scx, s64 delta)
+{
+	scx->vol->permissions_mem += delta;
+	ntfs_cache_mem_update(scx->vol, delta);
+}
+
 static struct PERMISSIONS_CACHE *create_caches(struct SECURITY_CONTEXT *scx,
 			u32 securindex)
 {
@@ -1433,14 +1706,17 @@ static struct PERMISSIONS_CACHE *create_caches(struct SECURITY_CONTEXT *scx,
 		ntfs_malloc(sizeof(struct PERMISSIONS_CACHE)
 		      + index1*sizeof(struct CACHED_PERMISSIONS*));
 	if (cache) {
+		account_permissions(scx, sizeof(struct PERMISSIONS_CACHE)
+		      + index1*sizeof(struct CACHED_PERMISSIONS*));
 		cache->head.last = index1;
 		cache->head.p_reads = 0;
 		cache->head.p_hits = 0;
 		cache->head.p_writes = 0;
-		*scx->pseccache = cache;
+		cache->head.retired = (struct PERMISSIONS_CACHE*)NULL;
 		for (i=0; i<=index1; i++)
 			cache->cachetable[i]
 			   = (struct CACHED_PERMISSIONS*)NULL;
+		__atomic_store_n(scx->pseccache, cache, __ATOMIC_RELEASE);
 	}
 	return (cache);
 }
@@ -1454,6 +1730,7 @@ static void free_caches(struct SECURITY_CONTEXT *scx)
 {
 	unsigned int index1;
 	struct PERMISSIONS_CACHE *pseccache;
+	struct PERMISSIONS_CACHE *retired;
 
 	pseccache = *scx->pseccache;
 	if (pseccache) {
@@ -1472,8 +1749,15 @@ static void free_caches(struct SECURITY_CONTEXT *scx)
 #endif
 				free(pseccache->cachetable[index1]);
 			}
-		free(pseccache);
+			/* the retired tables share the blocks of the last one */
+		while (pseccache) {
+			retired = pseccache->head.retired;
+			free(pseccache);
+			pseccache = retired;
+		}
 	}
+	ntfs_cache_mem_update(scx->vol, -(s64)scx->vol->permissions_mem);
+	scx->vol->permissions_mem = 0;
 }
 
 static int compare(const struct CACHED_SECURID *cached,
@@ -1524,6 +1808,9 @@ static int leg_compare(const struct CACHED_PERMISSIONS_LEGACY *cached,
  *	If allocation fails, the cache size is not updated
  *	Lack of memory is not considered as an error, the cache is left
  *	consistent and errno is not set.
+ *
+ *	The old table may still be read by threads which do not hold
+ *	the security lock, so it is only freed when unmounting.
  */
 
 static void resize_cache(struct SECURITY_CONTEXT *scx,
@@ -1550,26 +1837,223 @@ static void resize_cache(struct SECURITY_CONTEXT *scx,
 			    sizeof(struct PERMISSIONS_CACHE)
 			      + (newcnt - 1)*sizeof(struct CACHED_PERMISSIONS*));
 		if (newcache) {
+			account_permissions(scx,
+			    sizeof(struct PERMISSIONS_CACHE)
+			      + (newcnt - 1)*sizeof(struct CACHED_PERMISSIONS*));
 			memcpy(newcache,oldcache,
 			    sizeof(struct PERMISSIONS_CACHE)
 			      + (oldcnt - 1)*sizeof(struct CACHED_PERMISSIONS*));
-			free(oldcache);
 			     /* mark new entries as not valid */
 			for (i=newcache->head.last+1; i<=index1; i++)
 				newcache->cachetable[i]
 					 = (struct CACHED_PERMISSIONS*)NULL;
 			newcache->head.last = index1;
-			*scx->pseccache = newcache;
+			newcache->head.retired = oldcache;
+			__atomic_store_n(scx->pseccache, newcache,
+					__ATOMIC_RELEASE);
 		}
 	}
 }
 
+#if POSIXACLS
+
+/*
+ *		Posix descriptors compiled for access checks
+ *
+ *	The checks which do not depend on the groups of the requester
+ *	are reduced to masks, and the designated users are sorted for
+ *	a binary search. The designated groups are kept in ACL order,
+ *	as the first one the requester is member of has to be found.
+ *	The result is the same as walking the ACEs of the descriptor
+ *	in access_check_posix().
+ */
+
+struct POSIX_COMPILED_ACE {
+	u32 id;
+	int perms;
+} ;
+
+struct POSIX_COMPILED {
+	mode_t perms;		/* mode, or basic perms when ACLs are off */
+	mode_t rootperms;	/* perms granted to root */
+	int mask;		/* the ACL mask, or 7 */
+	int groupdiff;		/* perms of groups which differ from other */
+	int usercnt;		/* designated users, sorted by id */
+	int groupcnt;		/* designated groups, in ACL order */
+	struct POSIX_COMPILED_ACE ace[0];	/* users then groups */
+} ;
+
+static size_t compiled_posix_size(const struct POSIX_SECURITY *pxdesc)
+{
+	return (sizeof(struct POSIX_COMPILED)
+		+ pxdesc->acccnt*sizeof(struct POSIX_COMPILED_ACE));
+}
+
+static void compile_posix(const struct SECURITY_CONTEXT *scx,
+		const struct POSIX_SECURITY *pxdesc,
+		struct POSIX_COMPILED *pxcomp)
+{
+	const struct POSIX_ACE *pxace;
+	struct POSIX_COMPILED_ACE *pcace;
+	int groupperms;
+	int mask;
+	BOOL noacl;
+	mode_t perms;
+	int i;
+	int j;
+
+	noacl = !(scx->vol->secure_flags & (1 << SECURITY_ACL));
+	if (noacl)
+		perms = ntfs_basic_perms(scx, pxdesc);
+	else
+		perms = pxdesc->mode;
+	groupperms = 0;
+	mask = 7;
+	pxcomp->groupdiff = 0;
+	for (i=pxdesc->acccnt-1; i>=0 ; i--) {
+		pxace = &pxdesc->acl.ace[i];
+		switch (pxace->tag) {
+		case POSIX_ACL_USER_OBJ :
+			groupperms |= pxace->perms;
+			break;
+		case POSIX_ACL_GROUP_OBJ :
+			groupperms |= pxace->perms;
+			pxcomp->groupdiff |= ((pxace->perms & mask) ^ perms) & 7;
+			break;
+		case POSIX_ACL_GROUP :
+			if (!noacl) {
+				groupperms |= pxace->perms;
+				pxcomp->groupdiff
+					|= ((pxace->perms & mask) ^ perms) & 7;
+			}
+			break;
+		case POSIX_ACL_MASK :
+			if (!noacl)
+				mask = pxace->perms & 7;
+			break;
+		default :
+			break;
+		}
+	}
+	pxcomp->perms = perms;
+		/* root access if owner or other or some group execution */
+	if (perms & 0101)
+		pxcomp->rootperms = perms | 01777;
+	else
+		pxcomp->rootperms = (groupperms & mask & 1) | 6;
+	pxcomp->mask = mask;
+	pxcomp->usercnt = 0;
+	pxcomp->groupcnt = 0;
+	if (!noacl) {
+			/* designated users, the first ACE of a user wins */
+		for (i=0; i<pxdesc->acccnt; i++) {
+			pxace = &pxdesc->acl.ace[i];
+			if (pxace->tag == POSIX_ACL_USER) {
+				j = pxcomp->usercnt;
+				while ((j > 0)
+				    && (pxcomp->ace[j-1].id > (u32)pxace->id)) {
+					pxcomp->ace[j] = pxcomp->ace[j-1];
+					j--;
+				}
+				if ((j > 0)
+				    && (pxcomp->ace[j-1].id == (u32)pxace->id)) {
+					memmove(&pxcomp->ace[j],
+						&pxcomp->ace[j+1],
+						(pxcomp->usercnt - j)
+						    *sizeof(pxcomp->ace[0]));
+				} else {
+					pxcomp->ace[j].id = pxace->id;
+					pxcomp->ace[j].perms = pxace->perms;
+					pxcomp->usercnt++;
+				}
+			}
+		}
+		pcace = &pxcomp->ace[pxcomp->usercnt];
+		for (i=0; i<pxdesc->acccnt; i++) {
+			pxace = &pxdesc->acl.ace[i];
+			if (pxace->tag == POSIX_ACL_GROUP) {
+				pcace->id = pxace->id;
+				pcace->perms = pxace->perms;
+				pcace++;
+				pxcomp->groupcnt++;
+			}
+		}
+	}
+}
+
+#endif /* POSIXACLS */
+
+/*
+ *	Set the data of a permissions cache entry and make it valid
+ *
+ *	returns the entry, or NULL if there is not enough memory
+ */
+
+#if POSIXACLS
+static struct CACHED_PERMISSIONS *set_cache_entry(
+		struct SECURITY_CONTEXT *scx,
+		struct CACHED_PERMISSIONS *cacheentry, uid_t uid, gid_t gid,
+		struct POSIX_SECURITY *pxdesc)
+#else
+static struct CACHED_PERMISSIONS *set_cache_entry(
+		struct CACHED_PERMISSIONS *cacheentry, uid_t uid, gid_t gid,
+		mode_t mode)
+#endif
+{
+#if POSIXACLS
+	int pxsize;
+	struct POSIX_SECURITY *pxcached;
+	struct POSIX_COMPILED *pxcomp;
+#endif
+
+	cacheentry->uid = uid;
+	cacheentry->gid = gid;
+#if POSIXACLS
+	if (pxdesc) {
+			/* the compiled form follows, suitably aligned */
+		pxsize = (sizeof(struct POSIX_SECURITY)
+			+ (pxdesc->acccnt + pxdesc->defcnt)*sizeof(struct POSIX_ACE)
+			+ 7) & -8;
+		if (!ntfs_cache_mem_allowed(scx->vol, pxsize
+				+ compiled_posix_size(pxdesc)))
+			return ((struct CACHED_PERMISSIONS*)NULL);
+		pxcached = (struct POSIX_SECURITY*)malloc(pxsize
+				+ compiled_posix_size(pxdesc));
+		if (!pxcached)
+			return ((struct CACHED_PERMISSIONS*)NULL);
+		account_permissions(scx, pxsize + compiled_posix_size(pxdesc));
+		memcpy(pxcached, pxdesc, sizeof(struct POSIX_SECURITY)
+			+ (pxdesc->acccnt + pxdesc->defcnt)*sizeof(struct POSIX_ACE));
+		pxcomp = (struct POSIX_COMPILED*)((char*)pxcached + pxsize);
+		compile_posix(scx, pxdesc, pxcomp);
+		cacheentry->pxdesc = pxcached;
+		cacheentry->pxcomp = pxcomp;
+		cacheentry->mode = pxdesc->mode & 07777;
+	} else {
+		cacheentry->pxdesc = (struct POSIX_SECURITY*)NULL;
+		cacheentry->pxcomp = (struct POSIX_COMPILED*)NULL;
+	}
+#else
+	cacheentry->mode = mode & 07777;
+#endif
+	cacheentry->inh_fileid = const_cpu_to_le32(0);
+	cacheentry->inh_dirid = const_cpu_to_le32(0);
+		/* publish the entry to threads reading without locking */
+	__atomic_store_n(&cacheentry->valid, 1, __ATOMIC_RELEASE);
+	return (cacheentry);
+}
+
 /*
  *	Enter uid, gid and mode into cache, if possible
  *
  *	returns the updated or created cache entry,
  *	or NULL if not possible (typically if there is no
  *		security id associated)
+ *
+ *	Must be called with the security lock held. An entry which is
+ *	already valid describes the same security descriptor, it is
+ *	left unchanged as it may be in use by threads not holding the
+ *	lock.
  */
 
 #if POSIXACLS
@@ -1585,10 +2069,6 @@ static struct CACHED_PERMISSIONS *enter_cache(struct SECURITY_CONTEXT *scx,
 	struct CACHED_PERMISSIONS *cacheblock;
 	struct PERMISSIONS_CACHE *pcache;
 	u32 securindex;
-#if POSIXACLS
-	int pxsize;
-	struct POSIX_SECURITY *pxcached;
-#endif
 	unsigned int index1;
 	unsigned int index2;
 	int i;
@@ -1608,32 +2088,17 @@ static struct CACHED_PERMISSIONS *enter_cache(struct SECURITY_CONTEXT *scx,
 		     && (pcache->head.last >= index1)
 		     && pcache->cachetable[index1]) {
 			cacheentry = &pcache->cachetable[index1][index2];
-			cacheentry->uid = uid;
-			cacheentry->gid = gid;
+			if (!cacheentry->valid) {
 #if POSIXACLS
-			if (cacheentry->valid && cacheentry->pxdesc)
-				free(cacheentry->pxdesc);
-			if (pxdesc) {
-				pxsize = sizeof(struct POSIX_SECURITY)
-					+ (pxdesc->acccnt + pxdesc->defcnt)*sizeof(struct POSIX_ACE);
-				pxcached = (struct POSIX_SECURITY*)malloc(pxsize);
-				if (pxcached) {
-					memcpy(pxcached, pxdesc, pxsize);
-					cacheentry->pxdesc = pxcached;
-				} else {
-					cacheentry->valid = 0;
-					cacheentry = (struct CACHED_PERMISSIONS*)NULL;
-				}
-				cacheentry->mode = pxdesc->mode & 07777;
-			} else
-				cacheentry->pxdesc = (struct POSIX_SECURITY*)NULL;
+				cacheentry = set_cache_entry(scx, cacheentry,
+						uid, gid, pxdesc);
 #else
-			cacheentry->mode = mode & 07777;
+				cacheentry = set_cache_entry(cacheentry,
+						uid, gid, mode);
 #endif
-			cacheentry->inh_fileid = const_cpu_to_le32(0);
-			cacheentry->inh_dirid = const_cpu_to_le32(0);
-			cacheentry->valid = 1;
-			pcache->head.p_writes++;
+				if (cacheentry)
+					pcache->head.p_writes++;
+			}
 		} else {
 			if (!pcache) {
 				/* create the first cache block */
@@ -1645,42 +2110,36 @@ static struct CACHED_PERMISSIONS *enter_cache(struct SECURITY_CONTEXT *scx,
 				}
 			}
 			/* allocate block, if cache table was allocated */
-			if (pcache && (index1 <= pcache->head.last)) {
+			cacheentry = (struct CACHED_PERMISSIONS*)NULL;
+			if (pcache && (index1 <= pcache->head.last)
+			    && ntfs_cache_mem_allowed(scx->vol,
+					sizeof(struct CACHED_PERMISSIONS)
+						<< CACHE_PERMISSIONS_BITS)) {
 				cacheblock = (struct CACHED_PERMISSIONS*)
 					malloc(sizeof(struct CACHED_PERMISSIONS)
 						<< CACHE_PERMISSIONS_BITS);
-				pcache->cachetable[index1] = cacheblock;
-				for (i=0; i<(1 << CACHE_PERMISSIONS_BITS); i++)
-					cacheblock[i].valid = 0;
-				cacheentry = &cacheblock[index2];
-				if (cacheentry) {
-					cacheentry->uid = uid;
-					cacheentry->gid = gid;
+				if (cacheblock) {
+					account_permissions(scx,
+					    sizeof(struct CACHED_PERMISSIONS)
+						<< CACHE_PERMISSIONS_BITS);
+					for (i=0; i<(1 << CACHE_PERMISSIONS_BITS); i++)
+						cacheblock[i].valid = 0;
 #if POSIXACLS
-					if (pxdesc) {
-						pxsize = sizeof(struct POSIX_SECURITY)
-							+ (pxdesc->acccnt + pxdesc->defcnt)*sizeof(struct POSIX_ACE);
-						pxcached = (struct POSIX_SECURITY*)malloc(pxsize);
-						if (pxcached) {
-							memcpy(pxcached, pxdesc, pxsize);
-							cacheentry->pxdesc = pxcached;
-						} else {
-							cacheentry->valid = 0;
-							cacheentry = (struct CACHED_PERMISSIONS*)NULL;
-						}
-						cacheentry->mode = pxdesc->mode & 07777;
-					} else
-						cacheentry->pxdesc = (struct POSIX_SECURITY*)NULL;
+					cacheentry = set_cache_entry(scx,
+						&cacheblock[index2],
+						uid, gid, pxdesc);
 #else
-					cacheentry->mode = mode & 07777;
+					cacheentry = set_cache_entry(
+						&cacheblock[index2],
+						uid, gid, mode);
 #endif
-					cacheentry->inh_fileid = const_cpu_to_le32(0);
-					cacheentry->inh_dirid = const_cpu_to_le32(0);
-					cacheentry->valid = 1;
-					pcache->head.p_writes++;
+					if (cacheentry)
+						pcache->head.p_writes++;
+					__atomic_store_n(
+						&pcache->cachetable[index1],
+						cacheblock, __ATOMIC_RELEASE);
 				}
-			} else
-				cacheentry = (struct CACHED_PERMISSIONS*)NULL;
+			}
 		}
 	} else {
 		cacheentry = (struct CACHED_PERMISSIONS*)NULL;
@@ -1693,6 +2152,7 @@ static struct CACHED_PERMISSIONS *enter_cache(struct SECURITY_CONTEXT *scx,
 			wanted.perm.gid = gid;
 #if POSIXACLS
 			wanted.perm.mode = pxdesc->mode & 07777;
+			wanted.perm.pxcomp = (struct POSIX_COMPILED*)NULL;
 			wanted.perm.inh_fileid = const_cpu_to_le32(0);
 			wanted.perm.inh_dirid = const_cpu_to_le32(0);
 			wanted.mft_no = ni->mft_no;
@@ -1727,47 +2187,80 @@ static struct CACHED_PERMISSIONS *enter_cache(struct SECURITY_CONTEXT *scx,
 }
 
 /*
- *	Fetch owner, group and permission of a file, if cached
+ *	Fetch owner, group and permission of a file from the main cache
  *
- *	Beware : do not use the returned entry after a cache update :
- *	the cache may be relocated making the returned entry meaningless
+ *	This may be called without holding the security lock, and the
+ *	returned entry can be used until unmounting. Files with no
+ *	security id are not searched for.
  *
  *	returns the cache entry, or NULL if not available
  */
 
-static struct CACHED_PERMISSIONS *fetch_cache(struct SECURITY_CONTEXT *scx,
+static struct CACHED_PERMISSIONS *peek_cache(struct SECURITY_CONTEXT *scx,
 		ntfs_inode *ni)
 {
 	struct CACHED_PERMISSIONS *cacheentry;
+	struct CACHED_PERMISSIONS *cacheblock;
 	struct PERMISSIONS_CACHE *pcache;
 	u32 securindex;
 	unsigned int index1;
 	unsigned int index2;
 
-	/* cacheing is only possible if a security_id has been defined */
 	cacheentry = (struct CACHED_PERMISSIONS*)NULL;
 	if (test_nino_flag(ni, v3_Extensions)
 	   && (ni->security_id)) {
 		securindex = le32_to_cpu(ni->security_id);
 		index1 = securindex >> CACHE_PERMISSIONS_BITS;
 		index2 = securindex & ((1 << CACHE_PERMISSIONS_BITS) - 1);
-		pcache = *scx->pseccache;
+		pcache = __atomic_load_n(scx->pseccache, __ATOMIC_ACQUIRE);
 		if (pcache
-		     && (pcache->head.last >= index1)
-		     && pcache->cachetable[index1]) {
-			cacheentry = &pcache->cachetable[index1][index2];
-			/* reject if entry is not valid */
-			if (!cacheentry->valid)
-				cacheentry = (struct CACHED_PERMISSIONS*)NULL;
-			else
-				pcache->head.p_hits++;
-		if (pcache)
-			pcache->head.p_reads++;
+		     && (pcache->head.last >= index1)) {
+			cacheblock = __atomic_load_n(
+					&pcache->cachetable[index1],
+					__ATOMIC_ACQUIRE);
+			if (cacheblock
+			    && __atomic_load_n(&cacheblock[index2].valid,
+					__ATOMIC_ACQUIRE)) {
+				cacheentry = &cacheblock[index2];
+				__atomic_fetch_add(&pcache->head.p_hits, 1,
+						__ATOMIC_RELAXED);
+			}
+			__atomic_fetch_add(&pcache->head.p_reads, 1,
+					__ATOMIC_RELAXED);
 		}
 	}
+#if POSIXACLS
+	if (cacheentry && !cacheentry->pxdesc) {
+		ntfs_log_error("No Posix descriptor in cache\n");
+		cacheentry = (struct CACHED_PERMISSIONS*)NULL;
+	}
+#endif
+	return (cacheentry);
+}
+
+/*
+ *	Fetch owner, group and permission of a file, if cached
+ *
+ *	Beware : do not use the returned entry after a cache update :
+ *	the legacy cache may be relocated making the returned entry
+ *	meaningless
+ *
+ *	returns the cache entry, or NULL if not available
+ */
+
+static struct CACHED_PERMISSIONS *fetch_cache(struct SECURITY_CONTEXT *scx,
+		ntfs_inode *ni)
+{
+	struct CACHED_PERMISSIONS *cacheentry;
+
+	/* cacheing is only possible if a security_id has been defined */
+	cacheentry = (struct CACHED_PERMISSIONS*)NULL;
+	if (test_nino_flag(ni, v3_Extensions)
+	   && (ni->security_id)) {
+		cacheentry = peek_cache(scx, ni);
+	}
 #if CACHE_LEGACY_SIZE
 	else {
-		cacheentry = (struct CACHED_PERMISSIONS*)NULL;
 		if (ni->mrec->flags & MFT_RECORD_IS_DIRECTORY) {
 			struct CACHED_PERMISSIONS_LEGACY wanted;
 			struct CACHED_PERMISSIONS_LEGACY *legacy;
@@ -1780,17 +2273,174 @@ static struct CACHED_PERMISSIONS *fetch_cache(struct SECURITY_CONTEXT *scx,
 				(cache_compare)leg_compare);
 			if (legacy) cacheentry = &legacy->perm;
 		}
-	}
-#endif
 #if POSIXACLS
-	if (cacheentry && !cacheentry->pxdesc) {
-		ntfs_log_error("No Posix descriptor in cache\n");
-		cacheentry = (struct CACHED_PERMISSIONS*)NULL;
+		if (cacheentry && !cacheentry->pxdesc) {
+			ntfs_log_error("No Posix descriptor in cache\n");
+			cacheentry = (struct CACHED_PERMISSIONS*)NULL;
+		}
+#endif
 	}
 #endif
 	return (cacheentry);
 }
 
+/*
+ *		Intern the descriptors from the next block of $SDS
+ *
+ *	The second copy of each block is skipped. Entries which do not
+ *	look consistent are ignored, they will be retrieved through $SII
+ *	if ever needed.
+ *
+ *	Returns TRUE if there are more blocks to scan
+ */
+
+static BOOL intern_scan_block(ntfs_volume *vol, struct SECURE_INTERN *intern,
+			char *buf)
+{
+	const SECURITY_DESCRIPTOR_HEADER *phead;
+	const char *securattr;
+	u32 length;
+	u32 size;
+	int br;
+	int pos;
+
+	br = ntfs_attr_data_read(vol->secure_ni, STREAM_SDS, 4,
+			buf, ALIGN_SDS_BLOCK, intern->scanned);
+	pos = 0;
+	while ((br > 0)
+	    && ((pos + (int)sizeof(SECURITY_DESCRIPTOR_HEADER)) <= br)) {
+		phead = (const SECURITY_DESCRIPTOR_HEADER*)&buf[pos];
+		length = le32_to_cpu(phead->length);
+		if ((le64_to_cpu(phead->offset) != (u64)(intern->scanned + pos))
+		    || (length < sizeof(SECURITY_DESCRIPTOR_HEADER)
+				+ sizeof(SECURITY_DESCRIPTOR_RELATIVE))
+		    || (length > (u32)(br - pos)))
+			break;
+		securattr = &buf[pos + sizeof(SECURITY_DESCRIPTOR_HEADER)];
+		size = length - sizeof(SECURITY_DESCRIPTOR_HEADER);
+		if (ntfs_valid_descr(securattr, size)
+		    && (ntfs_security_hash((const SECURITY_DESCRIPTOR_RELATIVE*)
+				securattr, size) == phead->hash))
+			intern_enter(intern, phead->security_id,
+					securattr, size, phead->hash);
+		pos += (length + ALIGN_SDS_ENTRY - 1) & -ALIGN_SDS_ENTRY;
+	}
+	intern->scanned += 2*ALIGN_SDS_BLOCK;
+	return ((br == ALIGN_SDS_BLOCK)
+		&& (intern->size < SECURE_INTERN_MAX_SIZE));
+}
+
+/*
+ *		Scan $SDS synchronously
+ *
+ *	Called with the security lock held, when a descriptor is first
+ *	retrieved and no background scan has been started.
+ */
+
+static void intern_scan(ntfs_volume *vol, struct SECURE_INTERN *intern)
+{
+	char *buf;
+
+	intern->scan = FALSE;
+	buf = (char*)ntfs_malloc(ALIGN_SDS_BLOCK);
+	if (buf) {
+		while (intern_scan_block(vol, intern, buf)) { }
+		free(buf);
+		ntfs_log_debug("Interned %ld bytes of security descriptors\n",
+				(long)intern->size);
+	}
+}
+
+#ifdef ENABLE_THREADS
+
+static void *intern_thread(void *arg)
+{
+	ntfs_volume *vol;
+	struct SECURE_INTERN *intern;
+	char *buf;
+	BOOL more;
+
+	vol = (ntfs_volume*)arg;
+	intern = vol->secure_intern;
+	buf = (char*)ntfs_malloc(ALIGN_SDS_BLOCK);
+	more = (buf != (char*)NULL);
+	while (more) {
+			/* let the requests proceed between blocks */
+		ntfs_volume_lock_shared(vol);
+		ntfs_security_lock(vol);
+		more = !intern->stop && intern_scan_block(vol, intern, buf);
+		ntfs_security_unlock(vol);
+		ntfs_volume_unlock(vol);
+	}
+	ntfs_security_lock(vol);
+	intern->scan = FALSE;
+	ntfs_log_debug("Interned %ld bytes of security descriptors\n",
+			(long)intern->size);
+	ntfs_security_unlock(vol);
+	free(buf);
+	return ((void*)NULL);
+}
+
+#endif /* ENABLE_THREADS */
+
+/*
+ *		Request the security descriptors to be loaded into memory
+ *
+ *	When background is set, they are loaded by a thread which locks
+ *	the volume in shared mode, so the program must lock the volume
+ *	in every request. Otherwise they are loaded on the first
+ *	retrieval. To be called after daemonizing, which would not
+ *	retain the thread.
+ */
+
+void ntfs_secure_preload(ntfs_volume *vol, BOOL background)
+{
+	struct SECURE_INTERN *intern;
+
+	intern = vol->secure_intern;
+	if (intern && !intern->started && !intern->scanned) {
+		intern->scan = TRUE;
+#ifdef ENABLE_THREADS
+		if (background
+		    && vol->locks
+		    && !pthread_create(&intern->thread, NULL,
+				intern_thread, vol))
+			intern->started = TRUE;
+#endif
+	}
+}
+
+/*
+ *		Stop the loading of descriptors and free the interned ones
+ */
+
+static void intern_release(ntfs_volume *vol)
+{
+	struct SECURE_INTERN *intern;
+	struct INTERNED_DESCR *item;
+	unsigned int h;
+
+	intern = vol->secure_intern;
+	if (intern) {
+#ifdef ENABLE_THREADS
+		if (intern->started) {
+			ntfs_security_lock(vol);
+			intern->stop = TRUE;
+			ntfs_security_unlock(vol);
+			pthread_join(intern->thread, (void**)NULL);
+		}
+#endif
+		for (h=0; h<SECURE_INTERN_HASH; h++)
+			while (intern->hash[h]) {
+				item = intern->hash[h];
+				intern->hash[h] = item->next;
+				free(item);
+			}
+		free(intern);
+		vol->secure_intern = (struct SECURE_INTERN*)NULL;
+	}
+}
+
 /*
  *	Retrieve a security attribute from $Secure
  */
@@ -1816,7 +2466,13 @@ static char *retrievesecurityattr(ntfs_volume *vol, SII_INDEX_KEY id)
 	securattr = (char*)NULL;
 	ni = vol->secure_ni;
 	xsii = vol->secure_xsii;
-	if (ni && xsii) {
+	ntfs_security_lock(vol);
+	if (vol->secure_intern) {
+		if (vol->secure_intern->scan && !vol->secure_intern->started)
+			intern_scan(vol, vol->secure_intern);
+		securattr = intern_fetch(vol->secure_intern, id.security_id);
+	}
+	if (!securattr && ni && xsii) {
 		ntfs_index_ctx_reinit(xsii);
 		found =
 		    !ntfs_index_lookup((char*)&id,
@@ -1843,12 +2499,18 @@ static char *retrievesecurityattr(ntfs_volume *vol, SII_INDEX_KEY id)
 					/* error to be logged by caller */
 					free(securattr);
 					securattr = (char*)NULL;
-				}
+				} else
+					if (vol->secure_intern)
+						intern_enter(vol->secure_intern,
+							id.security_id,
+							securattr, size,
+							psii->hash);
 			}
 		} else
 			if (errno != ENOENT)
 				ntfs_log_perror("Inconsistency in index $SII");
 	}
+	ntfs_security_unlock(vol);
 	if (!securattr) {
 		ntfs_log_error("Failed to retrieve a security descriptor\n");
 		errno = EIO;
@@ -2059,6 +2721,85 @@ static int access_check_posix(struct SECURITY_CONTEXT *scx,
 	return (perms);
 }
 
+/*
+ *		Same as access_check_posix(), from a compiled descriptor
+ */
+
+static int access_check_compiled(struct SECURITY_CONTEXT *scx,
+			const struct POSIX_COMPILED *pxcomp, mode_t request,
+			uid_t uid, gid_t gid)
+{
+	const struct POSIX_COMPILED_ACE *pcace;
+	int userperms;
+	int groupperms;
+	int mask;
+	BOOL somegroup;
+	mode_t perms;
+	int low;
+	int high;
+	int mid;
+	int i;
+
+	perms = pxcomp->perms;
+	if (!scx->uid)
+		perms = pxcomp->rootperms;
+	else if (uid == scx->uid)
+		perms &= 07700;
+	else {
+		mask = pxcomp->mask;
+					/* designated users */
+		userperms = -1;
+		low = 0;
+		high = pxcomp->usercnt - 1;
+		while ((low <= high) && (userperms < 0)) {
+			mid = (low + high) >> 1;
+			if (pxcomp->ace[mid].id == (u32)scx->uid)
+				userperms = pxcomp->ace[mid].perms;
+			else
+				if (pxcomp->ace[mid].id < (u32)scx->uid)
+					low = mid + 1;
+				else
+					high = mid - 1;
+		}
+		if (userperms >= 0)
+			perms = (perms & 07000) + (userperms & mask);
+		else if (!(pxcomp->groupdiff & (request >> 6) & 7))
+				perms &= 07007;
+		else {
+					/* owning group */
+			if (!(~(perms >> 3) & request & mask)
+			    && ((gid == scx->gid)
+				|| groupmember(scx, scx->uid, gid)))
+				perms &= 07070;
+			else {
+					/* other groups */
+				groupperms = -1;
+				somegroup = FALSE;
+				pcace = &pxcomp->ace[pxcomp->usercnt];
+				for (i=0; (i<pxcomp->groupcnt)
+					    && (groupperms < 0); i++) {
+					if (groupmember(scx, scx->uid,
+							pcace[i].id)) {
+						if (!(~pcace[i].perms
+							    & request & mask))
+							groupperms
+							    = pcace[i].perms;
+						somegroup = TRUE;
+					}
+				}
+				if (groupperms >= 0)
+					perms = (perms & 07000) + (groupperms & mask);
+				else
+					if (somegroup)
+						perms = 0;
+					else
+						perms &= 07007;
+			}
+		}
+	}
+	return (perms);
+}
+
 /*
  *		Get permissions to access a file
  *	Takes into account the relation of user to file (owner, group, ...)
@@ -2080,17 +2821,29 @@ static int ntfs_get_perm(struct SECURITY_CONTEXT *scx,
 	gid_t gid;
 	int perm;
 	BOOL isdir;
+	BOOL locked;
 	struct POSIX_SECURITY *pxdesc;
 
 	if (!scx->mapping[MAPUSERS])
 		perm = 07777;
 	else {
-		/* check whether available in cache */
-		cached = fetch_cache(scx,ni);
+		/* check whether available in cache, first without locking */
+		locked = FALSE;
+		cached = peek_cache(scx,ni);
+		if (!cached) {
+			ntfs_security_lock(scx->vol);
+			locked = TRUE;
+			cached = fetch_cache(scx,ni);
+		}
 		if (cached) {
 			uid = cached->uid;
 			gid = cached->gid;
-			perm = access_check_posix(scx,cached->pxdesc,request,uid,gid);
+			if (cached->pxcomp)
+				perm = access_check_compiled(scx,
+					cached->pxcomp,request,uid,gid);
+			else
+				perm = access_check_posix(scx,
+					cached->pxdesc,request,uid,gid);
 		} else {
 			perm = 0;	/* default to no permission */
 			isdir = (ni->mrec->flags & MFT_RECORD_IS_DIRECTORY)
@@ -2157,6 +2910,8 @@ static int ntfs_get_perm(struct SECURITY_CONTEXT *scx,
 				uid = gid = 0;
 			}
 		}
+		if (locked)
+			ntfs_security_unlock(scx->vol);
 	}
 	return (perm);
 }
@@ -2184,6 +2939,7 @@ int ntfs_get_posix_acl(struct SECURITY_CONTEXT *scx, ntfs_inode *ni,
 	size_t outsize;
 
 	outsize = 0;	/* default to error */
+	ntfs_security_lock(scx->vol);
 	if (!scx->mapping[MAPUSERS])
 		errno = ENOTSUP;
 	else {
@@ -2235,7 +2991,6 @@ int ntfs_get_posix_acl(struct SECURITY_CONTEXT *scx, ntfs_inode *ni,
 						uid = ntfs_find_user(scx->mapping[MAPUSERS],usid);
 #endif
 					gid = ntfs_find_group(scx->mapping[MAPGROUPS],gsid);
-					if (pxdesc->tagsset & POSIX_ACL_EXTENSIONS)
 					enter_cache(scx, ni, uid,
 							gid, pxdesc);
 				}
@@ -2287,6 +3042,7 @@ int ntfs_get_posix_acl(struct SECURITY_CONTEXT *scx, ntfs_inode *ni,
 		} else
 			outsize = 0;
 	}
+	ntfs_security_unlock(scx->vol);
 	return (outsize ? (int)outsize : -errno);
 }
 
@@ -2310,6 +3066,7 @@ static int ntfs_get_perm(struct SECURITY_CONTEXT *scx,
 	const SID *usid;	/* owner of file/directory */
 	const SID *gsid;	/* group of file/directory */
 	BOOL isdir;
+	BOOL locked;
 	uid_t uid;
 	gid_t gid;
 	int perm;
@@ -2317,8 +3074,14 @@ static int ntfs_get_perm(struct SECURITY_CONTEXT *scx,
 	if (!scx->mapping[MAPUSERS] || (!scx->uid && !(request & S_IEXEC)))
 		perm = 07777;
 	else {
-		/* check whether available in cache */
-		cached = fetch_cache(scx,ni);
+		/* check whether available in cache, first without locking */
+		locked = FALSE;
+		cached = peek_cache(scx,ni);
+		if (!cached) {
+			ntfs_security_lock(scx->vol);
+			locked = TRUE;
+			cached = fetch_cache(scx,ni);
+		}
 		if (cached) {
 			perm = cached->mode;
 			uid = cached->uid;
@@ -2377,6 +3140,8 @@ static int ntfs_get_perm(struct SECURITY_CONTEXT *scx,
 				uid = gid = 0;
 			}
 		}
+		if (locked)
+			ntfs_security_unlock(scx->vol);
 		if (perm >= 0) {
 			if (!scx->uid) {
 				/* root access and execution */
@@ -2422,7 +3187,9 @@ int ntfs_get_ntfs_acl(struct SECURITY_CONTEXT *scx, ntfs_inode *ni,
 	size_t outsize;
 
 	outsize = 0;	/* default to no data and no error */
+	ntfs_security_lock(scx->vol);
 	securattr = getsecurityattr(scx->vol, ni);
+	ntfs_security_unlock(scx->vol);
 	if (securattr) {
 		outsize = ntfs_attr_size(securattr);
 		if (outsize <= size) {
@@ -2448,6 +3215,7 @@ int ntfs_get_owner_mode(struct SECURITY_CONTEXT *scx,
 	const struct CACHED_PERMISSIONS *cached;
 	int perm;
 	BOOL isdir;
+	BOOL locked;
 #if POSIXACLS
 	struct POSIX_SECURITY *pxdesc;
 #endif
@@ -2455,8 +3223,14 @@ int ntfs_get_owner_mode(struct SECURITY_CONTEXT *scx,
 	if (!scx->mapping[MAPUSERS])
 		perm = 07777;
 	else {
-			/* check whether available in cache */
-		cached = fetch_cache(scx,ni);
+			/* check whether available in cache, first without locking */
+		locked = FALSE;
+		cached = peek_cache(scx,ni);
+		if (!cached) {
+			ntfs_security_lock(scx->vol);
+			locked = TRUE;
+			cached = fetch_cache(scx,ni);
+		}
 		if (cached) {
 #if POSIXACLS
 			if (!(scx->vol->secure_flags & (1 << SECURITY_ACL))
@@ -2543,6 +3317,8 @@ int ntfs_get_owner_mode(struct SECURITY_CONTEXT *scx,
 				free(securattr);
 			}
 		}
+		if (locked)
+			ntfs_security_unlock(scx->vol);
 	}
 	return (perm);
 }
@@ -3360,20 +4136,21 @@ int ntfs_set_mode(struct SECURITY_CONTEXT *scx, ntfs_inode *ni, mode_t mode)
 }
 
 /*
- *	Create a default security descriptor for files whose descriptor
- *	cannot be inherited
+ *	Build a default security descriptor for files whose descriptor
+ *	cannot be inherited (everyone has full access)
+ *
+ *	Returns the descriptor, to be freed by caller, and its size
+ *		or NULL if there was an error (described by errno)
  */
 
-int ntfs_sd_add_everyone(ntfs_inode *ni)
+SECURITY_DESCRIPTOR_RELATIVE *ntfs_sd_everyone(int *psd_len)
 {
-	/* JPA SECURITY_DESCRIPTOR_ATTR *sd; */
 	SECURITY_DESCRIPTOR_RELATIVE *sd;
 	ACL *acl;
 	ACCESS_ALLOWED_ACE *ace;
 	SID *sid;
-	int ret, sd_len;
+	int sd_len;
 	
-	/* Create SECURITY_DESCRIPTOR attribute (everyone has full access). */
 	/*
 	 * Calculate security descriptor length. We have 2 sub-authorities in
 	 * owner and group SIDs, but structure SID contain only one, so add
@@ -3383,7 +4160,7 @@ int ntfs_sd_add_everyone(ntfs_inode *ni)
 		sizeof(ACL) + sizeof(ACCESS_ALLOWED_ACE); 
 	sd = (SECURITY_DESCRIPTOR_RELATIVE*)ntfs_calloc(sd_len);
 	if (!sd)
-		return -1;
+		return ((SECURITY_DESCRIPTOR_RELATIVE*)NULL);
 	
 	sd->revision = SECURITY_DESCRIPTOR_REVISION;
 	sd->control = SE_DACL_PRESENT | SE_SELF_RELATIVE;
@@ -3420,6 +4197,26 @@ int ntfs_sd_add_everyone(ntfs_inode *ni)
 	ace->sid.sub_authority[0] = const_cpu_to_le32(0);
 	ace->sid.identifier_authority.value[5] = 1;
 
+	*psd_len = sd_len;
+	return (sd);
+}
+
+/*
+ *	Create a default security descriptor for files whose descriptor
+ *	cannot be inherited
+ */
+
+int ntfs_sd_add_everyone(ntfs_inode *ni)
+{
+	/* JPA SECURITY_DESCRIPTOR_ATTR *sd; */
+	SECURITY_DESCRIPTOR_RELATIVE *sd;
+	int ret, sd_len;
+	
+	/* Create SECURITY_DESCRIPTOR attribute (everyone has full access). */
+	sd = ntfs_sd_everyone(&sd_len);
+	if (!sd)
+		return -1;
+
 	ret = ntfs_attr_add(ni, AT_SECURITY_DESCRIPTOR, AT_UNNAMED, 0, (u8*)sd,
 			    sd_len);
 	if (ret)
@@ -4015,6 +4812,71 @@ static le32 build_inherited_id(struct SECURITY_CONTEXT *scx,
 	return (securid);
 }
 
+#if CACHE_INHERIT_SIZE
+
+/*
+ *		Cacheing of the inherited security ids
+ *
+ *	The id inherited only depends on the descriptor of the parent
+ *	directory, on whether a directory is created, and on the user
+ *	creating it. As a descriptor is never changed in $Secure, a
+ *	directory getting a new descriptor gets a new security id, so
+ *	the entries do not have to be invalidated.
+ */
+
+static int inherit_compare(const struct CACHED_INHERIT *cached,
+			const struct CACHED_INHERIT *item)
+{
+	return ((cached->parent_id != item->parent_id)
+		|| (cached->fordir != item->fordir)
+		|| (cached->uid != item->uid)
+		|| (cached->gid != item->gid));
+}
+
+static le32 fetch_inherited_id(struct SECURITY_CONTEXT *scx,
+			le32 parent_id, BOOL fordir)
+{
+	struct CACHED_INHERIT wanted;
+	struct CACHED_INHERIT *cached;
+	le32 securid;
+
+	securid = const_cpu_to_le32(0);
+	wanted.parent_id = parent_id;
+	wanted.fordir = fordir;
+	wanted.uid = scx->uid;
+	wanted.gid = scx->gid;
+	wanted.variable = (void*)NULL;
+	wanted.varsize = 0;
+	ntfs_cache_lock(scx->vol);
+	cached = (struct CACHED_INHERIT*)ntfs_fetch_cache(
+			scx->vol->inherit_cache, GENERIC(&wanted),
+			(cache_compare)inherit_compare);
+	if (cached)
+		securid = cached->securid;
+	ntfs_cache_unlock(scx->vol);
+	return (securid);
+}
+
+static void enter_inherited_id(struct SECURITY_CONTEXT *scx,
+			le32 parent_id, BOOL fordir, le32 securid)
+{
+	struct CACHED_INHERIT wanted;
+
+	wanted.parent_id = parent_id;
+	wanted.fordir = fordir;
+	wanted.uid = scx->uid;
+	wanted.gid = scx->gid;
+	wanted.securid = securid;
+	wanted.variable = (void*)NULL;
+	wanted.varsize = 0;
+	ntfs_cache_lock(scx->vol);
+	ntfs_enter_cache(scx->vol->inherit_cache, GENERIC(&wanted),
+			(cache_compare)inherit_compare);
+	ntfs_cache_unlock(scx->vol);
+}
+
+#endif /* CACHE_INHERIT_SIZE */
+
 /*
  *		Get an inherited security id
  *
@@ -4051,6 +4913,12 @@ le32 ntfs_inherited_id(struct SECURITY_CONTEXT *scx,
 		    && (cached->uid == scx->uid) && (cached->gid == scx->gid))
 			securid = (fordir ? cached->inh_dirid
 					: cached->inh_fileid);
+#if CACHE_INHERIT_SIZE
+			/* another user, or the directory is not owned */
+		if (!securid && scx->vol->inherit_cache)
+			securid = fetch_inherited_id(scx,
+					dir_ni->security_id, fordir);
+#endif
 	}
 		/*
 		 * Not cached or not available in cache, compute it all
@@ -4076,6 +4944,14 @@ le32 ntfs_inherited_id(struct SECURITY_CONTEXT *scx,
 					else
 						cached->inh_fileid = securid;
 				}
+#if CACHE_INHERIT_SIZE
+				if (scx->vol->inherit_cache
+				    && test_nino_flag(dir_ni, v3_Extensions)
+				    && dir_ni->security_id)
+					enter_inherited_id(scx,
+						dir_ni->security_id,
+						fordir, securid);
+#endif
 			}
 		}
 	}
@@ -4487,6 +5363,7 @@ int ntfs_open_secure(ntfs_volume *vol)
 	vol->secure_ni = (ntfs_inode*)NULL;
 	vol->secure_xsii = (ntfs_index_context*)NULL;
 	vol->secure_xsdh = (ntfs_index_context*)NULL;
+	vol->secure_intern = (struct SECURE_INTERN*)NULL;
 	if (vol->major_ver >= 3) {
 			/* make sure this is a genuine $Secure inode 9 */
 		ni = ntfs_pathname_to_inode(vol, NULL, "$Secure");
@@ -4498,6 +5375,8 @@ int ntfs_open_secure(ntfs_volume *vol)
 						sdh_stream, 4);
 			if (ni && vol->secure_xsii && vol->secure_xsdh) {
 				vol->secure_ni = ni;
+				vol->secure_intern = (struct SECURE_INTERN*)
+					ntfs_calloc(sizeof(struct SECURE_INTERN));
 				res = 0;
 			}
 		}
@@ -4515,6 +5394,7 @@ void ntfs_close_secure(struct SECURITY_CONTEXT *scx)
 	ntfs_volume *vol;
 
 	vol = scx->vol;
+	intern_release(vol);
 	if (vol->secure_ni) {
 		ntfs_index_ctx_put(vol->secure_xsii);
 		ntfs_index_ctx_put(vol->secure_xsdh);
@@ -5197,6 +6077,171 @@ INDEX_ENTRY *ntfs_read_sdh(struct SECURITY_API *scapi,
 	return (ret);
 }
 
+/*
+ *		Scan an index of $Secure sequentially
+ *
+ *	The index blocks are read in their order on the device, in large
+ *	batches, instead of walking the tree, so the entries are passed
+ *	to the callback in no defined order. The callback returns zero
+ *	to go on, or nonzero to stop the scan.
+ *
+ *	Returns the count of entries passed to the callback, or -1 if
+ *	there is an error (EIO if some index blocks were unreadable)
+ */
+
+static int scan_secure_index(struct SECURITY_API *scapi, ntfschar *name,
+		ntfs_secure_entry_callback callback, void *context)
+{
+	struct INDEX_SCAN *scan;
+	INDEX_ENTRY *ie;
+	int count;
+
+	count = -1; /* default return */
+	if (scapi && (scapi->magic == MAGIC_API) && callback) {
+		if (scapi->security.vol->secure_ni) {
+			scan = ntfs_index_scan_start(
+					scapi->security.vol->secure_ni,
+					name, 4);
+			if (scan) {
+				count = 0;
+				while (ntfs_index_scan_next(scan, &ie)
+				    && !callback(context, ie))
+					count++;
+				if (ntfs_index_scan_end(scan))
+					count = -1;
+			}
+		} else
+			errno = EOPNOTSUPP;
+	} else
+		errno = EINVAL;
+	return (count);
+}
+
+/*
+ *		Scan $SII sequentially (for auditing security data)
+ */
+
+int ntfs_scan_sii(struct SECURITY_API *scapi,
+		ntfs_secure_entry_callback callback, void *context)
+{
+	return (scan_secure_index(scapi, sii_stream, callback, context));
+}
+
+/*
+ *		Scan $SDH sequentially (for auditing security data)
+ */
+
+int ntfs_scan_sdh(struct SECURITY_API *scapi,
+		ntfs_secure_entry_callback callback, void *context)
+{
+	return (scan_secure_index(scapi, sdh_stream, callback, context));
+}
+
+struct SECURID_SCAN {
+	ntfs_secure_file_callback callback;
+	void *context;
+#ifdef ENABLE_THREADS
+	pthread_mutex_t lock;
+#endif
+} ;
+
+/*
+ *		Get the security_id of a base MFT record
+ *
+ *	Called concurrently by the threads scanning the MFT. The records
+ *	are parsed without the lock, and the callback is called under it.
+ */
+
+static int securid_record(ntfs_volume *vol __attribute__((unused)),
+			s64 mft_no, MFT_RECORD *mrec, void *arg)
+{
+	struct SECURID_SCAN *sscan = (struct SECURID_SCAN*)arg;
+	ntfs_attr_search_ctx *ctx;
+	const STANDARD_INFORMATION *si;
+	u32 securid;
+	BOOL found;
+	int ret;
+
+	if (!mrec
+	    || !ntfs_is_file_record(mrec->magic)
+	    || !(mrec->flags & MFT_RECORD_IN_USE)
+	    || mrec->base_mft_record)
+		return (0);
+	ctx = ntfs_attr_get_search_ctx(NULL, mrec);
+	if (!ctx)
+		return (-1);
+	securid = 0;
+	found = FALSE;
+	while (!found && !ntfs_attrs_walk(ctx)
+	    && (ctx->attr->type != AT_END)) {
+		if ((ctx->attr->type == AT_STANDARD_INFORMATION)
+		    && !ctx->attr->non_resident) {
+			found = TRUE;
+			si = (const STANDARD_INFORMATION*)((const char*)
+				ctx->attr
+				+ le16_to_cpu(ctx->attr->value_offset));
+			if (le32_to_cpu(ctx->attr->value_length)
+					>= offsetof(STANDARD_INFORMATION, v3_end))
+				securid = le32_to_cpu(si->security_id);
+		}
+	}
+	ntfs_attr_put_search_ctx(ctx);
+	ret = 0;
+	if (found) {
+#ifdef ENABLE_THREADS
+		pthread_mutex_lock(&sscan->lock);
+#endif
+		if (sscan->callback(sscan->context, mft_no, securid)) {
+			errno = ECANCELED;
+			ret = -1;
+		}
+#ifdef ENABLE_THREADS
+		pthread_mutex_unlock(&sscan->lock);
+#endif
+	}
+	return (ret);
+}
+
+/*
+ *		Get the security_id of all the files (for auditing)
+ *
+ *	The MFT is read in large batches by several threads (zero for
+ *	one per processor), and the callback is called for each file in
+ *	no defined order, with a zero security_id if the file has none.
+ *	The calls are serialized, and the callback returns zero to go on,
+ *	or nonzero to stop the scan.
+ *
+ *	Returns 0 if successful, or -1 if there is an error (ECANCELED
+ *	if stopped by the callback)
+ */
+
+int ntfs_scan_security_ids(struct SECURITY_API *scapi, int threads,
+		ntfs_secure_file_callback callback, void *context)
+{
+	struct SECURID_SCAN sscan;
+	ntfs_volume *vol;
+	int res;
+
+	res = -1; /* default return */
+	if (scapi && (scapi->magic == MAGIC_API) && callback) {
+		vol = scapi->security.vol;
+		sscan.callback = callback;
+		sscan.context = context;
+#ifdef ENABLE_THREADS
+		pthread_mutex_init(&sscan.lock, NULL);
+#endif
+		res = ntfs_mft_scan_parallel(vol, 0,
+				vol->mft_na->initialized_size
+					>> vol->mft_record_size_bits,
+				threads, securid_record, &sscan);
+#ifdef ENABLE_THREADS
+		pthread_mutex_destroy(&sscan.lock);
+#endif
+	} else
+		errno = EINVAL;
+	return (res);
+}
+
 /*
  *		Get the mapped user SID
  *	A buffer of 40 bytes has to be supplied
@@ -24,6 +24,8 @@
  * algorithm with 4096-byte chunks).  System-compressed files can only be read,
  * not written; on Windows, if a program attempts to write to such a file, it is
  * automatically decompressed and turned into an ordinary uncompressed file.
+ * An ordinary file can however be turned into a system-compressed one as a
+ * whole, by ntfs_compress_system_file(), in the XPRESS formats.
  *
  * Rather than building it directly into NTFS, Microsoft implemented this new
  * compression mode using the Windows Overlay Filesystem (WOF) filter driver
@@ -71,9 +73,20 @@
 #include <string.h>
 #endif
 
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
+
 #include "attrib.h"
 #include "layout.h"
 #include "misc.h"
+#include "cache.h"
+#include "lock.h"
+#include "reparse.h"
 #include "system_compression.h"
 
 /******************************************************************************/
@@ -149,11 +162,15 @@ static ntfschar compressed_stream_name[] = {
 
 /******************************************************************************/
 
-/* The maximum number of chunk offsets that may be cached at any one time.  This
- * is purely an implementation detail, and this number can be changed.  The
- * minimum possible value is 2, and the maximum possible value is UINT32_MAX
- * divided by the maximum chunk size.  */
+/* The number of chunk offsets that may be cached at any one time.  The chunk
+ * table of small files is cached whole, larger files get a window sized from
+ * their number of chunks, between NUM_CHUNK_OFFSETS and MAX_CHUNK_OFFSETS, so
+ * that random reads do not reload the table too often.  These are purely
+ * implementation details, and these numbers can be changed.  The minimum
+ * possible value is 2, and the maximum possible value is UINT32_MAX divided by
+ * the maximum chunk size.  */
 #define NUM_CHUNK_OFFSETS	128
+#define MAX_CHUNK_OFFSETS	16384
 
 /* A special marker value not used by any chunk index  */
 #define INVALID_CHUNK_INDEX	UINT64_MAX
@@ -194,10 +211,12 @@ struct ntfs_system_decompression_ctx {
 	 * full or the offset of the file's last chunk has been cached.  There
 	 * is an extra entry at end-of-file which contains the end-of-file
 	 * offset.  All offsets are stored relative to 'base_chunk_offset'.
+	 * The array has 'num_chunk_offsets' entries.
 	 */
 	u64 base_chunk_idx;
 	u64 base_chunk_offset;
-	u32 chunk_offsets[NUM_CHUNK_OFFSETS];
+	u32 num_chunk_offsets;
+	u32 *chunk_offsets;
 
 	/* A temporary buffer used to hold the compressed chunk currently being
 	 * decompressed or the chunk offset data currently being parsed.  */
@@ -211,41 +230,65 @@ struct ntfs_system_decompression_ctx {
 	 *
 	 * This cache is intended to prevent adjacent reads with lengths shorter
 	 * than the chunk size from causing redundant chunk decompressions.
-	 * It's not intended to be a general purpose data cache.
+	 * Other recently decompressed chunks are kept in the volume-wide
+	 * chunk cache, which survives the decompression context.
 	 */
 	void *cached_chunk;
 	u64 cached_chunk_idx;
+
+	/* A buffer of SYSCOMP_BATCH_SIZE bytes holding the stored data of
+	 * consecutive chunks read at once, allocated on first use.  */
+	void *batch_buffer;
+};
+
+/* The maximum number of chunks in a batch, for the smallest chunk size  */
+#define MAX_BATCH_CHUNKS	(SYSCOMP_BATCH_SIZE >> 12)
+
+/* A batch of consecutive chunks decompressed straight into the read buffer,
+ * possibly by several threads, each with its own decompressor.  */
+struct chunk_batch {
+	WOF_FILE_PROVIDER_COMPRESSION_FORMAT format;
+	const u8 *in;		/* the stored data of the chunks  */
+	u8 *out;		/* chunk i decompresses to out + i * chunk_size  */
+	u32 chunk_size;
+	u32 last_size;		/* uncompressed size of the last chunk  */
+	size_t count;
+	u32 in_offsets[MAX_BATCH_CHUNKS + 1];
+	u8 failed[MAX_BATCH_CHUNKS];
+#ifdef ENABLE_THREADS
+	pthread_mutex_t lock;
+#endif
+	size_t next;		/* next chunk to decompress  */
 };
 
-static int allocate_decompressor(struct ntfs_system_decompression_ctx *ctx)
+static void *allocate_decompressor(WOF_FILE_PROVIDER_COMPRESSION_FORMAT format)
 {
-	if (ctx->format == FORMAT_LZX)
-		ctx->decompressor = lzx_allocate_decompressor();
+	if (format == FORMAT_LZX)
+		return lzx_allocate_decompressor();
 	else
-		ctx->decompressor = xpress_allocate_decompressor();
-	if (!ctx->decompressor)
-		return -1;
-	return 0;
+		return xpress_allocate_decompressor();
 }
 
-static void free_decompressor(struct ntfs_system_decompression_ctx *ctx)
+static void free_decompressor(WOF_FILE_PROVIDER_COMPRESSION_FORMAT format,
+			      void *decompressor)
 {
-	if (ctx->format == FORMAT_LZX)
-		lzx_free_decompressor(ctx->decompressor);
+	if (format == FORMAT_LZX)
+		lzx_free_decompressor(decompressor);
 	else
-		xpress_free_decompressor(ctx->decompressor);
+		xpress_free_decompressor(decompressor);
 }
 
-static int decompress(struct ntfs_system_decompression_ctx *ctx,
+static int decompress(WOF_FILE_PROVIDER_COMPRESSION_FORMAT format,
+		      void *decompressor,
 		      const void *compressed_data, size_t compressed_size,
 		      void *uncompressed_data, size_t uncompressed_size)
 {
-	if (ctx->format == FORMAT_LZX)
-		return lzx_decompress(ctx->decompressor,
+	if (format == FORMAT_LZX)
+		return lzx_decompress(decompressor,
 				      compressed_data, compressed_size,
 				      uncompressed_data, uncompressed_size);
 	else
-		return xpress_decompress(ctx->decompressor,
+		return xpress_decompress(decompressor,
 					 compressed_data, compressed_size,
 					 uncompressed_data, uncompressed_size);
 }
@@ -253,8 +296,10 @@ static int decompress(struct ntfs_system_decompression_ctx *ctx,
 static int get_compression_format(ntfs_inode *ni,
 				  WOF_FILE_PROVIDER_COMPRESSION_FORMAT *format_ret)
 {
-	WOF_FILE_PROVIDER_REPARSE_POINT_V1 *rp;
+	const WOF_FILE_PROVIDER_REPARSE_POINT_V1 *rp;
+	WOF_FILE_PROVIDER_REPARSE_POINT_V1 *buf;
 	s64 rpbuflen;
+	u32 peek_size;
 
 	if (!ni) {
 		errno = EINVAL;
@@ -267,10 +312,20 @@ static int get_compression_format(ntfs_inode *ni,
 		return -1;
 	}
 
-	/* Read the reparse point.  */
-	rp = ntfs_attr_readall(ni, AT_REPARSE_POINT, AT_UNNAMED, 0, &rpbuflen);
-	if (!rp)
-		return -1;
+	/* Read the reparse point, normally just looked at in the record.  */
+	buf = NULL;
+	rp = ntfs_attr_peek(ni, AT_REPARSE_POINT, AT_UNNAMED, 0, &peek_size);
+	if (rp)
+		rpbuflen = peek_size;
+	else {
+		if (errno != EOVERFLOW)
+			return -1;
+		buf = ntfs_attr_readall(ni, AT_REPARSE_POINT, AT_UNNAMED, 0,
+					&rpbuflen);
+		if (!buf)
+			return -1;
+		rp = buf;
+	}
 
 	/* Does the reparse point indicate a system compressed file?  */
 	if (rpbuflen < (s64)sizeof(WOF_FILE_PROVIDER_REPARSE_POINT_V1) ||
@@ -283,14 +338,14 @@ static int get_compression_format(ntfs_inode *ni,
 	     rp->file.compression_format != FORMAT_XPRESS16K &&
 	     rp->file.compression_format != FORMAT_LZX))
 	{
-		free(rp);
+		free(buf);
 		errno = EOPNOTSUPP;
 		return -1;
 	}
 
 	/* Save the compression format identifier.  */
 	*format_ret = rp->file.compression_format;
-	free(rp);
+	free(buf);
 	return 0;
 }
 
@@ -375,7 +430,8 @@ ntfs_open_system_decompression_ctx(ntfs_inode *ni)
 
 	/* Allocate the decompressor.  */
 	ctx->format = format;
-	if (allocate_decompressor(ctx))
+	ctx->decompressor = allocate_decompressor(format);
+	if (!ctx->decompressor)
 		goto err_free_ctx;
 
 	/* Open the WofCompressedData stream.  */
@@ -402,25 +458,35 @@ ntfs_open_system_decompression_ctx(ntfs_inode *ni)
 	 * WofCompressedData stream.  */
 	ctx->compressed_size = ctx->na->data_size;
 
-	/* Initially, no chunk offsets are cached.  */
+	/* Initially, no chunk offsets are cached.  Size the chunk offsets
+	 * cache for the whole table (including the implicit entries) if
+	 * possible.  */
 	ctx->base_chunk_idx = INVALID_CHUNK_INDEX;
+	ctx->num_chunk_offsets = min(max(ctx->num_chunks + 1,
+					 NUM_CHUNK_OFFSETS),
+				     MAX_CHUNK_OFFSETS);
 
 	/* Allocate buffers for chunk data.  */
+	ctx->chunk_offsets = ntfs_malloc(ctx->num_chunk_offsets *
+					 sizeof(u32));
 	ctx->temp_buffer = ntfs_malloc(max(ctx->chunk_size,
-					   NUM_CHUNK_OFFSETS * sizeof(u64)));
+					   ctx->num_chunk_offsets *
+						sizeof(u64)));
 	ctx->cached_chunk = ntfs_malloc(ctx->chunk_size);
 	ctx->cached_chunk_idx = INVALID_CHUNK_INDEX;
-	if (!ctx->temp_buffer || !ctx->cached_chunk)
+	ctx->batch_buffer = NULL;
+	if (!ctx->chunk_offsets || !ctx->temp_buffer || !ctx->cached_chunk)
 		goto err_close_ctx;
 
 	return ctx;
 
 err_close_ctx:
 	free(ctx->cached_chunk);
+	free(ctx->chunk_offsets);
 	free(ctx->temp_buffer);
 	ntfs_attr_close(ctx->na);
 err_free_decompressor:
-	free_decompressor(ctx);
+	free_decompressor(ctx->format, ctx->decompressor);
 err_free_ctx:
 	free(ctx);
 err:
@@ -440,11 +506,11 @@ static int get_chunk_location(struct ntfs_system_decompression_ctx *ctx,
 	 * the needed offsets into the cache.  To reduce the number of chunk
 	 * table reads that may be required later, also load some extra.  */
 	if (chunk_idx < ctx->base_chunk_idx ||
-	    chunk_idx + 1 >= ctx->base_chunk_idx + NUM_CHUNK_OFFSETS)
+	    chunk_idx + 1 >= ctx->base_chunk_idx + ctx->num_chunk_offsets)
 	{
 		const u64 start_chunk = chunk_idx;
 		const u64 end_chunk =
-			chunk_idx + min(NUM_CHUNK_OFFSETS - 1,
+			chunk_idx + min(ctx->num_chunk_offsets - 1,
 					ctx->num_chunks - chunk_idx);
 		const int entry_shift =
 			(ctx->uncompressed_size <= UINT32_MAX) ? 2 : 3;
@@ -533,6 +599,18 @@ static int get_chunk_location(struct ntfs_system_decompression_ctx *ctx,
 	return 0;
 }
 
+/* Return the uncompressed size of chunk @chunk_idx: all chunks decompress to
+ * 'chunk_size' bytes except possibly the last, which decompresses to whatever
+ * remains.  */
+static u32 get_chunk_size(struct ntfs_system_decompression_ctx *ctx,
+			  u64 chunk_idx)
+{
+	if (chunk_idx == ctx->num_chunks - 1)
+		return ((ctx->uncompressed_size - 1) &
+			(ctx->chunk_size - 1)) + 1;
+	return ctx->chunk_size;
+}
+
 /* Retrieve into @buffer the uncompressed data of chunk @chunk_idx.  */
 static int read_and_decompress_chunk(struct ntfs_system_decompression_ctx *ctx,
 				     u64 chunk_idx, void *buffer)
@@ -584,10 +662,113 @@ static int read_and_decompress_chunk(struct ntfs_system_decompression_ctx *ctx,
 		return 0;
 
 	/* The chunk was stored compressed.  Decompress its data.  */
-	return decompress(ctx, read_buffer, stored_size,
+	return decompress(ctx->format, ctx->decompressor,
+			  read_buffer, stored_size,
 			  buffer, uncompressed_size);
 }
 
+#if CACHE_CHUNK_SIZE
+
+/*
+ * Decompressed chunks are also kept in a volume-wide LRU cache, so that
+ * alternating between regions of a file, or reopening it, does not decompress
+ * the same chunks again.  The entries are keyed by the inode number and
+ * sequence number (so that a reused MFT record does not hit the entries of a
+ * deleted file), the size of the compressed stream and the chunk index.  The
+ * memory is bounded by CACHE_CHUNK_SIZE entries of at most one chunk.
+ */
+
+int ntfs_system_chunk_hash(const struct CACHED_GENERIC *item)
+{
+	const struct CACHED_CHUNK *chunk = (const struct CACHED_CHUNK*)item;
+
+	return ((chunk->inum * 131 + chunk->chunk) & 0x7fffffff);
+}
+
+static int chunk_cache_compare(const struct CACHED_GENERIC *cached,
+			       const struct CACHED_GENERIC *wanted)
+{
+	const struct CACHED_CHUNK *c = (const struct CACHED_CHUNK*)cached;
+	const struct CACHED_CHUNK *w = (const struct CACHED_CHUNK*)wanted;
+
+	return (c->inum != w->inum
+		|| c->chunk != w->chunk
+		|| c->compressed_size != w->compressed_size
+		|| c->sequence_number != w->sequence_number);
+}
+
+/* Build the cache key of chunk @chunk_idx.  */
+static void set_chunk_key(struct ntfs_system_decompression_ctx *ctx,
+			  u64 chunk_idx, struct CACHED_CHUNK *item)
+{
+	item->inum = ctx->na->ni->mft_no;
+	item->chunk = chunk_idx;
+	item->compressed_size = ctx->compressed_size;
+	item->sequence_number = ctx->na->ni->mrec->sequence_number;
+}
+
+/* Copy chunk @chunk_idx from the volume cache into 'cached_chunk'.  Return
+ * TRUE if it was found.  */
+static BOOL fetch_cached_chunk(struct ntfs_system_decompression_ctx *ctx,
+			       u64 chunk_idx)
+{
+	ntfs_volume *vol = ctx->na->ni->vol;
+	struct CACHED_CHUNK item;
+	struct CACHED_CHUNK *cached;
+	BOOL found = FALSE;
+
+	if (vol->chunk_cache) {
+		set_chunk_key(ctx, chunk_idx, &item);
+		ntfs_cache_lock(vol);
+		cached = (struct CACHED_CHUNK*)ntfs_fetch_cache(
+				vol->chunk_cache, GENERIC(&item),
+				chunk_cache_compare);
+		if (cached && (cached->datasize <= ctx->chunk_size)) {
+			memcpy(ctx->cached_chunk, cached->data,
+			       cached->datasize);
+			found = TRUE;
+		}
+		ntfs_cache_unlock(vol);
+	}
+	return found;
+}
+
+/* Enter chunk @chunk_idx, just decompressed into 'cached_chunk', into the
+ * volume cache.  */
+static void enter_cached_chunk(struct ntfs_system_decompression_ctx *ctx,
+			       u64 chunk_idx)
+{
+	ntfs_volume *vol = ctx->na->ni->vol;
+	struct CACHED_CHUNK item;
+
+	if (vol->chunk_cache) {
+		set_chunk_key(ctx, chunk_idx, &item);
+		item.data = ctx->cached_chunk;
+		item.datasize = get_chunk_size(ctx, chunk_idx);
+		ntfs_cache_lock(vol);
+		ntfs_enter_cache(vol->chunk_cache, GENERIC(&item),
+				 chunk_cache_compare);
+		ntfs_cache_unlock(vol);
+	}
+}
+
+#else /* CACHE_CHUNK_SIZE */
+
+static BOOL fetch_cached_chunk(
+		struct ntfs_system_decompression_ctx *ctx __attribute__((unused)),
+		u64 chunk_idx __attribute__((unused)))
+{
+	return FALSE;
+}
+
+static void enter_cached_chunk(
+		struct ntfs_system_decompression_ctx *ctx __attribute__((unused)),
+		u64 chunk_idx __attribute__((unused)))
+{
+}
+
+#endif /* CACHE_CHUNK_SIZE */
+
 /* Retrieve a pointer to the uncompressed data of the specified chunk.  On
  * failure, return NULL and set errno.  */
 static const void *get_chunk_data(struct ntfs_system_decompression_ctx *ctx,
@@ -595,13 +776,172 @@ static const void *get_chunk_data(struct ntfs_system_decompression_ctx *ctx,
 {
 	if (chunk_idx != ctx->cached_chunk_idx) {
 		ctx->cached_chunk_idx = INVALID_CHUNK_INDEX;
-		if (read_and_decompress_chunk(ctx, chunk_idx, ctx->cached_chunk))
-			return NULL;
+		if (!fetch_cached_chunk(ctx, chunk_idx)) {
+			if (read_and_decompress_chunk(ctx, chunk_idx,
+						      ctx->cached_chunk))
+				return NULL;
+			enter_cached_chunk(ctx, chunk_idx);
+		}
 		ctx->cached_chunk_idx = chunk_idx;
 	}
 	return ctx->cached_chunk;
 }
 
+/* Get the index of the next chunk of @batch to decompress.  */
+static size_t next_batch_chunk(struct chunk_batch *batch)
+{
+	size_t i;
+
+#ifdef ENABLE_THREADS
+	pthread_mutex_lock(&batch->lock);
+#endif
+	i = batch->next;
+	if (i < batch->count)
+		batch->next++;
+#ifdef ENABLE_THREADS
+	pthread_mutex_unlock(&batch->lock);
+#endif
+	return i;
+}
+
+/* Decompress the chunks of @batch not yet taken by another thread.  */
+static void decompress_batch(struct chunk_batch *batch, void *decompressor)
+{
+	size_t i;
+	u32 stored_size;
+	u32 size;
+
+	while ((i = next_batch_chunk(batch)) < batch->count) {
+		stored_size = batch->in_offsets[i + 1] - batch->in_offsets[i];
+		size = (i == batch->count - 1) ? batch->last_size :
+						 batch->chunk_size;
+		if (stored_size == size) {
+			/* Chunk is stored uncompressed  */
+			memcpy(&batch->out[i * batch->chunk_size],
+			       &batch->in[batch->in_offsets[i]], size);
+			batch->failed[i] = 0;
+		} else {
+			batch->failed[i] = decompress(batch->format,
+					decompressor,
+					&batch->in[batch->in_offsets[i]],
+					stored_size,
+					&batch->out[i * batch->chunk_size],
+					size) != 0;
+		}
+	}
+}
+
+#ifdef ENABLE_THREADS
+
+/* Thread helping the caller to decompress a batch.  */
+static void *decompress_batch_worker(void *arg)
+{
+	struct chunk_batch *batch = arg;
+	void *decompressor;
+
+	decompressor = allocate_decompressor(batch->format);
+	if (decompressor) {
+		decompress_batch(batch, decompressor);
+		free_decompressor(batch->format, decompressor);
+	}
+	return NULL;
+}
+
+#endif /* ENABLE_THREADS */
+
+/* Decompress straight into @out the @count consecutive chunks starting at
+ * @first_chunk, their stored data being fetched by a single read.  On
+ * success, return the number of leading chunks which could be decompressed.
+ * On failure, return -1 and set errno.  */
+static s64 read_chunk_batch(struct ntfs_system_decompression_ctx *ctx,
+			    u64 first_chunk, size_t count, u8 *out)
+{
+	struct chunk_batch batch;
+	u64 first_offset = 0;
+	u64 offset;
+	u32 stored_size;
+	size_t i;
+	s64 res;
+#ifdef ENABLE_THREADS
+	pthread_t tids[SYSCOMP_MAX_THREADS];
+	int threads;
+	int started;
+	int j;
+#endif
+
+	if (!ctx->batch_buffer) {
+		ctx->batch_buffer = ntfs_malloc(SYSCOMP_BATCH_SIZE);
+		if (!ctx->batch_buffer)
+			return -1;
+	}
+
+	/* Locate the stored chunks, which are consecutive in the stream.  */
+	batch.format = ctx->format;
+	batch.in = ctx->batch_buffer;
+	batch.out = out;
+	batch.chunk_size = ctx->chunk_size;
+	batch.last_size = get_chunk_size(ctx, first_chunk + count - 1);
+	batch.count = count;
+	batch.next = 0;
+	batch.in_offsets[0] = 0;
+	for (i = 0; i < count; i++) {
+		if (get_chunk_location(ctx, first_chunk + i,
+				       &offset, &stored_size))
+			return -1;
+		if (!i)
+			first_offset = offset;
+		if (offset != first_offset + batch.in_offsets[i] ||
+		    stored_size <= 0 ||
+		    stored_size > get_chunk_size(ctx, first_chunk + i)) {
+			errno = EINVAL;
+			return -1;
+		}
+		batch.in_offsets[i + 1] = batch.in_offsets[i] + stored_size;
+	}
+
+	/* Read the stored data of all the chunks.  */
+	res = ntfs_attr_pread(ctx->na, first_offset, batch.in_offsets[count],
+			      ctx->batch_buffer);
+	if (res != batch.in_offsets[count]) {
+		if (res >= 0)
+			errno = EINVAL;
+		return -1;
+	}
+
+	/* Decompress, with the help of other threads when there are enough
+	 * chunks and several processors.  */
+#ifdef ENABLE_THREADS
+	threads = 1;
+	if (count >= SYSCOMP_PARALLEL_MIN) {
+#if defined(HAVE_UNISTD_H) && defined(_SC_NPROCESSORS_ONLN)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+		if (threads > SYSCOMP_MAX_THREADS)
+			threads = SYSCOMP_MAX_THREADS;
+	}
+	pthread_mutex_init(&batch.lock, NULL);
+	started = 0;
+	while (started < (threads - 1) &&
+	       !pthread_create(&tids[started], NULL,
+			       decompress_batch_worker, &batch))
+		started++;
+	decompress_batch(&batch, ctx->decompressor);
+	for (j = 0; j < started; j++)
+		pthread_join(tids[j], NULL);
+	pthread_mutex_destroy(&batch.lock);
+#else
+	decompress_batch(&batch, ctx->decompressor);
+#endif
+
+	for (i = 0; i < count && !batch.failed[i]; i++)
+		;
+	if (!i) {
+		errno = EINVAL;
+		return -1;
+	}
+	return i;
+}
+
 /*
  * ntfs_read_system_compressed_data - Read data from a system-compressed file
  *
@@ -644,6 +984,35 @@ ssize_t ntfs_read_system_compressed_data(struct ntfs_system_decompression_ctx *c
 	do {
 		u32 len_to_copy;
 		const u8 *chunk;
+		size_t num_full;
+		s64 done;
+
+		/* Consecutive chunks entirely covered by the read are read
+		 * and decompressed by batches, straight into the buffer.  */
+		if (!offset_in_chunk && chunk_idx != ctx->cached_chunk_idx) {
+			num_full = (size_t)(end_p - p) >> ctx->chunk_order;
+			if (chunk_idx + num_full == ctx->num_chunks - 1 &&
+			    (u64)(end_p - p) == ctx->uncompressed_size -
+						(chunk_idx << ctx->chunk_order))
+				num_full++;
+			num_full = min(num_full,
+				       (size_t)(SYSCOMP_BATCH_SIZE >>
+						ctx->chunk_order));
+			if (num_full >= 2) {
+				done = read_chunk_batch(ctx, chunk_idx,
+							num_full, p);
+				if (done > 0) {
+					if (chunk_idx + done == ctx->num_chunks)
+						p += ctx->uncompressed_size -
+						     (chunk_idx <<
+						      ctx->chunk_order);
+					else
+						p += done << ctx->chunk_order;
+					chunk_idx += done;
+					continue;
+				}
+			}
+		}
 
 		if (chunk_idx == ctx->num_chunks - 1)
 			chunk_size = ((ctx->uncompressed_size - 1) &
@@ -673,9 +1042,232 @@ void ntfs_close_system_decompression_ctx(struct ntfs_system_decompression_ctx *c
 {
 	if (ctx) {
 		free(ctx->cached_chunk);
+		free(ctx->chunk_offsets);
 		free(ctx->temp_buffer);
+		free(ctx->batch_buffer);
 		ntfs_attr_close(ctx->na);
-		free_decompressor(ctx);
+		free_decompressor(ctx->format, ctx->decompressor);
 		free(ctx);
 	}
 }
+
+/*
+ * Write the chunks of the unnamed data stream @na, which has @num_chunks
+ * chunks of 1 << @chunk_order bytes, compressed to the stream @cna after
+ * its chunk table, and fill the chunk table.  Return the size of the
+ * compressed stream, or -1 on failure.
+ */
+static s64 write_compressed_chunks(ntfs_attr *na, ntfs_attr *cna,
+				   u32 chunk_order, u64 num_chunks,
+				   int entry_shift, void *table)
+{
+	const u32 chunk_size = (u32)1 << chunk_order;
+	const u32 chunks_per_batch = SYSCOMP_BATCH_SIZE >> chunk_order;
+	const s64 table_size = (num_chunks - 1) << entry_shift;
+	struct xpress_compressor *compressor;
+	u8 *inbuf;
+	u8 *outbuf;
+	u64 chunk_idx;
+	u64 i, count;
+	s64 pos, in_pos;
+	s64 batch_size;
+	size_t out_size;
+	size_t size, csize;
+	s64 ret;
+
+	ret = -1;
+	compressor = xpress_allocate_compressor(chunk_size);
+	inbuf = ntfs_malloc(SYSCOMP_BATCH_SIZE);
+	outbuf = ntfs_malloc(SYSCOMP_BATCH_SIZE);
+	if (!compressor || !inbuf || !outbuf)
+		goto out;
+
+	pos = table_size;
+	for (chunk_idx = 0; chunk_idx < num_chunks; chunk_idx += count) {
+		count = min(num_chunks - chunk_idx, chunks_per_batch);
+		in_pos = chunk_idx << chunk_order;
+		batch_size = min(na->data_size - in_pos,
+				 (s64)(count << chunk_order));
+		if (ntfs_attr_pread(na, in_pos, batch_size, inbuf)
+				!= batch_size) {
+			if (errno == 0)
+				errno = EIO;
+			goto out;
+		}
+		out_size = 0;
+		for (i = 0; i < count; i++) {
+			size = min(batch_size - (s64)(i << chunk_order),
+				   chunk_size);
+			/* Chunks not smaller when compressed are stored
+			 * uncompressed.  */
+			csize = xpress_compress(compressor,
+					&inbuf[i << chunk_order], size,
+					&outbuf[out_size], size - 1);
+			if (!csize) {
+				memcpy(&outbuf[out_size],
+				       &inbuf[i << chunk_order], size);
+				csize = size;
+			}
+			out_size += csize;
+			/* The table gives where each chunk but the first
+			 * begins, after the table.  */
+			if (chunk_idx + i + 1 < num_chunks) {
+				if (entry_shift == 3)
+					((le64 *)table)[chunk_idx + i] =
+						cpu_to_le64(pos + out_size
+							- table_size);
+				else
+					((le32 *)table)[chunk_idx + i] =
+						cpu_to_le32(pos + out_size
+							- table_size);
+			}
+		}
+		if (ntfs_attr_pwrite(cna, pos, out_size, outbuf)
+				!= (s64)out_size) {
+			if (errno == 0)
+				errno = EIO;
+			goto out;
+		}
+		pos += out_size;
+	}
+	if (table_size
+	    && (ntfs_attr_pwrite(cna, 0, table_size, table) != table_size)) {
+		if (errno == 0)
+			errno = EIO;
+		goto out;
+	}
+	ret = pos;
+out:
+	free(outbuf);
+	free(inbuf);
+	xpress_free_compressor(compressor);
+	return ret;
+}
+
+/*
+ * ntfs_compress_system_file - Turn a file into a system-compressed file
+ *
+ * @ni:		The NTFS inode for the file
+ * @format:	The compression format, one of the SYSTEM_COMPRESSION_XPRESS*
+ *		values (there is no LZX compressor)
+ *
+ * The data of the file is compressed to a WofCompressedData stream, the
+ * reparse point is set, and the unnamed data stream is made sparse, keeping
+ * its size.  The file is left unchanged if it is resident or if compressing
+ * would not save any cluster.
+ *
+ * Return 0 on success, or -1 and set errno on failure.
+ */
+int ntfs_compress_system_file(ntfs_inode *ni, int format)
+{
+	const u32 name_len = sizeof(compressed_stream_name) /
+					sizeof(compressed_stream_name[0]);
+	WOF_FILE_PROVIDER_REPARSE_POINT_V1 rp;
+	ntfs_volume *vol;
+	ntfs_attr *na;
+	ntfs_attr *cna;
+	void *table;
+	u32 chunk_order;
+	u64 num_chunks;
+	int entry_shift;
+	s64 size;
+	s64 compressed_size;
+	int res;
+
+	if (!ni) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((format != SYSTEM_COMPRESSION_XPRESS4K)
+	    && (format != SYSTEM_COMPRESSION_XPRESS8K)
+	    && (format != SYSTEM_COMPRESSION_XPRESS16K)) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	if (ni->mrec->flags & MFT_RECORD_IS_DIRECTORY) {
+		errno = EISDIR;
+		return -1;
+	}
+	/* Reparse points, including system-compressed files, and encrypted
+	 * files cannot be compressed, nor can files with WOF data.  */
+	if ((ni->flags & (FILE_ATTR_REPARSE_POINT | FILE_ATTR_ENCRYPTED))
+	    || ntfs_attr_exist(ni, AT_DATA, compressed_stream_name,
+				name_len)) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+	if (!na)
+		return -1;
+	if (na->data_flags & (ATTR_COMPRESSION_MASK | ATTR_IS_ENCRYPTED)) {
+		ntfs_attr_close(na);
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	size = na->data_size;
+	if (!NAttrNonResident(na) || !size) {
+		ntfs_attr_close(na);
+		return 0;
+	}
+
+	res = -1;
+	vol = ni->vol;
+	rp.file.compression_format = cpu_to_le32(format);
+	chunk_order = get_chunk_order(rp.file.compression_format);
+	num_chunks = (size + ((s64)1 << chunk_order) - 1) >> chunk_order;
+	entry_shift = (size <= UINT32_MAX) ? 2 : 3;
+	table = ntfs_malloc(((num_chunks - 1) << entry_shift) + 1);
+	if (!table)
+		goto close_na;
+
+	/* Write the compressed stream.  */
+	if (ntfs_attr_add(ni, AT_DATA, compressed_stream_name, name_len,
+			  NULL, 0))
+		goto free_table;
+	cna = ntfs_attr_open(ni, AT_DATA, compressed_stream_name, name_len);
+	if (!cna)
+		goto free_table;
+	compressed_size = write_compressed_chunks(na, cna, chunk_order,
+					num_chunks, entry_shift, table);
+	if (compressed_size < 0)
+		goto remove_stream;
+
+	/* Compare the allocations, and keep the file as is if no cluster
+	 * would be saved.  */
+	if (((compressed_size + vol->cluster_size - 1)
+			>> vol->cluster_size_bits)
+	    >= (na->allocated_size >> vol->cluster_size_bits)) {
+		res = 0;
+		goto remove_stream;
+	}
+
+	/* Set the reparse point, then free the uncompressed data.  */
+	rp.reparse.reparse_tag = IO_REPARSE_TAG_WOF;
+	rp.reparse.reparse_data_length = cpu_to_le16(sizeof(rp)
+						- sizeof(REPARSE_POINT));
+	rp.reparse.reserved = const_cpu_to_le16(0);
+	rp.wof.version = WOF_CURRENT_VERSION;
+	rp.wof.provider = WOF_PROVIDER_FILE;
+	rp.file.version = WOF_FILE_PROVIDER_CURRENT_VERSION;
+	if (ntfs_set_ntfs_reparse_data(ni, (const char*)&rp, sizeof(rp), 0))
+		goto remove_stream;
+	ntfs_attr_close(cna);
+	if (!ntfs_attr_truncate(na, 0) && !ntfs_attr_truncate(na, size))
+		res = 0;
+	else
+		ntfs_log_perror("Failed to free the data of inode %lld",
+				(long long)ni->mft_no);
+	goto free_table;
+
+remove_stream:
+	if (ntfs_attr_rm(cna))
+		ntfs_log_perror("Failed to remove the compressed data of "
+				"inode %lld", (long long)ni->mft_no);
+	ntfs_attr_close(cna);
+free_table:
+	free(table);
+close_na:
+	ntfs_attr_close(na);
+	return res;
+}
@@ -44,6 +44,9 @@
 #ifdef HAVE_LOCALE_H
 #include <locale.h>
 #endif
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
 
 #if defined(__APPLE__) || defined(__DARWIN__)
 #ifdef ENABLE_NFCONV
@@ -228,6 +231,69 @@ int ntfs_names_full_collate(const ntfschar *name1, const u32 name1_len,
 	return 0;
 }
 
+/*
+ * ntfs_names_full_collate_upcased() fully collate two Unicode names,
+ *		the first one having been upcased beforehand
+ *
+ * @name1:	first Unicode name to compare
+ * @upname1:	first Unicode name upcased by ntfs_name_upcase()
+ * @name1_len:	length of first Unicode name to compare
+ * @name2:	second Unicode name to compare
+ * @name2_len:	length of second Unicode name to compare
+ * @ic:		either CASE_SENSITIVE or IGNORE_CASE
+ * @upcase:	upcase table
+ * @upcase_len:	upcase table size
+ *
+ * The result is the same as ntfs_names_full_collate(), but the upcase
+ * table is only used for the characters of the second name which
+ * differ from the first name, which is usually the key looked for.
+ *
+ *  -1 if the first name collates before the second one,
+ *   0 if the names match,
+ *   1 if the second name collates before the first one
+ */
+int ntfs_names_full_collate_upcased(const ntfschar *name1,
+		const ntfschar *upname1, const u32 name1_len,
+		const ntfschar *name2, const u32 name2_len,
+		const IGNORE_CASE_BOOL ic,
+		const ntfschar *upcase, const u32 upcase_len)
+{
+	u32 cnt;
+	u32 i;
+	u16 u1, u2;
+
+	cnt = min(name1_len, name2_len);
+	i = 0;
+	while (i < cnt) {
+			/* skip identical characters, four at a time */
+		while (((i + 4) <= cnt) && !memcmp(&name1[i], &name2[i], 8))
+			i += 4;
+		while ((i < cnt) && (name1[i] == name2[i]))
+			i++;
+		if (i < cnt) {
+			u1 = le16_to_cpu(upname1[i]);
+			u2 = le16_to_cpu(name2[i]);
+			if (u2 < upcase_len)
+				u2 = le16_to_cpu(upcase[u2]);
+			if (u1 != u2)
+				return (u1 < u2 ? -1 : 1);
+			i++;
+		}
+	}
+	if (name1_len < name2_len)
+		return -1;
+	if (name1_len > name2_len)
+		return 1;
+	if (ic == CASE_SENSITIVE) {
+			/* same upcased names, the first difference decides */
+		for (i=0; (i<cnt) && (name1[i] == name2[i]); i++) { }
+		if (i < cnt)
+			return (le16_to_cpu(name1[i]) < le16_to_cpu(name2[i])
+				? -1 : 1);
+	}
+	return 0;
+}
+
 /**
  * ntfs_ucsncmp - compare two little endian Unicode strings
  * @s1:		first string
@@ -521,8 +587,37 @@ static int ntfs_utf16_to_utf8(const ntfschar *ins, const int ins_len,
 	int halfpair;
 
 	halfpair = 0;
+		/* room for the terminator in a provided buffer */
 	if (!*outs)
 		outs_len = PATH_MAX;
+	else
+		outs_len--;
+
+		/*
+		 * Fast path for plain ASCII names, the most common ones,
+		 * which are translated in a single pass and need no
+		 * normalization.
+		 */
+	for (i = 0; (i < ins_len) && ins[i]
+			&& !(ins[i] & const_cpu_to_le16(0xff80)); i++) { }
+	if ((i >= ins_len) || !ins[i]) {
+		size = i;
+		if (size > outs_len) {
+			errno = ENAMETOOLONG;
+			goto out;
+		}
+		if (!*outs) {
+			*outs = ntfs_malloc(size + 1);
+			if (!*outs)
+				goto out;
+		}
+		t = *outs;
+		for (i = 0; i < size; i++)
+			t[i] = le16_to_cpu(ins[i]);
+		t[size] = '\0';
+		ret = size;
+		goto out;
+	}
 
 	size = utf16_to_utf8_size(ins, ins_len, outs_len);
 
@@ -725,11 +820,13 @@ fail:
  * ntfs_utf8_to_utf16 - convert a UTF-8 string to a UTF-16LE string
  * @ins:	input multibyte string buffer
  * @outs:	on return contains the (allocated) output utf16 string
- * @outs_len:	length of output buffer in utf16 characters
+ * @outs_len:	length of output buffer in utf16 characters, including
+ *		the terminator (ignored if the output is allocated)
  * 
  * Return -1 with errno set.
  */
-static int ntfs_utf8_to_utf16(const char *ins, ntfschar **outs)
+static int ntfs_utf8_to_utf16(const char *ins, ntfschar **outs,
+			int outs_len)
 {
 #if defined(__APPLE__) || defined(__DARWIN__)
 #ifdef ENABLE_NFCONV
@@ -748,11 +845,44 @@ static int ntfs_utf8_to_utf16(const char *ins, ntfschar **outs)
 	u32 wc;
 	BOOL allocated;
 	ntfschar *outpos;
-	int shorts, ret = -1;
+	int i, shorts, ret = -1;
+
+		/*
+		 * Fast path for plain ASCII names, the most common ones,
+		 * which are translated in a single pass.
+		 */
+	for (i = 0; (i < PATH_MAX)
+			&& (((const unsigned char*)ins)[i] - 1U) < 0x7fU; i++) { }
+	if ((i >= PATH_MAX) || !ins[i]) {
+		if ((i >= PATH_MAX) || (*outs && (i >= outs_len))) {
+			errno = ENAMETOOLONG;
+			goto fail;
+		}
+		if (!*outs) {
+			*outs = ntfs_malloc((i + 1) * sizeof(ntfschar));
+			if (!*outs)
+				goto fail;
+		}
+		outpos = *outs;
+		shorts = i;
+		for (i = 0; i < shorts; i++)
+			outpos[i] = cpu_to_le16(((const unsigned char*)ins)[i]);
+		outpos[shorts] = const_cpu_to_le16(0);
+		ret = shorts;
+		goto fail;
+	}
 
 	shorts = utf8_to_utf16_size(ins);
 	if (shorts < 0)
 		goto fail;
+	if (*outs && (shorts >= outs_len)) {
+			/* an invalid sequence is reported first */
+		while ((i = utf8_to_unicode(&wc, t)) > 0)
+			t += i;
+		if (!i)
+			errno = ENAMETOOLONG;
+		goto fail;
+	}
 
 	allocated = FALSE;
 	if (!*outs) {
@@ -963,7 +1093,7 @@ int ntfs_mbstoucs(const char *ins, ntfschar **outs)
 	}
 	
 	if (use_utf8)
-		return ntfs_utf8_to_utf16(ins, outs);
+		return ntfs_utf8_to_utf16(ins, outs, PATH_MAX + 1);
 
 #ifdef MB_CUR_MAX
 	/* Determine the size of the multi-byte string in bytes. */
@@ -1061,6 +1191,47 @@ err_out:
 	return -1;
 }
 
+/*
+ *		Convert a multibyte string to a little endian Unicode string
+ *	into a buffer provided by the caller
+ *
+ *	This avoids allocating and freeing the Unicode string in the
+ *	most frequent operations, such as lookups.
+ *
+ *	@outs_len is the size of the buffer in Unicode characters,
+ *	including the terminating Unicode NULL.
+ *
+ *	Returns the number of Unicode characters written, as
+ *		ntfs_mbstoucs() does,
+ *		or -1 if there was an error (errno set to ENAMETOOLONG
+ *			if the buffer is too small)
+ */
+
+int ntfs_mbstoucs_buf(const char *ins, ntfschar *outs, int outs_len)
+{
+	ntfschar *ucs;
+	int len;
+
+	if (!ins || !outs || (outs_len <= 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (use_utf8)
+		return ntfs_utf8_to_utf16(ins, &outs, outs_len);
+	ucs = (ntfschar*)NULL;
+	len = ntfs_mbstoucs(ins, &ucs);
+	if (len >= 0) {
+		if (len < outs_len)
+			memcpy(outs, ucs, (len + 1)*sizeof(ntfschar));
+		else {
+			errno = ENAMETOOLONG;
+			len = -1;
+		}
+		free(ucs);
+	}
+	return (len);
+}
+
 /*
  *		Turn a UTF8 name uppercase
  *
@@ -1342,6 +1513,129 @@ ntfschar *ntfs_locase_table_build(const ntfschar *uc, u32 uc_cnt)
 	return (lc);
 }
 
+/*
+ *		Sharing of the case tables
+ *
+ *	Almost all volumes carry one of a few standard upcase tables, so
+ *	the upcase tables, and the locase tables built from them, are
+ *	shared by all the volumes mounted by the process. The tables are
+ *	identified by a hash of their contents, checked by comparing the
+ *	full contents, and a table is freed when the last volume using
+ *	it releases it. The shared tables must not be modified.
+ */
+
+struct CASE_TABLE {
+	struct CASE_TABLE *next;
+	ntfschar *table;
+	u32 len;		/* count of entries */
+	u32 hash;
+	int users;
+} ;
+
+static struct CASE_TABLE *case_tables = (struct CASE_TABLE*)NULL;
+#ifdef ENABLE_THREADS
+static pthread_mutex_t case_tables_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static u32 case_table_hash(const ntfschar *table, u32 len)
+{
+	u32 hash;
+	u32 i;
+
+		/* FNV-1a over the entries */
+	hash = 2166136261U;
+	for (i=0; i<len; i++)
+		hash = (hash ^ le16_to_cpu(table[i])) * 16777619U;
+	return (hash);
+}
+
+/*
+ *		Share a case table
+ *
+ *	The table, allocated by the caller, is freed when an identical
+ *	table is already shared, and the shared one is returned. If the
+ *	table cannot be registered, it is returned unshared, still to
+ *	be released by ntfs_case_table_release().
+ */
+
+ntfschar *ntfs_case_table_share(ntfschar *table, u32 len)
+{
+	struct CASE_TABLE *entry;
+	u32 hash;
+
+	if (table && len) {
+		hash = case_table_hash(table, len);
+#ifdef ENABLE_THREADS
+		pthread_mutex_lock(&case_tables_lock);
+#endif
+		entry = case_tables;
+		while (entry
+		    && ((entry->hash != hash)
+			|| (entry->len != len)
+			|| memcmp(entry->table, table, len*sizeof(ntfschar))))
+			entry = entry->next;
+		if (entry) {
+			entry->users++;
+			free(table);
+			table = entry->table;
+		} else {
+			entry = (struct CASE_TABLE*)
+					ntfs_malloc(sizeof(struct CASE_TABLE));
+			if (entry) {
+				entry->table = table;
+				entry->len = len;
+				entry->hash = hash;
+				entry->users = 1;
+				entry->next = case_tables;
+				case_tables = entry;
+			}
+		}
+#ifdef ENABLE_THREADS
+		pthread_mutex_unlock(&case_tables_lock);
+#endif
+	}
+	return (table);
+}
+
+/*
+ *		Release a case table
+ *
+ *	The table is freed if it is not shared, or when this is the
+ *	last user of the shared table.
+ */
+
+void ntfs_case_table_release(ntfschar *table)
+{
+	struct CASE_TABLE *entry;
+	struct CASE_TABLE *previous;
+
+	if (table) {
+#ifdef ENABLE_THREADS
+		pthread_mutex_lock(&case_tables_lock);
+#endif
+		previous = (struct CASE_TABLE*)NULL;
+		entry = case_tables;
+		while (entry && (entry->table != table)) {
+			previous = entry;
+			entry = entry->next;
+		}
+		if (!entry)
+			free(table);
+		else
+			if (!--entry->users) {
+				if (previous)
+					previous->next = entry->next;
+				else
+					case_tables = entry->next;
+				free(entry->table);
+				free(entry);
+			}
+#ifdef ENABLE_THREADS
+		pthread_mutex_unlock(&case_tables_lock);
+#endif
+	}
+}
+
 /**
  * ntfs_str2ucs - convert a string to a valid NTFS file name
  * @s:		input string
@@ -53,6 +53,21 @@
 #ifdef HAVE_LINUX_FD_H
 #include <linux/fd.h>
 #endif
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_SYS_MMAN_H) \
+		&& defined(HAVE_SYS_SYSCALL_H)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef __NR_io_uring_setup
+#define USE_IO_URING 1
+#endif
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
 
 #include "types.h"
 #include "mst.h"
@@ -61,7 +76,25 @@
 #include "logging.h"
 #include "misc.h"
 
-#define DEV_FD(dev)	(*(int *)dev->d_private)
+/*
+ *	The file descriptor has to be the first field, ntfs_device_fd_get()
+ *	relies on it.
+ */
+struct unix_filehandle {
+	int fd;
+#ifdef USE_IO_URING
+	struct unix_ring *ring;	/* NULL if not supported by the kernel */
+#endif
+#ifdef HAVE_SYS_MMAN_H
+	const char *map;	/* read-only mapping of the device or NULL */
+	s64 map_size;
+#endif
+} ;
+
+#define DEV_FD(dev)	(((struct unix_filehandle *)dev->d_private)->fd)
+#define DEV_RING(dev)	(((struct unix_filehandle *)dev->d_private)->ring)
+#define DEV_MAP(dev)	(((struct unix_filehandle *)dev->d_private)->map)
+#define DEV_MAP_SIZE(dev) (((struct unix_filehandle *)dev->d_private)->map_size)
 
 /* Define to nothing if not present on this system. */
 #ifndef O_EXCL
@@ -102,6 +135,498 @@ static int ntfs_fsync(int fildes)
 	return ret;
 }
 
+#ifdef O_DIRECT
+
+/*
+ *		Transfers on a device opened with O_DIRECT
+ *
+ *	The buffer, the position and the size of such transfers have to
+ *	be aligned, which most of the transfers requested by the library
+ *	are not (boot sector, MFT records, index blocks, bitmap
+ *	fragments...). These are done through an aligned buffer covering
+ *	the whole blocks involved, the blocks partially written being
+ *	read first. Small buffers are kept in a pool for being reused.
+ */
+
+#define DIRECT_IO_ALIGN 4096	/* alignment of positions and sizes */
+#define DIRECT_IO_MEM_ALIGN 512	/* alignment of buffers */
+#define DIRECT_POOL_BUFSIZE 65536 /* size of the pooled buffers */
+#define DIRECT_POOL_COUNT 8	/* max count of pooled buffers */
+
+static struct {
+	void *bufs[DIRECT_POOL_COUNT];
+	int count;
+#ifdef ENABLE_THREADS
+	pthread_mutex_t lock;
+#endif
+} direct_pool = {
+	.count = 0,
+#ifdef ENABLE_THREADS
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+#endif
+} ;
+
+static void *direct_buf_get(s64 size)
+{
+	void *buf;
+	int err;
+
+	buf = (void*)NULL;
+	if (size <= DIRECT_POOL_BUFSIZE) {
+#ifdef ENABLE_THREADS
+		pthread_mutex_lock(&direct_pool.lock);
+#endif
+		if (direct_pool.count)
+			buf = direct_pool.bufs[--direct_pool.count];
+#ifdef ENABLE_THREADS
+		pthread_mutex_unlock(&direct_pool.lock);
+#endif
+		size = DIRECT_POOL_BUFSIZE;
+	}
+	if (!buf) {
+		err = posix_memalign(&buf, DIRECT_IO_ALIGN, size);
+		if (err) {
+			ntfs_log_error("Failed to allocate an aligned"
+					" buffer of %lld bytes\n",
+					(long long)size);
+			buf = (void*)NULL;
+			errno = err;
+		}
+	}
+	return (buf);
+}
+
+static void direct_buf_put(void *buf, s64 size)
+{
+	int olderr;
+
+	olderr = errno;
+	if (size <= DIRECT_POOL_BUFSIZE) {
+#ifdef ENABLE_THREADS
+		pthread_mutex_lock(&direct_pool.lock);
+#endif
+		if (direct_pool.count < DIRECT_POOL_COUNT) {
+			direct_pool.bufs[direct_pool.count++] = buf;
+			buf = (void*)NULL;
+		}
+#ifdef ENABLE_THREADS
+		pthread_mutex_unlock(&direct_pool.lock);
+#endif
+	}
+	free(buf);
+	errno = olderr;
+}
+
+static BOOL direct_aligned(const void *buf, s64 count, s64 offset)
+{
+	return (!((unsigned long)buf & (DIRECT_IO_MEM_ALIGN - 1))
+		&& !(count & (DIRECT_IO_ALIGN - 1))
+		&& !(offset & (DIRECT_IO_ALIGN - 1)));
+}
+
+static s64 direct_pread(struct ntfs_device *dev, void *buf,
+		s64 count, s64 offset)
+{
+	char *bounce;
+	s64 start, skip, size;
+	s64 got, res;
+
+	if (direct_aligned(buf, count, offset)) {
+		res = pread(DEV_FD(dev), buf, count, offset);
+			/* alignment constraints may be stronger */
+		if ((res >= 0) || (errno != EINVAL))
+			return (res);
+	}
+	start = offset & ~(s64)(DIRECT_IO_ALIGN - 1);
+	skip = offset - start;
+	size = (skip + count + DIRECT_IO_ALIGN - 1)
+			& ~(s64)(DIRECT_IO_ALIGN - 1);
+	bounce = (char*)direct_buf_get(size);
+	if (!bounce)
+		return (-1);
+	got = pread(DEV_FD(dev), bounce, size, start);
+	if (got > skip) {
+		res = got - skip;
+		if (res > count)
+			res = count;
+		memcpy(buf, &bounce[skip], res);
+	} else
+		res = (got < 0 ? -1 : 0);
+	direct_buf_put(bounce, size);
+	return (res);
+}
+
+static s64 direct_pwrite(struct ntfs_device *dev, const void *buf,
+		s64 count, s64 offset)
+{
+	char *bounce;
+	s64 start, skip, end, size, wsize;
+	s64 got, res;
+
+	if (direct_aligned(buf, count, offset)) {
+		res = pwrite(DEV_FD(dev), buf, count, offset);
+		if ((res >= 0) || (errno != EINVAL))
+			return (res);
+	}
+	start = offset & ~(s64)(DIRECT_IO_ALIGN - 1);
+	skip = offset - start;
+	end = skip + count;
+	size = (end + DIRECT_IO_ALIGN - 1) & ~(s64)(DIRECT_IO_ALIGN - 1);
+	bounce = (char*)direct_buf_get(size);
+	if (!bounce)
+		return (-1);
+	wsize = size;
+	if (skip || (end < size)) {
+			/* read the blocks which are partially rewritten */
+		got = pread(DEV_FD(dev), bounce, size, start);
+		if (got < 0) {
+			direct_buf_put(bounce, size);
+			return (-1);
+		}
+		if (got < size) {
+			/* do not extend beyond the end of the device */
+			memset(&bounce[got], 0, size - got);
+			wsize = (got > end ? got : end);
+			wsize = (wsize + DIRECT_IO_MEM_ALIGN - 1)
+				& ~(s64)(DIRECT_IO_MEM_ALIGN - 1);
+		}
+	}
+	memcpy(&bounce[skip], buf, count);
+	got = pwrite(DEV_FD(dev), bounce, wsize, start);
+	if (got > skip) {
+		res = got - skip;
+		if (res > count)
+			res = count;
+	} else
+		res = (got < 0 ? -1 : 0);
+	direct_buf_put(bounce, size);
+	return (res);
+}
+
+#endif /* O_DIRECT */
+
+#ifdef USE_IO_URING
+
+/*
+ *		Batches of transfers through io_uring
+ *
+ *	All the transfers of a batch are submitted together, so that the
+ *	device sees them concurrently, then the completions are waited
+ *	for. The ring is shared by the threads using the device, a
+ *	thread which finds it busy processes its transfers in sequence.
+ */
+
+#define UNIX_RING_ENTRIES 32	/* max count of transfers in flight */
+#define UNIX_RING_MAX_RW 0x7ffff000 /* max count of bytes in a transfer */
+
+struct unix_ring {
+	int fd;
+	unsigned int entries;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr;
+	size_t sq_size;
+	void *cq_ptr;
+	size_t cq_size;
+	size_t sqes_size;
+	BOOL broken;		/* a failed wait left transfers in flight */
+#ifdef ENABLE_THREADS
+	pthread_mutex_t lock;
+#endif
+} ;
+
+static void unix_ring_free(struct unix_ring *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ptr)
+		munmap(ring->cq_ptr, ring->cq_size);
+	if (ring->sq_ptr)
+		munmap(ring->sq_ptr, ring->sq_size);
+	close(ring->fd);
+#ifdef ENABLE_THREADS
+	pthread_mutex_destroy(&ring->lock);
+#endif
+	free(ring);
+}
+
+/*
+ *		Set up a ring
+ *
+ *	Returns NULL if io_uring is not available (silently, as the
+ *	transfers can be done without it).
+ */
+
+static struct unix_ring *unix_ring_new(void)
+{
+	struct io_uring_params params;
+	struct unix_ring *ring;
+	void *ptr;
+
+	ring = (struct unix_ring*)calloc(1, sizeof(struct unix_ring));
+	if (!ring)
+		return ((struct unix_ring*)NULL);
+	memset(&params, 0, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, UNIX_RING_ENTRIES, &params);
+	if (ring->fd < 0) {
+		free(ring);
+		return ((struct unix_ring*)NULL);
+	}
+#ifdef ENABLE_THREADS
+	pthread_mutex_init(&ring->lock, NULL);
+#endif
+	ring->entries = params.sq_entries;
+	ring->sq_size = params.sq_off.array
+			+ params.sq_entries*sizeof(unsigned int);
+	ring->cq_size = params.cq_off.cqes
+			+ params.cq_entries*sizeof(struct io_uring_cqe);
+	ring->sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+	ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED)
+		goto fail;
+	ring->sq_ptr = ptr;
+	ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	if (ptr == MAP_FAILED)
+		goto fail;
+	ring->cq_ptr = ptr;
+	ptr = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED)
+		goto fail;
+	ring->sqes = (struct io_uring_sqe*)ptr;
+	ring->sq_tail = (unsigned int*)((char*)ring->sq_ptr
+			+ params.sq_off.tail);
+	ring->sq_mask = (unsigned int*)((char*)ring->sq_ptr
+			+ params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int*)((char*)ring->sq_ptr
+			+ params.sq_off.array);
+	ring->cq_head = (unsigned int*)((char*)ring->cq_ptr
+			+ params.cq_off.head);
+	ring->cq_tail = (unsigned int*)((char*)ring->cq_ptr
+			+ params.cq_off.tail);
+	ring->cq_mask = (unsigned int*)((char*)ring->cq_ptr
+			+ params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ptr
+			+ params.cq_off.cqes);
+	return (ring);
+fail :
+	unix_ring_free(ring);
+	return ((struct unix_ring*)NULL);
+}
+
+/*
+ *		Submit a batch of transfers and wait for their completion
+ *
+ *	Returns 0 if the transfers have been processed, with their own
+ *	result set, and -1 if they could not be submitted (errno is
+ *	then set, and the caller has to process them otherwise).
+ */
+
+static int unix_ring_transfer(struct ntfs_device *dev,
+		struct ntfs_device_io *ios, int count, int opcode)
+{
+	struct unix_ring *ring;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	unsigned int tail, head, idx;
+	int submitted, done, n, i, res;
+
+	ring = DEV_RING(dev);
+	if (!ring || ring->broken) {
+		errno = EOPNOTSUPP;
+		return (-1);
+	}
+#ifdef O_DIRECT
+		/* unaligned transfers have to go through a bounce buffer */
+	if (NDevDirect(dev))
+		for (i=0; i<count; i++)
+			if (!direct_aligned(ios[i].buf, ios[i].count,
+					ios[i].pos)) {
+				errno = EINVAL;
+				return (-1);
+			}
+#endif
+#ifdef ENABLE_THREADS
+	if (pthread_mutex_trylock(&ring->lock)) {
+		errno = EBUSY;
+		return (-1);
+	}
+#endif
+	res = 0;
+	for (done=0; !res && (done<count); done+=n) {
+		n = count - done;
+		if (n > (int)ring->entries)
+			n = ring->entries;
+		tail = *ring->sq_tail;
+		for (i=0; i<n; i++) {
+			idx = tail & *ring->sq_mask;
+			sqe = &ring->sqes[idx];
+			memset(sqe, 0, sizeof(struct io_uring_sqe));
+			sqe->opcode = opcode;
+			sqe->fd = DEV_FD(dev);
+			sqe->addr = (unsigned long)ios[done + i].buf;
+			sqe->len = (ios[done + i].count > UNIX_RING_MAX_RW
+					? UNIX_RING_MAX_RW
+					: ios[done + i].count);
+			sqe->off = ios[done + i].pos;
+			sqe->user_data = done + i;
+			ring->sq_array[idx] = idx;
+			tail++;
+		}
+		__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+		submitted = 0;
+		while ((submitted < n) && !res) {
+			i = syscall(__NR_io_uring_enter, ring->fd,
+					n - submitted, n - submitted,
+					IORING_ENTER_GETEVENTS, NULL, 0);
+			if (i > 0)
+				submitted += i;
+			else
+				if ((i < 0) && (errno != EINTR))
+					res = -1;
+		}
+			/* collect the completions of what was submitted */
+		i = 0;
+		while (i < submitted) {
+			head = *ring->cq_head;
+			if (head == __atomic_load_n(ring->cq_tail,
+					__ATOMIC_ACQUIRE)) {
+				if ((syscall(__NR_io_uring_enter, ring->fd,
+						0, 1, IORING_ENTER_GETEVENTS,
+						NULL, 0) < 0)
+				    && (errno != EINTR)) {
+					/* buffers may still be used */
+					ntfs_log_perror("Failed to wait for"
+						" device transfers");
+					ring->broken = TRUE;
+					break;
+				}
+				continue;
+			}
+			cqe = &ring->cqes[head & *ring->cq_mask];
+			ios[cqe->user_data].res = cqe->res;
+			__atomic_store_n(ring->cq_head, head + 1,
+					__ATOMIC_RELEASE);
+			i++;
+		}
+		if (i < submitted)
+			res = -1;
+		else
+			if (res)
+				/* unsubmitted entries would be sent later */
+				ring->broken = TRUE;
+	}
+#ifdef ENABLE_THREADS
+	pthread_mutex_unlock(&ring->lock);
+#endif
+	return (res);
+}
+
+#endif /* USE_IO_URING */
+
+#ifdef HAVE_SYS_MMAN_H
+
+/*
+ *		Transfers from a device mapped in memory
+ *
+ *	A device or an image opened read-only through the mmap operations
+ *	is mapped as a whole, and the reads are copied from the mapping,
+ *	with no system call once the pages are present, the kernel reading
+ *	ahead around the page faults. The big reads (such as the ranges
+ *	of MFT records of the scans) and the batches are announced to the
+ *	kernel first, so that their pages are read at once.
+ *
+ *	When the device is opened read-write or with O_DIRECT, or when it
+ *	cannot be mapped, the usual transfers are used.
+ */
+
+#define MMAP_WILLNEED_SIZE 65536 /* min size of the reads announced */
+
+/*
+ *		Map the device, if it is opened read-only
+ */
+
+static void unix_map(struct ntfs_device *dev)
+{
+	void *map;
+	s64 size;
+
+	if (!NDevReadOnly(dev) || NDevDirect(dev))
+		return;
+	size = lseek(DEV_FD(dev), 0, SEEK_END);
+	if ((lseek(DEV_FD(dev), 0, SEEK_SET) < 0)
+	    || (size <= 0) || ((s64)(size_t)size != size))
+		return;
+	map = mmap((void*)NULL, size, PROT_READ, MAP_SHARED, DEV_FD(dev), 0);
+	if (map == MAP_FAILED) {
+		ntfs_log_debug("Could not map %s, reading it instead\n",
+				dev->d_name);
+		return;
+	}
+	DEV_MAP(dev) = (const char*)map;
+	DEV_MAP_SIZE(dev) = size;
+}
+
+/*
+ *		Restrict a read to the mapping
+ *
+ *	Returns the count of bytes which can be read, short beyond the
+ *	end of the device, as with pread(2).
+ */
+
+static s64 unix_map_count(struct ntfs_device *dev, s64 count, s64 offset)
+{
+	if (offset >= DEV_MAP_SIZE(dev))
+		return (0);
+	if (count > (DEV_MAP_SIZE(dev) - offset))
+		count = DEV_MAP_SIZE(dev) - offset;
+	return (count);
+}
+
+/*
+ *		Tell the kernel a range of the mapping will be read soon
+ */
+
+static void unix_map_advise(struct ntfs_device *dev, s64 count, s64 offset)
+{
+#ifdef MADV_WILLNEED
+	s64 start;
+	long pagesize;
+
+	pagesize = sysconf(_SC_PAGESIZE);
+	if ((pagesize > 0) && (count > 0)) {
+		start = offset & -(s64)pagesize;
+		madvise((void*)(DEV_MAP(dev) + start), offset + count - start,
+				MADV_WILLNEED);
+	}
+#endif
+}
+
+static s64 unix_map_pread(struct ntfs_device *dev, void *buf,
+		s64 count, s64 offset)
+{
+	if ((count < 0) || (offset < 0)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	count = unix_map_count(dev, count, offset);
+	if (count >= MMAP_WILLNEED_SIZE)
+		unix_map_advise(dev, count, offset);
+	if (count)
+		memcpy(buf, DEV_MAP(dev) + offset, count);
+	return (count);
+}
+
+#endif /* HAVE_SYS_MMAN_H */
+
 /**
  * ntfs_device_unix_io_open - Open a device and lock it exclusively
  * @dev:
@@ -128,7 +653,7 @@ static int ntfs_device_unix_io_open(struct ntfs_device *dev, int flags)
 	if (S_ISBLK(sbuf.st_mode))
 		NDevSetBlock(dev);
 	
-	dev->d_private = ntfs_malloc(sizeof(int));
+	dev->d_private = ntfs_malloc(sizeof(struct unix_filehandle));
 	if (!dev->d_private)
 		return -1;
 	/*
@@ -137,14 +662,18 @@ static int ntfs_device_unix_io_open(struct ntfs_device *dev, int flags)
 	 */ 
 	if (!NDevBlock(dev) && (flags & O_RDWR) == O_RDWR)
 		flags |= O_EXCL;
-	*(int*)dev->d_private = open(dev->d_name, flags);
-	if (*(int*)dev->d_private == -1) {
+	DEV_FD(dev) = open(dev->d_name, flags);
+	if (DEV_FD(dev) == -1) {
 		err = errno;
 		goto err_out;
 	}
 	
 	if ((flags & O_RDWR) != O_RDWR)
 		NDevSetReadOnly(dev);
+#ifdef O_DIRECT
+	if (flags & O_DIRECT)
+		NDevSetDirect(dev);
+#endif
 	
 	memset(&flk, 0, sizeof(flk));
 	if (NDevReadOnly(dev))
@@ -162,6 +691,13 @@ static int ntfs_device_unix_io_open(struct ntfs_device *dev, int flags)
 		goto err_out;
 	}
 	
+#ifdef USE_IO_URING
+	DEV_RING(dev) = unix_ring_new();
+#endif
+#ifdef HAVE_SYS_MMAN_H
+	DEV_MAP(dev) = (const char*)NULL;
+	DEV_MAP_SIZE(dev) = 0;
+#endif
 	NDevSetOpen(dev);
 	return 0;
 err_out:
@@ -204,7 +740,16 @@ static int ntfs_device_unix_io_close(struct ntfs_device *dev)
 		ntfs_log_perror("Failed to close device %s", dev->d_name);
 		return -1;
 	}
+#ifdef USE_IO_URING
+	if (DEV_RING(dev))
+		unix_ring_free(DEV_RING(dev));
+#endif
+#ifdef HAVE_SYS_MMAN_H
+	if (DEV_MAP(dev))
+		munmap((void*)DEV_MAP(dev), DEV_MAP_SIZE(dev));
+#endif
 	NDevClearOpen(dev);
+	NDevClearDirect(dev);
 	free(dev->d_private);
 	dev->d_private = NULL;
 	return 0;
@@ -239,6 +784,20 @@ static s64 ntfs_device_unix_io_seek(struct ntfs_device *dev, s64 offset,
 static s64 ntfs_device_unix_io_read(struct ntfs_device *dev, void *buf,
 		s64 count)
 {
+#ifdef O_DIRECT
+	s64 pos;
+	s64 br;
+
+	if (NDevDirect(dev)) {
+		pos = lseek(DEV_FD(dev), 0, SEEK_CUR);
+		if (pos < 0)
+			return (-1);
+		br = direct_pread(dev, buf, count, pos);
+		if ((br > 0) && (lseek(DEV_FD(dev), pos + br, SEEK_SET) < 0))
+			br = -1;
+		return (br);
+	}
+#endif
 	return read(DEV_FD(dev), buf, count);
 }
 
@@ -255,10 +814,27 @@ static s64 ntfs_device_unix_io_read(struct ntfs_device *dev, void *buf,
 static s64 ntfs_device_unix_io_write(struct ntfs_device *dev, const void *buf,
 		s64 count)
 {
+#ifdef O_DIRECT
+	s64 pos;
+	s64 bw;
+
+#endif
 	if (NDevReadOnly(dev)) {
 		errno = EROFS;
 		return -1;
 	}
+#ifdef O_DIRECT
+	if (NDevDirect(dev)) {
+		pos = lseek(DEV_FD(dev), 0, SEEK_CUR);
+		if (pos < 0)
+			return (-1);
+		NDevSetDirty(dev);
+		bw = direct_pwrite(dev, buf, count, pos);
+		if ((bw > 0) && (lseek(DEV_FD(dev), pos + bw, SEEK_SET) < 0))
+			bw = -1;
+		return (bw);
+	}
+#endif
 	NDevSetDirty(dev);
 	return write(DEV_FD(dev), buf, count);
 }
@@ -277,6 +853,10 @@ static s64 ntfs_device_unix_io_write(struct ntfs_device *dev, const void *buf,
 static s64 ntfs_device_unix_io_pread(struct ntfs_device *dev, void *buf,
 		s64 count, s64 offset)
 {
+#ifdef O_DIRECT
+	if (NDevDirect(dev))
+		return (direct_pread(dev, buf, count, offset));
+#endif
 	return pread(DEV_FD(dev), buf, count, offset);
 }
 
@@ -299,9 +879,54 @@ static s64 ntfs_device_unix_io_pwrite(struct ntfs_device *dev, const void *buf,
 		return -1;
 	}
 	NDevSetDirty(dev);
+#ifdef O_DIRECT
+	if (NDevDirect(dev))
+		return (direct_pwrite(dev, buf, count, offset));
+#endif
 	return pwrite(DEV_FD(dev), buf, count, offset);
 }
 
+#ifdef USE_IO_URING
+
+/**
+ * ntfs_device_unix_io_pread_batch - Perform several positioned reads
+ * @dev:
+ * @ios:
+ * @count:
+ *
+ * Description...
+ *
+ * Returns:
+ */
+static int ntfs_device_unix_io_pread_batch(struct ntfs_device *dev,
+		struct ntfs_device_io *ios, int count)
+{
+	return unix_ring_transfer(dev, ios, count, IORING_OP_READ);
+}
+
+/**
+ * ntfs_device_unix_io_pwrite_batch - Perform several positioned writes
+ * @dev:
+ * @ios:
+ * @count:
+ *
+ * Description...
+ *
+ * Returns:
+ */
+static int ntfs_device_unix_io_pwrite_batch(struct ntfs_device *dev,
+		struct ntfs_device_io *ios, int count)
+{
+	if (NDevReadOnly(dev)) {
+		errno = EROFS;
+		return -1;
+	}
+	NDevSetDirty(dev);
+	return unix_ring_transfer(dev, ios, count, IORING_OP_WRITE);
+}
+
+#endif /* USE_IO_URING */
+
 /**
  * ntfs_device_unix_io_sync - Flush any buffered changes to the device
  * @dev:
@@ -368,4 +993,138 @@ struct ntfs_device_operations ntfs_device_unix_io_ops = {
 	.sync		= ntfs_device_unix_io_sync,
 	.stat		= ntfs_device_unix_io_stat,
 	.ioctl		= ntfs_device_unix_io_ioctl,
+#ifdef USE_IO_URING
+	.pread_batch	= ntfs_device_unix_io_pread_batch,
+	.pwrite_batch	= ntfs_device_unix_io_pwrite_batch,
+#endif
 };
+
+#ifdef HAVE_SYS_MMAN_H
+
+/**
+ * ntfs_device_unix_mmap_io_open - Open a device and map it if read-only
+ * @dev:
+ * @flags:
+ *
+ * Description...
+ *
+ * Returns:
+ */
+static int ntfs_device_unix_mmap_io_open(struct ntfs_device *dev, int flags)
+{
+	int res;
+
+	res = ntfs_device_unix_io_open(dev, flags);
+	if (!res)
+		unix_map(dev);
+	return res;
+}
+
+/**
+ * ntfs_device_unix_mmap_io_read - Read from the mapping, from the current
+ * location
+ * @dev:
+ * @buf:
+ * @count:
+ *
+ * Description...
+ *
+ * Returns:
+ */
+static s64 ntfs_device_unix_mmap_io_read(struct ntfs_device *dev, void *buf,
+		s64 count)
+{
+	s64 pos;
+	s64 br;
+
+	if (!DEV_MAP(dev))
+		return (ntfs_device_unix_io_read(dev, buf, count));
+	pos = lseek(DEV_FD(dev), 0, SEEK_CUR);
+	if (pos < 0)
+		return (-1);
+	br = unix_map_pread(dev, buf, count, pos);
+	if ((br > 0) && (lseek(DEV_FD(dev), pos + br, SEEK_SET) < 0))
+		br = -1;
+	return (br);
+}
+
+/**
+ * ntfs_device_unix_mmap_io_pread - Perform a positioned read from the mapping
+ * @dev:
+ * @buf:
+ * @count:
+ * @offset:
+ *
+ * Description...
+ *
+ * Returns:
+ */
+static s64 ntfs_device_unix_mmap_io_pread(struct ntfs_device *dev, void *buf,
+		s64 count, s64 offset)
+{
+	if (!DEV_MAP(dev))
+		return (ntfs_device_unix_io_pread(dev, buf, count, offset));
+	return (unix_map_pread(dev, buf, count, offset));
+}
+
+/**
+ * ntfs_device_unix_mmap_io_pread_batch - Perform several positioned reads
+ * from the mapping
+ * @dev:
+ * @ios:
+ * @count:
+ *
+ * All the ranges are announced to the kernel before copying the first
+ * one.
+ *
+ * Returns:
+ */
+static int ntfs_device_unix_mmap_io_pread_batch(struct ntfs_device *dev,
+		struct ntfs_device_io *ios, int count)
+{
+	s64 n;
+	int i;
+
+	if (!DEV_MAP(dev)) {
+#ifdef USE_IO_URING
+		return (ntfs_device_unix_io_pread_batch(dev, ios, count));
+#else
+		errno = EOPNOTSUPP;
+		return (-1);
+#endif
+	}
+	for (i=0; i<count; i++)
+		unix_map_advise(dev, unix_map_count(dev, ios[i].count,
+					ios[i].pos), ios[i].pos);
+	for (i=0; i<count; i++) {
+		n = unix_map_count(dev, ios[i].count, ios[i].pos);
+		if (n)
+			memcpy(ios[i].buf, DEV_MAP(dev) + ios[i].pos, n);
+		ios[i].res = n;
+	}
+	return (0);
+}
+
+/**
+ * Device operations for reading unix style devices and files mapped in
+ * memory. Devices opened read-write are accessed as with the unix style
+ * operations.
+ */
+struct ntfs_device_operations ntfs_device_unix_mmap_io_ops = {
+	.open		= ntfs_device_unix_mmap_io_open,
+	.close		= ntfs_device_unix_io_close,
+	.seek		= ntfs_device_unix_io_seek,
+	.read		= ntfs_device_unix_mmap_io_read,
+	.write		= ntfs_device_unix_io_write,
+	.pread		= ntfs_device_unix_mmap_io_pread,
+	.pwrite		= ntfs_device_unix_io_pwrite,
+	.sync		= ntfs_device_unix_io_sync,
+	.stat		= ntfs_device_unix_io_stat,
+	.ioctl		= ntfs_device_unix_io_ioctl,
+	.pread_batch	= ntfs_device_unix_mmap_io_pread_batch,
+#ifdef USE_IO_URING
+	.pwrite_batch	= ntfs_device_unix_io_pwrite_batch,
+#endif
+};
+
+#endif /* HAVE_SYS_MMAN_H */
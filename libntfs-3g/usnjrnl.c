@@ -0,0 +1,815 @@
+/**
+ * usnjrnl.c : reading and recording the change journal
+ *
+ *      This module is part of ntfs-3g library
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
+
+#include "param.h"
+#include "types.h"
+#include "layout.h"
+#include "attrib.h"
+#include "inode.h"
+#include "dir.h"
+#include "volume.h"
+#include "ntfstime.h"
+#include "usnjrnl.h"
+#include "misc.h"
+#include "logging.h"
+
+/*
+ *		Reading the change journal
+ *
+ *	Windows records the changes to files into $Extend/$UsnJrnl:$J,
+ *	so that finding the files changed since a known point only
+ *	requires reading the records appended since then, each record
+ *	being identified by its offset in the stream (its usn). The
+ *	oldest records are discarded by making the beginning of the
+ *	stream sparse, so the holes are skipped by looking at the
+ *	runlist, and the allocated parts are read in chunks of
+ *	USN_READ_SIZE bytes, from which the records are returned in
+ *	batches.
+ *
+ *	The changes made through ntfs-3g are only recorded when
+ *	requested (see below).
+ */
+
+struct USN_READER {
+	ntfs_inode *ni;		/* $UsnJrnl */
+	ntfs_attr *na;		/* its $J stream */
+	char *buf;		/* records read together */
+	s64 buf_pos;		/* usn of the start of buf */
+	s64 buf_count;		/* bytes in buf */
+	s64 pos;		/* next usn to examine */
+	s64 end;		/* size of $J when opened */
+} ;
+
+static ntfschar usn_j_name[] = { const_cpu_to_le16('$'),
+			const_cpu_to_le16('J') } ;
+static ntfschar usn_max_name[] = { const_cpu_to_le16('$'),
+			const_cpu_to_le16('M'), const_cpu_to_le16('a'),
+			const_cpu_to_le16('x') } ;
+
+/*
+ *		Open $Extend/$UsnJrnl
+ *
+ *	Returns the inode, or NULL with errno set to ENOENT if the
+ *	volume has no change journal
+ */
+
+static ntfs_inode *usn_open_inode(ntfs_volume *vol)
+{
+	ntfs_inode *dir_ni;
+	ntfs_inode *ni;
+	u64 inum;
+
+	ni = (ntfs_inode*)NULL;
+		/* do not use path_name_to inode - could reopen root */
+	dir_ni = ntfs_inode_open(vol, FILE_Extend);
+	if (dir_ni) {
+		inum = ntfs_inode_lookup_by_mbsname(dir_ni, "$UsnJrnl");
+		if (inum != (u64)-1)
+			ni = ntfs_inode_open(vol, MREF(inum));
+		ntfs_inode_close(dir_ni);
+	}
+	return (ni);
+}
+
+/*
+ *		Get the end of the allocated data from a position in $J
+ *
+ *	When @pos is in a hole, it is moved to the end of the hole.
+ *	Returns the end of the consecutive allocated runs from there.
+ */
+
+static s64 usn_extent(struct USN_READER *reader, s64 *pos)
+{
+	const runlist_element *rl;
+	ntfs_volume *vol;
+	VCN vcn;
+	s64 end;
+
+	if (!NAttrNonResident(reader->na))
+		return (reader->end);
+	vol = reader->ni->vol;
+	vcn = *pos >> vol->cluster_size_bits;
+	for (rl=reader->na->rl; rl->length && ((rl->vcn + rl->length) <= vcn);
+			rl++) { }
+	while (rl->length && (rl->lcn == LCN_HOLE))
+		rl++;
+	if (!rl->length)
+		return (*pos = reader->end);
+	if (rl->vcn > vcn)
+		*pos = rl->vcn << vol->cluster_size_bits;
+	while (rl->length && (rl->lcn != LCN_HOLE))
+		rl++;
+	end = rl->vcn << vol->cluster_size_bits;
+	if (!rl->length || (end > reader->end))
+		end = reader->end;
+	return (end);
+}
+
+/*
+ *		Read the records from @pos into the buffer
+ *
+ *	Returns the count of bytes read, zero at the end of $J,
+ *	or -1 if there was an error
+ */
+
+static s64 usn_fill(struct USN_READER *reader, s64 pos)
+{
+	s64 end;
+	s64 count;
+
+	end = usn_extent(reader, &pos);
+	reader->pos = pos;
+	count = end - pos;
+	if (count > USN_READ_SIZE)
+		count = USN_READ_SIZE;
+	if (count > 0) {
+		count = ntfs_attr_pread(reader->na, pos, count, reader->buf);
+		if (count <= 0) {
+			if (!count)
+				errno = EIO;
+			ntfs_log_perror("Failed to read $UsnJrnl at %lld",
+					(long long)pos);
+			count = -1;
+		}
+	}
+	reader->buf_pos = pos;
+	reader->buf_count = (count > 0 ? count : 0);
+	return (count);
+}
+
+/*
+ *		Decode a record of version 2.0
+ *
+ *	Returns TRUE if the record is consistent
+ */
+
+static BOOL usn_decode(const USN_RECORD *rec, u32 length,
+			struct USN_CHANGE *change)
+{
+	u32 name_offset;
+	u32 name_length;
+	BOOL ok;
+
+	name_offset = le16_to_cpu(rec->file_name_offset);
+	name_length = le16_to_cpu(rec->file_name_length);
+	ok = (length >= sizeof(USN_RECORD))
+		&& !le16_to_cpu(rec->minor_version)
+		&& (name_offset >= sizeof(USN_RECORD))
+		&& !(name_length & 1)
+		&& ((name_offset + name_length) <= length);
+	if (ok) {
+		change->usn = sle64_to_cpu(rec->usn);
+		change->mref = le64_to_cpu(rec->file_reference);
+		change->parent_mref = le64_to_cpu(rec->parent_reference);
+		change->timestamp = sle64_to_cpu(rec->timestamp);
+		change->reason = le32_to_cpu(rec->reason);
+		change->source_info = le32_to_cpu(rec->source_info);
+		change->security_id = le32_to_cpu(rec->security_id);
+		change->file_attributes = le32_to_cpu(rec->file_attributes);
+		change->name = (const ntfschar*)((const char*)rec
+						+ name_offset);
+		change->name_len = name_length/sizeof(ntfschar);
+	}
+	return (ok);
+}
+
+/**
+ * ntfs_usn_open - start reading the change journal
+ * @vol:	volume to read the journal from
+ * @start:	usn of the first record wanted
+ * @info:	where to store the description of the journal, or NULL
+ *
+ * The records are returned from @start, or from the oldest record still
+ * present when @start is lower. When @start was returned by a previous
+ * ntfs_usn_position(), the records before it have been discarded if it
+ * is lower than the lowest usn in @info, and the journal has been
+ * recreated if the journal id has changed.
+ *
+ * Return the reader on success or NULL on error, with errno set to
+ * ENOENT if the volume has no change journal.
+ */
+struct USN_READER *ntfs_usn_open(ntfs_volume *vol, s64 start,
+			struct USN_JOURNAL_INFO *info)
+{
+	struct USN_READER *reader;
+	USN_JOURNAL_MAX *max;
+	s64 size;
+	int err;
+
+	reader = (struct USN_READER*)ntfs_calloc(sizeof(struct USN_READER));
+	if (!reader)
+		return ((struct USN_READER*)NULL);
+	max = (USN_JOURNAL_MAX*)NULL;
+	reader->ni = usn_open_inode(vol);
+	if (!reader->ni)
+		goto err_out;
+	max = (USN_JOURNAL_MAX*)ntfs_attr_readall(reader->ni, AT_DATA,
+				usn_max_name, 4, &size);
+	reader->na = ntfs_attr_open(reader->ni, AT_DATA, usn_j_name, 2);
+	if (!max || !reader->na)
+		goto err_out;
+	if ((size < (s64)sizeof(USN_JOURNAL_MAX))
+	    || (NAttrNonResident(reader->na)
+		&& ntfs_attr_map_whole_runlist(reader->na))) {
+		if (size < (s64)sizeof(USN_JOURNAL_MAX))
+			errno = EIO;
+		ntfs_log_perror("Bad $UsnJrnl");
+		goto err_out;
+	}
+	reader->buf = (char*)ntfs_malloc(USN_READ_SIZE);
+	if (!reader->buf)
+		goto err_out;
+	reader->end = reader->na->data_size;
+	if (start < sle64_to_cpu(max->lowest_valid_usn))
+		start = sle64_to_cpu(max->lowest_valid_usn);
+	start = (start + 7) & -8LL;
+	reader->pos = (start < reader->end ? start : reader->end);
+	if (info) {
+		info->journal_id = le64_to_cpu(max->journal_id);
+		info->lowest_usn = sle64_to_cpu(max->lowest_valid_usn);
+		info->next_usn = reader->end;
+		info->maximum_size = sle64_to_cpu(max->maximum_size);
+		info->allocation_delta = sle64_to_cpu(max->allocation_delta);
+	}
+	free(max);
+	return (reader);
+err_out:
+	err = errno;
+	free(max);
+	if (reader->na)
+		ntfs_attr_close(reader->na);
+	if (reader->ni)
+		ntfs_inode_close(reader->ni);
+	free(reader);
+	errno = err;
+	return ((struct USN_READER*)NULL);
+}
+
+/**
+ * ntfs_usn_read - get the next batch of records
+ * @reader:	reader, as returned by ntfs_usn_open()
+ * @changes:	where to store the records
+ * @count:	max count of records to store
+ *
+ * Only records of version 2.0 are returned, the records of other
+ * versions are skipped. The names in the returned records remain
+ * at their address until the next call. The records appended to the
+ * journal after it was opened are not returned.
+ *
+ * Return the count of records stored, zero when there are no more
+ * records, or -1 on error with errno set to the error code.
+ */
+int ntfs_usn_read(struct USN_READER *reader, struct USN_CHANGE *changes,
+			int count)
+{
+	const USN_RECORD *rec;
+	s64 offset;
+	u32 length;
+	int n;
+
+	n = 0;
+	while ((n < count) && (reader->pos < reader->end)) {
+		offset = reader->pos - reader->buf_pos;
+		if ((offset < 0)
+		    || ((offset + (s64)sizeof(USN_RECORD))
+				> reader->buf_count)) {
+				/* names of the batch are in the buffer */
+			if (n)
+				break;
+			if (usn_fill(reader, reader->pos) < 0)
+				return (-1);
+			if (reader->pos >= reader->end)
+				break;
+				/* too short for a record, skip the extent */
+			if (reader->buf_count < (s64)sizeof(USN_RECORD)) {
+				reader->pos += reader->buf_count;
+				continue;
+			}
+			offset = 0;
+		}
+		rec = (const USN_RECORD*)&reader->buf[offset];
+		length = le32_to_cpu(rec->record_length);
+			/* padding or garbage, check the next position */
+		if ((length < sizeof(USN_RECORD)) || (length & 7)
+		    || (length > USN_READ_SIZE)) {
+			reader->pos += 8;
+			continue;
+		}
+		if ((offset + length) > reader->buf_count) {
+				/* read again from the record */
+			if (offset) {
+				if (n)
+					break;
+				reader->buf_count = 0;
+				continue;
+			}
+				/* the last record is incomplete */
+			if ((reader->buf_pos + reader->buf_count)
+					>= reader->end)
+				break;
+				/* garbage before a hole */
+			reader->pos += 8;
+			continue;
+		}
+		if ((le16_to_cpu(rec->major_version) == 2)
+		    && (sle64_to_cpu(rec->usn) == reader->pos)
+		    && usn_decode(rec, length, &changes[n]))
+			n++;
+		reader->pos += length;
+	}
+	return (n);
+}
+
+/**
+ * ntfs_usn_position - get the usn where the reading would continue
+ * @reader:	reader, as returned by ntfs_usn_open()
+ *
+ * When all the records have been read, this is the usn to start from
+ * for getting only the records appended later.
+ */
+s64 ntfs_usn_position(const struct USN_READER *reader)
+{
+	return (reader->pos);
+}
+
+/**
+ * ntfs_usn_close - end reading the change journal
+ * @reader:	reader, as returned by ntfs_usn_open()
+ *
+ * Return 0 on success or -1 on error with errno set
+ */
+int ntfs_usn_close(struct USN_READER *reader)
+{
+	int res;
+
+	ntfs_attr_close(reader->na);
+	res = ntfs_inode_close(reader->ni);
+	free(reader->buf);
+	free(reader);
+	return (res);
+}
+
+/*
+ *		Recording the changes into the change journal
+ *
+ *	When requested (mount option "usn_journal"), the changes made
+ *	through ntfs-3g are recorded as Windows does, so that the
+ *	programs relying on the journal do not have to examine all
+ *	the files after the volume has been used on Linux. The reasons
+ *	of the changes to a file accumulate until the file is closed,
+ *	and a record is appended when a reason is added, then when
+ *	the file is closed.
+ *
+ *	The records are gathered in a buffer, appended to $J in writes
+ *	of USN_WRITE_SIZE bytes, and when the volume is committed or
+ *	unmounted. When the journal grows beyond its maximum size
+ *	and allocation delta, its beginning is deallocated. If the
+ *	records cannot be appended, the journal id is changed, so
+ *	that the programs relying on the journal know they have to
+ *	examine all the files.
+ */
+
+struct USN_WRITER {
+#ifdef ENABLE_THREADS
+	pthread_mutex_t lock;
+#endif
+	ntfs_inode *ni;		/* $UsnJrnl, held */
+	ntfs_attr *na;		/* its $J stream */
+	ntfs_attr *max_na;	/* its $Max stream */
+	char *buf;		/* records not written yet */
+	s64 base;		/* usn of the start of buf */
+	u32 count;		/* bytes in buf */
+	BOOL failed;		/* records are not recorded any more */
+	USN_JOURNAL_MAX max;	/* current contents of $Max */
+} ;
+
+	/* the biggest record, with a name of 255 characters */
+#define USN_RECORD_MAX_SIZE ((sizeof(USN_RECORD) \
+		+ NTFS_MAX_NAME_LEN*sizeof(ntfschar) + 7) & -8)
+
+static void usn_lock(struct USN_WRITER *writer
+#ifndef ENABLE_THREADS
+			__attribute__((unused))
+#endif
+			)
+{
+#ifdef ENABLE_THREADS
+	pthread_mutex_lock(&writer->lock);
+#endif
+}
+
+static void usn_unlock(struct USN_WRITER *writer
+#ifndef ENABLE_THREADS
+			__attribute__((unused))
+#endif
+			)
+{
+#ifdef ENABLE_THREADS
+	pthread_mutex_unlock(&writer->lock);
+#endif
+}
+
+/*
+ *		Give up recording the changes
+ *
+ *	The journal id is changed, so that the programs relying on the
+ *	journal know some changes are missing.
+ */
+
+static void usn_fail(struct USN_WRITER *writer)
+{
+	writer->failed = TRUE;
+	writer->count = 0;
+	writer->max.journal_id = cpu_to_le64(sle64_to_cpu(
+				ntfs_current_time()));
+	writer->max.lowest_valid_usn = cpu_to_sle64(
+				(writer->na->data_size + 7) & -8LL);
+	if (ntfs_attr_pwrite(writer->max_na, 0, sizeof(USN_JOURNAL_MAX),
+			&writer->max) != (s64)sizeof(USN_JOURNAL_MAX))
+		ntfs_log_perror("Failed to invalidate $UsnJrnl, "
+				"it is now inaccurate");
+	else
+		ntfs_log_error("Changes are not recorded into $UsnJrnl "
+				"any more, its journal id has been changed\n");
+}
+
+/*
+ *		Deallocate the oldest records when the journal is too big
+ *
+ *	Only whole clusters can be deallocated, so the lowest valid usn
+ *	is set at the beginning of a journal page, where a record starts
+ *	unless the page begins with padding.
+ */
+
+static int usn_trim(struct USN_WRITER *writer)
+{
+	ntfs_volume *vol;
+	s64 maximum_size;
+	s64 lowest;
+	s64 new_lowest;
+	s64 start;
+	s64 end;
+
+	maximum_size = sle64_to_cpu(writer->max.maximum_size);
+	lowest = sle64_to_cpu(writer->max.lowest_valid_usn);
+	if ((maximum_size <= 0)
+	    || ((writer->base - lowest) <= (maximum_size
+			+ sle64_to_cpu(writer->max.allocation_delta))))
+		return (0);
+	vol = writer->ni->vol;
+	new_lowest = (writer->base - maximum_size) & -(s64)USN_PAGE_SIZE;
+	start = lowest & -(s64)vol->cluster_size;
+	end = new_lowest & -(s64)vol->cluster_size;
+	if (NAttrNonResident(writer->na) && (end > start)
+	    && ntfs_attr_punch_hole(writer->na, start, end - start))
+		return (-1);
+	writer->max.lowest_valid_usn = cpu_to_sle64(new_lowest);
+	if (ntfs_attr_pwrite(writer->max_na, 0, sizeof(USN_JOURNAL_MAX),
+			&writer->max) != (s64)sizeof(USN_JOURNAL_MAX))
+		return (-1);
+	return (0);
+}
+
+/*
+ *		Append the buffered records to $J
+ *
+ *	Must be called with the writer locked
+ */
+
+static int usn_flush(struct USN_WRITER *writer)
+{
+	s64 written;
+	int res;
+
+	res = 0;
+	if (writer->count) {
+		written = ntfs_attr_pwrite(writer->na, writer->base,
+					writer->count, writer->buf);
+		if (written != (s64)writer->count) {
+			ntfs_log_perror("Failed to append to $UsnJrnl");
+			usn_fail(writer);
+			res = -1;
+		} else {
+			writer->base += writer->count;
+			writer->count = 0;
+				/* the size of $J, for a consistent journal */
+			if (NInoDirty(writer->ni) && ntfs_inode_sync(writer->ni))
+				res = -1;
+			if (usn_trim(writer)) {
+				ntfs_log_perror("Failed to trim $UsnJrnl");
+				res = -1;
+			}
+		}
+	}
+	return (res);
+}
+
+/*
+ *		Append a record to the buffer
+ *
+ *	A record must not cross a journal page, the end of the current
+ *	page is filled with zeroes when needed.
+ *
+ *	Returns the usn of the record, or -1 if it was not recorded
+ */
+
+static s64 usn_append(struct USN_WRITER *writer, USN_RECORD *rec,
+			u32 length)
+{
+	s64 pos;
+	u32 room;
+
+	usn_lock(writer);
+	pos = -1;
+	if (!writer->failed) {
+		room = USN_PAGE_SIZE
+			- ((writer->base + writer->count) & (USN_PAGE_SIZE - 1));
+		if (((writer->count + room + length) > USN_WRITE_SIZE)
+		    && !usn_flush(writer))
+			room = USN_PAGE_SIZE
+				- (writer->base & (USN_PAGE_SIZE - 1));
+		if (!writer->failed) {
+			if (length > room) {
+				memset(&writer->buf[writer->count], 0, room);
+				writer->count += room;
+			}
+			pos = writer->base + writer->count;
+			rec->usn = cpu_to_sle64(pos);
+			memcpy(&writer->buf[writer->count], rec, length);
+			writer->count += length;
+		}
+	}
+	usn_unlock(writer);
+	return (pos);
+}
+
+/*
+ *		Get the name and parent of an inode from its first name
+ *	which is not a DOS name
+ *
+ *	Returns the byte size of the name, 0 if there is none
+ */
+
+static u32 usn_inode_name(ntfs_inode *ni, USN_RECORD *rec)
+{
+	ntfs_attr_search_ctx *ctx;
+	FILE_NAME_ATTR *fn;
+	u32 size;
+
+	size = 0;
+	ctx = ntfs_attr_get_search_ctx(ni, NULL);
+	if (ctx) {
+		while (!ntfs_attr_lookup(AT_FILE_NAME, AT_UNNAMED, 0,
+				CASE_SENSITIVE, 0, NULL, 0, ctx)) {
+			fn = (FILE_NAME_ATTR*)((u8*)ctx->attr
+				+ le16_to_cpu(ctx->attr->value_offset));
+			if (fn->file_name_type != FILE_NAME_DOS) {
+				rec->parent_reference = fn->parent_directory;
+				size = fn->file_name_length*sizeof(ntfschar);
+				memcpy(rec->file_name, fn->file_name, size);
+				break;
+			}
+		}
+		ntfs_attr_put_search_ctx(ctx);
+	}
+	return (size);
+}
+
+/**
+ * ntfs_usn_record - record a change to a file
+ * @ni:		inode changed
+ * @dir_ni:	directory where the file is named, or NULL
+ * @name:	name of the file in @dir_ni, NULL to use its first name
+ * @name_len:	length of @name in characters
+ * @reason:	USN_REASON_* of the change
+ *
+ * The reason is accumulated with the previous ones since the file was
+ * opened, and a record is appended when the reason is new, or when the
+ * reason is about a name or closing the file. The change is not
+ * recorded if the volume is not recording the changes, and errors
+ * are not returned, as they should not prevent the change.
+ */
+void ntfs_usn_record(ntfs_inode *ni, ntfs_inode *dir_ni,
+			const ntfschar *name, int name_len, le32 reason)
+{
+	struct USN_WRITER *writer;
+	USN_RECORD *rec;
+	le64 buf[USN_RECORD_MAX_SIZE/sizeof(le64)];
+	le32 named;
+	u32 size;
+	s64 usn;
+
+	writer = ni->vol->usn_writer;
+	if (!writer || writer->failed)
+		return;
+	if (ni->nr_extents == -1)
+		ni = ni->base_ni;
+		/* metadata files are not recorded, nor is $UsnJrnl */
+	if ((ni == writer->ni) || (ni->mft_no < FILE_first_user)
+	    || (ni->mrec->flags & MFT_RECORD_IS_4))
+		return;
+	named = USN_REASON_RENAME_OLD_NAME | USN_REASON_RENAME_NEW_NAME
+			| USN_REASON_HARD_LINK_CHANGE;
+	if ((reason == USN_REASON_CLOSE)
+	    ? !ni->usn_reasons
+	    : !(reason & ~ni->usn_reasons) && !(reason & named))
+		return;
+	rec = (USN_RECORD*)buf;
+	memset(rec, 0, sizeof(USN_RECORD));
+	if (name && dir_ni) {
+		if (name_len > NTFS_MAX_NAME_LEN)
+			name_len = NTFS_MAX_NAME_LEN;
+		size = name_len*sizeof(ntfschar);
+		memcpy(rec->file_name, name, size);
+		rec->parent_reference = MK_LE_MREF(dir_ni->mft_no,
+				le16_to_cpu(dir_ni->mrec->sequence_number));
+	} else
+		size = usn_inode_name(ni, rec);
+	rec->record_length = cpu_to_le32((sizeof(USN_RECORD) + size + 7) & -8);
+	rec->major_version = const_cpu_to_le16(2);
+	rec->file_reference = MK_LE_MREF(ni->mft_no,
+				le16_to_cpu(ni->mrec->sequence_number));
+	rec->timestamp = ntfs_current_time();
+	rec->reason = ni->usn_reasons | reason;
+	rec->security_id = ni->security_id;
+	rec->file_attributes = ni->flags;
+	if (ni->mrec->flags & MFT_RECORD_IS_DIRECTORY)
+		rec->file_attributes |= FILE_ATTR_DIRECTORY;
+	rec->file_name_length = cpu_to_le16(size);
+	rec->file_name_offset = const_cpu_to_le16(sizeof(USN_RECORD));
+		/* the old name is only mentioned in its own record */
+	if (reason & USN_REASON_CLOSE)
+		ni->usn_reasons = const_cpu_to_le32(0);
+	else
+		ni->usn_reasons = rec->reason & ~USN_REASON_RENAME_OLD_NAME;
+	usn = usn_append(writer, rec, le32_to_cpu(rec->record_length));
+		/* the usn of the file, unless it is being deleted */
+	if ((usn >= 0) && test_nino_flag(ni, v3_Extensions)
+	    && !(reason & USN_REASON_FILE_DELETE)) {
+		ni->usn = cpu_to_le64(usn);
+		ntfs_inode_mark_dirty(ni);
+	}
+}
+
+/**
+ * ntfs_usn_start - start recording the changes into the change journal
+ * @vol:	volume, mounted read-write
+ *
+ * The journal must have been created by Windows.
+ *
+ * Return 0 on success or -1 on error with errno set to the error code,
+ * ENOENT meaning the volume has no change journal.
+ */
+int ntfs_usn_start(ntfs_volume *vol)
+{
+	struct USN_WRITER *writer;
+	int err;
+
+	if (vol->usn_writer)
+		return (0);
+	if (NVolReadOnly(vol)) {
+		errno = EROFS;
+		return (-1);
+	}
+	writer = (struct USN_WRITER*)ntfs_calloc(sizeof(struct USN_WRITER));
+	if (!writer)
+		return (-1);
+	writer->ni = usn_open_inode(vol);
+	if (!writer->ni)
+		goto err_out;
+		/* share the inode with other openings */
+	ntfs_inode_hold(writer->ni);
+	writer->na = ntfs_attr_open(writer->ni, AT_DATA, usn_j_name, 2);
+	writer->max_na = ntfs_attr_open(writer->ni, AT_DATA, usn_max_name, 4);
+	if (!writer->na || !writer->max_na)
+		goto err_out;
+	if ((writer->max_na->data_size < (s64)sizeof(USN_JOURNAL_MAX))
+	    || (ntfs_attr_pread(writer->max_na, 0, sizeof(USN_JOURNAL_MAX),
+			&writer->max) != (s64)sizeof(USN_JOURNAL_MAX))) {
+		errno = EIO;
+		ntfs_log_perror("Bad $UsnJrnl");
+		goto err_out;
+	}
+	if (writer->na->data_flags
+			& (ATTR_COMPRESSION_MASK | ATTR_IS_ENCRYPTED)) {
+		errno = EOPNOTSUPP;
+		goto err_out;
+	}
+	writer->buf = (char*)ntfs_malloc(USN_WRITE_SIZE);
+	if (!writer->buf)
+		goto err_out;
+	writer->base = (writer->na->data_size + 7) & -8LL;
+#ifdef ENABLE_THREADS
+	pthread_mutex_init(&writer->lock, NULL);
+#endif
+	vol->usn_writer = writer;
+	return (0);
+err_out:
+	err = errno;
+	if (writer->max_na)
+		ntfs_attr_close(writer->max_na);
+	if (writer->na)
+		ntfs_attr_close(writer->na);
+	if (writer->ni)
+		ntfs_inode_close(writer->ni);
+	free(writer);
+	errno = err;
+	return (-1);
+}
+
+/**
+ * ntfs_usn_flush - append the records gathered to the change journal
+ * @vol:	volume
+ *
+ * Return 0 on success or -1 on error with errno set to the error code.
+ */
+int ntfs_usn_flush(ntfs_volume *vol)
+{
+	struct USN_WRITER *writer;
+	int res;
+
+	res = 0;
+	writer = vol->usn_writer;
+	if (writer) {
+		usn_lock(writer);
+		res = usn_flush(writer);
+		usn_unlock(writer);
+	}
+	return (res);
+}
+
+/**
+ * ntfs_usn_stop - stop recording the changes into the change journal
+ * @vol:	volume
+ *
+ * The files still open are recorded as closed, and the records gathered
+ * are appended to the journal.
+ *
+ * Return 0 on success or -1 on error with errno set to the error code.
+ */
+int ntfs_usn_stop(ntfs_volume *vol)
+{
+	struct USN_WRITER *writer;
+	ntfs_inode *ni;
+	int err;
+
+	writer = vol->usn_writer;
+	if (!writer)
+		return (0);
+	for (ni=vol->held_inodes; ni; ni=ni->next_held)
+		if (ni->usn_reasons)
+			ntfs_usn_record(ni, NULL, NULL, 0, USN_REASON_CLOSE);
+	err = 0;
+	if (ntfs_usn_flush(vol))
+		err = errno;
+	vol->usn_writer = (struct USN_WRITER*)NULL;
+	ntfs_attr_close(writer->max_na);
+	ntfs_attr_close(writer->na);
+	if (ntfs_inode_close(writer->ni) && !err)
+		err = errno;
+#ifdef ENABLE_THREADS
+	pthread_mutex_destroy(&writer->lock);
+#endif
+	free(writer->buf);
+	free(writer);
+	if (err) {
+		errno = err;
+		return (-1);
+	}
+	return (0);
+}
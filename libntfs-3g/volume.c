@@ -53,6 +53,9 @@
 #ifdef HAVE_LOCALE_H
 #include <locale.h>
 #endif
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
 
 #if defined(__sun) && defined (__SVR4)
 #include <sys/mnttab.h>
@@ -68,10 +71,21 @@
 #include "debug.h"
 #include "inode.h"
 #include "runlist.h"
+#include "lcnalloc.h"
 #include "logfile.h"
 #include "dir.h"
+#include "index.h"
 #include "logging.h"
 #include "cache.h"
+#include "mftcache.h"
+#include "dirindex.h"
+#include "idxcache.h"
+#include "bmpcache.h"
+#include "devcache.h"
+#include "usnjrnl.h"
+#include "lock.h"
+#include "overlay.h"
+#include "ioctl.h"
 #include "realpath.h"
 #include "misc.h"
 
@@ -167,6 +181,19 @@ static int __ntfs_volume_release(ntfs_volume *v)
 {
 	int err = 0;
 
+	ntfs_cluster_count_stop(v);
+	ntfs_discard_stop(v);
+		/* before the held inodes, including $UsnJrnl, are closed */
+	if (ntfs_usn_stop(v))
+		ntfs_error_set(&err);
+		/* close the inodes the program did not release */
+	while (v->held_inodes) {
+		v->held_inodes->open_count = 1;
+		if (ntfs_inode_close(v->held_inodes))
+			ntfs_error_set(&err);
+	}
+	if (ntfs_inode_defer_file_names(v, 0))
+		ntfs_error_set(&err);
 	if (ntfs_inode_free(&v->vol_ni))
 		ntfs_error_set(&err);
 	/* 
@@ -175,12 +202,27 @@ static int __ntfs_volume_release(ntfs_volume *v)
 	 */
 	if (v->lcnbmp_ni && NInoDirty(v->lcnbmp_ni))
 		ntfs_inode_sync(v->lcnbmp_ni);
+	ntfs_cluster_summary_release(v);
+	ntfs_cluster_windows_release(v);
 	ntfs_attr_free(&v->lcnbmp_na);
 	if (ntfs_inode_free(&v->lcnbmp_ni))
 		ntfs_error_set(&err);
 	
 	if (v->mft_ni && NInoDirty(v->mft_ni))
 		ntfs_inode_sync(v->mft_ni);
+	if (ntfs_bmpcache_flush(v, FALSE))
+		ntfs_error_set(&err);
+	if (ntfs_idxcache_detach(v))
+		ntfs_error_set(&err);
+	if (ntfs_dirindex_detach(v))
+		ntfs_error_set(&err);
+	ntfs_index_pool_release(v);
+	if (ntfs_mftcache_detach(v))
+		ntfs_error_set(&err);
+		/* the cleared bits only after the records */
+	if (ntfs_bmpcache_detach(v))
+		ntfs_error_set(&err);
+	ntfs_mft_bitmap_release(v);
 	ntfs_attr_free(&v->mftbmp_na);
 	ntfs_attr_free(&v->mft_na);
 	if (ntfs_inode_free(&v->mft_ni))
@@ -202,9 +244,12 @@ static int __ntfs_volume_release(ntfs_volume *v)
 	}
 
 	ntfs_free_lru_caches(v);
+	ntfs_inode_pool_release(v);
+	ntfs_attr_search_pool_release(v);
+	ntfs_free_locks(v);
 	free(v->vol_name);
-	free(v->upcase);
-	if (v->locase) free(v->locase);
+	ntfs_case_table_release(v->upcase);
+	ntfs_case_table_release(v->locase);
 	free(v->attrdef);
 	free(v);
 
@@ -347,6 +392,7 @@ mft_has_no_attr_list:
 			goto error_exit;
 		}
 		vol->mft_na->rl = nrl;
+		ntfs_attr_forget_runs(vol->mft_na);
 
 		/* Get the lowest vcn for the next extent. */
 		highest_vcn = sle64_to_cpu(a->highest_vcn);
@@ -473,6 +519,7 @@ ntfs_volume *ntfs_volume_startup(struct ntfs_device *dev,
 	s64 br;
 	ntfs_volume *vol;
 	NTFS_BOOT_SECTOR *bs;
+	int oflags;
 	int eo;
 
 	if (!dev || !dev->d_ops || !dev->d_name) {
@@ -494,6 +541,7 @@ ntfs_volume *ntfs_volume_startup(struct ntfs_device *dev,
 	vol->upcase_len = ntfs_upcase_build_default(&vol->upcase);
 	if (!vol->upcase_len || !vol->upcase)
 		goto error_exit;
+	vol->upcase = ntfs_case_table_share(vol->upcase, vol->upcase_len);
 
 	/* Default with no locase table and case sensitive file names */
 	vol->locase = (ntfschar*)NULL;
@@ -509,13 +557,19 @@ ntfs_volume *ntfs_volume_startup(struct ntfs_device *dev,
 #else
 	NVolClearCompression(vol);
 #endif
-	if (flags & NTFS_MNT_RDONLY)
+	if (flags & (NTFS_MNT_RDONLY | NTFS_MNT_IMMUTABLE))
 		NVolSetReadOnly(vol);
+	oflags = 0;
+#ifdef O_DIRECT
+	if (flags & NTFS_MNT_DIRECT_IO)
+		oflags |= O_DIRECT;
+#endif
 	
 	/* ...->open needs bracketing to compile with glibc 2.7 */
-	if ((dev->d_ops->open)(dev, NVolReadOnly(vol) ? O_RDONLY: O_RDWR)) {
+	if ((dev->d_ops->open)(dev,
+			oflags | (NVolReadOnly(vol) ? O_RDONLY: O_RDWR))) {
 		if (!NVolReadOnly(vol) && (errno == EROFS)) {
-			if ((dev->d_ops->open)(dev, O_RDONLY)) {
+			if ((dev->d_ops->open)(dev, oflags | O_RDONLY)) {
 				ntfs_log_perror("Error opening read-only '%s'",
 						dev->d_name);
 				goto error_exit;
@@ -607,6 +661,8 @@ ntfs_volume *ntfs_volume_startup(struct ntfs_device *dev,
 
 	/* Set the mft data allocation position to mft record 24. */
 	vol->mft_data_pos = 24;
+	vol->mft_growth = MFT_GROWTH_MAX;
+	vol->compression_level = COMPRESSION_LEVEL_DEFAULT;
 
 	/*
 	 * The cluster allocator is now fully operational.
@@ -692,6 +748,55 @@ out:
 	return 0;
 }
 
+/*
+ *		Get the current LSN of the journal
+ *
+ *	This identifies the state of the volume left by Windows, and
+ *	it is used for checking whether data saved from a previous
+ *	mount is still valid.
+ *
+ *	Returns 0 if successful, the LSN being zero if the journal
+ *			is empty,
+ *		-1 otherwise, with errno set
+ */
+
+int ntfs_volume_get_lsn(ntfs_volume *vol, s64 *lsn)
+{
+	ntfs_inode *ni;
+	ntfs_attr *na;
+	RESTART_PAGE_HEADER *rp;
+	RESTART_AREA *ra;
+	int res;
+
+	res = -1;
+	ni = ntfs_inode_open(vol, FILE_LogFile);
+	if (ni) {
+		na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+		if (na) {
+			rp = (RESTART_PAGE_HEADER*)NULL;
+			if (ntfs_check_logfile(na, &rp)) {
+				*lsn = 0;
+				if (rp && ntfs_is_rstr_record(rp->magic)) {
+					ra = (RESTART_AREA*)((u8*)rp
+						+ le16_to_cpu(
+						    rp->restart_area_offset));
+					*lsn = sle64_to_cpu(ra->current_lsn);
+				} else
+					if (rp)
+						*lsn = sle64_to_cpu(
+							rp->chkdsk_lsn);
+				res = 0;
+			} else
+				errno = EIO;
+			free(rp);
+			ntfs_attr_close(na);
+		}
+		if (ntfs_inode_close(ni))
+			res = -1;
+	}
+	return (res);
+}
+
 /**
  * ntfs_hiberfile_open - Find and open '/hiberfil.sys'
  * @vol:    An ntfs volume obtained from ntfs_mount
@@ -877,6 +982,74 @@ static int fix_txf_data(ntfs_volume *vol)
 	return (res);
 }
 
+/*
+ *		Load the attribute definitions from $AttrDef
+ *
+ *	This is done when mounting, unless NTFS_MNT_FAST is set, in which
+ *	case this is done when the table is first needed, which is by a
+ *	modification holding the volume lock in exclusive mode.
+ *
+ *	Returns 0 if successful (or already loaded),
+ *		-1 otherwise (with errno set)
+ */
+
+int ntfs_volume_load_attrdef(ntfs_volume *vol)
+{
+	ntfs_inode *ni;
+	ntfs_attr *na;
+	ATTR_DEF *attrdef;
+	s64 l;
+	int res;
+
+	if (vol->attrdef)
+		return (0);
+	res = -1;
+	ntfs_log_debug("Loading $AttrDef...\n");
+	ni = ntfs_inode_open(vol, FILE_AttrDef);
+	if (!ni) {
+		ntfs_log_perror("Failed to open $AttrDef");
+		return (-1);
+	}
+	/* Get an ntfs attribute for $AttrDef/$DATA. */
+	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+	if (!na) {
+		ntfs_log_perror("Failed to open ntfs attribute");
+		goto out;
+	}
+	/* Check we don't overflow 32-bits. */
+	if (na->data_size > 0xffffffffLL) {
+		ntfs_log_error("Attribute definition table is too big (max "
+			       "32-bit allowed).\n");
+		errno = EINVAL;
+		goto out;
+	}
+	attrdef = ntfs_malloc(na->data_size);
+	if (!attrdef)
+		goto out;
+	/* Read in the $DATA attribute value into the buffer. */
+	l = ntfs_attr_pread(na, 0, na->data_size, attrdef);
+	if (l != na->data_size) {
+		ntfs_log_error("Failed to read $AttrDef, unexpected length "
+			       "(%lld != %lld).\n", (long long)l,
+			       (long long)na->data_size);
+		free(attrdef);
+		errno = EIO;
+		goto out;
+	}
+	vol->attrdef_len = na->data_size;
+	vol->attrdef = attrdef;
+	res = 0;
+out :
+	if (na)
+		ntfs_attr_close(na);
+	/* Done with the $AttrDef mft record. */
+	if (ntfs_inode_close(ni)) {
+		ntfs_log_perror("Failed to close $AttrDef");
+		res = -1;
+	}
+	return (res);
+}
+
 /**
  * ntfs_device_mount - open ntfs volume
  * @dev:	device to open
@@ -889,6 +1062,8 @@ static int fix_txf_data(ntfs_volume *vol)
  * the mount system call (man 2 mount). Currently only the following flag
  * is implemented:
  *	NTFS_MNT_RDONLY	- mount volume read-only
+ *	NTFS_MNT_IMMUTABLE - mount volume read-only, and assume the device
+ *			  is not modified by anyone else while mounted
  *
  * The function opens the device @dev and verifies that it contains a valid
  * bootsector. Then, it allocates an ntfs_volume structure and initializes
@@ -911,6 +1086,10 @@ ntfs_volume *ntfs_device_mount(struct ntfs_device *dev, ntfs_mount_flags flags)
 	VOLUME_INFORMATION *vinf;
 	ntfschar *vname;
 	u32 record_size;
+	ntfschar *upcase;
+	struct MFT_SCAN *scan;
+	s64 first_user;
+	s64 mft_no;
 	int i, j, eo;
 	unsigned int k;
 	u32 u;
@@ -919,24 +1098,30 @@ ntfs_volume *ntfs_device_mount(struct ntfs_device *dev, ntfs_mount_flags flags)
 	if (!vol)
 		return NULL;
 
+	/*
+	 * Read all the system records in a single batch, the records
+	 * compared to $MFTMirr and the inodes opened below are then
+	 * taken from the batch instead of being read one at a time.
+	 * This is only an optimization, so failing to start is ignored.
+	 */
+	first_user = (vol->mftmirr_size > FILE_first_user
+			? vol->mftmirr_size : FILE_first_user);
+	scan = ntfs_mft_scan_start(vol, 0, first_user);
+	if (scan)
+		ntfs_mft_scan_next(scan, &mft_no, (MFT_RECORD**)NULL);
+
 	/* Load data from $MFT and $MFTMirr and compare the contents. */
 	m  = ntfs_malloc(vol->mftmirr_size << vol->mft_record_size_bits);
 	m2 = ntfs_malloc(vol->mftmirr_size << vol->mft_record_size_bits);
 	if (!m || !m2)
 		goto error_exit;
 
-	l = ntfs_attr_mst_pread(vol->mft_na, 0, vol->mftmirr_size,
-			vol->mft_record_size, m);
-	if (l != vol->mftmirr_size) {
-		if (l == -1)
+	for (i = 0; i < vol->mftmirr_size; ++i) {
+		if (ntfs_mft_records_read(vol, i, 1,
+				(MFT_RECORD*)(m + i * vol->mft_record_size))) {
 			ntfs_log_perror("Failed to read $MFT");
-		else {
-			ntfs_log_error("Failed to read $MFT, unexpected length "
-				       "(%lld != %d).\n", (long long)l,
-				       vol->mftmirr_size);
-			errno = EIO;
+			goto error_exit;
 		}
-		goto error_exit;
 	}
 	l = ntfs_attr_mst_pread(vol->mftmirr_na, 0, vol->mftmirr_size,
 			vol->mft_record_size, m2);
@@ -1050,23 +1235,24 @@ ntfs_volume *ntfs_device_mount(struct ntfs_device *dev, ntfs_mount_flags flags)
 		errno = EINVAL;
 		goto error_exit;
 	}
-	if (vol->upcase_len != na->data_size >> 1) {
-		vol->upcase_len = na->data_size >> 1;
-		/* Throw away default table. */
-		free(vol->upcase);
-		vol->upcase = ntfs_malloc(na->data_size);
-		if (!vol->upcase)
-			goto error_exit;
-	}
+	/* The default table may be shared, so read into a new buffer. */
+	upcase = ntfs_malloc(na->data_size);
+	if (!upcase)
+		goto error_exit;
 	/* Read in the $DATA attribute value into the buffer. */
-	l = ntfs_attr_pread(na, 0, na->data_size, vol->upcase);
+	l = ntfs_attr_pread(na, 0, na->data_size, upcase);
 	if (l != na->data_size) {
 		ntfs_log_error("Failed to read $UpCase, unexpected length "
 			       "(%lld != %lld).\n", (long long)l,
 			       (long long)na->data_size);
+		free(upcase);
 		errno = EIO;
 		goto error_exit;
 	}
+	/* Throw away default table, and share the one read. */
+	ntfs_case_table_release(vol->upcase);
+	vol->upcase_len = na->data_size >> 1;
+	vol->upcase = ntfs_case_table_share(upcase, vol->upcase_len);
 	/* Done with the $UpCase mft record. */
 	ntfs_attr_close(na);
 	if (ntfs_inode_close(ni)) {
@@ -1188,50 +1374,20 @@ ntfs_volume *ntfs_device_mount(struct ntfs_device *dev, ntfs_mount_flags flags)
 	}
 	ntfs_attr_put_search_ctx(ctx);
 	ctx = NULL;
-	/* Now load the attribute definitions from $AttrDef. */
-	ntfs_log_debug("Loading $AttrDef...\n");
-	ni = ntfs_inode_open(vol, FILE_AttrDef);
-	if (!ni) {
-		ntfs_log_perror("Failed to open $AttrDef");
-		goto error_exit;
-	}
-	/* Get an ntfs attribute for $AttrDef/$DATA. */
-	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
-	if (!na) {
-		ntfs_log_perror("Failed to open ntfs attribute");
-		goto error_exit;
-	}
-	/* Check we don't overflow 32-bits. */
-	if (na->data_size > 0xffffffffLL) {
-		ntfs_log_error("Attribute definition table is too big (max "
-			       "32-bit allowed).\n");
-		errno = EINVAL;
-		goto error_exit;
-	}
-	vol->attrdef_len = na->data_size;
-	vol->attrdef = ntfs_malloc(na->data_size);
-	if (!vol->attrdef)
-		goto error_exit;
-	/* Read in the $DATA attribute value into the buffer. */
-	l = ntfs_attr_pread(na, 0, na->data_size, vol->attrdef);
-	if (l != na->data_size) {
-		ntfs_log_error("Failed to read $AttrDef, unexpected length "
-			       "(%lld != %lld).\n", (long long)l,
-			       (long long)na->data_size);
-		errno = EIO;
-		goto error_exit;
-	}
-	/* Done with the $AttrDef mft record. */
-	ntfs_attr_close(na);
-	if (ntfs_inode_close(ni)) {
-		ntfs_log_perror("Failed to close $AttrDef");
+	/*
+	 * Now load the attribute definitions from $AttrDef, unless this
+	 * is deferred to the first modification which needs them, or
+	 * there can be no modification.
+	 */
+	if (!(flags & (NTFS_MNT_FAST | NTFS_MNT_IMMUTABLE))
+	    && ntfs_volume_load_attrdef(vol))
 		goto error_exit;
-	}
 	/*
 	 * Check for dirty logfile and hibernated Windows.
 	 * We care only about read-write mounts.
 	 */
-	if (!(flags & (NTFS_MNT_RDONLY | NTFS_MNT_FORENSIC))) {
+	if (!(flags & (NTFS_MNT_RDONLY | NTFS_MNT_IMMUTABLE
+			| NTFS_MNT_FORENSIC))) {
 		if (!(flags & NTFS_MNT_IGNORE_HIBERFILE) &&
 		    ntfs_volume_check_hiberfile(vol, 1) < 0)
 			goto error_exit;
@@ -1249,11 +1405,13 @@ ntfs_volume *ntfs_device_mount(struct ntfs_device *dev, ntfs_mount_flags flags)
 			goto error_exit;
 	}
 
+	ntfs_mft_scan_end(scan);
 	return vol;
 io_error_exit:
 	errno = EIO;
 error_exit:
 	eo = errno;
+	ntfs_mft_scan_end(scan);
 	if (ctx)
 		ntfs_attr_put_search_ctx(ctx);
 	free(m);
@@ -1303,8 +1461,9 @@ int ntfs_set_ignore_case(ntfs_volume *vol)
 
 	res = -1;
 	if (vol && vol->upcase) {
-		vol->locase = ntfs_locase_table_build(vol->upcase,
-					vol->upcase_len);
+		vol->locase = ntfs_case_table_share(
+				ntfs_locase_table_build(vol->upcase,
+					vol->upcase_len), vol->upcase_len);
 		if (vol->locase) {
 			NVolClearCaseSensitive(vol);
 			res = 0;
@@ -1327,6 +1486,12 @@ int ntfs_set_ignore_case(ntfs_volume *vol)
  * the mount system call (man 2 mount). Currently only the following flags
  * is implemented:
  *	NTFS_MNT_RDONLY	- mount volume read-only
+ *	NTFS_MNT_IMMUTABLE - mount volume read-only, and assume the device
+ *			  is not modified by anyone else while mounted
+ *	NTFS_MNT_MMAP	- with NTFS_MNT_RDONLY, read the device through a
+ *			  mapping in memory
+ *	NTFS_MNT_OVERLAY - @name is an overlay file, the writes are stored into
+ *			  it instead of the device it designates
  *
  * The function opens the device or file @name and verifies that it contains a
  * valid bootsector. Then, it allocates an ntfs_volume structure and initializes
@@ -1348,7 +1513,19 @@ ntfs_volume *ntfs_mount(const char *name __attribute__((unused)),
 	ntfs_volume *vol;
 
 	/* Allocate an ntfs_device structure. */
-	dev = ntfs_device_alloc(name, 0, &ntfs_device_default_io_ops, NULL);
+#ifndef HAVE_WINDOWS_H
+	if (flags & NTFS_MNT_OVERLAY)
+		dev = ntfs_device_alloc(name, 0, &ntfs_device_overlay_io_ops,
+				NULL);
+	else
+#endif
+	if ((flags & NTFS_MNT_MMAP)
+	    && (flags & (NTFS_MNT_RDONLY | NTFS_MNT_IMMUTABLE)))
+		dev = ntfs_device_alloc(name, 0, &ntfs_device_mmap_io_ops,
+				NULL);
+	else
+		dev = ntfs_device_alloc(name, 0, &ntfs_device_default_io_ops,
+				NULL);
 	if (!dev)
 		return NULL;
 	/* Call ntfs_device_mount() to do the actual mount. */
@@ -1357,8 +1534,10 @@ ntfs_volume *ntfs_mount(const char *name __attribute__((unused)),
 		int eo = errno;
 		ntfs_device_free(dev);
 		errno = eo;
-	} else
+	} else {
 		ntfs_create_lru_caches(vol);
+		ntfs_create_locks(vol);
+	}
 	return vol;
 #else
 	/*
@@ -1829,6 +2008,62 @@ int ntfs_volume_get_free_space(ntfs_volume *vol)
 	return (ret);
 }
 
+/*
+ *		Commit the metadata modifications gathered in the caches
+ *
+ *	When a commit interval is defined, the modified bitmap pages,
+ *	index blocks, MFT records and device blocks are kept in the
+ *	write-back caches, and they are written together at most every
+ *	commit_interval seconds, each cache writing in the order of
+ *	device locations. The bits set in the bitmaps are written first,
+ *	then the index blocks and the MFT records, as done on fsync(2),
+ *	and the bits cleared last, so that no record on the device ever
+ *	designates clusters or records which are not allocated there.
+ *	The records mirrored in $MFTMirr are still written immediately.
+ *
+ *	Unless @force is set, nothing is done until the interval has
+ *	elapsed since the previous commit. The device itself is not
+ *	synced, this is left to the caller.
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+int ntfs_volume_commit(ntfs_volume *vol, BOOL force)
+{
+	time_t now;
+	BOOL due;
+	int err;
+
+	err = 0;
+	if (force || vol->commit_interval) {
+		now = time((time_t*)NULL);
+		ntfs_cache_lock(vol);
+		due = force || ((now - vol->committed) >= vol->commit_interval);
+		if (due)
+			vol->committed = now;
+		ntfs_cache_unlock(vol);
+		if (due) {
+			if (ntfs_usn_flush(vol))
+				err = errno;
+			if (ntfs_bmpcache_flush(vol, FALSE) && !err)
+				err = errno;
+			if (ntfs_idxcache_flush(vol) && !err)
+				err = errno;
+			if (ntfs_mftcache_flush(vol) && !err)
+				err = errno;
+			if (ntfs_bmpcache_flush(vol, TRUE) && !err)
+				err = errno;
+			if (vol->dev && ntfs_devcache_flush(vol->dev) && !err)
+				err = errno;
+		}
+	}
+	if (err) {
+		errno = err;
+		return (-1);
+	}
+	return (0);
+}
+
 /**
  * ntfs_volume_rename - change the current label on a volume
  * @vol:	volume to change the label on
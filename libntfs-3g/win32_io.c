@@ -35,6 +35,9 @@
 #ifdef HAVE_STDLIB_H
 #include <stdlib.h>
 #endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
 
 /*
  *		Definitions needed for <winioctl.h>
@@ -116,17 +119,17 @@ typedef struct ntfs_volume ntfs_volume;
 #define FSCTL_ALLOW_EXTENDED_DASD_IO 0x90083
 #endif
 
+#define WIN32_INFLIGHT 32		/* max count of transfers in flight */
+#define WIN32_MAX_TRANSFER 0x80000000	/* max count of bytes in a transfer */
+
 /* Windows 2k+ imports. */
 typedef HANDLE (WINAPI *LPFN_FINDFIRSTVOLUME)(LPTSTR, DWORD);
 typedef BOOL (WINAPI *LPFN_FINDNEXTVOLUME)(HANDLE, LPTSTR, DWORD);
 typedef BOOL (WINAPI *LPFN_FINDVOLUMECLOSE)(HANDLE);
-typedef BOOL (WINAPI *LPFN_SETFILEPOINTEREX)(HANDLE, LARGE_INTEGER,
-		PLARGE_INTEGER, DWORD);
 
 static LPFN_FINDFIRSTVOLUME fnFindFirstVolume = NULL;
 static LPFN_FINDNEXTVOLUME fnFindNextVolume = NULL;
 static LPFN_FINDVOLUMECLOSE fnFindVolumeClose = NULL;
-static LPFN_SETFILEPOINTEREX fnSetFilePointerEx = NULL;
 
 #ifdef UNICODE
 #define FNPOSTFIX "W"
@@ -274,6 +277,15 @@ extern NTSTATUS	WINAPI NtFsControlFile(
 	ULONG OutputBufferLength
 );
 
+/*
+ *		A transfer of a batch, kept in flight in a slot
+ */
+
+struct win32_slot {
+	OVERLAPPED ov;
+	int io;			/* index of the transfer, -1 if free */
+} ;
+
 /**
  * struct win32_fd -
  */
@@ -289,6 +301,9 @@ typedef struct {
 	DWORD geo_sectors, geo_heads;
 	HANDLE vol_handle;
 	BOOL ntdll;
+	HANDLE event;		/* for waiting for a single transfer */
+	struct win32_slot *slots; /* transfers of a batch, when needed */
+	LONG batch_busy;	/* a batch is being transferred */
 } win32_fd;
 
 /**
@@ -360,40 +375,13 @@ static int ntfs_ntstatus_to_errno(NTSTATUS status)
 	}
 }
 
-/**
- * libntfs_SetFilePointerEx - emulation for SetFilePointerEx()
- *
- * We use this to emulate SetFilePointerEx() when it is not present.  This can
- * happen since SetFilePointerEx() only exists in Win2k+.
- */
-static BOOL WINAPI libntfs_SetFilePointerEx(HANDLE hFile,
-		LARGE_INTEGER liDistanceToMove,
-		PLARGE_INTEGER lpNewFilePointer, DWORD dwMoveMethod)
-{
-	liDistanceToMove.u.LowPart = SetFilePointer(hFile,
-			liDistanceToMove.u.LowPart,
-			&liDistanceToMove.u.HighPart, dwMoveMethod);
-	SetLastError(NO_ERROR);
-	if (liDistanceToMove.u.LowPart == INVALID_SET_FILE_POINTER &&
-			GetLastError() != NO_ERROR) {
-		if (lpNewFilePointer)
-			lpNewFilePointer->QuadPart = -1;
-		return FALSE;
-	}
-	if (lpNewFilePointer)
-		lpNewFilePointer->QuadPart = liDistanceToMove.QuadPart;
-	return TRUE;
-}
-
 /**
  * ntfs_device_win32_init_imports - initialize the function pointers
  *
- * The Find*Volume and SetFilePointerEx functions exist only on win2k+, as such
- * we cannot just staticly import them.
+ * The Find*Volume functions exist only on win2k+, as such we cannot just
+ * staticly import them.
  *
- * This function initializes the imports if the functions do exist and in the
- * SetFilePointerEx case, we emulate the function ourselves if it is not
- * present.
+ * This function initializes the imports if the functions do exist.
  *
  * Note: The values are cached, do be afraid to run it more than once.
  */
@@ -404,21 +392,6 @@ static void ntfs_device_win32_init_imports(void)
 		errno = ntfs_w32error_to_errno(GetLastError());
 		ntfs_log_trace("kernel32.dll could not be imported.\n");
 	}
-	if (!fnSetFilePointerEx) {
-		if (kernel32)
-			fnSetFilePointerEx = (LPFN_SETFILEPOINTEREX)
-					GetProcAddress(kernel32,
-					"SetFilePointerEx");
-		/*
-		 * If we did not get kernel32.dll or it is not Win2k+, emulate
-		 * SetFilePointerEx().
-		 */
-		if (!fnSetFilePointerEx) {
-			ntfs_log_debug("SetFilePointerEx() not found in "
-					"kernel32.dll: Enabling emulation.\n");
-			fnSetFilePointerEx = libntfs_SetFilePointerEx;
-		}
-	}
 	/* Cannot do lookups if we could not get kernel32.dll... */
 	if (!kernel32)
 		return;
@@ -435,6 +408,36 @@ static void ntfs_device_win32_init_imports(void)
 				GetProcAddress(kernel32, "FindVolumeClose");
 }
 
+/**
+ * win32_device_ioctl - issue a device control and wait for its completion
+ * @handle:	a win32 HANDLE, possibly opened for overlapped transfers
+ *
+ * The other arguments and the result are those of DeviceIoControl(). As
+ * the devices are opened for overlapped transfers, an OVERLAPPED structure
+ * has to be provided even for a synchronous control, and this also works
+ * for a handle opened otherwise.
+ */
+static BOOL win32_device_ioctl(HANDLE handle, DWORD code, void *in,
+		DWORD in_size, void *out, DWORD out_size, DWORD *bytes)
+{
+	OVERLAPPED ov;
+	DWORD err;
+	BOOL ok;
+
+	memset(&ov, 0, sizeof(ov));
+	ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (!ov.hEvent)
+		return FALSE;
+	ok = DeviceIoControl(handle, code, in, in_size, out, out_size,
+			bytes, &ov);
+	if (!ok && (GetLastError() == ERROR_IO_PENDING))
+		ok = GetOverlappedResult(handle, &ov, bytes, TRUE);
+	err = GetLastError();
+	CloseHandle(ov.hEvent);
+	SetLastError(err);
+	return ok;
+}
+
 /**
  * ntfs_device_unix_status_flags_to_win32 - convert unix->win32 open flags
  * @flags:	unix open status flags
@@ -472,6 +475,8 @@ static __inline__ int ntfs_device_unix_status_flags_to_win32(int flags)
  * @locking:	will the function gain an exclusive lock on the file?
  *
  * Supported flags are O_RDONLY, O_WRONLY and O_RDWR.
+ * The file is opened for overlapped transfers, so that several of them
+ * can be in flight (see ntfs_device_win32_pread_batch()).
  *
  * Return 0 if o.k.
  *	 -1 if not, and errno set.  In this case handle is trashed.
@@ -483,7 +488,7 @@ static int ntfs_device_win32_simple_open_file(const char *filename,
 			ntfs_device_unix_status_flags_to_win32(flags),
 			locking ? 0 : (FILE_SHARE_WRITE | FILE_SHARE_READ),
 			NULL, (flags & O_CREAT ? OPEN_ALWAYS : OPEN_EXISTING),
-			0, NULL);
+			FILE_FLAG_OVERLAPPED, NULL);
 	if (*handle == INVALID_HANDLE_VALUE) {
 		errno = ntfs_w32error_to_errno(GetLastError());
 		ntfs_log_trace("CreateFile(%s) failed.\n", filename);
@@ -506,8 +511,8 @@ static int ntfs_device_win32_lock(HANDLE handle)
 {
 	DWORD i;
 
-	if (!DeviceIoControl(handle, FSCTL_LOCK_VOLUME, NULL, 0, NULL, 0, &i,
-			NULL)) {
+	if (!win32_device_ioctl(handle, FSCTL_LOCK_VOLUME, NULL, 0, NULL, 0,
+			&i)) {
 		errno = ntfs_w32error_to_errno(GetLastError());
 		ntfs_log_trace("Couldn't lock volume.\n");
 		return -1;
@@ -527,8 +532,8 @@ static int ntfs_device_win32_unlock(HANDLE handle)
 {
 	DWORD i;
 
-	if (!DeviceIoControl(handle, FSCTL_UNLOCK_VOLUME, NULL, 0, NULL, 0, &i,
-			NULL)) {
+	if (!win32_device_ioctl(handle, FSCTL_UNLOCK_VOLUME, NULL, 0, NULL, 0,
+			&i)) {
 		errno = ntfs_w32error_to_errno(GetLastError());
 		ntfs_log_trace("Couldn't unlock volume.\n");
 		return -1;
@@ -570,8 +575,8 @@ static int ntfs_device_win32_dismount(HANDLE handle)
 {
 	DWORD i;
 
-	if (!DeviceIoControl(handle, FSCTL_DISMOUNT_VOLUME, NULL, 0, NULL, 0,
-			&i, NULL)) {
+	if (!win32_device_ioctl(handle, FSCTL_DISMOUNT_VOLUME, NULL, 0, NULL, 0,
+			&i)) {
 		errno = ntfs_w32error_to_errno(GetLastError());
 		ntfs_log_trace("Couldn't dismount volume.\n");
 		return -1;
@@ -620,8 +625,8 @@ static s64 ntfs_device_win32_getdisklength(HANDLE handle)
 	GET_LENGTH_INFORMATION buf;
 	DWORD i;
 
-	if (!DeviceIoControl(handle, IOCTL_DISK_GET_LENGTH_INFO, NULL, 0, &buf,
-			sizeof(buf), &i, NULL)) {
+	if (!win32_device_ioctl(handle, IOCTL_DISK_GET_LENGTH_INFO, NULL, 0,
+			&buf, sizeof(buf), &i)) {
 		errno = ntfs_w32error_to_errno(GetLastError());
 		ntfs_log_trace("Couldn't get disk length.\n");
 		return -1;
@@ -652,8 +657,8 @@ static s64 ntfs_device_win32_getntfssize(HANDLE handle)
 	DWORD i;
 	NTFS_VOLUME_DATA_BUFFER buf;
 
-	if (!DeviceIoControl(handle, FSCTL_GET_NTFS_VOLUME_DATA, NULL, 0, &buf,
-			sizeof(buf), &i, NULL)) {
+	if (!win32_device_ioctl(handle, FSCTL_GET_NTFS_VOLUME_DATA, NULL, 0,
+			&buf, sizeof(buf), &i)) {
 		errno = ntfs_w32error_to_errno(GetLastError());
 		ntfs_log_trace("Couldn't get NTFS volume length.\n");
 		return -1;
@@ -690,8 +695,8 @@ static int ntfs_device_win32_getgeo(HANDLE handle, win32_fd *fd)
 	BYTE b[sizeof(DISK_GEOMETRY) + sizeof(DISK_PARTITION_INFO) +
 			sizeof(DISK_DETECTION_INFO) + 512];
 
-	rvl = DeviceIoControl(handle, IOCTL_DISK_GET_DRIVE_GEOMETRY_EX, NULL,
-			0, &b, sizeof(b), &i, NULL);
+	rvl = win32_device_ioctl(handle, IOCTL_DISK_GET_DRIVE_GEOMETRY_EX, NULL,
+			0, &b, sizeof(b), &i);
 	if (rvl) {
 		ntfs_log_debug("GET_DRIVE_GEOMETRY_EX detected.\n");
 		DISK_DETECTION_INFO *ddi = (PDISK_DETECTION_INFO)
@@ -720,8 +725,8 @@ static int ntfs_device_win32_getgeo(HANDLE handle, win32_fd *fd)
 		}
 	} else
 		fd->geo_heads = -1;
-	rvl = DeviceIoControl(handle, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0,
-			&b, sizeof(b), &i, NULL);
+	rvl = win32_device_ioctl(handle, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0,
+			&b, sizeof(b), &i);
 	if (rvl) {
 		ntfs_log_debug("GET_DRIVE_GEOMETRY detected.\n");
 		fd->geo_cylinders = ((DISK_GEOMETRY*)&b)->Cylinders.QuadPart;
@@ -807,9 +812,9 @@ static __inline__ int ntfs_device_win32_open_file(char *filename, win32_fd *fd,
 		DWORD bytes;
 
 		/* try making sparse (but ignore errors) */
-		DeviceIoControl(handle, FSCTL_SET_SPARSE,
+		win32_device_ioctl(handle, FSCTL_SET_SPARSE,
 				(void*)NULL, 0, (void*)NULL, 0,
-				&bytes, (LPOVERLAPPED)NULL);
+				&bytes);
 	}
 	/* fill fd */
 	fd->handle = handle;
@@ -1005,10 +1010,10 @@ static HANDLE ntfs_device_win32_open_volume_for_partition(unsigned int drive_id,
 			char extents[EXTENTS_SIZE];
 
 			/* Check physical locations. */
-			if (DeviceIoControl(handle,
+			if (win32_device_ioctl(handle,
 					IOCTL_VOLUME_GET_VOLUME_DISK_EXTENTS,
 					NULL, 0, extents, EXTENTS_SIZE,
-					&bytesReturned, NULL)) {
+					&bytesReturned)) {
 				if (((VOLUME_DISK_EXTENTS *)extents)->
 						NumberOfDiskExtents == 1) {
 					DISK_EXTENT *extent = &((
@@ -1074,8 +1079,8 @@ static BOOL ntfs_device_win32_find_partition(HANDLE handle, DWORD partition_id,
 			errno = ENOMEM;
 			return FALSE;
 		}
-		if (DeviceIoControl(handle, IOCTL_DISK_GET_DRIVE_LAYOUT, NULL,
-				0, (BYTE*)drive_layout, buf_size, &i, NULL))
+		if (win32_device_ioctl(handle, IOCTL_DISK_GET_DRIVE_LAYOUT, NULL,
+				0, (BYTE*)drive_layout, buf_size, &i))
 			break;
 		err = GetLastError();
 		free(drive_layout);
@@ -1255,6 +1260,10 @@ static int ntfs_device_win32_open(struct ntfs_device *dev, int flags)
 	/* Setup our read-only flag. */
 	if ((flags & O_RDWR) != O_RDWR)
 		NDevSetReadOnly(dev);
+	fd.event = (fd.ntdll ? (HANDLE)NULL
+			: CreateEvent(NULL, TRUE, FALSE, NULL));
+	fd.slots = (struct win32_slot*)NULL;
+	fd.batch_busy = 0;
 	dev->d_private = (win32_fd*)ntfs_malloc(sizeof(win32_fd));
 	memcpy(dev->d_private, &fd, sizeof(win32_fd));
 	NDevSetOpen(dev);
@@ -1380,22 +1389,30 @@ static s64 ntfs_device_win32_pio(win32_fd *fd, const s64 pos,
 			errno = ntfs_ntstatus_to_errno(res);
 		}
 	} else {
-		if (!fnSetFilePointerEx(handle, li, NULL, FILE_BEGIN)) {
-			errno = ntfs_w32error_to_errno(GetLastError());
-			ntfs_log_trace("SetFilePointer failed.\n");
-			return -1;
-		}
+		OVERLAPPED ov;
+
+			/* the position is given along with the transfer */
+		memset(&ov, 0, sizeof(ov));
+		ov.Offset = li.u.LowPart;
+		ov.OffsetHigh = li.u.HighPart;
+		ov.hEvent = fd->event;
 		if (wbuf)
-			res = WriteFile(handle, wbuf, count, &bt, NULL);
+			res = WriteFile(handle, wbuf, count, (DWORD*)NULL, &ov);
 		else
-			res = ReadFile(handle, rbuf, count, &bt, NULL);
-		bytes = bt;
+			res = ReadFile(handle, rbuf, count, (DWORD*)NULL, &ov);
+		if (res || (GetLastError() == ERROR_IO_PENDING))
+			res = GetOverlappedResult(handle, &ov, &bt, TRUE);
+		if (!res && (GetLastError() == ERROR_HANDLE_EOF)) {
+			res = TRUE;
+			bt = 0;
+		}
 		if (!res) {
 			errno = ntfs_w32error_to_errno(GetLastError());
 			ntfs_log_trace("%sFile() failed.\n", write ?
 							"Write" : "Read");
 			return -1;
 		}
+		bytes = bt;
 		if (rbuf && !pos) {
 			/* get the sector size from the boot sector */
 			char *boot = (char*)rbuf;
@@ -1528,6 +1545,7 @@ static int ntfs_device_win32_close(struct ntfs_device *dev)
 {
 	win32_fd *fd = (win32_fd *)dev->d_private;
 	BOOL rvl;
+	int i;
 
 	ntfs_log_trace("Closing device %p.\n", dev);
 	if (!NDevOpen(dev)) {
@@ -1547,17 +1565,24 @@ static int ntfs_device_win32_close(struct ntfs_device *dev)
 		rvl = NtClose(fd->handle) == STATUS_SUCCESS;
 	} else
 		rvl = CloseHandle(fd->handle);
-	NDevClearOpen(dev);
-	free(fd);
 	if (!rvl) {
 		errno = ntfs_w32error_to_errno(GetLastError());
 		if (fd->ntdll)
 			ntfs_log_trace("NtClose() failed.\n");
 		else
 			ntfs_log_trace("CloseHandle() failed.\n");
-		return -1;
 	}
-	return 0;
+	if (fd->event)
+		CloseHandle(fd->event);
+	if (fd->slots) {
+		for (i=0; i<WIN32_INFLIGHT; i++)
+			if (fd->slots[i].ov.hEvent)
+				CloseHandle(fd->slots[i].ov.hEvent);
+		free(fd->slots);
+	}
+	NDevClearOpen(dev);
+	free(fd);
+	return (rvl ? 0 : -1);
 }
 
 /**
@@ -1833,8 +1858,8 @@ static __inline__ int ntfs_win32_blksszget(struct ntfs_device *dev,int *argp)
 	DWORD bytesReturned;
 	DISK_GEOMETRY dg;
 
-	if (DeviceIoControl(fd->handle, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0,
-			&dg, sizeof(DISK_GEOMETRY), &bytesReturned, NULL)) {
+	if (win32_device_ioctl(fd->handle, IOCTL_DISK_GET_DRIVE_GEOMETRY,
+			NULL, 0, &dg, sizeof(DISK_GEOMETRY), &bytesReturned)) {
 		/* success */
 		*argp = dg.BytesPerSector;
 		return 0;
@@ -1939,6 +1964,199 @@ static s64 ntfs_device_win32_pwrite(struct ntfs_device *dev, const void *b,
 	return (put);
 }
 
+/*
+ *		Get the slots for the transfers of a batch
+ *
+ *	They are allocated on first use, with an event for each of them,
+ *	and only one batch at a time may use them.
+ *
+ *	Returns the slots, or NULL if they cannot be used (errno is set)
+ */
+
+static struct win32_slot *win32_get_slots(win32_fd *fd)
+{
+	struct win32_slot *slots;
+	int i;
+
+	if (InterlockedCompareExchange(&fd->batch_busy, 1, 0)) {
+		errno = EBUSY;
+		return ((struct win32_slot*)NULL);
+	}
+	slots = fd->slots;
+	if (!slots) {
+		slots = (struct win32_slot*)ntfs_malloc(WIN32_INFLIGHT
+					*sizeof(struct win32_slot));
+		for (i=0; slots && (i<WIN32_INFLIGHT); i++) {
+			memset(&slots[i].ov, 0, sizeof(OVERLAPPED));
+			slots[i].ov.hEvent = CreateEvent(NULL, TRUE,
+						FALSE, NULL);
+			if (!slots[i].ov.hEvent) {
+				errno = ntfs_w32error_to_errno(GetLastError());
+				while (--i >= 0)
+					CloseHandle(slots[i].ov.hEvent);
+				free(slots);
+				slots = (struct win32_slot*)NULL;
+			}
+		}
+		fd->slots = slots;
+	}
+	if (slots)
+		for (i=0; i<WIN32_INFLIGHT; i++)
+			slots[i].io = -1;
+	else
+		InterlockedExchange(&fd->batch_busy, 0);
+	return (slots);
+}
+
+/*
+ *		Issue a transfer of a batch, without waiting
+ */
+
+static void win32_batch_issue(win32_fd *fd, struct ntfs_device_io *ios,
+		int k, struct win32_slot *slot, BOOL writing)
+{
+	LARGE_INTEGER li;
+	DWORD count;
+	BOOL res;
+
+	li.QuadPart = ios[k].pos + fd->part_start;
+	count = (ios[k].count > WIN32_MAX_TRANSFER
+			? WIN32_MAX_TRANSFER : ios[k].count);
+	ResetEvent(slot->ov.hEvent);
+	slot->ov.Internal = 0;
+	slot->ov.InternalHigh = 0;
+	slot->ov.Offset = li.u.LowPart;
+	slot->ov.OffsetHigh = li.u.HighPart;
+	if (writing)
+		res = WriteFile(fd->handle, ios[k].buf, count,
+				(DWORD*)NULL, &slot->ov);
+	else
+		res = ReadFile(fd->handle, ios[k].buf, count,
+				(DWORD*)NULL, &slot->ov);
+	if (res || (GetLastError() == ERROR_IO_PENDING))
+		slot->io = k;
+	else {
+		if (GetLastError() == ERROR_HANDLE_EOF)
+			ios[k].res = 0;
+		else
+			ios[k].res = -ntfs_w32error_to_errno(GetLastError());
+		slot->io = -1;
+	}
+}
+
+/*
+ *		Wait for the transfer in a slot, and record its result
+ */
+
+static void win32_batch_wait(win32_fd *fd, struct ntfs_device_io *ios,
+		struct win32_slot *slot, BOOL writing)
+{
+	struct ntfs_device_io *io;
+	DWORD bt;
+
+	io = &ios[slot->io];
+	if (GetOverlappedResult(fd->handle, &slot->ov, &bt, TRUE))
+		io->res = bt;
+	else
+		if (GetLastError() == ERROR_HANDLE_EOF)
+			io->res = 0;
+		else
+			io->res = -ntfs_w32error_to_errno(GetLastError());
+	if (!writing && !io->pos && (io->res > 12)) {
+		/* get the sector size from the boot sector */
+		char *boot = (char*)io->buf;
+		fd->geo_sector_size = (boot[11] & 255)
+					+ ((boot[12] & 255) << 8);
+	}
+	slot->io = -1;
+}
+
+/*
+ *		Transfer a batch with overlapped I/O
+ *
+ *	Up to WIN32_INFLIGHT transfers are kept in flight, the oldest one
+ *	being waited for before issuing a new one in its slot, so that
+ *	the device can process them concurrently.
+ *	Only sector aligned transfers on a device opened by CreateFile()
+ *	are supported, and not through the volume handle.
+ *
+ *	Returns 0 if the transfers have been processed, with their own
+ *	result set, and -1 if they could not be issued (errno is then
+ *	set, and the caller has to process them otherwise).
+ */
+
+static int win32_transfer_batch(struct ntfs_device *dev,
+		struct ntfs_device_io *ios, int count, BOOL writing)
+{
+	struct win32_slot *slots;
+	struct win32_slot *slot;
+	win32_fd *fd;
+	int i, k;
+
+	fd = (win32_fd*)dev->d_private;
+	if (fd->ntdll) {
+		errno = EOPNOTSUPP;
+		return (-1);
+	}
+	for (k=0; k<count; k++)
+		if ((((ULONG_PTR)ios[k].buf | ios[k].count | ios[k].pos)
+				& (fd->geo_sector_size - 1))
+		    || ((fd->vol_handle != INVALID_HANDLE_VALUE)
+				&& (ios[k].pos < fd->geo_size))) {
+			errno = EINVAL;
+			return (-1);
+		}
+	slots = win32_get_slots(fd);
+	if (!slots)
+		return (-1);
+	for (k=0; k<count; k++) {
+		slot = &slots[k % WIN32_INFLIGHT];
+		if (slot->io >= 0)
+			win32_batch_wait(fd, ios, slot, writing);
+		win32_batch_issue(fd, ios, k, slot, writing);
+	}
+	for (i=0; i<WIN32_INFLIGHT; i++)
+		if (slots[i].io >= 0)
+			win32_batch_wait(fd, ios, &slots[i], writing);
+	InterlockedExchange(&fd->batch_busy, 0);
+	return (0);
+}
+
+/**
+ * ntfs_device_win32_pread_batch - Perform several positioned reads
+ * @dev:	ntfs device obtained via ->open
+ * @ios:	the extents to read
+ * @count:	number of extents
+ *
+ * Return 0 if the reads have been processed, each one with its result set,
+ * and -1 if they could not be issued, with errno set.
+ */
+static int ntfs_device_win32_pread_batch(struct ntfs_device *dev,
+		struct ntfs_device_io *ios, int count)
+{
+	return (win32_transfer_batch(dev, ios, count, FALSE));
+}
+
+/**
+ * ntfs_device_win32_pwrite_batch - Perform several positioned writes
+ * @dev:	ntfs device obtained via ->open
+ * @ios:	the extents to write
+ * @count:	number of extents
+ *
+ * Return 0 if the writes have been processed, each one with its result set,
+ * and -1 if they could not be issued, with errno set.
+ */
+static int ntfs_device_win32_pwrite_batch(struct ntfs_device *dev,
+		struct ntfs_device_io *ios, int count)
+{
+	if (NDevReadOnly(dev)) {
+		errno = EROFS;
+		return (-1);
+	}
+	NDevSetDirty(dev);
+	return (win32_transfer_batch(dev, ios, count, TRUE));
+}
+
 struct ntfs_device_operations ntfs_device_win32_io_ops = {
 	.open		= ntfs_device_win32_open,
 	.close		= ntfs_device_win32_close,
@@ -1949,7 +2167,9 @@ struct ntfs_device_operations ntfs_device_win32_io_ops = {
 	.pwrite		= ntfs_device_win32_pwrite,
 	.sync		= ntfs_device_win32_sync,
 	.stat		= ntfs_device_win32_stat,
-	.ioctl		= ntfs_device_win32_ioctl
+	.ioctl		= ntfs_device_win32_ioctl,
+	.pread_batch	= ntfs_device_win32_pread_batch,
+	.pwrite_batch	= ntfs_device_win32_pwrite_batch
 };
 
 /*
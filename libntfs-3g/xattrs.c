@@ -57,6 +57,8 @@
 #include "object_id.h"
 #include "ea.h"
 #include "misc.h"
+#include "unistr.h"
+#include "lock.h"
 #include "logging.h"
 #include "xattrs.h"
 
@@ -799,4 +801,84 @@ int ntfs_xattr_system_removexattr(struct SECURITY_CONTEXT *scx,
 	return (res);
 }
 
+/*
+ *		Get the names of the named data streams of an inode
+ *
+ *	The names are translated to the current locale and terminated
+ *	by a null. Tools copying the extended attributes list them for
+ *	every file, and the list is kept in the inode until a named data
+ *	stream is added or removed (see attrib.c), so that it survives
+ *	when the inode is kept in the nidata cache.
+ *
+ *	Returns the size of the list, or -1 if there was an error
+ *	(errno is then set). The list must not be freed by caller.
+ */
+
+int ntfs_xattr_stream_names(ntfs_inode *ni, const char **plist)
+{
+	ntfs_attr_search_ctx *actx;
+	char *names;
+	char *newnames;
+	char *tmp_name;
+	int tmp_name_len;
+	int size;
+	int allocated;
+	int res;
+
+	if (!ni->stream_names) {
+		actx = ntfs_attr_get_search_ctx(ni, NULL);
+		if (!actx)
+			return (-1);
+		size = 0;
+		allocated = 64;
+		names = (char*)ntfs_malloc(allocated);
+		res = (names ? 0 : -1);
+		while (!res && !ntfs_attr_lookup(AT_DATA, NULL, 0,
+				CASE_SENSITIVE, 0, NULL, 0, actx)) {
+			if (!actx->attr->name_length
+			    || (actx->attr->non_resident
+				&& actx->attr->lowest_vcn))
+				continue;
+			tmp_name = (char*)NULL;
+			tmp_name_len = ntfs_ucstombs((ntfschar*)((u8*)actx->attr
+					+ le16_to_cpu(actx->attr->name_offset)),
+				actx->attr->name_length, &tmp_name, 0);
+			if (tmp_name_len < 0) {
+				res = -1;
+				break;
+			}
+			if ((size + tmp_name_len + 1) > allocated) {
+				allocated = 2*(size + tmp_name_len + 1);
+				newnames = (char*)realloc(names, allocated);
+				if (!newnames) {
+					free(tmp_name);
+					res = -1;
+					break;
+				}
+				names = newnames;
+			}
+			memcpy(&names[size], tmp_name, tmp_name_len + 1);
+			size += tmp_name_len + 1;
+			free(tmp_name);
+		}
+		if (!res && (errno != ENOENT))
+			res = -1;
+		ntfs_attr_put_search_ctx(actx);
+		if (res) {
+			free(names);
+			return (-1);
+		}
+			/* another thread may have listed the same inode */
+		ntfs_cache_lock(ni->vol);
+		if (!ni->stream_names) {
+			ni->stream_names = names;
+			ni->stream_names_size = size;
+		} else
+			free(names);
+		ntfs_cache_unlock(ni->vol);
+	}
+	*plist = ni->stream_names;
+	return (ni->stream_names_size);
+}
+
 #endif  /* HAVE_SETXATTR */
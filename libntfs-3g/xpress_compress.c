@@ -0,0 +1,520 @@
+/*
+ * xpress_compress.c - A compressor for the XPRESS compression format
+ * (Huffman variant), used to create files that use "System Compression".
+ * The bitstream is laid out so that the decompressor in xpress_decompress.c
+ * finds its bits and bytes where it expects them.
+ *
+ * This file is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include "decompress_common.h"
+#include "misc.h"
+#include "system_compression.h"
+
+#define XPRESS_NUM_SYMBOLS	512
+#define XPRESS_NUM_CHARS	256
+#define XPRESS_MAX_CODEWORD_LEN	15
+#define XPRESS_MIN_MATCH_LEN	3
+#define XPRESS_MAX_MATCH_LEN	(0xFFFF + XPRESS_MIN_MATCH_LEN)
+#define XPRESS_MAX_OFFSET	0xFFFF
+
+/* The symbol written after the last item, which Windows expects although it
+ * is never decoded.  */
+#define XPRESS_END_OF_DATA	256
+
+/* The largest buffer which may be compressed, so that positions fit in the
+ * 16-bit entries of the match-finding tables.  */
+#define XPRESS_MAX_BUFSIZE	32768
+
+/* These values trade compression speed for compression ratio.  */
+#define XPRESS_HASH_ORDER	14
+#define XPRESS_MAX_SEARCH_DEPTH	24
+#define XPRESS_NICE_MATCH_LEN	64
+
+/* A literal or a match, as found by the match-finder  */
+struct xpress_item {
+	u16 sym;
+	u16 offset;
+	u32 length;
+};
+
+/* Reusable heap-allocated memory for XPRESS compression  */
+struct xpress_compressor {
+
+	/* The Huffman code  */
+	u32 freqs[XPRESS_NUM_SYMBOLS];
+	u8 lens[XPRESS_NUM_SYMBOLS];
+	u16 codewords[XPRESS_NUM_SYMBOLS];
+
+	/* Temporary space for building the Huffman code  */
+	u32 sorted[XPRESS_NUM_SYMBOLS];
+	u32 node_freqs[2 * XPRESS_NUM_SYMBOLS];
+	u16 parents[2 * XPRESS_NUM_SYMBOLS];
+
+	/* Hash chains for finding matches : the heads hold positions plus one,
+	 * so that zero means no position.  */
+	u16 hash_heads[1 << XPRESS_HASH_ORDER];
+	u16 prev_positions[XPRESS_MAX_BUFSIZE];
+
+	/* The items found in the current buffer, at most one per byte, plus
+	 * the end of data  */
+	struct xpress_item items[XPRESS_MAX_BUFSIZE + 1];
+};
+
+/*
+ * Output bitstream, which mirrors what the decompressor reads.
+ *
+ * The decompressor fetches a 16-bit coding unit each time it is asked for
+ * more bits than it holds, and reads the literal bytes from where the next
+ * unit would be fetched.  So the compressor reserves the space of a unit
+ * when the decompressor would fetch it, fills the reserved units in order
+ * with the bits written, and writes the literal bytes after the last
+ * reserved unit.
+ */
+struct xpress_output_bitstream {
+
+	/* Bits written and not yet stored into the first reserved unit  */
+	u32 bitbuf;
+	unsigned bitcount;
+
+	/* Number of bits the decompressor would hold  */
+	unsigned bitsleft;
+
+	/* The reserved units, first to fill first  */
+	u8 *units[3];
+	unsigned num_units;
+
+	/* Next byte to be written, and end of the output buffer  */
+	u8 *next;
+	u8 *end;
+
+	/* Set when the output buffer is too small  */
+	BOOL overflow;
+};
+
+static void init_output_bitstream(struct xpress_output_bitstream *os,
+				  u8 *buffer, size_t size)
+{
+	os->bitbuf = 0;
+	os->bitcount = 0;
+	os->bitsleft = 0;
+	os->num_units = 0;
+	os->next = buffer;
+	os->end = buffer + size;
+	os->overflow = FALSE;
+}
+
+/* Reserve a unit if the decompressor would fetch one before reading
+ * @num_bits bits, as in bitstream_ensure_bits().  */
+static void output_ensure_bits(struct xpress_output_bitstream *os,
+			       unsigned num_bits)
+{
+	if (os->bitsleft < num_bits) {
+		if (os->end - os->next < 2) {
+			os->overflow = TRUE;
+			return;
+		}
+		os->units[os->num_units++] = os->next;
+		os->next += 2;
+		os->bitsleft += 16;
+	}
+}
+
+/* Store the first full unit of written bits into the first reserved unit.  */
+static void output_store_unit(struct xpress_output_bitstream *os, u16 unit)
+{
+	put_unaligned_le16(unit, os->units[0]);
+	os->units[0] = os->units[1];
+	os->units[1] = os->units[2];
+	os->num_units--;
+}
+
+/* Write @num_bits bits, which the decompressor holds after a call to
+ * output_ensure_bits() with at least @num_bits.  */
+static void output_write_bits(struct xpress_output_bitstream *os,
+			      u32 bits, unsigned num_bits)
+{
+	if (os->overflow)
+		return;
+	os->bitsleft -= num_bits;
+	os->bitbuf = (os->bitbuf << num_bits) | bits;
+	os->bitcount += num_bits;
+	if (os->bitcount >= 16) {
+		os->bitcount -= 16;
+		output_store_unit(os, os->bitbuf >> os->bitcount);
+	}
+}
+
+/* Write a literal byte, read by bitstream_read_byte()  */
+static void output_write_byte(struct xpress_output_bitstream *os, u8 v)
+{
+	if (os->end == os->next) {
+		os->overflow = TRUE;
+		return;
+	}
+	*os->next++ = v;
+}
+
+/* Write a 16-bit integer, read by bitstream_read_u16()  */
+static void output_write_u16(struct xpress_output_bitstream *os, u16 v)
+{
+	if (os->end - os->next < 2) {
+		os->overflow = TRUE;
+		return;
+	}
+	put_unaligned_le16(v, os->next);
+	os->next += 2;
+}
+
+/* Store the remaining bits, pad the reserved units with zeroes, and return
+ * the size of the output, or zero if it did not fit.  */
+static size_t output_flush(struct xpress_output_bitstream *os, u8 *buffer)
+{
+	if (os->overflow)
+		return 0;
+	if (os->bitcount) {
+		output_store_unit(os, os->bitbuf << (16 - os->bitcount));
+		os->bitcount = 0;
+	}
+	while (os->num_units)
+		output_store_unit(os, 0);
+	return os->next - buffer;
+}
+
+/* Compare two symbols by frequency then by symbol value, as packed by
+ * build_huffman_lens().  */
+static int compare_sorted(const void *p1, const void *p2)
+{
+	u32 v1 = *(const u32*)p1;
+	u32 v2 = *(const u32*)p2;
+
+	return (v1 > v2) - (v1 < v2);
+}
+
+/*
+ * Compute the Huffman codeword lengths from the symbol frequencies, and
+ * return the longest length.  The leaves, sorted by increasing frequency,
+ * and the internal nodes, created by increasing frequency, are merged
+ * like two sorted queues.
+ */
+static unsigned build_huffman_lens(struct xpress_compressor *c,
+				   const u32 freqs[])
+{
+	unsigned num_used;
+	unsigned num_nodes;
+	unsigned leaf, node;
+	unsigned i, k;
+	unsigned pick;
+	unsigned max_len;
+	unsigned len;
+
+	num_used = 0;
+	for (i = 0; i < XPRESS_NUM_SYMBOLS; i++) {
+		c->lens[i] = 0;
+		if (freqs[i])
+			c->sorted[num_used++] = (freqs[i] << 9) | i;
+	}
+	qsort(c->sorted, num_used, sizeof(c->sorted[0]), compare_sorted);
+	if (num_used == 1) {
+		/* A code needs two codewords, add an unused one.  */
+		c->lens[c->sorted[0] & 0x1FF] = 1;
+		c->lens[(c->sorted[0] & 0x1FF) ? 0 : 1] = 1;
+		return 1;
+	}
+
+	/* Nodes 0 to num_used-1 are the leaves, by increasing frequency.  */
+	for (i = 0; i < num_used; i++)
+		c->node_freqs[i] = c->sorted[i] >> 9;
+	leaf = 0;
+	node = num_used;
+	num_nodes = num_used;
+	while (num_nodes < 2 * num_used - 1) {
+		c->node_freqs[num_nodes] = 0;
+		for (k = 0; k < 2; k++) {
+			if ((leaf < num_used)
+			    && ((node == num_nodes)
+				|| (c->node_freqs[leaf]
+					<= c->node_freqs[node])))
+				pick = leaf++;
+			else
+				pick = node++;
+			c->node_freqs[num_nodes] += c->node_freqs[pick];
+			c->parents[pick] = num_nodes;
+		}
+		num_nodes++;
+	}
+
+	/* The depth of each node is the depth of its parent plus one,
+	 * parents being created after their children.  */
+	c->node_freqs[num_nodes - 1] = 0;
+	max_len = 0;
+	for (i = num_nodes - 1; i-- > 0; ) {
+		len = c->node_freqs[c->parents[i]] + 1;
+		c->node_freqs[i] = len;
+		if (i < num_used) {
+			c->lens[c->sorted[i] & 0x1FF] = len;
+			if (len > max_len)
+				max_len = len;
+		}
+	}
+	return max_len;
+}
+
+/*
+ * Build a canonical Huffman code limited to XPRESS_MAX_CODEWORD_LEN bits.
+ * When the Huffman code is too long, the frequencies are flattened until
+ * it fits, which costs little as this only happens for skewed data.
+ */
+static void make_huffman_code(struct xpress_compressor *c)
+{
+	u32 freqs[XPRESS_NUM_SYMBOLS];
+	u16 len_counts[XPRESS_MAX_CODEWORD_LEN + 1];
+	u16 next_codewords[XPRESS_MAX_CODEWORD_LEN + 1];
+	unsigned len;
+	unsigned sym;
+
+	memcpy(freqs, c->freqs, sizeof(freqs));
+	while (build_huffman_lens(c, freqs) > XPRESS_MAX_CODEWORD_LEN) {
+		for (sym = 0; sym < XPRESS_NUM_SYMBOLS; sym++)
+			if (freqs[sym])
+				freqs[sym] = (freqs[sym] >> 1) | 1;
+	}
+
+	/* Assign the codewords by increasing length, then symbol value, as
+	 * expected by make_huffman_decode_table().  */
+	for (len = 0; len <= XPRESS_MAX_CODEWORD_LEN; len++)
+		len_counts[len] = 0;
+	for (sym = 0; sym < XPRESS_NUM_SYMBOLS; sym++)
+		len_counts[c->lens[sym]]++;
+	next_codewords[1] = 0;
+	for (len = 1; len < XPRESS_MAX_CODEWORD_LEN; len++)
+		next_codewords[len + 1] = (next_codewords[len]
+						+ len_counts[len]) << 1;
+	for (sym = 0; sym < XPRESS_NUM_SYMBOLS; sym++)
+		if (c->lens[sym])
+			c->codewords[sym] = next_codewords[c->lens[sym]]++;
+}
+
+static FORCEINLINE u32 xpress_hash(const u8 *p)
+{
+	u32 v = p[0] | ((u32)p[1] << 8) | ((u32)p[2] << 16);
+
+	return (v * 0x9E3779B1) >> (32 - XPRESS_HASH_ORDER);
+}
+
+static void insert_position(struct xpress_compressor *c,
+			    const u8 *in, u32 pos)
+{
+	u32 hash = xpress_hash(&in[pos]);
+
+	c->prev_positions[pos] = c->hash_heads[hash];
+	c->hash_heads[hash] = pos + 1;
+}
+
+/* Find the longest match at @pos, inserting @pos into the hash chains.  */
+static u32 find_match(struct xpress_compressor *c, const u8 *in,
+		      u32 pos, u32 in_size, u32 *offset_ret)
+{
+	const u32 max_len = min(in_size - pos, XPRESS_MAX_MATCH_LEN);
+	const u32 nice_len = min(max_len, XPRESS_NICE_MATCH_LEN);
+	u32 best_len = XPRESS_MIN_MATCH_LEN - 1;
+	unsigned depth;
+	u32 cur;
+	u32 len;
+
+	cur = c->hash_heads[xpress_hash(&in[pos])];
+	insert_position(c, in, pos);
+	for (depth = 0; cur && (depth < XPRESS_MAX_SEARCH_DEPTH); depth++) {
+		const u8 *match = &in[cur - 1];
+
+		if ((match[best_len] == in[pos + best_len])
+		    && (match[0] == in[pos])) {
+			len = 1;
+			while ((len < max_len) && (match[len] == in[pos + len]))
+				len++;
+			if (len > best_len) {
+				best_len = len;
+				*offset_ret = pos - (cur - 1);
+				if (len >= nice_len)
+					break;
+			}
+		}
+		cur = c->prev_positions[cur - 1];
+	}
+	return (best_len >= XPRESS_MIN_MATCH_LEN ? best_len : 0);
+}
+
+/* Parse the buffer into literals and matches, greedily, counting the symbol
+ * frequencies.  Return the number of items.  */
+static u32 find_items(struct xpress_compressor *c, const u8 *in, u32 in_size)
+{
+	struct xpress_item *item = c->items;
+	u32 pos;
+	u32 len;
+	u32 offset = 0;
+	unsigned log2_offset;
+	unsigned len_header;
+
+	memset(c->hash_heads, 0, sizeof(c->hash_heads));
+	memset(c->freqs, 0, sizeof(c->freqs));
+	pos = 0;
+	while (pos < in_size) {
+		len = 0;
+		if (in_size - pos >= XPRESS_MIN_MATCH_LEN)
+			len = find_match(c, in, pos, in_size, &offset);
+		if (!len) {
+			item->sym = in[pos++];
+		} else {
+			log2_offset = 0;
+			while (offset >> (log2_offset + 1))
+				log2_offset++;
+			len_header = min(len - XPRESS_MIN_MATCH_LEN, 0xF);
+			item->sym = XPRESS_NUM_CHARS
+					| (log2_offset << 4) | len_header;
+			item->offset = offset;
+			item->length = len;
+			/* Index the positions covered by the match.  */
+			while (--len) {
+				pos++;
+				if (in_size - pos >= XPRESS_MIN_MATCH_LEN)
+					insert_position(c, in, pos);
+			}
+			pos++;
+		}
+		c->freqs[item->sym]++;
+		item++;
+	}
+	item->sym = XPRESS_END_OF_DATA;
+	c->freqs[XPRESS_END_OF_DATA]++;
+	return item - c->items;
+}
+
+/* Write a symbol, read by read_huffsym()  */
+static void write_symbol(struct xpress_compressor *c,
+			 struct xpress_output_bitstream *os, unsigned sym)
+{
+	output_ensure_bits(os, XPRESS_MAX_CODEWORD_LEN);
+	output_write_bits(os, c->codewords[sym], c->lens[sym]);
+}
+
+/*
+ * xpress_allocate_compressor - Allocate an XPRESS compressor
+ *
+ * @max_bufsize:	The largest size of data to be compressed at once
+ *
+ * Return the pointer to the compressor on success, or return NULL and set
+ * errno on failure.
+ */
+struct xpress_compressor *xpress_allocate_compressor(size_t max_bufsize)
+{
+	if (max_bufsize > XPRESS_MAX_BUFSIZE) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return ntfs_malloc(sizeof(struct xpress_compressor));
+}
+
+/*
+ * xpress_compress - Compress a buffer of data to the XPRESS format
+ *
+ * @compressor:		A compressor allocated with
+ *			xpress_allocate_compressor()
+ * @uncompressed_data:	The buffer of data to compress
+ * @uncompressed_size:	Number of bytes of data, not more than the size
+ *			given when allocating the compressor
+ * @compressed_data:	The buffer in which to store the compressed data
+ * @max_compressed_size: The size of this buffer
+ *
+ * Return the number of bytes of compressed data, or zero if it did not fit
+ * in the buffer, in which case the data should be stored uncompressed.
+ */
+size_t xpress_compress(struct xpress_compressor *compressor,
+		       const void *uncompressed_data, size_t uncompressed_size,
+		       void *compressed_data, size_t max_compressed_size)
+{
+	struct xpress_compressor *c = compressor;
+	const u8 *in = uncompressed_data;
+	u8 *out = compressed_data;
+	struct xpress_output_bitstream os;
+	const struct xpress_item *item;
+	u32 num_items;
+	u32 i;
+	unsigned log2_offset;
+	u32 length;
+
+	if (!uncompressed_size
+	    || (max_compressed_size <= XPRESS_NUM_SYMBOLS / 2))
+		return 0;
+
+	num_items = find_items(c, in, uncompressed_size);
+	make_huffman_code(c);
+
+	/* Write the codeword lengths, two per byte.  */
+	for (i = 0; i < XPRESS_NUM_SYMBOLS / 2; i++)
+		out[i] = c->lens[2 * i] | (c->lens[2 * i + 1] << 4);
+
+	/* Write the items, as they are read by xpress_decompress().  */
+	init_output_bitstream(&os, out + XPRESS_NUM_SYMBOLS / 2,
+			      max_compressed_size - XPRESS_NUM_SYMBOLS / 2);
+	for (item = c->items; item < &c->items[num_items]; item++) {
+		write_symbol(c, &os, item->sym);
+		if (item->sym < XPRESS_NUM_CHARS)
+			continue;
+		log2_offset = (item->sym >> 4) & 0xF;
+		output_ensure_bits(&os, 16);
+		output_write_bits(&os, item->offset ^ (1U << log2_offset),
+				  log2_offset);
+		length = item->length - XPRESS_MIN_MATCH_LEN;
+		if (length >= 0xF) {
+			if (length < 0xF + 0xFF) {
+				output_write_byte(&os, length - 0xF);
+			} else {
+				output_write_byte(&os, 0xFF);
+				output_write_u16(&os, length);
+			}
+		}
+		if (os.overflow)
+			return 0;
+	}
+	write_symbol(c, &os, XPRESS_END_OF_DATA);
+	length = output_flush(&os, out + XPRESS_NUM_SYMBOLS / 2);
+	return (length ? length + XPRESS_NUM_SYMBOLS / 2 : 0);
+}
+
+/*
+ * xpress_free_compressor - Free an XPRESS compressor
+ *
+ * @compressor:		A compressor that was allocated with
+ *			xpress_allocate_compressor(), or NULL.
+ */
+void xpress_free_compressor(struct xpress_compressor *compressor)
+{
+	free(compressor);
+}
@@ -38,6 +38,15 @@
 #include "utils.h"
 #include "logging.h"
 
+struct cluster_query {
+	ntfs_volume *vol;
+	cluster_cb *cb;
+	void *data;
+	MFT_REF *found;		/* distinct inodes found */
+	s64 count;
+	s64 size;
+};
+
 /**
  * cluster_find
  */
@@ -130,3 +139,133 @@ done:
 	return result;
 }
 
+
+/**
+ * cluster_get_index
+ *
+ * Load the index of the owners of the clusters from a file, or build it
+ * by scanning the MFT. When a file is given and it does not hold an
+ * index of this volume, the index built is saved into it.
+ */
+struct LCN_INDEX *cluster_get_index(ntfs_volume *vol, const char *path)
+{
+	struct LCN_INDEX *index;
+
+	index = (struct LCN_INDEX*)NULL;
+	if (path) {
+		index = ntfs_lcnindex_load(vol, path);
+		if (index)
+			ntfs_log_verbose("Loaded the index of clusters "
+					"from %s\n", path);
+	}
+	if (!index) {
+		ntfs_log_verbose("Indexing the clusters...\n");
+		index = ntfs_lcnindex_build(vol, 0);
+		if (index && path && !ntfs_lcnindex_save(index, path))
+			ntfs_log_verbose("Saved the index of clusters "
+					"into %s\n", path);
+	}
+	if (index)
+		ntfs_log_verbose("%lld runs of clusters indexed\n",
+				(long long)ntfs_lcnindex_count(index));
+	return index;
+}
+
+/**
+ * found_inode
+ *
+ * Record an inode found by a query, return TRUE if it was new.
+ */
+static BOOL found_inode(struct cluster_query *query, MFT_REF mref)
+{
+	MFT_REF *newfound;
+	s64 i;
+
+	for (i = 0; i < query->count; i++)
+		if (query->found[i] == mref)
+			return FALSE;
+	if (query->count >= query->size) {
+		newfound = (MFT_REF*)realloc(query->found,
+				(query->size + 64)*sizeof(MFT_REF));
+		if (!newfound)
+			return TRUE;
+		query->found = newfound;
+		query->size += 64;
+	}
+	query->found[query->count++] = mref;
+	return TRUE;
+}
+
+/**
+ * match_entry
+ *
+ * Open the inode owning a run found in the index, locate the attribute
+ * holding the run, and pass them to the callback of the query.
+ */
+static int match_entry(const struct LCN_INDEX *index,
+		const struct LCN_INDEX_ENTRY *entry,
+		LCN begin __attribute__((unused)),
+		LCN end __attribute__((unused)), void *arg)
+{
+	struct cluster_query *query = (struct cluster_query*)arg;
+	ntfs_attr_search_ctx *a_ctx;
+	ntfs_inode *ni;
+	runlist_element run;
+	int ret;
+
+	ni = ntfs_inode_open(query->vol, MREF(entry->mref));
+	if (!ni) {
+		ntfs_log_error("Couldn't open inode %llu\n",
+				(unsigned long long)MREF(entry->mref));
+		return 0;
+	}
+	ret = 0;
+	a_ctx = ntfs_attr_get_search_ctx(ni, NULL);
+	if (a_ctx && !ntfs_attr_lookup(entry->type,
+			ntfs_lcnindex_name(index, entry), entry->name_len,
+			CASE_SENSITIVE, entry->vcn, NULL, 0, a_ctx)) {
+		run.vcn = entry->vcn;
+		run.lcn = entry->lcn;
+		run.length = entry->length;
+		ret = (*query->cb)(ni, a_ctx->attr, &run, query->data);
+		found_inode(query, entry->mref);
+	} else
+		ntfs_log_error("Couldn't find the attribute 0x%02x of "
+				"inode %llu\n", (int)le32_to_cpu(entry->type),
+				(unsigned long long)MREF(entry->mref));
+	ntfs_attr_put_search_ctx(a_ctx);
+	ntfs_inode_close(ni);
+	return ret;
+}
+
+/**
+ * cluster_find_indexed
+ *
+ * Same as cluster_find(), locating the runs through an index, so that
+ * many ranges can be searched for after a single scan of the MFT.
+ */
+int cluster_find_indexed(ntfs_volume *vol, struct LCN_INDEX *index,
+		LCN c_begin, LCN c_end, cluster_cb *cb, void *data)
+{
+	struct cluster_query query;
+	int ret;
+
+	if (!vol || !index || !cb)
+		return -1;
+
+	memset(&query, 0, sizeof(query));
+	query.vol = vol;
+	query.cb = cb;
+	query.data = data;
+	ret = ntfs_lcnindex_query(index, c_begin, c_end, match_entry, &query);
+	free(query.found);
+	if (ret)
+		return (ret < 0 ? -1 : 1);
+
+	if (query.count > 1)
+		ntfs_log_info("* %lld inodes found\n",(long long)query.count);
+	else
+		ntfs_log_info("* %s inode found\n",
+				(query.count ? "one" : "no"));
+	return 0;
+}
@@ -26,6 +26,7 @@
 
 #include "types.h"
 #include "volume.h"
+#include "lcnindex.h"
 
 typedef struct {
 	int x;
@@ -35,5 +36,9 @@ typedef int (cluster_cb)(ntfs_inode *ino, ATTR_RECORD *attr, runlist_element *ru
 
 int cluster_find(ntfs_volume *vol, LCN c_begin, LCN c_end, cluster_cb *cb, void *data);
 
+struct LCN_INDEX *cluster_get_index(ntfs_volume *vol, const char *path);
+int cluster_find_indexed(ntfs_volume *vol, struct LCN_INDEX *index,
+		LCN c_begin, LCN c_end, cluster_cb *cb, void *data);
+
 #endif /* _CLUSTER_H_ */
 
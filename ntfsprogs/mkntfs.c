@@ -68,11 +68,16 @@
 #ifdef HAVE_LIBGEN_H
 #include <libgen.h>
 #endif
+#ifdef HAVE_SYS_IOCTL_H
+#include <sys/ioctl.h>
+#endif
 #ifdef ENABLE_UUID
 #include <uuid/uuid.h>
 #endif
 
 
+#include <dirent.h>
+
 #ifdef HAVE_GETOPT_H
 #include <getopt.h>
 #else
@@ -126,7 +131,10 @@
 #include "bootsect.h"
 #include "device.h"
 #include "dir.h"
+#include "inode.h"
+#include "volume.h"
 #include "mft.h"
+#include "mftcache.h"
 #include "mst.h"
 #include "runlist.h"
 #include "utils.h"
@@ -156,8 +164,39 @@ switch if you want to be able to build the NTFS utilities."
 /* Page size on ia32. Can change to 8192 on Alpha. */
 #define NTFS_PAGE_SIZE	4096
 
+/* Pages in the buffers used for writing large areas at once. */
+#define WRITE_BUFFER_PAGES	256
+
+/* MFT records kept in cache while populating the volume. */
+#define POPULATE_MFT_RECORDS	4096
+
+/* Size of the buffer for copying the files into the volume. */
+#define POPULATE_BUFFER_SIZE	(1024*1024)
+
+#if defined(linux) && defined(_IO) && !defined(BLKZEROOUT)
+#define BLKZEROOUT	_IO(0x12,127)	/* Zero out a range of the device. */
+#endif
+
 static char EXEC_NAME[] = "mkntfs";
 
+/* Files already copied which have several names. */
+struct POPULATE_LINK {
+	dev_t	dev;
+	ino_t	ino;
+	MFT_REF	mref;
+} ;
+
+struct POPULATE_STATE {
+	ntfs_volume *vol;
+	char *buf;
+	struct POPULATE_LINK *links;
+	int link_count;
+	int link_size;
+	int errors;
+	long long files;
+	long long bytes;
+} ;
+
 struct BITMAP_ALLOCATION {
 	struct BITMAP_ALLOCATION *next;
 	LCN	lcn;		/* first allocated cluster */
@@ -195,6 +234,7 @@ static runlist		  *g_rl_bad		  = NULL;
 static INDEX_ALLOCATION  *g_index_block	  = NULL;
 static ntfs_volume	  *g_vol		  = NULL;
 static int		   g_mft_size		  = 0;
+static long long	   g_mft_allocated	  = 0;		/* in bytes, reserved for $MFT, $DATA */
 static long long	   g_mft_lcn		  = 0;		/* lcn of $MFT, $DATA attribute */
 static long long	   g_mftmirr_lcn	  = 0;		/* lcn of $MFTMirr, $DATA */
 static long long	   g_logfile_lcn	  = 0;		/* lcn of $LogFile, $DATA */
@@ -221,10 +261,12 @@ static struct mkntfs_options {
 	long sectors_per_track;		/* -S, number of sectors per track on device */
 	BOOL use_epoch_time;		/* -T, fake the time to be 00:00:00 UTC, Jan 1, 1970. */
 	long mft_zone_multiplier;	/* -z, value from 1 to 4. Default is 1. */
+	long long expected_files;	/* -E, files to reserve the mft for */
 	long long num_sectors;		/* size of device in sectors */
 	long cluster_size;		/* -c, format with this cluster-size */
 	BOOL with_uuid;			/* -U, request setting an uuid */
 	char *label;			/* -L, volume label */
+	char *populate;			/* -P, directory to copy into the volume */
 } opts;
 
 
@@ -250,6 +292,7 @@ static void mkntfs_usage(void)
 "    -C, --enable-compression        Enable compression on the volume\n"
 "    -I, --no-indexing               Disable indexing on the volume\n"
 "    -n, --no-action                 Do not write to disk\n"
+"    -P, --populate DIR              Copy the tree of DIR into the volume\n"
 "\n"
 "Advanced options:\n"
 "    -c, --cluster-size BYTES        Specify the cluster size for the volume\n"
@@ -258,6 +301,7 @@ static void mkntfs_usage(void)
 "    -H, --heads NUM                 Specify the number of heads\n"
 "    -S, --sectors-per-track NUM     Specify the number of sectors per track\n"
 "    -z, --mft-zone-multiplier NUM   Set the MFT zone multiplier\n"
+"    -E, --expected-files NUM        Reserve a contiguous MFT for NUM files\n"
 "    -T, --zero-time                 Fake the time to be 00:00 UTC, Jan 1, 1970\n"
 "    -F, --force                     Force execution despite errors\n"
 "\n"
@@ -579,6 +623,7 @@ static void mkntfs_init_options(struct mkntfs_options *opts2)
 
 	/* Mark all the numeric options as "unset". */
 	opts2->cluster_size		= -1;
+	opts2->expected_files		= -1;
 	opts2->heads			= -1;
 	opts2->mft_zone_multiplier	= -1;
 	opts2->num_sectors		= -1;
@@ -592,11 +637,12 @@ static void mkntfs_init_options(struct mkntfs_options *opts2)
  */
 static int mkntfs_parse_options(int argc, char *argv[], struct mkntfs_options *opts2)
 {
-	static const char *sopt = "-c:CfFhH:IlL:np:qQs:S:TUvVz:";
+	static const char *sopt = "-c:CE:fFhH:IlL:np:P:qQs:S:TUvVz:";
 	static const struct option lopt[] = {
 		{ "cluster-size",	required_argument,	NULL, 'c' },
 		{ "debug",		no_argument,		NULL, 'Z' },
 		{ "enable-compression",	no_argument,		NULL, 'C' },
+		{ "expected-files",	required_argument,	NULL, 'E' },
 		{ "fast",		no_argument,		NULL, 'f' },
 		{ "force",		no_argument,		NULL, 'F' },
 		{ "heads",		required_argument,	NULL, 'H' },
@@ -607,6 +653,7 @@ static int mkntfs_parse_options(int argc, char *argv[], struct mkntfs_options *o
 		{ "no-action",		no_argument,		NULL, 'n' },
 		{ "no-indexing",	no_argument,		NULL, 'I' },
 		{ "partition-start",	required_argument,	NULL, 'p' },
+		{ "populate",		required_argument,	NULL, 'P' },
 		{ "quick",		no_argument,		NULL, 'Q' },
 		{ "quiet",		no_argument,		NULL, 'q' },
 		{ "sector-size",	required_argument,	NULL, 's' },
@@ -650,6 +697,11 @@ static int mkntfs_parse_options(int argc, char *argv[], struct mkntfs_options *o
 					&opts2->cluster_size))
 				err++;
 			break;
+		case 'E':
+			if (!mkntfs_parse_llong(optarg, "expected files",
+					&opts2->expected_files))
+				err++;
+			break;
 		case 'F':
 			opts2->force = TRUE;
 			break;
@@ -687,6 +739,16 @@ static int mkntfs_parse_options(int argc, char *argv[], struct mkntfs_options *o
 						&opts2->part_start_sect))
 				err++;
 			break;
+		case 'P':
+			if (!opts2->populate) {
+				opts2->populate = argv[optind-1];
+			} else {
+				ntfs_log_error("You may only specify the "
+						"directory to populate from "
+						"once.\n");
+				err++;
+			}
+			break;
 		case 'q':
 			ntfs_log_clear_levels(NTFS_LOG_LEVEL_QUIET |
 					NTFS_LOG_LEVEL_VERBOSE |
@@ -730,8 +792,10 @@ static int mkntfs_parse_options(int argc, char *argv[], struct mkntfs_options *o
 		default:
 			if (ntfs_log_parse_option (argv[optind-1]))
 				break;
-			if (((optopt == 'c') || (optopt == 'H') ||
+			if (((optopt == 'c') || (optopt == 'E') ||
+			     (optopt == 'H') ||
 			     (optopt == 'L') || (optopt == 'p') ||
+			     (optopt == 'P') ||
 			     (optopt == 's') || (optopt == 'S') ||
 			     (optopt == 'N') || (optopt == 'z')) &&
 			     (!optarg)) {
@@ -752,6 +816,11 @@ static int mkntfs_parse_options(int argc, char *argv[], struct mkntfs_options *o
 				ntfs_log_error("You must specify a device.\n");
 			err++;
 		}
+		if (opts2->populate && opts2->no_action) {
+			ntfs_log_error("Options --populate and --no-action "
+					"are exclusive.\n");
+			err++;
+		}
 	}
 
 	if (ver)
@@ -922,6 +991,13 @@ static s64 ntfs_rlwrite(struct ntfs_device *dev, const runlist *rl,
 			delta = length;
 			length = val_len - total;
 			delta -= length;
+			/*
+			 * Only pad to the end of the cluster, the rest of
+			 * the allocation may be a reservation which does
+			 * not have to be initialized.
+			 */
+			if (delta > ((-length) & (g_vol->cluster_size - 1)))
+				delta = (-length) & (g_vol->cluster_size - 1);
 		}
 		if (dev->d_ops->seek(dev, rl[i].lcn * g_vol->cluster_size,
 				SEEK_SET) == (off_t)-1)
@@ -3861,6 +3937,7 @@ static BOOL mkntfs_override_vol_params(ntfs_volume *vol)
 static BOOL mkntfs_initialize_bitmaps(void)
 {
 	u64 i;
+	s64 j;
 	int mft_bitmap_size;
 
 	/* Determine lcn bitmap byte size and allocate it. */
@@ -3871,7 +3948,7 @@ static BOOL mkntfs_initialize_bitmaps(void)
 			~(g_vol->cluster_size - 1);
 	ntfs_log_debug("g_lcn_bitmap_byte_size = %i, allocated = %llu\n",
 			g_lcn_bitmap_byte_size, (unsigned long long)i);
-	g_dynamic_buf_size = mkntfs_get_page_size();
+	g_dynamic_buf_size = mkntfs_get_page_size()*WRITE_BUFFER_PAGES;
 	g_dynamic_buf = (u8*)ntfs_calloc(g_dynamic_buf_size);
 	if (!g_dynamic_buf)
 		return FALSE;
@@ -3891,6 +3968,19 @@ static BOOL mkntfs_initialize_bitmaps(void)
 	if (g_mft_size < (s32)g_vol->cluster_size)
 		g_mft_size = g_vol->cluster_size;
 	ntfs_log_debug("MFT size = %i (0x%x) bytes\n", g_mft_size, g_mft_size);
+	/*
+	 * When the count of files is known, reserve a contiguous allocation
+	 * for their mft records, so that the mft does not have to be
+	 * extended (and fragmented) when creating them. Only the records
+	 * created by mkntfs are initialized.
+	 */
+	g_mft_allocated = g_mft_size;
+	if (opts.expected_files > 0)
+		g_mft_allocated += opts.expected_files
+					* g_vol->mft_record_size;
+	g_mft_allocated = (g_mft_allocated + g_vol->cluster_size - 1)
+				& ~(s64)(g_vol->cluster_size - 1);
+	ntfs_log_debug("MFT allocated size = %lld bytes\n", g_mft_allocated);
 	/* Determine mft bitmap size and allocate it. */
 	mft_bitmap_size = g_mft_size / g_vol->mft_record_size;
 	/* Convert to bytes, at least one. */
@@ -3912,15 +4002,21 @@ static BOOL mkntfs_initialize_bitmaps(void)
 	i = (8192 + g_vol->cluster_size - 1) / g_vol->cluster_size;
 	g_rl_mft_bmp[0].lcn = i;
 	/*
-	 * Size is always one cluster, even though valid data size and
-	 * initialized data size are only 8 bytes.
+	 * Size is one cluster, or enough for the reserved mft records,
+	 * even though valid data size and initialized data size are only
+	 * 8 bytes.
 	 */
-	g_rl_mft_bmp[1].vcn = 1LL;
-	g_rl_mft_bmp[0].length = 1LL;
+	j = (((g_mft_allocated >> g_vol->mft_record_size_bits) + 63) >> 3)
+			& ~7LL;
+	j = (j + g_vol->cluster_size - 1) >> g_vol->cluster_size_bits;
+	if (j < 1)
+		j = 1;
+	g_rl_mft_bmp[1].vcn = j;
+	g_rl_mft_bmp[0].length = j;
 	g_rl_mft_bmp[1].lcn = -1LL;
 	g_rl_mft_bmp[1].length = 0LL;
-	/* Allocate cluster for mft bitmap. */
-	return (bitmap_allocate(i,1));
+	/* Allocate clusters for mft bitmap. */
+	return (bitmap_allocate(i,j));
 }
 
 /**
@@ -3928,7 +4024,7 @@ static BOOL mkntfs_initialize_bitmaps(void)
  */
 static BOOL mkntfs_initialize_rl_mft(void)
 {
-	int j;
+	s64 j;
 	BOOL done;
 
 	/* If user didn't specify the mft lcn, determine it now. */
@@ -3967,6 +4063,20 @@ static BOOL mkntfs_initialize_rl_mft(void)
 	 * of the device.
 	 */
 	g_mft_zone_end += g_mft_lcn;
+	/* rounded up division by cluster size */
+	j = (g_mft_allocated + g_vol->cluster_size - 1) / g_vol->cluster_size;
+	/* Determine mftmirr_lcn (middle of volume). */
+	g_mftmirr_lcn = (opts.num_sectors * opts.sector_size >> 1)
+			/ g_vol->cluster_size;
+	/* The reserved mft must end before the mft mirror. */
+	if (g_mft_lcn + j > g_mftmirr_lcn) {
+		ntfs_log_error("The volume is too small for holding %lld "
+				"files.\n", opts.expected_files);
+		return FALSE;
+	}
+	/* The mft zone has to include the reserved mft. */
+	if (g_mft_zone_end < g_mft_lcn + j)
+		g_mft_zone_end = g_mft_lcn + j;
 	/* Create runlist for mft. */
 	g_rl_mft = ntfs_malloc(2 * sizeof(runlist));
 	if (!g_rl_mft)
@@ -3974,17 +4084,12 @@ static BOOL mkntfs_initialize_rl_mft(void)
 
 	g_rl_mft[0].vcn = 0LL;
 	g_rl_mft[0].lcn = g_mft_lcn;
-	/* rounded up division by cluster size */
-	j = (g_mft_size + g_vol->cluster_size - 1) / g_vol->cluster_size;
 	g_rl_mft[1].vcn = j;
 	g_rl_mft[0].length = j;
 	g_rl_mft[1].lcn = -1LL;
 	g_rl_mft[1].length = 0LL;
 	/* Allocate clusters for mft. */
 	bitmap_allocate(g_mft_lcn,j);
-	/* Determine mftmirr_lcn (middle of volume). */
-	g_mftmirr_lcn = (opts.num_sectors * opts.sector_size >> 1)
-			/ g_vol->cluster_size;
 	ntfs_log_debug("$MFTMirr logical cluster number = 0x%llx\n",
 			g_mftmirr_lcn);
 	/* Create runlist for mft mirror. */
@@ -4144,30 +4249,49 @@ static BOOL mkntfs_initialize_rl_bad(void)
 }
 
 /**
- * mkntfs_fill_device_with_zeroes -
+ * mkntfs_zero_out - zero out the clusters of a block device at once
+ *
+ * Return TRUE if the device did it, FALSE if the clusters have to be
+ * written.
  */
-static BOOL mkntfs_fill_device_with_zeroes(void)
+static BOOL mkntfs_zero_out(u64 length)
 {
-	/*
-	 * If not quick format, fill the device with 0s.
-	 * FIXME: Except bad blocks! (AIA)
-	 */
-	int i;
-	ssize_t bw;
-	unsigned long long position;
-	float progress_inc = (float)g_vol->nr_clusters / 100;
-	u64 volume_size;
+#ifdef BLKZEROOUT
+	struct stat sbuf;
+	u64 range[2];
 
-	volume_size = g_vol->nr_clusters << g_vol->cluster_size_bits;
+	if (opts.no_action
+	    || g_vol->dev->d_ops->stat(g_vol->dev, &sbuf)
+	    || !S_ISBLK(sbuf.st_mode))
+		return FALSE;
+	range[0] = 0;
+	range[1] = length;
+	if (g_vol->dev->d_ops->ioctl(g_vol->dev, BLKZEROOUT, range)) {
+		ntfs_log_debug("BLKZEROOUT failed : %s\n", strerror(errno));
+		return FALSE;
+	}
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
 
-	ntfs_log_progress("Initializing device with zeroes:   0%%");
-	for (position = 0; position < (unsigned long long)g_vol->nr_clusters;
-			position++) {
-		if (!(position % (int)(progress_inc+1))) {
-			ntfs_log_progress("\b\b\b\b%3.0f%%", position /
-					progress_inc);
-		}
-		bw = mkntfs_write(g_vol->dev, g_buf, g_vol->cluster_size);
+/**
+ * mkntfs_zero_clusters - write zeroes to clusters one by one
+ *
+ * This is used when a set of clusters could not be written at once,
+ * so that the bad clusters can be found.
+ */
+static BOOL mkntfs_zero_clusters(const void *zeroes,
+			unsigned long long position, s64 count,
+			float progress_inc)
+{
+	ssize_t bw;
+
+	g_vol->dev->d_ops->seek(g_vol->dev,
+			(off_t)position * g_vol->cluster_size, SEEK_SET);
+	for ( ; count > 0; position++, count--) {
+		bw = mkntfs_write(g_vol->dev, zeroes, g_vol->cluster_size);
 		if (bw != (ssize_t)g_vol->cluster_size) {
 			if (bw != -1 || errno != EIO) {
 				ntfs_log_error("This should not happen.\n");
@@ -4192,6 +4316,67 @@ static BOOL mkntfs_fill_device_with_zeroes(void)
 					g_vol->cluster_size, SEEK_SET);
 		}
 	}
+	return TRUE;
+}
+
+/**
+ * mkntfs_fill_device_with_zeroes -
+ *
+ * The device is asked to zero out the volume, and when it cannot,
+ * the clusters are written by large sets, only the sets which could
+ * not be written being written again cluster by cluster.
+ */
+static BOOL mkntfs_fill_device_with_zeroes(void)
+{
+	/*
+	 * If not quick format, fill the device with 0s.
+	 * FIXME: Except bad blocks! (AIA)
+	 */
+	int i;
+	ssize_t bw;
+	unsigned long long position;
+	unsigned long long next_progress;
+	float progress_inc = (float)g_vol->nr_clusters / 100;
+	u64 volume_size;
+	char *zeroes;
+	s64 count;
+	s64 chunk;
+
+	volume_size = g_vol->nr_clusters << g_vol->cluster_size_bits;
+
+	ntfs_log_progress("Initializing device with zeroes:   0%%");
+	if (mkntfs_zero_out(volume_size)) {
+		ntfs_log_progress("\b\b\b\b100%% - Done.\n");
+		return TRUE;
+	}
+	chunk = (mkntfs_get_page_size()*WRITE_BUFFER_PAGES)
+			>> g_vol->cluster_size_bits;
+	if (chunk < 1)
+		chunk = 1;
+	zeroes = (char*)ntfs_calloc(chunk << g_vol->cluster_size_bits);
+	if (!zeroes)
+		return FALSE;
+	next_progress = 0;
+	for (position = 0; position < (unsigned long long)g_vol->nr_clusters;
+			position += count) {
+		if (position >= next_progress) {
+			ntfs_log_progress("\b\b\b\b%3.0f%%", position /
+					progress_inc);
+			next_progress = position + (int)(progress_inc+1);
+		}
+		count = g_vol->nr_clusters - position;
+		if (count > chunk)
+			count = chunk;
+		bw = mkntfs_write(g_vol->dev, zeroes,
+				count << g_vol->cluster_size_bits);
+		if ((bw != (ssize_t)(count << g_vol->cluster_size_bits))
+		    && !mkntfs_zero_clusters(zeroes, position, count,
+				progress_inc)) {
+			free(zeroes);
+			return FALSE;
+		}
+	}
+	free(zeroes);
 	ntfs_log_progress("\b\b\b\b100%%");
 	position = (volume_size & (g_vol->cluster_size - 1)) /
 			opts.sector_size;
@@ -4537,8 +4722,7 @@ static BOOL mkntfs_create_root_structures(void)
 	if (!err)
 		err = create_hardlink(g_index_block, root_ref, m,
 				MK_LE_MREF(FILE_MFT, 1),
-				((g_mft_size - 1)
-					| (g_vol->cluster_size - 1)) + 1,
+				g_mft_allocated,
 				g_mft_size, FILE_ATTR_HIDDEN |
 				FILE_ATTR_SYSTEM, 0, 0, "$MFT",
 				FILE_NAME_WIN32_AND_DOS);
@@ -4959,7 +5143,7 @@ static int mkntfs_redirect(struct mkntfs_options *opts2)
 	u64 upcase_crc;
 	int result = 1;
 	ntfs_attr_search_ctx *ctx = NULL;
-	long long lw, pos;
+	long long lw, pos, cnt;
 	ATTR_RECORD *a;
 	MFT_RECORD *m;
 	int i, err;
@@ -5109,21 +5293,20 @@ static int mkntfs_redirect(struct mkntfs_options *opts2)
 	 */
 	ntfs_log_verbose("Syncing $MFT.\n");
 	pos = g_mft_lcn * g_vol->cluster_size;
-	lw = 1;
-	for (i = 0; i < g_mft_size / (s32)g_vol->mft_record_size; i++) {
-		if (!opts.no_action)
-			lw = ntfs_mst_pwrite(g_vol->dev, pos, 1, g_vol->mft_record_size, g_buf + i * g_vol->mft_record_size);
-		if (lw != 1) {
-			ntfs_log_error("ntfs_mst_pwrite: %s\n", lw == -1 ?
-				       strerror(errno) : "unknown error");
-			goto done;
-		}
-		pos += g_vol->mft_record_size;
+	cnt = g_mft_size / (s32)g_vol->mft_record_size;
+	lw = cnt;
+	/* The records are contiguous, write them at once. */
+	if (!opts.no_action)
+		lw = ntfs_mst_pwrite(g_vol->dev, pos, cnt, g_vol->mft_record_size, g_buf);
+	if (lw != cnt) {
+		ntfs_log_error("ntfs_mst_pwrite: %s\n", lw == -1 ?
+			       strerror(errno) : "unknown error");
+		goto done;
 	}
 	ntfs_log_verbose("Updating $MFTMirr.\n");
 	pos = g_mftmirr_lcn * g_vol->cluster_size;
-	lw = 1;
-	for (i = 0; i < g_rl_mftmirr[0].length * g_vol->cluster_size / g_vol->mft_record_size; i++) {
+	cnt = g_rl_mftmirr[0].length * g_vol->cluster_size / g_vol->mft_record_size;
+	for (i = 0; i < cnt; i++) {
 		m = (MFT_RECORD*)(g_buf + i * g_vol->mft_record_size);
 		/*
 		 * Decrement the usn by one, so it becomes the same as the one
@@ -5135,14 +5318,14 @@ static int mkntfs_redirect(struct mkntfs_options *opts2)
 			ntfs_log_error("ntfs_mft_usn_dec");
 			goto done;
 		}
-		if (!opts.no_action)
-			lw = ntfs_mst_pwrite(g_vol->dev, pos, 1, g_vol->mft_record_size, g_buf + i * g_vol->mft_record_size);
-		if (lw != 1) {
-			ntfs_log_error("ntfs_mst_pwrite: %s\n", lw == -1 ?
-				       strerror(errno) : "unknown error");
-			goto done;
-		}
-		pos += g_vol->mft_record_size;
+	}
+	lw = cnt;
+	if (!opts.no_action)
+		lw = ntfs_mst_pwrite(g_vol->dev, pos, cnt, g_vol->mft_record_size, g_buf);
+	if (lw != cnt) {
+		ntfs_log_error("ntfs_mst_pwrite: %s\n", lw == -1 ?
+			       strerror(errno) : "unknown error");
+		goto done;
 	}
 	ntfs_log_verbose("Syncing device.\n");
 	if (g_vol->dev->d_ops->sync(g_vol->dev)) {
@@ -5158,6 +5341,404 @@ done:
 }
 
 
+/*
+ *		Populating the volume from a directory tree
+ *
+ *	Once the volume has been formatted, it is mounted through the
+ *	library and the tree is copied into it. The count of files is
+ *	determined beforehand so that their MFT records are reserved
+ *	contiguously (as with --expected-files), the directories are
+ *	walked in the order of names, and the data of each file is
+ *	allocated at once before being copied, so that the files are
+ *	laid out contiguously, in the order they are copied. The MFT
+ *	records are kept in a write-back cache and written in the order
+ *	of their numbers, merging the consecutive ones.
+ *
+ *	The files get the security descriptor inherited from the root,
+ *	as there is no mapping of the owners, and their times are copied.
+ */
+
+/**
+ * mkntfs_count_tree - count the files in a directory tree
+ */
+static long long mkntfs_count_tree(const char *path)
+{
+	struct dirent *dirent;
+	struct stat st;
+	char *child;
+	DIR *dir;
+	long long count;
+
+	count = 0;
+	dir = opendir(path);
+	if (dir) {
+		while ((dirent = readdir(dir))) {
+			if (!strcmp(dirent->d_name, ".")
+			    || !strcmp(dirent->d_name, ".."))
+				continue;
+			count++;
+			child = (char*)ntfs_malloc(strlen(path)
+					+ strlen(dirent->d_name) + 2);
+			if (child) {
+				sprintf(child, "%s/%s", path, dirent->d_name);
+				if (!lstat(child, &st) && S_ISDIR(st.st_mode))
+					count += mkntfs_count_tree(child);
+				free(child);
+			}
+		}
+		closedir(dir);
+	}
+	return (count);
+}
+
+static int mkntfs_name_compare(const void *p1, const void *p2)
+{
+	return (strcmp(*(char* const*)p1, *(char* const*)p2));
+}
+
+/**
+ * mkntfs_list_dir - get the sorted names in a directory
+ *
+ * Return:  the count of names, or -1 if failed, the names are to be freed
+ */
+static int mkntfs_list_dir(const char *path, char ***pnames)
+{
+	struct dirent *dirent;
+	char **names;
+	char **newnames;
+	DIR *dir;
+	int count;
+	int size;
+
+	dir = opendir(path);
+	if (!dir) {
+		ntfs_log_perror("Could not open directory %s", path);
+		return (-1);
+	}
+	names = (char**)NULL;
+	count = 0;
+	size = 0;
+	while ((dirent = readdir(dir))) {
+		if (!strcmp(dirent->d_name, ".")
+		    || !strcmp(dirent->d_name, ".."))
+			continue;
+		if (count >= size) {
+			size = (size ? 2*size : 64);
+			newnames = (char**)realloc(names, size*sizeof(char*));
+			if (!newnames)
+				break;
+			names = newnames;
+		}
+		names[count] = strdup(dirent->d_name);
+		if (!names[count])
+			break;
+		count++;
+	}
+	if (dirent) {
+		ntfs_log_error("Not enough memory for listing %s\n", path);
+		while (count > 0)
+			free(names[--count]);
+		free(names);
+		closedir(dir);
+		return (-1);
+	}
+	closedir(dir);
+	if (count)
+		qsort(names, count, sizeof(char*), mkntfs_name_compare);
+	*pnames = names;
+	return (count);
+}
+
+/**
+ * mkntfs_copy_data - copy the data of a file into the volume
+ */
+static int mkntfs_copy_data(struct POPULATE_STATE *ps, ntfs_inode *ni,
+		const char *path, s64 size)
+{
+	ntfs_attr *na;
+	s64 pos;
+	ssize_t br;
+	int fd;
+	int res;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		ntfs_log_perror("Could not open %s", path);
+		return (-1);
+	}
+	res = -1;
+	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+	if (!na)
+		ntfs_log_perror("Could not open the data of %s", path);
+		/* allocate at once, for the data to be contiguous */
+	else if (ntfs_attr_truncate_solid(na, size))
+		ntfs_log_perror("Could not allocate %lld bytes for %s",
+				(long long)size, path);
+	else {
+		pos = 0;
+		do {
+			br = read(fd, ps->buf, POPULATE_BUFFER_SIZE);
+			if ((br > 0) && ((pos + br) > size))
+				br = size - pos;
+			if ((br > 0)
+			    && (ntfs_attr_pwrite(na, pos, br, ps->buf) != br)) {
+				ntfs_log_perror("Could not write into %s",
+						path);
+				br = -1;
+			} else
+				if (br > 0)
+					pos += br;
+		} while ((br > 0) && (pos < size));
+		if (br < 0)
+			ntfs_log_perror("Could not copy %s", path);
+		else {
+			ps->bytes += pos;
+			res = 0;
+		}
+	}
+	if (na)
+		ntfs_attr_close(na);
+	close(fd);
+	return (res);
+}
+
+/**
+ * mkntfs_set_times - copy the times of a file to its inode
+ */
+static void mkntfs_set_times(ntfs_inode *ni, const struct stat *st)
+{
+	struct timespec ts;
+
+	ts.tv_sec = st->st_mtime;
+	ts.tv_nsec = 0;
+	ni->creation_time = timespec2ntfs(ts);
+	ni->last_data_change_time = ni->creation_time;
+	ts.tv_sec = st->st_ctime;
+	ni->last_mft_change_time = timespec2ntfs(ts);
+	ts.tv_sec = st->st_atime;
+	ni->last_access_time = timespec2ntfs(ts);
+	NInoSetDirty(ni);
+	NInoFileNameSetDirty(ni);
+}
+
+/**
+ * mkntfs_find_link - find a file already copied under another name
+ */
+static struct POPULATE_LINK *mkntfs_find_link(struct POPULATE_STATE *ps,
+		const struct stat *st)
+{
+	int i;
+
+	for (i=0; i<ps->link_count; i++)
+		if ((ps->links[i].ino == st->st_ino)
+		    && (ps->links[i].dev == st->st_dev))
+			return (&ps->links[i]);
+	return ((struct POPULATE_LINK*)NULL);
+}
+
+/**
+ * mkntfs_add_link - record a file which has several names
+ */
+static void mkntfs_add_link(struct POPULATE_STATE *ps,
+		const struct stat *st, MFT_REF mref)
+{
+	struct POPULATE_LINK *links;
+
+	if (ps->link_count >= ps->link_size) {
+		links = (struct POPULATE_LINK*)realloc(ps->links,
+			(ps->link_size ? 2*ps->link_size : 64)
+				*sizeof(struct POPULATE_LINK));
+		if (!links)
+			return;
+		ps->links = links;
+		ps->link_size = (ps->link_size ? 2*ps->link_size : 64);
+	}
+	ps->links[ps->link_count].dev = st->st_dev;
+	ps->links[ps->link_count].ino = st->st_ino;
+	ps->links[ps->link_count].mref = mref;
+	ps->link_count++;
+}
+
+static int mkntfs_populate_dir(struct POPULATE_STATE *ps,
+		ntfs_inode *dir_ni, const char *path);
+
+/**
+ * mkntfs_populate_one - copy a file, a directory or a special file
+ */
+static int mkntfs_populate_one(struct POPULATE_STATE *ps,
+		ntfs_inode *dir_ni, const char *path, const char *name)
+{
+	struct POPULATE_LINK *link;
+	struct stat st;
+	ntfs_inode *ni;
+	ntfschar *uname;
+	ntfschar *utarget;
+	char *target;
+	int uname_len;
+	int utarget_len;
+	int res;
+
+	if (lstat(path, &st)) {
+		ntfs_log_perror("Could not stat %s", path);
+		return (-1);
+	}
+	uname = (ntfschar*)NULL;
+	uname_len = ntfs_mbstoucs(name, &uname);
+	if ((uname_len < 0) || (uname_len > NTFS_MAX_NAME_LEN)) {
+		ntfs_log_error("Bad file name %s\n", path);
+		free(uname);
+		return (-1);
+	}
+	res = -1;
+	ni = (ntfs_inode*)NULL;
+	link = ((st.st_nlink > 1) && !S_ISDIR(st.st_mode)
+			? mkntfs_find_link(ps, &st)
+			: (struct POPULATE_LINK*)NULL);
+	if (link) {
+		ni = ntfs_inode_open(ps->vol, link->mref);
+		if (ni && !ntfs_link(ni, dir_ni, uname, uname_len))
+			res = 0;
+		else
+			ntfs_log_perror("Could not link %s", path);
+		if (ni)
+			ntfs_inode_close(ni);
+		free(uname);
+		return (res);
+	}
+	switch (st.st_mode & S_IFMT) {
+	case S_IFDIR :
+	case S_IFREG :
+	case S_IFIFO :
+	case S_IFSOCK :
+		ni = ntfs_create(dir_ni, const_cpu_to_le32(0), uname,
+				uname_len, st.st_mode & S_IFMT);
+		break;
+	case S_IFCHR :
+	case S_IFBLK :
+		ni = ntfs_create_device(dir_ni, const_cpu_to_le32(0), uname,
+				uname_len, st.st_mode & S_IFMT, st.st_rdev);
+		break;
+	case S_IFLNK :
+		target = (char*)ntfs_malloc(st.st_size + 1);
+		if (target && (readlink(path, target, st.st_size + 1)
+					== st.st_size)) {
+			target[st.st_size] = 0;
+			utarget = (ntfschar*)NULL;
+			utarget_len = ntfs_mbstoucs(target, &utarget);
+			if (utarget_len > 0)
+				ni = ntfs_create_symlink(dir_ni,
+					const_cpu_to_le32(0), uname,
+					uname_len, utarget, utarget_len);
+			free(utarget);
+		}
+		free(target);
+		break;
+	default :
+		errno = EOPNOTSUPP;
+		break;
+	}
+	if (!ni)
+		ntfs_log_perror("Could not create %s", path);
+	else {
+		res = 0;
+		if (S_ISDIR(st.st_mode))
+			res = mkntfs_populate_dir(ps, ni, path);
+		else if (S_ISREG(st.st_mode) && st.st_size)
+			res = mkntfs_copy_data(ps, ni, path, st.st_size);
+		if ((st.st_nlink > 1) && !S_ISDIR(st.st_mode))
+			mkntfs_add_link(ps, &st, ni->mft_no);
+		mkntfs_set_times(ni, &st);
+		ps->files++;
+			/* the name is updated in the open directory */
+		if (ntfs_inode_close_in_dir(ni, dir_ni)) {
+			ntfs_log_perror("Could not close %s", path);
+			res = -1;
+		}
+	}
+	free(uname);
+	return (res);
+}
+
+/**
+ * mkntfs_populate_dir - copy the contents of a directory
+ *
+ * The errors are counted, and the copy goes on with the next file.
+ */
+static int mkntfs_populate_dir(struct POPULATE_STATE *ps,
+		ntfs_inode *dir_ni, const char *path)
+{
+	char **names;
+	char *child;
+	int count;
+	int i;
+
+	count = mkntfs_list_dir(path, &names);
+	if (count < 0)
+		return (-1);
+	for (i=0; i<count; i++) {
+		child = (char*)ntfs_malloc(strlen(path)
+				+ strlen(names[i]) + 2);
+		if (child) {
+			sprintf(child, "%s/%s", path, names[i]);
+			if (mkntfs_populate_one(ps, dir_ni, child, names[i]))
+				ps->errors++;
+			free(child);
+		} else
+			ps->errors++;
+		free(names[i]);
+	}
+	free(names);
+	return (0);
+}
+
+/**
+ * mkntfs_populate - copy a directory tree into the new volume
+ *
+ * Return:  0  Success, all the files have been copied
+ *	    1  Error, some files could not be copied
+ */
+static int mkntfs_populate(const char *dev_name, const char *source)
+{
+	struct POPULATE_STATE ps;
+	ntfs_inode *root;
+	int result;
+
+	ntfs_log_quiet("Copying the files from %s.\n", source);
+	memset(&ps, 0, sizeof(ps));
+	ps.vol = ntfs_mount(dev_name, NTFS_MNT_NONE);
+	if (!ps.vol) {
+		ntfs_log_perror("Could not mount the new volume");
+		return (1);
+	}
+	if (ntfs_volume_get_free_space(ps.vol)) {
+		ntfs_log_perror("Could not count the free space");
+		ntfs_umount(ps.vol, FALSE);
+		return (1);
+	}
+	if (ntfs_mftcache_attach(ps.vol, POPULATE_MFT_RECORDS, TRUE))
+		ntfs_log_perror("Could not set up a cache of MFT records");
+	ps.buf = (char*)ntfs_malloc(POPULATE_BUFFER_SIZE);
+	root = ntfs_inode_open(ps.vol, FILE_root);
+	if (!ps.buf || !root)
+		ps.errors++;
+	else if (mkntfs_populate_dir(&ps, root, source))
+		ps.errors++;
+	if (root && ntfs_inode_close(root))
+		ps.errors++;
+	if (ntfs_umount(ps.vol, FALSE)) {
+		ntfs_log_perror("Could not unmount the new volume");
+		ps.errors++;
+	}
+	free(ps.buf);
+	free(ps.links);
+	result = (ps.errors ? 1 : 0);
+	if (result)
+		ntfs_log_error("%d files could not be copied.\n", ps.errors);
+	ntfs_log_quiet("Copied %lld files, %lld bytes of data.\n",
+			ps.files, ps.bytes);
+	return (result);
+}
+
 /**
  * main - Begin here
  *
@@ -5178,8 +5759,15 @@ int main(int argc, char *argv[])
 			/* Read the command line options */
 	result = mkntfs_parse_options(argc, argv, &opts);
 
-	if (result < 0)
+	if ((result < 0) && opts.populate) {
+		if (opts.expected_files < 0)
+			opts.expected_files = mkntfs_count_tree(opts.populate);
 		result = mkntfs_redirect(&opts);
+		if (!result)
+			result = mkntfs_populate(opts.dev_name, opts.populate);
+	} else
+		if (result < 0)
+			result = mkntfs_redirect(&opts);
 
 	return result;
 }
@@ -0,0 +1,909 @@
+/**
+ * ntfsbench - Part of the Linux-NTFS project.
+ *
+ * This utility measures the speed of the main paths of libntfs-3g on
+ * a synthetic volume, and prints the results in a form which can be
+ * collected and compared between versions.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#include <sys/wait.h>
+
+#include "types.h"
+#include "attrib.h"
+#include "inode.h"
+#include "dir.h"
+#include "volume.h"
+#include "lcnalloc.h"
+#include "runlist.h"
+#include "system_compression.h"
+#include "misc.h"
+#include "utils.h"
+
+#define CHUNK_SIZE 65536	/* size of sequential transfers */
+#define RANDOM_SIZE 4096	/* size of random transfers */
+#define RANDOM_OPS 20000	/* count of random transfers */
+#define LOOKUP_OPS 100000	/* count of name lookups */
+#define ALLOC_OPS 2000		/* count of cluster allocations */
+#define ALLOC_SIZE 16		/* clusters per allocation */
+#define ALLOC_HOLES 20000	/* single cluster holes for fragmentation */
+#define XPRESS_SIZE 16777216	/* bytes compressed by XPRESS */
+#define XPRESS_CHUNK 4096	/* XPRESS chunk, as in SYSTEM_COMPRESSION_XPRESS4K */
+#define NAME_LEN 9		/* length of the names of created files */
+#define MAX_ENTRIES 100000000	/* files in a directory, for NAME_LEN */
+
+static const char *EXEC_NAME = "ntfsbench";
+
+static struct options {
+	const char *image;	/* image to create */
+	const char *mkntfs;	/* program to format the image */
+	const char *entries;	/* sizes of directories */
+	const char *benches;	/* benchmarks to run */
+	s64 size;		/* size of image */
+	s64 file_size;		/* size of files for data transfers */
+	int keep;		/* do not delete the image */
+} opts;
+
+static u32 seed;
+
+/**
+ * version - Print version information about the program
+ *
+ * Print a copyright statement and a brief description of the program.
+ *
+ * Return:  none
+ */
+static void version(void)
+{
+	ntfs_log_info("\n%s v%s (libntfs-3g) - Measure the speed of "
+			"libntfs-3g.\n\n", EXEC_NAME, VERSION);
+	ntfs_log_info("\n%s\n%s%s\n", ntfs_gpl, ntfs_bugs, ntfs_home);
+}
+
+/**
+ * usage - Print a list of the parameters to the program
+ *
+ * Print a list of the parameters and options for the program.
+ *
+ * Return:  none
+ */
+static void usage(void)
+{
+	ntfs_log_info("\nUsage: %s [options]\n\n"
+		"    -b, --bench LIST           Benchmarks to run, among data,"
+		" lookup,\n"
+		"                               alloc, lznt1 and xpress"
+		" (default all)\n"
+		"    -f, --file-size SIZE       Size of files for data"
+		" transfers (64M)\n"
+		"    -i, --image FILE           Image to create"
+		" (ntfsbench.img)\n"
+		"    -k, --keep                 Keep the image\n"
+		"    -m, --mkntfs PROGRAM       Program to format the image"
+		" (mkntfs)\n"
+		"    -n, --entries LIST         Sizes of directories"
+		" (1000,100000)\n"
+		"    -s, --size SIZE            Size of the image (2G)\n"
+		"    -h, --help                 Print this help\n"
+		"    -V, --version              Version information\n\n",
+		EXEC_NAME);
+	ntfs_log_info("%s%s\n", ntfs_bugs, ntfs_home);
+}
+
+/**
+ * parse_options - Read and validate the programs command line
+ *
+ * Read the command line, verify the syntax and parse the options.
+ *
+ * Return:   0 Success, and nothing more to do
+ *	    -1 Success, proceed
+ *	     1 Error, one or more problems
+ */
+static int parse_options(int argc, char **argv)
+{
+	static const char *sopt = "-b:f:hi:km:n:s:V";
+	static const struct option lopt[] = {
+		{ "bench",	 required_argument,	NULL, 'b' },
+		{ "file-size",	 required_argument,	NULL, 'f' },
+		{ "help",	 no_argument,		NULL, 'h' },
+		{ "image",	 required_argument,	NULL, 'i' },
+		{ "keep",	 no_argument,		NULL, 'k' },
+		{ "mkntfs",	 required_argument,	NULL, 'm' },
+		{ "entries",	 required_argument,	NULL, 'n' },
+		{ "size",	 required_argument,	NULL, 's' },
+		{ "version",	 no_argument,		NULL, 'V' },
+		{ NULL,		 0,			NULL, 0   }
+	};
+
+	int c = -1;
+	int err  = 0;
+	int ver  = 0;
+	int help = 0;
+
+	opterr = 0; /* We'll handle the errors, thank you. */
+
+	opts.image = "ntfsbench.img";
+	opts.mkntfs = "mkntfs";
+	opts.entries = "1000,100000";
+	opts.benches = "data,lookup,alloc,lznt1,xpress";
+	opts.size = 2LL << 30;
+	opts.file_size = 64LL << 20;
+
+	while ((c = getopt_long(argc, argv, sopt, lopt, NULL)) != -1) {
+		switch (c) {
+		case 'b':
+			opts.benches = optarg;
+			break;
+		case 'f':
+			if (!utils_parse_size(optarg, &opts.file_size, TRUE)
+			    || (opts.file_size < CHUNK_SIZE)) {
+				ntfs_log_error("Bad file size '%s'.\n",
+						optarg);
+				err++;
+			}
+			opts.file_size &= -(s64)CHUNK_SIZE;
+			break;
+		case 'h':
+			help++;
+			break;
+		case 'i':
+			opts.image = optarg;
+			break;
+		case 'k':
+			opts.keep++;
+			break;
+		case 'm':
+			opts.mkntfs = optarg;
+			break;
+		case 'n':
+			opts.entries = optarg;
+			break;
+		case 's':
+			if (!utils_parse_size(optarg, &opts.size, TRUE)
+			    || (opts.size < (64LL << 20))) {
+				ntfs_log_error("Bad image size '%s'.\n",
+						optarg);
+				err++;
+			}
+			break;
+		case 'V':
+			ver++;
+			break;
+		case 1:	/* A non-option argument */
+		case '?':
+		default:
+			ntfs_log_error("Unknown option '%s'.\n",
+					argv[optind - 1]);
+			err++;
+			break;
+		}
+	}
+
+	if (help || ver) {
+		if (ver)
+			version();
+		else
+			usage();
+		return (err ? 1 : 0);
+	}
+	if (err) {
+		usage();
+		return (1);
+	}
+	return (-1);
+}
+
+/*
+ *		Check whether a benchmark was selected
+ */
+
+static BOOL selected(const char *name)
+{
+	const char *p;
+	size_t len;
+
+	len = strlen(name);
+	for (p=opts.benches; p; p=strchr(p, ',')) {
+		if (*p == ',')
+			p++;
+		if (!strncmp(p, name, len) && ((p[len] == ',') || !p[len]))
+			return (TRUE);
+	}
+	return (FALSE);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec/1000000000.0);
+}
+
+/*
+ *		Print a result, as tab separated fields
+ */
+
+static void result(const char *bench, const char *param, double value,
+			const char *unit)
+{
+	printf("%s\t%s\t%.1f\t%s\n", bench, (*param ? param : "-"),
+			value, unit);
+	fflush(stdout);
+}
+
+/*
+ *		Pseudo-random numbers, the same on each run
+ */
+
+static u32 bench_random(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return (seed);
+}
+
+/*
+ *		Fill a buffer with text-like data which can be compressed
+ */
+
+static void fill_compressible(char *buf, s64 size)
+{
+	static const char *words[] = {
+		"alpha ", "beta ", "gamma ", "delta ", "epsilon ", "zeta ",
+		"eta ", "theta ", "iota ", "kappa ", "lambda ", "mu ",
+		"nu ", "xi ", "omicron ", "pi ", "rho ", "sigma ", "tau ",
+		"upsilon ", "phi ", "chi ", "psi ", "omega\n"
+	} ;
+	const char *w;
+	s64 pos;
+
+	pos = 0;
+	while (pos < size) {
+		w = words[bench_random() % (sizeof(words)/sizeof(words[0]))];
+		while (*w && (pos < size))
+			buf[pos++] = *w++;
+	}
+}
+
+/*
+ *		Build the name of a created file, as "f" and eight digits
+ */
+
+static int make_name(ntfschar *uname, unsigned int num)
+{
+	char name[NAME_LEN + 3];
+	int i;
+
+	snprintf(name, sizeof(name), "f%08u", num % MAX_ENTRIES);
+	for (i=0; i<NAME_LEN; i++)
+		uname[i] = cpu_to_le16(name[i]);
+	return (NAME_LEN);
+}
+
+static ntfs_inode *create_named(ntfs_inode *dir_ni, const char *name,
+			mode_t type)
+{
+	ntfschar *uname;
+	ntfs_inode *ni;
+	int len;
+
+	uname = (ntfschar*)NULL;
+	len = ntfs_mbstoucs(name, &uname);
+	if (len <= 0)
+		return ((ntfs_inode*)NULL);
+	ni = ntfs_create(dir_ni, const_cpu_to_le32(0), uname, len, type);
+	free(uname);
+	return (ni);
+}
+
+/*
+ *		Create the image and format it
+ */
+
+static int create_image(void)
+{
+	pid_t pid;
+	int status;
+	int fd;
+
+	fd = open(opts.image, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if ((fd < 0) || ftruncate(fd, opts.size) || close(fd)) {
+		ntfs_log_perror("Could not create %s", opts.image);
+		return (-1);
+	}
+	pid = fork();
+	if (!pid) {
+		execlp(opts.mkntfs, opts.mkntfs, "-F", "-f", "-q",
+			"-L", "ntfsbench", opts.image, (char*)NULL);
+		ntfs_log_perror("Could not run %s", opts.mkntfs);
+		_exit(1);
+	}
+	if ((pid < 0) || (waitpid(pid, &status, 0) != pid)
+	    || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		ntfs_log_error("Could not format %s\n", opts.image);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ *		Sequential and random transfers on an open attribute
+ */
+
+static int bench_transfers(ntfs_attr *na, const char *kind, char *buf,
+			BOOL writes)
+{
+	double start;
+	s64 pos;
+	s64 blocks;
+	int i;
+
+	if (writes) {
+		start = now();
+		for (pos=0; pos<opts.file_size; pos+=CHUNK_SIZE)
+			if (ntfs_attr_pwrite(na, pos, CHUNK_SIZE, buf)
+					!= CHUNK_SIZE)
+				return (-1);
+		result("seq_write", kind, opts.file_size/(now() - start)
+				/1048576.0, "MB/s");
+	}
+	start = now();
+	for (pos=0; pos<opts.file_size; pos+=CHUNK_SIZE)
+		if (ntfs_attr_pread(na, pos, CHUNK_SIZE, buf) != CHUNK_SIZE)
+			return (-1);
+	result("seq_read", kind, opts.file_size/(now() - start)/1048576.0,
+			"MB/s");
+	blocks = opts.file_size/RANDOM_SIZE;
+	start = now();
+	for (i=0; i<RANDOM_OPS; i++) {
+		pos = (bench_random() % blocks)*RANDOM_SIZE;
+		if (ntfs_attr_pread(na, pos, RANDOM_SIZE, buf) != RANDOM_SIZE)
+			return (-1);
+	}
+	result("rand_read", kind, RANDOM_OPS/(now() - start), "ops/s");
+	if (writes) {
+		start = now();
+		for (i=0; i<RANDOM_OPS; i++) {
+			pos = (bench_random() % blocks)*RANDOM_SIZE;
+			if (ntfs_attr_pwrite(na, pos, RANDOM_SIZE, buf)
+					!= RANDOM_SIZE)
+				return (-1);
+		}
+		result("rand_write", kind, RANDOM_OPS/(now() - start),
+				"ops/s");
+	}
+	return (0);
+}
+
+/*
+ *		Write a file made of one run per cluster
+ *
+ *	The file is appended cluster by cluster, and the cluster which
+ *	follows each appended one is allocated to nothing, so that the
+ *	next cluster of the file has to go elsewhere. The blocking
+ *	clusters are freed when done.
+ */
+
+static int write_fragmented(ntfs_volume *vol, ntfs_attr *na, char *buf)
+{
+	runlist **blockers;
+	s64 clusters;
+	s64 vcn;
+	LCN lcn;
+	int err;
+
+	clusters = opts.file_size >> vol->cluster_size_bits;
+	blockers = (runlist**)ntfs_calloc(clusters*sizeof(runlist*));
+	if (!blockers)
+		return (-1);
+	err = 0;
+	for (vcn=0; (vcn<clusters) && !err; vcn++) {
+		if (ntfs_attr_pwrite(na, vcn << vol->cluster_size_bits,
+				vol->cluster_size, buf) != vol->cluster_size)
+			err = -1;
+		else {
+			lcn = ntfs_attr_vcn_to_lcn(na, vcn);
+			if (lcn < 0)
+				err = -1;
+			else
+				blockers[vcn] = ntfs_cluster_alloc(vol, 0, 1,
+						lcn + 1, DATA_ZONE);
+		}
+	}
+	for (vcn=0; vcn<clusters; vcn++)
+		if (blockers[vcn]) {
+			if (ntfs_cluster_free_from_rl(vol, blockers[vcn]))
+				err = -1;
+			free(blockers[vcn]);
+		}
+	free(blockers);
+	return (err);
+}
+
+/*
+ *		Data transfers on a contiguous file and a fragmented one
+ */
+
+static int bench_data(ntfs_volume *vol)
+{
+	ntfs_inode *dir_ni;
+	ntfs_inode *ni;
+	ntfs_attr *na;
+	runlist_element *rl;
+	char *buf;
+	s64 runs;
+	int err;
+
+	err = -1;
+	buf = (char*)ntfs_malloc(CHUNK_SIZE);
+	dir_ni = ntfs_inode_open(vol, FILE_root);
+	if (!buf || !dir_ni)
+		goto out;
+	fill_compressible(buf, CHUNK_SIZE);
+	ni = create_named(dir_ni, "contiguous", S_IFREG);
+	if (!ni)
+		goto out;
+	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+	if (na) {
+		err = bench_transfers(na, "contiguous", buf, TRUE);
+		ntfs_attr_close(na);
+	}
+	if (ntfs_inode_close(ni) || err)
+		goto out;
+	err = -1;
+	ni = create_named(dir_ni, "fragmented", S_IFREG);
+	if (!ni)
+		goto out;
+	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+	if (na && !write_fragmented(vol, na, buf)
+	    && !ntfs_attr_map_whole_runlist(na)) {
+		runs = 0;
+		for (rl=na->rl; rl->length; rl++)
+			runs++;
+		result("runs", "fragmented", runs, "runs");
+		err = bench_transfers(na, "fragmented", buf, FALSE);
+	}
+	if (na)
+		ntfs_attr_close(na);
+	if (ntfs_inode_close(ni))
+		err = -1;
+out :
+	if (err)
+		ntfs_log_perror("Data benchmark failed");
+	if (dir_ni)
+		ntfs_inode_close(dir_ni);
+	free(buf);
+	return (err);
+}
+
+/*
+ *		Create, look up and unlink the files of a directory
+ */
+
+static int bench_lookup(ntfs_volume *vol, unsigned int count)
+{
+	ntfs_inode *root_ni;
+	ntfs_inode *dir_ni;
+	ntfs_inode *ni;
+	ntfschar uname[NAME_LEN];
+	char dirname[20];
+	char param[20];
+	double start;
+	MFT_REF dir_mref;
+	MFT_REF mref;
+	unsigned int i;
+	int len;
+	int err;
+
+	err = -1;
+	snprintf(dirname, sizeof(dirname), "dir%u", count);
+	snprintf(param, sizeof(param), "%u", count);
+	root_ni = ntfs_inode_open(vol, FILE_root);
+	if (!root_ni)
+		goto out;
+	dir_ni = create_named(root_ni, dirname, S_IFDIR);
+	ntfs_inode_close(root_ni);
+	if (!dir_ni)
+		goto out;
+	dir_mref = dir_ni->mft_no;
+	start = now();
+	for (i=0; i<count; i++) {
+		len = make_name(uname, i);
+		ni = ntfs_create(dir_ni, const_cpu_to_le32(0), uname, len,
+				S_IFREG);
+		if (!ni || ntfs_inode_close(ni)) {
+			ntfs_inode_close(dir_ni);
+			goto out;
+		}
+	}
+	result("create", param, count/(now() - start), "files/s");
+	start = now();
+	for (i=0; i<LOOKUP_OPS; i++) {
+		len = make_name(uname, bench_random() % count);
+		if (ntfs_inode_lookup_by_name(dir_ni, uname, len)
+				== (u64)-1) {
+			ntfs_inode_close(dir_ni);
+			goto out;
+		}
+	}
+	result("lookup", param, LOOKUP_OPS/(now() - start), "lookups/s");
+	ntfs_inode_close(dir_ni);
+		/* as for unlink(2), the inodes are opened for each file */
+	start = now();
+	for (i=0; i<count; i++) {
+		len = make_name(uname, i);
+		dir_ni = ntfs_inode_open(vol, dir_mref);
+		if (!dir_ni)
+			goto out;
+		mref = ntfs_inode_lookup_by_name(dir_ni, uname, len);
+		ni = (mref == (u64)-1 ? (ntfs_inode*)NULL
+				: ntfs_inode_open(vol, MREF(mref)));
+		if (!ni) {
+			ntfs_inode_close(dir_ni);
+			goto out;
+		}
+			/* ntfs_delete() closes ni and dir_ni */
+		if (ntfs_delete(vol, (char*)NULL, ni, dir_ni, uname, len))
+			goto out;
+	}
+	result("unlink", param, count/(now() - start), "files/s");
+	err = 0;
+out :
+	if (err)
+		ntfs_log_perror("Lookup benchmark failed");
+	return (err);
+}
+
+/*
+ *		Allocate clusters on an empty bitmap and on a fragmented one
+ *
+ *	The bitmap is fragmented by allocating single clusters and freeing
+ *	every other one, the allocations then start from the first hole.
+ */
+
+static int bench_alloc(ntfs_volume *vol)
+{
+	runlist **singles;
+	runlist *rl;
+	double start;
+	LCN goal;
+	int err;
+	int i;
+
+	err = -1;
+	start = now();
+	for (i=0; i<ALLOC_OPS; i++) {
+		rl = ntfs_cluster_alloc(vol, 0, ALLOC_SIZE, -1, DATA_ZONE);
+		if (!rl || ntfs_cluster_free_from_rl(vol, rl)) {
+			free(rl);
+			goto out;
+		}
+		free(rl);
+	}
+	result("cluster_alloc", "contiguous", ALLOC_OPS/(now() - start),
+			"allocs/s");
+	singles = (runlist**)ntfs_calloc(ALLOC_HOLES*sizeof(runlist*));
+	if (!singles)
+		goto out;
+	for (i=0; i<ALLOC_HOLES; i++) {
+		singles[i] = ntfs_cluster_alloc(vol, 0, 1, -1, DATA_ZONE);
+		if (!singles[i])
+			break;
+	}
+	if (i == ALLOC_HOLES) {
+		goal = singles[0]->lcn;
+		for (i=0; i<ALLOC_HOLES; i+=2) {
+			ntfs_cluster_free_from_rl(vol, singles[i]);
+			free(singles[i]);
+			singles[i] = (runlist*)NULL;
+		}
+		err = 0;
+		start = now();
+		for (i=0; (i<ALLOC_OPS) && !err; i++) {
+			rl = ntfs_cluster_alloc(vol, 0, ALLOC_SIZE, goal,
+					DATA_ZONE);
+			if (!rl || ntfs_cluster_free_from_rl(vol, rl))
+				err = -1;
+			free(rl);
+		}
+		if (!err)
+			result("cluster_alloc", "fragmented",
+				ALLOC_OPS/(now() - start), "allocs/s");
+	}
+	for (i=0; i<ALLOC_HOLES; i++)
+		if (singles[i]) {
+			ntfs_cluster_free_from_rl(vol, singles[i]);
+			free(singles[i]);
+		}
+	free(singles);
+out :
+	if (err)
+		ntfs_log_perror("Allocation benchmark failed");
+	return (err);
+}
+
+/*
+ *		Write and read a file compressed by LZNT1
+ */
+
+static int bench_lznt1(ntfs_volume *vol)
+{
+	ntfs_inode *root_ni;
+	ntfs_inode *dir_ni;
+	ntfs_inode *ni;
+	ntfs_attr *na;
+	char *buf;
+	double start;
+	s64 pos;
+	int err;
+
+	err = -1;
+	if (vol->cluster_size > MAX_COMPRESSION_CLUSTER_SIZE) {
+		ntfs_log_error("Compression needs clusters of 4096 bytes"
+				" or less\n");
+		return (-1);
+	}
+	NVolSetCompression(vol);
+	buf = (char*)ntfs_malloc(opts.file_size);
+	root_ni = ntfs_inode_open(vol, FILE_root);
+	if (!buf || !root_ni)
+		goto out;
+	fill_compressible(buf, opts.file_size);
+	dir_ni = create_named(root_ni, "compressed", S_IFDIR);
+	if (!dir_ni)
+		goto out;
+		/* files created in a compressed directory are compressed */
+	if (ntfs_attr_set_flags(dir_ni, AT_INDEX_ROOT, NTFS_INDEX_I30, 4,
+			ATTR_IS_COMPRESSED, ATTR_COMPRESSION_MASK)) {
+		ntfs_inode_close(dir_ni);
+		goto out;
+	}
+	dir_ni->flags |= FILE_ATTR_COMPRESSED;
+	NInoSetDirty(dir_ni);
+	ni = create_named(dir_ni, "lznt1", S_IFREG);
+	ntfs_inode_close(dir_ni);
+	if (!ni)
+		goto out;
+	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+	if (na && (na->data_flags & ATTR_COMPRESSION_MASK)) {
+		start = now();
+		for (pos=0; pos<opts.file_size; pos+=CHUNK_SIZE)
+			if (ntfs_attr_pwrite(na, pos, CHUNK_SIZE, &buf[pos])
+					!= CHUNK_SIZE)
+				break;
+		if ((pos == opts.file_size) && !ntfs_attr_pclose(na)) {
+			result("lznt1_compress", "", opts.file_size
+				/(now() - start)/1048576.0, "MB/s");
+			start = now();
+			for (pos=0; pos<opts.file_size; pos+=CHUNK_SIZE)
+				if (ntfs_attr_pread(na, pos, CHUNK_SIZE,
+						&buf[pos]) != CHUNK_SIZE)
+					break;
+			if (pos == opts.file_size) {
+				result("lznt1_decompress", "", opts.file_size
+					/(now() - start)/1048576.0, "MB/s");
+				err = 0;
+			}
+		}
+	} else
+		errno = EOPNOTSUPP;
+	if (na)
+		ntfs_attr_close(na);
+	if (ntfs_inode_close(ni))
+		err = -1;
+out :
+	if (err)
+		ntfs_log_perror("LZNT1 benchmark failed");
+	if (root_ni)
+		ntfs_inode_close(root_ni);
+	free(buf);
+	return (err);
+}
+
+/*
+ *		Compress and decode chunks with XPRESS, in memory
+ *
+ *	There is no LZX compressor in the library, so LZX decoding
+ *	cannot be measured on synthetic data.
+ */
+
+static int bench_xpress(void)
+{
+	struct xpress_compressor *compressor;
+	struct xpress_decompressor *decompressor;
+	char *data;
+	char *compressed;
+	char *decoded;
+	size_t *sizes;
+	double start;
+	s64 pos;
+	s64 total;
+	int n;
+	int err;
+
+	err = -1;
+	data = (char*)ntfs_malloc(XPRESS_SIZE);
+	compressed = (char*)ntfs_malloc(XPRESS_SIZE);
+	decoded = (char*)ntfs_malloc(XPRESS_CHUNK);
+	sizes = (size_t*)ntfs_malloc(XPRESS_SIZE/XPRESS_CHUNK*sizeof(size_t));
+	compressor = xpress_allocate_compressor(XPRESS_CHUNK);
+	decompressor = xpress_allocate_decompressor();
+	if (!data || !compressed || !decoded || !sizes
+	    || !compressor || !decompressor)
+		goto out;
+	fill_compressible(data, XPRESS_SIZE);
+	total = 0;
+	start = now();
+	for (pos=0, n=0; pos<XPRESS_SIZE; pos+=XPRESS_CHUNK, n++) {
+		sizes[n] = xpress_compress(compressor, &data[pos],
+				XPRESS_CHUNK, &compressed[pos],
+				XPRESS_CHUNK - 1);
+		total += (sizes[n] ? sizes[n] : XPRESS_CHUNK);
+	}
+	result("xpress_compress", "", XPRESS_SIZE/(now() - start)/1048576.0,
+			"MB/s");
+	result("xpress_ratio", "", total*100.0/XPRESS_SIZE, "%");
+	start = now();
+	for (pos=0, n=0; pos<XPRESS_SIZE; pos+=XPRESS_CHUNK, n++) {
+		if (sizes[n]
+		    && (xpress_decompress(decompressor, &compressed[pos],
+				sizes[n], decoded, XPRESS_CHUNK)
+			|| memcmp(decoded, &data[pos], XPRESS_CHUNK))) {
+			errno = EIO;
+			goto out;
+		}
+	}
+	result("xpress_decode", "", XPRESS_SIZE/(now() - start)/1048576.0,
+			"MB/s");
+	err = 0;
+out :
+	if (err)
+		ntfs_log_perror("XPRESS benchmark failed");
+	if (compressor)
+		xpress_free_compressor(compressor);
+	if (decompressor)
+		xpress_free_decompressor(decompressor);
+	free(sizes);
+	free(decoded);
+	free(compressed);
+	free(data);
+	return (err);
+}
+
+/*
+ *		Run a benchmark on a freshly mounted volume
+ */
+
+static int run_mounted(const char *name, unsigned int count)
+{
+	ntfs_volume *vol;
+	int err;
+
+	vol = ntfs_mount(opts.image, 0);
+	if (!vol) {
+		ntfs_log_perror("Could not mount %s", opts.image);
+		return (-1);
+	}
+		/* the allocations need the count of free clusters */
+	if (ntfs_volume_get_free_space(vol)) {
+		ntfs_log_perror("Could not get the free space of %s",
+				opts.image);
+		ntfs_umount(vol, FALSE);
+		return (-1);
+	}
+	if (!strcmp(name, "data"))
+		err = bench_data(vol);
+	else if (!strcmp(name, "lookup"))
+		err = bench_lookup(vol, count);
+	else if (!strcmp(name, "alloc"))
+		err = bench_alloc(vol);
+	else
+		err = bench_lznt1(vol);
+	if (ntfs_umount(vol, FALSE)) {
+		ntfs_log_perror("Could not unmount %s", opts.image);
+		err = -1;
+	}
+	return (err);
+}
+
+/**
+ * main - Begin here
+ *
+ * Start from here.
+ *
+ * Return:  0  Success, all the benchmarks were run
+ *	    1  Error, something went wrong
+ */
+int main(int argc, char *argv[])
+{
+	const char *p;
+	char *end;
+	unsigned long count;
+	int err;
+	int res;
+
+	ntfs_log_set_handler(ntfs_log_handler_stderr);
+
+	res = parse_options(argc, argv);
+	if (res >= 0)
+		return (res);
+
+	utils_set_locale();
+	seed = 0x4e544653;
+	if (create_image())
+		return (1);
+	printf("# %s %s, image %lld bytes, files %lld bytes\n",
+			EXEC_NAME, VERSION, (long long)opts.size,
+			(long long)opts.file_size);
+	err = 0;
+	if (selected("data") && run_mounted("data", 0))
+		err = 1;
+	if (selected("lookup"))
+		for (p=opts.entries; p && *p; p=end) {
+			count = strtoul(p, &end, 10);
+			if (!count || (count >= MAX_ENTRIES)
+			    || ((*end != ',') && *end)) {
+				ntfs_log_error("Bad directory size '%s'\n", p);
+				err = 1;
+				break;
+			}
+			if (*end == ',')
+				end++;
+			if (run_mounted("lookup", count))
+				err = 1;
+		}
+	if (selected("alloc") && run_mounted("alloc", 0))
+		err = 1;
+	if (selected("lznt1") && run_mounted("lznt1", 0))
+		err = 1;
+	if (selected("xpress") && bench_xpress())
+		err = 1;
+	if (!opts.keep)
+		unlink(opts.image);
+	return (err);
+}
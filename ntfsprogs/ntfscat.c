@@ -335,7 +335,9 @@ static int cat(ntfs_volume *vol, ntfs_inode *inode, ATTR_TYPES type,
 {
 	const int bufsize = 4096;
 	char *buffer;
+	const void *data;
 	ntfs_attr *attr;
+	ntfs_attr_stream *stream;
 	s64 bytes_read, written;
 	s64 offset;
 	u32 block_size;
@@ -359,15 +361,28 @@ static int cat(ntfs_volume *vol, ntfs_inode *inode, ATTR_TYPES type,
 	else
 		block_size = 0;
 
+	stream = (ntfs_attr_stream*)NULL;
+	if (opts.raw || !block_size) {
+		// Read by large buffers, decompressing each block once
+		stream = ntfs_attr_stream_open(attr);
+		if (!stream) {
+			ntfs_log_perror("ERROR: Couldn't read file");
+			ntfs_attr_close(attr);
+			free(buffer);
+			return 1;
+		}
+	}
+
 	offset = 0;
 	for (;;) {
-		if (!opts.raw && block_size > 0) {
+		data = buffer;
+		if (stream) {
+			bytes_read = ntfs_attr_stream_read(stream, &data);
+		} else {
 			// These types have fixup
 			bytes_read = ntfs_attr_mst_pread(attr, offset, 1, block_size, buffer);
 			if (bytes_read > 0)
 				bytes_read *= block_size;
-		} else {
-			bytes_read = ntfs_attr_pread(attr, offset, bufsize, buffer);
 		}
 		//ntfs_log_info("read %lld bytes\n", bytes_read);
 		if (bytes_read == -1) {
@@ -377,7 +392,7 @@ static int cat(ntfs_volume *vol, ntfs_inode *inode, ATTR_TYPES type,
 		if (!bytes_read)
 			break;
 
-		written = fwrite(buffer, 1, bytes_read, stdout);
+		written = fwrite(data, 1, bytes_read, stdout);
 		if (written != bytes_read) {
 			ntfs_log_perror("ERROR: Couldn't output all data!");
 			break;
@@ -385,6 +400,7 @@ static int cat(ntfs_volume *vol, ntfs_inode *inode, ATTR_TYPES type,
 		offset += bytes_read;
 	}
 
+	ntfs_attr_stream_close(stream);
 	ntfs_attr_close(attr);
 	free(buffer);
 	return 0;
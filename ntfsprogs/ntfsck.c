@@ -36,12 +36,21 @@
 #ifdef HAVE_FCNTL_H
 #include <fcntl.h>
 #endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
 
 #include <layout.h>
 #include <bitmap.h>
 #include <endians.h>
 #include <bootsect.h>
 #include <misc.h>
+#include <attrib.h>
+#include <runlist.h>
+#include <mft.h>
 
 #include "cluster.h"
 #include "utils.h"
@@ -119,7 +128,6 @@ static int unsupported = 0;
 
 static short bytes_per_sector, sectors_per_cluster;
 //static s64 mft_offset, mftmirr_offset;
-static s64 current_mft_record;
 
 /**
  * This is just a preliminary volume.
@@ -129,22 +137,46 @@ static s64 current_mft_record;
 
 static runlist_element *mft_rl, *mft_bitmap_rl;
 
+/*
+ * The MFT records are checked concurrently, the error count and the
+ * messages are serialized through this lock.
+ */
+#ifdef ENABLE_THREADS
+static pthread_mutex_t check_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void ntfsck_lock(void)
+{
+#ifdef ENABLE_THREADS
+	pthread_mutex_lock(&check_lock);
+#endif
+}
+
+static void ntfsck_unlock(void)
+{
+#ifdef ENABLE_THREADS
+	pthread_mutex_unlock(&check_lock);
+#endif
+}
+
 #define check_failed(FORMAT, ARGS...) \
 	do { \
+		ntfsck_lock(); \
 		errors++; \
 		ntfs_log_redirect(__FUNCTION__,__FILE__,__LINE__, \
 				NTFS_LOG_LEVEL_ERROR,NULL,FORMAT,##ARGS); \
+		ntfsck_unlock(); \
 	} while (0);
 
 /**
  * 0 success.
  * 1 fail.
  */
-static int assert_u32_equal(u32 val, u32 ok, const char *name)
+static int assert_u32_equal(s64 mft_no, u32 val, u32 ok, const char *name)
 {
 	if (val!=ok) {
 		check_failed("Assertion failed for '%lld:%s'. should be 0x%x, "
-			"was 0x%x.\n", (long long)current_mft_record, name,
+			"was 0x%x.\n", (long long)mft_no, name,
 			(int)ok, (int)val);
 		//errors++;
 		return 1;
@@ -152,11 +184,12 @@ static int assert_u32_equal(u32 val, u32 ok, const char *name)
 	return 0;
 }
 
-static int assert_u32_noteq(u32 val, u32 wrong, const char *name)
+static int assert_u32_noteq(s64 mft_no, u32 val, u32 wrong,
+			const char *name)
 {
 	if (val==wrong) {
 		check_failed("Assertion failed for '%lld:%s'. should not be "
-			"0x%x.\n", (long long)current_mft_record, name,
+			"0x%x.\n", (long long)mft_no, name,
 			(int)wrong);
 		return 1;
 	}
@@ -197,8 +230,6 @@ static BOOL verify_boot_sector(struct ntfs_device *dev, ntfs_volume *rawvol)
 	NTFS_BOOT_SECTOR *ntfs_boot = (NTFS_BOOT_SECTOR *)&buf;
 	//u32 bytes_per_cluster;
 
-	current_mft_record = 9;
-
 	if (ntfs_pread(dev, 0, sizeof(buf), buf) != sizeof(buf)) {
 		check_failed("Failed to read boot sector.\n");
 		return 1;
@@ -372,8 +403,7 @@ static int mft_bitmap_load(ntfs_volume *rawvol)
 	}
 
 	mft_bitmap_length = vcn * rawvol->cluster_size;
-	mft_bitmap_records = 8 * mft_bitmap_length * rawvol->cluster_size /
-		rawvol->mft_record_size;
+	mft_bitmap_records = 8 * mft_bitmap_length;
 
 	//printf("sizes: %d, %d.\n", mft_bitmap_length, mft_bitmap_records);
 
@@ -405,6 +435,7 @@ static int mft_bitmap_get_bit(s64 mft_no)
 }
 
 /**
+ * @mft_no: The number of the parent FILE record.
  * @attr_rec: The attribute record to check
  * @mft_rec: The parent FILE record.
  * @buflen: The size of the FILE record.
@@ -414,11 +445,9 @@ static int mft_bitmap_get_bit(s64 mft_no)
  *  otherwise: pointer to the next attribute record.
  *
  * The function only check fields that are inside this attr record.
- *
- * Assumes mft_rec is current_mft_record.
  */
-static ATTR_REC *check_attr_record(ATTR_REC *attr_rec, MFT_RECORD *mft_rec,
-			u16 buflen)
+static ATTR_REC *check_attr_record(s64 mft_no, ATTR_REC *attr_rec,
+			MFT_RECORD *mft_rec, u16 buflen)
 {
 	u16 name_offset;
 	u16 attrs_offset = le16_to_cpu(mft_rec->attrs_offset);
@@ -428,21 +457,22 @@ static ATTR_REC *check_attr_record(ATTR_REC *attr_rec, MFT_RECORD *mft_rec,
 	// Check that this attribute does not overflow the mft_record
 	if ((u8*)attr_rec+length >= ((u8*)mft_rec)+buflen) {
 		check_failed("Attribute (0x%x) is larger than FILE record (%lld).\n",
-				(int)attr_type, (long long)current_mft_record);
+				(int)attr_type, (long long)mft_no);
 		return NULL;
 	}
 
-	// Attr type must be a multiple of 0x10 and 0x10<=x<=0x100.
-	if ((attr_type & ~0x0F0) && (attr_type != 0x100)) {
-		check_failed("Unknown attribute type 0x%x.\n",
-			(int)attr_type);
-		goto check_attr_record_next_attr;
-	}
-
+	// Not sure where the next attribute is if the length is too short.
 	if (length<24) {
 		check_failed("Attribute %lld:0x%x Length too short (%u).\n",
-			(long long)current_mft_record, (int)attr_type,
+			(long long)mft_no, (int)attr_type,
 			(int)length);
+		return NULL;
+	}
+
+	// Attr type must be a multiple of 0x10 and 0x10<=x<=0x100.
+	if ((attr_type & ~0x0F0) && (attr_type != 0x100)) {
+		check_failed("Unknown attribute type %lld:0x%x.\n",
+			(long long)mft_no, (int)attr_type);
 		goto check_attr_record_next_attr;
 	}
 
@@ -450,34 +480,34 @@ static ATTR_REC *check_attr_record(ATTR_REC *attr_rec, MFT_RECORD *mft_rec,
 	// todo: instance number must be smaller than next_instance.
 	if ((u8*)attr_rec == ((u8*)mft_rec) + attrs_offset) {
 		if (!mft_rec->base_mft_record)
-			assert_u32_equal(attr_type, 0x10,
+			assert_u32_equal(mft_no, attr_type, 0x10,
 				"First attribute type");
 		// The following not always holds.
 		// attr 0x10 becomes instance 1 and attr 0x40 becomes 0.
 		//assert_u32_equal(attr_rec->instance, 0,
 		//	"First attribute instance number");
 	} else {
-		assert_u32_noteq(attr_type, 0x10,
+		assert_u32_noteq(mft_no, attr_type, 0x10,
 			"Not-first attribute type");
 		// The following not always holds.
 		//assert_u32_noteq(attr_rec->instance, 0,
 		//	"Not-first attribute instance number");
 	}
-	//if (current_mft_record==938 || current_mft_record==1683 || current_mft_record==3152 || current_mft_record==22410)
+	//if (mft_no==938 || mft_no==1683 || mft_no==3152 || mft_no==22410)
 	//printf("Attribute %lld:0x%x instance: %u isbase:%d.\n",
-	//		current_mft_record, (int)attr_type, (int)le16_to_cpu(attr_rec->instance), (int)mft_rec->base_mft_record);
+	//		mft_no, (int)attr_type, (int)le16_to_cpu(attr_rec->instance), (int)mft_rec->base_mft_record);
 	// todo: instance is unique.
 
 	// Check flags.
 	if (attr_rec->flags & ~(const_cpu_to_le16(0xc0ff))) {
 		check_failed("Attribute %lld:0x%x Unknown flags (0x%x).\n",
-			(long long)current_mft_record, (int)attr_type,
+			(long long)mft_no, (int)attr_type,
 			(int)le16_to_cpu(attr_rec->flags));
 	}
 
 	if (attr_rec->non_resident>1) {
 		check_failed("Attribute %lld:0x%x Unknown non-resident "
-			"flag (0x%x).\n", (long long)current_mft_record,
+			"flag (0x%x).\n", (long long)mft_no,
 			(int)attr_type, (int)attr_rec->non_resident);
 		goto check_attr_record_next_attr;
 	}
@@ -497,13 +527,13 @@ static ATTR_REC *check_attr_record(ATTR_REC *attr_rec, MFT_RECORD *mft_rec,
 		// Make sure all the fields exist.
 		if (length<64) {
 			check_failed("Non-resident attribute %lld:0x%x too short (%u).\n",
-				(long long)current_mft_record, (int)attr_type,
+				(long long)mft_no, (int)attr_type,
 				(int)length);
 			goto check_attr_record_next_attr;
 		}
 		if (attr_rec->compression_unit && (length<72)) {
 			check_failed("Compressed attribute %lld:0x%x too short (%u).\n",
-				(long long)current_mft_record, (int)attr_type,
+				(long long)mft_no, (int)attr_type,
 				(int)length);
 			goto check_attr_record_next_attr;
 		}
@@ -531,12 +561,14 @@ static ATTR_REC *check_attr_record(ATTR_REC *attr_rec, MFT_RECORD *mft_rec,
 		// Resident
 		if (attr_rec->name_length) {
 			if (name_offset < 24)
-				check_failed("Resident attribute with "
-					"name intersecting header.\n");
+				check_failed("Resident attribute %lld:0x%x "
+					"with name intersecting header.\n",
+					(long long)mft_no, (int)attr_type);
 			if (value_offset < name_offset +
 					attr_rec->name_length)
 				check_failed("Named resident attribute "
-					"with value before name.\n");
+					"%lld:0x%x with value before name.\n",
+					(long long)mft_no, (int)attr_type);
 		}
 		// if resident, length==value_length+value_offset
 		//assert_u32_equal(le32_to_cpu(attr_rec->value_length)+
@@ -544,24 +576,24 @@ static ATTR_REC *check_attr_record(ATTR_REC *attr_rec, MFT_RECORD *mft_rec,
 		//	"length==value_length+value_offset");
 		// if resident, length==value_length+value_offset
 		if (value_length+value_offset > length) {
-			check_failed("value_length(%d)+value_offset(%d)>length(%d) for attribute 0x%x.\n", (int)value_length, (int)value_offset, (int)length, (int)attr_type);
+			check_failed("value_length(%d)+value_offset(%d)>length(%d) for attribute %lld:0x%x.\n", (int)value_length, (int)value_offset, (int)length, (long long)mft_no, (int)attr_type);
 			return NULL;
 		}
 
 		// Check resident_flags.
 		if (attr_rec->resident_flags>0x01) {
-			check_failed("Unknown resident flags (0x%x) for attribute 0x%x.\n", (int)attr_rec->resident_flags, (int)attr_type);
+			check_failed("Unknown resident flags (0x%x) for attribute %lld:0x%x.\n", (int)attr_rec->resident_flags, (long long)mft_no, (int)attr_type);
 		} else if (attr_rec->resident_flags && (attr_type!=0x30)) {
-			check_failed("Resident flags mark attribute 0x%x as indexed.\n", (int)attr_type);
+			check_failed("Resident flags mark attribute %lld:0x%x as indexed.\n", (long long)mft_no, (int)attr_type);
 		}
 
 		// reservedR is 0.
-		assert_u32_equal(attr_rec->reservedR, 0, "Resident Reserved");
+		assert_u32_equal(mft_no, attr_rec->reservedR, 0,
+			"Resident Reserved");
 
 		// todo: attribute must not be 0xa0 (not sure about 0xb0, 0xe0, 0xf0)
 		// todo: check content well-formness per attr_type.
 	}
-	return 0;
 check_attr_record_next_attr:
 	return (ATTR_REC *)(((u8 *)attr_rec) + length);
 }
@@ -570,23 +602,30 @@ check_attr_record_next_attr:
  * All checks that can be satisfied only by data from the buffer.
  * No other [MFT records/metadata files] are required.
  *
- * The buffer is changed by removing the Update Sequence.
+ * The Update Sequence has already been removed from the buffer, and the
+ * record has been marked BAAD if it did not match.
  *
  * Return:
  *	0	Everything's cool.
  *	else	Consider this record as damaged.
  */
-static BOOL check_file_record(u8 *buffer, u16 buflen)
+static BOOL check_file_record(s64 mft_no, u8 *buffer, u16 buflen)
 {
-	u16 usa_count, usa_ofs, attrs_offset, usa;
-	u32 bytes_in_use, bytes_allocated, i;
+	u16 usa_count, usa_ofs, attrs_offset;
+	u32 bytes_in_use, bytes_allocated;
 	MFT_RECORD *mft_rec = (MFT_RECORD *)buffer;
 	ATTR_REC *attr_rec;
 
 	// check record magic
-	assert_u32_equal(le32_to_cpu(mft_rec->magic), le32_to_cpu(magic_FILE), "FILE record magic");
+	if (ntfs_is_baad_record(mft_rec->magic)) {
+		check_failed("Record %lld: update sequence mismatch.\n",
+			(long long)mft_no);
+		return 1;
+	}
+	if (assert_u32_equal(mft_no, le32_to_cpu(mft_rec->magic),
+			le32_to_cpu(magic_FILE), "FILE record magic"))
+		return 1;
 	// todo: records 16-23 must be filled in order.
-	// todo: what to do with magic_BAAD?
 
 	// check usa_count+offset to update seq <= attrs_offset <
 	//	bytes_in_use <= bytes_allocated <= buflen.
@@ -609,21 +648,14 @@ static BOOL check_file_record(u8 *buffer, u16 buflen)
 
 	// We should know all the flags.
 	if (le16_to_cpu(mft_rec->flags) > 0xf) {
-		check_failed("Unknown MFT record flags (0x%x).\n",
+		check_failed("Unknown MFT record flags %lld:(0x%x).\n",
+			(long long)mft_no,
 			(unsigned int)le16_to_cpu(mft_rec->flags));
 	}
 	// todo: flag in_use must be on.
 
-	// Remove update seq & check it.
-	usa = *(u16*)(buffer+usa_ofs); // The value that should be at the end of every sector.
-	assert_u32_equal(usa_count-1, buflen/NTFS_BLOCK_SIZE, "USA length");
-	for (i=1;i<usa_count;i++) {
-		u16 *fixup = (u16*)(buffer+NTFS_BLOCK_SIZE*i-2); // the value at the end of the sector.
-		u16 saved_val = *(u16*)(buffer+usa_ofs+2*i); // the actual data value that was saved in the us array.
-
-		assert_u32_equal(*fixup, usa, "fixup");
-		*fixup = saved_val; // remove it.
-	}
+	assert_u32_equal(mft_no, usa_count-1, buflen/NTFS_BLOCK_SIZE,
+		"USA length");
 
 	attr_rec = (ATTR_REC *)(buffer + attrs_offset);
 	while ((u8*)attr_rec<=buffer+buflen-4) {
@@ -635,13 +667,15 @@ static BOOL check_file_record(u8 *buffer, u16 buflen)
 		}
 		if ((u8*)attr_rec>buffer+buflen-8) {
 			// not AT_END yet no room for the length field.
-			check_failed("Attribute 0x%x is not AT_END, yet no "
-					"room for the length field.\n",
+			check_failed("Attribute %lld:0x%x is not AT_END, yet "
+					"no room for the length field.\n",
+					(long long)mft_no,
 					(int)le32_to_cpu(attr_rec->type));
 			return 1;
 		}
 
-		attr_rec = check_attr_record(attr_rec, mft_rec, buflen);
+		attr_rec = check_attr_record(mft_no, attr_rec, mft_rec,
+				buflen);
 		if (!attr_rec)
 			return 1;
 	}
@@ -666,12 +700,104 @@ static void replay_log(ntfs_volume *vol __attribute__((unused)))
 	unsupported++;
 }
 
-static void verify_mft_record(ntfs_volume *vol, s64 mft_num)
+/*
+ * A run of clusters allocated to an attribute, gathered while scanning
+ * the MFT for the cross-checks of cluster ownership.
+ */
+struct CLUSTER_RUN {
+	LCN lcn;
+	s64 length;
+	s64 mft_no;		/* the record holding the run */
+};
+
+/*
+ * State of the parallel scan of the MFT, shared by the checking threads
+ * and protected by the check lock.
+ */
+struct MFT_CHECK {
+	struct CLUSTER_RUN *runs;
+	s64 run_count;
+	s64 run_size;
+};
+
+/**
+ * Append the runs of a non-resident attribute to the list of allocated
+ * clusters.
+ *
+ * Return: 0 ok (even if the mapping pairs are damaged).
+ *	  -1 out of memory.
+ */
+static int collect_runs(ntfs_volume *vol, struct MFT_CHECK *check,
+			s64 mft_no, ATTR_RECORD *attr_rec)
 {
-	u8 *buffer;
-	int is_used;
+	runlist_element *rl;
+	runlist_element *prl;
+	struct CLUSTER_RUN *runs;
+	s64 size;
+	int res;
 
-	current_mft_record = mft_num;
+	rl = ntfs_mapping_pairs_decompress(vol, attr_rec, NULL);
+	if (!rl) {
+		check_failed("Attribute %lld:0x%x has bad mapping pairs.\n",
+			(long long)mft_no,
+			(int)le32_to_cpu(attr_rec->type));
+		return 0;
+	}
+	res = 0;
+	for (prl=rl; prl->length; prl++) {
+		if (prl->lcn < 0)
+			continue;
+		if ((prl->lcn + prl->length) > vol->nr_clusters) {
+			check_failed("Attribute %lld:0x%x has clusters beyond "
+				"the end of the volume (%lld).\n",
+				(long long)mft_no,
+				(int)le32_to_cpu(attr_rec->type),
+				(long long)(prl->lcn + prl->length));
+			continue;
+		}
+		ntfsck_lock();
+		if (check->run_count >= check->run_size) {
+			size = 2*(check->run_size + 64);
+			runs = (struct CLUSTER_RUN*)realloc(check->runs,
+					size*sizeof(struct CLUSTER_RUN));
+			if (runs) {
+				check->runs = runs;
+				check->run_size = size;
+			}
+		}
+		if (check->run_count < check->run_size) {
+			runs = &check->runs[check->run_count++];
+			runs->lcn = prl->lcn;
+			runs->length = prl->length;
+			runs->mft_no = mft_no;
+		} else
+			res = -1;
+		ntfsck_unlock();
+		if (res) {
+			errno = ENOMEM;
+			break;
+		}
+	}
+	free(rl);
+	return (res);
+}
+
+/**
+ * Check a record of the MFT, and collect the clusters it allocates.
+ *
+ * Called concurrently by the threads scanning the MFT, with the record
+ * already read and mst deprotected, or NULL if it could not be read.
+ *
+ * Return: 0 ok.
+ *	  -1 fatal error, stop the scan.
+ */
+static int verify_mft_record(ntfs_volume *vol, s64 mft_num,
+			MFT_RECORD *mrec, void *arg)
+{
+	struct MFT_CHECK *check = (struct MFT_CHECK*)arg;
+	ntfs_attr_search_ctx *ctx;
+	int is_used;
+	int res;
 
 	is_used = mft_bitmap_get_bit(mft_num);
 	if (is_used<0) {
@@ -680,20 +806,19 @@ static void verify_mft_record(ntfs_volume *vol, s64 mft_num)
 	} else if (!is_used) {
 		ntfs_log_verbose("Record %lld unused. Skipping.\n",
 				(long long)mft_num);
-		return;
+		return 0;
 	}
 
-	buffer = ntfs_malloc(vol->mft_record_size);
-	if (!buffer)
-		goto verify_mft_record_error;
+	if (!mrec) {
+		check_failed("Couldn't read $MFT record %lld.\n",
+			(long long)mft_num);
+		return 0;
+	}
 
 	ntfs_log_verbose("MFT record %lld\n", (long long)mft_num);
-	if (ntfs_attr_pread(vol->mft_na, mft_num*vol->mft_record_size, vol->mft_record_size, buffer) < 0) {
-		ntfs_log_perror("Couldn't read $MFT record %lld", (long long)mft_num);
-		goto verify_mft_record_error;
-	}
-	
-	check_file_record(buffer, vol->mft_record_size);
+	if (check_file_record(mft_num, (u8*)mrec, vol->mft_record_size)
+	    || !(mrec->flags & MFT_RECORD_IN_USE))
+		return 0;
 	// todo: if offset to first attribute >= 0x30, number of mft record should match.
 	// todo: Match the "record is used" with the mft bitmap.
 	// todo: if this is not base, check that the parent is a base, and is in use, and pointing to this record.
@@ -704,12 +829,114 @@ static void verify_mft_record(ntfs_volume *vol, s64 mft_num)
 	//   todo: Order of attributes.
 	//   todo: make sure compression_unit is the same.
 
-	return;
-verify_mft_record_error:
+	// The record is sane, collect the clusters of its attributes.
+	ctx = ntfs_attr_get_search_ctx(NULL, mrec);
+	if (!ctx)
+		return -1;
+	res = 0;
+	while (!res && !ntfs_attrs_walk(ctx)) {
+		if (ctx->attr->type == AT_END)
+			break;
+		if (ctx->attr->non_resident)
+			res = collect_runs(vol, check, mft_num, ctx->attr);
+	}
+	ntfs_attr_put_search_ctx(ctx);
+	return (res);
+}
+
+static int run_compare(const void *p1, const void *p2)
+{
+	const struct CLUSTER_RUN *r1 = (const struct CLUSTER_RUN*)p1;
+	const struct CLUSTER_RUN *r2 = (const struct CLUSTER_RUN*)p2;
 
-	if (buffer)
-		free(buffer);
-	errors++;
+	if (r1->lcn != r2->lcn)
+		return (r1->lcn < r2->lcn ? -1 : 1);
+	return (r1->mft_no < r2->mft_no ? -1 : (r1->mft_no > r2->mft_no));
+}
+
+/**
+ * Report the clusters in [start, end) whose $Bitmap bit is not the
+ * expected one, as ranges.
+ */
+static void check_bitmap_range(const u8 *bitmap, LCN start, LCN end,
+			int expected)
+{
+	LCN lcn;
+	LCN first;
+
+	for (lcn=start; lcn<end; lcn++) {
+		if (ntfs_bit_get(bitmap, lcn) == expected)
+			continue;
+		first = lcn;
+		while (((lcn + 1) < end)
+		    && (ntfs_bit_get(bitmap, lcn + 1) != expected))
+			lcn++;
+		if (expected) {
+			check_failed("Clusters %lld to %lld are allocated "
+				"but marked free in $Bitmap.\n",
+				(long long)first, (long long)lcn);
+		} else {
+			check_failed("Clusters %lld to %lld are marked in use "
+				"in $Bitmap but not allocated.\n",
+				(long long)first, (long long)lcn);
+		}
+	}
+}
+
+/**
+ * Cross-check the clusters allocated to the attributes: a cluster must
+ * not belong to two attributes, and the allocated clusters must be the
+ * ones marked in use in $Bitmap.
+ */
+static void check_clusters(ntfs_volume *vol, struct MFT_CHECK *check)
+{
+	struct CLUSTER_RUN *run;
+	u8 *bitmap;
+	s64 size;
+	s64 i;
+	LCN end;
+	LCN run_end;
+	s64 owner;
+
+	ntfs_log_info("Checking %lld cluster runs.\n",
+			(long long)check->run_count);
+	qsort(check->runs, check->run_count, sizeof(struct CLUSTER_RUN),
+			run_compare);
+	size = (vol->nr_clusters + 7) >> 3;
+	bitmap = (u8*)ntfs_malloc(size);
+	if (bitmap && (ntfs_attr_pread(vol->lcnbmp_na, 0, size, bitmap)
+				!= size)) {
+		ntfs_log_perror("Couldn't read $Bitmap");
+		errors++;
+		free(bitmap);
+		bitmap = (u8*)NULL;
+	}
+	end = 0;
+	owner = -1;
+	for (i=0; i<check->run_count; i++) {
+		run = &check->runs[i];
+		run_end = run->lcn + run->length;
+		if (run->lcn < end) {
+			check_failed("Clusters %lld to %lld are allocated to "
+				"both records %lld and %lld.\n",
+				(long long)run->lcn,
+				(long long)((run_end < end ? run_end : end) - 1),
+				(long long)owner, (long long)run->mft_no);
+		} else if (bitmap)
+			check_bitmap_range(bitmap, end, run->lcn, 0);
+		if (run_end > end) {
+			if (bitmap)
+				check_bitmap_range(bitmap,
+					(run->lcn > end ? run->lcn : end),
+					run_end, 1);
+			end = run_end;
+			owner = run->mft_no;
+		}
+	}
+	if (bitmap) {
+		check_bitmap_range(bitmap, end, vol->nr_clusters, 0);
+		free(bitmap);
+	}
 }
 
 /**
@@ -720,7 +947,6 @@ verify_mft_record_error:
  */
 static int verify_mft_preliminary(ntfs_volume *rawvol)
 {
-	current_mft_record = 0;
 	s64 mft_offset, mftmirr_offset;
 	int res;
 
@@ -764,7 +990,8 @@ static int verify_mft_preliminary(ntfs_volume *rawvol)
 
 static void check_volume(ntfs_volume *vol)
 {
-	s64 mft_num, nr_mft_records;
+	struct MFT_CHECK check;
+	s64 nr_mft_records;
 
 	ntfs_log_warning("Unsupported: check_volume()\n");
 	unsupported++;
@@ -774,16 +1001,19 @@ static void check_volume(ntfs_volume *vol)
 			vol->mft_record_size_bits;
 	ntfs_log_info("Checking %lld MFT records.\n", (long long)nr_mft_records);
 
-	for (mft_num=0; mft_num < nr_mft_records; mft_num++) {
-	 	verify_mft_record(vol, mft_num);
-	}
+	// The records are read in batches and checked by several threads.
+	memset(&check, 0, sizeof(check));
+	if (ntfs_mft_scan_parallel(vol, 0, nr_mft_records, 0,
+			verify_mft_record, &check)) {
+		ntfs_log_perror("Couldn't scan the MFT");
+		errors++;
+	} else
+		check_clusters(vol, &check);
+	free(check.runs);
 
 	// todo: Check metadata files.
 
 	// todo: Second pass on mft records. Now check the contents as well.
-	// todo: When going through runlists, build a bitmap.
-
-	// todo: cluster accounting.
 	return;
 }
 
@@ -64,6 +64,12 @@
 #ifdef HAVE_SYS_MOUNT_H
 #include <sys/mount.h>
 #endif
+#ifdef ENABLE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
 
 /*
  * FIXME: ntfsclone do bad things about endians handling. Fix it and remove
@@ -97,6 +103,9 @@
 #if defined(linux) && defined(_IOR) && !defined(BLKGETSIZE64)
 #define BLKGETSIZE64	_IOR(0x12,114,size_t)	/* Get device size in bytes. */
 #endif
+#if defined(linux) && defined(_IO) && !defined(BLKDISCARD)
+#define BLKDISCARD	_IO(0x12,119)	/* Discard a range of bytes. */
+#endif
 
 #if defined(linux) || defined(__uClinux__) || defined(__sun) \
 		|| defined(__APPLE__) || defined(__DARWIN__)
@@ -161,8 +170,15 @@ static struct {
 	int metadata_image;
 	int preserve_timestamps;
 	int restore_image;
+	int compress;
+	int threads;
+	int verify;		/* check an image, or a device against it */
+	int discard;		/* discard the output device first */
+	char *differential;	/* previous image */
 	char *output;
 	char *volume;
+	char **next_images;	/* differential images to restore after */
+	int next_image_count;
 #ifndef NO_STATFS
 	struct statfs stfs;
 #endif
@@ -212,6 +228,10 @@ static unsigned int wiped_unused_mft      = 0;
 static unsigned int wiped_resident_data   = 0;
 static unsigned int wiped_timestamp_data  = 0;
 
+	/* the records of metadata images may be wiped by several threads */
+#define count_wiped(counter, n) \
+		__atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+
 static le64 volume_serial_number; /* new random serial number */
 static u64 full_device_size; /* full size, including the backup boot sector */
 
@@ -237,9 +257,20 @@ static BOOL image_is_host_endian = FALSE;
  * doubt, bump the major version.
  *
  * Moved to 10.1 : Alternate boot sector now saved. Still compatible.
+ *
+ * Version 11.0 is the block image format, used when compressing.
+ * Version 11.1 is a differential block image, only holding the blocks
+ * which changed since a previous image.
  */
 #define NTFSCLONE_IMG_VER_MAJOR	10
 #define NTFSCLONE_IMG_VER_MINOR	1
+#define NTFSCLONE_IMG_VER_MAJOR_BLOCKS	11
+#define NTFSCLONE_IMG_VER_MINOR_BLOCKS	0
+#define NTFSCLONE_IMG_VER_MINOR_DIFF	1
+
+#define INDEX_MAGIC "\0ntfsclone-index"
+#define IMAGE_COMPRESSION_LEVEL 1 /* fast zlib compression */
+#define IMAGE_MAX_THREADS 16 /* default max count of threads */
 
 enum { CMD_GAP, CMD_NEXT } ;
 
@@ -270,13 +301,17 @@ static int compare_bitmaps(struct bitmap *a, BOOL copy);
 #define LAST_METADATA_INODE	11
 
 #define NTFS_MAX_CLUSTER_SIZE	65536
+#define NTFS_COPY_RUN_SIZE	4194304	/* max bytes copied at once */
 #define NTFS_SECTOR_SIZE	  512
+#define WIPE_CHUNK		   64	/* records wiped by a thread at once */
 
 #define rounded_up_division(a, b) (((a) + (b - 1)) / (b))
 
 #define read_all(f, p, n)  io_all((f), (p), (n), 0)
 #define write_all(f, p, n) io_all((f), (p), (n), 1)
 
+static u16 bytes_per_sector = NTFS_SECTOR_SIZE; /* of the boot sectors */
+
 __attribute__((format(printf, 1, 2)))
 static void Printf(const char *fmt, ...)
 {
@@ -352,13 +387,20 @@ static void perr_exit(const char *fmt, ...)
 __attribute__((noreturn))
 static void usage(int ret)
 {
-	fprintf(stderr, "\nUsage: %s [OPTIONS] SOURCE\n"
+	fprintf(stderr, "\nUsage: %s [OPTIONS] SOURCE [DIFFERENTIAL ...]\n"
+		"       %s --verify [OPTIONS] IMAGE [DEVICE]\n"
 		"    Efficiently clone NTFS to a sparse file, image, device or standard output.\n"
 		"\n"
 		"    -o, --output FILE      Clone NTFS to the non-existent FILE\n"
 		"    -O, --overwrite FILE   Clone NTFS to FILE, overwriting if exists\n"
 		"    -s, --save-image       Save to the special image format\n"
 		"    -r, --restore-image    Restore from the special image format\n"
+		"    -z, --compress         Save to the compressed block image format\n"
+		"        --threads N        Use N threads for compressing, wiping, restoring\n"
+		"                           or verifying\n"
+		"        --differential PREVIOUS Only save what changed since PREVIOUS\n"
+		"        --verify           Check SOURCE, or a DEVICE against it\n"
+		"        --discard          Discard the output device before writing\n"
 		"        --rescue           Continue after disk read errors\n"
 		"    -m, --metadata         Clone *only* metadata (for NTFS experts)\n"
 		"    -n, --no-action        Test restoring, without outputting anything\n"
@@ -376,7 +418,8 @@ static void usage(int ret)
 		"\n"
 		"    If FILE is '-' then send the image to the standard output. If SOURCE is '-'\n"
 		"    and --restore-image is used then read the image from the standard input.\n"
-		"\n", EXEC_NAME);
+		"    When restoring, the DIFFERENTIAL images are applied in order after SOURCE.\n"
+		"\n", EXEC_NAME, EXEC_NAME);
 	fprintf(stderr, "%s%s", ntfs_bugs, ntfs_home);
 	exit(ret);
 }
@@ -398,7 +441,7 @@ static void version(void)
 
 static void parse_options(int argc, char **argv)
 {
-	static const char *sopt = "-dfhmno:O:qrstV";
+	static const char *sopt = "-dfhmno:O:qrstVz";
 	static const struct option lopt[] = {
 #ifdef DEBUG
 		{ "debug",	      no_argument,	 NULL, 'd' },
@@ -416,6 +459,11 @@ static void parse_options(int argc, char **argv)
 		{ "new-serial",       no_argument,	 NULL, 'I' },
 		{ "new-half-serial",  no_argument,	 NULL, 'i' },
 		{ "save-image",	      no_argument,	 NULL, 's' },
+		{ "compress",	      no_argument,	 NULL, 'z' },
+		{ "threads",	      required_argument, NULL, 'T' },
+		{ "differential",     required_argument, NULL, 'P' },
+		{ "verify",	      no_argument,	 NULL, 'Y' },
+		{ "discard",	      no_argument,	 NULL, 'D' },
 		{ "preserve-timestamps",   no_argument,  NULL, 't' },
 		{ "version",	      no_argument,	 NULL, 'V' },
 		{ NULL, 0, NULL, 0 }
@@ -428,9 +476,17 @@ static void parse_options(int argc, char **argv)
 	while ((c = getopt_long(argc, argv, sopt, lopt, NULL)) != -1) {
 		switch (c) {
 		case 1:	/* A non-option argument */
-			if (opt.volume)
-				usage(1);
-			opt.volume = argv[optind-1];
+			if (opt.volume) {
+				if (!opt.next_images) {
+					opt.next_images = (char**)ntfs_malloc(
+							argc*sizeof(char*));
+					if (!opt.next_images)
+						perr_exit("parse_options");
+				}
+				opt.next_images[opt.next_image_count++]
+						= argv[optind-1];
+			} else
+				opt.volume = argv[optind-1];
 			break;
 		case 'd':
 			opt.debug++;
@@ -479,6 +535,26 @@ static void parse_options(int argc, char **argv)
 		case 't':
 			opt.preserve_timestamps++;
 			break;
+		case 'T':	/* not proposed as a short option */
+			opt.threads = atoi(optarg);
+			if (opt.threads < 1) {
+				err_printf("Bad count of threads '%s'.\n",
+						optarg);
+				usage(1);
+			}
+			break;
+		case 'Y':	/* not proposed as a short option */
+			opt.verify++;
+			break;
+		case 'D':	/* not proposed as a short option */
+			opt.discard++;
+			break;
+		case 'P':	/* not proposed as a short option */
+			opt.differential = optarg;
+		case 'z':
+			opt.compress++;
+			opt.save_image++;
+			break;
 		case 'V':
 			version();
 			break;
@@ -488,12 +564,30 @@ static void parse_options(int argc, char **argv)
 		}
 	}
 
-	if (!opt.no_action && (opt.output == NULL)) {
+	if (opt.verify) {
+		if (opt.volume == NULL) {
+			err_printf("You must specify an image.\n");
+			usage(1);
+		}
+		if (opt.next_image_count > 1) {
+			err_printf("Only one device can be verified\n");
+			usage(1);
+		}
+		if (!strcmp(opt.volume, "-"))
+			err_exit("An image read from standard input cannot "
+				 "be verified\n");
+		if (opt.output || opt.save_image || opt.restore_image
+		    || opt.metadata || opt.no_action || opt.differential)
+			err_exit("Verifying an image cannot be combined with "
+				 "saving or restoring\n");
+	}
+
+	if (!opt.no_action && !opt.verify && (opt.output == NULL)) {
 		err_printf("You must specify an output file.\n");
 		usage(1);
 	}
 
-	if (!opt.no_action && (strcmp(opt.output, "-") == 0))
+	if (opt.output && (strcmp(opt.output, "-") == 0))
 		opt.std_out++;
 
 	if (opt.volume == NULL) {
@@ -501,6 +595,12 @@ static void parse_options(int argc, char **argv)
 		usage(1);
 	}
 
+	if (opt.next_image_count && !opt.restore_image && !opt.verify) {
+		err_printf("Several sources are only allowed when "
+				"restoring\n");
+		usage(1);
+	}
+
 	if (!opt.restore_image && !strcmp(opt.volume, "-")) {
 		err_printf("Only special images can be read from standard input\n");
 		usage(1);
@@ -526,13 +626,37 @@ static void parse_options(int argc, char **argv)
 		err_exit("Saving and restoring an image at the same time "
 			 "is not supported!\n");
 
+	if (opt.compress && opt.metadata)
+		err_exit("Compressing a metadata image is not supported!\n");
+
+#ifndef ENABLE_ZLIB
+	if (opt.compress)
+		err_exit("This ntfsclone was built without compression "
+			 "support\n");
+#endif
+
+	if (!opt.threads) {
+#ifdef _SC_NPROCESSORS_ONLN
+		opt.threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+		if (opt.threads > IMAGE_MAX_THREADS)
+			opt.threads = IMAGE_MAX_THREADS;
+		if (opt.threads < 1)
+			opt.threads = 1;
+	}
+
 	if (opt.no_action && !opt.restore_image)
 		err_exit("A restoring test requires the restore option!\n");
 
 	if (opt.no_action && opt.output)
 		err_exit("A restoring test requires not defining any output!\n");
 
-	if (!opt.no_action && !opt.std_out) {
+	if (opt.discard
+	    && (opt.std_out || !opt.output || opt.save_image
+		|| opt.metadata_image))
+		err_exit("Discarding requires an output device or file!\n");
+
+	if (opt.output && !opt.std_out) {
 		struct stat st;
 #ifdef HAVE_WINDOWS_H
 		BOOL blkdev = opt.output[0] && (opt.output[1] == ':')
@@ -681,14 +805,15 @@ static int io_all(void *fd, void *buf, int count, int do_write)
 				else
 					i = write(*(int *)fd, buf, count);
 			}
-		} else if (opt.restore_image)
+		} else if (opt.restore_image || opt.verify)
 			i = read(*(int *)fd, buf, count);
 		else
 			i = dev->d_ops->read(dev, buf, count);
 		if (i < 0) {
 			if (errno != EAGAIN && errno != EINTR)
 				return -1;
-		} else if (i == 0 && !do_write && opt.restore_image) {
+		} else if (i == 0 && !do_write
+				&& (opt.restore_image || opt.verify)) {
 			return -1;
 		} else {
 			count -= i;
@@ -748,6 +873,64 @@ static void read_rescue(void *fd, char *buff, u32 csize, u32 bytes_per_sector,
 	}
 }
 
+static void write_failed(void)
+{
+#ifndef NO_STATFS
+	int err = errno;
+	perr_printf("Write failed");
+	if (err == EIO && opt.stfs.f_type == 0x517b)
+		Printf("Apparently you tried to clone to a remote "
+		       "Windows computer but they don't\nhave "
+		       "efficient sparse file handling by default. "
+		       "Please try a different method.\n");
+	exit(1);
+#else
+	perr_printf("Write failed");
+#endif
+}
+
+/*
+ *		Set the new serial number into a boot sector
+ *
+ *	@buff is the first cluster when @lcn is zero, and it ends with the
+ *	backup boot sector otherwise, @csize being the bytes in it.
+ */
+
+static void set_new_serial(char *buff, u64 lcn, s32 csize)
+{
+	NTFS_BOOT_SECTOR *bs;
+	le64 mask;
+
+		/*
+		 * For updating the backup boot sector, we need to
+		 * know the sector size, but this is not recorded
+		 * in the image header, so we collect it on the fly
+		 * while reading the first boot sector.
+		 */
+	if (!lcn) {
+		bs = (NTFS_BOOT_SECTOR*)buff;
+		bytes_per_sector = le16_to_cpu(bs->bpb.bytes_per_sector);
+		if ((bytes_per_sector > csize)
+		    || (bytes_per_sector < NTFS_SECTOR_SIZE))
+			bytes_per_sector = NTFS_SECTOR_SIZE;
+	} else
+		bs = (NTFS_BOOT_SECTOR*)(buff
+					+ csize - bytes_per_sector);
+	if (opt.new_serial & 2)
+		bs->volume_serial_number = volume_serial_number;
+	else {
+		mask = const_cpu_to_le64(~0x0ffffffffULL);
+		bs->volume_serial_number
+		    = (volume_serial_number & mask)
+			| (bs->volume_serial_number & ~mask);
+	}
+		/* Show the new full serial after merging */
+	if (!lcn)
+		Printf("New serial number      : 0x%llx\n",
+			(long long)le64_to_cpu(
+					bs->volume_serial_number));
+}
+
 static void copy_cluster(int rescue, u64 rescue_lcn, u64 lcn)
 {
 	char buff[NTFS_MAX_CLUSTER_SIZE]; /* overflow checked at mount time */
@@ -756,9 +939,6 @@ static void copy_cluster(int rescue, u64 rescue_lcn, u64 lcn)
 	BOOL backup_bootsector;
 	void *fd = (void *)&fd_in;
 	off_t rescue_pos;
-	NTFS_BOOT_SECTOR *bs;
-	le64 mask;
-	static u16 bytes_per_sector = NTFS_SECTOR_SIZE;
 
 	if (!opt.restore_image) {
 		csize = vol->cluster_size;
@@ -800,36 +980,8 @@ static void copy_cluster(int rescue, u64 rescue_lcn, u64 lcn)
 		/* Set the new serial number if requested */
 	if (opt.new_serial
 	    && !opt.save_image
-	    && (!lcn || backup_bootsector)) {
-			/*
-			 * For updating the backup boot sector, we need to
-			 * know the sector size, but this is not recorded
-			 * in the image header, so we collect it on the fly
-			 * while reading the first boot sector.
-			 */
-		if (!lcn) {
-			bs = (NTFS_BOOT_SECTOR*)buff;
-			bytes_per_sector = le16_to_cpu(bs->bpb.bytes_per_sector);
-			if ((bytes_per_sector > csize)
-			    || (bytes_per_sector < NTFS_SECTOR_SIZE))
-				bytes_per_sector = NTFS_SECTOR_SIZE;
-		} else
-			bs = (NTFS_BOOT_SECTOR*)(buff
-						+ csize - bytes_per_sector);
-		if (opt.new_serial & 2)
-			bs->volume_serial_number = volume_serial_number;
-		else {
-			mask = const_cpu_to_le64(~0x0ffffffffULL);
-			bs->volume_serial_number
-			    = (volume_serial_number & mask)
-				| (bs->volume_serial_number & ~mask);
-		}
-			/* Show the new full serial after merging */
-		if (!lcn)
-			Printf("New serial number      : 0x%llx\n",
-				(long long)le64_to_cpu(
-						bs->volume_serial_number));
-	}
+	    && (!lcn || backup_bootsector))
+		set_new_serial(buff, lcn, csize);
 
 	if (opt.save_image || (opt.metadata_image && wipe)) {
 		char cmd = CMD_NEXT;
@@ -838,20 +990,8 @@ static void copy_cluster(int rescue, u64 rescue_lcn, u64 lcn)
 	}
 
 	if ((!opt.metadata_image || wipe)
-	    && (write_all(&fd_out, buff, csize) == -1)) {
-#ifndef NO_STATFS
-		int err = errno;
-		perr_printf("Write failed");
-		if (err == EIO && opt.stfs.f_type == 0x517b)
-			Printf("Apparently you tried to clone to a remote "
-			       "Windows computer but they don't\nhave "
-			       "efficient sparse file handling by default. "
-			       "Please try a different method.\n");
-		exit(1);
-#else
-		perr_printf("Write failed");
-#endif
-	}
+	    && (write_all(&fd_out, buff, csize) == -1))
+		write_failed();
 }
 
 static s64 lseek_out(int fd, s64 pos, int mode)
@@ -881,6 +1021,43 @@ static void lseek_to_cluster(s64 lcn)
 			perr_exit("lseek output");
 }
 
+/*
+ *		Copy a run of used clusters
+ *
+ *	The run is read and written at once, possibly with the commands
+ *	of the image interleaved. It must not include the boot sectors,
+ *	which may have to be updated. If the run cannot be read, the
+ *	clusters are copied one by one, so that only the faulty ones
+ *	have to be rescued.
+ */
+
+static void copy_clusters(u64 lcn, u32 count, char *buff, char *image)
+{
+	u32 csize = vol->cluster_size;
+	u32 i;
+
+	if (read_all(vol->dev, buff, count*csize) == -1) {
+		if (errno != EIO)
+			perr_exit("read_all");
+		for (i=0; i<count; i++) {
+			lseek_to_cluster(lcn + i);
+			copy_cluster(opt.rescue, lcn + i, lcn + i);
+		}
+	} else {
+		if (opt.save_image) {
+			for (i=0; i<count; i++) {
+				image[i*(csize + 1)] = CMD_NEXT;
+				memcpy(&image[i*(csize + 1) + 1],
+					&buff[i*csize], csize);
+			}
+			if (write_all(&fd_out, image, count*(csize + 1)) == -1)
+				write_failed();
+		} else
+			if (write_all(&fd_out, buff, count*csize) == -1)
+				write_failed();
+	}
+}
+
 static void gap_to_cluster(s64 gap)
 {
 	sle64 count;
@@ -925,11 +1102,667 @@ static void write_image_hdr(void)
 	}
 }
 
+/*
+ *		Images made of blocks
+ *
+ *	In the block image format (version 11), the used clusters are
+ *	stored as blocks of consecutive clusters, each of them preceded
+ *	by a struct image_block and compressed independently of the
+ *	others. The blocks are followed by an empty block, an index of
+ *	all the blocks and a trailer which locates the index, so that any
+ *	block can be found without reading the previous ones.
+ *
+ *	When saving, the blocks are compressed by several threads while
+ *	the next clusters are being read, and they are written in their
+ *	order. When restoring from a file, the blocks are found through
+ *	the index and several threads restore them, and when restoring
+ *	from a stream, they are restored in their order.
+ *
+ *	The index records a checksum of every block, so that a
+ *	differential image (version 11.1) only has to store the blocks
+ *	which differ from the ones of a previous image. Its index still
+ *	describes all the blocks, the ones which are not stored having
+ *	a zero offset, so that the next differential image can be based
+ *	on it. The trailer identifies the image and the previous one,
+ *	for checking the order of a chain of images when restoring.
+ */
+
+/* All values are in little endian. */
+struct image_block {
+	le64 lcn;		/* First cluster of the block */
+	le32 length;		/* Bytes in the clusters, zero for the end */
+	le32 size;		/* Bytes stored, compressed if less than length */
+} __attribute__((__packed__));
+
+struct image_index {
+	struct image_block block;
+	le64 offset;		/* Of the block from start of image_hdr,
+				   zero if stored in a previous image */
+	le64 checksum;		/* Of the clusters in the block */
+} __attribute__((__packed__));
+
+struct image_trailer {
+	le64 index_offset;	/* From start of image_hdr */
+	le64 block_count;
+	le64 image_id;		/* Checksum of the index */
+	le64 base_id;		/* Id of the previous image, zero if none */
+	char magic[IMAGE_MAGIC_SIZE];
+} __attribute__((__packed__));
+
+enum { JOB_FREE, JOB_FILLED, JOB_BUSY, JOB_DONE } ;
+
+struct block_job {
+	u64 lcn;
+	u32 length;
+	u32 size;		/* compressed size, or length if not smaller,
+				   zero if unchanged from the previous image */
+	u64 checksum;
+	int state;
+	char *data;
+	char *packed;
+} ;
+
+static struct {
+	struct block_job *jobs;
+	int job_count;
+	int thread_count;	/* zero if compressing inline */
+	u64 next_fill;		/* sequence of the next job to fill */
+	u64 next_write;		/* sequence of the next job to write */
+	s64 offset;		/* of the next block in the image */
+	struct image_index *index;
+	s64 index_count;
+	s64 index_size;
+	struct image_index *previous;	/* index of the previous image */
+	s64 previous_count;
+	le64 base_id;
+	BOOL stop;
+#ifdef ENABLE_THREADS
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t *threads;
+#endif
+} blocks;
+
+/*
+ *		Read from a position in an image file
+ *
+ *	The position in the file is not restored.
+ */
+
+static int read_at(int fd, void *buf, u32 count, s64 pos)
+{
+	ssize_t i;
+
+	if (lseek(fd, pos, SEEK_SET) != (off_t)pos)
+		return (-1);
+	while (count > 0) {
+		i = read(fd, buf, count);
+		if (i < 0) {
+			if ((errno != EAGAIN) && (errno != EINTR))
+				return (-1);
+		} else if (!i) {
+			errno = 0;
+			return (-1);
+		} else {
+			count -= i;
+			buf = i + (char*)buf;
+		}
+	}
+	return (0);
+}
+
+/*
+ *		Read the trailer and the index of the blocks of an image
+ *
+ *	Returns the allocated index, or NULL if the image is not a file
+ *	or has no valid index. The position in the file is preserved.
+ */
+
+static struct image_index *read_image_index(int fd,
+			struct image_trailer *trailer, s64 *pcount)
+{
+	struct image_index *index;
+	struct stat st;
+	s64 index_offset;
+	s64 count;
+	off_t pos;
+
+	index = (struct image_index*)NULL;
+	pos = lseek(fd, 0, SEEK_CUR);
+	if ((pos != (off_t)-1)
+	    && !fstat(fd, &st) && S_ISREG(st.st_mode)
+	    && (st.st_size >= (off_t)sizeof(*trailer))
+	    && !read_at(fd, trailer, sizeof(*trailer),
+				st.st_size - sizeof(*trailer))
+	    && !memcmp(trailer->magic, INDEX_MAGIC, IMAGE_MAGIC_SIZE)) {
+		index_offset = le64_to_cpu(trailer->index_offset);
+		count = le64_to_cpu(trailer->block_count);
+		if ((index_offset > 0) && (count >= 0)
+		    && (count <= st.st_size/(s64)sizeof(struct image_index))
+		    && ((index_offset + count*sizeof(struct image_index)
+				+ sizeof(*trailer)) == (u64)st.st_size)) {
+			index = (struct image_index*)
+				ntfs_malloc(count*sizeof(struct image_index)
+							+ 1);
+			if (index
+			    && read_at(fd, index,
+					count*sizeof(struct image_index),
+					index_offset)) {
+				free(index);
+				index = (struct image_index*)NULL;
+			}
+			*pcount = count;
+		}
+	}
+	if ((pos != (off_t)-1) && (lseek(fd, pos, SEEK_SET) != pos))
+		perr_exit("lseek image");
+	return (index);
+}
+
+/*
+ *		Lock the blocks when several threads are processing them
+ */
+
+static void lock_blocks(void)
+{
+#ifdef ENABLE_THREADS
+	if (blocks.thread_count)
+		pthread_mutex_lock(&blocks.lock);
+#endif
+}
+
+static void unlock_blocks(void)
+{
+#ifdef ENABLE_THREADS
+	if (blocks.thread_count)
+		pthread_mutex_unlock(&blocks.lock);
+#endif
+}
+
+/*
+ *		Checksum of the clusters in a block
+ *
+ *	This is xxHash64 with a zero seed, which processes four 64-bit
+ *	lanes in parallel, so that checksumming is much faster than
+ *	compressing. It is used for detecting the blocks which changed
+ *	since a previous image and for verifying an image, not as a
+ *	protection against deliberate changes.
+ */
+
+#define XXH_P1 0x9e3779b185ebca87ULL
+#define XXH_P2 0xc2b2ae3d27d4eb4fULL
+#define XXH_P3 0x165667b19e3779f9ULL
+#define XXH_P4 0x85ebca77c2b2ae63ULL
+#define XXH_P5 0x27d4eb2f165667c5ULL
+
+static inline u64 xxh_rotl(u64 x, int r)
+{
+	return ((x << r) | (x >> (64 - r)));
+}
+
+static inline u64 xxh_read64(const char *p)
+{
+	le64 word;
+
+	memcpy(&word, p, sizeof(word));
+	return (le64_to_cpu(word));
+}
+
+static inline u64 xxh_round(u64 acc, u64 input)
+{
+	return (xxh_rotl(acc + input*XXH_P2, 31)*XXH_P1);
+}
+
+static inline u64 xxh_merge(u64 h, u64 v)
+{
+	return ((h ^ xxh_round(0, v))*XXH_P1 + XXH_P4);
+}
+
+static u64 block_checksum(const char *data, u32 length)
+{
+	const char *p = data;
+	const char *end = data + length;
+	u64 v1, v2, v3, v4;
+	le32 word;
+	u64 h;
+
+	if (length >= 32) {
+		v1 = XXH_P1 + XXH_P2;
+		v2 = XXH_P2;
+		v3 = 0;
+		v4 = -XXH_P1;
+		do {
+			v1 = xxh_round(v1, xxh_read64(p));
+			v2 = xxh_round(v2, xxh_read64(p + 8));
+			v3 = xxh_round(v3, xxh_read64(p + 16));
+			v4 = xxh_round(v4, xxh_read64(p + 24));
+			p += 32;
+		} while (p <= (end - 32));
+		h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7)
+			+ xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+		h = xxh_merge(h, v1);
+		h = xxh_merge(h, v2);
+		h = xxh_merge(h, v3);
+		h = xxh_merge(h, v4);
+	} else
+		h = XXH_P5;
+	h += length;
+	for ( ; (p + 8)<=end; p+=8)
+		h = xxh_rotl(h ^ xxh_round(0, xxh_read64(p)), 27)*XXH_P1
+			+ XXH_P4;
+	if ((p + 4) <= end) {
+		memcpy(&word, p, sizeof(word));
+		h = xxh_rotl(h ^ (le32_to_cpu(word)*XXH_P1), 23)*XXH_P2
+			+ XXH_P3;
+		p += 4;
+	}
+	for ( ; p<end; p++)
+		h = xxh_rotl(h ^ ((u8)*p*XXH_P5), 11)*XXH_P1;
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	h ^= h >> 32;
+	return (h);
+}
+
+/*
+ *		Check whether a block is the same in the previous image
+ *
+ *	As the blocks are in the order of clusters, the previous index
+ *	is searched by dichotomy.
+ */
+
+static BOOL unchanged_block(const struct block_job *job)
+{
+	const struct image_index *entry;
+	s64 low, high, mid;
+	BOOL same;
+
+	same = FALSE;
+	low = 0;
+	high = blocks.previous_count;
+	while (!same && (low < high)) {
+		mid = (low + high)/2;
+		entry = &blocks.previous[mid];
+		if (le64_to_cpu(entry->block.lcn) < job->lcn)
+			low = mid + 1;
+		else if (le64_to_cpu(entry->block.lcn) > job->lcn)
+			high = mid;
+		else {
+			same = (le32_to_cpu(entry->block.length)
+					== job->length)
+				&& (le64_to_cpu(entry->checksum)
+					== job->checksum);
+			high = low;
+		}
+	}
+	return (same);
+}
+
+static u32 packed_size(u32 length)
+{
+#ifdef ENABLE_ZLIB
+	return (compressBound(length));
+#else
+	return (length);
+#endif
+}
+
+/*
+ *		Compress the clusters of a block
+ *
+ *	Returns the compressed size, or the length when compressing
+ *	does not make the data smaller
+ */
+
+static u32 pack_block(const char *data, u32 length, char *packed)
+{
+	u32 size;
+#ifdef ENABLE_ZLIB
+	uLongf plen;
+
+	plen = packed_size(length);
+	if ((compress2((Bytef*)packed, &plen, (const Bytef*)data,
+			length, IMAGE_COMPRESSION_LEVEL) == Z_OK)
+	    && (plen < length))
+		size = plen;
+	else
+		size = length;
+#else
+	size = length;
+#endif
+	return (size);
+}
+
+/*
+ *		Process a block which has been read, in any thread
+ */
+
+static void process_block_job(struct block_job *job)
+{
+	job->checksum = block_checksum(job->data, job->length);
+	if (blocks.previous && unchanged_block(job))
+		job->size = 0;
+	else
+		job->size = pack_block(job->data, job->length, job->packed);
+}
+
+static void write_block_job(struct block_job *job)
+{
+	struct image_index *entry;
+	struct image_block block;
+
+	if (blocks.index_count >= blocks.index_size) {
+		blocks.index_size += 1024;
+		blocks.index = (struct image_index*)realloc(blocks.index,
+				blocks.index_size*sizeof(struct image_index));
+		if (!blocks.index)
+			perr_exit("realloc block index");
+	}
+	block.lcn = cpu_to_le64(job->lcn);
+	block.length = cpu_to_le32(job->length);
+	block.size = cpu_to_le32(job->size);
+	entry = &blocks.index[blocks.index_count++];
+	entry->block = block;
+	entry->checksum = cpu_to_le64(job->checksum);
+	if (job->size) {
+		entry->offset = cpu_to_le64(blocks.offset);
+		if ((write_all(&fd_out, &block, sizeof(block)) == -1)
+		    || (write_all(&fd_out,
+			    (job->size < job->length ? job->packed : job->data),
+			    job->size) == -1))
+			write_failed();
+		blocks.offset += sizeof(block) + job->size;
+	} else
+		entry->offset = const_cpu_to_le64(0);
+}
+
+#ifdef ENABLE_THREADS
+
+/*
+ *		Thread compressing the blocks, in no specific order
+ */
+
+static void *pack_thread(void *arg __attribute__((unused)))
+{
+	struct block_job *job;
+	u64 seq;
+
+	pthread_mutex_lock(&blocks.lock);
+	while (!blocks.stop) {
+		job = (struct block_job*)NULL;
+		for (seq=blocks.next_write; !job && (seq<blocks.next_fill);
+				seq++)
+			if (blocks.jobs[seq % blocks.job_count].state
+					== JOB_FILLED)
+				job = &blocks.jobs[seq % blocks.job_count];
+		if (job) {
+			job->state = JOB_BUSY;
+			pthread_mutex_unlock(&blocks.lock);
+			process_block_job(job);
+			pthread_mutex_lock(&blocks.lock);
+			job->state = JOB_DONE;
+			pthread_cond_broadcast(&blocks.cond);
+		} else
+			pthread_cond_wait(&blocks.cond, &blocks.lock);
+	}
+	pthread_mutex_unlock(&blocks.lock);
+	return ((void*)NULL);
+}
+
+#endif
+
+/*
+ *		Write the compressed blocks up to a sequence, in their order
+ */
+
+static void write_block_jobs(u64 upto)
+{
+	struct block_job *job;
+
+	while (blocks.next_write < upto) {
+		job = &blocks.jobs[blocks.next_write % blocks.job_count];
+		lock_blocks();
+#ifdef ENABLE_THREADS
+		while (job->state != JOB_DONE)
+			pthread_cond_wait(&blocks.cond, &blocks.lock);
+#endif
+		unlock_blocks();
+		write_block_job(job);
+		lock_blocks();
+		job->state = JOB_FREE;
+		blocks.next_write++;
+		unlock_blocks();
+	}
+}
+
+/*
+ *		Get a free job for reading the next block into
+ */
+
+static struct block_job *get_block_job(void)
+{
+	struct block_job *job;
+	int state;
+
+	job = &blocks.jobs[blocks.next_fill % blocks.job_count];
+	lock_blocks();
+	state = job->state;
+	unlock_blocks();
+	if (state != JOB_FREE)
+		write_block_jobs(blocks.next_fill - blocks.job_count + 1);
+	return (job);
+}
+
+/*
+ *		Submit a block which has been read for compression
+ */
+
+static void put_block_job(struct block_job *job, u64 lcn, u32 length)
+{
+	job->lcn = lcn;
+	job->length = length;
+	if (blocks.thread_count) {
+		lock_blocks();
+		job->state = JOB_FILLED;
+		blocks.next_fill++;
+#ifdef ENABLE_THREADS
+		pthread_cond_signal(&blocks.cond);
+#endif
+		unlock_blocks();
+	} else {
+		process_block_job(job);
+		job->state = JOB_DONE;
+		blocks.next_fill++;
+		write_block_jobs(blocks.next_fill);
+	}
+}
+
+static void start_blocks(u32 max_length)
+{
+	int i;
+
+	blocks.offset = le32_to_cpu(image_hdr.offset_to_image_data);
+	blocks.job_count = 1;
+#ifdef ENABLE_THREADS
+	if (opt.threads > 1) {
+		blocks.thread_count = opt.threads;
+		blocks.job_count = opt.threads + 2;
+	}
+#endif
+	blocks.jobs = (struct block_job*)ntfs_calloc(blocks.job_count
+				* sizeof(struct block_job));
+	if (!blocks.jobs)
+		perr_exit("start_blocks");
+	for (i=0; i<blocks.job_count; i++) {
+		blocks.jobs[i].data = (char*)ntfs_malloc(max_length);
+		blocks.jobs[i].packed = (char*)ntfs_malloc(
+						packed_size(max_length));
+		if (!blocks.jobs[i].data || !blocks.jobs[i].packed)
+			perr_exit("start_blocks");
+	}
+#ifdef ENABLE_THREADS
+	if (blocks.thread_count) {
+		blocks.threads = (pthread_t*)ntfs_malloc(blocks.thread_count
+					* sizeof(pthread_t));
+		if (!blocks.threads
+		    || pthread_mutex_init(&blocks.lock, NULL)
+		    || pthread_cond_init(&blocks.cond, NULL))
+			perr_exit("start_blocks");
+		for (i=0; i<blocks.thread_count; i++) {
+			errno = pthread_create(&blocks.threads[i], NULL,
+					pack_thread, NULL);
+			if (errno)
+				perr_exit("pthread_create");
+		}
+	}
+#endif
+}
+
+/*
+ *		Write the remaining blocks, the end block, the index
+ *	and the trailer
+ */
+
+static void end_blocks(void)
+{
+	struct image_trailer trailer;
+	struct image_block block;
+	int i;
+
+	write_block_jobs(blocks.next_fill);
+#ifdef ENABLE_THREADS
+	if (blocks.thread_count) {
+		pthread_mutex_lock(&blocks.lock);
+		blocks.stop = TRUE;
+		pthread_cond_broadcast(&blocks.cond);
+		pthread_mutex_unlock(&blocks.lock);
+		for (i=0; i<blocks.thread_count; i++)
+			pthread_join(blocks.threads[i], NULL);
+		pthread_cond_destroy(&blocks.cond);
+		pthread_mutex_destroy(&blocks.lock);
+		free(blocks.threads);
+	}
+#endif
+	memset(&block, 0, sizeof(block));
+	trailer.index_offset = cpu_to_le64(blocks.offset + sizeof(block));
+	trailer.block_count = cpu_to_le64(blocks.index_count);
+	trailer.image_id = cpu_to_le64(block_checksum((char*)blocks.index,
+			blocks.index_count*sizeof(struct image_index)));
+	trailer.base_id = blocks.base_id;
+	memcpy(trailer.magic, INDEX_MAGIC, IMAGE_MAGIC_SIZE);
+	if ((write_all(&fd_out, &block, sizeof(block)) == -1)
+	    || (blocks.index_count
+		&& (write_all(&fd_out, blocks.index, blocks.index_count
+				* sizeof(struct image_index)) == -1))
+	    || (write_all(&fd_out, &trailer, sizeof(trailer)) == -1))
+		write_failed();
+	for (i=0; i<blocks.job_count; i++) {
+		free(blocks.jobs[i].data);
+		free(blocks.jobs[i].packed);
+	}
+	free(blocks.jobs);
+	free(blocks.index);
+	free(blocks.previous);
+}
+
+/*
+ *		Load the index of the previous image of a differential one
+ *
+ *	The previous image must have been made from the same volume, and
+ *	be a file made of blocks, so that its index can be found.
+ */
+
+static void load_previous_image(const char *name, s64 device_size)
+{
+	struct image_hdr hdr;
+	struct image_trailer trailer;
+	int fd;
+
+	fd = open(name, O_RDONLY | O_BINARY);
+	if (fd == -1)
+		perr_exit("Opening previous image '%s' failed", name);
+	if (read_at(fd, &hdr, sizeof(hdr), 0)) {
+		if (!errno)
+			err_exit("Short previous image '%s'\n", name);
+		perr_exit("read previous image");
+	}
+	if (memcmp(hdr.magic, IMAGE_MAGIC, IMAGE_MAGIC_SIZE)
+	    || (hdr.major_ver != NTFSCLONE_IMG_VER_MAJOR_BLOCKS))
+		err_exit("'%s' is not a compressed image\n", name);
+	if ((le32_to_cpu(hdr.cluster_size) != vol->cluster_size)
+	    || (le64_to_cpu(hdr.device_size) != (u64)device_size)
+	    || (sle64_to_cpu(hdr.nr_clusters) != vol->nr_clusters))
+		err_exit("Image '%s' was not made from this volume\n", name);
+	blocks.previous = read_image_index(fd, &trailer,
+					&blocks.previous_count);
+	if (!blocks.previous)
+		err_exit("Image '%s' has no valid index\n", name);
+	blocks.base_id = trailer.image_id;
+	close(fd);
+}
+
+/*
+ *		Read the clusters of a block and submit it
+ *
+ *	The clusters are read at once, and one by one if this fails, so
+ *	that only the faulty ones have to be rescued.
+ */
+
+static void save_block(u64 lcn, u32 count)
+{
+	struct block_job *job;
+	u32 csize = vol->cluster_size;
+	u32 length;
+	u32 len;
+	u32 i, j;
+
+	length = count*csize;
+		/* possible partial cluster holding the backup boot sector */
+	if ((lcn + count)*csize > full_device_size) {
+		if (lcn*csize >= full_device_size)
+			err_exit("Corrupted input, copy aborted");
+		length = full_device_size - lcn*csize;
+	}
+	job = get_block_job();
+	lseek_to_cluster(lcn);
+	if (read_all(vol->dev, job->data, length) == -1) {
+		if (errno != EIO)
+			perr_exit("read_all");
+		for (i=0; i<count; i++) {
+			len = min(csize, length - i*csize);
+			lseek_to_cluster(lcn + i);
+			if (read_all(vol->dev, &job->data[i*csize], len) == -1) {
+				if (errno != EIO)
+					perr_exit("read_all");
+				if (!opt.rescue) {
+					Printf("%s", bad_sectors_warning_msg);
+					err_exit("Disk is faulty, can't make "
+						"full backup!");
+				}
+				for (j=0; j<len; j+=vol->sector_size)
+					rescue_sector(vol->dev,
+						vol->sector_size,
+						(lcn + i)*csize + j,
+						&job->data[i*csize + j]);
+			}
+		}
+	}
+	put_block_job(job, lcn, length);
+}
+
 static void clone_ntfs(u64 nr_clusters, int more_use)
 {
 	u64 cl, last_cl;  /* current and last used cluster */
+	s64 next_cl;
 	void *buf;
+	char *run_buf;
+	char *image_buf;
 	u32 csize = vol->cluster_size;
+	u32 max_run;
+	u32 count;
+	u32 i;
 	u64 p_counter = 0;
 	char alignment[IMAGE_HDR_ALIGN];
 	struct progress_bar progress;
@@ -942,8 +1775,14 @@ static void clone_ntfs(u64 nr_clusters, int more_use)
 	if (opt.new_serial)
 		generate_serial_number();
 
-	buf = ntfs_calloc(csize);
-	if (!buf)
+	max_run = NTFS_COPY_RUN_SIZE/csize;
+	buf = ntfs_calloc(max_run*csize);
+	run_buf = (char*)ntfs_malloc(max_run*csize);
+	image_buf = (char*)NULL;
+	if (opt.save_image && !opt.compress)
+		image_buf = (char*)ntfs_malloc(max_run*(csize + 1));
+	if (!buf || !run_buf
+	    || (opt.save_image && !opt.compress && !image_buf))
 		perr_exit("clone_ntfs");
 
 	progress_init(&progress, p_counter, nr_clusters, 100);
@@ -958,6 +1797,9 @@ static void clone_ntfs(u64 nr_clusters, int more_use)
 			perr_exit("write_all");
 	}
 
+	if (opt.compress)
+		start_blocks(max_run*csize);
+
 		/* save suspicious clusters if required */
 	if (more_use && opt.ignore_fs_check) {
 		compare_bitmaps(&lcn_bitmap, TRUE);
@@ -965,46 +1807,727 @@ static void clone_ntfs(u64 nr_clusters, int more_use)
 		/* Examine up to the alternate boot sector */
 	for (last_cl = cl = 0; cl <= (u64)vol->nr_clusters; cl++) {
 
-		if (ntfs_bit_get(lcn_bitmap.bm, cl)) {
-			progress_update(&progress, ++p_counter);
-			lseek_to_cluster(cl);
-			image_skip_clusters(cl - last_cl - 1);
+			/* jump to the next used cluster if unused ones are skipped */
+		if (!opt.std_out || opt.save_image) {
+			next_cl = ntfs_bitmap_find_set(lcn_bitmap.bm, cl,
+						vol->nr_clusters + 1);
+			if (next_cl < 0) {
+				cl = vol->nr_clusters + 1;
+				break;
+			}
+			cl = next_cl;
+		}
 
-			copy_cluster(opt.rescue, cl, cl);
+			/*
+			 * Copy the used clusters by runs, except the
+			 * clusters holding the boot sectors
+			 */
+		if (ntfs_bit_get(lcn_bitmap.bm, cl)) {
+			count = 1;
+			if (cl && (cl < (u64)vol->nr_clusters)) {
+				next_cl = ntfs_bitmap_find_zero(lcn_bitmap.bm,
+					cl, min(cl + max_run,
+						(u64)vol->nr_clusters));
+				if (next_cl < 0)
+					next_cl = min(cl + max_run,
+						(u64)vol->nr_clusters);
+				count = next_cl - cl;
+			}
+			for (i=0; i<count; i++)
+				progress_update(&progress, ++p_counter);
+			if (opt.compress)
+				save_block(cl, count);
+			else {
+				lseek_to_cluster(cl);
+				image_skip_clusters(cl - last_cl - 1);
+
+				if (count > 1)
+					copy_clusters(cl, count,
+						run_buf, image_buf);
+				else
+					copy_cluster(opt.rescue, cl, cl);
+			}
+			cl += count - 1;
 			last_cl = cl;
 			continue;
 		}
 
-		if (opt.std_out && !opt.save_image) {
-			progress_update(&progress, ++p_counter);
-			if (write_all(&fd_out, buf, csize) == -1)
-				perr_exit("write_all");
-		}
+			/* Write the unused clusters as zeroes, also by runs */
+		if (opt.std_out && !opt.save_image) {
+			next_cl = ntfs_bitmap_find_set(lcn_bitmap.bm, cl,
+					min(cl + max_run,
+						(u64)vol->nr_clusters + 1));
+			if (next_cl < 0)
+				next_cl = min(cl + max_run,
+						(u64)vol->nr_clusters + 1);
+			count = next_cl - cl;
+			for (i=0; i<count; i++)
+				progress_update(&progress, ++p_counter);
+			if (write_all(&fd_out, buf, count*csize) == -1)
+				perr_exit("write_all");
+			cl += count - 1;
+		}
+	}
+	if (opt.compress)
+		end_blocks();
+	else
+		image_skip_clusters(cl - last_cl - 1);
+	free(image_buf);
+	free(run_buf);
+	free(buf);
+}
+
+static void write_empty_clusters(s32 csize, s64 count,
+				 struct progress_bar *progress, u64 *p_counter)
+{
+	s64 i;
+	char buff[NTFS_MAX_CLUSTER_SIZE];
+
+	memset(buff, 0, csize);
+
+	for (i = 0; i < count; i++) {
+		if (write_all(&fd_out, buff, csize) == -1)
+			perr_exit("write_all");
+		progress_update(progress, ++(*p_counter));
+	}
+}
+
+/*
+ *		Check the description of a block read from an image
+ */
+
+static void check_block(const struct image_block *block)
+{
+	s64 nr_clusters = sle64_to_cpu(image_hdr.nr_clusters);
+	u32 csize = le32_to_cpu(image_hdr.cluster_size);
+	u64 lcn = le64_to_cpu(block->lcn);
+	u32 length = le32_to_cpu(block->length);
+	u32 size = le32_to_cpu(block->size);
+
+	if (!length || (length > NTFS_COPY_RUN_SIZE) || (size > length)
+	    || (lcn > (u64)nr_clusters)
+	    || ((lcn + rounded_up_division(length, csize))
+			> (u64)nr_clusters + 1))
+		err_exit("Corrupted image, bad block at cluster %lld\n",
+				(long long)lcn);
+}
+
+/*
+ *		Get the clusters of a block from the bytes stored
+ *
+ *	When the block is not compressed, the bytes have been read
+ *	directly into @data.
+ *
+ *	Returns FALSE if the compressed bytes are not valid
+ */
+
+static BOOL block_unpacks(const struct image_block *block,
+			const char *packed, char *data)
+{
+	u32 length = le32_to_cpu(block->length);
+	u32 size = le32_to_cpu(block->size);
+	BOOL ok;
+#ifdef ENABLE_ZLIB
+	uLongf dlen;
+#endif
+
+	ok = TRUE;
+	if (size < length) {
+#ifdef ENABLE_ZLIB
+		dlen = length;
+		ok = (uncompress((Bytef*)data, &dlen, (const Bytef*)packed,
+				size) == Z_OK)
+			&& (dlen == length);
+#else
+		err_exit("This ntfsclone was built without compression "
+				"support\n");
+#endif
+	}
+	return (ok);
+}
+
+static void unpack_block(const struct image_block *block,
+			const char *packed, char *data)
+{
+	if (!block_unpacks(block, packed, data))
+		err_exit("Corrupted image, bad data at cluster %lld\n",
+				(long long)le64_to_cpu(block->lcn));
+}
+
+/*
+ *		Check whether a block holds one of the boot sectors
+ */
+
+static BOOL is_boot_block(const struct image_block *block)
+{
+	s64 nr_clusters = sle64_to_cpu(image_hdr.nr_clusters);
+	u32 csize = le32_to_cpu(image_hdr.cluster_size);
+	u64 lcn = le64_to_cpu(block->lcn);
+
+	return (!lcn
+		|| ((lcn + rounded_up_division(le32_to_cpu(block->length),
+					csize)) > (u64)nr_clusters));
+}
+
+/*
+ *		Set the new serial number into the boot sectors of a block
+ */
+
+static void block_new_serial(const struct image_block *block, char *data)
+{
+	s64 nr_clusters = sle64_to_cpu(image_hdr.nr_clusters);
+	u32 csize = le32_to_cpu(image_hdr.cluster_size);
+	u64 lcn = le64_to_cpu(block->lcn);
+	u32 length = le32_to_cpu(block->length);
+
+	if (!lcn)
+		set_new_serial(data, 0, csize);
+	if ((lcn + rounded_up_division(length, csize)) > (u64)nr_clusters)
+		set_new_serial(&data[(nr_clusters - lcn)*csize], nr_clusters,
+				length - (nr_clusters - lcn)*csize);
+}
+
+#ifdef ENABLE_THREADS
+
+static int pread_all(int fd, void *buf, u32 count, s64 pos)
+{
+	ssize_t i;
+
+	while (count > 0) {
+		i = pread(fd, buf, count, pos);
+		if (i < 0) {
+			if ((errno != EAGAIN) && (errno != EINTR))
+				return (-1);
+		} else if (!i) {
+			errno = 0;
+			return (-1);
+		} else {
+			count -= i;
+			pos += i;
+			buf = i + (char*)buf;
+		}
+	}
+	return (0);
+}
+
+static int pwrite_all(int fd, const void *buf, u32 count, s64 pos)
+{
+	ssize_t i;
+
+	while (count > 0) {
+		i = pwrite(fd, buf, count, pos);
+		if (i < 0) {
+			if ((errno != EAGAIN) && (errno != EINTR))
+				return (-1);
+		} else {
+			count -= i;
+			pos += i;
+			buf = i + (const char*)buf;
+		}
+	}
+	return (0);
+}
+
+/*
+ *		Writer threads
+ *
+ *	When an image is read in its order, from a stream or in the
+ *	original format, the reading thread gathers the clusters of a
+ *	run or a compressed block into a job, and several writer threads
+ *	uncompress the jobs and write them at their position, so that
+ *	reading the image overlaps with uncompressing and writing. The
+ *	blocks holding the boot sectors are still processed in order by
+ *	the reading thread, as they may have to be updated.
+ */
+
+struct write_job {
+	struct image_block block;	/* compressed if size < length */
+	int state;
+	char *data;
+	char *packed;
+} ;
+
+static struct {
+	struct write_job *jobs;
+	int job_count;
+	int thread_count;	/* zero if writing inline */
+	int next;		/* next job to fill */
+	BOOL stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t *threads;
+} writers;
+
+static void write_job(struct write_job *job)
+{
+	s32 csize = le32_to_cpu(image_hdr.cluster_size);
+
+	unpack_block(&job->block, job->packed, job->data);
+	if (!opt.no_action
+	    && pwrite_all(fd_out, job->data, le32_to_cpu(job->block.length),
+			le64_to_cpu(job->block.lcn)*csize))
+		write_failed();
+}
+
+static void *write_thread(void *arg __attribute__((unused)))
+{
+	struct write_job *job;
+	int i;
+
+	pthread_mutex_lock(&writers.lock);
+	while (!writers.stop) {
+		job = (struct write_job*)NULL;
+		for (i=0; !job && (i<writers.job_count); i++)
+			if (writers.jobs[i].state == JOB_FILLED)
+				job = &writers.jobs[i];
+		if (job) {
+			job->state = JOB_BUSY;
+			pthread_mutex_unlock(&writers.lock);
+			write_job(job);
+			pthread_mutex_lock(&writers.lock);
+			job->state = JOB_FREE;
+			pthread_cond_broadcast(&writers.cond);
+		} else
+			pthread_cond_wait(&writers.cond, &writers.lock);
+	}
+	pthread_mutex_unlock(&writers.lock);
+	return ((void*)NULL);
+}
+
+/*
+ *		Start the writer threads, when the output can be written
+ *	at any position
+ */
+
+static void start_writers(void)
+{
+	int i;
+
+	writers.thread_count = 0;
+	if ((opt.threads > 1) && !opt.std_out && !dev_out) {
+		writers.thread_count = opt.threads;
+		writers.job_count = opt.threads + 2;
+		writers.next = 0;
+		writers.stop = FALSE;
+		writers.jobs = (struct write_job*)ntfs_calloc(
+				writers.job_count*sizeof(struct write_job));
+		writers.threads = (pthread_t*)ntfs_malloc(
+				writers.thread_count*sizeof(pthread_t));
+		if (!writers.jobs || !writers.threads
+		    || pthread_mutex_init(&writers.lock, NULL)
+		    || pthread_cond_init(&writers.cond, NULL))
+			perr_exit("start_writers");
+		for (i=0; i<writers.job_count; i++) {
+			writers.jobs[i].data = (char*)ntfs_malloc(
+						NTFS_COPY_RUN_SIZE);
+			writers.jobs[i].packed = (char*)ntfs_malloc(
+						NTFS_COPY_RUN_SIZE);
+			if (!writers.jobs[i].data || !writers.jobs[i].packed)
+				perr_exit("start_writers");
+		}
+		for (i=0; i<writers.thread_count; i++) {
+			errno = pthread_create(&writers.threads[i], NULL,
+						write_thread, NULL);
+			if (errno)
+				perr_exit("pthread_create");
+		}
+	}
+}
+
+/*
+ *		Get the next job to fill, when it has been written
+ */
+
+static struct write_job *get_write_job(void)
+{
+	struct write_job *job;
+
+	job = &writers.jobs[writers.next];
+	pthread_mutex_lock(&writers.lock);
+	while (job->state != JOB_FREE)
+		pthread_cond_wait(&writers.cond, &writers.lock);
+	pthread_mutex_unlock(&writers.lock);
+	return (job);
+}
+
+static void put_write_job(struct write_job *job, u64 lcn, u32 length,
+			u32 size)
+{
+	job->block.lcn = cpu_to_le64(lcn);
+	job->block.length = cpu_to_le32(length);
+	job->block.size = cpu_to_le32(size);
+	pthread_mutex_lock(&writers.lock);
+	job->state = JOB_FILLED;
+	writers.next = (writers.next + 1) % writers.job_count;
+	pthread_cond_broadcast(&writers.cond);
+	pthread_mutex_unlock(&writers.lock);
+}
+
+/*
+ *		Wait for the jobs to be written, and stop the writers
+ */
+
+static void end_writers(void)
+{
+	int i;
+
+	if (writers.thread_count) {
+		pthread_mutex_lock(&writers.lock);
+		for (i=0; i<writers.job_count; i++)
+			while (writers.jobs[i].state != JOB_FREE)
+				pthread_cond_wait(&writers.cond,
+						&writers.lock);
+		writers.stop = TRUE;
+		pthread_cond_broadcast(&writers.cond);
+		pthread_mutex_unlock(&writers.lock);
+		for (i=0; i<writers.thread_count; i++)
+			pthread_join(writers.threads[i], NULL);
+		pthread_cond_destroy(&writers.cond);
+		pthread_mutex_destroy(&writers.lock);
+		for (i=0; i<writers.job_count; i++) {
+			free(writers.jobs[i].data);
+			free(writers.jobs[i].packed);
+		}
+		free(writers.jobs);
+		free(writers.threads);
+		writers.thread_count = 0;
+	}
+}
+
+#endif
+
+/*
+ *		Read the bytes stored for a block
+ */
+
+static void read_block_bytes(char *buf, u32 size)
+{
+	if (read_all(&fd_in, buf, size) == -1) {
+		if (!errno)
+			err_exit("Short image file...\n");
+		perr_exit("read_all");
+	}
+}
+
+/*
+ *		Restore the blocks of an image in their order
+ *
+ *	This is used when restoring from a stream or to the standard
+ *	output, and the index at the end is not used. When the output
+ *	can be written at any position, the blocks are uncompressed and
+ *	written by the writer threads.
+ */
+
+static void restore_blocks(struct progress_bar *progress, u64 *p_counter)
+{
+	struct image_block block;
+	s32 csize = le32_to_cpu(image_hdr.cluster_size);
+#ifdef ENABLE_THREADS
+	struct write_job *job;
+#endif
+	char *data;
+	char *packed;
+	s64 pos;
+	u64 lcn;
+	u32 length;
+	u32 size;
+	u32 i;
+
+	data = (char*)ntfs_malloc(NTFS_COPY_RUN_SIZE);
+	packed = (char*)ntfs_malloc(NTFS_COPY_RUN_SIZE);
+	if (!data || !packed)
+		perr_exit("restore_blocks");
+	pos = 0;
+	do {
+		if (read_all(&fd_in, &block, sizeof(block)) == -1) {
+			if (!errno)
+				err_exit("Short image file...\n");
+			perr_exit("read_all");
+		}
+		length = le32_to_cpu(block.length);
+		if (length) {
+			check_block(&block);
+			lcn = le64_to_cpu(block.lcn);
+			size = le32_to_cpu(block.size);
+#ifdef ENABLE_THREADS
+			if (writers.thread_count && !is_boot_block(&block)) {
+				job = get_write_job();
+				read_block_bytes(size < length ?
+						job->packed : job->data, size);
+				put_write_job(job, lcn, length, size);
+			} else
+#endif
+			{
+				read_block_bytes(size < length ?
+						packed : data, size);
+				unpack_block(&block, packed, data);
+				if (opt.new_serial)
+					block_new_serial(&block, data);
+				if (opt.std_out) {
+					if ((s64)lcn < pos)
+						err_exit("Corrupted image, "
+							"block at cluster %lld "
+							"out of order\n",
+							(long long)lcn);
+					write_empty_clusters(csize, lcn - pos,
+							progress, p_counter);
+				} else {
+					if (!opt.no_action
+					    && (lseek_out(fd_out, lcn*csize,
+							SEEK_SET) == (off_t)-1))
+						perr_exit("restore_image: "
+								"lseek");
+				}
+				if (write_all(&fd_out, data, length) == -1)
+					write_failed();
+			}
+			pos = lcn + rounded_up_division(length, csize);
+			for (i=0; i<rounded_up_division(length, csize); i++)
+				progress_update(progress, ++(*p_counter));
+		}
+	} while (length);
+	free(packed);
+	free(data);
+}
+
+/*
+ *		Count the clusters stored in an image, from its index
+ */
+
+static u64 stored_clusters(const struct image_index *index, s64 count)
+{
+	u32 csize = le32_to_cpu(image_hdr.cluster_size);
+	u64 clusters;
+	s64 i;
+
+	clusters = 0;
+	for (i=0; i<count; i++)
+		if (index[i].offset)
+			clusters += rounded_up_division(
+				le32_to_cpu(index[i].block.length), csize);
+	return (clusters);
+}
+
+#ifdef ENABLE_THREADS
+
+static struct {
+	struct image_index *index;
+	s64 count;
+	s64 next;		/* next index entry to restore */
+	struct progress_bar *progress;
+	u64 *p_counter;
+	pthread_mutex_t lock;
+} restoring;
+
+/*
+ *		Load the index of the blocks of an image
+ *
+ *	Returns TRUE if the blocks can be restored through the index
+ */
+
+static BOOL load_block_index(void)
+{
+	struct image_trailer trailer;
+
+	restoring.index = (struct image_index*)NULL;
+	if (!opt.std_out && !dev_out && (opt.threads > 1))
+		restoring.index = read_image_index(fd_in, &trailer,
+						&restoring.count);
+	return (restoring.index != (struct image_index*)NULL);
+}
+
+static void restore_indexed_block(const struct image_index *entry,
+				char *data, char *packed)
+{
+	struct image_block block;
+	s32 csize = le32_to_cpu(image_hdr.cluster_size);
+	s64 offset;
+	u64 lcn;
+	u32 length;
+	u32 size;
+	u32 i;
+
+	offset = le64_to_cpu(entry->offset);
+	if (!offset)	/* stored in a previous image */
+		return;
+	if (pread_all(fd_in, &block, sizeof(block), offset)
+	    || memcmp(&block, &entry->block, sizeof(block)))
+		err_exit("Corrupted image, bad index at offset %lld\n",
+				(long long)offset);
+	check_block(&block);
+	lcn = le64_to_cpu(block.lcn);
+	length = le32_to_cpu(block.length);
+	size = le32_to_cpu(block.size);
+	if (pread_all(fd_in, (size < length ? packed : data), size,
+			offset + sizeof(block))) {
+		if (!errno)
+			err_exit("Short image file...\n");
+		perr_exit("pread");
+	}
+	unpack_block(&block, packed, data);
+	if (opt.new_serial)
+		block_new_serial(&block, data);
+	if (!opt.no_action
+	    && pwrite_all(fd_out, data, length, lcn*csize))
+		write_failed();
+	pthread_mutex_lock(&restoring.lock);
+	for (i=0; i<rounded_up_division(length, csize); i++)
+		progress_update(restoring.progress, ++(*restoring.p_counter));
+	pthread_mutex_unlock(&restoring.lock);
+}
+
+/*
+ *		Thread restoring the blocks, except the boot sectors
+ */
+
+static void *restore_thread(void *arg __attribute__((unused)))
+{
+	char *data;
+	char *packed;
+	s64 i;
+
+	data = (char*)ntfs_malloc(NTFS_COPY_RUN_SIZE);
+	packed = (char*)ntfs_malloc(NTFS_COPY_RUN_SIZE);
+	if (!data || !packed)
+		perr_exit("restore_thread");
+	do {
+		pthread_mutex_lock(&restoring.lock);
+		while ((restoring.next < restoring.count)
+		    && is_boot_block(&restoring.index[restoring.next].block))
+			restoring.next++;
+		i = restoring.next++;
+		pthread_mutex_unlock(&restoring.lock);
+		if (i < restoring.count)
+			restore_indexed_block(&restoring.index[i],
+						data, packed);
+	} while (i < restoring.count);
+	free(packed);
+	free(data);
+	return ((void*)NULL);
+}
+
+/*
+ *		Restore the blocks of an image through its index
+ *
+ *	The blocks are restored by several threads in no specific order,
+ *	except the ones holding the boot sectors, as the first one has
+ *	to be processed before the backup one when setting a new serial
+ *	number.
+ */
+
+static void restore_indexed(struct progress_bar *progress, u64 *p_counter)
+{
+	pthread_t *threads;
+	char *data;
+	char *packed;
+	s64 i;
+	int t;
+
+	restoring.next = 0;
+	restoring.progress = progress;
+	restoring.p_counter = p_counter;
+	threads = (pthread_t*)ntfs_malloc(opt.threads*sizeof(pthread_t));
+	data = (char*)ntfs_malloc(NTFS_COPY_RUN_SIZE);
+	packed = (char*)ntfs_malloc(NTFS_COPY_RUN_SIZE);
+	if (!threads || !data || !packed
+	    || pthread_mutex_init(&restoring.lock, NULL))
+		perr_exit("restore_indexed");
+	for (i=0; i<restoring.count; i++)
+		if (!le64_to_cpu(restoring.index[i].block.lcn))
+			restore_indexed_block(&restoring.index[i],
+						data, packed);
+	for (t=0; t<opt.threads; t++) {
+		errno = pthread_create(&threads[t], NULL,
+					restore_thread, NULL);
+		if (errno)
+			perr_exit("pthread_create");
 	}
-	image_skip_clusters(cl - last_cl - 1);
-	free(buf);
+	for (t=0; t<opt.threads; t++)
+		pthread_join(threads[t], NULL);
+	for (i=0; i<restoring.count; i++)
+		if (le64_to_cpu(restoring.index[i].block.lcn)
+		    && is_boot_block(&restoring.index[i].block))
+			restore_indexed_block(&restoring.index[i],
+						data, packed);
+	pthread_mutex_destroy(&restoring.lock);
+	free(packed);
+	free(data);
+	free(threads);
+	free(restoring.index);
 }
 
-static void write_empty_clusters(s32 csize, s64 count,
-				 struct progress_bar *progress, u64 *p_counter)
+#endif
+
+/*
+ *		Check whether a cluster of an image holds a boot sector
+ */
+
+static BOOL is_boot_cluster(s64 lcn)
 {
-	s64 i;
-	char buff[NTFS_MAX_CLUSTER_SIZE];
+	s32 csize = le32_to_cpu(image_hdr.cluster_size);
 
-	memset(buff, 0, csize);
+	return (!lcn || ((lcn + 1)*csize >= full_device_size));
+}
 
-	for (i = 0; i < count; i++) {
-		if (write_all(&fd_out, buff, csize) == -1)
-			perr_exit("write_all");
-		progress_update(progress, ++(*p_counter));
+/*
+ *		Restore a run of clusters from an image in the original format
+ *
+ *	The clusters following the first one in the image are gathered
+ *	and written at once, up to the next gap or boot sector. The
+ *	command following the run is returned, unless the end of the
+ *	image was met.
+ *
+ *	Returns the count of clusters restored
+ */
+
+static s64 restore_run(s64 pos, char *buf, char *cmd, BOOL *have_cmd)
+{
+	s32 csize = le32_to_cpu(image_hdr.cluster_size);
+	s64 max_run = NTFS_COPY_RUN_SIZE/csize;
+	s64 count;
+	BOOL more;
+#ifdef ENABLE_THREADS
+	struct write_job *job = (struct write_job*)NULL;
+
+	if (writers.thread_count) {
+		job = get_write_job();
+		buf = job->data;
 	}
+#endif
+	count = 0;
+	do {
+		read_block_bytes(&buf[count*csize], csize);
+		count++;
+		more = FALSE;
+		*have_cmd = FALSE;
+		if ((count < max_run) && !is_boot_cluster(pos + count)) {
+			*have_cmd = (read_all(&fd_in, cmd, sizeof(*cmd)) != -1);
+			more = *have_cmd && (*cmd == CMD_NEXT);
+		}
+	} while (more);
+#ifdef ENABLE_THREADS
+	if (job) {
+		put_write_job(job, pos, count*csize, count*csize);
+		if (!opt.no_action
+		    && (lseek_out(fd_out, count*csize, SEEK_CUR) == (off_t)-1))
+			perr_exit("restore_image: lseek");
+	} else
+#endif
+		if (write_all(&fd_out, buf, count*csize) == -1)
+			write_failed();
+	return (count);
 }
 
 static void restore_image(void)
 {
+	struct image_trailer trailer;
+	struct image_index *index;
 	s64 pos = 0, count;
+	s64 i;
 	s32 csize = le32_to_cpu(image_hdr.cluster_size);
+	char *buf;
 	char cmd;
+	BOOL have_cmd;
 	u64 p_counter = 0;
 	struct progress_bar progress;
 
@@ -1015,12 +2538,45 @@ static void restore_image(void)
 		      le64_to_cpu(image_hdr.inuse) + 1,
 		      100);
 
-	if (opt.new_serial)
+	if (image_hdr.minor_ver == NTFSCLONE_IMG_VER_MINOR_DIFF) {
+		index = read_image_index(fd_in, &trailer, &count);
+		if (index) {
+			progress_init(&progress, p_counter,
+					stored_clusters(index, count) + 1, 100);
+			free(index);
+		}
+	}
+
+	if (opt.new_serial && !volume_serial_number)	/* once per chain */
 		generate_serial_number();
 
+	if (image_hdr.major_ver == NTFSCLONE_IMG_VER_MAJOR_BLOCKS) {
+#ifdef ENABLE_THREADS
+		if (load_block_index())
+			restore_indexed(&progress, &p_counter);
+		else {
+			start_writers();
+			restore_blocks(&progress, &p_counter);
+			end_writers();
+		}
+#else
+		restore_blocks(&progress, &p_counter);
+#endif
+		return;
+	}
+
+	buf = (char*)ntfs_malloc(NTFS_COPY_RUN_SIZE);
+	if (!buf)
+		perr_exit("restore_image");
+#ifdef ENABLE_THREADS
+	start_writers();
+#endif
+	have_cmd = FALSE;
 		/* Restore up to the alternate boot sector */
 	while (pos <= sle64_to_cpu(image_hdr.nr_clusters)) {
-		if (read_all(&fd_in, &cmd, sizeof(cmd)) == -1) {
+		if (have_cmd)
+			have_cmd = FALSE;
+		else if (read_all(&fd_in, &cmd, sizeof(cmd)) == -1) {
 			if (pos == sle64_to_cpu(image_hdr.nr_clusters)) {
 				/* alternate boot sector no present in old images */
 				Printf("Warning : no alternate boot"
@@ -1071,13 +2627,247 @@ static void restore_image(void)
 			}
 			pos += count;
 		} else if (cmd == CMD_NEXT) {
-			copy_cluster(0, 0, pos);
-			pos++;
-			progress_update(&progress, ++p_counter);
+			if (is_boot_cluster(pos)) {
+				copy_cluster(0, 0, pos);
+				count = 1;
+			} else
+				count = restore_run(pos, buf, &cmd, &have_cmd);
+			pos += count;
+			for (i=0; i<count; i++)
+				progress_update(&progress, ++p_counter);
 		} else
 			err_exit("Invalid command code %d at input offset 0x%llx\n",
 					cmd, (long long)tellin(fd_in) - 1);
 	}
+#ifdef ENABLE_THREADS
+	end_writers();
+#endif
+	free(buf);
+}
+
+/*
+ *		Verification of an image
+ *
+ *	The index of a block image records the checksum of the clusters
+ *	of every block, so that the image can be checked by uncompressing
+ *	its blocks, and a device can be checked against the image by
+ *	reading its clusters, without restoring anything. Several threads
+ *	check consecutive blocks, so that the reads stay mostly sequential.
+ *
+ *	A differential image only stores the blocks which changed, but its
+ *	index describes all of them, so that a device can be checked
+ *	against the last image of a chain.
+ */
+
+static struct {
+	struct image_index *index;
+	s64 count;
+	s64 next;		/* next index entry to check */
+	int fd;			/* image or device read */
+	BOOL device;		/* checking a device against the image */
+	s64 checked;		/* count of blocks checked */
+	s64 bad;		/* count of blocks found different */
+	struct progress_bar progress;
+	u64 p_counter;
+#ifdef ENABLE_THREADS
+	pthread_mutex_t lock;
+#endif
+} verifying;
+
+static void lock_verifying(void)
+{
+#ifdef ENABLE_THREADS
+	if (opt.threads > 1)
+		pthread_mutex_lock(&verifying.lock);
+#endif
+}
+
+static void unlock_verifying(void)
+{
+#ifdef ENABLE_THREADS
+	if (opt.threads > 1)
+		pthread_mutex_unlock(&verifying.lock);
+#endif
+}
+
+static int verify_read(int fd, void *buf, u32 count, s64 pos)
+{
+#ifdef ENABLE_THREADS
+	return (pread_all(fd, buf, count, pos));
+#else
+	return (read_at(fd, buf, count, pos));
+#endif
+}
+
+/*
+ *		Check a block, from the image or from the device
+ *
+ *	Returns TRUE if the block is the one described by the index
+ */
+
+static BOOL verify_block(const struct image_index *entry,
+			char *data, char *packed)
+{
+	struct image_block block;
+	s32 csize = le32_to_cpu(image_hdr.cluster_size);
+	s64 offset;
+	u64 lcn;
+	u32 length;
+	u32 size;
+
+	check_block(&entry->block);
+	lcn = le64_to_cpu(entry->block.lcn);
+	length = le32_to_cpu(entry->block.length);
+	if (verifying.device) {
+		if (verify_read(verifying.fd, data, length, lcn*csize)) {
+			if (errno)
+				perr_printf("Reading cluster %lld failed",
+						(long long)lcn);
+			return (FALSE);
+		}
+	} else {
+		offset = le64_to_cpu(entry->offset);
+		size = le32_to_cpu(entry->block.size);
+		if (verify_read(verifying.fd, &block, sizeof(block), offset)
+		    || memcmp(&block, &entry->block, sizeof(block))
+		    || verify_read(verifying.fd,
+				(size < length ? packed : data), size,
+				offset + sizeof(block))
+		    || !block_unpacks(&block, packed, data))
+			return (FALSE);
+	}
+	return (block_checksum(data, length)
+			== le64_to_cpu(entry->checksum));
+}
+
+/*
+ *		Check the blocks of the image, in any thread
+ */
+
+static void *verify_thread(void *arg __attribute__((unused)))
+{
+	const struct image_index *entry;
+	char *data;
+	char *packed;
+	s32 csize = le32_to_cpu(image_hdr.cluster_size);
+	BOOL same;
+	s64 i;
+	u32 j;
+
+	data = (char*)ntfs_malloc(NTFS_COPY_RUN_SIZE);
+	packed = (char*)ntfs_malloc(NTFS_COPY_RUN_SIZE);
+	if (!data || !packed)
+		perr_exit("verify_thread");
+	do {
+		lock_verifying();
+			/* the blocks stored in a previous image are skipped */
+		while ((verifying.next < verifying.count)
+		    && !verifying.device
+		    && !verifying.index[verifying.next].offset)
+			verifying.next++;
+		i = verifying.next++;
+		unlock_verifying();
+		if (i < verifying.count) {
+			entry = &verifying.index[i];
+			same = verify_block(entry, data, packed);
+			lock_verifying();
+			verifying.checked++;
+			if (!same) {
+				verifying.bad++;
+				err_printf("%s at cluster %lld\n",
+					(verifying.device
+						? "Clusters differ"
+						: "Corrupted block"),
+					(long long)le64_to_cpu(
+							entry->block.lcn));
+			}
+			for (j=0; j<rounded_up_division(
+				le32_to_cpu(entry->block.length), csize); j++)
+				progress_update(&verifying.progress,
+						++verifying.p_counter);
+			unlock_verifying();
+		}
+	} while (i < verifying.count);
+	free(packed);
+	free(data);
+	return ((void*)NULL);
+}
+
+/*
+ *		Check an image, or a device against the image
+ *
+ *	Returns the exit code, 0 if no difference was found
+ */
+
+static int verify_image(const char *device)
+{
+	struct image_trailer trailer;
+	u64 clusters;
+	s64 i;
+#ifdef ENABLE_THREADS
+	pthread_t *threads;
+	int t;
+#endif
+
+	if (image_hdr.major_ver != NTFSCLONE_IMG_VER_MAJOR_BLOCKS)
+		err_exit("Image '%s' has no checksums, only the compressed "
+				"images can be verified\n", opt.volume);
+	verifying.index = read_image_index(fd_in, &trailer,
+					&verifying.count);
+	if (!verifying.index)
+		err_exit("Image '%s' has no valid index\n", opt.volume);
+	if (le64_to_cpu(trailer.image_id) != block_checksum(
+			(char*)verifying.index,
+			verifying.count*sizeof(struct image_index)))
+		err_exit("Image '%s' has a corrupted index\n", opt.volume);
+	verifying.device = (device != (const char*)NULL);
+	if (verifying.device) {
+		Printf("Verifying '%s' against the image ...\n", device);
+		verifying.fd = open(device, O_RDONLY | O_BINARY);
+		if (verifying.fd == -1)
+			perr_exit("Opening '%s' failed", device);
+	} else {
+		Printf("Verifying the image ...\n");
+		verifying.fd = fd_in;
+	}
+	clusters = 0;
+	for (i=0; i<verifying.count; i++)
+		if (verifying.device || verifying.index[i].offset)
+			clusters += rounded_up_division(le32_to_cpu(
+					verifying.index[i].block.length),
+				le32_to_cpu(image_hdr.cluster_size));
+	verifying.next = 0;
+	progress_init(&verifying.progress, 0, clusters + 1, 100);
+#ifdef ENABLE_THREADS
+	if (opt.threads > 1) {
+		threads = (pthread_t*)ntfs_malloc(opt.threads
+					* sizeof(pthread_t));
+		if (!threads || pthread_mutex_init(&verifying.lock, NULL))
+			perr_exit("verify_image");
+		for (t=0; t<opt.threads; t++) {
+			errno = pthread_create(&threads[t], NULL,
+						verify_thread, NULL);
+			if (errno)
+				perr_exit("pthread_create");
+		}
+		for (t=0; t<opt.threads; t++)
+			pthread_join(threads[t], NULL);
+		pthread_mutex_destroy(&verifying.lock);
+		free(threads);
+	} else
+#endif
+		verify_thread(NULL);
+	progress_update(&verifying.progress, ++verifying.p_counter);
+	if (verifying.device)
+		close(verifying.fd);
+	free(verifying.index);
+	Printf("Blocks checked         : %lld\n",
+			(long long)verifying.checked);
+	if (!verifying.device && (verifying.checked < verifying.count))
+		Printf("Blocks not stored      : %lld\n",
+			(long long)(verifying.count - verifying.checked));
+	Printf("Blocks different       : %lld\n", (long long)verifying.bad);
+	return (verifying.bad ? 1 : 0);
 }
 
 static void wipe_index_entry_timestams(INDEX_ENTRY *e)
@@ -1093,7 +2883,7 @@ static void wipe_index_entry_timestams(INDEX_ENTRY *e)
 		e->key.file_name.last_mft_change_time = timestamp;
 		e->key.file_name.last_access_time = timestamp;
 
-		wiped_timestamp_data += 32;
+		count_wiped(wiped_timestamp_data, 32);
 
 		e = (INDEX_ENTRY *)((u8 *)e + le16_to_cpu(e->length));
 	}
@@ -1211,7 +3001,7 @@ static void wipe_index_root_timestamps(ATTR_RECORD *attr, sle64 timestamp)
 			entry->key.file_name.last_data_change_time = timestamp;
 			entry->key.file_name.last_mft_change_time = timestamp;
 
-			wiped_timestamp_data += 32;
+			count_wiped(wiped_timestamp_data, 32);
 
 		} else if (ntfs_names_are_equal(NTFS_INDEX_Q,
 				sizeof(NTFS_INDEX_Q) / 2 - 1,
@@ -1230,7 +3020,7 @@ static void wipe_index_root_timestamps(ATTR_RECORD *attr, sle64 timestamp)
 			 */
 			if (le32_to_cpu(quota_q->version) == 2) {
 				quota_q->change_time = timestamp;
-				wiped_timestamp_data += 4;
+				count_wiped(wiped_timestamp_data, 4);
 			}
 		}
 
@@ -1248,7 +3038,7 @@ do {								\
 	ats->last_mft_change_time= (timestamp);			\
 	ats->last_access_time = (timestamp);			\
 								\
-	wiped_timestamp_data += 32;				\
+	count_wiped(wiped_timestamp_data, 32);			\
 								\
 } while (0)
 
@@ -1291,7 +3081,7 @@ static void wipe_resident_data(ntfs_walk_clusters_ctx *image)
 		}
 	}
 
-	wiped_resident_data += n;
+	count_wiped(wiped_resident_data, n);
 }
 
 static int wipe_data(char *p, int pos, int len)
@@ -1318,8 +3108,8 @@ static void wipe_unused_mft_data(ntfs_inode *ni)
 		return;
 
 	unused = le32_to_cpu(m->bytes_allocated) - le32_to_cpu(m->bytes_in_use);
-	wiped_unused_mft_data += wipe_data((char *)m,
-			le32_to_cpu(m->bytes_in_use), unused);
+	count_wiped(wiped_unused_mft_data, wipe_data((char *)m,
+			le32_to_cpu(m->bytes_in_use), unused));
 }
 
 static void wipe_unused_mft(ntfs_inode *ni)
@@ -1332,7 +3122,8 @@ static void wipe_unused_mft(ntfs_inode *ni)
 		return;
 
 	unused = le32_to_cpu(m->bytes_in_use) - sizeof(MFT_RECORD);
-	wiped_unused_mft += wipe_data((char *)m, sizeof(MFT_RECORD), unused);
+	count_wiped(wiped_unused_mft,
+			wipe_data((char *)m, sizeof(MFT_RECORD), unused));
 }
 
 static void clone_logfile_parts(ntfs_walk_clusters_ctx *image, runlist *rl)
@@ -1477,150 +3268,336 @@ static void write_set(char *buff, u32 csize, s64 *current_lcn,
 }
 
 /*
- *		Copy and wipe the full MFT or MFTMirr data.
- *	(only for metadata images)
+ *		Wiping of the records of a metadata image
  *
- *	Data are read and written by full clusters, but the wiping is done
- *	per MFT record.
+ *	The MFT and directory index records are read in large batches.
+ *	While the records of a batch are being wiped by several threads,
+ *	the previous batch is written and the next one is read, so that
+ *	the output is still produced in the order of clusters.
  */
 
-static void copy_wipe_mft(ntfs_walk_clusters_ctx *image, runlist *rl)
+struct wipe_batch {
+	char *buff;
+	u32 clusters;		/* clusters in the batch, zero at end */
+	u32 wi, wj;		/* runlist position of the first cluster */
+	s64 first;		/* number of the first record */
+} ;
+
+static struct {
+	char *buff;
+	u32 record_size;
+	u32 count;		/* records in the batch being wiped */
+	u32 next;		/* next record to wipe */
+	u32 done;		/* count of records wiped */
+	s64 first;		/* number of the first record */
+	BOOL mft;
+	BOOL stop;
+	int thread_count;	/* zero if wiping inline */
+#ifdef ENABLE_THREADS
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t *threads;
+#endif
+} wiping;
+
+static void wipe_records(char *buff, u32 record_size, s64 first, u32 count,
+			BOOL mft)
 {
-	char buff[NTFS_MAX_CLUSTER_SIZE]; /* overflow checked at mount time */
-	void *fd;
-	s64 mft_no;
-	u32 mft_record_size;
-	u32 csize;
-	u32 bytes_per_sector;
-	u32 records_per_set;
-	u32 clusters_per_set;
-	u32 wi,wj; /* indexes for reading */
-	u32 ri,rj; /* indexes for writing */
-	u32 k; /* lcn within run */
-	u32 r; /* mft_record within set */
-	s64 current_lcn;
+	char *rec;
+	u32 r;
+
+	for (r=0; r<count; r++) {
+		rec = &buff[r*record_size];
+		if (mft) {
+			if (!strncmp(rec, "FILE", 4))
+				wipe_mft(rec, record_size, first + r);
+		} else {
+			if (!opt.preserve_timestamps
+			    && !strncmp(rec, "INDX", 4))
+				wipe_indx(rec, record_size);
+		}
+	}
+}
 
-	current_lcn = image->current_lcn;
-	mft_record_size = image->ni->vol->mft_record_size;
-	csize = image->ni->vol->cluster_size;
-	bytes_per_sector = image->ni->vol->sector_size;
-	fd = image->ni->vol->dev;
-		/*
-		 * Depending on the sizes, there may be several records
-		 * per cluster, or several clusters per record.
-		 */
-	if (csize >= mft_record_size) {
-		records_per_set = csize/mft_record_size;
-		clusters_per_set = 1;
-	} else {
-		clusters_per_set = mft_record_size/csize;
-		records_per_set = 1;
+#ifdef ENABLE_THREADS
+
+/*
+ *		Thread wiping chunks of records of the current batch
+ */
+
+static void *wipe_thread(void *arg __attribute__((unused)))
+{
+	u32 first;
+	u32 count;
+
+	pthread_mutex_lock(&wiping.lock);
+	while (!wiping.stop) {
+		if (wiping.next < wiping.count) {
+			first = wiping.next;
+			count = min(WIPE_CHUNK, wiping.count - first);
+			wiping.next += count;
+			pthread_mutex_unlock(&wiping.lock);
+			wipe_records(&wiping.buff[first*wiping.record_size],
+					wiping.record_size,
+					wiping.first + first, count,
+					wiping.mft);
+			pthread_mutex_lock(&wiping.lock);
+			wiping.done += count;
+			if (wiping.done == wiping.count)
+				pthread_cond_broadcast(&wiping.cond);
+		} else
+			pthread_cond_wait(&wiping.cond, &wiping.lock);
 	}
-	mft_no = 0;
-	ri = rj = 0;
-	wi = wj = 0;
-	if (rl[ri].length)
-		lseek_to_cluster(rl[ri].lcn);
-	while (rl[ri].length) {
-		for (k=0; (k<clusters_per_set) && rl[ri].length; k++) {
-			read_rescue(fd, &buff[k*csize], csize, bytes_per_sector,
-							rl[ri].lcn + rj);
-			if (++rj >= rl[ri].length) {
-				rj = 0;
-				if (rl[++ri].length)
-					lseek_to_cluster(rl[ri].lcn);
-			}
+	pthread_mutex_unlock(&wiping.lock);
+	return ((void*)NULL);
+}
+
+#endif
+
+/*
+ *		Start the threads wiping the records of a metadata image
+ */
+
+static void start_wiping(void)
+{
+#ifdef ENABLE_THREADS
+	int i;
+
+	memset(&wiping, 0, sizeof(wiping));
+	if (opt.threads > 1) {
+		wiping.threads = (pthread_t*)ntfs_malloc(opt.threads
+					* sizeof(pthread_t));
+		if (!wiping.threads
+		    || pthread_mutex_init(&wiping.lock, NULL)
+		    || pthread_cond_init(&wiping.cond, NULL))
+			perr_exit("start_wiping");
+		wiping.thread_count = opt.threads;
+		for (i=0; i<wiping.thread_count; i++) {
+			errno = pthread_create(&wiping.threads[i], NULL,
+						wipe_thread, NULL);
+			if (errno)
+				perr_exit("pthread_create");
 		}
-		if (k == clusters_per_set) {
-			for (r=0; r<records_per_set; r++) {
-				if (!strncmp(&buff[r*mft_record_size],"FILE",4))
-					wipe_mft(&buff[r*mft_record_size],
-						mft_record_size, mft_no);
-				mft_no++;
+	}
+#endif
+}
+
+static void stop_wiping(void)
+{
+#ifdef ENABLE_THREADS
+	int i;
+
+	if (wiping.thread_count) {
+		pthread_mutex_lock(&wiping.lock);
+		wiping.stop = TRUE;
+		pthread_cond_broadcast(&wiping.cond);
+		pthread_mutex_unlock(&wiping.lock);
+		for (i=0; i<wiping.thread_count; i++)
+			pthread_join(wiping.threads[i], NULL);
+		pthread_cond_destroy(&wiping.cond);
+		pthread_mutex_destroy(&wiping.lock);
+		free(wiping.threads);
+		wiping.thread_count = 0;
+	}
+#endif
+}
+
+/*
+ *		Submit a batch of records for wiping
+ *
+ *	Small batches are wiped inline, as waking up the threads
+ *	would cost more.
+ */
+
+static void submit_wipe_batch(struct wipe_batch *batch, u32 record_size,
+			u32 count, BOOL mft)
+{
+	if (wiping.thread_count && (count > WIPE_CHUNK)) {
+#ifdef ENABLE_THREADS
+		pthread_mutex_lock(&wiping.lock);
+		wiping.buff = batch->buff;
+		wiping.record_size = record_size;
+		wiping.first = batch->first;
+		wiping.mft = mft;
+		wiping.next = 0;
+		wiping.done = 0;
+		wiping.count = count;
+		pthread_cond_broadcast(&wiping.cond);
+		pthread_mutex_unlock(&wiping.lock);
+#endif
+	} else
+		wipe_records(batch->buff, record_size, batch->first,
+				count, mft);
+}
+
+static void wait_wipe_batch(void)
+{
+#ifdef ENABLE_THREADS
+	if (wiping.thread_count) {
+		pthread_mutex_lock(&wiping.lock);
+		while (wiping.done < wiping.count)
+			pthread_cond_wait(&wiping.cond, &wiping.lock);
+		wiping.count = 0;
+		pthread_mutex_unlock(&wiping.lock);
+	}
+#endif
+}
+
+/*
+ *		Read the next clusters of a runlist into a batch
+ *
+ *	Each run is read at once, and one cluster at a time if this
+ *	fails, so that only the faulty ones have to be rescued.
+ */
+
+static void read_wipe_batch(struct wipe_batch *batch, runlist *rl,
+			u32 *pri, u32 *prj, u32 max_clusters)
+{
+	void *fd = vol->dev;
+	u32 csize = vol->cluster_size;
+	u32 count;
+	u32 i;
+
+	batch->wi = *pri;
+	batch->wj = *prj;
+	batch->clusters = 0;
+	while (rl[*pri].length && (batch->clusters < max_clusters)) {
+		count = min(rl[*pri].length - *prj,
+				max_clusters - batch->clusters);
+		lseek_to_cluster(rl[*pri].lcn + *prj);
+		if (read_all(fd, &batch->buff[batch->clusters*csize],
+				count*csize) == -1) {
+			if (errno != EIO)
+				perr_exit("read_all");
+			for (i=0; i<count; i++) {
+				lseek_to_cluster(rl[*pri].lcn + *prj + i);
+				read_rescue(fd, &batch->buff[(batch->clusters
+						+ i)*csize],
+					csize, vol->sector_size,
+					rl[*pri].lcn + *prj + i);
 			}
-			write_set(buff, csize, &current_lcn,
-					rl, wi, wj, clusters_per_set);
-			wj += clusters_per_set;
-			while (rl[wi].length && (wj >= rl[wi].length))
-				wj -= rl[wi++].length;
-		} else {
-			err_exit("Short last MFT record\n");
+		}
+		batch->clusters += count;
+		*prj += count;
+		if (*prj >= rl[*pri].length) {
+			*prj = 0;
+			(*pri)++;
 		}
 	}
-	image->current_lcn = current_lcn;
 }
 
 /*
- *		Copy and wipe the non-resident part of a directory index
+ *		Copy and wipe the records of the MFT, MFTMirr or a directory
  *	(only for metadata images)
  *
  *	Data are read and written by full clusters, but the wiping is done
- *	per index record.
+ *	per record.
+ *
+ *	Returns FALSE if the last record is short
  */
 
-static void copy_wipe_i30(ntfs_walk_clusters_ctx *image, runlist *rl)
+static BOOL copy_wipe_records(ntfs_walk_clusters_ctx *image, runlist *rl,
+			u32 record_size, BOOL mft)
 {
-	char buff[NTFS_MAX_CLUSTER_SIZE]; /* overflow checked at mount time */
-	void *fd;
-	u32 indx_record_size;
+	struct wipe_batch batch[2];
+	s64 current_lcn;
+	s64 total;
 	u32 csize;
-	u32 bytes_per_sector;
 	u32 records_per_set;
 	u32 clusters_per_set;
-	u32 wi,wj; /* indexes for reading */
-	u32 ri,rj; /* indexes for writing */
-	u32 k; /* lcn within run */
-	u32 r; /* mft_record within set */
-	s64 current_lcn;
+	u32 max_clusters;
+	u32 count;
+	u32 ri, rj; /* indexes for reading */
+	int cur;
+	int other;
+	BOOL pending;
+	BOOL ok;
 
 	current_lcn = image->current_lcn;
-	csize = image->ni->vol->cluster_size;
-	bytes_per_sector = image->ni->vol->sector_size;
-	fd = image->ni->vol->dev;
+	csize = vol->cluster_size;
 		/*
 		 * Depending on the sizes, there may be several records
 		 * per cluster, or several clusters per record.
 		 */
-	indx_record_size = image->ni->vol->indx_record_size;
-	if (csize >= indx_record_size) {
-		records_per_set = csize/indx_record_size;
+	if (csize >= record_size) {
+		records_per_set = csize/record_size;
 		clusters_per_set = 1;
 	} else {
-		clusters_per_set = indx_record_size/csize;
+		clusters_per_set = record_size/csize;
 		records_per_set = 1;
 	}
+		/* the batches are made of full sets, and not oversized */
+	total = 0;
+	for (ri=0; rl[ri].length; ri++)
+		total += rl[ri].length;
+	max_clusters = (NTFS_COPY_RUN_SIZE/(clusters_per_set*csize))
+				* clusters_per_set;
+	if (total < max_clusters)
+		max_clusters = total;
+	ok = TRUE;
+	if (!max_clusters)
+		return (ok);
+	batch[0].buff = (char*)ntfs_malloc(max_clusters*csize);
+	batch[1].buff = (char*)ntfs_malloc(max_clusters*csize);
+	if (!batch[0].buff || !batch[1].buff)
+		perr_exit("copy_wipe_records");
 	ri = rj = 0;
-	wi = wj = 0;
-	if (rl[ri].length)
-		lseek_to_cluster(rl[ri].lcn);
-	while (rl[ri].length) {
-		for (k=0; (k<clusters_per_set) && rl[ri].length; k++) {
-			read_rescue(fd, &buff[k*csize], csize, bytes_per_sector,
-							rl[ri].lcn + rj);
-			if (++rj >= rl[ri].length) {
-				rj = 0;
-				if (rl[++ri].length)
-					lseek_to_cluster(rl[ri].lcn);
-			}
-		}
-		if (k == clusters_per_set) {
-			/* wipe records_per_set records */
-			if (!opt.preserve_timestamps)
-				for (r=0; r<records_per_set; r++) {
-					if (!strncmp(&buff[r*indx_record_size],"INDX",4))
-						wipe_indx(&buff[r*indx_record_size],
-							indx_record_size);
-				}
-			write_set(buff, csize, &current_lcn,
-					rl, wi, wj, clusters_per_set);
-			wj += clusters_per_set;
-			while (rl[wi].length && (wj >= rl[wi].length))
-				wj -= rl[wi++].length;
-		} else {
-			err_exit("Short last directory index record\n");
+	cur = 0;
+	pending = FALSE;
+	read_wipe_batch(&batch[cur], rl, &ri, &rj, max_clusters);
+	batch[cur].first = 0;
+	while (ok && batch[cur].clusters) {
+		if (batch[cur].clusters % clusters_per_set)
+			ok = FALSE;
+		else {
+			count = batch[cur].clusters/clusters_per_set
+						* records_per_set;
+			submit_wipe_batch(&batch[cur], record_size,
+						count, mft);
+			other = 1 - cur;
+			if (pending)
+				write_set(batch[other].buff, csize,
+					&current_lcn, rl, batch[other].wi,
+					batch[other].wj,
+					batch[other].clusters);
+			read_wipe_batch(&batch[other], rl, &ri, &rj,
+					max_clusters);
+			batch[other].first = batch[cur].first + count;
+			wait_wipe_batch();
+			pending = TRUE;
+			cur = other;
 		}
 	}
+	if (ok && pending)
+		write_set(batch[1 - cur].buff, csize, &current_lcn, rl,
+				batch[1 - cur].wi, batch[1 - cur].wj,
+				batch[1 - cur].clusters);
+	free(batch[0].buff);
+	free(batch[1].buff);
 	image->current_lcn = current_lcn;
+	return (ok);
+}
+
+/*
+ *		Copy and wipe the full MFT or MFTMirr data.
+ *	(only for metadata images)
+ */
+
+static void copy_wipe_mft(ntfs_walk_clusters_ctx *image, runlist *rl)
+{
+	if (!copy_wipe_records(image, rl, vol->mft_record_size, TRUE))
+		err_exit("Short last MFT record\n");
+}
+
+/*
+ *		Copy and wipe the non-resident part of a directory index
+ *	(only for metadata images)
+ */
+
+static void copy_wipe_i30(ntfs_walk_clusters_ctx *image, runlist *rl)
+{
+	if (!copy_wipe_records(image, rl, vol->indx_record_size, FALSE))
+		err_exit("Short last directory index record\n");
 }
 
 static void dump_clusters(ntfs_walk_clusters_ctx *image, runlist *rl)
@@ -1744,6 +3721,7 @@ static void walk_runs(struct ntfs_walk_cluster *walk)
 					AT_DATA, NULL, 0);
 			if (na) {
 				na->rl = rl;
+				ntfs_attr_forget_runs(na);
 				rl = (runlist_element*)NULL;
 				if (!ntfs_attr_map_whole_runlist(na)) {
 					copy_wipe_mft(walk->image,na->rl);
@@ -1760,6 +3738,7 @@ static void walk_runs(struct ntfs_walk_cluster *walk)
 					AT_INDEX_ALLOCATION, NTFS_INDEX_I30, 4);
 			if (na) {
 				na->rl = rl;
+				ntfs_attr_forget_runs(na);
 				rl = (runlist_element*)NULL;
 				if (!ntfs_attr_map_whole_runlist(na)) {
 					copy_wipe_i30(walk->image,na->rl);
@@ -1922,6 +3901,7 @@ static int walk_clusters(ntfs_volume *volume, struct ntfs_walk_cluster *walk)
 	s64 last_mft_rec;
 	u64 nr_clusters;
 	ntfs_inode *ni;
+	struct MFT_SCAN *scan;
 	struct progress_bar progress;
 
 	if (opt.restore_image || (!opt.metadata && wipe))
@@ -1934,7 +3914,11 @@ static int walk_clusters(ntfs_volume *volume, struct ntfs_walk_cluster *walk)
 	progress_init(&progress, inode, last_mft_rec, 100);
 
 	NVolSetNoFixupWarn(volume);
-	for (; inode <= last_mft_rec; inode++) {
+		/* the records are read in batches by the scan */
+	scan = ntfs_mft_scan_start(volume, inode, last_mft_rec + 1);
+	if (!scan)
+		perr_exit("ntfs_mft_scan_start");
+	while (ntfs_mft_scan_next(scan, &inode, (MFT_RECORD**)NULL)) {
 
 		int err, deleted_inode;
 		MFT_REF mref = (MFT_REF)inode;
@@ -2005,6 +3989,7 @@ out:
 			perr_exit("ntfs_inode_close for inode %lld",
 				(long long)inode);
 	}
+	ntfs_mft_scan_end(scan);
 	if (opt.metadata) {
 		if (opt.metadata_image && wipe && opt.ignore_fs_check) {
 			gap_to_cluster(-walk->image->current_lcn);
@@ -2370,7 +4355,7 @@ static s64 open_image(void)
 		le32 offset_to_image_data;
 		int delta;
 
-		if (image_hdr.major_ver > NTFSCLONE_IMG_VER_MAJOR)
+		if (image_hdr.major_ver > NTFSCLONE_IMG_VER_MAJOR_BLOCKS)
 			err_exit("Do not know how to handle image format "
 					"version %d.%d.  Please obtain a "
 					"newer version of ntfsclone.\n",
@@ -2405,6 +4390,58 @@ static s64 open_image(void)
 	return le64_to_cpu(image_hdr.device_size);
 }
 
+/*
+ *		Restore the differential images which follow the first one
+ *
+ *	Each image must have been based on the one restored before it.
+ */
+
+static void restore_next_images(void)
+{
+	struct image_hdr previous;
+	struct image_trailer trailer;
+	struct image_index *index;
+	const char *previous_name;
+	s64 count;
+	le64 previous_id;
+	int i;
+
+	for (i=0; i<opt.next_image_count; i++) {
+		index = (struct image_index*)NULL;
+		if (image_hdr.major_ver == NTFSCLONE_IMG_VER_MAJOR_BLOCKS)
+			index = read_image_index(fd_in, &trailer, &count);
+		if (!index)
+			err_exit("Image '%s' cannot be followed by a "
+				"differential image\n", opt.volume);
+		free(index);
+		previous_id = trailer.image_id;
+		previous = image_hdr;
+		previous_name = opt.volume;
+		close(fd_in);
+		opt.volume = opt.next_images[i];
+		open_image();
+		if ((image_hdr.major_ver != NTFSCLONE_IMG_VER_MAJOR_BLOCKS)
+		    || (image_hdr.minor_ver != NTFSCLONE_IMG_VER_MINOR_DIFF))
+			err_exit("'%s' is not a differential image\n",
+					opt.volume);
+		if ((image_hdr.cluster_size != previous.cluster_size)
+		    || (image_hdr.device_size != previous.device_size)
+		    || (image_hdr.nr_clusters != previous.nr_clusters))
+			err_exit("Image '%s' was not made from the same "
+				"volume as '%s'\n", opt.volume, previous_name);
+		index = read_image_index(fd_in, &trailer, &count);
+		if (!index)
+			err_exit("Image '%s' has no valid index\n",
+					opt.volume);
+		free(index);
+		if (trailer.base_id != previous_id)
+			err_exit("Image '%s' was not based on '%s'\n",
+					opt.volume, previous_name);
+		print_image_info();
+		restore_image();
+	}
+}
+
 static s64 open_volume(void)
 {
 	s64 device_size;
@@ -2429,8 +4466,15 @@ static s64 open_volume(void)
 static void initialise_image_hdr(s64 device_size, s64 inuse)
 {
 	memcpy(image_hdr.magic, IMAGE_MAGIC, IMAGE_MAGIC_SIZE);
-	image_hdr.major_ver = NTFSCLONE_IMG_VER_MAJOR;
-	image_hdr.minor_ver = NTFSCLONE_IMG_VER_MINOR;
+	if (opt.compress) {
+		image_hdr.major_ver = NTFSCLONE_IMG_VER_MAJOR_BLOCKS;
+		image_hdr.minor_ver = (opt.differential
+					? NTFSCLONE_IMG_VER_MINOR_DIFF
+					: NTFSCLONE_IMG_VER_MINOR_BLOCKS);
+	} else {
+		image_hdr.major_ver = NTFSCLONE_IMG_VER_MAJOR;
+		image_hdr.minor_ver = NTFSCLONE_IMG_VER_MINOR;
+	}
 	image_hdr.cluster_size = cpu_to_le32(vol->cluster_size);
 	image_hdr.device_size = cpu_to_le64(device_size);
 	image_hdr.nr_clusters = cpu_to_sle64(vol->nr_clusters);
@@ -2458,6 +4502,36 @@ static void check_output_device(s64 input_size)
 		set_filesize(input_size);
 }
 
+/*
+ *		Discard the output device before writing to it
+ *
+ *	The clusters which are not in use are skipped when cloning or
+ *	restoring, so a thin provisioned device only gets the storage
+ *	for the clusters in use, and an SSD does not have to keep the
+ *	previous data. A file is always created sparse, there is
+ *	nothing to discard.
+ */
+
+static void discard_output_device(s64 input_size)
+{
+	if (opt.blkdev_out) {
+#ifdef BLKDISCARD
+		u64 range[2];
+
+		Printf("Discarding the output device ...\n");
+		range[0] = 0;
+		range[1] = input_size;
+		if (dev_out || ioctl(fd_out, BLKDISCARD, &range))
+			Printf("WARNING: Couldn't discard '%s' : %s\n",
+				opt.output,
+				(dev_out ? "not supported" : strerror(errno)));
+#else
+		Printf("WARNING: Discarding is not supported on this "
+			"system\n");
+#endif
+	}
+}
+
 static void ignore_bad_clusters(ntfs_walk_clusters_ctx *image)
 {
 	ntfs_inode *ni;
@@ -2541,6 +4615,7 @@ int main(int argc, char **argv)
 	s64 device_size;        /* input device size in bytes */
 	s64 ntfs_size;
 	unsigned int wiped_total = 0;
+	BOOL differential = FALSE;	/* restoring only changes */
 
 	/* make sure the layout of header is not affected by alignments */
 	if (offsetof(struct image_hdr, offset_to_image_data)
@@ -2557,10 +4632,27 @@ int main(int argc, char **argv)
 
 	utils_set_locale();
 
+	if (opt.verify) {
+		open_image();
+		print_image_info();
+		exit(verify_image(opt.next_image_count
+				? opt.next_images[0] : (const char*)NULL));
+	}
+
 	if (opt.restore_image) {
 		device_size = open_image();
 		ntfs_size = sle64_to_cpu(image_hdr.nr_clusters) *
 				le32_to_cpu(image_hdr.cluster_size);
+		if ((image_hdr.major_ver == NTFSCLONE_IMG_VER_MAJOR_BLOCKS)
+		    && (image_hdr.minor_ver == NTFSCLONE_IMG_VER_MINOR_DIFF)) {
+			if (opt.std_out)
+				err_exit("A differential image cannot be "
+					 "restored to standard output\n");
+			if (opt.discard)
+				err_exit("A differential image cannot be "
+					 "restored with discarding\n");
+			differential = TRUE;
+		}
 	} else {
 		device_size = open_volume();
 		ntfs_size = vol->nr_clusters * vol->cluster_size;
@@ -2569,6 +4661,9 @@ int main(int argc, char **argv)
 	ntfs_size += 512; /* add backup boot sector */
 	full_device_size = device_size;
 
+	if (opt.differential)
+		load_previous_image(opt.differential, device_size);
+
 	if (opt.std_out) {
 		if ((fd_out = fileno(stdout)) == -1)
 			perr_exit("fileno for stdout failed");
@@ -2582,7 +4677,7 @@ int main(int argc, char **argv)
 		int flags = O_RDWR | O_BINARY;
 
 		fd_out = 0;
-		if (!opt.blkdev_out) {
+		if (!opt.blkdev_out && !differential) {
 			flags |= O_CREAT | O_TRUNC;
 			if (!opt.overwrite)
 				flags |= O_EXCL;
@@ -2613,13 +4708,19 @@ int main(int argc, char **argv)
 #endif
 		}
 
-		if (!opt.save_image && !opt.metadata_image && !opt.no_action)
+			/* a differential image updates an existing file */
+		if (!opt.save_image && !opt.metadata_image && !opt.no_action
+		    && (opt.blkdev_out || !differential)) {
 			check_output_device(ntfs_size);
+			if (opt.discard)
+				discard_output_device(ntfs_size);
+		}
 	}
 
 	if (opt.restore_image) {
 		print_image_info();
 		restore_image();
+		restore_next_images();
 		if (!opt.no_action)
 			fsync_clone(fd_out);
 		exit(0);
@@ -2679,7 +4780,11 @@ int main(int argc, char **argv)
 	memset(&image, 0, sizeof(image));
 	backup_clusters.image = &image;
 
+	if (opt.metadata_image)
+		start_wiping();
 	walk_clusters(vol, &backup_clusters);
+	if (opt.metadata_image)
+		stop_wiping();
 
 	Printf("Num of MFT records       = %10lld\n",
 			(long long)vol->mft_na->initialized_size >>
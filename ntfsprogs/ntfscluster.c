@@ -86,10 +86,12 @@ static void usage(void)
 		"\n"
 		"    -c, --cluster RANGE  Look for objects in this range of clusters\n"
 		"    -s, --sector RANGE   Look for objects in this range of sectors\n"
+		"    -L, --list FILE      Look for objects in the sector ranges in FILE\n"
 		"    -I, --inode NUM      Show information about this inode\n"
 		"    -F, --filename NAME  Show information about this file\n"
 	/*	"    -l, --last           Find the last file on the volume\n" */
 		"\n"
+		"    -x, --index FILE     Keep the index of the clusters in FILE\n"
 		"    -f, --force          Use less caution\n"
 		"    -q, --quiet          Less output\n"
 		"    -v, --verbose        More output\n"
@@ -110,7 +112,7 @@ static void usage(void)
  */
 static int parse_options(int argc, char **argv)
 {
-	static const char *sopt = "-c:F:fh?I:ilqs:vV";
+	static const char *sopt = "-c:F:fh?I:iL:lqs:vVx:";
 	static const struct option lopt[] = {
 		{ "cluster",	required_argument,	NULL, 'c' },
 		{ "filename",	required_argument,	NULL, 'F' },
@@ -119,10 +121,12 @@ static int parse_options(int argc, char **argv)
 		{ "info",	no_argument,		NULL, 'i' },
 		{ "inode",	required_argument,	NULL, 'I' },
 		{ "last",	no_argument,		NULL, 'l' },
+		{ "list",	required_argument,	NULL, 'L' },
 		{ "quiet",	no_argument,		NULL, 'q' },
 		{ "sector",	required_argument,	NULL, 's' },
 		{ "verbose",	no_argument,		NULL, 'v' },
 		{ "version",	no_argument,		NULL, 'V' },
+		{ "index",	required_argument,	NULL, 'x' },
 		{ NULL,		0,			NULL, 0   }
 	};
 
@@ -187,6 +191,13 @@ static int parse_options(int argc, char **argv)
 			else
 				opts.action = act_error;
 			break;
+		case 'L':
+			if (opts.action == act_none) {
+				opts.action = act_list;
+				opts.list_file = optarg;
+			} else
+				opts.action = act_error;
+			break;
 		case 'l':
 			if (opts.action == act_none)
 				opts.action = act_last;
@@ -211,6 +222,9 @@ static int parse_options(int argc, char **argv)
 		case 'V':
 			ver++;
 			break;
+		case 'x':
+			opts.index_file = optarg;
+			break;
 		case '?':
 			if (strncmp (argv[optind-1], "--log-", 6) == 0) {
 				if (!ntfs_log_parse_option (argv[optind-1]))
@@ -219,7 +233,8 @@ static int parse_options(int argc, char **argv)
 			}
 			/* fall through */
 		default:
-			if ((optopt == 'c') || (optopt == 's'))
+			if ((optopt == 'c') || (optopt == 's')
+			    || (optopt == 'L') || (optopt == 'x'))
 				ntfs_log_error("Option '%s' requires an argument.\n", argv[optind-1]);
 			else
 				ntfs_log_error("Unknown option '%s'.\n", argv[optind-1]);
@@ -255,7 +270,7 @@ static int parse_options(int argc, char **argv)
 		}
 
 		if (opts.action == act_error) {
-			ntfs_log_error("You may only specify one action: --info, --cluster, --sector or --last.\n");
+			ntfs_log_error("You may only specify one action: --info, --cluster, --sector, --list or --last.\n");
 			err++;
 		} else if (opts.range_begin > opts.range_end) {
 			ntfs_log_error("The range must be in ascending order.\n");
@@ -471,6 +486,97 @@ static int find_last(ntfs_inode *ino, ATTR_RECORD *attr, runlist_element *run,
 	return 0;
 }
 
+/**
+ * find_range - Look for the owners of a range of clusters
+ *
+ * The index of the clusters is only used when it is kept in a file.
+ */
+static int find_range(ntfs_volume *vol, LCN begin, LCN end)
+{
+	struct LCN_INDEX *index;
+	int result;
+
+	if (!opts.index_file)
+		return cluster_find(vol, begin, end,
+				(cluster_cb*)&print_match, NULL);
+	index = cluster_get_index(vol, opts.index_file);
+	if (!index)
+		return 1;
+	result = cluster_find_indexed(vol, index, begin, end,
+			(cluster_cb*)&print_match, NULL);
+	ntfs_lcnindex_free(index);
+	return result;
+}
+
+/**
+ * find_list - Look for the owners of the sector ranges listed in a file
+ *
+ * The file has a sector or a range of sectors per line, as accepted by
+ * --sector, blank lines and lines beginning with '#' are ignored. The
+ * MFT is only scanned once for all the ranges.
+ */
+static int find_list(ntfs_volume *vol)
+{
+	struct LCN_INDEX *index;
+	FILE *f;
+	char line[256];
+	char *p;
+	s64 begin, end;
+	int shift;
+	int result;
+	int count;
+
+	if (!strcmp(opts.list_file, "-"))
+		f = stdin;
+	else
+		f = fopen(opts.list_file, "r");
+	if (!f) {
+		ntfs_log_perror("Couldn't open %s", opts.list_file);
+		return 1;
+	}
+	index = cluster_get_index(vol, opts.index_file);
+	if (!index) {
+		if (f != stdin)
+			fclose(f);
+		return 1;
+	}
+	shift = vol->cluster_size_bits - vol->sector_size_bits;
+	result = 0;
+	count = 0;
+	while (!result && fgets(line, sizeof(line), f)) {
+		count++;
+		p = line + strlen(line);
+		while ((p > line) && ((p[-1] == '\n') || (p[-1] == '\r')
+				|| (p[-1] == ' ') || (p[-1] == '\t')))
+			*--p = 0;
+		p = line;
+		while ((*p == ' ') || (*p == '\t'))
+			p++;
+		if (!*p || (*p == '#'))
+			continue;
+		if (!utils_parse_range(p, &begin, &end, FALSE)
+		    || (begin > end)) {
+			ntfs_log_error("Bad sector range '%s' at line %d "
+					"of %s\n", p, count, opts.list_file);
+			result = 1;
+			break;
+		}
+		if (begin == end)
+			ntfs_log_quiet("Searching for sector %llu\n",
+					(unsigned long long)begin);
+		else
+			ntfs_log_quiet("Searching for sector range %llu-%llu\n",
+					(unsigned long long)begin,
+					(unsigned long long)end);
+		result = cluster_find_indexed(vol, index, begin >> shift,
+				end >> shift, (cluster_cb*)&print_match, NULL);
+	}
+	ntfs_lcnindex_free(index);
+	if (f != stdin)
+		fclose(f);
+	return result;
+}
+
 /**
  * main - Begin here
  *
@@ -510,7 +616,10 @@ int main(int argc, char *argv[])
 			/* Convert to clusters */
 			opts.range_begin >>= (vol->cluster_size_bits - vol->sector_size_bits);
 			opts.range_end   >>= (vol->cluster_size_bits - vol->sector_size_bits);
-			result = cluster_find(vol, opts.range_begin, opts.range_end, (cluster_cb*)&print_match, NULL);
+			result = find_range(vol, opts.range_begin, opts.range_end);
+			break;
+		case act_list:
+			result = find_list(vol);
 			break;
 		case act_cluster:
 			if (opts.range_begin == opts.range_end)
@@ -518,7 +627,7 @@ int main(int argc, char *argv[])
 						(unsigned long long)opts.range_begin);
 			else
 				ntfs_log_quiet("Searching for cluster range %llu-%llu\n", (unsigned long long)opts.range_begin, (unsigned long long)opts.range_end);
-			result = cluster_find(vol, opts.range_begin, opts.range_end, (cluster_cb*)&print_match, NULL);
+			result = find_range(vol, opts.range_begin, opts.range_end);
 			break;
 		case act_file:
 			ino = ntfs_pathname_to_inode(vol, NULL, opts.filename);
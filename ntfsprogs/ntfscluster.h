@@ -32,6 +32,7 @@ enum action {
 	act_info,
 	act_cluster,
 	act_sector,
+	act_list,
 	act_inode,
 	act_file,
 	act_last,
@@ -48,6 +49,8 @@ struct options {
 	u64		 inode;		/* Inode to examine */
 	s64		 range_begin;	/* Look for objects in this range */
 	s64		 range_end;
+	char		*list_file;	/* Sector ranges to look for */
+	char		*index_file;	/* Saved index of the clusters */
 };
 
 struct match {
@@ -32,8 +32,12 @@
 #include <string.h>
 #include <errno.h>
 #include <getopt.h>
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
 
 #include "mst.h"
+#include "mft.h"
 #include "support.h"
 #include "utils.h"
 #include "misc.h"
@@ -60,10 +64,36 @@ static struct {
 	int debug;
 	int show_progress;
 	int verbose;
+	int metadata;
 	char *vol1;
 	char *vol2;
 } opt;
 
+	/*
+	 * The contents of the attributes are read in large chunks, and
+	 * when threads are available, the chunk of the second volume is
+	 * read by another thread while the chunk of the first volume is
+	 * being read.
+	 */
+#define CMP_BUFFER_SIZE (1024*1024)
+
+static struct {
+	u8 *buf1;
+	u8 *buf2;
+#ifdef ENABLE_THREADS
+	BOOL threaded;
+	BOOL stop;
+	BOOL pending;	/* a read is requested to the thread */
+	ntfs_attr *na;
+	s64 pos;
+	s64 count;	/* result of the read */
+	int err;	/* errno if the read failed */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+} reading;
+
 
 #define NTFS_PROGBAR		0x0001
 #define NTFS_PROGBAR_SUPPRESS	0x0002
@@ -170,6 +200,7 @@ static void usage(void)
 	printf("\nUsage: %s [OPTIONS] DEVICE1 DEVICE2\n"
 		"    Compare two NTFS volumes and tell the differences.\n"
 		"\n"
+		"    -m, --metadata         Don't compare the contents of user files\n"
 		"    -P, --no-progress-bar  Don't show progress bar\n"
 		"    -v, --verbose          More output\n"
 		"    -h, --help             Display this help\n"
@@ -184,12 +215,13 @@ static void usage(void)
 
 static void parse_options(int argc, char **argv)
 {
-	static const char *sopt = "-dhPv";
+	static const char *sopt = "-dhmPv";
 	static const struct option lopt[] = {
 #ifdef DEBUG
 		{ "debug",		no_argument,	NULL, 'd' },
 #endif
 		{ "help",		no_argument,	NULL, 'h' },
+		{ "metadata",		no_argument,	NULL, 'm' },
 		{ "no-progress-bar",	no_argument,	NULL, 'P' },
 		{ "verbose",		no_argument,	NULL, 'v' },
 		{ NULL, 0, NULL, 0 }
@@ -220,6 +252,9 @@ static void parse_options(int argc, char **argv)
 		case 'h':
 		case '?':
 			usage();
+		case 'm':
+			opt.metadata++;
+			break;
 		case 'P':
 			opt.show_progress = 0;
 			break;
@@ -597,17 +632,111 @@ out:
 	return;
 }
 
+#ifdef ENABLE_THREADS
+
+/*
+ *		Thread reading the chunks of the second volume
+ */
+
+static void *read_thread(void *arg __attribute__((unused)))
+{
+	pthread_mutex_lock(&reading.lock);
+	while (!reading.stop) {
+		if (reading.pending) {
+			pthread_mutex_unlock(&reading.lock);
+			reading.count = ntfs_attr_pread(reading.na,
+					reading.pos, CMP_BUFFER_SIZE,
+					reading.buf2);
+			reading.err = errno;
+			pthread_mutex_lock(&reading.lock);
+			reading.pending = FALSE;
+			pthread_cond_broadcast(&reading.cond);
+		} else
+			pthread_cond_wait(&reading.cond, &reading.lock);
+	}
+	pthread_mutex_unlock(&reading.lock);
+	return ((void*)NULL);
+}
+
+#endif
+
+static void start_reading(void)
+{
+	memset(&reading, 0, sizeof(reading));
+	reading.buf1 = (u8*)ntfs_malloc(CMP_BUFFER_SIZE);
+	reading.buf2 = (u8*)ntfs_malloc(CMP_BUFFER_SIZE);
+	if (!reading.buf1 || !reading.buf2)
+		perr_exit("Failed to allocate the comparison buffers");
+#ifdef ENABLE_THREADS
+	if (!pthread_mutex_init(&reading.lock, NULL)) {
+		if (!pthread_cond_init(&reading.cond, NULL)) {
+			reading.threaded = !pthread_create(&reading.thread,
+						NULL, read_thread, NULL);
+			if (!reading.threaded)
+				pthread_cond_destroy(&reading.cond);
+		}
+		if (!reading.threaded)
+			pthread_mutex_destroy(&reading.lock);
+	}
+#endif
+}
+
+static void stop_reading(void)
+{
+#ifdef ENABLE_THREADS
+	if (reading.threaded) {
+		pthread_mutex_lock(&reading.lock);
+		reading.stop = TRUE;
+		pthread_cond_broadcast(&reading.cond);
+		pthread_mutex_unlock(&reading.lock);
+		pthread_join(reading.thread, NULL);
+		pthread_cond_destroy(&reading.cond);
+		pthread_mutex_destroy(&reading.lock);
+	}
+#endif
+	free(reading.buf1);
+	free(reading.buf2);
+}
+
+/*
+ *		Read the same chunk of an attribute on both volumes
+ */
+
+static void read_chunks(ntfs_attr *na1, ntfs_attr *na2, s64 pos,
+			s64 *count1, s64 *count2)
+{
+#ifdef ENABLE_THREADS
+	if (reading.threaded) {
+		pthread_mutex_lock(&reading.lock);
+		reading.na = na2;
+		reading.pos = pos;
+		reading.pending = TRUE;
+		pthread_cond_broadcast(&reading.cond);
+		pthread_mutex_unlock(&reading.lock);
+		*count1 = ntfs_attr_pread(na1, pos, CMP_BUFFER_SIZE,
+					reading.buf1);
+		pthread_mutex_lock(&reading.lock);
+		while (reading.pending)
+			pthread_cond_wait(&reading.cond, &reading.lock);
+		*count2 = reading.count;
+		pthread_mutex_unlock(&reading.lock);
+		if ((*count1 != -1) && (*count2 == -1))
+			errno = reading.err;
+		return;
+	}
+#endif
+	*count1 = ntfs_attr_pread(na1, pos, CMP_BUFFER_SIZE, reading.buf1);
+	*count2 = ntfs_attr_pread(na2, pos, CMP_BUFFER_SIZE, reading.buf2);
+}
+
 static void cmp_attribute_data(ntfs_attr *na1, ntfs_attr *na2)
 {
 	s64 pos;
 	s64 count1 = 0, count2;
-	u8  buf1[NTFS_BUF_SIZE];
-	u8  buf2[NTFS_BUF_SIZE];
 
 	for (pos = 0; pos <= na1->data_size; pos += count1) {
 
-		count1 = ntfs_attr_pread(na1, pos, NTFS_BUF_SIZE, buf1);
-		count2 = ntfs_attr_pread(na2, pos, NTFS_BUF_SIZE, buf2);
+		read_chunks(na1, na2, pos, &count1, &count2);
 
 		if (count1 != count2) {
 			print_na(na1);
@@ -640,7 +769,7 @@ static void cmp_attribute_data(ntfs_attr *na1, ntfs_attr *na2)
 			exit(1);
 		}
 
-		if (cmp_buffer(buf1, buf2, count1, na1))
+		if (cmp_buffer(reading.buf1, reading.buf2, count1, na1))
 			return;
 	}
 
@@ -709,7 +838,8 @@ static void cmp_attribute(ntfs_attr_search_ctx *ctx1,
 
 	if (na1->type == AT_INDEX_ALLOCATION)
 		cmp_index_allocation(na1, na2);
-	else
+	else if (!opt.metadata || (na1->type != AT_DATA)
+	    || (inumber(na1->ni) < FILE_first_user))
 		cmp_attribute_data(na1, na2);
 
 close_attribs:
@@ -896,9 +1026,11 @@ out:
 
 static int cmp_inodes(ntfs_volume *vol1, ntfs_volume *vol2)
 {
-	u64 inode;
+	s64 inode, inode2;
 	int ret1, ret2;
+	int ret;
 	ntfs_inode *ni1, *ni2;
+	struct MFT_SCAN *scan1, *scan2;
 	struct progress_bar progress;
 	int pb_flags = 0;	/* progress bar flags */
 	u64 nr_mft_records, nr_mft_records2;
@@ -921,7 +1053,18 @@ static int cmp_inodes(ntfs_volume *vol1, ntfs_volume *vol2)
 	progress_init(&progress, 0, nr_mft_records - 1, pb_flags);
 	progress_update(&progress, 0);
 
-	for (inode = 0; inode < nr_mft_records; inode++) {
+		/* both scans return the same record numbers */
+	scan1 = ntfs_mft_scan_start(vol1, 0, nr_mft_records);
+	scan2 = ntfs_mft_scan_start(vol2, 0, nr_mft_records);
+	if (!scan1 || !scan2) {
+		perr_println("Could not scan the MFT");
+		ntfs_mft_scan_end(scan1);
+		ntfs_mft_scan_end(scan2);
+		return -1;
+	}
+	ret = 0;
+	while (!ret && ntfs_mft_scan_next(scan1, &inode, (MFT_RECORD**)NULL)
+	    && ntfs_mft_scan_next(scan2, &inode2, (MFT_RECORD**)NULL)) {
 
 		ret1 = inode_open(vol1, (MFT_REF)inode, &ni1);
 		ret2 = inode_open(vol2, (MFT_REF)inode, &ni2);
@@ -939,17 +1082,20 @@ static int cmp_inodes(ntfs_volume *vol1, ntfs_volume *vol2)
 		if (cmp_attributes(ni1, ni2) != 0) {
 			inode_close(ni1);
 			inode_close(ni2);
-			return -1;
+			ret = -1;
+			continue;
 		}
 close_inodes:
-		if (inode_close(ni1) != 0)
-			return -1;
-		if (inode_close(ni2) != 0)
-			return -1;
+		if ((inode_close(ni1) != 0) || (inode_close(ni2) != 0)) {
+			ret = -1;
+			continue;
+		}
 
 		progress_update(&progress, inode);
 	}
-	return 0;
+	ntfs_mft_scan_end(scan1);
+	ntfs_mft_scan_end(scan2);
+	return ret;
 }
 
 static ntfs_volume *mount_volume(const char *volume)
@@ -1001,8 +1147,10 @@ int main(int argc, char **argv)
 	vol1 = mount_volume(opt.vol1);
         vol2 = mount_volume(opt.vol2);
 
+	start_reading();
 	if (cmp_inodes(vol1, vol2) != 0)
 		exit(1);
+	stop_reading();
 
 	ntfs_umount(vol1, FALSE);
 	ntfs_umount(vol2, FALSE);
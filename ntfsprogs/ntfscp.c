@@ -48,6 +48,12 @@
 #ifdef HAVE_LIBGEN_H
 #include <libgen.h>
 #endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
 
 #include "types.h"
 #include "attrib.h"
@@ -59,6 +65,7 @@
 /* #include "version.h" */
 #include "logging.h"
 #include "misc.h"
+#include "system_compression.h"
 
 struct options {
 	char		*device;	/* Device/File to work with */
@@ -72,6 +79,8 @@ struct options {
 	int		 noaction;	/* Do not write to disk */
 	ATTR_TYPES	 attribute;	/* Write to this attribute. */
 	int		 inode;		/* Treat dest_file as inode number. */
+	int		 compact;	/* System compression format, or -1 */
+	int		 sparse;	/* Leave holes for zeroed clusters */
 };
 
 struct ALLOC_CONTEXT {
@@ -89,6 +98,33 @@ struct ALLOC_CONTEXT {
 
 enum STEP { STEP_ERR, STEP_ZERO, STEP_ONE } ;
 
+	/*
+	 * The source file is read in large chunks into two buffers, so
+	 * that, when threads are available, the next chunk can be read
+	 * while the current one is being written to the volume.
+	 */
+#define SOURCE_BUFFER_SIZE (4*1024*1024)
+
+struct COPY_BUFFER {
+	char *data;
+	s64 count;	/* bytes read, short at end of file or on error */
+	int err;	/* errno if the read failed */
+	BOOL filled;
+} ;
+
+static struct {
+	FILE *in;
+	struct COPY_BUFFER buffers[2];
+	int next;	/* buffer to be written next */
+#ifdef ENABLE_THREADS
+	BOOL threaded;
+	BOOL stop;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+} reading;
+
 static const char *EXEC_NAME = "ntfscp";
 static struct options opts;
 static volatile sig_atomic_t caught_terminate = 0;
@@ -122,6 +158,8 @@ static void usage(void)
 {
 	ntfs_log_info("\nUsage: %s [options] device src_file dest_file\n\n"
 		"    -a, --attribute NUM   Write to this attribute\n"
+		"    -C, --compact FORMAT  Compress as xpress4k, xpress8k or "
+			"xpress16k\n"
 		"    -i, --inode           Treat dest_file as inode number\n"
 		"    -f, --force           Use less caution\n"
 		"    -h, --help            Print this help\n"
@@ -129,6 +167,7 @@ static void usage(void)
 		"    -N, --attr-name NAME  Write to attribute with this name\n"
 		"    -n, --no-action       Do not write to disk\n"
 		"    -q, --quiet           Less output\n"
+		"    -s, --sparse          Do not allocate zeroed clusters\n"
 		"    -V, --version         Version information\n"
 		"    -v, --verbose         More output\n\n",
 		EXEC_NAME);
@@ -146,9 +185,10 @@ static void usage(void)
  */
 static int parse_options(int argc, char **argv)
 {
-	static const char *sopt = "-a:ifh?mN:no:qVv";
+	static const char *sopt = "-a:C:ifh?mN:no:qsVv";
 	static const struct option lopt[] = {
 		{ "attribute",	required_argument,	NULL, 'a' },
+		{ "compact",	required_argument,	NULL, 'C' },
 		{ "inode",	no_argument,		NULL, 'i' },
 		{ "force",	no_argument,		NULL, 'f' },
 		{ "help",	no_argument,		NULL, 'h' },
@@ -156,6 +196,7 @@ static int parse_options(int argc, char **argv)
 		{ "attr-name",	required_argument,	NULL, 'N' },
 		{ "no-action",	no_argument,		NULL, 'n' },
 		{ "quiet",	no_argument,		NULL, 'q' },
+		{ "sparse",	no_argument,		NULL, 's' },
 		{ "version",	no_argument,		NULL, 'V' },
 		{ "verbose",	no_argument,		NULL, 'v' },
 		{ NULL,		0,			NULL, 0   }
@@ -175,6 +216,7 @@ static int parse_options(int argc, char **argv)
 	opts.attr_name = NULL;
 	opts.inode = 0;
 	opts.attribute = AT_DATA;
+	opts.compact = -1;
 
 	opterr = 0; /* We'll handle the errors, thank you. */
 
@@ -208,6 +250,19 @@ static int parse_options(int argc, char **argv)
 			} else
 				opts.attribute = (ATTR_TYPES)cpu_to_le32(attr);
 			break;
+		case 'C':
+			if (!strcmp(optarg, "xpress4k"))
+				opts.compact = SYSTEM_COMPRESSION_XPRESS4K;
+			else if (!strcmp(optarg, "xpress8k"))
+				opts.compact = SYSTEM_COMPRESSION_XPRESS8K;
+			else if (!strcmp(optarg, "xpress16k"))
+				opts.compact = SYSTEM_COMPRESSION_XPRESS16K;
+			else {
+				ntfs_log_error("Unsupported compression "
+						"format '%s'.\n", optarg);
+				err++;
+			}
+			break;
 		case 'i':
 			opts.inode++;
 			break;
@@ -235,6 +290,9 @@ static int parse_options(int argc, char **argv)
 			opts.quiet++;
 			ntfs_log_clear_levels(NTFS_LOG_LEVEL_QUIET);
 			break;
+		case 's':
+			opts.sparse++;
+			break;
 		case 'V':
 			ver++;
 			break;
@@ -284,6 +342,19 @@ static int parse_options(int argc, char **argv)
 					"at the same time.\n");
 			err++;
 		}
+
+		if ((opts.compact >= 0)
+		    && ((opts.attribute != AT_DATA) || opts.attr_name)) {
+			ntfs_log_error("Only the unnamed data stream can be "
+					"compacted.\n");
+			err++;
+		}
+
+		if (opts.sparse && opts.minfragments) {
+			ntfs_log_error("You may not use --sparse and "
+					"--min-fragments at the same time.\n");
+			err++;
+		}
 	}
 
 	if (ver)
@@ -646,6 +717,7 @@ static int assign_runlist(struct ALLOC_CONTEXT *alctx)
 	if (na->rl)
 		free(na->rl);
 	na->rl = alctx->rl;
+	ntfs_attr_forget_runs(na);
 			/* Allocate the clusters */
 	for (k=0; ((k + 1) < alctx->rl_count) && !err; k++) {
 		if (ntfs_bitmap_set_run(alctx->vol->lcnbmp_na,
@@ -819,6 +891,148 @@ static ntfs_inode *ntfs_new_file(ntfs_inode *dir_ni,
  * Return:  0  Success, the program worked
  *	    1  Error, something went wrong
  */
+/*
+ *		Read the next chunk of the source file into a buffer
+ */
+
+static void fill_buffer(struct COPY_BUFFER *cb)
+{
+	cb->count = fread(cb->data, 1, SOURCE_BUFFER_SIZE, reading.in);
+	cb->err = (ferror(reading.in) ? (errno ? errno : EIO) : 0);
+}
+
+#ifdef ENABLE_THREADS
+
+/*
+ *		Thread reading the source file ahead of the writes
+ */
+
+static void *read_thread(void *arg __attribute__((unused)))
+{
+	struct COPY_BUFFER *cb;
+	BOOL end;
+	int i;
+
+	i = 0;
+	end = FALSE;
+	pthread_mutex_lock(&reading.lock);
+	while (!end && !reading.stop) {
+		cb = &reading.buffers[i];
+		if (cb->filled)
+			pthread_cond_wait(&reading.cond, &reading.lock);
+		else {
+			pthread_mutex_unlock(&reading.lock);
+			fill_buffer(cb);
+			end = (cb->count < SOURCE_BUFFER_SIZE);
+			pthread_mutex_lock(&reading.lock);
+			cb->filled = TRUE;
+			pthread_cond_broadcast(&reading.cond);
+			i ^= 1;
+		}
+	}
+	pthread_mutex_unlock(&reading.lock);
+	return ((void*)NULL);
+}
+
+#endif
+
+/*
+ *		Allocate the copy buffers and start reading ahead
+ *
+ *	Returns 0 if successful, -1 if the buffers could not be allocated
+ */
+
+static int start_reading(FILE *in)
+{
+	int i;
+
+	memset(&reading, 0, sizeof(reading));
+	reading.in = in;
+	for (i=0; i<2; i++) {
+		reading.buffers[i].data = (char*)malloc(SOURCE_BUFFER_SIZE);
+		if (!reading.buffers[i].data) {
+			free(reading.buffers[0].data);
+			return (-1);
+		}
+	}
+#ifdef ENABLE_THREADS
+	if (!pthread_mutex_init(&reading.lock, NULL)) {
+		if (!pthread_cond_init(&reading.cond, NULL)) {
+			reading.threaded = !pthread_create(&reading.thread,
+						NULL, read_thread, NULL);
+			if (!reading.threaded)
+				pthread_cond_destroy(&reading.cond);
+		}
+		if (!reading.threaded)
+			pthread_mutex_destroy(&reading.lock);
+	}
+#endif
+	return (0);
+}
+
+/*
+ *		Get the next chunk of the source file
+ *
+ *	The chunk is read by the caller when there is no reading thread.
+ */
+
+static struct COPY_BUFFER *next_buffer(void)
+{
+	struct COPY_BUFFER *cb;
+
+	cb = &reading.buffers[reading.next];
+#ifdef ENABLE_THREADS
+	if (reading.threaded) {
+		pthread_mutex_lock(&reading.lock);
+		while (!cb->filled)
+			pthread_cond_wait(&reading.cond, &reading.lock);
+		pthread_mutex_unlock(&reading.lock);
+	} else
+		fill_buffer(cb);
+#else
+	fill_buffer(cb);
+#endif
+	return (cb);
+}
+
+/*
+ *		Give back a buffer which has been written, for reading ahead
+ */
+
+static void release_buffer(struct COPY_BUFFER *cb)
+{
+#ifdef ENABLE_THREADS
+	if (reading.threaded) {
+		pthread_mutex_lock(&reading.lock);
+		cb->filled = FALSE;
+		pthread_cond_broadcast(&reading.cond);
+		pthread_mutex_unlock(&reading.lock);
+	}
+#endif
+	reading.next ^= 1;
+}
+
+/*
+ *		Stop reading ahead and free the copy buffers
+ */
+
+static void stop_reading(void)
+{
+#ifdef ENABLE_THREADS
+	if (reading.threaded) {
+		pthread_mutex_lock(&reading.lock);
+		reading.stop = TRUE;
+		pthread_cond_broadcast(&reading.cond);
+		pthread_mutex_unlock(&reading.lock);
+		pthread_join(reading.thread, NULL);
+		pthread_cond_destroy(&reading.cond);
+		pthread_mutex_destroy(&reading.lock);
+	}
+#endif
+	free(reading.buffers[0].data);
+	free(reading.buffers[1].data);
+}
+
 int main(int argc, char *argv[])
 {
 	FILE *in;
@@ -830,7 +1044,7 @@ int main(int argc, char *argv[])
 	int result = 1;
 	s64 new_size;
 	u64 offset;
-	char *buf;
+	struct COPY_BUFFER *cb;
 	s64 br, bw;
 	ntfschar *attr_name;
 	int attr_name_len = 0;
@@ -872,6 +1086,8 @@ int main(int argc, char *argv[])
 		goto umount;
 
 	NVolSetCompression(vol); /* allow compression */
+	if (opts.sparse)
+		NVolSetSparseZeroDetect(vol); /* do not allocate zeroes */
 	if (ntfs_volume_get_free_space(vol)) {
 		ntfs_log_perror("ERROR: couldn't get free space");
 		goto umount;
@@ -1068,7 +1284,19 @@ int main(int argc, char *argv[])
 				" of a compressed attribute\n");
 		opts.minfragments = 0;
 		}
-	if (na->data_size && opts.minfragments) {
+	if (opts.sparse
+	    && ((na->type != AT_DATA)
+		|| (na->data_flags
+			& (ATTR_COMPRESSION_MASK | ATTR_IS_ENCRYPTED)))) {
+		ntfs_log_info("Warning : Cannot leave holes"
+				" in this attribute\n");
+		opts.sparse = 0;
+	}
+		/*
+		 * Former data must not be left in the clusters which
+		 * will now be holes.
+		 */
+	if (na->data_size && (opts.minfragments || opts.sparse)) {
 		if (ntfs_attr_truncate(na, 0)) {
 			ntfs_log_perror(
 				"ERROR: Couldn't truncate existing attribute");
@@ -1093,6 +1321,12 @@ int main(int argc, char *argv[])
 				    "ERROR: Couldn't preallocate attribute");
 				goto close_attr;
 			}
+		} else if (opts.sparse) {
+			if (ntfs_attr_truncate(na, new_size)) {
+				ntfs_log_perror(
+					"ERROR: Couldn't resize attribute");
+				goto close_attr;
+			}
 		} else {
 			if (ntfs_attr_truncate_solid(na, new_size)) {
 				ntfs_log_perror(
@@ -1102,40 +1336,51 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	buf = malloc(NTFS_BUF_SIZE);
-	if (!buf) {
+	if (start_reading(in)) {
 		ntfs_log_perror("ERROR: malloc failed");
 		goto close_attr;
 	}
 
 	ntfs_log_verbose("Starting write.\n");
 	offset = 0;
-	while (!feof(in)) {
+	do {
 		if (caught_terminate) {
 			ntfs_log_error("SIGTERM or SIGINT received.  "
 					"Aborting write.\n");
 			break;
 		}
-		br = fread(buf, 1, NTFS_BUF_SIZE, in);
-		if (!br) {
-			if (!feof(in)) ntfs_log_perror("ERROR: fread failed");
-			break;
+		cb = next_buffer();
+		br = cb->count;
+		if (br) {
+			bw = ntfs_attr_pwrite(na, offset, br, cb->data);
+			if (bw != br) {
+				ntfs_log_perror("ERROR: ntfs_attr_pwrite failed");
+				break;
+			}
+			offset += bw;
 		}
-		bw = ntfs_attr_pwrite(na, offset, br, buf);
-		if (bw != br) {
-			ntfs_log_perror("ERROR: ntfs_attr_pwrite failed");
-			break;
+		if (cb->err) {
+			errno = cb->err;
+			ntfs_log_perror("ERROR: fread failed");
 		}
-		offset += bw;
-	}
+		release_buffer(cb);
+	} while (br == SOURCE_BUFFER_SIZE);
+	stop_reading();
 	if ((na->data_flags & ATTR_COMPRESSION_MASK)
 	    && ntfs_attr_pclose(na))
 		ntfs_log_perror("ERROR: ntfs_attr_pclose failed");
 	ntfs_log_verbose("Syncing.\n");
 	result = 0;
-	free(buf);
 close_attr:
 	ntfs_attr_close(na);
+	if (!result && (opts.compact >= 0) && !opts.noaction
+	    && (offset == (u64)new_size)) {
+		ntfs_log_verbose("Compacting.\n");
+		if (ntfs_compress_system_file(out, opts.compact)) {
+			ntfs_log_perror("ERROR: Couldn't compact the file");
+			result = 1;
+		}
+	}
 close_dst:
 	while (ntfs_inode_close(out) && !opts.noaction) {
 		if (errno != EBUSY) {
@@ -54,6 +54,9 @@
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
 #include <gcrypt.h>
 #include <gnutls/pkcs12.h>
 
@@ -71,6 +74,9 @@ typedef gcry_sexp_t ntfs_rsa_private_key;
 
 #define NTFS_SHA1_THUMBPRINT_SIZE 0x14
 
+#define DECRYPT_CHUNK_SIZE 4194304 /* bytes read and decrypted at once */
+#define MAX_DECRYPT_THREADS 32
+
 #define NTFS_CRED_TYPE_CERT_THUMBPRINT const_cpu_to_le32(3)
 
 #define NTFS_EFS_CERT_PURPOSE_OID_DDF "1.3.6.1.4.1.311.10.3.4" /* decryption */
@@ -120,6 +126,9 @@ typedef struct {
 	u8 *key_data;
 	gcry_cipher_hd_t *des_gcry_cipher_hd_ptr;
 	ntfs_desx_ctx desx_ctx;
+	u32 key_size;
+	int gcry_algo;
+	int gcry_mode;
 } ntfs_fek;
 
 struct options {
@@ -132,6 +141,7 @@ struct options {
 	int quiet;		/* Less output */
 	int verbose;		/* Extra output */
 	int encrypt;		/* Encrypt */
+	int threads;		/* Threads decrypting in parallel */
 };
 
 static const char *EXEC_NAME = "ntfsdecrypt";
@@ -172,6 +182,7 @@ static void usage(void)
 	       "    -i, --inode num         Display this inode\n\n"
 	       "    -k  --keyfile name.pfx  Use file name as the user's private key file.\n"
 	       "    -e  --encrypt           Update an encrypted file\n"
+	       "    -t  --threads num       Decrypt with num threads\n"
 	       "    -f  --force             Use less caution\n"
 	       "    -h  --help              Print this help\n"
 	       "    -q  --quiet             Less output\n"
@@ -192,7 +203,7 @@ static void usage(void)
  */
 static int parse_options(int argc, char **argv)
 {
-	static const char *sopt = "-fh?ei:k:qVv";
+	static const char *sopt = "-fh?ei:k:qt:Vv";
 	static const struct option lopt[] = {
 		{"encrypt", no_argument, NULL, 'e'},
 		{"force", no_argument, NULL, 'f'},
@@ -200,6 +211,7 @@ static int parse_options(int argc, char **argv)
 		{"inode", required_argument, NULL, 'i'},
 		{"keyfile", required_argument, NULL, 'k'},
 		{"quiet", no_argument, NULL, 'q'},
+		{"threads", required_argument, NULL, 't'},
 		{"version", no_argument, NULL, 'V'},
 		{"verbose", no_argument, NULL, 'v'},
 		{NULL, 0, NULL, 0}
@@ -209,10 +221,19 @@ static int parse_options(int argc, char **argv)
 	int err = 0;
 	int ver = 0;
 	int help = 0;
+	char *endptr;
 
 	opterr = 0;		/* We'll handle the errors, thank you. */
 
 	opts.inode = -1;
+	opts.threads = 1;
+#if defined(ENABLE_THREADS) && defined(_SC_NPROCESSORS_ONLN)
+	opts.threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (opts.threads < 1)
+		opts.threads = 1;
+	if (opts.threads > MAX_DECRYPT_THREADS)
+		opts.threads = MAX_DECRYPT_THREADS;
+#endif
 
 	while ((c = getopt_long(argc, argv, sopt, lopt, NULL)) != -1) {
 		switch (c) {
@@ -259,6 +280,16 @@ static int parse_options(int argc, char **argv)
 			opts.quiet++;
 			ntfs_log_clear_levels(NTFS_LOG_LEVEL_QUIET);
 			break;
+		case 't':
+			opts.threads = strtol(optarg, &endptr, 10);
+			if (*endptr || (opts.threads < 1)
+			    || (opts.threads > MAX_DECRYPT_THREADS)) {
+				ntfs_log_error("The number of threads must "
+					"be in the range 1..%d.\n",
+					MAX_DECRYPT_THREADS);
+				err++;
+			}
+			break;
 		case 'V':
 			ver++;
 			break;
@@ -1039,6 +1070,67 @@ static inline BOOL ntfs_des_test(void)
 
 #endif /* !defined(DO_CRYPTO_TESTS) */
 
+/**
+ * ntfs_fek_open_cipher - open and key the cipher of an in-memory FEK
+ *
+ * The algorithm, mode and key must already be recorded in the FEK.
+ *
+ * Returns 0 if successful, or an error code.
+ */
+static int ntfs_fek_open_cipher(ntfs_fek *fek)
+{
+	ntfs_desx_ctx *ctx;
+	gcry_error_t err;
+
+	ctx = &fek->desx_ctx;
+	err = gcry_cipher_open(&fek->gcry_cipher_hd, fek->gcry_algo,
+				fek->gcry_mode, 0);
+
+	if (err != GPG_ERR_NO_ERROR) {
+		ntfs_log_error("gcry_cipher_open() failed: %s\n",
+				gcry_strerror(err));
+		return (EINVAL);
+	}
+	if (fek->alg_id == CALG_DESX) {
+		err = ntfs_desx_key_expand(fek->key_data, (u32*)ctx->des_key,
+				&ctx->out_whitening, &ctx->in_whitening);
+		if (err == GPG_ERR_NO_ERROR)
+			err = gcry_cipher_setkey(fek->gcry_cipher_hd,
+							ctx->des_key, 8);
+	} else {
+		err = gcry_cipher_setkey(fek->gcry_cipher_hd, fek->key_data,
+							fek->key_size);
+	}
+	if (err != GPG_ERR_NO_ERROR) {
+		ntfs_log_error("gcry_cipher_setkey() failed: %s\n",
+				gcry_strerror(err));
+		gcry_cipher_close(fek->gcry_cipher_hd);
+		return (EINVAL);
+	}
+	return (0);
+}
+
+/**
+ * ntfs_fek_alloc - allocate an in-memory FEK with room for its key
+ */
+static ntfs_fek *ntfs_fek_alloc(u32 key_size)
+{
+	ntfs_fek *fek;
+
+	fek = malloc(((((sizeof(*fek) + 7) & ~7) + key_size + 7) & ~7) +
+			sizeof(gcry_cipher_hd_t));
+	if (!fek) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	fek->key_size = key_size;
+	fek->key_data = (u8*)fek + ((sizeof(*fek) + 7) & ~7);
+	fek->des_gcry_cipher_hd_ptr = NULL;
+	*(gcry_cipher_hd_t***)(fek->key_data + ((key_size + 7) & ~7)) =
+			&fek->des_gcry_cipher_hd_ptr;
+	return fek;
+}
+
 /**
  * ntfs_fek_import_from_raw
  */
@@ -1048,7 +1140,6 @@ static ntfs_fek *ntfs_fek_import_from_raw(u8 *fek_buf, unsigned fek_size)
 	u32 key_size, wanted_key_size, gcry_algo;
 	int gcry_mode;
 	gcry_error_t err;
-	ntfs_desx_ctx *ctx;
 
 	key_size = le32_to_cpup((le32*) fek_buf);
 	ntfs_log_debug("key_size 0x%x\n", key_size);
@@ -1058,20 +1149,12 @@ static ntfs_fek *ntfs_fek_import_from_raw(u8 *fek_buf, unsigned fek_size)
 		errno = EINVAL;
 		return NULL;
 	}
-	fek = malloc(((((sizeof(*fek) + 7) & ~7) + key_size + 7) & ~7) +
-			sizeof(gcry_cipher_hd_t));
-	if (!fek) {
-		errno = ENOMEM;
+	fek = ntfs_fek_alloc(key_size);
+	if (!fek)
 		return NULL;
-	}
-	ctx = &fek->desx_ctx;
 	fek->alg_id = *(le32*)(fek_buf + 8);
 	//ntfs_log_debug("alg_id 0x%x\n", le32_to_cpu(fek->alg_id));
-	fek->key_data = (u8*)fek + ((sizeof(*fek) + 7) & ~7);
 	memcpy(fek->key_data, fek_buf + 16, key_size);
-	fek->des_gcry_cipher_hd_ptr = NULL;
-	*(gcry_cipher_hd_t***)(fek->key_data + ((key_size + 7) & ~7)) =
-			&fek->des_gcry_cipher_hd_ptr;
 	switch (fek->alg_id) {
 	case CALG_DESX:
 		wanted_key_size = 16;
@@ -1112,32 +1195,11 @@ static ntfs_fek *ntfs_fek_import_from_raw(u8 *fek_buf, unsigned fek_size)
 		err = EIO;
 		goto out;
 	}
-	err = gcry_cipher_open(&fek->gcry_cipher_hd, gcry_algo,
-				gcry_mode, 0);
-
-	if (err != GPG_ERR_NO_ERROR) {
-		ntfs_log_error("gcry_cipher_open() failed: %s\n",
-				gcry_strerror(err));
-		err = EINVAL;
-		goto out;
-	}
-	if (fek->alg_id == CALG_DESX) {
-		err = ntfs_desx_key_expand(fek->key_data, (u32*)ctx->des_key,
-				&ctx->out_whitening, &ctx->in_whitening);
-		if (err == GPG_ERR_NO_ERROR)
-			err = gcry_cipher_setkey(fek->gcry_cipher_hd,
-							ctx->des_key, 8);
-	} else {
-		err = gcry_cipher_setkey(fek->gcry_cipher_hd, fek->key_data,
-							key_size);
-	}
-	if (err != GPG_ERR_NO_ERROR) {
-		ntfs_log_error("gcry_cipher_setkey() failed: %s\n",
-				gcry_strerror(err));
-		gcry_cipher_close(fek->gcry_cipher_hd);
-		err = EINVAL;
+	fek->gcry_algo = gcry_algo;
+	fek->gcry_mode = gcry_mode;
+	err = ntfs_fek_open_cipher(fek);
+	if (err)
 		goto out;
-	}
 	return fek;
 out:
 	free(fek);
@@ -1145,6 +1207,33 @@ out:
 	return NULL;
 }
 
+/**
+ * ntfs_fek_clone - duplicate an in-memory FEK
+ *
+ * The copy has its own cipher handle and chaining state, so that
+ * the original and the copy may be used concurrently.
+ */
+static ntfs_fek *ntfs_fek_clone(const ntfs_fek *fek)
+{
+	ntfs_fek *clone;
+	int err;
+
+	clone = ntfs_fek_alloc(fek->key_size);
+	if (!clone)
+		return NULL;
+	clone->alg_id = fek->alg_id;
+	clone->gcry_algo = fek->gcry_algo;
+	clone->gcry_mode = fek->gcry_mode;
+	memcpy(clone->key_data, fek->key_data, fek->key_size);
+	err = ntfs_fek_open_cipher(clone);
+	if (err) {
+		free(clone);
+		errno = err;
+		return NULL;
+	}
+	return clone;
+}
+
 /**
  * ntfs_fek_release
  */
@@ -1355,30 +1444,214 @@ static int ntfs_fek_encrypt_sector(ntfs_fek *fek, u8 *data, const u64 offset)
 	return 512;
 }
 
+/**
+ * ntfs_fek_decrypt_sectors - Decrypt consecutive sectors
+ * @fek:	The file encryption key
+ * @data:	The sectors, decrypted in place
+ * @offset:	The offset of the first sector in the file
+ * @count:	The number of bytes, a multiple of the sector size
+ *
+ * Returns 0 if successful, or -1 if a sector could not be decrypted.
+ */
+static int ntfs_fek_decrypt_sectors(ntfs_fek *fek, u8 *data, u64 offset,
+		s64 count)
+{
+	s64 done;
+
+	for (done = 0; done < count; done += 512)
+		if (ntfs_fek_decrypt_sector(fek, &data[done],
+				offset + done) != 512) {
+			ntfs_log_error("Couldn't decrypt sector at offset "
+				"%lld\n", (long long)(offset + done));
+			return (-1);
+		}
+	return (0);
+}
+
+#ifdef ENABLE_THREADS
+
+/*
+ *		Parallel decryption
+ *
+ *	Every sector is decrypted independently from the others, its
+ *	IV only depends on its offset in the file, so a chunk is split
+ *	into slices decrypted by several threads, each of them having
+ *	its own copy of the FEK (a cipher handle cannot be shared).
+ *	The AES-NI instructions are used by libgcrypt when available.
+ *
+ *	Meanwhile a writer thread outputs the previous chunk, so that
+ *	reading, decrypting and writing overlap.
+ */
+
+struct DECRYPT_SLICE {
+	pthread_t thread;
+	ntfs_fek *fek;
+	u8 *data;
+	u64 offset;
+	s64 count;
+	int res;
+} ;
+
+struct DECRYPT_WRITER {
+	pthread_t thread;
+	const u8 *data;
+	s64 count;
+	int res;
+	BOOL busy;
+} ;
+
+static void *decrypt_slice_thread(void *arg)
+{
+	struct DECRYPT_SLICE *slice;
+
+	slice = (struct DECRYPT_SLICE*)arg;
+	slice->res = ntfs_fek_decrypt_sectors(slice->fek, slice->data,
+				slice->offset, slice->count);
+	return ((void*)NULL);
+}
+
+static void *decrypt_writer_thread(void *arg)
+{
+	struct DECRYPT_WRITER *writer;
+
+	writer = (struct DECRYPT_WRITER*)arg;
+	if (fwrite(writer->data, 1, writer->count, stdout)
+			!= (size_t)writer->count) {
+		ntfs_log_perror("ERROR: Couldn't output all data!");
+		writer->res = -1;
+	}
+	return ((void*)NULL);
+}
+
+/*
+ *		Decrypt a chunk, split into slices for the threads
+ *
+ *	The first slice is decrypted by the calling thread.
+ */
+
+static int decrypt_chunk(ntfs_fek **feks, int threads, u8 *data,
+		u64 offset, s64 count)
+{
+	struct DECRYPT_SLICE slices[MAX_DECRYPT_THREADS];
+	s64 slice_size;
+	s64 pos;
+	int started;
+	int res;
+	int i;
+
+	slice_size = ((count / threads) + 511) & ~511;
+	if (slice_size < 512)
+		slice_size = 512;
+	started = 0;
+	res = 0;
+	for (pos = slice_size, i = 1; (i < threads) && (pos < count);
+				pos += slice_size, i++) {
+		slices[i].fek = feks[i];
+		slices[i].data = &data[pos];
+		slices[i].offset = offset + pos;
+		slices[i].count = (count - pos < slice_size
+					? count - pos : slice_size);
+		slices[i].res = 0;
+		if (pthread_create(&slices[i].thread, (pthread_attr_t*)NULL,
+				decrypt_slice_thread, &slices[i])) {
+			/* decrypt the remainder in this thread */
+			res = ntfs_fek_decrypt_sectors(feks[0], &data[pos],
+					offset + pos, count - pos);
+			break;
+		}
+		started = i;
+	}
+	if (ntfs_fek_decrypt_sectors(feks[0], data, offset,
+			(count < slice_size ? count : slice_size)))
+		res = -1;
+	for (i = 1; i <= started; i++) {
+		pthread_join(slices[i].thread, (void**)NULL);
+		if (slices[i].res)
+			res = -1;
+	}
+	return (res);
+}
+
+/*
+ *		Wait for the writer to finish the previous chunk
+ */
+
+static int decrypt_writer_wait(struct DECRYPT_WRITER *writer)
+{
+	if (writer->busy) {
+		pthread_join(writer->thread, (void**)NULL);
+		writer->busy = FALSE;
+	}
+	return (writer->res);
+}
+
+#endif /* ENABLE_THREADS */
+
 /**
  * ntfs_cat_decrypt - Decrypt the contents of an encrypted file to stdout.
  * @inode:	An encrypted file's inode structure, as obtained by
  * 		ntfs_inode_open().
  * @fek:	A file encryption key. As obtained by ntfs_inode_fek_get().
+ *
+ * The file is read in large chunks, which ntfs_attr_pread() maps onto
+ * as few runs as possible, and when threads are available the sectors
+ * of a chunk are decrypted in parallel while the previous chunk is
+ * being written.
  */
 static int ntfs_cat_decrypt(ntfs_inode *inode, ntfs_fek *fek)
 {
-	int bufsize = 512;
+	s64 bufsize;
+	unsigned char *buffers[2];
 	unsigned char *buffer;
 	ntfs_attr *attr;
-	s64 bytes_read, written, offset, total;
+	s64 bytes_read, offset, total, wanted, chunk;
 	s64 old_data_size, old_initialized_size;
+	ntfs_fek *feks[MAX_DECRYPT_THREADS];
+	int threads;
+	int cur;
 	int i;
+#ifdef ENABLE_THREADS
+	struct DECRYPT_WRITER writer;
+#endif
 
-	buffer = malloc(bufsize);
-	if (!buffer)
-		return 1;
 	attr = ntfs_attr_open(inode, AT_DATA, NULL, 0);
 	if (!attr) {
 		ntfs_log_error("Cannot cat a directory.\n");
-		free(buffer);
 		return 1;
 	}
+	/* keep chunks aligned to clusters, so that runs are not split */
+	bufsize = DECRYPT_CHUNK_SIZE;
+	if (bufsize < inode->vol->cluster_size)
+		bufsize = inode->vol->cluster_size;
+	if (bufsize > attr->allocated_size)
+		bufsize = (attr->allocated_size + 511) & ~511;
+	if (!bufsize)
+		bufsize = 512;
+	buffers[0] = malloc(bufsize);
+	buffers[1] = malloc(bufsize);
+	if (!buffers[0] || !buffers[1]) {
+		free(buffers[0]);
+		free(buffers[1]);
+		ntfs_attr_close(attr);
+		return 1;
+	}
+	feks[0] = fek;
+	threads = 1;
+#ifdef ENABLE_THREADS
+	writer.busy = FALSE;
+	writer.res = 0;
+	if (bufsize >= 2*512) {
+		i = opts.threads;
+		if (i > bufsize/512)
+			i = bufsize/512;
+		while ((threads < i)
+		    && (feks[threads] = ntfs_fek_clone(fek)))
+			threads++;
+		if (threads < i)
+			ntfs_log_verbose("Decrypting with %d threads instead "
+					"of %d\n", threads, i);
+	}
+#endif
 	total = attr->data_size;
 
 	// hack: make sure attr will not be commited to disk if you use this.
@@ -1390,37 +1663,68 @@ static int ntfs_cat_decrypt(ntfs_inode *inode, ntfs_fek *fek)
 	attr->data_size = attr->initialized_size = attr->allocated_size;
 
 	offset = 0;
+	cur = 0;
 	while (total > 0) {
-		bytes_read = ntfs_attr_pread(attr, offset, 512, buffer);
+		buffer = buffers[cur];
+		wanted = (total + 511) & ~511;
+		if (wanted > bufsize)
+			wanted = bufsize;
+		bytes_read = ntfs_attr_pread(attr, offset, wanted, buffer);
 		if (bytes_read == -1) {
 			ntfs_log_perror("ERROR: Couldn't read file");
 			break;
 		}
 		if (!bytes_read)
 			break;
-		if ((i = ntfs_fek_decrypt_sector(fek, buffer, offset)) <
-				bytes_read) {
+		if (bytes_read & 511) {
+			errno = EIO;
 			ntfs_log_perror("ERROR: Couldn't decrypt all data!");
-			ntfs_log_error("%u/%lld/%lld/%lld\n", i,
+			ntfs_log_error("%lld/%lld/%lld\n",
 				(long long)bytes_read, (long long)offset,
 				(long long)total);
 			break;
 		}
-		if (bytes_read > total)
-			bytes_read = total;
-		written = fwrite(buffer, 1, bytes_read, stdout);
-		if (written != bytes_read) {
+#ifdef ENABLE_THREADS
+		if (decrypt_chunk(feks, threads, buffer, offset, bytes_read))
+			break;
+#else
+		if (ntfs_fek_decrypt_sectors(fek, buffer, offset, bytes_read))
+			break;
+#endif
+		chunk = (bytes_read > total ? total : bytes_read);
+#ifdef ENABLE_THREADS
+		if (decrypt_writer_wait(&writer))
+			break;
+		writer.data = buffer;
+		writer.count = chunk;
+		if (!pthread_create(&writer.thread, (pthread_attr_t*)NULL,
+				decrypt_writer_thread, &writer))
+			writer.busy = TRUE;
+		else
+			decrypt_writer_thread(&writer);
+		if (writer.res)
+			break;
+#else
+		if (fwrite(buffer, 1, chunk, stdout) != (size_t)chunk) {
 			ntfs_log_perror("ERROR: Couldn't output all data!");
 			break;
 		}
+#endif
 		offset += bytes_read;
-		total -= bytes_read;
+		total -= chunk;
+		cur = 1 - cur;
 	}
+#ifdef ENABLE_THREADS
+	decrypt_writer_wait(&writer);
+#endif
+	for (i = 1; i < threads; i++)
+		ntfs_fek_release(feks[i]);
 	attr->data_size = old_data_size;
 	attr->initialized_size = old_initialized_size;
 	NAttrSetEncrypted(attr);
 	ntfs_attr_close(attr);
-	free(buffer);
+	free(buffers[0]);
+	free(buffers[1]);
 	return 0;
 }
 
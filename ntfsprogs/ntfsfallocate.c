@@ -392,357 +392,13 @@ static void parse_options(int argc, char *argv[])
 				(unsigned int)attr_name_len);
 }
 
-/*
- *		Save the initial runlist, to be restored on error
- */
-
-static runlist_element *ntfs_save_rl(runlist_element *rl)
-{
-	runlist_element *save;
-	int n;
-
-	n = 0;
-	save = (runlist_element*)NULL;
-	if (rl) {
-		while (rl[n].length)
-			n++;
-		save = (runlist_element*)malloc((n + 1)*sizeof(runlist_element));
-		if (save) {
-			memcpy(save, rl, (n + 1)*sizeof(runlist_element));
-		}
-	}
-	return (save);
-}
-
-/*
- *		Free the common part of two runs
- */
-
-static void free_common(ntfs_volume *vol, runlist_element *brl, s64 blth,
-				runlist_element *grl, s64 glth)
-{
-	VCN begin_common;
-	VCN end_common;
-
-	begin_common = max(grl->vcn, brl->vcn);
-	end_common = min(grl->vcn + glth, brl->vcn + blth);
-	if (end_common > begin_common) {
-		if (ntfs_bitmap_clear_run(vol->lcnbmp_na,
-			brl->lcn + begin_common - brl->vcn,
-					end_common - begin_common))
-			ntfs_log_error("Failed to free %lld clusters "
-				"from 0x%llx\n",
-				(long long)end_common - begin_common,
-				(long long)(brl->lcn + begin_common
-							- brl->vcn));
-	}
-}
-
-/*
- *		Restore the cluster allocations to initial state
- *
- *	If a new error occurs, only output a message
- */
-
-static void ntfs_restore_rl(ntfs_attr *na, runlist_element *oldrl)
-{
-	runlist_element *brl; /* Pointer to bad runlist */
-	runlist_element *grl; /* Pointer to good runlist */
-	ntfs_volume *vol;
-
-	vol = na->ni->vol;
-		/* Examine allocated entries from the bad runlist */
-	for (brl=na->rl; brl->length; brl++) {
-		if (brl->lcn != LCN_HOLE) {
-// TODO improve by examining both list in parallel
-		/* Find the holes in the good runlist which overlap */
-			for (grl=oldrl; grl->length
-			   && (grl->vcn<=(brl->vcn+brl->length)); grl++) {
-				if (grl->lcn == LCN_HOLE) {
-					free_common(vol, brl, brl->length, grl,
-						grl->length);
-				}
-			}
-			/* Free allocations beyond the end of good runlist */
-			if (grl && !grl->length
-			    && ((brl->vcn + brl->length) > grl->vcn)) {
-				free_common(vol, brl, brl->length, grl,
-					brl->vcn + brl->length - grl->vcn);
-			}
-		}
-	}
-	free(na->rl);
-	na->rl = oldrl;
-	if (ntfs_attr_update_mapping_pairs(na, 0)) {
-		ntfs_log_error("Failed to restore the original runlist\n");
-	}
-}
-
-/*
- *		Zero newly allocated runs up to initialized_size
- */
-
-static int ntfs_inner_zero(ntfs_attr *na, runlist_element *rl)
-{
-	ntfs_volume *vol;
-	char *buf;
-	runlist_element *zrl;
-	s64 cofs;
-	s64 pos;
-	s64 zeroed;
-	int err;
-
-	err = 0;
-	vol = na->ni->vol;
-	buf = (char*)malloc(vol->cluster_size);
-	if (buf) {
-		memset(buf, 0, vol->cluster_size);
-		zrl = rl;
-		pos = zrl->vcn << vol->cluster_size_bits;
-		while (zrl->length
-	 	    && !err
-	    	    && (pos < na->initialized_size)) {
-			for (cofs=0; cofs<zrl->length && !err; cofs++) {
-				zeroed = ntfs_pwrite(vol->dev,
-					(rl->lcn + cofs)
-						<< vol->cluster_size_bits,
-					vol->cluster_size, buf);
-				if (zeroed != vol->cluster_size) {
-					ntfs_log_error("Failed to zero at "
-						"offset %lld\n",
-						(long long)pos);
-					errno = EIO;
-					err = -1;
-				}
-				pos += vol->cluster_size;
-			}
-			zrl++;
-			pos = zrl->vcn << vol->cluster_size_bits;
-		}
-		free(buf);
-	} else {
-		ntfs_log_error("Failed to allocate memory\n");
-		errno = ENOSPC;
-		err = -1;
-	}
-	return (err);
-}
-
-/*
- *		Merge newly allocated runs into runlist
- */
-
-static int ntfs_merge_allocation(ntfs_attr *na, runlist_element *rl,
-				s64 size)
-{
-	ntfs_volume *vol;
-	int err;
-
-	err = 0;
-	vol = na->ni->vol;
-	/* Newly allocated clusters before initialized size need be zeroed */
-	if ((rl->vcn << vol->cluster_size_bits) < na->initialized_size) {
-		err = ntfs_inner_zero(na, rl);
-	}
-	if (!err) {
-		if (na->data_flags & ATTR_IS_SPARSE) {
-			na->compressed_size += size;
-			if (na->compressed_size >= na->allocated_size) {
-				na->data_flags &= ~ATTR_IS_SPARSE;
-				if (na->compressed_size > na->allocated_size) {
-					ntfs_log_error("File size error : "
-						"apparent %lld, "
-						"compressed %lld > "
-						"allocated %lld",
-						(long long)na->data_size,
-						(long long)na->compressed_size,
-						(long long)na->allocated_size);
-					errno = EIO;
-					err = -1;
-				}
-			}
-		}
-	}
-	if (!err) {
-		rl = ntfs_runlists_merge(na->rl, rl);
-		if (!rl) {
-			ntfs_log_error("Failed to merge the new allocation\n");
-			err = -1;
-		} else {
-			na->rl = rl;
-				/* Update the runlist */
-			if (ntfs_attr_update_mapping_pairs(na, 0)) {
-				ntfs_log_error(
-					"Failed to update the runlist\n");
-				err = -1;
-			}
-		}
-	}
-	return (err);
-}
-
-static int ntfs_inner_allocation(ntfs_attr *na, s64 alloc_offs, s64 alloc_len)
-{
-	ntfs_volume *vol;
-	runlist_element *rl;
-	runlist_element *prl;
-	runlist_element *rlc;
-	VCN from_vcn;
-	VCN end_vcn;
-	LCN lcn_seek_from;
-	VCN from_hole;
-	VCN end_hole;
-	s64 need;
-	int err;
-	BOOL done;
-
-	err = 0;
-	vol = na->ni->vol;
-		/* Find holes which overlap the requested allocation */
-	from_vcn = alloc_offs >> vol->cluster_size_bits;
-	end_vcn = (alloc_offs + alloc_len + vol->cluster_size - 1)
-			>> vol->cluster_size_bits;
-	do {
-		done = FALSE;
-		rl = na->rl;
-		while (rl->length
-		    && ((rl->lcn >= 0)
-		    	|| ((rl->vcn + rl->length) <= from_vcn)
-			|| (rl->vcn >= end_vcn)))
-				rl++;
-		if (!rl->length)
-			done = TRUE;
-		else {
-			from_hole = max(from_vcn, rl->vcn);
-			end_hole = min(end_vcn, rl->vcn + rl->length);
-			need = end_hole - from_hole;
-			lcn_seek_from = -1;
-			if (rl->vcn) {
-					/* Avoid fragmentation when possible */
-				prl = rl;
-				if ((--prl)->lcn >= 0) {
-					lcn_seek_from = prl->lcn
-						+ from_hole - prl->vcn;
-				}
-			}
-			if (need <= 0) {
-				ntfs_log_error("Wrong hole size %lld\n",
-							(long long)need);
-				errno = EIO;
-				err = -1;
-			} else {
-				rlc = ntfs_cluster_alloc(vol, from_hole, need,
-					 lcn_seek_from, DATA_ZONE);
-				if (!rlc)
-					err = -1;
-				else
-					err = ntfs_merge_allocation(na, rlc,
-						need << vol->cluster_size_bits);
-			}
-		}
-	} while (!err && !done);
-	return (err);
-}
-
-static int ntfs_full_allocation(ntfs_attr *na, ntfs_attr_search_ctx *ctx,
-				s64 alloc_offs, s64 alloc_len)
-{
-	ATTR_RECORD *attr;
-	ntfs_inode *ni;
-	s64 initialized_size;
-	s64 data_size;
-	int err;
-
-	err = 0;
-	initialized_size = na->initialized_size;
-	data_size = na->data_size;
-
-	if (na->allocated_size <= alloc_offs) {
-		/*
-		 * Request is fully beyond what was already allocated :
-		 * only need to expand the attribute
-		 */
-		err = ntfs_attr_truncate(na, alloc_offs);
-		if (!err)
-			err = ntfs_attr_truncate_solid(na,
-						alloc_offs + alloc_len);
-	} else {
-		/*
-		 * Request overlaps what was already allocated :
-		 * We may have to fill existing holes, and force zeroes
-		 * into clusters which are visible.
-		 */
-		if ((alloc_offs + alloc_len) > na->allocated_size)
-			err = ntfs_attr_truncate(na, alloc_offs + alloc_len);
-		if (!err)
-			err = ntfs_inner_allocation(na, alloc_offs, alloc_len);
-	}
-		/* Set the sizes, even after an error, to keep consistency */
-	na->initialized_size = initialized_size;
-		/* Restore the original apparent size if requested or error */
-	if (err || opts.no_size_change
-	    || ((alloc_offs + alloc_len) < data_size))
-		na->data_size = data_size;
-	else {
-		/*
-		 * "man 1 fallocate" does not define the new apparent size
-		 * when size change is allowed (no --keep-size).
-		 * Assuming the same as no FALLOC_FL_KEEP_SIZE in fallocate(2) :
-		 * "the file size will be changed if offset + len is greater
-		 * than the  file  size"
-// TODO check the behavior of another file system
-		 */
-		na->data_size = alloc_offs + alloc_len;
-	}
-
-	if (!err) {
-	/* Find the attribute, which may have been relocated for allocations */
-		if (ntfs_attr_lookup(attr_type, attr_name, attr_name_len,
-					CASE_SENSITIVE, 0, NULL, 0, ctx)) {
-			err = -1;
-			ntfs_log_error("Failed to locate the attribute\n");
-		} else {
-				/* Feed the sizes into the attribute */
-			attr = ctx->attr;
-			attr->data_size = cpu_to_sle64(na->data_size);
-			attr->initialized_size
-				= cpu_to_sle64(na->initialized_size);
-			attr->allocated_size
-				= cpu_to_sle64(na->allocated_size);
-			if (na->data_flags & ATTR_IS_SPARSE)
-				attr->compressed_size
-					= cpu_to_sle64(na->compressed_size);
-			/* Copy the unnamed data attribute sizes to inode */
-			if ((attr_type == AT_DATA) && !attr_name_len) {
-				ni = na->ni;
-				ni->data_size = na->data_size;
-				if (na->data_flags & ATTR_IS_SPARSE) {
-					ni->allocated_size
-						= na->compressed_size;
-					ni->flags |= FILE_ATTR_SPARSE_FILE;
-				} else
-					ni->allocated_size
-						= na->allocated_size;
-			}
-		}
-	}
-	return (err);
-}
-
-
 /*
  *		Do the actual allocations
  */
 
 static int ntfs_fallocate(ntfs_inode *ni, s64 alloc_offs, s64 alloc_len)
 {
-	s64 allocated_size;
-	s64 data_size;
-	ntfs_attr_search_ctx *ctx;
 	ntfs_attr *na;
-	runlist_element *oldrl;
-	const char *errmess;
-	int save_errno;
 	int err;
 
 	err = 0;
@@ -753,46 +409,14 @@ static int ntfs_fallocate(ntfs_inode *ni, s64 alloc_offs, s64 alloc_len)
 				(unsigned long)le32_to_cpu(attr_type));
 		err = -1;
 	} else {
-		errmess = (const char*)NULL;
 		if (na->data_flags & ATTR_IS_COMPRESSED) {
-			errmess= "Cannot fallocate a compressed file";
-		}
-
-		/* Locate the attribute record, needed for updating sizes */
-		ctx = ntfs_attr_get_search_ctx(ni, NULL);
-		if (!ctx) {
-			errmess = "Failed to allocate a search context";
-		}
-		if (errmess) {
-			ntfs_log_error("%s\n",errmess);
+			ntfs_log_error("Cannot fallocate a compressed file\n");
 			err = -1;
 		} else {
-			/* Get and save the initial allocations */
-			allocated_size = na->allocated_size;
-			data_size = ni->data_size;
-			err = ntfs_attr_map_whole_runlist(na);
-			if (!err) {
-				oldrl = ntfs_save_rl(na->rl);
-				if (oldrl) {
-					err = ntfs_full_allocation(na, ctx,
-							alloc_offs, alloc_len);
-					if (err) {
-						save_errno = errno;
-						ni->allocated_size
-							= allocated_size;
-						ni->data_size = data_size;
-						ntfs_restore_rl(na, oldrl);
-						errno = save_errno;
-					} else {
-						free(oldrl);
-	/* Mark file name dirty, to update the sizes in directories */
-						NInoFileNameSetDirty(ni);
-						NInoSetDirty(ni);
-					}
-				} else
-					err = -1;
-			}
-			ntfs_attr_put_search_ctx(ctx);
+			err = ntfs_attr_fallocate(na, alloc_offs, alloc_len,
+						opts.no_size_change);
+			if (err)
+				ntfs_log_perror("Failed to allocate");
 		}
 		/* Close the attribute. */
 		ntfs_attr_close(na);
@@ -403,14 +403,47 @@ static int clear_badclus(ntfs_volume *vol)
 	return (ok ? 0 : -1);
 }
 
+/*
+ *		Write a run of corrected records to $MFT and $MFTMirr
+ *
+ *	The run is written by a single request to each of them.
+ */
+static int write_mftmirr_run(ntfs_volume *vol, s64 first, s64 count,
+			u8 *m)
+{
+	int res;
+
+	if (count == 1)
+		ntfs_log_info("Correcting differences in record %lld... ",
+				(long long)first);
+	else
+		ntfs_log_info("Correcting differences in records %lld to "
+				"%lld... ", (long long)first,
+				(long long)(first + count - 1));
+	res = ntfs_mft_records_write(vol, first, count,
+			(MFT_RECORD*)(m + (first << vol->mft_record_size_bits)));
+	if (res) {
+		ntfs_log_info(FAILED);
+		ntfs_log_perror("Error correcting $MFT and $MFTMirr");
+	} else
+		ntfs_log_info(OK);
+	return (res);
+}
+
 /**
  * fix_mftmirr
+ *
+ * Both $MFT and $MFTMirr are read by a single request, the records
+ * are compared in memory, and the corrected ones are written back by
+ * runs of consecutive records.
  */
 static int fix_mftmirr(ntfs_volume *vol)
 {
-	s64 l, br;
+	s64 l;
 	unsigned char *m, *m2;
 	int i, ret = -1; /* failure */
+	int first;
+	BOOL identical;
 	BOOL done;
 
 	ntfs_log_info("\nProcessing $MFT and $MFTMirr...\n");
@@ -466,6 +499,10 @@ static int fix_mftmirr(ntfs_volume *vol)
 
 	ntfs_log_info("Comparing $MFTMirr to $MFT... ");
 	done = FALSE;
+		/* the usual case : both copies are identical */
+	identical = !memcmp(m, m2,
+			vol->mftmirr_size << vol->mft_record_size_bits);
+	first = -1;
 	for (i = 0; i < vol->mftmirr_size; ++i) {
 		MFT_RECORD *mrec, *mrec2;
 		const char *ESTR[12] = { "$MFT", "$MFTMirr", "$LogFile",
@@ -520,25 +557,32 @@ static int fix_mftmirr(ntfs_volume *vol)
 					!ntfs_is_mft_record(mrec->magic))
 				use_mirr = TRUE;
 		}
-		if (memcmp(mrec, mrec2, ntfs_mft_record_get_data_size(mrec))) {
+		if (identical
+		    || !memcmp(mrec, mrec2,
+				ntfs_mft_record_get_data_size(mrec))) {
+				/* end of a run of differences */
+			if ((first >= 0)
+			    && write_mftmirr_run(vol, first, i - first, m))
+				goto error_exit;
+			first = -1;
+		} else {
 			if (!done) {
 				done = TRUE;
 				ntfs_log_info(FAILED);
 			}
-			ntfs_log_info("Correcting differences in $MFT%s "
-					"record %d...", use_mirr ? "" : "Mirr",
-					i);
-			br = ntfs_mft_record_write(vol, i,
-					use_mirr ? mrec2 : mrec);
-			if (br) {
-				ntfs_log_info(FAILED);
-				ntfs_log_perror("Error correcting $MFT%s",
-						use_mirr ? "" : "Mirr");
-				goto error_exit;
-			}
-			ntfs_log_info(OK);
+			if (first < 0)
+				first = i;
+			ntfs_log_info("Found differences in $MFT%s "
+					"record %d (%s)\n",
+					use_mirr ? "" : "Mirr", i, s);
+				/* both copies are written from $MFT buffer */
+			if (use_mirr)
+				memcpy(mrec, mrec2, vol->mft_record_size);
 		}
 	}
+	if ((first >= 0)
+	    && write_mftmirr_run(vol, first, vol->mftmirr_size - first, m))
+		goto error_exit;
 	if (!done)
 		ntfs_log_info(OK);
 	ntfs_log_info("Processing of $MFT and $MFTMirr completed "
@@ -682,7 +726,7 @@ static int fix_upcase(ntfs_volume *vol)
 		}
 	} else {
 			/* accept the upcase table read from $UpCase */
-		free(vol->upcase);
+		ntfs_case_table_release(vol->upcase);
 		vol->upcase = upcase;
 		vol->upcase_len = upcase_len;
 		res = 0;
@@ -77,6 +77,8 @@
 #include "security.h"
 #include "mst.h"
 #include "dir.h"
+#include "reparse.h"
+#include "object_id.h"
 #include "ntfstime.h"
 /* #include "version.h" */
 #include "support.h"
@@ -93,6 +95,10 @@ static struct options {
 	int	 force;		/* Override common sense */
 	int	 notime;	/* Don't report timestamps at all */
 	int	 mft;		/* Dump information about the volume as well */
+	int	 reparse;	/* List the reparse points of the volume */
+	int	 objid;		/* List the object ids of the volume */
+	int	 all;		/* List all the inodes of the volume */
+	const char *format;	/* Format of the list of all inodes */
 } opts;
 
 struct RUNCOUNT {
@@ -136,6 +142,10 @@ static void usage(void)
 		"    -i, --inode NUM  Display information about this inode\n"
 		"    -F, --file FILE  Display information about this file (absolute path)\n"
 		"    -m, --mft        Dump information about the volume\n"
+		"    -r, --reparse    List the reparse points of the volume\n"
+		"    -o, --objid      List the object ids of the volume\n"
+		"    -a, --all        List all the inodes of the volume\n"
+		"        --format FMT Format of the list of all inodes (jsonl)\n"
 		"    -t, --notime     Don't report timestamps\n"
 		"\n"
 		"    -f, --force      Use less caution\n"
@@ -159,7 +169,7 @@ static void usage(void)
  */
 static int parse_options(int argc, char *argv[])
 {
-	static const char *sopt = "-:dfhi:F:mqtTvV";
+	static const char *sopt = "-:adfhi:F:moqrtTvV";
 	static const struct option lopt[] = {
 		{ "force",	 no_argument,		NULL, 'f' },
 		{ "help",	 no_argument,		NULL, 'h' },
@@ -170,6 +180,10 @@ static int parse_options(int argc, char *argv[])
 		{ "version",	 no_argument,		NULL, 'V' },
 		{ "notime",	 no_argument,		NULL, 'T' },
 		{ "mft",	 no_argument,		NULL, 'm' },
+		{ "reparse",	 no_argument,		NULL, 'r' },
+		{ "objid",	 no_argument,		NULL, 'o' },
+		{ "all",	 no_argument,		NULL, 'a' },
+		{ "format",	 required_argument,	NULL, 'O' },
 		{ NULL,		 0,			NULL,  0  }
 	};
 
@@ -237,6 +251,18 @@ static int parse_options(int argc, char *argv[])
 		case 'm':
 			opts.mft++;
 			break;
+		case 'r':
+			opts.reparse++;
+			break;
+		case 'o':
+			opts.objid++;
+			break;
+		case 'a':
+			opts.all++;
+			break;
+		case 'O':
+			opts.format = optarg;
+			break;
 		case '?':
 			if (optopt=='?') {
 				help++;
@@ -277,7 +303,8 @@ static int parse_options(int argc, char *argv[])
 			err++;
 		}
 
-		if (opts.inode == -1 && !opts.filename && !opts.mft) {
+		if (opts.inode == -1 && !opts.filename && !opts.mft
+		    && !opts.reparse && !opts.objid && !opts.all) {
 			if (argc > 1)
 				ntfs_log_error("You must specify an inode to "
 					"learn about.\n");
@@ -290,6 +317,12 @@ static int parse_options(int argc, char *argv[])
 			err++;
 		}
 
+		if (opts.format && strcmp(opts.format, "jsonl")) {
+			ntfs_log_error("The only format supported is "
+				"jsonl.\n");
+			err++;
+		}
+
 		if ((opts.inode != -1) && (opts.filename != NULL)) {
 			if (argc > 1)
 				ntfs_log_error("You may not specify --inode "
@@ -426,6 +459,379 @@ static const char *reparse_type_name(le32 tag)
 }
 
 /* *************** functions for dumping global info ******************** */
+/**
+ * ntfs_list_reparse_points - list the reparse points of the volume
+ *
+ * The $Extend/$Reparse index is scanned, rather than every inode.
+ */
+static void ntfs_list_reparse_points(ntfs_volume *vol)
+{
+	struct REPARSE_SCAN *rs;
+	u64 mref;
+	le32 tag;
+
+	rs = ntfs_reparse_scan_start(vol);
+	if (!rs) {
+		ntfs_log_perror("Failed to list the reparse points");
+		return;
+	}
+	while (ntfs_reparse_scan_next(rs, &mref, &tag))
+		printf("%llu\t0x%08lx%s\n", (unsigned long long)MREF(mref),
+				(long)le32_to_cpu(tag), reparse_type_name(tag));
+	if (ntfs_reparse_scan_end(rs))
+		ntfs_log_perror("Some reparse points could not be listed");
+}
+
+/**
+ * ntfs_list_object_ids - list the object ids of the volume
+ *
+ * The $Extend/$ObjId index is scanned, rather than every inode.
+ */
+static void ntfs_list_object_ids(ntfs_volume *vol)
+{
+	struct OBJECT_ID_SCAN *os;
+	char printable_GUID[37];
+	u64 mref;
+	GUID object_id;
+
+	os = ntfs_object_id_scan_start(vol);
+	if (!os) {
+		ntfs_log_perror("Failed to list the object ids");
+		return;
+	}
+	while (ntfs_object_id_scan_next(os, &mref, &object_id)) {
+		ntfs_guid_to_mbs(&object_id, printable_GUID);
+		printf("%llu\t%s\n", (unsigned long long)MREF(mref),
+				printable_GUID);
+	}
+	if (ntfs_object_id_scan_end(os))
+		ntfs_log_perror("Some object ids could not be listed");
+}
+
+/*
+ *		State of the listing of an inode
+ *
+ *	The attributes are walked in their order, so the ones of the same
+ *	type are consecutive and are listed as the items of an array, and
+ *	the extents of a stream are consecutive and their runs are listed
+ *	in the same stream item.
+ */
+
+struct LIST_STATE {
+	ntfs_volume *vol;
+	u64 inum;
+	ATTR_TYPES array;	/* type of the items in the open array */
+	int count;		/* items in the open array */
+	int runs;		/* runs in the open stream, -1 if none */
+} ;
+
+/**
+ * ntfs_list_string - print a name as a json string
+ *
+ * Names which cannot be translated are printed as null.
+ */
+static void ntfs_list_string(const ntfschar *uname, int uname_len)
+{
+	char *name = NULL;
+	const unsigned char *p;
+
+	if (ntfs_ucstombs(uname, uname_len, &name, 0) < 0) {
+		printf("null");
+		return;
+	}
+	putchar('"');
+	for (p=(const unsigned char*)name; p && *p; p++) {
+		if ((*p == '"') || (*p == '\\'))
+			printf("\\%c", *p);
+		else
+			if (*p < 0x20)
+				printf("\\u%04x", *p);
+			else
+				putchar(*p);
+	}
+	putchar('"');
+	free(name);
+}
+
+static void ntfs_list_close_array(struct LIST_STATE *state)
+{
+	if (state->runs >= 0) {
+		printf("]}");
+		state->runs = -1;
+	}
+	if (state->array) {
+		printf("]");
+		state->array = const_cpu_to_le32(0);
+	}
+}
+
+static void ntfs_list_open_item(struct LIST_STATE *state, ATTR_TYPES type,
+			const char *key)
+{
+	if (state->array != type) {
+		ntfs_list_close_array(state);
+		printf(",\"%s\":[", key);
+		state->array = type;
+		state->count = 0;
+	} else
+		if (state->runs >= 0) {
+			printf("]}");
+			state->runs = -1;
+		}
+	if (state->count++)
+		printf(",");
+}
+
+static void ntfs_list_standard_information(struct LIST_STATE *state,
+			ATTR_RECORD *attr)
+{
+	STANDARD_INFORMATION *si;
+	u32 value_length;
+
+	if (attr->non_resident)
+		return;
+	ntfs_list_close_array(state);
+	si = (STANDARD_INFORMATION*)((char*)attr
+			+ le16_to_cpu(attr->value_offset));
+	value_length = le32_to_cpu(attr->value_length);
+	if (value_length < offsetof(STANDARD_INFORMATION, v1_end))
+		return;
+	if (!opts.notime)
+		printf(",\"created\":%lld,\"modified\":%lld,"
+			"\"changed\":%lld,\"accessed\":%lld",
+			(long long)sle64_to_cpu(si->creation_time),
+			(long long)sle64_to_cpu(si->last_data_change_time),
+			(long long)sle64_to_cpu(si->last_mft_change_time),
+			(long long)sle64_to_cpu(si->last_access_time));
+	printf(",\"attributes\":%lu",
+			(unsigned long)le32_to_cpu(si->file_attributes));
+	if (value_length >= offsetof(STANDARD_INFORMATION, v3_end))
+		printf(",\"security_id\":%lu",
+			(unsigned long)le32_to_cpu(si->security_id));
+}
+
+static void ntfs_list_file_name(struct LIST_STATE *state, ATTR_RECORD *attr)
+{
+	FILE_NAME_ATTR *fn;
+
+	if (attr->non_resident)
+		return;
+	fn = (FILE_NAME_ATTR*)((char*)attr + le16_to_cpu(attr->value_offset));
+	ntfs_list_open_item(state, AT_FILE_NAME, "names");
+	printf("{\"parent\":%llu,\"name\":",
+			(unsigned long long)MREF_LE(fn->parent_directory));
+	ntfs_list_string((const ntfschar*)((const char*)fn
+				+ offsetof(FILE_NAME_ATTR, file_name)),
+			fn->file_name_length);
+	printf(",\"namespace\":%d}", (int)fn->file_name_type);
+}
+
+/**
+ * ntfs_list_runs - print the runs of an extent of a stream
+ *
+ * Each run is printed as [vcn,lcn,length], the lcn of a hole being -1.
+ */
+static void ntfs_list_runs(struct LIST_STATE *state, ATTR_RECORD *attr)
+{
+	runlist_element *rl;
+	int i;
+
+	rl = ntfs_mapping_pairs_decompress(state->vol, attr, NULL);
+	if (!rl) {
+		ntfs_log_perror("Could not decode the runs of inode %llu",
+				(unsigned long long)state->inum);
+		return;
+	}
+	for (i=0; rl[i].length; i++)
+		if ((rl[i].lcn >= 0) || (rl[i].lcn == LCN_HOLE))
+			printf("%s[%lld,%lld,%lld]",
+				(state->runs++ ? "," : ""),
+				(long long)rl[i].vcn,
+				(long long)(rl[i].lcn >= 0 ? rl[i].lcn : -1),
+				(long long)rl[i].length);
+	free(rl);
+}
+
+static void ntfs_list_data(struct LIST_STATE *state, ATTR_RECORD *attr)
+{
+	if (attr->non_resident && sle64_to_cpu(attr->lowest_vcn)) {
+		/* next extent of the open stream */
+		if ((state->array == AT_DATA) && (state->runs >= 0))
+			ntfs_list_runs(state, attr);
+		return;
+	}
+	ntfs_list_open_item(state, AT_DATA, "streams");
+	printf("{\"name\":");
+	if (attr->name_length)
+		ntfs_list_string((ntfschar*)((char*)attr
+				+ le16_to_cpu(attr->name_offset)),
+				attr->name_length);
+	else
+		printf("\"\"");
+	if (attr->non_resident) {
+		printf(",\"size\":%lld,\"allocated\":%lld,"
+			"\"initialized\":%lld,\"flags\":%u,\"runs\":[",
+			(long long)sle64_to_cpu(attr->data_size),
+			(long long)sle64_to_cpu(attr->allocated_size),
+			(long long)sle64_to_cpu(attr->initialized_size),
+			(unsigned int)le16_to_cpu(attr->flags));
+		state->runs = 0;
+		ntfs_list_runs(state, attr);
+	} else
+		printf(",\"size\":%lu,\"resident\":true}",
+			(unsigned long)le32_to_cpu(attr->value_length));
+}
+
+static void ntfs_list_reparse_tag(struct LIST_STATE *state,
+			ATTR_RECORD *attr)
+{
+	REPARSE_POINT *rp;
+	ntfs_inode *ni;
+	ntfs_attr *na;
+	le32 tag;
+
+	ntfs_list_close_array(state);
+	if (attr->non_resident) {
+		/* rare enough to read it through the inode */
+		tag = const_cpu_to_le32(0);
+		ni = ntfs_inode_open(state->vol, (MFT_REF)state->inum);
+		if (ni) {
+			na = ntfs_attr_open(ni, AT_REPARSE_POINT, AT_UNNAMED, 0);
+			if (na) {
+				if (ntfs_attr_pread(na, 0, sizeof(tag), &tag)
+						!= sizeof(tag))
+					tag = const_cpu_to_le32(0);
+				ntfs_attr_close(na);
+			}
+			ntfs_inode_close(ni);
+		}
+	} else {
+		if (le32_to_cpu(attr->value_length) < sizeof(tag))
+			return;
+		rp = (REPARSE_POINT*)((char*)attr
+				+ le16_to_cpu(attr->value_offset));
+		tag = rp->reparse_tag;
+	}
+	if (tag)
+		printf(",\"reparse_tag\":%lu", (unsigned long)le32_to_cpu(tag));
+}
+
+/**
+ * ntfs_list_has_attribute_list - check whether a record has extensions
+ */
+static BOOL ntfs_list_has_attribute_list(ntfs_volume *vol, MFT_RECORD *mrec)
+{
+	ATTR_RECORD *attr;
+	u32 offset;
+	u32 length;
+
+	offset = le16_to_cpu(mrec->attrs_offset);
+	attr = (ATTR_RECORD*)((char*)mrec + offset);
+	while (((offset + 8) <= vol->mft_record_size)
+	    && (attr->type != AT_END)
+	    && (le32_to_cpu(attr->type) <= le32_to_cpu(AT_ATTRIBUTE_LIST))) {
+		if (attr->type == AT_ATTRIBUTE_LIST)
+			return (TRUE);
+		length = le32_to_cpu(attr->length);
+		if (!length)
+			break;
+		offset += length;
+		attr = (ATTR_RECORD*)((char*)attr + length);
+	}
+	return (FALSE);
+}
+
+/**
+ * ntfs_list_inode - print the description of an inode as a json line
+ *
+ * The attributes are walked in the record returned by the scan, or
+ * through the inode when some of them are in extension records.
+ */
+static void ntfs_list_inode(ntfs_volume *vol, s64 mft_no, MFT_RECORD *mrec)
+{
+	struct LIST_STATE state;
+	ntfs_attr_search_ctx *ctx;
+	ntfs_inode *ni;
+
+	ni = (ntfs_inode*)NULL;
+	if (ntfs_list_has_attribute_list(vol, mrec)) {
+		ni = ntfs_inode_open(vol, (MFT_REF)mft_no);
+		if (!ni) {
+			ntfs_log_perror("Could not open inode %lld",
+					(long long)mft_no);
+			return;
+		}
+		ctx = ntfs_attr_get_search_ctx(ni, NULL);
+	} else
+		ctx = ntfs_attr_get_search_ctx(NULL, mrec);
+	if (!ctx) {
+		ntfs_log_perror("Could not list inode %lld", (long long)mft_no);
+		if (ni)
+			ntfs_inode_close(ni);
+		return;
+	}
+	state.vol = vol;
+	state.inum = mft_no;
+	state.array = const_cpu_to_le32(0);
+	state.count = 0;
+	state.runs = -1;
+	printf("{\"inode\":%lld,\"sequence\":%u,\"directory\":%s,"
+		"\"links\":%u", (long long)mft_no,
+		(unsigned int)le16_to_cpu(mrec->sequence_number),
+		(mrec->flags & MFT_RECORD_IS_DIRECTORY ? "true" : "false"),
+		(unsigned int)le16_to_cpu(mrec->link_count));
+	while (!ntfs_attrs_walk(ctx)) {
+		switch (le32_to_cpu(ctx->attr->type)) {
+		case 0x10 :	/* AT_STANDARD_INFORMATION */
+			ntfs_list_standard_information(&state, ctx->attr);
+			break;
+		case 0x30 :	/* AT_FILE_NAME */
+			ntfs_list_file_name(&state, ctx->attr);
+			break;
+		case 0x80 :	/* AT_DATA */
+			ntfs_list_data(&state, ctx->attr);
+			break;
+		case 0xc0 :	/* AT_REPARSE_POINT */
+			ntfs_list_reparse_tag(&state, ctx->attr);
+			break;
+		default :
+			break;
+		}
+	}
+	ntfs_list_close_array(&state);
+	printf("}\n");
+	ntfs_attr_put_search_ctx(ctx);
+	if (ni)
+		ntfs_inode_close(ni);
+}
+
+/**
+ * ntfs_list_all_inodes - list all the inodes of the volume
+ *
+ * The MFT is read by a single scan, and the base records in use are
+ * listed one per line.
+ */
+static void ntfs_list_all_inodes(ntfs_volume *vol)
+{
+	struct MFT_SCAN *scan;
+	MFT_RECORD *mrec;
+	s64 mft_no;
+
+	scan = ntfs_mft_scan_start(vol, 0,
+		vol->mft_na->initialized_size >> vol->mft_record_size_bits);
+	if (!scan) {
+		ntfs_log_perror("Failed to scan the MFT");
+		return;
+	}
+	while (ntfs_mft_scan_next(scan, &mft_no, &mrec)) {
+		if (mrec && ntfs_is_file_record(mrec->magic)
+		    && (mrec->flags & MFT_RECORD_IN_USE)
+		    && !mrec->base_mft_record)
+			ntfs_list_inode(vol, mft_no, mrec);
+	}
+	ntfs_mft_scan_end(scan);
+}
+
 /**
  * ntfs_dump_volume - dump information about the volume
  */
@@ -2438,6 +2844,13 @@ int main(int argc, char **argv)
 	if (opts.mft)
 		ntfs_dump_volume(vol);
 
+	if (opts.reparse)
+		ntfs_list_reparse_points(vol);
+	if (opts.objid)
+		ntfs_list_object_ids(vol);
+	if (opts.all)
+		ntfs_list_all_inodes(vol);
+
 	if ((opts.inode != -1) || opts.filename) {
 		ntfs_inode *inode;
 		/* obtain the inode */
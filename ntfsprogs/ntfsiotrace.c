@@ -0,0 +1,386 @@
+/**
+ * ntfsiotrace - Part of the Linux-NTFS project.
+ *
+ * This utility analyzes the transfers recorded into a trace file by
+ * the io_trace option of ntfs-3g, so that the access pattern of the
+ * library can be checked, and compared between versions.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include "types.h"
+#include "endians.h"
+#include "devtrace.h"
+#include "utils.h"
+
+#define SMALL_TRANSFER 4096	/* limit of transfers counted as small */
+#define SIZE_CLASSES 32		/* log2 classes of transfer sizes */
+
+static const char *EXEC_NAME = "ntfsiotrace";
+
+static struct options {
+	const char *file;	/* trace file */
+	int dump;		/* print every transfer */
+	int sizes;		/* print the distribution of sizes */
+} opts;
+
+/*
+ *	The statistics for a category and a direction
+ */
+
+struct IOSTATS {
+	u64 transfers;
+	u64 bytes;
+	u64 sequential;		/* starting where the previous one ended */
+	u64 small;		/* below SMALL_TRANSFER */
+	u64 failed;
+	u64 total_us;
+	u64 max_us;
+	s64 next_pos;		/* end of the previous transfer */
+	u64 sizes[SIZE_CLASSES];
+} ;
+
+static struct IOSTATS stats[NTFS_IO_CATEGORIES][2];
+
+static const char *category_names[NTFS_IO_CATEGORIES] = {
+	"other", "mft", "bitmap", "index", "log", "data"
+} ;
+
+/**
+ * version - Print version information about the program
+ *
+ * Print a copyright statement and a brief description of the program.
+ *
+ * Return:  none
+ */
+static void version(void)
+{
+	ntfs_log_info("\n%s v%s (libntfs-3g) - Analyze a trace of the "
+			"transfers of ntfs-3g.\n\n", EXEC_NAME, VERSION);
+	ntfs_log_info("\n%s\n%s%s\n", ntfs_gpl, ntfs_bugs, ntfs_home);
+}
+
+/**
+ * usage - Print a list of the parameters to the program
+ *
+ * Print a list of the parameters and options for the program.
+ *
+ * Return:  none
+ */
+static void usage(void)
+{
+	ntfs_log_info("\nUsage: %s [options] tracefile\n\n"
+		"    -d, --dump                 Print every transfer\n"
+		"    -s, --sizes                Print the distribution of sizes\n"
+		"    -h, --help                 Print this help\n"
+		"    -V, --version              Version information\n\n",
+		EXEC_NAME);
+	ntfs_log_info("%s%s\n", ntfs_bugs, ntfs_home);
+}
+
+/**
+ * parse_options - Read and validate the programs command line
+ *
+ * Read the command line, verify the syntax and parse the options.
+ *
+ * Return:   0 Success, and nothing more to do
+ *	    -1 Success, proceed
+ *	     1 Error, one or more problems
+ */
+static int parse_options(int argc, char **argv)
+{
+	static const char *sopt = "-dsh?V";
+	static const struct option lopt[] = {
+		{ "dump",	 no_argument,		NULL, 'd' },
+		{ "sizes",	 no_argument,		NULL, 's' },
+		{ "help",	 no_argument,		NULL, 'h' },
+		{ "version",	 no_argument,		NULL, 'V' },
+		{ NULL,		 0,			NULL, 0   }
+	};
+
+	int c = -1;
+	int err  = 0;
+	int ver  = 0;
+	int help = 0;
+
+	opterr = 0; /* We'll handle the errors, thank you. */
+
+	while ((c = getopt_long(argc, argv, sopt, lopt, NULL)) != -1) {
+		switch (c) {
+		case 1:	/* A non-option argument */
+			if (!opts.file) {
+				opts.file = argv[optind - 1];
+			} else {
+				ntfs_log_error("You must specify exactly one "
+						"trace file.\n");
+				err++;
+			}
+			break;
+		case 'd':
+			opts.dump++;
+			break;
+		case 's':
+			opts.sizes++;
+			break;
+		case 'h':
+			help++;
+			break;
+		case 'V':
+			ver++;
+			break;
+		case '?':
+		default:
+			ntfs_log_error("Unknown option '%s'.\n",
+					argv[optind - 1]);
+			err++;
+			break;
+		}
+	}
+
+	if (help || ver) {
+		if (ver)
+			version();
+		else
+			usage();
+		return (err ? 1 : 0);
+	}
+	if (!opts.file) {
+		if (argc > 1)
+			ntfs_log_error("You must specify a trace file.\n");
+		err++;
+	}
+	if (err) {
+		usage();
+		return (1);
+	}
+	return (-1);
+}
+
+/*
+ *		Account for a transfer
+ */
+
+static void account(const struct NTFS_IOTRACE_RECORD *rec)
+{
+	struct IOSTATS *st;
+	s64 pos;
+	u32 count;
+	u32 duration;
+	int category;
+	int n;
+
+	category = rec->category;
+	if (category >= NTFS_IO_CATEGORIES)
+		category = NTFS_IO_OTHER;
+	st = &stats[category][rec->op == NTFS_IOTRACE_WRITE];
+	pos = le64_to_cpu(rec->pos);
+	count = le32_to_cpu(rec->count);
+	duration = le32_to_cpu(rec->duration);
+	if (st->transfers && (pos == st->next_pos))
+		st->sequential++;
+	st->next_pos = pos + count;
+	st->transfers++;
+	st->bytes += count;
+	if (count < SMALL_TRANSFER)
+		st->small++;
+	if (rec->failed)
+		st->failed++;
+	st->total_us += duration;
+	if (duration > st->max_us)
+		st->max_us = duration;
+	for (n=0; (n<SIZE_CLASSES - 1) && (count >> (n + 1)); n++) ;
+	st->sizes[n]++;
+	if (opts.dump)
+		printf("%10.6f %c %-6s %12lld %9lu %7lu%s\n",
+			le64_to_cpu(rec->time)/1000000.0,
+			(rec->op == NTFS_IOTRACE_WRITE ? 'W' : 'R'),
+			category_names[category], (long long)pos,
+			(unsigned long)count, (unsigned long)duration,
+			(rec->failed ? " failed" : ""));
+}
+
+static void print_line(const char *name, char op, const struct IOSTATS *st)
+{
+	printf("%-7s %c %10llu %14llu %9llu %6.1f %6.1f %8llu %8llu %6llu\n",
+		name, op, (unsigned long long)st->transfers,
+		(unsigned long long)st->bytes,
+		(unsigned long long)(st->bytes/st->transfers),
+		st->sequential*100.0/st->transfers,
+		st->small*100.0/st->transfers,
+		(unsigned long long)(st->total_us/st->transfers),
+		(unsigned long long)st->max_us,
+		(unsigned long long)st->failed);
+}
+
+/*
+ *		Print the statistics of all the categories
+ */
+
+static void report(u64 count, u64 last_us)
+{
+	struct IOSTATS total[2];
+	struct IOSTATS *st;
+	int category;
+	int rw;
+	int n;
+
+	memset(total, 0, sizeof(total));
+	printf("%llu transfers over %.3f seconds\n\n",
+		(unsigned long long)count, last_us/1000000.0);
+	printf("%-7s %c %10s %14s %9s %6s %6s %8s %8s %6s\n",
+		"kind", ' ', "transfers", "bytes", "avg size", "seq%",
+		"small%", "avg us", "max us", "failed");
+	for (category=0; category<NTFS_IO_CATEGORIES; category++)
+		for (rw=0; rw<2; rw++) {
+			st = &stats[category][rw];
+			if (!st->transfers)
+				continue;
+			print_line(category_names[category],
+					(rw ? 'W' : 'R'), st);
+			total[rw].transfers += st->transfers;
+			total[rw].bytes += st->bytes;
+			total[rw].sequential += st->sequential;
+			total[rw].small += st->small;
+			total[rw].failed += st->failed;
+			total[rw].total_us += st->total_us;
+			if (st->max_us > total[rw].max_us)
+				total[rw].max_us = st->max_us;
+			for (n=0; n<SIZE_CLASSES; n++)
+				total[rw].sizes[n] += st->sizes[n];
+		}
+	for (rw=0; rw<2; rw++)
+		if (total[rw].transfers)
+			print_line("total", (rw ? 'W' : 'R'), &total[rw]);
+	if (opts.sizes) {
+		printf("\nSizes of transfers\n");
+		for (rw=0; rw<2; rw++)
+			for (n=0; n<SIZE_CLASSES; n++)
+				if (total[rw].sizes[n])
+					printf("%c below %10llu : %10llu\n",
+						(rw ? 'W' : 'R'), 2ULL << n,
+						(unsigned long long)
+						total[rw].sizes[n]);
+	}
+}
+
+/*
+ *		Read and analyze the trace file
+ */
+
+static int analyze(FILE *f)
+{
+	struct NTFS_IOTRACE_HEADER header;
+	struct NTFS_IOTRACE_RECORD rec;
+	char *extra;
+	u64 count;
+	u64 last_us;
+	u32 record_size;
+	int err;
+
+	err = 0;
+	if ((fread(&header, sizeof(header), 1, f) != 1)
+	    || memcmp(header.magic, NTFS_IOTRACE_MAGIC,
+			sizeof(header.magic))) {
+		ntfs_log_error("%s is not an ntfs-3g trace file\n",
+				opts.file);
+		return (1);
+	}
+	record_size = le32_to_cpu(header.record_size);
+	if (record_size < sizeof(rec)) {
+		ntfs_log_error("Unsupported record size %lu\n",
+				(unsigned long)record_size);
+		return (1);
+	}
+		/* skip the fields added by later versions */
+	extra = (char*)NULL;
+	if (record_size > sizeof(rec)) {
+		extra = (char*)malloc(record_size - sizeof(rec));
+		if (!extra) {
+			ntfs_log_error("Not enough memory\n");
+			return (1);
+		}
+	}
+	count = 0;
+	last_us = 0;
+	while (fread(&rec, sizeof(rec), 1, f) == 1) {
+		if (extra && (fread(extra, record_size - sizeof(rec),
+					1, f) != 1))
+			break;
+		account(&rec);
+		if ((le64_to_cpu(rec.time) + le32_to_cpu(rec.duration))
+		    > last_us)
+			last_us = le64_to_cpu(rec.time)
+					+ le32_to_cpu(rec.duration);
+		count++;
+	}
+	if (ferror(f)) {
+		ntfs_log_perror("Could not read %s", opts.file);
+		err = 1;
+	} else {
+		if (opts.dump)
+			printf("\n");
+		report(count, last_us);
+	}
+	free(extra);
+	return (err);
+}
+
+/**
+ * main - Begin here
+ *
+ * Start from here.
+ *
+ * Return:  0  Success, the trace was analyzed
+ *	    1  Error, something went wrong
+ */
+int main(int argc, char *argv[])
+{
+	FILE *f;
+	int res;
+
+	ntfs_log_set_handler(ntfs_log_handler_stderr);
+
+	res = parse_options(argc, argv);
+	if (res >= 0)
+		return (res);
+
+	f = fopen(opts.file, "rb");
+	if (!f) {
+		ntfs_log_perror("Could not open %s", opts.file);
+		return (1);
+	}
+	res = analyze(f);
+	fclose(f);
+	return (res);
+}
@@ -41,6 +41,12 @@
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
 
 #include "types.h"
 #include "mft.h"
@@ -63,6 +69,7 @@ static const char *EXEC_NAME = "ntfsls";
 struct dir {
 	struct ntfs_list_head list;
 	ntfs_inode *ni;
+	MFT_REF mref;
 	char name[MAX_PATH];
 	int depth;
 };
@@ -117,17 +124,26 @@ static struct options {
 	int inode;
 	int classify;
 	int recursive;
+	int threads;
 	const char *path;
 } opts;
 
+#define MAX_LIST_THREADS 16
+
+struct list_node;
+
 typedef struct {
 	ntfs_volume *vol;
+	FILE *out;		/* where to list the entries */
+	struct list_node *node;	/* directory being listed in parallel */
 } ntfsls_dirent;
 
 static int list_dir_entry(ntfsls_dirent * dirent, const ntfschar * name,
 			  const int name_len, const int name_type,
 			  const s64 pos, const MFT_REF mref,
 			  const unsigned dt_type);
+static int add_subdir_node(struct list_node *parent, const char *name,
+			  MFT_REF mref);
 
 /**
  * version - Print version information about the program
@@ -169,6 +185,7 @@ static void usage(void)
 		"    -q, --quiet          Less output\n"
 		"    -R, --recursive      Recursively list subdirectories\n"
 		"    -s, --system         Display system files\n"
+		"    -t, --threads NUM    List subdirectories with NUM threads\n"
 		"    -V, --version        Display version information\n"
 		"    -v, --verbose        More output\n"
 		"    -x, --dos            Use short (DOS 8.3) names\n"
@@ -191,7 +208,7 @@ static void usage(void)
  */
 static int parse_options(int argc, char *argv[])
 {
-	static const char *sopt = "-aFfh?ilp:qRsVvx";
+	static const char *sopt = "-aFfh?ilp:qRst:Vvx";
 	static const struct option lopt[] = {
 		{ "all",	 no_argument,		NULL, 'a' },
 		{ "classify",	 no_argument,		NULL, 'F' },
@@ -203,6 +220,7 @@ static int parse_options(int argc, char *argv[])
 		{ "recursive",	 no_argument,		NULL, 'R' },
 		{ "quiet",	 no_argument,		NULL, 'q' },
 		{ "system",	 no_argument,		NULL, 's' },
+		{ "threads",	 required_argument,	NULL, 't' },
 		{ "version",	 no_argument,		NULL, 'V' },
 		{ "verbose",	 no_argument,		NULL, 'v' },
 		{ "dos",	 no_argument,		NULL, 'x' },
@@ -214,12 +232,21 @@ static int parse_options(int argc, char *argv[])
 	int ver  = 0;
 	int help = 0;
 	int levels = 0;
+	char *endptr;
 
 	opterr = 0; /* We'll handle the errors, thank you. */
 
 	memset(&opts, 0, sizeof(opts));
 	opts.device = NULL;
 	opts.path = "/";
+	opts.threads = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+	opts.threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (opts.threads < 1)
+		opts.threads = 1;
+	if (opts.threads > MAX_LIST_THREADS)
+		opts.threads = MAX_LIST_THREADS;
+#endif
 
 	while ((c = getopt_long(argc, argv, sopt, lopt, NULL)) != -1) {
 		switch (c) {
@@ -276,6 +303,16 @@ static int parse_options(int argc, char *argv[])
 		case 'R':
 			opts.recursive++;
 			break;
+		case 't':
+			opts.threads = strtol(optarg, &endptr, 10);
+			if (*endptr || (opts.threads < 1)
+			    || (opts.threads > MAX_LIST_THREADS)) {
+				ntfs_log_error("The number of threads must "
+					"be between 1 and %d.\n",
+					MAX_LIST_THREADS);
+				err++;
+			}
+			break;
 		default:
 			ntfs_log_error("Unknown option '%s'.\n", argv[optind - 1]);
 			err++;
@@ -428,13 +465,12 @@ static int readdir_recursive(ntfs_inode * ni, s64 * pos, ntfsls_dirent * dirent)
 			pos2 = 0;
 			dir_list_insert_pos = &dirs.list;
 			if (!subdir->ni) {
-				subdir->ni =
-				    ntfs_pathname_to_inode(ni->vol, ni,
-							    subdir->name);
+				subdir->ni = ntfs_inode_open(ni->vol,
+							subdir->mref);
 
 				if (!subdir->ni) {
 					ntfs_log_error
-					    ("ntfsls::readdir_recursive(): cannot get inode from pathname.\n");
+					    ("ntfsls::readdir_recursive(): cannot open the subdirectory inode.\n");
 					result = -1;
 					break;
 				}
@@ -521,6 +557,15 @@ static int list_dir_entry(ntfsls_dirent * dirent, const ntfschar * name,
 		sprintf(filename + strlen(filename), "/");
 
 	if (dt_type == NTFS_DT_DIR && opts.recursive
+	    && strcmp(filename, ".") && strcmp(filename, "./")
+	    && strcmp(filename, "..") && strcmp(filename, "../")
+	    && dirent->node) {
+		/* listed in parallel, only record the subdirectory */
+		if (add_subdir_node(dirent->node, filename, mref)) {
+			result = -1;
+			goto free;
+		}
+	} else if (dt_type == NTFS_DT_DIR && opts.recursive
 	    && strcmp(filename, ".") && strcmp(filename, "./")
 	    && strcmp(filename, "..") && strcmp(filename, "../"))
 	{
@@ -534,14 +579,16 @@ static int list_dir_entry(ntfsls_dirent * dirent, const ntfschar * name,
 
 		strcpy(dir->name, filename);
 		dir->ni = NULL;
+		dir->mref = mref;
 		dir->depth = depth;
 	}
 
 	if (!opts.lng) {
 		if (!opts.inode)
-			printf("%s\n", filename);
+			fprintf(dirent->out, "%s\n", filename);
 		else
-			printf("%7llu %s\n", (unsigned long long)MREF(mref),
+			fprintf(dirent->out, "%7llu %s\n",
+					(unsigned long long)MREF(mref),
 					filename);
 		result = 0;
 	} else {
@@ -574,7 +621,7 @@ static int list_dir_entry(ntfsls_dirent * dirent, const ntfschar * name,
 			goto release;
 
 		change_time = ntfs2timespec(file_name_attr->last_data_change_time);
-		strcpy(t_buf, ctime(&change_time.tv_sec));
+		ctime_r(&change_time.tv_sec, t_buf);
 		memmove(t_buf+16, t_buf+19, 5);
 		t_buf[21] = '\0';
 
@@ -586,12 +633,13 @@ static int list_dir_entry(ntfsls_dirent * dirent, const ntfschar * name,
 		}
 
 		if (opts.inode)
-			printf("%7llu    %8lld %s %s\n",
+			fprintf(dirent->out, "%7llu    %8lld %s %s\n",
 					(unsigned long long)MREF(mref),
 					(long long)filesize, t_buf + 4,
 					filename);
 		else
-			printf("%8lld %s %s\n", (long long)filesize, t_buf + 4,
+			fprintf(dirent->out, "%8lld %s %s\n",
+					(long long)filesize, t_buf + 4,
 					filename);
 
 		if (dir) {
@@ -623,6 +671,315 @@ free:
 	return result;
 }
 
+/*
+ *		Parallel recursive listing
+ *
+ *	The directories are listed by several threads, each of them
+ *	working on its own mount of the volume, as an inode cannot be
+ *	used concurrently. Each directory listed is a node of a tree,
+ *	its listing being kept in memory with the list of its
+ *	subdirectories, which are then queued for listing. The main
+ *	thread prints the listings in the order of a sequential recursive
+ *	listing, and it lists the directory it needs next when no other
+ *	thread has taken it. The queue of the directories to list is a
+ *	stack, so that the threads work near the place being printed, and
+ *	they wait when too many listings are waiting to be printed.
+ */
+
+struct list_node {
+	struct list_node *next;		/* next sibling */
+	struct list_node *children;	/* subdirectories in their order */
+	struct list_node *last_child;
+	struct list_node *next_job;	/* next in the stack of jobs */
+	MFT_REF mref;
+	char *path;			/* printed before the listing */
+	int sep;			/* separator after path for children */
+	char *text;			/* the listing */
+	size_t size;
+	BOOL taken;
+	BOOL done;
+	BOOL failed;
+} ;
+
+/*
+ * Stop listing ahead when that many directories are waiting to be
+ * printed.
+ */
+#define MAX_LIST_AHEAD 1024
+
+#ifdef ENABLE_THREADS
+
+static struct {
+	struct list_node *jobs;		/* stack of directories to list */
+	int ahead;	/* directories listed and not printed yet */
+	BOOL stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} listing;
+
+#endif
+
+/**
+ * add_subdir_node - record a subdirectory of a directory listed in parallel
+ *
+ * Returns 0 on success or -1 on error.
+ */
+static int add_subdir_node(struct list_node *parent, const char *name,
+			  MFT_REF mref)
+{
+	struct list_node *node;
+	size_t len;
+
+	node = (struct list_node*)calloc(1, sizeof(struct list_node));
+	len = strlen(parent->path) + strlen(name) + 2;
+	if (node)
+		node->path = (char*)malloc(len);
+	if (!node || !node->path) {
+		ntfs_log_error("Failed to allocate for subdir.\n");
+		free(node);
+		return -1;
+	}
+	/* build the path as copied from readdir_recursive() */
+	if (parent->sep)
+		snprintf(node->path, len, "%s%c%s", parent->path,
+			PATH_SEP, name);
+	else
+		snprintf(node->path, len, "%s%s", parent->path, name);
+	node->sep = (*name != PATH_SEP) && !opts.classify;
+	node->mref = mref;
+	if (parent->last_child)
+		parent->last_child->next = node;
+	else
+		parent->children = node;
+	parent->last_child = node;
+	return 0;
+}
+
+#ifdef ENABLE_THREADS
+
+/**
+ * list_node_entries - list a directory into memory
+ */
+static void list_node_entries(ntfs_volume *vol, struct list_node *node)
+{
+	ntfsls_dirent dirent;
+	ntfs_inode *ni;
+	s64 pos;
+
+	ni = ntfs_inode_open(vol, node->mref);
+	if (!ni) {
+		ntfs_log_error("ntfsls::readdir_recursive(): cannot open "
+				"the subdirectory inode.\n");
+		node->failed = TRUE;
+		return;
+	}
+	memset(&dirent, 0, sizeof(dirent));
+	dirent.vol = vol;
+	dirent.node = node;
+	dirent.out = open_memstream(&node->text, &node->size);
+	if (!dirent.out) {
+		ntfs_log_perror("Failed to list in memory");
+		node->failed = TRUE;
+	} else {
+		pos = 0;
+		if (ntfs_readdir(ni, &pos, &dirent,
+				(ntfs_filldir_t) list_dir_entry))
+			node->failed = TRUE;
+		if (fclose(dirent.out))
+			node->failed = TRUE;
+	}
+	ntfs_inode_close(ni);
+}
+
+static void free_node(struct list_node *node)
+{
+	struct list_node *child;
+
+	while ((child = node->children)) {
+		node->children = child->next;
+		free_node(child);
+	}
+	free(node->text);
+	free(node->path);
+	free(node);
+}
+
+/**
+ * push_children - queue the subdirectories of a directory just listed
+ *
+ * The first subdirectory is pushed last, so that it is listed first.
+ * Must be called with the lock held.
+ */
+static void push_children(struct list_node *node)
+{
+	struct list_node *child;
+	struct list_node *first;
+
+	first = (struct list_node*)NULL;
+	for (child=node->children; child; child=child->next) {
+		child->next_job = first;
+		first = child;
+	}
+	/* reverse the order onto the stack */
+	while (first) {
+		child = first;
+		first = first->next_job;
+		child->next_job = listing.jobs;
+		listing.jobs = child;
+	}
+}
+
+/**
+ * list_thread - thread listing directories on its own mount of the volume
+ */
+static void *list_thread(void *arg __attribute__((unused)))
+{
+	struct list_node *node;
+	ntfs_volume *vol;
+
+	vol = ntfs_mount(opts.device, NTFS_MNT_RDONLY |
+			(opts.force ? NTFS_MNT_RECOVER : 0));
+	if (!vol)
+		return ((void*)NULL);
+	pthread_mutex_lock(&listing.lock);
+	while (!listing.stop) {
+		node = listing.jobs;
+		if (node && (listing.ahead < MAX_LIST_AHEAD)) {
+			listing.jobs = node->next_job;
+			node->taken = TRUE;
+			pthread_mutex_unlock(&listing.lock);
+			list_node_entries(vol, node);
+			pthread_mutex_lock(&listing.lock);
+			node->done = TRUE;
+			listing.ahead++;
+			push_children(node);
+			pthread_cond_broadcast(&listing.cond);
+		} else
+			pthread_cond_wait(&listing.cond, &listing.lock);
+	}
+	pthread_mutex_unlock(&listing.lock);
+	ntfs_umount(vol, FALSE);
+	return ((void*)NULL);
+}
+
+/**
+ * get_listed_node - get a directory listed, listing it if not taken yet
+ */
+static void get_listed_node(ntfs_volume *vol, struct list_node *node)
+{
+	struct list_node **pjob;
+
+	pthread_mutex_lock(&listing.lock);
+	if (!node->taken) {
+		for (pjob=&listing.jobs; *pjob && (*pjob != node);
+				pjob=&(*pjob)->next_job) { }
+		if (*pjob)
+			*pjob = node->next_job;
+		node->taken = TRUE;
+		pthread_mutex_unlock(&listing.lock);
+		list_node_entries(vol, node);
+		pthread_mutex_lock(&listing.lock);
+		node->done = TRUE;
+		listing.ahead++;
+		push_children(node);
+		pthread_cond_broadcast(&listing.cond);
+	}
+	while (!node->done)
+		pthread_cond_wait(&listing.cond, &listing.lock);
+	pthread_mutex_unlock(&listing.lock);
+}
+
+/**
+ * print_tree - print the listing of a directory and its subdirectories
+ *
+ * The subdirectories are freed once printed.
+ *
+ * Returns 0 on success or -1 on error.
+ */
+static int print_tree(ntfs_volume *vol, struct list_node *node)
+{
+	struct list_node *child;
+
+	get_listed_node(vol, node);
+	if (node->text)
+		fwrite(node->text, 1, node->size, stdout);
+	free(node->text);
+	node->text = (char*)NULL;
+	pthread_mutex_lock(&listing.lock);
+	listing.ahead--;
+	pthread_cond_broadcast(&listing.cond);
+	pthread_mutex_unlock(&listing.lock);
+	if (node->failed)
+		return -1;
+	while ((child = node->children)) {
+		printf("\n%s:\n", child->path);
+		if (print_tree(vol, child))
+			return -1;
+		node->children = child->next;
+		free_node(child);
+	}
+	return 0;
+}
+
+/**
+ * readdir_parallel - list a directory and its subdirectories by threads
+ *
+ * The output is the same as the one of readdir_recursive().
+ *
+ * Returns 0 on success or -1 on error.
+ */
+static int readdir_parallel(ntfs_volume *vol, ntfs_inode *ni)
+{
+	struct list_node *root;
+	pthread_t *threads;
+	int count;
+	int result;
+	int i;
+
+	root = (struct list_node*)calloc(1, sizeof(struct list_node));
+	threads = (pthread_t*)malloc(opts.threads*sizeof(pthread_t));
+	if (root)
+		root->path = strdup(opts.path);
+	if (!root || !root->path || !threads) {
+		ntfs_log_error("Failed to allocate for the listing.\n");
+		if (root)
+			free(root->path);
+		free(root);
+		free(threads);
+		return -1;
+	}
+	root->mref = MK_MREF(ni->mft_no,
+			le16_to_cpu(ni->mrec->sequence_number));
+	root->sep = (*opts.path != PATH_SEP);
+	memset(&listing, 0, sizeof(listing));
+	if (pthread_mutex_init(&listing.lock, NULL)
+	    || pthread_cond_init(&listing.cond, NULL)) {
+		ntfs_log_error("Failed to initialize the listing.\n");
+		free_node(root);
+		free(threads);
+		return -1;
+	}
+	count = 0;
+	for (i=1; i<opts.threads; i++)
+		if (!pthread_create(&threads[count], NULL, list_thread, NULL))
+			count++;
+	printf("%s:\n", opts.path);
+	result = print_tree(vol, root);
+	pthread_mutex_lock(&listing.lock);
+	listing.stop = TRUE;
+	pthread_cond_broadcast(&listing.cond);
+	pthread_mutex_unlock(&listing.lock);
+	for (i=0; i<count; i++)
+		pthread_join(threads[i], NULL);
+	pthread_cond_destroy(&listing.cond);
+	pthread_mutex_destroy(&listing.lock);
+	free_node(root);
+	free(threads);
+	return result;
+}
+
+#endif
+
 /**
  * main - Begin here
  *
@@ -671,7 +1028,13 @@ int main(int argc, char **argv)
 	pos = 0;
 	memset(&dirent, 0, sizeof(dirent));
 	dirent.vol = vol;
+	dirent.out = stdout;
 	if (ni->mrec->flags & MFT_RECORD_IS_DIRECTORY) {
+#ifdef ENABLE_THREADS
+		if (opts.recursive && (opts.threads > 1))
+			readdir_parallel(vol, ni);
+		else
+#endif
 		if (opts.recursive)
 			readdir_recursive(ni, &pos, &dirent);
 		else
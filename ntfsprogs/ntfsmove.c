@@ -39,6 +39,18 @@
 #ifdef HAVE_LIMITS_H
 #include <limits.h>
 #endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_SYS_IOCTL_H
+#include <sys/ioctl.h>
+#endif
 
 #include "types.h"
 #include "attrib.h"
@@ -47,6 +59,11 @@
 #include "debug.h"
 #include "dir.h"
 #include "bitmap.h"
+#include "inode.h"
+#include "mft.h"
+#include "runlist.h"
+#include "ioctl.h"
+#include "misc.h"
 #include "ntfsmove.h"
 /* #include "version.h" */
 #include "logging.h"
@@ -79,12 +96,18 @@ static void version(void)
 static void usage(void)
 {
 	ntfs_log_info("\nUsage: %s [options] device file\n"
+		"       %s -d [options] device\n"
+		"       %s -d -m [options] path...\n"
 		"\n"
 		"    -S      --start        Move to the start of the volume\n"
 		"    -B      --best         Move to the best place on the volume\n"
 		"    -E      --end          Move to the end of the volume\n"
 		"    -C num  --cluster num  Move to this cluster offset\n"
 		"\n"
+		"    -d      --defrag       Defragment the most fragmented files\n"
+		"    -N num  --count num    Defragment at most num files\n"
+		"    -m      --mounted      Paths are within an ntfs-3g mount\n"
+		"\n"
 		"    -D      --no-dirty     Do not mark volume dirty (require chkdsk)\n"
 		"    -n      --no-action    Do not write to disk\n"
 		"    -f      --force        Use less caution\n"
@@ -92,7 +115,7 @@ static void usage(void)
 		"    -q      --quiet        Less output\n"
 		"    -V      --version      Version information\n"
 		"    -v      --verbose      More output\n\n",
-		EXEC_NAME);
+		EXEC_NAME, EXEC_NAME, EXEC_NAME);
 	ntfs_log_info("%s%s\n", ntfs_bugs, ntfs_home);
 }
 
@@ -107,13 +130,16 @@ static void usage(void)
  */
 static int parse_options(int argc, char **argv)
 {
-	static const char *sopt = "-BC:DEfh?nqSVv";
+	static const char *sopt = "-BC:dDEfh?mN:nqSVv";
 	static const struct option lopt[] = {
 		{ "best",	no_argument,		NULL, 'B' },
 		{ "cluster",	required_argument,	NULL, 'C' },
+		{ "count",	required_argument,	NULL, 'N' },
+		{ "defrag",	no_argument,		NULL, 'd' },
 		{ "end",	no_argument,		NULL, 'E' },
 		{ "force",	no_argument,		NULL, 'f' },
 		{ "help",	no_argument,		NULL, 'h' },
+		{ "mounted",	no_argument,		NULL, 'm' },
 		{ "no-action",	no_argument,		NULL, 'n' },
 		{ "no-dirty",	no_argument,		NULL, 'D' },
 		{ "quiet",	no_argument,		NULL, 'q' },
@@ -132,18 +158,13 @@ static int parse_options(int argc, char **argv)
 
 	opterr = 0; /* We'll handle the errors, thank you. */
 
+	opts.paths = (char**)ntfs_malloc(argc*sizeof(char*));
+	if (!opts.paths)
+		return (0);
 	while ((c = getopt_long(argc, argv, sopt, lopt, NULL)) != -1) {
 		switch (c) {
 		case 1:	/* A non-option argument */
-			if (!opts.device) {
-				opts.device = argv[optind-1];
-			} else if (!opts.file) {
-				opts.file = argv[optind-1];
-			} else {
-				opts.device = NULL;
-				opts.file   = NULL;
-				err++;
-			}
+			opts.paths[opts.path_count++] = argv[optind-1];
 			break;
 		case 'B':
 			if (opts.location == 0)
@@ -160,6 +181,9 @@ static int parse_options(int argc, char **argv)
 				opts.location = -1;
 			}
 			break;
+		case 'd':
+			opts.defrag++;
+			break;
 		case 'D':
 			opts.nodirty++;
 			break;
@@ -181,6 +205,14 @@ static int parse_options(int argc, char **argv)
 			}
 			help++;
 			break;
+		case 'm':
+			opts.mounted++;
+			break;
+		case 'N':
+			opts.count = strtoll(optarg, &end, 0);
+			if ((end && *end) || (opts.count <= 0))
+				err++;
+			break;
 		case 'n':
 			opts.noaction++;
 			break;
@@ -217,14 +249,41 @@ static int parse_options(int argc, char **argv)
 
 	if (help || ver) {
 		opts.quiet = 0;
+	} else if (opts.defrag) {
+		if (opts.mounted) {
+			if (!opts.path_count) {
+				ntfs_log_error("You must specify the paths to"
+						" defragment.\n");
+				err++;
+			}
+		} else {
+			if (opts.path_count != 1) {
+				ntfs_log_error("You must specify one device.\n");
+				err++;
+			} else
+				opts.device = opts.paths[0];
+		}
+		if (opts.location) {
+			ntfs_log_error("You may not specify a location when"
+					" defragmenting.\n");
+			err++;
+		}
 	} else {
-		if ((opts.device == NULL) ||
-		    (opts.file   == NULL)) {
+		if (opts.path_count == 2) {
+			opts.device = opts.paths[0];
+			opts.file = opts.paths[1];
+		} else {
 			if (argc > 1)
 				ntfs_log_error("You must specify one device and one file.\n");
 			err++;
 		}
 
+		if (opts.mounted || opts.count) {
+			ntfs_log_error("You may only use --mounted or --count"
+					" when defragmenting.\n");
+			err++;
+		}
+
 		if (opts.quiet && opts.verbose) {
 			ntfs_log_error("You may not use --quiet and --verbose at the "
 					"same time.\n");
@@ -517,6 +576,7 @@ static int bitmap_alloc(ntfs_volume *vol, runlist_element *rl)
 		return -1;
 
 	res = ntfs_bitmap_set_run(vol->lcnbmp_na, rl->lcn, rl->length);
+	utils_bitmaps_invalidate(vol);
 	if (res < 0) {
 		ntfs_log_error("bitmap alloc returns %d\n", res);
 	}
@@ -535,6 +595,7 @@ static int bitmap_free(ntfs_volume *vol, runlist_element *rl)
 		return -1;
 
 	res = ntfs_bitmap_clear_run(vol->lcnbmp_na, rl->lcn, rl->length);
+	utils_bitmaps_invalidate(vol);
 	if (res < 0) {
 		ntfs_log_error("bitmap free returns %d\n", res);
 	}
@@ -855,6 +916,330 @@ static s64 move_file(ntfs_volume *vol, ntfs_inode *ino, u64 loc, int flags)
 }
 
 
+/*
+ *		Defragmentation of the most fragmented files
+ *
+ *	The files are ranked by their count of fragments, and the most
+ *	fragmented ones are relocated first, each one to a single free
+ *	extent when there is one (see ntfs_attr_defragment()). The
+ *	unnamed data of files and the index of directories are
+ *	considered, the system files and the files in $Extend are not.
+ *
+ *	On an unmounted device, the fragments are counted by a sequential
+ *	scan of the mft records. Within an ntfs-3g mount, the designated
+ *	files are ranked and relocated by the driver through an ioctl,
+ *	so that it coordinates with the openings of the files.
+ */
+
+struct DEFRAG_FILE {
+	const char *path;	/* path, when mounted */
+	s64 mft_no;		/* inode number, or rank of the path */
+	s64 fragments;
+} ;
+
+struct DEFRAG_LIST {
+	struct DEFRAG_FILE *files;
+	s64 count;
+	s64 size;
+} ;
+
+static int defrag_add(struct DEFRAG_LIST *list, const char *path,
+			s64 mft_no, s64 fragments)
+{
+	struct DEFRAG_FILE *files;
+	s64 size;
+
+	if (list->count >= list->size) {
+		size = (list->size ? 2*list->size : 256);
+		files = (struct DEFRAG_FILE*)realloc(list->files,
+					size*sizeof(struct DEFRAG_FILE));
+		if (!files) {
+			ntfs_log_error("Not enough memory\n");
+			return (-1);
+		}
+		list->files = files;
+		list->size = size;
+	}
+	list->files[list->count].path = path;
+	list->files[list->count].mft_no = mft_no;
+	list->files[list->count].fragments = fragments;
+	list->count++;
+	return (0);
+}
+
+/*
+ *		Order the files by decreasing fragments
+ */
+
+static int defrag_compare(const void *p1, const void *p2)
+{
+	const struct DEFRAG_FILE *f1 = (const struct DEFRAG_FILE*)p1;
+	const struct DEFRAG_FILE *f2 = (const struct DEFRAG_FILE*)p2;
+
+	if (f1->fragments == f2->fragments)
+		return (f1->mft_no < f2->mft_no ? -1
+				: (f1->mft_no > f2->mft_no));
+	return (f1->fragments > f2->fragments ? -1 : 1);
+}
+
+/*
+ *		Open the attribute to defragment in an inode
+ */
+
+static ntfs_attr *defrag_attr_open(ntfs_inode *ni)
+{
+	if (ni->mrec->flags & MFT_RECORD_IS_DIRECTORY)
+		return (ntfs_attr_open(ni, AT_INDEX_ALLOCATION,
+				NTFS_INDEX_I30, 4));
+	return (ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0));
+}
+
+/*
+ *		Count the fragments of a file from its base mft record
+ *
+ *	The runlist is decoded from the record, unless the attribute
+ *	has several extents, in which case the inode is opened.
+ *
+ *	Returns the count of fragments (0 if the attribute is resident
+ *		or absent), or -1 if there was an error
+ */
+
+static s64 record_fragments(ntfs_volume *vol, s64 mft_no, MFT_RECORD *mrec)
+{
+	ATTR_RECORD *a;
+	ATTR_RECORD *target;
+	ntfs_inode *ni;
+	ntfs_attr *na;
+	runlist_element *rl;
+	ATTR_TYPES type;
+	BOOL attrlist;
+	s64 fragments;
+	u32 offs;
+	u32 end;
+
+	type = (mrec->flags & MFT_RECORD_IS_DIRECTORY
+			? AT_INDEX_ALLOCATION : AT_DATA);
+	target = (ATTR_RECORD*)NULL;
+	attrlist = FALSE;
+	end = le32_to_cpu(mrec->bytes_in_use);
+	if (end > vol->mft_record_size)
+		end = vol->mft_record_size;
+	offs = le16_to_cpu(mrec->attrs_offset);
+	while ((offs + 8) <= end) {
+		a = (ATTR_RECORD*)((char*)mrec + offs);
+		if ((a->type == AT_END) || !a->length
+		    || ((offs + le32_to_cpu(a->length)) > end))
+			break;
+		if (a->type == AT_ATTRIBUTE_LIST)
+			attrlist = TRUE;
+		if ((a->type == type) && a->non_resident
+		    && (a->name_length == (type == AT_DATA ? 0 : 4)))
+			target = a;
+		offs += le32_to_cpu(a->length);
+	}
+	fragments = 0;
+	if (attrlist) {
+		ni = ntfs_inode_open(vol, mft_no);
+		if (!ni)
+			return (-1);
+		na = defrag_attr_open(ni);
+		if (na) {
+			if (NAttrNonResident(na)) {
+				if (ntfs_attr_map_whole_runlist(na))
+					fragments = -1;
+				else
+					fragments = ntfs_rl_fragments(na->rl);
+			}
+			ntfs_attr_close(na);
+		}
+		ntfs_inode_close(ni);
+	} else
+		if (target && !target->lowest_vcn) {
+			rl = ntfs_mapping_pairs_decompress(vol, target, NULL);
+			fragments = (rl ? ntfs_rl_fragments(rl) : -1);
+			free(rl);
+		}
+	return (fragments);
+}
+
+/*
+ *		Rank the fragmented files of an unmounted volume
+ */
+
+static int defrag_scan(ntfs_volume *vol, struct DEFRAG_LIST *list)
+{
+	struct MFT_SCAN *scan;
+	MFT_RECORD *mrec;
+	s64 mft_no;
+	s64 fragments;
+	int err;
+
+	scan = ntfs_mft_scan_start(vol, FILE_root, LLONG_MAX);
+	if (!scan) {
+		ntfs_log_perror("Could not scan the MFT");
+		return (-1);
+	}
+	err = 0;
+	while (!err && ntfs_mft_scan_next(scan, &mft_no, &mrec)) {
+		if (!mrec
+		    || !(mrec->flags & MFT_RECORD_IN_USE)
+		    || mrec->base_mft_record
+		    || ((mft_no < FILE_first_user) && (mft_no != FILE_root)))
+			continue;
+		fragments = record_fragments(vol, mft_no, mrec);
+		if (fragments < 0)
+			ntfs_log_error("Could not count the fragments of"
+					" inode %lld\n", (long long)mft_no);
+		else
+			if ((fragments > 1)
+			    && defrag_add(list, (const char*)NULL, mft_no,
+					fragments))
+				err = -1;
+	}
+	ntfs_mft_scan_end(scan);
+	return (err);
+}
+
+/*
+ *		Defragment a file of an unmounted volume
+ *
+ *	Returns the count of fragments after, or -1 if failed
+ */
+
+static s64 defrag_inode(ntfs_volume *vol, s64 mft_no)
+{
+	ntfs_inode *ni;
+	ntfs_attr *na;
+	s64 fragments;
+
+	ni = ntfs_inode_open(vol, mft_no);
+	if (!ni)
+		return (-1);
+	fragments = -1;
+	if ((mft_no != FILE_root) && utils_is_metadata(ni))
+		errno = EPERM;
+	else {
+		na = defrag_attr_open(ni);
+		if (na) {
+			fragments = ntfs_attr_defragment(na);
+			ntfs_attr_close(na);
+		}
+	}
+	if (ntfs_inode_close(ni))
+		fragments = -1;
+	return (fragments);
+}
+
+/*
+ *		Count the fragments or defragment a file within an ntfs-3g mount
+ *
+ *	Returns the count of fragments after, or -1 if failed
+ */
+
+static s64 defrag_path(const char *path, u64 flags, s64 *before)
+{
+#ifdef NTFS_IOC_DEFRAG
+	struct NTFS_DEFRAG dfg;
+	int fd;
+	int res;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return (-1);
+	memset(&dfg, 0, sizeof(dfg));
+	dfg.flags = flags;
+	res = ioctl(fd, NTFS_IOC_DEFRAG, &dfg);
+	close(fd);
+	if (res)
+		return (-1);
+	*before = dfg.before;
+	return (dfg.after);
+#else /* NTFS_IOC_DEFRAG */
+	*before = -1;
+	errno = EOPNOTSUPP;
+	return (-1);
+#endif /* NTFS_IOC_DEFRAG */
+}
+
+/*
+ *		Rank designated files within an ntfs-3g mount
+ */
+
+static int defrag_rank_mounted(struct DEFRAG_LIST *list)
+{
+	s64 fragments;
+	int i;
+
+	for (i=0; i<opts.path_count; i++) {
+		if (defrag_path(opts.paths[i], NTFS_DEFRAG_COUNT,
+				&fragments) < 0)
+			ntfs_log_perror("Could not count the fragments of %s",
+					opts.paths[i]);
+		else
+			if ((fragments > 1)
+			    && defrag_add(list, opts.paths[i], i, fragments))
+				return (-1);
+	}
+	return (0);
+}
+
+/*
+ *		Defragment the most fragmented files
+ *
+ *	Returns 0 if successful, 1 if some file could not be defragmented
+ */
+
+static int defrag(ntfs_volume *vol)
+{
+	struct DEFRAG_LIST list;
+	struct DEFRAG_FILE *file;
+	ntfs_inode *ni;
+	char name[MAX_PATH];
+	s64 before;
+	s64 after;
+	s64 i;
+	int result;
+
+	memset(&list, 0, sizeof(list));
+	if (vol ? defrag_scan(vol, &list) : defrag_rank_mounted(&list)) {
+		free(list.files);
+		return (1);
+	}
+	qsort(list.files, list.count, sizeof(struct DEFRAG_FILE),
+			defrag_compare);
+	if (opts.count && (list.count > opts.count))
+		list.count = opts.count;
+	result = 0;
+	for (i=0; i<list.count; i++) {
+		file = &list.files[i];
+		if (!file->path) {
+			ni = ntfs_inode_open(vol, file->mft_no);
+			if (!ni || !utils_inode_get_name(ni, name, MAX_PATH))
+				snprintf(name, MAX_PATH, "inode %lld",
+						(long long)file->mft_no);
+			if (ni)
+				ntfs_inode_close(ni);
+		}
+		before = file->fragments;
+		if (opts.noaction)
+			after = before;
+		else if (vol)
+			after = defrag_inode(vol, file->mft_no);
+		else
+			after = defrag_path(file->path, 0, &before);
+		if (after < 0) {
+			ntfs_log_perror("Could not defragment %s",
+					(file->path ? file->path : name));
+			result = 1;
+		} else
+			ntfs_log_info("%s : %lld -> %lld fragments\n",
+					(file->path ? file->path : name),
+					(long long)before, (long long)after);
+	}
+	free(list.files);
+	return (result);
+}
+
 /**
  * main - Begin here
  *
@@ -878,6 +1263,9 @@ int main(int argc, char *argv[])
 
 	utils_set_locale();
 
+	if (opts.defrag && opts.mounted)
+		return (defrag((ntfs_volume*)NULL));
+
 	if (opts.noaction)
 		flags |= NTFS_MNT_RDONLY;
 	if (opts.force)
@@ -889,6 +1277,17 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	if (opts.defrag) {
+		if (ntfs_volume_get_free_space(vol)) {
+			ntfs_log_perror("ERROR: couldn't get free space");
+			result = 1;
+		} else
+			result = defrag(vol);
+		if (ntfs_umount(vol, FALSE))
+			result = 1;
+		return (result);
+	}
+
 	inode = ntfs_pathname_to_inode(vol, NULL, opts.file);
 	if (!inode) {
 		ntfs_log_info("!inode\n");
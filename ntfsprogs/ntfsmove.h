@@ -39,6 +39,11 @@ struct options {
 	int		 verbose;	/* Extra output */
 	int		 noaction;	/* Do not write to disk */
 	int		 nodirty;	/* Do not mark volume dirty */
+	int		 defrag;	/* Defragment the most fragmented files */
+	int		 mounted;	/* Paths are within an ntfs-3g mount */
+	s64		 count;		/* Max count of files to defragment */
+	char		**paths;	/* Files to defragment when mounted */
+	int		 path_count;
 };
 
 #endif /* _NTFSMOVE_H_ */
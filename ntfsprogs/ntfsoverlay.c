@@ -0,0 +1,256 @@
+/**
+ * ntfsoverlay - Part of the Linux-NTFS project.
+ *
+ * This utility creates an overlay file protecting a device or an image
+ * from being written to, so that it can be mounted read-write with the
+ * option overlay of ntfs-3g, then merges the changes into the device
+ * or discards them.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include "types.h"
+#include "overlay.h"
+#include "utils.h"
+
+static const char *EXEC_NAME = "ntfsoverlay";
+
+static struct options {
+	const char *overlay;
+	const char *base;	/* device to create an overlay for */
+	u32 block_size;
+	int merge;
+	int discard;
+} opts;
+
+/**
+ * version - Print version information about the program
+ *
+ * Print a copyright statement and a brief description of the program.
+ *
+ * Return:  none
+ */
+static void version(void)
+{
+	ntfs_log_info("\n%s v%s (libntfs-3g) - Manage a copy-on-write "
+			"overlay.\n\n", EXEC_NAME, VERSION);
+	ntfs_log_info("\n%s\n%s%s\n", ntfs_gpl, ntfs_bugs, ntfs_home);
+}
+
+/**
+ * usage - Print a list of the parameters to the program
+ *
+ * Print a list of the parameters and options for the program.
+ *
+ * Return:  none
+ */
+static void usage(void)
+{
+	ntfs_log_info("\nUsage: %s [options] overlay\n\n"
+		"    -c, --create DEVICE        Create an overlay for device\n"
+		"    -b, --block-size BYTES     Granularity of the copies\n"
+		"    -m, --merge                Write the changes into the device\n"
+		"    -d, --discard              Discard the changes\n"
+		"    -h, --help                 Print this help\n"
+		"    -V, --version              Version information\n\n",
+		EXEC_NAME);
+	ntfs_log_info("%s%s\n", ntfs_bugs, ntfs_home);
+}
+
+/**
+ * parse_options - Read and validate the programs command line
+ *
+ * Read the command line, verify the syntax and parse the options.
+ *
+ * Return:   0 Success, and nothing more to do
+ *	    -1 Success, proceed
+ *	     1 Error, one or more problems
+ */
+static int parse_options(int argc, char **argv)
+{
+	static const char *sopt = "-b:c:dmh?V";
+	static const struct option lopt[] = {
+		{ "block-size",	 required_argument,	NULL, 'b' },
+		{ "create",	 required_argument,	NULL, 'c' },
+		{ "discard",	 no_argument,		NULL, 'd' },
+		{ "merge",	 no_argument,		NULL, 'm' },
+		{ "help",	 no_argument,		NULL, 'h' },
+		{ "version",	 no_argument,		NULL, 'V' },
+		{ NULL,		 0,			NULL, 0   }
+	};
+
+	int c = -1;
+	int err  = 0;
+	int ver  = 0;
+	int help = 0;
+	unsigned long size;
+	char *end;
+
+	opterr = 0; /* We'll handle the errors, thank you. */
+
+	while ((c = getopt_long(argc, argv, sopt, lopt, NULL)) != -1) {
+		switch (c) {
+		case 1:	/* A non-option argument */
+			if (!opts.overlay)
+				opts.overlay = argv[optind - 1];
+			else {
+				ntfs_log_error("You must specify exactly one "
+						"overlay.\n");
+				err++;
+			}
+			break;
+		case 'b':
+			size = strtoul(optarg, &end, 0);
+			if (!*optarg || (end && *end) || (size < 512)
+			    || (size > 65536) || (size & (size - 1))) {
+				ntfs_log_error("Bad block size '%s'.\n",
+						optarg);
+				err++;
+			}
+			opts.block_size = size;
+			break;
+		case 'c':
+			opts.base = optarg;
+			break;
+		case 'd':
+			opts.discard++;
+			break;
+		case 'm':
+			opts.merge++;
+			break;
+		case 'h':
+			help++;
+			break;
+		case 'V':
+			ver++;
+			break;
+		case '?':
+		default:
+			ntfs_log_error("Unknown option '%s'.\n",
+					argv[optind - 1]);
+			err++;
+			break;
+		}
+	}
+	if (help || ver) {
+		if (ver)
+			version();
+		else
+			usage();
+		return (err ? 1 : 0);
+	}
+	if (!opts.overlay) {
+		if (argc > 1)
+			ntfs_log_error("You must specify an overlay.\n");
+		err++;
+	}
+	if (((opts.base ? 1 : 0) + (opts.merge ? 1 : 0)
+			+ (opts.discard ? 1 : 0)) > 1) {
+		ntfs_log_error("Options --create, --merge and --discard "
+				"are exclusive.\n");
+		err++;
+	}
+	if (opts.block_size && !opts.base) {
+		ntfs_log_error("Option --block-size is only meaningful "
+				"with --create.\n");
+		err++;
+	}
+	if (err) {
+		usage();
+		return (1);
+	}
+	return (-1);
+}
+
+/*
+ *		Print the state of an overlay
+ */
+
+static int print_info(const char *overlay)
+{
+	struct NTFS_OVERLAY_INFO info;
+
+	if (ntfs_overlay_info(overlay, &info))
+		return (1);
+	printf("Base device        : %s\n", info.base_name);
+	printf("Base size          : %lld bytes\n",
+			(long long)info.base_size);
+	printf("Block size         : %lu bytes\n",
+			(unsigned long)info.block_size);
+	printf("Changed blocks     : %lld (%lld bytes)\n",
+			(long long)info.changed_blocks,
+			(long long)info.changed_blocks*info.block_size);
+	free(info.base_name);
+	return (0);
+}
+
+int main(int argc, char *argv[])
+{
+	s64 merged;
+	int res;
+
+	ntfs_log_set_handler(ntfs_log_handler_stderr);
+
+	res = parse_options(argc, argv);
+	if (res >= 0)
+		return (res);
+
+	utils_set_locale();
+	if (opts.base) {
+		res = ntfs_overlay_create(opts.base, opts.overlay,
+				opts.block_size);
+		if (!res)
+			res = print_info(opts.overlay);
+		else
+			res = 1;
+	} else
+		if (opts.merge) {
+			merged = ntfs_overlay_merge(opts.overlay);
+			if (merged >= 0) {
+				printf("%lld blocks merged\n",
+						(long long)merged);
+				res = 0;
+			} else
+				res = 1;
+		} else
+			if (opts.discard) {
+				res = (ntfs_overlay_discard(opts.overlay)
+						? 1 : 0);
+			} else
+				res = print_info(opts.overlay);
+	if (res)
+		ntfs_log_error("Failed to process the overlay '%s'\n",
+				opts.overlay);
+	return (res);
+}
@@ -45,6 +45,7 @@
 #define BASEBLKS 4 /* number of special blocks (always shown) */
 #define RSTBLKS 2 /* number of restart blocks */
 #define BUFFERCNT 64 /* number of block buffers - a power of 2 */
+#define WINDOWSZ 4194304 /* bytes read at once from the log - power of 2 */
 #define NTFSBLKLTH 512 /* usa block size */
 #define SHOWATTRS 20 /* max attrs shown in a dump */
 #define SHOWLISTS 10 /* max lcn or lsn shown in a list */
@@ -162,6 +163,9 @@ unsigned int playedactions; // change the name
 unsigned int redocount;
 unsigned int undocount;
 struct BUFFER *buffer_table[BASEBLKS + BUFFERCNT];
+char *window; /* raw log blocks read ahead, still protected */
+u32 window_first; /* first block in window */
+u32 window_count; /* number of blocks in window */
 
 static const le16 SDS[4] = {
 	const_cpu_to_le16('$'), const_cpu_to_le16('S'),
@@ -306,6 +310,60 @@ struct ATTR *getattrentry(unsigned int key, unsigned int lth)
 	return (pa);
 }
 
+/*
+ *		Get the raw data of a log block through a large window
+ *
+ *	The log is read by windows of WINDOWSZ bytes aligned to their
+ *	size, so that both forward and backward walks through the log
+ *	mostly read sequentially, at most one window being kept.
+ *	The data is still protected by the update sequence array, and
+ *	the special blocks are not supposed to be read this way, as
+ *	they are read before the block size is known and rewritten.
+ *
+ *	returns NULL if the window cannot be read (the block has then
+ *		to be read alone), otherwise the protected block data
+ */
+
+static const char *read_window(CONTEXT *ctx, unsigned int num)
+{
+	u32 blocks;
+	u32 first;
+	u32 count;
+	BOOL got;
+
+	if (!window || (num < window_first)
+	    || (num >= (window_first + window_count))) {
+		if (!window) {
+			window = (char*)malloc(WINDOWSZ);
+			if (!window)
+				return ((const char*)NULL);
+		}
+		blocks = WINDOWSZ >> blockbits;
+		first = num & -blocks;
+		count = blocks;
+		if (((u64)(first + count) << blockbits) > logfilesz)
+			count = (logfilesz >> blockbits) - first;
+		if ((num < first) || (num >= (first + count)))
+			return ((const char*)NULL);
+		if (ctx->vol)
+			got = (ntfs_attr_pread(log_na,(u64)first << blockbits,
+					(s64)count << blockbits, window)
+				== ((s64)count << blockbits));
+		else
+			got = !fseek(ctx->file, loclogblk(ctx, first), 0)
+			    && (fread(window, (size_t)count << blockbits,
+						1, ctx->file) == 1);
+		if (got) {
+			window_first = first;
+			window_count = count;
+		} else {
+			window_count = 0;
+			return ((const char*)NULL);
+		}
+	}
+	return (&window[(size_t)(num - window_first) << blockbits]);
+}
+
 /*
  *		Read blocks in a circular buffer
  *
@@ -316,6 +374,7 @@ struct ATTR *getattrentry(unsigned int key, unsigned int lth)
 static const struct BUFFER *read_buffer(CONTEXT *ctx, unsigned int num)
 {
 	struct BUFFER *buffer;
+	const char *raw;
 	BOOL got;
 
 		/*
@@ -349,7 +408,12 @@ static const struct BUFFER *read_buffer(CONTEXT *ctx, unsigned int num)
 	}
 	if (buffer && (buffer->num != num)) {
 		buffer->num = num;
-		if (ctx->vol)
+		raw = (num >= BASEBLKS ? read_window(ctx, num)
+					: (const char*)NULL);
+		if (raw) {
+			memcpy(buffer->block.data, raw, blocksz);
+			got = TRUE;
+		} else if (ctx->vol)
 			got = (ntfs_attr_pread(log_na,(u64)num << blockbits,
                 		blocksz, buffer->block.data) == blocksz);
 		else
@@ -4117,6 +4181,8 @@ int main(int argc, char *argv[])
 			attrtable = (struct ATTR**)NULL;
 			for (i=0; i<(BUFFERCNT + BASEBLKS); i++)
 				buffer_table[i] = (struct BUFFER*)NULL;
+			window = (char*)NULL;
+			window_count = 0;
 			ntfs_log_set_handler(ntfs_log_handler_outerr);
 			if (open_volume(&ctx, argv[argc - 1])) {
 				if (!ctx.vol
@@ -4143,6 +4209,7 @@ int main(int argc, char *argv[])
 							argv[argc - 1]);
 			for (i=0; i<(BUFFERCNT + BASEBLKS); i++)
 				free(buffer_table[i]);
+			free(window);
 			for (i=0; i<attrcount; i++)
 				free(attrtable[i]);
 			free(attrtable);
@@ -0,0 +1,308 @@
+/**
+ * ntfsreindex - Part of the Linux-NTFS project.
+ *
+ * This utility rebuilds the indexes of directories into fully filled
+ * index blocks, freeing the blocks left nearly empty by deletions,
+ * either on an unmounted device, or through an ntfs-3g mount
+ * (lowntfs-3g only).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_SYS_IOCTL_H
+#include <sys/ioctl.h>
+#endif
+
+#include "types.h"
+#include "volume.h"
+#include "inode.h"
+#include "dir.h"
+#include "index.h"
+#include "ioctl.h"
+#include "misc.h"
+#include "utils.h"
+
+static const char *EXEC_NAME = "ntfsreindex";
+
+static struct options {
+	const char *device;	/* device, unless mounted */
+	char **paths;		/* directories to rebuild */
+	int path_count;
+	int mounted;		/* paths are within an ntfs-3g mount */
+	int count;		/* only count the index blocks */
+	int force;		/* override the safety checks */
+} opts;
+
+/**
+ * version - Print version information about the program
+ *
+ * Print a copyright statement and a brief description of the program.
+ *
+ * Return:  none
+ */
+static void version(void)
+{
+	ntfs_log_info("\n%s v%s (libntfs-3g) - Rebuild directory indexes.\n\n",
+			EXEC_NAME, VERSION);
+	ntfs_log_info("\n%s\n%s%s\n", ntfs_gpl, ntfs_bugs, ntfs_home);
+}
+
+/**
+ * usage - Print a list of the parameters to the program
+ *
+ * Print a list of the parameters and options for the program.
+ *
+ * Return:  none
+ */
+static void usage(void)
+{
+	ntfs_log_info("\nUsage: %s [options] device path...\n"
+		"       %s [options] -m path...\n\n"
+		"    -m, --mounted              Paths are within an ntfs-3g mount\n"
+		"    -n, --count                Only count the index blocks\n"
+		"    -f, --force                Use less caution\n"
+		"    -h, --help                 Print this help\n"
+		"    -V, --version              Version information\n\n",
+		EXEC_NAME, EXEC_NAME);
+	ntfs_log_info("%s%s\n", ntfs_bugs, ntfs_home);
+}
+
+/**
+ * parse_options - Read and validate the programs command line
+ *
+ * Read the command line, verify the syntax and parse the options.
+ *
+ * Return:   0 Success, and nothing more to do
+ *	    -1 Success, proceed
+ *	     1 Error, one or more problems
+ */
+static int parse_options(int argc, char **argv)
+{
+	static const char *sopt = "-fmnh?V";
+	static const struct option lopt[] = {
+		{ "count",	 no_argument,		NULL, 'n' },
+		{ "force",	 no_argument,		NULL, 'f' },
+		{ "mounted",	 no_argument,		NULL, 'm' },
+		{ "help",	 no_argument,		NULL, 'h' },
+		{ "version",	 no_argument,		NULL, 'V' },
+		{ NULL,		 0,			NULL, 0   }
+	};
+
+	int c = -1;
+	int err  = 0;
+	int ver  = 0;
+	int help = 0;
+
+	opterr = 0; /* We'll handle the errors, thank you. */
+
+	opts.paths = (char**)ntfs_malloc(argc*sizeof(char*));
+	if (!opts.paths)
+		return (1);
+	while ((c = getopt_long(argc, argv, sopt, lopt, NULL)) != -1) {
+		switch (c) {
+		case 1:	/* A non-option argument */
+			opts.paths[opts.path_count++] = argv[optind - 1];
+			break;
+		case 'f':
+			opts.force++;
+			break;
+		case 'm':
+			opts.mounted++;
+			break;
+		case 'n':
+			opts.count++;
+			break;
+		case 'h':
+			help++;
+			break;
+		case 'V':
+			ver++;
+			break;
+		case '?':
+		default:
+			ntfs_log_error("Unknown option '%s'.\n",
+					argv[optind - 1]);
+			err++;
+			break;
+		}
+	}
+	if (help || ver) {
+		if (ver)
+			version();
+		else
+			usage();
+		return (err ? 1 : 0);
+	}
+		/* the device comes first, when not mounted */
+	if (!opts.mounted && opts.path_count) {
+		opts.device = opts.paths[0];
+		opts.paths++;
+		opts.path_count--;
+	}
+	if (!opts.path_count) {
+		if (argc > 1)
+			ntfs_log_error("You must specify a directory.\n");
+		err++;
+	}
+	if (err) {
+		usage();
+		return (1);
+	}
+	return (-1);
+}
+
+/*
+ *		Report the index blocks of a directory
+ */
+
+static void report(const char *path, s64 before, s64 after)
+{
+	if (opts.count)
+		ntfs_log_info("%s : %lld index blocks, %lld when rebuilt\n",
+			path, (long long)before, (long long)after);
+	else
+		ntfs_log_info("%s : %lld index blocks, now %lld\n",
+			path, (long long)before, (long long)after);
+}
+
+/*
+ *		Rebuild the index of a directory on an unmounted volume
+ */
+
+static int reindex_unmounted(ntfs_volume *vol, const char *path)
+{
+	ntfs_inode *ni;
+	s64 before;
+	s64 after;
+	int res;
+
+	ni = ntfs_pathname_to_inode(vol, NULL, path);
+	if (!ni) {
+		ntfs_log_perror("Could not open %s", path);
+		return (-1);
+	}
+	res = -1;
+	if (!(ni->mrec->flags & MFT_RECORD_IS_DIRECTORY))
+		ntfs_log_error("%s : not a directory\n", path);
+	else {
+		after = ntfs_index_rebuild(ni, NTFS_INDEX_I30, 4, &before,
+				opts.count != 0);
+		if (after < 0)
+			ntfs_log_perror("Could not rebuild the index of %s",
+					path);
+		else {
+			report(path, before, after);
+			res = 0;
+		}
+	}
+	if (ntfs_inode_close(ni)) {
+		ntfs_log_perror("Could not close %s", path);
+		res = -1;
+	}
+	return (res);
+}
+
+/*
+ *		Rebuild the index of a directory through an ntfs-3g mount
+ */
+
+static int reindex_mounted(const char *path)
+{
+#ifdef NTFS_IOC_REINDEX
+	struct NTFS_REINDEX rdx;
+	int fd;
+	int res;
+
+	fd = open(path, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		ntfs_log_perror("Could not open %s", path);
+		return (-1);
+	}
+	memset(&rdx, 0, sizeof(rdx));
+	rdx.flags = (opts.count ? NTFS_REINDEX_COUNT : 0);
+	res = ioctl(fd, NTFS_IOC_REINDEX, &rdx);
+	close(fd);
+	if (res)
+		ntfs_log_perror("Could not rebuild the index of %s", path);
+	else
+		report(path, rdx.before, rdx.after);
+	return (res);
+#else /* NTFS_IOC_REINDEX */
+	ntfs_log_error("%s : rebuilding through a mount is not supported\n",
+			path);
+	return (-1);
+#endif /* NTFS_IOC_REINDEX */
+}
+
+int main(int argc, char *argv[])
+{
+	ntfs_volume *vol;
+	unsigned long flags;
+	int res;
+	int i;
+
+	ntfs_log_set_handler(ntfs_log_handler_stderr);
+
+	res = parse_options(argc, argv);
+	if (res >= 0)
+		return (res);
+
+	utils_set_locale();
+	res = 0;
+	if (opts.mounted) {
+		for (i=0; i<opts.path_count; i++)
+			if (reindex_mounted(opts.paths[i]))
+				res = 1;
+	} else {
+		flags = (opts.force ? NTFS_MNT_RECOVER : 0);
+		if (opts.count)
+			flags |= NTFS_MNT_RDONLY;
+		vol = utils_mount_volume(opts.device, flags);
+		if (!vol)
+			return (1);
+		for (i=0; i<opts.path_count; i++)
+			if (reindex_unmounted(vol, opts.paths[i]))
+				res = 1;
+		if (ntfs_umount(vol, FALSE)) {
+			ntfs_log_perror("Could not unmount %s", opts.device);
+			res = 1;
+		}
+	}
+	return (res);
+}
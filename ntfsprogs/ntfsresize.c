@@ -58,6 +58,9 @@
 #ifdef HAVE_FCNTL_H
 #include <fcntl.h>
 #endif
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
 
 #include "debug.h"
 #include "types.h"
@@ -68,6 +71,7 @@
 #include "attrib.h"
 #include "volume.h"
 #include "mft.h"
+#include "mst.h"
 #include "bitmap.h"
 #include "inode.h"
 #include "runlist.h"
@@ -176,6 +180,13 @@ struct llcn_t {
 
 #define NTFSCK_PROGBAR		0x0001
 
+			/* clusters to be moved before updating the runlists */
+struct RELOCATION {
+	s64 src;
+	s64 dest;
+	s64 length;
+} ;
+
 			/* runlists which have to be processed later */
 struct DELAYED {
 	struct DELAYED *next;
@@ -197,6 +208,9 @@ typedef struct {
 	int show_outsider;	     /* controls showing the above information */
 	int flags;
 	struct bitmap lcn_bitmap;
+#ifdef ENABLE_THREADS
+	pthread_mutex_t lock;	     /* protects the above when scanning */
+#endif
 } ntfsck_t;
 
 typedef struct {
@@ -216,6 +230,11 @@ typedef struct {
 	VCN mft_highest_vcn;	     /* used for relocating the $MFT */
 	runlist_element *new_mft_start; /* new first run for $MFT:$DATA */
 	struct DELAYED *delayed_runlists; /* runlists to process later */
+	struct RELOCATION *plan;     /* clusters moved, in order of planning */
+	s64 plan_count;
+	s64 plan_size;
+	s64 plan_next;		     /* next move to be checked */
+	int planning;		     /* only collecting the moves */
 	struct progress_bar progress;
 	struct bitmap lcn_bitmap;
 	/* Temporary statistics until all case is supported */
@@ -226,11 +245,15 @@ typedef struct {
 	struct llcn_t last_compressed;
 	struct llcn_t last_lcn;
 	s64 last_unsupp;	     /* last unsupported cluster */
+#ifdef ENABLE_THREADS
+	pthread_mutex_t lock;	     /* protects the above when scanning */
+#endif
 } ntfs_resize_t;
 
-/* FIXME: This, lcn_bitmap and pos from find_free_cluster() will make a cluster
+/* FIXME: This, lcn_bitmap and free_cluster_pos will make a cluster
    allocation related structure, attached to ntfs_resize_t */
 static s64 max_free_cluster_range = 0;
+static s64 free_cluster_pos = 0;	/* where find_free_cluster() goes on */
 
 #define NTFS_MBYTE (1000 * 1000)
 
@@ -244,6 +267,8 @@ static s64 max_free_cluster_range = 0;
 #define DIRTY_ATTRIB		(2)
 
 #define NTFS_MAX_CLUSTER_SIZE	(65536)
+#define RELOCATION_BUFFER_SIZE	(16*1024*1024)	/* bytes moved at once */
+#define RELOCATION_BATCH_IOS	(256)		/* extents moved at once */
 
 static s64 rounded_up_division(s64 numer, s64 denom)
 {
@@ -702,9 +727,10 @@ static s64 nr_clusters_to_bitmap_byte_size(s64 nr_clusters)
 	return bm_bsize;
 }
 
-static void collect_resize_constraints(ntfs_resize_t *resize, runlist *rl)
+static void collect_resize_constraints(ntfs_resize_t *resize, s64 inode,
+			ATTR_RECORD *a, BOOL attrlist, runlist *rl)
 {
-	s64 inode, last_lcn;
+	s64 last_lcn;
 	ATTR_FLAGS flags;
 	ATTR_TYPES atype;
 	struct llcn_t *llcn = NULL;
@@ -712,11 +738,10 @@ static void collect_resize_constraints(ntfs_resize_t *resize, runlist *rl)
 
 	last_lcn = rl->lcn + (rl->length - 1);
 
-	inode = resize->ni->mft_no;
-	flags = resize->ctx->attr->flags;
-	atype = resize->ctx->attr->type;
+	flags = a->flags;
+	atype = a->type;
 
-	if ((ret = ntfs_inode_badclus_bad(inode, resize->ctx->attr)) != 0) {
+	if ((ret = ntfs_inode_badclus_bad(inode, a)) != 0) {
 		if (ret == -1)
 			perr_exit("Bad sector list check failed");
 		return;
@@ -724,12 +749,12 @@ static void collect_resize_constraints(ntfs_resize_t *resize, runlist *rl)
 
 	if (inode == FILE_Bitmap) {
 		llcn = &resize->last_lcn;
-		if (atype == AT_DATA && NInoAttrList(resize->ni))
+		if (atype == AT_DATA && attrlist)
 		    err_exit("Highly fragmented $Bitmap isn't supported yet.");
 
 		supported = 1;
 
-	} else if (NInoAttrList(resize->ni)) {
+	} else if (attrlist) {
 		llcn = &resize->last_multi_mft;
 
 		if (inode != FILE_MFTMirr)
@@ -769,20 +794,20 @@ static void collect_resize_constraints(ntfs_resize_t *resize, runlist *rl)
 }
 
 
-static void collect_relocation_info(ntfs_resize_t *resize, runlist *rl)
+static void collect_relocation_info(ntfs_resize_t *resize, s64 inode,
+			ATTR_RECORD *a, runlist *rl)
 {
-	s64 lcn, lcn_length, start, len, inode;
+	s64 lcn, lcn_length, start, len;
 	s64 new_vol_size;	/* (last LCN on the volume) + 1 */
 
 	lcn = rl->lcn;
 	lcn_length = rl->length;
-	inode = resize->ni->mft_no;
 	new_vol_size = resize->new_volume_size;
 
 	if (lcn + lcn_length <= new_vol_size)
 		return;
 
-	if (inode == FILE_Bitmap && resize->ctx->attr->type == AT_DATA)
+	if (inode == FILE_Bitmap && a->type == AT_DATA)
 		return;
 
 	start = lcn;
@@ -807,10 +832,54 @@ static void collect_relocation_info(ntfs_resize_t *resize, runlist *rl)
 
 	printf("Relocation needed for inode %8lld attr 0x%x LCN 0x%08llx "
 			"length %6lld\n", (long long)inode,
-			(unsigned int)le32_to_cpu(resize->ctx->attr->type),
+			(unsigned int)le32_to_cpu(a->type),
 			(unsigned long long)start, (long long)len);
 }
 
+static void resize_lock(ntfs_resize_t *resize
+#ifndef ENABLE_THREADS
+			__attribute__((unused))
+#endif
+			)
+{
+#ifdef ENABLE_THREADS
+	pthread_mutex_lock(&resize->lock);
+#endif
+}
+
+static void resize_unlock(ntfs_resize_t *resize
+#ifndef ENABLE_THREADS
+			__attribute__((unused))
+#endif
+			)
+{
+#ifdef ENABLE_THREADS
+	pthread_mutex_unlock(&resize->lock);
+#endif
+}
+
+static void fsck_lock(ntfsck_t *fsck
+#ifndef ENABLE_THREADS
+			__attribute__((unused))
+#endif
+			)
+{
+#ifdef ENABLE_THREADS
+	pthread_mutex_lock(&fsck->lock);
+#endif
+}
+
+static void fsck_unlock(ntfsck_t *fsck
+#ifndef ENABLE_THREADS
+			__attribute__((unused))
+#endif
+			)
+{
+#ifdef ENABLE_THREADS
+	pthread_mutex_unlock(&fsck->lock);
+#endif
+}
+
 /**
  * build_lcn_usage_bitmap
  *
@@ -820,17 +889,13 @@ static void collect_relocation_info(ntfs_resize_t *resize, runlist *rl)
  *
  * This serves as a rudimentary "chkdsk" operation.
  */
-static void build_lcn_usage_bitmap(ntfs_volume *vol, ntfsck_t *fsck)
+static void build_lcn_usage_bitmap(ntfs_volume *vol, ntfsck_t *fsck,
+			s64 inode, ATTR_RECORD *a)
 {
-	s64 inode;
-	ATTR_RECORD *a;
 	runlist *rl;
 	int i, j;
 	struct bitmap *lcn_bitmap = &fsck->lcn_bitmap;
 
-	a = fsck->ctx->attr;
-	inode = fsck->ni->mft_no;
-
 	if (!a->non_resident)
 		return;
 
@@ -842,7 +907,7 @@ static void build_lcn_usage_bitmap(ntfs_volume *vol, ntfsck_t *fsck)
 		exit(1);
 	}
 
-
+	fsck_lock(fsck);
 	for (i = 0; rl[i].length; i++) {
 		s64 lcn = rl[i].lcn;
 		s64 lcn_length = rl[i].length;
@@ -858,6 +923,15 @@ static void build_lcn_usage_bitmap(ntfs_volume *vol, ntfsck_t *fsck)
 				 (unsigned int)le32_to_cpu(a->type),
 				 (long long)lcn, (long long)lcn_length);
 
+		/* Mark the run at once if it is inside and not referenced */
+		if ((lcn + lcn_length <= vol->nr_clusters)
+		    && (ntfs_bitmap_find_set(lcn_bitmap->bm, lcn,
+					lcn + lcn_length) < 0)) {
+			ntfs_bitmap_fill(lcn_bitmap->bm, lcn, lcn + lcn_length);
+			fsck->inuse += lcn_length;
+			continue;
+		}
+
 		for (j = 0; j < lcn_length; j++) {
 			u64 k = (u64)lcn + j;
 
@@ -885,6 +959,7 @@ static void build_lcn_usage_bitmap(ntfs_volume *vol, ntfsck_t *fsck)
 		}
 		fsck->inuse += lcn_length;
 	}
+	fsck_unlock(fsck);
 	free(rl);
 }
 
@@ -913,7 +988,8 @@ static int walk_attributes(ntfs_volume *vol, ntfsck_t *fsck)
 	while (!ntfs_attrs_walk(fsck->ctx)) {
 		if (fsck->ctx->attr->type == AT_END)
 			break;
-		build_lcn_usage_bitmap(vol, fsck);
+		build_lcn_usage_bitmap(vol, fsck, fsck->ni->mft_no,
+				fsck->ctx->attr);
 	}
 
 	ntfs_attr_put_search_ctx(fsck->ctx);
@@ -1044,18 +1120,195 @@ static int inode_close(ntfs_inode *ni)
 	return 0;
 }
 
+/*
+ * State of the parallel scan building the allocation bitmap
+ *
+ * The plain base records are processed by the scan threads. The ones
+ * which need their inode to be opened, such as those with an attribute
+ * list, are only gathered, and they are processed afterwards.
+ */
+typedef struct {
+	ntfsck_t *fsck;
+	struct progress_bar progress;
+	s64 done;		/* count of records scanned */
+	s64 *deferred;		/* records to process through their inode */
+	s64 deferred_count;
+	s64 deferred_size;
+} fsck_scan_t;
+
+/*
+ * Append an inode to a list of deferred ones, the caller has to
+ * serialize the calls.
+ */
+static int append_inode(s64 **list, s64 *count, s64 *size, s64 inode)
+{
+	s64 *deferred;
+
+	if (*count >= *size) {
+		deferred = (s64*)realloc(*list, 2*(*size + 16)*sizeof(s64));
+		if (!deferred) {
+			perr_printf("realloc");
+			return -1;
+		}
+		*list = deferred;
+		*size = 2*(*size + 16);
+	}
+	(*list)[(*count)++] = inode;
+	return 0;
+}
+
+static int defer_inode(fsck_scan_t *scan, s64 inode)
+{
+	int ret;
+
+	fsck_lock(scan->fsck);
+	ret = append_inode(&scan->deferred, &scan->deferred_count,
+				&scan->deferred_size, inode);
+	fsck_unlock(scan->fsck);
+	return ret;
+}
+
+enum { RECORD_SKIP, RECORD_PLAIN, RECORD_DEFER } ;
+
+/**
+ * classify_record
+ *
+ * Tell whether a raw MFT record can be processed by itself, and return
+ * a search context on its attributes in that case. Damaged records,
+ * records with an attribute list and records without a standard
+ * information have to be processed through ntfs_inode_open().
+ */
+static int classify_record(ntfs_volume *vol, MFT_RECORD *mrec,
+			ntfs_attr_search_ctx **pctx)
+{
+	ntfs_attr_search_ctx *ctx;
+	int kind;
+
+	*pctx = (ntfs_attr_search_ctx*)NULL;
+		/* leave the damaged records to ntfs_inode_open() */
+	if (!mrec || !ntfs_is_file_record(mrec->magic)
+	    || (le32_to_cpu(mrec->bytes_allocated) != vol->mft_record_size)
+	    || (le16_to_cpu(mrec->attrs_offset) > vol->mft_record_size))
+		return RECORD_DEFER;
+
+	if (!(mrec->flags & MFT_RECORD_IN_USE) || mrec->base_mft_record)
+		return RECORD_SKIP;
+
+	if (!(ctx = attr_get_search_ctx(NULL, mrec)))
+		return -1;
+	kind = RECORD_PLAIN;
+	if (!ntfs_attr_lookup(AT_ATTRIBUTE_LIST, AT_UNNAMED, 0,
+				CASE_SENSITIVE, 0, NULL, 0, ctx)
+	    || (errno != ENOENT))
+		kind = RECORD_DEFER;
+	else {
+		ntfs_attr_reinit_search_ctx(ctx);
+		if (ntfs_attr_lookup(AT_STANDARD_INFORMATION, AT_UNNAMED, 0,
+				CASE_SENSITIVE, 0, NULL, 0, ctx))
+			kind = RECORD_DEFER;
+		else
+			ntfs_attr_reinit_search_ctx(ctx);
+	}
+	if (kind == RECORD_PLAIN)
+		*pctx = ctx;
+	else
+		ntfs_attr_put_search_ctx(ctx);
+	return kind;
+}
+
+/**
+ * scan_record
+ *
+ * Mark in lcn_bitmap the runs of a base MFT Record which holds all its
+ * attributes, otherwise defer the record. Called concurrently by the
+ * threads scanning the MFT.
+ */
+static int scan_record(ntfs_volume *vol, s64 inode, MFT_RECORD *mrec,
+			void *arg)
+{
+	fsck_scan_t *scan = (fsck_scan_t*)arg;
+	ntfs_attr_search_ctx *ctx;
+	int ret;
+
+	fsck_lock(scan->fsck);
+	if (!opt.infombonly)
+		progress_update(&scan->progress, scan->done);
+	scan->done++;
+	fsck_unlock(scan->fsck);
+
+	ret = 0;
+	switch (classify_record(vol, mrec, &ctx)) {
+	case RECORD_PLAIN :
+		while (!ntfs_attrs_walk(ctx)) {
+			if (ctx->attr->type == AT_END)
+				break;
+			build_lcn_usage_bitmap(vol, scan->fsck,
+					inode, ctx->attr);
+		}
+		ntfs_attr_put_search_ctx(ctx);
+		break;
+	case RECORD_DEFER :
+		ret = defer_inode(scan, inode);
+		break;
+	case RECORD_SKIP :
+		break;
+	default :
+		ret = -1;
+		break;
+	}
+	return ret;
+}
+
+static int inode_compare(const void *p1, const void *p2)
+{
+	s64 i1 = *(const s64*)p1;
+	s64 i2 = *(const s64*)p2;
+
+	return (i1 < i2 ? -1 : (i1 > i2 ? 1 : 0));
+}
+
+/**
+ * walk_inode
+ *
+ * Open an inode and build up the bitmap from all its non-resident
+ * attributes, including those in extent records.
+ */
+static int walk_inode(ntfs_volume *vol, ntfsck_t *fsck, s64 inode)
+{
+	ntfs_inode *ni;
+
+	if ((ni = ntfs_inode_open(vol, (MFT_REF)inode)) == NULL) {
+		/* FIXME: continue only if it make sense, e.g.
+		   MFT record not in use based on $MFT bitmap */
+		if (errno == EIO || errno == ENOENT)
+			return 0;
+		perr_printf("Reading inode %lld failed", (long long)inode);
+		return -1;
+	}
+
+	if (!ni->mrec->base_mft_record) {
+		fsck->ni = ni;
+		if (walk_attributes(vol, fsck) != 0) {
+			inode_close(ni);
+			return -1;
+		}
+	}
+	return inode_close(ni);
+}
+
 /**
  * walk_inodes
  *
  * Read each record in the MFT, skipping the unused ones, and build up a bitmap
- * from all the non-resident attributes.
+ * from all the non-resident attributes. The records are scanned in parallel,
+ * and those which need their inode to be opened are processed afterwards.
  */
 static int build_allocation_bitmap(ntfs_volume *vol, ntfsck_t *fsck)
 {
-	s64 nr_mft_records, inode = 0;
-	ntfs_inode *ni;
-	struct progress_bar progress;
+	s64 nr_mft_records, i;
+	fsck_scan_t scan;
 	int pb_flags = 0;	/* progress bar flags */
+	int ret;
 
 	/* WARNING: don't modify the text, external tools grep for it */
         if (!opt.infombonly)
@@ -1067,105 +1320,204 @@ static int build_allocation_bitmap(ntfs_volume *vol, ntfsck_t *fsck)
 	nr_mft_records = vol->mft_na->initialized_size >>
 			vol->mft_record_size_bits;
 
-	progress_init(&progress, inode, nr_mft_records - 1, pb_flags);
-
-	for (; inode < nr_mft_records; inode++) {
-        	if (!opt.infombonly)
-			progress_update(&progress, inode);
-
-		if ((ni = ntfs_inode_open(vol, (MFT_REF)inode)) == NULL) {
-			/* FIXME: continue only if it make sense, e.g.
-			   MFT record not in use based on $MFT bitmap */
-			if (errno == EIO || errno == ENOENT)
-				continue;
-			perr_printf("Reading inode %lld failed",
-					(long long)inode);
-			return -1;
-		}
-
-		if (ni->mrec->base_mft_record)
-			goto close_inode;
+	memset(&scan, 0, sizeof(scan));
+	scan.fsck = fsck;
+	progress_init(&scan.progress, 0, nr_mft_records - 1, pb_flags);
 
-		fsck->ni = ni;
-		if (walk_attributes(vol, fsck) != 0) {
-			inode_close(ni);
-			return -1;
-		}
-close_inode:
-		if (inode_close(ni) != 0)
-			return -1;
+#ifdef ENABLE_THREADS
+	pthread_mutex_init(&fsck->lock, NULL);
+#endif
+	ret = ntfs_mft_scan_parallel(vol, 0, nr_mft_records, 0,
+				scan_record, &scan);
+	if (ret)
+		perr_printf("ntfs_mft_scan_parallel");
+
+	if (!ret && scan.deferred_count) {
+		qsort(scan.deferred, scan.deferred_count, sizeof(s64),
+				inode_compare);
+		for (i = 0; !ret && (i < scan.deferred_count); i++)
+			ret = walk_inode(vol, fsck, scan.deferred[i]);
 	}
-	return 0;
+#ifdef ENABLE_THREADS
+	pthread_mutex_destroy(&fsck->lock);
+#endif
+	free(scan.deferred);
+	return ret;
 }
 
-static void build_resize_constraints(ntfs_resize_t *resize)
+/**
+ * build_resize_constraints
+ *
+ * Collect the constraints from the runs of an attribute. The runlist is
+ * decompressed without locking, as several threads may be collecting
+ * the constraints from different MFT records.
+ */
+static void build_resize_constraints(ntfs_resize_t *resize, s64 inode,
+			ATTR_RECORD *a, BOOL attrlist)
 {
 	s64 i;
 	runlist *rl;
 
-	if (!resize->ctx->attr->non_resident)
+	if (!a->non_resident)
 		return;
 
-	if (!(rl = ntfs_mapping_pairs_decompress(resize->vol,
-						 resize->ctx->attr, NULL)))
+	if (!(rl = ntfs_mapping_pairs_decompress(resize->vol, a, NULL)))
 		perr_exit("ntfs_decompress_mapping_pairs");
 
+	resize_lock(resize);
 	for (i = 0; rl[i].length; i++) {
 		/* CHECKME: LCN_RL_NOT_MAPPED check isn't needed */
 		if (rl[i].lcn == LCN_HOLE || rl[i].lcn == LCN_RL_NOT_MAPPED)
 			continue;
 
-		collect_resize_constraints(resize, rl + i);
+		collect_resize_constraints(resize, inode, a, attrlist, rl + i);
 		if (resize->shrink)
-			collect_relocation_info(resize, rl + i);
+			collect_relocation_info(resize, inode, a, rl + i);
 	}
+	resize_unlock(resize);
 	free(rl);
 }
 
-static void resize_constraints_by_attributes(ntfs_resize_t *resize)
+static void resize_constraints_by_attributes(ntfs_resize_t *resize,
+			ntfs_inode *ni)
 {
-	if (!(resize->ctx = attr_get_search_ctx(resize->ni, NULL)))
+	ntfs_attr_search_ctx *ctx;
+
+	if (!(ctx = attr_get_search_ctx(ni, NULL)))
 		exit(1);
 
-	while (!ntfs_attrs_walk(resize->ctx)) {
-		if (resize->ctx->attr->type == AT_END)
+	while (!ntfs_attrs_walk(ctx)) {
+		if (ctx->attr->type == AT_END)
 			break;
-		build_resize_constraints(resize);
+		build_resize_constraints(resize, ni->mft_no, ctx->attr,
+					NInoAttrList(ni));
 	}
 
-	ntfs_attr_put_search_ctx(resize->ctx);
+	ntfs_attr_put_search_ctx(ctx);
 }
 
-static void set_resize_constraints(ntfs_resize_t *resize)
+/**
+ * resize_constraints_by_inode
+ *
+ * Open an inode and collect the constraints from all its attributes,
+ * including those in extent records.
+ */
+static void resize_constraints_by_inode(ntfs_resize_t *resize, s64 inode)
 {
-	s64 nr_mft_records, inode;
 	ntfs_inode *ni;
 
-        if (!opt.infombonly)
-		printf("Collecting resizing constraints ...\n");
+	ni = ntfs_inode_open(resize->vol, (MFT_REF)inode);
+	if (ni == NULL) {
+		if (errno == EIO || errno == ENOENT)
+			return;
+		perr_exit("Reading inode %lld failed", (long long)inode);
+	}
 
-	nr_mft_records = resize->vol->mft_na->initialized_size >>
-			resize->vol->mft_record_size_bits;
+	if (!ni->mrec->base_mft_record)
+		resize_constraints_by_attributes(resize, ni);
+	if (inode_close(ni) != 0)
+		exit(1);
+}
 
-	for (inode = 0; inode < nr_mft_records; inode++) {
+/*
+ * State of the scan collecting the resize constraints
+ *
+ * When the relocations are listed, the records are scanned by a single
+ * thread and all of them are processed in their order.
+ */
+typedef struct {
+	ntfs_resize_t *resize;
+	BOOL in_order;		/* process the deferred records at once */
+	s64 *deferred;		/* records to process through their inode */
+	s64 deferred_count;
+	s64 deferred_size;
+} resize_scan_t;
 
-		ni = ntfs_inode_open(resize->vol, (MFT_REF)inode);
-		if (ni == NULL) {
-			if (errno == EIO || errno == ENOENT)
-				continue;
-			perr_exit("Reading inode %lld failed",
-					(long long)inode);
+/**
+ * constrain_record
+ *
+ * Collect the constraints from a base MFT Record which holds all its
+ * attributes, otherwise defer the record. Called concurrently by the
+ * threads scanning the MFT.
+ */
+static int constrain_record(ntfs_volume *vol, s64 inode, MFT_RECORD *mrec,
+			void *arg)
+{
+	resize_scan_t *scan = (resize_scan_t*)arg;
+	ntfs_attr_search_ctx *ctx;
+	int ret;
+
+	ret = 0;
+	switch (classify_record(vol, mrec, &ctx)) {
+	case RECORD_PLAIN :
+		while (!ntfs_attrs_walk(ctx)) {
+			if (ctx->attr->type == AT_END)
+				break;
+			build_resize_constraints(scan->resize, inode,
+					ctx->attr, FALSE);
 		}
+		ntfs_attr_put_search_ctx(ctx);
+		break;
+	case RECORD_DEFER :
+		if (scan->in_order)
+			resize_constraints_by_inode(scan->resize, inode);
+		else {
+			resize_lock(scan->resize);
+			ret = append_inode(&scan->deferred,
+					&scan->deferred_count,
+					&scan->deferred_size, inode);
+			resize_unlock(scan->resize);
+		}
+		break;
+	case RECORD_SKIP :
+		break;
+	default :
+		ret = -1;
+		break;
+	}
+	return ret;
+}
 
-		if (ni->mrec->base_mft_record)
-			goto close_inode;
+/**
+ * set_resize_constraints
+ *
+ * Scan the MFT in parallel and collect the highest clusters used by
+ * each kind of attribute, and the clusters to relocate. The records
+ * which need their inode to be opened are processed afterwards.
+ */
+static void set_resize_constraints(ntfs_resize_t *resize)
+{
+	s64 nr_mft_records, i;
+	resize_scan_t scan;
 
-		resize->ni = ni;
-		resize_constraints_by_attributes(resize);
-close_inode:
-		if (inode_close(ni) != 0)
-			exit(1);
+        if (!opt.infombonly)
+		printf("Collecting resizing constraints ...\n");
+
+	nr_mft_records = resize->vol->mft_na->initialized_size >>
+			resize->vol->mft_record_size_bits;
+
+	memset(&scan, 0, sizeof(scan));
+	scan.resize = resize;
+	scan.in_order = (opt.info || opt.infombonly)
+				&& resize->new_volume_size && resize->shrink;
+#ifdef ENABLE_THREADS
+	pthread_mutex_init(&resize->lock, NULL);
+#endif
+	if (ntfs_mft_scan_parallel(resize->vol, 0, nr_mft_records,
+				(scan.in_order ? 1 : 0),
+				constrain_record, &scan))
+		perr_exit("ntfs_mft_scan_parallel");
+
+	if (scan.deferred_count) {
+		qsort(scan.deferred, scan.deferred_count, sizeof(s64),
+				inode_compare);
+		for (i = 0; i < scan.deferred_count; i++)
+			resize_constraints_by_inode(resize, scan.deferred[i]);
 	}
+#ifdef ENABLE_THREADS
+	pthread_mutex_destroy(&resize->lock);
+#endif
+	free(scan.deferred);
 }
 
 static void rl_fixup(runlist **rl)
@@ -1280,6 +1632,7 @@ static int replace_runlist(ntfs_attr *na, const runlist_element *reprl,
 		/* deallocate the old runlist and replace */
 		free(na->rl);
 		na->rl = newrl;
+		ntfs_attr_forget_runs(na);
 		r = 0;
 	}
 	return (r);
@@ -1681,8 +2034,7 @@ static int find_free_cluster(struct bitmap *bm,
 			     s64 nr_vol_clusters,
 			     int hint)
 {
-	/* FIXME: get rid of this 'static' variable */
-	static s64 pos = 0;
+	s64 pos = free_cluster_pos;
 	s64 i, items = rle->length;
 	s64 free_zone = 0;
 
@@ -1728,6 +2080,7 @@ static int find_free_cluster(struct bitmap *bm,
 	pos = rle->lcn + items;
 	if (pos == nr_vol_clusters)
 		pos = 0;
+	free_cluster_pos = pos;
 
 	set_bitmap_range(bm, rle->lcn, rle->length, 1);
 	return 0;
@@ -1877,8 +2230,180 @@ static void copy_clusters(ntfs_resize_t *resize, s64 dest, s64 src, s64 len)
 	}
 }
 
+/**
+ * plan_clusters
+ *
+ * Record a move of clusters, to be done before the runlists are updated.
+ */
+static void plan_clusters(ntfs_resize_t *r, s64 dest, s64 src, s64 len)
+{
+	struct RELOCATION *move;
+
+	if (r->plan_count >= r->plan_size) {
+		r->plan_size += 1024;
+		r->plan = (struct RELOCATION*)realloc(r->plan,
+				r->plan_size*sizeof(struct RELOCATION));
+		if (!r->plan)
+			perr_exit("realloc");
+	}
+	move = &r->plan[r->plan_count++];
+	move->src = src;
+	move->dest = dest;
+	move->length = len;
+}
+
+/**
+ * check_planned_clusters
+ *
+ * When updating the runlists after the clusters have been moved, check
+ * the allocations are the same as when the moves were planned.
+ */
+static void check_planned_clusters(ntfs_resize_t *r, s64 dest, s64 src,
+			s64 len)
+{
+	struct RELOCATION *move;
+
+	if (r->plan_next >= r->plan_count)
+		err_exit("Unplanned relocation. Please report!\n");
+	move = &r->plan[r->plan_next++];
+	if ((move->src != src) || (move->dest != dest)
+	    || (move->length != len))
+		err_exit("Relocation differs from plan at LCN 0x%llx. "
+			 "Please report!\n", (long long)src);
+}
+
+static int relocation_compare(const void *p1, const void *p2)
+{
+	const struct RELOCATION *m1 = (const struct RELOCATION*)p1;
+	const struct RELOCATION *m2 = (const struct RELOCATION*)p2;
+
+	return (m1->src < m2->src ? -1 : (m1->src > m2->src ? 1 : 0));
+}
+
+/**
+ * move_batch
+ *
+ * Read a batch of extents at once, then write them at once.
+ */
+static void move_batch(ntfs_resize_t *resize, struct ntfs_device_io *ios,
+			s64 *dests, int count)
+{
+	ntfs_volume *vol = resize->vol;
+	s64 clusters;
+	int i;
+
+	if (!NDevReadOnly(vol->dev)) {
+		if (ntfs_pread_batch(vol->dev, ios, count))
+			perr_exit("ntfs_pread_batch");
+		for (i=0; i<count; i++)
+			if (ios[i].res != ios[i].count) {
+				if (ios[i].res < 0)
+					errno = -ios[i].res;
+				else
+					errno = EIO;
+				perr_printf("Failed to read from the disk");
+				if (errno == EIO)
+					printf("%s", bad_sectors_warning_msg);
+				exit(1);
+			}
+		for (i=0; i<count; i++)
+			ios[i].pos = dests[i] << vol->cluster_size_bits;
+		if (ntfs_pwrite_batch(vol->dev, ios, count))
+			perr_exit("ntfs_pwrite_batch");
+		for (i=0; i<count; i++)
+			if (ios[i].res != ios[i].count) {
+				if (ios[i].res < 0)
+					errno = -ios[i].res;
+				else
+					errno = EIO;
+				perr_printf("Failed to write to the disk");
+				if (errno == EIO)
+					printf("%s", bad_sectors_warning_msg);
+				exit(1);
+			}
+	}
+	clusters = 0;
+	for (i=0; i<count; i++)
+		clusters += ios[i].count >> vol->cluster_size_bits;
+	resize->relocations += clusters;
+	progress_update(&resize->progress, resize->relocations);
+}
+
+/**
+ * move_planned_clusters
+ *
+ * Carry out the planned moves in the order of source clusters, the
+ * consecutive ones being merged, so that large extents are read and
+ * written at once. The destinations were free clusters, so they do not
+ * overlap any source.
+ */
+static void move_planned_clusters(ntfs_resize_t *resize)
+{
+	struct ntfs_device_io ios[RELOCATION_BATCH_IOS];
+	s64 dests[RELOCATION_BATCH_IOS];
+	struct RELOCATION *moves;
+	struct RELOCATION move;
+	ntfs_volume *vol = resize->vol;
+	char *buf;
+	s64 max_clusters;
+	s64 used;		/* clusters in the buffer */
+	s64 count;
+	s64 i, j;
+	int n;
+
+	if (!resize->plan_count)
+		return;
+	moves = (struct RELOCATION*)ntfs_malloc(resize->plan_count
+					* sizeof(struct RELOCATION));
+	buf = (char*)ntfs_malloc(RELOCATION_BUFFER_SIZE);
+	if (!moves || !buf)
+		perr_exit("ntfs_malloc");
+	memcpy(moves, resize->plan,
+			resize->plan_count*sizeof(struct RELOCATION));
+	qsort(moves, resize->plan_count, sizeof(struct RELOCATION),
+			relocation_compare);
+	max_clusters = RELOCATION_BUFFER_SIZE >> vol->cluster_size_bits;
+	used = 0;
+	n = 0;
+	i = 0;
+	while (i < resize->plan_count) {
+			/* merge the moves which go on on both sides */
+		move = moves[i++];
+		while ((i < resize->plan_count)
+		    && (moves[i].src == move.src + move.length)
+		    && (moves[i].dest == move.dest + move.length))
+			move.length += moves[i++].length;
+		for (j=0; j<move.length; j+=count) {
+			if ((used == max_clusters)
+			    || (n == RELOCATION_BATCH_IOS)) {
+				move_batch(resize, ios, dests, n);
+				used = 0;
+				n = 0;
+			}
+			count = min(move.length - j, max_clusters - used);
+			ios[n].buf = &buf[used << vol->cluster_size_bits];
+			ios[n].count = count << vol->cluster_size_bits;
+			ios[n].pos = (move.src + j) << vol->cluster_size_bits;
+			dests[n] = move.dest + j;
+			used += count;
+			n++;
+		}
+	}
+	if (n)
+		move_batch(resize, ios, dests, n);
+	free(buf);
+	free(moves);
+}
+
 static void relocate_clusters(ntfs_resize_t *r, runlist *dest_rl, s64 src_lcn)
 {
+	if (r->planning) {
+		for (; dest_rl->length; src_lcn += dest_rl->length, dest_rl++)
+			plan_clusters(r, dest_rl->lcn, src_lcn,
+					dest_rl->length);
+		return;
+	}
+
 	/* collect_shrink_constraints() ensured $MFTMir DATA is one run */
 	if (r->mref == FILE_MFTMirr && r->ctx->attr->type == AT_DATA) {
 		if (!r->mftmir_old) {
@@ -1890,7 +2415,12 @@ static void relocate_clusters(ntfs_resize_t *r, runlist *dest_rl, s64 src_lcn)
 	}
 
 	for (; dest_rl->length; src_lcn += dest_rl->length, dest_rl++)
-		copy_clusters(r, dest_rl->lcn, src_lcn, dest_rl->length);
+		if (r->plan)
+			check_planned_clusters(r, dest_rl->lcn, src_lcn,
+					dest_rl->length);
+		else
+			copy_clusters(r, dest_rl->lcn, src_lcn,
+					dest_rl->length);
 }
 
 static void rl_split_run(runlist **rl, int run, s64 pos)
@@ -2046,7 +2576,7 @@ static void relocate_attribute(ntfs_resize_t *resize)
 		relocate_run(resize, &rl, i);
 	}
 
-	if (resize->dirty_inode == DIRTY_ATTRIB) {
+	if ((resize->dirty_inode == DIRTY_ATTRIB) && !resize->planning) {
 		if (!replace_attribute_runlist(resize, rl))
 			free(rl);
 		resize->dirty_inode = DIRTY_INODE;
@@ -2187,6 +2717,7 @@ static void relocate_inode(ntfs_resize_t *resize, MFT_REF mref, int do_mftdata)
 			perr_exit("Couldn't update MFT own record");
 	} else {
 		if ((resize->dirty_inode == DIRTY_INODE)
+		   && !resize->planning
 		   && write_mft_record(vol, mref, resize->mrec)) {
 			perr_exit("Couldn't update record %llu",
 						(unsigned long long)mref);
@@ -2200,6 +2731,9 @@ static void relocate_inodes(ntfs_resize_t *resize)
 	MFT_REF mref;
 	VCN highest_vcn;
 	s64 length;
+	s64 free_range;
+	s64 free_pos;
+	u8 *bitmap;
 
 	printf("Relocating needed data ...\n");
 
@@ -2264,8 +2798,38 @@ static void relocate_inodes(ntfs_resize_t *resize)
 		}
 	}
 
+		/*
+		 * First only plan the relocations of the data, then move
+		 * the data in the order of clusters, and finally allocate
+		 * again the same clusters while updating the runlists.
+		 * The MFT data is moved afterwards, as its records are
+		 * being updated until then.
+		 */
+	bitmap = ntfs_malloc(resize->lcn_bitmap.size);
+	if (!bitmap)
+		perr_exit("ntfs_malloc failed");
+	memcpy(bitmap, resize->lcn_bitmap.bm, resize->lcn_bitmap.size);
+	free_range = max_free_cluster_range;
+	free_pos = free_cluster_pos;
+	resize->planning = 1;
+	for (mref = 0; mref < (MFT_REF)nr_mft_records; mref++)
+		relocate_inode(resize, mref, 0);
+	resize->planning = 0;
+
+	move_planned_clusters(resize);
+
+	memcpy(resize->lcn_bitmap.bm, bitmap, resize->lcn_bitmap.size);
+	free(bitmap);
+	max_free_cluster_range = free_range;
+	free_cluster_pos = free_pos;
+	resize->plan_next = 0;
 	for (mref = 0; mref < (MFT_REF)nr_mft_records; mref++)
 		relocate_inode(resize, mref, 0);
+	if (resize->plan_next != resize->plan_count)
+		err_exit("Missing planned relocation. Please report!\n");
+	free(resize->plan);
+	resize->plan = (struct RELOCATION*)NULL;
+	resize->plan_count = resize->plan_size = 0;
 
 	while (1) {
 		highest_vcn = resize->mft_highest_vcn;
@@ -2501,6 +3065,7 @@ static void truncate_bitmap_data_attr(ntfs_resize_t *resize)
 			/* switch to the new bitmap runlist */
 		free(lcnbmp_na->rl);
 		lcnbmp_na->rl = rl;
+		ntfs_attr_forget_runs(lcnbmp_na);
 	}
 }
 
@@ -3693,8 +4258,6 @@ static int copy_boot(expand_t *expand)
 	char *buf;
 	ntfs_volume *vol;
 	s64 mftmirr_lcn;
-	s64 written;
-	u32 boot_cnt;
 	u32 hidden_sectors;
 	le32 hidden_sectors_le;
 	int res;
@@ -3703,7 +4266,7 @@ static int copy_boot(expand_t *expand)
 		ntfs_log_verbose("Copying $Boot...\n");
 	vol = expand->vol;
 	res = 0;
-	buf = (char*)ntfs_malloc(vol->cluster_size);
+	buf = (char*)ntfs_malloc(expand->boot_size);
 	if (buf) {
 			/* set the new volume parameters in the bootsector */
 		bs = (NTFS_BOOT_SECTOR*)expand->bootsector;
@@ -3723,24 +4286,19 @@ static int copy_boot(expand_t *expand)
 			hidden_sectors_le = cpu_to_le32(hidden_sectors);
 			memcpy(&bs->bpb.hidden_sectors,&hidden_sectors_le,4);
 		}
-		written = 0;
-		boot_cnt = expand->boot_size >> vol->cluster_size_bits;
-		while (!res && (written < boot_cnt)) {
-			lseek_to_cluster(vol, expand->cluster_increment + written);
-			if (!read_all(vol->dev, buf, vol->cluster_size)) {
-				if (!written)
-					memcpy(buf, expand->bootsector, vol->sector_size);
-				lseek_to_cluster(vol, written);
-				if (!opt.ro_flag
-				    && write_all(vol->dev, buf, vol->cluster_size)) {
-					err_printf("Failed to write the new $Boot\n");
-					res = -1;
-				} else
-					written++;
-			} else {
-				err_printf("Failed to read the old $Boot\n");
+			/* copy all the clusters at once */
+		lseek_to_cluster(vol, expand->cluster_increment);
+		if (!read_all(vol->dev, buf, expand->boot_size)) {
+			memcpy(buf, expand->bootsector, vol->sector_size);
+			lseek_to_cluster(vol, 0);
+			if (!opt.ro_flag
+			    && write_all(vol->dev, buf, expand->boot_size)) {
+				err_printf("Failed to write the new $Boot\n");
 				res = -1;
 			}
+		} else {
+			err_printf("Failed to read the old $Boot\n");
+			res = -1;
 		}
 		free(buf);
 	} else {
@@ -4123,14 +4681,12 @@ static runlist_element *rebase_runlists_meta(expand_t *expand, s64 inum)
 }
 
 /*
- *		Rebase all runlists in an MFT record
+ *		Rebase all runlists in an MFT record which has been read
  *
- *	Read from the old $MFT, rebase the runlists,
- *	and write to the new $MFT
+ *	The record is replaced by a minimal one when not in use.
  */
 
-static int rebase_inode(expand_t *expand, const runlist_element *prl,
-		s64 inum, s64 jnum)
+static int rebase_record(expand_t *expand, s64 inum)
 {
 	MFT_RECORD *mrec;
 	runlist_element *rl;
@@ -4142,11 +4698,7 @@ static int rebase_inode(expand_t *expand, const runlist_element *prl,
 	vol = expand->vol;
 	mrec = expand->mrec;
 	if (expand->mft_bitmap[inum >> 3] & (1 << (inum & 7))) {
-		pos = (prl->lcn << vol->cluster_size_bits)
-			+ ((inum - jnum) << vol->mft_record_size_bits);
-		if ((ntfs_mst_pread(vol->dev, pos, 1,
-					vol->mft_record_size, mrec) == 1)
-		    && (mrec->flags & MFT_RECORD_IN_USE)) {
+		if (mrec->flags & MFT_RECORD_IN_USE) {
 			switch (inum) {
 			case FILE_Bitmap :
 			case FILE_Boot :
@@ -4173,16 +4725,50 @@ static int rebase_inode(expand_t *expand, const runlist_element *prl,
 			 */
 		res = minimal_record(expand,mrec);
 	}
+	if (!res && opt.verbose) {
+		pos = (expand->mft_lcn << vol->cluster_size_bits)
+			+ (inum << vol->mft_record_size_bits);
+		ntfs_log_verbose("Rebasing inode %lld cluster 0x%llx\n",
+			(long long)inum,
+			(long long)(pos >> vol->cluster_size_bits));
+	}
+	return (res);
+}
+
+/*
+ *		Rebase all runlists in an MFT record
+ *
+ *	Read from the old $MFT, rebase the runlists,
+ *	and write to the new $MFT
+ */
+
+static int rebase_inode(expand_t *expand, const runlist_element *prl,
+		s64 inum, s64 jnum)
+{
+	ntfs_volume *vol;
+	s64 pos;
+	int res;
+
+	res = 0;
+	vol = expand->vol;
+	if (expand->mft_bitmap[inum >> 3] & (1 << (inum & 7))) {
+		pos = (prl->lcn << vol->cluster_size_bits)
+			+ ((inum - jnum) << vol->mft_record_size_bits);
+		if (ntfs_mst_pread(vol->dev, pos, 1,
+				vol->mft_record_size, expand->mrec) != 1) {
+			err_printf("Could not read the $MFT entry %lld\n",
+					(long long)inum);
+			res = -1;
+		}
+	}
+	if (!res)
+		res = rebase_record(expand, inum);
 	if (!res) {
 		pos = (expand->mft_lcn << vol->cluster_size_bits)
 			+ (inum << vol->mft_record_size_bits);
-		if (opt.verbose)
-			ntfs_log_verbose("Rebasing inode %lld cluster 0x%llx\n",
-				(long long)inum,
-				(long long)(pos >> vol->cluster_size_bits));
 		if (!opt.ro_flag
 		    && (ntfs_mst_pwrite(vol->dev, pos, 1,
-				vol->mft_record_size, mrec) != 1)) {
+				vol->mft_record_size, expand->mrec) != 1)) {
 			err_printf("Could not write the $MFT entry %lld\n",
 					(long long)inum);
 			res = -1;
@@ -4191,19 +4777,83 @@ static int rebase_inode(expand_t *expand, const runlist_element *prl,
 	return (res);
 }
 
+/*
+ *		Rebase a set of consecutive MFT records
+ *
+ *	The records are read from the old $MFT and written to the new
+ *	one in a single transfer each way. Only the records in use are
+ *	deprotected, the other ones may be uninitialized. If the records
+ *	cannot be read at once, they are processed one by one, so that
+ *	only those in use have to be readable.
+ */
+
+static int rebase_records(expand_t *expand, char *buf,
+		const runlist_element *prl, s64 first, s64 count, s64 jnum)
+{
+	ntfs_volume *vol;
+	MFT_RECORD *mrec;
+	s64 inum;
+	s64 pos;
+	s64 i;
+	int res;
+
+	res = 0;
+	vol = expand->vol;
+	mrec = expand->mrec;
+	pos = (prl->lcn << vol->cluster_size_bits)
+		+ ((first - jnum) << vol->mft_record_size_bits);
+	if (ntfs_pread(vol->dev, pos, count << vol->mft_record_size_bits,
+			buf) == (count << vol->mft_record_size_bits)) {
+		for (i=0; !res && (i<count); i++) {
+			inum = first + i;
+			progress_update(expand->progress, inum);
+			expand->mrec = (MFT_RECORD*)
+				&buf[i << vol->mft_record_size_bits];
+			if (expand->mft_bitmap[inum >> 3] & (1 << (inum & 7)))
+				ntfs_mst_post_read_fixup(
+					(NTFS_RECORD*)expand->mrec,
+					vol->mft_record_size);
+			res = rebase_record(expand, inum);
+		}
+		expand->mrec = mrec;
+		pos = (expand->mft_lcn << vol->cluster_size_bits)
+			+ (first << vol->mft_record_size_bits);
+		if (!res && !opt.ro_flag
+		    && (ntfs_mst_pwrite(vol->dev, pos, count,
+				vol->mft_record_size, buf) != count)) {
+			err_printf("Could not write the $MFT entries %lld to %lld\n",
+					(long long)first,
+					(long long)(first + count - 1));
+			res = -1;
+		}
+	} else {
+		for (i=0; !res && (i<count); i++) {
+			progress_update(expand->progress, first + i);
+			res = rebase_inode(expand, prl, first + i, jnum);
+		}
+	}
+	return (res);
+}
+
 /*
  *		Rebase all runlists
  *
  *	First get the $MFT and define its location in the expanded space,
- *	then rebase the other inodes and write them to the new $MFT
+ *	then rebase the other inodes and write them to the new $MFT.
+ *	The records are processed by large sets, the new $MFT being
+ *	contiguous and the old one being generally made of few runs.
  */
 
 static int rebase_all_inodes(expand_t *expand)
 {
 	ntfs_volume *vol;
 	MFT_RECORD *mrec;
+	char *buf;
 	s64 inum;
 	s64 jnum;
+	s64 end;
+	s64 count;
+	s64 batch;
 	s64 inodecnt;
 	s64 pos;
 	s64 got;
@@ -4233,28 +4883,43 @@ static int rebase_all_inodes(expand_t *expand)
 				vol->mft_record_size, mrec) != 1)))
 			res = -1;
 		else {
+			batch = RELOCATION_BUFFER_SIZE
+					>> vol->mft_record_size_bits;
+			if (batch < 1)
+				batch = 1;
+			buf = (char*)ntfs_malloc(batch
+					<< vol->mft_record_size_bits);
+			if (!buf) {
+				err_printf("Failed to allocate memory\n");
+				res = -1;
+			}
 			for (prl=mft_rl; prl->length; prl++) { }
 			inodecnt = (prl->vcn << vol->cluster_size_bits)
 				>> vol->mft_record_size_bits;
 			progress_init(expand->progress, 0, inodecnt,
 				(opt.show_progress ? NTFS_PROGBAR : 0));
-			prl = mft_rl;
-			jnum = 0;
-			do {
-				inum++;
-				while (prl->length
-				    && ((inum << vol->mft_record_size_bits)
-					>= ((prl->vcn + prl->length)
-						<< vol->cluster_size_bits))) {
-					prl++;
-					jnum = inum;
+			inum = 1;
+			for (prl=mft_rl; !res && prl->length; prl++) {
+					/* records starting in this run */
+				jnum = ((prl->vcn << vol->cluster_size_bits)
+					+ vol->mft_record_size - 1)
+						>> vol->mft_record_size_bits;
+				end = (((prl->vcn + prl->length)
+						<< vol->cluster_size_bits)
+					+ vol->mft_record_size - 1)
+						>> vol->mft_record_size_bits;
+				while (!res && (inum < end)) {
+					count = end - inum;
+					if (count > batch)
+						count = batch;
+					res = rebase_records(expand, buf,
+						prl, inum, count, jnum);
+					inum += count;
 				}
-				progress_update(expand->progress, inum);
-				if (prl->length) {
-					res = rebase_inode(expand,
-						prl,inum,jnum);
-				}
-			} while (!res && prl->length);
+			}
+			if (!res)
+				progress_update(expand->progress, inodecnt);
+			free(buf);
 			free(mft_rl);
 		}
 	} else {
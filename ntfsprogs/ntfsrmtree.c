@@ -0,0 +1,373 @@
+/**
+ * ntfsrmtree - Part of the Linux-NTFS project.
+ *
+ * This utility deletes directory trees, in a single operation for each
+ * tree instead of one unlink per file, either on an unmounted device,
+ * or through an ntfs-3g mount (lowntfs-3g only).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_SYS_IOCTL_H
+#include <sys/ioctl.h>
+#endif
+
+#include "types.h"
+#include "volume.h"
+#include "inode.h"
+#include "dir.h"
+#include "unistr.h"
+#include "ioctl.h"
+#include "misc.h"
+#include "utils.h"
+
+static const char *EXEC_NAME = "ntfsrmtree";
+
+static struct options {
+	const char *device;	/* device, unless mounted */
+	char **paths;		/* trees to delete */
+	int path_count;
+	int mounted;		/* paths are within an ntfs-3g mount */
+	int force;		/* override the safety checks */
+	int verbose;		/* print the count for each tree */
+} opts;
+
+/**
+ * version - Print version information about the program
+ *
+ * Print a copyright statement and a brief description of the program.
+ *
+ * Return:  none
+ */
+static void version(void)
+{
+	ntfs_log_info("\n%s v%s (libntfs-3g) - Delete directory trees.\n\n",
+			EXEC_NAME, VERSION);
+	ntfs_log_info("\n%s\n%s%s\n", ntfs_gpl, ntfs_bugs, ntfs_home);
+}
+
+/**
+ * usage - Print a list of the parameters to the program
+ *
+ * Print a list of the parameters and options for the program.
+ *
+ * Return:  none
+ */
+static void usage(void)
+{
+	ntfs_log_info("\nUsage: %s [options] device path...\n"
+		"       %s [options] -m path...\n\n"
+		"    -m, --mounted              Paths are within an ntfs-3g mount\n"
+		"    -f, --force                Use less caution\n"
+		"    -v, --verbose              Print the count of deleted inodes\n"
+		"    -h, --help                 Print this help\n"
+		"    -V, --version              Version information\n\n",
+		EXEC_NAME, EXEC_NAME);
+	ntfs_log_info("%s%s\n", ntfs_bugs, ntfs_home);
+}
+
+/**
+ * parse_options - Read and validate the programs command line
+ *
+ * Read the command line, verify the syntax and parse the options.
+ *
+ * Return:   0 Success, and nothing more to do
+ *	    -1 Success, proceed
+ *	     1 Error, one or more problems
+ */
+static int parse_options(int argc, char **argv)
+{
+	static const char *sopt = "-fmvh?V";
+	static const struct option lopt[] = {
+		{ "force",	 no_argument,		NULL, 'f' },
+		{ "mounted",	 no_argument,		NULL, 'm' },
+		{ "verbose",	 no_argument,		NULL, 'v' },
+		{ "help",	 no_argument,		NULL, 'h' },
+		{ "version",	 no_argument,		NULL, 'V' },
+		{ NULL,		 0,			NULL, 0   }
+	};
+
+	int c = -1;
+	int err  = 0;
+	int ver  = 0;
+	int help = 0;
+
+	opterr = 0; /* We'll handle the errors, thank you. */
+
+	opts.paths = (char**)ntfs_malloc(argc*sizeof(char*));
+	if (!opts.paths)
+		return (1);
+	while ((c = getopt_long(argc, argv, sopt, lopt, NULL)) != -1) {
+		switch (c) {
+		case 1:	/* A non-option argument */
+			opts.paths[opts.path_count++] = argv[optind - 1];
+			break;
+		case 'f':
+			opts.force++;
+			break;
+		case 'm':
+			opts.mounted++;
+			break;
+		case 'v':
+			opts.verbose++;
+			break;
+		case 'h':
+			help++;
+			break;
+		case 'V':
+			ver++;
+			break;
+		case '?':
+		default:
+			ntfs_log_error("Unknown option '%s'.\n",
+					argv[optind - 1]);
+			err++;
+			break;
+		}
+	}
+	if (help || ver) {
+		if (ver)
+			version();
+		else
+			usage();
+		return (err ? 1 : 0);
+	}
+		/* the device comes first, when not mounted */
+	if (!opts.mounted && opts.path_count) {
+		opts.device = opts.paths[0];
+		opts.paths++;
+		opts.path_count--;
+	}
+	if (!opts.path_count) {
+		if (argc > 1)
+			ntfs_log_error("You must specify a path to delete.\n");
+		err++;
+	}
+	if (err) {
+		usage();
+		return (1);
+	}
+	return (-1);
+}
+
+/*
+ *		Split a path into its parent directory and its last name
+ *
+ *	Trailing slashes are ignored, and the path is modified.
+ *	Returns the name, or NULL if there is none.
+ */
+
+static char *split_path(char *path, const char **parent)
+{
+	char *name;
+	size_t len;
+
+	len = strlen(path);
+	while ((len > 1) && (path[len - 1] == '/'))
+		path[--len] = '\0';
+	name = strrchr(path, '/');
+	if (!name) {
+		*parent = ".";
+		name = path;
+	} else {
+		*name++ = '\0';
+		*parent = (path[0] ? path : "/");
+	}
+	if (!name[0] || !strcmp(name, ".") || !strcmp(name, ".."))
+		name = (char*)NULL;
+	return (name);
+}
+
+/*
+ *		Get the separator to print between a parent and a name
+ */
+
+static const char *separator(const char *parent)
+{
+	return (strcmp(parent, "/") ? "/" : "");
+}
+
+/*
+ *		Delete a tree, or a single file, on an unmounted volume
+ */
+
+static int delete_unmounted(ntfs_volume *vol, char *path)
+{
+	ntfs_inode *dir_ni;
+	ntfs_inode *ni;
+	ntfschar *uname;
+	const char *parent;
+	char *name;
+	u64 count;
+	int uname_len;
+	int res;
+
+	name = split_path(path, &parent);
+	if (!name || !strcmp(parent, ".")) {
+		ntfs_log_error("%s : not a full path within the volume\n",
+				path);
+		return (-1);
+	}
+	res = -1;
+	dir_ni = ntfs_pathname_to_inode(vol, NULL, parent);
+	if (!dir_ni) {
+		ntfs_log_perror("Could not open %s", parent);
+		return (-1);
+	}
+	ni = ntfs_pathname_to_inode(vol, dir_ni, name);
+	if (!ni) {
+		ntfs_log_perror("Could not open %s%s%s", parent,
+				separator(parent), name);
+		ntfs_inode_close(dir_ni);
+		return (-1);
+	}
+	count = 0;
+	if (ni->mrec->flags & MFT_RECORD_IS_DIRECTORY) {
+			/* both inodes are closed */
+		res = ntfs_delete_tree(ni, dir_ni, NULL, NULL, &count);
+		dir_ni = (ntfs_inode*)NULL;
+	} else {
+		uname = (ntfschar*)NULL;
+		uname_len = ntfs_mbstoucs(name, &uname);
+		if (uname_len < 0) {
+			ntfs_inode_close(ni);
+		} else {
+				/* ni is closed */
+			res = ntfs_delete(vol, (const char*)NULL, ni, dir_ni,
+					uname, uname_len);
+			if (!res)
+				count = 1;
+		}
+		free(uname);
+	}
+	if (res)
+		ntfs_log_perror("Could not delete %s%s%s", parent,
+				separator(parent), name);
+	else
+		if (opts.verbose)
+			ntfs_log_info("%s%s%s : %llu inodes deleted\n",
+				parent, separator(parent), name,
+				(unsigned long long)count);
+	if (dir_ni)
+		ntfs_inode_close(dir_ni);
+	return (res);
+}
+
+/*
+ *		Delete a tree, or a single file, through an ntfs-3g mount
+ */
+
+static int delete_mounted(char *path)
+{
+#ifdef NTFS_IOC_RMTREE
+	struct NTFS_RMTREE rmt;
+	const char *parent;
+	char *name;
+	int fd;
+	int res;
+
+	name = split_path(path, &parent);
+	if (!name || (strlen(name) >= NTFS_RMTREE_NAME_MAX)) {
+		ntfs_log_error("%s : bad path\n", path);
+		return (-1);
+	}
+	fd = open(parent, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		ntfs_log_perror("Could not open %s", parent);
+		return (-1);
+	}
+	memset(&rmt, 0, sizeof(rmt));
+	strcpy(rmt.name, name);
+	res = ioctl(fd, NTFS_IOC_RMTREE, &rmt);
+		/* not a directory, delete it the usual way */
+	if (res && (errno == ENOTDIR)) {
+		res = unlinkat(fd, name, 0);
+		rmt.count = 1;
+	}
+	close(fd);
+	if (res)
+		ntfs_log_perror("Could not delete %s%s%s", parent,
+				separator(parent), name);
+	else
+		if (opts.verbose)
+			ntfs_log_info("%s%s%s : %llu inodes deleted\n",
+				parent, separator(parent), name,
+				(unsigned long long)rmt.count);
+	return (res);
+#else /* NTFS_IOC_RMTREE */
+	ntfs_log_error("%s : deleting through a mount is not supported\n",
+			path);
+	return (-1);
+#endif /* NTFS_IOC_RMTREE */
+}
+
+int main(int argc, char *argv[])
+{
+	ntfs_volume *vol;
+	unsigned long flags;
+	int res;
+	int i;
+
+	ntfs_log_set_handler(ntfs_log_handler_stderr);
+
+	res = parse_options(argc, argv);
+	if (res >= 0)
+		return (res);
+
+	utils_set_locale();
+	res = 0;
+	if (opts.mounted) {
+		for (i=0; i<opts.path_count; i++)
+			if (delete_mounted(opts.paths[i]))
+				res = 1;
+	} else {
+		flags = (opts.force ? NTFS_MNT_RECOVER : 0);
+		vol = utils_mount_volume(opts.device, flags);
+		if (!vol)
+			return (1);
+		for (i=0; i<opts.path_count; i++)
+			if (delete_unmounted(vol, opts.paths[i]))
+				res = 1;
+		if (ntfs_umount(vol, FALSE)) {
+			ntfs_log_perror("Could not unmount %s", opts.device);
+			res = 1;
+		}
+	}
+	return (res);
+}
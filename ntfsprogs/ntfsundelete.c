@@ -72,6 +72,9 @@
 #ifdef HAVE_REGEX_H
 #include <regex.h>
 #endif
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
 
 #if !defined(REG_NOERROR) || (REG_NOERROR != 0)
 #define REG_NOERROR 0
@@ -1136,10 +1139,13 @@ static struct filename *rescue_name(MFT_RECORD *mft, ntfs_attr_search_ctx *ctx)
  * One of the filenames is picked (the one with the lowest numbered namespace)
  * and its locale friendly name is put in pref_name.
  *
+ * The names of the parents are not looked for, this is done afterwards
+ * by get_parent_names(), as it needs reading other MFT records.
+ *
  * Return:  n  The number of $FILENAME attributes found
  *	   -1  Error
  */
-static int get_filenames(struct ufile *file, ntfs_volume* vol)
+static int get_filenames(struct ufile *file)
 {
 	ATTR_RECORD *rec;
 	FILE_NAME_ATTR *attr;
@@ -1188,14 +1194,11 @@ static int get_filenames(struct ufile *file, ntfs_volume* vol)
 
 		name->parent_name = NULL;
 
-		if (opts.parent) {
+		if (opts.parent)
 			name->parent_mref = attr->parent_directory;
-			get_parent_name(name, vol);
-		}
 
 		if (name->name_space < space) {
 			file->pref_name = name->name;
-			file->pref_pname = name->parent_name;
 			space = name->name_space;
 		}
 
@@ -1239,6 +1242,26 @@ static int get_filenames(struct ufile *file, ntfs_volume* vol)
 	return count;
 }
 
+/**
+ * get_parent_names - Find the names of the parents of a file
+ * @file:  The file object to work with
+ * @vol:   An ntfs volume obtained from ntfs_mount
+ *
+ * The parent filename of the preferred name is put in pref_pname.
+ */
+static void get_parent_names(struct ufile *file, ntfs_volume *vol)
+{
+	struct ntfs_list_head *item;
+	struct filename *name;
+
+	ntfs_list_for_each(item, &file->name) {
+		name = ntfs_list_entry(item, struct filename, list);
+		get_parent_name(name, vol);
+		if (name->name == file->pref_name)
+			file->pref_pname = name->parent_name;
+	}
+}
+
 /**
  * get_data - Read an MFT Record's $DATA attributes
  * @file:  The file object to work with
@@ -1322,25 +1345,16 @@ static int get_data(struct ufile *file, ntfs_volume *vol)
 }
 
 /**
- * read_record - Read an MFT record into memory
+ * new_file - Create a file object for an MFT record
  * @vol:     An ntfs volume obtained from ntfs_mount
- * @record:  The record number to read
- *
- * Read the specified MFT record and gather as much information about it as
- * possible.
+ * @record:  The record number
  *
- * Return:  Pointer  A ufile object containing the results
+ * Return:  Pointer  A ufile object with room for the raw record
  *	    NULL     Error
  */
-static struct ufile * read_record(ntfs_volume *vol, long long record)
+static struct ufile *new_file(ntfs_volume *vol, long long record)
 {
-	ATTR_RECORD *attr10, *attr20, *attr90;
 	struct ufile *file;
-	ntfs_attr *mft;
-	u32 log_levels;
-
-	if (!vol)
-		return NULL;
 
 	file = calloc(1, sizeof(*file));
 	if (!file) {
@@ -1358,26 +1372,22 @@ static struct ufile * read_record(ntfs_volume *vol, long long record)
 		free_file(file);
 		return NULL;
 	}
+	return file;
+}
 
-	mft = ntfs_attr_open(vol->mft_ni, AT_DATA, AT_UNNAMED, 0);
-	if (!mft) {
-		ntfs_log_perror("ERROR: Couldn't open $MFT/$DATA");
-		free_file(file);
-		return NULL;
-	}
-
-	if (ntfs_attr_mst_pread(mft, vol->mft_record_size * record, 1, vol->mft_record_size, file->mft) < 1) {
-		ntfs_log_error("ERROR: Couldn't read MFT Record %lld.\n", record);
-		ntfs_attr_close(mft);
-		free_file(file);
-		return NULL;
-	}
-
-	ntfs_attr_close(mft);
-	mft = NULL;
+/**
+ * parse_record - Gather information from a raw MFT record
+ * @file:  The file object holding the raw record
+ * @vol:   An ntfs volume obtained from ntfs_mount
+ *
+ * Only the raw record is examined, so that several records can be parsed
+ * concurrently. The logging of errors is supposed to have been disabled
+ * by the caller, as the records are suspicious.
+ */
+static void parse_record(struct ufile *file, ntfs_volume *vol)
+{
+	ATTR_RECORD *attr10, *attr20, *attr90;
 
-	/* disable errors logging, while examining suspicious records */
-	log_levels = ntfs_log_clear_levels(NTFS_LOG_LEVEL_PERROR);
 	attr10 = find_first_attribute(AT_STANDARD_INFORMATION,	file->mft);
 	attr20 = find_first_attribute(AT_ATTRIBUTE_LIST,	file->mft);
 	attr90 = find_first_attribute(AT_INDEX_ROOT,		file->mft);
@@ -1396,12 +1406,48 @@ static struct ufile * read_record(ntfs_volume *vol, long long record)
 	if (attr90)
 		file->directory = 1;
 
-	if (get_filenames(file, vol) < 0) {
+	if (get_filenames(file) < 0) {
 		ntfs_log_error("ERROR: Couldn't get filenames.\n");
 	}
 	if (get_data(file, vol) < 0) {
 		ntfs_log_error("ERROR: Couldn't get data streams.\n");
 	}
+}
+
+/**
+ * read_record - Read an MFT record into memory
+ * @vol:     An ntfs volume obtained from ntfs_mount
+ * @record:  The record number to read
+ *
+ * Read the specified MFT record and gather as much information about it as
+ * possible.
+ *
+ * Return:  Pointer  A ufile object containing the results
+ *	    NULL     Error
+ */
+static struct ufile * read_record(ntfs_volume *vol, long long record)
+{
+	struct ufile *file;
+	u32 log_levels;
+
+	if (!vol)
+		return NULL;
+
+	file = new_file(vol, record);
+	if (!file)
+		return NULL;
+
+	if (ntfs_mft_record_read(vol, record, file->mft)) {
+		ntfs_log_error("ERROR: Couldn't read MFT Record %lld.\n", record);
+		free_file(file);
+		return NULL;
+	}
+
+	/* disable errors logging, while examining suspicious records */
+	log_levels = ntfs_log_clear_levels(NTFS_LOG_LEVEL_PERROR);
+	parse_record(file, vol);
+	if (opts.parent)
+		get_parent_names(file, vol);
 	/* restore errors logging */
 	ntfs_log_set_levels(log_levels);
 
@@ -1435,7 +1481,7 @@ static int calc_percentage(struct ufile *file, ntfs_volume *vol)
 	runlist_element *rl = NULL;
 	struct ntfs_list_head *pos;
 	struct data *data;
-	long long i, j;
+	long long i, j, k;
 	long long start, end;
 	int clusters_inuse, clusters_free;
 	int percent = 0;
@@ -1515,11 +1561,19 @@ static int calc_percentage(struct ufile *file, ntfs_volume *vol)
 			start = rl[i].lcn;
 			end   = rl[i].lcn + rl[i].length;
 
-			for (j = start; j < end; j++) {
-				if (utils_cluster_in_use(vol, j))
-					clusters_inuse++;
-				else
-					clusters_free++;
+			/* count the clusters by runs in use and free */
+			for (j = start; j < end; j = k) {
+				k = utils_cluster_next(vol, j, FALSE);
+				if ((k < j) || (k > end))
+					k = end;
+				clusters_inuse += k - j;
+				if (k < end) {
+					j = k;
+					k = utils_cluster_next(vol, j, TRUE);
+					if ((k < 0) || (k > end))
+						k = end;
+					clusters_free += k - j;
+				}
 			}
 		}
 
@@ -1906,6 +1960,319 @@ static int set_date(const char *pathname, time_t date)
 	return 1;
 }
 
+/*
+ *		Bulk recovery
+ *
+ *	When several files are undeleted, the clusters to copy are not
+ *	read file by file. The output files are created and the parts
+ *	which are not read from the device (fill bytes and holes) are
+ *	written, leaving gaps for the clusters to copy, which are recorded
+ *	as jobs. The jobs are then sorted by cluster number and the
+ *	clusters are read in a single pass by large consecutive extents,
+ *	and scattered to the output files. The truncation and the date
+ *	of the files are set when their data has been copied.
+ */
+
+#define BULK_MAX_JOBS 262144		/* jobs before the data is copied */
+#define BULK_MAX_FILES 16384		/* files before the data is copied */
+#define BULK_OPEN_FILES 64		/* output files kept open */
+#define BULK_BUFFER_SIZE (4*1024*1024)	/* bytes read at once */
+
+struct bulk_job {
+	LCN lcn;			/* first cluster to copy */
+	s64 count;			/* count of clusters */
+	s64 offset;			/* to copy to in the output file */
+	int file;			/* index of the output file */
+};
+
+struct bulk_file {
+	char *pathname;
+	time_t date;
+	s64 truncate_size;		/* negative if not to be truncated */
+	int fd;				/* negative if not open */
+	BOOL failed;
+};
+
+static struct {
+	BOOL enabled;
+	struct bulk_job *jobs;
+	s64 job_count;
+	s64 job_size;
+	struct bulk_file *files;
+	int file_count;
+	int file_size;
+	int opened[BULK_OPEN_FILES];	/* output files kept open */
+	int open_count;
+	int next_close;
+} bulk;
+
+/**
+ * bulk_add_file - Register an output file to be copied to in bulk
+ *
+ * Return:  -1  Error, failed to allocate memory
+ *	     n  Success, the index of the file
+ */
+static int bulk_add_file(const char *pathname, time_t date)
+{
+	struct bulk_file *files;
+	struct bulk_file *f;
+
+	if (bulk.file_count >= bulk.file_size) {
+		files = (struct bulk_file*)realloc(bulk.files,
+			(bulk.file_size + 1024)*sizeof(struct bulk_file));
+		if (!files)
+			return -1;
+		bulk.files = files;
+		bulk.file_size += 1024;
+	}
+	f = &bulk.files[bulk.file_count];
+	f->pathname = strdup(pathname);
+	if (!f->pathname)
+		return -1;
+	f->date = date;
+	f->truncate_size = -1;
+	f->fd = -1;
+	f->failed = FALSE;
+	return bulk.file_count++;
+}
+
+/**
+ * bulk_add_cluster - Record a cluster to be copied to an output file
+ *
+ * The cluster is appended to the last job when it extends it.
+ *
+ * Return:  0  Error, failed to allocate memory
+ *	    1  Success
+ */
+static int bulk_add_cluster(int file, LCN lcn, s64 offset, u32 cluster_size)
+{
+	struct bulk_job *jobs;
+	struct bulk_job *job;
+
+	if (bulk.job_count) {
+		job = &bulk.jobs[bulk.job_count - 1];
+		if ((job->file == file)
+		    && ((job->lcn + job->count) == lcn)
+		    && ((job->offset + job->count*cluster_size) == offset)) {
+			job->count++;
+			return 1;
+		}
+	}
+	if (bulk.job_count >= bulk.job_size) {
+		jobs = (struct bulk_job*)realloc(bulk.jobs,
+			(bulk.job_size + 4096)*sizeof(struct bulk_job));
+		if (!jobs)
+			return 0;
+		bulk.jobs = jobs;
+		bulk.job_size += 4096;
+	}
+	job = &bulk.jobs[bulk.job_count++];
+	job->lcn = lcn;
+	job->count = 1;
+	job->offset = offset;
+	job->file = file;
+	return 1;
+}
+
+/**
+ * bulk_pending - Check whether a file is waiting for its data
+ */
+static BOOL bulk_pending(const char *pathname)
+{
+	struct stat st;
+	int i;
+
+	if (stat(pathname, &st))
+		return FALSE;
+	for (i = 0; i < bulk.file_count; i++)
+		if (!strcmp(bulk.files[i].pathname, pathname))
+			return TRUE;
+	return FALSE;
+}
+
+/**
+ * bulk_open - Get a descriptor for writing to an output file
+ *
+ * Only a few output files are kept open, the least recently opened one
+ * is closed when another one has to be opened.
+ *
+ * Return:  -1  Error, failed to open the file
+ *	     n  Success, this is the file descriptor
+ */
+static int bulk_open(int file)
+{
+	struct bulk_file *f = &bulk.files[file];
+	int flags;
+
+	if (f->fd >= 0)
+		return f->fd;
+	if (bulk.open_count >= BULK_OPEN_FILES) {
+		close(bulk.files[bulk.opened[bulk.next_close]].fd);
+		bulk.files[bulk.opened[bulk.next_close]].fd = -1;
+		bulk.open_count--;
+	}
+	flags = O_WRONLY;
+#ifdef HAVE_WINDOWS_H
+	flags |= O_BINARY;
+#endif
+	f->fd = open(f->pathname, flags);
+	if (f->fd >= 0) {
+		bulk.opened[bulk.next_close] = file;
+		bulk.next_close = (bulk.next_close + 1) % BULK_OPEN_FILES;
+		bulk.open_count++;
+	}
+	return f->fd;
+}
+
+/**
+ * bulk_write - Write the data of a job, or part of it, to its file
+ */
+static void bulk_write(struct bulk_job *job, const char *buffer,
+		s64 offset, s64 length)
+{
+	struct bulk_file *f = &bulk.files[job->file];
+	ssize_t written;
+	int fd;
+
+	if (f->failed)
+		return;
+	fd = bulk_open(job->file);
+	if (fd < 0) {
+		ntfs_log_perror("Couldn't open '%s'", f->pathname);
+		f->failed = TRUE;
+		return;
+	}
+	while (length > 0) {
+		written = pwrite(fd, buffer, length, offset);
+		if (written <= 0) {
+			if ((written < 0) && (errno == EINTR))
+				continue;
+			ntfs_log_perror("Write failed to '%s'", f->pathname);
+			f->failed = TRUE;
+			return;
+		}
+		buffer += written;
+		offset += written;
+		length -= written;
+	}
+}
+
+/**
+ * bulk_read_job - Copy the data of a single job, by parts if it is large
+ */
+static void bulk_read_job(ntfs_volume *vol, struct bulk_job *job,
+		char *buffer, s64 max_clusters)
+{
+	s64 done;
+	s64 count;
+
+	for (done = 0; done < job->count; done += count) {
+		if (bulk.files[job->file].failed)
+			break;
+		count = min(job->count - done, max_clusters);
+		if (ntfs_cluster_read(vol, job->lcn + done, count, buffer)
+				< count) {
+			ntfs_log_perror("Read failed for '%s'",
+				bulk.files[job->file].pathname);
+			bulk.files[job->file].failed = TRUE;
+		} else
+			bulk_write(job, buffer,
+				job->offset + done*vol->cluster_size,
+				count*vol->cluster_size);
+	}
+}
+
+static int compare_jobs(const void *p1, const void *p2)
+{
+	const struct bulk_job *j1 = (const struct bulk_job*)p1;
+	const struct bulk_job *j2 = (const struct bulk_job*)p2;
+
+	if (j1->lcn != j2->lcn)
+		return (j1->lcn < j2->lcn ? -1 : 1);
+	if (j1->file != j2->file)
+		return (j1->file < j2->file ? -1 : 1);
+	return 0;
+}
+
+/**
+ * bulk_flush - Copy the recorded clusters to the output files
+ * @vol:  An ntfs volume obtained from ntfs_mount
+ *
+ * The jobs are sorted by cluster number, and consecutive jobs are read
+ * together, so that the device is read in a single ascending pass.
+ * When reading an extent fails, its jobs are read separately, so that
+ * only the files with unreadable clusters are not recovered.
+ */
+static void bulk_flush(ntfs_volume *vol)
+{
+	struct bulk_file *f;
+	char *buffer;
+	s64 max_clusters;
+	s64 i, j, k;
+	LCN end;
+
+	buffer = (char*)NULL;
+	max_clusters = BULK_BUFFER_SIZE/vol->cluster_size;
+	if (!max_clusters)
+		max_clusters = 1;
+	if (bulk.job_count) {
+		buffer = (char*)malloc(max_clusters*vol->cluster_size);
+		if (!buffer) {
+			ntfs_log_error("ERROR: Couldn't allocate memory in "
+					"bulk_flush()\n");
+			for (i = 0; i < bulk.file_count; i++)
+				bulk.files[i].failed = TRUE;
+		}
+		qsort(bulk.jobs, bulk.job_count, sizeof(struct bulk_job),
+				compare_jobs);
+	}
+	for (i = 0; buffer && (i < bulk.job_count); i = j) {
+		end = bulk.jobs[i].lcn + bulk.jobs[i].count;
+		for (j = i + 1; (j < bulk.job_count)
+		    && (bulk.jobs[j].lcn == end)
+		    && ((end + bulk.jobs[j].count - bulk.jobs[i].lcn)
+				<= max_clusters); j++)
+			end += bulk.jobs[j].count;
+		if ((j == (i + 1))
+		    || (ntfs_cluster_read(vol, bulk.jobs[i].lcn,
+				end - bulk.jobs[i].lcn, buffer)
+				< (end - bulk.jobs[i].lcn))) {
+			for (k = i; k < j; k++)
+				bulk_read_job(vol, &bulk.jobs[k], buffer,
+						max_clusters);
+		} else {
+			for (k = i; k < j; k++)
+				bulk_write(&bulk.jobs[k],
+					&buffer[(bulk.jobs[k].lcn
+						- bulk.jobs[i].lcn)
+						* vol->cluster_size],
+					bulk.jobs[k].offset,
+					bulk.jobs[k].count*vol->cluster_size);
+		}
+	}
+	free(buffer);
+	for (i = 0; i < bulk.file_count; i++) {
+		f = &bulk.files[i];
+		if ((f->fd >= 0) && (close(f->fd) < 0)) {
+			ntfs_log_perror("Close failed");
+		}
+		if (f->failed)
+			ntfs_log_error("ERROR: Couldn't recover all the data "
+					"of '%s'\n", f->pathname);
+		else {
+			if ((f->truncate_size >= 0)
+			    && truncate(f->pathname, (off_t)f->truncate_size))
+				ntfs_log_perror("Truncation failed");
+			set_date(f->pathname, f->date);
+		}
+		free(f->pathname);
+	}
+	bulk.job_count = 0;
+	bulk.file_count = 0;
+	bulk.open_count = 0;
+	bulk.next_close = 0;
+}
+
 /**
  * undelete_file - Recover a deleted file from an NTFS volume
  * @vol:    An ntfs volume obtained from ntfs_mount
@@ -1943,10 +2310,16 @@ static int undelete_file(ntfs_volume *vol, long long inode)
 	int result = 0;
 	char *name;
 	long long cluster_count;	/* I'll need this variable (see below). +mabs */
+	int pending;			/* index of the file in bulk recovery */
+	off_t pos;
 
 	if (!vol)
 		return 0;
 
+	if (bulk.enabled && ((bulk.job_count >= BULK_MAX_JOBS)
+			|| (bulk.file_count >= BULK_MAX_FILES)))
+		bulk_flush(vol);
+
 	/* try to get record */
 	file = read_record(vol, inode);
 	if (!file || !file->mft) {
@@ -2009,6 +2382,10 @@ static int undelete_file(ntfs_volume *vol, long long inode)
 			}
 
 		create_pathname(opts.dest, name, d->name, pathname, sizeof(pathname));
+		/* do not overwrite a file still waiting for its data */
+		if (bulk.enabled && opts.force && bulk_pending(pathname))
+			bulk_flush(vol);
+		pending = -1;
 		if (d->resident) {
 			fd = open_file(pathname);
 			if (fd < 0) {
@@ -2102,6 +2479,21 @@ static int undelete_file(ntfs_volume *vol, long long inode)
 							close(fd);
 							goto free;
 						}
+					} else if (bulk.enabled) {
+						/* leave a gap, to be filled later */
+						if (pending < 0)
+							pending = bulk_add_file(pathname,
+								file->date);
+						pos = lseek(fd, bufsize, SEEK_CUR);
+						if ((pending < 0)
+						    || (pos == (off_t)-1)
+						    || !bulk_add_cluster(pending, j,
+							pos - bufsize, bufsize)) {
+							ntfs_log_perror("Couldn't record the data to copy");
+							close(fd);
+							goto free;
+						}
+						cluster_count++;
 					} else {
 						if (ntfs_cluster_read(vol, j, 1, buffer) < 1) {
 							ntfs_log_perror("Read failed");
@@ -2119,6 +2511,14 @@ static int undelete_file(ntfs_volume *vol, long long inode)
 			}
 			ntfs_log_quiet("\n");
 
+			/* extend the file over a final gap */
+			if ((pending >= 0)
+			    && ftruncate(fd, lseek(fd, 0, SEEK_CUR))) {
+				ntfs_log_perror("Write failed");
+				close(fd);
+				goto free;
+			}
+
 			/*
 			 * The following block of code implements the --truncate option.
 			 * Its semantics are as follows:
@@ -2137,7 +2537,10 @@ static int undelete_file(ntfs_volume *vol, long long inode)
 				if (d->percent == 100 && d->size_alloc >= d->size_data &&
 					(d->size_alloc - d->size_data) <= (long long)vol->cluster_size &&
 					cluster_count * (long long)vol->cluster_size == d->size_alloc) {
-					if (ftruncate(fd, (off_t)d->size_data))
+					if (pending >= 0)
+						bulk.files[pending].truncate_size
+							= d->size_data;
+					else if (ftruncate(fd, (off_t)d->size_data))
 						ntfs_log_perror("Truncation failed");
 				} else ntfs_log_quiet("Truncation not performed because file has an "
 					"inconsistent $MFT record.\n");
@@ -2149,7 +2552,8 @@ static int undelete_file(ntfs_volume *vol, long long inode)
 			fd = -1;
 
 		}
-		set_date(pathname, file->date);
+		if (pending < 0)
+			set_date(pathname, file->date);
 		if (d->name)
 			ntfs_log_quiet("Undeleted '%s:%s' successfully.\n", file->pref_name, d->name);
 		else
@@ -2163,6 +2567,91 @@ free:
 	return result;
 }
 
+/*
+ *		Context of the scan of a chunk of MFT records
+ *
+ *	The records of a chunk are parsed concurrently by the threads of
+ *	ntfs_mft_scan_parallel(). The deleted files which pass the filters
+ *	are collected, and they are sorted afterwards, so that they are
+ *	listed and undeleted in their order by a single thread.
+ */
+
+#define SCAN_CHUNK_RECORDS 16384
+
+struct scan_chunk {
+	const u8 *bitmap;		/* MFT records in use */
+	regex_t *re;			/* for matching names, or NULL */
+	struct ufile **files;		/* deleted files found */
+	int count;
+#ifdef ENABLE_THREADS
+	pthread_mutex_t lock;
+#endif
+};
+
+/**
+ * keep_file - Check whether a deleted file passes the filters
+ */
+static BOOL keep_file(struct ufile *file, regex_t *re)
+{
+	if ((opts.since > 0) && (file->date <= opts.since))
+		return FALSE;
+	if (re && !name_match(re, file))
+		return FALSE;
+	if (opts.size_begin && (opts.size_begin > file->max_size))
+		return FALSE;
+	if (opts.size_end && (opts.size_end < file->max_size))
+		return FALSE;
+	return TRUE;
+}
+
+/**
+ * scan_record - Parse an MFT record while scanning for deleted files
+ *
+ * Called concurrently for the records of a chunk, with the logging of
+ * errors disabled.
+ */
+static int scan_record(ntfs_volume *vol, s64 mft_no, MFT_RECORD *mrec,
+		void *arg)
+{
+	struct scan_chunk *chunk = (struct scan_chunk*)arg;
+	struct ufile *file;
+
+	if (chunk->bitmap[mft_no >> 3] & (1 << (mft_no & 7)))
+		return 0;
+	if (!mrec || !ntfs_is_file_record(mrec->magic)) {
+		ntfs_log_error("Couldn't read MFT Record %lld.\n",
+				(long long)mft_no);
+		return 0;
+	}
+	file = new_file(vol, mft_no);
+	if (!file)
+		return 0;
+	memcpy(file->mft, mrec, vol->mft_record_size);
+	parse_record(file, vol);
+	if (!keep_file(file, chunk->re)) {
+		free_file(file);
+		return 0;
+	}
+#ifdef ENABLE_THREADS
+	pthread_mutex_lock(&chunk->lock);
+#endif
+	chunk->files[chunk->count++] = file;
+#ifdef ENABLE_THREADS
+	pthread_mutex_unlock(&chunk->lock);
+#endif
+	return 0;
+}
+
+static int compare_files(const void *p1, const void *p2)
+{
+	const struct ufile *f1 = *(const struct ufile* const*)p1;
+	const struct ufile *f2 = *(const struct ufile* const*)p2;
+
+	if (f1->inode != f2->inode)
+		return (f1->inode < f2->inode ? -1 : 1);
+	return 0;
+}
+
 /**
  * scan_disk - Search an NTFS volume for files that could be undeleted
  * @vol:  An ntfs volume obtained from ntfs_mount
@@ -2170,6 +2659,10 @@ free:
  * Read through all the MFT entries looking for deleted files.  For each one
  * determine how much of the data lies in unused disk space.
  *
+ * The MFT is scanned by chunks, the records of a chunk being read by large
+ * transfers and parsed by several threads. The deleted files found in a
+ * chunk are then processed in their order.
+ *
  * The list can be filtered by name, size and date, using command line options.
  *
  * Return:  -1  Error, something went wrong
@@ -2178,16 +2671,17 @@ free:
 static int scan_disk(ntfs_volume *vol)
 {
 	s64 nr_mft_records;
-	const int BUFSIZE = 8192;
-	char *buffer = NULL;
+	u8 *bitmap = NULL;
 	int results = 0;
 	ntfs_attr *attr;
 	long long size;
 	long long bmpsize;
-	long long i;
-	int j, k, b;
+	s64 first, end;
 	int percent;
+	int i;
+	u32 log_levels;
 	struct ufile *file;
+	struct scan_chunk chunk;
 	regex_t re;
 
 	if (!vol)
@@ -2201,12 +2695,22 @@ static int scan_disk(ntfs_volume *vol)
 	NVolSetNoFixupWarn(vol);
 	bmpsize = attr->initialized_size;
 
-	buffer = malloc(BUFSIZE);
-	if (!buffer) {
+	memset(&chunk, 0, sizeof(chunk));
+	bitmap = malloc(bmpsize + 1);
+	chunk.files = (struct ufile**)malloc(SCAN_CHUNK_RECORDS
+					* sizeof(struct ufile*));
+	if (!bitmap || !chunk.files) {
 		ntfs_log_error("ERROR: Couldn't allocate memory in scan_disk()\n");
 		results = -1;
 		goto out;
 	}
+	size = ntfs_attr_pread(attr, 0, bmpsize, bitmap);
+	if (size < 0) {
+		ntfs_log_perror("ERROR: Couldn't read $MFT/$BITMAP");
+		results = -1;
+		goto out;
+	}
+	chunk.bitmap = bitmap;
 
 	if (opts.match) {
 		int flags = REG_NOSUB;
@@ -2221,6 +2725,7 @@ static int scan_disk(ntfs_volume *vol)
 		re->upcase = vol->upcase;
 		re->upcase_len = vol->upcase_len;
 #endif
+		chunk.re = &re;
 	}
 
 	nr_mft_records = vol->mft_na->initialized_size >>
@@ -2228,68 +2733,71 @@ static int scan_disk(ntfs_volume *vol)
 
 	ntfs_log_quiet("Inode    Flags  %%age     Date    Time       Size  Filename\n");
 	ntfs_log_quiet("-----------------------------------------------------------------------\n");
-	for (i = 0; i < bmpsize; i += BUFSIZE) {
-		long long read_count = min((bmpsize - i), BUFSIZE);
-		size = ntfs_attr_pread(attr, i, read_count, buffer);
-		if (size < 0)
+	nr_mft_records = min(nr_mft_records, size*8);
+#ifdef ENABLE_THREADS
+	pthread_mutex_init(&chunk.lock, NULL);
+#endif
+	for (first = 0; first < nr_mft_records; first = end) {
+		end = min(first + SCAN_CHUNK_RECORDS, nr_mft_records);
+		chunk.count = 0;
+		/* disable errors logging, while examining suspicious records */
+		log_levels = ntfs_log_clear_levels(NTFS_LOG_LEVEL_PERROR);
+		if (ntfs_mft_scan_parallel(vol, first, end, 0,
+				scan_record, &chunk)) {
+			ntfs_log_set_levels(log_levels);
+			ntfs_log_perror("ERROR: Couldn't scan the MFT");
+			for (i = 0; i < chunk.count; i++)
+				free_file(chunk.files[i]);
+			results = -1;
 			break;
+		}
+		ntfs_log_set_levels(log_levels);
+		qsort(chunk.files, chunk.count, sizeof(struct ufile*),
+				compare_files);
+		for (i = 0; i < chunk.count; i++) {
+			file = chunk.files[i];
+			if (opts.parent) {
+				log_levels = ntfs_log_clear_levels(
+						NTFS_LOG_LEVEL_PERROR);
+				get_parent_names(file, vol);
+				ntfs_log_set_levels(log_levels);
+			}
 
-		for (j = 0; j < size; j++) {
-			b = buffer[j];
-			for (k = 0; k < 8; k++, b>>=1) {
-				if (((i+j)*8+k) >= nr_mft_records)
-					goto done;
-				if (b & 1)
-					continue;
-				file = read_record(vol, (i+j)*8+k);
-				if (!file) {
-					ntfs_log_error("Couldn't read MFT Record %lld.\n",
-							(long long)(i+j)*8+k);
-					continue;
-				}
-
-				if ((opts.since > 0) && (file->date <= opts.since))
-					goto skip;
-				if (opts.match && !name_match(&re, file))
-					goto skip;
-				if (opts.size_begin && (opts.size_begin > file->max_size))
-					goto skip;
-				if (opts.size_end && (opts.size_end < file->max_size))
-					goto skip;
-
-				percent = calc_percentage(file, vol);
-				if ((opts.percent == -1) || (percent >= opts.percent)) {
-					if (opts.verbose)
-						dump_record(file);
-					else
-						list_record(file);
-
-					/* Was -u specified with no inode
-					   so undelete file by regex */
-					if (opts.mode == MODE_UNDELETE) {
-						if  (!undelete_file(vol, file->inode))
-							ntfs_log_verbose("ERROR: Failed to undelete "
-								  "inode %lli\n!",
-								  file->inode);
-						ntfs_log_info("\n");
-					}
-				}
-				if (((opts.percent == -1) && (percent > 0)) ||
-				    ((opts.percent > 0)  && (percent >= opts.percent))) {
-					results++;
+			percent = calc_percentage(file, vol);
+			if ((opts.percent == -1) || (percent >= opts.percent)) {
+				if (opts.verbose)
+					dump_record(file);
+				else
+					list_record(file);
+
+				/* Was -u specified with no inode
+				   so undelete file by regex */
+				if (opts.mode == MODE_UNDELETE) {
+					if  (!undelete_file(vol, file->inode))
+						ntfs_log_verbose("ERROR: Failed to undelete "
+							  "inode %lli\n!",
+							  file->inode);
+					ntfs_log_info("\n");
 				}
-skip:
-				free_file(file);
 			}
+			if (((opts.percent == -1) && (percent > 0)) ||
+			    ((opts.percent > 0)  && (percent >= opts.percent))) {
+				results++;
+			}
+			free_file(file);
 		}
 	}
-done:
-	ntfs_log_quiet("\nFiles with potentially recoverable content: %d\n",
-		results);
+#ifdef ENABLE_THREADS
+	pthread_mutex_destroy(&chunk.lock);
+#endif
+	if (results >= 0)
+		ntfs_log_quiet("\nFiles with potentially recoverable content: %d\n",
+			results);
 out:
 	if (opts.match)
 		regfree(&re);
-	free(buffer);
+	free(chunk.files);
+	free(bitmap);
 	NVolClearNoFixupWarn(vol);
 	if (attr)
 		ntfs_attr_close(attr);
@@ -2404,6 +2912,7 @@ static int handle_undelete(ntfs_volume *vol)
 				"specified!\n");
 		} else {
 			avoid_duplicate_printing= 1;
+			bulk.enabled = TRUE;
 			result = !scan_disk(vol);
 			if (result)
 				ntfs_log_verbose("ERROR: Failed to scan device "
@@ -2414,6 +2923,9 @@ static int handle_undelete(ntfs_volume *vol)
 		ntfs_log_quiet("Inode    Flags  %%age  Date            Size  Filename\n");
 		ntfs_log_quiet("---------------------------------------------------------------\n");
 
+		/* recover in bulk when there are several inodes */
+		bulk.enabled = (nr_entries > 1)
+				|| (ranges[0].end > ranges[0].begin);
 		/* loop all given inodes */
 		for (i = 0; i < nr_entries; i++) {
 			for (inode = ranges[i].begin; inode <= ranges[i].end; inode ++) {
@@ -2425,6 +2937,11 @@ static int handle_undelete(ntfs_volume *vol)
 			}
 		}
 	}
+	if (bulk.enabled) {
+		bulk_flush(vol);
+		free(bulk.jobs);
+		free(bulk.files);
+	}
 	return (result);
 }
 
@@ -0,0 +1,381 @@
+/**
+ * ntfsusn - Part of the Linux-NTFS project.
+ *
+ * This utility lists the records of the change journal of a volume,
+ * from a given update sequence number, so that the files changed by
+ * Windows since a previous listing can be found without examining
+ * all of them.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+
+#include "types.h"
+#include "layout.h"
+#include "volume.h"
+#include "unistr.h"
+#include "ntfstime.h"
+#include "usnjrnl.h"
+#include "misc.h"
+#include "utils.h"
+
+static const char *EXEC_NAME = "ntfsusn";
+
+	/* count of records got at once */
+#define USN_BATCH 256
+
+static struct options {
+	const char *device;
+	s64 start;		/* first usn wanted */
+	u64 journal_id;		/* journal the start belongs to */
+	int has_journal_id;
+	int force;		/* override the safety checks */
+	int verbose;		/* print the reasons by name */
+} opts;
+
+static const struct {
+	u32 reason;
+	const char *name;
+} reason_names[] = {
+	{ const_le32_to_cpu(USN_REASON_DATA_OVERWRITE),
+			"data_overwrite" },
+	{ const_le32_to_cpu(USN_REASON_DATA_EXTEND),
+			"data_extend" },
+	{ const_le32_to_cpu(USN_REASON_DATA_TRUNCATION),
+			"data_truncation" },
+	{ const_le32_to_cpu(USN_REASON_NAMED_DATA_OVERWRITE),
+			"named_data_overwrite" },
+	{ const_le32_to_cpu(USN_REASON_NAMED_DATA_EXTEND),
+			"named_data_extend" },
+	{ const_le32_to_cpu(USN_REASON_NAMED_DATA_TRUNCATION),
+			"named_data_truncation" },
+	{ const_le32_to_cpu(USN_REASON_FILE_CREATE),
+			"file_create" },
+	{ const_le32_to_cpu(USN_REASON_FILE_DELETE),
+			"file_delete" },
+	{ const_le32_to_cpu(USN_REASON_EA_CHANGE),
+			"ea_change" },
+	{ const_le32_to_cpu(USN_REASON_SECURITY_CHANGE),
+			"security_change" },
+	{ const_le32_to_cpu(USN_REASON_RENAME_OLD_NAME),
+			"rename_old_name" },
+	{ const_le32_to_cpu(USN_REASON_RENAME_NEW_NAME),
+			"rename_new_name" },
+	{ const_le32_to_cpu(USN_REASON_INDEXABLE_CHANGE),
+			"indexable_change" },
+	{ const_le32_to_cpu(USN_REASON_BASIC_INFO_CHANGE),
+			"basic_info_change" },
+	{ const_le32_to_cpu(USN_REASON_HARD_LINK_CHANGE),
+			"hard_link_change" },
+	{ const_le32_to_cpu(USN_REASON_COMPRESSION_CHANGE),
+			"compression_change" },
+	{ const_le32_to_cpu(USN_REASON_ENCRYPTION_CHANGE),
+			"encryption_change" },
+	{ const_le32_to_cpu(USN_REASON_OBJECT_ID_CHANGE),
+			"object_id_change" },
+	{ const_le32_to_cpu(USN_REASON_REPARSE_POINT_CHANGE),
+			"reparse_point_change" },
+	{ const_le32_to_cpu(USN_REASON_STREAM_CHANGE),
+			"stream_change" },
+	{ const_le32_to_cpu(USN_REASON_TRANSACTED_CHANGE),
+			"transacted_change" },
+	{ const_le32_to_cpu(USN_REASON_INTEGRITY_CHANGE),
+			"integrity_change" },
+	{ const_le32_to_cpu(USN_REASON_CLOSE),
+			"close" },
+} ;
+
+/**
+ * version - Print version information about the program
+ *
+ * Print a copyright statement and a brief description of the program.
+ *
+ * Return:  none
+ */
+static void version(void)
+{
+	ntfs_log_info("\n%s v%s (libntfs-3g) - List the change journal.\n\n",
+			EXEC_NAME, VERSION);
+	ntfs_log_info("\n%s\n%s%s\n", ntfs_gpl, ntfs_bugs, ntfs_home);
+}
+
+/**
+ * usage - Print a list of the parameters to the program
+ *
+ * Print a list of the parameters and options for the program.
+ *
+ * Return:  none
+ */
+static void usage(void)
+{
+	ntfs_log_info("\nUsage: %s [options] device\n\n"
+		"    -s, --start USN            List from this usn\n"
+		"    -j, --journal ID           The start usn belongs to this journal\n"
+		"    -f, --force                Use less caution\n"
+		"    -v, --verbose              Print the reasons by name\n"
+		"    -h, --help                 Print this help\n"
+		"    -V, --version              Version information\n\n",
+		EXEC_NAME);
+	ntfs_log_info("%s%s\n", ntfs_bugs, ntfs_home);
+}
+
+/**
+ * parse_options - Read and validate the programs command line
+ *
+ * Read the command line, verify the syntax and parse the options.
+ *
+ * Return:   0 Success, and nothing more to do
+ *	    -1 Success, proceed
+ *	     1 Error, one or more problems
+ */
+static int parse_options(int argc, char **argv)
+{
+	static const char *sopt = "-fj:s:vh?V";
+	static const struct option lopt[] = {
+		{ "force",	 no_argument,		NULL, 'f' },
+		{ "journal",	 required_argument,	NULL, 'j' },
+		{ "start",	 required_argument,	NULL, 's' },
+		{ "verbose",	 no_argument,		NULL, 'v' },
+		{ "help",	 no_argument,		NULL, 'h' },
+		{ "version",	 no_argument,		NULL, 'V' },
+		{ NULL,		 0,			NULL, 0   }
+	};
+
+	int c = -1;
+	int err  = 0;
+	int ver  = 0;
+	int help = 0;
+	char *end;
+
+	opterr = 0; /* We'll handle the errors, thank you. */
+
+	while ((c = getopt_long(argc, argv, sopt, lopt, NULL)) != -1) {
+		switch (c) {
+		case 1:	/* A non-option argument */
+			if (!opts.device)
+				opts.device = argv[optind - 1];
+			else {
+				ntfs_log_error("You must specify exactly one "
+						"device.\n");
+				err++;
+			}
+			break;
+		case 'f':
+			opts.force++;
+			break;
+		case 'j':
+			opts.journal_id = strtoull(optarg, &end, 0);
+			if (!*optarg || (end && *end)) {
+				ntfs_log_error("Bad journal id '%s'.\n",
+						optarg);
+				err++;
+			}
+			opts.has_journal_id++;
+			break;
+		case 's':
+			opts.start = strtoll(optarg, &end, 0);
+			if (!*optarg || (end && *end) || (opts.start < 0)) {
+				ntfs_log_error("Bad usn '%s'.\n", optarg);
+				err++;
+			}
+			break;
+		case 'v':
+			opts.verbose++;
+			break;
+		case 'h':
+			help++;
+			break;
+		case 'V':
+			ver++;
+			break;
+		case '?':
+		default:
+			ntfs_log_error("Unknown option '%s'.\n",
+					argv[optind - 1]);
+			err++;
+			break;
+		}
+	}
+	if (help || ver) {
+		if (ver)
+			version();
+		else
+			usage();
+		return (err ? 1 : 0);
+	}
+	if (!opts.device) {
+		if (argc > 1)
+			ntfs_log_error("You must specify a device.\n");
+		err++;
+	}
+	if (err) {
+		usage();
+		return (1);
+	}
+	return (-1);
+}
+
+/*
+ *		Print the reasons of a change
+ */
+
+static void print_reasons(u32 reason)
+{
+	const char *sep;
+	unsigned int i;
+
+	if (!opts.verbose)
+		printf("0x%08lx", (unsigned long)reason);
+	else {
+		sep = "";
+		for (i=0; i<sizeof(reason_names)/sizeof(reason_names[0]); i++)
+			if (reason & reason_names[i].reason) {
+				printf("%s%s", sep, reason_names[i].name);
+				sep = "|";
+			}
+		if (!*sep)
+			printf("none");
+	}
+}
+
+/*
+ *		Print a change
+ *
+ *	usn inode parent-inode reasons time name
+ */
+
+static void print_change(const struct USN_CHANGE *change)
+{
+	struct timespec ts;
+	char *name;
+
+	name = (char*)NULL;
+	if (ntfs_ucstombs(change->name, change->name_len, &name, 0) < 0)
+		name = (char*)NULL;
+	ts = ntfs2timespec(cpu_to_sle64(change->timestamp));
+	printf("%lld %lld %lld ", (long long)change->usn,
+			(long long)MREF(change->mref),
+			(long long)MREF(change->parent_mref));
+	print_reasons(change->reason);
+	printf(" %lld.%09ld %s\n", (long long)ts.tv_sec, (long)ts.tv_nsec,
+			(name ? name : "?"));
+	free(name);
+}
+
+/*
+ *		List the changes from the requested usn
+ *
+ *	Returns 0 if successful, 1 if an error occurred, and 2 if the
+ *	changes since the requested usn are not all present.
+ */
+
+static int list_changes(ntfs_volume *vol)
+{
+	struct USN_JOURNAL_INFO info;
+	struct USN_CHANGE *changes;
+	struct USN_READER *reader;
+	int count;
+	int res;
+	int i;
+
+	changes = (struct USN_CHANGE*)ntfs_malloc(USN_BATCH
+				*sizeof(struct USN_CHANGE));
+	if (!changes)
+		return (1);
+	res = 0;
+	reader = ntfs_usn_open(vol, opts.start, &info);
+	if (!reader) {
+		if (errno == ENOENT)
+			ntfs_log_error("The volume has no change journal\n");
+		else
+			ntfs_log_perror("Could not open the change journal");
+		res = 1;
+	} else {
+		if (opts.has_journal_id
+		    && (opts.journal_id != info.journal_id)) {
+			ntfs_log_error("The journal has been recreated\n");
+			res = 2;
+		} else
+			if (opts.start && (opts.start < info.lowest_usn)) {
+				ntfs_log_error("The changes from usn %lld to "
+					"%lld have been discarded\n",
+					(long long)opts.start,
+					(long long)info.lowest_usn);
+				res = 2;
+			}
+		do {
+			count = ntfs_usn_read(reader, changes, USN_BATCH);
+			for (i=0; i<count; i++)
+				print_change(&changes[i]);
+		} while (count > 0);
+		if (count < 0) {
+			ntfs_log_perror("Could not read the change journal");
+			res = 1;
+		}
+		ntfs_log_info("Journal 0x%llx, next usn %lld\n",
+			(unsigned long long)info.journal_id,
+			(long long)ntfs_usn_position(reader));
+		ntfs_usn_close(reader);
+	}
+	free(changes);
+	return (res);
+}
+
+int main(int argc, char *argv[])
+{
+	ntfs_volume *vol;
+	unsigned long flags;
+	int res;
+
+	ntfs_log_set_handler(ntfs_log_handler_stderr);
+
+	res = parse_options(argc, argv);
+	if (res >= 0)
+		return (res);
+
+	utils_set_locale();
+	flags = NTFS_MNT_RDONLY | (opts.force ? NTFS_MNT_RECOVER : 0);
+	vol = utils_mount_volume(opts.device, flags);
+	if (!vol)
+		return (1);
+	res = list_changes(vol);
+	fflush(stdout);
+	if (ntfs_umount(vol, FALSE)) {
+		ntfs_log_perror("Could not unmount %s", opts.device);
+		res = 1;
+	}
+	return (res);
+}
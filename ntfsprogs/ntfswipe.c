@@ -56,6 +56,9 @@
 #ifdef HAVE_LIMITS_H
 #include <limits.h>
 #endif
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
 
 #include "ntfswipe.h"
 #include "types.h"
@@ -464,6 +467,63 @@ static int parse_options(int argc, char *argv[])
 	return (err ? 1 : (help || ver ? 0 : -1));
 }
 
+/*
+ * Size of the buffers used for wiping the unused clusters, the runs of
+ * consecutive unused clusters are written by chunks of this size.
+ */
+#define WIPE_BUFFER_SIZE (4*1024*1024)
+
+static BOOL zeroout_unsupported = FALSE;
+
+/**
+ * wipe_clusters - Overwrite a run of consecutive clusters
+ * @vol:     An ntfs volume obtained from ntfs_mount
+ * @buffer:  WIPE_BUFFER_SIZE bytes filled with @byte
+ * @byte:    Overwrite with this value
+ * @lcn:     First cluster to overwrite
+ * @count:   Number of clusters
+ *
+ * When overwriting with zeroes, the device is first asked to write the
+ * zeroes by itself, and the buffer is only used if it cannot.
+ *
+ * Return:  0  Success, the clusters were overwritten
+ *         -1  Error, something went wrong
+ */
+static int wipe_clusters(ntfs_volume *vol, const u8 *buffer, int byte,
+			s64 lcn, s64 count)
+{
+	s64 pos;
+	s64 end;
+	s64 size;
+#ifdef BLKZEROOUT
+	uint64_t range[2];
+#endif
+
+	pos = lcn << vol->cluster_size_bits;
+	end = (lcn + count) << vol->cluster_size_bits;
+#ifdef BLKZEROOUT
+	if (!byte && !zeroout_unsupported) {
+		range[0] = pos;
+		range[1] = end - pos;
+		if (!vol->dev->d_ops->ioctl(vol->dev, BLKZEROOUT, range))
+			return 0;
+		ntfs_log_verbose("Zeroing is not supported by the device, "
+				"writing the zeroes\n");
+		zeroout_unsupported = TRUE;
+	}
+#endif
+	while (pos < end) {
+		size = min(end - pos, WIPE_BUFFER_SIZE);
+		if (ntfs_pwrite(vol->dev, pos, size, buffer) != size) {
+			ntfs_log_error("Write failed at cluster %lld\n",
+				(long long)(pos >> vol->cluster_size_bits));
+			return -1;
+		}
+		pos += size;
+	}
+	return 0;
+}
+
 /**
  * wipe_unused - Wipe unused clusters
  * @vol:   An ntfs volume obtained from ntfs_mount
@@ -471,6 +531,7 @@ static int parse_options(int argc, char *argv[])
  * @act:   Wipe, test or info
  *
  * Read $Bitmap and wipe any clusters that are marked as not in use.
+ * The runs of unused clusters are overwritten by large chunks.
  *
  * Return: >0  Success, the attribute was wiped
  *          0  Nothing to wipe
@@ -478,39 +539,34 @@ static int parse_options(int argc, char *argv[])
  */
 static s64 wipe_unused(ntfs_volume *vol, int byte, enum action act)
 {
-	s64 i;
+	s64 lcn;
+	s64 end;
 	s64 total = 0;
-	s64 result = 0;
 	u8 *buffer = NULL;
 
 	if (!vol || (byte < 0))
 		return -1;
 
 	if (act != act_info) {
-		buffer = malloc(vol->cluster_size);
+		buffer = malloc(WIPE_BUFFER_SIZE);
 		if (!buffer) {
 			ntfs_log_error("malloc failed\n");
 			return -1;
 		}
-		memset(buffer, byte, vol->cluster_size);
+		memset(buffer, byte, WIPE_BUFFER_SIZE);
 	}
 
-	for (i = 0; i < vol->nr_clusters; i++) {
-		if (utils_cluster_in_use(vol, i)) {
-			//ntfs_log_verbose("cluster %lld is in use\n", i);
-			continue;
-		}
-
-		if (act == act_wipe) {
-			//ntfs_log_verbose("cluster %lld is not in use\n", i);
-			result = ntfs_pwrite(vol->dev, vol->cluster_size * i, vol->cluster_size, buffer);
-			if (result != vol->cluster_size) {
-				ntfs_log_error("write failed\n");
-				goto free;
-			}
-		}
+	for (lcn = utils_cluster_next(vol, 0, FALSE);
+	     (lcn >= 0) && (lcn < vol->nr_clusters);
+	     lcn = utils_cluster_next(vol, end, FALSE)) {
+		end = utils_cluster_next(vol, lcn, TRUE);
+		if (end < 0)
+			break;
+		if ((act == act_wipe)
+		    && wipe_clusters(vol, buffer, byte, lcn, end - lcn))
+			goto free;
 
-		total += vol->cluster_size;
+		total += (end - lcn) * vol->cluster_size;
 	}
 
 	ntfs_log_quiet("wipe_unused 0x%02x, %lld bytes\n", byte, (long long)total);
@@ -527,9 +583,10 @@ free:
  *
  * Read $Bitmap and wipe any clusters that are marked as not in use.
  *
- * - read/write on a block basis (64 clusters, arbitrary)
- * - skip of fully used block
- * - skip non-used block already wiped
+ * - only the runs of unused clusters are read and written
+ * - read by chunks of WIPE_BUFFER_SIZE bytes
+ * - skip the chunks already wiped
+ * - write the runs of clusters not wiped yet
  *
  * Return: >0  Success, the attribute was wiped
  *          0  Nothing to wipe
@@ -537,91 +594,67 @@ free:
  */
 static s64 wipe_unused_fast(ntfs_volume *vol, int byte, enum action act)
 {
-	s64 i;
+	s64 lcn;
+	s64 end;
+	s64 pos;
+	s64 count;
+	s64 max_count;
+	s64 i, j;
 	s64 total = 0;
 	s64 unused = 0;
-	s64 result;
 	u8 *buffer;
-	u8 *big_buffer;
-	u32 *u32_buffer;
-	u32 u32_bytes;
-	unsigned int blksize;
-	unsigned int j,k;
-	BOOL wipe_needed;
+	u8 *pattern;
 
 	if (!vol || (byte < 0))
 		return -1;
 
-	big_buffer = (u8*)malloc(vol->cluster_size*64);
-	if (!big_buffer) {
+	buffer = (u8*)malloc(WIPE_BUFFER_SIZE);
+	pattern = (u8*)malloc(WIPE_BUFFER_SIZE);
+	if (!buffer || !pattern) {
 		ntfs_log_error("malloc failed\n");
+		free(buffer);
+		free(pattern);
 		return -1;
 	}
-
-	for (i = 0; i < vol->nr_clusters; i+=64) {
-		blksize = vol->nr_clusters - i;
-		if (blksize > 64)
-			blksize = 64;
-	   /* if all clusters in this block are used, ignore the block */
-		result = 0;
-		for (j = 0; j < blksize; j++) {
-			if (utils_cluster_in_use(vol, i+j))
-				result++;
-		}
-		unused += (blksize - result) * vol->cluster_size;
-
-		if (result == blksize) {
-			continue;
-		}
-		/*
-		 * if all unused clusters in this block are already wiped,
-		 * ignore the block
-		 */
-		if (ntfs_pread(vol->dev, vol->cluster_size * i,
-					vol->cluster_size * blksize, big_buffer)
-				!= vol->cluster_size * blksize) {
-			ntfs_log_error("Read failed at cluster %lld\n",
-					(long long)i);
-			goto free;
-		}
-
-		result = 0;
-		wipe_needed = FALSE;
-		u32_bytes = (byte & 255)*0x01010101;
-		buffer = big_buffer;
-		for (j = 0; (j < blksize) && !wipe_needed; j++) {
-			u32_buffer = (u32*)buffer;
-			if (!utils_cluster_in_use(vol, i+j)) {
-				for (k = 0; (k < vol->cluster_size)
-					&& (*u32_buffer++ == u32_bytes); k+=4) {
-				}
-				if (k < vol->cluster_size)
-					wipe_needed = TRUE;
+	memset(pattern, byte, WIPE_BUFFER_SIZE);
+	max_count = WIPE_BUFFER_SIZE >> vol->cluster_size_bits;
+
+	for (lcn = utils_cluster_next(vol, 0, FALSE);
+	     (lcn >= 0) && (lcn < vol->nr_clusters);
+	     lcn = utils_cluster_next(vol, end, FALSE)) {
+		end = utils_cluster_next(vol, lcn, TRUE);
+		if (end < 0)
+			break;
+		unused += (end - lcn) * vol->cluster_size;
+		for (pos = lcn; pos < end; pos += count) {
+			count = min(end - pos, max_count);
+			if (ntfs_pread(vol->dev, pos << vol->cluster_size_bits,
+					count << vol->cluster_size_bits, buffer)
+				!= (count << vol->cluster_size_bits)) {
+				ntfs_log_error("Read failed at cluster %lld\n",
+						(long long)pos);
+				goto free;
 			}
-			buffer += vol->cluster_size;
-		}
-
-		if (!wipe_needed) { 
-			continue;
-		}
-			/* else wipe unused clusters in the block */
-		buffer = big_buffer;
-
-		for (j = 0; j < blksize; j++) {
-			if (!utils_cluster_in_use(vol, i+j)) {
-				memset(buffer, byte, vol->cluster_size);
-				total += vol->cluster_size;
+			/* ignore the chunks already wiped */
+			if (!memcmp(buffer, pattern,
+					count << vol->cluster_size_bits))
+				continue;
+			/* else wipe the runs of clusters not wiped yet */
+			for (i = 0; i < count; i = j) {
+				for (j = i; (j < count)
+				    && !memcmp(&buffer[j << vol->cluster_size_bits],
+						pattern, vol->cluster_size); j++) {
+				}
+				for (i = j; (j < count)
+				    && memcmp(&buffer[j << vol->cluster_size_bits],
+						pattern, vol->cluster_size); j++) {
+				}
+				if ((j > i) && (act == act_wipe)
+				    && wipe_clusters(vol, pattern, byte,
+						pos + i, j - i))
+					goto free;
+				total += (j - i) * vol->cluster_size;
 			}
-			buffer += vol->cluster_size;
-		}
-
-		if ((act == act_wipe)
-			&& (ntfs_pwrite(vol->dev, vol->cluster_size * i,
-				vol->cluster_size * blksize, big_buffer)
-					!= vol->cluster_size * blksize)) {
-			ntfs_log_error("Write failed at cluster %lld\n",
-					(long long)i);
-			goto free;
 		}
 	}
 
@@ -629,7 +662,8 @@ static s64 wipe_unused_fast(ntfs_volume *vol, int byte, enum action act)
 			" already wiped, %lld more bytes wiped\n",
 			byte, (long long)(unused - total), (long long)total);
 free:
-	free(big_buffer);
+	free(pattern);
+	free(buffer);
 	return total;
 }
 
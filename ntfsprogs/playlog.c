@@ -74,6 +74,7 @@ struct STORE {
 	struct STORE *upper;
 	struct STORE *lower;
 	LCN lcn;
+	BOOL dirty;
 	char data[1];
 } ;
 
@@ -154,6 +155,7 @@ static struct STORE *getclusterentry(LCN lcn, BOOL create)
 			newone->upper = (struct STORE*)NULL;
 			newone->lower = (struct STORE*)NULL;
 			newone->lcn = lcn;
+			newone->dirty = FALSE;
 			*current = newone;
 		}
 	}
@@ -179,6 +181,40 @@ void freeclusterentry(struct STORE *entry)
 	}
 }
 
+/*
+ *		Write the updated clusters to the device
+ *
+ *	The tree is walked in order, so that the clusters are written
+ *	in the order of their lcns. The clusters are kept in the store,
+ *	as they may be needed again by later actions.
+ *	With option -n nothing is written.
+ */
+
+static int flushclusterentry(ntfs_volume *vol, struct STORE *entry)
+{
+	int err;
+
+	err = 0;
+	if (entry) {
+		err = flushclusterentry(vol, entry->lower);
+		if (!err && entry->dirty && !optn) {
+			if (optv)
+				printf("== lcn 0x%llx to device\n",
+						(long long)entry->lcn);
+			if (ntfs_pwrite(vol->dev, entry->lcn << clusterbits,
+					clustersz, entry->data) != clustersz) {
+				printf("** Could not write cluster 0x%llx\n",
+						(long long)entry->lcn);
+				err = 1;
+			} else
+				entry->dirty = FALSE;
+		}
+		if (!err)
+			err = flushclusterentry(vol, entry->upper);
+	}
+	return (err);
+}
+
 /*
  *		Check whether an attribute type is a valid one
  */
@@ -406,7 +442,8 @@ static int sanity_indx(ntfs_volume *vol, const char *buffer)
  *		Allocate a buffer and read a full set of raw clusters
  *
  *	Do not use for accessing $LogFile.
- *	With option -n reading is first attempted from the memory store
+ *	Reading is first attempted from the memory store, which holds
+ *	the clusters updated by previous actions.
  */
 
 static char *read_raw(ntfs_volume *vol, const struct LOG_RECORD *logr)
@@ -432,17 +469,15 @@ static char *read_raw(ntfs_volume *vol, const struct LOG_RECORD *logr)
 			store = (struct STORE*)NULL;
 			lcn = le64_to_cpu(logr->lcn_list[i]);
 			target = buffer + clustersz*i;
-			if (optn) {
-				store = getclusterentry(lcn, FALSE);
-				if (store) {
-					memcpy(target, store->data, clustersz);
+			store = getclusterentry(lcn, FALSE);
+			if (store) {
+				memcpy(target, store->data, clustersz);
 				if (optv)
 					printf("== lcn 0x%llx from store\n",
 							(long long)lcn);
 				if ((optv > 1) && optc
 				    && within_lcn_range(logr))
 					dump(store->data, clustersz);
-				}
 			}
 			if (!store
 			   && (ntfs_pread(vol->dev, lcn << clusterbits,
@@ -474,11 +509,14 @@ static char *read_raw(ntfs_volume *vol, const struct LOG_RECORD *logr)
  *		Write a full set of raw clusters
  *
  *	Do not use for accessing $LogFile.
- *	With option -n a copy of the buffer is kept in memory for later use.
+ *	The clusters are only copied to the memory store, they are
+ *	written to the device when the actions have all been played,
+ *	so that a cluster updated by several actions is written once.
+ *	With option -n they are never written.
  */
 
-static int write_raw(ntfs_volume *vol, const struct LOG_RECORD *logr,
-					char *buffer)
+static int write_raw(ntfs_volume *vol __attribute__((unused)),
+			const struct LOG_RECORD *logr, char *buffer)
 {
 	int err;
 	struct STORE *store;
@@ -491,38 +529,23 @@ static int write_raw(ntfs_volume *vol, const struct LOG_RECORD *logr,
 	count = le16_to_cpu(logr->lcns_to_follow);
 	if (!count)
 		printf("** Error : no lcn to write to\n");
-	if (optn) {
-		for (i=0; (i<count) && !err; i++) {
-			lcn = le64_to_cpu(logr->lcn_list[i]);
-			source = buffer + clustersz*i;
-			store = getclusterentry(lcn, TRUE);
-			if (store) {
-				memcpy(store->data, source, clustersz);
-				if (optv)
-					printf("== lcn 0x%llx to store\n",
-							(long long)lcn);
-				if ((optv > 1) && optc
-				    && within_lcn_range(logr))
-					dump(store->data, clustersz);
-			} else {
-				printf("** Could not store cluster 0x%llx\n",
-					(long long)lcn);
-				err = 1;
-			}
-		}
-	} else {
-		for (i=0; (i<count) && !err; i++) {
-			lcn = le64_to_cpu(logr->lcn_list[i]);
+	for (i=0; (i<count) && !err; i++) {
+		lcn = le64_to_cpu(logr->lcn_list[i]);
+		source = buffer + clustersz*i;
+		store = getclusterentry(lcn, TRUE);
+		if (store) {
+			memcpy(store->data, source, clustersz);
+			store->dirty = TRUE;
 			if (optv)
-				printf("== lcn 0x%llx to device\n",
-							(long long)lcn);
-			source = buffer + clustersz*i;
-			if (ntfs_pwrite(vol->dev, lcn << clusterbits,
-        	       			clustersz, source) != clustersz) {
-				printf("** Could not write cluster 0x%llx\n",
+				printf("== lcn 0x%llx to store\n",
 						(long long)lcn);
-				err = 1;
-			}
+			if ((optv > 1) && optc
+			    && within_lcn_range(logr))
+				dump(store->data, clustersz);
+		} else {
+			printf("** Could not store cluster 0x%llx\n",
+				(long long)lcn);
+			err = 1;
 		}
 	}
 	return (err);
@@ -530,12 +553,15 @@ static int write_raw(ntfs_volume *vol, const struct LOG_RECORD *logr,
 
 /*
  *		Write a full set of raw clusters to mft_mirr
+ *
+ *	As for other clusters, the copy is only made in the memory store.
  */
 
 static int write_mirr(ntfs_volume *vol, const struct LOG_RECORD *logr,
 					char *buffer)
 {
 	int err;
+	struct STORE *store;
 	LCN lcn;
 	char *source;
 	int count;
@@ -550,9 +576,12 @@ static int write_mirr(ntfs_volume *vol, const struct LOG_RECORD *logr,
 			lcn = ntfs_attr_vcn_to_lcn(vol->mftmirr_na,
 				le32_to_cpu(logr->target_vcn) + i);
 			source = buffer + clustersz*i;
-			if ((lcn < 0)
-			    || (ntfs_pwrite(vol->dev, lcn << clusterbits,
-        	       			clustersz, source) != clustersz)) {
+			store = (lcn < 0 ? (struct STORE*)NULL
+					: getclusterentry(lcn, TRUE));
+			if (store) {
+				memcpy(store->data, source, clustersz);
+				store->dirty = TRUE;
+			} else {
 				printf("** Could not write cluster 0x%llx\n",
 						(long long)lcn);
 				err = 1;
@@ -4460,6 +4489,9 @@ int play_redos(ntfs_volume *vol, const struct ACTION_RECORD *firstaction)
 		if (!err)
 			action = action->next;
 	}
+		/* write what was done, even if some action failed */
+	if (flushclusterentry(vol, cluster_door))
+		err = 1;
 	return (err);
 }
 
@@ -4825,5 +4857,8 @@ int play_undos(ntfs_volume *vol, const struct ACTION_RECORD *lastaction)
 		if (!err)
 			action = action->prev;
 	}
+		/* write what was done, even if some action failed */
+	if (flushclusterentry(vol, cluster_door))
+		err = 1;
 	return (err);
 }
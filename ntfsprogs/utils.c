@@ -700,6 +700,126 @@ int utils_attr_get_name(ntfs_volume *vol, ATTR_RECORD *attr, char *buffer, int b
 	return 0;
 }
 
+/*
+ *		Windows on the bitmaps of a volume
+ *
+ *	The bitmaps of the clusters and of the MFT records are read in
+ *	large windows, which are kept until a bit outside of them, or on
+ *	another volume, is tested. The bits beyond the end of a bitmap
+ *	are read as set for the clusters and as clear for the records, as
+ *	if the volume was followed by used space.
+ *
+ *	The windows are not updated when the bitmaps are changed, so the
+ *	programs which allocate or free clusters or records have to call
+ *	utils_bitmaps_invalidate() after doing so.
+ */
+
+#define UTILS_BITMAP_WINDOW 1048576	/* bytes, a power of two */
+
+struct utils_bitmap {
+	ntfs_volume *vol;
+	u8 *buffer;
+	s64 first;			/* first bit in the window */
+} ;
+
+static struct utils_bitmap lcn_window = { NULL, NULL, -1 } ;
+static struct utils_bitmap mft_window = { NULL, NULL, -1 } ;
+
+/**
+ * utils_bitmaps_invalidate - Forget the bitmap windows of a volume
+ * @vol:  An ntfs volume obtained from ntfs_mount, or NULL for any volume
+ *
+ * This has to be called after clusters or MFT records have been allocated
+ * or freed.
+ */
+void utils_bitmaps_invalidate(ntfs_volume *vol)
+{
+	if (!vol || (lcn_window.vol == vol))
+		lcn_window.first = -1;
+	if (!vol || (mft_window.vol == vol))
+		mft_window.first = -1;
+}
+
+/**
+ * bitmap_window - Get the window of a bitmap which holds a bit
+ *
+ * Return:  The byte holding the bit, or NULL if an error occurred
+ */
+static const u8 *bitmap_window(struct utils_bitmap *window, ntfs_volume *vol,
+		ntfs_attr *na, s64 bit, int fill)
+{
+	s64 br;
+
+	if ((window->vol != vol) || (window->first < 0)
+	    || (bit < window->first)
+	    || (bit >= window->first + ((s64)UTILS_BITMAP_WINDOW << 3))) {
+		ntfs_log_debug("Bit lies outside window.\n");
+		if (!window->buffer) {
+			window->buffer = (u8*)ntfs_malloc(UTILS_BITMAP_WINDOW);
+			if (!window->buffer)
+				return NULL;
+		}
+		window->vol = vol;
+		window->first = -1;
+		br = ntfs_attr_pread(na,
+				(bit >> 3) & ~(s64)(UTILS_BITMAP_WINDOW - 1),
+				UTILS_BITMAP_WINDOW, window->buffer);
+		if (br < 0)
+			return NULL;
+		/* Fill the end of the window, in case the read is shorter. */
+		memset(window->buffer + br, fill, UTILS_BITMAP_WINDOW - br);
+		window->first = bit & ~(((s64)UTILS_BITMAP_WINDOW << 3) - 1);
+		ntfs_log_debug("Reloaded bitmap window.\n");
+	}
+	return (&window->buffer[(bit - window->first) >> 3]);
+}
+
+/**
+ * bitmap_next - Find the next bit in a given state
+ *
+ * Aligned 64-bit words and bytes are compared to the value which has all
+ * their bits in the unwanted state, so that long runs are skipped fast.
+ *
+ * Return:  The first bit from @bit up to @end (excluded) in the wanted
+ *	    state, @end if there is none, or -1 if an error occurred
+ */
+static s64 bitmap_next(struct utils_bitmap *window, ntfs_volume *vol,
+		ntfs_attr *na, s64 bit, s64 end, BOOL set, int fill)
+{
+	const u8 *p;
+	u8 skip8;
+	u64 skip64;
+	s64 last;
+
+	skip8 = (set ? 0 : 0xff);
+	skip64 = (set ? 0 : ~(u64)0);
+	while (bit < end) {
+		p = bitmap_window(window, vol, na, bit, fill);
+		if (!p)
+			return -1;
+		last = window->first + ((s64)UTILS_BITMAP_WINDOW << 3);
+		if (last > end)
+			last = end;
+		while (bit < last) {
+			if (!(bit & 63) && (bit + 64 <= last)
+			    && (*(const u64*)p == skip64)) {
+				bit += 64;
+				p += 8;
+			} else if (!(bit & 7) && (bit + 8 <= last)
+			    && (*p == skip8)) {
+				bit += 8;
+				p++;
+			} else {
+				if (((*p >> (bit & 7)) & 1) == (set ? 1 : 0))
+					return bit;
+				if (!(++bit & 7))
+					p++;
+			}
+		}
+	}
+	return end;
+}
+
 /**
  * utils_cluster_in_use - Determine if a cluster is in use
  * @vol:  An ntfs volume obtained from ntfs_mount
@@ -707,14 +827,7 @@ int utils_attr_get_name(ntfs_volume *vol, ATTR_RECORD *attr, char *buffer, int b
  *
  * The metadata file $Bitmap has one binary bit representing each cluster on
  * disk.  The bit will be set for each cluster that is in use.  The function
- * reads the relevant part of $Bitmap into a buffer and tests the bit.
- *
- * This function has a static buffer in which it caches a section of $Bitmap.
- * If the lcn, being tested, lies outside the range, the buffer will be
- * refreshed. @bmplcn stores offset to the first bit (in bits) stored in the
- * buffer.
- *
- * NOTE: Be very carefull with shifts by 3 everywhere in this function.
+ * reads the relevant window of $Bitmap into a buffer and tests the bit.
  *
  * Return:  1  Cluster is in use
  *	    0  Cluster is free space
@@ -722,48 +835,19 @@ int utils_attr_get_name(ntfs_volume *vol, ATTR_RECORD *attr, char *buffer, int b
  */
 int utils_cluster_in_use(ntfs_volume *vol, long long lcn)
 {
-	static unsigned char buffer[512];
-	static long long bmplcn = -(sizeof(buffer) << 3);
-	int byte, bit;
-	ntfs_attr *attr;
+	const u8 *p;
 
-	if (!vol) {
+	if (!vol || (lcn < 0)) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	/* Does lcn lie in the section of $Bitmap we already have cached? */
-	if ((lcn < bmplcn)
-	    || (lcn >= (long long)(bmplcn + (sizeof(buffer) << 3)))) {
-		ntfs_log_debug("Bit lies outside cache.\n");
-		attr = ntfs_attr_open(vol->lcnbmp_ni, AT_DATA, AT_UNNAMED, 0);
-		if (!attr) {
-			ntfs_log_perror("Couldn't open $Bitmap");
-			return -1;
-		}
-
-		/* Mark the buffer as in use, in case the read is shorter. */
-		memset(buffer, 0xFF, sizeof(buffer));
-		bmplcn = lcn & (~((sizeof(buffer) << 3) - 1));
-
-		if (ntfs_attr_pread(attr, (bmplcn >> 3), sizeof(buffer),
-					buffer) < 0) {
-			ntfs_log_perror("Couldn't read $Bitmap");
-			ntfs_attr_close(attr);
-			return -1;
-		}
-
-		ntfs_log_debug("Reloaded bitmap buffer.\n");
-		ntfs_attr_close(attr);
+	p = bitmap_window(&lcn_window, vol, vol->lcnbmp_na, lcn, 0xff);
+	if (!p) {
+		ntfs_log_perror("Couldn't read $Bitmap");
+		return -1;
 	}
-
-	bit  = 1 << (lcn & 7);
-	byte = (lcn >> 3) & (sizeof(buffer) - 1);
-	ntfs_log_debug("cluster = %lld, bmplcn = %lld, byte = %d, bit = %d, "
-			"in use %d\n", lcn, bmplcn, byte, bit, buffer[byte] &
-			bit);
-
-	return (buffer[byte] & bit);
+	return ((*p >> (lcn & 7)) & 1);
 }
 
 /**
@@ -773,11 +857,7 @@ int utils_cluster_in_use(ntfs_volume *vol, long long lcn)
  *
  * The metadata file $BITMAP has one binary bit representing each record in the
  * MFT.  The bit will be set for each record that is in use.  The function
- * reads the relevant part of $BITMAP into a buffer and tests the bit.
- *
- * This function has a static buffer in which it caches a section of $BITMAP.
- * If the mref, being tested, lies outside the range, the buffer will be
- * refreshed.
+ * reads the relevant window of $BITMAP into a buffer and tests the bit.
  *
  * Return:  1  MFT Record is in use
  *	    0  MFT Record is unused
@@ -785,9 +865,8 @@ int utils_cluster_in_use(ntfs_volume *vol, long long lcn)
  */
 int utils_mftrec_in_use(ntfs_volume *vol, MFT_REF mref)
 {
-	static u8 buffer[512];
-	static s64 bmpmref = -(sizeof(buffer) << 3) - 1; /* Which bit of $BITMAP is in the buffer */
-	int byte, bit;
+	const u8 *p;
+	s64 inum;
 
 	ntfs_log_trace("Entering.\n");
 
@@ -796,30 +875,65 @@ int utils_mftrec_in_use(ntfs_volume *vol, MFT_REF mref)
 		return -1;
 	}
 
-	/* Does mref lie in the section of $Bitmap we already have cached? */
-	if (((s64)MREF(mref) < bmpmref)
-	    || ((s64)MREF(mref) >= (s64)(bmpmref + (sizeof(buffer) << 3)))) {
-		ntfs_log_debug("Bit lies outside cache.\n");
-
-		/* Mark the buffer as not in use, in case the read is shorter. */
-		memset(buffer, 0, sizeof(buffer));
-		bmpmref = mref & (~((sizeof(buffer) << 3) - 1));
+	inum = MREF(mref);
+	p = bitmap_window(&mft_window, vol, vol->mftbmp_na, inum, 0);
+	if (!p) {
+		ntfs_log_perror("Couldn't read $MFT/$BITMAP");
+		return -1;
+	}
+	return ((*p >> (inum & 7)) & 1);
+}
 
-		if (ntfs_attr_pread(vol->mftbmp_na, (bmpmref>>3), sizeof(buffer), buffer) < 0) {
-			ntfs_log_perror("Couldn't read $MFT/$BITMAP");
-			return -1;
-		}
+/**
+ * utils_cluster_next - Find the next cluster in use or free
+ * @vol:     An ntfs volume obtained from ntfs_mount
+ * @lcn:     The first Logical Cluster Number to test
+ * @in_use:  TRUE to look for a cluster in use, FALSE for a free one
+ *
+ * Return:  The first cluster from @lcn in the wanted state, the count of
+ *	    clusters on the volume if there is none, or -1 if an error
+ *	    occurred
+ */
+s64 utils_cluster_next(ntfs_volume *vol, s64 lcn, BOOL in_use)
+{
+	s64 res;
 
-		ntfs_log_debug("Reloaded bitmap buffer.\n");
+	if (!vol || (lcn < 0)) {
+		errno = EINVAL;
+		return -1;
 	}
 
-	bit  = 1 << (mref & 7);
-	byte = (mref >> 3) & (sizeof(buffer) - 1);
-	ntfs_log_debug("cluster = %lld, bmpmref = %lld, byte = %d, bit = %d, "
-			"in use %d\n", (long long) mref, (long long) bmpmref,
-			byte, bit, buffer[byte] & bit);
+	res = bitmap_next(&lcn_window, vol, vol->lcnbmp_na, lcn,
+			vol->nr_clusters, in_use, 0xff);
+	if (res < 0)
+		ntfs_log_perror("Couldn't read $Bitmap");
+	return res;
+}
+
+/**
+ * utils_mftrec_next - Find the next MFT Record in use or unused
+ * @vol:     An ntfs volume obtained from ntfs_mount
+ * @inum:    The first inode number to test
+ * @in_use:  TRUE to look for a record in use, FALSE for an unused one
+ *
+ * Return:  The first record from @inum in the wanted state, the count of
+ *	    records in the MFT if there is none, or -1 if an error occurred
+ */
+s64 utils_mftrec_next(ntfs_volume *vol, s64 inum, BOOL in_use)
+{
+	s64 res;
+
+	if (!vol || (inum < 0)) {
+		errno = EINVAL;
+		return -1;
+	}
 
-	return (buffer[byte] & bit);
+	res = bitmap_next(&mft_window, vol, vol->mftbmp_na, inum,
+			vol->mft_na->data_size >> vol->mft_record_size_bits,
+			in_use, 0);
+	if (res < 0)
+		ntfs_log_perror("Couldn't read $MFT/$BITMAP");
+	return res;
 }
 
 /**
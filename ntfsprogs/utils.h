@@ -48,6 +48,9 @@ int utils_inode_get_name(ntfs_inode *inode, char *buffer, int bufsize);
 int utils_attr_get_name(ntfs_volume *vol, ATTR_RECORD *attr, char *buffer, int bufsize);
 int utils_cluster_in_use(ntfs_volume *vol, long long lcn);
 int utils_mftrec_in_use(ntfs_volume *vol, MFT_REF mref);
+s64 utils_cluster_next(ntfs_volume *vol, s64 lcn, BOOL in_use);
+s64 utils_mftrec_next(ntfs_volume *vol, s64 inum, BOOL in_use);
+void utils_bitmaps_invalidate(ntfs_volume *vol);
 int utils_is_metadata(ntfs_inode *inode);
 void utils_dump_mem(void *buf, int start, int length, int flags);
 
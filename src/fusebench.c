@@ -0,0 +1,840 @@
+/**
+ * ntfs-3g.bench - Measure the speed of the ntfs-3g drivers through FUSE
+ *
+ * This program mounts a scratch image with the drivers, runs file
+ * system workloads on the mount point, and prints the throughput,
+ * latency and CPU cost of each workload, so that the changes to the
+ * drivers can be compared on the same hardware.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_SYS_MOUNT_H
+#include <sys/mount.h>
+#endif
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <signal.h>
+#include <getopt.h>
+
+#include "compat.h"
+#include "volume.h"
+#include "misc.h"
+
+#define CHUNK_SIZE 1048576	/* size of sequential transfers */
+#define RANDOM_SIZE 4096	/* size of random transfers */
+#define FILES_PER_DIR 100	/* files per directory in the mkdir workload */
+#define MOUNT_WAIT 10		/* seconds to wait for the mount */
+
+static const char *EXEC_NAME = "ntfs-3g.bench";
+
+static struct options {
+	const char *image;	/* image to create */
+	const char *mkntfs;	/* program to format the image */
+	const char *drivers;	/* drivers to compare */
+	const char *mount_options; /* added to the options of the drivers */
+	const char *workloads;	/* workloads to run */
+	char *mountpoint;
+	long long size;		/* size of image */
+	long long file_size;	/* size of file for data workloads */
+	unsigned long files;	/* files in metadata workloads */
+	unsigned long random_ops; /* random transfers */
+	int keep;		/* do not delete the image */
+} opts;
+
+/*
+ *	The measures of a workload
+ */
+
+struct WORKLOAD {
+	const char *name;
+	const char *driver;
+	unsigned long count;	/* operations done */
+	unsigned long max;	/* operations which can be timed */
+	unsigned long bytes;	/* bytes per operation, if data */
+	double start;
+	double elapsed;
+	double client_cpu;	/* seconds used by this program */
+	double driver_cpu;	/* seconds used by the driver */
+	float *latencies;	/* microseconds */
+} ;
+
+static pid_t driver_pid;
+static u32 seed;
+
+static const char *usage_msg =
+"\n"
+"%s %s - Measure the speed of the ntfs-3g drivers\n"
+"\n"
+"Usage:    %s [options]\n"
+"\n"
+"    -d, --drivers LIST         Drivers to compare\n"
+"                               (./lowntfs-3g,./ntfs-3g)\n"
+"    -f, --file-size SIZE       Size of file for data workloads, in MB (256)\n"
+"    -i, --image FILE           Image to create (ntfs-3g.bench.img)\n"
+"    -k, --keep                 Keep the image\n"
+"    -m, --mkntfs PROGRAM       Program to format the image"
+" (../ntfsprogs/mkntfs)\n"
+"    -M, --mountpoint DIR       Mount point (a temporary directory)\n"
+"    -n, --files COUNT          Files in metadata workloads (10000)\n"
+"    -o, --options OPTIONS      Added to the mount options of the drivers\n"
+"    -r, --random COUNT         Random transfers (20000)\n"
+"    -s, --size SIZE            Size of the image, in MB (4096)\n"
+"    -w, --workloads LIST       Workloads to run, among data and meta\n"
+"                               (data,meta)\n"
+"    -h, --help                 Print this help\n"
+"\n"
+"Example:  %s -o big_writes -d ./lowntfs-3g\n"
+"\n"
+"Must be run as root, from the src directory of the build tree.\n"
+"\n"
+"%s";
+
+static void usage(void)
+{
+	ntfs_log_info(usage_msg, EXEC_NAME, VERSION, EXEC_NAME, EXEC_NAME,
+			ntfs_home);
+}
+
+static BOOL parse_count(const char *arg, unsigned long *count)
+{
+	char *end;
+
+	*count = strtoul(arg, &end, 10);
+	return (*count && !*end);
+}
+
+static int parse_options(int argc, char *argv[])
+{
+	unsigned long count;
+	int c;
+
+	static const char *sopt = "-d:f:hi:km:M:n:o:r:s:w:";
+	static const struct option lopt[] = {
+		{ "drivers",	required_argument,	NULL, 'd' },
+		{ "file-size",	required_argument,	NULL, 'f' },
+		{ "help",	no_argument,		NULL, 'h' },
+		{ "image",	required_argument,	NULL, 'i' },
+		{ "keep",	no_argument,		NULL, 'k' },
+		{ "mkntfs",	required_argument,	NULL, 'm' },
+		{ "mountpoint",	required_argument,	NULL, 'M' },
+		{ "files",	required_argument,	NULL, 'n' },
+		{ "options",	required_argument,	NULL, 'o' },
+		{ "random",	required_argument,	NULL, 'r' },
+		{ "size",	required_argument,	NULL, 's' },
+		{ "workloads",	required_argument,	NULL, 'w' },
+		{ NULL,		0,			NULL,  0  }
+	};
+
+	opterr = 0; /* We handle errors. */
+	opts.image = "ntfs-3g.bench.img";
+	opts.mkntfs = "../ntfsprogs/mkntfs";
+	opts.drivers = "./lowntfs-3g,./ntfs-3g";
+	opts.workloads = "data,meta";
+	opts.size = 4096LL << 20;
+	opts.file_size = 256LL << 20;
+	opts.files = 10000;
+	opts.random_ops = 20000;
+
+	while ((c = getopt_long(argc, argv, sopt, lopt, NULL)) != -1) {
+		switch (c) {
+		case 'd':
+			opts.drivers = optarg;
+			break;
+		case 'f':
+			if (!parse_count(optarg, &count))
+				return -1;
+			opts.file_size = (long long)count << 20;
+			break;
+		case 'h':
+			usage();
+			exit(0);
+		case 'i':
+			opts.image = optarg;
+			break;
+		case 'k':
+			opts.keep++;
+			break;
+		case 'm':
+			opts.mkntfs = optarg;
+			break;
+		case 'M':
+			opts.mountpoint = optarg;
+			break;
+		case 'n':
+			if (!parse_count(optarg, &opts.files))
+				return -1;
+			break;
+		case 'o':
+			opts.mount_options = optarg;
+			break;
+		case 'r':
+			if (!parse_count(optarg, &opts.random_ops))
+				return -1;
+			break;
+		case 's':
+			if (!parse_count(optarg, &count))
+				return -1;
+			opts.size = (long long)count << 20;
+			break;
+		case 'w':
+			opts.workloads = optarg;
+			break;
+		default:
+			ntfs_log_error("%s: Unknown option '%s'.\n", EXEC_NAME,
+				       argv[optind - 1]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ *		Check whether an item is in a comma separated list
+ */
+
+static BOOL in_list(const char *list, const char *name)
+{
+	const char *p;
+	size_t len;
+
+	len = strlen(name);
+	for (p=list; p; p=strchr(p, ',')) {
+		if (*p == ',')
+			p++;
+		if (!strncmp(p, name, len) && ((p[len] == ',') || !p[len]))
+			return (TRUE);
+	}
+	return (FALSE);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec/1000000000.0);
+}
+
+static u32 bench_random(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return (seed);
+}
+
+/*
+ *		Get the CPU time used by this program
+ */
+
+static double client_cpu(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+		+ (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec)
+			/1000000.0);
+}
+
+/*
+ *		Get the CPU time used by the driver, all threads included
+ *
+ *	The user and system times are the fields 14 and 15 of
+ *	/proc/pid/stat, the command name in field 2 may contain spaces.
+ */
+
+static double driver_cpu(void)
+{
+	char path[40];
+	char buf[1024];
+	unsigned long long utime;
+	unsigned long long stime;
+	char *p;
+	FILE *f;
+	size_t n;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)driver_pid);
+	f = fopen(path, "r");
+	if (!f)
+		return (0.0);
+	n = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[n] = 0;
+	p = strrchr(buf, ')');
+	if (!p || (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u"
+			" %llu %llu", &utime, &stime) != 2))
+		return (0.0);
+	return ((double)(utime + stime)/sysconf(_SC_CLK_TCK));
+}
+
+/*
+ *		Start and end a workload
+ */
+
+static int begin(struct WORKLOAD *w, const char *name, const char *driver,
+			unsigned long max, unsigned long bytes)
+{
+	w->name = name;
+	w->driver = driver;
+	w->count = 0;
+	w->max = max;
+	w->bytes = bytes;
+	w->latencies = (float*)ntfs_malloc(max*sizeof(float));
+	if (!w->latencies)
+		return (-1);
+	w->client_cpu = client_cpu();
+	w->driver_cpu = driver_cpu();
+	w->start = now();
+	return (0);
+}
+
+/*
+ *		Account for an operation which started at @start
+ */
+
+static void timed(struct WORKLOAD *w, double start)
+{
+	if (w->count < w->max)
+		w->latencies[w->count] = (now() - start)*1000000.0;
+	w->count++;
+}
+
+static int compare_latencies(const void *p1, const void *p2)
+{
+	float l1 = *(const float*)p1;
+	float l2 = *(const float*)p2;
+
+	return ((l1 > l2) - (l1 < l2));
+}
+
+/*
+ *		End a workload and print its results
+ *
+ *	The fields are the workload, the driver, the operations per
+ *	second, the MB per second for data workloads, the median and 99th
+ *	percentile latencies and the CPU time per operation, both in
+ *	microseconds, the latter for this program and the driver together.
+ */
+
+static int end(struct WORKLOAD *w, int err)
+{
+	unsigned long timed_count;
+	double cpu;
+	char mbps[20];
+
+	w->elapsed = now() - w->start;
+	cpu = client_cpu() - w->client_cpu + driver_cpu() - w->driver_cpu;
+	if (!err && w->count) {
+		timed_count = (w->count < w->max ? w->count : w->max);
+		qsort(w->latencies, timed_count, sizeof(float),
+				compare_latencies);
+		if (w->bytes)
+			snprintf(mbps, sizeof(mbps), "%.1f",
+				w->count*(double)w->bytes/w->elapsed/1048576.0);
+		else
+			strcpy(mbps, "-");
+		printf("%s\t%s\t%.1f\t%s\t%.1f\t%.1f\t%.1f\n",
+			w->name, w->driver, w->count/w->elapsed, mbps,
+			w->latencies[timed_count/2],
+			w->latencies[(timed_count*99)/100],
+			cpu*1000000.0/w->count);
+		fflush(stdout);
+	}
+	if (err)
+		ntfs_log_perror("Workload %s failed with %s", w->name,
+				w->driver);
+	free(w->latencies);
+	w->latencies = (float*)NULL;
+	return (err);
+}
+
+/*
+ *		Run a program and wait for it
+ */
+
+static int run(const char *program, const char *arg1, const char *arg2,
+			const char *arg3, const char *arg4)
+{
+	pid_t pid;
+	int status;
+
+	pid = fork();
+	if (!pid) {
+			/* keep the standard output for the results */
+		dup2(2, 1);
+		execlp(program, program, arg1, arg2, arg3, arg4, (char*)NULL);
+		_exit(127);
+	}
+	if ((pid < 0) || (waitpid(pid, &status, 0) != pid)
+	    || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		errno = EIO;
+		return (-1);
+	}
+	return (0);
+}
+
+static int create_image(void)
+{
+	int fd;
+
+	fd = open(opts.image, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if ((fd < 0) || ftruncate(fd, opts.size) || close(fd)) {
+		ntfs_log_perror("Could not create %s", opts.image);
+		return (-1);
+	}
+	if (run(opts.mkntfs, "-F", "-f", "-q", opts.image)) {
+		ntfs_log_error("Could not format %s with %s\n", opts.image,
+				opts.mkntfs);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ *		Check whether the mount point is mounted
+ */
+
+static BOOL is_mounted(void)
+{
+	struct stat st_mnt;
+	struct stat st_parent;
+	char parent[PATH_MAX];
+
+	snprintf(parent, sizeof(parent), "%s/..", opts.mountpoint);
+	return (!stat(opts.mountpoint, &st_mnt)
+		&& !stat(parent, &st_parent)
+		&& (st_mnt.st_dev != st_parent.st_dev));
+}
+
+/*
+ *		Mount the image with a driver kept in the foreground, so
+ *	that its CPU time can be read
+ */
+
+static int mount_image(const char *driver)
+{
+	char options[256];
+	double limit;
+	int status;
+
+	snprintf(options, sizeof(options), "no_detach%s%s",
+			(opts.mount_options ? "," : ""),
+			(opts.mount_options ? opts.mount_options : ""));
+	driver_pid = fork();
+	if (!driver_pid) {
+		dup2(2, 1);
+		execl(driver, driver, "-o", options, opts.image,
+				opts.mountpoint, (char*)NULL);
+		ntfs_log_perror("Could not run %s", driver);
+		_exit(127);
+	}
+	if (driver_pid < 0)
+		return (-1);
+	limit = now() + MOUNT_WAIT;
+	while (!is_mounted()) {
+		if ((waitpid(driver_pid, &status, WNOHANG) == driver_pid)
+		    || (now() > limit)) {
+			ntfs_log_error("Could not mount %s with %s\n",
+					opts.image, driver);
+			kill(driver_pid, SIGTERM);
+			waitpid(driver_pid, &status, 0);
+			return (-1);
+		}
+		usleep(10000);
+	}
+	return (0);
+}
+
+/*
+ *		Unmount and wait for the driver to have synced the image
+ */
+
+static int unmount_image(void)
+{
+	int status;
+	int err;
+
+	err = 0;
+	if (umount(opts.mountpoint)
+	    && run("fusermount", "-u", opts.mountpoint, (char*)NULL,
+			(char*)NULL)) {
+		ntfs_log_perror("Could not unmount %s", opts.mountpoint);
+		kill(driver_pid, SIGTERM);
+		err = -1;
+	}
+	if ((waitpid(driver_pid, &status, 0) != driver_pid)
+	    || !WIFEXITED(status) || WEXITSTATUS(status))
+		err = -1;
+	return (err);
+}
+
+static int remount(const char *driver)
+{
+	if (unmount_image())
+		return (-1);
+	return (mount_image(driver));
+}
+
+static void make_path(char *path, const char *dir, const char *prefix,
+			unsigned long num)
+{
+	snprintf(path, PATH_MAX, "%s/%s/%s%08lu", opts.mountpoint, dir,
+			prefix, num);
+}
+
+/*
+ *		Data workloads : sequential write and read, random read
+ *	and write, each on a freshly mounted volume
+ *
+ *	The final fsync() of the writes is included in the throughput,
+ *	but not in the latencies.
+ */
+
+static int data_workloads(const char *driver, const char *name)
+{
+	struct WORKLOAD w;
+	char path[PATH_MAX];
+	char *buf;
+	double start;
+	long long pos;
+	long long blocks;
+	unsigned long i;
+	int fd;
+	int err;
+
+	buf = (char*)ntfs_malloc(CHUNK_SIZE);
+	if (!buf)
+		return (-1);
+	for (i=0; i<CHUNK_SIZE; i++)
+		buf[i] = bench_random();
+	snprintf(path, sizeof(path), "%s/data", opts.mountpoint);
+	blocks = opts.file_size/RANDOM_SIZE;
+	err = mount_image(driver);
+	if (!err && !begin(&w, "seq_write", name,
+			opts.file_size/CHUNK_SIZE, CHUNK_SIZE)) {
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		err = (fd < 0 ? -1 : 0);
+		for (pos=0; (pos<opts.file_size) && !err; pos+=CHUNK_SIZE) {
+			start = now();
+			if (write(fd, buf, CHUNK_SIZE) != CHUNK_SIZE)
+				err = -1;
+			timed(&w, start);
+		}
+		if ((fd >= 0) && (fsync(fd) | close(fd)))
+			err = -1;
+		err = end(&w, err);
+	}
+	if (!err)
+		err = remount(driver);
+	if (!err && !begin(&w, "seq_read", name,
+			opts.file_size/CHUNK_SIZE, CHUNK_SIZE)) {
+		fd = open(path, O_RDONLY);
+		err = (fd < 0 ? -1 : 0);
+		for (pos=0; (pos<opts.file_size) && !err; pos+=CHUNK_SIZE) {
+			start = now();
+			if (read(fd, buf, CHUNK_SIZE) != CHUNK_SIZE)
+				err = -1;
+			timed(&w, start);
+		}
+		if ((fd >= 0) && close(fd))
+			err = -1;
+		err = end(&w, err);
+	}
+	if (!err)
+		err = remount(driver);
+	if (!err && !begin(&w, "rand_read", name, opts.random_ops,
+			RANDOM_SIZE)) {
+		fd = open(path, O_RDONLY);
+		err = (fd < 0 ? -1 : 0);
+		for (i=0; (i<opts.random_ops) && !err; i++) {
+			pos = (bench_random() % blocks)*RANDOM_SIZE;
+			start = now();
+			if (pread(fd, buf, RANDOM_SIZE, pos) != RANDOM_SIZE)
+				err = -1;
+			timed(&w, start);
+		}
+		if ((fd >= 0) && close(fd))
+			err = -1;
+		err = end(&w, err);
+	}
+	if (!err)
+		err = remount(driver);
+	if (!err && !begin(&w, "rand_write", name, opts.random_ops,
+			RANDOM_SIZE)) {
+		fd = open(path, O_WRONLY);
+		err = (fd < 0 ? -1 : 0);
+		for (i=0; (i<opts.random_ops) && !err; i++) {
+			pos = (bench_random() % blocks)*RANDOM_SIZE;
+			start = now();
+			if (pwrite(fd, buf, RANDOM_SIZE, pos) != RANDOM_SIZE)
+				err = -1;
+			timed(&w, start);
+		}
+		if ((fd >= 0) && (fsync(fd) | close(fd)))
+			err = -1;
+		err = end(&w, err);
+	}
+	if (!err && unlink(path))
+		err = -1;
+	if (is_mounted() && unmount_image())
+		err = -1;
+	free(buf);
+	return (err);
+}
+
+/*
+ *		Metadata workloads : mkdir, create, stat, listing with
+ *	the attributes of each entry, rename and unlink
+ *
+ *	The files are created in a single directory, and the volume is
+ *	remounted before stat and listing so that they start cold.
+ */
+
+static int meta_workloads(const char *driver, const char *name)
+{
+	struct WORKLOAD w;
+	struct stat st;
+	struct dirent *entry;
+	char path[PATH_MAX];
+	char newpath[PATH_MAX];
+	double start;
+	unsigned long dirs;
+	unsigned long i;
+	DIR *dir;
+	int fd;
+	int err;
+
+	dirs = (opts.files + FILES_PER_DIR - 1)/FILES_PER_DIR;
+	err = mount_image(driver);
+	if (!err) {
+		snprintf(path, sizeof(path), "%s/dirs", opts.mountpoint);
+		snprintf(newpath, sizeof(newpath), "%s/big", opts.mountpoint);
+		if (mkdir(path, 0755) || mkdir(newpath, 0755))
+			err = -1;
+	}
+	if (!err && !begin(&w, "mkdir", name, dirs, 0)) {
+		for (i=0; (i<dirs) && !err; i++) {
+			make_path(path, "dirs", "d", i);
+			start = now();
+			if (mkdir(path, 0755))
+				err = -1;
+			timed(&w, start);
+		}
+		err = end(&w, err);
+	}
+	if (!err && !begin(&w, "create", name, opts.files, 0)) {
+		for (i=0; (i<opts.files) && !err; i++) {
+			make_path(path, "big", "f", i);
+			start = now();
+			fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+			if ((fd < 0) || close(fd))
+				err = -1;
+			timed(&w, start);
+		}
+		err = end(&w, err);
+	}
+	if (!err)
+		err = remount(driver);
+	if (!err && !begin(&w, "stat", name, opts.files, 0)) {
+		for (i=0; (i<opts.files) && !err; i++) {
+			make_path(path, "big", "f", bench_random() % opts.files);
+			start = now();
+			if (lstat(path, &st))
+				err = -1;
+			timed(&w, start);
+		}
+		err = end(&w, err);
+	}
+	if (!err)
+		err = remount(driver);
+	if (!err && !begin(&w, "list", name, opts.files + 2, 0)) {
+		snprintf(path, sizeof(path), "%s/big", opts.mountpoint);
+		dir = opendir(path);
+		if (!dir)
+			err = -1;
+		else {
+			do {
+				start = now();
+				errno = 0;
+				entry = readdir(dir);
+				if (entry) {
+					if (fstatat(dirfd(dir), entry->d_name,
+						    &st, AT_SYMLINK_NOFOLLOW))
+						err = -1;
+					timed(&w, start);
+				} else
+					if (errno)
+						err = -1;
+			} while (entry && !err);
+			if (closedir(dir))
+				err = -1;
+		}
+		if (!err && (w.count != (opts.files + 2))) {
+			errno = EIO;
+			err = -1;
+		}
+		err = end(&w, err);
+	}
+		/* rename within the directory, and to other directories */
+	if (!err && !begin(&w, "rename", name, opts.files, 0)) {
+		for (i=0; (i<opts.files) && !err; i++) {
+			make_path(path, "big", "f", i);
+			if (i & 1)
+				make_path(newpath, "big", "g", i);
+			else
+				snprintf(newpath, sizeof(newpath),
+					"%s/dirs/d%08lu/g%08lu",
+					opts.mountpoint,
+					(i/2) % dirs, i);
+			start = now();
+			if (rename(path, newpath))
+				err = -1;
+			timed(&w, start);
+		}
+		err = end(&w, err);
+	}
+	if (!err && !begin(&w, "unlink", name, opts.files, 0)) {
+		for (i=0; (i<opts.files) && !err; i++) {
+			if (i & 1)
+				make_path(path, "big", "g", i);
+			else
+				snprintf(path, sizeof(path),
+					"%s/dirs/d%08lu/g%08lu",
+					opts.mountpoint,
+					(i/2) % dirs, i);
+			start = now();
+			if (unlink(path))
+				err = -1;
+			timed(&w, start);
+		}
+		err = end(&w, err);
+	}
+	for (i=0; (i<dirs) && !err; i++) {
+		make_path(path, "dirs", "d", i);
+		if (rmdir(path))
+			err = -1;
+	}
+	if (!err) {
+		snprintf(path, sizeof(path), "%s/dirs", opts.mountpoint);
+		snprintf(newpath, sizeof(newpath), "%s/big", opts.mountpoint);
+		if (rmdir(path) || rmdir(newpath))
+			err = -1;
+	}
+	if (is_mounted() && unmount_image())
+		err = -1;
+	return (err);
+}
+
+/*
+ *		Run the workloads with every driver
+ */
+
+static int run_drivers(void)
+{
+	char driver[PATH_MAX];
+	const char *name;
+	const char *p;
+	size_t len;
+	int err;
+
+	err = 0;
+	for (p=opts.drivers; *p; p+=len + (p[len] == ',')) {
+		len = strcspn(p, ",");
+		if (!len || (len >= sizeof(driver)))
+			continue;
+		memcpy(driver, p, len);
+		driver[len] = 0;
+		name = strrchr(driver, '/');
+		name = (name ? name + 1 : driver);
+			/* the same pseudo-random sequence for each driver */
+		seed = 0x4e544653;
+		if (in_list(opts.workloads, "data")
+		    && data_workloads(driver, name))
+			err = -1;
+		if (in_list(opts.workloads, "meta")
+		    && meta_workloads(driver, name))
+			err = -1;
+	}
+	return (err);
+}
+
+int main(int argc, char *argv[])
+{
+	char tmpdir[] = "/tmp/ntfs-3g.benchXXXXXX";
+	BOOL made_mountpoint;
+	int err;
+
+	ntfs_log_set_handler(ntfs_log_handler_stderr);
+
+	if (parse_options(argc, argv)) {
+		usage();
+		exit(1);
+	}
+	made_mountpoint = FALSE;
+	if (!opts.mountpoint) {
+		opts.mountpoint = mkdtemp(tmpdir);
+		if (!opts.mountpoint) {
+			ntfs_log_perror("Could not create a mount point");
+			exit(1);
+		}
+		made_mountpoint = TRUE;
+	}
+	err = create_image();
+	if (!err) {
+		printf("# %s %s, options %s, file %lld MB, %lu files\n",
+			EXEC_NAME, VERSION,
+			(opts.mount_options ? opts.mount_options : "-"),
+			opts.file_size >> 20, opts.files);
+		printf("# workload\tdriver\tops/s\tMB/s\tp50 us\tp99 us"
+			"\tcpu us/op\n");
+		fflush(stdout);
+		err = run_drivers();
+		if (!opts.keep)
+			unlink(opts.image);
+	}
+	if (made_mountpoint)
+		rmdir(opts.mountpoint);
+	return (err ? 1 : 0);
+}
@@ -65,6 +65,7 @@
 #endif
 #include <syslog.h>
 #include <sys/wait.h>
+#include <pthread.h>
 
 #ifdef HAVE_SETXATTR
 #include <sys/xattr.h>
@@ -87,6 +88,10 @@
 #include <linux/fs.h>
 #endif
 
+#ifdef HAVE_LINUX_FIEMAP_H
+#include <linux/fiemap.h>
+#endif
+
 #include "compat.h"
 #include "bitmap.h"
 #include "attrib.h"
@@ -99,12 +104,24 @@
 #include "ntfstime.h"
 #include "security.h"
 #include "reparse.h"
+#include "system_compression.h"
 #include "object_id.h"
 #include "efs.h"
 #include "logging.h"
 #include "xattrs.h"
 #include "misc.h"
+#include "lcnalloc.h"
+#include "cache.h"
+#include "devcache.h"
+#include "devtrace.h"
+#include "mftcache.h"
+#include "dirindex.h"
+#include "idxcache.h"
+#include "bmpcache.h"
+#include "usnjrnl.h"
 #include "ioctl.h"
+#include "lock.h"
+#include "realpath.h"
 
 #include "ntfs-3g_common.h"
 
@@ -125,12 +142,12 @@
 #endif
 
 #if !CACHEING
-#define ATTR_TIMEOUT 0.0
-#define ENTRY_TIMEOUT 0.0
+#define DEFAULT_ATTR_TIMEOUT 0.0
+#define DEFAULT_ENTRY_TIMEOUT 0.0
 #else
 #if defined(__sun) && defined (__SVR4)
-#define ATTR_TIMEOUT 10.0
-#define ENTRY_TIMEOUT 10.0
+#define DEFAULT_ATTR_TIMEOUT 10.0
+#define DEFAULT_ENTRY_TIMEOUT 10.0
 #else /* defined(__sun) && defined (__SVR4) */
 	/*
 	 * FUSE cacheing is only usable with basic permissions
@@ -139,10 +156,18 @@
 #if KERNELACLS | !KERNELPERMS
 #warning "Fuse cacheing is only usable with basic permissions checked by kernel"
 #endif
-#define ATTR_TIMEOUT (ctx->vol->secure_flags & (1 << SECURITY_DEFAULT) ? 1.0 : 0.0)
-#define ENTRY_TIMEOUT (ctx->vol->secure_flags & (1 << SECURITY_DEFAULT) ? 1.0 : 0.0)
+#define DEFAULT_ATTR_TIMEOUT (ctx->vol->secure_flags & (1 << SECURITY_DEFAULT) ? 1.0 : 0.0)
+#define DEFAULT_ENTRY_TIMEOUT (ctx->vol->secure_flags & (1 << SECURITY_DEFAULT) ? 1.0 : 0.0)
 #endif /* defined(__sun) && defined (__SVR4) */
 #endif
+	/* option "cache_timeout" overrides the timeouts */
+#define ATTR_TIMEOUT (ctx->cache_timeout \
+			? (double)ctx->cache_timeout : DEFAULT_ATTR_TIMEOUT)
+#define ENTRY_TIMEOUT (ctx->cache_timeout \
+			? (double)ctx->cache_timeout : DEFAULT_ENTRY_TIMEOUT)
+#define NEGATIVE_TIMEOUT ((double)ctx->cache_timeout)
+	/* the kernel may keep the attributes of an immutable volume */
+#define IMMUTABLE_TIMEOUT (365*86400)
 #define GHOSTLTH 40 /* max length of a ghost file name - see ghostformat */
 
 		/* sometimes the kernel cannot check access */
@@ -164,25 +189,54 @@ typedef enum {
 	FSTYPE_FUSEBLK
 } fuse_fstype;
 
+	/*
+	 * The directory entries are collected on the first readdir()
+	 * as a list of fill_entry records, and they are formatted
+	 * when they are sent, as plain entries or with attributes.
+	 * The list is kept until the directory is released, and the
+	 * entries are located from their cookies (the offset passed
+	 * to readdir()) through a table, so that a listing can be
+	 * resumed anywhere without scanning the list.
+	 */
+typedef struct fill_entry {
+	u64 ino;
+	off_t off;		/* offset of next entry */
+	mode_t mode;		/* only the type and defaults */
+	unsigned int namelen;
+	char name[0];		/* null terminated */
+} ntfs_fuse_fill_entry_t;
+
+#define FILL_ENTRY_SIZE(namelen) \
+	((offsetof(ntfs_fuse_fill_entry_t, name) + (namelen) + 8) & ~(size_t)7)
+
 typedef struct fill_item {
 	struct fill_item *next;
 	size_t bufsize;
-	size_t off;
+	size_t off;		/* end of the entries */
 	char buf[0];
 } ntfs_fuse_fill_item_t;
 
 typedef struct fill_context {
 	struct fill_item *first;
 	struct fill_item *last;
+	struct fill_entry **cookies;	/* entries by cookie */
 	off_t off;
-	fuse_req_t req;
 	fuse_ino_t ino;
 	BOOL filled;
 } ntfs_fuse_fill_context_t;
 
+struct open_data {
+	ntfs_inode *ni;		/* held open while the file is open */
+	ntfs_attr *na;		/* unnamed data, NULL until needed */
+	struct ntfs_system_decompression_ctx *dctx; /* NULL until needed */
+	int count;		/* count of openings sharing it */
+	pthread_mutex_t lock;	/* for using na */
+} ;
+
 struct open_file {
 	struct open_file *next;
 	struct open_file *previous;
+	struct open_data *data;
 	long long ghost;
 	fuse_ino_t ino;
 	fuse_ino_t parent;
@@ -202,11 +256,8 @@ enum RM_TYPES {
 	RM_ANY,
 } ;
 
-static struct ntfs_options opts;
-
 const char *EXEC_NAME = "lowntfs-3g";
 
-static ntfs_fuse_context_t *ctx;
 static u32 ntfs_sequence;
 static const char ghostformat[] = ".ghost-ntfs-3g-%020llu";
 
@@ -270,6 +321,294 @@ static const char *unpriv_fuseblk_msg =
 #endif	
 
 
+/*
+ *		Locking for the multithreaded loop (option "threads=n")
+ *
+ *	When several worker threads are in use, each request holds
+ *	the volume lock while it is being processed :
+ *	- requests which only read data or metadata (lookup, getattr,
+ *	  readlink, opendir, readdir, readdirplus, releasedir, read,
+ *	  access, bmap, getxattr and listxattr) take it in shared mode,
+ *	  and may be processed concurrently,
+ *	- statfs only reads the counters of free clusters and MFT records,
+ *	  which are kept up to date by the allocations, so it does not
+ *	  take the lock and is not delayed by the other requests,
+ *	- all other requests take it in exclusive mode, as they may
+ *	  allocate clusters or MFT records, update indexes or change
+ *	  the list of open files.
+ *
+ *	Shared holders must not write anything, so the access times
+ *	they update are only recorded, and written by the next request
+ *	holding the lock exclusively (or when unmounting). With option
+ *	"lazytime" all the access times are recorded, even by the single
+ *	threaded loop, and written together later. Option
+ *	"addsecurids" implies writing while reading security data, so
+ *	shared holders exclude each other when it is set.
+ *
+ *	The data attribute kept open for an open file has its own lock,
+ *	a read which finds it in use opens a private attribute instead.
+ *
+ *	With the single threaded loop, the unlocked operations are used.
+ */
+
+#define DEFERRED_ATIMES 256	/* max count of deferred access times */
+#define LAZYTIME_DELAY 60	/* max seconds an access time is deferred */
+
+struct ATIME_LIST {
+	pthread_mutex_t lock;
+	int count;
+	time_t oldest;
+	struct {
+		fuse_ino_t ino;
+		ntfs_time atime;
+	} list[DEFERRED_ATIMES];
+} ;
+
+#ifdef FUSE_INTERNAL
+
+struct notify_item {
+	struct notify_item *next;
+	fuse_ino_t ino;		/* the parent directory if there is a name */
+	size_t namelen;		/* zero for invalidating attributes */
+	char name[1];
+} ;
+
+#endif /* FUSE_INTERNAL */
+
+/*
+ *		State of a mounted volume
+ *
+ *	Several volumes may be served by the same process (option
+ *	"--volumes"), the requests to all of them being processed by
+ *	a shared pool of worker threads. The context and the state of
+ *	the volume of the current request are then designated by
+ *	thread-local variables, set before each request is processed
+ *	(see ntfs_fuse_enter()).
+ */
+
+struct ntfs_instance {
+	struct ntfs_instance *next;
+	ntfs_fuse_context_t *ctx;
+	struct ntfs_options opts;
+	struct fuse_session *se;
+	char *parsed_options;
+	char *volume_line;	/* holding the names, with option --volumes */
+	const char *permissions_mode;
+	const char *failed_secure;
+#if defined(HAVE_SETXATTR) && defined(XATTR_MAPPINGS)
+	struct XATTRMAPPING *xattr_mapping;
+#endif /* defined(HAVE_SETXATTR) && defined(XATTR_MAPPINGS) */
+	BOOL blkdev_on_fuse;	/* for the warning about old kernels */
+	BOOL shared_readers;
+	BOOL serving;		/* sharing the cache pool */
+	time_t last_request;	/* for trimming the caches when idle */
+	struct ATIME_LIST deferred_atimes;
+#ifdef FUSE_INTERNAL
+	struct {
+		pthread_mutex_t lock;
+		pthread_cond_t cond;
+		struct notify_item *list;
+		pthread_t thread;
+		BOOL running;
+		BOOL stop;
+	} notifier;
+#endif /* FUSE_INTERNAL */
+} ;
+
+#ifdef FUSE_INTERNAL
+static __thread ntfs_fuse_context_t *ctx;
+static __thread struct ntfs_instance *instance;
+
+#define IDLE_TRIM_DELAY 30	/* seconds without requests before trimming */
+
+static struct ntfs_instance *instances;	/* all the volumes served */
+static pthread_mutex_t instances_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct CACHE_POOL *cache_pool;	/* shared by all the volumes */
+static time_t next_trim;
+#else
+static ntfs_fuse_context_t *ctx;
+static struct ntfs_instance *instance;
+#endif
+
+/*
+ *		Record an access time to be written later
+ *
+ *	If the list is full, the update is lost, this cannot happen
+ *	unless there are more threads than half the size of the list.
+ */
+
+static void ntfs_fuse_defer_atime(ntfs_inode *ni)
+{
+	struct ATIME_LIST *deferred = &instance->deferred_atimes;
+	int i;
+
+	if ((ni->mft_no < FILE_first_user) && (ni->mft_no != FILE_root))
+		return;
+	pthread_mutex_lock(&deferred->lock);
+	for (i=0; (i<deferred->count)
+			&& (deferred->list[i].ino != ni->mft_no); i++) { }
+	if (i < DEFERRED_ATIMES) {
+		deferred->list[i].ino = ni->mft_no;
+		deferred->list[i].atime = ntfs_current_time();
+		if (!deferred->count)
+			deferred->oldest = time((time_t*)NULL);
+		if (i == deferred->count)
+			deferred->count++;
+	}
+	pthread_mutex_unlock(&deferred->lock);
+}
+
+/*
+ *		Forget the deferred access time of an inode
+ *
+ *	Used when the access time is set explicitly, so that it is not
+ *	overwritten later by an older access.
+ */
+
+static void ntfs_fuse_cancel_atime(ntfs_inode *ni)
+{
+	struct ATIME_LIST *deferred = &instance->deferred_atimes;
+	int i;
+
+	if (deferred->count) {
+		pthread_mutex_lock(&deferred->lock);
+		for (i=0; (i<deferred->count)
+			&& (deferred->list[i].ino != ni->mft_no); i++) { }
+		if (i < deferred->count)
+			deferred->list[i]
+				= deferred->list[--deferred->count];
+		pthread_mutex_unlock(&deferred->lock);
+	}
+}
+
+/*
+ *		Get the access time of an inode, including a deferred one
+ */
+
+static ntfs_time ntfs_fuse_deferred_atime(ntfs_inode *ni)
+{
+	struct ATIME_LIST *deferred = &instance->deferred_atimes;
+	ntfs_time atime;
+	int i;
+
+	atime = ni->last_access_time;
+	if (deferred->count) {
+		pthread_mutex_lock(&deferred->lock);
+		for (i=0; (i<deferred->count)
+			&& (deferred->list[i].ino != ni->mft_no); i++) { }
+		if ((i < deferred->count)
+		    && (sle64_to_cpu(deferred->list[i].atime)
+				> sle64_to_cpu(atime)))
+			atime = deferred->list[i].atime;
+		pthread_mutex_unlock(&deferred->lock);
+	}
+	return (atime);
+}
+
+/*
+ *		Check whether the deferred access times have to be written
+ *
+ *	With option "lazytime" they are kept until the list is half
+ *	full or the oldest one has been deferred for LAZYTIME_DELAY
+ *	seconds, otherwise they are written as soon as possible.
+ */
+
+static BOOL ntfs_fuse_atimes_due(void)
+{
+	struct ATIME_LIST *deferred = &instance->deferred_atimes;
+	return (deferred->count
+		&& (!ctx->lazytime
+		    || (deferred->count >= DEFERRED_ATIMES/2)
+		    || (time((time_t*)NULL)
+			>= deferred->oldest + LAZYTIME_DELAY)));
+}
+
+/*
+ *		Write the deferred access times
+ *
+ *	Must be called with the volume locked in exclusive mode.
+ */
+
+static void ntfs_fuse_flush_atimes(void)
+{
+	struct ATIME_LIST *deferred = &instance->deferred_atimes;
+	ntfs_inode *ni;
+	int i;
+
+	pthread_mutex_lock(&deferred->lock);
+	for (i=0; i<deferred->count; i++) {
+		ni = ntfs_inode_open(ctx->vol,
+				INODE(deferred->list[i].ino));
+		if (ni) {
+			if (sle64_to_cpu(deferred->list[i].atime)
+			    > sle64_to_cpu(ni->last_access_time)) {
+				ni->last_access_time
+					= deferred->list[i].atime;
+				NInoFileNameSetDirty(ni);
+				NInoSetDirty(ni);
+			}
+			if (ntfs_inode_close(ni))
+				ntfs_log_perror("Failed to update the access"
+					" time of inode %lld",
+					(long long)deferred->list[i].ino);
+		}
+	}
+	deferred->count = 0;
+	pthread_mutex_unlock(&deferred->lock);
+}
+
+/*
+ *		Apply the deferred updates of directory entries
+ *		(option "filename_delay")
+ *
+ *	Must be called with no inode open, and with the volume locked
+ *	in exclusive mode when several threads are used.
+ */
+
+static void ntfs_fuse_flush_file_names(BOOL force)
+{
+	if (ntfs_inode_flush_file_names(ctx->vol, force))
+		ntfs_log_perror("Failed to update some directory entries");
+}
+
+/*
+ *		Write the metadata updates gathered in the caches
+ *		when the commit interval has elapsed (option "commit")
+ */
+
+static void ntfs_fuse_commit(void)
+{
+	if (ntfs_volume_commit(ctx->vol, FALSE))
+		ntfs_log_perror("Failed to commit the metadata updates");
+}
+
+static void ntfs_fuse_lock_shared(void)
+{
+	if (instance->shared_readers)
+		ntfs_volume_lock_shared(ctx->vol);
+	else
+		ntfs_volume_lock_exclusive(ctx->vol);
+}
+
+static void ntfs_fuse_lock_exclusive(void)
+{
+	ntfs_volume_lock_exclusive(ctx->vol);
+	if (ntfs_fuse_atimes_due())
+		ntfs_fuse_flush_atimes();
+	ntfs_fuse_flush_file_names(FALSE);
+	ntfs_fuse_commit();
+}
+
+static void ntfs_fuse_unlock(void)
+{
+	ntfs_volume_unlock(ctx->vol);
+		/* do not let the deferred access times accumulate */
+	if (instance->deferred_atimes.count >= DEFERRED_ATIMES/2) {
+		ntfs_fuse_lock_exclusive();
+		ntfs_volume_unlock(ctx->vol);
+	}
+}
+
 static void ntfs_fuse_update_times(ntfs_inode *ni, ntfs_time_update_flags mask)
 {
 	if (ctx->atime == ATIME_DISABLED)
@@ -280,9 +619,261 @@ static void ntfs_fuse_update_times(ntfs_inode *ni, ntfs_time_update_flags mask)
 			(sle64_to_cpu(ni->last_access_time)
 				>= sle64_to_cpu(ni->last_mft_change_time)))
 		return;
-	ntfs_inode_update_times(ni, mask);
+	if (((ctx->threads > 1) || ctx->lazytime)
+			&& (mask == NTFS_UPDATE_ATIME)) {
+		if (!NVolReadOnly(ni->vol))
+			ntfs_fuse_defer_atime(ni);
+	} else
+		ntfs_inode_update_times(ni, mask);
+}
+
+/*
+ *		Invalidations of the kernel cache (option "cache_timeout")
+ *
+ *	The kernel then keeps the entries, including the negative ones,
+ *	and the attributes for a long time. It updates its cache for the
+ *	changes it requests, so only the changes it cannot be aware of
+ *	have to be notified : the other names deleted along with a name
+ *	(the DOS name of a long name, or the reverse), the ghost files
+ *	and the times which are set when closing.
+ *
+ *	The kernel may wait for the reply to a request while holding a
+ *	lock needed for a notification, so the notifications cannot
+ *	be sent while processing a request. They are queued and sent
+ *	by a dedicated thread.
+ */
+
+#ifdef FUSE_INTERNAL
+
+/*
+ *		Queue an invalidation of a directory entry, or of the
+ *	attributes of an inode if there is no name
+ *
+ *	If there is not enough memory, the cache is outdated until
+ *	the timeout is reached.
+ */
+
+static void ntfs_fuse_notify(fuse_ino_t ino, const char *name)
+{
+	struct notify_item *item;
+	size_t namelen;
+
+	if (instance->notifier.running) {
+		namelen = (name ? strlen(name) : 0);
+		item = (struct notify_item*)ntfs_malloc(
+				sizeof(struct notify_item) + namelen);
+		if (item) {
+			item->ino = ino;
+			item->namelen = namelen;
+			if (name)
+				strcpy(item->name, name);
+			pthread_mutex_lock(&instance->notifier.lock);
+			item->next = instance->notifier.list;
+			instance->notifier.list = item;
+			pthread_cond_signal(&instance->notifier.cond);
+			pthread_mutex_unlock(&instance->notifier.lock);
+		}
+	}
+}
+
+/*
+ *		Queue the invalidations of the other names of an inode
+ *	in a directory, which are deleted along with a name
+ *
+ *	Only a WIN32 name and its DOS name are deleted together,
+ *	the POSIX names (hard links) are independent.
+ */
+
+static void ntfs_fuse_notify_aliases(ntfs_inode *ni, fuse_ino_t parent)
+{
+	ntfs_attr_search_ctx *actx;
+	FILE_NAME_ATTR *fn;
+	char *name;
+
+	if (instance->notifier.running) {
+		actx = ntfs_attr_get_search_ctx(ni, NULL);
+		if (actx) {
+			while (!ntfs_attr_lookup(AT_FILE_NAME, AT_UNNAMED, 0,
+					CASE_SENSITIVE, 0, NULL, 0, actx)) {
+				/* We know this will always be resident. */
+				fn = (FILE_NAME_ATTR*)((u8*)actx->attr +
+					le16_to_cpu(actx->attr->value_offset));
+				if (((fn->file_name_type == FILE_NAME_WIN32)
+				    || (fn->file_name_type == FILE_NAME_DOS))
+				    && (MREF_LE(fn->parent_directory)
+						== INODE(parent))) {
+					name = (char*)NULL;
+					if (ntfs_ucstombs((const ntfschar*)
+						    ((const u8*)fn + offsetof(FILE_NAME_ATTR, file_name)),
+						    fn->file_name_length,
+						    &name, 0) > 0)
+						ntfs_fuse_notify(parent, name);
+					free(name);
+				}
+			}
+			ntfs_attr_put_search_ctx(actx);
+		}
+	}
+}
+
+static void *ntfs_fuse_notifier(void *arg)
+{
+	struct notify_item *list;
+	struct notify_item *item;
+
+		/* each volume has its own notifier */
+	instance = (struct ntfs_instance*)arg;
+	ctx = instance->ctx;
+	pthread_mutex_lock(&instance->notifier.lock);
+	while (!instance->notifier.stop || instance->notifier.list) {
+		list = instance->notifier.list;
+		instance->notifier.list = (struct notify_item*)NULL;
+		if (list) {
+			pthread_mutex_unlock(&instance->notifier.lock);
+				/* -ENOENT when the kernel has no cache */
+			while (list) {
+				item = list;
+				list = item->next;
+				if (item->namelen)
+					fuse_lowlevel_notify_inval_entry(
+						ctx->fc, item->ino,
+						item->name, item->namelen);
+				else
+					fuse_lowlevel_notify_inval_inode(
+						ctx->fc, item->ino, -1, 0);
+				free(item);
+			}
+			pthread_mutex_lock(&instance->notifier.lock);
+		} else
+			pthread_cond_wait(&instance->notifier.cond,
+					&instance->notifier.lock);
+	}
+	pthread_mutex_unlock(&instance->notifier.lock);
+	return ((void*)NULL);
+}
+
+static int ntfs_fuse_start_notifier(void)
+{
+	int err;
+
+	instance->notifier.stop = FALSE;
+	err = pthread_create(&instance->notifier.thread, NULL,
+			ntfs_fuse_notifier, (void*)instance);
+	if (!err)
+		instance->notifier.running = TRUE;
+	else {
+		errno = err;
+		err = -1;
+	}
+	return (err);
+}
+
+static void ntfs_fuse_stop_notifier(void)
+{
+	if (instance->notifier.running) {
+		instance->notifier.running = FALSE;
+		pthread_mutex_lock(&instance->notifier.lock);
+		instance->notifier.stop = TRUE;
+		pthread_cond_signal(&instance->notifier.cond);
+		pthread_mutex_unlock(&instance->notifier.lock);
+		pthread_join(instance->notifier.thread, NULL);
+	}
+}
+
+/*
+ *		Give the cache memory of idle volumes back to the pool
+ *
+ *	Called by a worker thread about to process a request, with no
+ *	lock held, so that no housekeeping thread is needed. Only the
+ *	volumes still serving are trimmed, and they cannot be closed
+ *	while the list is locked.
+ */
+
+static void ntfs_fuse_trim_idle(time_t now)
+{
+	struct ntfs_instance *inst;
+	ntfs_volume *vol;
+
+	pthread_mutex_lock(&instances_lock);
+	if (now >= next_trim) {
+		next_trim = now + IDLE_TRIM_DELAY;
+		for (inst=instances; inst; inst=inst->next) {
+			vol = inst->ctx->vol;
+			if ((inst != instance) && inst->serving && vol
+			    && ((now - inst->last_request)
+					>= IDLE_TRIM_DELAY)) {
+				ntfs_volume_lock_exclusive(vol);
+				ntfs_cache_pool_trim(vol);
+				ntfs_volume_unlock(vol);
+			}
+		}
+	}
+	pthread_mutex_unlock(&instances_lock);
+}
+
+/*
+ *		Designate the volume of the request about to be processed
+ *
+ *	Called by the worker threads shared by several volumes.
+ */
+
+static void ntfs_fuse_enter(void *data)
+{
+	time_t now;
+
+	instance = (struct ntfs_instance*)data;
+	ctx = instance->ctx;
+	now = time((time_t*)NULL);
+	instance->last_request = now;
+	if (cache_pool && (now >= next_trim))
+		ntfs_fuse_trim_idle(now);
+}
+
+/*
+ *		Close a volume which has been unmounted
+ *
+ *	Called by the main thread when no request to the volume is
+ *	being processed any more, the other volumes are still served.
+ */
+
+static void ntfs_close(void);
+
+static void ntfs_fuse_leave(void *data)
+{
+	instance = (struct ntfs_instance*)data;
+	ctx = instance->ctx;
+	ntfs_fuse_stop_notifier();
+	ntfs_close();
+}
+
+/*
+ *		Stop sharing the cache pool before closing the volume
+ */
+
+static void ntfs_fuse_leave_pool(void)
+{
+	pthread_mutex_lock(&instances_lock);
+	if (instance->serving) {
+		instance->serving = FALSE;
+		ntfs_cache_pool_leave(ctx->vol);
+	}
+	pthread_mutex_unlock(&instances_lock);
+}
+
+#else /* FUSE_INTERNAL */
+
+static void ntfs_fuse_notify(fuse_ino_t ino __attribute__((unused)),
+			const char *name __attribute__((unused)))
+{
 }
 
+static void ntfs_fuse_notify_aliases(ntfs_inode *ni __attribute__((unused)),
+			fuse_ino_t parent __attribute__((unused)))
+{
+}
+
+#endif /* FUSE_INTERNAL */
+
 static s64 ntfs_get_nr_free_mft_records(ntfs_volume *vol)
 {
 	ntfs_attr *na = vol->mftbmp_na;
@@ -590,12 +1181,30 @@ static void ntfs_init(void *userdata __attribute__((unused)),
 #ifdef FUSE_CAP_BIG_WRITES
 	if (ctx->big_writes
 	    && ((ctx->vol->nr_clusters << ctx->vol->cluster_size_bits)
-			>= SAFE_CAPACITY_FOR_BIG_WRITES))
+			>= SAFE_CAPACITY_FOR_BIG_WRITES)) {
 		conn->want |= FUSE_CAP_BIG_WRITES;
+#ifdef FUSE_CAP_MAX_PAGES
+			/* allow requests beyond 128K on recent kernels */
+		conn->want |= FUSE_CAP_MAX_PAGES;
+#endif
+	}
 #endif
 #ifdef FUSE_CAP_IOCTL_DIR
 	conn->want |= FUSE_CAP_IOCTL_DIR;
 #endif /* defined(FUSE_CAP_IOCTL_DIR) */
+#ifdef FUSE_CAP_READDIRPLUS
+		/*
+		 * Attributes are only useful if the kernel can keep them,
+		 * and the kernel is left to choose when to get them.
+		 */
+	if (ENTRY_TIMEOUT > 0.0)
+		conn->want |= FUSE_CAP_READDIRPLUS
+				| FUSE_CAP_READDIRPLUS_AUTO;
+#endif /* defined(FUSE_CAP_READDIRPLUS) */
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+	if (ctx->writeback_cache)
+		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+#endif /* defined(FUSE_CAP_WRITEBACK_CACHE) */
 }
 
 static int ntfs_fuse_getstat(struct SECURITY_CONTEXT *scx,
@@ -603,6 +1212,7 @@ static int ntfs_fuse_getstat(struct SECURITY_CONTEXT *scx,
 {
 	int res = 0;
 	ntfs_attr *na;
+	ntfs_time atime;
 	BOOL withusermapping;
 
 	memset(stbuf, 0, sizeof(struct stat));
@@ -612,7 +1222,23 @@ static int ntfs_fuse_getstat(struct SECURITY_CONTEXT *scx,
 		if (ni->flags & FILE_ATTR_REPARSE_POINT) {
 			char *target;
 			int attr_size;
-
+			s64 compressed_size;
+
+			compressed_size =
+				ntfs_get_system_compressed_file_size(ni);
+			if (compressed_size >= 0) {
+				/* System-compressed file  */
+				stbuf->st_size = ni->data_size;
+				stbuf->st_blocks = (compressed_size + 511) >> 9;
+				stbuf->st_nlink =
+					le16_to_cpu(ni->mrec->link_count);
+				stbuf->st_mode = S_IFREG | (0555 & ~ctx->fmask);
+				goto owner;
+			}
+			if (errno != EOPNOTSUPP) {
+				res = -errno;
+				goto exit;
+			}
 			errno = 0;
 			target = ntfs_make_symlink(ni, ctx->abs_mnt_point,
 					&attr_size);
@@ -742,6 +1368,7 @@ static int ntfs_fuse_getstat(struct SECURITY_CONTEXT *scx,
 		}
 		stbuf->st_mode |= (0777 & ~ctx->fmask);
 	}
+owner :
 	if (withusermapping) {
 		if (ntfs_get_owner_mode(scx,ni,stbuf) < 0)
 			set_fuse_error(&res);
@@ -753,19 +1380,20 @@ static int ntfs_fuse_getstat(struct SECURITY_CONTEXT *scx,
 		stbuf->st_mode |= 0777;
 nodata :
 	stbuf->st_ino = ni->mft_no;
+	atime = ntfs_fuse_deferred_atime(ni);
 #ifdef HAVE_STRUCT_STAT_ST_ATIMESPEC
-	stbuf->st_atimespec = ntfs2timespec(ni->last_access_time);
+	stbuf->st_atimespec = ntfs2timespec(atime);
 	stbuf->st_ctimespec = ntfs2timespec(ni->last_mft_change_time);
 	stbuf->st_mtimespec = ntfs2timespec(ni->last_data_change_time);
 #elif defined(HAVE_STRUCT_STAT_ST_ATIM)
-	stbuf->st_atim = ntfs2timespec(ni->last_access_time);
+	stbuf->st_atim = ntfs2timespec(atime);
 	stbuf->st_ctim = ntfs2timespec(ni->last_mft_change_time);
 	stbuf->st_mtim = ntfs2timespec(ni->last_data_change_time);
 #elif defined(HAVE_STRUCT_STAT_ST_ATIMENSEC)
 	{
 	struct timespec ts;
 
-	ts = ntfs2timespec(ni->last_access_time);
+	ts = ntfs2timespec(atime);
 	stbuf->st_atime = ts.tv_sec;
 	stbuf->st_atimensec = ts.tv_nsec;
 	ts = ntfs2timespec(ni->last_mft_change_time);
@@ -780,7 +1408,7 @@ nodata :
 	{
 	struct timespec ts;
 
-	ts = ntfs2timespec(ni->last_access_time);
+	ts = ntfs2timespec(atime);
 	stbuf->st_atime = ts.tv_sec;
 	ts = ntfs2timespec(ni->last_mft_change_time);
 	stbuf->st_ctime = ts.tv_sec;
@@ -878,9 +1506,15 @@ static void ntfs_fuse_lookup(fuse_req_t req, fuse_ino_t parent,
 		}
 	} else
 		errno = ENAMETOOLONG;
-	if (!ok)
-		fuse_reply_err(req, errno);
-	else
+	if (!ok) {
+		if ((errno == ENOENT) && ctx->cache_timeout) {
+				/* let the kernel cache the missing name */
+			memset(&entry, 0, sizeof(entry));
+			entry.entry_timeout = NEGATIVE_TIMEOUT;
+			fuse_reply_entry(req, &entry);
+		} else
+			fuse_reply_err(req, errno);
+	} else
 		fuse_reply_entry(req, &entry);
 }
 
@@ -977,17 +1611,26 @@ static int ntfs_fuse_filler(ntfs_fuse_fill_context_t *fill_ctx,
 		const s64 pos __attribute__((unused)), const MFT_REF mref,
 		const unsigned dt_type __attribute__((unused)))
 {
-	char *filename = NULL;
+	char namebuf[NTFS_MAX_NAME_LEN*3 + 1];
+	char *filename = namebuf;
 	int ret = 0;
 	int filenamelen = -1;
 	size_t sz;
 	ntfs_fuse_fill_item_t *current;
 	ntfs_fuse_fill_item_t *newone;
+	ntfs_fuse_fill_entry_t *entry;
 
 	if (name_type == FILE_NAME_DOS)
 		return 0;
         
-	if ((filenamelen = ntfs_ucstombs(name, name_len, &filename, 0)) < 0) {
+		/* translate into the stack, unless the locale needs more */
+	filenamelen = ntfs_ucstombs(name, name_len, &filename,
+				sizeof(namebuf));
+	if ((filenamelen < 0) && (errno == ENAMETOOLONG)) {
+		filename = (char*)NULL;
+		filenamelen = ntfs_ucstombs(name, name_len, &filename, 0);
+	}
+	if (filenamelen < 0) {
 		ntfs_log_perror("Filename decoding failed (inode %llu)",
 				(unsigned long long)MREF(mref));
 		return -1;
@@ -1054,45 +1697,42 @@ static int ntfs_fuse_filler(ntfs_fuse_fill_context_t *fill_ctx,
 #endif /* defined(__APPLE__) || defined(__DARWIN__), ... */
 	
 		current = fill_ctx->last;
-		sz = fuse_add_direntry(fill_ctx->req,
-				&current->buf[current->off],
-				current->bufsize - current->off,
-				filename, &st, current->off + fill_ctx->off);
-		if (!sz || ((current->off + sz) > current->bufsize)) {
+		filenamelen = strlen(filename);
+		sz = FILL_ENTRY_SIZE(filenamelen);
+		if ((current->off + sz) > current->bufsize) {
 			newone = (ntfs_fuse_fill_item_t*)ntfs_malloc
 				(sizeof(ntfs_fuse_fill_item_t)
-				     + current->bufsize);
+				     + (sz > current->bufsize
+					? sz : current->bufsize));
 			if (newone) {
 				newone->off = 0;
-				newone->bufsize = current->bufsize;
+				newone->bufsize = (sz > current->bufsize
+					? sz : current->bufsize);
 				newone->next = (ntfs_fuse_fill_item_t*)NULL;
 				current->next = newone;
 				fill_ctx->last = newone;
-				fill_ctx->off += current->off;
 				current = newone;
-				sz = fuse_add_direntry(fill_ctx->req,
-					current->buf,
-					current->bufsize - current->off,
-					filename, &st, fill_ctx->off);
-				if (!sz) {
-					errno = EIO;
-					ntfs_log_error("Could not add a"
-						" directory entry (inode %lld)\n",
-						(unsigned long long)MREF(mref));
-				}
 			} else {
 				sz = 0;
 				errno = ENOMEM;
 			}
 		}
 		if (sz) {
+			entry = (ntfs_fuse_fill_entry_t*)
+					&current->buf[current->off];
+			entry->ino = st.st_ino;
+			entry->off = ++fill_ctx->off;
+			entry->mode = st.st_mode;
+			entry->namelen = filenamelen;
+			memcpy(entry->name, filename, filenamelen + 1);
 			current->off += sz;
 		} else {
 			ret = -1;
 		}
 	}
         
-	free(filename);
+	if (filename != namebuf)
+		free(filename);
 	return ret;
 }
 
@@ -1105,6 +1745,8 @@ static void ntfs_fuse_opendir(fuse_req_t req, fuse_ino_t ino,
 	ntfs_fuse_fill_context_t *fill;
 	struct SECURITY_CONTEXT security;
 
+		/* show the latest sizes and times to directory readers */
+	ntfs_fuse_flush_file_names(TRUE);
 	ni = ntfs_inode_open(ctx->vol, INODE(ino));
 	if (ni) {
 		if (ntfs_fuse_fill_security_context(req, &security)) {
@@ -1128,6 +1770,7 @@ static void ntfs_fuse_opendir(fuse_req_t req, fuse_ino_t ino,
 			else {
 				fill->first = fill->last
 					= (ntfs_fuse_fill_item_t*)NULL;
+				fill->cookies = (ntfs_fuse_fill_entry_t**)NULL;
 				fill->filled = FALSE;
 				fill->ino = ino;
 				fill->off = 0;
@@ -1143,36 +1786,194 @@ static void ntfs_fuse_opendir(fuse_req_t req, fuse_ino_t ino,
 }
 
 
+/*
+ *		Free the entries collected for a directory
+ */
+
+static void ntfs_fuse_fill_clear(ntfs_fuse_fill_context_t *fill)
+{
+	ntfs_fuse_fill_item_t *current;
+
+	current = fill->first;
+	while (current) {
+		current = current->next;
+		free(fill->first);
+		fill->first = current;
+	}
+	fill->last = (ntfs_fuse_fill_item_t*)NULL;
+	free(fill->cookies);
+	fill->cookies = (ntfs_fuse_fill_entry_t**)NULL;
+	fill->filled = FALSE;
+}
+
+/*
+ *		Build the table of collected entries indexed by cookie
+ *
+ *	The entry sent after the one with cookie N is at index N, the
+ *	cookies being allocated sequentially by ntfs_fuse_filler().
+ *
+ *	Returns 0 if successful, -1 otherwise (errno tells why)
+ */
+
+static int ntfs_fuse_fill_index(ntfs_fuse_fill_context_t *fill)
+{
+	ntfs_fuse_fill_item_t *current;
+	ntfs_fuse_fill_entry_t *entry;
+	size_t pos;
+	off_t n;
+
+	fill->cookies = (ntfs_fuse_fill_entry_t**)ntfs_malloc(
+			(fill->off + 1)*sizeof(ntfs_fuse_fill_entry_t*));
+	if (!fill->cookies)
+		return (-1);
+	n = 0;
+	for (current=fill->first; current; current=current->next) {
+		for (pos=0; pos<current->off;
+				pos+=FILL_ENTRY_SIZE(entry->namelen)) {
+			entry = (ntfs_fuse_fill_entry_t*)&current->buf[pos];
+			fill->cookies[n++] = entry;
+		}
+	}
+	return (0);
+}
+
+/*
+ *		Queue the records of the collected entries for being read
+ *
+ *	The lookups and getattrs which generally follow a listing then
+ *	find the records in the MFT cache, and they have been read in
+ *	the order of their numbers rather than in the order of names.
+ */
+
+static void ntfs_fuse_readahead(ntfs_fuse_fill_context_t *fill)
+{
+	s64 *list;
+	off_t n;
+
+	list = (s64*)ntfs_malloc(fill->off*sizeof(s64));
+	if (list) {
+		for (n=0; n<fill->off; n++)
+			list[n] = MREF(INODE(fill->cookies[n]->ino));
+		ntfs_mftcache_readahead(ctx->vol, list, fill->off);
+		free(list);
+	}
+}
+
 static void ntfs_fuse_releasedir(fuse_req_t req,
 			fuse_ino_t ino __attribute__((unused)),
 			struct fuse_file_info *fi)
 {
 	ntfs_fuse_fill_context_t *fill;
-	ntfs_fuse_fill_item_t *current;
 
 	fill = (ntfs_fuse_fill_context_t*)(long)fi->fh;
 	if (fill && (fill->ino == ino)) {
 			/* make sure to clear results */
-		current = fill->first;
-		while (current) {
-			current = current->next;
-			free(fill->first);
-			fill->first = current;
-		}
+		ntfs_fuse_fill_clear(fill);
 		fill->ino = 0;
 		free(fill);
 	}
+		/* only the single threaded loop has the volume to itself */
+	if ((ctx->threads <= 1) && ntfs_fuse_atimes_due())
+		ntfs_fuse_flush_atimes();
 	fuse_reply_err(req, 0);
 }
 
-static void ntfs_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
-			off_t off __attribute__((unused)),
-			struct fuse_file_info *fi __attribute__((unused)))
-{
-	ntfs_fuse_fill_item_t *first;
-	ntfs_fuse_fill_item_t *current;
-	ntfs_fuse_fill_context_t *fill;
+/*
+ *		Format the directory entries following a cookie into a reply buffer
+ *
+ *	The entries are shown with their attributes when plus is set. The inode has to be opened to
+ *	get the attributes, but this saves the index search a lookup
+ *	would require, and the kernel request for it.
+ *
+ *	Returns the size of the formatted entries
+ */
+
+static size_t ntfs_fuse_fill_reply(fuse_req_t req,
+			ntfs_fuse_fill_context_t *fill, off_t off,
+			char *buf, size_t size, BOOL plus)
+{
+	struct SECURITY_CONTEXT security;
+	struct fuse_entry_param e;
+	ntfs_fuse_fill_entry_t *entry;
+#if !KERNELPERMS | (POSIXACLS & !KERNELACLS)
+	ntfs_inode *dir_ni;
+#endif
+	size_t len;
+	size_t sz;
+	BOOL full;
+	BOOL withattr;
+
+	withattr = plus;
+#if !KERNELPERMS | (POSIXACLS & !KERNELACLS)
+		/* as for a lookup, the directory must be searchable */
+	if (plus && ntfs_fuse_fill_security_context(req, &security)) {
+		dir_ni = ntfs_inode_open(ctx->vol, INODE(fill->ino));
+		if (!dir_ni
+		    || !ntfs_allowed_access(&security, dir_ni, S_IEXEC))
+			withattr = FALSE;
+		if (dir_ni)
+			ntfs_inode_close(dir_ni);
+	}
+#else
+	if (plus)
+		ntfs_fuse_fill_security_context(req, &security);
+#endif
+	len = 0;
+	full = FALSE;
+	while ((off >= 0) && (off < fill->off) && !full) {
+		entry = fill->cookies[off];
+		memset(&e, 0, sizeof(e));
+		e.attr.st_ino = entry->ino;
+		e.attr.st_mode = entry->mode;
+#ifdef FUSE_INTERNAL
+		if (plus) {
+			sz = fuse_add_direntry_plus(req, NULL, 0,
+				entry->name, &e, entry->off);
+			full = (len + sz) > size;
+				/*
+				 * Lookups are not counted on "."
+				 * and "..", and failing to get
+				 * attributes only returns the name.
+				 */
+			if (!full
+			    && withattr
+			    && strcmp(entry->name, ".")
+			    && strcmp(entry->name, "..")
+			    && !ntfs_fuse_fillstat(&security,
+						&e, entry->ino)) {
+				memset(&e, 0, sizeof(e));
+				e.attr.st_ino = entry->ino;
+				e.attr.st_mode = entry->mode;
+			}
+			if (!full)
+				fuse_add_direntry_plus(req, &buf[len],
+					size - len, entry->name,
+					&e, entry->off);
+		} else
+#endif /* FUSE_INTERNAL */
+		{
+			sz = fuse_add_direntry(req, &buf[len],
+				size - len, entry->name,
+				&e.attr, entry->off);
+			full = (len + sz) > size;
+		}
+		if (!full) {
+			len += sz;
+			off++;
+		}
+	}
+	return (len);
+}
+
+static void ntfs_fuse_readdir_common(fuse_req_t req, fuse_ino_t ino,
+			size_t size, off_t off, struct fuse_file_info *fi,
+			BOOL plus)
+{
+	ntfs_fuse_fill_item_t *first;
+	ntfs_fuse_fill_context_t *fill;
 	ntfs_inode *ni;
+	char *buf;
+	size_t len;
 	s64 pos = 0;
 	int err = 0;
 
@@ -1180,24 +1981,16 @@ static void ntfs_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 	if (fill && (fill->ino == ino)) {
 		if (fill->filled && !off) {
 			/* Rewinding : make sure to clear existing results */   
-			current = fill->first;
-			while (current) {
-				current = current->next;
-				free(fill->first);
-				fill->first = current;
-			}
-			fill->filled = FALSE;
+			ntfs_fuse_fill_clear(fill);
 		}
 		if (!fill->filled) {
 				/* initial call : build the full list */
-			current = (ntfs_fuse_fill_item_t*)NULL;
 			first = (ntfs_fuse_fill_item_t*)ntfs_malloc
 				(sizeof(ntfs_fuse_fill_item_t) + size);
 			if (first) {
 				first->bufsize = size;
 				first->off = 0;
 				first->next = (ntfs_fuse_fill_item_t*)NULL;
-				fill->req = req;
 				fill->first = first;
 				fill->last = first;
 				fill->off = 0;
@@ -1209,49 +2002,44 @@ static void ntfs_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 						(ntfs_filldir_t)
 							ntfs_fuse_filler))
 						err = -errno;
-					fill->filled = TRUE;
 					ntfs_fuse_update_times(ni,
 						NTFS_UPDATE_ATIME);
 					if (ntfs_inode_close(ni))
 						set_fuse_error(&err);
 				}
-				if (!err) {
-					off_t loc = 0;
 				/*
 				 * In some circumstances, the queue gets
 				 * reinitialized by releasedir() + opendir(),
 				 * apparently always on end of partial buffer.
-				 * Files may be missing or duplicated.
+				 * The listing is then resumed from the
+				 * cookie, files may be missing or duplicated.
 				 */
-					while (first
-					    && ((loc < off) || !first->off)) {
-						loc += first->off;
-						fill->first = first->next;
-						free(first);
-						first = fill->first;
-					}
-					current = first;
-				}
+				if (!err && ntfs_fuse_fill_index(fill))
+					err = -errno;
+				if (!err && ctx->mft_cache && (fill->off > 2))
+					ntfs_fuse_readahead(fill);
+				if (!err)
+					fill->filled = TRUE;
+				else
+					ntfs_fuse_fill_clear(fill);
 			} else
 				err = -errno;
-		} else {
-			/* subsequent call : return next non-empty buffer */
-			current = fill->first;
-			while (current && !current->off) {
-				current = current->next;
-				free(fill->first);
-				fill->first = current;
-			}
 		}
 		if (!err) {
-			if (current) {
-				fuse_reply_buf(req, current->buf, current->off);
-				fill->first = current->next;
-				free(current);
-			} else {
-				fuse_reply_buf(req, (char*)NULL, 0);
+			buf = (char*)ntfs_malloc(size);
+			if (buf) {
+				len = ntfs_fuse_fill_reply(req, fill, off,
+						buf, size, plus);
+				/*
+				 * Nothing from the list is used after
+				 * replying, a releasedir() may follow
+				 * immediately
+				 */
+				fuse_reply_buf(req, buf, len);
+				free(buf);
 				/* reply sent, now must exit with no error */
-			}
+			} else
+				err = -errno;
 		}
 	} else {
 		errno = EIO;
@@ -1262,6 +2050,183 @@ static void ntfs_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 		fuse_reply_err(req, -err);
 }
 
+static void ntfs_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			off_t off, struct fuse_file_info *fi)
+{
+	ntfs_fuse_readdir_common(req, ino, size, off, fi, FALSE);
+}
+
+#ifdef FUSE_INTERNAL
+
+static void ntfs_fuse_readdirplus(fuse_req_t req, fuse_ino_t ino,
+			size_t size, off_t off, struct fuse_file_info *fi)
+{
+	ntfs_fuse_readdir_common(req, ino, size, off, fi, TRUE);
+}
+
+#endif /* FUSE_INTERNAL */
+
+/*
+ *		Attach the open inode and data attribute to a new opening
+ *
+ *	All the openings of the same inode share the same structure,
+ *	so that the data attribute has a single state. The inode is
+ *	held, so that other requests get the same ntfs_inode.
+ *	No data is attached if the inode cannot be opened, the file
+ *	is then processed as if not open.
+ */
+
+static struct open_data *ntfs_fuse_attach_data(fuse_ino_t ino)
+{
+	struct open_file *of;
+	struct open_data *data;
+
+	for (of=ctx->open_files; of && (!of->data || (of->ino != ino));
+			of=of->next) { }
+	if (of) {
+		data = of->data;
+		data->count++;
+	} else {
+		data = (struct open_data*)ntfs_malloc(sizeof(struct open_data));
+		if (data) {
+			data->ni = ntfs_inode_open(ctx->vol, INODE(ino));
+			if (data->ni) {
+				ntfs_inode_hold(data->ni);
+				data->na = (ntfs_attr*)NULL;
+				data->dctx = (struct ntfs_system_decompression_ctx*)
+						NULL;
+				data->count = 1;
+				pthread_mutex_init(&data->lock, NULL);
+			} else {
+				free(data);
+				data = (struct open_data*)NULL;
+			}
+		}
+	}
+	return (data);
+}
+
+/*
+ *		Get the data attribute of an open file
+ *
+ *	The attribute is opened on first use with its full runlist
+ *	mapped, and kept open until the file is closed, or until the
+ *	attribute is changed by another handle.
+ *	When the attribute has several extents, which happens for huge
+ *	fragmented files, the runlist is only mapped when needed, and
+ *	released when it is growing too big.
+ *	Must be called with data->lock held.
+ *
+ *	Returns NULL if the attribute cannot be opened, with errno set
+ */
+
+static ntfs_attr *ntfs_fuse_get_data(struct open_data *data)
+{
+	if (!data->na) {
+		data->na = ntfs_attr_open(data->ni, AT_DATA, AT_UNNAMED, 0);
+		if (data->na
+		    && NAttrNonResident(data->na)
+		    && !NInoAttrList(data->ni)
+		    && ntfs_attr_map_whole_runlist(data->na)) {
+			ntfs_attr_close(data->na);
+			data->na = (ntfs_attr*)NULL;
+		}
+	}
+	return (data->na);
+}
+
+/*
+ *		Get the decompression context of a system-compressed file
+ *
+ *	The context is built on first use and kept until the file is
+ *	closed, so that the chunk offsets and the last decompressed
+ *	chunk are not read again for each read.
+ *	Must be called with data->lock held.
+ *
+ *	Returns NULL if the context cannot be built, with errno set
+ *		to EOPNOTSUPP if the file is not system-compressed
+ */
+
+static struct ntfs_system_decompression_ctx *ntfs_fuse_get_dctx(
+			struct open_data *data)
+{
+	if (!data->dctx)
+		data->dctx = ntfs_open_system_decompression_ctx(data->ni);
+	return (data->dctx);
+}
+
+/*
+ *		Close the data attribute kept open for an inode
+ *
+ *	This has to be done when the attribute has been changed through
+ *	another handle, so that it is reopened with up-to-date sizes
+ *	and runlist.
+ */
+
+static void ntfs_fuse_drop_data(fuse_ino_t ino)
+{
+	struct open_file *of;
+
+	for (of=ctx->open_files; of && (!of->data || (of->ino != ino));
+			of=of->next) { }
+	if (of && of->data->na) {
+		pthread_mutex_lock(&of->data->lock);
+		ntfs_attr_close(of->data->na);
+		of->data->na = (ntfs_attr*)NULL;
+		pthread_mutex_unlock(&of->data->lock);
+	}
+}
+
+/*
+ *		Write out the data buffered in the attribute kept open
+ *
+ *	This has to be done before the attribute is changed through
+ *	another handle, or when the data has to be on the device.
+ *
+ *	Returns 0 if successful, or -errno
+ */
+
+static int ntfs_fuse_flush_data(fuse_ino_t ino)
+{
+	struct open_file *of;
+	int res;
+
+	res = 0;
+	for (of=ctx->open_files; of && (!of->data || (of->ino != ino));
+			of=of->next) { }
+	if (of && of->data->na) {
+		pthread_mutex_lock(&of->data->lock);
+		if (of->data->na && ntfs_attr_flush(of->data->na))
+			res = -errno;
+		pthread_mutex_unlock(&of->data->lock);
+	}
+	return (res);
+}
+
+/*
+ *		Detach the open inode and data attribute from an opening
+ *
+ *	The inode is closed (and synced) when the last opening goes.
+ */
+
+static int ntfs_fuse_detach_data(struct open_data *data)
+{
+	int res;
+
+	res = 0;
+	if (!--data->count) {
+		if (data->na)
+			ntfs_attr_close(data->na);
+		if (data->dctx)
+			ntfs_close_system_decompression_ctx(data->dctx);
+		if (ntfs_inode_close(data->ni))
+			res = -errno;
+		pthread_mutex_destroy(&data->lock);
+		free(data);
+	}
+	return (res);
+}
+
 static void ntfs_fuse_open(fuse_req_t req, fuse_ino_t ino,
 		      struct fuse_file_info *fi)
 {
@@ -1313,6 +2278,16 @@ static void ntfs_fuse_open(fuse_req_t req, fuse_ino_t ino,
 			/* deny opening metadata files for writing */
 				if (ino < FILE_first_user)
 					res = -EPERM;
+			/* deny opening system-compressed files for writing */
+				if ((res >= 0)
+				    && (ni->flags & FILE_ATTR_REPARSE_POINT)) {
+					if (ntfs_get_system_compressed_file_size(
+							ni) >= 0)
+						res = -EPERM;
+					else
+						if (errno != EOPNOTSUPP)
+							res = -errno;
+				}
 			}
 			ntfs_attr_close(na);
 		} else
@@ -1328,6 +2303,7 @@ static void ntfs_fuse_open(fuse_req_t req, fuse_ino_t ino,
 			of->parent = 0;
 			of->ino = ino;
 			of->state = state;
+			of->data = ntfs_fuse_attach_data(ino);
 			of->next = ctx->open_files;
 			of->previous = (struct open_file*)NULL;
 			if (ctx->open_files)
@@ -1335,6 +2311,9 @@ static void ntfs_fuse_open(fuse_req_t req, fuse_ino_t ino,
 			ctx->open_files = of;
 			fi->fh = (long)of;
 		}
+			/* the data of an immutable volume never gets stale */
+		if (ctx->immutable)
+			fi->keep_cache = 1;
 	}
 	if (res)
 		fuse_reply_err(req, -res);
@@ -1342,33 +2321,214 @@ static void ntfs_fuse_open(fuse_req_t req, fuse_ino_t ino,
 		fuse_reply_open(req, fi);
 }
 
+#ifdef FUSE_INTERNAL
+
+#define SPLICE_BUFS 32		/* max count of segments of a spliced read */
+#define SPLICE_ZEROES 65536	/* max size of a segment of zeroes */
+
+static const char ntfs_fuse_zeroes[SPLICE_ZEROES];
+
+/*
+ *		Reply to a read from the MFT record
+ *
+ *	This is only possible for plain resident data, which is sent
+ *	straight from the record held in memory, with no intermediate
+ *	buffer. The range must be within the data size.
+ *
+ *	Returns 0 if a reply was sent (possibly an error),
+ *		-1 if this is not possible, and nothing was sent
+ */
+
+static int ntfs_fuse_resident_read(fuse_req_t req, ntfs_attr *na,
+			s64 offset, s64 size)
+{
+	const char *value;
+	u32 length;
+
+	if (NAttrNonResident(na)
+	    || (na->data_flags & (ATTR_COMPRESSION_MASK | ATTR_IS_ENCRYPTED))
+	    || ntfs_attr_pending_writes(na))
+		return (-1);
+	value = (const char*)ntfs_attr_peek(na->ni, na->type,
+				na->name, na->name_len, &length);
+	if (!value || ((offset + size) > length))
+		return (-1);
+	fuse_reply_buf(req, value + offset, size);
+	return (0);
+}
+
+/*
+ *		Reply to a read by splicing from the device
+ *
+ *	This is only possible for plain non-resident data, the
+ *	runlist is used to locate the requested range on the device,
+ *	and holes or the uninitialized end are sent as zeroes.
+ *	The range must be within the data size.
+ *
+ *	Returns 0 if a reply was sent (possibly an error),
+ *		-1 if splicing is not possible, and nothing was sent
+ */
+
+static int ntfs_fuse_splice_read(fuse_req_t req, ntfs_attr *na,
+			s64 offset, s64 size)
+{
+	struct fuse_buf bufv[SPLICE_BUFS];
+	ntfs_volume *vol;
+	runlist_element *rl;
+	s64 pos;
+	s64 end;
+	s64 len;
+	int count;
+	int fd;
+
+	vol = na->ni->vol;
+		/*
+		 * The raw data of encrypted files (efs_raw) is spliced up to
+		 * the end of the data, the padding and its size being read
+		 * as usual.
+		 */
+	if (!NAttrNonResident(na)
+	    || (na->data_flags & ATTR_COMPRESSION_MASK)
+	    || ((na->data_flags & ATTR_IS_ENCRYPTED)
+		&& (!vol->efs_raw
+		    || ((offset + size) > na->initialized_size)))
+	    || ntfs_attr_pending_writes(na))
+		return (-1);
+	fd = ntfs_device_fd_get(vol->dev);
+	if (fd < 0)
+		return (-1);
+	rl = (runlist_element*)NULL;
+	count = 0;
+	pos = offset;
+	end = offset + size;
+	while ((pos < end) && (count < SPLICE_BUFS)) {
+		len = end - pos;
+		if (pos >= na->initialized_size) {
+			bufv[count].mem = ntfs_fuse_zeroes;
+			if (len > SPLICE_ZEROES)
+				len = SPLICE_ZEROES;
+		} else {
+			if (!rl)
+				rl = ntfs_attr_find_vcn(na,
+					pos >> vol->cluster_size_bits);
+			while (rl && rl->length
+			    && (pos >= ((rl->vcn + rl->length)
+					<< vol->cluster_size_bits)))
+				rl++;
+				/* map the next extent if needed */
+			if (rl && rl->length && (rl->lcn == LCN_RL_NOT_MAPPED))
+				rl = ntfs_attr_find_vcn(na,
+					pos >> vol->cluster_size_bits);
+			if (!rl || !rl->length
+			    || ((rl->lcn < 0) && (rl->lcn != LCN_HOLE)))
+				return (-1);
+			if (len > (((rl->vcn + rl->length)
+					<< vol->cluster_size_bits) - pos))
+				len = ((rl->vcn + rl->length)
+					<< vol->cluster_size_bits) - pos;
+			if (len > (na->initialized_size - pos))
+				len = na->initialized_size - pos;
+			if (rl->lcn == LCN_HOLE) {
+				bufv[count].mem = ntfs_fuse_zeroes;
+				if (len > SPLICE_ZEROES)
+					len = SPLICE_ZEROES;
+			} else {
+				bufv[count].mem = (const void*)NULL;
+				bufv[count].fd = fd;
+				bufv[count].pos = ((rl->lcn - rl->vcn)
+					<< vol->cluster_size_bits) + pos;
+			}
+		}
+		bufv[count].size = len;
+		count++;
+		pos += len;
+	}
+	if (pos < end)
+		return (-1);
+	fuse_reply_data(req, bufv, count);
+	return (0);
+}
+
+#endif /* FUSE_INTERNAL */
+
 static void ntfs_fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size,
-			off_t offset,
-			struct fuse_file_info *fi __attribute__((unused)))
+			off_t offset, struct fuse_file_info *fi)
 {
 	ntfs_inode *ni = NULL;
 	ntfs_attr *na = NULL;
+	struct open_data *data;
 	int res;
 	char *buf = (char*)NULL;
 	s64 total = 0;
 	s64 max_read;
+	BOOL replied = FALSE;
 
+	data = (struct open_data*)NULL;
 	if (!size) {
 		res = 0;
 		goto exit;
 	}
-	buf = (char*)ntfs_malloc(size);
-	if (!buf) {
-		res = -errno;
-		goto exit;
+
+		/*
+		 * Use the attribute kept open, unless it is being used
+		 * by a concurrent read, in which case a private one is
+		 * opened on the same inode. However appended data which
+		 * has not been written yet is only in the attribute
+		 * kept open, so it has to be waited for.
+		 */
+	if (fi->fh)
+		data = ((struct open_file*)(long)fi->fh)->data;
+	if (data && pthread_mutex_trylock(&data->lock)) {
+		if (data->na && ntfs_attr_pending_writes(data->na))
+			pthread_mutex_lock(&data->lock);
+		else
+			data = (struct open_data*)NULL;
+	}
+	if (data)
+		ni = data->ni;
+	else {
+		ni = ntfs_inode_open(ctx->vol, INODE(ino));
+		if (!ni) {
+			res = -errno;
+			goto exit;
+		}
 	}
+		/*
+		 * A system-compressed file is read through its
+		 * decompression context, kept with the open inode.
+		 */
+	if (ni->flags & FILE_ATTR_REPARSE_POINT) {
+		struct ntfs_system_decompression_ctx *dctx;
 
-	ni = ntfs_inode_open(ctx->vol, INODE(ino));
-	if (!ni) {
-		res = -errno;
-		goto exit;
+		if (data)
+			dctx = ntfs_fuse_get_dctx(data);
+		else
+			dctx = ntfs_open_system_decompression_ctx(ni);
+		if (dctx) {
+			buf = (char*)ntfs_malloc(size);
+			if (buf) {
+				res = ntfs_read_system_compressed_data(dctx,
+						offset, size, buf);
+				if (res < 0)
+					res = -errno;
+				else
+					ntfs_fuse_update_times(ni,
+							NTFS_UPDATE_ATIME);
+			} else
+				res = -errno;
+			if (!data)
+				ntfs_close_system_decompression_ctx(dctx);
+			goto exit;
+		}
+		if (errno != EOPNOTSUPP) {
+			res = -errno;
+			goto exit;
+		}
 	}
-	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+	if (data)
+		na = ntfs_fuse_get_data(data);
+	else
+		na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
 	if (!na) {
 		res = -errno;
 		goto exit;
@@ -1388,6 +2548,25 @@ static void ntfs_fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 			goto ok;
 		size = max_read - offset;
 	}
+	if (size && !ntfs_fuse_resident_read(req, na, offset, size)) {
+		ntfs_fuse_update_times(na->ni, NTFS_UPDATE_ATIME);
+		res = size;
+		replied = TRUE;
+		goto exit;
+	}
+#ifdef FUSE_INTERNAL
+	if (size && !ntfs_fuse_splice_read(req, na, offset, size)) {
+		ntfs_fuse_update_times(na->ni, NTFS_UPDATE_ATIME);
+		res = size;
+		replied = TRUE;
+		goto exit;
+	}
+#endif /* FUSE_INTERNAL */
+	buf = (char*)ntfs_malloc(size ? size : 1);
+	if (!buf) {
+		res = -errno;
+		goto exit;
+	}
 	while (size > 0) {
 		s64 ret = ntfs_attr_pread(na, offset, size, buf + total);
 		if (ret != (s64)size)
@@ -1406,11 +2585,19 @@ ok:
 	ntfs_fuse_update_times(na->ni, NTFS_UPDATE_ATIME);
 	res = total;
 exit:
-	if (na)
-		ntfs_attr_close(na);
-	if (ntfs_inode_close(ni))
-		set_fuse_error(&res);
-	if (res < 0)
+	if (data) {
+		if (data->na)
+			ntfs_attr_release_runlist(data->na, RUNLIST_KEEP_MAX);
+		pthread_mutex_unlock(&data->lock);
+	} else {
+		if (na)
+			ntfs_attr_close(na);
+		if (ntfs_inode_close(ni))
+			set_fuse_error(&res);
+	}
+	if (replied)
+		;
+	else if (res < 0)
 		fuse_reply_err(req, -res);
 	else
 		fuse_reply_buf(req, buf, res);
@@ -1418,19 +2605,49 @@ exit:
 }
 
 static void ntfs_fuse_write(fuse_req_t req, fuse_ino_t ino, const char *buf, 
-			size_t size, off_t offset,
-			struct fuse_file_info *fi __attribute__((unused)))
+			size_t size, off_t offset, struct fuse_file_info *fi)
 {
 	ntfs_inode *ni = NULL;
 	ntfs_attr *na = NULL;
+	struct open_data *data;
 	int res, total = 0;
 
-	ni = ntfs_inode_open(ctx->vol, INODE(ino));
-	if (!ni) {
-		res = -errno;
-		goto exit;
+	data = (struct open_data*)NULL;
+	if (fi->fh)
+		data = ((struct open_file*)(long)fi->fh)->data;
+	if (data) {
+		pthread_mutex_lock(&data->lock);
+		ni = data->ni;
+		na = ntfs_fuse_get_data(data);
+			/*
+			 * Writing to compressed or encrypted data leaves
+			 * a state in the attribute : use a private one,
+			 * and have the kept one reopened.
+			 */
+		if (na && (na->data_flags
+				& (ATTR_COMPRESSION_MASK | ATTR_IS_ENCRYPTED))) {
+			ntfs_attr_close(na);
+			data->na = (ntfs_attr*)NULL;
+			pthread_mutex_unlock(&data->lock);
+			data = (struct open_data*)NULL;
+			ni = ntfs_inode_open(ctx->vol, INODE(ino));
+			if (!ni) {
+				res = -errno;
+				goto exit;
+			}
+			na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+		}
+			/* buffer appends, unless this is not supported */
+		if (na && data && ctx->write_buffer && !ctx->sync)
+			ntfs_attr_buffer_writes(na);
+	} else {
+		ni = ntfs_inode_open(ctx->vol, INODE(ino));
+		if (!ni) {
+			res = -errno;
+			goto exit;
+		}
+		na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
 	}
-	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
 	if (!na) {
 		res = -errno;
 		goto exit;
@@ -1452,12 +2669,23 @@ static void ntfs_fuse_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
 		     - sle64_to_cpu(ni->last_data_change_time)) > ctx->dmtime))
 		ntfs_fuse_update_times(na->ni, NTFS_UPDATE_MCTIME);
 exit:
-	if (na)
-		ntfs_attr_close(na);
 	if (total)
 		set_archive(ni);
-	if (ntfs_inode_close(ni))
-		set_fuse_error(&res);
+	if (data) {
+			/* do not keep an attribute in unknown state */
+		if ((res < 0) && data->na) {
+			ntfs_attr_close(data->na);
+			data->na = (ntfs_attr*)NULL;
+		}
+		if (data->na)
+			ntfs_attr_release_runlist(data->na, RUNLIST_KEEP_MAX);
+		pthread_mutex_unlock(&data->lock);
+	} else {
+		if (na)
+			ntfs_attr_close(na);
+		if (ntfs_inode_close(ni))
+			set_fuse_error(&res);
+	}
 	if (res < 0)
 		fuse_reply_err(req, -res);
 	else
@@ -1607,6 +2835,11 @@ static int ntfs_fuse_trunc(struct SECURITY_CONTEXT *scx, fuse_ino_t ino,
 		errno = EPERM;
 		goto exit;
 	}
+	res = ntfs_fuse_flush_data(ino);
+	if (res) {
+		errno = -res;
+		goto exit;
+	}
 	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
 	if (!na)
 		goto exit;
@@ -1644,6 +2877,9 @@ static int ntfs_fuse_trunc(struct SECURITY_CONTEXT *scx, fuse_ino_t ino,
 exit:
 	res = -errno;
 	ntfs_attr_close(na);
+		/* the attribute kept open by descriptors is outdated */
+	if (na)
+		ntfs_fuse_drop_data(ino);
 	if (ntfs_inode_close(ni))
 		set_fuse_error(&res);
 	return res;
@@ -1651,11 +2887,31 @@ exit:
 
 #if defined(HAVE_UTIMENSAT) & defined(FUSE_SET_ATTR_ATIME_NOW)
 
+/*
+ *		Set the times of a file
+ *
+ *	With the writeback cache, the kernel updates the times of written
+ *	files by itself, and later flushes them through an open file.
+ *	Setting the current time has to be accepted from any process
+ *	allowed to write (the file has been checked for writing when
+ *	opened), but setting explicit times still requires being the
+ *	owner, so that a writer cannot backdate the file.
+ */
+
 static int ntfs_fuse_utimens(struct SECURITY_CONTEXT *scx, fuse_ino_t ino,
-		struct stat *stin, struct stat *stbuf, int to_set)
+#if !KERNELPERMS | (POSIXACLS & !KERNELACLS)
+		struct stat *stin, struct stat *stbuf, int to_set,
+		BOOL opened)
+#else
+		struct stat *stin, struct stat *stbuf, int to_set,
+		BOOL opened __attribute__((unused)))
+#endif
 {
 	ntfs_inode *ni;
 	int res = 0;
+#if !KERNELPERMS | (POSIXACLS & !KERNELACLS)
+	BOOL explicit;
+#endif
 
 	ni = ntfs_inode_open(ctx->vol, INODE(ino));
 	if (!ni)
@@ -1664,13 +2920,21 @@ static int ntfs_fuse_utimens(struct SECURITY_CONTEXT *scx, fuse_ino_t ino,
 			/* no check or update if both UTIME_OMIT */
 	if (to_set & (FUSE_SET_ATTR_ATIME + FUSE_SET_ATTR_MTIME)) {
 #if !KERNELPERMS | (POSIXACLS & !KERNELACLS)
+		explicit = ((to_set & FUSE_SET_ATTR_ATIME)
+				&& !(to_set & FUSE_SET_ATTR_ATIME_NOW))
+			|| ((to_set & FUSE_SET_ATTR_MTIME)
+				&& !(to_set & FUSE_SET_ATTR_MTIME_NOW));
 		if (ntfs_allowed_as_owner(scx, ni)
-		    || ((to_set & FUSE_SET_ATTR_ATIME_NOW)
-			&& (to_set & FUSE_SET_ATTR_MTIME_NOW)
+		    || ((((to_set & FUSE_SET_ATTR_ATIME_NOW)
+			    && (to_set & FUSE_SET_ATTR_MTIME_NOW))
+			|| (opened && ctx->writeback_cache && !explicit))
 			&& ntfs_allowed_access(scx, ni, S_IWRITE))) {
 #endif
 			ntfs_time_update_flags mask = NTFS_UPDATE_CTIME;
 
+			if (to_set & (FUSE_SET_ATTR_ATIME
+					| FUSE_SET_ATTR_ATIME_NOW))
+				ntfs_fuse_cancel_atime(ni);
 			if (to_set & FUSE_SET_ATTR_ATIME_NOW)
 				mask |= NTFS_UPDATE_ATIME;
 			else
@@ -1735,6 +2999,7 @@ static int ntfs_fuse_utime(struct SECURITY_CONTEXT *scx, fuse_ino_t ino,
 			actime.tv_nsec = 0;
 			modtime.tv_sec = stin->st_mtime;
 			modtime.tv_nsec = 0;
+			ntfs_fuse_cancel_atime(ni);
 			ni->last_access_time = timespec2ntfs(actime);
 			ni->last_data_change_time = timespec2ntfs(modtime);
 			ntfs_fuse_update_times(ni, NTFS_UPDATE_CTIME);
@@ -1754,6 +3019,7 @@ static int ntfs_fuse_utime(struct SECURITY_CONTEXT *scx, fuse_ino_t ino,
 		actime.tv_nsec = 0;
 		modtime.tv_sec = stin->st_mtime;
 		modtime.tv_nsec = 0;
+		ntfs_fuse_cancel_atime(ni);
 		ni->last_access_time = timespec2ntfs(actime);
 		ni->last_data_change_time = timespec2ntfs(modtime);
 		ntfs_fuse_update_times(ni, NTFS_UPDATE_CTIME);
@@ -1843,7 +3109,8 @@ static void ntfs_fuse_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 						/* some set of atime/mtime */
 	if (!res && (to_set & (FUSE_SET_ATTR_ATIME + FUSE_SET_ATTR_MTIME))) {
 #if defined(HAVE_UTIMENSAT) & defined(FUSE_SET_ATTR_ATIME_NOW)
-		res = ntfs_fuse_utimens(&security, ino, attr, &stbuf, to_set);
+		res = ntfs_fuse_utimens(&security, ino, attr, &stbuf, to_set,
+					fi != (struct fuse_file_info*)NULL);
 #else /* defined(HAVE_UTIMENSAT) & defined(FUSE_SET_ATTR_ATIME_NOW) */
 		res = ntfs_fuse_utime(&security, ino, attr, &stbuf);
 #endif /* defined(HAVE_UTIMENSAT) & defined(FUSE_SET_ATTR_ATIME_NOW) */
@@ -2051,6 +3318,7 @@ exit:
 			of->parent = 0;
 			of->ino = e->ino;
 			of->state = state;
+			of->data = ntfs_fuse_attach_data(e->ino);
 			of->next = ctx->open_files;
 			of->previous = (struct open_file*)NULL;
 			if (ctx->open_files)
@@ -2319,6 +3587,7 @@ static int ntfs_fuse_rm(fuse_req_t req, fuse_ino_t parent, const char *name,
 					(struct fuse_entry_param*)NULL);
 			if (res)
 				goto out;
+			ntfs_fuse_notify(parent, ghostname);
 				/* now reopen then parent directory */
 			dir_ni = ntfs_inode_open(ctx->vol, INODE(parent));
 			if (!dir_ni) {
@@ -2334,6 +3603,7 @@ static int ntfs_fuse_rm(fuse_req_t req, fuse_ino_t parent, const char *name,
 			goto exit;
 		}
 	}
+	ntfs_fuse_notify_aliases(ni, parent);
 	if (ntfs_delete(ctx->vol, (char*)NULL, ni, dir_ni,
 				 uname, uname_len))
 		res = -errno;
@@ -2361,6 +3631,93 @@ static void ntfs_fuse_unlink(fuse_req_t req, fuse_ino_t parent,
 		fuse_reply_err(req, 0);
 }
 
+/*
+ *		Rename an inode, possibly to another directory
+ *
+ *	The new name must not exist. The permissions required are those
+ *	for unlinking the old name and for linking the new one.
+ */
+
+static int ntfs_fuse_move(fuse_req_t req __attribute__((unused)),
+			fuse_ino_t ino, fuse_ino_t parent, const char *name,
+			fuse_ino_t newparent, const char *newname)
+{
+	ntfschar *uname = NULL;
+	ntfschar *unewname = NULL;
+	ntfs_inode *dir_ni = NULL, *newdir_ni = NULL, *ni = NULL;
+	int res = 0, uname_len, unewname_len;
+#if !KERNELPERMS | (POSIXACLS & !KERNELACLS)
+	struct SECURITY_CONTEXT security;
+#endif
+
+	/* deny renaming metadata files */
+	if (ino < FILE_first_user)
+		return (-EPERM);
+	/* Generate unicode filenames. */
+	uname_len = ntfs_mbstoucs(name, &uname);
+	unewname_len = ntfs_mbstoucs(newname, &unewname);
+	if ((uname_len < 0)
+	    || (unewname_len < 0)
+	    || (ctx->windows_names
+		&& ntfs_forbidden_names(ctx->vol,unewname,unewname_len))) {
+		res = -errno;
+		goto exit;
+	}
+	/* Open the parent directories, once if they are the same */
+	dir_ni = ntfs_inode_open(ctx->vol, INODE(parent));
+	if (!dir_ni) {
+		res = -errno;
+		goto exit;
+	}
+	if (newparent == parent)
+		newdir_ni = dir_ni;
+	else {
+		newdir_ni = ntfs_inode_open(ctx->vol, INODE(newparent));
+		if (!newdir_ni) {
+			res = -errno;
+			goto exit;
+		}
+	}
+	ni = ntfs_inode_open(ctx->vol, INODE(ino));
+	if (!ni) {
+		res = -errno;
+		goto exit;
+	}
+
+#if !KERNELPERMS | (POSIXACLS & !KERNELACLS)
+	/* JPA the old name must be unlinkable, the new parent writeable */
+	if (ntfs_fuse_fill_security_context(req, &security)
+	    && (!ntfs_allowed_dir_access(&security, dir_ni, ino, ni,
+				S_IEXEC + S_IWRITE + S_ISVTX)
+		|| !ntfs_allowed_access(&security, newdir_ni,
+				S_IWRITE + S_IEXEC))) {
+		res = -EACCES;
+		goto exit;
+	}
+#endif
+	if (ntfs_rename(ctx->vol, (char*)NULL, ni, dir_ni, uname, uname_len,
+			newdir_ni, unewname, unewname_len)) {
+		res = -errno;
+		goto exit;
+	}
+	ntfs_inode_update_mbsname(newdir_ni, newname, ni->mft_no);
+	set_archive(ni);
+exit:
+	/* 
+	 * Must close the directories first otherwise
+	 * ntfs_inode_sync_file_name(ni) may fail.
+	 */
+	if ((newdir_ni != dir_ni) && ntfs_inode_close(newdir_ni))
+		set_fuse_error(&res);
+	if (ntfs_inode_close(dir_ni))
+		set_fuse_error(&res);
+	if (ntfs_inode_close(ni))
+		set_fuse_error(&res);
+	free(uname);
+	free(unewname);
+	return (res);
+}
+
 static int ntfs_fuse_safe_rename(fuse_req_t req, fuse_ino_t ino,
 			fuse_ino_t parent, const char *name, fuse_ino_t xino,
 			fuse_ino_t newparent, const char *newname,
@@ -2370,46 +3727,28 @@ static int ntfs_fuse_safe_rename(fuse_req_t req, fuse_ino_t ino,
 
 	ntfs_log_trace("Entering\n");
         
-	ret = ntfs_fuse_newlink(req, xino, newparent, tmp,
-				(struct fuse_entry_param*)NULL);
+		/* Set the existing target aside, to restore it on failure */
+	ret = ntfs_fuse_move(req, xino, newparent, newname, newparent, tmp);
 	if (ret)
 		return ret;
         
-	ret = ntfs_fuse_rm(req, newparent, newname, RM_ANY);
-	if (!ret) {
-	        
-		ret = ntfs_fuse_newlink(req, ino, newparent, newname,
-					(struct fuse_entry_param*)NULL);
-		if (ret)
-			goto restore;
-	        
-		ret = ntfs_fuse_rm(req, parent, name, RM_ANY);
-		if (ret) {
-			if (ntfs_fuse_rm(req, newparent, newname, RM_ANY))
-				goto err;
-			goto restore;
-		}
+	ret = ntfs_fuse_move(req, ino, parent, name, newparent, newname);
+	if (ret) {
+		if (ntfs_fuse_move(req, xino, newparent, tmp,
+					newparent, newname))
+			ntfs_log_perror("Rename failed. Existing file '%s' "
+				"was renamed to '%s'", newname, tmp);
+		return ret;
 	}
-        
-	goto cleanup;
-restore:
-	if (ntfs_fuse_newlink(req, xino, newparent, newname,
-				(struct fuse_entry_param*)NULL)) {
-err:
-		ntfs_log_perror("Rename failed. Existing file '%s' was renamed "
-				"to '%s'", newname, tmp);
-	} else {
-cleanup:
 		/*
 		 * Condition for this unlink has already been checked in
 		 * "ntfs_fuse_rename_existing_dest()", so it should never
 		 * fail (unless concurrent access to directories when fuse
 		 * is multithreaded)
 		 */
-		if (ntfs_fuse_rm(req, newparent, tmp, RM_ANY) < 0)
-			ntfs_log_perror("Rename failed. Existing file '%s' still present "
-				"as '%s'", newname, tmp);
-	}
+	if (ntfs_fuse_rm(req, newparent, tmp, RM_ANY) < 0)
+		ntfs_log_perror("Rename failed. Existing file '%s' still present "
+			"as '%s'", newname, tmp);
 	return	ret;
 }
 
@@ -2485,10 +3824,6 @@ static void ntfs_fuse_rename(fuse_req_t req, fuse_ino_t parent,
         
 	ntfs_log_debug("rename: old: '%s'  new: '%s'\n", name, newname);
         
-	/*
-	 *  FIXME: Rename should be atomic.
-	 */
-        
 	ino = ntfs_fuse_inode_lookup(parent, name);
 	if (ino == (fuse_ino_t)-1) {
 		ret = -errno;
@@ -2522,14 +3857,8 @@ static void ntfs_fuse_rename(fuse_req_t req, fuse_ino_t parent,
 		}
 	} else {
 			/* target does not exist */
-		ret = ntfs_fuse_newlink(req, ino, newparent, newname,
-					(struct fuse_entry_param*)NULL);
-		if (ret)
-			goto out;
-        
-		ret = ntfs_fuse_rm(req, parent, name, RM_ANY);
-		if (ret)
-			ntfs_fuse_rm(req, newparent, newname, RM_ANY);
+		ret = ntfs_fuse_move(req, ino, parent, name,
+					newparent, newname);
 	}
 out:
 	if (ret)
@@ -2548,13 +3877,12 @@ static void ntfs_fuse_release(fuse_req_t req, fuse_ino_t ino,
 	int res;
 
 	of = (struct open_file*)(long)fi->fh;
+	res = ntfs_fuse_flush_data(ino);
 	/* Only for marked descriptors there is something to do */
 	if (!of
 	    || !(of->state & (CLOSE_COMPRESSED
-				| CLOSE_ENCRYPTED | CLOSE_DMTIME))) {
-		res = 0;
+				| CLOSE_ENCRYPTED | CLOSE_DMTIME)))
 		goto out;
-	}
 	ni = ntfs_inode_open(ctx->vol, INODE(ino));
 	if (!ni) {
 		res = -errno;
@@ -2566,8 +3894,10 @@ static void ntfs_fuse_release(fuse_req_t req, fuse_ino_t ino,
 		goto exit;
 	}
 	res = 0;
-	if (of->state & CLOSE_DMTIME)
+	if (of->state & CLOSE_DMTIME) {
 		ntfs_inode_update_times(ni,NTFS_UPDATE_MCTIME);
+		ntfs_fuse_notify(ino, (const char*)NULL);
+	}
 	if (of->state & CLOSE_COMPRESSED)
 		res = ntfs_attr_pclose(na);
 #ifdef HAVE_SETXATTR	/* extended attributes interface required */
@@ -2579,12 +3909,18 @@ exit:
 		ntfs_attr_close(na);
 	if (ntfs_inode_close(ni))
 		set_fuse_error(&res);
+		/* the attribute kept open by other descriptors is outdated */
+	ntfs_fuse_drop_data(ino);
 out:    
 		/* remove the associate ghost file (even if release failed) */
 	if (of) {
+			/* the inode must not be held when deleting the ghost */
+		if (of->data && ntfs_fuse_detach_data(of->data))
+			set_fuse_error(&res);
 		if (of->state & CLOSE_GHOST) {
 			sprintf(ghostname,ghostformat,of->ghost);
 			ntfs_fuse_rm(req, of->parent, ghostname, RM_ANY);
+			ntfs_fuse_notify(of->parent, ghostname);
 		}
 			/* remove from open files list */
 		if (of->next)
@@ -2595,6 +3931,10 @@ out:
 			ctx->open_files = of->next;
 		free(of);
 	}
+	if (ntfs_fuse_atimes_due())
+		ntfs_fuse_flush_atimes();
+	ntfs_fuse_flush_file_names(FALSE);
+	ntfs_fuse_commit();
 	if (res)
 		fuse_reply_err(req, -res);
 	else
@@ -2626,19 +3966,135 @@ static void ntfs_fuse_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
 		fuse_reply_err(req, 0);
 }
 
-static void ntfs_fuse_fsync(fuse_req_t req,
-			fuse_ino_t ino __attribute__((unused)),
-			int type __attribute__((unused)),
+/*
+ *		Sync a file or directory
+ *
+ *	Only the modifications of the inode are written from the caches,
+ *	and with a non-zero @type (fdatasync(2)), an mft record only
+ *	modified for its times is not written.
+ */
+
+static void ntfs_fuse_fsync(fuse_req_t req, fuse_ino_t ino, int type,
 			struct fuse_file_info *fi __attribute__((unused)))
 {
-		/* sync the full device */
-	if (ntfs_device_sync(ctx->vol->dev))
-		fuse_reply_err(req, errno);
-	else
-		fuse_reply_err(req, 0);
+	ntfs_inode *ni;
+	int res;
+
+	if (instance->deferred_atimes.count)
+		ntfs_fuse_flush_atimes();
+	res = ntfs_fuse_flush_data(ino);
+	ni = ntfs_inode_open(ctx->vol, INODE(ino));
+	if (!ni)
+		res = -errno;
+	else {
+		if (!res && ntfs_inode_fsync(ni, type != 0))
+			res = -errno;
+		if (ntfs_inode_close(ni))
+			set_fuse_error(&res);
+	}
+	fuse_reply_err(req, -res);
 }
 
 #if defined(FUSE_INTERNAL) || (FUSE_VERSION >= 28)
+#ifdef NTFS_IOC_RMTREE
+
+/*
+ *		Check whether an inode is currently open, so that it is
+ *	not deleted along with a tree (there is no ghost for them)
+ */
+
+static BOOL ntfs_fuse_file_open(void *data __attribute__((unused)),
+			u64 mft_no)
+{
+	struct open_file *of;
+
+	for (of=ctx->open_files; of && (of->ino != mft_no); of=of->next) { }
+	return (of != (struct open_file*)NULL);
+}
+
+/*
+ *		Delete a directory tree designated by its name in a parent
+ *	directory, in a single operation
+ *
+ *	This is restricted to root, as the permissions on the directories
+ *	of the tree are not checked.
+ */
+
+static int ntfs_fuse_rmtree(fuse_req_t req, fuse_ino_t parent,
+			struct NTFS_RMTREE *rmt)
+{
+	ntfs_inode *dir_ni;
+	ntfs_inode *ni;
+	u64 iref;
+	u64 count;
+	int res;
+
+	if (fuse_req_ctx(req)->uid)
+		return (-EPERM);
+	rmt->name[NTFS_RMTREE_NAME_MAX - 1] = '\0';
+	if (!rmt->name[0] || strchr(rmt->name, '/')
+	    || !strcmp(rmt->name, ".") || !strcmp(rmt->name, ".."))
+		return (-EINVAL);
+	res = 0;
+	dir_ni = ntfs_inode_open(ctx->vol, INODE(parent));
+	if (!dir_ni)
+		return (-errno);
+	iref = ntfs_inode_lookup_by_mbsname(dir_ni, rmt->name);
+	if (iref == (u64)-1)
+		res = -errno;
+	else
+		if (MREF(iref) < FILE_first_user)
+			res = -EPERM;
+	ni = (ntfs_inode*)NULL;
+	if (!res) {
+		ni = ntfs_inode_open(ctx->vol, MREF(iref));
+		if (!ni)
+			res = -errno;
+	}
+	if (res) {
+		ntfs_inode_close(dir_ni);
+		return (res);
+	}
+	ntfs_fuse_notify_aliases(ni, parent);
+		/* both inodes are closed */
+	if (ntfs_delete_tree(ni, dir_ni, ntfs_fuse_file_open, NULL, &count))
+		res = -errno;
+	else
+		ntfs_fuse_notify(parent, rmt->name);
+	rmt->count = count;
+	return (res);
+}
+
+#endif /* NTFS_IOC_RMTREE */
+#ifdef NTFS_IOC_DEFRAG
+
+/*
+ *		Prepare for defragmenting a file or a directory
+ *
+ *	This is restricted to root, as the data of other users is moved.
+ *	The files whose compression or encryption is completed on closing
+ *	are not moved while open, and the data attribute kept open for
+ *	the other openings is closed, so that it is reopened with the
+ *	new runlist.
+ */
+
+static int ntfs_fuse_defrag_prepare(fuse_req_t req, fuse_ino_t ino)
+{
+	struct open_file *of;
+
+	if (fuse_req_ctx(req)->uid)
+		return (-EPERM);
+	for (of=ctx->open_files; of && ((of->ino != ino)
+			|| !(of->state & (CLOSE_COMPRESSED | CLOSE_ENCRYPTED)));
+			of=of->next) { }
+	if (of)
+		return (-EBUSY);
+	ntfs_fuse_drop_data(ino);
+	return (0);
+}
+
+#endif /* NTFS_IOC_DEFRAG */
+
 static void ntfs_fuse_ioctl(fuse_req_t req __attribute__((unused)),
 			fuse_ino_t ino __attribute__((unused)),
 			int cmd, void *arg,
@@ -2653,7 +4109,55 @@ static void ntfs_fuse_ioctl(fuse_req_t req __attribute__((unused)),
 
 	if (flags & FUSE_IOCTL_COMPAT) {
 		ret = -ENOSYS;
+#ifdef NTFS_IOC_RMTREE
+	} else if (cmd == (int)NTFS_IOC_RMTREE) {
+			/* issued on the parent directory, not on an inode */
+		if ((in_bufsz < sizeof(struct NTFS_RMTREE))
+		    || (out_bufsz < sizeof(struct NTFS_RMTREE)))
+			ret = -EINVAL;
+		else {
+			buf = ntfs_malloc(out_bufsz);
+			if (!buf)
+				ret = -ENOMEM;
+			else {
+				memcpy(buf, data, sizeof(struct NTFS_RMTREE));
+				ret = ntfs_fuse_rmtree(req, ino,
+						(struct NTFS_RMTREE*)buf);
+			}
+		}
+#endif /* NTFS_IOC_RMTREE */
+#if defined(FITRIM) && defined(BLKDISCARD)
+	} else if (cmd == (int)FITRIM) {
+			/* issued on any inode, only the volume matters */
+		if ((in_bufsz < sizeof(struct fstrim_range))
+		    || (out_bufsz < sizeof(struct fstrim_range)))
+			ret = -EINVAL;
+		else if (fuse_req_ctx(req)->uid)
+			ret = -EPERM;
+		else {
+			buf = ntfs_malloc(out_bufsz);
+			if (!buf)
+				ret = -ENOMEM;
+			else {
+				memcpy(buf, data, sizeof(struct fstrim_range));
+				ret = ntfs_fstrim(ctx->vol, buf);
+			}
+		}
+#endif /* defined(FITRIM) && defined(BLKDISCARD) */
 	} else {
+		ret = ntfs_fuse_flush_data(ino);
+#ifdef NTFS_IOC_DEFRAG
+		if (!ret && (cmd == (int)NTFS_IOC_DEFRAG))
+			ret = ntfs_fuse_defrag_prepare(req, ino);
+#endif /* NTFS_IOC_DEFRAG */
+#ifdef NTFS_IOC_REINDEX
+			/* all the names in the directory are rewritten */
+		if (!ret && (cmd == (int)NTFS_IOC_REINDEX)
+		    && fuse_req_ctx(req)->uid)
+			ret = -EPERM;
+#endif /* NTFS_IOC_REINDEX */
+		if (ret)
+			goto fail;
 		ni = ntfs_inode_open(ctx->vol, INODE(ino));
 		if (!ni) {
 			ret = -errno;
@@ -2668,7 +4172,25 @@ static void ntfs_fuse_ioctl(fuse_req_t req __attribute__((unused)),
 			}
 			memcpy(buf, data, in_bufsz);
 		}
-		ret = ntfs_ioctl(ni, cmd, arg, flags, buf);
+#if defined(FS_IOC_FIEMAP) && defined(HAVE_LINUX_FIEMAP_H)
+			/* only record the extents which fit in the reply */
+		if (cmd == (int)FS_IOC_FIEMAP) {
+			struct fiemap *fm = (struct fiemap*)buf;
+			size_t room;
+
+			if ((in_bufsz < sizeof(struct fiemap))
+			    || (out_bufsz < sizeof(struct fiemap)))
+				ret = -EINVAL;
+			else {
+				room = (out_bufsz - sizeof(struct fiemap))
+					/ sizeof(struct fiemap_extent);
+				if (fm->fm_extent_count > room)
+					fm->fm_extent_count = room;
+			}
+		}
+#endif
+		if (!ret)
+			ret = ntfs_ioctl(ni, cmd, arg, flags, buf);
 		if (ntfs_inode_close (ni))
 			set_fuse_error(&ret);
 	}
@@ -2682,6 +4204,220 @@ fail :
 }
 #endif /* defined(FUSE_INTERNAL) || (FUSE_VERSION >= 28) */
 
+#if defined(FUSE_INTERNAL) || (FUSE_VERSION >= 29)
+
+/*
+ *		Allocate or deallocate space to a file
+ *
+ *	Preallocated clusters are not zeroed, they are beyond the
+ *	initialized size, and punched clusters are freed.
+ */
+
+static void ntfs_fuse_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+			off_t offset, off_t length,
+			struct fuse_file_info *fi __attribute__((unused)))
+{
+	ntfs_inode *ni = NULL;
+	ntfs_attr *na = NULL;
+	s64 oldsize;
+	int res;
+
+	if ((mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+	    || ((mode & FALLOC_FL_PUNCH_HOLE)
+		&& !(mode & FALLOC_FL_KEEP_SIZE))) {
+		errno = EOPNOTSUPP;
+		goto exit;
+	}
+	if ((offset < 0) || (length <= 0)) {
+		errno = EINVAL;
+		goto exit;
+	}
+	/* deny allocating to metadata files */
+	if (ino < FILE_first_user) {
+		errno = EPERM;
+		goto exit;
+	}
+	res = ntfs_fuse_flush_data(ino);
+	if (res) {
+		errno = -res;
+		goto exit;
+	}
+	ni = ntfs_inode_open(ctx->vol, INODE(ino));
+	if (!ni)
+		goto exit;
+	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+	if (!na)
+		goto exit;
+	oldsize = na->data_size;
+	if (mode & FALLOC_FL_PUNCH_HOLE)
+		res = ntfs_attr_punch_hole(na, offset, length);
+	else
+		res = ntfs_attr_fallocate(na, offset, length,
+				(mode & FALLOC_FL_KEEP_SIZE) != 0);
+	if (res)
+		goto exit;
+	if ((mode & FALLOC_FL_PUNCH_HOLE) || (na->data_size != oldsize)) {
+		set_archive(ni);
+		ntfs_fuse_update_times(ni, NTFS_UPDATE_MCTIME);
+	} else
+		ntfs_fuse_update_times(ni, NTFS_UPDATE_CTIME);
+	errno = 0;
+exit:
+	res = -errno;
+	ntfs_attr_close(na);
+		/* the attribute kept open by descriptors is outdated */
+	if (na)
+		ntfs_fuse_drop_data(ino);
+	if (ni && ntfs_inode_close(ni))
+		set_fuse_error(&res);
+	fuse_reply_err(req, -res);
+}
+
+#endif /* defined(FUSE_INTERNAL) || (FUSE_VERSION >= 29) */
+
+#if defined(FUSE_INTERNAL) && defined(SEEK_DATA) && defined(SEEK_HOLE)
+
+/*
+ *		Find the next data or hole, for SEEK_DATA and SEEK_HOLE
+ */
+
+static void ntfs_fuse_lseek(fuse_req_t req, fuse_ino_t ino, off_t off,
+			int whence, struct fuse_file_info *fi __attribute__((unused)))
+{
+	ntfs_inode *ni = NULL;
+	ntfs_attr *na = NULL;
+	s64 pos;
+	int res;
+
+	pos = -1;
+	if ((whence != SEEK_DATA) && (whence != SEEK_HOLE)) {
+		errno = EINVAL;
+		goto exit;
+	}
+		/* buffered appends have to be located */
+	res = ntfs_fuse_flush_data(ino);
+	if (res) {
+		errno = -res;
+		goto exit;
+	}
+	ni = ntfs_inode_open(ctx->vol, INODE(ino));
+	if (!ni)
+		goto exit;
+		/* the sparse data of a system-compressed file is a stub */
+	if ((ni->flags & FILE_ATTR_REPARSE_POINT)
+	    && (ntfs_get_system_compressed_file_size(ni) >= 0)) {
+		if (off < ni->data_size)
+			pos = (whence == SEEK_HOLE ? ni->data_size : off);
+		else
+			errno = ENXIO;
+		goto exit;
+	}
+	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+	if (!na)
+		goto exit;
+	pos = ntfs_attr_seek_hole_data(na, off, whence == SEEK_HOLE);
+exit:
+	res = (pos < 0 ? -errno : 0);
+	ntfs_attr_close(na);
+	if (ni && ntfs_inode_close(ni))
+		set_fuse_error(&res);
+	if (res)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_lseek(req, pos);
+}
+
+#endif /* defined(FUSE_INTERNAL) && defined(SEEK_DATA) && ... */
+
+#ifdef FUSE_INTERNAL
+
+/*
+ *		Copy data from a file to another one inside the volume
+ *
+ *	The data does not go through fuse, and the holes are kept.
+ */
+
+static void ntfs_fuse_copy_file_range(fuse_req_t req, fuse_ino_t ino_in,
+			off_t off_in,
+			struct fuse_file_info *fi_in __attribute__((unused)),
+			fuse_ino_t ino_out, off_t off_out,
+			struct fuse_file_info *fi_out __attribute__((unused)),
+			size_t len, int flags)
+{
+	ntfs_inode *ni_in = NULL;
+	ntfs_inode *ni_out = NULL;
+	ntfs_attr *na_in = NULL;
+	ntfs_attr *na_out = NULL;
+	s64 copied;
+	int res;
+
+	copied = -1;
+	if (flags || (off_in < 0) || (off_out < 0)) {
+		errno = EINVAL;
+		goto exit;
+	}
+	/* deny writing to metadata files */
+	if (ino_out < FILE_first_user) {
+		errno = EPERM;
+		goto exit;
+	}
+	res = ntfs_fuse_flush_data(ino_in);
+	if (!res && (ino_out != ino_in))
+		res = ntfs_fuse_flush_data(ino_out);
+	if (res) {
+		errno = -res;
+		goto exit;
+	}
+	ni_in = ntfs_inode_open(ctx->vol, INODE(ino_in));
+	if (!ni_in)
+		goto exit;
+		/* let the kernel copy system-compressed data by reading */
+	if ((ni_in->flags & FILE_ATTR_REPARSE_POINT)
+	    && (ntfs_get_system_compressed_file_size(ni_in) >= 0)) {
+		errno = EOPNOTSUPP;
+		goto exit;
+	}
+	na_in = ntfs_attr_open(ni_in, AT_DATA, AT_UNNAMED, 0);
+	if (!na_in)
+		goto exit;
+	if (ino_out != ino_in) {
+		ni_out = ntfs_inode_open(ctx->vol, INODE(ino_out));
+		if (!ni_out)
+			goto exit;
+		na_out = ntfs_attr_open(ni_out, AT_DATA, AT_UNNAMED, 0);
+		if (!na_out)
+			goto exit;
+	}
+	copied = ntfs_attr_copy_range(na_in, off_in,
+			(na_out ? na_out : na_in), off_out, len);
+	if (copied > 0) {
+		set_archive(na_out ? ni_out : ni_in);
+		ntfs_fuse_update_times(na_out ? ni_out : ni_in,
+				NTFS_UPDATE_MCTIME);
+		if (na_out)
+			ntfs_fuse_update_times(ni_in, NTFS_UPDATE_ATIME);
+	}
+exit:
+	res = (copied < 0 ? -errno : 0);
+	ntfs_attr_close(na_out);
+		/* the attribute kept open by descriptors is outdated */
+	if (na_out)
+		ntfs_fuse_drop_data(ino_out);
+	if (ni_out && ntfs_inode_close(ni_out))
+		set_fuse_error(&res);
+	ntfs_attr_close(na_in);
+	if (na_in && !ni_out)
+		ntfs_fuse_drop_data(ino_in);
+	if (ni_in && ntfs_inode_close(ni_in))
+		set_fuse_error(&res);
+	if (res)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_write(req, copied);
+}
+
+#endif /* FUSE_INTERNAL */
+
 static void ntfs_fuse_bmap(fuse_req_t req, fuse_ino_t ino, size_t blocksize,
 		      uint64_t vidx)
 {
@@ -2906,7 +4642,6 @@ static int fix_xattr_prefix(const char *name, int namespace, ntfschar **lename)
 
 static void ntfs_fuse_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
 {
-	ntfs_attr_search_ctx *actx = NULL;
 	ntfs_inode *ni;
 	char *list = (char*)NULL;
 	int ret = 0;
@@ -2932,11 +4667,6 @@ static void ntfs_fuse_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
 		goto exit;
 	}
 #endif
-	actx = ntfs_attr_get_search_ctx(ni, NULL);
-	if (!actx) {
-		ret = -errno;
-		goto exit;
-	}
 	if (size) {
 		list = (char*)malloc(size);
 		if (!list) {
@@ -2946,17 +4676,10 @@ static void ntfs_fuse_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
 	}
 
 	if ((ctx->streams == NF_STREAMS_INTERFACE_XATTR)
-	    || (ctx->streams == NF_STREAMS_INTERFACE_OPENXATTR)) {
-		ret = ntfs_fuse_listxattr_common(ni, actx, list, size,
+	    || (ctx->streams == NF_STREAMS_INTERFACE_OPENXATTR))
+		ret = ntfs_fuse_listxattr_common(ni, list, size,
 				ctx->streams == NF_STREAMS_INTERFACE_XATTR);
-		if (ret < 0)
-			goto exit;
-	}
-	if (errno != ENOENT)
-		ret = -errno;
 exit:
-	if (actx)
-		ntfs_attr_put_search_ctx(actx);
 	if (ntfs_inode_close(ni))
 		set_fuse_error(&ret);
 out :
@@ -2970,6 +4693,73 @@ out :
 	free(list);
 }
 
+/*
+ *		Get the statistics of the mount as a text
+ *
+ *	They are made of counts and log2 histograms of the time spent in
+ *	each fuse operation, followed by the statistics of the device,
+ *	the cluster allocator and the caches.
+ *	As the statistics change between requests, some margin is added
+ *	to the size returned to a size query.
+ */
+
+#define STATS_SIZE 65536
+#define STATS_MARGIN 4096
+#define STATS_OPS 64 /* more than the fuse operations */
+
+static const char nf_ns_stats_xattr[] = "system.ntfs_stats";
+
+static void ntfs_fuse_getstats(fuse_req_t req, size_t size)
+{
+	struct fuse_op_stats *stats;
+	char *text;
+	size_t len;
+	int count;
+	int i;
+	int n;
+
+	text = (char*)ntfs_malloc(STATS_SIZE);
+	stats = (struct fuse_op_stats*)ntfs_malloc(
+				STATS_OPS*sizeof(struct fuse_op_stats));
+	if (!text || !stats) {
+		fuse_reply_err(req, ENOMEM);
+		goto out;
+	}
+	len = 0;
+	count = fuse_req_stats(req, stats, STATS_OPS);
+	for (i=0; i<count; i++) {
+		if (!stats[i].count)
+			continue;
+		len += snprintf(&text[len], STATS_SIZE - len,
+			"%-15s %10llu ops %14llu us :",
+			stats[i].name, stats[i].count, stats[i].total_us);
+		for (n=0; (n<FUSE_STATS_BUCKETS) && (len<STATS_SIZE); n++)
+			if (stats[i].buckets[n])
+				len += snprintf(&text[len], STATS_SIZE - len,
+					" <%lluus:%llu", 2ULL << n,
+					stats[i].buckets[n]);
+		if (len < STATS_SIZE)
+			len += snprintf(&text[len], STATS_SIZE - len, "\n");
+		if (len >= STATS_SIZE)
+			break;
+	}
+	if (len < STATS_SIZE)
+		len += ntfs_fuse_volume_stats(ctx->vol, &text[len],
+					STATS_SIZE - len);
+	if (len >= STATS_SIZE)
+		len = STATS_SIZE - 1;
+	if (!size)
+		fuse_reply_xattr(req, len + STATS_MARGIN);
+	else
+		if (len > size)
+			fuse_reply_err(req, ERANGE);
+		else
+			fuse_reply_buf(req, text, len);
+out :
+	free(stats);
+	free(text);
+}
+
 static void ntfs_fuse_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
 			  size_t size)
 {
@@ -2985,6 +4775,10 @@ static void ntfs_fuse_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
 	int namespace;
 	struct SECURITY_CONTEXT security;
 
+	if ((INODE(ino) == FILE_root) && !strcmp(name, nf_ns_stats_xattr)) {
+		ntfs_fuse_getstats(req, size);
+		return;
+	}
 	attr = ntfs_xattr_system_type(name,ctx->vol);
 	if (attr != XATTR_UNMAPPED) {
 		/*
@@ -3088,7 +4882,7 @@ static void ntfs_fuse_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
 		res = -errno;
 		goto exit;
 	}
-	na = ntfs_attr_open(ni, AT_DATA, lename, lename_len);
+	na = ntfs_stream_open(ni, lename, lename_len);
 	if (!na) {
 		res = -ENODATA;
 		goto exit;
@@ -3112,7 +4906,7 @@ static void ntfs_fuse_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
 		res = rsize;
 exit:
 	if (na)
-		ntfs_attr_close(na);
+		ntfs_stream_close(na);
 	free(lename);
 	if (ntfs_inode_close(ni))
 		set_fuse_error(&res);
@@ -3142,6 +4936,12 @@ static void ntfs_fuse_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
 	int namespace;
 	struct SECURITY_CONTEXT security;
 
+		/* the file flags or sizes may be changed */
+	res = ntfs_fuse_flush_data(ino);
+	if (res) {
+		fuse_reply_err(req, -res);
+		return;
+	}
 	attr = ntfs_xattr_system_type(name,ctx->vol);
 	if (attr != XATTR_UNMAPPED) {
 		/*
@@ -3221,6 +5021,8 @@ static void ntfs_fuse_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
 		    && fuse_lowlevel_notify_inval_inode(ctx->fc, ino, -1, 0))
 			res = -errno;
 #endif
+			/* the data attribute may have changed (eg efs info) */
+		ntfs_fuse_drop_data(ino);
 		if (res < 0)
 			fuse_reply_err(req, -res);
 		else
@@ -3294,7 +5096,7 @@ static void ntfs_fuse_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
 		res = -errno;
 		goto exit;
 	}
-	na = ntfs_attr_open(ni, AT_DATA, lename, lename_len);
+	na = ntfs_stream_open(ni, lename, lename_len);
 	if (na && flags == XATTR_CREATE) {
 		res = -EEXIST;
 		goto exit;
@@ -3312,7 +5114,7 @@ static void ntfs_fuse_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
 			set_archive(ni);
 			NInoFileNameSetDirty(ni);
 		}
-		na = ntfs_attr_open(ni, AT_DATA, lename, lename_len);
+		na = ntfs_stream_open(ni, lename, lename_len);
 		if (!na) {
 			res = -errno;
 			goto exit;
@@ -3351,8 +5153,12 @@ static void ntfs_fuse_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
 		}
 	}
 exit:
-	if (na)
-		ntfs_attr_close(na);
+	if (na) {
+		if (res)
+			ntfs_attr_close(na);
+		else
+			ntfs_stream_close(na);
+	}
 	free(lename);
 	if (ntfs_inode_close(ni))
 		set_fuse_error(&res);
@@ -3578,9 +5384,14 @@ static void ntfs_close(void)
 	if (!ctx->vol)
 		return;
         
+#ifdef FUSE_INTERNAL
+	ntfs_fuse_leave_pool();
+#endif
 	if (ctx->mounted) {
-		ntfs_log_info("Unmounting %s (%s)\n", opts.device, 
+		ntfs_log_info("Unmounting %s (%s)\n", instance->opts.device, 
 			      ctx->vol->vol_name);
+		if (instance->deferred_atimes.count)
+			ntfs_fuse_flush_atimes();
 		if (ntfs_fuse_fill_security_context((fuse_req_t)NULL, &security)) {
 			if (ctx->seccache && ctx->seccache->head.p_reads) {
 				ntfs_log_info("Permissions cache : %lu writes, "
@@ -3594,63 +5405,418 @@ static void ntfs_close(void)
 			}
 		}
 		ntfs_close_secure(&security);
+		ntfs_fuse_log_lru_caches(ctx->vol);
+		if (ctx->mount_cache && !ctx->mount_cache_loaded)
+			ntfs_fuse_save_mount_cache(ctx->vol, ctx->mount_cache);
 	}
         
 	if (ntfs_umount(ctx->vol, FALSE))
-		ntfs_log_perror("Failed to close volume %s", opts.device);
+		ntfs_log_perror("Failed to close volume %s",
+				instance->opts.device);
         
 	ctx->vol = NULL;
 }
 
-static void ntfs_fuse_destroy2(void *notused __attribute__((unused)))
+static void ntfs_fuse_destroy2(void *notused __attribute__((unused)))
+{
+	ntfs_close();
+}
+
+static struct fuse_lowlevel_ops ntfs_3g_ops = {
+	.lookup 	= ntfs_fuse_lookup,
+	.getattr	= ntfs_fuse_getattr,
+	.readlink	= ntfs_fuse_readlink,
+	.opendir	= ntfs_fuse_opendir,
+	.readdir	= ntfs_fuse_readdir,
+#ifdef FUSE_INTERNAL
+	.readdirplus	= ntfs_fuse_readdirplus,
+#endif /* FUSE_INTERNAL */
+	.releasedir	= ntfs_fuse_releasedir,
+	.open		= ntfs_fuse_open,
+	.release	= ntfs_fuse_release,
+	.read		= ntfs_fuse_read,
+	.write		= ntfs_fuse_write,
+	.setattr	= ntfs_fuse_setattr,
+	.statfs 	= ntfs_fuse_statfs,
+	.create 	= ntfs_fuse_create_file,
+	.mknod		= ntfs_fuse_mknod,
+	.symlink	= ntfs_fuse_symlink,
+	.link		= ntfs_fuse_link,
+	.unlink 	= ntfs_fuse_unlink,
+	.rename 	= ntfs_fuse_rename,
+	.mkdir		= ntfs_fuse_mkdir,
+	.rmdir		= ntfs_fuse_rmdir,
+	.fsync		= ntfs_fuse_fsync,
+	.fsyncdir	= ntfs_fuse_fsync,
+	.bmap		= ntfs_fuse_bmap,
+	.destroy	= ntfs_fuse_destroy2,
+#if defined(FUSE_INTERNAL) || (FUSE_VERSION >= 28)
+	.ioctl		= ntfs_fuse_ioctl,
+#endif /* defined(FUSE_INTERNAL) || (FUSE_VERSION >= 28) */
+#if defined(FUSE_INTERNAL) || (FUSE_VERSION >= 29)
+	.fallocate	= ntfs_fuse_fallocate,
+#endif /* defined(FUSE_INTERNAL) || (FUSE_VERSION >= 29) */
+#if defined(FUSE_INTERNAL) && defined(SEEK_DATA) && defined(SEEK_HOLE)
+	.lseek		= ntfs_fuse_lseek,
+#endif /* defined(FUSE_INTERNAL) && defined(SEEK_DATA) && ... */
+#ifdef FUSE_INTERNAL
+	.copy_file_range = ntfs_fuse_copy_file_range,
+#endif /* FUSE_INTERNAL */
+#if !KERNELPERMS | (POSIXACLS & !KERNELACLS)
+	.access 	= ntfs_fuse_access,
+#endif
+#ifdef HAVE_SETXATTR
+	.getxattr	= ntfs_fuse_getxattr,
+	.setxattr	= ntfs_fuse_setxattr,
+	.removexattr	= ntfs_fuse_removexattr,
+	.listxattr	= ntfs_fuse_listxattr,
+#endif /* HAVE_SETXATTR */
+#if 0 && (defined(__APPLE__) || defined(__DARWIN__)) /* Unfinished. */
+	/* MacFUSE extensions. */
+	.getxtimes	= ntfs_macfuse_getxtimes,
+	.setcrtime	= ntfs_macfuse_setcrtime,
+	.setbkuptime	= ntfs_macfuse_setbkuptime,
+	.setchgtime	= ntfs_macfuse_setchgtime,
+#endif /* defined(__APPLE__) || defined(__DARWIN__) */
+	.init		= ntfs_init
+};
+
+/*
+ *		Locked variants of the operations, for the multithreaded loop
+ */
+
+static void ntfs_fuse_mt_lookup(fuse_req_t req, fuse_ino_t parent,
+			const char *name)
+{
+	ntfs_fuse_lock_shared();
+	ntfs_fuse_lookup(req, parent, name);
+	ntfs_fuse_unlock();
+}
+
+static void ntfs_fuse_mt_getattr(fuse_req_t req, fuse_ino_t ino,
+			struct fuse_file_info *fi)
+{
+	ntfs_fuse_lock_shared();
+	ntfs_fuse_getattr(req, ino, fi);
+	ntfs_fuse_unlock();
+}
+
+static void ntfs_fuse_mt_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+	ntfs_fuse_lock_shared();
+	ntfs_fuse_readlink(req, ino);
+	ntfs_fuse_unlock();
+}
+
+static void ntfs_fuse_mt_opendir(fuse_req_t req, fuse_ino_t ino,
+			struct fuse_file_info *fi)
+{
+	ntfs_fuse_lock_shared();
+		/* deferred directory entries can only be written exclusively */
+	if (ntfs_inode_file_names_pending(ctx->vol)) {
+		ntfs_volume_unlock(ctx->vol);
+		ntfs_fuse_lock_exclusive();
+	}
+	ntfs_fuse_opendir(req, ino, fi);
+	ntfs_fuse_unlock();
+}
+
+static void ntfs_fuse_mt_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			off_t off, struct fuse_file_info *fi)
+{
+	ntfs_fuse_lock_shared();
+	ntfs_fuse_readdir(req, ino, size, off, fi);
+	ntfs_fuse_unlock();
+}
+
+#ifdef FUSE_INTERNAL
+static void ntfs_fuse_mt_readdirplus(fuse_req_t req, fuse_ino_t ino,
+			size_t size, off_t off, struct fuse_file_info *fi)
+{
+	ntfs_fuse_lock_shared();
+	ntfs_fuse_readdirplus(req, ino, size, off, fi);
+	ntfs_fuse_unlock();
+}
+#endif /* FUSE_INTERNAL */
+
+static void ntfs_fuse_mt_releasedir(fuse_req_t req, fuse_ino_t ino,
+			struct fuse_file_info *fi)
+{
+	ntfs_fuse_lock_shared();
+	ntfs_fuse_releasedir(req, ino, fi);
+	ntfs_fuse_unlock();
+}
+
+static void ntfs_fuse_mt_open(fuse_req_t req, fuse_ino_t ino,
+			struct fuse_file_info *fi)
+{
+	ntfs_fuse_lock_exclusive();
+	ntfs_fuse_open(req, ino, fi);
+	ntfs_fuse_unlock();
+}
+
+static void ntfs_fuse_mt_release(fuse_req_t req, fuse_ino_t ino,
+			struct fuse_file_info *fi)
+{
+	ntfs_fuse_lock_exclusive();
+	ntfs_fuse_release(req, ino, fi);
+	ntfs_fuse_unlock();
+}
+
+static void ntfs_fuse_mt_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+			off_t offset, struct fuse_file_info *fi)
+{
+	ntfs_fuse_lock_shared();
+	ntfs_fuse_read(req, ino, size, offset, fi);
+	ntfs_fuse_unlock();
+}
+
+static void ntfs_fuse_mt_write(fuse_req_t req, fuse_ino_t ino,
+			const char *buf, size_t size, off_t offset,
+			struct fuse_file_info *fi)
+{
+	ntfs_fuse_lock_exclusive();
+	ntfs_fuse_write(req, ino, buf, size, offset, fi);
+	ntfs_fuse_unlock();
+}
+
+static void ntfs_fuse_mt_setattr(fuse_req_t req, fuse_ino_t ino,
+			struct stat *attr, int to_set,
+			struct fuse_file_info *fi)
+{
+	ntfs_fuse_lock_exclusive();
+	ntfs_fuse_setattr(req, ino, attr, to_set, fi);
+	ntfs_fuse_unlock();
+}
+
+static void ntfs_fuse_mt_create_file(fuse_req_t req, fuse_ino_t parent,
+			const char *name, mode_t mode,
+			struct fuse_file_info *fi)
+{
+	ntfs_fuse_lock_exclusive();
+	ntfs_fuse_create_file(req, parent, name, mode, fi);
+	ntfs_fuse_unlock();
+}
+
+static void ntfs_fuse_mt_mknod(fuse_req_t req, fuse_ino_t parent,
+			const char *name, mode_t mode, dev_t rdev)
+{
+	ntfs_fuse_lock_exclusive();
+	ntfs_fuse_mknod(req, parent, name, mode, rdev);
+	ntfs_fuse_unlock();
+}
+
+static void ntfs_fuse_mt_symlink(fuse_req_t req, const char *target,
+			fuse_ino_t parent, const char *name)
+{
+	ntfs_fuse_lock_exclusive();
+	ntfs_fuse_symlink(req, target, parent, name);
+	ntfs_fuse_unlock();
+}
+
+static void ntfs_fuse_mt_link(fuse_req_t req, fuse_ino_t ino,
+			fuse_ino_t newparent, const char *newname)
+{
+	ntfs_fuse_lock_exclusive();
+	ntfs_fuse_link(req, ino, newparent, newname);
+	ntfs_fuse_unlock();
+}
+
+static void ntfs_fuse_mt_unlink(fuse_req_t req, fuse_ino_t parent,
+			const char *name)
+{
+	ntfs_fuse_lock_exclusive();
+	ntfs_fuse_unlink(req, parent, name);
+	ntfs_fuse_unlock();
+}
+
+static void ntfs_fuse_mt_rename(fuse_req_t req, fuse_ino_t parent,
+			const char *name, fuse_ino_t newparent,
+			const char *newname)
+{
+	ntfs_fuse_lock_exclusive();
+	ntfs_fuse_rename(req, parent, name, newparent, newname);
+	ntfs_fuse_unlock();
+}
+
+static void ntfs_fuse_mt_mkdir(fuse_req_t req, fuse_ino_t parent,
+			const char *name, mode_t mode)
+{
+	ntfs_fuse_lock_exclusive();
+	ntfs_fuse_mkdir(req, parent, name, mode);
+	ntfs_fuse_unlock();
+}
+
+static void ntfs_fuse_mt_rmdir(fuse_req_t req, fuse_ino_t parent,
+			const char *name)
+{
+	ntfs_fuse_lock_exclusive();
+	ntfs_fuse_rmdir(req, parent, name);
+	ntfs_fuse_unlock();
+}
+
+static void ntfs_fuse_mt_fsync(fuse_req_t req, fuse_ino_t ino, int type,
+			struct fuse_file_info *fi)
+{
+	ntfs_fuse_lock_exclusive();
+	ntfs_fuse_fsync(req, ino, type, fi);
+	ntfs_fuse_unlock();
+}
+
+static void ntfs_fuse_mt_bmap(fuse_req_t req, fuse_ino_t ino,
+			size_t blocksize, uint64_t vidx)
+{
+	ntfs_fuse_lock_shared();
+	ntfs_fuse_bmap(req, ino, blocksize, vidx);
+	ntfs_fuse_unlock();
+}
+
+#if defined(FUSE_INTERNAL) || (FUSE_VERSION >= 28)
+static void ntfs_fuse_mt_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd,
+			void *arg, struct fuse_file_info *fi, unsigned flags,
+			const void *data, size_t in_bufsz, size_t out_bufsz)
+{
+#if defined(FITRIM) && defined(BLKDISCARD)
+		/* trimming only locks the allocations, see ntfs_fstrim() */
+	if (!(flags & FUSE_IOCTL_COMPAT) && (cmd == (int)FITRIM)) {
+		ntfs_fuse_ioctl(req, ino, cmd, arg, fi, flags, data,
+				in_bufsz, out_bufsz);
+		return;
+	}
+#endif /* defined(FITRIM) && defined(BLKDISCARD) */
+	ntfs_fuse_lock_exclusive();
+	ntfs_fuse_ioctl(req, ino, cmd, arg, fi, flags, data,
+			in_bufsz, out_bufsz);
+	ntfs_fuse_unlock();
+}
+#endif /* defined(FUSE_INTERNAL) || (FUSE_VERSION >= 28) */
+
+#if defined(FUSE_INTERNAL) || (FUSE_VERSION >= 29)
+static void ntfs_fuse_mt_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+			off_t offset, off_t length, struct fuse_file_info *fi)
+{
+	ntfs_fuse_lock_exclusive();
+	ntfs_fuse_fallocate(req, ino, mode, offset, length, fi);
+	ntfs_fuse_unlock();
+}
+#endif /* defined(FUSE_INTERNAL) || (FUSE_VERSION >= 29) */
+
+#if defined(FUSE_INTERNAL) && defined(SEEK_DATA) && defined(SEEK_HOLE)
+static void ntfs_fuse_mt_lseek(fuse_req_t req, fuse_ino_t ino, off_t off,
+			int whence, struct fuse_file_info *fi)
+{
+	ntfs_fuse_lock_exclusive();
+	ntfs_fuse_lseek(req, ino, off, whence, fi);
+	ntfs_fuse_unlock();
+}
+#endif /* defined(FUSE_INTERNAL) && defined(SEEK_DATA) && ... */
+
+#ifdef FUSE_INTERNAL
+static void ntfs_fuse_mt_copy_file_range(fuse_req_t req, fuse_ino_t ino_in,
+			off_t off_in, struct fuse_file_info *fi_in,
+			fuse_ino_t ino_out, off_t off_out,
+			struct fuse_file_info *fi_out, size_t len, int flags)
+{
+	ntfs_fuse_lock_exclusive();
+	ntfs_fuse_copy_file_range(req, ino_in, off_in, fi_in,
+			ino_out, off_out, fi_out, len, flags);
+	ntfs_fuse_unlock();
+}
+#endif /* FUSE_INTERNAL */
+
+#if !KERNELPERMS | (POSIXACLS & !KERNELACLS)
+static void ntfs_fuse_mt_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+	ntfs_fuse_lock_shared();
+	ntfs_fuse_access(req, ino, mask);
+	ntfs_fuse_unlock();
+}
+#endif /* !KERNELPERMS | (POSIXACLS & !KERNELACLS) */
+
+#ifdef HAVE_SETXATTR
+static void ntfs_fuse_mt_getxattr(fuse_req_t req, fuse_ino_t ino,
+			const char *name, size_t size)
+{
+	ntfs_fuse_lock_shared();
+	ntfs_fuse_getxattr(req, ino, name, size);
+	ntfs_fuse_unlock();
+}
+
+static void ntfs_fuse_mt_setxattr(fuse_req_t req, fuse_ino_t ino,
+			const char *name, const char *value, size_t size,
+			int flags)
 {
-	ntfs_close();
+	ntfs_fuse_lock_exclusive();
+	ntfs_fuse_setxattr(req, ino, name, value, size, flags);
+	ntfs_fuse_unlock();
 }
 
-static struct fuse_lowlevel_ops ntfs_3g_ops = {
-	.lookup 	= ntfs_fuse_lookup,
-	.getattr	= ntfs_fuse_getattr,
-	.readlink	= ntfs_fuse_readlink,
-	.opendir	= ntfs_fuse_opendir,
-	.readdir	= ntfs_fuse_readdir,
-	.releasedir	= ntfs_fuse_releasedir,
-	.open		= ntfs_fuse_open,
-	.release	= ntfs_fuse_release,
-	.read		= ntfs_fuse_read,
-	.write		= ntfs_fuse_write,
-	.setattr	= ntfs_fuse_setattr,
+static void ntfs_fuse_mt_removexattr(fuse_req_t req, fuse_ino_t ino,
+			const char *name)
+{
+	ntfs_fuse_lock_exclusive();
+	ntfs_fuse_removexattr(req, ino, name);
+	ntfs_fuse_unlock();
+}
+
+static void ntfs_fuse_mt_listxattr(fuse_req_t req, fuse_ino_t ino,
+			size_t size)
+{
+	ntfs_fuse_lock_shared();
+	ntfs_fuse_listxattr(req, ino, size);
+	ntfs_fuse_unlock();
+}
+#endif /* HAVE_SETXATTR */
+
+static struct fuse_lowlevel_ops ntfs_3g_mt_ops = {
+	.lookup 	= ntfs_fuse_mt_lookup,
+	.getattr	= ntfs_fuse_mt_getattr,
+	.readlink	= ntfs_fuse_mt_readlink,
+	.opendir	= ntfs_fuse_mt_opendir,
+	.readdir	= ntfs_fuse_mt_readdir,
+#ifdef FUSE_INTERNAL
+	.readdirplus	= ntfs_fuse_mt_readdirplus,
+#endif /* FUSE_INTERNAL */
+	.releasedir	= ntfs_fuse_mt_releasedir,
+	.open		= ntfs_fuse_mt_open,
+	.release	= ntfs_fuse_mt_release,
+	.read		= ntfs_fuse_mt_read,
+	.write		= ntfs_fuse_mt_write,
+	.setattr	= ntfs_fuse_mt_setattr,
 	.statfs 	= ntfs_fuse_statfs,
-	.create 	= ntfs_fuse_create_file,
-	.mknod		= ntfs_fuse_mknod,
-	.symlink	= ntfs_fuse_symlink,
-	.link		= ntfs_fuse_link,
-	.unlink 	= ntfs_fuse_unlink,
-	.rename 	= ntfs_fuse_rename,
-	.mkdir		= ntfs_fuse_mkdir,
-	.rmdir		= ntfs_fuse_rmdir,
-	.fsync		= ntfs_fuse_fsync,
-	.fsyncdir	= ntfs_fuse_fsync,
-	.bmap		= ntfs_fuse_bmap,
+	.create 	= ntfs_fuse_mt_create_file,
+	.mknod		= ntfs_fuse_mt_mknod,
+	.symlink	= ntfs_fuse_mt_symlink,
+	.link		= ntfs_fuse_mt_link,
+	.unlink 	= ntfs_fuse_mt_unlink,
+	.rename 	= ntfs_fuse_mt_rename,
+	.mkdir		= ntfs_fuse_mt_mkdir,
+	.rmdir		= ntfs_fuse_mt_rmdir,
+	.fsync		= ntfs_fuse_mt_fsync,
+	.fsyncdir	= ntfs_fuse_mt_fsync,
+	.bmap		= ntfs_fuse_mt_bmap,
 	.destroy	= ntfs_fuse_destroy2,
 #if defined(FUSE_INTERNAL) || (FUSE_VERSION >= 28)
-	.ioctl		= ntfs_fuse_ioctl,
+	.ioctl		= ntfs_fuse_mt_ioctl,
 #endif /* defined(FUSE_INTERNAL) || (FUSE_VERSION >= 28) */
+#if defined(FUSE_INTERNAL) || (FUSE_VERSION >= 29)
+	.fallocate	= ntfs_fuse_mt_fallocate,
+#endif /* defined(FUSE_INTERNAL) || (FUSE_VERSION >= 29) */
+#if defined(FUSE_INTERNAL) && defined(SEEK_DATA) && defined(SEEK_HOLE)
+	.lseek		= ntfs_fuse_mt_lseek,
+#endif /* defined(FUSE_INTERNAL) && defined(SEEK_DATA) && ... */
+#ifdef FUSE_INTERNAL
+	.copy_file_range = ntfs_fuse_mt_copy_file_range,
+#endif /* FUSE_INTERNAL */
 #if !KERNELPERMS | (POSIXACLS & !KERNELACLS)
-	.access 	= ntfs_fuse_access,
+	.access 	= ntfs_fuse_mt_access,
 #endif
 #ifdef HAVE_SETXATTR
-	.getxattr	= ntfs_fuse_getxattr,
-	.setxattr	= ntfs_fuse_setxattr,
-	.removexattr	= ntfs_fuse_removexattr,
-	.listxattr	= ntfs_fuse_listxattr,
+	.getxattr	= ntfs_fuse_mt_getxattr,
+	.setxattr	= ntfs_fuse_mt_setxattr,
+	.removexattr	= ntfs_fuse_mt_removexattr,
+	.listxattr	= ntfs_fuse_mt_listxattr,
 #endif /* HAVE_SETXATTR */
-#if 0 && (defined(__APPLE__) || defined(__DARWIN__)) /* Unfinished. */
-	/* MacFUSE extensions. */
-	.getxtimes	= ntfs_macfuse_getxtimes,
-	.setcrtime	= ntfs_macfuse_setcrtime,
-	.setbkuptime	= ntfs_macfuse_setbkuptime,
-	.setchgtime	= ntfs_macfuse_setchgtime,
-#endif /* defined(__APPLE__) || defined(__DARWIN__) */
 	.init		= ntfs_init
 };
 
@@ -3669,6 +5835,10 @@ static int ntfs_fuse_init(void)
 		.streams = NF_STREAMS_INTERFACE_NONE,
 #endif		        
 		.atime	 = ATIME_RELATIVE,
+		.inode_cache = CACHE_INODE_SIZE,
+		.nidata_cache = CACHE_NIDATA_SIZE,
+		.lookup_cache = CACHE_LOOKUP_SIZE,
+		.compression_level = COMPRESSION_LEVEL_DEFAULT,
 		.silent  = TRUE,
 		.recover = TRUE
 	};
@@ -3688,6 +5858,16 @@ static int ntfs_open(const char *device)
 		flags |= NTFS_MNT_RECOVER;
 	if (ctx->hiberfile)
 		flags |= NTFS_MNT_IGNORE_HIBERFILE;
+	if (ctx->direct_io_dev)
+		flags |= NTFS_MNT_DIRECT_IO;
+	if (ctx->mmap_dev)
+		flags |= NTFS_MNT_MMAP;
+	if (ctx->overlay)
+		flags |= NTFS_MNT_OVERLAY;
+	if (ctx->fast_mount)
+		flags |= NTFS_MNT_FAST;
+	if (ctx->immutable)
+		flags |= NTFS_MNT_IMMUTABLE;
 
 	ctx->vol = vol = ntfs_mount(device, flags);
 	if (!vol) {
@@ -3696,10 +5876,55 @@ static int ntfs_open(const char *device)
 	}
 	if (ctx->sync && ctx->vol->dev)
 		NDevSetSync(ctx->vol->dev);
+	if (ctx->block_cache && ctx->vol->dev
+	    && ntfs_devcache_attach(ctx->vol->dev,
+			(s64)ctx->block_cache << 20,
+			ctx->block_cache_writeback))
+		ntfs_log_perror("Could not set up the device cache");
+	if (ctx->io_trace && ctx->vol->dev
+	    && ntfs_devtrace_attach(ctx->vol->dev, ctx->io_trace))
+		ntfs_log_perror("Could not trace the device into '%s'",
+				ctx->io_trace);
+	if (ctx->mft_cache
+	    && ntfs_mftcache_attach(ctx->vol, ctx->mft_cache,
+			ctx->mft_cache_writeback))
+		ntfs_log_perror("Could not set up the MFT record cache");
+	if (ctx->dir_index_cache
+	    && ntfs_dirindex_attach(ctx->vol,
+			(s64)ctx->dir_index_cache << 20))
+		ntfs_log_perror("Could not set up the directory index cache");
+	if (ctx->index_cache
+	    && ntfs_idxcache_attach(ctx->vol, ctx->index_cache))
+		ntfs_log_perror("Could not set up the index block cache");
+	if ((ctx->bitmap_cache || ctx->bitmap_resident)
+	    && ntfs_bmpcache_attach(ctx->vol, ctx->bitmap_cache,
+			ctx->bitmap_resident))
+		ntfs_log_perror("Could not set up the bitmap cache");
+	if (ctx->filename_delay
+	    && ntfs_inode_defer_file_names(ctx->vol, ctx->filename_delay))
+		ntfs_log_perror("Could not defer the directory entry updates");
+	if (ctx->commit_interval) {
+		ctx->vol->commit_interval = ctx->commit_interval;
+		ctx->vol->committed = time((time_t*)NULL);
+	}
+	if (ctx->mft_growth)
+		ctx->vol->mft_growth = ctx->mft_growth;
+	if (ntfs_cluster_stripe_set(ctx->vol, ctx->stripe))
+		ntfs_log_perror("Could not align the allocations to stripes");
+	ctx->vol->compression_level = ctx->compression_level;
+	ctx->vol->fstrim_rate = (u64)ctx->fstrim_rate << 20;
+	if (ntfs_resize_lru_caches(ctx->vol, ctx->inode_cache,
+			ctx->nidata_cache, ctx->lookup_cache))
+		ntfs_log_perror("Could not resize the caches");
+	ctx->vol->cache_mem = ctx->cache_mem;
 	if (ctx->compression)
 		NVolSetCompression(ctx->vol);
 	else
 		NVolClearCompression(ctx->vol);
+	if (ctx->sparse_zero_detect)
+		NVolSetSparseZeroDetect(ctx->vol);
+	if (ctx->usn_journal && !ctx->ro && ntfs_usn_start(ctx->vol))
+		ntfs_log_perror("Could not record the changes into $UsnJrnl");
 #ifdef HAVE_SETXATTR
 			/* archivers must see hidden files */
 	if (ctx->efs_raw)
@@ -3712,16 +5937,20 @@ static int ntfs_open(const char *device)
 	if (ctx->ignore_case && ntfs_set_ignore_case(vol))
 		goto err_out;
         
-	vol->free_clusters = ntfs_attr_get_free_bits(vol->lcnbmp_na);
-	if (vol->free_clusters < 0) {
-		ntfs_log_perror("Failed to read NTFS $Bitmap");
-		goto err_out;
-	}
+	ctx->mount_cache_loaded = ctx->mount_cache
+		&& ntfs_fuse_load_mount_cache(vol, ctx->mount_cache);
+	if (!ctx->mount_cache_loaded) {
+		if (ntfs_cluster_count_free(vol)) {
+			ntfs_log_perror("Failed to read NTFS $Bitmap");
+			goto err_out;
+		}
 
-	vol->free_mft_records = ntfs_get_nr_free_mft_records(vol);
-	if (vol->free_mft_records < 0) {
-		ntfs_log_perror("Failed to calculate free MFT records");
-		goto err_out;
+		vol->free_mft_records = ntfs_get_nr_free_mft_records(vol);
+		if (vol->free_mft_records < 0) {
+			ntfs_log_perror("Failed to calculate free MFT"
+					" records");
+			goto err_out;
+		}
 	}
 
 	if (ctx->hiberfile && ntfs_volume_check_hiberfile(vol, 0)) {
@@ -3869,7 +6098,7 @@ static struct fuse_chan *try_fuse_mount(char *parsed_options)
 		goto free_args;
 	}
         
-	fc = fuse_mount(opts.mnt_point, &margs);
+	fc = fuse_mount(instance->opts.mnt_point, &margs);
 free_args:
 	fuse_opt_free_args(&margs);
 	return fc;
@@ -3895,7 +6124,7 @@ static int set_fuseblk_options(char **parsed_options)
 	return 0;
 }
 
-static struct fuse_session *mount_fuse(char *parsed_options)
+static struct fuse_session *mount_fuse(char *parsed_options, BOOL signals)
 {
 	struct fuse_session *se = NULL;
 	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
@@ -3910,12 +6139,17 @@ static struct fuse_session *mount_fuse(char *parsed_options)
 		if (fuse_opt_add_arg(&args, "-odebug") == -1)
 			goto err;
         
-	se = fuse_lowlevel_new(&args , &ntfs_3g_ops, sizeof(ntfs_3g_ops), NULL);
+	if (ctx->threads > 1)
+		se = fuse_lowlevel_new(&args, &ntfs_3g_mt_ops,
+				sizeof(ntfs_3g_mt_ops), NULL);
+	else
+		se = fuse_lowlevel_new(&args, &ntfs_3g_ops,
+				sizeof(ntfs_3g_ops), NULL);
 	if (!se)
 		goto err;
         
         
-	if (fuse_set_signal_handlers(se))
+	if (signals && fuse_set_signal_handlers(se))
 		goto err_destroy;
 	fuse_session_add_chan(se, ctx->fc);
 out:
@@ -3925,11 +6159,11 @@ err_destroy:
 	fuse_session_destroy(se);
 	se = NULL;
 err:    
-	fuse_unmount(opts.mnt_point, ctx->fc);
+	fuse_unmount(instance->opts.mnt_point, ctx->fc);
 	goto out;
 }
 
-static void setup_logging(char *parsed_options)
+static void setup_logging(void)
 {
 	if (!ctx->no_detach) {
 		if (daemon(0, ctx->debug))
@@ -3943,74 +6177,94 @@ static void setup_logging(char *parsed_options)
 		}
 	}
 
-	ctx->seccache = (struct PERMISSIONS_CACHE*)NULL;
-
 	ntfs_log_info("Version %s %s %d\n", VERSION, FUSE_TYPE, fuse_version());
-	if (strcmp(opts.arg_device,opts.device))
+}
+
+static void log_mount(void)
+{
+	const struct ntfs_options *popts = &instance->opts;
+
+	if (strcmp(popts->arg_device, popts->device))
 		ntfs_log_info("Requested device %s canonicalized as %s\n",
-				opts.arg_device,opts.device);
+				popts->arg_device, popts->device);
 	ntfs_log_info("Mounted %s (%s, label \"%s\", NTFS %d.%d)\n",
-			opts.device, (ctx->ro) ? "Read-Only" : "Read-Write",
+			popts->device, (ctx->ro) ? "Read-Only" : "Read-Write",
 			ctx->vol->vol_name, ctx->vol->major_ver,
 			ctx->vol->minor_ver);
-	ntfs_log_info("Cmdline options: %s\n", opts.options ? opts.options : "");
-	ntfs_log_info("Mount options: %s\n", parsed_options);
+	ntfs_log_info("Cmdline options: %s\n",
+			popts->options ? popts->options : "");
+	ntfs_log_info("Mount options: %s\n", instance->parsed_options);
 }
 
-int main(int argc, char *argv[])
+/*
+ *		Allocate the state of a volume to mount
+ *
+ *	The current instance and context are set to the new ones.
+ *
+ *	Returns NULL if there is not enough memory
+ */
+
+static struct ntfs_instance *new_instance(const struct ntfs_options *popts)
+{
+	struct ntfs_instance *inst;
+
+	inst = (struct ntfs_instance*)ntfs_calloc(
+				sizeof(struct ntfs_instance));
+	if (inst) {
+		inst->opts = *popts;
+		pthread_mutex_init(&inst->deferred_atimes.lock, NULL);
+#ifdef FUSE_INTERNAL
+		pthread_mutex_init(&inst->notifier.lock, NULL);
+		pthread_cond_init(&inst->notifier.cond, NULL);
+#endif
+		instance = inst;
+		if (ntfs_fuse_init()) {
+			pthread_mutex_destroy(&inst->deferred_atimes.lock);
+#ifdef FUSE_INTERNAL
+			pthread_mutex_destroy(&inst->notifier.lock);
+			pthread_cond_destroy(&inst->notifier.cond);
+#endif
+			free(inst);
+			inst = instance = (struct ntfs_instance*)NULL;
+		} else
+			inst->ctx = ctx;
+	}
+	return (inst);
+}
+
+/*
+ *		Mount the volume of the current instance
+ *
+ *	The volume is opened and mounted through fuse, but no request is
+ *	processed yet. Whatever the outcome, the resources are to be
+ *	released by close_volume().
+ *
+ *	When the workers are shared with other volumes, the signals are
+ *	handled for all the volumes by the caller.
+ *
+ *	Returns zero if successful, or the code to exit with
+ */
+
+static int mount_volume(BOOL shared)
 {
-	char *parsed_options = NULL;
-	struct fuse_session *se;
 #if !(defined(__sun) && defined (__SVR4))
 	fuse_fstype fstype = FSTYPE_UNKNOWN;
 #endif
-	const char *permissions_mode = (const char*)NULL;
-	const char *failed_secure = (const char*)NULL;
-#if defined(HAVE_SETXATTR) && defined(XATTR_MAPPINGS)
-	struct XATTRMAPPING *xattr_mapping = (struct XATTRMAPPING*)NULL;
-#endif /* defined(HAVE_SETXATTR) && defined(XATTR_MAPPINGS) */
 	struct stat sbuf;
 	unsigned long existing_mount;
-	int err, fd;
-
-	/*
-	 * Make sure file descriptors 0, 1 and 2 are open, 
-	 * otherwise chaos would ensue.
-	 */
-	do {
-		fd = open("/dev/null", O_RDWR);
-		if (fd > 2)
-			close(fd);
-	} while (fd >= 0 && fd <= 2);
-
-#ifndef FUSE_INTERNAL
-	if ((getuid() != geteuid()) || (getgid() != getegid())) {
-		fprintf(stderr, "%s", setuid_msg);
-		return NTFS_VOLUME_INSECURE;
-	}
-#endif
-	if (drop_privs())
-		return NTFS_VOLUME_NO_PRIVILEGE;
-        
-	ntfs_set_locale();
-	ntfs_log_set_handler(ntfs_log_handler_stderr);
-
-	if (ntfs_parse_options(&opts, usage, argc, argv)) {
-		usage();
-		return NTFS_VOLUME_SYNTAX_ERROR;
-	}
+	size_t size;
+	int err;
 
-	if (ntfs_fuse_init()) {
-		err = NTFS_VOLUME_OUT_OF_MEMORY;
-		goto err2;
-	}
-        
-	parsed_options = parse_mount_options(ctx, &opts, TRUE);
-	if (!parsed_options) {
+	instance->parsed_options = parse_mount_options(ctx, &instance->opts,
+				TRUE);
+	if (!instance->parsed_options) {
 		err = NTFS_VOLUME_SYNTAX_ERROR;
 		goto err_out;
 	}
-	if (!ntfs_check_if_mounted(opts.device,&existing_mount)
+		/* shared workers need the locks */
+	if (shared && (ctx->threads < 2))
+		ctx->threads = 2;
+	if (!ntfs_check_if_mounted(instance->opts.device,&existing_mount)
 	    && (existing_mount & NTFS_MF_MOUNTED)
 		/* accept multiple read-only mounts */
 	    && (!(existing_mount & NTFS_MF_READONLY) || !ctx->ro)) {
@@ -4019,18 +6273,19 @@ int main(int argc, char *argv[])
 	}
 
 			/* need absolute mount point for junctions */
-	if (opts.mnt_point[0] == '/')
-		ctx->abs_mnt_point = strdup(opts.mnt_point);
+	if (instance->opts.mnt_point[0] == '/')
+		ctx->abs_mnt_point = strdup(instance->opts.mnt_point);
 	else {
 		ctx->abs_mnt_point = (char*)ntfs_malloc(PATH_MAX);
 		if (ctx->abs_mnt_point) {
-			if (getcwd(ctx->abs_mnt_point,
-				     PATH_MAX - strlen(opts.mnt_point) - 1)) {
+			size = PATH_MAX - strlen(instance->opts.mnt_point) - 1;
+			if (getcwd(ctx->abs_mnt_point, size)) {
 				strcat(ctx->abs_mnt_point, "/");
-				strcat(ctx->abs_mnt_point, opts.mnt_point);
+				strcat(ctx->abs_mnt_point,
+					instance->opts.mnt_point);
 #if defined(__sun) && defined (__SVR4)
 			/* Solaris also wants the absolute mount point */
-				opts.mnt_point = ctx->abs_mnt_point;
+				instance->opts.mnt_point = ctx->abs_mnt_point;
 #endif /* defined(__sun) && defined (__SVR4) */
 			}
 		}
@@ -4042,8 +6297,8 @@ int main(int argc, char *argv[])
 
 	ctx->security.uid = 0;
 	ctx->security.gid = 0;
-	if ((opts.mnt_point[0] == '/')
-	   && !stat(opts.mnt_point,&sbuf)) {
+	if ((instance->opts.mnt_point[0] == '/')
+	   && !stat(instance->opts.mnt_point,&sbuf)) {
 		/* collect owner of mount point, useful for default mapping */
 		ctx->security.uid = sbuf.st_uid;
 		ctx->security.gid = sbuf.st_gid;
@@ -4063,8 +6318,8 @@ int main(int argc, char *argv[])
 	if (drop_privs())
 		goto err_out;
 #endif  
-	if (stat(opts.device, &sbuf)) {
-		ntfs_log_perror("Failed to access '%s'", opts.device);
+	if (stat(instance->opts.device, &sbuf)) {
+		ntfs_log_perror("Failed to access '%s'", instance->opts.device);
 		err = NTFS_VOLUME_NO_PRIVILEGE;
 		goto err_out;
 	}
@@ -4078,22 +6333,22 @@ int main(int argc, char *argv[])
 #ifndef FUSE_INTERNAL
 	if (getuid() && ctx->blkdev) {
 		ntfs_log_error("%s", unpriv_fuseblk_msg);
-		err = NTFS_VOLUME_NO_PRIVILEGE;
-		goto err2;
+		return (NTFS_VOLUME_NO_PRIVILEGE);
 	}
 #endif
-	err = ntfs_open(opts.device);
+	err = ntfs_open(instance->opts.device);
 	if (err)
 		goto err_out;
         
+	err = NTFS_VOLUME_SYNTAX_ERROR;
 	/* Force read-only mount if the device was found read-only */
 	if (!ctx->ro && NVolReadOnly(ctx->vol)) {
 		ctx->ro = TRUE;
-		if (ntfs_strinsert(&parsed_options, ",ro")) 
+		if (ntfs_strinsert(&instance->parsed_options, ",ro")) 
                 	goto err_out;
 	}
 	/* We must do this after ntfs_open() to be able to set the blksize */
-	if (ctx->blkdev && set_fuseblk_options(&parsed_options))
+	if (ctx->blkdev && set_fuseblk_options(&instance->parsed_options))
 		goto err_out;
 
 	ctx->security.vol = ctx->vol;
@@ -4104,7 +6359,7 @@ int main(int argc, char *argv[])
 		/* JPA open $Secure, (whatever NTFS version !) */
 		/* to initialize security data */
 	if (ntfs_open_secure(ctx->vol) && (ctx->vol->major_ver >= 3))
-		failed_secure = "Could not open file $Secure";
+		instance->failed_secure = "Could not open file $Secure";
 	if (!ntfs_build_mapping(&ctx->security,ctx->usermap_path,
 		(ctx->vol->secure_flags
 			& ((1 << SECURITY_DEFAULT) | (1 << SECURITY_ACL)))
@@ -4113,15 +6368,15 @@ int main(int argc, char *argv[])
 #if POSIXACLS
 		/* use basic permissions if requested */
 		if (ctx->vol->secure_flags & (1 << SECURITY_DEFAULT))
-			permissions_mode = "User mapping built, Posix ACLs not used";
+			instance->permissions_mode
+				= "User mapping built, Posix ACLs not used";
 		else {
-			permissions_mode = "User mapping built, Posix ACLs in use";
+			instance->permissions_mode
+				= "User mapping built, Posix ACLs in use";
 #if KERNELACLS
-			if (ntfs_strinsert(&parsed_options,
-					",default_permissions,acl")) {
-				err = NTFS_VOLUME_SYNTAX_ERROR;
+			if (ntfs_strinsert(&instance->parsed_options,
+					",default_permissions,acl"))
 				goto err_out;
-			}
 #endif /* KERNELACLS */
 		}
 #else /* POSIXACLS */
@@ -4133,13 +6388,12 @@ int main(int argc, char *argv[])
 			 */
 #if KERNELPERMS
 			ctx->vol->secure_flags |= (1 << SECURITY_DEFAULT);
-			if (ntfs_strinsert(&parsed_options, ",default_permissions")) {
-				err = NTFS_VOLUME_SYNTAX_ERROR;
+			if (ntfs_strinsert(&instance->parsed_options,
+					",default_permissions"))
 				goto err_out;
-			}
 #endif /* KERNELPERMS */
 		}
-		permissions_mode = "User mapping built";
+		instance->permissions_mode = "User mapping built";
 #endif /* POSIXACLS */
 		ctx->dmask = ctx->fmask = 0;
 	} else {
@@ -4151,26 +6405,27 @@ int main(int argc, char *argv[])
 		if ((ctx->vol->secure_flags & (1 << SECURITY_WANTED))
 		   && !(ctx->vol->secure_flags & (1 << SECURITY_DEFAULT))) {
 			ctx->vol->secure_flags |= (1 << SECURITY_DEFAULT);
-			if (ntfs_strinsert(&parsed_options, ",default_permissions")) {
-				err = NTFS_VOLUME_SYNTAX_ERROR;
+			if (ntfs_strinsert(&instance->parsed_options,
+					",default_permissions"))
 				goto err_out;
-			}
 		}
 		if (ctx->vol->secure_flags & (1 << SECURITY_DEFAULT)) {
 			ctx->vol->secure_flags |= (1 << SECURITY_RAW);
-			permissions_mode = "Global ownership and permissions enforced";
+			instance->permissions_mode
+				= "Global ownership and permissions enforced";
 		} else {
 			ctx->vol->secure_flags &= ~(1 << SECURITY_RAW);
-			permissions_mode = "Ownership and permissions disabled";
+			instance->permissions_mode
+				= "Ownership and permissions disabled";
 		}
 	}
 	if (ctx->usermap_path)
 		free (ctx->usermap_path);
 
 #if defined(HAVE_SETXATTR) && defined(XATTR_MAPPINGS)
-	xattr_mapping = ntfs_xattr_build_mapping(ctx->vol,
+	instance->xattr_mapping = ntfs_xattr_build_mapping(ctx->vol,
 				ctx->xattrmap_path);
-	ctx->vol->xattr_mapping = xattr_mapping;
+	ctx->vol->xattr_mapping = instance->xattr_mapping;
 	/*
 	 * Errors are logged, do not refuse mounting, it would be
 	 * too difficult to fix the unmountable mapping file.
@@ -4179,8 +6434,50 @@ int main(int argc, char *argv[])
 		free(ctx->xattrmap_path);
 #endif /* defined(HAVE_SETXATTR) && defined(XATTR_MAPPINGS) */
 
-	se = mount_fuse(parsed_options);
-	if (!se) {
+	if ((ctx->threads > 1) && !ctx->vol->locks) {
+		if (shared) {
+			ntfs_log_error("No thread support, cannot share the"
+					" worker threads\n");
+			goto err_out;
+		}
+		ntfs_log_error("No thread support, option 'threads'"
+				" ignored\n");
+		ctx->threads = 1;
+	}
+	instance->shared_readers = !(ctx->vol->secure_flags
+				& (1 << SECURITY_ADDSECURIDS));
+	if (ctx->cache_timeout && !ctx->immutable) {
+#ifdef FUSE_INTERNAL
+			/* the kernel cannot check ACLs or ignore case */
+		if ((ctx->security.mapping[MAPUSERS]
+			&& !(ctx->vol->secure_flags & (1 << SECURITY_DEFAULT)))
+		    || ctx->ignore_case) {
+			ntfs_log_error("Option 'cache_timeout' cannot be used"
+				" with this configuration, ignored\n");
+			ctx->cache_timeout = 0;
+		}
+#else
+		ntfs_log_error("Option 'cache_timeout' needs the internal"
+				" fuse, ignored\n");
+		ctx->cache_timeout = 0;
+#endif
+	}
+		/*
+		 * Nothing is ever invalidated on an immutable volume, so
+		 * the kernel may keep the names and attributes as long as
+		 * it can check the permissions by itself.
+		 */
+	if (ctx->immutable) {
+		if ((ctx->security.mapping[MAPUSERS]
+			&& !(ctx->vol->secure_flags & (1 << SECURITY_DEFAULT)))
+		    || ctx->ignore_case)
+			ctx->cache_timeout = 0;
+		else
+			if (!ctx->cache_timeout)
+				ctx->cache_timeout = IMMUTABLE_TIMEOUT;
+	}
+	instance->se = mount_fuse(instance->parsed_options, !shared);
+	if (!instance->se) {
 		err = NTFS_VOLUME_FUSE_ERROR;
 		goto err_out;
 	}
@@ -4191,33 +6488,350 @@ int main(int argc, char *argv[])
 	if (S_ISBLK(sbuf.st_mode) && (fstype == FSTYPE_FUSE))
 		ntfs_log_info("%s", fuse26_kmod_msg);
 #endif  
-	setup_logging(parsed_options);
-	if (failed_secure)
-		ntfs_log_info("%s\n",failed_secure);
-	if (permissions_mode)
-		ntfs_log_info("%s, configuration type %d\n",permissions_mode,
+	return (0);
+err_out:
+	ntfs_mount_error(instance->opts.device, instance->opts.mnt_point, err);
+	return (err);
+}
+
+/*
+ *		Start serving the volume of the current instance
+ *
+ *	This is done after daemonizing, which would not retain the
+ *	threads started for the volume.
+ */
+
+static void start_volume(void)
+{
+	ctx->seccache = (struct PERMISSIONS_CACHE*)NULL;
+	log_mount();
+	ntfs_cluster_count_start(ctx->vol);
+	if (ctx->security.mapping[MAPUSERS])
+		ntfs_secure_preload(ctx->vol, TRUE);
+	if (ctx->discard && !ctx->ro && ntfs_discard_start(ctx->vol))
+		ntfs_log_perror("Could not start discarding the freed clusters");
+	if (ctx->vol->mft_cache && ntfs_mftcache_readahead_start(ctx->vol))
+		ntfs_log_perror("Could not start reading the MFT records"
+				" of the directories listed");
+#ifdef FUSE_INTERNAL
+	if (ctx->cache_timeout && !ctx->immutable
+	    && ntfs_fuse_start_notifier()) {
+		ntfs_log_perror("Could not start the notifier thread, option"
+				" 'cache_timeout' ignored");
+		ctx->cache_timeout = 0;
+	}
+#endif
+	if (instance->failed_secure)
+		ntfs_log_info("%s\n",instance->failed_secure);
+	if (instance->permissions_mode)
+		ntfs_log_info("%s, configuration type %d\n",
+			instance->permissions_mode,
 			5 + POSIXACLS*6 - KERNELPERMS*3 + CACHEING);
-        
-	fuse_session_loop(se);
-	fuse_remove_signal_handlers(se);
-        
-	err = 0;
+}
 
-	fuse_unmount(opts.mnt_point, ctx->fc);
-	fuse_session_destroy(se);
-err_out:
-	ntfs_mount_error(opts.device, opts.mnt_point, err);
+/*
+ *		Release the resources of the current instance
+ */
+
+static void close_volume(void)
+{
+	struct ntfs_instance *inst;
+
+	if (instance->se) {
+		fuse_unmount(instance->opts.mnt_point, ctx->fc);
+		fuse_session_destroy(instance->se);
+	}
 	if (ctx->abs_mnt_point)
 		free(ctx->abs_mnt_point);
 #if defined(HAVE_SETXATTR) && defined(XATTR_MAPPINGS)
-	ntfs_xattr_free_mapping(xattr_mapping);
+	ntfs_xattr_free_mapping(instance->xattr_mapping);
 #endif /* defined(HAVE_SETXATTR) && defined(XATTR_MAPPINGS) */
-err2:
 	ntfs_close();
+	free(ctx->mount_cache);
+	free(ctx->io_trace);
 	free(ctx);
-	free(parsed_options);
-	free(opts.options);
-	free(opts.device);
-	return err;
+	inst = instance;
+	free(inst->parsed_options);
+	free(inst->opts.options);
+	free(inst->opts.device);
+	free(inst->volume_line);
+	pthread_mutex_destroy(&inst->deferred_atimes.lock);
+#ifdef FUSE_INTERNAL
+	pthread_mutex_destroy(&inst->notifier.lock);
+	pthread_cond_destroy(&inst->notifier.cond);
+#endif
+	free(inst);
+	ctx = (ntfs_fuse_context_t*)NULL;
+	instance = (struct ntfs_instance*)NULL;
+}
+
+#ifdef FUSE_INTERNAL
+
+/*
+ *		Read the list of volumes to serve
+ *
+ *	Each line designates a device and a mount point, optionally
+ *	followed by mount options which are added to the options of the
+ *	command line. Empty lines and lines beginning with '#' are ignored.
+ *
+ *	Returns zero if successful, or the code to exit with
+ */
+
+static int read_volumes(const struct ntfs_options *popts)
+{
+	struct ntfs_instance **plast;
+	struct ntfs_options opts;
+	char line[3*PATH_MAX];
+	char *copy;
+	char *options;
+	char *extra;
+	FILE *f;
+	int lineno;
+	int err;
+
+	f = fopen(popts->volumes, "r");
+	if (!f) {
+		ntfs_log_perror("Failed to open '%s'", popts->volumes);
+		return (NTFS_VOLUME_SYNTAX_ERROR);
+	}
+	err = 0;
+	lineno = 0;
+	plast = &instances;
+	while (!err && fgets(line, sizeof(line), f)) {
+		lineno++;
+		copy = strdup(line);
+		if (!copy) {
+			err = NTFS_VOLUME_OUT_OF_MEMORY;
+			break;
+		}
+		memset(&opts, 0, sizeof(opts));
+		opts.arg_device = strtok(copy, " \t\n");
+		opts.mnt_point = strtok((char*)NULL, " \t\n");
+		options = strtok((char*)NULL, " \t\n");
+		extra = strtok((char*)NULL, " \t\n");
+		if (!opts.arg_device || (opts.arg_device[0] == '#')) {
+			free(copy);
+			continue;
+		}
+		if (!opts.mnt_point || extra) {
+			ntfs_log_error("%s: Bad volume at line %d of '%s'\n",
+					EXEC_NAME, lineno, popts->volumes);
+			free(copy);
+			err = NTFS_VOLUME_SYNTAX_ERROR;
+			break;
+		}
+		opts.device = ntfs_malloc(PATH_MAX + 1);
+		if (popts->options)
+			opts.options = strdup(popts->options);
+		if (!opts.device || (popts->options && !opts.options)
+		    || (options && opts.options
+			&& ntfs_strappend(&opts.options, ","))
+		    || (options && ntfs_strappend(&opts.options, options))) {
+			err = NTFS_VOLUME_OUT_OF_MEMORY;
+		} else
+			if (!ntfs_realpath_canonicalize(opts.arg_device,
+					opts.device)) {
+				ntfs_log_perror("%s: Failed to access volume"
+					" '%s'", EXEC_NAME, opts.arg_device);
+				err = NTFS_VOLUME_NO_PRIVILEGE;
+			} else {
+				*plast = new_instance(&opts);
+				if (*plast) {
+					(*plast)->volume_line = copy;
+					plast = &(*plast)->next;
+				} else
+					err = NTFS_VOLUME_OUT_OF_MEMORY;
+			}
+		if (err) {
+			free(opts.device);
+			free(opts.options);
+			free(copy);
+		}
+	}
+	fclose(f);
+	if (!err && !instances) {
+		ntfs_log_error("%s: No volume listed in '%s'\n",
+				EXEC_NAME, popts->volumes);
+		err = NTFS_VOLUME_SYNTAX_ERROR;
+	}
+	return (err);
 }
 
+/*
+ *		Serve several volumes from the same process
+ *
+ *	The requests to all the volumes are processed by a shared pool
+ *	of worker threads, its size being the largest value of option
+ *	"threads", and the caches of all the volumes share a memory budget
+ *	which is the largest value of option "cache_mem". A volume is
+ *	closed as soon as it is unmounted, and the process exits when
+ *	all the volumes are unmounted.
+ *
+ *	Returns zero if successful, or the code to exit with
+ */
+
+static int serve_volumes(struct ntfs_options *popts)
+{
+	struct ntfs_instance *inst;
+	struct fuse_session **sessions;
+	void **data;
+	u64 budget;
+	int threads;
+	int count;
+	int err;
+
+	sessions = (struct fuse_session**)NULL;
+	data = (void**)NULL;
+	count = 0;
+	budget = 0;
+	threads = 0;
+	err = read_volumes(popts);
+	for (inst=instances; inst && !err; inst=inst->next) {
+		instance = inst;
+		ctx = inst->ctx;
+		err = mount_volume(TRUE);
+		if (ctx->cache_mem > budget)
+			budget = ctx->cache_mem;
+		if (ctx->threads > threads)
+			threads = ctx->threads;
+		count++;
+	}
+	if (!err) {
+		sessions = (struct fuse_session**)ntfs_malloc(
+				count*sizeof(struct fuse_session*));
+		data = (void**)ntfs_malloc(count*sizeof(void*));
+		if (budget)
+			cache_pool = ntfs_cache_pool_create(budget);
+		if (!sessions || !data || (budget && !cache_pool))
+			err = NTFS_VOLUME_OUT_OF_MEMORY;
+	}
+	if (!err) {
+		instance = instances;
+		ctx = instance->ctx;
+		setup_logging();
+		count = 0;
+		for (inst=instances; inst; inst=inst->next) {
+			instance = inst;
+			ctx = inst->ctx;
+			start_volume();
+			inst->last_request = time((time_t*)NULL);
+			if (cache_pool) {
+				ntfs_cache_pool_join(cache_pool, ctx->vol);
+				inst->serving = TRUE;
+			}
+			sessions[count] = inst->se;
+			data[count] = inst;
+			count++;
+		}
+		ntfs_log_info("Serving %d volumes with up to %d worker"
+				" threads\n", count, threads);
+		if (cache_pool)
+			ntfs_log_info("Sharing %llu bytes of cache memory\n",
+				(unsigned long long)budget);
+		if (fuse_set_signal_handlers_multi(sessions, count))
+			err = NTFS_VOLUME_FUSE_ERROR;
+		else {
+			fuse_sessions_loop_mt_max(sessions, data, count,
+				threads, ntfs_fuse_enter, ntfs_fuse_leave);
+			fuse_remove_signal_handlers_multi(sessions);
+		}
+	}
+	while (instances) {
+		pthread_mutex_lock(&instances_lock);
+		inst = instances;
+		instances = inst->next;
+		pthread_mutex_unlock(&instances_lock);
+		instance = inst;
+		ctx = inst->ctx;
+		ntfs_fuse_stop_notifier();
+		close_volume();
+	}
+	ntfs_cache_pool_free(cache_pool);
+	cache_pool = (struct CACHE_POOL*)NULL;
+	free(sessions);
+	free(data);
+	free(popts->options);
+	return (err);
+}
+
+#endif /* FUSE_INTERNAL */
+
+int main(int argc, char *argv[])
+{
+	struct ntfs_options opts;
+#ifdef FUSE_INTERNAL
+	void *data;
+#endif
+	int err, fd;
+
+	/*
+	 * Make sure file descriptors 0, 1 and 2 are open, 
+	 * otherwise chaos would ensue.
+	 */
+	do {
+		fd = open("/dev/null", O_RDWR);
+		if (fd > 2)
+			close(fd);
+	} while (fd >= 0 && fd <= 2);
+
+#ifndef FUSE_INTERNAL
+	if ((getuid() != geteuid()) || (getgid() != getegid())) {
+		fprintf(stderr, "%s", setuid_msg);
+		return NTFS_VOLUME_INSECURE;
+	}
+#endif
+	if (drop_privs())
+		return NTFS_VOLUME_NO_PRIVILEGE;
+        
+	ntfs_set_locale();
+	ntfs_log_set_handler(ntfs_log_handler_stderr);
+
+	memset(&opts, 0, sizeof(opts));
+	if (ntfs_parse_options(&opts, usage, argc, argv)) {
+		usage();
+		return NTFS_VOLUME_SYNTAX_ERROR;
+	}
+#ifdef FUSE_INTERNAL
+	if (opts.volumes)
+		return (serve_volumes(&opts));
+#else
+	if (opts.volumes) {
+		ntfs_log_error("%s: Option '--volumes' needs the internal"
+				" fuse\n", EXEC_NAME);
+		return NTFS_VOLUME_SYNTAX_ERROR;
+	}
+#endif
+
+	if (!new_instance(&opts)) {
+		free(opts.options);
+		free(opts.device);
+		return NTFS_VOLUME_OUT_OF_MEMORY;
+	}
+        
+	err = mount_volume(FALSE);
+	if (!err) {
+		setup_logging();
+		start_volume();
+        
+		if (ctx->threads > 1) {
+			ntfs_log_info("Using up to %d worker threads\n",
+					ctx->threads);
+#ifdef FUSE_INTERNAL
+				/* the workers need the thread-local context */
+			data = instance;
+			fuse_sessions_loop_mt_max(&instance->se, &data, 1,
+				ctx->threads, ntfs_fuse_enter,
+				(void (*)(void*))NULL);
+#else
+			fuse_session_loop_mt(instance->se);
+#endif
+		} else
+			fuse_session_loop(instance->se);
+		fuse_remove_signal_handlers(instance->se);
+#ifdef FUSE_INTERNAL
+		ntfs_fuse_stop_notifier();
+#endif
+	}
+	close_volume();
+	return err;
+}
@@ -82,6 +82,14 @@
 #include <sys/param.h>
 #endif /* defined(__APPLE__) || defined(__DARWIN__), ... */
 
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
+
+#ifdef HAVE_LINUX_FIEMAP_H
+#include <linux/fiemap.h>
+#endif
+
 #include "compat.h"
 #include "attrib.h"
 #include "inode.h"
@@ -98,6 +106,15 @@
 #include "logging.h"
 #include "xattrs.h"
 #include "misc.h"
+#include "lcnalloc.h"
+#include "cache.h"
+#include "devcache.h"
+#include "devtrace.h"
+#include "mftcache.h"
+#include "dirindex.h"
+#include "idxcache.h"
+#include "bmpcache.h"
+#include "usnjrnl.h"
 #include "ioctl.h"
 #include "system_compression.h"
 
@@ -547,6 +564,30 @@ static void set_fuse_error(int *err)
 		*err = -errno;
 }
 
+/*
+ *		Apply the deferred updates of directory entries
+ *		(option "filename_delay")
+ *
+ *	Must be called with no inode open
+ */
+
+static void ntfs_fuse_flush_file_names(BOOL force)
+{
+	if (ntfs_inode_flush_file_names(ctx->vol, force))
+		ntfs_log_perror("Failed to update some directory entries");
+}
+
+/*
+ *		Write the metadata updates gathered in the caches
+ *		when the commit interval has elapsed (option "commit")
+ */
+
+static void ntfs_fuse_commit(void)
+{
+	if (ntfs_volume_commit(ctx->vol, FALSE))
+		ntfs_log_perror("Failed to commit the metadata updates");
+}
+
 #if defined(__APPLE__) || defined(__DARWIN__)
 static int ntfs_macfuse_getxtimes(const char *org_path,
 		struct timespec *bkuptime, struct timespec *crtime)
@@ -655,8 +696,13 @@ static void *ntfs_init(struct fuse_conn_info *conn)
 #ifdef FUSE_CAP_BIG_WRITES
 	if (ctx->big_writes
 	    && ((ctx->vol->nr_clusters << ctx->vol->cluster_size_bits)
-			>= SAFE_CAPACITY_FOR_BIG_WRITES))
+			>= SAFE_CAPACITY_FOR_BIG_WRITES)) {
 		conn->want |= FUSE_CAP_BIG_WRITES;
+#ifdef FUSE_CAP_MAX_PAGES
+			/* allow requests beyond 128K on recent kernels */
+		conn->want |= FUSE_CAP_MAX_PAGES;
+#endif
+	}
 #endif
 #ifdef FUSE_CAP_IOCTL_DIR
 	conn->want |= FUSE_CAP_IOCTL_DIR;
@@ -1015,14 +1061,22 @@ static int ntfs_fuse_filler(ntfs_fuse_fill_context_t *fill_ctx,
 		const s64 pos __attribute__((unused)), const MFT_REF mref,
 		const unsigned dt_type __attribute__((unused)))
 {
-	char *filename = NULL;
+	char namebuf[NTFS_MAX_NAME_LEN*3 + 1];
+	char *filename = namebuf;
 	int ret = 0;
 	int filenamelen = -1;
 
 	if (name_type == FILE_NAME_DOS)
 		return 0;
 	
-	if ((filenamelen = ntfs_ucstombs(name, name_len, &filename, 0)) < 0) {
+		/* translate into the stack, unless the locale needs more */
+	filenamelen = ntfs_ucstombs(name, name_len, &filename,
+				sizeof(namebuf));
+	if ((filenamelen < 0) && (errno == ENAMETOOLONG)) {
+		filename = (char*)NULL;
+		filenamelen = ntfs_ucstombs(name, name_len, &filename, 0);
+	}
+	if (filenamelen < 0) {
 		ntfs_log_perror("Filename decoding failed (inode %llu)",
 				(unsigned long long)MREF(mref));
 		return -1;
@@ -1032,7 +1086,8 @@ static int ntfs_fuse_filler(ntfs_fuse_fill_context_t *fill_ctx,
 		ntfs_log_error("Unable to access '%s' (inode %llu) with "
 				"current named streams access interface.\n",
 				filename, (unsigned long long)MREF(mref));
-		free(filename);
+		if (filename != namebuf)
+			free(filename);
 		return 0;
 	} else {
 		struct stat st = { .st_ino = MREF(mref) };
@@ -1097,7 +1152,8 @@ static int ntfs_fuse_filler(ntfs_fuse_fill_context_t *fill_ctx,
 		ret = fill_ctx->filler(fill_ctx->buf, filename, &st, 0);
 	}
 	
-	free(filename);
+	if (filename != namebuf)
+		free(filename);
 	return ret;
 }
 
@@ -1114,6 +1170,8 @@ static int ntfs_fuse_opendir(const char *path,
 	if (ntfs_fuse_is_named_data_stream(path))
 		return -EINVAL; /* n/a for named data streams. */
 
+		/* show the latest sizes and times to directory readers */
+	ntfs_fuse_flush_file_names(TRUE);
 	ni = ntfs_pathname_to_inode(ctx->vol, NULL, path);
 	if (ni) {
 		if (ntfs_fuse_fill_security_context(&security)) {
@@ -1295,7 +1353,7 @@ static int ntfs_fuse_read(const char *org_path, char *buf, size_t size,
 		}
 	}
 
-	na = ntfs_attr_open(ni, AT_DATA, stream_name, stream_name_len);
+	na = ntfs_stream_open(ni, stream_name, stream_name_len);
 	if (!na) {
 		res = -errno;
 		goto exit;
@@ -1334,7 +1392,7 @@ ok:
 	res = total;
 exit:
 	if (na)
-		ntfs_attr_close(na);
+		ntfs_stream_close(na);
 	if (ntfs_inode_close(ni))
 		set_fuse_error(&res);
 	free(path);
@@ -1362,7 +1420,7 @@ static int ntfs_fuse_write(const char *org_path, const char *buf, size_t size,
 		res = -errno;
 		goto exit;
 	}
-	na = ntfs_attr_open(ni, AT_DATA, stream_name, stream_name_len);
+	na = ntfs_stream_open(ni, stream_name, stream_name_len);
 	if (!na) {
 		res = -errno;
 		goto exit;
@@ -1384,12 +1442,18 @@ static int ntfs_fuse_write(const char *org_path, const char *buf, size_t size,
 		     - sle64_to_cpu(ni->last_data_change_time)) > ctx->dmtime))
 		ntfs_fuse_update_times(na->ni, NTFS_UPDATE_MCTIME);
 exit:
-	if (na)
-		ntfs_attr_close(na);
+	if (na) {
+		if (res < 0)
+			ntfs_attr_close(na);
+		else
+			ntfs_stream_close(na);
+	}
 	if (total)
 		set_archive(ni);
 	if (ntfs_inode_close(ni))
 		set_fuse_error(&res);
+	ntfs_fuse_flush_file_names(FALSE);
+	ntfs_fuse_commit();
 	free(path);
 	if (stream_name_len)
 		free(stream_name);
@@ -1444,6 +1508,8 @@ exit:
 	if (stream_name_len)
 		free(stream_name);
 out:	
+	ntfs_fuse_flush_file_names(FALSE);
+	ntfs_fuse_commit();
 	return res;
 }
 
@@ -2156,6 +2222,115 @@ static int ntfs_fuse_unlink(const char *org_path)
 	return res;
 }
 
+/*
+ *		Rename a file or directory, possibly to another directory
+ *
+ *	The new path must not exist. The permissions required are those
+ *	for unlinking the old path and for linking the new one.
+ */
+
+static int ntfs_fuse_move(const char *old_path, const char *new_path)
+{
+	char *name, *newname;
+	ntfschar *uname = NULL, *unewname = NULL;
+	ntfs_inode *dir_ni = NULL, *newdir_ni = NULL, *ni;
+	char *path, *newpath;
+	int res = 0, uname_len, unewname_len;
+#if !KERNELPERMS | (POSIXACLS & !KERNELACLS)
+	struct SECURITY_CONTEXT security;
+#endif
+
+	if (ntfs_fuse_is_named_data_stream(old_path))
+		return -EINVAL; /* n/a for named data streams. */
+	if (ntfs_fuse_is_named_data_stream(new_path))
+		return -EINVAL; /* n/a for named data streams. */
+	path = strdup(old_path);
+	newpath = strdup(new_path);
+	if (!path || !newpath) {
+		res = -errno;
+		ni = (ntfs_inode*)NULL;
+		goto exit;
+	}
+	/* Open object to rename. */
+	ni = ntfs_pathname_to_inode(ctx->vol, NULL, path);
+	if (!ni) {
+		res = -errno;
+		goto exit;
+	}
+	/* deny renaming metadata files */
+	if (ni->mft_no < FILE_first_user) {
+		res = -EPERM;
+		goto exit;
+	}
+	/* Generate unicode filenames. */
+	name = strrchr(path, '/');
+	name++;
+	uname_len = ntfs_mbstoucs(name, &uname);
+	newname = strrchr(newpath, '/');
+	newname++;
+	unewname_len = ntfs_mbstoucs(newname, &unewname);
+	if ((uname_len < 0)
+	    || (unewname_len < 0)
+	    || (ctx->windows_names
+		&& ntfs_forbidden_names(ctx->vol,unewname,unewname_len))) {
+		res = -errno;
+		goto exit;
+	}
+	/* Open the parent directories, once if they are the same */
+	*--name = 0;
+	*--newname = 0;
+	dir_ni = ntfs_pathname_to_inode(ctx->vol, NULL, path);
+	if (!dir_ni) {
+		res = -errno;
+		goto exit;
+	}
+	if (!strcmp(path, newpath))
+		newdir_ni = dir_ni;
+	else {
+		newdir_ni = ntfs_pathname_to_inode(ctx->vol, NULL, newpath);
+		if (!newdir_ni) {
+			res = -errno;
+			goto exit;
+		}
+	}
+
+#if !KERNELPERMS | (POSIXACLS & !KERNELACLS)
+	/* JPA the old path must be unlinkable, the new parent writeable */
+	if (ntfs_fuse_fill_security_context(&security)
+	    && (!ntfs_allowed_dir_access(&security, old_path, dir_ni, ni,
+				S_IEXEC + S_IWRITE + S_ISVTX)
+		|| !ntfs_allowed_access(&security, newdir_ni,
+				S_IWRITE + S_IEXEC)))
+		res = -EACCES;
+	else
+#endif
+	{
+		if (ntfs_rename(ctx->vol, old_path, ni, dir_ni,
+				uname, uname_len, newdir_ni,
+				unewname, unewname_len)) {
+			res = -errno;
+			goto exit;
+		}
+		set_archive(ni);
+	}
+exit:
+	/* 
+	 * Must close the directories first otherwise
+	 * ntfs_inode_sync_file_name(ni) may fail.
+	 */
+	if ((newdir_ni != dir_ni) && ntfs_inode_close(newdir_ni))
+		set_fuse_error(&res);
+	if (ntfs_inode_close(dir_ni))
+		set_fuse_error(&res);
+	if (ntfs_inode_close(ni))
+		set_fuse_error(&res);
+	free(uname);
+	free(unewname);
+	free(path);
+	free(newpath);
+	return res;
+}
+
 static int ntfs_fuse_safe_rename(const char *old_path, 
 				 const char *new_path, 
 				 const char *tmp)
@@ -2164,43 +2339,27 @@ static int ntfs_fuse_safe_rename(const char *old_path,
 
 	ntfs_log_trace("Entering\n");
 	
-	ret = ntfs_fuse_link(new_path, tmp);
+		/* Set the existing target aside, to restore it on failure */
+	ret = ntfs_fuse_move(new_path, tmp);
 	if (ret)
 		return ret;
 	
-	ret = ntfs_fuse_unlink(new_path);
-	if (!ret) {
-		
-		ret = ntfs_fuse_link(old_path, new_path);
-		if (ret)
-			goto restore;
-		
-		ret = ntfs_fuse_unlink(old_path);
-		if (ret) {
-			if (ntfs_fuse_unlink(new_path))
-				goto err;
-			goto restore;
-		}
+	ret = ntfs_fuse_move(old_path, new_path);
+	if (ret) {
+		if (ntfs_fuse_move(tmp, new_path))
+			ntfs_log_perror("Rename failed. Existing file '%s' "
+				"was renamed to '%s'", new_path, tmp);
+		return ret;
 	}
-	
-	goto cleanup;
-restore:
-	if (ntfs_fuse_link(tmp, new_path)) {
-err:
-		ntfs_log_perror("Rename failed. Existing file '%s' was renamed "
-				"to '%s'", new_path, tmp);
-	} else {
-cleanup:
 		/*
 		 * Condition for this unlink has already been checked in
 		 * "ntfs_fuse_rename_existing_dest()", so it should never
 		 * fail (unless concurrent access to directories when fuse
 		 * is multithreaded)
 		 */
-		if (ntfs_fuse_unlink(tmp) < 0)
-			ntfs_log_perror("Rename failed. Existing file '%s' still present "
+	if (ntfs_fuse_unlink(tmp) < 0)
+		ntfs_log_perror("Rename failed. Existing file '%s' still present "
 				"as '%s'", new_path, tmp);
-	}
 	return 	ret;
 }
 
@@ -2259,9 +2418,6 @@ static int ntfs_fuse_rename(const char *old_path, const char *new_path)
 	
 	ntfs_log_debug("rename: old: '%s'  new: '%s'\n", old_path, new_path);
 	
-	/*
-	 *  FIXME: Rename should be atomic.
-	 */
 	stream_name_len = ntfs_fuse_parse_path(new_path, &path, &stream_name);
 	if (stream_name_len < 0)
 		return stream_name_len;
@@ -2306,13 +2462,7 @@ static int ntfs_fuse_rename(const char *old_path, const char *new_path)
 		goto out;
 	}
 
-	ret = ntfs_fuse_link(old_path, new_path);
-	if (ret)
-		goto out;
-	
-	ret = ntfs_fuse_unlink(old_path);
-	if (ret)
-		ntfs_fuse_unlink(new_path);
+	ret = ntfs_fuse_move(old_path, new_path);
 out:
 	free(path);
 	if (stream_name_len)
@@ -2474,23 +2624,36 @@ static int ntfs_fuse_utime(const char *path, struct utimbuf *buf)
 
 #endif /* HAVE_UTIMENSAT */
 
-static int ntfs_fuse_fsync(const char *path __attribute__((unused)),
-			int type __attribute__((unused)),
+static int ntfs_fuse_fsync(const char *path, int type,
 			struct fuse_file_info *fi __attribute__((unused)))
 {
+	ntfs_inode *ni;
 	int ret;
 
-		/* sync the full device */
-	ret = ntfs_device_sync(ctx->vol->dev);
-	if (ret)
-		ret = -errno;
+	ni = ntfs_pathname_to_inode(ctx->vol, NULL, path);
+	if (ni) {
+		ret = ntfs_inode_fsync(ni, type != 0);
+		if (ret)
+			ret = -errno;
+		if (ntfs_inode_close(ni))
+			set_fuse_error(&ret);
+	} else {
+			/* not reachable by its path, sync the full device */
+		ret = ntfs_inode_flush_file_names(ctx->vol, TRUE);
+		if (!ret)
+			ret = ntfs_volume_commit(ctx->vol, TRUE);
+		if (!ret)
+			ret = ntfs_device_sync(ctx->vol->dev);
+		if (ret)
+			ret = -errno;
+	}
 	return (ret);
 }
 
 #if defined(FUSE_INTERNAL) || (FUSE_VERSION >= 28)
 static int ntfs_fuse_ioctl(const char *path,
 			int cmd, void *arg,
-			struct fuse_file_info *fi __attribute__((unused)),
+			struct fuse_file_info *fi,
 			unsigned int flags, void *data)
 {
 	ntfs_inode *ni;
@@ -2498,11 +2661,30 @@ static int ntfs_fuse_ioctl(const char *path,
 
 	if (flags & FUSE_IOCTL_COMPAT)
 		return -ENOSYS;
+#ifdef NTFS_IOC_DEFRAG
+		/* not while the compression or encryption is pending */
+	if (cmd == (int)NTFS_IOC_DEFRAG) {
+		if (fuse_get_context()->uid)
+			return -EPERM;
+		if (fi && (fi->fh & (CLOSE_COMPRESSED | CLOSE_ENCRYPTED)))
+			return -EBUSY;
+	}
+#endif /* NTFS_IOC_DEFRAG */
 
 	ni = ntfs_pathname_to_inode(ctx->vol, NULL, path);
 	if (!ni)
 		return -errno;
 
+#if defined(FS_IOC_FIEMAP) && defined(HAVE_LINUX_FIEMAP_H)
+		/*
+		 * only record the extents which fit in the reply, which
+		 * has the size defined by the ioctl code
+		 */
+	if (cmd == (int)FS_IOC_FIEMAP)
+		((struct fiemap*)data)->fm_extent_count
+			= (_IOC_SIZE(cmd) - sizeof(struct fiemap))
+				/ sizeof(struct fiemap_extent);
+#endif
 	ret = ntfs_ioctl(ni, cmd, arg, flags, data);
 
 	if (ntfs_inode_close (ni))
@@ -2511,6 +2693,127 @@ static int ntfs_fuse_ioctl(const char *path,
 }
 #endif /* defined(FUSE_INTERNAL) || (FUSE_VERSION >= 28) */
 
+#if defined(FUSE_INTERNAL) || (FUSE_VERSION >= 29)
+
+/*
+ *		Allocate or deallocate space to a file
+ *
+ *	Preallocated clusters are not zeroed, they are beyond the
+ *	initialized size, and punched clusters are freed.
+ */
+
+static int ntfs_fuse_fallocate(const char *org_path, int mode,
+			off_t offset, off_t length,
+			struct fuse_file_info *fi __attribute__((unused)))
+{
+	ntfs_inode *ni = NULL;
+	ntfs_attr *na = NULL;
+	int res;
+	char *path = NULL;
+	ntfschar *stream_name;
+	int stream_name_len;
+	s64 oldsize;
+
+	if ((mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+	    || ((mode & FALLOC_FL_PUNCH_HOLE)
+		&& !(mode & FALLOC_FL_KEEP_SIZE)))
+		return (-EOPNOTSUPP);
+	if ((offset < 0) || (length <= 0))
+		return (-EINVAL);
+	stream_name_len = ntfs_fuse_parse_path(org_path, &path, &stream_name);
+	if (stream_name_len < 0)
+		return stream_name_len;
+	ni = ntfs_pathname_to_inode(ctx->vol, NULL, path);
+	if (!ni)
+		goto exit;
+	/* deny allocating to metadata files */
+	if (ni->mft_no < FILE_first_user) {
+		errno = EPERM;
+		goto exit;
+	}
+	na = ntfs_attr_open(ni, AT_DATA, stream_name, stream_name_len);
+	if (!na)
+		goto exit;
+	oldsize = na->data_size;
+	if (mode & FALLOC_FL_PUNCH_HOLE)
+		res = ntfs_attr_punch_hole(na, offset, length);
+	else
+		res = ntfs_attr_fallocate(na, offset, length,
+				(mode & FALLOC_FL_KEEP_SIZE) != 0);
+	if (res)
+		goto exit;
+	if ((mode & FALLOC_FL_PUNCH_HOLE) || (na->data_size != oldsize)) {
+		set_archive(ni);
+		ntfs_fuse_update_times(ni, NTFS_UPDATE_MCTIME);
+	} else
+		ntfs_fuse_update_times(ni, NTFS_UPDATE_CTIME);
+	errno = 0;
+exit:
+	res = -errno;
+	ntfs_attr_close(na);
+	if (ntfs_inode_close(ni))
+		set_fuse_error(&res);
+	free(path);
+	if (stream_name_len)
+		free(stream_name);
+	return res;
+}
+
+#endif /* defined(FUSE_INTERNAL) || (FUSE_VERSION >= 29) */
+
+#if defined(FUSE_INTERNAL) && defined(SEEK_DATA) && defined(SEEK_HOLE)
+
+/*
+ *		Find the next data or hole, for SEEK_DATA and SEEK_HOLE
+ */
+
+static off_t ntfs_fuse_lseek(const char *org_path, off_t off, int whence,
+			struct fuse_file_info *fi __attribute__((unused)))
+{
+	ntfs_inode *ni = NULL;
+	ntfs_attr *na = NULL;
+	char *path = NULL;
+	ntfschar *stream_name;
+	int stream_name_len;
+	s64 pos;
+	int res;
+
+	if ((whence != SEEK_DATA) && (whence != SEEK_HOLE))
+		return (-EINVAL);
+	stream_name_len = ntfs_fuse_parse_path(org_path, &path, &stream_name);
+	if (stream_name_len < 0)
+		return stream_name_len;
+	pos = -1;
+	ni = ntfs_pathname_to_inode(ctx->vol, NULL, path);
+	if (!ni)
+		goto exit;
+		/* the sparse data of a system-compressed file is a stub */
+	if (!stream_name_len
+	    && (ni->flags & FILE_ATTR_REPARSE_POINT)
+	    && (ntfs_get_system_compressed_file_size(ni) >= 0)) {
+		if (off < ni->data_size)
+			pos = (whence == SEEK_HOLE ? ni->data_size : off);
+		else
+			errno = ENXIO;
+		goto exit;
+	}
+	na = ntfs_attr_open(ni, AT_DATA, stream_name, stream_name_len);
+	if (!na)
+		goto exit;
+	pos = ntfs_attr_seek_hole_data(na, off, whence == SEEK_HOLE);
+exit:
+	res = (pos < 0 ? -errno : 0);
+	ntfs_attr_close(na);
+	if (ni && ntfs_inode_close(ni))
+		set_fuse_error(&res);
+	free(path);
+	if (stream_name_len)
+		free(stream_name);
+	return (res ? res : pos);
+}
+
+#endif /* defined(FUSE_INTERNAL) && defined(SEEK_DATA) && ... */
+
 static int ntfs_fuse_bmap(const char *path, size_t blocksize, uint64_t *idx)
 {
 	ntfs_inode *ni;
@@ -2712,7 +3015,6 @@ static int fix_xattr_prefix(const char *name, int namespace, ntfschar **lename)
 
 static int ntfs_fuse_listxattr(const char *path, char *list, size_t size)
 {
-	ntfs_attr_search_ctx *actx = NULL;
 	ntfs_inode *ni;
 	int ret = 0;
 #if !KERNELPERMS | (POSIXACLS & !KERNELACLS)
@@ -2739,24 +3041,11 @@ static int ntfs_fuse_listxattr(const char *path, char *list, size_t size)
 		goto exit;
 	}
 #endif
-	actx = ntfs_attr_get_search_ctx(ni, NULL);
-	if (!actx) {
-		ret = -errno;
-		goto exit;
-	}
-
 	if ((ctx->streams == NF_STREAMS_INTERFACE_XATTR)
-	    || (ctx->streams == NF_STREAMS_INTERFACE_OPENXATTR)) {
-		ret = ntfs_fuse_listxattr_common(ni, actx, list, size,
+	    || (ctx->streams == NF_STREAMS_INTERFACE_OPENXATTR))
+		ret = ntfs_fuse_listxattr_common(ni, list, size,
 				ctx->streams == NF_STREAMS_INTERFACE_XATTR);
-		if (ret < 0)
-			goto exit;
-	}
-	if (errno != ENOENT)
-		ret = -errno;
 exit:
-	if (actx)
-		ntfs_attr_put_search_ctx(actx);
 	if (ntfs_inode_close(ni))
 		set_fuse_error(&ret);
 	return ret;
@@ -2948,7 +3237,7 @@ static int ntfs_fuse_getxattr(const char *path, const char *name,
 		res = -errno;
 		goto exit;
 	}
-	na = ntfs_attr_open(ni, AT_DATA, lename, lename_len);
+	na = ntfs_stream_open(ni, lename, lename_len);
 	if (!na) {
 		res = -ENODATA;
 		goto exit;
@@ -2970,7 +3259,7 @@ static int ntfs_fuse_getxattr(const char *path, const char *name,
 		res = rsize;
 exit:
 	if (na)
-		ntfs_attr_close(na);
+		ntfs_stream_close(na);
 	free(lename);
 	if (ntfs_inode_close(ni))
 		set_fuse_error(&res);
@@ -3133,7 +3422,7 @@ static int ntfs_fuse_setxattr(const char *path, const char *name,
 		res = -errno;
 		goto exit;
 	}
-	na = ntfs_attr_open(ni, AT_DATA, lename, lename_len);
+	na = ntfs_stream_open(ni, lename, lename_len);
 	if (na && flags == XATTR_CREATE) {
 		res = -EEXIST;
 		goto exit;
@@ -3151,7 +3440,7 @@ static int ntfs_fuse_setxattr(const char *path, const char *name,
 			set_archive(ni);
 			NInoFileNameSetDirty(ni);
 		}
-		na = ntfs_attr_open(ni, AT_DATA, lename, lename_len);
+		na = ntfs_stream_open(ni, lename, lename_len);
 		if (!na) {
 			res = -errno;
 			goto exit;
@@ -3190,8 +3479,12 @@ static int ntfs_fuse_setxattr(const char *path, const char *name,
 		}
 	}
 exit:
-	if (na)
-		ntfs_attr_close(na);
+	if (na) {
+		if (res)
+			ntfs_attr_close(na);
+		else
+			ntfs_stream_close(na);
+	}
 	free(lename);
 	if (ntfs_inode_close(ni))
 		set_fuse_error(&res);
@@ -3419,6 +3712,9 @@ static void ntfs_close(void)
 			}
 		}
 		ntfs_close_secure(&security);
+		ntfs_fuse_log_lru_caches(ctx->vol);
+		if (ctx->mount_cache && !ctx->mount_cache_loaded)
+			ntfs_fuse_save_mount_cache(ctx->vol, ctx->mount_cache);
 	}
 	
 	if (ntfs_umount(ctx->vol, FALSE))
@@ -3465,6 +3761,12 @@ static struct fuse_operations ntfs_3g_ops = {
 #if defined(FUSE_INTERNAL) || (FUSE_VERSION >= 28)
         .ioctl		= ntfs_fuse_ioctl,
 #endif /* defined(FUSE_INTERNAL) || (FUSE_VERSION >= 28) */
+#if defined(FUSE_INTERNAL) || (FUSE_VERSION >= 29)
+        .fallocate	= ntfs_fuse_fallocate,
+#endif /* defined(FUSE_INTERNAL) || (FUSE_VERSION >= 29) */
+#if defined(FUSE_INTERNAL) && defined(SEEK_DATA) && defined(SEEK_HOLE)
+        .lseek		= ntfs_fuse_lseek,
+#endif /* defined(FUSE_INTERNAL) && defined(SEEK_DATA) && ... */
 #if !KERNELPERMS | (POSIXACLS & !KERNELACLS)
 	.access		= ntfs_fuse_access,
 	.opendir	= ntfs_fuse_opendir,
@@ -3500,6 +3802,10 @@ static int ntfs_fuse_init(void)
 		.streams = NF_STREAMS_INTERFACE_NONE,
 #endif			
 		.atime   = ATIME_RELATIVE,
+		.inode_cache = CACHE_PATH_SIZE,
+		.nidata_cache = CACHE_NIDATA_SIZE,
+		.lookup_cache = CACHE_LOOKUP_SIZE,
+		.compression_level = COMPRESSION_LEVEL_DEFAULT,
 		.silent  = TRUE,
 		.recover = TRUE
 	};
@@ -3518,6 +3824,16 @@ static int ntfs_open(const char *device)
 		flags |= NTFS_MNT_RECOVER;
 	if (ctx->hiberfile)
 		flags |= NTFS_MNT_IGNORE_HIBERFILE;
+	if (ctx->direct_io_dev)
+		flags |= NTFS_MNT_DIRECT_IO;
+	if (ctx->mmap_dev)
+		flags |= NTFS_MNT_MMAP;
+	if (ctx->overlay)
+		flags |= NTFS_MNT_OVERLAY;
+	if (ctx->fast_mount)
+		flags |= NTFS_MNT_FAST;
+	if (ctx->immutable)
+		flags |= NTFS_MNT_IMMUTABLE;
 
 	ctx->vol = ntfs_mount(device, flags);
 	if (!ctx->vol) {
@@ -3526,10 +3842,55 @@ static int ntfs_open(const char *device)
 	}
 	if (ctx->sync && ctx->vol->dev)
 		NDevSetSync(ctx->vol->dev);
+	if (ctx->block_cache && ctx->vol->dev
+	    && ntfs_devcache_attach(ctx->vol->dev,
+			(s64)ctx->block_cache << 20,
+			ctx->block_cache_writeback))
+		ntfs_log_perror("Could not set up the device cache");
+	if (ctx->io_trace && ctx->vol->dev
+	    && ntfs_devtrace_attach(ctx->vol->dev, ctx->io_trace))
+		ntfs_log_perror("Could not trace the device into '%s'",
+				ctx->io_trace);
+	if (ctx->mft_cache
+	    && ntfs_mftcache_attach(ctx->vol, ctx->mft_cache,
+			ctx->mft_cache_writeback))
+		ntfs_log_perror("Could not set up the MFT record cache");
+	if (ctx->dir_index_cache
+	    && ntfs_dirindex_attach(ctx->vol,
+			(s64)ctx->dir_index_cache << 20))
+		ntfs_log_perror("Could not set up the directory index cache");
+	if (ctx->index_cache
+	    && ntfs_idxcache_attach(ctx->vol, ctx->index_cache))
+		ntfs_log_perror("Could not set up the index block cache");
+	if ((ctx->bitmap_cache || ctx->bitmap_resident)
+	    && ntfs_bmpcache_attach(ctx->vol, ctx->bitmap_cache,
+			ctx->bitmap_resident))
+		ntfs_log_perror("Could not set up the bitmap cache");
+	if (ctx->filename_delay
+	    && ntfs_inode_defer_file_names(ctx->vol, ctx->filename_delay))
+		ntfs_log_perror("Could not defer the directory entry updates");
+	if (ctx->commit_interval) {
+		ctx->vol->commit_interval = ctx->commit_interval;
+		ctx->vol->committed = time((time_t*)NULL);
+	}
+	if (ctx->mft_growth)
+		ctx->vol->mft_growth = ctx->mft_growth;
+	if (ntfs_cluster_stripe_set(ctx->vol, ctx->stripe))
+		ntfs_log_perror("Could not align the allocations to stripes");
+	ctx->vol->compression_level = ctx->compression_level;
+	ctx->vol->fstrim_rate = (u64)ctx->fstrim_rate << 20;
+	if (ntfs_resize_lru_caches(ctx->vol, ctx->inode_cache,
+			ctx->nidata_cache, ctx->lookup_cache))
+		ntfs_log_perror("Could not resize the caches");
+	ctx->vol->cache_mem = ctx->cache_mem;
 	if (ctx->compression)
 		NVolSetCompression(ctx->vol);
 	else
 		NVolClearCompression(ctx->vol);
+	if (ctx->sparse_zero_detect)
+		NVolSetSparseZeroDetect(ctx->vol);
+	if (ctx->usn_journal && !ctx->ro && ntfs_usn_start(ctx->vol))
+		ntfs_log_perror("Could not record the changes into $UsnJrnl");
 #ifdef HAVE_SETXATTR
 			/* archivers must see hidden files */
 	if (ctx->efs_raw)
@@ -3539,16 +3900,21 @@ static int ntfs_open(const char *device)
 				!ctx->hide_hid_files, ctx->hide_dot_files))
 		goto err_out;
 	
-	ctx->vol->free_clusters = ntfs_attr_get_free_bits(ctx->vol->lcnbmp_na);
-	if (ctx->vol->free_clusters < 0) {
-		ntfs_log_perror("Failed to read NTFS $Bitmap");
-		goto err_out;
-	}
+	ctx->mount_cache_loaded = ctx->mount_cache
+		&& ntfs_fuse_load_mount_cache(ctx->vol, ctx->mount_cache);
+	if (!ctx->mount_cache_loaded) {
+		if (ntfs_cluster_count_free(ctx->vol)) {
+			ntfs_log_perror("Failed to read NTFS $Bitmap");
+			goto err_out;
+		}
 
-	ctx->vol->free_mft_records = ntfs_get_nr_free_mft_records(ctx->vol);
-	if (ctx->vol->free_mft_records < 0) {
-		ntfs_log_perror("Failed to calculate free MFT records");
-		goto err_out;
+		ctx->vol->free_mft_records
+				= ntfs_get_nr_free_mft_records(ctx->vol);
+		if (ctx->vol->free_mft_records < 0) {
+			ntfs_log_perror("Failed to calculate free MFT"
+					" records");
+			goto err_out;
+		}
 	}
 
 	if (ctx->hiberfile && ntfs_volume_check_hiberfile(ctx->vol, 0)) {
@@ -3830,6 +4196,11 @@ int main(int argc, char *argv[])
 		usage();
 		return NTFS_VOLUME_SYNTAX_ERROR;
 	}
+	if (opts.volumes) {
+		ntfs_log_error("%s: Option '--volumes' is only supported by "
+				"lowntfs-3g\n", EXEC_NAME);
+		return NTFS_VOLUME_SYNTAX_ERROR;
+	}
 
 	if (ntfs_fuse_init()) {
 		err = NTFS_VOLUME_OUT_OF_MEMORY;
@@ -4022,6 +4393,12 @@ int main(int argc, char *argv[])
 		ntfs_log_info("%s", fuse26_kmod_msg);
 #endif	
 	setup_logging(parsed_options);
+		/* after daemonizing, which would not retain the thread */
+	ntfs_cluster_count_start(ctx->vol);
+	if (ctx->security.mapping[MAPUSERS])
+		ntfs_secure_preload(ctx->vol, FALSE);
+	if (ctx->discard && !ctx->ro && ntfs_discard_start(ctx->vol))
+		ntfs_log_perror("Could not start discarding the freed clusters");
 	if (failed_secure)
 	        ntfs_log_info("%s\n",failed_secure);
 	if (permissions_mode)
@@ -4046,6 +4423,8 @@ err_out:
 #endif /* defined(HAVE_SETXATTR) && defined(XATTR_MAPPINGS) */
 err2:
 	ntfs_close();
+	free(ctx->mount_cache);
+	free(ctx->io_trace);
 	free(ctx);
 	free(parsed_options);
 	free(opts.options);
@@ -24,6 +24,10 @@
 #include "config.h"
 #endif
 
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+
 #ifdef HAVE_STDLIB_H
 #include <stdlib.h>
 #endif
@@ -40,6 +44,10 @@
 #include <errno.h>
 #endif
 
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
 #include <getopt.h>
 #include <fuse.h>
 
@@ -48,6 +56,12 @@
 #include "xattrs.h"
 #include "ntfs-3g_common.h"
 #include "realpath.h"
+#include "cache.h"
+#include "mftcache.h"
+#include "dirindex.h"
+#include "idxcache.h"
+#include "bmpcache.h"
+#include "lcnalloc.h"
 #include "misc.h"
 
 const char xattr_ntfs_3g[] = "ntfs-3g.";
@@ -76,6 +90,7 @@ const struct DEFOPTION optionlist[] = {
 	{ "noatime", OPT_NOATIME, FLGOPT_BOGUS },
 	{ "atime", OPT_ATIME, FLGOPT_BOGUS },
 	{ "relatime", OPT_RELATIME, FLGOPT_BOGUS },
+	{ "lazytime", OPT_LAZYTIME, FLGOPT_BOGUS },
 	{ "delay_mtime", OPT_DMTIME, FLGOPT_DECIMAL | FLGOPT_OPTIONAL },
 	{ "fake_rw", OPT_FAKE_RW, FLGOPT_BOGUS },
 	{ "fsname", OPT_FSNAME, FLGOPT_NOSUPPORT },
@@ -117,6 +132,38 @@ const struct DEFOPTION optionlist[] = {
 	{ "usermapping", OPT_USERMAPPING, FLGOPT_STRING },
 	{ "xattrmapping", OPT_XATTRMAPPING, FLGOPT_STRING },
 	{ "efs_raw", OPT_EFS_RAW, FLGOPT_BOGUS },
+	{ "threads", OPT_THREADS, FLGOPT_DECIMAL },
+	{ "writeback_cache", OPT_WRITEBACK_CACHE, FLGOPT_BOGUS },
+	{ "cache_timeout", OPT_CACHE_TIMEOUT, FLGOPT_DECIMAL },
+	{ "direct_io_dev", OPT_DIRECT_IO_DEV, FLGOPT_BOGUS },
+	{ "mmap_dev", OPT_MMAP_DEV, FLGOPT_BOGUS },
+	{ "overlay", OPT_OVERLAY, FLGOPT_BOGUS },
+	{ "fast_mount", OPT_FAST_MOUNT, FLGOPT_BOGUS },
+	{ "immutable", OPT_IMMUTABLE, FLGOPT_BOGUS },
+	{ "mount_cache", OPT_MOUNT_CACHE, FLGOPT_STRING },
+	{ "block_cache", OPT_BLOCK_CACHE, FLGOPT_DECIMAL },
+	{ "block_cache_writeback", OPT_BLOCK_CACHE_WRITEBACK, FLGOPT_BOGUS },
+	{ "io_trace", OPT_IO_TRACE, FLGOPT_STRING },
+	{ "write_buffer", OPT_WRITE_BUFFER, FLGOPT_BOGUS },
+	{ "inode_cache", OPT_INODE_CACHE, FLGOPT_DECIMAL },
+	{ "nidata_cache", OPT_NIDATA_CACHE, FLGOPT_DECIMAL },
+	{ "lookup_cache", OPT_LOOKUP_CACHE, FLGOPT_DECIMAL },
+	{ "mft_cache", OPT_MFT_CACHE, FLGOPT_DECIMAL },
+	{ "mft_cache_writeback", OPT_MFT_CACHE_WRITEBACK, FLGOPT_BOGUS },
+	{ "dir_index_cache", OPT_DIR_INDEX_CACHE, FLGOPT_DECIMAL },
+	{ "index_cache", OPT_INDEX_CACHE, FLGOPT_DECIMAL },
+	{ "bitmap_cache", OPT_BITMAP_CACHE, FLGOPT_DECIMAL },
+	{ "bitmap_resident", OPT_BITMAP_RESIDENT, FLGOPT_BOGUS },
+	{ "cache_mem", OPT_CACHE_MEM, FLGOPT_STRING },
+	{ "filename_delay", OPT_FILENAME_DELAY, FLGOPT_DECIMAL },
+	{ "commit", OPT_COMMIT, FLGOPT_DECIMAL },
+	{ "mft_growth", OPT_MFT_GROWTH, FLGOPT_DECIMAL },
+	{ "stripe", OPT_STRIPE, FLGOPT_STRING },
+	{ "compression_level", OPT_COMPRESSION_LEVEL, FLGOPT_DECIMAL },
+	{ "discard", OPT_DISCARD, FLGOPT_STRING },
+	{ "fstrim_rate", OPT_FSTRIM_RATE, FLGOPT_DECIMAL },
+	{ "sparse_zero_detect", OPT_SPARSE_ZERO_DETECT, FLGOPT_BOGUS },
+	{ "usn_journal", OPT_USN_JOURNAL, FLGOPT_BOGUS },
 	{ (const char*)NULL, 0, 0 } /* end marker */
 } ;
 
@@ -221,6 +268,45 @@ static int missing_option_value(char *val, const char *s)
 	return 0;
 }
 
+/*
+ *		Get a memory size, in MB unless followed by K, M or G
+ *
+ *	Returns 0 if successful, -1 if the value is not valid
+ */
+
+static int memory_option_value(char *val, const char *s, u64 *psize)
+{
+	unsigned long long size;
+	char *end;
+
+	size = strtoull(val, &end, 10);
+	switch (*end) {
+	case 'k' :
+	case 'K' :
+		size <<= 10;
+		end++;
+		break;
+	case 'g' :
+	case 'G' :
+		size <<= 30;
+		end++;
+		break;
+	case 'm' :
+	case 'M' :
+		end++;
+		/* fall through */
+	default :
+		size <<= 20;
+		break;
+	}
+	if ((end == val) || *end || (size > ((u64)1 << 50))) {
+		ntfs_log_error("'%s' option needs a size, such as 256M\n", s);
+		return -1;
+	}
+	*psize = size;
+	return 0;
+}
+
 char *parse_mount_options(ntfs_fuse_context_t *ctx,
 			const struct ntfs_options *popts, BOOL low_fuse)
 {
@@ -232,6 +318,7 @@ char *parse_mount_options(ntfs_fuse_context_t *ctx,
 	int acl = 0;
 	int want_permissions = 0;
 	int intarg;
+	u64 size;
 	const struct DEFOPTION *poptl;
 
 	ctx->secure_flags = 0;
@@ -292,6 +379,9 @@ char *parse_mount_options(ntfs_fuse_context_t *ctx,
 			case OPT_RELATIME :
 				ctx->atime = ATIME_RELATIVE;
 				break;
+			case OPT_LAZYTIME :
+				ctx->lazytime = TRUE;
+				break;
 			case OPT_DMTIME :
 				if (!intarg)
 					intarg = DEFAULT_DMTIME;
@@ -480,6 +570,214 @@ char *parse_mount_options(ntfs_fuse_context_t *ctx,
 				ctx->efs_raw = TRUE;
 				break;
 #endif /* HAVE_SETXATTR */
+			case OPT_THREADS :
+				if (!low_fuse) {
+					ntfs_log_error("'%s' is an unsupported option.\n",
+						poptl->name);
+					goto err_exit;
+				}
+				if (intarg < 1) {
+					ntfs_log_error("'%s' option needs a positive"
+						" value\n", poptl->name);
+					goto err_exit;
+				}
+				ctx->threads = intarg;
+				break;
+			case OPT_WRITEBACK_CACHE :
+				if (!low_fuse) {
+					ntfs_log_error("'%s' is an unsupported option.\n",
+						poptl->name);
+					goto err_exit;
+				}
+				ctx->writeback_cache = TRUE;
+				break;
+			case OPT_CACHE_TIMEOUT :
+				if (!low_fuse) {
+					ntfs_log_error("'%s' is an unsupported option.\n",
+						poptl->name);
+					goto err_exit;
+				}
+				if (intarg < 1) {
+					ntfs_log_error("'%s' option needs a positive"
+						" value\n", poptl->name);
+					goto err_exit;
+				}
+				ctx->cache_timeout = intarg;
+				break;
+			case OPT_DIRECT_IO_DEV :
+				ctx->direct_io_dev = TRUE;
+				break;
+			case OPT_MMAP_DEV :
+				ctx->mmap_dev = TRUE;
+				break;
+			case OPT_OVERLAY :
+				ctx->overlay = TRUE;
+				break;
+			case OPT_FAST_MOUNT :
+				ctx->fast_mount = TRUE;
+				break;
+			case OPT_IMMUTABLE :
+				ctx->immutable = TRUE;
+				break;
+			case OPT_MOUNT_CACHE :
+				free(ctx->mount_cache);
+				ctx->mount_cache = strdup(val);
+				if (!ctx->mount_cache) {
+					ntfs_log_error("no more memory to store "
+						"'mount_cache' option.\n");
+					goto err_exit;
+				}
+				break;
+			case OPT_BLOCK_CACHE :
+				if ((intarg < 1) || (intarg > 65536)) {
+					ntfs_log_error("'%s' option needs a value"
+						" from 1 to 65536\n", poptl->name);
+					goto err_exit;
+				}
+				ctx->block_cache = intarg;
+				break;
+			case OPT_BLOCK_CACHE_WRITEBACK :
+				ctx->block_cache_writeback = TRUE;
+				break;
+			case OPT_IO_TRACE :
+				free(ctx->io_trace);
+				ctx->io_trace = strdup(val);
+				if (!ctx->io_trace) {
+					ntfs_log_error("no more memory to store "
+						"'io_trace' option.\n");
+					goto err_exit;
+				}
+				break;
+			case OPT_WRITE_BUFFER :
+				ctx->write_buffer = TRUE;
+				break;
+			case OPT_INODE_CACHE :
+			case OPT_NIDATA_CACHE :
+			case OPT_LOOKUP_CACHE :
+				if ((intarg < 0) || (intarg > CACHE_MAX_SIZE)
+				    || ((intarg > 0) && (intarg < 3))) {
+					ntfs_log_error("'%s' option needs zero or"
+						" a value from 3 to %d\n",
+						poptl->name, CACHE_MAX_SIZE);
+					goto err_exit;
+				}
+				if (poptl->type == OPT_INODE_CACHE)
+					ctx->inode_cache = intarg;
+				else if (poptl->type == OPT_NIDATA_CACHE)
+					ctx->nidata_cache = intarg;
+				else
+					ctx->lookup_cache = intarg;
+				break;
+			case OPT_MFT_CACHE :
+				if ((intarg < 1) || (intarg > CACHE_MAX_SIZE)) {
+					ntfs_log_error("'%s' option needs a value"
+						" from 1 to %d\n", poptl->name,
+						CACHE_MAX_SIZE);
+					goto err_exit;
+				}
+				ctx->mft_cache = intarg;
+				break;
+			case OPT_MFT_CACHE_WRITEBACK :
+				ctx->mft_cache_writeback = TRUE;
+				break;
+			case OPT_DIR_INDEX_CACHE :
+				if ((intarg < 1) || (intarg > 65536)) {
+					ntfs_log_error("'%s' option needs a value"
+						" from 1 to 65536\n", poptl->name);
+					goto err_exit;
+				}
+				ctx->dir_index_cache = intarg;
+				break;
+			case OPT_INDEX_CACHE :
+				if ((intarg < 1) || (intarg > CACHE_MAX_SIZE)) {
+					ntfs_log_error("'%s' option needs a value"
+						" from 1 to %d\n", poptl->name,
+						CACHE_MAX_SIZE);
+					goto err_exit;
+				}
+				ctx->index_cache = intarg;
+				break;
+			case OPT_BITMAP_CACHE :
+				if ((intarg < 1) || (intarg > CACHE_MAX_SIZE)) {
+					ntfs_log_error("'%s' option needs a value"
+						" from 1 to %d\n", poptl->name,
+						CACHE_MAX_SIZE);
+					goto err_exit;
+				}
+				ctx->bitmap_cache = intarg;
+				break;
+			case OPT_BITMAP_RESIDENT :
+				ctx->bitmap_resident = TRUE;
+				break;
+			case OPT_CACHE_MEM :
+				if (memory_option_value(val, opt,
+						&ctx->cache_mem))
+					goto err_exit;
+				break;
+			case OPT_FILENAME_DELAY :
+				if ((intarg < 1) || (intarg > 86400)) {
+					ntfs_log_error("'%s' option needs a value"
+						" from 1 to 86400\n", poptl->name);
+					goto err_exit;
+				}
+				ctx->filename_delay = intarg;
+				break;
+			case OPT_COMMIT :
+				if ((intarg < 1) || (intarg > 86400)) {
+					ntfs_log_error("'%s' option needs a value"
+						" from 1 to 86400\n", poptl->name);
+					goto err_exit;
+				}
+				ctx->commit_interval = intarg;
+				break;
+			case OPT_MFT_GROWTH :
+				if (intarg < MFT_GROWTH_MIN) {
+					ntfs_log_error("'%s' option needs a value"
+						" of at least %d\n", poptl->name,
+						MFT_GROWTH_MIN);
+					goto err_exit;
+				}
+				ctx->mft_growth = intarg;
+				break;
+			case OPT_STRIPE :
+				if (memory_option_value(val, opt, &size))
+					goto err_exit;
+					/* zero means no alignment */
+				ctx->stripe = (size ? (s64)size : -1);
+				break;
+			case OPT_COMPRESSION_LEVEL :
+				if ((intarg < 0)
+				    || (intarg > COMPRESSION_LEVEL_MAX)) {
+					ntfs_log_error("'%s' option needs a value"
+						" from 0 to %d\n", poptl->name,
+						COMPRESSION_LEVEL_MAX);
+					goto err_exit;
+				}
+				ctx->compression_level = intarg;
+				break;
+			case OPT_DISCARD :
+				if (!strcmp(val, "async"))
+					ctx->discard = TRUE;
+				else {
+					ntfs_log_error("Invalid discard mode,"
+						" only 'async' is supported.\n");
+					goto err_exit;
+				}
+				break;
+			case OPT_FSTRIM_RATE :
+				if ((intarg < 1) || (intarg > 1048576)) {
+					ntfs_log_error("'%s' option needs a value"
+						" from 1 to 1048576\n", poptl->name);
+					goto err_exit;
+				}
+				ctx->fstrim_rate = intarg;
+				break;
+			case OPT_SPARSE_ZERO_DETECT :
+				ctx->sparse_zero_detect = TRUE;
+				break;
+			case OPT_USN_JOURNAL :
+				ctx->usn_journal = TRUE;
+				break;
 			case OPT_FSNAME : /* Filesystem name. */
 			/*
 			 * We need this to be able to check whether filesystem
@@ -507,6 +805,13 @@ char *parse_mount_options(ntfs_fuse_context_t *ctx,
 			if (ntfs_strappend(&ret, ","))
 				goto err_exit;
 		}
+	}
+		/* an immutable volume is read-only, with no access times */
+	if (ctx->immutable) {
+		if (!ctx->ro && ntfs_strappend(&ret, "ro,"))
+			goto err_exit;
+		ctx->ro = TRUE;
+		ctx->atime = ATIME_DISABLED;
 	}
 	if (!no_def_opts && ntfs_strappend(&ret, def_opts))
 		goto err_exit;
@@ -535,6 +840,16 @@ char *parse_mount_options(ntfs_fuse_context_t *ctx,
 		ctx->secure_flags &= ~(1 << SECURITY_ADDSECURIDS);
 		ctx->hiberfile = FALSE;
 	}
+		/* committing periodically needs write-back caches */
+	if (ctx->commit_interval && !ctx->sync) {
+		if (!ctx->mft_cache)
+			ctx->mft_cache = COMMIT_MFT_RECORDS;
+		ctx->mft_cache_writeback = TRUE;
+		if (!ctx->index_cache)
+			ctx->index_cache = COMMIT_INDEX_BLOCKS;
+		if (!ctx->bitmap_cache)
+			ctx->bitmap_cache = COMMIT_BITMAP_PAGES;
+	}
 exit:
 	free(options);
 	return ret;
@@ -562,6 +877,7 @@ int ntfs_parse_options(struct ntfs_options *popts, void (*usage)(void),
 		{ "no-mtab",	 no_argument,		NULL, 'n' },
 		{ "verbose",	 no_argument,		NULL, 'v' },
 		{ "version",	 no_argument,		NULL, 'V' },
+		{ "volumes",	 required_argument,	NULL, 'L' },
 		{ NULL,		 0,			NULL,  0  }
 	};
 
@@ -624,6 +940,10 @@ int ntfs_parse_options(struct ntfs_options *popts, void (*usage)(void),
 			ntfs_log_info("%s %s %s %d\n", EXEC_NAME, VERSION, 
 				      FUSE_TYPE, fuse_version());
 			exit(0);
+		case 'L':
+			/* the volumes and mount points are in a file */
+			popts->volumes = optarg;
+			break;
 		default:
 			ntfs_log_error("%s: Unknown option '%s'.\n", EXEC_NAME,
 				       argv[optind - 1]);
@@ -631,6 +951,16 @@ int ntfs_parse_options(struct ntfs_options *popts, void (*usage)(void),
 		}
 	}
 
+	if (popts->volumes) {
+		if (popts->device) {
+			ntfs_log_error("%s: No device can be specified with "
+					"option --volumes.\n", EXEC_NAME);
+			free(popts->device);
+			popts->device = NULL;
+			return -1;
+		}
+		return 0;
+	}
 	if (!popts->device) {
 		ntfs_log_error("%s: No device is specified.\n", EXEC_NAME);
 		return -1;
@@ -645,32 +975,30 @@ int ntfs_parse_options(struct ntfs_options *popts, void (*usage)(void),
 
 #ifdef HAVE_SETXATTR
 
-int ntfs_fuse_listxattr_common(ntfs_inode *ni, ntfs_attr_search_ctx *actx,
-			char *list, size_t size, BOOL prefixing)
+int ntfs_fuse_listxattr_common(ntfs_inode *ni, char *list, size_t size,
+			BOOL prefixing)
 {
 	int ret = 0;
 	char *to = list;
+	const char *names;
+	const char *tmp_name;
+	int names_size;
+	int tmp_name_len;
+	int pos;
 #ifdef XATTR_MAPPINGS
 	BOOL accepted;
 	const struct XATTRMAPPING *item;
 #endif /* XATTR_MAPPINGS */
 
 		/* first list the regular user attributes (ADS) */
-	while (!ntfs_attr_lookup(AT_DATA, NULL, 0, CASE_SENSITIVE,
-				0, NULL, 0, actx)) {
-		char *tmp_name = NULL;
-		int tmp_name_len;
-
-		if (!actx->attr->name_length)
-			continue;
-		tmp_name_len = ntfs_ucstombs(
-			(ntfschar *)((u8*)actx->attr +
-				le16_to_cpu(actx->attr->name_offset)),
-			actx->attr->name_length, &tmp_name, 0);
-		if (tmp_name_len < 0) {
-			ret = -errno;
-			goto exit;
-		}
+	names_size = ntfs_xattr_stream_names(ni, &names);
+	if (names_size < 0) {
+		ret = -errno;
+		goto exit;
+	}
+	for (pos=0; pos<names_size; pos+=tmp_name_len+1) {
+		tmp_name = &names[pos];
+		tmp_name_len = strlen(tmp_name);
 				/*
 				 * When using name spaces, do not return
 				 * security, trusted or system attributes
@@ -678,32 +1006,26 @@ int ntfs_fuse_listxattr_common(ntfs_inode *ni, ntfs_attr_search_ctx *actx,
 				 * otherwise insert "user." prefix
 				 */
 		if (prefixing) {
-			if ((strlen(tmp_name) > sizeof(xattr_ntfs_3g))
+			if (((size_t)tmp_name_len > sizeof(xattr_ntfs_3g))
 			  && !strncmp(tmp_name,xattr_ntfs_3g,
 				sizeof(xattr_ntfs_3g)-1))
-				tmp_name_len = 0;
-			else
-				ret += tmp_name_len
-					 + nf_ns_user_prefix_len + 1;
+				continue;
+			ret += tmp_name_len + nf_ns_user_prefix_len + 1;
 		} else
 			ret += tmp_name_len + 1;
-		if (size && tmp_name_len) {
+		if (size) {
 			if ((size_t)ret <= size) {
 				if (prefixing) {
 					strcpy(to, nf_ns_user_prefix);
 					to += nf_ns_user_prefix_len;
 				}
-				strncpy(to, tmp_name, tmp_name_len);
-				to += tmp_name_len;
-				*to = 0;
-				to++;
+				memcpy(to, tmp_name, tmp_name_len + 1);
+				to += tmp_name_len + 1;
 			} else {
-				free(tmp_name);
 				ret = -ERANGE;
 				goto exit;
 			}
 		}
-		free(tmp_name);
 	}
 #ifdef XATTR_MAPPINGS
 		/* now append the system attributes mapped to user space */
@@ -750,3 +1072,307 @@ exit :
 }
 
 #endif /* HAVE_SETXATTR */
+
+/*
+ *		Log the statistics of a cache
+ */
+
+static void log_lru_cache(const char *what, const struct CACHE_HEADER *cache)
+{
+	if (cache && cache->reads) {
+		ntfs_log_info("%s cache : %d entries, %lu writes, %lu reads,"
+			" %lu hits, %lu misses\n",
+			what, cache->item_count, cache->writes, cache->reads,
+			cache->hits, cache->misses);
+	}
+}
+
+/*
+ *		Log the statistics of the inode, nidata, lookup and MFT caches,
+ *	to help selecting their sizes
+ */
+
+void ntfs_fuse_log_lru_caches(ntfs_volume *vol)
+{
+#if CACHE_INODE_SIZE
+	log_lru_cache("Inode", vol->xinode_cache);
+#endif
+#if CACHE_NIDATA_SIZE
+	log_lru_cache("Nidata", vol->nidata_cache);
+#endif
+#if CACHE_LOOKUP_SIZE
+	log_lru_cache("Lookup", vol->lookup_cache);
+#endif
+#if CACHE_GROUPS_SIZE
+	log_lru_cache("Groups", vol->groups_cache);
+#endif
+#if CACHE_INHERIT_SIZE
+	log_lru_cache("Inherit", vol->inherit_cache);
+#endif
+#if CACHE_SYMLINK_SIZE
+	log_lru_cache("Symlink", vol->symlink_cache);
+#endif
+	ntfs_mftcache_log(vol);
+	ntfs_dirindex_log(vol);
+	ntfs_idxcache_log(vol);
+	ntfs_bmpcache_log(vol);
+}
+
+/*
+ *		Format the statistics of a cache
+ */
+
+static int format_lru_cache(char *buf, size_t size, const char *what,
+			const struct CACHE_HEADER *cache)
+{
+	int len;
+
+	len = 0;
+	if (cache && cache->reads) {
+		len = snprintf(buf, size, "%s cache : %d entries,"
+			" %lu reads, %lu hits (%lu%%), %lu misses,"
+			" %llu bytes, %lu evictions\n",
+			what, cache->item_count, cache->reads,
+			cache->hits, cache->hits*100/cache->reads,
+			cache->misses, (unsigned long long)cache->mem_used,
+			cache->evictions);
+	}
+	return (len);
+}
+
+/*
+ *		Format the statistics of the device, the cluster allocator
+ *	and the caches of a volume, as a text readable by users.
+ *
+ *	Returns the length of the text, which is truncated to the
+ *	size of the buffer (as with snprintf())
+ */
+
+int ntfs_fuse_volume_stats(ntfs_volume *vol, char *buf, size_t size)
+{
+	struct ntfs_device *dev;
+	size_t len;
+
+	dev = vol->dev;
+	len = snprintf(buf, size, "device : %llu reads, %llu bytes read,"
+			" %llu writes, %llu bytes written\n",
+			(unsigned long long)__atomic_load_n(&dev->d_reads,
+					__ATOMIC_RELAXED),
+			(unsigned long long)__atomic_load_n(&dev->d_read_bytes,
+					__ATOMIC_RELAXED),
+			(unsigned long long)__atomic_load_n(&dev->d_writes,
+					__ATOMIC_RELAXED),
+			(unsigned long long)__atomic_load_n(
+					&dev->d_written_bytes,
+					__ATOMIC_RELAXED));
+	len += snprintf(buf + (len < size ? len : size),
+			(len < size ? size - len : 0),
+			"allocator : %llu requests, %llu clusters,"
+			" %llu bitmap bytes scanned, %llu skipped\n",
+			(unsigned long long)vol->alloc_calls,
+			(unsigned long long)vol->alloc_clusters,
+			(unsigned long long)vol->alloc_bmp_read,
+			(unsigned long long)vol->alloc_bmp_skipped);
+	len += snprintf(buf + (len < size ? len : size),
+			(len < size ? size - len : 0),
+			"cache memory : %llu bytes used, budget %llu bytes,"
+			" %llu bytes in permissions cache\n",
+			(unsigned long long)__atomic_load_n(
+					&vol->cache_mem_used,
+					__ATOMIC_RELAXED),
+			(unsigned long long)vol->cache_mem,
+			(unsigned long long)vol->permissions_mem);
+#define APPEND_CACHE(what, cache) \
+	len += format_lru_cache(buf + (len < size ? len : size), \
+			(len < size ? size - len : 0), what, cache)
+#if CACHE_INODE_SIZE
+	APPEND_CACHE("Inode", vol->xinode_cache);
+#endif
+#if CACHE_NIDATA_SIZE
+	APPEND_CACHE("Nidata", vol->nidata_cache);
+#endif
+#if CACHE_LOOKUP_SIZE
+	APPEND_CACHE("Lookup", vol->lookup_cache);
+#endif
+#if CACHE_SECURID_SIZE
+	APPEND_CACHE("Securid", vol->securid_cache);
+#endif
+#if CACHE_LEGACY_SIZE
+	APPEND_CACHE("Legacy", vol->legacy_cache);
+#endif
+#if CACHE_GROUPS_SIZE
+	APPEND_CACHE("Groups", vol->groups_cache);
+#endif
+#if CACHE_INHERIT_SIZE
+	APPEND_CACHE("Inherit", vol->inherit_cache);
+#endif
+#if CACHE_CHUNK_SIZE
+	APPEND_CACHE("Chunk", vol->chunk_cache);
+#endif
+#if CACHE_SYMLINK_SIZE
+	APPEND_CACHE("Symlink", vol->symlink_cache);
+#endif
+#undef APPEND_CACHE
+	return (len);
+}
+
+/*
+ *		Cache of the mount data of read-only mounts
+ *
+ *	Counting the free clusters and MFT records implies reading the
+ *	full bitmaps, and the result is the same on each mount of a
+ *	volume which has not been modified. So on read-only mounts, the
+ *	counts are saved on unmounting into a small file named after the
+ *	volume serial number, and they are used on the next mount if the
+ *	volume still has the same size, MFT size, flags and journal LSN.
+ *	Mounting read-write drops the file, as ntfs-3g does not update
+ *	the journal.
+ */
+
+#define MOUNT_CACHE_VERSION 1
+
+struct MOUNT_CACHE {
+	unsigned long long serial_no;
+	unsigned long long lsn;
+	unsigned long long nr_clusters;
+	unsigned long long mft_size;
+	unsigned long long free_clusters;
+	unsigned long long free_mft_records;
+	unsigned int flags;
+	unsigned int version;
+} ;
+
+static char *mount_cache_name(const ntfs_volume *vol, const char *dir)
+{
+	char *name;
+
+	name = (char*)ntfs_malloc(strlen(dir) + 22);
+	if (name)
+		sprintf(name, "%s/%016llx", dir,
+				(unsigned long long)vol->serial_no);
+	return (name);
+}
+
+static int mount_cache_key(ntfs_volume *vol, struct MOUNT_CACHE *mc)
+{
+	s64 lsn;
+	int res;
+
+	res = -1;
+	if (!(vol->flags & VOLUME_IS_DIRTY)
+	    && !ntfs_volume_get_lsn(vol, &lsn)) {
+		mc->version = MOUNT_CACHE_VERSION;
+		mc->serial_no = vol->serial_no;
+		mc->lsn = lsn;
+		mc->nr_clusters = vol->nr_clusters;
+		mc->mft_size = vol->mft_na->data_size;
+		mc->flags = le16_to_cpu(vol->flags);
+		res = 0;
+	}
+	return (res);
+}
+
+/*
+ *		Get the free counts saved by a previous read-only mount
+ *
+ *	Returns TRUE if the counts have been set in the volume
+ */
+
+BOOL ntfs_fuse_load_mount_cache(ntfs_volume *vol, const char *dir)
+{
+	struct MOUNT_CACHE key;
+	struct MOUNT_CACHE mc;
+	char *name;
+	FILE *f;
+	BOOL loaded;
+
+	loaded = FALSE;
+	name = mount_cache_name(vol, dir);
+	if (name) {
+		if (!NVolReadOnly(vol)) {
+				/* the counts will become obsolete */
+			if (unlink(name) && (errno != ENOENT))
+				ntfs_log_perror("Could not remove %s", name);
+		} else {
+			f = fopen(name, "r");
+			if (f) {
+				if ((fscanf(f, "version %u serial %llx lsn %llu"
+					" clusters %llu mft %llu flags %x"
+					" free_clusters %llu"
+					" free_mft_records %llu",
+					&mc.version, &mc.serial_no, &mc.lsn,
+					&mc.nr_clusters, &mc.mft_size,
+					&mc.flags, &mc.free_clusters,
+					&mc.free_mft_records) == 8)
+				    && !mount_cache_key(vol, &key)
+				    && (mc.version == key.version)
+				    && (mc.serial_no == key.serial_no)
+				    && (mc.lsn == key.lsn)
+				    && (mc.nr_clusters == key.nr_clusters)
+				    && (mc.mft_size == key.mft_size)
+				    && (mc.flags == key.flags)
+				    && (mc.free_clusters <= mc.nr_clusters)) {
+					vol->free_clusters = mc.free_clusters;
+					vol->free_mft_records
+						= mc.free_mft_records;
+					loaded = TRUE;
+				}
+				fclose(f);
+			}
+		}
+		free(name);
+	}
+	return (loaded);
+}
+
+/*
+ *		Save the free counts for the next read-only mount
+ *
+ *	Nothing is saved if the count of free clusters is not complete.
+ *	The file is renamed into place, so that a mount never sees it
+ *	partially written.
+ */
+
+void ntfs_fuse_save_mount_cache(ntfs_volume *vol, const char *dir)
+{
+	struct MOUNT_CACHE mc;
+	char *name;
+	char *tmpname;
+	FILE *f;
+	BOOL ok;
+
+	if (NVolReadOnly(vol)
+	    && ntfs_cluster_count_done(vol)
+	    && (vol->free_clusters >= 0)
+	    && (vol->free_mft_records >= 0)
+	    && !mount_cache_key(vol, &mc)) {
+		name = mount_cache_name(vol, dir);
+		tmpname = (char*)ntfs_malloc(strlen(dir) + 26);
+		if (name && tmpname) {
+			sprintf(tmpname, "%s.tmp", name);
+			f = fopen(tmpname, "w");
+			if (f) {
+				ok = (fprintf(f, "version %u\nserial %016llx\n"
+					"lsn %llu\nclusters %llu\nmft %llu\n"
+					"flags %x\nfree_clusters %llu\n"
+					"free_mft_records %llu\n",
+					mc.version, mc.serial_no, mc.lsn,
+					mc.nr_clusters, mc.mft_size, mc.flags,
+					(unsigned long long)vol->free_clusters,
+					(unsigned long long)
+						vol->free_mft_records) > 0);
+				if (fclose(f))
+					ok = FALSE;
+				if (!ok || rename(tmpname, name)) {
+					ntfs_log_perror("Could not save %s",
+							name);
+					unlink(tmpname);
+				}
+			} else
+				ntfs_log_perror("Could not create %s",
+						tmpname);
+		}
+		free(name);
+		free(tmpname);
+	}
+}
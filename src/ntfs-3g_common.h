@@ -25,11 +25,20 @@
 
 #include "inode.h"
 
+		/* fallocate(2) modes, as passed through the fuse protocol */
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE	0x01
+#endif
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE	0x02
+#endif
+
 struct ntfs_options {
         char    *mnt_point;     /* Mount point */    
         char    *options;       /* Mount options */  
         char    *device;        /* Device to mount */
 	char	*arg_device;	/* Device requested in argv */
+	char	*volumes;	/* File listing the volumes to serve */
 } ;
 
 typedef enum {
@@ -50,6 +59,7 @@ enum {
 	OPT_NOATIME,
 	OPT_ATIME,
 	OPT_RELATIME,
+	OPT_LAZYTIME,
 	OPT_DMTIME,
 	OPT_FAKE_RW,
 	OPT_FSNAME,
@@ -91,6 +101,38 @@ enum {
 	OPT_USERMAPPING,
 	OPT_XATTRMAPPING,
 	OPT_EFS_RAW,
+	OPT_THREADS,
+	OPT_WRITEBACK_CACHE,
+	OPT_CACHE_TIMEOUT,
+	OPT_DIRECT_IO_DEV,
+	OPT_MMAP_DEV,
+	OPT_OVERLAY,
+	OPT_FAST_MOUNT,
+	OPT_IMMUTABLE,
+	OPT_MOUNT_CACHE,
+	OPT_BLOCK_CACHE,
+	OPT_BLOCK_CACHE_WRITEBACK,
+	OPT_IO_TRACE,
+	OPT_WRITE_BUFFER,
+	OPT_INODE_CACHE,
+	OPT_NIDATA_CACHE,
+	OPT_LOOKUP_CACHE,
+	OPT_MFT_CACHE,
+	OPT_MFT_CACHE_WRITEBACK,
+	OPT_DIR_INDEX_CACHE,
+	OPT_INDEX_CACHE,
+	OPT_BITMAP_CACHE,
+	OPT_BITMAP_RESIDENT,
+	OPT_CACHE_MEM,
+	OPT_FILENAME_DELAY,
+	OPT_COMMIT,
+	OPT_MFT_GROWTH,
+	OPT_STRIPE,
+	OPT_DISCARD,
+	OPT_FSTRIM_RATE,
+	OPT_SPARSE_ZERO_DETECT,
+	OPT_USN_JOURNAL,
+	OPT_COMPRESSION_LEVEL,
 } ;
 
 			/* Option flags */
@@ -119,6 +161,23 @@ typedef struct {
 	ntfs_fuse_streams_interface streams;
 	ntfs_atime_t atime;
 	s64 dmtime;
+	int threads;
+	int cache_timeout;
+	int block_cache;
+	int inode_cache;
+	int nidata_cache;
+	int lookup_cache;
+	int mft_cache;
+	int dir_index_cache;
+	int index_cache;
+	int bitmap_cache;
+	int filename_delay;
+	int commit_interval;
+	int mft_growth;
+	int compression_level;
+	int fstrim_rate;
+	u64 cache_mem;
+	s64 stripe;
 	BOOL ro;
 	BOOL show_sys_files;
 	BOOL hide_hid_files;
@@ -131,7 +190,22 @@ typedef struct {
 	BOOL recover;
 	BOOL hiberfile;
 	BOOL sync;
+	BOOL lazytime;
 	BOOL big_writes;
+	BOOL writeback_cache;
+	BOOL direct_io_dev;
+	BOOL mmap_dev;
+	BOOL overlay;
+	BOOL fast_mount;
+	BOOL immutable;
+	BOOL mount_cache_loaded;
+	BOOL block_cache_writeback;
+	BOOL mft_cache_writeback;
+	BOOL bitmap_resident;
+	BOOL discard;
+	BOOL sparse_zero_detect;
+	BOOL usn_journal;
+	BOOL write_buffer;
 	BOOL debug;
 	BOOL no_detach;
 	BOOL blkdev;
@@ -146,6 +220,8 @@ typedef struct {
 	BOOL inherit;
 	unsigned int secure_flags;
 	char *usermap_path;
+	char *mount_cache;
+	char *io_trace;
 	char *abs_mnt_point;
 	struct PERMISSIONS_CACHE *seccache;
 	struct SECURITY_CONTEXT security;
@@ -179,7 +255,13 @@ char *parse_mount_options(ntfs_fuse_context_t *ctx,
 int ntfs_parse_options(struct ntfs_options *popts, void (*usage)(void),
 			int argc, char *argv[]);
 
-int ntfs_fuse_listxattr_common(ntfs_inode *ni, ntfs_attr_search_ctx *actx,
- 			char *list, size_t size, BOOL prefixing);
+int ntfs_fuse_listxattr_common(ntfs_inode *ni, char *list, size_t size,
+			BOOL prefixing);
+
+void ntfs_fuse_log_lru_caches(ntfs_volume *vol);
+int ntfs_fuse_volume_stats(ntfs_volume *vol, char *buf, size_t size);
+
+BOOL ntfs_fuse_load_mount_cache(ntfs_volume *vol, const char *dir);
+void ntfs_fuse_save_mount_cache(ntfs_volume *vol, const char *dir);
 
 #endif /* _NTFS_3G_COMMON_H */
@@ -254,6 +254,9 @@
 #define READ_SDS "ntfs_read_sds"
 #define READ_SII "ntfs_read_sii"
 #define READ_SDH "ntfs_read_sdh"
+#define SCAN_SII "ntfs_scan_sii"
+#define SCAN_SDH "ntfs_scan_sdh"
+#define SCAN_SECURITY_IDS "ntfs_scan_security_ids"
 #define GET_USER "ntfs_get_user"
 #define GET_GROUP "ntfs_get_group"
 #define GET_USID "ntfs_get_usid"
@@ -358,6 +361,9 @@ typedef int (*dircallback)(struct CALLBACK *context, char *ntfsname,
 	int length, int type, long long pos, u64 mft_ref,
 	unsigned int dt_type);
 
+typedef int (*entrycallback)(void *context, const char *entry);
+typedef int (*securidcallback)(void *context, u64 inum, u32 securid);
+
 #ifndef HAVE_SYSLOG_H
 void ntfs_log_early_error(const char *format, ...)
 			__attribute__((format(printf, 1, 2)));
@@ -380,6 +386,10 @@ int ntfs_read_sds(void *scapi,
 		char *buf, DWORD buflen, DWORD offset);
 void *ntfs_read_sii(void *scapi, void *entry);
 void *ntfs_read_sdh(void *scapi, void *entry);
+int ntfs_scan_sii(void *scapi, entrycallback callback, void *context);
+int ntfs_scan_sdh(void *scapi, entrycallback callback, void *context);
+int ntfs_scan_security_ids(void *scapi, int threads,
+		securidcallback callback, void *context);
 
 int ntfs_get_usid(void *scapi, uid_t uid, char *buf);
 int ntfs_get_gsid(void *scapi, gid_t gid, char *buf);
@@ -406,6 +416,12 @@ typedef int (*type_read_sds)(void *scapi,
 		char *buf, DWORD buflen, DWORD offset);
 typedef void *(*type_read_sii)(void *scapi, void *entry);
 typedef void *(*type_read_sdh)(void *scapi, void *entry);
+typedef int (*type_scan_sii)(void *scapi,
+		entrycallback callback, void *context);
+typedef int (*type_scan_sdh)(void *scapi,
+		entrycallback callback, void *context);
+typedef int (*type_scan_security_ids)(void *scapi, int threads,
+		securidcallback callback, void *context);
 
 typedef int (*type_get_usid)(void *scapi, uid_t uid, char *buf);
 typedef int (*type_get_gsid)(void *scapi, gid_t gid, char *buf);
@@ -424,6 +440,9 @@ type_read_directory ntfs_read_directory;
 type_read_sds ntfs_read_sds;
 type_read_sii ntfs_read_sii;
 type_read_sdh ntfs_read_sdh;
+type_scan_sii ntfs_scan_sii;
+type_scan_sdh ntfs_scan_sdh;
+type_scan_security_ids ntfs_scan_security_ids;
 
 type_get_usid ntfs_get_usid;
 type_get_gsid ntfs_get_gsid;
@@ -542,6 +561,7 @@ int consist_sdh(const char*);
 int audit_sds(BOOL);
 int audit_sii(void);
 int audit_sdh(void);
+int audit_files(void);
 void audit_summary(void);
 BOOL audit(const char*);
 int getoptions(int, char*[]);
@@ -693,6 +713,7 @@ MAPTYPE mappingtype;
 
 void *ntfs_handle;
 void *ntfs_context = (void*)NULL;
+BOOL scans_available = FALSE; /* sequential scans of $Secure and MFT */
 
 /*
  *		Open and close the security API (platform dependent)
@@ -701,6 +722,9 @@ void *ntfs_context = (void*)NULL;
 BOOL open_security_api(void)
 {
 #if USESTUBS | defined(STSC)
+#ifndef STSC
+	scans_available = TRUE;
+#endif
 	return (TRUE);
 #else
 	char *error;
@@ -742,6 +766,16 @@ BOOL open_security_api(void)
 					dlsym(ntfs_handle,READ_SII);
 			ntfs_read_sdh = (type_read_sdh)
 					dlsym(ntfs_handle,READ_SDH);
+				/* optional, missing from older libraries */
+			ntfs_scan_sii = (type_scan_sii)
+					dlsym(ntfs_handle,SCAN_SII);
+			ntfs_scan_sdh = (type_scan_sdh)
+					dlsym(ntfs_handle,SCAN_SDH);
+			ntfs_scan_security_ids = (type_scan_security_ids)
+					dlsym(ntfs_handle,SCAN_SECURITY_IDS);
+			scans_available = ntfs_scan_sii
+				&& ntfs_scan_sdh
+				&& ntfs_scan_security_ids;
 			ntfs_get_user = (type_get_user)
 					dlsym(ntfs_handle,GET_USER);
 			ntfs_get_group = (type_get_group)
@@ -6216,20 +6250,28 @@ int consist_sds(const char *attr, unsigned int offset,
 
 /*
  *		       Auditing of $SDS (Linux only)
+ *
+ *	Each block of the requested copy is read at once, and the
+ *	entries are examined within the buffer.
  */
 
 int audit_sds(BOOL second)
 {
-	static char attr[MAXATTRSZ + 20];
+	char *buf;
+	const char *attr;
 	BOOL isdir;
 	BOOL done;
+	BOOL blockdone;
 	BOOL unsane;
 	u32 prevkey;
 	int errcnt;
 	int size;
+	int got;
 	unsigned int entrysz;
 	unsigned int entryalsz;
 	unsigned int offset;
+	unsigned int base;
+	unsigned int pos;
 	int count;
 	int deleted;
 	int mode;
@@ -6239,100 +6281,115 @@ int audit_sds(BOOL second)
 	else
 		printf("\nAuditing $SDS-1\n");
 	errcnt = 0;
-	offset = (second ? 0x40000 : 0);
+	base = (second ? 0x40000 : 0);
 	count = 0;
 	deleted = 0;
 	done = FALSE;
 	prevkey = 0;
 
-	  /* get size of first record */
+		/* room for an oversized entry at the end of a block */
+	buf = (char*)malloc(SDSBLKSZ + MAXATTRSZ + 20);
+	if (!buf) {
+		printf("** Could not allocate a buffer for $SDS\n");
+		errors++;
+		return (1);
+	}
 
-	size = ntfs_read_sds(ntfs_context,(char*)attr,20,offset);
-	if (size != 20) {
-		if ((size < 0) && (errno == ENOTSUP))
+	  /* get the first block */
+
+	got = ntfs_read_sds(ntfs_context,buf,SDSBLKSZ,base);
+	if (got < 20) {
+		if ((got < 0) && (errno == ENOTSUP))
 			printf("** There is no $SDS-%d in this volume\n",
 							(second ? 2 : 1));
 		else {
 			printf("** Could not open $SDS-%d, size %d\n",
-							(second ? 2 : 1),size);
+							(second ? 2 : 1),got);
 			errors++;
 			errcnt++;
 		}
 	} else
 		do {
-			entrysz = get4l(attr,16);
-			entryalsz = ((entrysz - 1) | 15) + 1;
-			if (entryalsz <= (MAXATTRSZ + 20)) {
-				/* read next header in anticipation, to get its size */
-				size = ntfs_read_sds(ntfs_context,
-					(char*)&attr[20],entryalsz,offset + 20);
-				if (opt_v)
-					printf("\nAt offset 0x%lx got %lu bytes\n",(long)offset,(long)size);
-			} else {
-				printf("** Security attribute is too long (%ld bytes) - stopping\n",
-					(long)entryalsz);
-				errcnt++;
-			}
-			if ((entryalsz > (MAXATTRSZ + 20)) || (size < (int)(entrysz - 20)))
-				done = TRUE;
-			else {
-				if (opt_v) {
-					printf("Entry size %d bytes\n",entrysz);
-					hexdump(&attr[20],size,8);
-				}
-
-				unsane = !valid_sds(attr,offset,entrysz,
-					size,prevkey,second);
-				if (!unsane) {
-					if (!get4l(attr,0) && !get4l(attr,4))
-						deleted++;
-					else
-						count++;
-					errcnt += consist_sds(attr,offset,
-						entrysz, second);
-					if (opt_v >= 2) {
-						isdir = guess_dir(&attr[20]);
-						printf("Assuming %s descriptor\n",(isdir ? "directory" : "file"));
-						showheader(&attr[20],0);
-						showusid(&attr[20],0);
-						showgsid(&attr[20],0);
-						showdacl(&attr[20],isdir,0);
-						showsacl(&attr[20],isdir,0);
-						showownership(&attr[20]);
-						mode = linux_permissions(
-						    &attr[20],isdir);
-						printf("Interpreted Unix mode 0%03o\n",mode);
-					}
-					prevkey = get4l(attr,4);
-				}
-				if (!unsane) {
-					memcpy(attr,&attr[entryalsz],20);
-					offset += entryalsz;
-					if (!get4l(attr,16)
-					   || ((((offset - 1) | 0x3ffff) - offset + 1) < 20)) {
-						if (second)
-							offset = ((offset - 1) | 0x7ffff) + 0x40001;
-						else
-							offset = ((offset - 1) | 0x7ffff) + 1;
+			memset(&buf[got],0,SDSBLKSZ + MAXATTRSZ + 20 - got);
+			pos = 0;
+			blockdone = FALSE;
+			do {
+				attr = &buf[pos];
+				offset = base + pos;
+				entrysz = get4l(attr,16);
+				entryalsz = ((entrysz - 1) | 15) + 1;
+				if (!entrysz)
+					blockdone = TRUE;
+				else
+					if (entryalsz > (MAXATTRSZ + 20)) {
+						printf("** Security attribute is too long (%ld bytes) - stopping\n",
+							(long)entryalsz);
+						errcnt++;
+						done = TRUE;
+					} else {
+						size = got - pos - 20;
+						if (size > (int)entryalsz)
+							size = entryalsz;
 						if (opt_v)
-							printf("Trying next SDS-%d block at offset 0x%lx\n",
-								(second ? 2 : 1), (long)offset);
-						size = ntfs_read_sds(ntfs_context,
-							(char*)attr,20,offset);
-						if (size != 20) {
-							if (opt_v)
-								printf("Assuming end of $SDS, got %d bytes\n",size);
+							printf("\nAt offset 0x%lx got %lu bytes\n",(long)offset,(long)size);
+						if (size < (int)(entrysz - 20))
 							done = TRUE;
+					}
+				if (!done && !blockdone) {
+					if (opt_v) {
+						printf("Entry size %d bytes\n",entrysz);
+						hexdump(&attr[20],size,8);
+					}
+
+					unsane = !valid_sds(attr,offset,entrysz,
+						size,prevkey,second);
+					if (!unsane) {
+						if (!get4l(attr,0) && !get4l(attr,4))
+							deleted++;
+						else
+							count++;
+						errcnt += consist_sds(attr,offset,
+							entrysz, second);
+						if (opt_v >= 2) {
+							isdir = guess_dir(&attr[20]);
+							printf("Assuming %s descriptor\n",(isdir ? "directory" : "file"));
+							showheader(&attr[20],0);
+							showusid(&attr[20],0);
+							showgsid(&attr[20],0);
+							showdacl(&attr[20],isdir,0);
+							showsacl(&attr[20],isdir,0);
+							showownership(&attr[20]);
+							mode = linux_permissions(
+							    &attr[20],isdir);
+							printf("Interpreted Unix mode 0%03o\n",mode);
 						}
+						prevkey = get4l(attr,4);
+						pos += entryalsz;
+						if ((pos + 20) > (unsigned int)got)
+							blockdone = TRUE;
+					} else {
+						printf("** Sanity check failed - stopping there\n");
+						errcnt++;
+						errors++;
+						done = TRUE;
 					}
-				} else {
-					printf("** Sanity check failed - stopping there\n");
-					errcnt++;
-					errors++;
+				}
+			} while (!done && !blockdone);
+			if (!done) {
+				base += 0x80000;
+				if (opt_v)
+					printf("Trying next SDS-%d block at offset 0x%lx\n",
+						(second ? 2 : 1), (long)base);
+				got = ntfs_read_sds(ntfs_context,
+						buf,SDSBLKSZ,base);
+				if (got < 20) {
+					if (opt_v)
+						printf("Assuming end of $SDS, got %d bytes\n",got);
 					done = TRUE;
 				}
 			}
 		} while (!done);
+	free(buf);
 	if (count || deleted || errcnt) {
 		printf("%d valid and %d deleted entries in $SDS-%d\n",
 				count,deleted,(second ? 2 : 1));
@@ -6470,12 +6527,60 @@ int consist_sii(const char *entry)
 }
 
 
+/*
+ *		Context of a sequential scan of $SII or $SDH
+ */
+
+struct INDEX_AUDIT {
+	int count;
+	int errcnt;
+} ;
+
+/*
+ *		Check whether a key was already met in an index
+ *
+ *	As the scanned entries come in no defined order, their ordering
+ *	cannot be checked, but duplicated keys are detected.
+ */
+
+static BOOL duplicated_key(u32 key, int flag)
+{
+	BOOL dup;
+
+	dup = (key > 0) && (key < MAXSECURID)
+		&& securdata[key >> SECBLKSZ]
+		&& (securdata[key >> SECBLKSZ][key & ((1 << SECBLKSZ) - 1)].flags
+								& flag);
+	if (dup) {
+		printf("** Duplicated key 0x%lx\n",(long)key);
+		errors++;
+	}
+	return (dup);
+}
+
+static int scan_sii_entry(void *context, const char *entry)
+{
+	struct INDEX_AUDIT *audit;
+
+	audit = (struct INDEX_AUDIT*)context;
+	if (valid_sii(entry,0) && !duplicated_key(get4l(entry,16),INSII)) {
+		audit->count++;
+		audit->errcnt += consist_sii(entry);
+	} else
+		audit->errcnt++;
+	return (0);
+}
+
 /*
  *		       Auditing of $SII (Linux only)
+ *
+ *	The index blocks are scanned sequentially when the library can,
+ *	otherwise the tree is walked in key order.
  */
 
 int audit_sii()
 {
+	struct INDEX_AUDIT audit;
 	char *entry;
 	int errcnt;
 	u32 prevkey;
@@ -6489,7 +6594,26 @@ int audit_sii()
 	entry = (char*)NULL;
 	prevkey = 0;
 	done = FALSE;
-	do {
+#ifndef STSC
+	if (scans_available) {
+		audit.count = 0;
+		audit.errcnt = 0;
+		if (ntfs_scan_sii(ntfs_context,scan_sii_entry,&audit) < 0) {
+			if (errno == ENOTSUP)
+				printf("** There is no $SII in this volume\n");
+			else {
+				printf("** Could not scan all of $SII\n");
+				printerror(stdout);
+				errors++;
+				audit.errcnt++;
+			}
+		}
+		count = audit.count;
+		errcnt = audit.errcnt;
+		done = TRUE;
+	}
+#endif
+	while (!done) {
 		entry = (char*)ntfs_read_sii(ntfs_context,(void*)entry);
 		if (entry) {
 			valid = valid_sii(entry,prevkey);
@@ -6499,10 +6623,12 @@ int audit_sii()
 				prevkey = get4l(entry,16);
 			} else
 				errcnt++;
-		} else
+		} else {
 			if ((errno == ENOTSUP) && !prevkey)
 				printf("** There is no $SII in this volume\n");
-	} while (entry && !done);
+			done = TRUE;
+		}
+	}
 	if (count || errcnt) {
 		printf("%d valid entries in $SII\n",count);
 		printf("%d errors in $SII\n",errcnt);
@@ -6656,12 +6782,29 @@ int consist_sdh(const char *entry)
 	return (errcnt);
 }
 
+static int scan_sdh_entry(void *context, const char *entry)
+{
+	struct INDEX_AUDIT *audit;
+
+	audit = (struct INDEX_AUDIT*)context;
+	if (valid_sdh(entry,0,0) && !duplicated_key(get4l(entry,20),INSDH)) {
+		audit->count++;
+		audit->errcnt += consist_sdh(entry);
+	} else
+		audit->errcnt++;
+	return (0);
+}
+
 /*
  *		       Auditing of $SDH (Linux only)
+ *
+ *	The index blocks are scanned sequentially when the library can,
+ *	otherwise the tree is walked in key order.
  */
 
 int audit_sdh()
 {
+	struct INDEX_AUDIT audit;
 	char *entry;
 	int errcnt;
 	int count;
@@ -6677,7 +6820,26 @@ int audit_sdh()
 	prevhash = 0;
 	entry = (char*)NULL;
 	done = FALSE;
-	do {
+#ifndef STSC
+	if (scans_available) {
+		audit.count = 0;
+		audit.errcnt = 0;
+		if (ntfs_scan_sdh(ntfs_context,scan_sdh_entry,&audit) < 0) {
+			if (errno == ENOTSUP)
+				printf("** There is no $SDH in this volume\n");
+			else {
+				printf("** Could not scan all of $SDH\n");
+				printerror(stdout);
+				errors++;
+				audit.errcnt++;
+			}
+		}
+		count = audit.count;
+		errcnt = audit.errcnt;
+		done = TRUE;
+	}
+#endif
+	while (!done) {
 		entry = (char*)ntfs_read_sdh(ntfs_context,(void*)entry);
 		if (entry) {
 			valid = valid_sdh(entry,prevkey,prevhash);
@@ -6688,10 +6850,12 @@ int audit_sdh()
 				prevkey = get4l(entry,20);
 			} else
 				errcnt++;
-		} else
+		} else {
 			if ((errno == ENOTSUP) && !prevkey)
 				printf("** There is no $SDH in this volume\n");
-	} while (entry && !done);
+			done = TRUE;
+		}
+	}
 	if (count || errcnt) {
 		printf("%d valid entries in $SDH\n",count);
 		printf("%d errors in $SDH\n",errcnt);
@@ -6699,6 +6863,76 @@ int audit_sdh()
 	return (errcnt);
 }
 
+#ifndef STSC
+
+/*
+ *		Context of the scan of the security keys of files
+ */
+
+struct FILE_AUDIT {
+	s64 count;
+	int errcnt;
+} ;
+
+static int scan_file_key(void *context, u64 inum, u32 securid)
+{
+	struct FILE_AUDIT *audit;
+	struct SECURITY_DATA *psecurdata;
+
+	audit = (struct FILE_AUDIT*)context;
+	audit->count++;
+	if (securid >= MAXSECURID) {
+		printf("** Inode %lld : security_id 0x%lx out of bounds\n",
+			(long long)inum,(long)securid);
+		warnings++;
+	} else
+		if (securid) {
+			if (!securdata[securid >> SECBLKSZ])
+				newblock(securid);
+			if (securdata[securid >> SECBLKSZ]) {
+				psecurdata = &securdata[securid >> SECBLKSZ]
+					[securid & ((1 << SECBLKSZ) - 1)];
+				psecurdata->filecount++;
+				if (!(psecurdata->flags
+					& (INSDS1 | INSDS2 | INSII | INSDH))) {
+					printf("** Inode %lld : security_id 0x%lx is not defined\n",
+						(long long)inum,(long)securid);
+					audit->errcnt++;
+					errors++;
+				}
+			}
+		}
+	return (0);
+}
+
+/*
+ *		       Auditing of the security keys of files (Linux only)
+ *
+ *	The MFT is scanned by the library, in large batches and by
+ *	several threads, rather than walking the directory tree.
+ */
+
+int audit_files()
+{
+	struct FILE_AUDIT audit;
+
+	printf("\nAuditing the keys of files\n");
+	audit.count = 0;
+	audit.errcnt = 0;
+	if (ntfs_scan_security_ids(ntfs_context,0,scan_file_key,&audit)) {
+		printf("** Could not scan all of the MFT\n");
+		printerror(stdout);
+		errors++;
+		audit.errcnt++;
+	}
+	printf("%lld files checked\n",(long long)audit.count);
+	if (audit.errcnt)
+		printf("%d errors in the keys of files\n",audit.errcnt);
+	return (audit.errcnt);
+}
+
+#endif /* STSC */
+
 /*
  *		Audit summary
  */
@@ -6772,7 +7006,13 @@ BOOL audit(const char *volume)
 			if (audit_sds(TRUE)) err = TRUE;
 			if (audit_sii()) err = TRUE;
 			if (audit_sdh()) err = TRUE;
-			if (opt_r) recurseshow("/");
+			if (opt_r)
+				recurseshow("/");
+#ifndef STSC
+			else
+				if (scans_available && audit_files())
+					err = TRUE;
+#endif
 
 			audit_summary();
 			close_volume(volume);
@@ -39,6 +39,7 @@
 #define MAXATTRSZ 65536 /* Max sec attr size (16448 met for WinXP) */
 #define MAXSECURID 262144
 #define SECBLKSZ 8
+#define SDSBLKSZ 0x40000 /* size of $SDS blocks, read at once */
 #define MAXFILENAME 4096
 #define FORCEMASK 0 /* Special (dangerous) option -m to force a mask */
 #define MAXLINE 80 /* maximum processed size of a line */
@@ -252,7 +253,7 @@ struct SECURITY_DATA {
 	char *attr;
 	u32 hash;
 	u32 length;
-	unsigned int filecount:16;
+	unsigned int filecount;
 	unsigned int mode:12;
 	unsigned int flags:4;
 } ;
@@ -51,6 +51,10 @@
  *
  *  May 2014 Version 1.1.6
  *     - fixed a wrong function header
+ *
+ *  Oct 2026 Version 1.1.7
+ *     - collected the owners and groups from $SDS instead of
+ *       walking the directories, with counts of files from the MFT
  */
 
 /*
@@ -86,15 +90,20 @@
 #define GET_FILE_SECURITY "ntfs_get_file_security"
 #define SET_FILE_SECURITY "ntfs_set_file_security"
 #define READ_DIRECTORY "ntfs_read_directory"
+#define READ_SDS "ntfs_read_sds"
+#define SCAN_SECURITY_IDS "ntfs_scan_security_ids"
 #define INIT_FILE_SECURITY "ntfs_initialize_file_security"
 #define LEAVE_FILE_SECURITY "ntfs_leave_file_security"
 
-#define VERSION "1.1.6"
+#define VERSION "1.1.7"
 #define MAPDIR ".NTFS-3G"
 #define MAPFILE "UserMapping"
 #define MAXATTRSZ 2048
 #define MAXSIDSZ 80
 #define MAXNAMESZ 256
+#define SDSBLKSZ 0x40000 /* size of $SDS blocks, read at once */
+#define MAXSECURID 0x1000000 /* ignore greater security ids */
+#define SIDHASHSZ 256
 #define OWNERS1 "Documents and Settings"
 #define OWNERS2 "Users"
 
@@ -163,6 +172,9 @@ typedef int (*dircallback)(struct CALLBACK *context, char *ntfsname,
 	int length, int type, long long pos, unsigned long long mft_ref,
 	unsigned int dt_type);
 
+typedef int (*securidcallback)(void *context, unsigned long long inum,
+	unsigned int securid);
+
 #if USESTUBS
 
 #define STATIC static
@@ -174,6 +186,10 @@ BOOL ntfs_set_file_security(void *scapi,
                 const char *path, DWORD selection, const char *attr);
 BOOL ntfs_read_directory(void *scapi,
 		const char *path, dircallback callback, void *context);
+int ntfs_read_sds(void *scapi,
+		char *buf, DWORD size, DWORD offset);
+int ntfs_scan_security_ids(void *scapi, int threads,
+		securidcallback callback, void *context);
 void *ntfs_initialize_file_security(const char *device,
                                 unsigned long flags);
 BOOL ntfs_leave_file_security(void *scapi);
@@ -189,6 +205,10 @@ BOOL (*ntfs_set_file_security)(void *scapi,
                 const char *path, DWORD selection, const char *attr);
 BOOL (*ntfs_read_directory)(void *scapi,
 		const char *path, dircallback callback, void *context);
+int (*ntfs_read_sds)(void *scapi,
+		char *buf, DWORD size, DWORD offset);
+int (*ntfs_scan_security_ids)(void *scapi, int threads,
+		securidcallback callback, void *context);
 void *(*ntfs_initialize_file_security)(const char *device,
                                 unsigned long flags);
 BOOL (*ntfs_leave_file_security)(void *scapi);
@@ -225,6 +245,8 @@ unsigned char *currentsid;
 
 void *ntfs_handle;
 void *ntfs_context = (void*)NULL;
+boolean sdsavailable = DENIED;	/* $SDS can be read */
+boolean scanavailable = DENIED;	/* security ids can be got from MFT */
 
 /*
  *		Shut down compiler warnings for unused parameters
@@ -242,6 +264,8 @@ return ((long)p);
 STATIC boolean open_security_api(void)
 {
 #if USESTUBS
+	sdsavailable = AGREED;
+	scanavailable = AGREED;
 	return (AGREED);
 #else
 	char *error;
@@ -268,6 +292,13 @@ STATIC boolean open_security_api(void)
 					dlsym(ntfs_handle,SET_FILE_SECURITY);
 			ntfs_read_directory =
 					dlsym(ntfs_handle,READ_DIRECTORY);
+				/* optional, missing from older libraries */
+			ntfs_read_sds =
+					dlsym(ntfs_handle,READ_SDS);
+			ntfs_scan_security_ids =
+					dlsym(ntfs_handle,SCAN_SECURITY_IDS);
+			sdsavailable = (ntfs_read_sds != NULL);
+			scanavailable = (ntfs_scan_security_ids != NULL);
 			err = !ntfs_initialize_file_security
 				|| !ntfs_leave_file_security
 				|| !ntfs_get_file_security
@@ -478,7 +509,8 @@ STATIC unsigned char *makegroupsid(const unsigned char *sid)
 }
 
 STATIC void domapping(const char *accname, const char *filename,
-		const char *dir, const unsigned char *sid, int type)
+		const char *dir, const unsigned char *sid, int type,
+		long long files)
 {
 	char buf[81];
 	char *sidstr;
@@ -507,9 +539,19 @@ STATIC void domapping(const char *accname, const char *filename,
 					printf("Under Windows login \"%s\"\n", accname);
 				if (dir)
 					printf("   in directory \"%s\"\n",dir);
-				printf("   file \"%s\" has no mapped %s\n",
+				if (filename) {
+					printf("   file \"%s\" has no mapped %s\n",
 					       filename,(type ? "group" : "owner"));
-				printf("By which Linux login should this file be owned ?\n");
+					printf("By which Linux login should this file be owned ?\n");
+				} else {
+					printf("   %s has no mapped %s\n",
+					       sidstr,(type ? "group" : "owner"));
+					if (files >= 0)
+						printf("   it is the %s of %lld file%s\n",
+						       (type ? "group" : "owner"),
+						       files,(files > 1 ? "s" : ""));
+					printf("By which Linux login should its files be owned ?\n");
+				}
 				printf("Enter %s of login, or just press \"enter\" if this file\n",
 					(type ? "gid" : "uid"));
 				printf("does not belong to a user, or you do not known to whom\n");
@@ -587,7 +629,7 @@ STATIC void listaclusers(const char *accname, const unsigned char *attr, int off
 	x = 8;
 	for (i = 0; i < cnt; i++) {
 		domapping(accname, (char *)NULL, (char*)NULL, 
-                                       &attr[off + x + 8], 2);
+                                       &attr[off + x + 8], 2, -1);
 		x += get2l(attr, off + x + 2);
 	}
 }
@@ -611,12 +653,12 @@ STATIC void account(const char *accname, const char *dir, const char *name, int
 			if (GetFileSecurity
 			    (fullname, OWNER_SECURITY_INFORMATION, attr, MAXATTRSZ,
 			     &attrsz)) {
-				domapping(accname, name, dir, &attr[20], 0);
+				domapping(accname, name, dir, &attr[20], 0, -1);
 				attrsz = 0;
 				if (GetFileSecurity
 				    (fullname, GROUP_SECURITY_INFORMATION, attr,
 				     MAXATTRSZ, &attrsz))
-					domapping(accname, name, dir, &attr[20], 1);
+					domapping(accname, name, dir, &attr[20], 1, -1);
 				else
 					printf("   No group SID\n");
 				attrsz = 0;
@@ -650,12 +692,12 @@ STATIC void account(const char *accname, const char *dir, const char *name, int
 		if (ntfs_get_file_security(ntfs_context,
 			fullname, OWNER_SECURITY_INFORMATION,
 			(char*)attr, MAXATTRSZ, &attrsz)) {
-			domapping(accname, name, dir, &attr[20], 0);
+			domapping(accname, name, dir, &attr[20], 0, -1);
 			attrsz = 0;
 			if (ntfs_get_file_security(ntfs_context,
 			     fullname, GROUP_SECURITY_INFORMATION,
 			     (char*)attr, MAXATTRSZ, &attrsz))
-				domapping(accname, name, dir, &attr[20], 1);
+				domapping(accname, name, dir, &attr[20], 1, -1);
 			else
 				printf("   No group SID\n");
 			attrsz = 0;
@@ -814,6 +856,280 @@ STATIC boolean recurse(const char *accname, const char *dir, int levels, int doc
 	ntfs_read_directory(ntfs_context,dir,callback,&context);
 	return (!err);
 }
+
+/*
+ *		Collection of the owners and groups from $SDS
+ *
+ *	All the security descriptors are stored in $SDS, so reading it
+ *	sequentially gets all the owners and groups, without walking the
+ *	directories and fetching the descriptor of each file. The count
+ *	of files using each of them is then got from a scan of the MFT.
+ */
+
+struct SIDUSE {
+	struct SIDUSE *next;	/* next in hash list */
+	unsigned char *sid;
+	long long files;	/* count of files, -1 if unknown */
+	int type;		/* 0 for owner, 1 for group */
+} ;
+
+struct SIDLIST {
+	struct SIDUSE *hash[SIDHASHSZ];
+	struct SIDUSE **owners;	/* owner of each security id */
+	struct SIDUSE **groups;	/* group of each security id */
+	unsigned int securidcnt;
+	int count;		/* count of distinct owners and groups */
+} ;
+
+/*
+ *		Get the record of an owner or group, creating it if needed
+ */
+
+STATIC struct SIDUSE *getsiduse(struct SIDLIST *list,
+		const unsigned char *sid, int type)
+{
+	struct SIDUSE *item;
+	unsigned int h;
+	int sidsz;
+
+	sidsz = 8 + 4*sid[1];
+	h = (get4l(sid, sidsz - 4) + type) & (SIDHASHSZ - 1);
+	item = list->hash[h];
+	while (item && ((item->type != type)
+			|| memcmp(item->sid, sid, sidsz)))
+		item = item->next;
+	if (!item) {
+		item = (struct SIDUSE*)malloc(sizeof(struct SIDUSE));
+		if (item) {
+			item->sid = (unsigned char*)malloc(sidsz);
+			if (item->sid) {
+				memcpy(item->sid, sid, sidsz);
+				item->type = type;
+				item->files = -1;
+				item->next = list->hash[h];
+				list->hash[h] = item;
+				list->count++;
+			} else {
+				free(item);
+				item = (struct SIDUSE*)NULL;
+			}
+		}
+	}
+	return (item);
+}
+
+/*
+ *		Record the owner and group of a security descriptor
+ *
+ *	Only the SIDs of users of a domain (S-1-5-21-...) may be mapped.
+ *	Returns FALSE if there is not enough memory
+ */
+
+STATIC boolean addsids(struct SIDLIST *list, unsigned int securid,
+		const unsigned char *attr, unsigned int size)
+{
+	struct SIDUSE **newowners;
+	struct SIDUSE **newgroups;
+	struct SIDUSE *item;
+	const unsigned char *sid;
+	unsigned int newcnt;
+	unsigned int off;
+	boolean ok;
+	int type;
+
+	ok = AGREED;
+	if (securid >= list->securidcnt) {
+		newcnt = (list->securidcnt ? 2*list->securidcnt : 4096);
+		while (newcnt <= securid)
+			newcnt *= 2;
+		newowners = (struct SIDUSE**)realloc(list->owners,
+				newcnt*sizeof(struct SIDUSE*));
+		if (newowners)
+			list->owners = newowners;
+		newgroups = (struct SIDUSE**)realloc(list->groups,
+				newcnt*sizeof(struct SIDUSE*));
+		if (newgroups)
+			list->groups = newgroups;
+		if (newowners && newgroups) {
+			memset(&list->owners[list->securidcnt], 0,
+				(newcnt - list->securidcnt)
+					*sizeof(struct SIDUSE*));
+			memset(&list->groups[list->securidcnt], 0,
+				(newcnt - list->securidcnt)
+					*sizeof(struct SIDUSE*));
+			list->securidcnt = newcnt;
+		} else
+			ok = DENIED;
+	}
+	for (type=0; (type<2) && ok; type++) {
+		off = get4l(attr, (type ? 8 : 4));
+		sid = &attr[off];
+		if (off && ((off + 8) <= size)
+		    && ((off + 8 + 4*sid[1]) <= size)
+		    && (sid[0] == 1) && (sid[1] > 1)
+		    && (get6h(sid, 2) == 5) && (get4l(sid, 8) == 21)) {
+			item = getsiduse(list, sid, type);
+			if (!item)
+				ok = DENIED;
+			if (type)
+				list->groups[securid] = item;
+			else
+				list->owners[securid] = item;
+		}
+	}
+	return (ok);
+}
+
+/*
+ *		Read $SDS sequentially and record the owners and groups
+ *
+ *	Only the first copy of each block is examined.
+ *	Returns FALSE if $SDS could not be read
+ */
+
+STATIC boolean readsds(struct SIDLIST *list)
+{
+	char *buf;
+	unsigned int offset;
+	unsigned int pos;
+	unsigned int entrysz;
+	unsigned int securid;
+	boolean ok;
+	boolean blockdone;
+	int got;
+
+	ok = DENIED;
+	buf = (char*)malloc(SDSBLKSZ);
+	if (buf) {
+		offset = 0;
+		got = ntfs_read_sds(ntfs_context, buf, SDSBLKSZ, offset);
+		ok = (got >= 0);
+		while (ok && (got >= 20)) {
+			pos = 0;
+			blockdone = DENIED;
+			do {
+				entrysz = get4l((unsigned char*)buf, pos + 16);
+				securid = get4l((unsigned char*)buf, pos + 4);
+				if ((entrysz < 40)
+				    || ((pos + entrysz) > (unsigned int)got))
+					blockdone = AGREED;
+				else {
+					if (securid && (securid < MAXSECURID))
+						ok = addsids(list, securid,
+						    (unsigned char*)&buf[pos + 20],
+						    entrysz - 20);
+					pos += ((entrysz - 1) | 15) + 1;
+					if ((pos + 20) > (unsigned int)got)
+						blockdone = AGREED;
+				}
+			} while (ok && !blockdone);
+				/* skip the mirror block */
+			offset += 2*SDSBLKSZ;
+			got = ntfs_read_sds(ntfs_context, buf, SDSBLKSZ, offset);
+		}
+		free(buf);
+	}
+	return (ok);
+}
+
+/*
+ *		Count the files using each owner and group
+ */
+
+STATIC int countfile(void *context, unsigned long long inum,
+		unsigned int securid)
+{
+	struct SIDLIST *list;
+	struct SIDUSE *item;
+	int type;
+
+	unused((void*)&inum);
+	list = (struct SIDLIST*)context;
+	if (securid < list->securidcnt)
+		for (type=0; type<2; type++) {
+			item = (type ? list->groups[securid]
+					: list->owners[securid]);
+			if (item) {
+				if (item->files < 0)
+					item->files = 0;
+				item->files++;
+			}
+		}
+	return (0);
+}
+
+/*
+ *		Sort owners before groups, then the most used first
+ */
+
+STATIC int comparesids(const void *p1, const void *p2)
+{
+	const struct SIDUSE *item1 = *(const struct SIDUSE* const*)p1;
+	const struct SIDUSE *item2 = *(const struct SIDUSE* const*)p2;
+
+	if (item1->type != item2->type)
+		return (item1->type - item2->type);
+	if (item1->files != item2->files)
+		return (item1->files > item2->files ? -1 : 1);
+	if (item1->sid[1] != item2->sid[1])
+		return (item1->sid[1] - item2->sid[1]);
+	return (memcmp(item1->sid, item2->sid, 8 + 4*item1->sid[1]));
+}
+
+/*
+ *		Ask for the mapping of all the owners and groups from $SDS
+ *
+ *	Returns FALSE if $SDS could not be used, so that the directories
+ *	have to be walked instead.
+ */
+
+STATIC boolean getsdsusers(void)
+{
+	struct SIDLIST list;
+	struct SIDUSE **sorted;
+	struct SIDUSE *item;
+	struct SIDUSE *next;
+	boolean counted;
+	boolean ok;
+	int i, n;
+
+	ok = DENIED;
+	memset(&list, 0, sizeof(list));
+	if (sdsavailable && readsds(&list)) {
+		counted = scanavailable
+			&& !ntfs_scan_security_ids(ntfs_context, 0,
+					countfile, &list);
+		sorted = (struct SIDUSE**)malloc((list.count + 1)
+					*sizeof(struct SIDUSE*));
+		if (sorted) {
+			n = 0;
+			for (i=0; i<SIDHASHSZ; i++)
+				for (item=list.hash[i]; item; item=item->next)
+					sorted[n++] = item;
+			qsort(sorted, n, sizeof(struct SIDUSE*), comparesids);
+			for (i=0; i<n; i++) {
+					/* unused descriptors are kept */
+				if (!counted || (sorted[i]->files > 0))
+					domapping((char*)NULL, (char*)NULL,
+						(char*)NULL, sorted[i]->sid,
+						sorted[i]->type,
+						sorted[i]->files);
+			}
+			free(sorted);
+			ok = AGREED;
+		}
+	}
+	for (i=0; i<SIDHASHSZ; i++)
+		for (item=list.hash[i]; item; item=next) {
+			next = item->next;
+			free(item->sid);
+			free(item);
+		}
+	free(list.owners);
+	free(list.groups);
+	return (ok);
+}
+
 #endif
 
 /*
@@ -928,9 +1244,12 @@ STATIC boolean getusers(const char *dir, int levels)
 	context.levels = levels;
 	context.docset = 2;
 	ntfs_read_directory(ntfs_context,dir,callback,&context);
-	printf("* Search for other directories %s\n",dir);
-	context.docset = 0;
-	ntfs_read_directory(ntfs_context,dir,callback,&context);
+	printf("* Search for other owners in the security data\n");
+	if (!getsdsusers()) {
+		printf("* Search for other directories %s\n",dir);
+		context.docset = 0;
+		ntfs_read_directory(ntfs_context,dir,callback,&context);
+	}
 
 	return (!err);
 }